@@ -15,6 +15,7 @@
 //
 
 #include <memory>
+#include <string>
 #include <utility>
 
 #include <base/files/file_util.h>
@@ -55,8 +56,28 @@ ApexHandlerInterface::CreateApexHandler() {
   }
 }
 
+// static
+std::string ApexHandlerAndroid::GetCacheKey(
+    const std::vector<ApexInfo>& apex_infos) {
+  std::string key;
+  for (const auto& apex_info : apex_infos) {
+    if (!apex_info.is_compressed()) {
+      continue;
+    }
+    key += apex_info.package_name() + ":" +
+           std::to_string(apex_info.version()) + ":" +
+           std::to_string(apex_info.decompressed_size()) + ";";
+  }
+  return key;
+}
+
 android::base::Result<uint64_t> ApexHandlerAndroid::CalculateSize(
     const std::vector<ApexInfo>& apex_infos) const {
+  std::string key = GetCacheKey(apex_infos);
+  if (calculated_size_key_ == key) {
+    return calculated_size_;
+  }
+
   // We might not need to decompress every APEX. Communicate with apexd to get
   // accurate requirement.
   auto apex_service = GetApexService();
@@ -72,19 +93,32 @@ android::base::Result<uint64_t> ApexHandlerAndroid::CalculateSize(
     return android::base::Error()
            << "Failed to get size required from apexservice";
   }
+  calculated_size_key_ = std::move(key);
+  calculated_size_ = size_from_apexd;
   return size_from_apexd;
 }
 
 bool ApexHandlerAndroid::AllocateSpace(
     const std::vector<ApexInfo>& apex_infos) const {
+  std::string key = GetCacheKey(apex_infos);
+  if (allocated_space_key_ == key) {
+    return true;
+  }
+
   auto apex_service = GetApexService();
   if (apex_service == nullptr) {
     return false;
   }
   auto compressed_apex_info_list = CreateCompressedApexInfoList(apex_infos);
+  // A failed reservation may have released the previous one.
+  allocated_space_key_.reset();
   auto result =
       apex_service->reserveSpaceForCompressedApex(compressed_apex_info_list);
-  return result.isOk();
+  if (!result.isOk()) {
+    return false;
+  }
+  allocated_space_key_ = std::move(key);
+  return true;
 }
 
 android::sp<android::apex::IApexService> ApexHandlerAndroid::GetApexService()
@@ -18,6 +18,7 @@
 #define SYSTEM_UPDATE_ENGINE_AOSP_APEX_HANDLER_ANDROID_H_
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -30,6 +31,10 @@
 namespace chromeos_update_engine {
 
 
+// Both calls to apexd are slow and the client may allocate the space for the
+// same payload several times before applying it, so the size last calculated
+// and the space last reserved are remembered for the compressed APEXes they
+// were for, and not asked for again.
 class ApexHandlerAndroid : virtual public ApexHandlerInterface {
  public:
   android::base::Result<uint64_t> CalculateSize(
@@ -38,6 +43,17 @@ class ApexHandlerAndroid : virtual public ApexHandlerInterface {
 
  private:
   android::sp<android::apex::IApexService> GetApexService() const;
+
+  // The compressed APEXes of |apex_infos| as a string, to compare the lists
+  // passed.
+  static std::string GetCacheKey(const std::vector<ApexInfo>& apex_infos);
+
+  // The key and the result of the last successful CalculateSize().
+  mutable std::optional<std::string> calculated_size_key_;
+  mutable uint64_t calculated_size_{0};
+  // The key of the APEXes the space was last reserved for, unknown until a
+  // reservation succeeds.
+  mutable std::optional<std::string> allocated_space_key_;
 };
 
 class FlattenedApexHandlerAndroid : virtual public ApexHandlerInterface {
@@ -70,6 +70,35 @@ TEST(ApexHandlerAndroidTest, AllocateSpaceUpdatableApex) {
   ASSERT_TRUE(apex_handler.AllocateSpace({}));
 }
 
+TEST(ApexHandlerAndroidTest, RepeatedCallsUpdatableApex) {
+  ApexHandlerAndroid apex_handler;
+  std::vector<ApexInfo> apex_infos;
+  apex_infos.push_back(CreateApexInfo("sample1", 1, true, 1));
+  apex_infos.push_back(CreateApexInfo("sample2", 2, true, 2));
+  auto result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 3u);
+  // Answered from the last result.
+  result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 3u);
+  ASSERT_TRUE(apex_handler.AllocateSpace(apex_infos));
+  ASSERT_TRUE(apex_handler.AllocateSpace(apex_infos));
+
+  // Uncompressed APEXes don't change what's asked to apexd, other compressed
+  // ones do.
+  apex_infos.push_back(CreateApexInfo("uncompressed", 1, false, 4));
+  result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 3u);
+  apex_infos.push_back(CreateApexInfo("sample3", 1, true, 4));
+  result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 7u);
+  ASSERT_TRUE(apex_handler.AllocateSpace(apex_infos));
+  ASSERT_TRUE(apex_handler.AllocateSpace({}));
+}
+
 TEST(ApexHandlerAndroidTest, CalculateSizeFlattenedApex) {
   FlattenedApexHandlerAndroid apex_handler;
   std::vector<ApexInfo> apex_infos;
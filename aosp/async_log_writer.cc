@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/async_log_writer.h"
+
+#include <utility>
+
+#include <android-base/file.h>
+
+namespace chromeos_update_engine {
+
+AsyncLogWriter::AsyncLogWriter(android::base::unique_fd fd,
+                               size_t max_pending_bytes)
+    : fd_(std::move(fd)), max_pending_bytes_(max_pending_bytes) {
+  if (fd_ != -1) {
+    writer_ = std::thread(&AsyncLogWriter::WriterLoop, this);
+  }
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  pending_cond_.notify_one();
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+}
+
+void AsyncLogWriter::Write(std::string_view line, bool wait) {
+  if (!writer_.joinable()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  space_cond_.wait(lock,
+                   [this] { return pending_.size() < max_pending_bytes_; });
+  pending_.append(line.data(), line.size());
+  queued_bytes_ += line.size();
+  pending_cond_.notify_one();
+  if (wait) {
+    const uint64_t queued_bytes = queued_bytes_;
+    written_cond_.wait(lock, [this, queued_bytes] {
+      return written_bytes_ >= queued_bytes;
+    });
+  }
+}
+
+void AsyncLogWriter::WriterLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    pending_cond_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+    // The lines still pending are written before stopping.
+    if (pending_.empty()) {
+      break;
+    }
+    std::string batch;
+    batch.swap(pending_);
+    space_cond_.notify_all();
+    lock.unlock();
+    ignore_result(android::base::WriteFully(fd_, batch.data(), batch.size()));
+    lock.lock();
+    written_bytes_ += batch.size();
+    written_cond_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
+#define UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Writes the log lines to a file on a background thread, so that the threads
+// logging don't wait for the storage, which with O_SYNC can take milliseconds
+// per write. The lines queued while a write is in progress are written
+// together in the next one.
+class AsyncLogWriter {
+ public:
+  // Above |max_pending_bytes| of lines not taken by the writer yet, Write()
+  // waits for it.
+  AsyncLogWriter(android::base::unique_fd fd, size_t max_pending_bytes);
+  // Writes the lines still pending, then stops the writer.
+  ~AsyncLogWriter();
+
+  // Queues |line| to be written. With |wait|, returns only once it's written,
+  // for the errors that must be on disk in case the process dies next.
+  void Write(std::string_view line, bool wait);
+
+ private:
+  void WriterLoop();
+
+  android::base::unique_fd fd_;
+  const size_t max_pending_bytes_;
+
+  std::mutex mutex_;
+  // Signaled when lines are queued or the writer is stopping.
+  std::condition_variable pending_cond_;
+  // Signaled when the writer takes the pending lines.
+  std::condition_variable space_cond_;
+  // Signaled when the writer wrote the lines it took.
+  std::condition_variable written_cond_;
+  // The lines not taken by the writer yet.
+  std::string pending_;
+  // Bytes of lines queued and written since the writer started.
+  uint64_t queued_bytes_{0};
+  uint64_t written_bytes_{0};
+  bool stopping_{false};
+  std::thread writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncLogWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_ASYNC_LOG_WRITER_H_
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/async_log_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class AsyncLogWriterTest : public ::testing::Test {
+ protected:
+  android::base::unique_fd OpenLogFile() {
+    return android::base::unique_fd(
+        open(log_file_.path().c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC));
+  }
+
+  string ReadLogFile() {
+    string contents;
+    EXPECT_TRUE(utils::ReadFile(log_file_.path(), &contents));
+    return contents;
+  }
+
+  ScopedTempFile log_file_{"AsyncLogWriter-XXXXXX"};
+};
+
+TEST_F(AsyncLogWriterTest, WritesPendingLinesWhenDestroyedTest) {
+  {
+    AsyncLogWriter writer(OpenLogFile(), 1024 * 1024);
+    writer.Write("first\n", false);
+    writer.Write("second\n", false);
+  }
+  EXPECT_EQ("first\nsecond\n", ReadLogFile());
+}
+
+TEST_F(AsyncLogWriterTest, WaitTest) {
+  AsyncLogWriter writer(OpenLogFile(), 1024 * 1024);
+  writer.Write("info\n", false);
+  writer.Write("error\n", true);
+  // Everything queued until the line waited for is in the file.
+  EXPECT_EQ("info\nerror\n", ReadLogFile());
+}
+
+TEST_F(AsyncLogWriterTest, LinesFromThreadsDontInterleaveTest) {
+  constexpr int kThreads = 4;
+  constexpr int kLinesPerThread = 1000;
+  {
+    AsyncLogWriter writer(OpenLogFile(), 4096);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&writer, t] {
+        for (int i = 0; i < kLinesPerThread; i++)
+          writer.Write(base::StringPrintf("thread %d line %d\n", t, i), false);
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+  }
+  std::vector<int> next_line(kThreads, 0);
+  const string contents = ReadLogFile();
+  for (const string& line : base::SplitString(
+           contents, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    int t = 0;
+    int i = 0;
+    ASSERT_EQ(2, sscanf(line.c_str(), "thread %d line %d", &t, &i)) << line;
+    ASSERT_LT(t, kThreads);
+    // The lines of each thread are written in order.
+    EXPECT_EQ(next_line[t]++, i);
+  }
+  EXPECT_EQ(std::vector<int>(kThreads, kLinesPerThread), next_line);
+}
+
+TEST_F(AsyncLogWriterTest, WaitsForWriterAbovePendingLimitTest) {
+  int fds[2];
+  ASSERT_EQ(0, pipe2(fds, O_CLOEXEC));
+  android::base::unique_fd read_fd(fds[0]);
+  // Much more than the pipe holds while nothing reads from it.
+  const string line(1024, 'x');
+  constexpr size_t kLines = 1024;
+  std::atomic<bool> done{false};
+  AsyncLogWriter writer(android::base::unique_fd(fds[1]), line.size());
+  std::thread logging_thread([&] {
+    for (size_t i = 0; i < kLines; i++)
+      writer.Write(line, false);
+    done = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(done);
+
+  string contents(kLines * line.size(), '\0');
+  EXPECT_TRUE(
+      android::base::ReadFully(read_fd, contents.data(), contents.size()));
+  logging_thread.join();
+  EXPECT_TRUE(done);
+  EXPECT_EQ(string(kLines * line.size(), 'x'), contents);
+}
+
+}  // namespace chromeos_update_engine
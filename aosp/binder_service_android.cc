@@ -17,6 +17,7 @@
 #include "update_engine/aosp/binder_service_android.h"
 
 #include <memory>
+#include <utility>
 
 #include <base/bind.h>
 #include <base/logging.h>
@@ -29,12 +30,33 @@
 using android::binder::Status;
 using android::os::IUpdateEngineCallback;
 using android::os::ParcelFileDescriptor;
+using android::os::UpdateEngineOperationStatistics;
+using android::os::UpdateEnginePhaseStatistics;
+using android::os::UpdateEngineStatistics;
 using std::string;
 using std::vector;
 using update_engine::UpdateEngineStatus;
 
 namespace chromeos_update_engine {
 
+namespace {
+vector<UpdateEngineOperationStatistics> ToParcelables(
+    const vector<UpdateStatistics::Operations>& operations) {
+  vector<UpdateEngineOperationStatistics> parcelables;
+  for (const auto& op_stats : operations) {
+    UpdateEngineOperationStatistics parcelable;
+    parcelable.name = android::String16(op_stats.name.c_str());
+    parcelable.count = op_stats.count;
+    parcelable.wallTimeMillis = op_stats.wall_time_ms;
+    parcelable.bytesRead = op_stats.bytes_read;
+    parcelable.bytesWritten = op_stats.bytes_written;
+    parcelable.dataBytes = op_stats.data_bytes;
+    parcelables.push_back(std::move(parcelable));
+  }
+  return parcelables;
+}
+}  // namespace
+
 BinderUpdateEngineAndroidService::BinderUpdateEngineAndroidService(
     ServiceDelegateAndroidInterface* service_delegate)
     : service_delegate_(service_delegate) {}
@@ -265,4 +287,44 @@ Status BinderUpdateEngineAndroidService::setPerformanceMode(bool enable) {
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::calibrate() {
+  brillo::ErrorPtr error;
+  if (!service_delegate_->Calibrate(&error))
+    return ErrorPtrToStatus(error);
+  return Status::ok();
+}
+
+Status BinderUpdateEngineAndroidService::getStatistics(
+    UpdateEngineStatistics* return_value) {
+  UpdateStatistics stats;
+  brillo::ErrorPtr error;
+  if (!service_delegate_->GetStatistics(&stats, &error))
+    return ErrorPtrToStatus(error);
+
+  *return_value = UpdateEngineStatistics();
+  return_value->status = stats.status;
+  for (const auto& phase : stats.phases) {
+    UpdateEnginePhaseStatistics parcelable;
+    parcelable.name = android::String16(phase.name.c_str());
+    parcelable.partition = android::String16(phase.partition.c_str());
+    parcelable.wallTimeMillis = phase.wall_time_ms;
+    parcelable.running = phase.running;
+    return_value->phases.push_back(std::move(parcelable));
+  }
+  return_value->operationTypes = ToParcelables(stats.operation_types);
+  return_value->partitions = ToParcelables(stats.partitions);
+  return_value->bytesDownloaded = stats.bytes_downloaded;
+  return_value->payloadBytesReceived = stats.payload_bytes_received;
+  return_value->payloadBytesTotal = stats.payload_bytes_total;
+  return_value->bytesVerified = stats.bytes_verified;
+  return_value->bytesToVerify = stats.bytes_to_verify;
+  return_value->downloadBytesPerSecond = stats.download_rate;
+  return_value->applyBytesPerSecond = stats.apply_rate;
+  return_value->verifyBytesPerSecond = stats.verify_rate;
+  return_value->pipelinedBytes = stats.pipelined_bytes;
+  return_value->scheduledOperationBytes = stats.scheduled_operation_bytes;
+  return_value->etaMillis = stats.eta_ms;
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
@@ -28,6 +28,7 @@
 
 #include "android/os/BnUpdateEngine.h"
 #include "android/os/IUpdateEngineCallback.h"
+#include "android/os/UpdateEngineStatistics.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
 #include "update_engine/common/service_observer_interface.h"
 
@@ -80,6 +81,9 @@ class BinderUpdateEngineAndroidService : public android::os::BnUpdateEngine,
   android::binder::Status cleanupSuccessfulUpdate(
       const android::sp<android::os::IUpdateEngineCallback>& callback) override;
   android::binder::Status setPerformanceMode(bool enable) override;
+  android::binder::Status calibrate() override;
+  android::binder::Status getStatistics(
+      android::os::UpdateEngineStatistics* return_value) override;
 
  private:
   // Remove the passed |callback| from the list of registered callbacks. Called
@@ -43,8 +43,6 @@ constexpr auto kCheckBootCompletedInterval = base::TimeDelta::FromSeconds(2);
 // Interval to check IBootControl::isSlotMarkedSuccessful
 constexpr auto kCheckSlotMarkedSuccessfulInterval =
     base::TimeDelta::FromSeconds(2);
-// Interval to call SnapshotManager::ProcessUpdateState
-constexpr auto kWaitForMergeInterval = base::TimeDelta::FromSeconds(2);
 
 #ifdef __ANDROID_RECOVERY__
 static constexpr bool kIsRecovery = true;
@@ -263,13 +261,15 @@ void CleanupPreviousUpdateAction::CheckSlotMarkedSuccessfulOrSchedule() {
   WaitForMergeOrSchedule();
 }
 
-void CleanupPreviousUpdateAction::ScheduleWaitForMerge() {
+// |delay| is the interval before the next SnapshotManager::ProcessUpdateState
+// call, as decided by |merge_pacer_|.
+void CleanupPreviousUpdateAction::ScheduleWaitForMerge(base::TimeDelta delay) {
   TEST_AND_RETURN(running_);
   scheduled_task_ = MessageLoop::current()->PostDelayedTask(
       FROM_HERE,
       base::Bind(&CleanupPreviousUpdateAction::WaitForMergeOrSchedule,
                  base::Unretained(this)),
-      kWaitForMergeInterval);
+      delay);
   CheckTaskScheduled("WaitForMerge");
 }
 
@@ -287,9 +287,11 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
     merge_stats_->set_merge_failure_code(failure_code);
   }
 
+  auto poll_start_time = base::TimeTicks::Now();
   auto state = snapshot_->ProcessUpdateState(
       std::bind(&CleanupPreviousUpdateAction::OnMergePercentageUpdate, this),
       std::bind(&CleanupPreviousUpdateAction::BeforeCancel, this));
+  auto poll_end_time = base::TimeTicks::Now();
   merge_stats_->set_state(state);
 
   switch (state) {
@@ -316,7 +318,19 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
     }
 
     case UpdateState::Merging: {
-      ScheduleWaitForMerge();
+      // The first poll only marks the start of the first interval.
+      auto elapsed = last_merge_poll_time_.is_null()
+                         ? base::TimeDelta()
+                         : poll_end_time - last_merge_poll_time_;
+      last_merge_poll_time_ = poll_end_time;
+      PressureStall pressure;
+      bool has_pressure = ReadIoPressure(&pressure);
+      merge_pacer_.set_total_bytes(merge_stats_->total_cow_size_bytes());
+      ScheduleWaitForMerge(
+          merge_pacer_.RecordInterval(elapsed,
+                                      merge_percentage_,
+                                      poll_end_time - poll_start_time,
+                                      has_pressure ? &pressure : nullptr));
       return;
     }
 
@@ -361,6 +375,7 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
 bool CleanupPreviousUpdateAction::OnMergePercentageUpdate() {
   double percentage = 0.0;
   snapshot_->GetUpdateState(&percentage);
+  merge_percentage_ = percentage;
   if (delegate_) {
     // libsnapshot uses [0, 100] percentage but update_engine uses [0, 1].
     delegate_->OnCleanupProgressUpdate(percentage / 100);
@@ -410,6 +425,22 @@ void CleanupPreviousUpdateAction::InitiateMergeAndWait() {
     return;
   }
 
+  // Don't start merging while the device is busy with foreground I/O, the
+  // merge would slow it down further. Recovery has no foreground load.
+  PressureStall pressure;
+  bool has_pressure = !kIsRecovery && ReadIoPressure(&pressure);
+  auto now = base::TimeTicks::Now();
+  if (merge_deferred_since_.is_null()) {
+    merge_deferred_since_ = now;
+  }
+  if (merge_pacer_.ShouldDeferMerge(has_pressure ? &pressure : nullptr,
+                                    now - merge_deferred_since_)) {
+    LOG(INFO) << "I/O pressure is " << pressure.some_avg10
+              << "%, deferring merge.";
+    ScheduleWaitForMerge(MergePacer::kMaxInterval);
+    return;
+  }
+
   snapshot_->UpdateCowStats(merge_stats_);
 
   auto merge_start_time = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -459,6 +490,7 @@ void CleanupPreviousUpdateAction::InitiateMergeAndWait() {
 }
 
 void CleanupPreviousUpdateAction::ReportMergeStats() {
+  merge_pacer_.LogSummary();
   auto result = merge_stats_->Finish();
   if (result == nullptr) {
     LOG(WARNING) << "Not reporting merge stats because "
@@ -22,10 +22,12 @@
 #include <string>
 #include <string_view>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 #include <libsnapshot/snapshot.h>
 #include <libsnapshot/snapshot_stats.h>
 
+#include "update_engine/aosp/merge_pacer.h"
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/cleanup_previous_update_action_delegate.h"
@@ -77,6 +79,15 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   unsigned int last_percentage_{0};
   android::snapshot::ISnapshotMergeStats* merge_stats_;
   brillo::MessageLoop::TaskId scheduled_task_{brillo::MessageLoop::kTaskIdNull};
+  // Paces the merge polls and collects per-interval merge telemetry.
+  MergePacer merge_pacer_;
+  // Merge percentage reported by the last OnMergePercentageUpdate().
+  double merge_percentage_{0};
+  // When the last merge poll ended. Null before the first one.
+  base::TimeTicks last_merge_poll_time_;
+  // When InitiateMergeAndWait() was first called. Merges are deferred under
+  // I/O pressure for at most MergePacer::kMaxMergeDeferral from then.
+  base::TimeTicks merge_deferred_since_;
 
   // Helpers for task management.
   void AcknowledgeTaskExecuted();
@@ -88,7 +99,7 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   void WaitBootCompletedOrSchedule();
   void ScheduleWaitMarkBootSuccessful();
   void CheckSlotMarkedSuccessfulOrSchedule();
-  void ScheduleWaitForMerge();
+  void ScheduleWaitForMerge(base::TimeDelta delay);
   void WaitForMergeOrSchedule();
   void InitiateMergeAndWait();
   void ReportMergeStats();
@@ -18,9 +18,14 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -40,12 +45,18 @@ DEFINE_string(partitions,
               "",
               "Comma separated list of partitions to extract, leave empty for "
               "extracting all partitions");
+DEFINE_int32(threads, 1, "Number of partitions converted at once");
+DEFINE_int32(compress_threads,
+             0,
+             "Number of threads compressing the blocks of each COW image, 0 "
+             "to compress them on the thread writing the COW");
 
 namespace chromeos_update_engine {
 
 bool ProcessPartition(const chromeos_update_engine::PartitionUpdate& partition,
                       const char* image_dir,
-                      size_t block_size) {
+                      size_t block_size,
+                      int num_compress_threads) {
   base::FilePath img_dir{image_dir};
   auto target_img = img_dir.Append(partition.partition_name() + ".img");
   auto output_cow = img_dir.Append(partition.partition_name() + ".cow");
@@ -62,7 +73,9 @@ bool ProcessPartition(const chromeos_update_engine::PartitionUpdate& partition,
   }
 
   android::snapshot::CowWriter cow_writer{
-      {.block_size = static_cast<uint32_t>(block_size), .compression = "gz"}};
+      {.block_size = static_cast<uint32_t>(block_size),
+       .compression = "gz",
+       .num_compress_threads = num_compress_threads}};
   TEST_AND_RETURN_FALSE(cow_writer.Initialize(output_fd));
   TEST_AND_RETURN_FALSE(CowDryRun(nullptr,
                                   target_img_fd,
@@ -76,6 +89,50 @@ bool ProcessPartition(const chromeos_update_engine::PartitionUpdate& partition,
   return true;
 }
 
+// The result of the conversion of a partition.
+struct PartitionResult {
+  bool success{false};
+  int64_t cow_size{0};
+  double seconds{0};
+};
+
+// Converts |partition| and logs how its COW size compares to the estimate
+// and how fast it was converted.
+PartitionResult ConvertPartition(const PartitionUpdate& partition,
+                                 const char* image_dir,
+                                 size_t block_size,
+                                 int num_compress_threads) {
+  PartitionResult result;
+  const auto start = std::chrono::steady_clock::now();
+  if (!ProcessPartition(
+          partition, image_dir, block_size, num_compress_threads)) {
+    LOG(ERROR) << "Failed to convert " << partition.partition_name();
+    return result;
+  }
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  base::FilePath img_dir{image_dir};
+  const auto output_cow =
+      img_dir.Append(partition.partition_name() + ".cow").value();
+  result.cow_size = utils::FileSize(output_cow);
+  const auto& actual_cow_size = result.cow_size;
+  const double image_mib =
+      partition.new_partition_info().size() / (1024.0 * 1024.0);
+  LOG(INFO) << partition.partition_name()
+            << ": estimated COW size is: " << partition.estimate_cow_size()
+            << ", actual COW size is: " << actual_cow_size
+            << ", estimated COW size is "
+            << (actual_cow_size - partition.estimate_cow_size()) * 100.0f /
+                   actual_cow_size
+            << "% smaller";
+  LOG(INFO) << partition.partition_name() << ": converted " << image_mib
+            << " MiB in " << result.seconds << " s, "
+            << image_mib / std::max(result.seconds, 1e-6) << " MiB/s";
+  result.success = true;
+  return result;
+}
+
 }  // namespace chromeos_update_engine
 
 using chromeos_update_engine::MetadataParseResult;
@@ -136,9 +193,7 @@ int main(int argc, char* argv[]) {
     return 5;
   }
 
-  size_t estimated_total_cow_size = 0;
-  size_t actual_total_cow_size = 0;
-
+  std::vector<const chromeos_update_engine::PartitionUpdate*> to_convert;
   for (const auto& partition : manifest.partitions()) {
     if (partition.estimate_cow_size() == 0) {
       continue;
@@ -147,24 +202,46 @@ int main(int argc, char* argv[]) {
         partitions.count(partition.partition_name()) == 0) {
       continue;
     }
-    LOG(INFO) << partition.partition_name();
-    if (!ProcessPartition(partition, images_dir, manifest.block_size())) {
+    to_convert.push_back(&partition);
+  }
+
+  // The threads take the next partition to convert until there are none
+  // left. The results are reported in the payload order.
+  std::vector<chromeos_update_engine::PartitionResult> results(
+      to_convert.size());
+  std::atomic<size_t> next_partition{0};
+  auto convert_partitions = [&]() {
+    for (size_t i = next_partition++; i < to_convert.size();
+         i = next_partition++) {
+      LOG(INFO) << to_convert[i]->partition_name();
+      results[i] =
+          chromeos_update_engine::ConvertPartition(*to_convert[i],
+                                                   images_dir,
+                                                   manifest.block_size(),
+                                                   FLAGS_compress_threads);
+    }
+  };
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < FLAGS_threads; i++)
+    threads.emplace_back(convert_partitions);
+  convert_partitions();
+  for (auto& thread : threads)
+    thread.join();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  size_t estimated_total_cow_size = 0;
+  size_t actual_total_cow_size = 0;
+  uint64_t total_image_size = 0;
+  for (size_t i = 0; i < to_convert.size(); i++) {
+    if (!results[i].success) {
       return 6;
     }
-    base::FilePath img_dir{images_dir};
-    const auto output_cow =
-        img_dir.Append(partition.partition_name() + ".cow").value();
-    const auto actual_cow_size =
-        chromeos_update_engine::utils::FileSize(output_cow);
-    LOG(INFO) << partition.partition_name()
-              << ": estimated COW size is: " << partition.estimate_cow_size()
-              << ", actual COW size is: " << actual_cow_size
-              << ", estimated COW size is "
-              << (actual_cow_size - partition.estimate_cow_size()) * 100.0f /
-                     actual_cow_size
-              << "% smaller";
-    estimated_total_cow_size += partition.estimate_cow_size();
-    actual_total_cow_size += actual_cow_size;
+    estimated_total_cow_size += to_convert[i]->estimate_cow_size();
+    actual_total_cow_size += results[i].cow_size;
+    total_image_size += to_convert[i]->new_partition_info().size();
   }
 
   LOG(INFO) << "Total estimated COW size is: " << estimated_total_cow_size
@@ -173,5 +250,8 @@ int main(int argc, char* argv[]) {
             << (actual_total_cow_size - estimated_total_cow_size) * 100.0f /
                    actual_total_cow_size
             << "% smaller";
+  const double total_image_mib = total_image_size / (1024.0 * 1024.0);
+  LOG(INFO) << "Converted " << total_image_mib << " MiB in " << seconds
+            << " s, " << total_image_mib / std::max(seconds, 1e-6) << " MiB/s";
   return 0;
 }
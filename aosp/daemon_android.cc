@@ -18,6 +18,7 @@
 
 #include <sysexits.h>
 
+#include <base/time/time.h>
 #include <binderwrapper/binder_wrapper.h>
 
 #include "update_engine/aosp/daemon_state_android.h"
@@ -31,6 +32,15 @@ unique_ptr<DaemonBase> DaemonBase::CreateInstance() {
 }
 
 int DaemonAndroid::OnInit() {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  // Logs the time spent since |start_time| up to the step |step| of the
+  // startup.
+  auto log_startup_step = [&start_time](const char* step) {
+    LOG(INFO) << "Startup: " << step << " after "
+              << (base::TimeTicks::Now() - start_time).InMilliseconds()
+              << "ms";
+  };
+
   // Register the |subprocess_| singleton with this Daemon as the signal
   // handler.
   subprocess_.Init(this);
@@ -46,6 +56,7 @@ int DaemonAndroid::OnInit() {
   daemon_state_.reset(daemon_state_android);
   LOG_IF(ERROR, !daemon_state_android->Initialize())
       << "Failed to initialize system state.";
+  log_startup_step("system state initialized");
 
   auto binder_wrapper = android::BinderWrapper::Get();
 
@@ -66,8 +77,10 @@ int DaemonAndroid::OnInit() {
     LOG(ERROR) << "Failed to register stable binder service.";
   }
   daemon_state_->AddObserver(stable_binder_service_.get());
+  log_startup_step("binder services registered");
 
   daemon_state_->StartUpdater();
+  log_startup_step("updater started");
   return EX_OK;
 }
 
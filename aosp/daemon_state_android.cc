@@ -16,6 +16,7 @@
 
 #include "update_engine/aosp/daemon_state_android.h"
 
+#include <android-base/properties.h>
 #include <base/logging.h>
 
 #include "update_engine/aosp/apex_handler_interface.h"
@@ -27,6 +28,13 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+// Whether to keep the prefs in a single log file instead of one file per key.
+// Builds older than LogPrefs can't read the log, only enable it on devices
+// that won't roll back to one.
+constexpr char kLogPrefsProperty[] = "ro.update_engine.log_prefs";
+}  // namespace
+
 bool DaemonStateAndroid::Initialize() {
   boot_control_ = boot_control::CreateBootControl();
   if (!boot_control_) {
@@ -50,6 +58,13 @@ bool DaemonStateAndroid::Initialize() {
     prefs_.reset(new MemoryPrefs());
     LOG(WARNING)
         << "Could not get a non-volatile directory, fall back to memory prefs";
+  } else if (android::base::GetBoolProperty(kLogPrefsProperty, false)) {
+    LogPrefs* prefs = new LogPrefs();
+    prefs_.reset(prefs);
+    if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
+      LOG(ERROR) << "Failed to initialize preferences.";
+      return false;
+    }
   } else {
     Prefs* prefs = new Prefs();
     prefs_.reset(prefs);
@@ -16,7 +16,11 @@
 
 #include "update_engine/aosp/dynamic_partition_control_android.h"
 
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
 #include <algorithm>
+#include <atomic>
 #include <chrono>  // NOLINT(build/c++11) - using libsnapshot / liblp API
 #include <cstdint>
 #include <map>
@@ -24,6 +28,7 @@
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -31,8 +36,10 @@
 #include <android-base/strings.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 #include <bootloader_message/bootloader_message.h>
 #include <fs_mgr.h>
 #include <fs_mgr_dm_linear.h>
@@ -62,6 +69,7 @@ using android::fs_mgr::CreateLogicalPartition;
 using android::fs_mgr::CreateLogicalPartitionParams;
 using android::fs_mgr::DestroyLogicalPartition;
 using android::fs_mgr::Fstab;
+using android::fs_mgr::LpMetadata;
 using android::fs_mgr::MetadataBuilder;
 using android::fs_mgr::Partition;
 using android::fs_mgr::PartitionOpener;
@@ -98,6 +106,13 @@ constexpr std::chrono::milliseconds kMapTimeout{1000};
 // Map timeout for dynamic partitions with snapshots. Since several devices
 // needs to be mapped, this timeout is longer than |kMapTimeout|.
 constexpr std::chrono::milliseconds kMapSnapshotTimeout{10000};
+// Number of COW writers opened at once while preparing the partitions.
+constexpr size_t kMaxCowWriterPrepareThreads = 8;
+
+// Returns the milliseconds elapsed since |start|, for the timing logs.
+static int64_t MillisecondsSince(base::TimeTicks start) {
+  return (base::TimeTicks::Now() - start).InMilliseconds();
+}
 
 DynamicPartitionControlAndroid::~DynamicPartitionControlAndroid() {
   UnmapAllPartitions();
@@ -135,13 +150,23 @@ DynamicPartitionControlAndroid::DynamicPartitionControlAndroid(
           GetFeatureFlag(kVirtualAbCompressionXorEnabled, "")),
       virtual_ab_userspace_snapshots_(
           GetFeatureFlag(kVirtualAbUserspaceSnapshotsEnabled, nullptr)),
-      source_slot_(source_slot) {
-  if (GetVirtualAbFeatureFlag().IsEnabled()) {
-    snapshot_ = SnapshotManager::New();
-  } else {
-    snapshot_ = SnapshotManagerStub::New();
+      source_slot_(source_slot) {}
+
+android::snapshot::ISnapshotManager*
+DynamicPartitionControlAndroid::GetSnapshotManager() {
+  // Created on first use, most boots never need it. The threads preparing and
+  // applying the partitions may ask for it at once. It's then kept until this
+  // object is destroyed, so the pointers they hold stay valid.
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
+  if (!snapshot_) {
+    if (GetVirtualAbFeatureFlag().IsEnabled()) {
+      snapshot_ = SnapshotManager::New();
+    } else {
+      snapshot_ = SnapshotManagerStub::New();
+    }
+    CHECK(snapshot_ != nullptr) << "Cannot initialize SnapshotManager.";
   }
-  CHECK(snapshot_ != nullptr) << "Cannot initialize SnapshotManager.";
+  return snapshot_.get();
 }
 
 FeatureFlag DynamicPartitionControlAndroid::GetDynamicPartitionsFeatureFlag() {
@@ -197,15 +222,14 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
       .force_writable = force_writable,
   };
   bool success = false;
-  if (GetVirtualAbFeatureFlag().IsEnabled() && target_supports_snapshot_ &&
-      force_writable && ExpectMetadataMounted()) {
+  if (MapsAsSnapshot(force_writable)) {
     // Only target partitions are mapped with force_writable. On Virtual
     // A/B devices, target partitions may overlap with source partitions, so
     // they must be mapped with snapshot.
     // One exception is when /metadata is not mounted. Fallback to
     // CreateLogicalPartition as snapshots are not created in the first place.
     params.timeout_ms = kMapSnapshotTimeout;
-    success = snapshot_->MapUpdateSnapshot(params, path);
+    success = GetSnapshotManager()->MapUpdateSnapshot(params, path);
   } else {
     params.timeout_ms = kMapTimeout;
     success = CreateLogicalPartition(params, path);
@@ -220,9 +244,100 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
             << " to device mapper (force_writable = " << force_writable
             << "); device path at " << *path;
   mapped_devices_.insert(target_partition_name);
+  ClearPartitionDeviceCache();
+  return true;
+}
+
+bool DynamicPartitionControlAndroid::MapsAsSnapshot(bool force_writable) {
+  return GetVirtualAbFeatureFlag().IsEnabled() && target_supports_snapshot_ &&
+         force_writable && ExpectMetadataMounted();
+}
+
+bool DynamicPartitionControlAndroid::MapPartitionsOnDeviceMapper(
+    const std::string& super_device,
+    const std::vector<std::string>& target_partition_names,
+    uint32_t slot,
+    bool force_writable,
+    std::map<std::string, std::string>* paths) {
+  std::vector<std::string> created;
+  for (const auto& name : target_partition_names) {
+    std::string path;
+    if (MapsAsSnapshot(force_writable) ||
+        GetState(name) != DmDeviceState::INVALID) {
+      // Snapshots and the devices already there go the usual way.
+      TEST_AND_RETURN_FALSE(MapPartitionOnDeviceMapper(
+          super_device, name, slot, force_writable, &path));
+      (*paths)[name] = path;
+      continue;
+    }
+    // Don't wait for the device node here.
+    CreateLogicalPartitionParams params = {
+        .block_device = super_device,
+        .metadata_slot = slot,
+        .partition_name = name,
+        .force_writable = force_writable,
+        .timeout_ms = std::chrono::milliseconds(0),
+    };
+    if (!CreateLogicalPartition(params, &path)) {
+      LOG(ERROR) << "Cannot map " << name << " in " << super_device
+                 << " on device mapper.";
+      return false;
+    }
+    mapped_devices_.insert(name);
+    ClearPartitionDeviceCache();
+    created.push_back(name);
+  }
+  const auto deadline = std::chrono::steady_clock::now() + kMapTimeout;
+  for (const auto& name : created) {
+    const auto timeout = std::max(
+        std::chrono::milliseconds(0),
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()));
+    std::string path;
+    if (!DeviceMapper::Instance().WaitForDevice(name, timeout, &path)) {
+      LOG(ERROR) << "Timed out waiting for the device node of " << name;
+      return false;
+    }
+    LOG(INFO) << "Succesfully mapped " << name
+              << " to device mapper (force_writable = " << force_writable
+              << "); device path at " << path;
+    (*paths)[name] = path;
+  }
   return true;
 }
 
+void DynamicPartitionControlAndroid::MapTargetPartitions(
+    uint32_t target_slot, const DeltaArchiveManifest& manifest) {
+  std::string device_dir_str;
+  if (!GetDeviceDir(&device_dir_str)) {
+    return;
+  }
+  const std::string super_device =
+      base::FilePath(device_dir_str)
+          .Append(GetSuperPartitionName(target_slot))
+          .value();
+  auto builder = LoadMetadataBuilder(super_device, target_slot);
+  if (builder == nullptr) {
+    return;
+  }
+  std::vector<std::string> names;
+  const auto suffix = SlotSuffixForSlotNumber(target_slot);
+  for (const auto& partition : manifest.partitions()) {
+    const std::string name = partition.partition_name() + suffix;
+    // Empty partitions have nothing to map.
+    const auto* lp_partition = builder->FindPartition(name);
+    if (lp_partition != nullptr && lp_partition->size() > 0) {
+      names.push_back(name);
+    }
+  }
+  std::map<std::string, std::string> paths;
+  LOG_IF(WARNING,
+         !MapPartitionsOnDeviceMapper(
+             super_device, names, target_slot, true, &paths))
+      << "Failed to map the target partitions at once, mapping them when "
+      << "opened";
+}
+
 bool DynamicPartitionControlAndroid::MapPartitionOnDeviceMapper(
     const std::string& super_device,
     const std::string& target_partition_name,
@@ -281,7 +396,8 @@ bool DynamicPartitionControlAndroid::UnmapPartitionOnDeviceMapper(
     // On a Virtual A/B device, |target_partition_name| may be a leftover from
     // a paused update. Clean up any underlying devices.
     if (ExpectMetadataMounted()) {
-      success &= snapshot_->UnmapUpdateSnapshot(target_partition_name);
+      success &=
+          GetSnapshotManager()->UnmapUpdateSnapshot(target_partition_name);
     } else {
       LOG(INFO) << "Skip UnmapUpdateSnapshot(" << target_partition_name
                 << ") because metadata is not mounted";
@@ -296,11 +412,18 @@ bool DynamicPartitionControlAndroid::UnmapPartitionOnDeviceMapper(
               << " from device mapper.";
   }
   mapped_devices_.erase(target_partition_name);
+  ClearPartitionDeviceCache();
   return true;
 }
 
 bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
-  snapshot_->UnmapAllSnapshots();
+  {
+    // They keep their snapshots mapped.
+    std::lock_guard<std::mutex> lock(prepared_cow_writers_mutex_);
+    prepared_cow_writers_.clear();
+  }
+  GetSnapshotManager()->UnmapAllSnapshots();
+  ClearPartitionDeviceCache();
   if (mapped_devices_.empty()) {
     return false;
   }
@@ -317,12 +440,7 @@ bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
 void DynamicPartitionControlAndroid::Cleanup() {
   UnmapAllPartitions();
   metadata_device_.reset();
-  if (GetVirtualAbFeatureFlag().IsEnabled()) {
-    snapshot_ = SnapshotManager::New();
-  } else {
-    snapshot_ = SnapshotManagerStub::New();
-  }
-  CHECK(snapshot_ != nullptr) << "Cannot initialize SnapshotManager.";
+  InvalidateMetadataCache();
 }
 
 bool DynamicPartitionControlAndroid::DeviceExists(const std::string& path) {
@@ -339,20 +457,65 @@ bool DynamicPartitionControlAndroid::GetDmDevicePathByName(
   return DeviceMapper::Instance().GetDmDevicePathByName(name, path);
 }
 
+std::unique_ptr<LpMetadata> DynamicPartitionControlAndroid::ReadMetadata(
+    const std::string& super_device, uint32_t slot) {
+  return android::fs_mgr::ReadMetadata(PartitionOpener(), super_device, slot);
+}
+
 std::unique_ptr<MetadataBuilder>
 DynamicPartitionControlAndroid::LoadMetadataBuilder(
     const std::string& super_device, uint32_t slot) {
-  auto builder = MetadataBuilder::New(PartitionOpener(), super_device, slot);
+  const auto key = std::make_pair(super_device, slot);
+  std::shared_ptr<const LpMetadata> metadata;
+  {
+    // Held while reading, the same metadata isn't read twice at once.
+    std::lock_guard<std::mutex> lock(metadata_cache_mutex_);
+    auto it = metadata_cache_.find(key);
+    if (it == metadata_cache_.end()) {
+      std::shared_ptr<const LpMetadata> read = ReadMetadata(super_device, slot);
+      num_metadata_reads_++;
+      if (read == nullptr) {
+        LOG(WARNING) << "No metadata slot "
+                     << BootControlInterface::SlotName(slot) << " in "
+                     << super_device;
+        return nullptr;
+      }
+      LOG(INFO) << "Loaded metadata from slot "
+                << BootControlInterface::SlotName(slot) << " in "
+                << super_device << ", " << num_metadata_reads_
+                << " metadata reads so far";
+      it = metadata_cache_.emplace(key, std::move(read)).first;
+    }
+    metadata = it->second;
+  }
+  // Built outside of the lock, |metadata| is kept alive if the cache is
+  // dropped meanwhile.
+  const PartitionOpener opener;
+  auto builder = MetadataBuilder::New(*metadata, &opener);
   if (builder == nullptr) {
-    LOG(WARNING) << "No metadata slot " << BootControlInterface::SlotName(slot)
-                 << " in " << super_device;
+    LOG(WARNING) << "Invalid metadata in slot "
+                 << BootControlInterface::SlotName(slot) << " in "
+                 << super_device;
     return nullptr;
   }
-  LOG(INFO) << "Loaded metadata from slot "
-            << BootControlInterface::SlotName(slot) << " in " << super_device;
   return builder;
 }
 
+void DynamicPartitionControlAndroid::ClearPartitionDeviceCache() {
+  std::lock_guard<std::mutex> lock(partition_device_cache_mutex_);
+  partition_device_cache_.clear();
+  partition_device_cache_generation_++;
+}
+
+void DynamicPartitionControlAndroid::InvalidateMetadataCache() {
+  {
+    std::lock_guard<std::mutex> lock(metadata_cache_mutex_);
+    metadata_cache_.clear();
+  }
+  // The devices of the dynamic partitions are looked up in the metadata.
+  ClearPartitionDeviceCache();
+}
+
 std::unique_ptr<MetadataBuilder>
 DynamicPartitionControlAndroid::LoadMetadataBuilder(
     const std::string& super_device,
@@ -380,6 +543,10 @@ bool DynamicPartitionControlAndroid::StoreMetadata(
     const std::string& super_device,
     MetadataBuilder* builder,
     uint32_t target_slot) {
+  // Even a failed write may have changed some of the slots. Dropped again once
+  // written, it may have been read by another thread meanwhile.
+  InvalidateMetadataCache();
+  DEFER { InvalidateMetadataCache(); };
   auto metadata = builder->Export();
   if (metadata == nullptr) {
     LOG(ERROR) << "Cannot export metadata to slot "
@@ -450,6 +617,9 @@ bool DynamicPartitionControlAndroid::PreparePartitionsForUpdate(
     const DeltaArchiveManifest& manifest,
     bool update,
     uint64_t* required_size) {
+  // The metadata may have changed since it was cached, for example by the
+  // merge of the previous update.
+  InvalidateMetadataCache();
   source_slot_ = source_slot;
   target_slot_ = target_slot;
   if (required_size != nullptr) {
@@ -539,7 +709,8 @@ bool DynamicPartitionControlAndroid::PreparePartitionsForUpdate(
     // should not proceed because during next boot, snapshots will overlay on
     // the devices incorrectly.
     if (ExpectMetadataMounted()) {
-      TEST_AND_RETURN_FALSE(snapshot_->CancelUpdate());
+      InvalidateMetadataCache();
+      TEST_AND_RETURN_FALSE(GetSnapshotManager()->CancelUpdate());
     } else {
       LOG(INFO) << "Skip canceling previous update because metadata is not "
                 << "mounted";
@@ -549,6 +720,7 @@ bool DynamicPartitionControlAndroid::PreparePartitionsForUpdate(
   // TODO(xunchang) support partial update on non VAB enabled devices.
   TEST_AND_RETURN_FALSE(PrepareDynamicPartitionsForUpdate(
       source_slot, target_slot, manifest, delete_source));
+  MapTargetPartitions(target_slot, manifest);
 
   if (required_size != nullptr) {
     *required_size = 0;
@@ -594,6 +766,7 @@ bool DynamicPartitionControlAndroid::SetTargetBuildVars(
 
   // Store the flags.
   is_target_dynamic_ = is_target_dynamic;
+  ClearPartitionDeviceCache();
   // If !is_target_dynamic_, leave target_supports_snapshot_ unset because
   // snapshots would not work without dynamic partition.
   if (is_target_dynamic_) {
@@ -966,11 +1139,16 @@ bool DynamicPartitionControlAndroid::PrepareSnapshotPartitionsForUpdate(
   TEST_AND_RETURN_FALSE(
       CheckSuperPartitionAllocatableSpace(builder.get(), manifest, true));
 
-  if (!snapshot_->BeginUpdate()) {
+  // Both write the metadata of the target slot.
+  InvalidateMetadataCache();
+  auto start = base::TimeTicks::Now();
+  if (!GetSnapshotManager()->BeginUpdate()) {
     LOG(ERROR) << "Cannot begin new update.";
     return false;
   }
-  auto ret = snapshot_->CreateUpdateSnapshots(manifest);
+  LOG(INFO) << "BeginUpdate took " << MillisecondsSince(start) << " ms.";
+  start = base::TimeTicks::Now();
+  auto ret = GetSnapshotManager()->CreateUpdateSnapshots(manifest);
   if (!ret) {
     LOG(ERROR) << "Cannot create update snapshots: " << ret.string();
     if (required_size != nullptr &&
@@ -979,9 +1157,73 @@ bool DynamicPartitionControlAndroid::PrepareSnapshotPartitionsForUpdate(
     }
     return false;
   }
+  LOG(INFO) << "CreateUpdateSnapshots took " << MillisecondsSince(start)
+            << " ms.";
+  PrepareCowWriters(source_slot, manifest);
   return true;
 }
 
+void DynamicPartitionControlAndroid::PrepareCowWriters(
+    uint32_t source_slot, const DeltaArchiveManifest& manifest) {
+  if (!UpdateUsesSnapshotCompression() || manifest.partitions().empty()) {
+    return;
+  }
+  struct PreparedPartition {
+    std::string name;
+    std::optional<std::string> source_path;
+  };
+  std::vector<PreparedPartition> partitions;
+  for (const auto& partition : manifest.partitions()) {
+    PreparedPartition prepared{partition.partition_name(), std::nullopt};
+    std::string source_path;
+    if (partition.old_partition_info().size() > 0 &&
+        GetPartitionDevice(
+            prepared.name, source_slot, source_slot, &source_path)) {
+      prepared.source_path = source_path;
+    }
+    partitions.push_back(std::move(prepared));
+  }
+
+  // Mapping the snapshot of each partition and opening its COW dominates;
+  // the partitions don't depend on each other. A writer that fails to open
+  // here is opened again by OpenCowWriter().
+  const auto start = base::TimeTicks::Now();
+  auto prepare = [&](const PreparedPartition& partition) {
+    const auto partition_start = base::TimeTicks::Now();
+    auto writer = OpenNewCowWriter(partition.name, partition.source_path);
+    LOG(INFO) << "Opening the COW writer of " << partition.name
+              << (writer ? "" : " failed, it") << " took "
+              << MillisecondsSince(partition_start) << " ms.";
+    if (writer == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(prepared_cow_writers_mutex_);
+    prepared_cow_writers_[partition.name] = {partition.source_path,
+                                             std::move(writer)};
+  };
+  // The first partition is prepared alone, so that the snapshot manager sets
+  // up what it creates on first use before the threads share it.
+  prepare(partitions[0]);
+  std::atomic<size_t> next{1};
+  std::vector<std::thread> threads;
+  const size_t num_threads =
+      std::min(kMaxCowWriterPrepareThreads, partitions.size() - 1);
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back([&]() {
+      for (size_t index = next++; index < partitions.size(); index = next++)
+        prepare(partitions[index]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::lock_guard<std::mutex> lock(prepared_cow_writers_mutex_);
+  LOG(INFO) << "Opened the COW writers of " << prepared_cow_writers_.size()
+            << " of " << partitions.size() << " partitions in "
+            << MillisecondsSince(start) << " ms on " << num_threads + 1
+            << " threads.";
+}
+
 std::string DynamicPartitionControlAndroid::GetSuperPartitionName(
     uint32_t slot) {
   return fs_mgr_get_super_partition_name(slot);
@@ -1072,9 +1314,10 @@ bool DynamicPartitionControlAndroid::UpdatePartitionMetadata(
 
 bool DynamicPartitionControlAndroid::FinishUpdate(bool powerwash_required) {
   if (ExpectMetadataMounted()) {
-    if (snapshot_->GetUpdateState() == UpdateState::Initiated) {
+    if (GetSnapshotManager()->GetUpdateState() == UpdateState::Initiated) {
       LOG(INFO) << "Snapshot writes are done.";
-      return snapshot_->FinishedSnapshotWrites(powerwash_required);
+      InvalidateMetadataCache();
+      return GetSnapshotManager()->FinishedSnapshotWrites(powerwash_required);
     }
   } else {
     LOG(INFO) << "Skip FinishedSnapshotWrites() because /metadata is not "
@@ -1126,6 +1369,34 @@ DynamicPartitionControlAndroid::GetPartitionDevice(
     uint32_t slot,
     uint32_t current_slot,
     bool not_in_payload) {
+  const auto key =
+      std::make_tuple(partition_name, slot, current_slot, not_in_payload);
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(partition_device_cache_mutex_);
+    auto it = partition_device_cache_.find(key);
+    if (it != partition_device_cache_.end())
+      return it->second;
+    generation = partition_device_cache_generation_;
+  }
+  auto partition_device = ResolvePartitionDevice(
+      partition_name, slot, current_slot, not_in_payload);
+  // Failures are looked up again, the device may show up later. Neither is
+  // the result kept if the cache was cleared meanwhile.
+  if (partition_device.has_value()) {
+    std::lock_guard<std::mutex> lock(partition_device_cache_mutex_);
+    if (generation == partition_device_cache_generation_)
+      partition_device_cache_.emplace(key, *partition_device);
+  }
+  return partition_device;
+}
+
+std::optional<PartitionDevice>
+DynamicPartitionControlAndroid::ResolvePartitionDevice(
+    const std::string& partition_name,
+    uint32_t slot,
+    uint32_t current_slot,
+    bool not_in_payload) {
   std::string device_dir_str;
   if (!GetDeviceDir(&device_dir_str)) {
     LOG(ERROR) << "Failed to GetDeviceDir()";
@@ -1296,7 +1567,7 @@ DynamicPartitionControlAndroid::GetCleanupPreviousUpdateAction(
     return std::make_unique<NoOpAction>();
   }
   return std::make_unique<CleanupPreviousUpdateAction>(
-      prefs, boot_control, snapshot_.get(), delegate);
+      prefs, boot_control, GetSnapshotManager(), delegate);
 }
 
 bool DynamicPartitionControlAndroid::ResetUpdate(PrefsInterface* prefs) {
@@ -1318,7 +1589,8 @@ bool DynamicPartitionControlAndroid::ResetUpdate(PrefsInterface* prefs) {
       DeltaPerformer::ResetUpdateProgress(prefs, false /* quick */));
 
   if (ExpectMetadataMounted()) {
-    TEST_AND_RETURN_FALSE(snapshot_->CancelUpdate());
+    InvalidateMetadataCache();
+    TEST_AND_RETURN_FALSE(GetSnapshotManager()->CancelUpdate());
   } else {
     LOG(INFO) << "Skip cancelling update in ResetUpdate because /metadata is "
               << "not mounted";
@@ -1419,7 +1691,7 @@ bool DynamicPartitionControlAndroid::EnsureMetadataMounted() {
   }
 
   if (metadata_device_ == nullptr) {
-    metadata_device_ = snapshot_->EnsureMetadataMounted();
+    metadata_device_ = GetSnapshotManager()->EnsureMetadataMounted();
   }
   return metadata_device_ != nullptr;
 }
@@ -1429,6 +1701,26 @@ DynamicPartitionControlAndroid::OpenCowWriter(
     const std::string& partition_name,
     const std::optional<std::string>& source_path,
     bool) {
+  {
+    std::lock_guard<std::mutex> lock(prepared_cow_writers_mutex_);
+    auto it = prepared_cow_writers_.find(partition_name);
+    if (it != prepared_cow_writers_.end()) {
+      auto prepared = std::move(it->second);
+      prepared_cow_writers_.erase(it);
+      if (prepared.source_path == source_path) {
+        return std::move(prepared.writer);
+      }
+      LOG(INFO) << "The COW writer of " << partition_name
+                << " was prepared for another source, opening it again.";
+    }
+  }
+  return OpenNewCowWriter(partition_name, source_path);
+}
+
+std::unique_ptr<android::snapshot::ISnapshotWriter>
+DynamicPartitionControlAndroid::OpenNewCowWriter(
+    const std::string& partition_name,
+    const std::optional<std::string>& source_path) {
   auto suffix = SlotSuffixForSlotNumber(target_slot_);
 
   auto super_device = GetSuperDevice();
@@ -1443,7 +1735,8 @@ DynamicPartitionControlAndroid::OpenCowWriter(
       .timeout_ms = kMapSnapshotTimeout};
   // TODO(zhangkelvin) Open an APPEND mode CowWriter once there's an API to do
   // it.
-  return snapshot_->OpenSnapshotWriter(params, std::move(source_path));
+  return GetSnapshotManager()->OpenSnapshotWriter(params,
+                                                  std::move(source_path));
 }  // namespace chromeos_update_engine
 
 std::unique_ptr<FileDescriptor> DynamicPartitionControlAndroid::OpenCowFd(
@@ -1480,7 +1773,7 @@ std::optional<base::FilePath> DynamicPartitionControlAndroid::GetSuperDevice() {
 }
 
 bool DynamicPartitionControlAndroid::MapAllPartitions() {
-  return snapshot_->MapAllSnapshots(kMapSnapshotTimeout);
+  return GetSnapshotManager()->MapAllSnapshots(kMapSnapshotTimeout);
 }
 
 bool DynamicPartitionControlAndroid::IsDynamicPartition(
@@ -1504,7 +1797,55 @@ bool DynamicPartitionControlAndroid::IsDynamicPartition(
 
 bool DynamicPartitionControlAndroid::UpdateUsesSnapshotCompression() {
   return GetVirtualAbFeatureFlag().IsEnabled() &&
-         snapshot_->UpdateUsesCompression();
+         GetSnapshotManager()->UpdateUsesCompression();
+}
+
+bool DynamicPartitionControlAndroid::GetVerityDevice(
+    const std::string& partition_name,
+    const std::string& data_device,
+    std::string* verity_device,
+    brillo::Blob* root_digest,
+    uint64_t* data_size) {
+  // fs_mgr names the verity devices after the mount point of the partition.
+  const std::string name = partition_name + "-verity";
+  auto& dm = DeviceMapper::Instance();
+  if (dm.GetState(name) != DmDeviceState::ACTIVE) {
+    return false;
+  }
+  std::vector<DeviceMapper::TargetInfo> table;
+  if (!dm.GetTableInfo(name, &table) || table.size() != 1 ||
+      DeviceMapper::GetTargetType(table[0].spec) != "verity") {
+    return false;
+  }
+  // The table is: <version> <data_dev> <hash_dev> <data_block_size>
+  // <hash_block_size> <num_data_blocks> <hash_start_block> <algorithm>
+  // <root_digest> <salt> [<optional arguments>], with the devices as
+  // major:minor.
+  const auto args = android::base::Split(table[0].data, " ");
+  if (args.size() < 10) {
+    LOG(WARNING) << "Unexpected verity table of " << name << ": "
+                 << table[0].data;
+    return false;
+  }
+  struct stat data_stat {};
+  if (stat(data_device.c_str(), &data_stat) != 0 ||
+      !S_ISBLK(data_stat.st_mode) ||
+      args[1] != StringPrintf("%u:%u",
+                              major(data_stat.st_rdev),
+                              minor(data_stat.st_rdev))) {
+    LOG(INFO) << "The verity device " << name << " doesn't read from "
+              << data_device;
+    return false;
+  }
+  uint64_t data_block_size = 0;
+  uint64_t num_data_blocks = 0;
+  root_digest->clear();
+  TEST_AND_RETURN_FALSE(base::StringToUint64(args[3], &data_block_size));
+  TEST_AND_RETURN_FALSE(base::StringToUint64(args[5], &num_data_blocks));
+  TEST_AND_RETURN_FALSE(base::HexStringToBytes(args[8], root_digest));
+  TEST_AND_RETURN_FALSE(dm.GetDmDevicePathByName(name, verity_device));
+  *data_size = data_block_size * num_data_blocks;
+  return true;
 }
 
 FeatureFlag
@@ -17,10 +17,14 @@
 #ifndef UPDATE_ENGINE_AOSP_DYNAMIC_PARTITION_CONTROL_ANDROID_H_
 #define UPDATE_ENGINE_AOSP_DYNAMIC_PARTITION_CONTROL_ANDROID_H_
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <array>
 
 #include <base/files/file_util.h>
@@ -117,6 +121,11 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
 
   bool UpdateUsesSnapshotCompression() override;
+  bool GetVerityDevice(const std::string& partition_name,
+                       const std::string& data_device,
+                       std::string* verity_device,
+                       brillo::Blob* root_digest,
+                       uint64_t* data_size) override;
 
   std::optional<base::FilePath> GetSuperDevice();
 
@@ -133,6 +142,11 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   virtual std::unique_ptr<android::fs_mgr::MetadataBuilder> LoadMetadataBuilder(
       const std::string& super_device, uint32_t slot);
 
+  // Reads the metadata of |super_device| at slot |slot| from the device, for
+  // the cache of LoadMetadataBuilder().
+  virtual std::unique_ptr<android::fs_mgr::LpMetadata> ReadMetadata(
+      const std::string& super_device, uint32_t slot);
+
   // Retrieves metadata from |super_device| at slot |source_slot|. And
   // modifies the metadata so that during updates, the metadata can be written
   // to |target_slot|. In particular, on retrofit devices, the returned
@@ -161,6 +175,17 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
       bool force_writable,
       std::string* path);
 
+  // Same as MapPartitionOnDeviceMapper() for each of |target_partition_names|,
+  // but the devices that aren't snapshots are all created before waiting for
+  // any of their device nodes, so the waits overlap. Sets |paths| to the
+  // device path of each partition.
+  virtual bool MapPartitionsOnDeviceMapper(
+      const std::string& super_device,
+      const std::vector<std::string>& target_partition_names,
+      uint32_t slot,
+      bool force_writable,
+      std::map<std::string, std::string>* paths);
+
   // Return true if a static partition exists at device path |path|.
   virtual bool DeviceExists(const std::string& path);
 
@@ -238,12 +263,29 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   friend class DynamicPartitionControlAndroidTest;
   friend class SnapshotPartitionTestP;
 
+  // Looks up the device of |partition_name| in |slot| for
+  // GetPartitionDevice(), which keeps the result in |partition_device_cache_|.
+  std::optional<PartitionDevice> ResolvePartitionDevice(
+      const std::string& partition_name,
+      uint32_t slot,
+      uint32_t current_slot,
+      bool not_in_payload);
+
   bool MapPartitionInternal(const std::string& super_device,
                             const std::string& target_partition_name,
                             uint32_t slot,
                             bool force_writable,
                             std::string* path);
 
+  // Whether a partition mapped with |force_writable| is mapped as a snapshot.
+  bool MapsAsSnapshot(bool force_writable);
+
+  // Maps the dynamic partitions of |manifest| in |target_slot| at once after
+  // PrepareDynamicPartitionsForUpdate(). A failure only means they are mapped
+  // one by one when opened.
+  void MapTargetPartitions(uint32_t target_slot,
+                           const DeltaArchiveManifest& manifest);
+
   // Update |builder| according to |partition_metadata|.
   // - In Android mode, this is only called when the device
   //   does not have Virtual A/B.
@@ -260,6 +302,17 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
                                           const DeltaArchiveManifest& manifest,
                                           uint64_t* required_size);
 
+  // Opens the COW writers of the partitions of |manifest| on several threads
+  // once their snapshots are created, for OpenCowWriter() to hand them out.
+  // Only with snapshot compression. Logs the time taken by each.
+  void PrepareCowWriters(uint32_t source_slot,
+                         const DeltaArchiveManifest& manifest);
+
+  // Maps the snapshot of |partition_name| and opens a COW writer for it.
+  std::unique_ptr<android::snapshot::ISnapshotWriter> OpenNewCowWriter(
+      const std::string& partition_name,
+      const std::optional<std::string>& source_path);
+
   enum SpaceLimit {
     // Most restricted: if sum(groups) > super / 2, error
     ERROR_IF_EXCEEDED_HALF_OF_SUPER,
@@ -337,13 +390,52 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   // target_supports_snapshot_ and is_target_dynamic_.
   bool SetTargetBuildVars(const DeltaArchiveManifest& manifest);
 
+  // Returns |snapshot_|, creating it on the first call. Thread-safe.
+  android::snapshot::ISnapshotManager* GetSnapshotManager();
+
+  // Drops |metadata_cache_| and |partition_device_cache_|. Must be called
+  // before anything writes the metadata of the super partition.
+  void InvalidateMetadataCache();
+
+  void ClearPartitionDeviceCache();
+
   std::set<std::string> mapped_devices_;
   const FeatureFlag dynamic_partitions_;
   const FeatureFlag virtual_ab_;
   const FeatureFlag virtual_ab_compression_;
   const FeatureFlag virtual_ab_compression_xor_;
   const FeatureFlag virtual_ab_userspace_snapshots_;
+  // Created by GetSnapshotManager() under |snapshot_mutex_|, then never reset.
+  std::mutex snapshot_mutex_;
   std::unique_ptr<android::snapshot::ISnapshotManager> snapshot_;
+  // The metadata read by LoadMetadataBuilder(), by super device and slot.
+  // Guarded by |metadata_cache_mutex_|, as the devices of the dynamic
+  // partitions are looked up from several threads. The entries are shared
+  // with the builders being created from them when the cache is dropped.
+  std::mutex metadata_cache_mutex_;
+  std::map<std::pair<std::string, uint32_t>,
+           std::shared_ptr<const android::fs_mgr::LpMetadata>>
+      metadata_cache_;
+  // Number of times the metadata was read from a super device. Guarded by
+  // |metadata_cache_mutex_|.
+  size_t num_metadata_reads_ = 0;
+  // The devices found by GetPartitionDevice(), by partition name, slot,
+  // current slot and not_in_payload. Cleared whenever a partition is mapped
+  // or unmapped. Guarded by |partition_device_cache_mutex_|, the devices are
+  // also looked up from the threads applying and verifying the partitions.
+  std::mutex partition_device_cache_mutex_;
+  std::map<std::tuple<std::string, uint32_t, uint32_t, bool>, PartitionDevice>
+      partition_device_cache_;
+  // Incremented by ClearPartitionDeviceCache().
+  uint64_t partition_device_cache_generation_ = 0;
+  // The COW writers opened by PrepareCowWriters() and not yet handed out, by
+  // partition name, with the source path they were opened with.
+  struct PreparedCowWriter {
+    std::optional<std::string> source_path;
+    std::unique_ptr<android::snapshot::ISnapshotWriter> writer;
+  };
+  std::mutex prepared_cow_writers_mutex_;
+  std::map<std::string, PreparedCowWriter> prepared_cow_writers_;
   std::unique_ptr<android::snapshot::AutoDevice> metadata_device_;
   bool target_supports_snapshot_ = false;
   // Whether the target partitions should be loaded as dynamic partitions. Set
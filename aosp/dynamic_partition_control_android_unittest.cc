@@ -17,7 +17,11 @@
 #include "update_engine/aosp/dynamic_partition_control_android.h"
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <base/logging.h>
@@ -544,6 +548,33 @@ TEST_P(DynamicPartitionControlAndroidTestP,
   EXPECT_EQ(GetDevice(T("bar")), bar_device);
 }
 
+TEST_P(DynamicPartitionControlAndroidTestP, GetPartitionDeviceCachedTest) {
+  SetMetadata(source(), {{S("system"), 2_GiB}, {S("vendor"), 1_GiB}});
+  // The static partition "bar" is looked up once until the next update is
+  // prepared.
+  EXPECT_CALL(dynamicControl(), DeviceExists(GetDevice(S("bar"))))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  std::string bar_device;
+  EXPECT_TRUE(dynamicControl().GetPartitionDevice(
+      "bar", source(), source(), &bar_device));
+  EXPECT_EQ(GetDevice(S("bar")), bar_device);
+  bar_device.clear();
+  EXPECT_TRUE(dynamicControl().GetPartitionDevice(
+      "bar", source(), source(), &bar_device));
+  EXPECT_EQ(GetDevice(S("bar")), bar_device);
+
+  EXPECT_TRUE(dynamicControl().PreparePartitionsForUpdate(
+      source(),
+      target(),
+      PartitionSizesToManifest({{"system", 2_GiB}, {"vendor", 1_GiB}}),
+      false,
+      nullptr));
+  EXPECT_TRUE(dynamicControl().GetPartitionDevice(
+      "bar", source(), source(), &bar_device));
+  EXPECT_EQ(GetDevice(S("bar")), bar_device);
+}
+
 INSTANTIATE_TEST_CASE_P(DynamicPartitionControlAndroidTest,
                         DynamicPartitionControlAndroidTestP,
                         testing::Values(TestParam{0, 1}, TestParam{1, 0}));
@@ -753,6 +784,80 @@ TEST_F(DynamicPartitionControlAndroidTest, ApplyingToCurrentSlot) {
       << "Should not be able to apply to current slot.";
 }
 
+TEST_F(DynamicPartitionControlAndroidTest, MetadataCacheTest) {
+  SetSlots({0, 1});
+  const string super_device = GetSuperDevice(source());
+  int num_reads = 0;
+  ON_CALL(dynamicControl(), ReadMetadata(super_device, source()))
+      .WillByDefault(Invoke([&](auto, auto) {
+        num_reads++;
+        const PartitionSuffixSizes sizes = {{S("system"), 2_GiB},
+                                            {S("vendor"), 1_GiB}};
+        return NewFakeMetadata(PartitionSuffixSizesToManifest(sizes))
+            ->Export();
+      }));
+
+  // Read once, the next builders are created from the cached copy.
+  auto builder =
+      dynamicControl().RealLoadMetadataBuilder(super_device, source());
+  ASSERT_NE(nullptr, builder);
+  ASSERT_NE(nullptr,
+            dynamicControl().RealLoadMetadataBuilder(super_device, source()));
+  EXPECT_EQ(1, num_reads);
+
+  // Writing the metadata drops the cache, even if the write fails. This is how
+  // the metadata edited by UpdatePartitionMetadata() is written.
+  EXPECT_FALSE(dynamicControl().RealStoreMetadata(
+      GetSuperDevice(target()), builder.get(), target()));
+  ASSERT_NE(nullptr,
+            dynamicControl().RealLoadMetadataBuilder(super_device, source()));
+  EXPECT_EQ(2, num_reads);
+
+  // So does preparing the partitions, for what the last merge changed.
+  EXPECT_TRUE(dynamicControl().PreparePartitionsForUpdate(
+      source(),
+      target(),
+      PartitionSizesToManifest({{"system", 2_GiB}, {"vendor", 1_GiB}}),
+      false,
+      nullptr));
+  ASSERT_NE(nullptr,
+            dynamicControl().RealLoadMetadataBuilder(super_device, source()));
+  EXPECT_EQ(3, num_reads);
+}
+
+TEST_F(DynamicPartitionControlAndroidTest, MetadataCacheThreadsTest) {
+  SetSlots({0, 1});
+  const string super_device = GetSuperDevice(source());
+  ON_CALL(dynamicControl(), ReadMetadata(super_device, source()))
+      .WillByDefault(Invoke([&](auto, auto) {
+        return NewFakeMetadata(
+                   PartitionSuffixSizesToManifest({{S("system"), 2_GiB}}))
+            ->Export();
+      }));
+  std::unique_ptr<MetadataBuilder> builder =
+      dynamicControl().RealLoadMetadataBuilder(super_device, source());
+  ASSERT_NE(nullptr, builder);
+
+  // The builders are created while other threads drop the cache.
+  std::atomic<bool> failed{false};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < 100; j++) {
+        if (!dynamicControl().RealLoadMetadataBuilder(super_device, source()))
+          failed = true;
+      }
+    });
+  }
+  for (int j = 0; j < 100; j++) {
+    EXPECT_FALSE(dynamicControl().RealStoreMetadata(
+        GetSuperDevice(target()), builder.get(), target()));
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_FALSE(failed);
+}
+
 TEST_P(DynamicPartitionControlAndroidTestP, OptimizeOperationTest) {
   ASSERT_TRUE(dynamicControl().PreparePartitionsForUpdate(
       source(),
@@ -1057,6 +1162,29 @@ TEST_P(SnapshotPartitionTestP, PreparePartitions) {
   EXPECT_EQ(0u, required_size);
 }
 
+// Test that with snapshot compression, the COW writers of all the partitions
+// are opened while preparing them.
+TEST_P(SnapshotPartitionTestP, PreparePartitionsOpensCowWriters) {
+  ExpectCreateUpdateSnapshots(android::snapshot::Return::Ok());
+  SetMetadata(source(), {});
+  EXPECT_CALL(*snapshot_, UpdateUsesCompression())
+      .WillRepeatedly(Return(true));
+  std::mutex mutex;
+  std::set<string> opened;
+  EXPECT_CALL(*snapshot_, OpenSnapshotWriter(_, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(
+          [&](const auto& params, const auto& source_device)
+              -> std::unique_ptr<android::snapshot::ISnapshotWriter> {
+            std::lock_guard<std::mutex> lock(mutex);
+            opened.insert(params.partition_name);
+            EXPECT_FALSE(source_device.has_value());
+            return nullptr;
+          }));
+  EXPECT_TRUE(PreparePartitionsForUpdate(nullptr));
+  EXPECT_EQ(std::set<string>({T("system"), T("vendor")}), opened);
+}
+
 // Test that if not enough space, required size returned by SnapshotManager is
 // passed up.
 TEST_P(SnapshotPartitionTestP, PreparePartitionsNoSpace) {
@@ -0,0 +1,254 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Replays the I/O trace of an install, recorded with the IO_TRACE header, on
+// the storage of the host or of another device, to compare how the storage
+// handles the access pattern of the update.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <gflags/gflags.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/io_trace.h"
+
+DEFINE_string(files,
+              "",
+              "Comma separated <index>=<path> of the files to replay the I/O "
+              "of the trace on, the recorded paths are used for the others");
+DEFINE_bool(writes,
+            false,
+            "Replay the writes and flushes, writing zeros over the files. "
+            "Only the reads are replayed otherwise");
+DEFINE_string(timing,
+              "original",
+              "\"original\" to start the I/O at the recorded times, \"asap\" "
+              "to issue each I/O as soon as the previous one of its thread "
+              "is done");
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Statistics of the replayed I/O of one kind.
+struct ReplayStats {
+  uint64_t count{0};
+  uint64_t bytes{0};
+  std::vector<uint64_t> latencies_us;
+
+  void Add(const ReplayStats& other) {
+    count += other.count;
+    bytes += other.bytes;
+    latencies_us.insert(latencies_us.end(),
+                        other.latencies_us.begin(),
+                        other.latencies_us.end());
+  }
+};
+
+uint64_t Percentile(const std::vector<uint64_t>& sorted, double percentile) {
+  if (sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1,
+                         static_cast<size_t>(sorted.size() * percentile))];
+}
+
+void PrintStats(const char* name, ReplayStats* stats, double seconds) {
+  std::sort(stats->latencies_us.begin(), stats->latencies_us.end());
+  printf("%s: %" PRIu64 " ops, %" PRIu64
+         " bytes, %.1f MiB/s, latency p50 %" PRIu64 " us, p99 %" PRIu64
+         " us, max %" PRIu64 " us\n",
+         name,
+         stats->count,
+         stats->bytes,
+         stats->bytes / (1024.0 * 1024.0) / std::max(seconds, 1e-6),
+         Percentile(stats->latencies_us, 0.5),
+         Percentile(stats->latencies_us, 0.99),
+         Percentile(stats->latencies_us, 1));
+}
+
+// Replays |entries| of one thread of the trace on |fds|, from |start|.
+void ReplayThread(const std::vector<const IoTraceEntry*>& entries,
+                  const std::vector<android::base::unique_fd>& fds,
+                  std::chrono::steady_clock::time_point start,
+                  bool original_timing,
+                  ReplayStats* reads,
+                  ReplayStats* writes) {
+  std::vector<char> buffer;
+  for (const IoTraceEntry* entry : entries) {
+    const bool is_write = entry->op == IoTraceEntry::Op::kWrite ||
+                          entry->op == IoTraceEntry::Op::kFlush;
+    if (entry->op == IoTraceEntry::Op::kIoctl || (is_write && !FLAGS_writes))
+      continue;
+    if (original_timing)
+      std::this_thread::sleep_until(
+          start + std::chrono::microseconds(entry->start_us));
+    if (buffer.size() < entry->length)
+      buffer.resize(entry->length);
+    const int fd = fds[entry->file].get();
+    const auto io_start = std::chrono::steady_clock::now();
+    bool success = true;
+    switch (entry->op) {
+      case IoTraceEntry::Op::kRead: {
+        ssize_t bytes_read = 0;
+        success = utils::PReadAll(
+            fd, buffer.data(), entry->length, entry->offset, &bytes_read);
+        break;
+      }
+      case IoTraceEntry::Op::kWrite:
+        success = utils::PWriteAll(
+            fd, buffer.data(), entry->length, entry->offset);
+        break;
+      case IoTraceEntry::Op::kFlush:
+        success = fsync(fd) == 0;
+        break;
+      case IoTraceEntry::Op::kIoctl:
+        break;
+    }
+    if (!success) {
+      PLOG(WARNING) << "Failed to replay the I/O of " << entry->length
+                    << " bytes at " << entry->offset << " of file "
+                    << entry->file;
+      continue;
+    }
+    ReplayStats* stats =
+        entry->op == IoTraceEntry::Op::kRead ? reads : writes;
+    stats->count++;
+    stats->bytes += entry->length;
+    stats->latencies_us.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - io_start)
+            .count());
+  }
+}
+
+int Replay(const char* trace_path) {
+  std::string contents;
+  IoTrace trace;
+  if (!android::base::ReadFileToString(trace_path, &contents) ||
+      !ParseIoTrace(contents, &trace)) {
+    LOG(ERROR) << "Failed to read the I/O trace " << trace_path;
+    return 1;
+  }
+  if (FLAGS_timing != "original" && FLAGS_timing != "asap") {
+    LOG(ERROR) << "Invalid --timing: " << FLAGS_timing;
+    return 1;
+  }
+  for (const auto& file : android::base::Split(FLAGS_files, ",")) {
+    if (file.empty())
+      continue;
+    const auto parts = android::base::Split(file, "=");
+    unsigned index = 0;
+    if (parts.size() != 2 || !base::StringToUint(parts[0], &index) ||
+        index >= trace.files.size()) {
+      LOG(ERROR) << "Invalid --files entry: " << file;
+      return 1;
+    }
+    trace.files[index] = parts[1];
+  }
+
+  std::vector<android::base::unique_fd> fds;
+  for (const auto& path : trace.files) {
+    fds.emplace_back(
+        open(path.c_str(), (FLAGS_writes ? O_RDWR : O_RDONLY) | O_CLOEXEC));
+    if (!fds.back().ok())
+      PLOG(WARNING) << "Failed to open " << path << ", skipping its I/O";
+  }
+
+  // The I/O of each recorded thread is replayed on a thread of its own, in
+  // the order it was issued.
+  std::map<uint32_t, std::vector<const IoTraceEntry*>> threads;
+  for (const auto& entry : trace.entries) {
+    if (fds[entry.file].ok())
+      threads[entry.thread].push_back(&entry);
+  }
+  for (auto& [thread, entries] : threads) {
+    std::stable_sort(entries.begin(),
+                     entries.end(),
+                     [](const IoTraceEntry* a, const IoTraceEntry* b) {
+                       return a->start_us < b->start_us;
+                     });
+  }
+
+  std::vector<ReplayStats> reads(threads.size());
+  std::vector<ReplayStats> writes(threads.size());
+  std::vector<std::thread> replay_threads;
+  const auto start = std::chrono::steady_clock::now();
+  size_t i = 0;
+  for (const auto& [thread, entries] : threads) {
+    replay_threads.emplace_back(ReplayThread,
+                                std::cref(entries),
+                                std::cref(fds),
+                                start,
+                                FLAGS_timing == "original",
+                                &reads[i],
+                                &writes[i]);
+    i++;
+  }
+  for (auto& thread : replay_threads)
+    thread.join();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  ReplayStats total_reads;
+  ReplayStats total_writes;
+  for (i = 0; i < threads.size(); i++) {
+    total_reads.Add(reads[i]);
+    total_writes.Add(writes[i]);
+  }
+  uint64_t recorded_us = 0;
+  for (const auto& entry : trace.entries)
+    recorded_us = std::max(recorded_us, entry.start_us + entry.latency_us);
+  printf("Replayed %zu entries of %zu threads in %.3f s, recorded in %.3f s\n",
+         trace.entries.size(),
+         threads.size(),
+         seconds,
+         recorded_us / 1e6);
+  PrintStats("reads", &total_reads, seconds);
+  if (FLAGS_writes)
+    PrintStats("writes", &total_writes, seconds);
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage(
+      "A tool to replay the I/O trace of an update install");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 2) {
+    printf("Usage: %s <io_trace>\n", argv[0]);
+    return -1;
+  }
+  return chromeos_update_engine::Replay(argv[1]);
+}
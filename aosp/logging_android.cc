@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <functional>
 #include <iomanip>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -32,11 +33,13 @@
 #include <android-base/unique_fd.h>
 #include <base/files/dir_reader_posix.h>
 #include <base/logging.h>
+#include <base/macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <log/log.h>
 
 #include "android/log.h"
+#include "update_engine/aosp/async_log_writer.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -52,6 +55,9 @@ namespace {
 
 constexpr char kSystemLogsRoot[] = "/data/misc/update_engine_log";
 constexpr size_t kLogCount = 5;
+// Above this many bytes of messages waiting to be written to the log file,
+// the threads logging wait for the writer.
+constexpr size_t kMaxPendingLogBytes = 1024 * 1024;
 
 // Keep the most recent |kLogCount| logs but remove the old ones in
 // "/data/misc/update_engine_log/".
@@ -119,49 +125,44 @@ const char* LogPriorityToCString(int priority) {
 
 using LoggerFunction = std::function<void(const struct __android_log_message*)>;
 
+// Writes the log messages to a file through an AsyncLogWriter. Errors are on
+// disk before the thread logging them goes on, in case the process dies next.
 class FileLogger {
  public:
-  explicit FileLogger(const string& path) {
-    fd_.reset(TEMP_FAILURE_RETRY(
+  explicit FileLogger(const string& path)
+      : writer_(OpenLogFile(path), kMaxPendingLogBytes) {}
+  void operator()(const struct __android_log_message* log_message) {
+    std::string_view message_str =
+        log_message->message != nullptr ? log_message->message : "";
+    string line = GetPrefix(log_message);
+    line.append(message_str.data(), message_str.size());
+    line += '\n';
+    writer_.Write(line, log_message->priority >= ANDROID_LOG_ERROR);
+  }
+
+ private:
+  AsyncLogWriter writer_;
+
+  static android::base::unique_fd OpenLogFile(const string& path) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(path.c_str(),
              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW | O_SYNC,
              0644)));
-    if (fd_ == -1) {
+    if (fd == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot open persistent log %s: %s", path.c_str(), strerror(errno));
-      return;
+      return fd;
     }
     // The log file will have AID_LOG as group ID; this GID is inherited from
     // the parent directory "/data/misc/update_engine_log" which sets the SGID
     // bit.
-    if (fchmod(fd_.get(), 0640) == -1) {
+    if (fchmod(fd.get(), 0640) == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot chmod 0640 persistent log %s: %s",
             path.c_str(),
             strerror(errno));
-      return;
-    }
-  }
-  // Copy-constructor needed to be converted to std::function.
-  FileLogger(const FileLogger& other) { fd_.reset(dup(other.fd_)); }
-  void operator()(const struct __android_log_message* log_message) {
-    if (fd_ == -1) {
-      return;
     }
-
-    std::string_view message_str =
-        log_message->message != nullptr ? log_message->message : "";
-
-    WriteToFd(GetPrefix(log_message));
-    WriteToFd(message_str);
-    WriteToFd("\n");
-  }
-
- private:
-  android::base::unique_fd fd_;
-  void WriteToFd(std::string_view message) {
-    ignore_result(
-        android::base::WriteFully(fd_, message.data(), message.size()));
+    return fd;
   }
 
   string GetPrefix(const struct __android_log_message* log_message) {
@@ -187,6 +188,8 @@ class FileLogger {
     }
     return ss.str();
   }
+
+  DISALLOW_COPY_AND_ASSIGN(FileLogger);
 };
 
 class CombinedLogger {
@@ -202,7 +205,12 @@ class CombinedLogger {
       }
     }
     if (log_to_file) {
-      loggers_.push_back(std::move(FileLogger(SetupLogFile(kSystemLogsRoot))));
+      auto file_logger =
+          std::make_shared<FileLogger>(SetupLogFile(kSystemLogsRoot));
+      loggers_.push_back(
+          [file_logger](const struct __android_log_message* log_message) {
+            (*file_logger)(log_message);
+          });
     }
   }
   void operator()(const struct __android_log_message* log_message) {
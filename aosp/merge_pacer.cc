@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/merge_pacer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr uint64_t kMergeBlockSize = 4096;
+}  // namespace
+
+base::TimeDelta MergePacer::RecordInterval(base::TimeDelta elapsed,
+                                           double percentage,
+                                           base::TimeDelta blocked,
+                                           const PressureStall* pressure) {
+  // The first call only establishes where the merge started from.
+  const double merged =
+      last_percentage_ < 0 ? 0 : std::max(0.0, percentage - last_percentage_);
+  last_percentage_ = percentage;
+
+  num_intervals_++;
+  total_elapsed_ += elapsed;
+  total_blocked_ += blocked;
+  merged_percentage_ += merged;
+
+  const double merged_bytes = merged / 100 * total_bytes_;
+  double bytes_per_second = 0;
+  if (elapsed > base::TimeDelta()) {
+    bytes_per_second = merged_bytes / elapsed.InSecondsF();
+    peak_bytes_per_second_ = std::max(peak_bytes_per_second_, bytes_per_second);
+  }
+
+  if (pressure != nullptr) {
+    max_some_pressure_ = std::max(max_some_pressure_, pressure->some_avg10);
+    max_full_pressure_ = std::max(max_full_pressure_, pressure->full_avg10);
+  }
+
+  // Back off exponentially while foreground I/O competes with the merge, and
+  // poll more often when the device is idle so that completion is noticed
+  // early. Without pressure information, stay at the default interval.
+  if (pressure == nullptr) {
+    next_interval_ = kDefaultInterval;
+  } else if (pressure->some_avg10 >= kBusyPressure) {
+    num_busy_intervals_++;
+    next_interval_ = std::min(next_interval_ * 2, kMaxInterval);
+  } else if (pressure->some_avg10 < kIdlePressure) {
+    next_interval_ = std::max(next_interval_ / 2, kMinInterval);
+  } else {
+    next_interval_ = kDefaultInterval;
+  }
+
+  VLOG(1) << "Merge interval " << num_intervals_ << ": "
+          << elapsed.InMilliseconds() << "ms, " << merged << "% merged ("
+          << static_cast<uint64_t>(bytes_per_second / kMergeBlockSize)
+          << " blocks/s, " << static_cast<uint64_t>(bytes_per_second)
+          << " bytes/s), blocked " << blocked.InMilliseconds()
+          << "ms, I/O pressure "
+          << (pressure ? base::NumberToString(pressure->some_avg10) : "n/a")
+          << ", next poll in " << next_interval_.InMilliseconds() << "ms.";
+  return next_interval_;
+}
+
+bool MergePacer::ShouldDeferMerge(const PressureStall* pressure,
+                                  base::TimeDelta deferred) const {
+  return pressure != nullptr && pressure->some_avg10 >= kBusyPressure &&
+         deferred < kMaxMergeDeferral;
+}
+
+void MergePacer::LogSummary() const {
+  if (num_intervals_ == 0)
+    return;
+  double average_bytes_per_second = 0;
+  if (total_elapsed_ > base::TimeDelta()) {
+    average_bytes_per_second = merged_percentage_ / 100 * total_bytes_ /
+                               total_elapsed_.InSecondsF();
+  }
+  LOG(INFO) << "Merge pacing: " << num_intervals_ << " intervals over "
+            << total_elapsed_.InSeconds() << "s, " << num_busy_intervals_
+            << " under I/O pressure; average "
+            << static_cast<uint64_t>(average_bytes_per_second) << " bytes/s, "
+            << "peak " << static_cast<uint64_t>(peak_bytes_per_second_)
+            << " bytes/s; blocked " << total_blocked_.InMilliseconds()
+            << "ms; max I/O pressure some=" << max_some_pressure_
+            << " full=" << max_full_pressure_ << ".";
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_MERGE_PACER_H_
+#define UPDATE_ENGINE_AOSP_MERGE_PACER_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/pressure_stall.h"
+
+namespace chromeos_update_engine {
+
+// MergePacer tracks the throughput of a snapshot merge between two polls of
+// SnapshotManager::ProcessUpdateState and decides when the next poll should
+// happen. libsnapshot doesn't let update_engine throttle the merge itself, so
+// the pacing happens at the two points update_engine controls: when the merge
+// is initiated, which is deferred while the device is busy with foreground
+// I/O, and how often the merge is polled, which is backed off under pressure
+// and tightened when the device is idle.
+class MergePacer {
+ public:
+  // Merge is considered to compete with foreground I/O above this "some"
+  // pressure, and the device is idle below |kIdlePressure|.
+  static constexpr double kBusyPressure = 40.0;
+  static constexpr double kIdlePressure = 10.0;
+  static constexpr base::TimeDelta kMinInterval =
+      base::TimeDelta::FromSeconds(1);
+  static constexpr base::TimeDelta kDefaultInterval =
+      base::TimeDelta::FromSeconds(2);
+  static constexpr base::TimeDelta kMaxInterval =
+      base::TimeDelta::FromSeconds(30);
+  // Longest time the merge is held back because of I/O pressure.
+  static constexpr base::TimeDelta kMaxMergeDeferral =
+      base::TimeDelta::FromMinutes(10);
+
+  MergePacer() = default;
+
+  // Size of the COW images being merged, used to turn merge percentages into
+  // bytes. 0 if unknown.
+  void set_total_bytes(uint64_t total_bytes) { total_bytes_ = total_bytes; }
+
+  // Records a polling interval of length |elapsed| at the end of which the
+  // merge reached |percentage| (in [0, 100]), and during which update_engine
+  // was blocked in libsnapshot for |blocked|. |pressure| is null if not
+  // available. Returns the delay before the next poll.
+  base::TimeDelta RecordInterval(base::TimeDelta elapsed,
+                                 double percentage,
+                                 base::TimeDelta blocked,
+                                 const PressureStall* pressure);
+
+  // Returns whether the merge should not be initiated yet given the current
+  // |pressure| and the time it has already been deferred for.
+  bool ShouldDeferMerge(const PressureStall* pressure,
+                        base::TimeDelta deferred) const;
+
+  // Logs the throughput, blocked time and pressure seen during the merge.
+  void LogSummary() const;
+
+  base::TimeDelta next_interval() const { return next_interval_; }
+  size_t num_intervals() const { return num_intervals_; }
+  size_t num_busy_intervals() const { return num_busy_intervals_; }
+  base::TimeDelta total_blocked() const { return total_blocked_; }
+  // Highest throughput seen over a single interval, in bytes per second.
+  double peak_bytes_per_second() const { return peak_bytes_per_second_; }
+
+ private:
+  uint64_t total_bytes_{0};
+  base::TimeDelta next_interval_{kDefaultInterval};
+  // Percentage the last recorded interval ended at, negative before the
+  // first one.
+  double last_percentage_{-1};
+
+  size_t num_intervals_{0};
+  size_t num_busy_intervals_{0};
+  base::TimeDelta total_elapsed_;
+  base::TimeDelta total_blocked_;
+  double merged_percentage_{0};
+  double peak_bytes_per_second_{0};
+  double max_some_pressure_{0};
+  double max_full_pressure_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MergePacer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_MERGE_PACER_H_
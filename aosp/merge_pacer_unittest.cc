@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/merge_pacer.h"
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr auto kTwoSeconds = base::TimeDelta::FromSeconds(2);
+
+PressureStall MakePressure(double some) {
+  PressureStall pressure;
+  pressure.some_avg10 = some;
+  return pressure;
+}
+}  // namespace
+
+TEST(MergePacerTest, BacksOffUnderPressureTest) {
+  MergePacer pacer;
+  PressureStall busy = MakePressure(MergePacer::kBusyPressure);
+  auto interval = MergePacer::kDefaultInterval;
+  for (int i = 0; i < 10; i++) {
+    auto next = pacer.RecordInterval(kTwoSeconds, i, {}, &busy);
+    EXPECT_EQ(std::min(interval * 2, MergePacer::kMaxInterval), next);
+    interval = next;
+  }
+  EXPECT_EQ(MergePacer::kMaxInterval, pacer.next_interval());
+  EXPECT_EQ(10u, pacer.num_busy_intervals());
+
+  // Moderate pressure goes back to the default interval.
+  PressureStall moderate = MakePressure(MergePacer::kIdlePressure);
+  EXPECT_EQ(MergePacer::kDefaultInterval,
+            pacer.RecordInterval(kTwoSeconds, 11, {}, &moderate));
+  EXPECT_EQ(10u, pacer.num_busy_intervals());
+}
+
+TEST(MergePacerTest, SpeedsUpWhenIdleTest) {
+  MergePacer pacer;
+  PressureStall idle = MakePressure(0);
+  for (int i = 0; i < 5; i++) {
+    pacer.RecordInterval(kTwoSeconds, i, {}, &idle);
+  }
+  EXPECT_EQ(MergePacer::kMinInterval, pacer.next_interval());
+
+  // Without pressure information, the default interval is used.
+  EXPECT_EQ(MergePacer::kDefaultInterval,
+            pacer.RecordInterval(kTwoSeconds, 6, {}, nullptr));
+}
+
+TEST(MergePacerTest, ThroughputTest) {
+  MergePacer pacer;
+  pacer.set_total_bytes(1000000);
+  // The first interval only establishes the starting point.
+  pacer.RecordInterval({}, 10, base::TimeDelta::FromMilliseconds(5), nullptr);
+  EXPECT_EQ(0, pacer.peak_bytes_per_second());
+  // 10% of 1MB in 2s.
+  pacer.RecordInterval(
+      kTwoSeconds, 20, base::TimeDelta::FromMilliseconds(7), nullptr);
+  EXPECT_DOUBLE_EQ(50000, pacer.peak_bytes_per_second());
+  pacer.RecordInterval(kTwoSeconds, 22, {}, nullptr);
+  EXPECT_DOUBLE_EQ(50000, pacer.peak_bytes_per_second());
+  EXPECT_EQ(3u, pacer.num_intervals());
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(12), pacer.total_blocked());
+}
+
+TEST(MergePacerTest, ShouldDeferMergeTest) {
+  MergePacer pacer;
+  PressureStall busy = MakePressure(MergePacer::kBusyPressure + 1);
+  PressureStall idle = MakePressure(0);
+  EXPECT_TRUE(pacer.ShouldDeferMerge(&busy, {}));
+  EXPECT_FALSE(pacer.ShouldDeferMerge(&idle, {}));
+  EXPECT_FALSE(pacer.ShouldDeferMerge(nullptr, {}));
+  // The merge isn't deferred forever.
+  EXPECT_FALSE(pacer.ShouldDeferMerge(&busy, MergePacer::kMaxMergeDeferral));
+}
+
+}  // namespace chromeos_update_engine
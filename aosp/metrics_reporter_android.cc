@@ -20,8 +20,10 @@
 
 #include <algorithm>
 #include <any>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include <android-base/properties.h>
 #include <base/strings/string_util.h>
@@ -32,6 +34,7 @@
 #include <statslog_ue.h>
 
 #include "update_engine/common/constants.h"
+#include "update_engine/common/metrics_queue.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
 using android::fs_mgr::GetPartitionGroupName;
@@ -67,10 +70,65 @@ bool IsFECEnabled(const chromeos_update_engine::InstallPlan* install_plan) {
       [](const auto& partition) { return partition.fec_size > 0; });
 }
 
+// Reads the sizes of the super partition of the current slot from its
+// metadata. They are left at 0 without dynamic partitions or on errors.
+void ReadSuperPartitionSizes(int64_t* super_partition_size_bytes,
+                             int64_t* slot_size_bytes,
+                             int64_t* super_free_space) {
+  *super_partition_size_bytes = 0;
+  *slot_size_bytes = 0;
+  *super_free_space = 0;
+
+  if (!android::base::GetBoolProperty("ro.boot.dynamic_partitions", false))
+    return;
+  uint32_t slot = SlotNumberForSlotSuffix(fs_mgr_get_slot_suffix());
+  auto super_device = fs_mgr_get_super_partition_name();
+  std::unique_ptr<LpMetadata> metadata = ReadMetadata(super_device, slot);
+  if (!metadata) {
+    LOG(ERROR) << "Could not read dynamic partition metadata for device: "
+               << super_device;
+    return;
+  }
+  *super_partition_size_bytes = GetTotalSuperPartitionSize(*metadata);
+
+  for (const auto& group : metadata->groups) {
+    if (EndsWith(GetPartitionGroupName(group),
+                 fs_mgr_get_slot_suffix(),
+                 base::CompareCase::SENSITIVE)) {
+      *slot_size_bytes += group.maximum_size;
+    }
+  }
+
+  auto metadata_builder = MetadataBuilder::New(*metadata);
+  if (!metadata_builder) {
+    LOG(ERROR) << "Cannot create metadata builder.";
+    return;
+  }
+  auto free_regions = metadata_builder->GetFreeRegions();
+  for (const auto& interval : free_regions) {
+    *super_free_space += interval.length();
+  }
+  *super_free_space *= android::dm::kSectorSize;
+}
+
+void LogCounters(const std::map<std::string, int64_t>& counters) {
+  for (const auto& [name, value] : counters)
+    LOG(INFO) << "Metrics counter " << name << ": " << value;
+}
+
 }  // namespace
 
 namespace chromeos_update_engine {
 
+MetricsReporterAndroid::MetricsReporterAndroid(
+    DynamicPartitionControlInterface* dynamic_partition_control,
+    const InstallPlan* install_plan)
+    : dynamic_partition_control_(dynamic_partition_control),
+      install_plan_(install_plan),
+      queue_(std::make_unique<MetricsQueue>(LogCounters)) {}
+
+MetricsReporterAndroid::~MetricsReporterAndroid() = default;
+
 namespace metrics {
 
 std::unique_ptr<MetricsReporterInterface> CreateMetricsReporter(
@@ -90,47 +148,45 @@ void MetricsReporterAndroid::ReportUpdateAttemptMetrics(
     int64_t payload_size,
     metrics::AttemptResult attempt_result,
     ErrorCode error_code) {
-  int64_t payload_size_mib = payload_size / kNumBytesInOneMiB;
+  // The dynamic partition control and the super partition metadata are only
+  // read from the main loop, before the next attempt can rewrite super.
+  const bool vab_compression_used =
+      dynamic_partition_control_->UpdateUsesSnapshotCompression();
+  int64_t super_partition_size_bytes, slot_size_bytes, super_free_space;
+  ReadSuperPartitionSizes(
+      &super_partition_size_bytes, &slot_size_bytes, &super_free_space);
+  queue_->Push(MetricsQueue::Priority::kHigh, [=] {
+    WriteUpdateAttemptMetrics(attempt_number,
+                              payload_type,
+                              duration,
+                              duration_uptime,
+                              payload_size,
+                              attempt_result,
+                              error_code,
+                              super_partition_size_bytes,
+                              slot_size_bytes,
+                              super_free_space,
+                              vab_compression_used);
+  });
+}
 
-  int64_t super_partition_size_bytes = 0;
-  int64_t super_free_space = 0;
-  int64_t slot_size_bytes = 0;
-
-  if (android::base::GetBoolProperty("ro.boot.dynamic_partitions", false)) {
-    uint32_t slot = SlotNumberForSlotSuffix(fs_mgr_get_slot_suffix());
-    auto super_device = fs_mgr_get_super_partition_name();
-    std::unique_ptr<LpMetadata> metadata = ReadMetadata(super_device, slot);
-    if (metadata) {
-      super_partition_size_bytes = GetTotalSuperPartitionSize(*metadata);
-
-      for (const auto& group : metadata->groups) {
-        if (EndsWith(GetPartitionGroupName(group),
-                     fs_mgr_get_slot_suffix(),
-                     base::CompareCase::SENSITIVE)) {
-          slot_size_bytes += group.maximum_size;
-        }
-      }
-
-      auto metadata_builder = MetadataBuilder::New(*metadata);
-      if (metadata_builder) {
-        auto free_regions = metadata_builder->GetFreeRegions();
-        for (const auto& interval : free_regions) {
-          super_free_space += interval.length();
-        }
-        super_free_space *= android::dm::kSectorSize;
-      } else {
-        LOG(ERROR) << "Cannot create metadata builder.";
-      }
-    } else {
-      LOG(ERROR) << "Could not read dynamic partition metadata for device: "
-                 << super_device;
-    }
-  }
+// static
+void MetricsReporterAndroid::WriteUpdateAttemptMetrics(
+    int attempt_number,
+    PayloadType payload_type,
+    base::TimeDelta duration,
+    base::TimeDelta duration_uptime,
+    int64_t payload_size,
+    metrics::AttemptResult attempt_result,
+    ErrorCode error_code,
+    int64_t super_partition_size_bytes,
+    int64_t slot_size_bytes,
+    int64_t super_free_space,
+    bool vab_compression_used) {
+  int64_t payload_size_mib = payload_size / kNumBytesInOneMiB;
 
   bool vab_compression_enabled = android::base::GetBoolProperty(
       "ro.virtual_ab.compression.enabled", false);
-  bool vab_compression_used =
-      dynamic_partition_control_->UpdateUsesSnapshotCompression();
 
   statsd::stats_write(
       statsd::UPDATE_ENGINE_UPDATE_ATTEMPT_REPORTED,
@@ -156,8 +212,10 @@ void MetricsReporterAndroid::ReportUpdateAttemptDownloadMetrics(
     metrics::DownloadErrorCode /* payload_download_error_code */,
     metrics::ConnectionType /* connection_type */) {
   // TODO(xunchang) add statsd reporting
-  LOG(INFO) << "Current update attempt downloads "
-            << payload_bytes_downloaded / kNumBytesInOneMiB << " bytes data";
+  queue_->Push(MetricsQueue::Priority::kLow, [payload_bytes_downloaded] {
+    LOG(INFO) << "Current update attempt downloads "
+              << payload_bytes_downloaded / kNumBytesInOneMiB << " bytes data";
+  });
 }
 
 void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
@@ -177,16 +235,20 @@ void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
     total_bytes_downloaded += num_bytes_downloaded[i] / kNumBytesInOneMiB;
   }
 
-  statsd::stats_write(statsd::UPDATE_ENGINE_SUCCESSFUL_UPDATE_REPORTED,
-                      static_cast<int32_t>(attempt_count),
-                      GetStatsdEnumValue(static_cast<int32_t>(payload_type)),
-                      static_cast<int32_t>(payload_size_mib),
-                      static_cast<int32_t>(total_bytes_downloaded),
-                      static_cast<int32_t>(download_overhead_percentage),
-                      static_cast<int32_t>(total_duration.InMinutes()),
-                      static_cast<int32_t>(reboot_count),
-                      IsHashTreeEnabled(install_plan_),
-                      IsFECEnabled(install_plan_));
+  const bool hash_tree_enabled = IsHashTreeEnabled(install_plan_);
+  const bool fec_enabled = IsFECEnabled(install_plan_);
+  queue_->Push(MetricsQueue::Priority::kHigh, [=] {
+    statsd::stats_write(statsd::UPDATE_ENGINE_SUCCESSFUL_UPDATE_REPORTED,
+                        static_cast<int32_t>(attempt_count),
+                        GetStatsdEnumValue(static_cast<int32_t>(payload_type)),
+                        static_cast<int32_t>(payload_size_mib),
+                        static_cast<int32_t>(total_bytes_downloaded),
+                        static_cast<int32_t>(download_overhead_percentage),
+                        static_cast<int32_t>(total_duration.InMinutes()),
+                        static_cast<int32_t>(reboot_count),
+                        hash_tree_enabled,
+                        fec_enabled);
+  });
 }
 
 void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
@@ -196,4 +258,37 @@ void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   LOG(INFO) << "Abnormally terminated update attempt result " << attempt_result;
 }
 
+void MetricsReporterAndroid::ReportInstallOperationMetrics(
+    const InstallOperationStatsMap& stats) {
+  // There is no statsd atom for these yet, so they are only logged.
+  queue_->Push(MetricsQueue::Priority::kLow, [stats] {
+    LOG(INFO) << "Install operations applied during this update attempt:";
+    LogInstallOperationStats(stats);
+  });
+}
+
+void MetricsReporterAndroid::ReportDownloadMetrics(const DownloadStats& stats) {
+  // There is no statsd atom for these yet, so they are only logged.
+  queue_->Push(MetricsQueue::Priority::kLow, [stats] {
+    LOG(INFO) << "Payload download during this update attempt:";
+    LogDownloadStats(stats);
+  });
+}
+
+void MetricsReporterAndroid::ReportPhaseMetrics(const PhaseStatsMap& stats) {
+  // There is no statsd atom for these yet, so they are only logged.
+  queue_->Push(MetricsQueue::Priority::kLow, [stats] {
+    LOG(INFO) << "Time spent in each phase of this update attempt:";
+    LogPhaseStats(stats);
+  });
+}
+
+void MetricsReporterAndroid::ReportStatusNotificationMetrics(int num_sent,
+                                                             int num_dropped) {
+  // There is no statsd atom for these yet, so they are only logged, summed
+  // with the other counters.
+  queue_->AddToCounter("status_notifications_sent", num_sent);
+  queue_->AddToCounter("status_notifications_coalesced", num_dropped);
+}
+
 };  // namespace chromeos_update_engine
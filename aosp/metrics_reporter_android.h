@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_AOSP_METRICS_REPORTER_ANDROID_H_
 #define UPDATE_ENGINE_AOSP_METRICS_REPORTER_ANDROID_H_
 
+#include <memory>
 #include <string>
 
 #include "update_engine/common/error_code.h"
@@ -26,15 +27,17 @@
 
 namespace chromeos_update_engine {
 
+class MetricsQueue;
+
+// The reports are written to statsd and to the log on a background thread,
+// see MetricsQueue.
 class MetricsReporterAndroid : public MetricsReporterInterface {
  public:
   explicit MetricsReporterAndroid(
       DynamicPartitionControlInterface* dynamic_partition_control,
-      const InstallPlan* install_plan)
-      : dynamic_partition_control_(dynamic_partition_control),
-        install_plan_(install_plan) {}
+      const InstallPlan* install_plan);
 
-  ~MetricsReporterAndroid() override = default;
+  ~MetricsReporterAndroid() override;
 
   void ReportRollbackMetrics(metrics::RollbackResult result) override {}
 
@@ -95,9 +98,34 @@ class MetricsReporterAndroid : public MetricsReporterInterface {
   void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) override {}
 
+  void ReportInstallOperationMetrics(
+      const InstallOperationStatsMap& stats) override;
+
+  void ReportDownloadMetrics(const DownloadStats& stats) override;
+
+  void ReportPhaseMetrics(const PhaseStatsMap& stats) override;
+
+  void ReportStatusNotificationMetrics(int num_sent, int num_dropped) override;
+
  private:
+  // Writes the update attempt atom on the thread of |queue_|, with the super
+  // partition sizes read on the main loop when the attempt was reported.
+  static void WriteUpdateAttemptMetrics(int attempt_number,
+                                        PayloadType payload_type,
+                                        base::TimeDelta duration,
+                                        base::TimeDelta duration_uptime,
+                                        int64_t payload_size,
+                                        metrics::AttemptResult attempt_result,
+                                        ErrorCode error_code,
+                                        int64_t super_partition_size_bytes,
+                                        int64_t slot_size_bytes,
+                                        int64_t super_free_space,
+                                        bool vab_compression_used);
+
   DynamicPartitionControlInterface* dynamic_partition_control_{};
   const InstallPlan* install_plan_{};
+  // Destroyed first, running the pending reports.
+  std::unique_ptr<MetricsQueue> queue_;
 
   DISALLOW_COPY_AND_ASSIGN(MetricsReporterAndroid);
 };
@@ -42,6 +42,14 @@ class MockDynamicPartitionControlAndroid
       MapPartitionOnDeviceMapper,
       (const std::string&, const std::string&, uint32_t, bool, std::string*),
       (override));
+  MOCK_METHOD(bool,
+              MapPartitionsOnDeviceMapper,
+              (const std::string&,
+               const std::vector<std::string>&,
+               uint32_t,
+               bool,
+               (std::map<std::string, std::string>*)),
+              (override));
   MOCK_METHOD(bool,
               UnmapPartitionOnDeviceMapper,
               (const std::string&),
@@ -64,6 +72,10 @@ class MockDynamicPartitionControlAndroid
               LoadMetadataBuilder,
               (const std::string&, uint32_t, uint32_t),
               (override));
+  MOCK_METHOD(std::unique_ptr<::android::fs_mgr::LpMetadata>,
+              ReadMetadata,
+              (const std::string&, uint32_t),
+              (override));
   MOCK_METHOD(bool,
               StoreMetadata,
               (const std::string&, android::fs_mgr::MetadataBuilder*, uint32_t),
@@ -135,6 +147,19 @@ class MockDynamicPartitionControlAndroid
         source_slot, target_slot);
   }
 
+  std::unique_ptr<::android::fs_mgr::MetadataBuilder> RealLoadMetadataBuilder(
+      const std::string& super_device, uint32_t slot) {
+    return DynamicPartitionControlAndroid::LoadMetadataBuilder(super_device,
+                                                               slot);
+  }
+
+  bool RealStoreMetadata(const std::string& super_device,
+                         android::fs_mgr::MetadataBuilder* builder,
+                         uint32_t target_slot) {
+    return DynamicPartitionControlAndroid::StoreMetadata(
+        super_device, builder, target_slot);
+  }
+
   std::optional<bool> RealIsAvbEnabledInFstab(const std::string& path) {
     return DynamicPartitionControlAndroid::IsAvbEnabledInFstab(path);
   }
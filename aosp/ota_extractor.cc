@@ -14,11 +14,17 @@
 // limitations under the License.
 //
 
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <iterator>
 #include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -30,16 +36,22 @@
 #include <unistd.h>
 #include <xz.h>
 
+#include "update_engine/aosp/ota_payload_source.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
 #include "update_engine/update_metadata.pb.h"
 
-DEFINE_string(payload, "", "Path to payload.bin");
+DEFINE_string(payload,
+              "",
+              "Path to payload.bin, or to the OTA package holding it. May be "
+              "an http:// or https:// URL, only the parts of the payload "
+              "needed are then downloaded");
 DEFINE_string(
     input_dir,
     "",
@@ -47,12 +59,18 @@ DEFINE_string(
 DEFINE_string(output_dir, "", "Directory to put output images");
 DEFINE_int64(payload_offset,
              0,
-             "Offset to start of payload.bin. Useful if payload path actually "
-             "points to a .zip file containing payload.bin");
+             "Offset to start of payload.bin. Found in the central directory "
+             "when the payload path points to a .zip file containing "
+             "payload.bin");
 DEFINE_string(partitions,
               "",
               "Comma separated list of partitions to extract, leave empty for "
               "extracting all partitions");
+DEFINE_int32(threads,
+             1,
+             "Number of threads applying the operations. The operations of a "
+             "partition are applied concurrently, and the threads move on to "
+             "the next partitions while the images are completed.");
 
 using chromeos_update_engine::DeltaArchiveManifest;
 using chromeos_update_engine::PayloadMetadata;
@@ -62,8 +80,9 @@ namespace chromeos_update_engine {
 void WriteVerity(const PartitionUpdate& partition,
                  FileDescriptorPtr fd,
                  const size_t block_size) {
-  // 512KB buffer, arbitrary value. Larger buffers may improve performance.
-  static constexpr size_t BUFFER_SIZE = 1024 * 512;
+  // The data is hashed straight from the page cache when the image can be
+  // memory mapped, and read into a buffer of this size otherwise.
+  static constexpr size_t BUFFER_SIZE = 16 * 1024 * 1024;
   if (partition.hash_tree_extent().num_blocks() == 0 &&
       partition.fec_extent().num_blocks() == 0) {
     return;
@@ -73,42 +92,212 @@ void WriteVerity(const PartitionUpdate& partition,
   CHECK(install_part.ParseVerityConfig(partition));
   VerityWriterAndroid writer;
   CHECK(writer.Init(install_part));
-  std::array<uint8_t, BUFFER_SIZE> buffer;
   const auto data_size =
       install_part.hash_tree_data_offset + install_part.hash_tree_data_size;
-  size_t offset = 0;
-  while (offset < data_size) {
-    const auto bytes_to_read =
-        static_cast<ssize_t>(std::min(BUFFER_SIZE, data_size - offset));
-    ssize_t bytes_read;
-    CHECK(
-        utils::ReadAll(fd, buffer.data(), bytes_to_read, offset, &bytes_read));
-    CHECK_EQ(bytes_read, bytes_to_read)
-        << " Failed to read at offset " << offset << " "
-        << android::base::ErrnoNumberAsString(errno);
-    writer.Update(offset, buffer.data(), bytes_read);
-    offset += bytes_read;
+  // Accessing the mapping past the end of the file would fault.
+  void* mapped = MAP_FAILED;
+  if (data_size && utils::FileSize(fd->Fd()) >= static_cast<off_t>(data_size))
+    mapped = mmap(nullptr, data_size, PROT_READ, MAP_SHARED, fd->Fd(), 0);
+  if (mapped != MAP_FAILED) {
+    const auto* data = static_cast<const uint8_t*>(mapped);
+    if (madvise(mapped, data_size, MADV_SEQUENTIAL) != 0)
+      PLOG(WARNING) << "madvise(MADV_SEQUENTIAL) failed";
+    for (size_t offset = 0; offset < data_size; offset += BUFFER_SIZE) {
+      const size_t size = std::min(BUFFER_SIZE, data_size - offset);
+      CHECK(writer.Update(offset, data + offset, size));
+      // The hashed pages won't be needed again.
+      madvise(const_cast<uint8_t*>(data) + offset, size, MADV_DONTNEED);
+    }
+    munmap(mapped, data_size);
+  } else {
+    std::vector<uint8_t> buffer(BUFFER_SIZE);
+    size_t offset = 0;
+    while (offset < data_size) {
+      const auto bytes_to_read =
+          static_cast<ssize_t>(std::min(BUFFER_SIZE, data_size - offset));
+      ssize_t bytes_read;
+      CHECK(utils::ReadAll(
+          fd, buffer.data(), bytes_to_read, offset, &bytes_read));
+      CHECK_EQ(bytes_read, bytes_to_read)
+          << " Failed to read at offset " << offset << " "
+          << android::base::ErrnoNumberAsString(errno);
+      CHECK(writer.Update(offset, buffer.data(), bytes_read));
+      offset += bytes_read;
+    }
   }
   CHECK(writer.Finalize(fd.get(), fd.get()));
   return;
 }
 
+// A partition being extracted.
+struct PartitionExtraction {
+  const PartitionUpdate* partition;
+  std::string output_path;
+  // The source image, for incremental OTAs.
+  std::string input_path;
+  // The operations of the partition not applied yet. The one applying the
+  // last operation completes the image.
+  std::atomic<size_t> remaining_ops;
+};
+
+// What the threads extracting the images share.
+struct ExtractionContext {
+  const DeltaArchiveManifest* manifest;
+  PayloadSource* source;
+  // Offset of the operations' data in |source|.
+  uint64_t data_begin;
+  std::vector<std::unique_ptr<PartitionExtraction>> partitions;
+  // The index of the partition in |partitions| and of the operation in the
+  // partition of all the operations to apply, in payload order. The
+  // operations of a partition write distinct blocks, so they can be applied
+  // in any order.
+  std::vector<std::pair<size_t, int>> operations;
+  // The next one of |operations| to apply.
+  std::atomic<size_t> next_operation{0};
+  // Set once a thread fails, for the others to stop.
+  std::atomic<bool> failed{false};
+};
+
+bool ApplyOperation(const ExtractionContext& context,
+                    const InstallOperation& op,
+                    InstallOperationExecutor* executor,
+                    FileDescriptorPtr out_fd,
+                    FileDescriptorPtr in_fd) {
+  const auto block_size = context.manifest->block_size();
+  if (op.has_src_sha256_hash()) {
+    brillo::Blob actual_hash;
+    TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+        in_fd, op.src_extents(), block_size, &actual_hash));
+    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+             HexEncode(op.src_sha256_hash()));
+  }
+
+  // The data is used straight from the memory mapped payload, or downloaded
+  // for this operation only.
+  const auto op_data_offset = context.data_begin + op.data_offset();
+  const size_t data_size = op.data_length();
+  brillo::Blob buffer;
+  const unsigned char* data = nullptr;
+  if (data_size) {
+    data = context.source->Read(op_data_offset, data_size, &buffer);
+    TEST_AND_RETURN_FALSE(data);
+  }
+  if (op.has_data_sha256_hash()) {
+    brillo::Blob actual_hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBytes(data, data_size, &actual_hash));
+    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+             HexEncode(op.data_sha256_hash()));
+  }
+  auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
+  if (op.type() == InstallOperation::ZERO) {
+    TEST_AND_RETURN_FALSE(executor->ExecuteZeroOrDiscardOperation(
+        op, std::move(direct_writer)));
+  } else if (op.type() == InstallOperation::REPLACE ||
+             op.type() == InstallOperation::REPLACE_BZ ||
+             op.type() == InstallOperation::REPLACE_XZ ||
+             op.type() == InstallOperation::REPLACE_ZSTD) {
+    TEST_AND_RETURN_FALSE(executor->ExecuteReplaceOperation(
+        op, std::move(direct_writer), data, data_size));
+  } else if (op.type() == InstallOperation::SOURCE_COPY) {
+    CHECK(in_fd->IsOpen());
+    TEST_AND_RETURN_FALSE(executor->ExecuteSourceCopyOperation(
+        op, std::move(direct_writer), in_fd));
+  } else {
+    CHECK(in_fd->IsOpen());
+    TEST_AND_RETURN_FALSE(executor->ExecuteDiffOperation(
+        op, std::move(direct_writer), in_fd, data, data_size));
+  }
+  context.source->Done(op_data_offset, data_size);
+  return true;
+}
+
+// Computes the verity data of the extracted image, and checks its hash.
+bool CompleteImage(const PartitionExtraction& extraction,
+                   const size_t block_size) {
+  const PartitionUpdate& partition = *extraction.partition;
+  const auto& output_path = extraction.output_path;
+  auto out_fd =
+      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(out_fd->Open(output_path.c_str(), O_RDWR));
+  WriteVerity(partition, out_fd, block_size);
+  out_fd->Close();
+  int err =
+      truncate64(output_path.c_str(), partition.new_partition_info().size());
+  if (err) {
+    PLOG(ERROR) << "Failed to truncate " << output_path << " to "
+                << partition.new_partition_info().size();
+  }
+  brillo::Blob actual_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfFile(output_path, &actual_hash));
+  CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+           HexEncode(partition.new_partition_info().hash()))
+      << " Partition " << partition.partition_name()
+      << " hash mismatches. Either the source image or OTA package is "
+         "corrupted.";
+  LOG(INFO) << "Extracted partition " << partition.partition_name();
+  return true;
+}
+
+// Applies the next operations of |context| until there are none left, and
+// completes the images whose last operation it applied.
+bool ExtractOperations(ExtractionContext* context) {
+  const auto block_size = context->manifest->block_size();
+  InstallOperationExecutor executor(block_size);
+  // The file descriptors are opened by every thread, since the writes of the
+  // operations seek.
+  size_t current_partition = context->partitions.size();
+  FileDescriptorPtr out_fd;
+  FileDescriptorPtr in_fd;
+  while (!context->failed) {
+    const size_t i = context->next_operation++;
+    if (i >= context->operations.size())
+      return true;
+    const auto [partition_index, op_index] = context->operations[i];
+    auto& extraction = *context->partitions[partition_index];
+    const PartitionUpdate& partition = *extraction.partition;
+    if (partition_index != current_partition) {
+      TEST_AND_RETURN_FALSE(
+          executor.SetZstdDictionary(partition.zstd_dictionary()));
+      out_fd =
+          std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+      TEST_AND_RETURN_FALSE_ERRNO(
+          out_fd->Open(extraction.output_path.c_str(), O_RDWR));
+      in_fd =
+          std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+      if (!extraction.input_path.empty()) {
+        CHECK(in_fd->Open(extraction.input_path.c_str(), O_RDONLY))
+            << " failed to open " << extraction.input_path;
+      }
+      current_partition = partition_index;
+    }
+    TEST_AND_RETURN_FALSE(ApplyOperation(
+        *context, partition.operations(op_index), &executor, out_fd, in_fd));
+    if (--extraction.remaining_ops == 0) {
+      TEST_AND_RETURN_FALSE(CompleteImage(extraction, block_size));
+    }
+  }
+  return true;
+}
+
 bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
                           const PayloadMetadata& metadata,
-                          int payload_fd,
-                          size_t payload_offset,
+                          PayloadSource* source,
+                          uint64_t payload_offset,
                           std::string_view input_dir,
                           std::string_view output_dir,
-                          const std::set<std::string>& partitions) {
-  InstallOperationExecutor executor(manifest.block_size());
-  const size_t data_begin = metadata.GetMetadataSize() +
-                            metadata.GetMetadataSignatureSize() +
-                            payload_offset;
+                          const std::set<std::string>& partitions,
+                          size_t num_threads) {
+  ExtractionContext context;
+  context.manifest = &manifest;
+  context.source = source;
+  context.data_begin = metadata.GetMetadataSize() +
+                       metadata.GetMetadataSignatureSize() + payload_offset;
   const base::FilePath output_dir_path(
       base::StringPiece(output_dir.data(), output_dir.size()));
   const base::FilePath input_dir_path(
       base::StringPiece(input_dir.data(), input_dir.size()));
-  std::vector<unsigned char> blob;
   for (const auto& partition : manifest.partitions()) {
     if (!partitions.empty() &&
         partitions.count(partition.partition_name()) == 0) {
@@ -116,81 +305,46 @@ bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
     }
     LOG(INFO) << "Extracting partition " << partition.partition_name()
               << " size: " << partition.new_partition_info().size();
-    const auto output_path =
+    auto extraction = std::make_unique<PartitionExtraction>();
+    extraction->partition = &partition;
+    extraction->output_path =
         output_dir_path.Append(partition.partition_name() + ".img").value();
-    auto out_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+    extraction->remaining_ops = partition.operations_size();
+    EintrSafeFileDescriptor out_fd;
     TEST_AND_RETURN_FALSE_ERRNO(
-        out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT, 0644));
-    auto in_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+        out_fd.Open(extraction->output_path.c_str(), O_RDWR | O_CREAT, 0644));
+    out_fd.Close();
     if (partition.has_old_partition_info()) {
-      const auto input_path =
+      extraction->input_path =
           input_dir_path.Append(partition.partition_name() + ".img").value();
       LOG(INFO) << "Incremental OTA detected for partition "
                 << partition.partition_name() << " opening source image "
-                << input_path;
-      CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
-          << " failed to open " << input_path;
-    }
-
-    for (const auto& op : partition.operations()) {
-      if (op.has_src_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-            in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.src_sha256_hash()));
-      }
-
-      blob.resize(op.data_length());
-      const auto op_data_offset = data_begin + op.data_offset();
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          payload_fd, blob.data(), blob.size(), op_data_offset, &bytes_read));
-      if (op.has_data_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(
-            HashCalculator::RawHashOfData(blob, &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.data_sha256_hash()));
-      }
-      auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
-      if (op.type() == InstallOperation::ZERO) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
-            op, std::move(direct_writer)));
-      } else if (op.type() == InstallOperation::REPLACE ||
-                 op.type() == InstallOperation::REPLACE_BZ ||
-                 op.type() == InstallOperation::REPLACE_XZ) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
-            op, std::move(direct_writer), blob.data(), blob.size()));
-      } else if (op.type() == InstallOperation::SOURCE_COPY) {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
-            op, std::move(direct_writer), in_fd));
-      } else {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
-            op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
-      }
+                << extraction->input_path;
     }
-    WriteVerity(partition, out_fd, manifest.block_size());
-    int err =
-        truncate64(output_path.c_str(), partition.new_partition_info().size());
-    if (err) {
-      PLOG(ERROR) << "Failed to truncate " << output_path << " to "
-                  << partition.new_partition_info().size();
+    if (partition.operations_size() == 0) {
+      TEST_AND_RETURN_FALSE(
+          CompleteImage(*extraction, manifest.block_size()));
+      continue;
     }
-    brillo::Blob actual_hash;
-    TEST_AND_RETURN_FALSE(
-        HashCalculator::RawHashOfFile(output_path, &actual_hash));
-    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-             HexEncode(partition.new_partition_info().hash()))
-        << " Partition " << partition.partition_name()
-        << " hash mismatches. Either the source image or OTA package is "
-           "corrupted.";
+    for (int i = 0; i < partition.operations_size(); i++)
+      context.operations.emplace_back(context.partitions.size(), i);
+    context.partitions.push_back(std::move(extraction));
   }
-  return true;
+
+  if (num_threads <= 1)
+    return ExtractOperations(&context);
+  // The threads take the operations in order, so all of them work on the
+  // first partitions while the images of the previous ones are completed.
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back([&context] {
+      if (!ExtractOperations(&context))
+        context.failed = true;
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  return !context.failed;
 }
 
 }  // namespace chromeos_update_engine
@@ -209,6 +363,10 @@ bool IsIncrementalOTA(const DeltaArchiveManifest& manifest) {
 }  // namespace
 
 int main(int argc, char* argv[]) {
+  using chromeos_update_engine::HttpPayloadSource;
+  using chromeos_update_engine::MappedPayloadSource;
+  using chromeos_update_engine::PayloadSource;
+
   gflags::SetUsageMessage(
       "A tool to extract device images from Android OTA packages");
   gflags::ParseCommandLineFlags(&argc, &argv, true);
@@ -224,44 +382,65 @@ int main(int argc, char* argv[]) {
   if (!partitions.empty()) {
     LOG(INFO) << "Extracting " << android::base::Join(partitions, ", ");
   }
-  int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
-  if (payload_fd < 0) {
-    PLOG(ERROR) << "Failed to open payload file";
-    return 1;
-  }
-  chromeos_update_engine::ScopedFdCloser closer{&payload_fd};
-  auto payload_size = chromeos_update_engine::utils::FileSize(payload_fd);
-  if (payload_size <= 0) {
-    PLOG(ERROR)
-        << "Couldn't determine size of payload file, or payload file is empty";
-    return 1;
-  }
 
-  PayloadMetadata payload_metadata;
-  auto payload = static_cast<unsigned char*>(
-      mmap(nullptr, payload_size, PROT_READ, MAP_PRIVATE, payload_fd, 0));
+  std::unique_ptr<PayloadSource> source;
+  if (android::base::StartsWith(FLAGS_payload, "http://") ||
+      android::base::StartsWith(FLAGS_payload, "https://")) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    auto http_source = std::make_unique<HttpPayloadSource>(FLAGS_payload);
+    if (!http_source->Init()) {
+      return 1;
+    }
+    source = std::move(http_source);
+  } else {
+    auto mapped_source = std::make_unique<MappedPayloadSource>();
+    if (!mapped_source->Init(FLAGS_payload)) {
+      LOG(ERROR) << "Failed to map the payload file";
+      return 1;
+    }
+    source = std::move(mapped_source);
+  }
 
-  if (payload == MAP_FAILED) {
-    PLOG(ERROR) << "Failed to mmap() payload file";
+  uint64_t payload_offset = FLAGS_payload_offset;
+  if (payload_offset > source->size()) {
+    LOG(ERROR) << "--payload_offset is past the end of " << FLAGS_payload;
     return 1;
   }
+  uint64_t payload_size = source->size() - payload_offset;
+  if (payload_offset == 0 &&
+      chromeos_update_engine::IsZipFile(source.get())) {
+    if (!chromeos_update_engine::FindStoredZipEntry(
+            source.get(), "payload.bin", &payload_offset, &payload_size)) {
+      LOG(ERROR) << "Failed to find payload.bin in " << FLAGS_payload;
+      return 1;
+    }
+    LOG(INFO) << "Found payload.bin at offset " << payload_offset;
+  }
 
-  auto munmap_deleter = [payload_size](auto payload) {
-    munmap(payload, payload_size);
-  };
-  std::unique_ptr<unsigned char, decltype(munmap_deleter)> munmapper{
-      payload, munmap_deleter};
-  if (payload_metadata.ParsePayloadHeader(payload + FLAGS_payload_offset,
-                                          payload_size - FLAGS_payload_offset,
-                                          nullptr) !=
-      chromeos_update_engine::MetadataParseResult::kSuccess) {
+  PayloadMetadata payload_metadata;
+  brillo::Blob header_buffer;
+  const size_t header_size = std::min<uint64_t>(
+      payload_size, chromeos_update_engine::kMaxPayloadHeaderSize);
+  const unsigned char* header =
+      header_size ? source->Read(payload_offset, header_size, &header_buffer)
+                  : nullptr;
+  if (!header ||
+      payload_metadata.ParsePayloadHeader(header, header_size, nullptr) !=
+          chromeos_update_engine::MetadataParseResult::kSuccess) {
     LOG(ERROR) << "Payload header parse failed!";
     return 1;
   }
+  // Only the metadata is read, along with the data of the operations of the
+  // partitions extracted.
   DeltaArchiveManifest manifest;
-  if (!payload_metadata.GetManifest(payload + FLAGS_payload_offset,
-                                    payload_size - FLAGS_payload_offset,
-                                    &manifest)) {
+  const uint64_t metadata_size = payload_metadata.GetMetadataSize();
+  brillo::Blob metadata_buffer;
+  const unsigned char* metadata =
+      metadata_size <= payload_size
+          ? source->Read(payload_offset, metadata_size, &metadata_buffer)
+          : nullptr;
+  if (!metadata ||
+      !payload_metadata.GetManifest(metadata, metadata_size, &manifest)) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 1;
   }
@@ -272,9 +451,10 @@ int main(int argc, char* argv[]) {
   }
   return !ExtractImagesFromOTA(manifest,
                                payload_metadata,
-                               payload_fd,
-                               FLAGS_payload_offset,
+                               source.get(),
+                               payload_offset,
                                FLAGS_input_dir,
                                FLAGS_output_dir,
-                               partitions);
+                               partitions,
+                               std::max(FLAGS_threads, 1));
 }
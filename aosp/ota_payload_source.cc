@@ -0,0 +1,352 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/ota_payload_source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Signatures and sizes of the zip records, see the .ZIP File Format
+// Specification.
+constexpr uint32_t kLocalFileHeaderSignature = 0x04034b50;
+constexpr uint32_t kCentralDirectorySignature = 0x02014b50;
+constexpr uint32_t kEndOfCentralDirectorySignature = 0x06054b50;
+constexpr uint32_t kZip64EndOfCentralDirectorySignature = 0x06064b50;
+constexpr uint32_t kZip64LocatorSignature = 0x07064b50;
+constexpr size_t kLocalFileHeaderSize = 30;
+constexpr size_t kCentralDirectoryHeaderSize = 46;
+constexpr size_t kEndOfCentralDirectorySize = 22;
+constexpr size_t kZip64EndOfCentralDirectorySize = 56;
+constexpr size_t kZip64LocatorSize = 20;
+constexpr size_t kMaxCommentSize = 0xffff;
+constexpr uint16_t kZip64ExtraFieldId = 0x0001;
+constexpr uint16_t kStoredMethod = 0;
+
+uint64_t ReadLE(const uint8_t* data, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = size; i > 0; i--)
+    value = (value << 8) | data[i - 1];
+  return value;
+}
+
+// curl write callback appending the data received to a brillo::Blob.
+size_t AppendToBlob(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  auto* blob = static_cast<brillo::Blob*>(userdata);
+  blob->insert(blob->end(), ptr, ptr + size * nmemb);
+  return size * nmemb;
+}
+
+// Reads |count| bytes at |offset| of |source| into |blob|.
+bool ReadBlob(PayloadSource* source,
+              uint64_t offset,
+              size_t count,
+              brillo::Blob* blob) {
+  brillo::Blob buffer;
+  const uint8_t* data = source->Read(offset, count, &buffer);
+  TEST_AND_RETURN_FALSE(data);
+  blob->assign(data, data + count);
+  return true;
+}
+
+// Finds the offset and the number of entries of the central directory.
+bool FindCentralDirectory(PayloadSource* source,
+                          uint64_t* cd_offset,
+                          uint64_t* cd_size,
+                          uint64_t* num_entries) {
+  const uint64_t size = source->size();
+  TEST_AND_RETURN_FALSE(size >= kEndOfCentralDirectorySize);
+  const size_t tail_size = static_cast<size_t>(std::min<uint64_t>(
+      size, kEndOfCentralDirectorySize + kMaxCommentSize + kZip64LocatorSize));
+  const uint64_t tail_offset = size - tail_size;
+  brillo::Blob tail;
+  TEST_AND_RETURN_FALSE(ReadBlob(source, tail_offset, tail_size, &tail));
+  // The end of central directory record is followed by its comment only.
+  size_t eocd = tail_size - kEndOfCentralDirectorySize;
+  while (ReadLE(tail.data() + eocd, 4) != kEndOfCentralDirectorySignature ||
+         eocd + kEndOfCentralDirectorySize +
+                 ReadLE(tail.data() + eocd + 20, 2) !=
+             tail_size) {
+    if (eocd == 0) {
+      LOG(ERROR) << "End of central directory not found, not a zip file";
+      return false;
+    }
+    eocd--;
+  }
+  *num_entries = ReadLE(tail.data() + eocd + 10, 2);
+  *cd_size = ReadLE(tail.data() + eocd + 12, 4);
+  *cd_offset = ReadLE(tail.data() + eocd + 16, 4);
+
+  if (eocd >= kZip64LocatorSize &&
+      ReadLE(tail.data() + eocd - kZip64LocatorSize, 4) ==
+          kZip64LocatorSignature) {
+    const uint64_t zip64_eocd_offset =
+        ReadLE(tail.data() + eocd - kZip64LocatorSize + 8, 8);
+    brillo::Blob zip64_eocd;
+    TEST_AND_RETURN_FALSE(zip64_eocd_offset < size);
+    TEST_AND_RETURN_FALSE(ReadBlob(source,
+                                   zip64_eocd_offset,
+                                   kZip64EndOfCentralDirectorySize,
+                                   &zip64_eocd));
+    TEST_AND_RETURN_FALSE(ReadLE(zip64_eocd.data(), 4) ==
+                          kZip64EndOfCentralDirectorySignature);
+    *num_entries = ReadLE(zip64_eocd.data() + 32, 8);
+    *cd_size = ReadLE(zip64_eocd.data() + 40, 8);
+    *cd_offset = ReadLE(zip64_eocd.data() + 48, 8);
+  }
+  TEST_AND_RETURN_FALSE(*cd_offset <= size && *cd_size <= size - *cd_offset);
+  return true;
+}
+
+}  // namespace
+
+MappedPayloadSource::~MappedPayloadSource() {
+  if (data_)
+    munmap(data_, size_);
+}
+
+bool MappedPayloadSource::Init(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser closer(&fd);
+  const off_t size = utils::FileSize(fd);
+  if (size <= 0) {
+    LOG(ERROR) << "Couldn't determine the size of " << path
+               << ", or it's empty";
+    return false;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(data != MAP_FAILED);
+  data_ = static_cast<uint8_t*>(data);
+  size_ = size;
+  // The operations' data is mostly read in order, and only once.
+  if (madvise(data_, size_, MADV_SEQUENTIAL) != 0)
+    PLOG(WARNING) << "madvise(MADV_SEQUENTIAL) failed";
+  return true;
+}
+
+const uint8_t* MappedPayloadSource::Read(uint64_t offset,
+                                         size_t count,
+                                         brillo::Blob* buffer) {
+  if (offset > size_ || count > size_ - offset) {
+    LOG(ERROR) << "Reading " << count << " bytes at " << offset
+               << " past the end of the file";
+    return nullptr;
+  }
+  return data_ + offset;
+}
+
+void MappedPayloadSource::Done(uint64_t offset, size_t count) {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  const uint64_t begin = (offset + page_size - 1) / page_size * page_size;
+  const uint64_t end = (offset + count) / page_size * page_size;
+  if (end > begin)
+    madvise(data_ + begin, end - begin, MADV_DONTNEED);
+}
+
+HttpPayloadSource::~HttpPayloadSource() {
+  for (CURL* handle : idle_handles_)
+    curl_easy_cleanup(handle);
+}
+
+CURL* HttpPayloadSource::GetHandle() {
+  CURL* handle = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_handles_.empty()) {
+      handle = idle_handles_.back();
+      idle_handles_.pop_back();
+    }
+  }
+  if (handle) {
+    curl_easy_reset(handle);
+  } else {
+    handle = curl_easy_init();
+    CHECK(handle);
+  }
+  curl_easy_setopt(handle, CURLOPT_URL, url_.c_str());
+  curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+  return handle;
+}
+
+void HttpPayloadSource::ReturnHandle(CURL* handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_handles_.push_back(handle);
+}
+
+bool HttpPayloadSource::Init() {
+  CURL* handle = GetHandle();
+  curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+  const CURLcode result = curl_easy_perform(handle);
+  curl_off_t length = -1;
+  if (result == CURLE_OK) {
+    curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+  }
+  ReturnHandle(handle);
+  if (result != CURLE_OK) {
+    LOG(ERROR) << "Failed to get " << url_ << ": "
+               << curl_easy_strerror(result);
+    return false;
+  }
+  if (length <= 0) {
+    LOG(ERROR) << "Couldn't determine the size of " << url_;
+    return false;
+  }
+  size_ = length;
+  return true;
+}
+
+bool HttpPayloadSource::ReadOnce(CURL* handle,
+                                 uint64_t offset,
+                                 size_t count,
+                                 brillo::Blob* buffer) {
+  buffer->clear();
+  buffer->reserve(count);
+  const std::string range = base::StringPrintf(
+      "%" PRIu64 "-%" PRIu64, offset, offset + count - 1);
+  curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, AppendToBlob);
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, buffer);
+  const CURLcode result = curl_easy_perform(handle);
+  if (result != CURLE_OK) {
+    LOG(WARNING) << "Failed to get the range " << range << " of " << url_
+                 << ": " << curl_easy_strerror(result);
+    return false;
+  }
+  long response_code = 0;  // NOLINT(runtime/int) - curl needs a long.
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &response_code);
+  // A server ignoring the range sends the whole file.
+  if (response_code != 206 && !(offset == 0 && count == size_)) {
+    LOG(ERROR) << url_ << " doesn't support range requests, response code "
+               << response_code;
+    return false;
+  }
+  return buffer->size() == count;
+}
+
+const uint8_t* HttpPayloadSource::Read(uint64_t offset,
+                                       size_t count,
+                                       brillo::Blob* buffer) {
+  if (count == 0 || offset > size_ || count > size_ - offset) {
+    LOG(ERROR) << "Invalid range of " << count << " bytes at " << offset;
+    return nullptr;
+  }
+  CURL* handle = GetHandle();
+  bool success = false;
+  for (int attempt = 0; attempt <= kMaxRetries && !success; attempt++)
+    success = ReadOnce(handle, offset, count, buffer);
+  ReturnHandle(handle);
+  if (!success) {
+    LOG(ERROR) << "Failed to read " << count << " bytes at " << offset
+               << " of " << url_;
+    return nullptr;
+  }
+  return buffer->data();
+}
+
+bool IsZipFile(PayloadSource* source) {
+  brillo::Blob magic;
+  return source->size() >= 4 && ReadBlob(source, 0, 4, &magic) &&
+         ReadLE(magic.data(), 4) == kLocalFileHeaderSignature;
+}
+
+bool FindStoredZipEntry(PayloadSource* source,
+                        const std::string& name,
+                        uint64_t* offset,
+                        uint64_t* size) {
+  uint64_t cd_offset, cd_size, num_entries;
+  TEST_AND_RETURN_FALSE(
+      FindCentralDirectory(source, &cd_offset, &cd_size, &num_entries));
+  brillo::Blob cd;
+  TEST_AND_RETURN_FALSE(ReadBlob(source, cd_offset, cd_size, &cd));
+  size_t pos = 0;
+  for (uint64_t i = 0; i < num_entries; i++) {
+    TEST_AND_RETURN_FALSE(pos + kCentralDirectoryHeaderSize <= cd.size());
+    const uint8_t* header = cd.data() + pos;
+    TEST_AND_RETURN_FALSE(ReadLE(header, 4) == kCentralDirectorySignature);
+    const size_t name_size = ReadLE(header + 28, 2);
+    const size_t extra_size = ReadLE(header + 30, 2);
+    const size_t comment_size = ReadLE(header + 32, 2);
+    const size_t record_size =
+        kCentralDirectoryHeaderSize + name_size + extra_size + comment_size;
+    TEST_AND_RETURN_FALSE(pos + record_size <= cd.size());
+    pos += record_size;
+    const std::string entry_name(
+        header + kCentralDirectoryHeaderSize,
+        header + kCentralDirectoryHeaderSize + name_size);
+    if (entry_name != name)
+      continue;
+
+    if (ReadLE(header + 10, 2) != kStoredMethod) {
+      LOG(ERROR) << name << " is compressed in the zip file";
+      return false;
+    }
+    uint64_t compressed_size = ReadLE(header + 20, 4);
+    uint64_t uncompressed_size = ReadLE(header + 24, 4);
+    uint64_t local_header_offset = ReadLE(header + 42, 4);
+    // The zip64 extra field has the values that didn't fit, in this order.
+    const uint8_t* extra = header + kCentralDirectoryHeaderSize + name_size;
+    for (size_t extra_pos = 0; extra_pos + 4 <= extra_size;) {
+      const uint16_t id = ReadLE(extra + extra_pos, 2);
+      const size_t field_size = ReadLE(extra + extra_pos + 2, 2);
+      const uint8_t* field = extra + extra_pos + 4;
+      const uint8_t* field_end = field + field_size;
+      TEST_AND_RETURN_FALSE(extra_pos + 4 + field_size <= extra_size);
+      extra_pos += 4 + field_size;
+      if (id != kZip64ExtraFieldId)
+        continue;
+      for (uint64_t* value :
+           {&uncompressed_size, &compressed_size, &local_header_offset}) {
+        if (*value != 0xffffffff)
+          continue;
+        TEST_AND_RETURN_FALSE(field + 8 <= field_end);
+        *value = ReadLE(field, 8);
+        field += 8;
+      }
+    }
+    TEST_AND_RETURN_FALSE(compressed_size == uncompressed_size);
+
+    brillo::Blob local_header;
+    TEST_AND_RETURN_FALSE(ReadBlob(
+        source, local_header_offset, kLocalFileHeaderSize, &local_header));
+    TEST_AND_RETURN_FALSE(ReadLE(local_header.data(), 4) ==
+                          kLocalFileHeaderSignature);
+    *offset = local_header_offset + kLocalFileHeaderSize +
+              ReadLE(local_header.data() + 26, 2) +
+              ReadLE(local_header.data() + 28, 2);
+    *size = uncompressed_size;
+    TEST_AND_RETURN_FALSE(*offset <= source->size() &&
+                          *size <= source->size() - *offset);
+    return true;
+  }
+  LOG(ERROR) << name << " not found in the zip file";
+  return false;
+}
+
+}  // namespace chromeos_update_engine
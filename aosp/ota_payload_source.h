@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_OTA_PAYLOAD_SOURCE_H_
+#define UPDATE_ENGINE_AOSP_OTA_PAYLOAD_SOURCE_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <curl/curl.h>
+
+namespace chromeos_update_engine {
+
+// Random access to the bytes of an OTA payload, or of the OTA package holding
+// it, for ota_extractor. The sources may be read from several threads at once.
+class PayloadSource {
+ public:
+  virtual ~PayloadSource() = default;
+
+  // The number of bytes of the source.
+  virtual uint64_t size() const = 0;
+
+  // Returns the |count| bytes at |offset|, which are either stored in |buffer|
+  // or valid as long as the source. Returns nullptr on error.
+  virtual const uint8_t* Read(uint64_t offset,
+                              size_t count,
+                              brillo::Blob* buffer) = 0;
+
+  // Tells the source the |count| bytes at |offset| won't be read again.
+  virtual void Done(uint64_t offset, size_t count) {}
+
+ protected:
+  PayloadSource() = default;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(PayloadSource);
+};
+
+// A local file, memory mapped.
+class MappedPayloadSource : public PayloadSource {
+ public:
+  MappedPayloadSource() = default;
+  ~MappedPayloadSource() override;
+
+  bool Init(const std::string& path);
+
+  uint64_t size() const override { return size_; }
+  const uint8_t* Read(uint64_t offset,
+                      size_t count,
+                      brillo::Blob* buffer) override;
+  // Evicts the whole pages of the range from memory.
+  void Done(uint64_t offset, size_t count) override;
+
+ private:
+  uint8_t* data_{nullptr};
+  uint64_t size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedPayloadSource);
+};
+
+// A file on an HTTP(S) server supporting range requests. Only the ranges read
+// are downloaded. curl_global_init() must be called first.
+class HttpPayloadSource : public PayloadSource {
+ public:
+  explicit HttpPayloadSource(std::string url) : url_(std::move(url)) {}
+  ~HttpPayloadSource() override;
+
+  // Gets the size of the file.
+  bool Init();
+
+  uint64_t size() const override { return size_; }
+  const uint8_t* Read(uint64_t offset,
+                      size_t count,
+                      brillo::Blob* buffer) override;
+
+ private:
+  // Number of times a failed range request is sent again.
+  static constexpr int kMaxRetries = 3;
+
+  // Returns an idle handle, which keeps its connection to the server, or a new
+  // one.
+  CURL* GetHandle();
+  void ReturnHandle(CURL* handle);
+
+  bool ReadOnce(CURL* handle,
+                uint64_t offset,
+                size_t count,
+                brillo::Blob* buffer);
+
+  const std::string url_;
+  uint64_t size_{0};
+
+  std::mutex mutex_;
+  std::vector<CURL*> idle_handles_;
+
+  DISALLOW_COPY_AND_ASSIGN(HttpPayloadSource);
+};
+
+// Whether |source| starts like a zip file.
+bool IsZipFile(PayloadSource* source);
+
+// Finds the entry |name| of the zip file in |source| and stores the offset and
+// the size of its data. The entry must be stored uncompressed. Supports zip64.
+bool FindStoredZipEntry(PayloadSource* source,
+                        const std::string& name,
+                        uint64_t* offset,
+                        uint64_t* size);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_OTA_PAYLOAD_SOURCE_H_
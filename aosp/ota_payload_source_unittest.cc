@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/ota_payload_source.h"
+
+#include <stdio.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <ziparchive/zip_writer.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPayloadData[] = "CrAU payload data";
+
+// Writes a zip file with a compressed entry before and after a stored
+// payload.bin.
+void WriteZipFile(const string& path) {
+  FILE* file = fopen(path.c_str(), "wb");
+  ASSERT_NE(nullptr, file);
+  ZipWriter writer(file);
+  const string metadata(1000, 'm');
+  ASSERT_EQ(0, writer.StartEntry("META-INF/metadata", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(metadata.data(), metadata.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("payload.bin", ZipWriter::kAlign32));
+  ASSERT_EQ(0, writer.WriteBytes(kPayloadData, sizeof(kPayloadData)));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("care_map.pb", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(metadata.data(), metadata.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(file));
+}
+}  // namespace
+
+TEST(OtaPayloadSourceTest, FindStoredZipEntryTest) {
+  ScopedTempFile zip_file("ota_payload_source.XXXXXX");
+  WriteZipFile(zip_file.path());
+  MappedPayloadSource source;
+  ASSERT_TRUE(source.Init(zip_file.path()));
+  EXPECT_TRUE(IsZipFile(&source));
+
+  uint64_t offset = 0, size = 0;
+  ASSERT_TRUE(FindStoredZipEntry(&source, "payload.bin", &offset, &size));
+  EXPECT_EQ(0u, offset % 32);
+  ASSERT_EQ(sizeof(kPayloadData), size);
+  brillo::Blob buffer;
+  const uint8_t* data = source.Read(offset, size, &buffer);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ(string(kPayloadData, sizeof(kPayloadData)),
+            string(data, data + size));
+
+  // Compressed entries can't be read in place.
+  EXPECT_FALSE(
+      FindStoredZipEntry(&source, "META-INF/metadata", &offset, &size));
+  EXPECT_FALSE(FindStoredZipEntry(&source, "payload", &offset, &size));
+}
+
+TEST(OtaPayloadSourceTest, NotZipFileTest) {
+  ScopedTempFile payload_file("ota_payload_source.XXXXXX");
+  ASSERT_TRUE(utils::WriteFile(
+      payload_file.path().c_str(), kPayloadData, sizeof(kPayloadData)));
+  MappedPayloadSource source;
+  ASSERT_TRUE(source.Init(payload_file.path()));
+  EXPECT_FALSE(IsZipFile(&source));
+  uint64_t offset = 0, size = 0;
+  EXPECT_FALSE(FindStoredZipEntry(&source, "payload.bin", &offset, &size));
+
+  brillo::Blob buffer;
+  EXPECT_NE(nullptr, source.Read(0, sizeof(kPayloadData), &buffer));
+  EXPECT_EQ(nullptr, source.Read(1, sizeof(kPayloadData), &buffer));
+}
+
+}  // namespace chromeos_update_engine
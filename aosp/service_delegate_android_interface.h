@@ -39,6 +39,66 @@ class CleanupSuccessfulUpdateCallbackInterface {
   virtual void RegisterForDeathNotifications(base::Closure unbind) = 0;
 };
 
+// A snapshot of the progress of the ongoing or last update attempt, see
+// ServiceDelegateAndroidInterface::GetStatistics().
+struct UpdateStatistics {
+  // Time spent in an action, under its Type(), or in a phase timed within the
+  // actions, see phase_metrics.h.
+  struct Phase {
+    std::string name;
+    // Empty for the phases that aren't per partition.
+    std::string partition;
+    // Summed over the times it ran, including the ongoing run.
+    int64_t wall_time_ms{0};
+    bool running{false};
+  };
+  // Resources used by the install operations applied so far, either of one
+  // type or to one partition.
+  struct Operations {
+    // The operation type or the partition name.
+    std::string name;
+    uint64_t count{0};
+    uint64_t wall_time_ms{0};
+    // Bytes read from the source partition and written to the target one.
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+    // Bytes of payload data consumed.
+    uint64_t data_bytes{0};
+  };
+
+  // The UpdateStatus of the engine.
+  int32_t status{0};
+  std::vector<Phase> phases;
+  std::vector<Operations> operation_types;
+  std::vector<Operations> partitions;
+
+  // Bytes of payload downloaded by this attempt, and bytes of the payloads
+  // received so far out of the total, including the ones received by
+  // earlier attempts.
+  uint64_t bytes_downloaded{0};
+  uint64_t payload_bytes_received{0};
+  uint64_t payload_bytes_total{0};
+  // Bytes of the target partitions verified so far, out of the total.
+  uint64_t bytes_verified{0};
+  uint64_t bytes_to_verify{0};
+
+  // Throughputs in bytes per second over the time spent in the action doing
+  // the work so far, 0 until it started.
+  uint64_t download_rate{0};
+  uint64_t apply_rate{0};
+  uint64_t verify_rate{0};
+
+  // Payload bytes received and waiting to be applied with pipelined apply,
+  // and payload bytes of the install operations scheduled on the worker
+  // threads and not applied yet.
+  uint64_t pipelined_bytes{0};
+  uint64_t scheduled_operation_bytes{0};
+
+  // Estimated time remaining until the download or the verification in
+  // progress completes, -1 if unknown.
+  int64_t eta_ms{-1};
+};
+
 // This class defines the interface exposed by the Android version of the
 // daemon service. This interface only includes the method calls that such
 // daemon exposes. For asynchronous events initiated by a class implementing
@@ -131,6 +191,17 @@ class ServiceDelegateAndroidInterface {
 
   virtual bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) = 0;
 
+  // Measures the performance of the device and stores the tuning profile the
+  // next updates can opt in to. In case of error, returns false and sets
+  // |error| accordingly.
+  virtual bool Calibrate(brillo::ErrorPtr* error) = 0;
+
+  // Fills |stats| with the progress of the ongoing update attempt, or of the
+  // last one once it's done. In case of error, returns false and sets |error|
+  // accordingly.
+  virtual bool GetStatistics(UpdateStatistics* stats,
+                             brillo::ErrorPtr* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
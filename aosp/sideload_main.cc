@@ -16,11 +16,13 @@
 
 #include <xz.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include <base/command_line.h>
 #include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/asynchronous_signal_handler.h>
 #include <brillo/flag_helper.h>
@@ -30,6 +32,7 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 #include "update_engine/common/boot_control.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware.h"
 #include "update_engine/common/logging.h"
@@ -185,6 +188,10 @@ int main(int argc, char** argv) {
                 "",
                 "A list of key-value pairs, one element of the list per line.");
   DEFINE_int64(status_fd, -1, "A file descriptor to notify the update status.");
+  DEFINE_bool(pipelined_apply,
+              true,
+              "Apply the payload on a separate thread while it's read, unless "
+              "the headers set PIPELINED_APPLY already.");
 
   chromeos_update_engine::Terminator::Init();
   chromeos_update_engine::SetupLogging(true /* stderr */, false /* file */);
@@ -197,6 +204,20 @@ int main(int argc, char** argv) {
 
   vector<string> headers = base::SplitString(
       FLAGS_headers, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  // Nothing else competes for the CPU in recovery, reading the payload and
+  // applying it can always overlap.
+  const string pipelined_apply_key =
+      string(chromeos_update_engine::kPayloadPipelinedApply) + "=";
+  if (FLAGS_pipelined_apply &&
+      std::none_of(headers.begin(),
+                   headers.end(),
+                   [&pipelined_apply_key](const string& header) {
+                     return base::StartsWith(header,
+                                             pipelined_apply_key,
+                                             base::CompareCase::SENSITIVE);
+                   })) {
+    headers.push_back(pipelined_apply_key + "1");
+  }
 
   if (!chromeos_update_engine::ApplyUpdatePayload(
           FLAGS_payload, FLAGS_offset, FLAGS_size, headers, FLAGS_status_fd))
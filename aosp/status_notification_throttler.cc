@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/status_notification_throttler.h"
+
+#include <utility>
+
+#include <base/bind.h>
+#include <base/logging.h>
+
+using update_engine::UpdateEngineStatus;
+
+namespace chromeos_update_engine {
+
+StatusNotificationThrottler::StatusNotificationThrottler(
+    base::TimeDelta min_interval, SendCallback send)
+    : min_interval_(min_interval), send_(std::move(send)) {}
+
+void StatusNotificationThrottler::Notify(const UpdateEngineStatus& status) {
+  if (pending_) {
+    num_dropped_++;
+    pending_.reset();
+  }
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (last_status_ != status.status || now - last_send_time_ >= min_interval_) {
+    send_task_id_.Cancel();
+    Send(status);
+    return;
+  }
+  pending_ = status;
+  if (!send_task_id_.IsScheduled()) {
+    CHECK(send_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&StatusNotificationThrottler::SendPending,
+                       base::Unretained(this)),
+        last_send_time_ + min_interval_ - now));
+  }
+}
+
+void StatusNotificationThrottler::ResetCounts() {
+  num_sent_ = 0;
+  num_dropped_ = 0;
+}
+
+void StatusNotificationThrottler::Send(const UpdateEngineStatus& status) {
+  last_status_ = status.status;
+  last_send_time_ = base::TimeTicks::Now();
+  num_sent_++;
+  send_.Run(status);
+}
+
+void StatusNotificationThrottler::SendPending() {
+  if (!pending_)
+    return;
+  const UpdateEngineStatus status = *pending_;
+  pending_.reset();
+  Send(status);
+}
+
+}  // namespace chromeos_update_engine
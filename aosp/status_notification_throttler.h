@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_STATUS_NOTIFICATION_THROTTLER_H_
+#define UPDATE_ENGINE_AOSP_STATUS_NOTIFICATION_THROTTLER_H_
+
+#include <optional>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/client_library/include/update_engine/update_status.h"
+#include "update_engine/common/scoped_task_id.h"
+
+namespace chromeos_update_engine {
+
+// StatusNotificationThrottler coalesces the status notifications sent to the
+// service observers, so that each of their clients gets at most one progress
+// update per |min_interval|. A notification that changes the status is sent
+// right away and replaces any progress update held back. The last progress
+// update held back is sent once |min_interval| has passed since the previous
+// notification.
+class StatusNotificationThrottler {
+ public:
+  using SendCallback = base::RepeatingCallback<void(
+      const update_engine::UpdateEngineStatus& status)>;
+
+  StatusNotificationThrottler(base::TimeDelta min_interval, SendCallback send);
+  ~StatusNotificationThrottler() = default;
+
+  // Sends |status| through the send callback now or later, as described
+  // above.
+  void Notify(const update_engine::UpdateEngineStatus& status);
+
+  // The number of notifications sent, and of notifications replaced by a
+  // later one before being sent, since the last ResetCounts().
+  int num_sent() const { return num_sent_; }
+  int num_dropped() const { return num_dropped_; }
+  void ResetCounts();
+
+ private:
+  void Send(const update_engine::UpdateEngineStatus& status);
+  void SendPending();
+
+  const base::TimeDelta min_interval_;
+  SendCallback send_;
+
+  // The last notification sent. Unset until the first one.
+  std::optional<update_engine::UpdateStatus> last_status_;
+  base::TimeTicks last_send_time_;
+
+  // The progress update held back, sent by |send_task_id_|.
+  std::optional<update_engine::UpdateEngineStatus> pending_;
+  ScopedTaskId send_task_id_;
+
+  int num_sent_{0};
+  int num_dropped_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(StatusNotificationThrottler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_STATUS_NOTIFICATION_THROTTLER_H_
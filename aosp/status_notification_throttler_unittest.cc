@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/status_notification_throttler.h"
+
+#include <vector>
+
+#include <base/bind.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+using update_engine::UpdateEngineStatus;
+using update_engine::UpdateStatus;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr auto kInterval = base::TimeDelta::FromHours(1);
+
+void RecordStatus(std::vector<UpdateEngineStatus>* sent,
+                  const UpdateEngineStatus& status) {
+  sent->push_back(status);
+}
+
+UpdateEngineStatus MakeStatus(UpdateStatus status, double progress) {
+  UpdateEngineStatus update_engine_status{};
+  update_engine_status.status = status;
+  update_engine_status.progress = progress;
+  return update_engine_status;
+}
+}  // namespace
+
+class StatusNotificationThrottlerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  std::vector<UpdateEngineStatus> sent_;
+};
+
+TEST_F(StatusNotificationThrottlerTest, CoalescesProgressTest) {
+  StatusNotificationThrottler throttler(
+      kInterval, base::BindRepeating(&RecordStatus, &sent_));
+  throttler.Notify(MakeStatus(UpdateStatus::DOWNLOADING, 0.1));
+  throttler.Notify(MakeStatus(UpdateStatus::DOWNLOADING, 0.2));
+  throttler.Notify(MakeStatus(UpdateStatus::DOWNLOADING, 0.3));
+  ASSERT_EQ(1u, sent_.size());
+  EXPECT_DOUBLE_EQ(0.1, sent_[0].progress);
+
+  // Only the last progress update held back is sent, once the interval has
+  // passed.
+  EXPECT_TRUE(loop_.RunOnce(false));
+  ASSERT_EQ(2u, sent_.size());
+  EXPECT_DOUBLE_EQ(0.3, sent_[1].progress);
+  EXPECT_EQ(2, throttler.num_sent());
+  EXPECT_EQ(1, throttler.num_dropped());
+
+  throttler.ResetCounts();
+  EXPECT_EQ(0, throttler.num_sent());
+  EXPECT_EQ(0, throttler.num_dropped());
+}
+
+TEST_F(StatusNotificationThrottlerTest, StatusChangeSentRightAwayTest) {
+  StatusNotificationThrottler throttler(
+      kInterval, base::BindRepeating(&RecordStatus, &sent_));
+  throttler.Notify(MakeStatus(UpdateStatus::DOWNLOADING, 0.5));
+  throttler.Notify(MakeStatus(UpdateStatus::DOWNLOADING, 0.9));
+  throttler.Notify(MakeStatus(UpdateStatus::VERIFYING, 0.0));
+  ASSERT_EQ(2u, sent_.size());
+  EXPECT_EQ(UpdateStatus::VERIFYING, sent_[1].status);
+  EXPECT_EQ(1, throttler.num_dropped());
+
+  // The progress update replaced by the status change is not sent later.
+  EXPECT_FALSE(loop_.PendingTasks());
+}
+
+TEST_F(StatusNotificationThrottlerTest, NoIntervalTest) {
+  StatusNotificationThrottler throttler(
+      base::TimeDelta(), base::BindRepeating(&RecordStatus, &sent_));
+  for (int i = 0; i < 5; i++)
+    throttler.Notify(MakeStatus(UpdateStatus::VERIFYING, i / 5.0));
+  EXPECT_EQ(5u, sent_.size());
+  EXPECT_EQ(0, throttler.num_dropped());
+}
+
+}  // namespace chromeos_update_engine
@@ -16,7 +16,10 @@
 
 #include "update_engine/aosp/update_attempter_android.h"
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <limits>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -26,6 +29,8 @@
 #include <android-base/properties.h>
 #include <android-base/unique_fd.h>
 #include <base/bind.h>
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <brillo/data_encoding.h>
@@ -42,14 +47,21 @@
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_accounting.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector.h"
+#include "update_engine/common/phase_metrics.h"
+#include "update_engine/common/thread_placement.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/io_policy_file_descriptor.h"
+#include "update_engine/payload_consumer/io_trace.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
@@ -82,11 +94,52 @@ namespace {
 const double kBroadcastThresholdProgress = 0.01;  // 1%
 const int kBroadcastThresholdSeconds = 10;
 
+// Minimum interval between two progress notifications sent to the observers,
+// in milliseconds. Changes of the status are always sent right away.
+constexpr char kStatusUpdateIntervalProperty[] =
+    "ro.update_engine.status_update_interval_ms";
+constexpr uint64_t kDefaultStatusUpdateIntervalMs = 250;
+
+// Whether to adjust the task profiles of a background update to the load of
+// the device instead of keeping the OtaProfiles.
+constexpr char kAdaptiveThrottlingProperty[] =
+    "ro.update_engine.adaptive_throttling";
+
+// Applies |profiles| to all the threads of update_engine, so that the worker
+// threads already started follow the calling one. Returns whether they could
+// be applied to the calling thread, the others may exit meanwhile.
+bool SetUpdateEngineTaskProfiles(const std::vector<std::string>& profiles) {
+  if (!SetTaskProfiles(0, profiles))
+    return false;
+  base::FileEnumerator tasks(base::FilePath("/proc/self/task"),
+                             false,
+                             base::FileEnumerator::DIRECTORIES);
+  for (auto path = tasks.Next(); !path.empty(); path = tasks.Next()) {
+    int tid = 0;
+    if (base::StringToInt(path.BaseName().value(), &tid) && tid != gettid())
+      SetTaskProfiles(tid, profiles);
+  }
+  return true;
+}
+
 const char* const kErrorDomain = "update_engine";
 // TODO(deymo): Convert the different errors to a numeric value to report them
 // back on the service error.
 const char* const kGenericError = "generic_error";
 
+// The maximum number of connections of PARALLEL_DOWNLOAD.
+constexpr size_t kMaxParallelDownloads = 8;
+
+// Directory of the BLOB_CACHE_SIZE cache, in the non-volatile directory.
+constexpr char kBlobCacheDirectory[] = "blob_cache";
+
+// Prefix of the IO_TRACE files, followed by the time the update started.
+constexpr char kIoTracePrefix[] = "/data/misc/update_engine_log/io_trace.";
+
+// How long the result of an AllocateSpaceForPayload() that found too little
+// space is used for the next calls for the same payload.
+constexpr TimeDelta kInsufficientSpaceTimeout = TimeDelta::FromMinutes(5);
+
 // Log and set the error on the passed ErrorPtr.
 bool LogAndSetError(brillo::ErrorPtr* error,
                     const base::Location& location,
@@ -145,10 +198,17 @@ UpdateAttempterAndroid::UpdateAttempterAndroid(
       boot_control_(boot_control),
       hardware_(hardware),
       apex_handler_android_(std::move(apex_handler)),
+      notification_throttler_(
+          TimeDelta::FromMilliseconds(android::base::GetUintProperty<uint64_t>(
+              kStatusUpdateIntervalProperty, kDefaultStatusUpdateIntervalMs)),
+          base::BindRepeating(&UpdateAttempterAndroid::SendStatusToObservers,
+                              base::Unretained(this))),
       processor_(new ActionProcessor()),
       clock_(new Clock()),
       metric_bytes_downloaded_(kPrefsCurrentBytesDownloaded, prefs_),
-      metric_total_bytes_downloaded_(kPrefsTotalBytesDownloaded, prefs_) {
+      metric_total_bytes_downloaded_(kPrefsTotalBytesDownloaded, prefs_),
+      cpu_limiter_(base::BindRepeating(&UpdateAttempterAndroid::SetCpuShares,
+                                       base::Unretained(this))) {
   metrics_reporter_ = metrics::CreateMetricsReporter(
       boot_control_->GetDynamicPartitionControl(), &install_plan_);
   network_selector_ = network::CreateNetworkSelector();
@@ -239,6 +299,8 @@ bool UpdateAttempterAndroid::ApplyPayload(
 
   // Setup the InstallPlan based on the request.
   install_plan_ = InstallPlan();
+  payload_bytes_received_ = 0;
+  payload_bytes_total_ = 0;
 
   install_plan_.download_url = payload_url;
   install_plan_.version = "";
@@ -326,6 +388,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.Dump();
 
   HttpFetcher* fetcher = nullptr;
+  vector<std::unique_ptr<HttpFetcher>> parallel_fetchers;
   if (FileFetcher::SupportedUrl(payload_url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
     fetcher = new FileFetcher();
@@ -335,25 +398,60 @@ bool UpdateAttempterAndroid::ApplyPayload(
     return false;  // NOLINT, unreached but analyzer might not know.
                    // Suppress warnings about null 'fetcher' after this.
 #else
-    LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
-    if (!headers[kPayloadDownloadRetry].empty()) {
-      libcurl_fetcher->set_max_retry_count(
-          atoi(headers[kPayloadDownloadRetry].c_str()));
+    auto new_libcurl_fetcher = [this, &headers]() {
+      LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
+      if (!headers[kPayloadDownloadRetry].empty()) {
+        libcurl_fetcher->set_max_retry_count(
+            atoi(headers[kPayloadDownloadRetry].c_str()));
+      }
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      return libcurl_fetcher;
+    };
+    fetcher = new_libcurl_fetcher();
+    install_plan_.mirror_urls = brillo::string_utils::Split(
+        headers[kPayloadMirrorUrls], ",", true /* trim_whitespaces */);
+    size_t num_connections = 1;
+    if (!headers[kPayloadParallelDownload].empty()) {
+      if (!base::StringToSizeT(headers[kPayloadParallelDownload],
+                               &num_connections) ||
+          num_connections == 0) {
+        delete fetcher;
+        return LogAndSetError(error,
+                              FROM_HERE,
+                              "Invalid parallel download connections: " +
+                                  headers[kPayloadParallelDownload]);
+      }
+    }
+    // Each URL gets a connection at least.
+    num_connections = std::min(
+        std::max(num_connections, 1 + install_plan_.mirror_urls.size()),
+        kMaxParallelDownloads);
+    if (num_connections > 1) {
+      LOG(INFO) << "Downloading over " << num_connections << " connections"
+                << " from " << 1 + install_plan_.mirror_urls.size()
+                << " URLs.";
     }
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    fetcher = libcurl_fetcher;
+    for (size_t i = 1; i < num_connections; i++)
+      parallel_fetchers.emplace_back(new_libcurl_fetcher());
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
-  if (!headers[kPayloadPropertyAuthorization].empty())
-    fetcher->SetHeader("Authorization", headers[kPayloadPropertyAuthorization]);
-  if (!headers[kPayloadPropertyUserAgent].empty())
-    fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
-
+  vector<HttpFetcher*> fetchers = {fetcher};
+  for (const auto& parallel_fetcher : parallel_fetchers)
+    fetchers.push_back(parallel_fetcher.get());
+  for (HttpFetcher* http_fetcher : fetchers) {
+    if (!headers[kPayloadPropertyAuthorization].empty()) {
+      http_fetcher->SetHeader("Authorization",
+                              headers[kPayloadPropertyAuthorization]);
+    }
+    if (!headers[kPayloadPropertyUserAgent].empty())
+      http_fetcher->SetHeader("User-Agent", headers[kPayloadPropertyUserAgent]);
+    if (!headers[kPayloadPropertyNetworkProxy].empty())
+      http_fetcher->SetProxies({headers[kPayloadPropertyNetworkProxy]});
+  }
   if (!headers[kPayloadPropertyNetworkProxy].empty()) {
     LOG(INFO) << "Using proxy url from payload headers: "
               << headers[kPayloadPropertyNetworkProxy];
-    fetcher->SetProxies({headers[kPayloadPropertyNetworkProxy]});
   }
   if (!headers[kPayloadVABCNone].empty()) {
     install_plan_.vabc_none = true;
@@ -364,8 +462,165 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadBatchedWrites].empty()) {
     install_plan_.batched_writes = true;
   }
+  if (!headers[kPayloadPipelinedApply].empty()) {
+    install_plan_.pipelined_apply = true;
+  }
+  if (!headers[kPayloadAdaptiveDownload].empty()) {
+    install_plan_.adaptive_download = true;
+  }
+  if (!headers[kPayloadParallelInstallOps].empty()) {
+    install_plan_.parallel_install_ops = true;
+  }
+  if (!headers[kPayloadIoUring].empty()) {
+    install_plan_.use_io_uring = true;
+  }
+  if (!headers[kPayloadStreamReplaceOps].empty()) {
+    install_plan_.stream_replace_ops = true;
+  }
+  if (!headers[kPayloadConcurrentPartitions].empty()) {
+    install_plan_.parallel_install_ops = true;
+    install_plan_.concurrent_partitions = true;
+  }
+  if (!headers[kPayloadAdaptiveVABCCompression].empty()) {
+    install_plan_.adaptive_vabc_compression = true;
+  }
+  if (!headers[kPayloadParallelVerification].empty()) {
+    size_t verify_threads = 0;
+    if (!base::StringToSizeT(headers[kPayloadParallelVerification],
+                             &verify_threads) ||
+        verify_threads == 0) {
+      verify_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    install_plan_.verify_threads = verify_threads;
+  }
+  if (!headers[kPayloadVerifyReadSize].empty()) {
+    if (!base::StringToSizeT(headers[kPayloadVerifyReadSize],
+                             &install_plan_.verify_read_size)) {
+      return LogAndSetError(
+          error,
+          FROM_HERE,
+          "Invalid verify read size: " + headers[kPayloadVerifyReadSize]);
+    }
+  }
+  if (!headers[kPayloadHashWhileWriting].empty()) {
+    install_plan_.hash_while_writing = true;
+  }
+  if (!headers[kPayloadIncrementalVerity].empty()) {
+    install_plan_.incremental_verity = true;
+  }
+  if (!headers[kPayloadTrustSourceVerity].empty()) {
+    install_plan_.trust_source_verity = true;
+  }
+  if (!headers[kPayloadVerifySourcePartitions].empty()) {
+    install_plan_.verify_source_partitions = true;
+  }
+  if (!headers[kPayloadPreparePartitionsEarly].empty()) {
+    install_plan_.prepare_partitions_early = true;
+  }
+  if (!headers[kPayloadOverlapActions].empty()) {
+    install_plan_.overlap_actions = true;
+  }
+  if (!headers[kPayloadApplyMemoryBudget].empty()) {
+    if (!base::StringToUint64(headers[kPayloadApplyMemoryBudget],
+                              &install_plan_.apply_memory_budget)) {
+      return LogAndSetError(error,
+                            FROM_HERE,
+                            "Invalid apply memory budget: " +
+                                headers[kPayloadApplyMemoryBudget]);
+    }
+    // Otherwise the whole data of the replace operations is buffered.
+    install_plan_.stream_replace_ops = true;
+  }
+  if (!headers[kPayloadSourceWarmingSize].empty() &&
+      !base::StringToUint64(headers[kPayloadSourceWarmingSize],
+                            &install_plan_.source_warming_size)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid source warming size: " +
+                              headers[kPayloadSourceWarmingSize]);
+  }
+  if (!headers[kPayloadIoPriority].empty() &&
+      !ParseIoPriority(headers[kPayloadIoPriority],
+                       &install_plan_.io_priority)) {
+    return LogAndSetError(
+        error,
+        FROM_HERE,
+        "Invalid I/O priority: " + headers[kPayloadIoPriority]);
+  }
+  if (!headers[kPayloadWritebackInterval].empty() &&
+      !base::StringToUint64(headers[kPayloadWritebackInterval],
+                            &install_plan_.writeback_interval)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid writeback interval: " +
+                              headers[kPayloadWritebackInterval]);
+  }
+  if (!headers[kPayloadDirectIo].empty()) {
+    install_plan_.direct_io = true;
+  }
+  if (!headers[kPayloadKernelCopy].empty()) {
+    install_plan_.kernel_copy = true;
+  }
+  if (!headers[kPayloadDiscardTarget].empty()) {
+    install_plan_.discard_target = true;
+  }
+  if (!headers[kPayloadWriteBackBufferSize].empty() &&
+      !base::StringToUint64(headers[kPayloadWriteBackBufferSize],
+                            &install_plan_.write_back_buffer_size)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid write back buffer size: " +
+                              headers[kPayloadWriteBackBufferSize]);
+  }
+  if (!headers[kPayloadPostinstallConcurrency].empty() &&
+      !base::StringToSizeT(headers[kPayloadPostinstallConcurrency],
+                           &install_plan_.postinstall_concurrency)) {
+    return LogAndSetError(error,
+                          FROM_HERE,
+                          "Invalid postinstall concurrency: " +
+                              headers[kPayloadPostinstallConcurrency]);
+  }
+  if (!headers[kPayloadSkipAppliedOperations].empty()) {
+    install_plan_.skip_applied_operations = true;
+  }
+  AlignedBufferPool::Get()->set_use_huge_pages(
+      !headers[kPayloadHugePageBuffers].empty());
+  if (!headers[kPayloadIoTrace].empty()) {
+    IoTraceRecorder::Get()->Start(kIoTracePrefix +
+                                  utils::GetTimeAsString(time(nullptr)));
+  } else {
+    IoTraceRecorder::Get()->Stop();
+  }
+  // Only fills the parameters the headers above left unset.
+  if (!headers[kPayloadUseTuningProfile].empty()) {
+    UseTuningProfile();
+  }
+  if (performance_mode_) {
+    UsePerformanceModeSettings();
+  }
+  blob_cache_.reset();
+  if (!headers[kPayloadBlobCacheSize].empty()) {
+    uint64_t blob_cache_size = 0;
+    if (!base::StringToUint64(headers[kPayloadBlobCacheSize],
+                              &blob_cache_size)) {
+      return LogAndSetError(
+          error,
+          FROM_HERE,
+          "Invalid blob cache size: " + headers[kPayloadBlobCacheSize]);
+    }
+    base::FilePath blob_cache_dir;
+    if (GetBlobCacheDirectory(&blob_cache_dir)) {
+      blob_cache_ =
+          std::make_unique<BlobCache>(blob_cache_dir, blob_cache_size);
+      if (!blob_cache_->Init()) {
+        LOG(WARNING) << "Unable to use the blob cache in "
+                     << blob_cache_dir.value();
+        blob_cache_.reset();
+      }
+    }
+  }
 
-  BuildUpdateActions(fetcher);
+  BuildUpdateActions(fetcher, std::move(parallel_fetchers));
 
   SetStatusAndNotify(UpdateStatus::UPDATE_AVAILABLE);
 
@@ -443,6 +698,7 @@ bool UpdateAttempterAndroid::ResetStatus(brillo::ErrorPtr* error) {
     std::vector<ApexInfo> apex_infos_blank;
     apex_handler_android_->AllocateSpace(apex_infos_blank);
   }
+  insufficient_space_.reset();
   // Remove the reboot marker so that if the machine is rebooted
   // after resetting to idle state, it doesn't go back to
   // UpdateStatus::UPDATED_NEED_REBOOT state.
@@ -586,22 +842,234 @@ bool UpdateAttempterAndroid::SetPerformanceMode(bool enable,
 
   if (performance_mode_ == enable)
     return true;
-  bool ret;
   if (enable)
-    ret = SetTaskProfiles(0, {"ProcessCapacityMax", "HighIoPriority", "MaxPerformance"});
-  else
-    ret = SetTaskProfiles(0, {"OtaProfiles"});
-  if (!ret)
+    cpu_limiter_.Stop();
+  if (!SetCpuShares(enable ? CpuShares::kHigh : CpuShares::kLow))
     return LogAndSetError(error, FROM_HERE, "Could not change profiles");
   performance_mode_ = enable;
+  if (!enable && processor_->IsRunning())
+    StartCpuLimiter();
+  // The actions of an ongoing update already have their copy of the install
+  // plan, only the task profiles change for them.
+  LOG_IF(INFO, processor_->IsRunning())
+      << "The engine settings of performance mode apply from the next update.";
   return true;
 }
 
+bool UpdateAttempterAndroid::Calibrate(brillo::ErrorPtr* error) {
+  // The measurements would compete with the update for the storage.
+  if (processor_->IsRunning()) {
+    return LogAndSetError(
+        error, FROM_HERE, "Can't calibrate while an update is running.");
+  }
+  TuningProfile profile;
+  if (!CalibrateAndStoreTuningProfile(&profile))
+    return LogAndSetError(error, FROM_HERE, "Calibration failed.");
+  return true;
+}
+
+bool UpdateAttempterAndroid::GetStatistics(UpdateStatistics* stats,
+                                           brillo::ErrorPtr* error) {
+  *stats = UpdateStatistics();
+  stats->status = static_cast<int32_t>(status_);
+  stats->payload_bytes_received = payload_bytes_received_;
+  stats->payload_bytes_total = payload_bytes_total_;
+
+  // The stats of the current action, not collected by ActionCompleted() yet.
+  InstallOperationStatsMap operation_stats = install_operation_stats_;
+  PartitionOperationStatsMap partition_stats = partition_operation_stats_;
+  std::optional<DownloadStats> download_stats = download_stats_;
+  AbstractAction* current_action = processor_->current_action();
+  if (current_action &&
+      current_action->Type() == DownloadAction::StaticType()) {
+    auto download_action = static_cast<DownloadAction*>(current_action);
+    operation_stats = download_action->operation_metrics().GetStats();
+    partition_stats = download_action->operation_metrics().GetPartitionStats();
+    download_stats = download_action->download_metrics().GetStats();
+    stats->pipelined_bytes = download_action->pipelined_bytes();
+  } else if (current_action &&
+             current_action->Type() == FilesystemVerifierAction::StaticType()) {
+    stats->bytes_verified =
+        static_cast<FilesystemVerifierAction*>(current_action)
+            ->bytes_verified();
+  }
+  const MemoryTagBytes memory_in_use = memory_accounting::GetInUse();
+  stats->scheduled_operation_bytes =
+      memory_in_use[static_cast<size_t>(MemoryTag::kScheduledOperations)];
+
+  PhaseStatsMap phase_stats = processor_->phase_metrics()->GetStats();
+  const PhaseStatsMap running_stats =
+      processor_->phase_metrics()->GetRunningStats();
+  for (const auto& [key, running] : running_stats)
+    phase_stats[key].wall_time += running.wall_time;
+  for (const auto& [key, phase] : phase_stats) {
+    stats->phases.push_back({key.first,
+                             key.second,
+                             phase.wall_time.InMilliseconds(),
+                             running_stats.count(key) > 0});
+  }
+
+  uint64_t bytes_applied = 0;
+  for (const auto& [type, op_stats] : operation_stats) {
+    stats->operation_types.push_back(
+        {InstallOperationTypeName(type),
+         op_stats.count,
+         static_cast<uint64_t>(op_stats.wall_time.InMilliseconds()),
+         op_stats.src_bytes,
+         op_stats.dst_bytes,
+         op_stats.data_bytes});
+    bytes_applied += op_stats.dst_bytes;
+  }
+  for (const auto& [partition, op_stats] : partition_stats) {
+    stats->partitions.push_back(
+        {partition,
+         op_stats.count,
+         static_cast<uint64_t>(op_stats.wall_time.InMilliseconds()),
+         op_stats.src_bytes,
+         op_stats.dst_bytes,
+         op_stats.data_bytes});
+  }
+
+  for (const auto& partition : install_plan_.partitions)
+    stats->bytes_to_verify += partition.target_size;
+  if (status_ == UpdateStatus::FINALIZING ||
+      status_ == UpdateStatus::UPDATED_NEED_REBOOT) {
+    stats->bytes_verified = stats->bytes_to_verify;
+  }
+  stats->bytes_verified =
+      std::min(stats->bytes_verified, stats->bytes_to_verify);
+  if (download_stats)
+    stats->bytes_downloaded = download_stats->bytes_received;
+
+  // Bytes per second over |wall_time|, 0 if it's empty.
+  auto rate = [](uint64_t bytes, TimeDelta wall_time) -> uint64_t {
+    const int64_t wall_ms = wall_time.InMilliseconds();
+    return wall_ms > 0 ? bytes * 1000 / wall_ms : 0;
+  };
+  const TimeDelta download_time =
+      phase_stats[{DownloadAction::StaticType(), ""}].wall_time;
+  const TimeDelta verify_time =
+      phase_stats[{FilesystemVerifierAction::StaticType(), ""}].wall_time;
+  stats->download_rate = rate(stats->bytes_downloaded, download_time);
+  stats->apply_rate = rate(bytes_applied, download_time);
+  stats->verify_rate = rate(stats->bytes_verified, verify_time);
+
+  if (status_ == UpdateStatus::DOWNLOADING && stats->download_rate > 0 &&
+      payload_bytes_total_ >= payload_bytes_received_) {
+    stats->eta_ms = (payload_bytes_total_ - payload_bytes_received_) * 1000 /
+                    stats->download_rate;
+  } else if (status_ == UpdateStatus::VERIFYING && stats->verify_rate > 0) {
+    stats->eta_ms = (stats->bytes_to_verify - stats->bytes_verified) * 1000 /
+                    stats->verify_rate;
+  }
+  return true;
+}
+
+bool UpdateAttempterAndroid::SetCpuShares(CpuShares shares) {
+  ThreadPlacement::Mode mode = ThreadPlacement::Mode::kDefault;
+  switch (shares) {
+    case CpuShares::kHigh:
+      TEST_AND_RETURN_FALSE(SetUpdateEngineTaskProfiles(
+          {"ProcessCapacityMax", "HighIoPriority", "MaxPerformance"}));
+      mode = ThreadPlacement::Mode::kPerformance;
+      break;
+    case CpuShares::kNormal:
+      TEST_AND_RETURN_FALSE(SetUpdateEngineTaskProfiles(
+          {"ProcessCapacityNormal", "NormalIoPriority", "NormalPerformance"}));
+      break;
+    case CpuShares::kLow:
+      TEST_AND_RETURN_FALSE(SetUpdateEngineTaskProfiles({"OtaProfiles"}));
+      mode = ThreadPlacement::Mode::kBackground;
+      break;
+  }
+  // The task profiles reset the CPUs of the threads, the workers are placed
+  // again for the new shares at their next piece of work.
+  ThreadPlacement::Get()->SetMode(mode);
+  return true;
+}
+
+void UpdateAttempterAndroid::StartCpuLimiter() {
+  if (!performance_mode_ &&
+      android::base::GetBoolProperty(kAdaptiveThrottlingProperty, false)) {
+    cpu_limiter_.Start(CpuShares::kLow);
+  }
+}
+
+void UpdateAttempterAndroid::StopCpuLimiter() {
+  if (!cpu_limiter_.IsRunning())
+    return;
+  cpu_limiter_.Stop();
+  SetCpuShares(CpuShares::kLow);
+}
+
+void UpdateAttempterAndroid::UsePerformanceModeSettings() {
+  // Background mode keeps whatever the payload headers asked for.
+  install_plan_.pipelined_apply = true;
+  install_plan_.parallel_install_ops = true;
+  install_plan_.concurrent_partitions = true;
+  install_plan_.use_io_uring = true;
+  if (install_plan_.verify_threads == 0) {
+    install_plan_.verify_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  LOG(INFO) << "Using performance mode, applying and verifying on "
+            << install_plan_.verify_threads << " threads.";
+}
+
+void UpdateAttempterAndroid::UseTuningProfile() {
+  TuningProfile profile;
+  string value;
+  // The calibration takes seconds of storage I/O, it's left to calibrate()
+  // rather than delaying the update.
+  if (!prefs_->GetString(kPrefsTuningProfile, &value) ||
+      !profile.Load(value) ||
+      profile.build_timestamp != hardware_->GetBuildTimestamp()) {
+    LOG(WARNING) << "No tuning profile for this build, calibrate first.";
+    return;
+  }
+  profile.ApplyTo(&install_plan_);
+  LOG(INFO) << "Using the tuning profile: verifying "
+            << install_plan_.verify_read_size << " bytes at once on "
+            << install_plan_.verify_threads << " threads.";
+}
+
+bool UpdateAttempterAndroid::CalibrateAndStoreTuningProfile(
+    TuningProfile* profile) {
+  base::FilePath dir;
+  if (!hardware_->GetNonVolatileDirectory(&dir))
+    return false;
+  if (!CalibrateDevice(dir, profile)) {
+    LOG(WARNING) << "Unable to calibrate in " << dir.value();
+    return false;
+  }
+  profile->build_timestamp = hardware_->GetBuildTimestamp();
+  return prefs_->SetString(kPrefsTuningProfile, profile->ToString());
+}
+
 void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
                                             ErrorCode code) {
   LOG(INFO) << "Processing Done.";
   metric_bytes_downloaded_.Flush(true);
   metric_total_bytes_downloaded_.Flush(true);
+  if (!install_operation_stats_.empty()) {
+    metrics_reporter_->ReportInstallOperationMetrics(install_operation_stats_);
+    install_operation_stats_.clear();
+  }
+  partition_operation_stats_.clear();
+  if (download_stats_) {
+    metrics_reporter_->ReportDownloadMetrics(*download_stats_);
+    download_stats_.reset();
+  }
+  const PhaseStatsMap phase_stats = processor_->phase_metrics()->GetStats();
+  if (!phase_stats.empty()) {
+    metrics_reporter_->ReportPhaseMetrics(phase_stats);
+  }
+  metrics_reporter_->ReportStatusNotificationMetrics(
+      notification_throttler_.num_sent(),
+      notification_throttler_.num_dropped());
+  notification_throttler_.ResetCounts();
+  // The buffers kept for the next operations aren't needed until the next
+  // update.
+  AlignedBufferPool::Get()->Trim();
   last_error_ = code;
   if (status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE) {
     TerminateUpdateAndNotify(code);
@@ -615,6 +1083,8 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
         LOG(ERROR) << "Failed to write update completion marker";
       }
       prefs_->SetInt64(kPrefsDeltaUpdateFailures, 0);
+      // Nothing in it is needed once the update is applied.
+      ClearBlobCache();
 
       LOG(INFO) << "Update successfully applied, waiting to reboot.";
       break;
@@ -660,6 +1130,17 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
     cleanup_previous_update_code_ = code;
     NotifyCleanupPreviousUpdateCallbacksAndClear();
   }
+  if (type == DownloadAction::StaticType()) {
+    // Kept even if the download failed, the operations applied before the
+    // failure are reported too.
+    auto download_action = static_cast<DownloadAction*>(action);
+    install_operation_stats_ = download_action->operation_metrics().GetStats();
+    partition_operation_stats_ =
+        download_action->operation_metrics().GetPartitionStats();
+    download_stats_ = download_action->download_metrics().GetStats();
+    if (download_stats_->num_transfers == 0)
+      download_stats_.reset();
+  }
   // download_progress_ is actually used by other actions, such as
   // filesystem_verify_action. Therefore we always clear it.
   download_progress_ = 0;
@@ -688,6 +1169,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
 void UpdateAttempterAndroid::BytesReceived(uint64_t bytes_progressed,
                                            uint64_t bytes_received,
                                            uint64_t total) {
+  payload_bytes_received_ = bytes_received;
+  payload_bytes_total_ = total;
   double progress = 0;
   if (total)
     progress = static_cast<double>(bytes_received) / static_cast<double>(total);
@@ -733,6 +1216,7 @@ void UpdateAttempterAndroid::OnVerifyProgressUpdate(double progress) {
 void UpdateAttempterAndroid::ScheduleProcessingStart() {
   LOG(INFO) << "Scheduling an action processor start.";
   processor_->set_delegate(this);
+  StartCpuLimiter();
   brillo::MessageLoop::current()->PostTask(
       FROM_HERE,
       Bind([](ActionProcessor* processor) { processor->StartProcessing(); },
@@ -751,9 +1235,12 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
     SetStatusAndNotify(UpdateStatus::IDLE);
     for (auto observer : daemon_state_->service_observers())
       observer->SendPayloadApplicationComplete(error_code);
+    StopCpuLimiter();
     return;
   }
 
+  StopCpuLimiter();
+  IoTraceRecorder::Get()->Stop();
   boot_control_->GetDynamicPartitionControl()->Cleanup();
 
   download_progress_ = 0;
@@ -791,14 +1278,20 @@ void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
   UpdateEngineStatus status_to_send = {.status = status_,
                                        .progress = download_progress_,
                                        .new_size_bytes = payload_size};
+  notification_throttler_.Notify(status_to_send);
+  last_notify_time_ = TimeTicks::Now();
+}
 
+void UpdateAttempterAndroid::SendStatusToObservers(
+    const UpdateEngineStatus& status) {
   for (auto observer : daemon_state_->service_observers()) {
-    observer->SendStatusUpdate(status_to_send);
+    observer->SendStatusUpdate(status);
   }
-  last_notify_time_ = TimeTicks::Now();
 }
 
-void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
+void UpdateAttempterAndroid::BuildUpdateActions(
+    HttpFetcher* fetcher,
+    std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers) {
   CHECK(!processor_->IsRunning());
 
   // Actions:
@@ -817,8 +1310,11 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
                                        update_certificates_path_);
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
+  if (!parallel_fetchers.empty())
+    download_action->SetParallelFetchers(std::move(parallel_fetchers));
+  download_action->set_blob_cache(blob_cache_.get());
   auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
-      boot_control_->GetDynamicPartitionControl());
+      boot_control_->GetDynamicPartitionControl(), prefs_);
   auto postinstall_runner_action =
       std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
   filesystem_verifier_action->set_delegate(this);
@@ -831,6 +1327,7 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
   BondActions(filesystem_verifier_action.get(),
               postinstall_runner_action.get());
 
+  processor_->set_overlap_actions(install_plan_.overlap_actions);
   processor_->EnqueueAction(std::move(update_boot_flags_action));
   processor_->EnqueueAction(std::move(cleanup_previous_update_action));
   processor_->EnqueueAction(std::move(install_plan_action));
@@ -1140,13 +1637,56 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
   }
 
   string payload_id = GetPayloadId(headers);
+  // The partitions are prepared again for a different payload or slot.
+  const string allocation_key =
+      payload_id + ":" +
+      HashCalculator::SHA256Digest(manifest.SerializeAsString()) + ":" +
+      std::to_string(GetCurrentSlot()) + ":" + std::to_string(GetTargetSlot());
   uint64_t required_size = 0;
-  if (!DeltaPerformer::PreparePartitionsForUpdate(prefs_,
-                                                  boot_control_,
-                                                  GetTargetSlot(),
-                                                  manifest,
-                                                  payload_id,
-                                                  &required_size)) {
+  // Preparing the partitions takes seconds, don't do it again while the space
+  // freed since the last attempt can't be enough.
+  if (GetRequiredSpaceSinceLastAllocation(allocation_key, &required_size)) {
+    LOG(ERROR) << "Still insufficient space for payload: " << required_size
+               << " bytes, apex decompression: " << apex_size_required
+               << " bytes";
+    return required_size + apex_size_required;
+  }
+  // The blob cache shares the data partition with the snapshots, it's limited
+  // to the space their COW leaves.
+  std::unique_ptr<BlobCache> leftover_blob_cache;
+  BlobCache* blob_cache = blob_cache_.get();
+  if (!blob_cache) {
+    leftover_blob_cache = OpenLeftoverBlobCache();
+    blob_cache = leftover_blob_cache.get();
+  }
+  // The COW is sized with the compression the update is installed with.
+  const bool adaptive_vabc_compression =
+      !headers[kPayloadAdaptiveVABCCompression].empty();
+  bool prepared =
+      DeltaPerformer::PreparePartitionsForUpdate(prefs_,
+                                                 boot_control_,
+                                                 GetTargetSlot(),
+                                                 &manifest,
+                                                 payload_id,
+                                                 adaptive_vabc_compression,
+                                                 blob_cache,
+                                                 &required_size);
+  // The COW estimate may be short, give all the space back before asking for
+  // more.
+  if (!prepared && required_size > 0 && blob_cache && blob_cache->Clear() > 0) {
+    LOG(INFO) << "Retrying after clearing the blob cache.";
+    required_size = 0;
+    prepared =
+        DeltaPerformer::PreparePartitionsForUpdate(prefs_,
+                                                   boot_control_,
+                                                   GetTargetSlot(),
+                                                   &manifest,
+                                                   payload_id,
+                                                   adaptive_vabc_compression,
+                                                   blob_cache,
+                                                   &required_size);
+  }
+  if (!prepared) {
     if (required_size == 0) {
       LogAndSetError(error, FROM_HERE, "Failed to allocate space for payload.");
       return 0;
@@ -1154,9 +1694,11 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
       LOG(ERROR) << "Insufficient space for payload: " << required_size
                  << " bytes, apex decompression: " << apex_size_required
                  << " bytes";
+      RecordInsufficientSpace(allocation_key, required_size);
       return required_size + apex_size_required;
     }
   }
+  insufficient_space_.reset();
 
   if (apex_size_required > 0 && apex_handler_android_ != nullptr &&
       !apex_handler_android_->AllocateSpace(apex_infos)) {
@@ -1169,6 +1711,72 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
   return 0;
 }
 
+bool UpdateAttempterAndroid::GetDataFreeSpace(uint64_t* free_space) {
+  base::FilePath non_volatile_path;
+  return hardware_->GetNonVolatileDirectory(&non_volatile_path) &&
+         utils::GetFilesystemFreeSpace(non_volatile_path.value(), free_space);
+}
+
+void UpdateAttempterAndroid::RecordInsufficientSpace(const string& key,
+                                                     uint64_t required_size) {
+  insufficient_space_.reset();
+  uint64_t free_space = 0;
+  if (!GetDataFreeSpace(&free_space))
+    return;
+  insufficient_space_ = InsufficientSpace{
+      key, required_size, free_space, clock_->GetMonotonicTime()};
+}
+
+bool UpdateAttempterAndroid::GetRequiredSpaceSinceLastAllocation(
+    const string& key, uint64_t* required_size) {
+  if (!insufficient_space_)
+    return false;
+  if (insufficient_space_->key != key ||
+      clock_->GetMonotonicTime() - insufficient_space_->time >
+          kInsufficientSpaceTimeout) {
+    insufficient_space_.reset();
+    return false;
+  }
+  uint64_t free_space = 0;
+  if (!GetDataFreeSpace(&free_space))
+    return false;
+  const InsufficientSpace& last = *insufficient_space_;
+  const uint64_t freed_space =
+      free_space > last.free_space ? free_space - last.free_space : 0;
+  if (freed_space >= last.required_size)
+    return false;
+  *required_size = last.required_size - freed_space;
+  return true;
+}
+
+bool UpdateAttempterAndroid::GetBlobCacheDirectory(base::FilePath* path) {
+  base::FilePath non_volatile_path;
+  if (!hardware_->GetNonVolatileDirectory(&non_volatile_path))
+    return false;
+  *path = non_volatile_path.Append(kBlobCacheDirectory);
+  return true;
+}
+
+std::unique_ptr<BlobCache> UpdateAttempterAndroid::OpenLeftoverBlobCache() {
+  base::FilePath blob_cache_dir;
+  if (!GetBlobCacheDirectory(&blob_cache_dir) ||
+      !base::DirectoryExists(blob_cache_dir)) {
+    return nullptr;
+  }
+  auto blob_cache = std::make_unique<BlobCache>(
+      blob_cache_dir, std::numeric_limits<uint64_t>::max());
+  if (!blob_cache->Init())
+    return nullptr;
+  return blob_cache;
+}
+
+uint64_t UpdateAttempterAndroid::ClearBlobCache() {
+  if (blob_cache_)
+    return blob_cache_->Clear();
+  auto blob_cache = OpenLeftoverBlobCache();
+  return blob_cache ? blob_cache->Clear() : 0;
+}
+
 void UpdateAttempterAndroid::CleanupSuccessfulUpdate(
     std::unique_ptr<CleanupSuccessfulUpdateCallbackInterface> callback,
     brillo::ErrorPtr* error) {
@@ -1220,6 +1828,7 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
       std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
   SetStatusAndNotify(UpdateStatus::VERIFYING);
   postinstall_runner_action->set_delegate(this);
+  processor_->set_overlap_actions(false);
 
   // If last error code is kUpdatedButNotActive, we know that we reached this
   // state by calling applyPayload() with switch_slot=false. That applyPayload()
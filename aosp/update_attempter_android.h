@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -28,10 +29,12 @@
 
 #include "update_engine/aosp/apex_handler_interface.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
+#include "update_engine/aosp/status_notification_throttler.h"
 #include "update_engine/client_library/include/update_engine/update_status.h"
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/clock_interface.h"
+#include "update_engine/common/cpu_limiter.h"
 #include "update_engine/common/daemon_state_interface.h"
 #include "update_engine/common/download_action.h"
 #include "update_engine/common/error_code.h"
@@ -40,8 +43,10 @@
 #include "update_engine/common/network_selector_interface.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/metrics_utils.h"
+#include "update_engine/payload_consumer/blob_cache.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/payload_consumer/tuning_profile.h"
 
 namespace chromeos_update_engine {
 
@@ -101,6 +106,9 @@ class UpdateAttempterAndroid
   bool resetShouldSwitchSlotOnReboot(brillo::ErrorPtr* error) override;
 
   bool SetPerformanceMode(bool enable, brillo::ErrorPtr* error) override;
+  bool Calibrate(brillo::ErrorPtr* error) override;
+  bool GetStatistics(UpdateStatistics* stats,
+                     brillo::ErrorPtr* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -161,10 +169,38 @@ class UpdateAttempterAndroid
   // all observers.
   void SetStatusAndNotify(UpdateStatus status);
 
+  // Turns on the multi-threaded and io_uring paths of the engine in
+  // |install_plan_|, on top of what the payload headers enabled. Used in
+  // performance mode.
+  void UsePerformanceModeSettings();
+
+  // Sets the parameters of the stored tuning profile the payload headers left
+  // unset in |install_plan_|. Does nothing if the profile is missing or from
+  // another build.
+  void UseTuningProfile();
+
+  // Measures |profile| and stores it in the prefs.
+  bool CalibrateAndStoreTuningProfile(TuningProfile* profile);
+
+  // Sets the task profiles of update_engine matching |shares|: the ones of
+  // performance mode for kHigh and the OtaProfiles for kLow.
+  bool SetCpuShares(CpuShares shares);
+
+  // Starts adjusting the task profiles to the load of the device during a
+  // background update, if enabled. StopCpuLimiter() restores the OtaProfiles.
+  void StartCpuLimiter();
+  void StopCpuLimiter();
+
+  // Sends |status| to all observers, called by |notification_throttler_|.
+  void SendStatusToObservers(const update_engine::UpdateEngineStatus& status);
+
   // Helper method to construct the sequence of actions to be performed for
   // applying an update using a given HttpFetcher. The ownership of |fetcher| is
-  // passed to this function.
-  void BuildUpdateActions(HttpFetcher* fetcher);
+  // passed to this function, as well as that of |parallel_fetchers|, which
+  // download the payload in parallel with |fetcher|.
+  void BuildUpdateActions(
+      HttpFetcher* fetcher,
+      std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers = {});
 
   // Writes to the processing completed marker. Does nothing if
   // |update_completed_marker_| is empty.
@@ -238,6 +274,32 @@ class UpdateAttempterAndroid
 
   bool IsProductionBuild();
 
+  // Sets |free_space| to the bytes available on the data partition, where the
+  // snapshots of the update are created.
+  bool GetDataFreeSpace(uint64_t* free_space);
+
+  // Remembers that preparing the partitions for the payload |key| found
+  // |required_size| bytes missing on the data partition.
+  void RecordInsufficientSpace(const std::string& key, uint64_t required_size);
+
+  // Returns whether the space freed on the data partition since preparing the
+  // partitions for |key| failed is still too little, setting |required_size|
+  // to the bytes still missing.
+  bool GetRequiredSpaceSinceLastAllocation(const std::string& key,
+                                           uint64_t* required_size);
+
+  // Sets |path| to the directory of the blob cache. Returns false if there's
+  // no non-volatile directory.
+  bool GetBlobCacheDirectory(base::FilePath* path);
+
+  // Opens the blob cache left by a previous attempt with BLOB_CACHE_SIZE,
+  // without limiting its size. Returns nullptr if there's none.
+  std::unique_ptr<BlobCache> OpenLeftoverBlobCache();
+
+  // Removes the entries of the blob cache, whether it's used by the ongoing
+  // update or was left by a previous one. Returns the number of bytes freed.
+  uint64_t ClearBlobCache();
+
   DaemonStateInterface* daemon_state_;
 
   // DaemonStateAndroid pointers.
@@ -247,20 +309,49 @@ class UpdateAttempterAndroid
 
   std::unique_ptr<ApexHandlerInterface> apex_handler_android_;
 
+  // The last AllocateSpaceForPayload() that found too little space.
+  struct InsufficientSpace {
+    std::string key;
+    uint64_t required_size;
+    // Bytes available on the data partition after the attempt.
+    uint64_t free_space;
+    base::Time time;
+  };
+  std::optional<InsufficientSpace> insufficient_space_;
+
   // Last status notification timestamp used for throttling. Use monotonic
   // TimeTicks to ensure that notifications are sent even if the system clock is
   // set back in the middle of an update.
   base::TimeTicks last_notify_time_;
 
+  // Limits the rate of the progress notifications sent to the observers.
+  StatusNotificationThrottler notification_throttler_;
+
   // The processor for running Actions.
   std::unique_ptr<ActionProcessor> processor_;
 
   // The InstallPlan used during the ongoing update.
   InstallPlan install_plan_;
 
+  // Resources used by the install operations of the ongoing update, reported
+  // once processing is done.
+  InstallOperationStatsMap install_operation_stats_;
+  PartitionOperationStatsMap partition_operation_stats_;
+  // Timings of the payload download of the ongoing update, reported once
+  // processing is done. Unset if nothing was downloaded.
+  std::optional<DownloadStats> download_stats_;
+
+  // Pieces of the payload kept across attempts with BLOB_CACHE_SIZE, nullptr
+  // otherwise. Used by the DownloadAction.
+  std::unique_ptr<BlobCache> blob_cache_;
+
   // For status:
   UpdateStatus status_{UpdateStatus::IDLE};
   double download_progress_{0.0};
+  // Last bytes of the payloads received and total reported by the
+  // DownloadAction of the ongoing update.
+  uint64_t payload_bytes_received_{0};
+  uint64_t payload_bytes_total_{0};
 
   // The offset in the payload file where the CrAU part starts.
   int64_t base_offset_{0};
@@ -289,6 +380,9 @@ class UpdateAttempterAndroid
 
   bool performance_mode_ = false;
 
+  // Adjusts the task profiles of background updates, see StartCpuLimiter().
+  AdaptiveCPULimiter cpu_limiter_;
+
   DISALLOW_COPY_AND_ASSIGN(UpdateAttempterAndroid);
 };
 
@@ -35,12 +35,14 @@
 
 #include "update_engine/aosp/daemon_state_android.h"
 #include "update_engine/common/constants.h"
+#include "update_engine/common/download_action.h"
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_clock.h"
 #include "update_engine/common/fake_hardware.h"
 #include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/mock_action_processor.h"
 #include "update_engine/common/mock_metrics_reporter.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -80,6 +82,28 @@ class UpdateAttempterAndroidTest : public ::testing::Test {
         std::move(payload));
   }
 
+  InstallPlan* install_plan() {
+    return &update_attempter_android_.install_plan_;
+  }
+
+  void UsePerformanceModeSettings() {
+    update_attempter_android_.UsePerformanceModeSettings();
+  }
+
+  // Sets the stats collected from the last DownloadAction.
+  void SetDownloadStats(const DownloadStats& download_stats,
+                        InstallOperation::Type type,
+                        const std::string& partition,
+                        const InstallOperationStats& op_stats) {
+    update_attempter_android_.download_stats_ = download_stats;
+    update_attempter_android_.install_operation_stats_[type] = op_stats;
+    update_attempter_android_.partition_operation_stats_[partition] = op_stats;
+  }
+
+  PhaseMetrics* phase_metrics() {
+    return update_attempter_android_.processor_->phase_metrics();
+  }
+
   DaemonStateAndroid daemon_state_;
   FakePrefs prefs_;
   FakeBootControl boot_control_;
@@ -238,6 +262,63 @@ TEST_F(UpdateAttempterAndroidTest, ReportMetricsForBytesDownloaded) {
       0, metrics_utils::GetPersistedValue(kPrefsTotalBytesDownloaded, &prefs_));
 }
 
+TEST_F(UpdateAttempterAndroidTest, PerformanceModeSettings) {
+  install_plan()->verify_threads = 2;
+  UsePerformanceModeSettings();
+  EXPECT_TRUE(install_plan()->pipelined_apply);
+  EXPECT_TRUE(install_plan()->parallel_install_ops);
+  EXPECT_TRUE(install_plan()->concurrent_partitions);
+  EXPECT_TRUE(install_plan()->use_io_uring);
+  // The number of verification threads from the headers is kept.
+  EXPECT_EQ(2u, install_plan()->verify_threads);
+
+  install_plan()->verify_threads = 0;
+  UsePerformanceModeSettings();
+  EXPECT_GT(install_plan()->verify_threads, 0u);
+}
+
+TEST_F(UpdateAttempterAndroidTest, GetStatisticsTest) {
+  update_attempter_android_.BytesReceived(50, 50, 200);
+  DownloadStats download_stats;
+  download_stats.bytes_received = 100;
+  InstallOperationStats op_stats;
+  op_stats.count = 3;
+  op_stats.dst_bytes = 400;
+  SetDownloadStats(download_stats, InstallOperation::ZERO, "system", op_stats);
+  phase_metrics()->Add(DownloadAction::StaticType(),
+                       "",
+                       TimeDelta::FromSeconds(2),
+                       TimeDelta::FromSeconds(1));
+  phase_metrics()->Start(phases::kApply, "system");
+
+  UpdateStatistics stats;
+  brillo::ErrorPtr error;
+  ASSERT_TRUE(update_attempter_android_.GetStatistics(&stats, &error));
+  EXPECT_EQ(static_cast<int32_t>(UpdateStatus::DOWNLOADING), stats.status);
+  EXPECT_EQ(100u, stats.bytes_downloaded);
+  EXPECT_EQ(50u, stats.payload_bytes_received);
+  EXPECT_EQ(200u, stats.payload_bytes_total);
+  EXPECT_EQ(50u, stats.download_rate);
+  EXPECT_EQ(200u, stats.apply_rate);
+  EXPECT_EQ(0u, stats.verify_rate);
+  // 150 bytes left at 50 bytes per second.
+  EXPECT_EQ(3000, stats.eta_ms);
+
+  ASSERT_EQ(2u, stats.phases.size());
+  EXPECT_EQ(DownloadAction::StaticType(), stats.phases[0].name);
+  EXPECT_FALSE(stats.phases[0].running);
+  EXPECT_EQ(phases::kApply, stats.phases[1].name);
+  EXPECT_EQ("system", stats.phases[1].partition);
+  EXPECT_TRUE(stats.phases[1].running);
+
+  ASSERT_EQ(1u, stats.operation_types.size());
+  EXPECT_EQ("ZERO", stats.operation_types[0].name);
+  EXPECT_EQ(3u, stats.operation_types[0].count);
+  ASSERT_EQ(1u, stats.partitions.size());
+  EXPECT_EQ("system", stats.partitions[0].name);
+  EXPECT_EQ(400u, stats.partitions[0].bytes_written);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
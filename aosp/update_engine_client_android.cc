@@ -170,6 +170,12 @@ int UpdateEngineClientAndroid::OnInit() {
               "Wait for previous update to merge. "
               "Only available after rebooting to new slot.");
   DEFINE_bool(perf_mode, false, "Enable perf mode.");
+  DEFINE_bool(calibrate,
+              false,
+              "Measure the performance of the device for the next updates.");
+  DEFINE_bool(statistics,
+              false,
+              "Show the progress statistics of the ongoing update and exit.");
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
   brillo::FlagHelper::Init(argc_, argv_, "Android Update Engine Client");
@@ -297,6 +303,40 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->setPerformanceMode(true));
   }
 
+  if (FLAGS_calibrate) {
+    return ExitWhenIdle(service_->calibrate());
+  }
+
+  if (FLAGS_statistics) {
+    android::os::UpdateEngineStatistics stats;
+    Status status = service_->getStatistics(&stats);
+    if (status.isOk()) {
+      auto update_status =
+          static_cast<update_engine::UpdateStatus>(stats.status);
+      LOG(INFO) << "Status: " << UpdateStatusToString(update_status)
+                << ", downloaded " << stats.payloadBytesReceived << " of "
+                << stats.payloadBytesTotal << " bytes at "
+                << stats.downloadBytesPerSecond << " B/s, applied at "
+                << stats.applyBytesPerSecond << " B/s, verified "
+                << stats.bytesVerified << " of " << stats.bytesToVerify
+                << " bytes at " << stats.verifyBytesPerSecond
+                << " B/s, ETA " << stats.etaMillis << " ms.";
+      for (const auto& phase : stats.phases) {
+        LOG(INFO) << android::String8{phase.name}.c_str() << " "
+                  << android::String8{phase.partition}.c_str() << ": "
+                  << phase.wallTimeMillis << " ms"
+                  << (phase.running ? " (running)" : "");
+      }
+      for (const auto& op_stats : stats.partitions) {
+        LOG(INFO) << android::String8{op_stats.name}.c_str() << ": "
+                  << op_stats.count
+                  << " operations, " << op_stats.bytesRead << " bytes read, "
+                  << op_stats.bytesWritten << " bytes written";
+      }
+    }
+    return ExitWhenIdle(status);
+  }
+
   if (FLAGS_update) {
     auto and_headers = ParseHeaders(FLAGS_headers);
     Status status = service_->applyPayload(
@@ -17,6 +17,7 @@
 #include "update_engine/certificate_checker.h"
 
 #include <string>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -164,26 +165,36 @@ bool CertificateChecker::CheckCertificateChange(int preverify_ok,
                                           kPrefsUpdateServerCertificate,
                                           static_cast<int>(server_to_check),
                                           depth);
-  string stored_digest;
-  // If there's no stored certificate, we just store the current one and return.
-  if (!prefs_->GetString(storage_key, &stored_digest)) {
-    if (!prefs_->SetString(storage_key, digest_string)) {
-      LOG(WARNING) << "Failed to store server certificate on storage key "
-                   << storage_key;
+  // The stored digests are only read from prefs once, the daemon is the only
+  // one writing them.
+  auto stored_digest = stored_digests_.find(storage_key);
+  if (stored_digest == stored_digests_.end()) {
+    string digest_in_prefs;
+    // If there's no stored certificate, we just store the current one and
+    // return.
+    if (!prefs_->GetString(storage_key, &digest_in_prefs)) {
+      if (!prefs_->SetString(storage_key, digest_string)) {
+        LOG(WARNING) << "Failed to store server certificate on storage key "
+                     << storage_key;
+      }
+      stored_digests_[storage_key] = digest_string;
+      NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
+      return true;
     }
-    NotifyCertificateChecked(server_to_check, CertificateCheckResult::kValid);
-    return true;
+    stored_digest =
+        stored_digests_.emplace(storage_key, std::move(digest_in_prefs)).first;
   }
 
   // Certificate changed, we store a report to UMA and store the most recent
   // certificate.
-  if (stored_digest != digest_string) {
+  if (stored_digest->second != digest_string) {
     if (!prefs_->SetString(storage_key, digest_string)) {
       LOG(WARNING) << "Failed to store server certificate on storage key "
                    << storage_key;
     }
-    LOG(INFO) << "Certificate changed from " << stored_digest << " to "
+    LOG(INFO) << "Certificate changed from " << stored_digest->second << " to "
               << digest_string << ".";
+    stored_digest->second = digest_string;
     NotifyCertificateChecked(server_to_check,
                              CertificateCheckResult::kValidChanged);
     return true;
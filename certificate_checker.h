@@ -20,6 +20,7 @@
 #include <curl/curl.h>
 #include <openssl/ssl.h>
 
+#include <map>
 #include <string>
 
 #include <base/macros.h>
@@ -125,6 +126,7 @@ class CertificateChecker {
   FRIEND_TEST(CertificateCheckerTest, SameCertificate);
   FRIEND_TEST(CertificateCheckerTest, ChangedCertificate);
   FRIEND_TEST(CertificateCheckerTest, FailedCertificate);
+  FRIEND_TEST(CertificateCheckerTest, CachedCertificate);
 
   // These callbacks are asynchronously called by openssl after initial SSL
   // verification. They are used to perform any additional security verification
@@ -167,6 +169,9 @@ class CertificateChecker {
   // The observer called whenever a certificate is checked, if not null.
   Observer* observer_{nullptr};
 
+  // The digests stored in prefs, by prefs key, once read or written.
+  std::map<std::string, std::string> stored_digests_;
+
   DISALLOW_COPY_AND_ASSIGN(CertificateChecker);
 };
 
@@ -133,4 +133,28 @@ TEST_F(CertificateCheckerTest, FailedCertificate) {
       cert_checker.CheckCertificateChange(0, nullptr, server_to_check_));
 }
 
+// check certificate change, several times
+TEST_F(CertificateCheckerTest, CachedCertificate) {
+  EXPECT_CALL(openssl_wrapper_, GetCertificateDigest(nullptr, _, _, _))
+      .WillRepeatedly(DoAll(SetArgPointee<1>(depth_),
+                            SetArgPointee<2>(length_),
+                            SetArrayArgument<3>(digest_, digest_ + 4),
+                            Return(true)));
+  // The stored digest is only read once, and only written when it changes.
+  EXPECT_CALL(prefs_, GetString(cert_key_, _))
+      .WillOnce(DoAll(SetArgPointee<1>(diff_digest_hex_), Return(true)));
+  EXPECT_CALL(prefs_, SetString(cert_key_, digest_hex_)).WillOnce(Return(true));
+  EXPECT_CALL(observer_,
+              CertificateChecked(server_to_check_,
+                                 CertificateCheckResult::kValidChanged));
+  EXPECT_CALL(
+      observer_,
+      CertificateChecked(server_to_check_, CertificateCheckResult::kValid))
+      .Times(2);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(
+        cert_checker.CheckCertificateChange(1, nullptr, server_to_check_));
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -110,13 +110,36 @@ class AbstractAction {
     processor_ = processor;
   }
 
-  // Returns true iff the action is the current action of its ActionProcessor.
+  // Times |phase| of |partition| in the phase metrics of the ActionProcessor,
+  // if any. See PhaseMetrics.
+  void StartPhase(const std::string& phase,
+                  const std::string& partition = "") {
+    if (processor_)
+      processor_->phase_metrics()->Start(phase, partition);
+  }
+  void StopPhase(const std::string& phase, const std::string& partition = "") {
+    if (processor_)
+      processor_->phase_metrics()->Stop(phase, partition);
+  }
+
+  // Returns true iff the action is the current action of its ActionProcessor,
+  // or was started early and still runs.
   bool IsRunning() const {
     if (!processor_)
       return false;
-    return processor_->current_action() == this;
+    return processor_->IsActionRunning(this);
   }
 
+  // Whether the action can start while the action before it is still
+  // running, working on the partitions that one is done with. Called right
+  // before starting the action early, once its input object is set. See
+  // ActionProcessor::set_overlap_actions().
+  virtual bool CanStartOnPartitions() { return false; }
+
+  // Called on an action started early when the action before it is done with
+  // more partitions, and once it completed.
+  virtual void PartitionsReady() {}
+
   // Called on asynchronous actions if canceled. Actions may implement if
   // there's any cleanup to do. There is no need to call
   // ActionProcessor::ActionComplete() because the processor knows this
@@ -140,6 +163,23 @@ class AbstractAction {
   virtual std::string Type() const = 0;
 
  protected:
+  // Whether the action before this one is done with |partition|, always true
+  // unless this action was started early.
+  bool IsPartitionReady(const std::string& partition) const {
+    return !processor_ || processor_->IsPartitionReady(this, partition);
+  }
+  // Whether the actions before this one completed, which an action started
+  // early must wait for before completing successfully.
+  bool AllPartitionsReady() const {
+    return !processor_ || processor_->AllPartitionsReady(this);
+  }
+  // Lets the next action work on |partition|. Its output object must be set
+  // before.
+  void PartitionCompleted(const std::string& partition) {
+    if (processor_)
+      processor_->PartitionCompleted(this, partition);
+  }
+
   // A weak pointer to the processor that owns this Action.
   ActionProcessor* processor_;
 };
@@ -193,6 +233,14 @@ class Action : public AbstractAction {
     return in_pipe_->contents();
   }
 
+  // Moves the object out of the input pipe, for actions that keep their own
+  // copy of it. The input pipe then holds a default constructed object until
+  // the previous action sets it again.
+  typename ActionTraits<SubClass>::InputObjectType TakeInputObject() {
+    CHECK(HasInputObject());
+    return in_pipe_->take_contents();
+  }
+
   // Returns true iff there's an output pipe.
   bool HasOutputPipe() const { return out_pipe_.get(); }
 
@@ -204,6 +252,12 @@ class Action : public AbstractAction {
     CHECK(HasOutputPipe());
     out_pipe_->set_contents(out_obj);
   }
+  // Moves the object passed into the output pipe, for the last use of it.
+  void SetOutputObject(
+      typename ActionTraits<SubClass>::OutputObjectType&& out_obj) {
+    CHECK(HasOutputPipe());
+    out_pipe_->set_contents(std::move(out_obj));
+  }
 
   // Returns a reference to the object sitting in the output pipe.
   const typename ActionTraits<SubClass>::OutputObjectType& GetOutputObject() {
@@ -22,6 +22,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/macros.h>
@@ -63,6 +64,15 @@ class ActionPipe {
   // This should be called by an Action on its output pipe.
   // Stores a copy of the passed object in this pipe.
   void set_contents(const ObjectType& contents) { contents_ = contents; }
+  // Moves the passed object into this pipe.
+  void set_contents(ObjectType&& contents) { contents_ = std::move(contents); }
+
+  // This may be called by an Action on its input pipe instead of contents().
+  // Moves the stored object out of this pipe, leaving a default constructed
+  // one.
+  ObjectType take_contents() {
+    return std::exchange(contents_, ObjectType());
+  }
 
   // Bonds two Actions together with a new ActionPipe. The ActionPipe is
   // jointly owned by the two Actions and will be automatically destroyed
@@ -57,4 +57,18 @@ TEST(ActionPipeTest, SimpleTest) {
   EXPECT_EQ("foo", b.in_pipe()->contents());
 }
 
+TEST(ActionPipeTest, MoveTest) {
+  ActionPipeTestAction a, b;
+  BondActions(&a, &b);
+  string contents(100, 'x');
+  const char* data = contents.data();
+  a.out_pipe()->set_contents(std::move(contents));
+  EXPECT_EQ(data, b.in_pipe()->contents().data());
+
+  // Taking the contents leaves an empty object in the pipe.
+  const string taken = b.in_pipe()->take_contents();
+  EXPECT_EQ(data, taken.data());
+  EXPECT_EQ("", b.in_pipe()->contents());
+}
+
 }  // namespace chromeos_update_engine
@@ -16,9 +16,11 @@
 
 #include "update_engine/common/action_processor.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 
+#include <base/bind.h>
 #include <base/logging.h>
 
 #include "update_engine/common/action.h"
@@ -43,12 +45,26 @@ bool ActionProcessor::IsRunning() const {
   return current_action_ != nullptr || suspended_;
 }
 
+bool ActionProcessor::IsActionRunning(const AbstractAction* actionptr) const {
+  if (actionptr == current_action_.get())
+    return actionptr != nullptr;
+  return std::any_of(early_actions_.begin(),
+                     early_actions_.end(),
+                     [actionptr](const unique_ptr<AbstractAction>& action) {
+                       return action.get() == actionptr;
+                     });
+}
+
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
+  phase_metrics_.Reset();
+  completed_partitions_.clear();
+  partition_reporters_.clear();
   if (!actions_.empty()) {
     current_action_ = std::move(actions_.front());
     actions_.pop_front();
     LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
+    phase_metrics_.Start(current_action_->Type());
     current_action_->PerformAction();
   }
 }
@@ -57,14 +73,19 @@ void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
   if (current_action_) {
     current_action_->TerminateProcessing();
+    phase_metrics_.Stop(current_action_->Type());
   }
   LOG(INFO) << "ActionProcessor: aborted "
             << (current_action_ ? current_action_->Type() : "")
             << (suspended_ ? " while suspended" : "");
   current_action_.reset();
+  TerminateEarlyActions();
   suspended_ = false;
   // Delete all the actions before calling the delegate.
   actions_.clear();
+  completed_partitions_.clear();
+  partition_reporters_.clear();
+  deliver_partitions_task_.Cancel();
   if (delegate_)
     delegate_->ProcessingStopped(this);
 }
@@ -82,6 +103,10 @@ void ActionProcessor::SuspendProcessing() {
   // the action can ignore that and terminate at any point.
   LOG(INFO) << "ActionProcessor: suspending " << current_action_->Type();
   current_action_->SuspendAction();
+  for (const auto& action : early_actions_) {
+    LOG(INFO) << "ActionProcessor: suspending " << action->Type();
+    action->SuspendAction();
+  }
 }
 
 void ActionProcessor::ResumeProcessing() {
@@ -90,6 +115,13 @@ void ActionProcessor::ResumeProcessing() {
     return;
   }
   suspended_ = false;
+  for (const auto& action : early_actions_) {
+    LOG(INFO) << "ActionProcessor: resuming " << action->Type();
+    action->ResumeAction();
+  }
+  // The partitions completed while suspended weren't delivered.
+  if (!partition_reporters_.empty())
+    ScheduleDeliverCompletedPartitions();
   if (current_action_) {
     // The current_action_ did not call ActionComplete while suspended, so we
     // should notify it of the resume operation.
@@ -107,18 +139,33 @@ void ActionProcessor::ResumeProcessing() {
 
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      ErrorCode code) {
-  CHECK_EQ(actionptr, current_action_.get());
+  if (actionptr != current_action_.get()) {
+    // Actions aborted because of an action started early may still report
+    // their completion while terminated.
+    if (!IsActionRunning(actionptr)) {
+      LOG(INFO) << "ActionProcessor: ignoring the completion of aborted "
+                << actionptr->Type();
+      return;
+    }
+    EarlyActionComplete(actionptr, code);
+    return;
+  }
+  string old_type = current_action_->Type();
+  phase_metrics_.Stop(old_type);
   if (delegate_)
     delegate_->ActionCompleted(this, actionptr, code);
-  string old_type = current_action_->Type();
   current_action_->ActionCompleted(code);
+  completed_partitions_.erase(actionptr);
   current_action_.reset();
   LOG(INFO) << "ActionProcessor: finished "
-            << (actions_.empty() ? "last action " : "") << old_type
-            << (suspended_ ? " while suspended" : "") << " with code "
-            << utils::ErrorCodeToString(code);
-  if (!actions_.empty() && code != ErrorCode::kSuccess) {
+            << (actions_.empty() && early_actions_.empty() ? "last action "
+                                                           : "")
+            << old_type << (suspended_ ? " while suspended" : "")
+            << " with code " << utils::ErrorCodeToString(code);
+  if ((!actions_.empty() || !early_actions_.empty()) &&
+      code != ErrorCode::kSuccess) {
     LOG(INFO) << "ActionProcessor: Aborting processing due to failure.";
+    TerminateEarlyActions();
     actions_.clear();
   }
   if (suspended_) {
@@ -132,6 +179,15 @@ void ActionProcessor::ActionComplete(AbstractAction* actionptr,
 }
 
 void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
+  if (!early_actions_.empty()) {
+    // The next action is already running, it can now use all the partitions.
+    current_action_ = std::move(early_actions_.front());
+    early_actions_.pop_front();
+    LOG(INFO) << "ActionProcessor: " << current_action_->Type()
+              << " started early is now the current action";
+    current_action_->PartitionsReady();
+    return;
+  }
   if (actions_.empty()) {
     if (delegate_) {
       delegate_->ProcessingDone(this, code);
@@ -141,7 +197,136 @@ void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
   current_action_ = std::move(actions_.front());
   actions_.pop_front();
   LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
+  phase_metrics_.Start(current_action_->Type());
   current_action_->PerformAction();
 }
 
+AbstractAction* ActionProcessor::PreviousAction(
+    const AbstractAction* actionptr) const {
+  for (size_t i = 0; i < early_actions_.size(); i++) {
+    if (early_actions_[i].get() == actionptr)
+      return i == 0 ? current_action_.get() : early_actions_[i - 1].get();
+  }
+  return nullptr;
+}
+
+bool ActionProcessor::IsPartitionReady(const AbstractAction* actionptr,
+                                       const string& partition) const {
+  const AbstractAction* previous = PreviousAction(actionptr);
+  if (!previous)
+    return true;
+  auto it = completed_partitions_.find(previous);
+  return it != completed_partitions_.end() && it->second.count(partition);
+}
+
+bool ActionProcessor::AllPartitionsReady(
+    const AbstractAction* actionptr) const {
+  return PreviousAction(actionptr) == nullptr;
+}
+
+void ActionProcessor::PartitionCompleted(AbstractAction* actionptr,
+                                         const string& partition) {
+  if (!overlap_actions_ || !IsActionRunning(actionptr))
+    return;
+  if (!completed_partitions_[actionptr].insert(partition).second)
+    return;
+  partition_reporters_.push_back(actionptr);
+  if (!suspended_)
+    ScheduleDeliverCompletedPartitions();
+}
+
+void ActionProcessor::ScheduleDeliverCompletedPartitions() {
+  if (deliver_partitions_task_.IsScheduled())
+    return;
+  CHECK(deliver_partitions_task_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&ActionProcessor::DeliverCompletedPartitions,
+                     base::Unretained(this))));
+}
+
+void ActionProcessor::DeliverCompletedPartitions() {
+  // Any call below may complete or terminate actions, so only one is made per
+  // task.
+  while (!partition_reporters_.empty() && !suspended_) {
+    const AbstractAction* reporter = partition_reporters_.front();
+    partition_reporters_.pop_front();
+    if (!IsActionRunning(reporter))
+      continue;
+    if (!partition_reporters_.empty())
+      ScheduleDeliverCompletedPartitions();
+
+    AbstractAction* last_action = early_actions_.empty()
+                                      ? current_action_.get()
+                                      : early_actions_.back().get();
+    if (reporter != last_action) {
+      for (const auto& action : early_actions_) {
+        if (PreviousAction(action.get()) == reporter) {
+          action->PartitionsReady();
+          return;
+        }
+      }
+      return;
+    }
+    if (actions_.empty() || !actions_.front()->CanStartOnPartitions())
+      return;
+    early_actions_.push_back(std::move(actions_.front()));
+    actions_.pop_front();
+    AbstractAction* action = early_actions_.back().get();
+    LOG(INFO) << "ActionProcessor: starting " << action->Type()
+              << " early, while " << reporter->Type() << " is running";
+    phase_metrics_.Start(action->Type());
+    action->PerformAction();
+    return;
+  }
+}
+
+void ActionProcessor::EarlyActionComplete(AbstractAction* actionptr,
+                                          ErrorCode code) {
+  auto it = std::find_if(early_actions_.begin(),
+                         early_actions_.end(),
+                         [actionptr](const unique_ptr<AbstractAction>& action) {
+                           return action.get() == actionptr;
+                         });
+  CHECK(it != early_actions_.end());
+  if (code == ErrorCode::kSuccess) {
+    LOG(ERROR) << "ActionProcessor: " << actionptr->Type()
+               << " completed before the actions before it.";
+    code = ErrorCode::kError;
+  }
+  LOG(INFO) << "ActionProcessor: " << actionptr->Type()
+            << " started early failed, aborting the actions before it.";
+  // The actions before it are taken out before being terminated, so that
+  // their completion is ignored if reported while terminating.
+  std::deque<unique_ptr<AbstractAction>> aborted_actions;
+  if (current_action_)
+    aborted_actions.push_back(std::move(current_action_));
+  while (early_actions_.front().get() != actionptr) {
+    aborted_actions.push_back(std::move(early_actions_.front()));
+    early_actions_.pop_front();
+  }
+  current_action_ = std::move(early_actions_.front());
+  early_actions_.pop_front();
+  for (const auto& action : aborted_actions) {
+    action->TerminateProcessing();
+    phase_metrics_.Stop(action->Type());
+    completed_partitions_.erase(action.get());
+  }
+  aborted_actions.clear();
+  // As if these actions were never started: the failed action is reported
+  // like when it fails as the current action.
+  ActionComplete(actionptr, code);
+}
+
+void ActionProcessor::TerminateEarlyActions() {
+  while (!early_actions_.empty()) {
+    unique_ptr<AbstractAction> action = std::move(early_actions_.back());
+    early_actions_.pop_back();
+    LOG(INFO) << "ActionProcessor: aborted " << action->Type()
+              << " started early";
+    action->TerminateProcessing();
+    phase_metrics_.Stop(action->Type());
+    completed_partitions_.erase(action.get());
+  }
+}
+
 }  // namespace chromeos_update_engine
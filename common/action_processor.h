@@ -18,13 +18,18 @@
 #define UPDATE_ENGINE_COMMON_ACTION_PROCESSOR_H_
 
 #include <deque>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
 #include <vector>
 
 #include <base/macros.h>
 #include <brillo/errors/error.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/phase_metrics.h"
+#include "update_engine/common/scoped_task_id.h"
 
 #include <gtest/gtest_prod.h>
 
@@ -37,6 +42,9 @@
 // See action.h for an overview of this class and other Action* classes.
 
 // An ActionProcessor keeps a queue of Actions and processes them in order.
+// When it overlaps the actions, an action that works partition by partition
+// may start while the action before it is still running, as soon as that one
+// is done with some partitions.
 
 namespace chromeos_update_engine {
 
@@ -82,9 +90,44 @@ class ActionProcessor {
   ActionProcessorDelegate* delegate() const { return delegate_; }
   void set_delegate(ActionProcessorDelegate* delegate) { delegate_ = delegate; }
 
-  // Returns a pointer to the current Action that's processing.
+  // Returns a pointer to the current Action that's processing. When actions
+  // overlap, this is the first of the running actions.
   AbstractAction* current_action() const { return current_action_.get(); }
 
+  // Returns whether |actionptr| is the current action or was started early
+  // and is still running.
+  bool IsActionRunning(const AbstractAction* actionptr) const;
+
+  // Whether to start the next action in the queue early when it can start on
+  // partitions, see AbstractAction::CanStartOnPartitions(), as soon as the
+  // last running action is done with a partition. An action started early
+  // only becomes the current action once the actions before it completed.
+  // Requires a MessageLoop.
+  void set_overlap_actions(bool overlap_actions) {
+    overlap_actions_ = overlap_actions;
+  }
+  bool overlap_actions() const { return overlap_actions_; }
+
+  // Called by a running action once it is done with |partition|, so that the
+  // next action can work on it. The next action is started or notified from a
+  // separate task, never before this call returns. Ignored unless the actions
+  // overlap.
+  void PartitionCompleted(AbstractAction* actionptr,
+                          const std::string& partition);
+
+  // Returns whether the action before |actionptr| is done with |partition|,
+  // which is always true unless |actionptr| was started early.
+  bool IsPartitionReady(const AbstractAction* actionptr,
+                        const std::string& partition) const;
+
+  // Returns whether all the actions before |actionptr| completed. An action
+  // started early must wait for this before completing successfully.
+  bool AllPartitionsReady(const AbstractAction* actionptr) const;
+
+  // The time spent in each action since StartProcessing(), under the Type() of
+  // the action, and in the phases the actions time within themselves.
+  PhaseMetrics* phase_metrics() { return &phase_metrics_; }
+
   // Called by an action to notify processor that it's done. Caller passes self.
   // But this call deletes the action if there no other object has a reference
   // to it, so in that case, the caller should not try to access any of its
@@ -99,6 +142,23 @@ class ActionProcessor {
   // processing will terminate.
   void StartNextActionOrFinish(ErrorCode code);
 
+  // Returns the running action right before |actionptr|, or nullptr if it
+  // isn't one of |early_actions_| or if the current action already completed.
+  AbstractAction* PreviousAction(const AbstractAction* actionptr) const;
+
+  // Handles the completion of one of |early_actions_| with |code|. As it can't
+  // complete before the actions before it, this fails the whole processing.
+  void EarlyActionComplete(AbstractAction* actionptr, ErrorCode code);
+
+  // Terminates |early_actions_|, the last ones first, and removes them.
+  void TerminateEarlyActions();
+
+  // Notifies the action following the first of |partition_reporters_| that
+  // more partitions are ready, or starts the next action of the queue early.
+  // Runs from its own task.
+  void DeliverCompletedPartitions();
+  void ScheduleDeliverCompletedPartitions();
+
   // Actions that have not yet begun processing, in the order in which
   // they'll be processed.
   std::deque<std::unique_ptr<AbstractAction>> actions_;
@@ -106,6 +166,19 @@ class ActionProcessor {
   // A pointer to the currently processing Action, if any.
   std::unique_ptr<AbstractAction> current_action_;
 
+  // The actions started early and still running, in the queue order, after
+  // |current_action_|.
+  std::deque<std::unique_ptr<AbstractAction>> early_actions_;
+
+  bool overlap_actions_{false};
+  // The partitions each running action is done with.
+  std::map<const AbstractAction*, std::set<std::string>>
+      completed_partitions_;
+  // The actions that completed partitions since DeliverCompletedPartitions()
+  // last looked at them, in order.
+  std::deque<const AbstractAction*> partition_reporters_;
+  ScopedTaskId deliver_partitions_task_;
+
   // The ErrorCode reported by an action that was suspended but finished while
   // being suspended. This error code is stored here to be reported back to the
   // delegate once the processor is resumed.
@@ -114,6 +187,8 @@ class ActionProcessor {
   // Whether the action processor is or should be suspended.
   bool suspended_{false};
 
+  PhaseMetrics phase_metrics_;
+
   // A pointer to the delegate, or null if none.
   ActionProcessorDelegate* delegate_{nullptr};
 
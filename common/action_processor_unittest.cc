@@ -16,9 +16,11 @@
 
 #include "update_engine/common/action_processor.h"
 
+#include <memory>
 #include <string>
 #include <utility>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/action.h"
@@ -55,6 +57,50 @@ class ActionProcessorTestAction : public Action<ActionProcessorTestAction> {
   string Type() const { return "ActionProcessorTestAction"; }
 };
 
+class OverlapTestAction;
+
+template <>
+class ActionTraits<OverlapTestAction> {
+ public:
+  typedef string OutputObjectType;
+  typedef string InputObjectType;
+};
+
+// An action that may start while the action before it runs.
+class OverlapTestAction : public Action<OverlapTestAction> {
+ public:
+  typedef string InputObjectType;
+  typedef string OutputObjectType;
+
+  // What happened to the action, kept by the test as the processor deletes
+  // the action.
+  struct State {
+    bool performed{false};
+    bool terminated{false};
+    int num_partitions_ready{0};
+  };
+
+  OverlapTestAction(bool can_start_early, State* state)
+      : can_start_early_(can_start_early), state_(state) {}
+
+  void PerformAction() override { state_->performed = true; }
+  void TerminateProcessing() override { state_->terminated = true; }
+  bool CanStartOnPartitions() override { return can_start_early_; }
+  void PartitionsReady() override { state_->num_partitions_ready++; }
+  void CompleteAction(ErrorCode code) {
+    processor_->ActionComplete(this, code);
+  }
+  string Type() const override { return "OverlapTestAction"; }
+
+  using AbstractAction::AllPartitionsReady;
+  using AbstractAction::IsPartitionReady;
+  using AbstractAction::PartitionCompleted;
+
+ private:
+  bool can_start_early_;
+  State* state_;
+};
+
 namespace {
 class MyActionProcessorDelegate : public ActionProcessorDelegate {
  public:
@@ -183,6 +229,11 @@ TEST_F(ActionProcessorTest, ChainActionsTest) {
   EXPECT_EQ(nullptr, action_processor_.current_action());
   EXPECT_TRUE(action_processor_.actions_.empty());
   EXPECT_FALSE(action_processor_.IsRunning());
+
+  // Each action was timed.
+  const PhaseStatsMap stats = action_processor_.phase_metrics()->GetStats();
+  ASSERT_EQ(1u, stats.size());
+  EXPECT_EQ(3u, stats.at({"ActionProcessorTestAction", ""}).count);
 }
 
 TEST_F(ActionProcessorTest, DefaultDelegateTest) {
@@ -268,4 +319,96 @@ TEST_F(ActionProcessorTest, StoppedWhileSuspendedTest) {
   EXPECT_EQ(nullptr, action_processor_.current_action());
 }
 
+TEST_F(ActionProcessorTest, OverlapActionsTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  ActionProcessor processor;
+  processor.set_overlap_actions(true);
+  OverlapTestAction::State first_state, second_state;
+  auto first = std::make_unique<OverlapTestAction>(false, &first_state);
+  auto second = std::make_unique<OverlapTestAction>(true, &second_state);
+  OverlapTestAction* first_ptr = first.get();
+  OverlapTestAction* second_ptr = second.get();
+  processor.EnqueueAction(std::move(first));
+  processor.EnqueueAction(std::move(second));
+  processor.StartProcessing();
+  EXPECT_TRUE(first_state.performed);
+  EXPECT_FALSE(second_state.performed);
+
+  // The next action starts from the message loop.
+  first_ptr->PartitionCompleted("system");
+  EXPECT_FALSE(second_state.performed);
+  EXPECT_TRUE(loop.RunOnce(false));
+  EXPECT_TRUE(second_state.performed);
+  EXPECT_TRUE(second_ptr->IsRunning());
+  EXPECT_EQ(first_ptr, processor.current_action());
+  EXPECT_TRUE(second_ptr->IsPartitionReady("system"));
+  EXPECT_FALSE(second_ptr->IsPartitionReady("vendor"));
+  EXPECT_FALSE(second_ptr->AllPartitionsReady());
+
+  first_ptr->PartitionCompleted("vendor");
+  EXPECT_TRUE(loop.RunOnce(false));
+  EXPECT_EQ(1, second_state.num_partitions_ready);
+  EXPECT_TRUE(second_ptr->IsPartitionReady("vendor"));
+
+  // Once the first action completes, the second one is the current action.
+  first_ptr->CompleteAction(ErrorCode::kSuccess);
+  EXPECT_EQ(second_ptr, processor.current_action());
+  EXPECT_EQ(2, second_state.num_partitions_ready);
+  EXPECT_TRUE(second_ptr->AllPartitionsReady());
+  EXPECT_FALSE(second_state.terminated);
+  second_ptr->CompleteAction(ErrorCode::kSuccess);
+  EXPECT_FALSE(processor.IsRunning());
+  EXPECT_FALSE(loop.PendingTasks());
+}
+
+TEST_F(ActionProcessorTest, OverlapActionsDisabledTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  ActionProcessor processor;
+  OverlapTestAction::State first_state, second_state;
+  auto first = std::make_unique<OverlapTestAction>(false, &first_state);
+  OverlapTestAction* first_ptr = first.get();
+  processor.EnqueueAction(std::move(first));
+  processor.EnqueueAction(
+      std::make_unique<OverlapTestAction>(true, &second_state));
+  processor.StartProcessing();
+  first_ptr->PartitionCompleted("system");
+  EXPECT_FALSE(loop.PendingTasks());
+  EXPECT_FALSE(second_state.performed);
+  processor.StopProcessing();
+}
+
+TEST_F(ActionProcessorTest, EarlyActionFailureTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  ActionProcessor processor;
+  MyActionProcessorDelegate delegate(&processor);
+  processor.set_delegate(&delegate);
+  processor.set_overlap_actions(true);
+  OverlapTestAction::State first_state, second_state, third_state;
+  auto first = std::make_unique<OverlapTestAction>(false, &first_state);
+  auto second = std::make_unique<OverlapTestAction>(true, &second_state);
+  OverlapTestAction* first_ptr = first.get();
+  OverlapTestAction* second_ptr = second.get();
+  processor.EnqueueAction(std::move(first));
+  processor.EnqueueAction(std::move(second));
+  processor.EnqueueAction(
+      std::make_unique<OverlapTestAction>(true, &third_state));
+  processor.StartProcessing();
+  first_ptr->PartitionCompleted("system");
+  EXPECT_TRUE(loop.RunOnce(false));
+  ASSERT_TRUE(second_state.performed);
+
+  // The failure of the action started early aborts the one before it.
+  second_ptr->CompleteAction(ErrorCode::kError);
+  EXPECT_TRUE(first_state.terminated);
+  EXPECT_FALSE(third_state.performed);
+  EXPECT_TRUE(delegate.action_completed_called_);
+  EXPECT_EQ(ErrorCode::kError, delegate.action_exit_code_);
+  EXPECT_TRUE(delegate.processing_done_called_);
+  EXPECT_FALSE(processor.IsRunning());
+  processor.set_delegate(nullptr);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/bandwidth_estimator.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "update_engine/common/clock.h"
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The throughput is measured over intervals of at least this length, and
+// averaged with this weight for the newest sample.
+constexpr TimeDelta kSampleInterval = TimeDelta::FromSeconds(1);
+constexpr int kSampleWeight = 4;
+
+// A connection is dropped under this fraction of the throughput, and this
+// rate at most.
+constexpr uint64_t kLowSpeedFraction = 8;
+constexpr uint64_t kMaxLowSpeedLimitBps = 16 * 1024;
+
+// The first retry waits this many round trips, and at least this long.
+constexpr int kRetryRoundTrips = 4;
+constexpr TimeDelta kMinRetryDelay = TimeDelta::FromSeconds(1);
+
+// Samples measured after adding a connection, and at the best number of
+// connections before adding one again.
+constexpr size_t kProbeSamples = 5;
+constexpr size_t kReprobeSamples = 30;
+// The throughput must improve by this much for a connection to be kept.
+constexpr uint64_t kMinGainPercent = 10;
+}  // namespace
+
+BandwidthEstimator::BandwidthEstimator()
+    : BandwidthEstimator(std::make_unique<Clock>()) {}
+
+BandwidthEstimator::BandwidthEstimator(std::unique_ptr<ClockInterface> clock)
+    : clock_(std::move(clock)) {}
+
+bool BandwidthEstimator::BytesReceived(size_t length) {
+  const base::Time now = clock_->GetMonotonicTime();
+  if (sample_start_time_.is_null()) {
+    // These bytes were on their way before the measure started.
+    sample_start_time_ = now;
+    return false;
+  }
+  sample_bytes_ += length;
+  const TimeDelta elapsed = now - sample_start_time_;
+  if (elapsed < kSampleInterval)
+    return false;
+
+  last_sample_ = sample_bytes_ * 1000000 / elapsed.InMicroseconds();
+  if (num_samples_++ == 0) {
+    bytes_per_second_ = last_sample_;
+  } else {
+    bytes_per_second_ =
+        (bytes_per_second_ * (kSampleWeight - 1) + last_sample_) /
+        kSampleWeight;
+  }
+  sample_start_time_ = now;
+  sample_bytes_ = 0;
+  return true;
+}
+
+void BandwidthEstimator::TransferStopped() {
+  sample_start_time_ = base::Time();
+  sample_bytes_ = 0;
+}
+
+void BandwidthEstimator::ConnectionEstablished(TimeDelta connect_time) {
+  if (connect_time <= TimeDelta())
+    return;
+  if (rtt_.is_zero())
+    rtt_ = connect_time;
+  else
+    rtt_ = (rtt_ * (kSampleWeight - 1) + connect_time) / kSampleWeight;
+}
+
+int BandwidthEstimator::GetLowSpeedLimit(int min_bps) const {
+  const uint64_t limit =
+      std::min(bytes_per_second_ / kLowSpeedFraction, kMaxLowSpeedLimitBps);
+  return std::max(min_bps, static_cast<int>(limit));
+}
+
+TimeDelta BandwidthEstimator::GetRetryDelay(int num_failures,
+                                            TimeDelta max_delay) const {
+  TimeDelta delay = std::max(kMinRetryDelay, rtt_ * kRetryRoundTrips);
+  for (int i = 1; i < num_failures && delay < max_delay; i++)
+    delay *= 2;
+  return std::min(delay, max_delay);
+}
+
+void BandwidthEstimator::Reset() {
+  TransferStopped();
+  num_samples_ = 0;
+  last_sample_ = 0;
+  bytes_per_second_ = 0;
+  rtt_ = TimeDelta();
+}
+
+ConnectionTuner::ConnectionTuner(size_t max_connections)
+    : max_connections_(std::max<size_t>(max_connections, 1)) {}
+
+void ConnectionTuner::AddSample(uint64_t bytes_per_second) {
+  // The first sample after a change still partly measures the previous
+  // number of connections.
+  if (num_samples_++ > 0)
+    samples_total_ += bytes_per_second;
+  if (num_samples_ < (settled_ ? kReprobeSamples : kProbeSamples))
+    return;
+  const uint64_t throughput = samples_total_ / (num_samples_ - 1);
+  num_samples_ = 0;
+  samples_total_ = 0;
+
+  if (probing_ && throughput * 100 <
+                      previous_throughput_ * (100 + kMinGainPercent)) {
+    // The network or the server is the limit, not the connections.
+    connections_--;
+    probing_ = false;
+    settled_ = true;
+    return;
+  }
+  probing_ = connections_ < max_connections_;
+  settled_ = !probing_;
+  if (probing_) {
+    previous_throughput_ = throughput;
+    connections_++;
+  }
+}
+
+void ConnectionTuner::Reset() {
+  connections_ = 1;
+  probing_ = settled_ = false;
+  previous_throughput_ = 0;
+  num_samples_ = 0;
+  samples_total_ = 0;
+}
+
+}  // namespace chromeos_update_engine
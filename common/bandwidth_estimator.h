@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_BANDWIDTH_ESTIMATOR_H_
+#define UPDATE_ENGINE_COMMON_BANDWIDTH_ESTIMATOR_H_
+
+#include <memory>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+
+namespace chromeos_update_engine {
+
+// BandwidthEstimator keeps running estimates of the throughput and round trip
+// time of a download, from which the fetchers tune their transfers to the
+// network instead of using settings fixed for the slowest one. It's only used
+// from the message loop thread.
+class BandwidthEstimator {
+ public:
+  BandwidthEstimator();
+  explicit BandwidthEstimator(std::unique_ptr<ClockInterface> clock);
+
+  // Records |length| bytes received. Returns whether this completed a new
+  // throughput sample, see last_sample().
+  bool BytesReceived(size_t length);
+  // Called when the data stops coming for reasons other than the network, for
+  // example when the transfer is paused or ends, so that the time until the
+  // next bytes isn't measured.
+  void TransferStopped();
+  // Records the time taken by the TCP handshake of a new connection, which is
+  // about one round trip.
+  void ConnectionEstablished(base::TimeDelta connect_time);
+
+  // Whether a throughput sample was taken yet, and the throughput measured
+  // over the latest sample interval and averaged over the recent ones, in
+  // bytes per second.
+  bool has_throughput() const { return num_samples_ > 0; }
+  uint64_t last_sample() const { return last_sample_; }
+  uint64_t bytes_per_second() const { return bytes_per_second_; }
+  // The average round trip time, zero until a connection was established.
+  base::TimeDelta rtt() const { return rtt_; }
+
+  // Returns the transfer rate under which the connection is considered
+  // stalled and dropped to resume it: a fraction of the estimated throughput,
+  // so that a connection stuck on a fast network is restarted early, but never
+  // under |min_bps| nor high enough to drop the connection of a network that
+  // is merely slow.
+  int GetLowSpeedLimit(int min_bps) const;
+
+  // Returns how long to wait before retrying a transfer that failed
+  // |num_failures| times in a row without receiving data: a few round trips
+  // the first time, so a connection dropped by a network change resumes
+  // quickly, doubling with each failure up to |max_delay|.
+  base::TimeDelta GetRetryDelay(int num_failures,
+                                base::TimeDelta max_delay) const;
+
+  void Reset();
+
+ private:
+  std::unique_ptr<ClockInterface> clock_;
+
+  // Start of the current sample interval and the bytes received since then;
+  // null when not measuring.
+  base::Time sample_start_time_;
+  uint64_t sample_bytes_{0};
+
+  uint64_t num_samples_{0};
+  uint64_t last_sample_{0};
+  uint64_t bytes_per_second_{0};
+  base::TimeDelta rtt_;
+
+  DISALLOW_COPY_AND_ASSIGN(BandwidthEstimator);
+};
+
+// ConnectionTuner picks how many connections to download over in parallel. It
+// starts with one and adds one at a time, as long as the last one added raised
+// the throughput noticeably, then probes again from time to time as the
+// network changes.
+class ConnectionTuner {
+ public:
+  explicit ConnectionTuner(size_t max_connections);
+
+  // Updates connections() from a new throughput sample, in bytes per second.
+  void AddSample(uint64_t bytes_per_second);
+
+  size_t connections() const { return connections_; }
+
+  void Reset();
+
+ private:
+  const size_t max_connections_;
+  size_t connections_{1};
+
+  // Whether |connections_| was just raised, and the average throughput with
+  // one connection fewer.
+  bool probing_{false};
+  // Whether adding a connection didn't help, or there are already
+  // |max_connections_|, so the next probe waits longer.
+  bool settled_{false};
+  uint64_t previous_throughput_{0};
+
+  // Samples added since |connections_| last changed, and their total after
+  // the first one, which is still measuring the previous setting.
+  size_t num_samples_{0};
+  uint64_t samples_total_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionTuner);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_BANDWIDTH_ESTIMATOR_H_
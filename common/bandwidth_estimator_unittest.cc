@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/bandwidth_estimator.h"
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+class BandwidthEstimatorTest : public ::testing::Test {
+ protected:
+  BandwidthEstimatorTest() {
+    auto clock = std::make_unique<FakeClock>();
+    clock_ = clock.get();
+    clock_->SetMonotonicTime(now_);
+    estimator_ = std::make_unique<BandwidthEstimator>(std::move(clock));
+  }
+
+  void AdvanceTime(TimeDelta delta) {
+    now_ += delta;
+    clock_->SetMonotonicTime(now_);
+  }
+
+  base::Time now_ = base::Time::FromInternalValue(1000000);
+  FakeClock* clock_;
+  std::unique_ptr<BandwidthEstimator> estimator_;
+};
+
+TEST_F(BandwidthEstimatorTest, ThroughputTest) {
+  EXPECT_FALSE(estimator_->has_throughput());
+  // The first bytes only start the measure.
+  EXPECT_FALSE(estimator_->BytesReceived(5000));
+  AdvanceTime(TimeDelta::FromMilliseconds(500));
+  EXPECT_FALSE(estimator_->BytesReceived(1000));
+  AdvanceTime(TimeDelta::FromMilliseconds(1500));
+  EXPECT_TRUE(estimator_->BytesReceived(3000));
+  EXPECT_TRUE(estimator_->has_throughput());
+  EXPECT_EQ(2000u, estimator_->last_sample());
+  EXPECT_EQ(2000u, estimator_->bytes_per_second());
+
+  AdvanceTime(TimeDelta::FromSeconds(1));
+  EXPECT_TRUE(estimator_->BytesReceived(6000));
+  EXPECT_EQ(6000u, estimator_->last_sample());
+  EXPECT_EQ(3000u, estimator_->bytes_per_second());
+
+  // The time while stopped isn't measured.
+  estimator_->TransferStopped();
+  AdvanceTime(TimeDelta::FromSeconds(10));
+  EXPECT_FALSE(estimator_->BytesReceived(1000));
+  AdvanceTime(TimeDelta::FromSeconds(1));
+  EXPECT_TRUE(estimator_->BytesReceived(3000));
+  EXPECT_EQ(3000u, estimator_->last_sample());
+  EXPECT_EQ(3000u, estimator_->bytes_per_second());
+
+  estimator_->Reset();
+  EXPECT_FALSE(estimator_->has_throughput());
+  EXPECT_EQ(0u, estimator_->bytes_per_second());
+}
+
+TEST_F(BandwidthEstimatorTest, LowSpeedLimitTest) {
+  EXPECT_EQ(10, estimator_->GetLowSpeedLimit(10));
+  estimator_->BytesReceived(0);
+  AdvanceTime(TimeDelta::FromSeconds(1));
+  estimator_->BytesReceived(80000);
+  EXPECT_EQ(10000, estimator_->GetLowSpeedLimit(10));
+  EXPECT_EQ(20000, estimator_->GetLowSpeedLimit(20000));
+
+  // Capped on fast networks.
+  estimator_->Reset();
+  estimator_->BytesReceived(0);
+  AdvanceTime(TimeDelta::FromSeconds(1));
+  estimator_->BytesReceived(100 * 1024 * 1024);
+  EXPECT_EQ(16 * 1024, estimator_->GetLowSpeedLimit(10));
+}
+
+TEST_F(BandwidthEstimatorTest, RetryDelayTest) {
+  const TimeDelta max_delay = TimeDelta::FromSeconds(20);
+  EXPECT_EQ(TimeDelta::FromSeconds(1), estimator_->GetRetryDelay(1, max_delay));
+  EXPECT_EQ(TimeDelta::FromSeconds(4), estimator_->GetRetryDelay(3, max_delay));
+  EXPECT_EQ(max_delay, estimator_->GetRetryDelay(10, max_delay));
+  EXPECT_EQ(max_delay, estimator_->GetRetryDelay(1000, max_delay));
+  EXPECT_EQ(TimeDelta::FromSeconds(1),
+            estimator_->GetRetryDelay(1, TimeDelta::FromSeconds(1)));
+
+  estimator_->ConnectionEstablished(TimeDelta::FromMilliseconds(400));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(400), estimator_->rtt());
+  estimator_->ConnectionEstablished(TimeDelta::FromMilliseconds(800));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(500), estimator_->rtt());
+  // Reused connections don't measure anything.
+  estimator_->ConnectionEstablished(TimeDelta());
+  EXPECT_EQ(TimeDelta::FromMilliseconds(500), estimator_->rtt());
+  EXPECT_EQ(TimeDelta::FromSeconds(2), estimator_->GetRetryDelay(1, max_delay));
+  EXPECT_EQ(TimeDelta::FromSeconds(8), estimator_->GetRetryDelay(3, max_delay));
+}
+
+TEST(ConnectionTunerTest, AddsConnectionsWhileTheyHelpTest) {
+  ConnectionTuner tuner(4);
+  EXPECT_EQ(1u, tuner.connections());
+  auto add_samples = [&tuner](size_t count, uint64_t bytes_per_second) {
+    for (size_t i = 0; i < count; i++)
+      tuner.AddSample(bytes_per_second);
+  };
+  add_samples(5, 1000);
+  EXPECT_EQ(2u, tuner.connections());
+  // The first sample after a change isn't counted.
+  add_samples(1, 0);
+  add_samples(4, 1800);
+  EXPECT_EQ(3u, tuner.connections());
+  // Less than 10% better, back to two connections for a while.
+  add_samples(5, 1900);
+  EXPECT_EQ(2u, tuner.connections());
+  add_samples(29, 1800);
+  EXPECT_EQ(2u, tuner.connections());
+  add_samples(1, 1800);
+  EXPECT_EQ(3u, tuner.connections());
+  add_samples(5, 2500);
+  EXPECT_EQ(4u, tuner.connections());
+  add_samples(5, 3000);
+  EXPECT_EQ(4u, tuner.connections());
+
+  tuner.Reset();
+  EXPECT_EQ(1u, tuner.connections());
+}
+
+TEST(ConnectionTunerTest, SingleConnectionTest) {
+  ConnectionTuner tuner(1);
+  for (int i = 0; i < 100; i++)
+    tuner.AddSample(1000);
+  EXPECT_EQ(1u, tuner.connections());
+}
+
+}  // namespace chromeos_update_engine
@@ -110,6 +110,8 @@ static constexpr const auto& kPrefsTargetVersionUniqueId =
     "target-version-unique-id";
 static constexpr const auto& kPrefsTotalBytesDownloaded =
     "total-bytes-downloaded";
+static constexpr const auto& kPrefsTuningProfile = "tuning-profile";
+static constexpr const auto& kPrefsUncompressedCow = "uncompressed-cow";
 static constexpr const auto& kPrefsUpdateCheckCount = "update-check-count";
 static constexpr const auto& kPrefsUpdateCheckResponseHash =
     "update-check-response-hash";
@@ -134,6 +136,10 @@ static constexpr const auto& kPrefsUpdateStateNextDataOffset =
     "update-state-next-data-offset";
 static constexpr const auto& kPrefsUpdateStateNextOperation =
     "update-state-next-operation";
+static constexpr const auto& kPrefsUpdateStateOperationBytesWritten =
+    "update-state-operation-bytes-written";
+static constexpr const auto& kPrefsUpdateStateOperationSHA256Context =
+    "update-state-operation-sha-256-context";
 static constexpr const auto& kPrefsUpdateStatePayloadIndex =
     "update-state-payload-index";
 static constexpr const auto& kPrefsUpdateStateSHA256Context =
@@ -147,6 +153,12 @@ static constexpr const auto& kPrefsUpdateBootTimestampStart =
 static constexpr const auto& kPrefsUpdateTimestampStart =
     "update-timestamp-start";
 static constexpr const auto& kPrefsUrlSwitchCount = "url-switch-count";
+static constexpr const auto& kPrefsVerifierStateOffset =
+    "verifier-state-offset";
+static constexpr const auto& kPrefsVerifierStatePartitionIndex =
+    "verifier-state-partition-index";
+static constexpr const auto& kPrefsVerifierStateSHA256Context =
+    "verifier-state-sha-256-context";
 static constexpr const auto& kPrefsVerityWritten = "verity-written";
 static constexpr const auto& kPrefsWallClockScatteringWaitPeriod =
     "wall-clock-wait-period";
@@ -185,9 +197,111 @@ static constexpr const auto& kPayloadDisableVABC = "DISABLE_VABC";
 static constexpr const auto& kPayloadEnableThreading = "ENABLE_THREADING";
 // Enable batched writes for VABC
 static constexpr const auto& kPayloadBatchedWrites = "BATCHED_WRITES";
+// Apply the payload on a separate thread, overlapping download and install.
+static constexpr const auto& kPayloadPipelinedApply = "PIPELINED_APPLY";
+// Apply independent install operations of a partition in parallel.
+static constexpr const auto& kPayloadParallelInstallOps =
+    "PARALLEL_INSTALL_OPS";
+// Submit batched partition reads and writes through io_uring.
+static constexpr const auto& kPayloadIoUring = "IO_URING";
+// Write the data of large REPLACE operations as it's downloaded.
+static constexpr const auto& kPayloadStreamReplaceOps = "STREAM_REPLACE_OPS";
+// Apply the operations of consecutive partitions concurrently, implies
+// PARALLEL_INSTALL_OPS.
+static constexpr const auto& kPayloadConcurrentPartitions =
+    "CONCURRENT_PARTITIONS";
+// Skip Virtual AB Compression, as with VABC_NONE, if there's enough free space
+// for an uncompressed COW when the partitions are first prepared.
+static constexpr const auto& kPayloadAdaptiveVABCCompression =
+    "ADAPTIVE_VABC_COMPRESSION";
+// Hash the partitions after the update on several threads at once. Set
+// "PARALLEL_VERIFICATION=<n>" to use n threads, defaults to the number of CPUs.
+static constexpr const auto& kPayloadParallelVerification =
+    "PARALLEL_VERIFICATION";
+// Number of bytes read at once when hashing the partitions after the update.
+static constexpr const auto& kPayloadVerifyReadSize = "VERIFY_READ_SIZE";
+// Hash the target partitions as they're written, so that only the data that
+// couldn't be hashed in order is read back after the update.
+static constexpr const auto& kPayloadHashWhileWriting = "HASH_WHILE_WRITING";
+// Build the hash tree of the target partitions from the digests of the blocks
+// copied from the source partitions in the source hash trees, only hashing
+// the blocks the payload changes.
+static constexpr const auto& kPayloadIncrementalVerity = "INCREMENTAL_VERITY";
+// Read the source partitions through their active dm-verity device when its
+// root digest matches the payload, without hashing the source extents.
+static constexpr const auto& kPayloadTrustSourceVerity = "TRUST_SOURCE_VERITY";
+// Hash each source partition once before applying its operations, so that
+// their source extents don't need to be verified one by one.
+static constexpr const auto& kPayloadVerifySourcePartitions =
+    "VERIFY_SOURCE_PARTITIONS";
+// Verify the metadata and prepare the partitions on a separate thread as soon
+// as the metadata is received, while the rest of the payload downloads.
+static constexpr const auto& kPayloadPreparePartitionsEarly =
+    "PREPARE_PARTITIONS_EARLY";
+// Verify each partition as soon as it's written and run its postinstall as
+// soon as it's verified, while the next partitions are still being updated.
+static constexpr const auto& kPayloadOverlapActions = "OVERLAP_ACTIONS";
+// Keep the metadata and the operation data of the payload on disk, up to
+// "BLOB_CACHE_SIZE=<n>" bytes and the free space the COW of the update leaves
+// on /data, so that a new attempt doesn't download them again.
+static constexpr const auto& kPayloadBlobCacheSize = "BLOB_CACHE_SIZE";
+// Keep the buffers of the diff operations larger than "APPLY_MEMORY_BUDGET=<n>"
+// bytes in scratch files, and write the replace operations as they're
+// received, for devices low on memory.
+static constexpr const auto& kPayloadApplyMemoryBudget = "APPLY_MEMORY_BUDGET";
+// Read up to "SOURCE_WARMING_SIZE=<n>" bytes of the source partitions into the
+// page cache ahead of the operations applied, while the payload downloads.
+static constexpr const auto& kPayloadSourceWarmingSize = "SOURCE_WARMING_SIZE";
+// I/O priority of the threads writing the target partitions, "idle", "be:<n>"
+// or "rt:<n>" with n from 0 (highest) to 7.
+static constexpr const auto& kPayloadIoPriority = "IO_PRIORITY";
+// Start the writeback of the target partitions every "WRITEBACK_INTERVAL=<n>"
+// bytes written, bounding the dirty pages and the final fsync().
+static constexpr const auto& kPayloadWritebackInterval = "WRITEBACK_INTERVAL";
+// Write the target partitions with O_DIRECT, bypassing the page cache.
+static constexpr const auto& kPayloadDirectIo = "DIRECT_IO";
+// Copy the blocks of SOURCE_COPY operations within the kernel, without
+// reading them into update_engine.
+static constexpr const auto& kPayloadKernelCopy = "KERNEL_COPY";
+// Discard the blocks of the target partitions the operations rewrite before
+// applying them, so the storage doesn't garbage-collect the old data while the
+// partitions are written.
+static constexpr const auto& kPayloadDiscardTarget = "DISCARD_TARGET";
+// Write back the cached writes to the target partitions on a background thread
+// with two buffers of "WRITE_BACK_BUFFER_SIZE=<bytes>" each.
+static constexpr const auto& kPayloadWriteBackBufferSize =
+    "WRITE_BACK_BUFFER_SIZE";
+// Run up to "POSTINSTALL_CONCURRENCY=<n>" postinstall programs at once, for the
+// partitions that don't depend on each other.
+static constexpr const auto& kPayloadPostinstallConcurrency =
+    "POSTINSTALL_CONCURRENCY";
+// Skip the operations whose destination already holds the data they write,
+// per the target hashes of the operations in the manifest, until the first one
+// that doesn't.
+static constexpr const auto& kPayloadSkipAppliedOperations =
+    "SKIP_APPLIED_OPERATIONS";
+// Size the reads and the threads of the verification from the tuning profile
+// stored by calibrate(), when the headers above don't set them.
+static constexpr const auto& kPayloadUseTuningProfile = "USE_TUNING_PROFILE";
+// Back the large buffers of the apply and verify paths with transparent huge
+// pages.
+static constexpr const auto& kPayloadHugePageBuffers = "HUGE_PAGE_BUFFERS";
+// Record the reads and writes of the install to a trace file in the update
+// engine log directory, to replay them on the host with io_trace_replay.
+static constexpr const auto& kPayloadIoTrace = "IO_TRACE";
 
 // Max retry count for download
 static constexpr const auto& kPayloadDownloadRetry = "DOWNLOAD_RETRY";
+// Number of HTTP connections the payload is downloaded over in parallel.
+static constexpr const auto& kPayloadParallelDownload = "PARALLEL_DOWNLOAD";
+// Tune the download to the measured throughput and round trip time: the low
+// speed limit, the retry delays and, with PARALLEL_DOWNLOAD, the number of
+// connections used and the size of the ranges fetched over them.
+static constexpr const auto& kPayloadAdaptiveDownload = "ADAPTIVE_DOWNLOAD";
+// Comma separated mirrors of the payload URL. The parallel download connections
+// are spread over them, with one connection per URL at least, and the ranges
+// that fail on one of them are fetched from the others.
+static constexpr const auto& kPayloadMirrorUrls = "MIRROR_URLS";
 
 // Set "SWITCH_SLOT_ON_REBOOT=0" to skip marking the updated partitions active.
 // The default is 1 (always switch slot if update succeeded).
@@ -16,10 +16,11 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 
+#include <algorithm>
+#include <utility>
+
 #include <base/logging.h>
 
-#include "update_engine/payload_generator/extent_ranges.h"
-#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -32,12 +33,82 @@ void push_back(std::vector<CowOperation>* converted, const CowOperation& op) {
   }
 }
 
+namespace {
+
+// A range of blocks [start, end).
+using BlockRange = std::pair<uint64_t, uint64_t>;
+
+// Returns the target blocks of the COW_COPY merge operations as sorted,
+// disjoint ranges.
+std::vector<BlockRange> GetCopyRanges(
+    const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations) {
+  std::vector<BlockRange> ranges;
+  for (const auto& merge_op : merge_operations) {
+    if (merge_op.type() != CowMergeOperation::COW_COPY) {
+      continue;
+    }
+    const auto& extent = merge_op.dst_extent();
+    if (extent.num_blocks() > 0) {
+      ranges.emplace_back(extent.start_block(),
+                          extent.start_block() + extent.num_blocks());
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+  size_t num_ranges = 0;
+  for (const auto& range : ranges) {
+    if (num_ranges > 0 && range.first <= ranges[num_ranges - 1].second) {
+      ranges[num_ranges - 1].second =
+          std::max(ranges[num_ranges - 1].second, range.second);
+    } else {
+      ranges[num_ranges++] = range;
+    }
+  }
+  ranges.resize(num_ranges);
+  return ranges;
+}
+
+// Adds the COW_REPLACE operations of the |num_blocks| blocks copied from
+// |src_block| to |dst_block| that aren't in |copy_ranges|.
+void AddReplaceOperations(const std::vector<BlockRange>& copy_ranges,
+                          uint64_t src_block,
+                          uint64_t dst_block,
+                          uint64_t num_blocks,
+                          std::vector<CowOperation>* converted) {
+  const uint64_t end_block = dst_block + num_blocks;
+  // The first copy range ending after |dst_block|.
+  auto it = std::upper_bound(
+      copy_ranges.begin(),
+      copy_ranges.end(),
+      dst_block,
+      [](uint64_t block, const BlockRange& range) {
+        return block < range.second;
+      });
+  uint64_t block = dst_block;
+  while (block < end_block) {
+    if (it != copy_ranges.end() && it->first <= block) {
+      block = it->second;
+      ++it;
+      continue;
+    }
+    const uint64_t next_block =
+        it == copy_ranges.end() ? end_block : std::min(end_block, it->first);
+    push_back(converted,
+              {CowOperation::CowReplace,
+               src_block + (block - dst_block),
+               block,
+               next_block - block});
+    block = next_block;
+  }
+}
+
+}  // namespace
+
 std::vector<CowOperation> ConvertToCowOperations(
     const ::google::protobuf::RepeatedPtrField<
         ::chromeos_update_engine::InstallOperation>& operations,
     const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations) {
-  ExtentRanges merge_extents;
   std::vector<CowOperation> converted;
 
   // We want all CowCopy ops to be done first, before any COW_REPLACE happen.
@@ -46,42 +117,56 @@ std::vector<CowOperation> ConvertToCowOperations(
   // perform CowCopy first.
 
   // This loop handles CowCopy blocks within SOURCE_COPY, and the next loop
-  // converts the leftover blocks to CowReplace?
+  // converts the leftover blocks to CowReplace.
   for (const auto& merge_op : merge_operations) {
-    if (merge_op.type() != CowMergeOperation::COW_COPY) {
+    if (merge_op.type() != CowMergeOperation::COW_COPY ||
+        merge_op.src_extent().num_blocks() == 0) {
       continue;
     }
-    merge_extents.AddExtent(merge_op.dst_extent());
-    const auto& src_extent = merge_op.src_extent();
-    const auto& dst_extent = merge_op.dst_extent();
-    // Add blocks in reverse order, because snapused specifically prefers this
-    // ordering. Since we already eliminated all self-overlapping SOURCE_COPY
-    // during delta generation, this should be safe to do.
-    for (uint64_t i = src_extent.num_blocks(); i > 0; i--) {
-      auto src_block = src_extent.start_block() + i - 1;
-      auto dst_block = dst_extent.start_block() + i - 1;
-      converted.push_back({CowOperation::CowCopy, src_block, dst_block, 1});
-    }
+    // One operation per merge operation. Its blocks are to be written in
+    // reverse order, because snapuserd specifically prefers this ordering.
+    // Since we already eliminated all self-overlapping SOURCE_COPY during
+    // delta generation, this should be safe to do.
+    converted.push_back({CowOperation::CowCopy,
+                         merge_op.src_extent().start_block(),
+                         merge_op.dst_extent().start_block(),
+                         merge_op.src_extent().num_blocks()});
   }
   // COW_REPLACE are added after COW_COPY, because replace might modify blocks
   // needed by COW_COPY. Please don't merge this loop with the previous one.
+  const auto copy_ranges = GetCopyRanges(merge_operations);
   for (const auto& operation : operations) {
     if (operation.type() != InstallOperation::SOURCE_COPY) {
       continue;
     }
+    // Walks the runs where both the source and target blocks are contiguous.
     const auto& src_extents = operation.src_extents();
     const auto& dst_extents = operation.dst_extents();
-    BlockIterator it1{src_extents};
-    BlockIterator it2{dst_extents};
-    while (!it1.is_end() && !it2.is_end()) {
-      const auto src_block = *it1;
-      const auto dst_block = *it2;
-      if (!merge_extents.ContainsBlock(dst_block)) {
-        push_back(&converted,
-                  {CowOperation::CowReplace, src_block, dst_block, 1});
+    int src_index = 0;
+    int dst_index = 0;
+    uint64_t src_offset = 0;
+    uint64_t dst_offset = 0;
+    while (src_index < src_extents.size() && dst_index < dst_extents.size()) {
+      const auto& src_extent = src_extents[src_index];
+      const auto& dst_extent = dst_extents[dst_index];
+      const uint64_t num_blocks =
+          std::min(src_extent.num_blocks() - src_offset,
+                   dst_extent.num_blocks() - dst_offset);
+      AddReplaceOperations(copy_ranges,
+                           src_extent.start_block() + src_offset,
+                           dst_extent.start_block() + dst_offset,
+                           num_blocks,
+                           &converted);
+      src_offset += num_blocks;
+      dst_offset += num_blocks;
+      if (src_offset == src_extent.num_blocks()) {
+        src_index++;
+        src_offset = 0;
+      }
+      if (dst_offset == dst_extent.num_blocks()) {
+        dst_index++;
+        dst_offset = 0;
       }
-      ++it1;
-      ++it2;
     }
   }
   return converted;
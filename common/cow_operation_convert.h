@@ -46,6 +46,10 @@ struct CowOperation {
 // returned list is that if operations are applied in such order, there would be
 // no merge conflicts.
 
+// There is one COW_COPY per COW_COPY merge operation, whose blocks are to be
+// applied in reverse order, and the COW_REPLACE are coalesced, so the list is
+// proportional to the number of merge operations and extents, not blocks.
+
 // This funnction is intended to be used by delta_performer to perform
 // SOURCE_COPY operations on Virtual AB Compression devices.
 std::vector<CowOperation> ConvertToCowOperations(
@@ -217,7 +217,7 @@ TEST_F(CowOperationConvertTest, InterleavingSrcExtent) {
 
   auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
   // Expect 4 COW_COPY
-  ASSERT_EQ(cow_ops.size(), 12UL);
+  ASSERT_EQ(cow_ops.size(), 4UL);
   ASSERT_TRUE(std::all_of(cow_ops.begin(), cow_ops.end(), [](auto&& cow_op) {
     return cow_op.op == CowOperation::CowCopy;
   }));
@@ -232,8 +232,9 @@ TEST_F(CowOperationConvertTest, SelfOverlappingOperation) {
       &merge_operations_, CowMergeOperation::COW_COPY, {20, 10}, {25, 10});
 
   auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
-  // Expect 10 COW_COPY
-  ASSERT_EQ(cow_ops.size(), 10UL);
+  // Expect 1 COW_COPY of 10 blocks
+  ASSERT_EQ(cow_ops.size(), 1UL);
+  ASSERT_EQ(cow_ops[0].block_count, 10UL);
   ASSERT_TRUE(std::all_of(cow_ops.begin(), cow_ops.end(), [](auto&& cow_op) {
     return cow_op.op == CowOperation::CowCopy;
   }));
@@ -297,4 +298,35 @@ TEST_F(CowOperationConvertTest, CowReplaceDifferenceSrc) {
   VerifyCowMergeOp(cow_ops);
 }
 
+TEST_F(CowOperationConvertTest, LargeRunsTest) {
+  AddOperation(&operations_,
+               InstallOperation::SOURCE_COPY,
+               {{1000000, 500000}, {0, 500000}},
+               {{0, 250000}, {2000000, 750000}});
+  AddMergeOperation(&merge_operations_,
+                    CowMergeOperation::COW_COPY,
+                    {1100000, 100000},
+                    {100000, 100000});
+  AddMergeOperation(&merge_operations_,
+                    CowMergeOperation::COW_COPY,
+                    {1000000, 100000},
+                    {0, 100000});
+
+  auto cow_ops = ConvertToCowOperations(operations_, merge_operations_);
+  // The two copies, then the blocks left are replaced in one run per
+  // contiguous source and target run, whatever the number of blocks.
+  ASSERT_EQ(cow_ops.size(), 5UL);
+  ASSERT_EQ(cow_ops[2].op, CowOperation::CowReplace);
+  ASSERT_EQ(cow_ops[2].src_block, 1200000UL);
+  ASSERT_EQ(cow_ops[2].dst_block, 200000UL);
+  ASSERT_EQ(cow_ops[2].block_count, 50000UL);
+  ASSERT_EQ(cow_ops[3].src_block, 1250000UL);
+  ASSERT_EQ(cow_ops[3].dst_block, 2000000UL);
+  ASSERT_EQ(cow_ops[3].block_count, 250000UL);
+  ASSERT_EQ(cow_ops[4].src_block, 0UL);
+  ASSERT_EQ(cow_ops[4].dst_block, 2250000UL);
+  ASSERT_EQ(cow_ops[4].block_count, 500000UL);
+  VerifyCowMergeOp(cow_ops);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,321 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/cpu_kernels.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <atomic>
+#include <mutex>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kCpuKernelsEnv[] = "UPDATE_ENGINE_CPU_KERNELS";
+
+// The vector loops of each variant leave the last bytes, from |i|, to these.
+void XorBytesFrom(const uint8_t* src, size_t size, uint8_t* dst, size_t i) {
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+    memcpy(&a, src + i, sizeof(a));
+    memcpy(&b, dst + i, sizeof(b));
+    b ^= a;
+    memcpy(dst + i, &b, sizeof(b));
+  }
+  for (; i < size; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+bool IsZeroFrom(const uint8_t* data, size_t size, size_t i) {
+  uint64_t bits = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    bits |= word;
+    // Checked once per cache line, not to stop on every word.
+    if (i % 64 == 0 && bits)
+      return false;
+  }
+  for (; i < size; i++) {
+    bits |= data[i];
+  }
+  return bits == 0;
+}
+
+void GenericXorBytes(const void* data, size_t size, void* buffer) {
+  XorBytesFrom(static_cast<const uint8_t*>(data),
+               size,
+               static_cast<uint8_t*>(buffer),
+               0);
+}
+
+bool GenericIsZero(const void* data, size_t size) {
+  return IsZeroFrom(static_cast<const uint8_t*>(data), size, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void Sse2XorBytes(const void* data,
+                                                  size_t size,
+                                                  void* buffer) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  uint8_t* dst = static_cast<uint8_t*>(buffer);
+  size_t i = 0;
+  // Four registers per iteration so the loads of the next ones overlap with
+  // the XORs.
+  for (; i + 64 <= size; i += 64) {
+    const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+    __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+    __m128i a = _mm_xor_si128(_mm_loadu_si128(s), _mm_loadu_si128(d));
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(s + 1), _mm_loadu_si128(d + 1));
+    __m128i c = _mm_xor_si128(_mm_loadu_si128(s + 2), _mm_loadu_si128(d + 2));
+    __m128i e = _mm_xor_si128(_mm_loadu_si128(s + 3), _mm_loadu_si128(d + 3));
+    _mm_storeu_si128(d, a);
+    _mm_storeu_si128(d + 1, b);
+    _mm_storeu_si128(d + 2, c);
+    _mm_storeu_si128(d + 3, e);
+  }
+  for (; i + 16 <= size; i += 16) {
+    __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+    _mm_storeu_si128(
+        d,
+        _mm_xor_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)),
+            _mm_loadu_si128(d)));
+  }
+  XorBytesFrom(src, size, dst, i);
+}
+
+__attribute__((target("sse2"))) bool Sse2IsZero(const void* data,
+                                                size_t size) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+    const __m128i bits =
+        _mm_or_si128(_mm_or_si128(_mm_loadu_si128(s), _mm_loadu_si128(s + 1)),
+                     _mm_or_si128(_mm_loadu_si128(s + 2),
+                                  _mm_loadu_si128(s + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) !=
+        0xffff) {
+      return false;
+    }
+  }
+  return IsZeroFrom(src, size, i);
+}
+
+__attribute__((target("avx2"))) void Avx2XorBytes(const void* data,
+                                                  size_t size,
+                                                  void* buffer) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  uint8_t* dst = static_cast<uint8_t*>(buffer);
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    const __m256i* s = reinterpret_cast<const __m256i*>(src + i);
+    __m256i* d = reinterpret_cast<__m256i*>(dst + i);
+    __m256i a =
+        _mm256_xor_si256(_mm256_loadu_si256(s), _mm256_loadu_si256(d));
+    __m256i b =
+        _mm256_xor_si256(_mm256_loadu_si256(s + 1), _mm256_loadu_si256(d + 1));
+    __m256i c =
+        _mm256_xor_si256(_mm256_loadu_si256(s + 2), _mm256_loadu_si256(d + 2));
+    __m256i e =
+        _mm256_xor_si256(_mm256_loadu_si256(s + 3), _mm256_loadu_si256(d + 3));
+    _mm256_storeu_si256(d, a);
+    _mm256_storeu_si256(d + 1, b);
+    _mm256_storeu_si256(d + 2, c);
+    _mm256_storeu_si256(d + 3, e);
+  }
+  for (; i + 32 <= size; i += 32) {
+    __m256i* d = reinterpret_cast<__m256i*>(dst + i);
+    _mm256_storeu_si256(
+        d,
+        _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)),
+            _mm256_loadu_si256(d)));
+  }
+  XorBytesFrom(src, size, dst, i);
+}
+
+__attribute__((target("avx2"))) bool Avx2IsZero(const void* data,
+                                                size_t size) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    const __m256i* s = reinterpret_cast<const __m256i*>(src + i);
+    const __m256i bits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256(s), _mm256_loadu_si256(s + 1)),
+        _mm256_or_si256(_mm256_loadu_si256(s + 2), _mm256_loadu_si256(s + 3)));
+    if (!_mm256_testz_si256(bits, bits))
+      return false;
+  }
+  return IsZeroFrom(src, size, i);
+}
+#elif defined(__ARM_NEON)
+void NeonXorBytes(const void* data, size_t size, void* buffer) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  uint8_t* dst = static_cast<uint8_t*>(buffer);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    uint8x16x4_t a = vld1q_u8_x4(src + i);
+    uint8x16x4_t b = vld1q_u8_x4(dst + i);
+    b.val[0] = veorq_u8(a.val[0], b.val[0]);
+    b.val[1] = veorq_u8(a.val[1], b.val[1]);
+    b.val[2] = veorq_u8(a.val[2], b.val[2]);
+    b.val[3] = veorq_u8(a.val[3], b.val[3]);
+    vst1q_u8_x4(dst + i, b);
+  }
+  for (; i + 16 <= size; i += 16) {
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), vld1q_u8(dst + i)));
+  }
+  XorBytesFrom(src, size, dst, i);
+}
+
+bool NeonIsZero(const void* data, size_t size) {
+  const uint8_t* src = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const uint8x16x4_t a = vld1q_u8_x4(src + i);
+    const uint64x2_t bits = vreinterpretq_u64_u8(vorrq_u8(
+        vorrq_u8(a.val[0], a.val[1]), vorrq_u8(a.val[2], a.val[3])));
+    if (vgetq_lane_u64(bits, 0) | vgetq_lane_u64(bits, 1))
+      return false;
+  }
+  return IsZeroFrom(src, size, i);
+}
+#endif
+
+const CpuKernels kGenericKernels = {
+    CpuKernelVariant::kGeneric, "generic", GenericXorBytes, GenericIsZero};
+#if defined(__x86_64__) || defined(__i386__)
+const CpuKernels kSse2Kernels = {
+    CpuKernelVariant::kSse2, "sse2", Sse2XorBytes, Sse2IsZero};
+const CpuKernels kAvx2Kernels = {
+    CpuKernelVariant::kAvx2, "avx2", Avx2XorBytes, Avx2IsZero};
+#elif defined(__ARM_NEON)
+const CpuKernels kNeonKernels = {
+    CpuKernelVariant::kNeon, "neon", NeonXorBytes, NeonIsZero};
+#endif
+
+std::atomic<const CpuKernels*> g_kernels{nullptr};
+
+const CpuKernels* SelectCpuKernels() {
+  const std::vector<const CpuKernels*> supported = GetSupportedCpuKernels();
+  const char* forced = getenv(kCpuKernelsEnv);
+  if (forced) {
+    for (const CpuKernels* kernels : supported) {
+      if (strcmp(kernels->name, forced) == 0 && SelfTestCpuKernels(*kernels))
+        return kernels;
+    }
+    LOG(ERROR) << "Can't use the " << forced << " CPU kernels named by "
+               << kCpuKernelsEnv << ".";
+  }
+  for (auto it = supported.rbegin(); it != supported.rend(); it++) {
+    if (SelfTestCpuKernels(**it))
+      return *it;
+    LOG(ERROR) << "The " << (*it)->name << " CPU kernels failed their "
+               << "self-test.";
+  }
+  return &kGenericKernels;
+}
+}  // namespace
+
+const CpuKernels& GetCpuKernels() {
+  const CpuKernels* kernels = g_kernels.load(std::memory_order_acquire);
+  if (kernels)
+    return *kernels;
+  static std::once_flag selected;
+  std::call_once(selected, [] {
+    const CpuKernels* expected = nullptr;
+    g_kernels.compare_exchange_strong(expected, SelectCpuKernels());
+  });
+  return *g_kernels.load(std::memory_order_acquire);
+}
+
+std::vector<const CpuKernels*> GetSupportedCpuKernels() {
+  std::vector<const CpuKernels*> supported = {&kGenericKernels};
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    supported.push_back(&kSse2Kernels);
+  if (__builtin_cpu_supports("avx2"))
+    supported.push_back(&kAvx2Kernels);
+#elif defined(__ARM_NEON)
+  supported.push_back(&kNeonKernels);
+#endif
+  return supported;
+}
+
+bool ForceCpuKernels(const std::string& name) {
+  for (const CpuKernels* kernels : GetSupportedCpuKernels()) {
+    if (kernels->name == name) {
+      if (!SelfTestCpuKernels(*kernels))
+        return false;
+      g_kernels.store(kernels, std::memory_order_release);
+      LOG(INFO) << "Using the " << name << " CPU kernels.";
+      return true;
+    }
+  }
+  LOG(ERROR) << "The " << name << " CPU kernels are not supported.";
+  return false;
+}
+
+bool SelfTestCpuKernels(const CpuKernels& kernels) {
+  // Covers the vector loops, the word loop and the byte tail of every
+  // variant, with unaligned buffers.
+  uint8_t data[512 + 3], buffer[512 + 3], expected[512 + 3];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = static_cast<uint8_t>(i * 13 + 5);
+  }
+  for (size_t size : {0, 1, 7, 8, 31, 32, 63, 64, 127, 128, 129, 500, 512}) {
+    for (size_t offset : {0, 1, 3}) {
+      for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = expected[i] = static_cast<uint8_t>(i * 7 + 1);
+      }
+      GenericXorBytes(data + offset, size, expected + offset);
+      kernels.xor_bytes(data + offset, size, buffer + offset);
+      if (memcmp(buffer, expected, sizeof(buffer)) != 0)
+        return false;
+
+      // All zeros, then with a single byte set at each end.
+      memset(buffer, 0, sizeof(buffer));
+      if (!kernels.is_zero(buffer + offset, size))
+        return false;
+      if (size == 0)
+        continue;
+      for (size_t i : {offset, offset + size - 1}) {
+        buffer[i] = 0x80;
+        if (kernels.is_zero(buffer + offset, size))
+          return false;
+        buffer[i] = 0;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
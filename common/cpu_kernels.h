@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_CPU_KERNELS_H_
+#define UPDATE_ENGINE_COMMON_CPU_KERNELS_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// The implementations of the loops run over every byte of the blocks of an
+// update, on the device and on the host. The variants using the wider vector
+// registers are only built for the architectures that have them, and only
+// selected on the CPUs that support them.
+enum class CpuKernelVariant {
+  kGeneric,
+  kSse2,
+  kAvx2,
+  kNeon,
+};
+
+struct CpuKernels {
+  CpuKernelVariant variant;
+  // Name of the variant, like "avx2".
+  const char* name;
+  // XORs |size| bytes of |data| into |buffer|, in place. The two may not
+  // overlap unless they're the same.
+  void (*xor_bytes)(const void* data, size_t size, void* buffer);
+  // Returns whether the |size| bytes of |data| are all zeros.
+  bool (*is_zero)(const void* data, size_t size);
+};
+
+// Returns the kernels to use, selected on the first call: the fastest variant
+// supported by the build and the CPU that passes SelfTestCpuKernels(). The
+// UPDATE_ENGINE_CPU_KERNELS environment variable may name the variant to
+// select instead, to compare them in benchmarks.
+const CpuKernels& GetCpuKernels();
+
+// Returns the variants supported by the build and the CPU, the generic one
+// first and the fastest last.
+std::vector<const CpuKernels*> GetSupportedCpuKernels();
+
+// Uses the variant named |name| from now on. Returns false and keeps the
+// current variant if it isn't supported or fails its self-test.
+bool ForceCpuKernels(const std::string& name);
+
+// Returns whether |kernels| give the same results as the generic ones over
+// buffers of assorted sizes and alignments.
+bool SelfTestCpuKernels(const CpuKernels& kernels);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_CPU_KERNELS_H_
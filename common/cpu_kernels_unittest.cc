@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/cpu_kernels.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+bool AlwaysZero(const void* /* data */, size_t /* size */) {
+  return true;
+}
+}  // namespace
+
+TEST(CpuKernelsTest, SupportedKernelsTest) {
+  const vector<const CpuKernels*> supported = GetSupportedCpuKernels();
+  ASSERT_FALSE(supported.empty());
+  EXPECT_EQ(CpuKernelVariant::kGeneric, supported[0]->variant);
+  for (const CpuKernels* kernels : supported) {
+    EXPECT_TRUE(SelfTestCpuKernels(*kernels)) << kernels->name;
+
+    // A single byte set anywhere in a few blocks.
+    vector<uint8_t> data(3 * 4096 + 5);
+    EXPECT_TRUE(kernels->is_zero(data.data(), data.size()));
+    for (size_t i = 0; i < data.size(); i += 97) {
+      data[i] = 1;
+      EXPECT_FALSE(kernels->is_zero(data.data(), data.size()))
+          << kernels->name << " " << i;
+      data[i] = 0;
+    }
+  }
+}
+
+TEST(CpuKernelsTest, SelfTestFailsTest) {
+  CpuKernels broken = *GetSupportedCpuKernels()[0];
+  broken.is_zero = AlwaysZero;
+  EXPECT_FALSE(SelfTestCpuKernels(broken));
+}
+
+TEST(CpuKernelsTest, ForceKernelsTest) {
+  const string selected = GetCpuKernels().name;
+
+  EXPECT_TRUE(ForceCpuKernels("generic"));
+  EXPECT_EQ(CpuKernelVariant::kGeneric, GetCpuKernels().variant);
+  EXPECT_FALSE(ForceCpuKernels("unknown"));
+  EXPECT_EQ(CpuKernelVariant::kGeneric, GetCpuKernels().variant);
+
+  EXPECT_TRUE(ForceCpuKernels(selected));
+  EXPECT_EQ(selected, GetCpuKernels().name);
+}
+
+}  // namespace chromeos_update_engine
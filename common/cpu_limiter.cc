@@ -16,7 +16,9 @@
 
 #include "update_engine/common/cpu_limiter.h"
 
+#include <algorithm>
 #include <string>
+#include <utility>
 
 #include <base/bind.h>
 #include <base/logging.h>
@@ -85,4 +87,66 @@ void CPULimiter::StopLimiterCallback() {
   manage_shares_id_ = brillo::MessageLoop::kTaskIdNull;
 }
 
+AdaptiveCPULimiter::AdaptiveCPULimiter(SetSharesCallback set_shares)
+    : set_shares_(std::move(set_shares)) {}
+
+void AdaptiveCPULimiter::Start(CpuShares shares) {
+  Stop();
+  shares_ = shares;
+  if (!set_shares_.Run(shares_)) {
+    LOG(WARNING) << "Failed to set the cpu shares to "
+                 << static_cast<int>(shares_);
+  }
+  SchedulePoll();
+}
+
+void AdaptiveCPULimiter::Stop() {
+  poll_task_id_.Cancel();
+}
+
+CpuShares AdaptiveCPULimiter::NextShares(CpuShares shares,
+                                         const PressureStall* cpu,
+                                         const PressureStall* io) {
+  if (cpu == nullptr && io == nullptr)
+    return shares;
+  const double pressure = std::max(cpu ? cpu->some_avg10 : 0.0,
+                                   io ? io->some_avg10 : 0.0);
+  if (pressure >= kBusyPressure) {
+    return shares == CpuShares::kHigh ? CpuShares::kNormal : CpuShares::kLow;
+  }
+  if (pressure < kIdlePressure) {
+    return shares == CpuShares::kLow ? CpuShares::kNormal : CpuShares::kHigh;
+  }
+  return shares;
+}
+
+void AdaptiveCPULimiter::Poll() {
+  PressureStall cpu;
+  PressureStall io;
+  const bool has_cpu = ReadCpuPressure(&cpu);
+  const bool has_io = ReadIoPressure(&io);
+  const CpuShares shares = NextShares(
+      shares_, has_cpu ? &cpu : nullptr, has_io ? &io : nullptr);
+  if (shares != shares_) {
+    LOG(INFO) << "Changing the cpu shares from " << static_cast<int>(shares_)
+              << " to " << static_cast<int>(shares) << ", cpu pressure "
+              << (has_cpu ? base::NumberToString(cpu.some_avg10) : "n/a")
+              << ", io pressure "
+              << (has_io ? base::NumberToString(io.some_avg10) : "n/a");
+    if (set_shares_.Run(shares)) {
+      shares_ = shares;
+    } else {
+      LOG(WARNING) << "Failed to set the cpu shares.";
+    }
+  }
+  SchedulePoll();
+}
+
+void AdaptiveCPULimiter::SchedulePoll() {
+  CHECK(poll_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&AdaptiveCPULimiter::Poll, base::Unretained(this)),
+      kPollInterval));
+}
+
 }  // namespace chromeos_update_engine
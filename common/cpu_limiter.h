@@ -17,8 +17,14 @@
 #ifndef UPDATE_ENGINE_COMMON_CPU_LIMITER_H_
 #define UPDATE_ENGINE_COMMON_CPU_LIMITER_H_
 
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
+#include "update_engine/common/pressure_stall.h"
+#include "update_engine/common/scoped_task_id.h"
+
 namespace chromeos_update_engine {
 
 // Cgroups cpu shares constants. 1024 is the default shares a standard process
@@ -58,6 +64,57 @@ class CPULimiter {
       brillo::MessageLoop::kTaskIdNull};
 };
 
+// AdaptiveCPULimiter adjusts the cpu shares of update_engine to the CPU and
+// I/O pressure of the device, polled every |kPollInterval|. The shares are
+// stepped up towards kHigh while the device is idle, so that a background
+// update finishes as fast as possible, and down towards kLow while tasks are
+// stalled, so that it stays unnoticed. They are applied by the |set_shares|
+// callback, which may also change the I/O priority. The pressure caused by
+// update_engine itself is part of what the kernel reports, so the shares
+// only move one step per poll and the two thresholds are far apart.
+class AdaptiveCPULimiter {
+ public:
+  using SetSharesCallback = base::RepeatingCallback<bool(CpuShares shares)>;
+
+  // The device is considered busy at or above this "some" pressure, of either
+  // the CPU or I/O, and idle below |kIdlePressure|.
+  static constexpr double kBusyPressure = 40.0;
+  static constexpr double kIdlePressure = 10.0;
+  // The pressure is averaged over 10 seconds by the kernel.
+  static constexpr base::TimeDelta kPollInterval =
+      base::TimeDelta::FromSeconds(10);
+
+  explicit AdaptiveCPULimiter(SetSharesCallback set_shares);
+  ~AdaptiveCPULimiter() = default;
+
+  // Sets the shares to |shares| and adjusts them until Stop() is called.
+  void Start(CpuShares shares);
+
+  // Stops adjusting the shares, leaving them as they are.
+  void Stop();
+
+  bool IsRunning() const { return poll_task_id_.IsScheduled(); }
+  CpuShares shares() const { return shares_; }
+
+  // Returns the shares to use after |shares| given the current |cpu| and |io|
+  // pressure, either of which is null if unknown.
+  static CpuShares NextShares(CpuShares shares,
+                              const PressureStall* cpu,
+                              const PressureStall* io);
+
+ private:
+  // Reads the pressure, applies the next shares and schedules the next poll.
+  void Poll();
+
+  void SchedulePoll();
+
+  SetSharesCallback set_shares_;
+  CpuShares shares_{CpuShares::kNormal};
+  ScopedTaskId poll_task_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(AdaptiveCPULimiter);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_COMMON_CPU_LIMITER_H_
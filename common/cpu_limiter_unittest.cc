@@ -16,6 +16,10 @@
 
 #include "update_engine/common/cpu_limiter.h"
 
+#include <vector>
+
+#include <base/bind.h>
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gtest/gtest.h>
 
 namespace chromeos_update_engine {
@@ -29,6 +33,17 @@ namespace {
 int CompareCpuShares(CpuShares shares_lhs, CpuShares shares_rhs) {
   return static_cast<int>(shares_lhs) - static_cast<int>(shares_rhs);
 }
+
+bool RecordShares(std::vector<CpuShares>* set_shares, CpuShares shares) {
+  set_shares->push_back(shares);
+  return true;
+}
+
+PressureStall MakePressure(double some) {
+  PressureStall pressure;
+  pressure.some_avg10 = some;
+  return pressure;
+}
 }  // namespace
 
 // Tests the CPU shares enum is in the order we expect it.
@@ -39,4 +54,54 @@ TEST(CPULimiterTest, CompareCpuSharesTest) {
   EXPECT_GT(CompareCpuShares(CpuShares::kHigh, CpuShares::kNormal), 0);
 }
 
+TEST(CPULimiterTest, NextSharesTest) {
+  const PressureStall idle =
+      MakePressure(AdaptiveCPULimiter::kIdlePressure / 2);
+  const PressureStall busy = MakePressure(AdaptiveCPULimiter::kBusyPressure);
+  const PressureStall moderate = MakePressure(
+      (AdaptiveCPULimiter::kIdlePressure + AdaptiveCPULimiter::kBusyPressure) /
+      2);
+
+  // The shares move one step at a time.
+  EXPECT_EQ(CpuShares::kNormal,
+            AdaptiveCPULimiter::NextShares(CpuShares::kLow, &idle, &idle));
+  EXPECT_EQ(CpuShares::kHigh,
+            AdaptiveCPULimiter::NextShares(CpuShares::kNormal, &idle, &idle));
+  EXPECT_EQ(CpuShares::kHigh,
+            AdaptiveCPULimiter::NextShares(CpuShares::kHigh, &idle, &idle));
+  EXPECT_EQ(CpuShares::kNormal,
+            AdaptiveCPULimiter::NextShares(CpuShares::kHigh, &idle, &busy));
+  EXPECT_EQ(CpuShares::kLow,
+            AdaptiveCPULimiter::NextShares(CpuShares::kNormal, &busy, &idle));
+  EXPECT_EQ(CpuShares::kLow,
+            AdaptiveCPULimiter::NextShares(CpuShares::kLow, &busy, nullptr));
+
+  // Nothing changes between the thresholds or without pressure information.
+  EXPECT_EQ(
+      CpuShares::kHigh,
+      AdaptiveCPULimiter::NextShares(CpuShares::kHigh, &moderate, &idle));
+  EXPECT_EQ(CpuShares::kLow,
+            AdaptiveCPULimiter::NextShares(CpuShares::kLow, nullptr, nullptr));
+}
+
+TEST(CPULimiterTest, AdaptiveLimiterStartStopTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  std::vector<CpuShares> set_shares;
+  AdaptiveCPULimiter limiter(base::BindRepeating(&RecordShares, &set_shares));
+  EXPECT_FALSE(limiter.IsRunning());
+
+  limiter.Start(CpuShares::kLow);
+  EXPECT_TRUE(limiter.IsRunning());
+  EXPECT_EQ(std::vector<CpuShares>({CpuShares::kLow}), set_shares);
+
+  // Polls whether or not the kernel reports the pressure.
+  EXPECT_TRUE(loop.RunOnce(false));
+  EXPECT_TRUE(limiter.IsRunning());
+
+  limiter.Stop();
+  EXPECT_FALSE(limiter.IsRunning());
+  EXPECT_FALSE(loop.PendingTasks());
+}
+
 }  // namespace chromeos_update_engine
@@ -21,15 +21,26 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#include <base/callback.h>
 
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/download_metrics.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/blob_cache.h"
 #include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/install_operation_metrics.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/pipelined_payload_writer.h"
 
 // The Download Action downloads a specified url to disk. The url should point
 // to an update in a delta payload format. The payload will be piped into a
@@ -108,9 +119,34 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
 
+  // Downloads the payload over |fetchers| too, in parallel with the fetcher
+  // passed to the constructor. Takes ownership of the fetchers.
+  void SetParallelFetchers(std::vector<std::unique_ptr<HttpFetcher>> fetchers);
+
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
+  // Reuses the pieces of the payloads found in |blob_cache| instead of
+  // downloading them again, and stores the downloaded ones in it. Must outlive
+  // this object. May be nullptr.
+  void set_blob_cache(BlobCache* blob_cache) { blob_cache_ = blob_cache; }
+
+  // Resources used by the install operations applied by this action so far.
+  const InstallOperationMetrics& operation_metrics() const {
+    return operation_metrics_;
+  }
+
+  // Timings of the download of the payloads by this action so far.
+  const DownloadMetrics& download_metrics() const { return download_metrics_; }
+
+  // Bytes received and waiting to be applied with pipelined apply, 0
+  // otherwise.
+  size_t pipelined_bytes() const;
+
  private:
+  // Creates a new |delta_performer_| for |payload_|, which resets all its
+  // state.
+  void CreateDeltaPerformer();
+
   // Attempt to load cached manifest data from prefs
   // return true on success, false otherwise.
   bool LoadCachedManifest(int64_t manifest_size);
@@ -118,6 +154,58 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // When starting a payload from the beginning, writes its metadata from
+  // |blob_cache_| if it's there, and only adds the ranges of the payload which
+  // data isn't cached to |http_fetcher_|. Returns false if nothing was added.
+  bool UseBlobCache();
+
+  // Once the manifest is parsed, aligns the chunks of the parallel download to
+  // the data blobs of the operations, so that the blobs needed next aren't
+  // split between a fetcher and the one behind it.
+  void MaybeSetChunkBoundaries();
+
+  // Hands the received bytes to |delta_performer_|, either directly or through
+  // |pipelined_writer_| when pipelined apply is enabled.
+  bool WriteToPerformer(const void* bytes, size_t length);
+
+  // Called with the received bytes while the partitions are prepared early.
+  // Collects the metadata of the payload and starts |metadata_thread_| once
+  // it's complete, then buffers the following bytes in |pending_bytes_|.
+  void BufferEarlyBytes(const void* bytes, size_t length);
+
+  // Periodically called while |metadata_thread_| runs. Once it's done, runs
+  // |after_metadata_thread_| if anything was deferred, otherwise writes the
+  // bytes received meanwhile and resumes the transfer if it was paused.
+  void CheckMetadataThread();
+
+  // Whether |metadata_thread_| still uses |delta_performer_|. The main loop
+  // never waits for it, what needs |delta_performer_| meanwhile is deferred
+  // to |after_metadata_thread_|.
+  bool IsMetadataThreadRunning() const;
+
+  // Stops the apply of the payload and closes |delta_performer_|.
+  void CloseDeltaPerformer();
+
+  // Waits for |metadata_thread_|, then writes the metadata if it wasn't
+  // complete yet and the bytes received meanwhile. Returns false and sets
+  // |code_| on failure.
+  bool WriteEarlyBytes();
+
+  void JoinMetadataThread();
+
+  // Periodically called while the transfer is paused because
+  // |pipelined_writer_| is full. Resumes the transfer once enough data has
+  // been applied, or terminates it if applying failed.
+  void CheckPipelineBackpressure();
+
+  // Called by |delta_performer_| once it applied |partition|, maybe on the
+  // pipeline thread. Keeps it for ReportAppliedPartitions() with a copy of
+  // the install plan at that point.
+  void OnPartitionApplied(const std::string& partition);
+  // Sets the install plan as the output object and lets the next action work
+  // on the partitions kept by OnPartitionApplied().
+  void ReportAppliedPartitions();
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -126,6 +214,10 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   BootControlInterface* boot_control_;
   HardwareInterface* hardware_;
 
+  // Filled by |http_fetcher_|, and by this action for the time the transfer
+  // waits for |delta_performer_|, so it's declared first to outlive them.
+  DownloadMetrics download_metrics_;
+
   // Pointer to the MultiRangeHttpFetcher that does the http work.
   std::unique_ptr<MultiRangeHttpFetcher> http_fetcher_;
 
@@ -134,8 +226,47 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // update.
   bool interactive_;
 
+  // Filled by |delta_performer_| as it applies the operations, so it's
+  // declared first to outlive it.
+  InstallOperationMetrics operation_metrics_;
+  BlobCache* blob_cache_{nullptr};
   std::unique_ptr<DeltaPerformer> delta_performer_;
 
+  // Feeds |delta_performer_| from a separate thread when
+  // install_plan_.pipelined_apply is set, nullptr otherwise.
+  std::unique_ptr<PipelinedPayloadWriter> pipelined_writer_;
+  ScopedTaskId backpressure_task_id_;
+  // Whether the transfer is paused because |pipelined_writer_| is full, and
+  // whether it's paused because the action was suspended. The transfer is only
+  // resumed once neither of them holds.
+  bool backpressure_paused_{false};
+  bool suspended_{false};
+
+  // When the action processor overlaps the actions, the partitions applied
+  // by |delta_performer_| and not reported to the next action yet, and the
+  // install plan they were applied with.
+  std::mutex applied_partitions_mutex_;
+  std::vector<std::string> applied_partitions_;
+  std::unique_ptr<InstallPlan> applied_install_plan_;
+
+  // With install_plan_.prepare_partitions_early, the metadata is written to
+  // |delta_performer_| on |metadata_thread_|, so that it's verified and the
+  // partitions are prepared while the transfer continues. |collect_metadata_|
+  // is set until the metadata is complete in |metadata_bytes_|. The bytes
+  // received while the thread runs wait in |pending_bytes_|, and the transfer
+  // is paused when they reach the size of the pipeline buffer.
+  bool collect_metadata_{false};
+  brillo::Blob metadata_bytes_;
+  brillo::Blob pending_bytes_;
+  std::thread metadata_thread_;
+  std::atomic<bool> metadata_thread_done_{false};
+  // Set by |metadata_thread_|, read once it's joined.
+  bool metadata_result_{false};
+  ErrorCode metadata_error_{ErrorCode::kSuccess};
+  ScopedTaskId metadata_task_id_;
+  // Run in order by CheckMetadataThread() once |metadata_thread_| is done.
+  std::vector<base::OnceClosure> after_metadata_thread_;
+
   // Used by TransferTerminated to figure if this action terminated itself or
   // was terminated by the action processor.
   ErrorCode code_;
@@ -146,6 +277,8 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   uint64_t bytes_received_previous_payloads_{0};
   uint64_t bytes_total_{0};
   bool download_active_{false};
+  // Whether MaybeSetChunkBoundaries() was done for the current payload.
+  bool chunk_boundaries_set_{false};
 
   // Loaded from prefs before downloading any payload.
   size_t resume_payload_index_{0};
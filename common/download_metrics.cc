@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_metrics.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+#include "update_engine/common/clock.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr base::TimeDelta kThroughputSampleInterval =
+    base::TimeDelta::FromSeconds(1);
+}  // namespace
+
+DownloadMetrics::DownloadMetrics()
+    : DownloadMetrics(std::make_unique<Clock>()) {}
+
+DownloadMetrics::DownloadMetrics(std::unique_ptr<ClockInterface> clock)
+    : clock_(std::move(clock)) {
+  Reset();
+}
+
+void DownloadMetrics::TransferStarted() {
+  if (start_time_.is_null())
+    start_time_ = clock_->GetMonotonicTime();
+}
+
+void DownloadMetrics::BytesReceived(size_t length) {
+  const base::Time now = clock_->GetMonotonicTime();
+  TransferStarted();
+  if (!received_bytes_) {
+    received_bytes_ = true;
+    stats_.time_to_first_byte = now - start_time_;
+  }
+  stats_.bytes_received += length;
+
+  const int64_t elapsed_us =
+      std::max<int64_t>(0, (now - start_time_).InMicroseconds());
+  auto& samples = stats_.throughput_samples;
+  size_t index =
+      elapsed_us / stats_.throughput_sample_interval.InMicroseconds();
+  while (index >= kMaxThroughputSamples) {
+    for (size_t i = 0; i < samples.size(); i += 2) {
+      samples[i / 2] =
+          samples[i] + (i + 1 < samples.size() ? samples[i + 1] : 0);
+    }
+    samples.resize((samples.size() + 1) / 2);
+    stats_.throughput_sample_interval *= 2;
+    index = elapsed_us / stats_.throughput_sample_interval.InMicroseconds();
+  }
+  if (index >= samples.size())
+    samples.resize(index + 1, 0);
+  samples[index] += length;
+}
+
+void DownloadMetrics::ConnectionFinished(base::TimeDelta dns_time,
+                                         base::TimeDelta connect_time,
+                                         base::TimeDelta tls_time) {
+  stats_.num_transfers++;
+  stats_.dns_time += dns_time;
+  stats_.connect_time += connect_time;
+  stats_.tls_time += tls_time;
+}
+
+void DownloadMetrics::RetryStarted(base::TimeDelta wait_time) {
+  stats_.num_retries++;
+  stats_.retry_wait_time += wait_time;
+}
+
+void DownloadMetrics::BackpressureStarted() {
+  if (backpressure_start_time_.is_null())
+    backpressure_start_time_ = clock_->GetMonotonicTime();
+}
+
+void DownloadMetrics::BackpressureEnded() {
+  if (backpressure_start_time_.is_null())
+    return;
+  stats_.backpressure_time +=
+      clock_->GetMonotonicTime() - backpressure_start_time_;
+  backpressure_start_time_ = base::Time();
+}
+
+DownloadStats DownloadMetrics::GetStats() const {
+  return stats_;
+}
+
+void DownloadMetrics::Reset() {
+  stats_ = DownloadStats();
+  stats_.throughput_sample_interval = kThroughputSampleInterval;
+  start_time_ = base::Time();
+  received_bytes_ = false;
+  backpressure_start_time_ = base::Time();
+}
+
+void LogDownloadStats(const DownloadStats& stats) {
+  LOG(INFO) << stats.bytes_received << " bytes received, first byte after "
+            << stats.time_to_first_byte.InMilliseconds() << " ms.";
+  LOG(INFO) << stats.num_transfers << " transfers, "
+            << stats.dns_time.InMilliseconds() << " ms DNS, "
+            << stats.connect_time.InMilliseconds() << " ms connect, "
+            << stats.tls_time.InMilliseconds() << " ms TLS.";
+  LOG(INFO) << stats.num_retries << " retries after waiting "
+            << stats.retry_wait_time.InMilliseconds() << " ms, "
+            << stats.backpressure_time.InMilliseconds()
+            << " ms waiting for the payload consumer.";
+  if (stats.throughput_samples.empty())
+    return;
+  std::string samples;
+  for (uint64_t bytes : stats.throughput_samples) {
+    if (!samples.empty())
+      samples += ",";
+    samples += base::NumberToString(bytes);
+  }
+  LOG(INFO) << "Bytes received per "
+            << stats.throughput_sample_interval.InSeconds()
+            << " s: " << samples;
+}
+
+}  // namespace chromeos_update_engine
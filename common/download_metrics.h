@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_DOWNLOAD_METRICS_H_
+#define UPDATE_ENGINE_COMMON_DOWNLOAD_METRICS_H_
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+
+namespace chromeos_update_engine {
+
+// Timings of the download of the payloads during an update attempt. When the
+// payload is downloaded over several connections, the connection and retry
+// times are summed over all of them.
+struct DownloadStats {
+  uint64_t bytes_received{0};
+  // From the start of the first transfer to the first byte received.
+  base::TimeDelta time_to_first_byte;
+
+  // Transfers made, including the retries, and the time spent resolving the
+  // host name, connecting and doing the TLS handshake for them. Transfers over
+  // a reused connection add no time.
+  uint64_t num_transfers{0};
+  base::TimeDelta dns_time;
+  base::TimeDelta connect_time;
+  base::TimeDelta tls_time;
+
+  // Transfers restarted after a failure, and the time waited before they were
+  // restarted.
+  uint64_t num_retries{0};
+  base::TimeDelta retry_wait_time;
+
+  // Time the received data waited for the payload consumer, either with the
+  // transfer paused or while it was being written.
+  base::TimeDelta backpressure_time;
+
+  // Bytes received during each |throughput_sample_interval| since the start of
+  // the first transfer.
+  base::TimeDelta throughput_sample_interval;
+  std::vector<uint64_t> throughput_samples;
+};
+
+// DownloadMetrics builds the DownloadStats from the events reported by the
+// fetchers and the DownloadAction. It's only used from the message loop
+// thread.
+class DownloadMetrics {
+ public:
+  // The throughput is sampled every second, until there are this many samples.
+  // Then the interval doubles and the pairs of samples are merged.
+  static constexpr size_t kMaxThroughputSamples = 1024;
+
+  DownloadMetrics();
+  explicit DownloadMetrics(std::unique_ptr<ClockInterface> clock);
+
+  // Called when a transfer, or a retry of it, starts.
+  void TransferStarted();
+  void BytesReceived(size_t length);
+  // Records the connection phases of a finished or aborted transfer.
+  void ConnectionFinished(base::TimeDelta dns_time,
+                          base::TimeDelta connect_time,
+                          base::TimeDelta tls_time);
+  // Records a transfer restarted after waiting |wait_time|.
+  void RetryStarted(base::TimeDelta wait_time);
+
+  // Called when the received data starts and stops waiting for the payload
+  // consumer. Nested calls are ignored.
+  void BackpressureStarted();
+  void BackpressureEnded();
+
+  DownloadStats GetStats() const;
+
+  void Reset();
+
+ private:
+  std::unique_ptr<ClockInterface> clock_;
+  DownloadStats stats_;
+  // Start of the first transfer, null until then.
+  base::Time start_time_;
+  bool received_bytes_{false};
+  // Start of the ongoing backpressure, null if there is none.
+  base::Time backpressure_start_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(DownloadMetrics);
+};
+
+// Logs a summary of |stats|.
+void LogDownloadStats(const DownloadStats& stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_DOWNLOAD_METRICS_H_
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/download_metrics.h"
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+class DownloadMetricsTest : public ::testing::Test {
+ protected:
+  DownloadMetricsTest() {
+    auto clock = std::make_unique<FakeClock>();
+    clock_ = clock.get();
+    metrics_ = std::make_unique<DownloadMetrics>(std::move(clock));
+  }
+
+  void AdvanceTime(TimeDelta delta) {
+    now_ += delta;
+    clock_->SetMonotonicTime(now_);
+  }
+
+  base::Time now_ = base::Time::FromInternalValue(1000000);
+  FakeClock* clock_;
+  std::unique_ptr<DownloadMetrics> metrics_;
+};
+
+TEST_F(DownloadMetricsTest, TimingsTest) {
+  AdvanceTime(TimeDelta());
+  metrics_->TransferStarted();
+  AdvanceTime(TimeDelta::FromMilliseconds(300));
+  metrics_->BytesReceived(100);
+  AdvanceTime(TimeDelta::FromMilliseconds(800));
+  // Only the first transfer counts for the time to first byte.
+  metrics_->TransferStarted();
+  metrics_->BytesReceived(50);
+  metrics_->ConnectionFinished(TimeDelta::FromMilliseconds(10),
+                               TimeDelta::FromMilliseconds(20),
+                               TimeDelta::FromMilliseconds(30));
+  metrics_->ConnectionFinished(
+      TimeDelta(), TimeDelta::FromMilliseconds(5), TimeDelta());
+  metrics_->RetryStarted(TimeDelta::FromSeconds(20));
+
+  metrics_->BackpressureStarted();
+  AdvanceTime(TimeDelta::FromMilliseconds(200));
+  // Nested calls are ignored.
+  metrics_->BackpressureStarted();
+  AdvanceTime(TimeDelta::FromMilliseconds(100));
+  metrics_->BackpressureEnded();
+  metrics_->BackpressureEnded();
+  AdvanceTime(TimeDelta::FromSeconds(1));
+  metrics_->BytesReceived(25);
+
+  const DownloadStats stats = metrics_->GetStats();
+  EXPECT_EQ(175u, stats.bytes_received);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(300), stats.time_to_first_byte);
+  EXPECT_EQ(2u, stats.num_transfers);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(10), stats.dns_time);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(25), stats.connect_time);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(30), stats.tls_time);
+  EXPECT_EQ(1u, stats.num_retries);
+  EXPECT_EQ(TimeDelta::FromSeconds(20), stats.retry_wait_time);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(300), stats.backpressure_time);
+  EXPECT_EQ(TimeDelta::FromSeconds(1), stats.throughput_sample_interval);
+  // Received at 0.3 s, 1.1 s and 2.4 s.
+  EXPECT_EQ(std::vector<uint64_t>({100, 50, 25}), stats.throughput_samples);
+
+  metrics_->Reset();
+  EXPECT_EQ(0u, metrics_->GetStats().bytes_received);
+  EXPECT_TRUE(metrics_->GetStats().throughput_samples.empty());
+}
+
+TEST_F(DownloadMetricsTest, MergesThroughputSamplesTest) {
+  AdvanceTime(TimeDelta());
+  metrics_->TransferStarted();
+  for (size_t i = 0; i < DownloadMetrics::kMaxThroughputSamples; i++) {
+    metrics_->BytesReceived(1);
+    AdvanceTime(TimeDelta::FromSeconds(1));
+  }
+  DownloadStats stats = metrics_->GetStats();
+  EXPECT_EQ(DownloadMetrics::kMaxThroughputSamples,
+            stats.throughput_samples.size());
+
+  // One more sample doesn't fit, the interval doubles.
+  metrics_->BytesReceived(1);
+  stats = metrics_->GetStats();
+  EXPECT_EQ(TimeDelta::FromSeconds(2), stats.throughput_sample_interval);
+  EXPECT_EQ(DownloadMetrics::kMaxThroughputSamples / 2 + 1,
+            stats.throughput_samples.size());
+  EXPECT_EQ(2u, stats.throughput_samples.front());
+  EXPECT_EQ(1u, stats.throughput_samples.back());
+  EXPECT_EQ(DownloadMetrics::kMaxThroughputSamples + 1, stats.bytes_received);
+}
+
+}  // namespace chromeos_update_engine
@@ -23,6 +23,8 @@
 #include <string>
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/action.h"
 #include "update_engine/common/cleanup_previous_update_action_delegate.h"
 #include "update_engine/common/error_code.h"
@@ -194,6 +196,16 @@ class DynamicPartitionControlInterface {
   // To know if the device supports snapshot compression by itself, use
   // GetVirtualAbCompressionFeatureFlag
   virtual bool UpdateUsesSnapshotCompression() = 0;
+
+  // Finds the active dm-verity device of |partition_name| (without slot
+  // suffix) reading its data from the block device at |data_device|. Returns
+  // false if there is none, otherwise sets the path of the verity device, its
+  // root digest and the size in bytes of the data it covers.
+  virtual bool GetVerityDevice(const std::string& partition_name,
+                               const std::string& data_device,
+                               std::string* verity_device,
+                               brillo::Blob* root_digest,
+                               uint64_t* data_size) = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -125,4 +125,13 @@ bool DynamicPartitionControlStub::UpdateUsesSnapshotCompression() {
   return false;
 }
 
+bool DynamicPartitionControlStub::GetVerityDevice(
+    const std::string& partition_name,
+    const std::string& data_device,
+    std::string* verity_device,
+    brillo::Blob* root_digest,
+    uint64_t* data_size) {
+  return false;
+}
+
 }  // namespace chromeos_update_engine
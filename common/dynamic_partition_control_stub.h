@@ -27,7 +27,7 @@
 
 namespace chromeos_update_engine {
 
-class DynamicPartitionControlStub final : public DynamicPartitionControlInterface {
+class DynamicPartitionControlStub : public DynamicPartitionControlInterface {
  public:
   FeatureFlag GetDynamicPartitionsFeatureFlag() override;
   FeatureFlag GetVirtualAbFeatureFlag() override;
@@ -79,6 +79,11 @@ class DynamicPartitionControlStub final : public DynamicPartitionControlInterfac
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
   bool UpdateUsesSnapshotCompression() override;
+  bool GetVerityDevice(const std::string& partition_name,
+                       const std::string& data_device,
+                       std::string* verity_device,
+                       brillo::Blob* root_digest,
+                       uint64_t* data_size) override;
 };
 }  // namespace chromeos_update_engine
 
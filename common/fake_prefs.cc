@@ -130,6 +130,26 @@ bool FakePrefs::GetSubKeys(std::string_view ns, vector<string>* keys) const {
   return true;
 }
 
+bool FakePrefs::StartTransaction() {
+  if (transaction_backup_)
+    return false;
+  transaction_backup_ = values_;
+  return true;
+}
+
+void FakePrefs::CancelTransaction() {
+  if (transaction_backup_)
+    values_ = std::move(*transaction_backup_);
+  transaction_backup_.reset();
+}
+
+bool FakePrefs::SubmitTransaction() {
+  if (!transaction_backup_)
+    return false;
+  transaction_backup_.reset();
+  return true;
+}
+
 string FakePrefs::GetTypeName(PrefType type) {
   switch (type) {
     case PrefType::kString:
@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <map>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -56,6 +57,12 @@ class FakePrefs : public PrefsInterface {
   bool GetSubKeys(std::string_view ns,
                   std::vector<std::string>* keys) const override;
 
+  // Changes are applied right away and observers notified as they're made,
+  // CancelTransaction() restores the values from before StartTransaction().
+  bool StartTransaction() override;
+  void CancelTransaction() override;
+  bool SubmitTransaction() override;
+
   void AddObserver(std::string_view key, ObserverInterface* observer) override;
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
@@ -108,6 +115,10 @@ class FakePrefs : public PrefsInterface {
   // Container for all the key/value pairs.
   std::map<std::string, PrefTypeValue, std::less<>> values_;
 
+  // Copy of |values_| from when the transaction in progress started.
+  std::optional<std::map<std::string, PrefTypeValue, std::less<>>>
+      transaction_backup_;
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
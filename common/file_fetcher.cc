@@ -16,13 +16,20 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <limits>
 #include <string>
 
 #include <base/bind.h>
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/streams/file_stream.h>
@@ -30,11 +37,24 @@
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/platform_constants.h"
 
+using brillo::MessageLoop;
 using std::string;
 
 namespace {
 
-size_t kReadBufferSize = 16 * 1024;
+// Streams, like the pipe update_engine_sideload may read the payload from,
+// are read in large chunks so the delegate gets whole operations at once
+// rather than being called for every few pages.
+constexpr size_t kStreamReadBufferSize = 1024 * 1024;  // 1 MiB
+
+// The pipe buffer requested for a pipe payload, so the writer can get ahead
+// of the update by more than the default 64 KiB.
+constexpr int kPipeBufferSize = 1024 * 1024;  // 1 MiB
+
+// How much of a memory mapped file is passed to the delegate at once. Large
+// chunks let the DeltaPerformer apply most operations straight from the
+// mapping, without buffering their data.
+constexpr size_t kMappedChunkSize = 16 * 1024 * 1024;  // 16 MiB
 
 }  // namespace
 
@@ -73,17 +93,31 @@ void FileFetcher::BeginTransfer(const string& url) {
   if (base::StartsWith(url, "fd://", base::CompareCase::INSENSITIVE_ASCII)) {
     int fd = std::stoi(url.substr(strlen("fd://")));
     file_path = url;
-    stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
+    MapFile(fd);
+    if (!mapped_data_) {
+      PrepareStream(fd);
+      stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
+    }
   } else {
     file_path = url.substr(strlen("file://"));
-    stream_ =
-        brillo::FileStream::Open(base::FilePath(file_path),
-                                 brillo::Stream::AccessMode::READ,
-                                 brillo::FileStream::Disposition::OPEN_EXISTING,
-                                 nullptr);
+    int fd = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd >= 0) {
+      // The mapping stays valid once the file is closed.
+      MapFile(fd);
+      if (!mapped_data_)
+        PrepareStream(fd);
+      IGNORE_EINTR(close(fd));
+    }
+    if (!mapped_data_) {
+      stream_ = brillo::FileStream::Open(
+          base::FilePath(file_path),
+          brillo::Stream::AccessMode::READ,
+          brillo::FileStream::Disposition::OPEN_EXISTING,
+          nullptr);
+    }
   }
 
-  if (!stream_) {
+  if (!stream_ && !mapped_data_) {
     LOG(ERROR) << "Couldn't open " << file_path;
     http_response_code_ = kHttpResponseNotFound;
     CleanUp();
@@ -93,7 +127,7 @@ void FileFetcher::BeginTransfer(const string& url) {
   }
   http_response_code_ = kHttpResponseOk;
 
-  if (offset_)
+  if (offset_ && stream_)
     stream_->SetPosition(offset_, nullptr);
   bytes_copied_ = 0;
   transfer_in_progress_ = true;
@@ -108,11 +142,60 @@ void FileFetcher::TerminateTransfer() {
   }
 }
 
+void FileFetcher::MapFile(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+      file_stat.st_size <= 0 ||
+      static_cast<uint64_t>(file_stat.st_size) >
+          std::numeric_limits<size_t>::max()) {
+    return;
+  }
+  const size_t size = file_stat.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to memory map the file, reading it instead";
+    return;
+  }
+  // The file is read once from the beginning to the end, the kernel can read
+  // ahead more and drop the pages sooner.
+  if (madvise(data, size, MADV_SEQUENTIAL) != 0)
+    PLOG(WARNING) << "madvise(MADV_SEQUENTIAL) failed";
+  mapped_data_ = static_cast<uint8_t*>(data);
+  mapped_size_ = size;
+  mapped_evicted_size_ = 0;
+}
+
+void FileFetcher::PrepareStream(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+    return;
+  if (S_ISFIFO(file_stat.st_mode)) {
+    // Best effort, the size is capped by /proc/sys/fs/pipe-max-size.
+    if (fcntl(fd, F_SETPIPE_SZ, kPipeBufferSize) < 0)
+      PLOG(INFO) << "Unable to grow the pipe buffer";
+  } else if (S_ISREG(file_stat.st_mode) || S_ISBLK(file_stat.st_mode)) {
+    // POSIX_FADV_SEQUENTIAL only applies to this open file, but the pages
+    // read ahead for POSIX_FADV_WILLNEED are there for any other reader.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, offset_, kStreamReadBufferSize * 4, POSIX_FADV_WILLNEED);
+  }
+}
+
 void FileFetcher::ScheduleRead() {
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
-  buffer_.resize(kReadBufferSize);
+  if (mapped_data_) {
+    if (mapped_read_task_id_ == MessageLoop::kTaskIdNull) {
+      mapped_read_task_id_ = MessageLoop::current()->PostTask(
+          FROM_HERE,
+          base::Bind(&FileFetcher::OnMappedDataCallback,
+                     base::Unretained(this)));
+    }
+    return;
+  }
+
+  buffer_.resize(kStreamReadBufferSize);
   size_t bytes_to_read = buffer_.size();
   if (data_length_ >= 0) {
     bytes_to_read = std::min(static_cast<uint64_t>(bytes_to_read),
@@ -154,6 +237,57 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
   }
 }
 
+void FileFetcher::OnMappedDataCallback() {
+  mapped_read_task_id_ = MessageLoop::kTaskIdNull;
+  if (transfer_paused_ || !transfer_in_progress_)
+    return;
+
+  const uint64_t position = offset_ + bytes_copied_;
+  uint64_t remaining = position < mapped_size_ ? mapped_size_ - position : 0;
+  if (data_length_ >= 0) {
+    remaining = std::min(remaining,
+                         static_cast<uint64_t>(data_length_) - bytes_copied_);
+  }
+  if (!remaining) {
+    OnReadDoneCallback(0);
+    return;
+  }
+
+  const size_t length = std::min<uint64_t>(remaining, kMappedChunkSize);
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  // Start reading the next chunk while the delegate consumes this one, the
+  // sequential readahead alone is way smaller than a chunk.
+  const uint64_t next_begin = (position + length) / page_size * page_size;
+  const uint64_t next_end =
+      std::min<uint64_t>(position + length + kMappedChunkSize, mapped_size_);
+  if (next_end > next_begin &&
+      madvise(mapped_data_ + next_begin,
+              next_end - next_begin,
+              MADV_WILLNEED) != 0) {
+    PLOG(WARNING) << "madvise(MADV_WILLNEED) failed";
+  }
+  bytes_copied_ += length;
+  if (delegate_ &&
+      !delegate_->ReceivedBytes(this, mapped_data_ + position, length))
+    return;
+  // The delegate may have terminated the transfer.
+  if (!mapped_data_)
+    return;
+
+  // The delegate doesn't keep the data it was passed, so the pages up to the
+  // end of it won't be needed again.
+  const size_t evict_end = (position + length) / page_size * page_size;
+  if (evict_end > mapped_evicted_size_) {
+    if (madvise(mapped_data_ + mapped_evicted_size_,
+                evict_end - mapped_evicted_size_,
+                MADV_DONTNEED) != 0) {
+      PLOG(WARNING) << "madvise(MADV_DONTNEED) failed";
+    }
+    mapped_evicted_size_ = evict_end;
+  }
+  ScheduleRead();
+}
+
 void FileFetcher::OnReadErrorCallback(const brillo::Error* error) {
   LOG(ERROR) << "Asynchronous read failed: " << error->GetMessage();
   CleanUp();
@@ -189,6 +323,16 @@ void FileFetcher::CleanUp() {
   ongoing_read_ = false;
   buffer_ = brillo::Blob();
 
+  if (mapped_read_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(mapped_read_task_id_);
+    mapped_read_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (mapped_data_) {
+    munmap(mapped_data_, mapped_size_);
+    mapped_data_ = nullptr;
+    mapped_size_ = 0;
+  }
+
   transfer_in_progress_ = false;
   transfer_paused_ = false;
 }
@@ -23,12 +23,14 @@
 
 #include <base/logging.h>
 #include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that reads files
-// asynchronously.
+// asynchronously. Regular files are memory mapped and passed to the delegate
+// straight from the mapping, other files are read through a stream.
 
 namespace chromeos_update_engine {
 
@@ -83,10 +85,22 @@ class FileFetcher : public HttpFetcher {
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
 
+  // Memory maps the file |fd| if it's a regular file, leaving |mapped_data_|
+  // null otherwise. Doesn't take ownership of |fd|.
+  void MapFile(int fd);
+
+  // Sets up |fd| to be streamed from: grows the buffer of a pipe and tells
+  // the kernel a file is read sequentially. Doesn't take ownership of |fd|.
+  void PrepareStream(int fd);
+
   // Schedule a new asynchronous read if the stream is not paused and no other
   // read is in process. This method can be called at any point.
   void ScheduleRead();
 
+  // Passes the next chunk of |mapped_data_| to the delegate, and then evicts
+  // the pages consumed so far from memory.
+  void OnMappedDataCallback();
+
   // Called from the main loop when a single read from |stream_| succeeds or
   // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
   void OnReadDoneCallback(size_t bytes_read);
@@ -113,6 +127,15 @@ class FileFetcher : public HttpFetcher {
 
   brillo::StreamPtr stream_;
 
+  // The whole file when it's memory mapped, used instead of |stream_|.
+  uint8_t* mapped_data_{nullptr};
+  size_t mapped_size_{0};
+  // The part of |mapped_data_| already evicted from memory.
+  size_t mapped_evicted_size_{0};
+  // The pending OnMappedDataCallback() task.
+  brillo::MessageLoop::TaskId mapped_read_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
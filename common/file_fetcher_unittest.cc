@@ -17,14 +17,47 @@
 #include "update_engine/common/file_fetcher.h"
 
 #include <string>
+#include <vector>
 
+#include <brillo/message_loops/fake_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
-class FileFetcherUnitTest : public ::testing::Test {};
+namespace {
+class RecordingDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + length);
+    chunk_sizes_.push_back(length);
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    done_ = true;
+    successful_ = successful;
+  }
+
+  brillo::Blob data_;
+  std::vector<size_t> chunk_sizes_;
+  bool done_{false};
+  bool successful_{false};
+};
+}  // namespace
+
+class FileFetcherUnitTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+};
 
 TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_TRUE(FileFetcher::SupportedUrl("file:///path/to/somewhere.bin"));
@@ -34,4 +67,33 @@ TEST_F(FileFetcherUnitTest, SupporterUrlsTest) {
   EXPECT_FALSE(FileFetcher::SupportedUrl("http:///no_http_here"));
 }
 
+TEST_F(FileFetcherUnitTest, MappedFileTest) {
+  // More than one chunk of the mapping.
+  brillo::Blob contents(17 * 1024 * 1024 + 300);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+  ScopedTempFile file("FileFetcher-XXXXXX");
+  ASSERT_TRUE(
+      utils::WriteFile(file.path().c_str(), contents.data(), contents.size()));
+
+  RecordingDelegate delegate;
+  FileFetcher fetcher;
+  fetcher.set_delegate(&delegate);
+  fetcher.SetOffset(100);
+  fetcher.SetLength(contents.size() - 200);
+  fetcher.BeginTransfer("file://" + file.path());
+  brillo::MessageLoopRunUntil(
+      &loop_, base::TimeDelta::FromSeconds(10), [&delegate]() {
+        return delegate.done_;
+      });
+
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(brillo::Blob(contents.begin() + 100, contents.end() - 100),
+            delegate.data_);
+  // Passed straight from the mapping rather than in small reads.
+  EXPECT_EQ(std::vector<size_t>({16 * 1024 * 1024, 1024 * 1024 + 100}),
+            delegate.chunk_sizes_);
+  EXPECT_EQ(contents.size() - 200, fetcher.GetBytesDownloaded());
+}
+
 }  // namespace chromeos_update_engine
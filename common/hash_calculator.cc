@@ -17,6 +17,13 @@
 #include "update_engine/common/hash_calculator.h"
 
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
@@ -27,6 +34,49 @@ using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Below this many blocks per thread, starting threads costs more than it
+// saves.
+constexpr size_t kMinBlocksPerThread = 64;
+
+// The files are hashed in chunks of this size, large enough for the reads not
+// to be bound by their latency.
+constexpr size_t kFileBufferSize = 4 * 1024 * 1024;
+
+// Reads up to |count| bytes from |fd| into |buffer|, less only at the end of
+// the file. Returns the number of bytes read, or -1 on error.
+ssize_t ReadFull(int fd, uint8_t* buffer, size_t count) {
+  size_t bytes_read = 0;
+  while (bytes_read < count) {
+    ssize_t rc =
+        HANDLE_EINTR(read(fd, buffer + bytes_read, count - bytes_read));
+    if (rc < 0)
+      return -1;
+    if (rc == 0)
+      break;
+    bytes_read += rc;
+  }
+  return bytes_read;
+}
+
+// Hashes the blocks [first_block, last_block) of |data| into |out_hashes|.
+void HashBlocks(const uint8_t* data,
+                size_t length,
+                size_t block_size,
+                size_t first_block,
+                size_t last_block,
+                uint8_t* out_hashes) {
+  for (size_t i = first_block; i < last_block; i++) {
+    const size_t offset = i * block_size;
+    // The one-shot SHA256() avoids setting up a context for every block, it
+    // uses the SHA extensions of the CPU when available like SHA256_Update().
+    SHA256(data + offset,
+           std::min(block_size, length - offset),
+           out_hashes + i * SHA256_DIGEST_LENGTH);
+  }
+}
+}  // namespace
+
 HashCalculator::HashCalculator() : valid_(false) {
   valid_ = (SHA256_Init(&ctx_) == 1);
   LOG_IF(ERROR, !valid_) << "SHA256_Init failed";
@@ -48,27 +98,58 @@ off_t HashCalculator::UpdateFile(const string& name, off_t length) {
   if (fd < 0) {
     return -1;
   }
+  ScopedFdCloser fd_closer(&fd);
+  // Best effort, lets the kernel read ahead more.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  const int kBufferSize = 128 * 1024;  // 128 KiB
-  brillo::Blob buffer(kBufferSize);
+  // The buffers of the small files are only as large as the file, there is
+  // no need to allocate and clear kFileBufferSize bytes to hash a few bytes.
+  size_t buffer_size = kFileBufferSize;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+    buffer_size = std::clamp<off_t>(file_stat.st_size, 1, buffer_size);
+  }
+  if (length >= 0) {
+    buffer_size = std::clamp<off_t>(length, 1, buffer_size);
+  }
+  auto bytes_to_read = [length, buffer_size](off_t bytes_processed) {
+    if (length < 0)
+      return buffer_size;
+    return std::min<size_t>(buffer_size, length - bytes_processed);
+  };
+
+  // The next chunk of the file is read on another thread while the current
+  // one is hashed. The second buffer is only allocated if there's more than
+  // one chunk to read.
+  brillo::Blob buffers[2];
+  buffers[0].resize(buffer_size);
+  size_t current = 0;
+  size_t count = bytes_to_read(0);
+  ssize_t rc = ReadFull(fd, buffers[current].data(), count);
   off_t bytes_processed = 0;
-  while (length < 0 || bytes_processed < length) {
-    off_t bytes_to_read = buffer.size();
-    if (length >= 0 && bytes_to_read > length - bytes_processed) {
-      bytes_to_read = length - bytes_processed;
+  while (rc > 0) {
+    const off_t next_offset = bytes_processed + rc;
+    // A short read is the end of the file.
+    const size_t next_count =
+        static_cast<size_t>(rc) == count ? bytes_to_read(next_offset) : 0;
+    std::future<ssize_t> pending;
+    if (next_count > 0) {
+      brillo::Blob* next_buffer = &buffers[1 - current];
+      next_buffer->resize(buffer_size);
+      pending = std::async(
+          std::launch::async, ReadFull, fd, next_buffer->data(), next_count);
     }
-    ssize_t rc = HANDLE_EINTR(read(fd, buffer.data(), bytes_to_read));
-    if (rc == 0) {  // EOF
-      break;
-    }
-    if (rc < 0 || !Update(buffer.data(), rc)) {
-      bytes_processed = -1;
-      break;
+    // The future returned by std::async waits for the read on destruction, so
+    // returning early never leaves it reading into a freed buffer.
+    if (!Update(buffers[current].data(), rc)) {
+      return -1;
     }
-    bytes_processed += rc;
+    bytes_processed = next_offset;
+    rc = pending.valid() ? pending.get() : 0;
+    count = next_count;
+    current = 1 - current;
   }
-  IGNORE_EINTR(close(fd));
-  return bytes_processed;
+  return rc < 0 ? -1 : bytes_processed;
 }
 
 // Call Finalize() when all data has been passed in. This mostly just
@@ -115,6 +196,41 @@ off_t HashCalculator::RawHashOfFile(const string& name,
   return res;
 }
 
+bool HashCalculator::RawHashOfBlocks(const void* data,
+                                     size_t length,
+                                     size_t block_size,
+                                     brillo::Blob* out_hashes,
+                                     size_t num_threads) {
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  const size_t num_blocks = (length + block_size - 1) / block_size;
+  out_hashes->resize(num_blocks * SHA256_DIGEST_LENGTH);
+  num_threads = std::max<size_t>(
+      1, std::min(num_threads, num_blocks / kMinBlocksPerThread));
+  const size_t blocks_per_thread = (num_blocks + num_threads - 1) / num_threads;
+  std::vector<std::thread> threads;
+  for (size_t first = blocks_per_thread; first < num_blocks;
+       first += blocks_per_thread) {
+    threads.emplace_back(HashBlocks,
+                         bytes,
+                         length,
+                         block_size,
+                         first,
+                         std::min(num_blocks, first + blocks_per_thread),
+                         out_hashes->data());
+  }
+  HashBlocks(bytes,
+             length,
+             block_size,
+             0,
+             std::min(num_blocks, blocks_per_thread),
+             out_hashes->data());
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return true;
+}
+
 string HashCalculator::GetContext() const {
   return string(reinterpret_cast<const char*>(&ctx_), sizeof(ctx_));
 }
@@ -76,6 +76,15 @@ class HashCalculator {
                              off_t length,
                              brillo::Blob* out_hash);
   static bool RawHashOfFile(const std::string& name, brillo::Blob* out_hash);
+  // Hashes each |block_size| bytes block of |data| independently, the last one
+  // may be shorter, and stores their SHA256_DIGEST_LENGTH bytes digests one
+  // after another in |out_hashes|. The blocks are split between |num_threads|
+  // threads.
+  static bool RawHashOfBlocks(const void* data,
+                              size_t length,
+                              size_t block_size,
+                              brillo::Blob* out_hashes,
+                              size_t num_threads = 1);
   static std::string SHA256Digest(std::string_view blob);
 
   static std::string SHA256Digest(std::vector<unsigned char> blob);
@@ -19,6 +19,7 @@
 #include <math.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -103,6 +104,35 @@ TEST_F(HashCalculatorTest, BigTest) {
             brillo::data_encoding::Base64Encode(calc.raw_hash()));
 }
 
+TEST_F(HashCalculatorTest, RawHashOfBlocksTest) {
+  constexpr size_t kBlockSize = 4096;
+  // A partial last block, and enough blocks for several threads.
+  brillo::Blob data(kBlockSize * 300 + 123);
+  test_utils::FillWithData(&data);
+  for (size_t num_threads : {1, 4}) {
+    brillo::Blob hashes;
+    ASSERT_TRUE(HashCalculator::RawHashOfBlocks(
+        data.data(), data.size(), kBlockSize, &hashes, num_threads));
+    ASSERT_EQ(301u * SHA256_DIGEST_LENGTH, hashes.size());
+    for (size_t i = 0; i < 301; i++) {
+      const size_t offset = i * kBlockSize;
+      brillo::Blob hash;
+      ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+          data.data() + offset,
+          std::min(kBlockSize, data.size() - offset),
+          &hash));
+      EXPECT_EQ(hash,
+                brillo::Blob(hashes.begin() + i * SHA256_DIGEST_LENGTH,
+                             hashes.begin() + (i + 1) * SHA256_DIGEST_LENGTH))
+          << "block " << i << " with " << num_threads << " threads";
+    }
+  }
+
+  brillo::Blob hashes;
+  EXPECT_TRUE(HashCalculator::RawHashOfBlocks(nullptr, 0, kBlockSize, &hashes));
+  EXPECT_TRUE(hashes.empty());
+}
+
 TEST_F(HashCalculatorTest, UpdateFileSimpleTest) {
   ScopedTempFile data_file("data.XXXXXX");
   ASSERT_TRUE(test_utils::WriteFileString(data_file.path(), "hi"));
@@ -139,6 +169,28 @@ TEST_F(HashCalculatorTest, RawHashOfFileSimpleTest) {
   }
 }
 
+TEST_F(HashCalculatorTest, UpdateFileSeveralChunksTest) {
+  ScopedTempFile data_file("data.XXXXXX");
+  // Larger than two of the chunks the file is read in.
+  brillo::Blob data(9 * 1024 * 1024 + 123);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 7 + i / 4096;
+  ASSERT_TRUE(
+      utils::WriteFile(data_file.path().c_str(), data.data(), data.size()));
+
+  for (const off_t length :
+       {off_t{-1}, off_t{4 * 1024 * 1024}, off_t{5 * 1024 * 1024 + 1}}) {
+    const size_t expected_size = length < 0 ? data.size() : length;
+    brillo::Blob expected_hash, raw_hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+        data.data(), expected_size, &expected_hash));
+    EXPECT_EQ(
+        static_cast<off_t>(expected_size),
+        HashCalculator::RawHashOfFile(data_file.path(), length, &raw_hash));
+    EXPECT_EQ(expected_hash, raw_hash);
+  }
+}
+
 TEST_F(HashCalculatorTest, UpdateFileNonexistentTest) {
   HashCalculator calc;
   EXPECT_EQ(-1, calc.UpdateFile("/some/non-existent/file", -1));
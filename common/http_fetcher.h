@@ -29,6 +29,7 @@
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/constants.h"
+#include "update_engine/common/download_metrics.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/http_common.h"
 
@@ -137,9 +138,21 @@ class HttpFetcher {
   // Sets the number of allowed retries.
   virtual void set_max_retry_count(int max_retry_count) = 0;
 
+  // Sets whether the fetcher tunes its transfers to the throughput and round
+  // trip time it measures, if it supports it. The settings above are then the
+  // limits of the tuning.
+  virtual void set_adaptive_tuning(bool adaptive_tuning) {}
+
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Sets where the fetcher records the timings of its transfers, if it
+  // supports it. Doesn't take ownership of |download_metrics|, which may be
+  // null.
+  virtual void set_download_metrics(DownloadMetrics* download_metrics) {
+    download_metrics_ = download_metrics;
+  }
+
  protected:
   // The URL we're actively fetching from
   std::string url_;
@@ -161,6 +174,9 @@ class HttpFetcher {
   // The delegate; may be null.
   HttpFetcherDelegate* delegate_ = nullptr;
 
+  // Where the transfer timings are recorded; may be null.
+  DownloadMetrics* download_metrics_ = nullptr;
+
   // Proxy servers
   std::deque<std::string> proxies_;
 
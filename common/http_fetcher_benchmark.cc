@@ -0,0 +1,302 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmarks of the throughput and CPU cost of the HTTP fetchers, against
+// test_http_server and its /shaped/ network model. Run with
+// --benchmark_format=json for machine-readable results.
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#endif  // BASE_VER < 780000
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+#if BASE_VER >= 780000  // CrOS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER >= 780000
+#include <base/time/time.h>
+#include <benchmark/benchmark.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop.h>
+#ifdef __CHROMEOS__
+#include <brillo/process/process.h>
+#else
+#include <brillo/process.h>
+#endif  // __CHROMEOS__
+#include <brillo/streams/file_stream.h>
+
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/libcurl_http_fetcher.h"
+
+using brillo::MessageLoop;
+using std::string;
+using std::unique_ptr;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr char kListeningMsgPrefix[] = "listening on port ";
+
+// The test_http_server all the benchmarks download from.
+class BenchmarkHttpServer {
+ public:
+  bool Start() {
+    process_.AddArg(test_utils::GetBuildArtifactsPath("test_http_server"));
+    process_.RedirectUsingPipe(STDOUT_FILENO, false);
+    if (!process_.Start()) {
+      LOG(ERROR) << "Failed to spawn the HTTP server.";
+      return false;
+    }
+    brillo::StreamPtr stdout = brillo::FileStream::FromFileDescriptor(
+        process_.GetPipe(STDOUT_FILENO), false /* own */, nullptr);
+    if (!stdout)
+      return false;
+    string line;
+    char buf[128];
+    while (line.find('\n') == string::npos) {
+      size_t read{};
+      if (!stdout->ReadBlocking(buf, sizeof(buf), &read, nullptr) ||
+          read == 0) {
+        LOG(ERROR) << "Failed to read the port of the HTTP server.";
+        return false;
+      }
+      line.append(buf, read);
+    }
+    const size_t prefix_len = strlen(kListeningMsgPrefix);
+    unsigned int port = 0;
+    if (line.compare(0, prefix_len, kListeningMsgPrefix) != 0 ||
+        !base::StringToUint(
+            line.substr(prefix_len, line.find('\n') - prefix_len), &port)) {
+      LOG(ERROR) << "Unexpected HTTP server output: " << line;
+      return false;
+    }
+    port_ = port;
+    return true;
+  }
+
+  ~BenchmarkHttpServer() { process_.Kill(SIGTERM, 10); }
+
+  string Url(const string& path) const {
+    return base::StringPrintf("http://127.0.0.1:%u%s", port_, path.c_str());
+  }
+
+ private:
+  brillo::ProcessImpl process_;
+  unsigned int port_{0};
+};
+
+BenchmarkHttpServer* server = nullptr;
+
+// Counts the bytes received, pausing the transfer for |pause_ms| after every
+// |pause_every| bytes if not 0.
+class BenchmarkDelegate : public HttpFetcherDelegate {
+ public:
+  BenchmarkDelegate(size_t pause_every, int pause_ms)
+      : pause_every_(pause_every),
+        pause_ms_(pause_ms),
+        next_pause_(pause_every) {}
+
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    bytes_received_ += length;
+    if (pause_every_ && bytes_received_ >= next_pause_) {
+      next_pause_ += pause_every_;
+      fetcher->Pause();
+      MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&HttpFetcher::Unpause, base::Unretained(fetcher)),
+          base::TimeDelta::FromMilliseconds(pause_ms_));
+    }
+    return true;
+  }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    successful_ = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    MessageLoop::current()->BreakLoop();
+  }
+
+  size_t bytes_received() const { return bytes_received_; }
+  bool successful() const { return successful_; }
+
+ private:
+  const size_t pause_every_;
+  const int pause_ms_;
+  size_t next_pause_;
+  size_t bytes_received_{0};
+  bool successful_{false};
+};
+
+double ProcessCpuSeconds() {
+  timespec ts{};
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fetches |url| with the fetchers made by |new_fetcher| once per iteration,
+// and reports the throughput and the CPU seconds per MiB, including the ones
+// of the libcurl threads.
+template <typename NewFetcher>
+void RunFetches(benchmark::State& state,
+                NewFetcher new_fetcher,
+                const string& url,
+                size_t pause_every = 0,
+                int pause_ms = 0) {
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop;
+  brillo::BaseMessageLoop loop(&base_loop);
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop(base_loop.task_runner());
+#endif  // BASE_VER < 780000
+  loop.SetAsCurrent();
+
+  size_t total_bytes = 0;
+  double cpu_seconds = 0;
+  for (auto _ : state) {
+    unique_ptr<HttpFetcher> fetcher = new_fetcher();
+    BenchmarkDelegate delegate(pause_every, pause_ms);
+    fetcher->set_delegate(&delegate);
+    const double cpu_start = ProcessCpuSeconds();
+    loop.PostTask(FROM_HERE,
+                  base::Bind(&HttpFetcher::BeginTransfer,
+                             base::Unretained(fetcher.get()),
+                             url));
+    loop.Run();
+    cpu_seconds += ProcessCpuSeconds() - cpu_start;
+    if (!delegate.successful()) {
+      state.SkipWithError("Transfer failed.");
+      break;
+    }
+    total_bytes += delegate.bytes_received();
+  }
+  state.SetBytesProcessed(total_bytes);
+  if (total_bytes > 0) {
+    state.counters["cpu_s_per_mib"] =
+        cpu_seconds / (static_cast<double>(total_bytes) / (1 << 20));
+  }
+}
+
+// Path of a payload of |size| bytes served at |bytes_per_sec|, 0 for as fast
+// as possible.
+string PayloadPath(size_t size, size_t bytes_per_sec) {
+  if (bytes_per_sec == 0)
+    return base::StringPrintf("/download/%zu", size);
+  return base::StringPrintf("/shaped/%zu/%zu/0/0/0/0", size, bytes_per_sec);
+}
+
+FakeHardware* fake_hardware() {
+  static FakeHardware hardware;
+  hardware.SetIsOfficialBuild(false);
+  return &hardware;
+}
+
+// Args: payload size, bandwidth cap.
+void BM_LibcurlHttpFetcher(benchmark::State& state) {
+  RunFetches(
+      state,
+      [] { return std::make_unique<LibcurlHttpFetcher>(fake_hardware()); },
+      server->Url(PayloadPath(state.range(0), state.range(1))));
+}
+BENCHMARK(BM_LibcurlHttpFetcher)
+    ->ArgsProduct({{1 << 20, 16 << 20, 64 << 20}, {0}})
+    ->Args({16 << 20, 8 << 20})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Args: payload size, number of ranges.
+void BM_MultiRangeHttpFetcher(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const size_t num_ranges = state.range(1);
+  RunFetches(state,
+             [size, num_ranges] {
+               auto fetcher = std::make_unique<MultiRangeHttpFetcher>(
+                   new LibcurlHttpFetcher(fake_hardware()));
+               fetcher->ClearRanges();
+               const size_t range_size = size / num_ranges;
+               for (size_t i = 0; i < num_ranges; i++)
+                 fetcher->AddRange(i * range_size, range_size);
+               return fetcher;
+             },
+             server->Url(PayloadPath(size, 0)));
+}
+BENCHMARK(BM_MultiRangeHttpFetcher)
+    ->ArgsProduct({{16 << 20}, {1, 16, 256}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Args: payload size, bytes between pauses, pause duration in ms.
+void BM_LibcurlHttpFetcherPauses(benchmark::State& state) {
+  RunFetches(
+      state,
+      [] { return std::make_unique<LibcurlHttpFetcher>(fake_hardware()); },
+      server->Url(PayloadPath(state.range(0), 0)),
+      state.range(1),
+      state.range(2));
+}
+BENCHMARK(BM_LibcurlHttpFetcherPauses)
+    ->ArgsProduct({{16 << 20}, {256 << 10, 4 << 20}, {0, 10}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Args: payload size.
+void BM_FileFetcher(benchmark::State& state) {
+  ScopedTempFile file("http_fetcher_benchmark.XXXXXX");
+  const string data(state.range(0), 'a');
+  if (!utils::WriteFile(file.path().c_str(), data.data(), data.size())) {
+    state.SkipWithError("Unable to write the file to fetch.");
+    return;
+  }
+  RunFetches(state,
+             [] { return std::make_unique<FileFetcher>(); },
+             "file://" + file.path());
+}
+BENCHMARK(BM_FileFetcher)
+    ->Arg(16 << 20)
+    ->Arg(64 << 20)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  chromeos_update_engine::BenchmarkHttpServer http_server;
+  if (!http_server.Start())
+    return 1;
+  chromeos_update_engine::server = &http_server;
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -785,6 +785,35 @@ TYPED_TEST(HttpFetcherTest, FlakyTest) {
   }
 }
 
+TYPED_TEST(HttpFetcherTest, ShapedTest) {
+  if (this->test_.IsMock() || !this->test_.IsHttpSupported())
+    return;
+  FlakyHttpFetcherTestDelegate delegate;
+  unique_ptr<HttpFetcher> fetcher(this->test_.NewSmallFetcher());
+  fetcher->set_delegate(&delegate);
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  // 1 MB/s after 20 ms of latency, with 3 stalls of 50 ms: at least 270 ms.
+  const base::TimeTicks start = base::TimeTicks::Now();
+  this->loop_.PostTask(
+      FROM_HERE,
+      base::Bind(&StartTransfer,
+                 fetcher.get(),
+                 LocalServerUrlForPath(
+                     server->GetPort(),
+                     base::StringPrintf(
+                         "/shaped/%d/1000000/20/10/30000/50", kBigLength))));
+  this->loop_.Run();
+  EXPECT_GE((base::TimeTicks::Now() - start).InMilliseconds(), 270);
+
+  ASSERT_EQ(kBigLength, static_cast<int>(delegate.data.size()));
+  for (int i = 0; i < kBigLength; i += 10) {
+    ASSERT_EQ(delegate.data.substr(i, 10), "abcdefghij");
+  }
+}
+
 // This delegate kills the server attached to it after receiving any bytes.
 // This can be used for testing what happens when you try to fetch data and
 // the server dies.
@@ -1403,6 +1432,233 @@ TYPED_TEST(HttpFetcherTest, BlockedTransferOfficialBuildTest) {
   BlockedTransferTestHelper(&this->test_, true);
 }
 
+// Collects the data of a MultiRangeHttpFetcher fetching in parallel.
+class ParallelMultiRangeTestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + length);
+    return true;
+  }
+  void SeekToOffset(off_t offset) override { seek_offsets_.push_back(offset); }
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    successful_ = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+  void TransferTerminated(HttpFetcher* fetcher) override { ADD_FAILURE(); }
+
+  brillo::Blob data_;
+  vector<off_t> seek_offsets_;
+  bool successful_{false};
+};
+
+// Records the offsets of the transfers it begins.
+class OffsetRecordingHttpFetcher : public MockHttpFetcher {
+ public:
+  OffsetRecordingHttpFetcher(const brillo::Blob& data, vector<off_t>* offsets)
+      : MockHttpFetcher(data.data(), data.size()), offsets_(offsets) {}
+
+  void SetOffset(off_t offset) override {
+    offsets_->push_back(offset);
+    MockHttpFetcher::SetOffset(offset);
+  }
+
+ private:
+  vector<off_t>* offsets_;
+};
+
+// Fails the transfers from |failing_urls|, and records the URLs of all of them.
+class MirrorHttpFetcher : public MockHttpFetcher {
+ public:
+  MirrorHttpFetcher(const brillo::Blob& data,
+                    const vector<string>& failing_urls,
+                    vector<string>* urls)
+      : MockHttpFetcher(data.data(), data.size()),
+        failing_urls_(failing_urls),
+        urls_(urls) {}
+
+  void BeginTransfer(const string& url) override {
+    urls_->push_back(url);
+    if (std::find(failing_urls_.begin(), failing_urls_.end(), url) ==
+        failing_urls_.end()) {
+      MockHttpFetcher::BeginTransfer(url);
+      return;
+    }
+    http_response_code_ = kHttpResponseNotFound;
+    delegate()->TransferComplete(this, false);
+  }
+
+ private:
+  vector<string> failing_urls_;
+  vector<string>* urls_;
+};
+
+class ParallelMultiRangeHttpFetcherTest : public ::testing::Test {
+ protected:
+  ParallelMultiRangeHttpFetcherTest() {
+    loop_.SetAsCurrent();
+    for (size_t i = 0; i < data_.size(); i++)
+      data_[i] = static_cast<uint8_t>(i * 7 + i / 1000);
+  }
+
+  void TearDown() override {
+    EXPECT_EQ(0, brillo::MessageLoopRunMaxIterations(&loop_, 1));
+  }
+
+  // Runs |fetcher| until the transfer completes.
+  void RunTransfer(MultiRangeHttpFetcher* fetcher) {
+    fetcher->set_delegate(&delegate_);
+    MessageLoop::current()->PostTask(
+        FROM_HERE, base::Bind(StartTransfer, fetcher, string(kUnusedUrl)));
+    MessageLoop::current()->Run();
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+
+  brillo::Blob data_ = brillo::Blob(kMockHttpFetcherChunkSize * 10);
+  ParallelMultiRangeTestDelegate delegate_;
+};
+
+TEST_F(ParallelMultiRangeHttpFetcherTest, DeliversInOrderTest) {
+  MultiRangeHttpFetcher fetcher(
+      new MockHttpFetcher(data_.data(), data_.size()));
+  vector<unique_ptr<HttpFetcher>> fetchers;
+  for (int i = 0; i < 2; i++) {
+    fetchers.push_back(
+        std::make_unique<MockHttpFetcher>(data_.data(), data_.size()));
+  }
+  // Each chunk takes a few of the deliveries of the mock fetchers, so the
+  // later chunks are received while the first one is still delivered.
+  fetcher.SetParallelFetchers(std::move(fetchers), 150000);
+  fetcher.AddRange(1000, 400000);
+  fetcher.AddRange(450000, 60000);
+  RunTransfer(&fetcher);
+
+  EXPECT_TRUE(delegate_.successful_);
+  brillo::Blob expected(data_.begin() + 1000, data_.begin() + 401000);
+  expected.insert(
+      expected.end(), data_.begin() + 450000, data_.begin() + 510000);
+  EXPECT_EQ(expected, delegate_.data_);
+  EXPECT_EQ((vector<off_t>{1000, 450000}), delegate_.seek_offsets_);
+}
+
+TEST_F(ParallelMultiRangeHttpFetcherTest, ChunkBoundariesTest) {
+  vector<off_t> offsets;
+  MultiRangeHttpFetcher fetcher(
+      new OffsetRecordingHttpFetcher(data_, &offsets));
+  vector<unique_ptr<HttpFetcher>> fetchers;
+  fetchers.push_back(
+      std::make_unique<OffsetRecordingHttpFetcher>(data_, &offsets));
+  fetcher.SetParallelFetchers(std::move(fetchers), 100000);
+  fetcher.AddRange(0, 500000);
+  // Only the boundaries in the second half of a chunk end it.
+  fetcher.SetChunkBoundaries({30000, 70000, 180000, 260000, 420000});
+  RunTransfer(&fetcher);
+
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 500000),
+            delegate_.data_);
+  std::sort(offsets.begin(), offsets.end());
+  EXPECT_EQ((vector<off_t>{0, 70000, 170000, 260000, 360000, 420000}),
+            offsets);
+}
+
+TEST_F(ParallelMultiRangeHttpFetcherTest, ChunkBoundariesDuringTransferTest) {
+  vector<off_t> offsets;
+  MultiRangeHttpFetcher fetcher(
+      new OffsetRecordingHttpFetcher(data_, &offsets));
+  vector<unique_ptr<HttpFetcher>> fetchers;
+  fetchers.push_back(
+      std::make_unique<OffsetRecordingHttpFetcher>(data_, &offsets));
+  fetcher.SetParallelFetchers(std::move(fetchers), 100000);
+  fetcher.AddRange(1000, 200000);
+  fetcher.AddRange(300000, 200000);
+  fetcher.set_delegate(&delegate_);
+  MessageLoop::current()->PostTask(
+      FROM_HERE, base::Bind(StartTransfer, &fetcher, string(kUnusedUrl)));
+  // The first two chunks are started right away, the boundaries only apply to
+  // the remaining ones, which are split again.
+  MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&MultiRangeHttpFetcher::SetChunkBoundaries,
+                 base::Unretained(&fetcher),
+                 vector<off_t>{150000, 380000}));
+  MessageLoop::current()->Run();
+
+  EXPECT_TRUE(delegate_.successful_);
+  brillo::Blob expected(data_.begin() + 1000, data_.begin() + 201000);
+  expected.insert(
+      expected.end(), data_.begin() + 300000, data_.begin() + 500000);
+  EXPECT_EQ(expected, delegate_.data_);
+  EXPECT_EQ((vector<off_t>{1000, 300000}), delegate_.seek_offsets_);
+  std::sort(offsets.begin(), offsets.end());
+  EXPECT_EQ((vector<off_t>{1000, 101000, 300000, 380000, 480000}), offsets);
+}
+
+TEST_F(ParallelMultiRangeHttpFetcherTest, FailureTest) {
+  MultiRangeHttpFetcher fetcher(
+      new MockHttpFetcher(data_.data(), data_.size()));
+  auto failing_fetcher =
+      std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+  failing_fetcher->FailTransfer(kHttpResponseNotFound);
+  vector<unique_ptr<HttpFetcher>> fetchers;
+  fetchers.push_back(std::move(failing_fetcher));
+  fetcher.SetParallelFetchers(std::move(fetchers), 50000);
+  fetcher.AddRange(0, 200000);
+  RunTransfer(&fetcher);
+
+  // The other chunks are abandoned as soon as one of them fails.
+  EXPECT_FALSE(delegate_.successful_);
+  EXPECT_EQ(kHttpResponseNotFound, fetcher.http_response_code());
+  EXPECT_LT(delegate_.data_.size(), 200000u);
+}
+
+TEST_F(ParallelMultiRangeHttpFetcherTest, MirrorFailoverTest) {
+  const string mirror_url = "http://mirror.invalid/payload";
+  const vector<string> failing_urls = {mirror_url};
+  vector<string> urls;
+  MultiRangeHttpFetcher fetcher(
+      new MirrorHttpFetcher(data_, failing_urls, &urls));
+  vector<unique_ptr<HttpFetcher>> fetchers;
+  fetchers.push_back(
+      std::make_unique<MirrorHttpFetcher>(data_, failing_urls, &urls));
+  fetcher.SetParallelFetchers(std::move(fetchers), 50000);
+  fetcher.SetMirrorUrls({mirror_url});
+  fetcher.AddRange(1000, 200000);
+  RunTransfer(&fetcher);
+
+  // The chunk that failed on the mirror is fetched from the other URL.
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(brillo::Blob(data_.begin() + 1000, data_.begin() + 201000),
+            delegate_.data_);
+  EXPECT_EQ(1, std::count(urls.begin(), urls.end(), mirror_url));
+  EXPECT_EQ(4, std::count(urls.begin(), urls.end(), string(kUnusedUrl)));
+
+  // The transfer fails once all the URLs did.
+  urls.clear();
+  delegate_.data_.clear();
+  const vector<string> all_urls = {kUnusedUrl, mirror_url};
+  MultiRangeHttpFetcher failing_fetcher(
+      new MirrorHttpFetcher(data_, all_urls, &urls));
+  fetchers.clear();
+  fetchers.push_back(
+      std::make_unique<MirrorHttpFetcher>(data_, all_urls, &urls));
+  failing_fetcher.SetParallelFetchers(std::move(fetchers), 50000);
+  failing_fetcher.SetMirrorUrls({mirror_url});
+  failing_fetcher.AddRange(0, 200000);
+  RunTransfer(&failing_fetcher);
+  EXPECT_FALSE(delegate_.successful_);
+  EXPECT_EQ(kHttpResponseNotFound, failing_fetcher.http_response_code());
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
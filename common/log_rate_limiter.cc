@@ -0,0 +1,51 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/log_rate_limiter.h"
+
+namespace chromeos_update_engine {
+
+LogRateLimiter* LogRateLimiter::Get() {
+  static LogRateLimiter limiter;
+  return &limiter;
+}
+
+bool LogRateLimiter::Allow(const char* file, int line) {
+  return Allow(file, line, base::TimeTicks::Now());
+}
+
+bool LogRateLimiter::Allow(const char* file, int line, base::TimeTicks now) {
+  size_t suppressed = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CallSiteState& state = call_sites_[{file, line}];
+    if (now - state.second_start >= base::TimeDelta::FromSeconds(1)) {
+      suppressed = state.suppressed;
+      state = {now, 0, 0};
+    }
+    if (state.logged >= kMaxMessagesPerSecond) {
+      state.suppressed++;
+      return false;
+    }
+    state.logged++;
+  }
+  // Not logged while holding |mutex_|, in case the handler logs too.
+  LOG_IF(INFO, suppressed > 0) << suppressed << " messages from " << file
+                               << ":" << line << " were not logged";
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_LOG_RATE_LIMITER_H_
+#define UPDATE_ENGINE_COMMON_LOG_RATE_LIMITER_H_
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Limits the messages logged from each call site of LOG_RATE_LIMITED(), which
+// is meant for the messages logged for every operation by the workers. All
+// the other messages are logged as usual.
+class LogRateLimiter {
+ public:
+  // At most this many messages per second are logged from each call site.
+  static constexpr size_t kMaxMessagesPerSecond = 20;
+
+  LogRateLimiter() = default;
+
+  // The limiter used by LOG_RATE_LIMITED().
+  static LogRateLimiter* Get();
+
+  // Returns whether to log a message from |file|:|line|, otherwise it's
+  // counted. Once the second in which messages of that call site were dropped
+  // is over, logs how many were before the next one.
+  bool Allow(const char* file, int line);
+  // Same as above, at |now|. Exposed for testing.
+  bool Allow(const char* file, int line, base::TimeTicks now);
+
+ private:
+  struct CallSiteState {
+    base::TimeTicks second_start;
+    size_t logged{0};
+    size_t suppressed{0};
+  };
+
+  std::mutex mutex_;
+  // Keyed by the file name, which stays at the same address, and the line.
+  std::map<std::pair<const char*, int>, CallSiteState> call_sites_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogRateLimiter);
+};
+
+}  // namespace chromeos_update_engine
+
+// Same as LOG(severity), limited to LogRateLimiter::kMaxMessagesPerSecond
+// messages per second from each call site.
+#define LOG_RATE_LIMITED(severity)                                 \
+  LAZY_STREAM(LOG_STREAM(severity),                                \
+              LOG_IS_ON(severity) &&                               \
+                  ::chromeos_update_engine::LogRateLimiter::Get()  \
+                      ->Allow(__FILE__, __LINE__))
+
+#endif  // UPDATE_ENGINE_COMMON_LOG_RATE_LIMITER_H_
@@ -0,0 +1,55 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/log_rate_limiter.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(LogRateLimiterTest, LimitsEachCallSiteTest) {
+  LogRateLimiter limiter;
+  const base::TimeTicks start = base::TimeTicks::Now();
+  for (size_t i = 0; i < LogRateLimiter::kMaxMessagesPerSecond; i++)
+    EXPECT_TRUE(limiter.Allow("file.cc", 1, start));
+  EXPECT_FALSE(limiter.Allow("file.cc", 1, start));
+  EXPECT_FALSE(limiter.Allow(
+      "file.cc", 1, start + base::TimeDelta::FromMilliseconds(999)));
+
+  // The other call sites have their own limit.
+  EXPECT_TRUE(limiter.Allow("file.cc", 2, start));
+  EXPECT_TRUE(limiter.Allow("other_file.cc", 1, start));
+
+  // The limit starts over the next second.
+  const base::TimeTicks next_second = start + base::TimeDelta::FromSeconds(1);
+  for (size_t i = 0; i < LogRateLimiter::kMaxMessagesPerSecond; i++)
+    EXPECT_TRUE(limiter.Allow("file.cc", 1, next_second));
+  EXPECT_FALSE(limiter.Allow("file.cc", 1, next_second));
+}
+
+TEST(LogRateLimiterTest, MacroTest) {
+  int evaluated = 0;
+  auto count = [&evaluated] { return ++evaluated; };
+  for (size_t i = 0; i < 2 * LogRateLimiter::kMaxMessagesPerSecond; i++)
+    LOG_RATE_LIMITED(INFO) << "message " << count();
+  // The loop takes well under a second, the messages past the limit aren't
+  // even formatted.
+  EXPECT_GE(evaluated, static_cast<int>(LogRateLimiter::kMaxMessagesPerSecond));
+  EXPECT_LT(evaluated,
+            static_cast<int>(2 * LogRateLimiter::kMaxMessagesPerSecond));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_accounting.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include <base/files/file_util.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+std::atomic<uint64_t> in_use[kNumMemoryTags];
+std::atomic<uint64_t> peaks[kNumMemoryTags];
+
+size_t TagIndex(MemoryTag tag) {
+  return static_cast<size_t>(tag);
+}
+}  // namespace
+
+const char* MemoryTagName(MemoryTag tag) {
+  switch (tag) {
+    case MemoryTag::kPayloadBuffer:
+      return "payload_buffer";
+    case MemoryTag::kManifest:
+      return "manifest";
+    case MemoryTag::kScheduledOperations:
+      return "scheduled_operations";
+    case MemoryTag::kDiffData:
+      return "diff_data";
+    case MemoryTag::kVerifier:
+      return "verifier";
+    case MemoryTag::kBufferPool:
+      return "buffer_pool";
+    case MemoryTag::kNumConstants:
+      break;
+  }
+  return "unknown";
+}
+
+namespace memory_accounting {
+
+MemoryTagBytes GetInUse() {
+  MemoryTagBytes bytes;
+  for (size_t i = 0; i < kNumMemoryTags; i++)
+    bytes[i] = in_use[i];
+  return bytes;
+}
+
+MemoryTagBytes TakePeaks() {
+  MemoryTagBytes bytes;
+  for (size_t i = 0; i < kNumMemoryTags; i++) {
+    const uint64_t current = in_use[i];
+    bytes[i] = std::max(peaks[i].exchange(current), current);
+  }
+  return bytes;
+}
+
+uint64_t GetResidentSetSize() {
+  std::string statm;
+  if (!base::ReadFileToString(base::FilePath("/proc/self/statm"), &statm))
+    return 0;
+  uint64_t size = 0, resident = 0;
+  if (sscanf(statm.c_str(), "%" SCNu64 " %" SCNu64, &size, &resident) != 2)
+    return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+}  // namespace memory_accounting
+
+MemoryCharge::MemoryCharge(MemoryTag tag, uint64_t bytes) : tag_(tag) {
+  Set(bytes);
+}
+
+MemoryCharge::~MemoryCharge() {
+  Set(0);
+}
+
+void MemoryCharge::Set(uint64_t bytes) {
+  const size_t index = TagIndex(tag_);
+  if (bytes < bytes_) {
+    in_use[index] -= bytes_ - bytes;
+  } else if (bytes > bytes_) {
+    const uint64_t total = in_use[index] += bytes - bytes_;
+    uint64_t peak = peaks[index];
+    while (total > peak && !peaks[index].compare_exchange_weak(peak, total)) {
+    }
+  }
+  bytes_ = bytes;
+}
+
+}  // namespace chromeos_update_engine
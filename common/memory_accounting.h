@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// The subsystems whose large buffers are accounted, to tell which of them
+// drives the peak memory of an update.
+enum class MemoryTag {
+  // The payload data received and not applied yet.
+  kPayloadBuffer,
+  // The parsed manifest.
+  kManifest,
+  // The data of the operations waiting for or running on the worker threads.
+  kScheduledOperations,
+  // The source and target data of the diff operations held in memory, and
+  // the cached source data.
+  kDiffData,
+  // The read buffer of the filesystem verifier.
+  kVerifier,
+  // The idle buffers kept by the AlignedBufferPool for reuse.
+  kBufferPool,
+
+  kNumConstants,
+};
+
+constexpr size_t kNumMemoryTags = static_cast<size_t>(MemoryTag::kNumConstants);
+
+// Bytes per MemoryTag.
+using MemoryTagBytes = std::array<uint64_t, kNumMemoryTags>;
+
+// Returns the name of |tag| used in the logs.
+const char* MemoryTagName(MemoryTag tag);
+
+namespace memory_accounting {
+
+// Returns the bytes currently charged to each tag.
+MemoryTagBytes GetInUse();
+
+// Returns the peak bytes charged to each tag since the previous call, and
+// starts the next interval from the bytes currently in use. Only one caller
+// in the process samples the peaks, the PhaseMetrics of the ActionProcessor
+// during an update.
+MemoryTagBytes TakePeaks();
+
+// Returns the resident set size of the process in bytes, or 0 if unknown.
+uint64_t GetResidentSetSize();
+
+}  // namespace memory_accounting
+
+// Charges the bytes of a buffer to |tag| for the lifetime of the object. The
+// owner of the buffer updates the charge as the buffer grows and shrinks.
+// May be used from any thread.
+class MemoryCharge {
+ public:
+  explicit MemoryCharge(MemoryTag tag, uint64_t bytes = 0);
+  ~MemoryCharge();
+
+  // Charges |bytes| instead of the bytes charged so far.
+  void Set(uint64_t bytes);
+  uint64_t bytes() const { return bytes_; }
+
+ private:
+  const MemoryTag tag_;
+  uint64_t bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryCharge);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_ACCOUNTING_H_
@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_accounting.h"
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+uint64_t InUse(MemoryTag tag) {
+  return memory_accounting::GetInUse()[static_cast<size_t>(tag)];
+}
+}  // namespace
+
+TEST(MemoryAccountingTest, ChargeTest) {
+  const uint64_t in_use = InUse(MemoryTag::kDiffData);
+  memory_accounting::TakePeaks();
+  {
+    MemoryCharge charge(MemoryTag::kDiffData, 100);
+    EXPECT_EQ(in_use + 100, InUse(MemoryTag::kDiffData));
+    MemoryCharge other(MemoryTag::kDiffData);
+    other.Set(50);
+    EXPECT_EQ(in_use + 150, InUse(MemoryTag::kDiffData));
+    charge.Set(20);
+    EXPECT_EQ(20u, charge.bytes());
+    EXPECT_EQ(in_use + 70, InUse(MemoryTag::kDiffData));
+  }
+  EXPECT_EQ(in_use, InUse(MemoryTag::kDiffData));
+
+  // The peak of the interval, then the bytes in use as the next one starts.
+  EXPECT_EQ(in_use + 150,
+            memory_accounting::TakePeaks()[static_cast<size_t>(
+                MemoryTag::kDiffData)]);
+  EXPECT_EQ(in_use,
+            memory_accounting::TakePeaks()[static_cast<size_t>(
+                MemoryTag::kDiffData)]);
+}
+
+TEST(MemoryAccountingTest, TagNamesTest) {
+  for (size_t i = 0; i < kNumMemoryTags; i++)
+    EXPECT_NE(std::string("unknown"), MemoryTagName(static_cast<MemoryTag>(i)));
+}
+
+TEST(MemoryAccountingTest, ResidentSetSizeTest) {
+  const uint64_t rss = memory_accounting::GetResidentSetSize();
+  EXPECT_GT(rss, 0u);
+  // Touches 16 MiB, which becomes resident.
+  auto buffer = std::make_unique<char[]>(16 << 20);
+  for (size_t i = 0; i < (16 << 20); i += 4096)
+    buffer[i] = 1;
+  EXPECT_EQ(1, buffer[0]);
+  EXPECT_GE(memory_accounting::GetResidentSetSize(), rss + (8 << 20));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/metrics_queue.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Nice value of the reporting thread, below the update's own threads.
+constexpr int kReportingNiceValue = 10;
+}  // namespace
+
+MetricsQueue::MetricsQueue(CountersReport counters_report, size_t capacity)
+    : counters_report_(std::move(counters_report)),
+      capacity_(std::max<size_t>(capacity, 1)) {}
+
+MetricsQueue::~MetricsQueue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    wake_.notify_one();
+  }
+  if (thread_.joinable())
+    thread_.join();
+  LOG_IF(WARNING, num_dropped_ > 0)
+      << "Dropped " << num_dropped_ << " metrics reports for lack of room.";
+}
+
+void MetricsQueue::Push(Priority priority, Report report) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_.size() >= capacity_) {
+    if (priority == Priority::kLow) {
+      num_dropped_++;
+      return;
+    }
+    const auto low = std::find_if(
+        pending_.begin(), pending_.end(), [](const auto& pending) {
+          return pending.first == Priority::kLow;
+        });
+    if (low != pending_.end()) {
+      pending_.erase(low);
+      num_dropped_++;
+    }
+  }
+  pending_.emplace_back(priority, std::move(report));
+  StartThreadLocked();
+  wake_.notify_one();
+}
+
+void MetricsQueue::AddToCounter(const std::string& name, int64_t delta) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Left for the next batch, not worth waking the thread for.
+  counters_[name] += delta;
+  StartThreadLocked();
+}
+
+void MetricsQueue::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!thread_.joinable())
+    return;
+  flush_requested_ = true;
+  wake_.notify_one();
+  batch_done_.wait(lock, [this] {
+    return pending_.empty() && counters_.empty() && !reporting_;
+  });
+}
+
+uint64_t MetricsQueue::num_dropped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_dropped_;
+}
+
+void MetricsQueue::StartThreadLocked() {
+  if (!thread_.joinable())
+    thread_ = std::thread(&MetricsQueue::ReportLoop, this);
+}
+
+void MetricsQueue::ReportLoop() {
+  // Only a hint, the reports still run off the main loop if this fails.
+  if (setpriority(PRIO_PROCESS, gettid(), kReportingNiceValue) != 0)
+    PLOG(WARNING) << "Unable to lower the priority of the metrics thread";
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] {
+      return stop_ || flush_requested_ || !pending_.empty();
+    });
+    if (pending_.empty() && counters_.empty()) {
+      flush_requested_ = false;
+      batch_done_.notify_all();
+      if (stop_)
+        return;
+      continue;
+    }
+    std::deque<std::pair<Priority, Report>> batch;
+    batch.swap(pending_);
+    std::map<std::string, int64_t> counters;
+    counters.swap(counters_);
+    flush_requested_ = false;
+    reporting_ = true;
+    lock.unlock();
+
+    for (const auto& [priority, report] : batch)
+      report();
+    if (!counters.empty() && counters_report_)
+      counters_report_(counters);
+
+    lock.lock();
+    reporting_ = false;
+    batch_done_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
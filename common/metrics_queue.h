@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_METRICS_QUEUE_H_
+#define UPDATE_ENGINE_COMMON_METRICS_QUEUE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// MetricsQueue runs the reports of the metrics on a background thread at a low
+// priority, so that what they read (the partition metadata, system
+// properties) and the writes to statsd don't delay the main loop. The reports
+// queued while the thread is busy run together in its next batch. Counters
+// are summed in memory and reported once, with the next batch of reports or
+// Flush().
+//
+// At most |capacity| reports are pending. When full, the new low priority
+// reports are dropped, and the new high priority ones replace the oldest
+// pending low priority report. High priority reports are never dropped.
+class MetricsQueue {
+ public:
+  enum class Priority {
+    kLow,
+    kHigh,
+  };
+
+  using Report = std::function<void()>;
+  // Reports the counters summed since the last batch, by name.
+  using CountersReport =
+      std::function<void(const std::map<std::string, int64_t>& counters)>;
+
+  static constexpr size_t kDefaultCapacity = 64;
+
+  explicit MetricsQueue(CountersReport counters_report,
+                        size_t capacity = kDefaultCapacity);
+  // Runs the pending reports, then stops the thread.
+  ~MetricsQueue();
+
+  // Queues |report| to run on the background thread, started by the first
+  // report or counter. Never blocks on the reports running.
+  void Push(Priority priority, Report report);
+
+  // Adds |delta| to the counter |name|.
+  void AddToCounter(const std::string& name, int64_t delta);
+
+  // Waits until the reports and counters queued so far are reported.
+  void Flush();
+
+  // Returns the number of reports dropped for lack of room.
+  uint64_t num_dropped() const;
+
+ private:
+  // Main loop of the reporting thread.
+  void ReportLoop();
+
+  // Starts |thread_| if it isn't running. Called with |mutex_| held.
+  void StartThreadLocked();
+
+  const CountersReport counters_report_;
+  const size_t capacity_;
+
+  mutable std::mutex mutex_;
+  // Signaled when there are reports to run, a flush or a stop.
+  std::condition_variable wake_;
+  // Signaled when a batch of reports is done.
+  std::condition_variable batch_done_;
+  std::deque<std::pair<Priority, Report>> pending_;
+  std::map<std::string, int64_t> counters_;
+  // Whether Flush() is waiting for the counters too.
+  bool flush_requested_{false};
+  // Whether the thread is running a batch.
+  bool reporting_{false};
+  bool stop_{false};
+  uint64_t num_dropped_{0};
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricsQueue);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_METRICS_QUEUE_H_
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/metrics_queue.h"
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class MetricsQueueTest : public ::testing::Test {
+ protected:
+  MetricsQueue::Report Record(const string& name) {
+    return [this, name] {
+      std::lock_guard<std::mutex> lock(mutex_);
+      reported_.push_back(name);
+    };
+  }
+
+  MetricsQueue::CountersReport RecordCounters() {
+    return [this](const map<string, int64_t>& counters) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      counters_.push_back(counters);
+    };
+  }
+
+  std::mutex mutex_;
+  vector<string> reported_;
+  vector<map<string, int64_t>> counters_;
+};
+
+TEST_F(MetricsQueueTest, ReportsInOrderTest) {
+  MetricsQueue queue(RecordCounters());
+  queue.Flush();
+  queue.Push(MetricsQueue::Priority::kLow, Record("a"));
+  queue.AddToCounter("x", 2);
+  queue.Push(MetricsQueue::Priority::kHigh, Record("b"));
+  queue.AddToCounter("x", 3);
+  queue.AddToCounter("y", 1);
+  queue.Push(MetricsQueue::Priority::kLow, Record("c"));
+  queue.Flush();
+  EXPECT_EQ(vector<string>({"a", "b", "c"}), reported_);
+  // The counters are summed, whichever batches the reports ran in.
+  map<string, int64_t> summed;
+  for (const auto& counters : counters_) {
+    for (const auto& [name, value] : counters)
+      summed[name] += value;
+  }
+  EXPECT_EQ((map<string, int64_t>{{"x", 5}, {"y", 1}}), summed);
+
+  // Counters alone are reported on Flush().
+  counters_.clear();
+  queue.AddToCounter("z", 7);
+  queue.Flush();
+  EXPECT_EQ((vector<map<string, int64_t>>{{{"z", 7}}}), counters_);
+  EXPECT_EQ(0u, queue.num_dropped());
+}
+
+TEST_F(MetricsQueueTest, DropsLowPriorityReportsTest) {
+  MetricsQueue queue(RecordCounters(), 2);
+  // Keeps the thread busy while the next reports are queued.
+  std::promise<void> started;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  queue.Push(MetricsQueue::Priority::kHigh, [&started, released] {
+    started.set_value();
+    released.wait();
+  });
+  started.get_future().wait();
+
+  queue.Push(MetricsQueue::Priority::kLow, Record("low1"));
+  queue.Push(MetricsQueue::Priority::kLow, Record("low2"));
+  // Full, the new low priority report is dropped, the high priority ones
+  // replace the oldest low priority ones.
+  queue.Push(MetricsQueue::Priority::kLow, Record("low3"));
+  queue.Push(MetricsQueue::Priority::kHigh, Record("high1"));
+  queue.Push(MetricsQueue::Priority::kHigh, Record("high2"));
+  // Only high priority ones are pending, none is dropped.
+  queue.Push(MetricsQueue::Priority::kHigh, Record("high3"));
+  EXPECT_EQ(3u, queue.num_dropped());
+
+  release.set_value();
+  queue.Flush();
+  EXPECT_EQ(vector<string>({"high1", "high2", "high3"}), reported_);
+}
+
+TEST_F(MetricsQueueTest, DestructorRunsPendingReportsTest) {
+  {
+    MetricsQueue queue(RecordCounters());
+    queue.Push(MetricsQueue::Priority::kLow, Record("a"));
+    queue.AddToCounter("x", 1);
+  }
+  EXPECT_EQ(vector<string>({"a"}), reported_);
+  EXPECT_EQ((vector<map<string, int64_t>>{{{"x", 1}}}), counters_);
+}
+
+}  // namespace chromeos_update_engine
@@ -23,9 +23,12 @@
 #include <base/time/time.h>
 
 #include "update_engine/common/constants.h"
+#include "update_engine/common/download_metrics.h"
 #include "update_engine/common/dynamic_partition_control_interface.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/metrics_constants.h"
+#include "update_engine/common/phase_metrics.h"
+#include "update_engine/payload_consumer/install_operation_metrics.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
 namespace chromeos_update_engine {
@@ -233,6 +236,32 @@ class MetricsReporterInterface {
   //
   virtual void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) = 0;
+
+  // Helper function to report the resources used by the install operations
+  // applied during an update attempt, per operation type: the number of
+  // operations, their wall and CPU time, and the bytes read from the source
+  // partitions, written to the target partitions and consumed from the
+  // payload.
+  virtual void ReportInstallOperationMetrics(
+      const InstallOperationStatsMap& stats) = 0;
+
+  // Helper function to report the timings of the payload download during an
+  // update attempt: the time to the first byte, the connection phases, the
+  // retries, the time spent waiting for the payload consumer and the
+  // throughput over time.
+  virtual void ReportDownloadMetrics(const DownloadStats& stats) = 0;
+
+  // Helper function to report the wall and CPU time spent in each action of
+  // an update attempt, and in the phases timed within them like the manifest
+  // parsing, the partition preparation and the apply, verification and
+  // postinstall of each partition, with the peak memory of each.
+  virtual void ReportPhaseMetrics(const PhaseStatsMap& stats) = 0;
+
+  // Helper function to report the number of status notifications sent to the
+  // service observers during an update attempt, and of the progress updates
+  // coalesced into later ones.
+  virtual void ReportStatusNotificationMetrics(int num_sent,
+                                               int num_dropped) = 0;
 };
 
 namespace metrics {
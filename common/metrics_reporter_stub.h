@@ -90,6 +90,16 @@ class MetricsReporterStub : public MetricsReporterInterface {
   void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) override {}
 
+  void ReportInstallOperationMetrics(
+      const InstallOperationStatsMap& stats) override {}
+
+  void ReportDownloadMetrics(const DownloadStats& stats) override {}
+
+  void ReportPhaseMetrics(const PhaseStatsMap& stats) override {}
+
+  void ReportStatusNotificationMetrics(int num_sent,
+                                       int num_dropped) override {}
+
  private:
   DISALLOW_COPY_AND_ASSIGN(MetricsReporterStub);
 };
@@ -90,6 +90,14 @@ class MockDynamicPartitionControl : public DynamicPartitionControlInterface {
               (const std::string&, uint32_t slot),
               (override));
   MOCK_METHOD(bool, UpdateUsesSnapshotCompression, (), (override));
+  MOCK_METHOD(bool,
+              GetVerityDevice,
+              (const std::string&,
+               const std::string&,
+               std::string*,
+               brillo::Blob*,
+               uint64_t*),
+              (override));
 };
 
 }  // namespace chromeos_update_engine
@@ -90,6 +90,16 @@ class MockMetricsReporter : public MetricsReporterInterface {
 
   MOCK_METHOD2(ReportEnterpriseUpdateSeenToDownloadDays,
                void(bool has_time_restriction_policy, int time_to_update_days));
+
+  MOCK_METHOD1(ReportInstallOperationMetrics,
+               void(const InstallOperationStatsMap& stats));
+
+  MOCK_METHOD1(ReportDownloadMetrics, void(const DownloadStats& stats));
+
+  MOCK_METHOD1(ReportPhaseMetrics, void(const PhaseStatsMap& stats));
+
+  MOCK_METHOD2(ReportStatusNotificationMetrics,
+               void(int num_sent, int num_dropped));
 };
 
 }  // namespace chromeos_update_engine
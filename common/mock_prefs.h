@@ -45,6 +45,10 @@ class MockPrefs : public PrefsInterface {
   MOCK_CONST_METHOD2(GetSubKeys,
                      bool(std::string_view, std::vector<std::string>*));
 
+  MOCK_METHOD0(StartTransaction, bool());
+  MOCK_METHOD0(CancelTransaction, void());
+  MOCK_METHOD0(SubmitTransaction, bool());
+
   MOCK_METHOD2(AddObserver, void(std::string_view key, ObserverInterface*));
   MOCK_METHOD2(RemoveObserver, void(std::string_view key, ObserverInterface*));
 };
@@ -20,6 +20,8 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "update_engine/common/utils.h"
 
@@ -42,8 +44,16 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
   url_ = url;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
-  LOG(INFO) << "starting first transfer";
   base_fetcher_->set_delegate(this);
+  parallel_ = !parallel_fetchers_.empty() &&
+              std::all_of(ranges_.begin(), ranges_.end(), [](const Range& r) {
+                return r.HasLength();
+              });
+  if (parallel_) {
+    BeginParallelTransfer();
+    return;
+  }
+  LOG(INFO) << "starting first transfer";
   StartTransfer();
 }
 
@@ -58,6 +68,12 @@ void MultiRangeHttpFetcher::TerminateTransfer() {
   }
   terminating_ = true;
 
+  if (parallel_) {
+    TerminateConnections();
+    // Note that after the callback returns this object may be destroyed.
+    MaybeEndParallelTransfer();
+    return;
+  }
   if (!pending_transfer_ended_) {
     pending_transfer_ended_ = true;
     base_fetcher_->TerminateTransfer();
@@ -89,6 +105,8 @@ void MultiRangeHttpFetcher::StartTransfer() {
 bool MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
                                           const void* bytes,
                                           size_t length) {
+  if (parallel_)
+    return ParallelReceivedBytes(fetcher, bytes, length);
   CHECK_LT(current_index_, ranges_.size());
   CHECK_EQ(fetcher, base_fetcher_.get());
   CHECK(!pending_transfer_ended_);
@@ -122,6 +140,10 @@ bool MultiRangeHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
 // State change: Downloading or Pending transfer ended -> Stopped
 void MultiRangeHttpFetcher::TransferEnded(HttpFetcher* fetcher,
                                           bool successful) {
+  if (parallel_) {
+    ParallelTransferEnded(fetcher, successful);
+    return;
+  }
   CHECK(base_fetcher_active_) << "Transfer ended unexpectedly.";
   CHECK_EQ(fetcher, base_fetcher_.get());
   pending_transfer_ended_ = false;
@@ -182,6 +204,355 @@ void MultiRangeHttpFetcher::Reset() {
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  parallel_ = parallel_failed_ = false;
+  chunks_.clear();
+  connections_.clear();
+  next_chunk_ = deliver_index_ = 0;
+  retry_chunks_.clear();
+  urls_.clear();
+  failed_urls_.clear();
+  url_bytes_.clear();
+  bandwidth_estimator_.TransferStopped();
+  connection_tuner_.reset();
+}
+
+void MultiRangeHttpFetcher::SetParallelFetchers(
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers, size_t chunk_size) {
+  CHECK(!base_fetcher_active_) << "SetParallelFetchers but already active.";
+  CHECK_GT(chunk_size, static_cast<size_t>(0));
+  parallel_fetchers_ = std::move(fetchers);
+  parallel_chunk_size_ = chunk_size_ = chunk_size;
+  for (auto& fetcher : parallel_fetchers_) {
+    fetcher->set_download_metrics(download_metrics_);
+    fetcher->set_adaptive_tuning(adaptive_tuning_);
+  }
+}
+
+void MultiRangeHttpFetcher::SetChunkBoundaries(
+    std::vector<off_t> boundaries) {
+  chunk_boundaries_ = std::move(boundaries);
+  // The chunks are split again the next time one is started, as the current
+  // ones may still be used by the callbacks up the stack.
+  replan_chunks_ = parallel_;
+}
+
+void MultiRangeHttpFetcher::SetMirrorUrls(std::vector<std::string> urls) {
+  CHECK(!base_fetcher_active_) << "SetMirrorUrls but already active.";
+  mirror_urls_ = std::move(urls);
+}
+
+void MultiRangeHttpFetcher::Pause() {
+  bandwidth_estimator_.TransferStopped();
+  base_fetcher_->Pause();
+  // The idle fetchers are paused too, so that the chunks started on them
+  // wait for Unpause().
+  for (auto& fetcher : parallel_fetchers_)
+    fetcher->Pause();
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  base_fetcher_->Unpause();
+  for (auto& fetcher : parallel_fetchers_)
+    fetcher->Unpause();
+}
+
+size_t MultiRangeHttpFetcher::GetBytesDownloaded() {
+  size_t bytes_downloaded = base_fetcher_->GetBytesDownloaded();
+  for (auto& fetcher : parallel_fetchers_)
+    bytes_downloaded += fetcher->GetBytesDownloaded();
+  return bytes_downloaded;
+}
+
+void MultiRangeHttpFetcher::BeginParallelTransfer() {
+  // With adaptive tuning, the chunk size tuned over the previous transfers is
+  // kept, but the number of connections is probed again.
+  if (adaptive_tuning_) {
+    connection_tuner_ =
+        std::make_unique<ConnectionTuner>(1 + parallel_fetchers_.size());
+  } else {
+    chunk_size_ = parallel_chunk_size_;
+  }
+  chunks_.clear();
+  for (const Range& range : ranges_)
+    SplitInChunks(range.offset(), range.length(), true);
+  replan_chunks_ = false;
+  urls_ = {url_};
+  urls_.insert(urls_.end(), mirror_urls_.begin(), mirror_urls_.end());
+  failed_urls_.assign(urls_.size(), false);
+  url_bytes_.assign(urls_.size(), 0);
+  connections_.clear();
+  connections_.push_back({base_fetcher_.get()});
+  for (auto& fetcher : parallel_fetchers_) {
+    fetcher->set_delegate(this);
+    connections_.push_back({fetcher.get()});
+  }
+  for (size_t i = 0; i < connections_.size(); i++)
+    connections_[i].url_index = i % urls_.size();
+  LOG(INFO) << "starting parallel transfer of " << chunks_.size()
+            << " chunks over " << connections_.size() << " fetchers from "
+            << urls_.size() << " URLs";
+  next_chunk_ = deliver_index_ = 0;
+  parallel_failed_ = false;
+  base_fetcher_active_ = true;
+  if (delegate_)
+    delegate_->SeekToOffset(chunks_[0].offset);
+  StartIdleConnections();
+  // Note that after the callback returns this object may be destroyed.
+  MaybeEndParallelTransfer();
+}
+
+void MultiRangeHttpFetcher::SplitInChunks(off_t offset,
+                                          size_t length,
+                                          bool starts_range) {
+  const off_t end = offset + static_cast<off_t>(length);
+  const off_t chunk_size = static_cast<off_t>(chunk_size_);
+  while (offset < end) {
+    off_t chunk_end = std::min(end, offset + chunk_size);
+    if (chunk_end < end) {
+      // Use the last boundary in the second half of the chunk, if any.
+      auto it = std::upper_bound(
+          chunk_boundaries_.begin(), chunk_boundaries_.end(), chunk_end);
+      if (it != chunk_boundaries_.begin() &&
+          *(it - 1) > offset + chunk_size / 2) {
+        chunk_end = *(it - 1);
+      }
+    }
+    chunks_.push_back(
+        {offset, static_cast<size_t>(chunk_end - offset), starts_range});
+    starts_range = false;
+    offset = chunk_end;
+  }
+}
+
+void MultiRangeHttpFetcher::ReplanChunks() {
+  replan_chunks_ = false;
+  if (next_chunk_ >= chunks_.size())
+    return;
+  // Nothing was received for these chunks yet.
+  const std::vector<Chunk> pending(chunks_.begin() + next_chunk_,
+                                   chunks_.end());
+  chunks_.erase(chunks_.begin() + next_chunk_, chunks_.end());
+  for (size_t i = 0; i < pending.size();) {
+    const off_t offset = pending[i].offset;
+    size_t length = pending[i].length;
+    const bool starts_range = pending[i].starts_range;
+    // Merge the following chunks of the same range.
+    for (i++; i < pending.size() && !pending[i].starts_range; i++)
+      length += pending[i].length;
+    SplitInChunks(offset, length, starts_range);
+  }
+}
+
+bool MultiRangeHttpFetcher::ParallelReceivedBytes(HttpFetcher* fetcher,
+                                                  const void* bytes,
+                                                  size_t length) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection != nullptr && connection->active);
+  CHECK(!connection->ending);
+  Chunk& chunk = chunks_[connection->chunk_index];
+  const size_t size = std::min(length, chunk.length - chunk.bytes_received);
+  chunk.bytes_received += size;
+  url_bytes_[connection->url_index] += size;
+  if (connection_tuner_ && bandwidth_estimator_.BytesReceived(size))
+    TuneParallelTransfer();
+  if (connection->chunk_index == deliver_index_) {
+    if (delegate_ && !delegate_->ReceivedBytes(this, bytes, size))
+      return false;
+  } else {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    chunk.data.insert(chunk.data.end(), data, data + size);
+  }
+  if (chunk.bytes_received < chunk.length)
+    return true;
+
+  // Pass on the chunks this one was holding back, then wait for the
+  // TransferTerminated callback before starting the next chunk on |fetcher|.
+  if (!DeliverChunks())
+    return false;
+  connection->ending = true;
+  fetcher->TerminateTransfer();
+  return false;
+}
+
+void MultiRangeHttpFetcher::ParallelTransferEnded(HttpFetcher* fetcher,
+                                                  bool successful) {
+  Connection* connection = FindConnection(fetcher);
+  CHECK(connection != nullptr && connection->active)
+      << "Transfer ended unexpectedly.";
+  connection->active = connection->ending = false;
+  // Keep the response code of the first failure.
+  if (!parallel_failed_)
+    http_response_code_ = fetcher->http_response_code();
+
+  // As with the sequential ranges, which all have a length here, the chunk
+  // succeeded if all its bytes were received.
+  const Chunk& chunk = chunks_[connection->chunk_index];
+  if (!terminating_ && !parallel_failed_ &&
+      chunk.bytes_received < chunk.length && !RetryOnOtherUrl(*connection)) {
+    LOG(INFO) << "Didn't get enough bytes of the chunk at " << chunk.offset
+              << ". Ending w/ failure.";
+    parallel_failed_ = true;
+    TerminateConnections();
+  } else if (!terminating_ && !parallel_failed_) {
+    StartIdleConnections();
+  }
+  // Note that after the callback returns this object may be destroyed.
+  MaybeEndParallelTransfer();
+}
+
+bool MultiRangeHttpFetcher::RetryOnOtherUrl(const Connection& connection) {
+  failed_urls_[connection.url_index] = true;
+  if (std::find(failed_urls_.begin(), failed_urls_.end(), false) ==
+      failed_urls_.end()) {
+    return false;
+  }
+  const Chunk& chunk = chunks_[connection.chunk_index];
+  LOG(WARNING) << "Didn't get enough bytes of the chunk at " << chunk.offset
+               << " from " << urls_[connection.url_index]
+               << ", fetching the rest from the other URLs.";
+  retry_chunks_.push_back(connection.chunk_index);
+  return true;
+}
+
+MultiRangeHttpFetcher::Connection* MultiRangeHttpFetcher::FindConnection(
+    HttpFetcher* fetcher) {
+  for (auto& connection : connections_) {
+    if (connection.fetcher == fetcher)
+      return &connection;
+  }
+  return nullptr;
+}
+
+void MultiRangeHttpFetcher::StartIdleConnections() {
+  if (replan_chunks_)
+    ReplanChunks();
+  const size_t max_active_connections = GetMaxActiveConnections();
+  size_t num_active = std::count_if(
+      connections_.begin(), connections_.end(), [](const Connection& c) {
+        return c.active;
+      });
+  connection_loop_depth_++;
+  for (auto& connection : connections_) {
+    // The delegate may terminate the transfer from a callback of
+    // BeginTransfer().
+    if (terminating_ || parallel_failed_ ||
+        num_active >= max_active_connections) {
+      break;
+    }
+    // The chunks to retry are behind the delivered data, so they don't count
+    // against the chunks fetched ahead of it.
+    if (retry_chunks_.empty() &&
+        (next_chunk_ >= chunks_.size() ||
+         next_chunk_ >= deliver_index_ + max_active_connections)) {
+      break;
+    }
+    if (connection.active)
+      continue;
+    num_active++;
+    if (!retry_chunks_.empty()) {
+      connection.chunk_index = retry_chunks_.front();
+      retry_chunks_.pop_front();
+    } else {
+      connection.chunk_index = next_chunk_++;
+    }
+    connection.active = true;
+    // Move on to the next URL left after a failure.
+    while (failed_urls_[connection.url_index])
+      connection.url_index = (connection.url_index + 1) % urls_.size();
+    const Chunk& chunk = chunks_[connection.chunk_index];
+    connection.fetcher->SetOffset(chunk.offset + chunk.bytes_received);
+    connection.fetcher->SetLength(chunk.length - chunk.bytes_received);
+    connection.fetcher->BeginTransfer(urls_[connection.url_index]);
+  }
+  connection_loop_depth_--;
+}
+
+size_t MultiRangeHttpFetcher::GetMaxActiveConnections() const {
+  if (!connection_tuner_)
+    return connections_.size();
+  return std::min(connection_tuner_->connections(), connections_.size());
+}
+
+void MultiRangeHttpFetcher::TuneParallelTransfer() {
+  const size_t connections = connection_tuner_->connections();
+  connection_tuner_->AddSample(bandwidth_estimator_.last_sample());
+  if (connection_tuner_->connections() != connections) {
+    LOG(INFO) << "Fetching over " << connection_tuner_->connections()
+              << " connections at " << bandwidth_estimator_.bytes_per_second()
+              << " bytes/s.";
+  }
+
+  // Chunks of about two seconds of each connection, only split again when
+  // the size changed twofold, as that restarts the planning.
+  const size_t chunk_size = std::clamp<size_t>(
+      bandwidth_estimator_.bytes_per_second() * 2 /
+          connection_tuner_->connections(),
+      parallel_chunk_size_,
+      parallel_chunk_size_ * kMaxChunkSizeFactor);
+  if (chunk_size >= chunk_size_ * 2 || chunk_size * 2 <= chunk_size_) {
+    LOG(INFO) << "Fetching chunks of " << chunk_size << " bytes.";
+    chunk_size_ = chunk_size;
+    replan_chunks_ = true;
+  }
+}
+
+void MultiRangeHttpFetcher::TerminateConnections() {
+  connection_loop_depth_++;
+  for (auto& connection : connections_) {
+    if (connection.active && !connection.ending) {
+      connection.ending = true;
+      connection.fetcher->TerminateTransfer();
+    }
+  }
+  connection_loop_depth_--;
+}
+
+bool MultiRangeHttpFetcher::DeliverChunks() {
+  while (deliver_index_ < chunks_.size()) {
+    Chunk& chunk = chunks_[deliver_index_];
+    if (!chunk.data.empty()) {
+      brillo::Blob data;
+      data.swap(chunk.data);
+      if (delegate_ &&
+          !delegate_->ReceivedBytes(this, data.data(), data.size())) {
+        return false;
+      }
+    }
+    if (chunk.bytes_received < chunk.length)
+      return true;
+    deliver_index_++;
+    if (deliver_index_ < chunks_.size() &&
+        chunks_[deliver_index_].starts_range && delegate_) {
+      delegate_->SeekToOffset(chunks_[deliver_index_].offset);
+    }
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::MaybeEndParallelTransfer() {
+  if (!base_fetcher_active_ || connection_loop_depth_ > 0)
+    return;
+  for (const auto& connection : connections_) {
+    if (connection.active)
+      return;
+  }
+  const bool terminated = terminating_;
+  const bool successful = !parallel_failed_ && deliver_index_ == chunks_.size();
+  LOG(INFO) << "Done w/ all parallel transfers";
+  if (urls_.size() > 1) {
+    for (size_t i = 0; i < urls_.size(); i++) {
+      LOG(INFO) << "Received " << url_bytes_[i] << " bytes from " << urls_[i]
+                << (failed_urls_[i] ? " before it failed" : "");
+    }
+  }
+  Reset();
+  // Note that after the callback returns this object may be destroyed.
+  if (!delegate_)
+    return;
+  if (terminated)
+    delegate_->TransferTerminated(this);
+  else
+    delegate_->TransferComplete(this, successful);
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
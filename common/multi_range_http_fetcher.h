@@ -23,6 +23,9 @@
 #include <utility>
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/bandwidth_estimator.h"
 #include "update_engine/common/http_fetcher.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
@@ -32,6 +35,11 @@
 // as a length to specify unlimited length. It really only would make sense
 // for the last range specified to have unlimited length, tho it is legal for
 // other entries to have unlimited length.
+//
+// With SetParallelFetchers(), the ranges are instead split in chunks which are
+// fetched concurrently over the base fetcher and the extra ones, and the data
+// is reordered so the delegate still receives it in order. With
+// SetMirrorUrls(), the connections are spread over the mirrors of the URL too.
 
 // There are three states a MultiRangeHttpFetcher object will be in:
 // - Stopped (start state)
@@ -55,7 +63,10 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
         bytes_received_this_range_(0) {}
   ~MultiRangeHttpFetcher() override {}
 
-  void ClearRanges() { ranges_.clear(); }
+  void ClearRanges() {
+    ranges_.clear();
+    chunk_boundaries_.clear();
+  }
 
   void AddRange(off_t offset, size_t size) {
     CHECK_GT(size, static_cast<size_t>(0));
@@ -64,6 +75,29 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void AddRange(off_t offset) { ranges_.push_back(Range(offset)); }
 
+  // Fetches the ranges in |chunk_size| chunks over the base fetcher and
+  // |fetchers| in parallel. Each fetcher has at most one chunk in flight, and
+  // at most one chunk per fetcher is fetched ahead of the data delivered to
+  // the delegate. Must be called while stopped. Transfers with a range of
+  // unspecified length are still fetched sequentially over the base fetcher.
+  void SetParallelFetchers(std::vector<std::unique_ptr<HttpFetcher>> fetchers,
+                           size_t chunk_size);
+
+  // Ends the chunks of the parallel mode at these sorted offsets where it
+  // keeps them above half the chunk size, so that the pieces of the data
+  // smaller than a chunk, such as the data blobs of the install operations,
+  // arrive over a single fetcher. It can be called during the transfer, and
+  // then applies to the chunks not started yet. Cleared by ClearRanges().
+  void SetChunkBoundaries(std::vector<off_t> boundaries);
+
+  // Fetches the chunks of the parallel mode from these mirrors of the URL
+  // passed to BeginTransfer() too, one URL per connection in turn. As the
+  // idle connections take the next chunk, the faster mirrors serve more of
+  // them. A chunk that fails on a URL is fetched again from where it stopped
+  // on the other URLs, and the transfer only fails once all the URLs did.
+  // Must be called while stopped.
+  void SetMirrorUrls(std::vector<std::string> urls);
+
   // HttpFetcher overrides.
   void SetOffset(off_t offset) override;
 
@@ -81,6 +115,8 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   void SetHeader(const std::string& header_name,
                  const std::string& header_value) override {
     base_fetcher_->SetHeader(header_name, header_value);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->SetHeader(header_name, header_value);
   }
 
   bool GetHeader(const std::string& header_name,
@@ -88,40 +124,70 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     return base_fetcher_->GetHeader(header_name, header_value);
   }
 
-  void Pause() override { base_fetcher_->Pause(); }
+  void Pause() override;
 
-  void Unpause() override { base_fetcher_->Unpause(); }
+  void Unpause() override;
 
   // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
   void set_idle_seconds(int seconds) override {
     base_fetcher_->set_idle_seconds(seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_idle_seconds(seconds);
   }
   void set_retry_seconds(int seconds) override {
     base_fetcher_->set_retry_seconds(seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_retry_seconds(seconds);
   }
   // TODO(deymo): Determine if this method should be virtual in HttpFetcher so
   // this call is sent to the base_fetcher_.
   void SetProxies(const std::deque<std::string>& proxies) override {
     HttpFetcher::SetProxies(proxies);
     base_fetcher_->SetProxies(proxies);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->SetProxies(proxies);
   }
 
-  inline size_t GetBytesDownloaded() override {
-    return base_fetcher_->GetBytesDownloaded();
+  size_t GetBytesDownloaded() override;
+
+  void set_download_metrics(DownloadMetrics* download_metrics) override {
+    HttpFetcher::set_download_metrics(download_metrics);
+    base_fetcher_->set_download_metrics(download_metrics);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_download_metrics(download_metrics);
   }
 
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
   }
 
   void set_connect_timeout(int connect_timeout_seconds) override {
     base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_connect_timeout(connect_timeout_seconds);
   }
 
   void set_max_retry_count(int max_retry_count) override {
     base_fetcher_->set_max_retry_count(max_retry_count);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_max_retry_count(max_retry_count);
+  }
+
+  // In parallel mode, adaptive tuning also only uses as many of the fetchers
+  // as raise the throughput, and grows the chunks up to kMaxChunkSizeFactor
+  // times the chunk size on fast networks, so that each request is worth its
+  // round trip.
+  void set_adaptive_tuning(bool adaptive_tuning) override {
+    adaptive_tuning_ = adaptive_tuning;
+    base_fetcher_->set_adaptive_tuning(adaptive_tuning);
+    for (auto& fetcher : parallel_fetchers_)
+      fetcher->set_adaptive_tuning(adaptive_tuning);
   }
 
+  static constexpr size_t kMaxChunkSizeFactor = 4;
+
  private:
   // A range object defining the offset and length of a download chunk.  Zero
   // length indicates an unspecified end offset (note that it is impossible to
@@ -145,6 +211,30 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   typedef std::vector<Range> RangesVect;
 
+  // A piece of a range fetched by a single fetcher in parallel mode.
+  struct Chunk {
+    off_t offset;
+    size_t length;
+    // Whether the delegate is told to seek to |offset| before its data.
+    bool starts_range;
+    size_t bytes_received{0};
+    // The data received before the previous chunks were delivered.
+    brillo::Blob data;
+  };
+
+  // One of the fetchers used in parallel mode and the chunk it fetches.
+  struct Connection {
+    HttpFetcher* fetcher;
+    size_t chunk_index{0};
+    // Whether |fetcher| is transferring, or hasn't reported the end of its
+    // transfer yet.
+    bool active{false};
+    // Whether TerminateTransfer() was called on |fetcher|.
+    bool ending{false};
+    // The index in |urls_| of the URL the chunk is fetched from.
+    size_t url_index{0};
+  };
+
   // State change: Stopped or Downloading -> Downloading
   void StartTransfer();
 
@@ -162,6 +252,37 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void Reset();
 
+  // Parallel mode counterparts of the above.
+  void BeginParallelTransfer();
+  // Appends the chunks of |length| bytes at |offset| to |chunks_|.
+  void SplitInChunks(off_t offset, size_t length, bool starts_range);
+  // Splits the chunks not started yet again after SetChunkBoundaries().
+  void ReplanChunks();
+  bool ParallelReceivedBytes(HttpFetcher* fetcher,
+                             const void* bytes,
+                             size_t length);
+  void ParallelTransferEnded(HttpFetcher* fetcher, bool successful);
+  // Marks the URL of |connection| as failed and queues the rest of its chunk
+  // to be fetched from another URL. Returns false if no other URL is left.
+  bool RetryOnOtherUrl(const Connection& connection);
+  Connection* FindConnection(HttpFetcher* fetcher);
+  // Starts the next chunks on the idle connections, as far as the chunks
+  // fetched ahead of the delivered data allow.
+  void StartIdleConnections();
+  // The number of connections to fetch chunks over at once.
+  size_t GetMaxActiveConnections() const;
+  // Updates the number of connections and the chunk size from a new sample of
+  // |bandwidth_estimator_|.
+  void TuneParallelTransfer();
+  // Terminates the transfers of all the active connections.
+  void TerminateConnections();
+  // Passes the buffered data of the chunks that are next in order to the
+  // delegate. Returns false if the delegate didn't accept it.
+  bool DeliverChunks();
+  // Signals the end of the transfer to the delegate once all the connections
+  // are done.
+  void MaybeEndParallelTransfer();
+
   std::unique_ptr<HttpFetcher> base_fetcher_;
 
   // If true, do not send any more data or TransferComplete to the delegate.
@@ -180,6 +301,43 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   RangesVect::size_type current_index_;  // index into ranges_
   size_t bytes_received_this_range_;
 
+  // The extra fetchers and chunk size of the parallel mode.
+  std::vector<std::unique_ptr<HttpFetcher>> parallel_fetchers_;
+  size_t parallel_chunk_size_{0};
+  // The size of the chunks split from now on, tuned from
+  // |parallel_chunk_size_| with adaptive tuning.
+  size_t chunk_size_{0};
+  std::vector<off_t> chunk_boundaries_;
+  bool replan_chunks_{false};
+
+  // The state of the current transfer in parallel mode.
+  bool parallel_{false};
+  bool parallel_failed_{false};
+  // A deque, so that replanning the chunks not started yet keeps the
+  // references to the others valid.
+  std::deque<Chunk> chunks_;
+  std::vector<Connection> connections_;
+  // The next chunk to fetch, and the chunk being delivered to the delegate.
+  size_t next_chunk_{0};
+  size_t deliver_index_{0};
+  // The chunks that failed part way, to resume before the next ones.
+  std::deque<size_t> retry_chunks_;
+  // The URL of the transfer followed by |mirror_urls_|, whether they failed,
+  // and the bytes received from each.
+  std::vector<std::string> mirror_urls_;
+  std::vector<std::string> urls_;
+  std::vector<bool> failed_urls_;
+  std::vector<uint64_t> url_bytes_;
+  // Defers the end of the transfer while looping over |connections_|, as the
+  // fetchers may call back from BeginTransfer() or TerminateTransfer().
+  int connection_loop_depth_{0};
+
+  // The throughput of all the connections, and the number of connections it
+  // picks, with adaptive tuning.
+  bool adaptive_tuning_{false};
+  BandwidthEstimator bandwidth_estimator_;
+  std::unique_ptr<ConnectionTuner> connection_tuner_;
+
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
 
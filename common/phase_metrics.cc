@@ -0,0 +1,207 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/phase_metrics.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/clock.h"
+#include "update_engine/common/trace.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+base::TimeDelta GetCpuTime(clockid_t clock_id) {
+  struct timespec ts {};
+  if (clock_gettime(clock_id, &ts) != 0)
+    return base::TimeDelta();
+  return base::TimeDelta::FromTimeSpec(ts);
+}
+
+base::TimeDelta GetProcessCpuTime() {
+  return GetCpuTime(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Returns the peak memory of |stats| to append to its log line.
+std::string FormatPeakMemory(const PhaseStats& stats) {
+  std::string peak_memory;
+  if (stats.peak_rss) {
+    peak_memory +=
+        ", peak RSS " + std::to_string(stats.peak_rss / 1024 / 1024) + " MiB";
+  }
+  for (size_t i = 0; i < kNumMemoryTags; i++) {
+    if (!stats.peak_memory[i])
+      continue;
+    peak_memory += std::string(", ") +
+                   MemoryTagName(static_cast<MemoryTag>(i)) + " " +
+                   std::to_string(stats.peak_memory[i] / 1024) + " KiB";
+  }
+  return peak_memory;
+}
+
+// The same phase and partition only runs once at a time in a PhaseMetrics.
+uint64_t TraceId(const PhaseMetrics* metrics) {
+  return reinterpret_cast<uintptr_t>(metrics);
+}
+}  // namespace
+
+bool PhaseStats::operator==(const PhaseStats& other) const {
+  return count == other.count && wall_time == other.wall_time &&
+         cpu_time == other.cpu_time && peak_rss == other.peak_rss &&
+         peak_memory == other.peak_memory;
+}
+
+PhaseMetrics::PhaseMetrics() : PhaseMetrics(std::make_unique<Clock>()) {}
+
+PhaseMetrics::PhaseMetrics(std::unique_ptr<ClockInterface> clock)
+    : clock_(std::move(clock)) {}
+
+void PhaseMetrics::Start(const std::string& phase,
+                         const std::string& partition) {
+  const uint64_t rss = memory_accounting::GetResidentSetSize();
+  const MemoryTagBytes peaks = memory_accounting::TakePeaks();
+  const RunningPhase running{clock_->GetMonotonicTime(),
+                             GetProcessCpuTime(),
+                             rss,
+                             memory_accounting::GetInUse()};
+  std::lock_guard<std::mutex> lock(mutex_);
+  AddMemorySample(rss, peaks);
+  if (running_.emplace(PhaseKey(phase, partition), running).second)
+    trace::AsyncBegin(phase, partition, TraceId(this));
+}
+
+void PhaseMetrics::Stop(const std::string& phase,
+                        const std::string& partition) {
+  const base::Time wall_end = clock_->GetMonotonicTime();
+  const base::TimeDelta cpu_end = GetProcessCpuTime();
+  const uint64_t rss = memory_accounting::GetResidentSetSize();
+  const MemoryTagBytes peaks = memory_accounting::TakePeaks();
+  std::lock_guard<std::mutex> lock(mutex_);
+  AddMemorySample(rss, peaks);
+  auto it = running_.find(PhaseKey(phase, partition));
+  if (it == running_.end())
+    return;
+  trace::AsyncEnd(phase, partition, TraceId(this));
+  PhaseStats& stats = stats_[it->first];
+  stats.count++;
+  stats.wall_time += wall_end - it->second.wall_start;
+  stats.cpu_time += cpu_end - it->second.cpu_start;
+  stats.peak_rss = std::max(stats.peak_rss, it->second.peak_rss);
+  for (size_t i = 0; i < kNumMemoryTags; i++) {
+    stats.peak_memory[i] =
+        std::max(stats.peak_memory[i], it->second.peak_memory[i]);
+  }
+  running_.erase(it);
+}
+
+void PhaseMetrics::AddMemorySample(uint64_t rss, const MemoryTagBytes& peaks) {
+  for (auto& [key, running] : running_) {
+    running.peak_rss = std::max(running.peak_rss, rss);
+    for (size_t i = 0; i < kNumMemoryTags; i++)
+      running.peak_memory[i] = std::max(running.peak_memory[i], peaks[i]);
+  }
+}
+
+void PhaseMetrics::Add(const std::string& phase,
+                       const std::string& partition,
+                       base::TimeDelta wall_time,
+                       base::TimeDelta cpu_time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PhaseStats& stats = stats_[PhaseKey(phase, partition)];
+  stats.count++;
+  stats.wall_time += wall_time;
+  stats.cpu_time += cpu_time;
+}
+
+PhaseStatsMap PhaseMetrics::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+PhaseStatsMap PhaseMetrics::GetRunningStats() const {
+  const base::Time wall_now = clock_->GetMonotonicTime();
+  const base::TimeDelta cpu_now = GetProcessCpuTime();
+  std::lock_guard<std::mutex> lock(mutex_);
+  PhaseStatsMap stats;
+  for (const auto& [key, running] : running_) {
+    PhaseStats& running_stats = stats[key];
+    running_stats.count = 1;
+    running_stats.wall_time = wall_now - running.wall_start;
+    running_stats.cpu_time = cpu_now - running.cpu_start;
+    running_stats.peak_rss = running.peak_rss;
+    running_stats.peak_memory = running.peak_memory;
+  }
+  return stats;
+}
+
+void PhaseMetrics::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [key, running] : running_)
+    trace::AsyncEnd(key.first, key.second, TraceId(this));
+  running_.clear();
+  stats_.clear();
+}
+
+ScopedPhaseTimer::ScopedPhaseTimer(PhaseMetrics* metrics,
+                                   const std::string& phase,
+                                   const std::string& partition)
+    : metrics_(metrics), phase_(phase), partition_(partition) {
+  if (metrics_)
+    metrics_->Start(phase_, partition_);
+}
+
+ScopedPhaseTimer::~ScopedPhaseTimer() {
+  if (metrics_)
+    metrics_->Stop(phase_, partition_);
+}
+
+ScopedThreadPhaseTimer::ScopedThreadPhaseTimer(PhaseMetrics* metrics,
+                                               const std::string& phase,
+                                               const std::string& partition)
+    : metrics_(metrics), phase_(phase), partition_(partition) {
+  if (metrics_) {
+    traced_ = trace::Begin(phase_, partition_);
+    wall_start_ = metrics_->clock_->GetMonotonicTime();
+    cpu_start_ = GetCpuTime(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+
+ScopedThreadPhaseTimer::~ScopedThreadPhaseTimer() {
+  if (!metrics_)
+    return;
+  if (traced_)
+    trace::End();
+  metrics_->Add(phase_,
+                partition_,
+                metrics_->clock_->GetMonotonicTime() - wall_start_,
+                GetCpuTime(CLOCK_THREAD_CPUTIME_ID) - cpu_start_);
+}
+
+void LogPhaseStats(const PhaseStatsMap& stats) {
+  for (const auto& [key, phase_stats] : stats) {
+    LOG(INFO) << key.first << (key.second.empty() ? "" : " ") << key.second
+              << ": " << phase_stats.count << " times, "
+              << phase_stats.wall_time.InMilliseconds() << " ms wall, "
+              << phase_stats.cpu_time.InMilliseconds() << " ms CPU"
+              << FormatPeakMemory(phase_stats) << ".";
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PHASE_METRICS_H_
+#define UPDATE_ENGINE_COMMON_PHASE_METRICS_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+#include "update_engine/common/memory_accounting.h"
+
+namespace chromeos_update_engine {
+
+// Names of the phases timed within the actions. The actions themselves are
+// timed by the ActionProcessor under their Type().
+namespace phases {
+// From the first byte of the payload to the manifest being validated.
+constexpr char kManifest[] = "manifest";
+constexpr char kPreparePartitions[] = "prepare_partitions";
+// From a partition being opened to all its operations being applied.
+constexpr char kApply[] = "apply";
+constexpr char kVerity[] = "verity";
+constexpr char kHashing[] = "hashing";
+constexpr char kPostinstall[] = "postinstall";
+}  // namespace phases
+
+// Time spent in one phase, summed over the times it ran.
+struct PhaseStats {
+  uint64_t count{0};
+  base::TimeDelta wall_time;
+  // CPU time of the whole process during the phase. Phases running at the
+  // same time, like the download and the apply of a partition, each count the
+  // CPU time used by both.
+  base::TimeDelta cpu_time;
+  // Peak resident set size of the process, sampled when any phase starts or
+  // stops while this one runs. 0 for the phases timed by the caller.
+  uint64_t peak_rss{0};
+  // Peak bytes charged to each MemoryTag while the phase ran.
+  MemoryTagBytes peak_memory{};
+
+  bool operator==(const PhaseStats& other) const;
+};
+
+// The phase name and the partition name, empty for the phases that aren't
+// per partition.
+using PhaseKey = std::pair<std::string, std::string>;
+using PhaseStatsMap = std::map<PhaseKey, PhaseStats>;
+
+// PhaseMetrics accumulates PhaseStats per phase and partition. Phases can be
+// started and stopped from any thread, and several can run at once. The runs
+// of the phases are also traced, see trace.h.
+class PhaseMetrics {
+ public:
+  PhaseMetrics();
+  explicit PhaseMetrics(std::unique_ptr<ClockInterface> clock);
+
+  // Starts timing |phase| of |partition|. Ignored if it's already running.
+  void Start(const std::string& phase, const std::string& partition = "");
+  // Adds the time since |phase| of |partition| started to its stats. Ignored
+  // if it isn't running.
+  void Stop(const std::string& phase, const std::string& partition = "");
+  // Adds a run of |phase| of |partition| timed by the caller, for the phases
+  // running on several threads at once.
+  void Add(const std::string& phase,
+           const std::string& partition,
+           base::TimeDelta wall_time,
+           base::TimeDelta cpu_time);
+
+  // Returns the stats of the phases stopped so far.
+  PhaseStatsMap GetStats() const;
+  // Returns the stats of the runs of the phases still running, timed up to
+  // now. Each counts once.
+  PhaseStatsMap GetRunningStats() const;
+
+  // Clears the stats and forgets the running phases.
+  void Reset();
+
+ private:
+  friend class ScopedThreadPhaseTimer;
+
+  struct RunningPhase {
+    base::Time wall_start;
+    base::TimeDelta cpu_start;
+    uint64_t peak_rss;
+    MemoryTagBytes peak_memory;
+  };
+
+  // Adds the memory sampled at the start or stop of a phase to the peaks of
+  // the running phases. Must be called with |mutex_| held.
+  void AddMemorySample(uint64_t rss, const MemoryTagBytes& peaks);
+
+  std::unique_ptr<ClockInterface> clock_;
+  mutable std::mutex mutex_;
+  std::map<PhaseKey, RunningPhase> running_;
+  PhaseStatsMap stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(PhaseMetrics);
+};
+
+// Times |phase| of |partition| in |metrics| for its lifetime. Does nothing if
+// |metrics| is null.
+class ScopedPhaseTimer {
+ public:
+  ScopedPhaseTimer(PhaseMetrics* metrics,
+                   const std::string& phase,
+                   const std::string& partition = "");
+  ~ScopedPhaseTimer();
+
+ private:
+  PhaseMetrics* metrics_;
+  std::string phase_;
+  std::string partition_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPhaseTimer);
+};
+
+// Like ScopedPhaseTimer, but counts the CPU time of the calling thread only,
+// and the runs of |phase| of |partition| on other threads may overlap it. Their
+// wall times add up.
+class ScopedThreadPhaseTimer {
+ public:
+  ScopedThreadPhaseTimer(PhaseMetrics* metrics,
+                         const std::string& phase,
+                         const std::string& partition = "");
+  ~ScopedThreadPhaseTimer();
+
+ private:
+  PhaseMetrics* metrics_;
+  std::string phase_;
+  std::string partition_;
+  base::Time wall_start_;
+  base::TimeDelta cpu_start_;
+  bool traced_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedThreadPhaseTimer);
+};
+
+// Logs a summary of |stats|, one line per phase and partition.
+void LogPhaseStats(const PhaseStatsMap& stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PHASE_METRICS_H_
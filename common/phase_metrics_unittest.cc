@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/phase_metrics.h"
+
+#include <memory>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+class PhaseMetricsTest : public ::testing::Test {
+ protected:
+  PhaseMetricsTest() {
+    auto clock = std::make_unique<FakeClock>();
+    clock_ = clock.get();
+    clock_->SetMonotonicTime(now_);
+    metrics_ = std::make_unique<PhaseMetrics>(std::move(clock));
+  }
+
+  void AdvanceTime(TimeDelta delta) {
+    now_ += delta;
+    clock_->SetMonotonicTime(now_);
+  }
+
+  base::Time now_ = base::Time::FromInternalValue(1000000);
+  FakeClock* clock_;
+  std::unique_ptr<PhaseMetrics> metrics_;
+};
+
+TEST_F(PhaseMetricsTest, PhasesTest) {
+  metrics_->Start(phases::kApply, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(100));
+  metrics_->Start(phases::kApply, "vendor");
+  // Already running.
+  metrics_->Start(phases::kApply, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(50));
+  metrics_->Stop(phases::kApply, "system");
+  // Not running anymore.
+  metrics_->Stop(phases::kApply, "system");
+  metrics_->Start(phases::kApply, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(10));
+  metrics_->Stop(phases::kApply, "system");
+  metrics_->Stop(phases::kApply, "vendor");
+  {
+    ScopedPhaseTimer timer(metrics_.get(), phases::kPreparePartitions);
+    AdvanceTime(TimeDelta::FromMilliseconds(20));
+  }
+  ScopedPhaseTimer no_metrics(nullptr, phases::kManifest);
+  // Never stopped.
+  metrics_->Start(phases::kHashing);
+
+  const PhaseStatsMap stats = metrics_->GetStats();
+  ASSERT_EQ(3u, stats.size());
+  const PhaseStats& system = stats.at({phases::kApply, "system"});
+  EXPECT_EQ(2u, system.count);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(160), system.wall_time);
+  EXPECT_GE(system.cpu_time, TimeDelta());
+  const PhaseStats& vendor = stats.at({phases::kApply, "vendor"});
+  EXPECT_EQ(1u, vendor.count);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(60), vendor.wall_time);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(20),
+            stats.at({phases::kPreparePartitions, ""}).wall_time);
+
+  metrics_->Reset();
+  EXPECT_TRUE(metrics_->GetStats().empty());
+  metrics_->Stop(phases::kHashing);
+  EXPECT_TRUE(metrics_->GetStats().empty());
+}
+
+TEST_F(PhaseMetricsTest, RunningStatsTest) {
+  metrics_->Start(phases::kApply, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(100));
+  metrics_->Start(phases::kVerity, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(20));
+  metrics_->Stop(phases::kApply, "system");
+  AdvanceTime(TimeDelta::FromMilliseconds(5));
+
+  PhaseStatsMap running = metrics_->GetRunningStats();
+  ASSERT_EQ(1u, running.size());
+  const PhaseStats& verity = running.at({phases::kVerity, "system"});
+  EXPECT_EQ(1u, verity.count);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(25), verity.wall_time);
+  // Only the stopped runs are in the stats.
+  EXPECT_EQ(1u, metrics_->GetStats().size());
+
+  metrics_->Stop(phases::kVerity, "system");
+  EXPECT_TRUE(metrics_->GetRunningStats().empty());
+}
+
+TEST_F(PhaseMetricsTest, OverlappingRunsTest) {
+  metrics_->Add(phases::kApply,
+                "system",
+                TimeDelta::FromMilliseconds(30),
+                TimeDelta::FromMilliseconds(10));
+  {
+    ScopedThreadPhaseTimer first(metrics_.get(), phases::kApply, "system");
+    AdvanceTime(TimeDelta::FromMilliseconds(10));
+    // Overlaps |first|, as on another thread.
+    ScopedThreadPhaseTimer second(metrics_.get(), phases::kApply, "system");
+    AdvanceTime(TimeDelta::FromMilliseconds(5));
+  }
+  ScopedThreadPhaseTimer no_metrics(nullptr, phases::kApply, "system");
+
+  const PhaseStatsMap stats = metrics_->GetStats();
+  const PhaseStats& system = stats.at({phases::kApply, "system"});
+  EXPECT_EQ(3u, system.count);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(50), system.wall_time);
+  EXPECT_GE(system.cpu_time, TimeDelta::FromMilliseconds(10));
+}
+
+TEST_F(PhaseMetricsTest, PeakMemoryTest) {
+  const size_t tag = static_cast<size_t>(MemoryTag::kPayloadBuffer);
+  const uint64_t in_use = memory_accounting::GetInUse()[tag];
+  MemoryCharge charge(MemoryTag::kPayloadBuffer);
+  metrics_->Start(phases::kApply, "system");
+  charge.Set(1000);
+  charge.Set(4000);
+  charge.Set(500);
+  metrics_->Start(phases::kVerity, "system");
+  charge.Set(2000);
+  charge.Set(0);
+  metrics_->Stop(phases::kVerity, "system");
+  metrics_->Stop(phases::kApply, "system");
+  // Only timed by the caller.
+  metrics_->Add(phases::kHashing, "system", TimeDelta(), TimeDelta());
+
+  const PhaseStatsMap stats = metrics_->GetStats();
+  const PhaseStats& apply = stats.at({phases::kApply, "system"});
+  EXPECT_EQ(in_use + 4000, apply.peak_memory[tag]);
+  EXPECT_GT(apply.peak_rss, 0u);
+  const PhaseStats& verity = stats.at({phases::kVerity, "system"});
+  EXPECT_EQ(in_use + 2000, verity.peak_memory[tag]);
+  EXPECT_GT(verity.peak_rss, 0u);
+  EXPECT_EQ(0u, stats.at({phases::kHashing, "system"}).peak_rss);
+}
+
+}  // namespace chromeos_update_engine
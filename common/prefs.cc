@@ -16,8 +16,12 @@
 
 #include "update_engine/common/prefs.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
 
+#include <android-base/unique_fd.h>
 #include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
@@ -25,6 +29,7 @@
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -34,6 +39,114 @@ namespace chromeos_update_engine {
 
 namespace {
 
+using KeyChanges = PrefsBase::StorageInterface::KeyChanges;
+
+// Name of the journal file in the prefs directory. Keys can't contain dots,
+// so it never collides with one.
+constexpr char kJournalFileName[] = ".journal";
+
+// Serializes |changes| as a sequence of "set <key> <size>\n<value>" and
+// "del <key>\n" records.
+string SerializeJournal(const KeyChanges& changes) {
+  string journal;
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      journal += "set " + key + " " + std::to_string(value->size()) + "\n";
+      journal += *value;
+    } else {
+      journal += "del " + key + "\n";
+    }
+  }
+  return journal;
+}
+
+// Name of the log file of LogPrefs in the prefs directory.
+constexpr char kLogFileName[] = ".log";
+
+// The log is compacted once it grew by this many bytes past twice its size
+// after the last compaction.
+constexpr uint64_t kMinLogCompactionGrowth = 64 * 1024;
+
+bool ParseJournal(std::string_view journal, KeyChanges* changes);
+
+// Serializes |changes| as one log record: a "txn <size> <sha256>\n" header
+// followed by their journal. The checksum tells a record torn by a crash.
+string SerializeLogRecord(const KeyChanges& changes) {
+  const string journal = SerializeJournal(changes);
+  return "txn " + std::to_string(journal.size()) + " " +
+         HashCalculator::SHA256Digest(journal) + "\n" + journal;
+}
+
+// Applies the records of |log| to |values| and returns the size of their
+// valid prefix, the rest being torn or corrupted.
+size_t ParseLog(std::string_view log,
+                std::map<string, string, std::less<>>* values) {
+  size_t parsed = 0;
+  while (parsed < log.size()) {
+    const std::string_view record = log.substr(parsed);
+    const size_t eol = record.find('\n');
+    if (eol == std::string_view::npos)
+      break;
+    const vector<string> fields =
+        base::SplitString(record.substr(0, eol),
+                          " ",
+                          base::KEEP_WHITESPACE,
+                          base::SPLIT_WANT_ALL);
+    size_t size = 0;
+    if (fields.size() != 3 || fields[0] != "txn" ||
+        !base::StringToSizeT(fields[1], &size) ||
+        size > record.size() - eol - 1) {
+      break;
+    }
+    const std::string_view journal = record.substr(eol + 1, size);
+    KeyChanges changes;
+    if (HashCalculator::SHA256Digest(journal) != fields[2] ||
+        !ParseJournal(journal, &changes)) {
+      break;
+    }
+    for (const auto& [key, value] : changes) {
+      if (value) {
+        (*values)[key] = *value;
+      } else {
+        values->erase(key);
+      }
+    }
+    parsed += eol + 1 + size;
+  }
+  return parsed;
+}
+
+// Allows only non-empty keys containing [A-Za-z0-9_-/].
+bool IsValidKey(std::string_view key) {
+  return !key.empty() &&
+         std::all_of(key.begin(), key.end(), [](char c) {
+           return base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) || c == '_' ||
+                  c == '-' || c == PrefsInterface::kKeySeparator;
+         });
+}
+
+bool ParseJournal(std::string_view journal, KeyChanges* changes) {
+  while (!journal.empty()) {
+    const size_t eol = journal.find('\n');
+    TEST_AND_RETURN_FALSE(eol != std::string_view::npos);
+    const vector<string> fields = base::SplitString(
+        journal.substr(0, eol), " ", base::KEEP_WHITESPACE,
+        base::SPLIT_WANT_ALL);
+    journal.remove_prefix(eol + 1);
+    if (fields.size() == 2 && fields[0] == "del") {
+      (*changes)[fields[1]] = std::nullopt;
+      continue;
+    }
+    size_t size = 0;
+    TEST_AND_RETURN_FALSE(fields.size() == 3 && fields[0] == "set" &&
+                          base::StringToSizeT(fields[2], &size) &&
+                          size <= journal.size());
+    (*changes)[fields[1]] = string(journal.substr(0, size));
+    journal.remove_prefix(size);
+  }
+  return true;
+}
+
 void DeleteEmptyDirectories(const base::FilePath& path) {
   base::FileEnumerator path_enum(
       path, false /* recursive */, base::FileEnumerator::DIRECTORIES);
@@ -51,18 +164,53 @@ void DeleteEmptyDirectories(const base::FilePath& path) {
 
 }  // namespace
 
+bool PrefsBase::StorageInterface::SetKeys(const KeyChanges& changes) {
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      TEST_AND_RETURN_FALSE(SetKey(key, *value));
+    } else {
+      TEST_AND_RETURN_FALSE(DeleteKey(key));
+    }
+  }
+  return true;
+}
+
 bool PrefsBase::GetString(const std::string_view key, string* value) const {
-  return storage_->GetKey(key, value);
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (transaction_) {
+    const auto it = transaction_->find(key);
+    if (it != transaction_->end()) {
+      if (!it->second)
+        return false;
+      *value = *it->second;
+      return true;
+    }
+  }
+  if (cache_values_) {
+    const auto it = cache_.find(key);
+    if (it != cache_.end()) {
+      if (!it->second)
+        return false;
+      *value = *it->second;
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(storage_->GetKey(key, value));
+  if (cache_values_)
+    cache_.emplace(key, *value);
+  return true;
 }
 
 bool PrefsBase::SetString(std::string_view key, std::string_view value) {
-  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefSet(key);
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (transaction_) {
+    (*transaction_)[string{key}] = string{value};
+    return true;
   }
+  const bool success = storage_->SetKey(key, value);
+  UpdateCache(key, string{value}, success);
+  TEST_AND_RETURN_FALSE(success);
+  NotifyObservers(key, false);
   return true;
 }
 
@@ -100,21 +248,35 @@ bool PrefsBase::SetBoolean(std::string_view key, const bool value) {
 }
 
 bool PrefsBase::Exists(std::string_view key) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (transaction_) {
+    const auto it = transaction_->find(key);
+    if (it != transaction_->end())
+      return it->second.has_value();
+  }
+  if (cache_values_) {
+    const auto it = cache_.find(key);
+    if (it != cache_.end())
+      return it->second.has_value();
+  }
   return storage_->KeyExists(key);
 }
 
 bool PrefsBase::Delete(std::string_view key) {
-  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefDeleted(key);
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (transaction_) {
+    (*transaction_)[string{key}] = std::nullopt;
+    return true;
   }
+  const bool success = storage_->DeleteKey(key);
+  UpdateCache(key, std::nullopt, success);
+  TEST_AND_RETURN_FALSE(success);
+  NotifyObservers(key, true);
   return true;
 }
 
 bool PrefsBase::Delete(std::string_view pref_key, const vector<string>& nss) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   // Delete pref key for platform.
   bool success = Delete(pref_key);
   // Delete pref key in each namespace.
@@ -133,15 +295,84 @@ bool PrefsBase::Delete(std::string_view pref_key, const vector<string>& nss) {
 }
 
 bool PrefsBase::GetSubKeys(std::string_view ns, vector<string>* keys) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   return storage_->GetSubKeys(ns, keys);
 }
 
+bool PrefsBase::StartTransaction() {
+  // Released when the transaction is submitted or canceled.
+  mutex_.lock();
+  if (transaction_) {
+    mutex_.unlock();
+    LOG(ERROR) << "A transaction is already in progress.";
+    return false;
+  }
+  transaction_.emplace();
+  return true;
+}
+
+void PrefsBase::CancelTransaction() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (!transaction_)
+    return;
+  transaction_.reset();
+  mutex_.unlock();
+}
+
+bool PrefsBase::SubmitTransaction() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(transaction_);
+  const StorageInterface::KeyChanges changes = std::move(*transaction_);
+  transaction_.reset();
+  mutex_.unlock();
+  const bool success = storage_->SetKeys(changes);
+  for (const auto& [key, value] : changes) {
+    UpdateCache(key, value, success);
+  }
+  TEST_AND_RETURN_FALSE(success);
+  for (const auto& [key, value] : changes) {
+    NotifyObservers(key, !value);
+  }
+  return true;
+}
+
+void PrefsBase::UpdateCache(std::string_view key,
+                            const std::optional<string>& value,
+                            bool success) {
+  if (!cache_values_)
+    return;
+  if (success) {
+    cache_.insert_or_assign(string{key}, value);
+  } else {
+    // The key may have been partially changed, read it again next time.
+    const auto it = cache_.find(key);
+    if (it != cache_.end())
+      cache_.erase(it);
+  }
+}
+
+void PrefsBase::NotifyObservers(std::string_view key, bool deleted) {
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key == observers_.end())
+    return;
+  std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
+  for (ObserverInterface* observer : copy_observers) {
+    if (deleted) {
+      observer->OnPrefDeleted(key);
+    } else {
+      observer->OnPrefSet(key);
+    }
+  }
+}
+
 void PrefsBase::AddObserver(std::string_view key, ObserverInterface* observer) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   observers_[std::string{key}].push_back(observer);
 }
 
 void PrefsBase::RemoveObserver(std::string_view key,
                                ObserverInterface* observer) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   std::vector<ObserverInterface*>& observers_for_key =
       observers_[std::string{key}];
   auto observer_it =
@@ -157,11 +388,15 @@ string PrefsInterface::CreateSubKey(const vector<string>& ns_and_key) {
 // Prefs
 
 bool Prefs::Init(const base::FilePath& prefs_dir) {
+  ClearCache();
   return file_storage_.Init(prefs_dir);
 }
 
 bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
+  journal_.clear();
+  ReplayJournal();
+  RestoreFromLog();
   // Delete empty directories. Ignore errors when deleting empty directories.
   DeleteEmptyDirectories(prefs_dir_);
   return true;
@@ -195,47 +430,294 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
 }
 
 bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
+  if (journal_.find(key) != journal_.end())
+    return SetKeys({{string{key}, string{value}}});
+  return ApplyChange(key, string{value}, true);
+}
+
+bool Prefs::FileStorage::KeyExists(std::string_view key) const {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  return base::PathExists(filename);
+}
+
+bool Prefs::FileStorage::DeleteKey(std::string_view key) {
+  if (journal_.find(key) != journal_.end())
+    return SetKeys({{string{key}, std::nullopt}});
+  return ApplyChange(key, std::nullopt, true);
+}
+
+bool Prefs::FileStorage::SetKeys(const KeyChanges& changes) {
+  KeyChanges journal = journal_;
+  for (const auto& [key, value] : changes) {
+    base::FilePath filename;
+    TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+    journal[key] = value;
+  }
+  if (!base::DirectoryExists(prefs_dir_)) {
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+  }
+  // This is the only write that has to reach the disk, the key files are
+  // restored from the journal if the new values don't make it.
+  TEST_AND_RETURN_FALSE(utils::WriteStringToFileAtomic(
+      GetJournalPath().value(), SerializeJournal(journal)));
+  journal_ = std::move(journal);
+  for (const auto& [key, value] : changes) {
+    TEST_AND_RETURN_FALSE(ApplyChange(key, value, false));
+  }
+  return true;
+}
+
+bool Prefs::FileStorage::ApplyChange(std::string_view key,
+                                     const std::optional<string>& value,
+                                     bool sync) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  if (!value) {
+#if BASE_VER < 800000
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
+#else
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
+#endif
+    return true;
+  }
   if (!base::DirectoryExists(filename.DirName())) {
     // Only attempt to create the directory if it doesn't exist to avoid calls
     // to parent directories where we might not have permission to write to.
     TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
   }
+  if (sync) {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteStringToFileAtomic(filename.value(), *value));
+    return true;
+  }
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(filename.value().c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                              0644)));
+  TEST_AND_RETURN_FALSE_ERRNO(fd != -1);
   TEST_AND_RETURN_FALSE(
-      utils::WriteStringToFileAtomic(filename.value(), value));
+      utils::WriteAll(fd.get(), value->data(), value->size()));
   return true;
 }
 
-bool Prefs::FileStorage::KeyExists(std::string_view key) const {
-  base::FilePath filename;
-  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-  return base::PathExists(filename);
+void Prefs::FileStorage::ReplayJournal() {
+  const base::FilePath journal_path = GetJournalPath();
+  string journal;
+  if (!base::ReadFileToString(journal_path, &journal))
+    return;
+  KeyChanges changes;
+  if (ParseJournal(journal, &changes)) {
+    LOG(INFO) << "Replaying " << changes.size() << " prefs from "
+              << journal_path.value();
+    for (const auto& [key, value] : changes) {
+      LOG_IF(ERROR, !ApplyChange(key, value, true))
+          << "Unable to restore pref " << key;
+    }
+  } else {
+    // The journal is renamed into place once complete, this should never
+    // happen.
+    LOG(ERROR) << "Ignoring corrupted prefs journal " << journal_path.value();
+  }
+#if BASE_VER < 800000
+  base::DeleteFile(journal_path, false);
+#else
+  base::DeleteFile(journal_path);
+#endif
 }
 
-bool Prefs::FileStorage::DeleteKey(std::string_view key) {
-  base::FilePath filename;
-  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+void Prefs::FileStorage::RestoreFromLog() {
+  const base::FilePath log_path = prefs_dir_.Append(kLogFileName);
+  string log;
+  if (!base::ReadFileToString(log_path, &log))
+    return;
+  std::map<string, string, std::less<>> values;
+  ParseLog(log, &values);
+  LOG(INFO) << "Restoring " << values.size() << " prefs from "
+            << log_path.value();
+  for (const auto& [key, value] : values) {
+    // Keep the log until all the keys are restored.
+    if (!ApplyChange(key, value, true)) {
+      LOG(ERROR) << "Unable to restore pref " << key;
+      return;
+    }
+  }
 #if BASE_VER < 800000
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
+  base::DeleteFile(log_path, false);
 #else
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
+  base::DeleteFile(log_path);
 #endif
-  return true;
+}
+
+base::FilePath Prefs::FileStorage::GetJournalPath() const {
+  return prefs_dir_.Append(kJournalFileName);
 }
 
 bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
                                            base::FilePath* filename) const {
-  // Allows only non-empty keys containing [A-Za-z0-9_-/].
-  TEST_AND_RETURN_FALSE(!key.empty());
-  for (char c : key)
-    TEST_AND_RETURN_FALSE(base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) ||
-                          c == '_' || c == '-' || c == kKeySeparator);
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
   *filename = prefs_dir_.Append(
       base::FilePath::StringPieceType(key.data(), key.size()));
   return true;
 }
 
+// LogPrefs
+
+bool LogPrefs::Init(const base::FilePath& prefs_dir) {
+  return log_storage_.Init(prefs_dir);
+}
+
+bool LogPrefs::LogStorage::Init(const base::FilePath& prefs_dir) {
+  prefs_dir_ = prefs_dir;
+  values_.clear();
+  log_fd_.reset();
+  if (!base::DirectoryExists(prefs_dir_)) {
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+  }
+  const base::FilePath log_path = prefs_dir_.Append(kLogFileName);
+  if (!base::PathExists(log_path)) {
+    return MigrateFromFiles();
+  }
+  string log;
+  TEST_AND_RETURN_FALSE(base::ReadFileToString(log_path, &log));
+  log_size_ = ParseLog(log, &values_);
+  compacted_size_ = log_size_;
+  if (log_size_ < log.size()) {
+    LOG(WARNING) << "Dropping " << log.size() - log_size_
+                 << " bytes of torn or corrupted records from "
+                 << log_path.value();
+    // Don't append after them.
+    return Compact();
+  }
+  log_fd_.reset(TEMP_FAILURE_RETRY(
+      open(log_path.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)));
+  TEST_AND_RETURN_FALSE_ERRNO(log_fd_ != -1);
+  return true;
+}
+
+bool LogPrefs::LogStorage::GetKey(std::string_view key, string* value) const {
+  const auto it = values_.find(key);
+  if (it == values_.end())
+    return false;
+  *value = it->second;
+  return true;
+}
+
+bool LogPrefs::LogStorage::GetSubKeys(std::string_view ns,
+                                      vector<string>* keys) const {
+  TEST_AND_RETURN_FALSE(IsValidKey(ns));
+  for (auto it = values_.lower_bound(ns);
+       it != values_.end() && it->first.compare(0, ns.size(), ns) == 0;
+       ++it) {
+    keys->push_back(it->first);
+  }
+  return true;
+}
+
+bool LogPrefs::LogStorage::SetKey(std::string_view key,
+                                  std::string_view value) {
+  return Append({{string{key}, string{value}}});
+}
+
+bool LogPrefs::LogStorage::KeyExists(std::string_view key) const {
+  return values_.find(key) != values_.end();
+}
+
+bool LogPrefs::LogStorage::DeleteKey(std::string_view key) {
+  if (values_.find(key) == values_.end())
+    return true;
+  return Append({{string{key}, std::nullopt}});
+}
+
+bool LogPrefs::LogStorage::SetKeys(const KeyChanges& changes) {
+  return Append(changes);
+}
+
+bool LogPrefs::LogStorage::Append(const KeyChanges& changes) {
+  for (const auto& [key, value] : changes) {
+    TEST_AND_RETURN_FALSE(IsValidKey(key));
+  }
+  TEST_AND_RETURN_FALSE(log_fd_ != -1);
+  const string record = SerializeLogRecord(changes);
+  if (!utils::WriteAll(log_fd_.get(), record.data(), record.size()) ||
+      fdatasync(log_fd_.get()) != 0) {
+    PLOG(ERROR) << "Failed to append " << record.size() << " bytes to the "
+                << "prefs log";
+    // Drop what may have been written, the next records would follow it.
+    if (ftruncate(log_fd_.get(), log_size_) != 0) {
+      PLOG(ERROR) << "Failed to truncate the prefs log, closing it";
+      log_fd_.reset();
+    }
+    return false;
+  }
+  log_size_ += record.size();
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      values_[key] = *value;
+    } else {
+      values_.erase(key);
+    }
+  }
+  if (log_size_ > compacted_size_ * 2 + kMinLogCompactionGrowth) {
+    // The record is already durable, a failure here only delays compaction.
+    LOG_IF(WARNING, !Compact()) << "Failed to compact the prefs log";
+  }
+  return true;
+}
+
+bool LogPrefs::LogStorage::Compact() {
+  const base::FilePath log_path = prefs_dir_.Append(kLogFileName);
+  KeyChanges changes;
+  for (const auto& [key, value] : values_) {
+    changes.emplace(key, value);
+  }
+  const string record = SerializeLogRecord(changes);
+  log_fd_.reset();
+  TEST_AND_RETURN_FALSE(
+      utils::WriteStringToFileAtomic(log_path.value(), record));
+  log_fd_.reset(TEMP_FAILURE_RETRY(
+      open(log_path.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)));
+  TEST_AND_RETURN_FALSE_ERRNO(log_fd_ != -1);
+  log_size_ = record.size();
+  compacted_size_ = log_size_;
+  return true;
+}
+
+bool LogPrefs::LogStorage::MigrateFromFiles() {
+  {
+    // Applies the journal of the per-file layout, if any.
+    Prefs prefs;
+    TEST_AND_RETURN_FALSE(prefs.Init(prefs_dir_));
+  }
+  vector<base::FilePath> files;
+  base::FileEnumerator file_enum(
+      prefs_dir_, true /* recursive */, base::FileEnumerator::FILES);
+  for (base::FilePath path = file_enum.Next(); !path.empty();
+       path = file_enum.Next()) {
+    const string key =
+        path.value().substr(prefs_dir_.AsEndingWithSeparator().value().size());
+    if (!IsValidKey(key))
+      continue;
+    TEST_AND_RETURN_FALSE(base::ReadFileToString(path, &values_[key]));
+    files.push_back(path);
+  }
+  TEST_AND_RETURN_FALSE(Compact());
+  if (!files.empty()) {
+    LOG(INFO) << "Migrated " << files.size() << " prefs to "
+              << prefs_dir_.Append(kLogFileName).value();
+  }
+  // The log is durable, the files won't be read anymore.
+  for (const auto& path : files) {
+#if BASE_VER < 800000
+    base::DeleteFile(path, false);
+#else
+    base::DeleteFile(path);
+#endif
+  }
+  DeleteEmptyDirectories(prefs_dir_);
+  return true;
+}
+
 // MemoryPrefs
 
 bool MemoryPrefs::MemoryStorage::GetKey(std::string_view key,
@@ -19,10 +19,13 @@
 
 #include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include <android-base/unique_fd.h>
 #include <base/files/file_path.h>
 
 #include "gtest/gtest_prod.h"  // for FRIEND_TEST
@@ -31,12 +34,19 @@
 namespace chromeos_update_engine {
 
 // Implements a preference store by storing the value associated with a key
-// in a given storage passed during construction.
+// in a given storage passed during construction. It can be used from several
+// threads, a transaction belongs to the thread which started it and the other
+// threads wait for it to be submitted or canceled.
 class PrefsBase : public PrefsInterface {
  public:
   // Storage interface used to set and retrieve keys.
   class StorageInterface {
    public:
+    // Changes to apply to several keys, keys mapped to std::nullopt are
+    // deleted.
+    using KeyChanges =
+        std::map<std::string, std::optional<std::string>, std::less<>>;
+
     StorageInterface() = default;
     virtual ~StorageInterface() = default;
 
@@ -60,11 +70,20 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(std::string_view key) = 0;
 
+    // Applies all of |changes|. The default implementation applies them one
+    // by one, storages that can persist them atomically should override it.
+    // Returns whether the operation succeeded.
+    virtual bool SetKeys(const KeyChanges& changes);
+
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
 
-  explicit PrefsBase(StorageInterface* storage) : storage_(storage) {}
+  // With |cache_values|, the values read from and written to |storage| are
+  // kept in memory, so reading a key again doesn't go to the storage. All the
+  // changes to |storage| must then go through this object.
+  explicit PrefsBase(StorageInterface* storage, bool cache_values = false)
+      : storage_(storage), cache_values_(cache_values) {}
 
   // PrefsInterface methods.
   bool GetString(std::string_view key, std::string* value) const override;
@@ -82,18 +101,53 @@ class PrefsBase : public PrefsInterface {
   bool GetSubKeys(std::string_view ns,
                   std::vector<std::string>* keys) const override;
 
+  bool StartTransaction() override;
+  void CancelTransaction() override;
+  bool SubmitTransaction() override;
+
   void AddObserver(std::string_view key, ObserverInterface* observer) override;
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+ protected:
+  // Drops the cached values, for when the storage changed behind our back.
+  void ClearCache() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    cache_.clear();
+  }
+
  private:
+  // Notifies the observers of |key| that it was set, or deleted if |deleted|.
+  void NotifyObservers(std::string_view key, bool deleted);
+
+  // Records the outcome of setting |key| to |value|, or deleting it if
+  // |value| is std::nullopt, in |cache_|.
+  void UpdateCache(std::string_view key,
+                   const std::optional<std::string>& value,
+                   bool success);
+
+  // Guards all the members below. It's also held by the thread with a
+  // transaction in progress from StartTransaction() until the transaction is
+  // submitted or canceled. Observers are notified with it held, so they can
+  // use this object again.
+  mutable std::recursive_mutex mutex_;
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
 
+  // The changes recorded by the transaction in progress, if any.
+  std::optional<StorageInterface::KeyChanges> transaction_;
+
   // The concrete implementation of the storage used for the keys.
   StorageInterface* storage_;
 
+  const bool cache_values_;
+  // The values of the keys known to the cache, std::nullopt for the keys
+  // known not to exist.
+  mutable std::map<std::string, std::optional<std::string>, std::less<>>
+      cache_;
+
   DISALLOW_COPY_AND_ASSIGN(PrefsBase);
 };
 
@@ -103,7 +157,7 @@ class PrefsBase : public PrefsInterface {
 
 class Prefs : public PrefsBase {
  public:
-  Prefs() : PrefsBase(&file_storage_) {}
+  Prefs() : PrefsBase(&file_storage_, true) {}
 
   // Initializes the store by associating this object with |prefs_dir|
   // as the preference store directory. Returns true on success, false
@@ -128,6 +182,10 @@ class Prefs : public PrefsBase {
     bool SetKey(std::string_view key, std::string_view value) override;
     bool KeyExists(std::string_view key) const override;
     bool DeleteKey(std::string_view key) override;
+    // Writes all of |changes| to a single journal file with one fsync, then
+    // updates the files of the keys without waiting for them to reach the
+    // disk. Init() replays the journal if the device crashed before they did.
+    bool SetKeys(const KeyChanges& changes) override;
 
    private:
     FRIEND_TEST(PrefsTest, GetFileNameForKey);
@@ -139,8 +197,28 @@ class Prefs : public PrefsBase {
     bool GetFileNameForKey(std::string_view key,
                            base::FilePath* filename) const;
 
+    // Sets |key| to |value|, or deletes it if |value| is std::nullopt. Waits
+    // for the change to reach the disk only if |sync|.
+    bool ApplyChange(std::string_view key,
+                     const std::optional<std::string>& value,
+                     bool sync);
+
+    // Applies the changes left in the journal file, if any, and removes it.
+    void ReplayJournal();
+
+    // Moves the keys left in the log of LogPrefs, if any, to their files and
+    // removes it.
+    void RestoreFromLog();
+
+    base::FilePath GetJournalPath() const;
+
     // Preference store directory.
     base::FilePath prefs_dir_;
+
+    // All the changes in the journal file. Until the journal is replayed,
+    // changes to these keys must go through the journal too, or replaying it
+    // would revert them.
+    KeyChanges journal_;
   };
 
   // The concrete file storage implementation.
@@ -149,6 +227,72 @@ class Prefs : public PrefsBase {
   DISALLOW_COPY_AND_ASSIGN(Prefs);
 };
 
+// Implements a preference store by appending the changes to a single log file
+// under a preference store directory, with one fsync per change or
+// transaction. The log is rewritten with just the current values once it grew
+// large enough. The keys stored by Prefs in the same directory are migrated to
+// the log on initialization.
+
+class LogPrefs : public PrefsBase {
+ public:
+  LogPrefs() : PrefsBase(&log_storage_) {}
+
+  // Initializes the store by associating this object with |prefs_dir|
+  // as the preference store directory. Returns true on success, false
+  // otherwise.
+  bool Init(const base::FilePath& prefs_dir);
+
+ private:
+  FRIEND_TEST(LogPrefsTest, CompactionTest);
+
+  class LogStorage : public PrefsBase::StorageInterface {
+   public:
+    LogStorage() = default;
+
+    bool Init(const base::FilePath& prefs_dir);
+
+    // PrefsBase::StorageInterface overrides.
+    bool GetKey(std::string_view key, std::string* value) const override;
+    bool GetSubKeys(std::string_view ns,
+                    std::vector<std::string>* keys) const override;
+    bool SetKey(std::string_view key, std::string_view value) override;
+    bool KeyExists(std::string_view key) const override;
+    bool DeleteKey(std::string_view key) override;
+    bool SetKeys(const KeyChanges& changes) override;
+
+    // Size of the log file in bytes.
+    uint64_t log_size() const { return log_size_; }
+
+   private:
+    // Appends |changes| to the log as one record and waits for it to reach
+    // the disk before applying them to |values_|.
+    bool Append(const KeyChanges& changes);
+
+    // Replaces the log with a single record of all of |values_|.
+    bool Compact();
+
+    // Moves the keys stored one per file in |prefs_dir_| to |values_| and
+    // the log.
+    bool MigrateFromFiles();
+
+    // Preference store directory.
+    base::FilePath prefs_dir_;
+
+    // The current values, all loaded from the log on Init().
+    std::map<std::string, std::string, std::less<>> values_;
+
+    android::base::unique_fd log_fd_;
+    uint64_t log_size_{0};
+    // Size of the log right after the last compaction.
+    uint64_t compacted_size_{0};
+  };
+
+  // The concrete log storage implementation.
+  LogStorage log_storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogPrefs);
+};
+
 // Implements a preference store in memory. The stored values are lost when the
 // object is destroyed.
 
@@ -93,6 +93,21 @@ class PrefsInterface {
   virtual bool GetSubKeys(std::string_view ns,
                           std::vector<std::string>* keys) const = 0;
 
+  // Starts a transaction. Until SubmitTransaction() or CancelTransaction() is
+  // called, the Set*() and Delete() calls are only recorded. The Get*() and
+  // Exists() methods see the recorded changes, GetSubKeys() doesn't. Returns
+  // false if a transaction is already in progress or if the store doesn't
+  // support them, in which case changes keep being applied right away.
+  virtual bool StartTransaction() = 0;
+
+  // Drops the changes recorded since StartTransaction().
+  virtual void CancelTransaction() = 0;
+
+  // Persists all the changes recorded since StartTransaction(), such that if
+  // the device crashes either all of them or none of them are kept. Observers
+  // are notified once the changes are persisted. Returns whether they were.
+  virtual bool SubmitTransaction() = 0;
+
   // Add an observer to watch whenever the given |key| is modified. The
   // OnPrefSet() and OnPrefDelete() methods will be called whenever any of the
   // Set*() methods or the Delete() method are called on the given key,
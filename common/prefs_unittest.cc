@@ -20,6 +20,7 @@
 
 #include <limits>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/files/file_util.h>
@@ -580,10 +581,265 @@ TEST_F(PrefsTest, UnsuccessfulCallsNotObserved) {
   prefs_.RemoveObserver(kInvalidKey, &mock_obserser);
 }
 
+TEST_F(PrefsTest, TransactionSubmitted) {
+  MockPrefsObserver mock_obserser;
+  prefs_.AddObserver(kKey, &mock_obserser);
+  ASSERT_TRUE(prefs_.SetString("deleted-key", "value"));
+
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_FALSE(prefs_.StartTransaction());
+  EXPECT_CALL(mock_obserser, OnPrefSet(_)).Times(0);
+  EXPECT_TRUE(prefs_.SetString(kKey, "value"));
+  EXPECT_TRUE(prefs_.SetInt64("other-key", 42));
+  EXPECT_TRUE(prefs_.Delete("deleted-key"));
+  // The changes are visible, but not persisted yet.
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  EXPECT_FALSE(prefs_.Exists("deleted-key"));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append("deleted-key")));
+  testing::Mock::VerifyAndClearExpectations(&mock_obserser);
+
+  EXPECT_CALL(mock_obserser, OnPrefSet(Eq(kKey)));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("value", value);
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append("other-key"), &value));
+  EXPECT_EQ("42", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("deleted-key")));
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+
+  prefs_.RemoveObserver(kKey, &mock_obserser);
+}
+
+TEST_F(PrefsTest, TransactionCanceled) {
+  ASSERT_TRUE(prefs_.SetString(kKey, "old value"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new value"));
+  prefs_.CancelTransaction();
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("old value", value);
+  EXPECT_TRUE(prefs_.StartTransaction());
+  prefs_.CancelTransaction();
+}
+
+TEST_F(PrefsTest, TransactionBelongsToItsThread) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "transaction value"));
+  // The other thread waits for the transaction to be submitted instead of
+  // joining it.
+  std::thread other_thread([this] {
+    EXPECT_TRUE(prefs_.SetString("other-key", "other value"));
+    ASSERT_TRUE(prefs_.StartTransaction());
+    EXPECT_TRUE(prefs_.SetString(kKey, "other transaction value"));
+    EXPECT_TRUE(prefs_.SubmitTransaction());
+  });
+  EXPECT_FALSE(prefs_.Exists("other-key"));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  other_thread.join();
+
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("other transaction value", value);
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append("other-key"), &value));
+  EXPECT_EQ("other value", value);
+}
+
+TEST_F(PrefsTest, TransactionReplayedAfterCrash) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "multi\nline value"));
+  EXPECT_TRUE(prefs_.SetString("other-key", ""));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  // Simulate the key files not reaching the disk before a crash.
+  ASSERT_TRUE(SetValue(kKey, "torn"));
+  ASSERT_TRUE(SetValue("other-key", "lost"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("multi\nline value", value);
+  EXPECT_TRUE(prefs.GetString("other-key", &value));
+  EXPECT_EQ("", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(".journal")));
+}
+
+TEST_F(PrefsTest, SetStringAfterTransactionNotReverted) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "value"));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "later value"));
+  EXPECT_TRUE(prefs_.Delete("other-key"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("later value", value);
+}
+
+TEST_F(PrefsTest, ValuesCachedTest) {
+  ASSERT_TRUE(SetValue(kKey, "value"));
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  ASSERT_TRUE(prefs_.SetInt64("other-key", 5));
+  ASSERT_TRUE(prefs_.SetString("deleted-key", "value"));
+  ASSERT_TRUE(prefs_.Delete("deleted-key"));
+
+  // Changed behind the back of |prefs_|, the cached values are still used.
+  ASSERT_TRUE(SetValue(kKey, "changed"));
+  ASSERT_TRUE(SetValue("other-key", "6"));
+  ASSERT_TRUE(SetValue("deleted-key", "value"));
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  int64_t int_value = 0;
+  EXPECT_TRUE(prefs_.GetInt64("other-key", &int_value));
+  EXPECT_EQ(5, int_value);
+  EXPECT_FALSE(prefs_.Exists("deleted-key"));
+
+  // A failed write drops the cached value.
+  ASSERT_TRUE(base::CreateDirectory(prefs_dir_.Append("dir-key")));
+  EXPECT_FALSE(prefs_.SetString("dir-key", "value"));
+  EXPECT_TRUE(prefs_.Exists("dir-key"));
+
+  ASSERT_TRUE(prefs_.Init(prefs_dir_));
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("changed", value);
+  EXPECT_TRUE(prefs_.Exists("deleted-key"));
+}
+
 TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+class LogPrefsTest : public BasePrefsTest {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    prefs_dir_ = temp_dir_.GetPath();
+    ASSERT_TRUE(prefs_.Init(prefs_dir_));
+    common_prefs_ = &prefs_;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  base::FilePath prefs_dir_;
+  LogPrefs prefs_;
+};
+
+TEST_F(LogPrefsTest, PersistedTest) {
+  EXPECT_TRUE(prefs_.SetString(kKey, "multi\nline value"));
+  EXPECT_TRUE(prefs_.SetInt64("ns/other-key", 5));
+  EXPECT_TRUE(prefs_.SetBoolean("deleted-key", true));
+  EXPECT_TRUE(prefs_.Delete("deleted-key"));
+  EXPECT_FALSE(prefs_.SetString("bad.key", "value"));
+  // Only the log is written.
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+
+  LogPrefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("multi\nline value", value);
+  int64_t int_value = 0;
+  EXPECT_TRUE(prefs.GetInt64("ns/other-key", &int_value));
+  EXPECT_EQ(5, int_value);
+  EXPECT_FALSE(prefs.Exists("deleted-key"));
+  vector<string> keys;
+  EXPECT_TRUE(prefs.GetSubKeys("ns/", &keys));
+  EXPECT_THAT(keys, ElementsAre("ns/other-key"));
+}
+
+TEST_F(LogPrefsTest, TornRecordDroppedTest) {
+  ASSERT_TRUE(prefs_.SetString(kKey, "value"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new value"));
+  EXPECT_TRUE(prefs_.SetString("other-key", "other value"));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+
+  // Cut the last record as a crash in the middle of its write would.
+  const base::FilePath log_path = prefs_dir_.Append(".log");
+  string log;
+  ASSERT_TRUE(base::ReadFileToString(log_path, &log));
+  log.resize(log.size() - 3);
+  ASSERT_TRUE(base::WriteFile(log_path, log.data(), log.size()) ==
+              static_cast<int>(log.size()));
+
+  // None of the changes of the transaction is applied.
+  LogPrefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  EXPECT_FALSE(prefs.Exists("other-key"));
+
+  // The torn record is gone, the next ones are read back.
+  EXPECT_TRUE(prefs.SetString("other-key", "value"));
+  LogPrefs reloaded_prefs;
+  ASSERT_TRUE(reloaded_prefs.Init(prefs_dir_));
+  EXPECT_TRUE(reloaded_prefs.GetString("other-key", &value));
+  EXPECT_EQ("value", value);
+}
+
+TEST_F(LogPrefsTest, CompactionTest) {
+  const string large_value(1024, 'a');
+  ASSERT_TRUE(prefs_.SetString("other-key", "other value"));
+  for (int i = 0; i < 200; i++) {
+    ASSERT_TRUE(prefs_.SetString(kKey, large_value + std::to_string(i)));
+  }
+  // Well under the 200 KiB written.
+  EXPECT_LT(prefs_.log_storage_.log_size(), 100u * 1024);
+
+  LogPrefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ(large_value + "199", value);
+  EXPECT_TRUE(prefs.GetString("other-key", &value));
+  EXPECT_EQ("other value", value);
+}
+
+TEST_F(LogPrefsTest, MigrationTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const base::FilePath prefs_dir = temp_dir.GetPath();
+  {
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    ASSERT_TRUE(prefs.SetString(kKey, "value"));
+    ASSERT_TRUE(prefs.SetInt64("ns/sub-key", 7));
+  }
+
+  {
+    LogPrefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir));
+    string value;
+    EXPECT_TRUE(prefs.GetString(kKey, &value));
+    EXPECT_EQ("value", value);
+    EXPECT_TRUE(prefs.GetString("ns/sub-key", &value));
+    EXPECT_EQ("7", value);
+    EXPECT_FALSE(base::PathExists(prefs_dir.Append(kKey)));
+    EXPECT_FALSE(base::PathExists(prefs_dir.Append("ns")));
+    EXPECT_TRUE(prefs.SetString(kKey, "new value"));
+  }
+
+  // And back to one file per key.
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("new value", value);
+  EXPECT_TRUE(prefs.GetString("ns/sub-key", &value));
+  EXPECT_EQ("7", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir.Append(".log")));
+}
+
+TEST_F(LogPrefsTest, MultiNamespaceKeyTest) {
+  MultiNamespaceKeyTest();
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
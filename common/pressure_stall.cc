@@ -0,0 +1,75 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/pressure_stall.h"
+
+#include <base/files/file_util.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kCpuPressurePath[] = "/proc/pressure/cpu";
+constexpr char kIoPressurePath[] = "/proc/pressure/io";
+
+// Parses the avg10 value of a pressure line such as
+// "some avg10=1.23 avg60=0.50 avg300=0.10 total=12345".
+bool ParseAvg10(const std::string& line, double* avg10) {
+  for (const auto& field : base::SplitString(
+           line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (base::StartsWith(field, "avg10=", base::CompareCase::SENSITIVE)) {
+      return base::StringToDouble(field.substr(6), avg10);
+    }
+  }
+  return false;
+}
+
+bool ReadPressureStall(const char* path, PressureStall* pressure) {
+  std::string contents;
+  // Not logged, this fails on every poll on kernels without PSI support.
+  if (!base::ReadFileToString(base::FilePath(path), &contents))
+    return false;
+  return ParsePressureStall(contents, pressure);
+}
+}  // namespace
+
+bool ParsePressureStall(const std::string& contents, PressureStall* pressure) {
+  bool has_some = false;
+  for (const auto& line : base::SplitString(
+           contents, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (base::StartsWith(line, "some ", base::CompareCase::SENSITIVE)) {
+      TEST_AND_RETURN_FALSE(ParseAvg10(line, &pressure->some_avg10));
+      has_some = true;
+    } else if (base::StartsWith(line, "full ", base::CompareCase::SENSITIVE)) {
+      TEST_AND_RETURN_FALSE(ParseAvg10(line, &pressure->full_avg10));
+    }
+  }
+  return has_some;
+}
+
+bool ReadCpuPressure(PressureStall* pressure) {
+  return ReadPressureStall(kCpuPressurePath, pressure);
+}
+
+bool ReadIoPressure(PressureStall* pressure) {
+  return ReadPressureStall(kIoPressurePath, pressure);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,44 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PRESSURE_STALL_H_
+#define UPDATE_ENGINE_COMMON_PRESSURE_STALL_H_
+
+#include <string>
+
+namespace chromeos_update_engine {
+
+// Device wide pressure on a resource, as reported by the kernel pressure stall
+// information in /proc/pressure/<resource>. Values are the percentage of wall
+// time over the last 10 seconds during which at least one task ("some") or
+// all non-idle tasks ("full") were stalled on the resource.
+struct PressureStall {
+  double some_avg10{0};
+  double full_avg10{0};
+};
+
+// Parses the contents of a /proc/pressure file. Returns false if the "some"
+// line is missing or malformed; the "full" line is optional.
+bool ParsePressureStall(const std::string& contents, PressureStall* pressure);
+
+// Reads the current CPU or I/O pressure. Return false if the kernel doesn't
+// expose pressure stall information.
+bool ReadCpuPressure(PressureStall* pressure);
+bool ReadIoPressure(PressureStall* pressure);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PRESSURE_STALL_H_
@@ -0,0 +1,44 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/pressure_stall.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(PressureStallTest, ParsePressureStallTest) {
+  PressureStall pressure;
+  EXPECT_TRUE(ParsePressureStall(
+      "some avg10=12.34 avg60=5.00 avg300=1.00 total=123456\n"
+      "full avg10=3.50 avg60=1.00 avg300=0.50 total=2345\n",
+      &pressure));
+  EXPECT_DOUBLE_EQ(12.34, pressure.some_avg10);
+  EXPECT_DOUBLE_EQ(3.5, pressure.full_avg10);
+
+  // Older kernels don't report the "full" line for I/O.
+  pressure = PressureStall();
+  EXPECT_TRUE(ParsePressureStall(
+      "some avg10=1.00 avg60=0.00 avg300=0.00 total=1\n", &pressure));
+  EXPECT_DOUBLE_EQ(1.0, pressure.some_avg10);
+  EXPECT_DOUBLE_EQ(0.0, pressure.full_avg10);
+
+  EXPECT_FALSE(ParsePressureStall("", &pressure));
+  EXPECT_FALSE(ParsePressureStall("full avg10=1.00\n", &pressure));
+  EXPECT_FALSE(ParsePressureStall("some avg10=abc\n", &pressure));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,10 +17,17 @@
 #include "update_engine/common/subprocess.h"
 
 #include <fcntl.h>
+#include <paths.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
@@ -30,6 +37,7 @@
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 #include <base/stl_util.h>
+#include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/secure_blob.h>
@@ -45,61 +53,232 @@ namespace chromeos_update_engine {
 
 namespace {
 
-bool SetupChild(const std::map<string, string>& env, uint32_t flags) {
-  // Setup the environment variables.
-  clearenv();
-  for (const auto& key_value : env) {
-    setenv(key_value.first.c_str(), key_value.second.c_str(), 0);
+// Everything the child needs between vfork() and execve(). It is all prepared
+// by the parent, since the child shares the memory of the parent until it
+// execs and can only make async-signal-safe calls until then.
+struct ChildSetup {
+  const char* path;
+  char* const* argv;
+  char* const* envp;
+  int dev_null_fd;
+  // The (parent fd, child fd) pairs to dup2() in the child. The parent fds are
+  // all above the child ones so no redirection overwrites another one.
+  vector<std::pair<int, int>> redirects;
+  bool redirect_stderr;
+  // The file descriptors left open in the child, sorted.
+  vector<int> kept_fds;
+  int max_fd;
+  sigset_t signal_mask;
+};
+
+// Closes the file descriptors from |first| to |last|, both included.
+void CloseFdRange(int first, int last) {
+  if (first > last)
+    return;
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, first, last, 0) == 0)
+    return;
+#endif  // SYS_close_range
+  for (int fd = first; fd <= last; fd++)
+    close(fd);
+}
+
+[[noreturn]] void RunChild(const ChildSetup& setup) {
+  if (dup2(setup.dev_null_fd, STDIN_FILENO) != STDIN_FILENO)
+    _exit(Subprocess::kErrorExitStatus);
+  for (const auto& redirect : setup.redirects) {
+    if (dup2(redirect.first, redirect.second) != redirect.second)
+      _exit(Subprocess::kErrorExitStatus);
+  }
+  if (setup.redirect_stderr &&
+      dup2(STDOUT_FILENO, STDERR_FILENO) != STDERR_FILENO) {
+    _exit(Subprocess::kErrorExitStatus);
+  }
+  int first = 0;
+  for (const int fd : setup.kept_fds) {
+    CloseFdRange(first, fd - 1);
+    first = fd + 1;
   }
+  CloseFdRange(first, setup.max_fd);
+
+  // All the signals are blocked since vfork(). Restore the default action of
+  // the caught ones before unblocking them, so handlers of the parent never
+  // run in the child. execve() would reset them anyway.
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction action;
+    if (sigaction(sig, nullptr, &action) != 0 || action.sa_handler == SIG_DFL ||
+        action.sa_handler == SIG_IGN) {
+      continue;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(sig, &action, nullptr);
+  }
+  sigprocmask(SIG_SETMASK, &setup.signal_mask, nullptr);
 
-  if ((flags & Subprocess::kRedirectStderrToStdout) != 0) {
-    if (HANDLE_EINTR(dup2(STDOUT_FILENO, STDERR_FILENO)) != STDERR_FILENO)
-      return false;
+  execve(setup.path, setup.argv, setup.envp);
+  _exit(Subprocess::kErrorExitStatus);
+}
+
+// Returns the path of the executable |file| within the directories of $PATH,
+// or |file| if it contains a slash or isn't found.
+string FindInPath(const string& file) {
+  if (file.find('/') != string::npos)
+    return file;
+  const char* path = getenv("PATH");
+  for (const string& dir : base::SplitString(path ? path : _PATH_DEFPATH,
+                                             ":",
+                                             base::KEEP_WHITESPACE,
+                                             base::SPLIT_WANT_ALL)) {
+    string candidate = (dir.empty() ? "." : dir) + "/" + file;
+    if (access(candidate.c_str(), X_OK) == 0)
+      return candidate;
   }
+  return file;
+}
 
-  int fd = HANDLE_EINTR(open("/dev/null", O_RDONLY));
-  if (fd < 0)
-    return false;
-  if (HANDLE_EINTR(dup2(fd, STDIN_FILENO)) != STDIN_FILENO)
-    return false;
-  IGNORE_EINTR(close(fd));
+// Returns a copy of |fd| numbered above |min_fd|, closing |fd|.
+base::ScopedFD MoveFdAbove(base::ScopedFD fd, int min_fd) {
+  if (!fd.is_valid() || fd.get() > min_fd)
+    return fd;
+  return base::ScopedFD(
+      HANDLE_EINTR(fcntl(fd.get(), F_DUPFD_CLOEXEC, min_fd + 1)));
+}
 
-  return true;
+}  // namespace
+
+Subprocess::Process::~Process() {
+  Reset();
 }
 
-// Helper function to launch a process with the given Subprocess::Flags.
-// This function only sets up and starts the process according to the |flags|.
-// The caller is responsible for watching the termination of the subprocess.
-// Return whether the process was successfully launched and fills in the |proc|
-// Process.
-bool LaunchProcess(const vector<string>& cmd,
-                   uint32_t flags,
-                   const vector<int>& output_pipes,
-                   brillo::Process* proc) {
+bool Subprocess::Process::Start(const vector<string>& cmd,
+                                uint32_t flags,
+                                const vector<int>& output_pipes) {
+  CHECK_EQ(pid_, 0);
+  if (cmd.empty()) {
+    LOG(ERROR) << "No command to run";
+    return false;
+  }
+  LOG(INFO) << "Running \"" << base::JoinString(cmd, " ") << "\"";
+
+  const string path =
+      (flags & Subprocess::kSearchPath) != 0 ? FindInPath(cmd[0]) : cmd[0];
+  vector<char*> argv;
   for (const string& arg : cmd)
-    proc->AddArg(arg);
-  proc->SetSearchPath((flags & Subprocess::kSearchPath) != 0);
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
 
   // Create an environment for the child process with just the required PATHs.
-  std::map<string, string> env;
+  vector<string> env;
   for (const char* key : {"LD_LIBRARY_PATH", "PATH"}) {
     const char* value = getenv(key);
     if (value)
-      env.emplace(key, value);
+      env.push_back(string(key) + "=" + value);
+  }
+  vector<char*> envp;
+  for (const string& key_value : env)
+    envp.push_back(const_cast<char*>(key_value.c_str()));
+  envp.push_back(nullptr);
+
+  vector<int> child_fds = output_pipes;
+  child_fds.push_back(STDOUT_FILENO);
+  std::sort(child_fds.begin(), child_fds.end());
+  child_fds.erase(std::unique(child_fds.begin(), child_fds.end()),
+                  child_fds.end());
+  const int max_child_fd = std::max(child_fds.back(), STDERR_FILENO);
+
+  // All our file descriptors are close-on-exec, and numbered above the ones
+  // of the child.
+  base::ScopedFD dev_null_fd =
+      MoveFdAbove(base::ScopedFD(HANDLE_EINTR(
+                      open("/dev/null", O_RDONLY | O_CLOEXEC))),
+                  max_child_fd);
+  if (!dev_null_fd.is_valid()) {
+    PLOG(ERROR) << "Failed to open /dev/null";
+    return false;
+  }
+  std::map<int, base::ScopedFD> pipes;
+  vector<base::ScopedFD> write_fds;
+  ChildSetup setup;
+  for (const int child_fd : child_fds) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      PLOG(ERROR) << "Failed to create a pipe";
+      return false;
+    }
+    pipes[child_fd].reset(fds[0]);
+    write_fds.push_back(MoveFdAbove(base::ScopedFD(fds[1]), max_child_fd));
+    if (!write_fds.back().is_valid()) {
+      PLOG(ERROR) << "Failed to duplicate a pipe";
+      return false;
+    }
+    setup.redirects.emplace_back(write_fds.back().get(), child_fd);
   }
 
-  for (const int fd : output_pipes) {
-    proc->RedirectUsingPipe(fd, false);
+  setup.path = path.c_str();
+  setup.argv = argv.data();
+  setup.envp = envp.data();
+  setup.dev_null_fd = dev_null_fd.get();
+  setup.redirect_stderr = (flags & Subprocess::kRedirectStderrToStdout) != 0;
+  setup.kept_fds = child_fds;
+  setup.kept_fds.insert(setup.kept_fds.end(),
+                        {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+  std::sort(setup.kept_fds.begin(), setup.kept_fds.end());
+  setup.kept_fds.erase(
+      std::unique(setup.kept_fds.begin(), setup.kept_fds.end()),
+      setup.kept_fds.end());
+  const long open_max = sysconf(_SC_OPEN_MAX);  // NOLINT(runtime/int)
+  setup.max_fd = open_max > 0 ? open_max - 1 : std::numeric_limits<int>::max();
+
+  sigset_t all_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &setup.signal_mask);
+  const pid_t pid = vfork();
+  if (pid == 0)
+    RunChild(setup);
+  const int vfork_errno = errno;
+  pthread_sigmask(SIG_SETMASK, &setup.signal_mask, nullptr);
+  if (pid < 0) {
+    errno = vfork_errno;
+    PLOG(ERROR) << "Failed to start a child process";
+    return false;
   }
-  proc->SetCloseUnusedFileDescriptors(true);
-  proc->RedirectUsingPipe(STDOUT_FILENO, false);
-  proc->SetPreExecCallback(base::Bind(&SetupChild, env, flags));
 
-  LOG(INFO) << "Running \"" << base::JoinString(cmd, " ") << "\"";
-  return proc->Start();
+  pid_ = pid;
+  pipes_ = std::move(pipes);
+  return true;
 }
 
-}  // namespace
+int Subprocess::Process::GetPipe(int fd) const {
+  auto it = pipes_.find(fd);
+  return it == pipes_.end() ? -1 : it->second.get();
+}
+
+int Subprocess::Process::Wait() {
+  if (pid_ == 0)
+    return Subprocess::kErrorExitStatus;
+  int status;
+  const pid_t pid = HANDLE_EINTR(waitpid(pid_, &status, 0));
+  if (pid != pid_) {
+    PLOG(ERROR) << "Failed to wait for process " << pid_;
+    pid_ = 0;
+    return Subprocess::kErrorExitStatus;
+  }
+  pid_ = 0;
+  if (WIFSIGNALED(status)) {
+    LOG(ERROR) << "Process " << pid << " was killed by signal "
+               << WTERMSIG(status);
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+void Subprocess::Process::Reset() {
+  pipes_.clear();
+  if (pid_ != 0 && kill(pid_, SIGKILL) != 0)
+    PLOG(WARNING) << "Error sending SIGKILL to " << pid_;
+  pid_ = 0;
+}
 
 void Subprocess::Init(
     brillo::AsynchronousSignalHandlerInterface* async_signal_handler) {
@@ -160,10 +339,10 @@ void Subprocess::ChildExitedCallback(const siginfo_t& info) {
   }
   // Release and close all the pipes after calling the callback so our
   // redirected pipes are still alive. Releasing the process first makes
-  // Reset(0) not attempt to kill the process, which is already a zombie at this
+  // Reset() not attempt to kill the process, which is already a zombie at this
   // point.
   record->proc.Release();
-  record->proc.Reset(0);
+  record->proc.Reset();
 
   subprocess_records_.erase(pid_record);
 }
@@ -179,7 +358,7 @@ pid_t Subprocess::ExecFlags(const vector<string>& cmd,
                             const ExecCallback& callback) {
   unique_ptr<SubprocessRecord> record(new SubprocessRecord(callback));
 
-  if (!LaunchProcess(cmd, flags, output_pipes, &record->proc)) {
+  if (!record->proc.Start(cmd, flags, output_pipes)) {
     LOG(ERROR) << "Failed to launch subprocess";
     return 0;
   }
@@ -243,8 +422,8 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
                                       int* return_code,
                                       string* stdout_str,
                                       string* stderr_str) {
-  brillo::ProcessImpl proc;
-  if (!LaunchProcess(cmd, flags, {STDERR_FILENO}, &proc)) {
+  Process proc;
+  if (!proc.Start(cmd, flags, {STDERR_FILENO})) {
     LOG(ERROR) << "Failed to launch subprocess";
     return false;
   }
@@ -290,7 +469,7 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
   int proc_return_code = proc.Wait();
   if (return_code)
     *return_code = proc_return_code;
-  return proc_return_code != brillo::Process::kErrorExitStatus;
+  return proc_return_code != kErrorExitStatus;
 }
 
 void Subprocess::FlushBufferedLogsAtExit() {
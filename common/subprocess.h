@@ -25,16 +25,15 @@
 #include <vector>
 
 #include <base/callback.h>
+#include <base/files/scoped_file.h>
 #include <base/files/file_descriptor_watcher_posix.h>
 #include <base/logging.h>
 #include <base/macros.h>
 #include <brillo/asynchronous_signal_handler_interface.h>
 #include <brillo/message_loops/message_loop.h>
 #ifdef __CHROMEOS__
-#include <brillo/process/process.h>
 #include <brillo/process/process_reaper.h>
 #else
-#include <brillo/process.h>
 #include <brillo/process_reaper.h>
 #endif  // __CHROMEOS__
 #include <gtest/gtest_prod.h>
@@ -57,6 +56,9 @@ class Subprocess {
     kRedirectStderrToStdout = 1 << 1,
   };
 
+  // The exit code of a child that failed to execute the command.
+  static constexpr int kErrorExitStatus = 127;
+
   // Callback type used when an async process terminates. It receives the exit
   // code and the stdout output (and stderr if redirected).
   using ExecCallback = base::Callback<void(int, const std::string&)>;
@@ -115,6 +117,48 @@ class Subprocess {
  private:
   FRIEND_TEST(SubprocessTest, CancelTest);
 
+  // A child process started with vfork() and execve(). Unlike fork(), vfork()
+  // doesn't copy the page tables of the whole update_engine address space,
+  // which makes starting a child much cheaper for a large process.
+  class Process {
+   public:
+    Process() = default;
+    // Calls Reset().
+    ~Process();
+
+    // Starts |cmd| in a child with stdin on /dev/null and pipes connected to
+    // its stdout and to each of the file descriptors in |output_pipes|. Every
+    // other file descriptor but stderr is closed in the child. Returns whether
+    // the child was started, even if it then fails to execute |cmd|.
+    bool Start(const std::vector<std::string>& cmd,
+               uint32_t flags,
+               const std::vector<int>& output_pipes);
+
+    pid_t pid() const { return pid_; }
+
+    // Returns the parent end of the pipe connected to |fd| in the child, or -1
+    // if |fd| isn't redirected.
+    int GetPipe(int fd) const;
+
+    // Waits for the child to exit and returns its exit code, -1 if it was
+    // killed by a signal or kErrorExitStatus if it couldn't be waited for.
+    int Wait();
+
+    // Forgets about the child without killing it, once it exited or is going
+    // to be waited for somewhere else.
+    void Release() { pid_ = 0; }
+
+    // Kills the child with SIGKILL unless released and closes the pipes.
+    void Reset();
+
+   private:
+    pid_t pid_{0};
+    // The parent end of the pipes, by file descriptor in the child.
+    std::map<int, base::ScopedFD> pipes_;
+
+    DISALLOW_COPY_AND_ASSIGN(Process);
+  };
+
   struct SubprocessRecord {
     explicit SubprocessRecord(const ExecCallback& callback)
         : callback(callback) {}
@@ -122,9 +166,9 @@ class Subprocess {
     // The callback supplied by the caller.
     ExecCallback callback;
 
-    // The ProcessImpl instance managing the child process. Destroying this
-    // will close our end of the pipes we have open.
-    brillo::ProcessImpl proc;
+    // The child process. Destroying this will close our end of the pipes we
+    // have open.
+    Process proc;
 
     // These are used to monitor the stdout of the running process, including
     // the stderr if it was redirected.
@@ -209,6 +209,17 @@ TEST_F(SubprocessTest, SynchronousTrueSearchsOnPath) {
   EXPECT_EQ(0, rc);
 }
 
+TEST_F(SubprocessTest, SynchronousMissingCommandFails) {
+  int rc = -1;
+  EXPECT_FALSE(Subprocess::SynchronousExecFlags(
+      {"update_engine_missing_command"},
+      Subprocess::kSearchPath,
+      &rc,
+      nullptr,
+      nullptr));
+  EXPECT_EQ(Subprocess::kErrorExitStatus, rc);
+}
+
 TEST_F(SubprocessTest, SynchronousEchoTest) {
   vector<string> cmd = {
       kBinPath "/sh", "-c", "echo -n stdout-here; echo -n stderr-there >&2"};
@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/thread_placement.h"
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Nice value of the compute work of background updates.
+constexpr int kBackgroundComputeNiceValue = 10;
+
+// Reads the capacity of each CPU, 0 where the kernel doesn't report it.
+vector<uint64_t> ReadCpuCapacities() {
+  vector<uint64_t> capacities;
+  for (int cpu = 0;; cpu++) {
+    const base::FilePath cpu_dir(
+        base::StringPrintf("/sys/devices/system/cpu/cpu%d", cpu));
+    if (!base::DirectoryExists(cpu_dir))
+      break;
+    string value;
+    uint64_t capacity = 0;
+    if (base::ReadFileToString(cpu_dir.Append("cpu_capacity"), &value))
+      base::StringToUint64(base::TrimWhitespaceASCII(value, base::TRIM_ALL),
+                           &capacity);
+    capacities.push_back(capacity);
+  }
+  return capacities;
+}
+}  // namespace
+
+ThreadPlacement* ThreadPlacement::Get() {
+  static ThreadPlacement* placement = new ThreadPlacement(ReadCpuCapacities());
+  return placement;
+}
+
+ThreadPlacement::ThreadPlacement(vector<uint64_t> cpu_capacities)
+    : cpu_capacities_(std::move(cpu_capacities)) {}
+
+void ThreadPlacement::SetMode(Mode mode) {
+  mode_ = mode;
+  generation_++;
+}
+
+vector<int> ThreadPlacement::GetCpus(Mode mode, WorkClass work_class) const {
+  vector<int> all_cpus(cpu_capacities_.size());
+  for (size_t cpu = 0; cpu < all_cpus.size(); cpu++)
+    all_cpus[cpu] = cpu;
+  if (mode == Mode::kDefault || cpu_capacities_.empty())
+    return all_cpus;
+  const auto [min_capacity, max_capacity] =
+      std::minmax_element(cpu_capacities_.begin(), cpu_capacities_.end());
+  if (*min_capacity == *max_capacity)
+    return all_cpus;
+
+  // The compute work gets the largest CPUs in performance mode, the smallest
+  // ones in background mode.
+  const uint64_t compute_capacity =
+      mode == Mode::kPerformance ? *max_capacity : *min_capacity;
+  vector<int> compute_cpus;
+  vector<int> other_cpus;
+  for (size_t cpu = 0; cpu < cpu_capacities_.size(); cpu++) {
+    (cpu_capacities_[cpu] == compute_capacity ? compute_cpus : other_cpus)
+        .push_back(cpu);
+  }
+  if (work_class == WorkClass::kCompute)
+    return compute_cpus;
+  // In background mode the I/O work may use any CPU, the larger ones are
+  // only busy with the rest of the device.
+  return mode == Mode::kPerformance ? other_cpus : all_cpus;
+}
+
+int ThreadPlacement::GetNiceValue(Mode mode, WorkClass work_class) {
+  return mode == Mode::kBackground && work_class == WorkClass::kCompute
+             ? kBackgroundComputeNiceValue
+             : 0;
+}
+
+void ThreadPlacement::PlaceCurrentThread(WorkClass work_class) {
+  // What the calling thread was last placed for.
+  thread_local const ThreadPlacement* placed_by = nullptr;
+  thread_local uint64_t placed_generation = 0;
+  thread_local WorkClass placed_class = WorkClass::kCompute;
+
+  const uint64_t generation = generation_;
+  if (generation == 0 || (placed_by == this &&
+                          placed_generation == generation &&
+                          placed_class == work_class)) {
+    return;
+  }
+  placed_by = this;
+  placed_generation = generation;
+  placed_class = work_class;
+
+  const Mode mode = mode_;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : GetCpus(mode, work_class))
+    CPU_SET(cpu, &cpu_set);
+  // Only a hint: the task profiles of update_engine may not allow these CPUs
+  // or a higher priority.
+  if ((CPU_COUNT(&cpu_set) != 0 &&
+       sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) ||
+      setpriority(PRIO_PROCESS, gettid(), GetNiceValue(mode, work_class)) !=
+          0) {
+    if (!logged_failure_.exchange(true))
+      PLOG(WARNING) << "Unable to place the worker threads";
+  }
+}
+
+}  // namespace chromeos_update_engine
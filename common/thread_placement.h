@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_THREAD_PLACEMENT_H_
+#define UPDATE_ENGINE_COMMON_THREAD_PLACEMENT_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// ThreadPlacement chooses the CPUs and the priority of the worker threads of
+// an update from the kind of work they do and the mode of the update. On
+// devices with CPUs of different capacities, like big.LITTLE, the compute
+// work (diffs, decompression, hashing) runs on the largest CPUs in
+// performance mode and on the smallest ones in background mode, at a lower
+// priority. The I/O work stays off the CPUs given to the compute work when
+// there are others, so that submitting I/O isn't delayed behind it.
+//
+// The workers call PlaceCurrentThread() before each piece of work, which only
+// makes system calls when the class of work or the mode changed. Nothing
+// is changed until SetMode() is called once.
+class ThreadPlacement {
+ public:
+  enum class Mode {
+    // All the CPUs, at the default priority.
+    kDefault,
+    kPerformance,
+    kBackground,
+  };
+
+  enum class WorkClass {
+    kCompute,
+    kIo,
+  };
+
+  // Returns the placement of the update_engine process, with the CPU
+  // capacities read from sysfs.
+  static ThreadPlacement* Get();
+
+  // |cpu_capacities| has the capacity of each CPU, by CPU number.
+  explicit ThreadPlacement(std::vector<uint64_t> cpu_capacities);
+  ~ThreadPlacement() = default;
+
+  // Sets the mode, which the workers follow from their next piece of work.
+  // May be called from any thread.
+  void SetMode(Mode mode);
+  Mode mode() const { return mode_; }
+
+  // Moves the calling thread to the CPUs and the priority of |work_class| in
+  // the current mode, if it isn't there already.
+  void PlaceCurrentThread(WorkClass work_class);
+
+  // Returns the CPUs for |work_class| in |mode|, all of them if the CPUs
+  // don't differ in capacity.
+  std::vector<int> GetCpus(Mode mode, WorkClass work_class) const;
+
+  // Returns the nice value for |work_class| in |mode|.
+  static int GetNiceValue(Mode mode, WorkClass work_class);
+
+ private:
+  const std::vector<uint64_t> cpu_capacities_;
+  std::atomic<Mode> mode_{Mode::kDefault};
+  // Incremented by each SetMode(), 0 until then.
+  std::atomic<uint64_t> generation_{0};
+  std::atomic<bool> logged_failure_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPlacement);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_THREAD_PLACEMENT_H_
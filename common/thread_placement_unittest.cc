@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/thread_placement.h"
+
+#include <sys/resource.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+using Mode = ThreadPlacement::Mode;
+using WorkClass = ThreadPlacement::WorkClass;
+
+TEST(ThreadPlacementTest, BigLittleTest) {
+  // Four little, two medium and two big CPUs.
+  ThreadPlacement placement({160, 160, 160, 160, 512, 512, 1024, 1024});
+  const vector<int> all_cpus = {0, 1, 2, 3, 4, 5, 6, 7};
+
+  EXPECT_EQ(vector<int>({6, 7}),
+            placement.GetCpus(Mode::kPerformance, WorkClass::kCompute));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 4, 5}),
+            placement.GetCpus(Mode::kPerformance, WorkClass::kIo));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3}),
+            placement.GetCpus(Mode::kBackground, WorkClass::kCompute));
+  EXPECT_EQ(all_cpus, placement.GetCpus(Mode::kBackground, WorkClass::kIo));
+  EXPECT_EQ(all_cpus, placement.GetCpus(Mode::kDefault, WorkClass::kCompute));
+  EXPECT_EQ(all_cpus, placement.GetCpus(Mode::kDefault, WorkClass::kIo));
+
+  EXPECT_LT(0,
+            ThreadPlacement::GetNiceValue(Mode::kBackground,
+                                          WorkClass::kCompute));
+  EXPECT_EQ(0,
+            ThreadPlacement::GetNiceValue(Mode::kBackground, WorkClass::kIo));
+  EXPECT_EQ(0,
+            ThreadPlacement::GetNiceValue(Mode::kPerformance,
+                                          WorkClass::kCompute));
+}
+
+TEST(ThreadPlacementTest, SameCapacityTest) {
+  // Without capacities, or with only one kind of CPU, nothing is restricted.
+  ThreadPlacement placement({1024, 1024, 1024});
+  EXPECT_EQ(vector<int>({0, 1, 2}),
+            placement.GetCpus(Mode::kPerformance, WorkClass::kCompute));
+  EXPECT_EQ(vector<int>({0, 1, 2}),
+            placement.GetCpus(Mode::kBackground, WorkClass::kIo));
+  ThreadPlacement unknown_placement({0, 0});
+  EXPECT_EQ(vector<int>({0, 1}),
+            unknown_placement.GetCpus(Mode::kBackground, WorkClass::kCompute));
+}
+
+TEST(ThreadPlacementTest, SetModeTest) {
+  ThreadPlacement placement({1024, 1024});
+  EXPECT_EQ(Mode::kDefault, placement.mode());
+  // Doesn't touch the thread before a mode is set.
+  placement.PlaceCurrentThread(WorkClass::kCompute);
+  EXPECT_EQ(0, getpriority(PRIO_PROCESS, 0));
+  placement.SetMode(Mode::kBackground);
+  EXPECT_EQ(Mode::kBackground, placement.mode());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_file.h>
+#include <base/json/string_escape.h>
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <base/threading/platform_thread.h>
+
+#ifdef __ANDROID__
+#define ATRACE_TAG ATRACE_TAG_ALWAYS
+#include <cutils/trace.h>
+#endif  // __ANDROID__
+
+using std::string;
+using std::string_view;
+
+namespace chromeos_update_engine {
+namespace trace {
+
+namespace {
+// Category of the asynchronous spans in the JSON file, which tells them apart
+// together with their name and id.
+constexpr char kCategory[] = "update_engine";
+
+// Whether |file_trace| is open, checked without locking |file_trace_mutex|.
+std::atomic<bool> file_trace_enabled{false};
+std::mutex file_trace_mutex;
+base::ScopedFILE file_trace;
+bool file_trace_empty = true;
+
+string SpanName(string_view name, string_view arg) {
+  string span_name(name);
+  if (!arg.empty()) {
+    span_name += ' ';
+    span_name.append(arg.data(), arg.size());
+  }
+  return span_name;
+}
+
+int64_t NowInMicroseconds() {
+  struct timespec ts {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Writes an event of type |phase| to the file trace, with the |fields|
+// specific to it.
+void WriteFileEvent(char phase, const string& fields) {
+  if (!file_trace_enabled.load(std::memory_order_relaxed))
+    return;
+  const string event = base::StringPrintf(
+      "{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRId64 "%s}",
+      phase,
+      static_cast<int>(getpid()),
+      static_cast<int>(base::PlatformThread::CurrentId()),
+      NowInMicroseconds(),
+      fields.c_str());
+  std::lock_guard<std::mutex> lock(file_trace_mutex);
+  if (!file_trace)
+    return;
+  fprintf(file_trace.get(),
+          "%s%s",
+          file_trace_empty ? "[\n" : ",\n",
+          event.c_str());
+  file_trace_empty = false;
+}
+
+string NameField(const string& name) {
+  return ",\"name\":" + base::GetQuotedJSONString(name);
+}
+
+string AsyncFields(const string& name, uint64_t id) {
+  return base::StringPrintf(
+             ",\"cat\":\"%s\",\"id\":\"0x%" PRIx64 "\"", kCategory, id) +
+         NameField(name);
+}
+}  // namespace
+
+bool IsEnabled() {
+#ifdef __ANDROID__
+  if (ATRACE_ENABLED())
+    return true;
+#endif  // __ANDROID__
+  return file_trace_enabled.load(std::memory_order_relaxed);
+}
+
+bool StartFileTrace(const string& path) {
+  std::lock_guard<std::mutex> lock(file_trace_mutex);
+  if (file_trace) {
+    LOG(ERROR) << "A trace is already being written.";
+    return false;
+  }
+  file_trace.reset(base::OpenFile(base::FilePath(path), "w"));
+  if (!file_trace) {
+    PLOG(ERROR) << "Unable to create the trace file " << path;
+    return false;
+  }
+  file_trace_empty = true;
+  file_trace_enabled = true;
+  return true;
+}
+
+void StopFileTrace() {
+  std::lock_guard<std::mutex> lock(file_trace_mutex);
+  if (!file_trace)
+    return;
+  file_trace_enabled = false;
+  fputs(file_trace_empty ? "[]\n" : "\n]\n", file_trace.get());
+  file_trace.reset();
+}
+
+bool Begin(string_view name, string_view arg) {
+  if (!IsEnabled())
+    return false;
+  const string span_name = SpanName(name, arg);
+#ifdef __ANDROID__
+  atrace_begin(ATRACE_TAG, span_name.c_str());
+#endif  // __ANDROID__
+  WriteFileEvent('B', NameField(span_name));
+  return true;
+}
+
+void End() {
+#ifdef __ANDROID__
+  atrace_end(ATRACE_TAG);
+#endif  // __ANDROID__
+  WriteFileEvent('E', "");
+}
+
+void AsyncBegin(string_view name, string_view arg, uint64_t id) {
+  if (!IsEnabled())
+    return;
+  const string span_name = SpanName(name, arg);
+#ifdef __ANDROID__
+  atrace_async_begin(ATRACE_TAG, span_name.c_str(), static_cast<int32_t>(id));
+#endif  // __ANDROID__
+  WriteFileEvent('b', AsyncFields(span_name, id));
+}
+
+void AsyncEnd(string_view name, string_view arg, uint64_t id) {
+  if (!IsEnabled())
+    return;
+  const string span_name = SpanName(name, arg);
+#ifdef __ANDROID__
+  atrace_async_end(ATRACE_TAG, span_name.c_str(), static_cast<int32_t>(id));
+#endif  // __ANDROID__
+  WriteFileEvent('e', AsyncFields(span_name, id));
+}
+
+}  // namespace trace
+}  // namespace chromeos_update_engine
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TRACE_H_
+#define UPDATE_ENGINE_COMMON_TRACE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Trace spans of the update, to look at one update in Perfetto next to the
+// CPU and I/O tracks. On Android the spans are ATrace events, always written
+// to the trace marker and recorded when tracing is on. They can also be
+// written to a file in the JSON trace event format, which Perfetto and
+// chrome://tracing open, for example from the host tools. Otherwise a span
+// costs an atomic load.
+//
+// The name of a span is |name|, followed by |arg| if not empty, for example
+// the phase and the partition.
+namespace trace {
+
+// Returns whether the spans are recorded.
+bool IsEnabled();
+
+// Writes the spans to |path| until StopFileTrace() is called. Returns false if
+// the file can't be created or a file trace is already running.
+bool StartFileTrace(const std::string& path);
+// Completes and closes the file of StartFileTrace(), if any.
+void StopFileTrace();
+
+// Begins a span on the calling thread, ended by the next call to End() on the
+// same thread. Returns whether the span is recorded. End() must only be called
+// if it is.
+bool Begin(std::string_view name, std::string_view arg = {});
+void End();
+
+// Begins and ends a span which may end on another thread or in another call
+// than it started, like a transfer or an action. |id| tells apart the spans of
+// the same name running at once.
+void AsyncBegin(std::string_view name, std::string_view arg, uint64_t id);
+void AsyncEnd(std::string_view name, std::string_view arg, uint64_t id);
+
+}  // namespace trace
+
+// Traces a span on the calling thread for the lifetime of the object.
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(std::string_view name, std::string_view arg = {})
+      : traced_(trace::Begin(name, arg)) {}
+  ~ScopedTrace() {
+    if (traced_)
+      trace::End();
+  }
+
+ private:
+  const bool traced_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTrace);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_TRACE_H_
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/trace.h"
+
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+size_t CountOccurrences(const string& str, const string& pattern) {
+  size_t count = 0;
+  for (size_t pos = str.find(pattern); pos != string::npos;
+       pos = str.find(pattern, pos + 1)) {
+    count++;
+  }
+  return count;
+}
+}  // namespace
+
+TEST(TraceTest, FileTraceTest) {
+  ScopedTempFile file("trace.XXXXXX");
+  ASSERT_TRUE(trace::StartFileTrace(file.path()));
+  EXPECT_TRUE(trace::IsEnabled());
+  EXPECT_FALSE(trace::StartFileTrace(file.path()));
+  {
+    ScopedTrace outer("apply", "system");
+    ScopedTrace inner("SOURCE_COPY");
+  }
+  trace::AsyncBegin("transfer", "", 1);
+  std::thread([] { trace::AsyncEnd("transfer", "", 1); }).join();
+  trace::StopFileTrace();
+  // Not recorded anymore.
+  ScopedTrace after_stop("ZERO");
+
+  string contents;
+  ASSERT_TRUE(utils::ReadFile(file.path(), &contents));
+  EXPECT_EQ(0u, contents.find("[\n{"));
+  EXPECT_EQ(contents.size() - 4, contents.find("}\n]\n"));
+  EXPECT_EQ(6u, CountOccurrences(contents, "{\"ph\":"));
+  EXPECT_EQ(2u, CountOccurrences(contents, "\"ph\":\"B\""));
+  EXPECT_EQ(2u, CountOccurrences(contents, "\"ph\":\"E\""));
+  EXPECT_EQ(1u, CountOccurrences(contents, "\"name\":\"apply system\""));
+  EXPECT_EQ(1u, CountOccurrences(contents, "\"name\":\"SOURCE_COPY\""));
+  EXPECT_EQ(
+      2u, CountOccurrences(contents, "\"id\":\"0x1\",\"name\":\"transfer\""));
+  EXPECT_EQ(string::npos, contents.find("ZERO"));
+}
+
+TEST(TraceTest, EmptyFileTraceTest) {
+  ScopedTempFile file("trace.XXXXXX");
+  ASSERT_TRUE(trace::StartFileTrace(file.path()));
+  trace::StopFileTrace();
+  string contents;
+  ASSERT_TRUE(utils::ReadFile(file.path(), &contents));
+  EXPECT_EQ("[]\n", contents);
+
+  EXPECT_FALSE(trace::StartFileTrace("/nonexistent/trace.json"));
+}
+
+}  // namespace chromeos_update_engine
@@ -30,6 +30,7 @@
 #include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -56,6 +57,7 @@
 #include <brillo/data_encoding.h>
 
 #include "update_engine/common/constants.h"
+#include "update_engine/common/cpu_kernels.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -457,6 +459,14 @@ bool WriteStringToFileAtomic(const std::string& path,
   return FsyncDirectory(std::filesystem::path(path).parent_path().c_str());
 }
 
+void XorBytes(const void* data, size_t size, void* buffer) {
+  GetCpuKernels().xor_bytes(data, size, buffer);
+}
+
+bool IsAllZeros(const void* data, size_t size) {
+  return GetCpuKernels().is_zero(data, size);
+}
+
 void HexDumpArray(const uint8_t* const arr, const size_t length) {
   LOG(INFO) << "Logging array of length: " << length;
   const unsigned int bytes_per_line = 16;
@@ -680,6 +690,16 @@ bool IsMountpoint(const std::string& mountpoint) {
          (stparent.st_dev != stdir.st_dev || stparent.st_ino == stdir.st_ino);
 }
 
+bool GetFilesystemFreeSpace(const string& path, uint64_t* free_bytes) {
+  struct statvfs stats {};
+  if (statvfs(path.c_str(), &stats) != 0) {
+    PLOG(ERROR) << "Error statvfs'ing " << path;
+    return false;
+  }
+  *free_bytes = static_cast<uint64_t>(stats.f_bavail) * stats.f_frsize;
+  return true;
+}
+
 // Tries to parse the header of an ELF file to obtain a human-readable
 // description of it on the |output| string.
 static bool GetFileFormatELF(const uint8_t* buffer,
@@ -964,15 +984,18 @@ bool WriteExtents(const std::string& path,
                   size_t block_size) {
   EintrSafeFileDescriptor fd;
   TEST_AND_RETURN_FALSE(fd.Open(path.c_str(), O_RDWR));
+  std::vector<FileDescriptor::WriteRequest> requests;
+  requests.reserve(extents.size());
   size_t bytes_written = 0;
   for (const auto& ext : extents) {
-    TEST_AND_RETURN_FALSE_ERRNO(
-        fd.Seek(ext.start_block() * block_size, SEEK_SET));
-    TEST_AND_RETURN_FALSE_ERRNO(
-        fd.Write(data.data() + bytes_written, ext.num_blocks() * block_size));
-    bytes_written += ext.num_blocks() * block_size;
+    const size_t bytes = ext.num_blocks() * block_size;
+    TEST_AND_RETURN_FALSE(bytes_written + bytes <= data.size());
+    requests.push_back({data.data() + bytes_written,
+                        bytes,
+                        static_cast<off64_t>(ext.start_block() * block_size)});
+    bytes_written += bytes;
   }
-  return true;
+  return fd.WriteBatch(requests);
 }
 bool ReadExtents(const std::string& path,
                  const vector<Extent>& extents,
@@ -1001,21 +1024,26 @@ bool ReadExtents(FileDescriptorPtr fd,
                  ssize_t out_data_size,
                  size_t block_size) {
   brillo::Blob data(out_data_size);
+  std::vector<FileDescriptor::ReadRequest> requests;
+  requests.reserve(extents.size());
   ssize_t bytes_read = 0;
 
   for (const Extent& extent : extents) {
-    ssize_t bytes_read_this_iteration = 0;
     ssize_t bytes = extent.num_blocks() * block_size;
     TEST_LE(bytes_read + bytes, out_data_size);
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &data[bytes_read],
-                                          bytes,
-                                          extent.start_block() * block_size,
-                                          &bytes_read_this_iteration));
-    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
-    bytes_read += bytes_read_this_iteration;
+    requests.push_back(
+        {data.data() + bytes_read,
+         static_cast<size_t>(bytes),
+         static_cast<off64_t>(extent.start_block() * block_size)});
+    bytes_read += bytes;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
+  // The extents contiguous on disk are read with a single call. Like
+  // PReadAll(), leave the file offset where it was.
+  auto old_off = fd->Seek(0, SEEK_CUR);
+  TEST_AND_RETURN_FALSE_ERRNO(old_off >= 0);
+  TEST_AND_RETURN_FALSE(fd->ReadBatch(requests));
+  TEST_AND_RETURN_FALSE_ERRNO(fd->Seek(old_off, SEEK_SET) == old_off);
   *out_data = data;
   return true;
 }
@@ -226,6 +226,10 @@ bool UnmountFilesystem(const std::string& mountpoint);
 // mounted on top of a different filesystem (not inside the same filesystem).
 bool IsMountpoint(const std::string& mountpoint);
 
+// Stores in |free_bytes| the number of bytes available to unprivileged users on
+// the filesystem |path| belongs to. Returns false on error.
+bool GetFilesystemFreeSpace(const std::string& path, uint64_t* free_bytes);
+
 // Returns a human-readable string with the file format based on magic constants
 // on the header of the file.
 std::string GetFileFormat(const std::string& path);
@@ -247,6 +251,14 @@ std::string ToString(PayloadType payload_type);
 // [value - range / 2, value + range - range / 2]
 int FuzzInt(int value, unsigned int range);
 
+// XORs |size| bytes of |data| into |buffer|, in place. The two may not
+// overlap unless they're the same. Uses the CPU kernels of GetCpuKernels().
+void XorBytes(const void* data, size_t size, void* buffer);
+
+// Returns whether the |size| bytes of |data| are all zeros. Uses the CPU
+// kernels of GetCpuKernels().
+bool IsAllZeros(const void* data, size_t size);
+
 // Log a string in hex to LOG(INFO). Useful for debugging.
 void HexDumpArray(const uint8_t* const arr, const size_t length);
 inline void HexDumpString(const std::string& str) {
@@ -488,6 +500,8 @@ class ScopedTempFile {
     CHECK(fd_closer_);
     fd_closer_.reset();
   }
+  // Keeps the file once this object is destroyed, e.g. after renaming it.
+  void Release() { unlinker_->set_should_remove(false); }
 
  private:
   std::string path_;
@@ -418,6 +418,16 @@ TEST(UtilsTest, IsMountpointTest) {
   EXPECT_FALSE(utils::IsMountpoint(file.path()));
 }
 
+TEST(UtilsTest, GetFilesystemFreeSpaceTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  uint64_t free_bytes = 0;
+  EXPECT_TRUE(
+      utils::GetFilesystemFreeSpace(temp_dir.GetPath().value(), &free_bytes));
+  EXPECT_GT(free_bytes, 0u);
+  EXPECT_FALSE(utils::GetFilesystemFreeSpace("/path/to/nowhere", &free_bytes));
+}
+
 TEST(UtilsTest, VersionPrefix) {
   EXPECT_EQ(10575, utils::VersionPrefix("10575.39."));
   EXPECT_EQ(10575, utils::VersionPrefix("10575.39"));
@@ -474,4 +484,24 @@ TEST(UtilsTest, ValidatePerPartitionTimestamp) {
   ASSERT_EQ(ErrorCode::kSuccess, utils::IsTimestampNewer("10", ""));
 }
 
+TEST(UtilsTest, XorBytesTest) {
+  // Cover the vector loops, the word loop and the byte tail, with unaligned
+  // buffers.
+  for (size_t size : {0, 1, 7, 8, 15, 16, 63, 64, 65, 100, 4096, 4099}) {
+    for (size_t offset : {0, 1, 3}) {
+      vector<uint8_t> data(size + offset), buffer(size + offset);
+      for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<uint8_t>(i * 13 + 5);
+        buffer[i] = static_cast<uint8_t>(i * 7 + 1);
+      }
+      vector<uint8_t> expected = buffer;
+      for (size_t i = offset; i < expected.size(); i++) {
+        expected[i] ^= data[i];
+      }
+      utils::XorBytes(data.data() + offset, size, buffer.data() + offset);
+      EXPECT_EQ(expected, buffer) << "size " << size << " offset " << offset;
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
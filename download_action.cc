@@ -20,7 +20,10 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
@@ -30,12 +33,26 @@
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 
 using base::FilePath;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Size of the buffer sitting between the fetcher and the DeltaPerformer when
+// pipelined apply is enabled.
+constexpr size_t kPipelineBufferSize = 8 * 1024 * 1024;  // 8 MiB
+// How often to check whether a transfer paused because of a full pipeline
+// buffer can be resumed.
+constexpr base::TimeDelta kPipelineBackpressureCheckInterval =
+    base::TimeDelta::FromMilliseconds(5);
+// Size of the pieces of the payload downloaded by each of the parallel
+// fetchers.
+constexpr size_t kParallelDownloadChunkSize = 1024 * 1024;  // 1 MiB
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -51,15 +68,29 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  JoinMetadataThread();
+}
+
+void DownloadAction::SetParallelFetchers(
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers) {
+  http_fetcher_->SetParallelFetchers(std::move(fetchers),
+                                     kParallelDownloadChunkSize);
+}
+
+size_t DownloadAction::pipelined_bytes() const {
+  return pipelined_writer_ ? pipelined_writer_->buffered_bytes() : 0;
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
+  http_fetcher_->set_download_metrics(&download_metrics_);
 
   // Get the InstallPlan and read it
   CHECK(HasInputObject());
-  install_plan_ = GetInputObject();
+  install_plan_ = TakeInputObject();
   install_plan_.Dump();
+  http_fetcher_->set_adaptive_tuning(install_plan_.adaptive_download);
 
   bytes_received_ = 0;
   bytes_received_previous_payloads_ = 0;
@@ -92,6 +123,18 @@ void DownloadAction::PerformAction() {
   StartDownloading();
 }
 
+void DownloadAction::CreateDeltaPerformer() {
+  delta_performer_ =
+      std::make_unique<DeltaPerformer>(prefs_,
+                                       boot_control_,
+                                       hardware_,
+                                       delegate_,
+                                       &install_plan_,
+                                       payload_,
+                                       interactive_,
+                                       update_certificates_path_);
+}
+
 bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
   std::string cached_manifest_bytes;
   if (!prefs_->GetString(kPrefsManifestBytes, &cached_manifest_bytes) ||
@@ -120,21 +163,44 @@ bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
   return success;
 }
 
+bool DownloadAction::UseBlobCache() {
+  if (!blob_cache_ || payload_->hash.empty() || !payload_->size)
+    return false;
+  const string key = BlobCache::MetadataKey(payload_->hash);
+  brillo::Blob metadata;
+  if (!blob_cache_->Get(key, &metadata))
+    return false;
+
+  delta_performer_->set_blob_cache(blob_cache_);
+  ErrorCode error;
+  if (!delta_performer_->Write(metadata.data(), metadata.size(), &error) ||
+      !delta_performer_->IsManifestValid()) {
+    LOG(WARNING) << "Cached metadata fails to load, error code:"
+                 << static_cast<int>(error) << "," << error;
+    blob_cache_->Remove(key);
+    CreateDeltaPerformer();
+    return false;
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  if (!delta_performer_->UseCachedOperationData(&ranges))
+    ranges.emplace_back(metadata.size(), payload_->size - metadata.size());
+  for (const auto& [offset, length] : ranges)
+    http_fetcher_->AddRange(base_offset_ + offset, length);
+  LOG(INFO) << "Parsed the cached metadata, downloading " << ranges.size()
+            << " ranges of the payload.";
+  return true;
+}
+
 void DownloadAction::StartDownloading() {
   download_active_ = true;
+  chunk_boundaries_set_ = false;
   http_fetcher_->ClearRanges();
 
   if (delta_performer_ != nullptr) {
     LOG(INFO) << "Using writer for test.";
   } else {
-    delta_performer_.reset(new DeltaPerformer(prefs_,
-                                              boot_control_,
-                                              hardware_,
-                                              delegate_,
-                                              &install_plan_,
-                                              payload_,
-                                              interactive_,
-                                              update_certificates_path_));
+    CreateDeltaPerformer();
   }
 
   if (install_plan_.is_resume &&
@@ -147,18 +213,7 @@ void DownloadAction::StartDownloading() {
 
     // TODO(zhangkelvin) Add unittest for success and fallback route
     if (!LoadCachedManifest(manifest_metadata_size + manifest_signature_size)) {
-      if (delta_performer_) {
-        // Create a new DeltaPerformer to reset all its state
-        delta_performer_ =
-            std::make_unique<DeltaPerformer>(prefs_,
-                                             boot_control_,
-                                             hardware_,
-                                             delegate_,
-                                             &install_plan_,
-                                             payload_,
-                                             interactive_,
-                                             update_certificates_path_);
-      }
+      CreateDeltaPerformer();
       http_fetcher_->AddRange(base_offset_,
                               manifest_metadata_size + manifest_signature_size);
     }
@@ -176,7 +231,7 @@ void DownloadAction::StartDownloading() {
       http_fetcher_->AddRange(base_offset_ + resume_offset,
                               payload_->size - resume_offset);
     }
-  } else {
+  } else if (!UseBlobCache()) {
     if (payload_->size) {
       http_fetcher_->AddRange(base_offset_, payload_->size);
     } else {
@@ -186,21 +241,70 @@ void DownloadAction::StartDownloading() {
     }
   }
 
+  delta_performer_->set_operation_metrics(&operation_metrics_);
+  delta_performer_->set_phase_metrics(processor_ ? processor_->phase_metrics()
+                                                 : nullptr);
+  delta_performer_->set_blob_cache(blob_cache_);
+  if (processor_ && processor_->overlap_actions() && HasOutputPipe()) {
+    delta_performer_->set_partition_applied_callback(base::BindRepeating(
+        &DownloadAction::OnPartitionApplied, base::Unretained(this)));
+  }
+
+  // Nothing to prepare early if the cached manifest was parsed above, and
+  // the pipelined apply already prepares the partitions on its own thread.
+  collect_metadata_ = install_plan_.prepare_partitions_early &&
+                      !install_plan_.pipelined_apply &&
+                      !delta_performer_->IsManifestValid();
+
+  if (install_plan_.pipelined_apply) {
+    // The cached manifest, if any, was parsed synchronously above. Everything
+    // coming from the fetcher is applied on the pipeline thread.
+    pipelined_writer_ = std::make_unique<PipelinedPayloadWriter>(
+        delta_performer_.get(), kPipelineBufferSize);
+    // |delegate_| lives on the main loop, WriteToPerformer() asks it whether
+    // to cancel instead of the pipeline thread.
+    delta_performer_->set_download_delegate(nullptr);
+    if (!pipelined_writer_->Start()) {
+      LOG(WARNING) << "Failed to start pipelined apply, falling back to "
+                      "applying the payload inline.";
+      pipelined_writer_.reset();
+      delta_performer_->set_download_delegate(delegate_);
+    }
+  }
+
+  // When resuming, the cached manifest is already parsed.
+  MaybeSetChunkBoundaries();
+  http_fetcher_->SetMirrorUrls(install_plan_.mirror_urls);
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  // The fetcher is already paused if the pipeline is full.
+  if (!backpressure_paused_)
+    http_fetcher_->Pause();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  // Keep the fetcher paused until the pipeline has room again,
+  // CheckPipelineBackpressure() will resume it.
+  if (!backpressure_paused_)
+    http_fetcher_->Unpause();
 }
 
 void DownloadAction::TerminateProcessing() {
-  if (delta_performer_) {
-    delta_performer_->Close();
-    delta_performer_.reset();
+  backpressure_task_id_.Cancel();
+  backpressure_paused_ = false;
+  download_metrics_.BackpressureEnded();
+  if (IsMetadataThreadRunning()) {
+    // The partitions are still being prepared, |delta_performer_| is closed
+    // once that's done.
+    after_metadata_thread_.push_back(base::BindOnce(
+        &DownloadAction::CloseDeltaPerformer, base::Unretained(this)));
+  } else {
+    metadata_task_id_.Cancel();
+    CloseDeltaPerformer();
   }
   download_active_ = false;
   // Terminates the transfer. The action is terminated, if necessary, when the
@@ -208,6 +312,23 @@ void DownloadAction::TerminateProcessing() {
   http_fetcher_->TerminateTransfer();
 }
 
+void DownloadAction::CloseDeltaPerformer() {
+  JoinMetadataThread();
+  collect_metadata_ = false;
+  metadata_bytes_.clear();
+  pending_bytes_.clear();
+  if (pipelined_writer_) {
+    // Make sure the pipeline thread is done with |delta_performer_| before
+    // closing it.
+    pipelined_writer_->Stop();
+    pipelined_writer_.reset();
+  }
+  if (delta_performer_) {
+    delta_performer_->Close();
+    delta_performer_.reset();
+  }
+}
+
 void DownloadAction::SeekToOffset(off_t offset) {
   bytes_received_ = offset;
 }
@@ -221,7 +342,11 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   if (delegate_ && download_active_) {
     delegate_->BytesReceived(length, bytes_downloaded_total, bytes_total_);
   }
-  if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
+  if (delta_performer_ && (collect_metadata_ || metadata_thread_.joinable())) {
+    BufferEarlyBytes(bytes, length);
+    return true;
+  }
+  if (delta_performer_ && !WriteToPerformer(bytes, length)) {
     if (code_ != ErrorCode::kSuccess) {
       LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
                  << ") in DeltaPerformer's Write method when "
@@ -233,11 +358,255 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     TerminateProcessing();
     return false;
   }
+  ReportAppliedPartitions();
+  MaybeSetChunkBoundaries();
+
+  return true;
+}
+
+void DownloadAction::OnPartitionApplied(const string& partition) {
+  std::lock_guard<std::mutex> lock(applied_partitions_mutex_);
+  applied_partitions_.push_back(partition);
+  applied_install_plan_ = std::make_unique<InstallPlan>(install_plan_);
+}
+
+void DownloadAction::ReportAppliedPartitions() {
+  std::vector<string> partitions;
+  std::unique_ptr<InstallPlan> install_plan;
+  {
+    std::lock_guard<std::mutex> lock(applied_partitions_mutex_);
+    partitions.swap(applied_partitions_);
+    install_plan = std::move(applied_install_plan_);
+  }
+  if (partitions.empty())
+    return;
+  SetOutputObject(std::move(*install_plan));
+  for (const string& partition : partitions) {
+    LOG(INFO) << "Partition " << partition << " is applied.";
+    PartitionCompleted(partition);
+  }
+}
+
+void DownloadAction::MaybeSetChunkBoundaries() {
+  // With pipelined apply the manifest is parsed on the pipeline thread.
+  if (chunk_boundaries_set_ || !delta_performer_ || pipelined_writer_ ||
+      !delta_performer_->IsManifestValid()) {
+    return;
+  }
+  chunk_boundaries_set_ = true;
+  std::vector<off_t> boundaries;
+  for (uint64_t end : delta_performer_->GetOperationDataEnds())
+    boundaries.push_back(base_offset_ + end);
+  http_fetcher_->SetChunkBoundaries(std::move(boundaries));
+}
+
+void DownloadAction::BufferEarlyBytes(const void* bytes, size_t length) {
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  if (!collect_metadata_) {
+    pending_bytes_.insert(pending_bytes_.end(), data, data + length);
+    if (!backpressure_paused_ && pending_bytes_.size() >= kPipelineBufferSize) {
+      backpressure_paused_ = true;
+      download_metrics_.BackpressureStarted();
+      if (!suspended_)
+        http_fetcher_->Pause();
+    }
+    return;
+  }
+
+  metadata_bytes_.insert(metadata_bytes_.end(), data, data + length);
+  if (metadata_bytes_.size() < kMaxPayloadHeaderSize)
+    return;
+  // If the header is invalid, |delta_performer_| fails on it with the right
+  // error code from the thread too.
+  PayloadMetadata payload_metadata;
+  ErrorCode error = ErrorCode::kSuccess;
+  if (payload_metadata.ParsePayloadHeader(metadata_bytes_, &error) ==
+      MetadataParseResult::kSuccess) {
+    const uint64_t metadata_size = payload_metadata.GetMetadataSize() +
+                                   payload_metadata.GetMetadataSignatureSize();
+    if (metadata_bytes_.size() < metadata_size)
+      return;
+    // Only the metadata goes to the thread, the operations are applied on the
+    // main loop once it's done.
+    pending_bytes_.assign(metadata_bytes_.begin() + metadata_size,
+                          metadata_bytes_.end());
+    metadata_bytes_.resize(metadata_size);
+  }
+
+  LOG(INFO) << "Received the " << metadata_bytes_.size()
+            << " bytes of metadata, preparing the partitions while the "
+               "download continues.";
+  collect_metadata_ = false;
+  metadata_thread_done_ = false;
+  // |delegate_| lives on the main loop, the operations without data may still
+  // be applied on the thread.
+  delta_performer_->set_download_delegate(nullptr);
+  metadata_thread_ = std::thread([this] {
+    metadata_result_ = delta_performer_->Write(
+        metadata_bytes_.data(), metadata_bytes_.size(), &metadata_error_);
+    metadata_thread_done_ = true;
+  });
+  CHECK(metadata_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&DownloadAction::CheckMetadataThread,
+                     base::Unretained(this)),
+      kPipelineBackpressureCheckInterval));
+}
+
+void DownloadAction::CheckMetadataThread() {
+  if (!metadata_thread_done_) {
+    CHECK(metadata_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&DownloadAction::CheckMetadataThread,
+                       base::Unretained(this)),
+        kPipelineBackpressureCheckInterval));
+    return;
+  }
+  if (!after_metadata_thread_.empty()) {
+    // The action was terminated or the transfer ended meanwhile.
+    JoinMetadataThread();
+    std::vector<base::OnceClosure> callbacks;
+    callbacks.swap(after_metadata_thread_);
+    for (base::OnceClosure& callback : callbacks)
+      std::move(callback).Run();
+    return;
+  }
+  if (!WriteEarlyBytes()) {
+    if (code_ != ErrorCode::kSuccess) {
+      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+                 << ") while applying the payload metadata -- Terminating "
+                 << "processing";
+    }
+    TerminateProcessing();
+    return;
+  }
+  ReportAppliedPartitions();
+  MaybeSetChunkBoundaries();
+  if (backpressure_paused_) {
+    backpressure_paused_ = false;
+    download_metrics_.BackpressureEnded();
+    if (!suspended_)
+      http_fetcher_->Unpause();
+  }
+}
+
+bool DownloadAction::WriteEarlyBytes() {
+  if (collect_metadata_) {
+    // The transfer ended before the metadata was complete.
+    collect_metadata_ = false;
+    pending_bytes_.swap(metadata_bytes_);
+  } else {
+    JoinMetadataThread();
+    if (!metadata_result_) {
+      code_ = metadata_error_;
+      return false;
+    }
+  }
+  brillo::Blob().swap(metadata_bytes_);
+  brillo::Blob pending_bytes;
+  pending_bytes.swap(pending_bytes_);
+  return pending_bytes.empty() ||
+         WriteToPerformer(pending_bytes.data(), pending_bytes.size());
+}
+
+bool DownloadAction::IsMetadataThreadRunning() const {
+  return metadata_thread_.joinable() && !metadata_thread_done_;
+}
+
+void DownloadAction::JoinMetadataThread() {
+  if (!metadata_thread_.joinable())
+    return;
+  metadata_thread_.join();
+  if (delta_performer_)
+    delta_performer_->set_download_delegate(delegate_);
+}
+
+bool DownloadAction::WriteToPerformer(const void* bytes, size_t length) {
+  if (!pipelined_writer_) {
+    // The transfer doesn't progress while the data is applied.
+    download_metrics_.BackpressureStarted();
+    const bool result = delta_performer_->Write(bytes, length, &code_);
+    download_metrics_.BackpressureEnded();
+    return result;
+  }
 
+  if (delegate_ && delegate_->ShouldCancel(&code_))
+    return false;
+  if (!pipelined_writer_->Write(bytes, length, &code_))
+    return false;
+  if (!backpressure_paused_ && pipelined_writer_->IsAboveHighWatermark()) {
+    backpressure_paused_ = true;
+    download_metrics_.BackpressureStarted();
+    if (!suspended_)
+      http_fetcher_->Pause();
+    CHECK(backpressure_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&DownloadAction::CheckPipelineBackpressure,
+                       base::Unretained(this)),
+        kPipelineBackpressureCheckInterval));
+  }
   return true;
 }
 
+void DownloadAction::CheckPipelineBackpressure() {
+  if (!pipelined_writer_ || !backpressure_paused_)
+    return;
+  // Failures of the pipeline thread are otherwise only noticed on the next
+  // Write(), which never comes while the fetcher is paused.
+  if (pipelined_writer_->HasFailed(&code_)) {
+    if (code_ != ErrorCode::kSuccess) {
+      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+                 << ") while applying the pipelined payload -- Terminating "
+                 << "processing";
+    }
+    TerminateProcessing();
+    return;
+  }
+  ReportAppliedPartitions();
+  if (pipelined_writer_->IsBelowLowWatermark()) {
+    backpressure_paused_ = false;
+    download_metrics_.BackpressureEnded();
+    if (!suspended_)
+      http_fetcher_->Unpause();
+    return;
+  }
+  CHECK(backpressure_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&DownloadAction::CheckPipelineBackpressure,
+                     base::Unretained(this)),
+      kPipelineBackpressureCheckInterval));
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (IsMetadataThreadRunning()) {
+    // The whole payload was received before the partitions were prepared.
+    after_metadata_thread_.push_back(
+        base::BindOnce(&DownloadAction::TransferComplete,
+                       base::Unretained(this),
+                       fetcher,
+                       successful));
+    return;
+  }
+  backpressure_task_id_.Cancel();
+  metadata_task_id_.Cancel();
+  backpressure_paused_ = false;
+  download_metrics_.BackpressureEnded();
+  ErrorCode pipeline_error = ErrorCode::kSuccess;
+  if (delta_performer_ && (collect_metadata_ || metadata_thread_.joinable())) {
+    // The whole payload was received while the partitions were prepared.
+    if (!WriteEarlyBytes())
+      pipeline_error = code_;
+  }
+  if (pipelined_writer_) {
+    // Apply whatever is still buffered before closing the writer.
+    if (!pipelined_writer_->Drain(&pipeline_error) &&
+        pipeline_error != ErrorCode::kSuccess) {
+      LOG(ERROR) << "Error " << utils::ErrorCodeToString(pipeline_error)
+                 << " (" << pipeline_error
+                 << ") while applying the pipelined payload.";
+    }
+    pipelined_writer_.reset();
+  }
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
@@ -245,6 +614,8 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
   download_active_ = false;
   ErrorCode code =
       successful ? ErrorCode::kSuccess : ErrorCode::kDownloadTransferError;
+  if (code == ErrorCode::kSuccess)
+    code = pipeline_error;
   if (code == ErrorCode::kSuccess) {
     if (delta_performer_ && !payload_->already_applied)
       code = delta_performer_->VerifyPayload(payload_->hash, payload_->size);
@@ -273,6 +644,14 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
 }
 
 void DownloadAction::TransferTerminated(HttpFetcher* fetcher) {
+  if (IsMetadataThreadRunning()) {
+    // The action can't complete while the thread uses it.
+    after_metadata_thread_.push_back(
+        base::BindOnce(&DownloadAction::TransferTerminated,
+                       base::Unretained(this),
+                       fetcher));
+    return;
+  }
   if (code_ != ErrorCode::kSuccess) {
     processor_->ActionComplete(this, code_);
   } else if (payload_->already_applied) {
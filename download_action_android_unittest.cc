@@ -14,10 +14,19 @@
 // limitations under the License.
 //
 
+#include <endian.h>
 #include <unistd.h>
+
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gmock/gmock.h>
 #include <gmock/gmock-actions.h>
 #include <gmock/gmock-function-mocker.h>
@@ -29,6 +38,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/download_action.h"
 #include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/mock_action_processor.h"
 #include "update_engine/common/mock_http_fetcher.h"
 #include "update_engine/common/mock_prefs.h"
@@ -43,6 +53,7 @@
 namespace chromeos_update_engine {
 using testing::_;
 using testing::DoAll;
+using testing::InvokeWithoutArgs;
 using testing::Return;
 using testing::SetArgPointee;
 
@@ -172,4 +183,204 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
   // Manifest is cached, so no data should be downloaded from http fetcher.
   ASSERT_EQ(download_action->http_fetcher()->GetBytesDownloaded(), 0UL);
 }
+
+namespace {
+// What DownloadAction hands to FakeDeltaPerformer, kept outside of it since
+// DownloadAction owns the performer.
+struct PerformerLog {
+  std::mutex mutex;
+  std::condition_variable released_cv;
+  // The first write, the one of |metadata_thread_|, waits while it's set.
+  bool blocked{false};
+  std::vector<size_t> writes;
+  bool closed{false};
+};
+
+class FakeDeltaPerformer : public DeltaPerformer {
+ public:
+  FakeDeltaPerformer(PrefsInterface* prefs,
+                     InstallPlan* install_plan,
+                     InstallPlan::Payload* payload,
+                     PerformerLog* log)
+      : DeltaPerformer(prefs,
+                       nullptr,
+                       nullptr,
+                       nullptr,
+                       install_plan,
+                       payload,
+                       false),
+        log_(log) {}
+
+  using DeltaPerformer::Write;
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    std::unique_lock<std::mutex> lock(log_->mutex);
+    log_->writes.push_back(count);
+    if (log_->writes.size() == 1)
+      log_->released_cv.wait(lock, [this] { return !log_->blocked; });
+    return true;
+  }
+  int Close() override {
+    std::lock_guard<std::mutex> lock(log_->mutex);
+    log_->closed = true;
+    return 0;
+  }
+
+ private:
+  PerformerLog* log_;
+};
+}  // namespace
+
+class DownloadActionPreparePartitionsEarlyTest : public DownloadActionTest {
+ protected:
+  // Size of the header and the manifest of the fake payload.
+  static constexpr size_t kMetadataSize = 24 + METADATA_SIZE;
+
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override {
+    Release();
+    download_action_.reset();
+  }
+
+  // Starts |download_action_| on a payload of |size| bytes. Only the header
+  // of the payload is valid, FakeDeltaPerformer doesn't parse the rest.
+  void StartDownload(size_t size) {
+    ASSERT_GE(size, kMetadataSize + SIGNATURE_SIZE);
+    payload_data_.assign(size, 'x');
+    // The magic, the major version, the manifest size and the metadata
+    // signature size, big endian.
+    const uint64_t major_version = htobe64(kBrilloMajorPayloadVersion);
+    const uint64_t manifest_size = htobe64(METADATA_SIZE);
+    const uint32_t signature_size = htobe32(SIGNATURE_SIZE);
+    memcpy(&payload_data_[0], kDeltaMagic, sizeof(kDeltaMagic));
+    memcpy(&payload_data_[4], &major_version, sizeof(major_version));
+    memcpy(&payload_data_[12], &manifest_size, sizeof(manifest_size));
+    memcpy(&payload_data_[20], &signature_size, sizeof(signature_size));
+
+    MockHttpFetcher* http_fetcher =
+        new MockHttpFetcher(payload_data_.data(), payload_data_.size());
+    InstallPlan install_plan;
+    install_plan.download_url = "http://fake_url.invalid";
+    install_plan.prepare_partitions_early = true;
+    auto& payload = install_plan.payloads.emplace_back();
+    payload.size = payload_data_.size();
+    payload.payload_urls.emplace_back("http://fake_url.invalid");
+    action_pipe->set_contents(install_plan);
+
+    download_action_ = std::make_unique<DownloadAction>(
+        &prefs_, &boot_control_, nullptr, http_fetcher, false);
+    download_action_->SetTestFileWriter(std::make_unique<FakeDeltaPerformer>(
+        &prefs_, &install_plan_, &payload_, &log_));
+    download_action_->set_in_pipe(action_pipe);
+    download_action_->SetProcessor(&mock_processor_);
+    download_action_->PerformAction();
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(log_.mutex);
+      log_.blocked = false;
+    }
+    log_.released_cv.notify_all();
+  }
+
+  // Runs |loop_| until |done| returns true or nothing is left to run.
+  bool RunLoopUntil(const std::function<bool()>& done) {
+    for (int i = 0; i < 1000000 && !done(); i++) {
+      if (!loop_.RunOnce(false))
+        break;
+    }
+    return done();
+  }
+
+  std::vector<size_t> Writes() {
+    std::lock_guard<std::mutex> lock(log_.mutex);
+    return log_.writes;
+  }
+
+  size_t BytesDownloaded() {
+    return download_action_->http_fetcher()->GetBytesDownloaded();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakePrefs prefs_;
+  BootControlStub boot_control_;
+  MockActionProcessor mock_processor_;
+  // The install plan of FakeDeltaPerformer, unused.
+  InstallPlan install_plan_;
+  InstallPlan::Payload payload_;
+  PerformerLog log_;
+  brillo::Blob payload_data_;
+  std::unique_ptr<DownloadAction> download_action_;
+};
+
+TEST_F(DownloadActionPreparePartitionsEarlyTest, OnlyMetadataOnThread) {
+  log_.blocked = true;
+  StartDownload(kMetadataSize + SIGNATURE_SIZE + 3 * kMockHttpFetcherChunkSize);
+  // The whole payload is received while the partitions are prepared, the
+  // transfer completes once they are.
+  EXPECT_CALL(mock_processor_, ActionComplete(download_action_.get(), _))
+      .Times(0);
+  ASSERT_TRUE(RunLoopUntil([this] {
+    return Writes().size() == 1 && BytesDownloaded() == payload_data_.size();
+  }));
+  EXPECT_EQ(std::vector<size_t>{kMetadataSize + SIGNATURE_SIZE}, Writes());
+  testing::Mock::VerifyAndClearExpectations(&mock_processor_);
+
+  bool complete = false;
+  EXPECT_CALL(mock_processor_, ActionComplete(download_action_.get(), _))
+      .WillOnce(InvokeWithoutArgs([&complete] { complete = true; }));
+  Release();
+  ASSERT_TRUE(RunLoopUntil([&complete] { return complete; }));
+  const std::vector<size_t> writes = Writes();
+  ASSERT_EQ(2u, writes.size());
+  EXPECT_EQ(kMetadataSize + SIGNATURE_SIZE, writes[0]);
+  EXPECT_EQ(payload_data_.size(), writes[0] + writes[1]);
+  EXPECT_TRUE(log_.closed);
+}
+
+TEST_F(DownloadActionPreparePartitionsEarlyTest, PausesWhenBufferIsFull) {
+  log_.blocked = true;
+  // More than the 8 MiB kept while the partitions are prepared.
+  const size_t size = 9 * 1024 * 1024;
+  StartDownload(size);
+  ASSERT_TRUE(RunLoopUntil([this] { return Writes().size() == 1; }));
+  // The transfer stops growing once the buffer is full.
+  for (int i = 0; i < 1000; i++)
+    ASSERT_TRUE(loop_.RunOnce(false));
+  const size_t paused_at = BytesDownloaded();
+  EXPECT_GE(paused_at, 8u * 1024 * 1024);
+  EXPECT_LT(paused_at, size);
+  for (int i = 0; i < 1000; i++)
+    ASSERT_TRUE(loop_.RunOnce(false));
+  EXPECT_EQ(paused_at, BytesDownloaded());
+
+  bool complete = false;
+  EXPECT_CALL(mock_processor_, ActionComplete(download_action_.get(), _))
+      .WillOnce(InvokeWithoutArgs([&complete] { complete = true; }));
+  Release();
+  ASSERT_TRUE(RunLoopUntil([&complete] { return complete; }));
+  const std::vector<size_t> writes = Writes();
+  EXPECT_EQ(kMetadataSize + SIGNATURE_SIZE, writes[0]);
+  EXPECT_EQ(size, std::accumulate(writes.begin(), writes.end(), size_t{0}));
+}
+
+TEST_F(DownloadActionPreparePartitionsEarlyTest, TerminateWhileThreadRuns) {
+  log_.blocked = true;
+  StartDownload(kMetadataSize + SIGNATURE_SIZE + 3 * kMockHttpFetcherChunkSize);
+  ASSERT_TRUE(RunLoopUntil([this] { return Writes().size() == 1; }));
+  // Neither the termination nor the TransferTerminated() callback wait for
+  // the thread.
+  EXPECT_CALL(mock_processor_, ActionComplete(_, _)).Times(0);
+  download_action_->TerminateProcessing();
+  EXPECT_FALSE(log_.closed);
+
+  Release();
+  ASSERT_TRUE(RunLoopUntil([this] {
+    std::lock_guard<std::mutex> lock(log_.mutex);
+    return log_.closed;
+  }));
+  // The bytes received meanwhile are dropped.
+  EXPECT_EQ(std::vector<size_t>{kMetadataSize + SIGNATURE_SIZE}, Writes());
+}
 }  // namespace chromeos_update_engine
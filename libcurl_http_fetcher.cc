@@ -41,6 +41,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 
 using base::TimeDelta;
@@ -57,6 +58,10 @@ namespace {
 
 const int kNoNetworkRetrySeconds = 10;
 
+// Name of the trace span of each transfer, from its start or resume to its
+// end.
+constexpr char kTraceName[] = "transfer";
+
 // libcurl's CURLOPT_SOCKOPTFUNCTION callback function. Called after the socket
 // is created but before it is connected. This callback tags the created socket
 // so the network usage can be tracked in Android.
@@ -72,6 +77,26 @@ int LibcurlSockoptCallback(void* /* clientp */,
   return CURL_SOCKOPT_OK;
 }
 
+// Returns the share handle through which all the fetchers reuse the TLS
+// sessions and the DNS cache of each other, so that the parallel connections
+// and retries to the same server skip the full TLS handshake. The fetchers all
+// run on the message loop thread, so the share needs no locking. Connections
+// aren't shared, their close socket callback points to the fetcher that
+// opened them.
+CURLSH* GetCurlShareHandle() {
+  static CURLSH* share_handle = []() {
+    CURLSH* handle = curl_share_init();
+    CHECK(handle);
+    CHECK_EQ(curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS),
+             CURLSHE_OK);
+    CHECK_EQ(
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION),
+        CURLSHE_OK);
+    return handle;
+  }();
+  return share_handle;
+}
+
 }  // namespace
 
 // static
@@ -107,6 +132,15 @@ LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  if (curl_handle_) {
+    curl_easy_cleanup(curl_handle_);
+    curl_handle_ = nullptr;
+  }
+  // Closes the cached connections.
+  if (curl_multi_handle_) {
+    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
+    curl_multi_handle_ = nullptr;
+  }
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -142,12 +176,37 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   LOG(INFO) << "Starting/Resuming transfer";
   CHECK(!transfer_in_progress_);
   url_ = url;
-  curl_multi_handle_ = curl_multi_init();
-  CHECK(curl_multi_handle_);
-
-  curl_handle_ = curl_easy_init();
-  CHECK(curl_handle_);
+  // The handles are kept across retries and transfers: |curl_multi_handle_|
+  // caches the connections, which can then be reused, and |curl_handle_| the
+  // TLS session, which must be reset from the previous transfer's options.
+  if (!curl_multi_handle_) {
+    curl_multi_handle_ = curl_multi_init();
+    CHECK(curl_multi_handle_);
+  }
+  if (curl_handle_) {
+    curl_easy_reset(curl_handle_);
+  } else {
+    curl_handle_ = curl_easy_init();
+    CHECK(curl_handle_);
+  }
   ignore_failure_ = false;
+  if (download_metrics_) {
+    download_metrics_->TransferStarted();
+    if (!retry_scheduled_time_.is_null()) {
+      download_metrics_->RetryStarted(base::TimeTicks::Now() -
+                                      retry_scheduled_time_);
+    }
+  }
+  retry_scheduled_time_ = base::TimeTicks();
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, GetCurlShareHandle()),
+           CURLE_OK);
+  // Use HTTP/2 over TLS when the server supports it, it falls back to
+  // HTTP/1.1 otherwise.
+  if (curl_easy_setopt(
+          curl_handle_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) !=
+      CURLE_OK) {
+    LOG(INFO) << "HTTP/2 isn't supported by libcurl, using HTTP/1.1.";
+  }
 
   // Tag and untag the socket for network usage stats.
   curl_easy_setopt(
@@ -238,9 +297,15 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   // If the connection drops under |low_speed_limit_bps_| (10
   // bytes/sec by default) for |low_speed_time_seconds_| (90 seconds,
-  // 180 on non-official builds), reconnect.
+  // 180 on non-official builds), reconnect. With adaptive tuning, the limit
+  // is raised on fast networks so that a stalled connection isn't waited on
+  // for as long.
+  const int low_speed_limit_bps =
+      adaptive_tuning_
+          ? bandwidth_estimator_.GetLowSpeedLimit(low_speed_limit_bps_)
+          : low_speed_limit_bps_;
   CHECK_EQ(curl_easy_setopt(
-               curl_handle_, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit_bps_),
+               curl_handle_, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit_bps),
            CURLE_OK);
   CHECK_EQ(curl_easy_setopt(
                curl_handle_, CURLOPT_LOW_SPEED_TIME, low_speed_time_seconds_),
@@ -282,6 +347,7 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
 
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
+  trace::AsyncBegin(kTraceName, "", reinterpret_cast<uintptr_t>(this));
 }
 
 // Lock down only the protocol in case of HTTP.
@@ -345,6 +411,9 @@ void LibcurlHttpFetcher::BeginTransfer(const string& url) {
   http_response_code_ = 0;
   terminate_requested_ = false;
   sent_byte_ = false;
+  retry_scheduled_time_ = base::TimeTicks();
+  retries_without_progress_ = 0;
+  bytes_downloaded_at_retry_ = bytes_downloaded_;
 
   // If we are paused, we delay these two operations until Unpause is called.
   if (transfer_paused_) {
@@ -510,6 +579,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   if (!sent_byte_ && http_response_code_ == 0 &&
       no_network_retry_count_ < no_network_max_retries_) {
     no_network_retry_count_++;
+    retry_scheduled_time_ = base::TimeTicks::Now();
     retry_task_id_ = MessageLoop::current()->PostDelayedTask(
         FROM_HERE,
         base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
@@ -536,6 +606,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
     if (HasProxy()) {
       // We have another proxy. Retry immediately.
       LOG(INFO) << "Retrying with next proxy setting";
+      retry_scheduled_time_ = base::TimeTicks::Now();
       retry_task_id_ = MessageLoop::current()->PostTask(
           FROM_HERE,
           base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
@@ -563,11 +634,12 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
     }
     // Need to restart transfer
     LOG(INFO) << "Restarting transfer to download the remaining bytes";
+    retry_scheduled_time_ = base::TimeTicks::Now();
     retry_task_id_ = MessageLoop::current()->PostDelayedTask(
         FROM_HERE,
         base::Bind(&LibcurlHttpFetcher::RetryTimeoutCallback,
                    base::Unretained(this)),
-        TimeDelta::FromSeconds(retry_seconds_));
+        GetRetryDelay());
   } else {
     LOG(INFO) << "Transfer completed (" << http_response_code_ << "), "
               << bytes_downloaded_ << " bytes downloaded";
@@ -608,6 +680,9 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void* ptr, size_t size, size_t nmemb) {
     }
   }
   bytes_downloaded_ += payload_size;
+  bandwidth_estimator_.BytesReceived(payload_size);
+  if (download_metrics_)
+    download_metrics_->BytesReceived(payload_size);
   if (delegate_) {
     in_write_callback_ = true;
     auto should_terminate = !delegate_->ReceivedBytes(this, ptr, payload_size);
@@ -629,6 +704,7 @@ void LibcurlHttpFetcher::Pause() {
     return;
   }
   transfer_paused_ = true;
+  bandwidth_estimator_.TransferStopped();
   if (!transfer_in_progress_) {
     // If pause before we started a connection, we don't need to notify curl
     // about that, we will simply not start the connection later.
@@ -790,23 +866,67 @@ void LibcurlHttpFetcher::CleanUp() {
     curl_slist_free_all(curl_http_headers_);
     curl_http_headers_ = nullptr;
   }
-  if (curl_handle_) {
-    if (curl_multi_handle_) {
-      CHECK_EQ(curl_multi_remove_handle(curl_multi_handle_, curl_handle_),
-               CURLM_OK);
-    }
-    curl_easy_cleanup(curl_handle_);
-    curl_handle_ = nullptr;
-  }
-  if (curl_multi_handle_) {
-    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
-    curl_multi_handle_ = nullptr;
+  // The handles themselves are only freed with the fetcher, see
+  // ResumeTransfer().
+  bandwidth_estimator_.TransferStopped();
+  if (transfer_in_progress_) {
+    trace::AsyncEnd(kTraceName, "", reinterpret_cast<uintptr_t>(this));
+    RecordConnectionTimes();
+    CHECK_EQ(curl_multi_remove_handle(curl_multi_handle_, curl_handle_),
+             CURLM_OK);
   }
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
 }
 
+void LibcurlHttpFetcher::RecordConnectionTimes() {
+  if (!download_metrics_ && !adaptive_tuning_)
+    return;
+  // Each of these is the time from the start of the transfer to the end of
+  // the phase, they're 0 when the phase wasn't needed.
+  curl_off_t namelookup_us = 0, connect_us = 0, appconnect_us = 0;
+  if (curl_easy_getinfo(
+          curl_handle_, CURLINFO_NAMELOOKUP_TIME_T, &namelookup_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_CONNECT_TIME_T, &connect_us) !=
+          CURLE_OK ||
+      curl_easy_getinfo(
+          curl_handle_, CURLINFO_APPCONNECT_TIME_T, &appconnect_us) !=
+          CURLE_OK) {
+    LOG(WARNING) << "Unable to get the connection times of the transfer.";
+    return;
+  }
+  connect_us = max(connect_us, namelookup_us);
+  // No TLS handshake was done for plain HTTP.
+  appconnect_us = max(appconnect_us, connect_us);
+  bandwidth_estimator_.ConnectionEstablished(
+      TimeDelta::FromMicroseconds(connect_us - namelookup_us));
+  if (!download_metrics_)
+    return;
+  download_metrics_->ConnectionFinished(
+      TimeDelta::FromMicroseconds(namelookup_us),
+      TimeDelta::FromMicroseconds(connect_us - namelookup_us),
+      TimeDelta::FromMicroseconds(appconnect_us - connect_us));
+}
+
+TimeDelta LibcurlHttpFetcher::GetRetryDelay() {
+  const TimeDelta max_delay = TimeDelta::FromSeconds(retry_seconds_);
+  if (!adaptive_tuning_)
+    return max_delay;
+  // A transfer that made progress since the last retry was likely dropped by
+  // a network change, retry it soon. Back off while the retries get nothing.
+  if (bytes_downloaded_ > bytes_downloaded_at_retry_)
+    retries_without_progress_ = 0;
+  retries_without_progress_++;
+  bytes_downloaded_at_retry_ = bytes_downloaded_;
+  const TimeDelta delay =
+      bandwidth_estimator_.GetRetryDelay(retries_without_progress_, max_delay);
+  LOG(INFO) << "Retrying in " << delay.InMilliseconds() << " ms, after "
+            << retries_without_progress_ << " retries without progress.";
+  return delay;
+}
+
 void LibcurlHttpFetcher::GetHttpResponseCode() {
   long http_response_code = 0;  // NOLINT(runtime/int) - curl needs long.
   if (base::StartsWith(url_, "file://", base::CompareCase::INSENSITIVE_ASCII)) {
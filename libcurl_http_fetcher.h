@@ -27,9 +27,11 @@
 #include <base/files/file_descriptor_watcher_posix.h>
 #include <base/logging.h>
 #include <base/macros.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/certificate_checker.h"
+#include "update_engine/common/bandwidth_estimator.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
 
@@ -153,12 +155,20 @@ class LibcurlHttpFetcher : public HttpFetcher {
     max_retry_count_ = max_retry_count;
   }
 
+  // With adaptive tuning, the low speed limit is raised to a fraction of the
+  // measured throughput, and the retries of stalled transfers back off from a
+  // few round trips up to the retry timeout.
+  void set_adaptive_tuning(bool adaptive_tuning) override {
+    adaptive_tuning_ = adaptive_tuning;
+  }
+
   void set_is_update_check(bool is_update_check) {
     is_update_check_ = is_update_check;
   }
 
  private:
   FRIEND_TEST(LibcurlHttpFetcherTest, HostResolvedTest);
+  FRIEND_TEST(LibcurlHttpFetcherTest, ReusesCurlHandlesTest);
 
   // libcurl's CURLOPT_CLOSESOCKETFUNCTION callback function. Called when
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
@@ -212,8 +222,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
         ptr, size, nmemb);
   }
 
-  // Cleans up the following if they are non-null:
-  // curl(m) handles, fd_controller_maps_(fd_task_maps_), timeout_id_.
+  // Ends the current transfer, if any, and cleans up the following if they
+  // are non-null: fd_controller_maps_(fd_task_maps_), timeout_id_. The curl(m)
+  // handles are kept for the next transfer.
   void CleanUp();
 
   // Force terminate the transfer. This will invoke the delegate's (if any)
@@ -230,6 +241,13 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Sets the curl options for file URI.
   void SetCurlOptionsForFile();
 
+  // Records the connection phases of the transfer in |download_metrics_| and
+  // |bandwidth_estimator_|.
+  void RecordConnectionTimes();
+
+  // Returns how long to wait before retrying an interrupted transfer.
+  base::TimeDelta GetRetryDelay();
+
   // Convert a proxy URL into a curl proxy type, if applicable. Returns true iff
   // conversion was successful, false otherwise (in which case nothing is
   // written to |out_type|).
@@ -289,11 +307,21 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int retry_count_{0};
   int max_retry_count_{kDownloadMaxRetryCount};
 
-  // Seconds to wait before retrying a resume.
+  // Seconds to wait before retrying a resume, the most with adaptive tuning.
   int retry_seconds_{20};
 
-  // When waiting for a retry, the task id of the retry callback.
+  // Whether the transfers are tuned from |bandwidth_estimator_|, and the
+  // retries in a row that received no data, counted from the bytes
+  // downloaded at the last retry.
+  bool adaptive_tuning_{false};
+  BandwidthEstimator bandwidth_estimator_;
+  int retries_without_progress_{0};
+  off_t bytes_downloaded_at_retry_{0};
+
+  // When waiting for a retry, the task id of the retry callback and when it
+  // was scheduled.
   brillo::MessageLoop::TaskId retry_task_id_{brillo::MessageLoop::kTaskIdNull};
+  base::TimeTicks retry_scheduled_time_;
 
   // Number of resumes due to no network (e.g., HTTP response code 0).
   int no_network_retry_count_{0};
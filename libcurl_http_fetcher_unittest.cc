@@ -95,6 +95,24 @@ TEST_F(LibcurlHttpFetcherTest, InvalidURLTest) {
             no_network_max_retries);
 }
 
+TEST_F(LibcurlHttpFetcherTest, ReusesCurlHandlesTest) {
+  libcurl_fetcher_.set_no_network_max_retries(2);
+
+  libcurl_fetcher_.BeginTransfer("not-a-URL");
+  CURLM* multi_handle = libcurl_fetcher_.curl_multi_handle_;
+  CURL* handle = libcurl_fetcher_.curl_handle_;
+  ASSERT_NE(nullptr, multi_handle);
+  ASSERT_NE(nullptr, handle);
+  while (loop_.PendingTasks()) {
+    loop_.RunOnce(true);
+  }
+
+  // The retries went through the same handles, which outlive the transfer.
+  EXPECT_FALSE(libcurl_fetcher_.transfer_in_progress_);
+  EXPECT_EQ(multi_handle, libcurl_fetcher_.curl_multi_handle_);
+  EXPECT_EQ(handle, libcurl_fetcher_.curl_handle_);
+}
+
 TEST_F(LibcurlHttpFetcherTest, CouldNotResolveHostTest) {
   int no_network_max_retries = 1;
   libcurl_fetcher_.set_no_network_max_retries(no_network_max_retries);
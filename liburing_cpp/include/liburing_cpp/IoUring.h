@@ -53,6 +53,12 @@ class IoUringInterface {
   // Register a set of file descriptors to kernel.
   virtual Errno RegisterFiles(const int* files, size_t files_size) = 0;
   virtual Errno UnregisterFiles() = 0;
+
+  // Have the kernel signal the eventfd |fd| whenever a CQE is posted, so the
+  // completions can be polled for along with other file descriptors.
+  virtual Errno RegisterEventFd(int fd) = 0;
+  virtual Errno UnregisterEventFd() = 0;
+
   // Append a submission entry into this io_uring. This does not submit the
   // operation to the kernel. For that, call |IoUringInterface::Submit()|
   virtual IoUringSQE PrepRead(int fd, void *buf, unsigned nbytes,
@@ -61,6 +67,20 @@ class IoUringInterface {
   // this write operation completes.
   virtual IoUringSQE PrepWrite(int fd, const void *buf, unsigned nbytes,
                                uint64_t offset) = 0;
+  // Same as PrepRead()/PrepWrite(), but |buf| must lie within the buffer at
+  // |buf_index| of the ones passed to |RegisterBuffers()|. The kernel skips
+  // mapping the pages of registered buffers on every request.
+  virtual IoUringSQE PrepReadFixed(int fd, void* buf, unsigned nbytes,
+                                   uint64_t offset, int buf_index) = 0;
+  virtual IoUringSQE PrepWriteFixed(int fd, const void* buf, unsigned nbytes,
+                                    uint64_t offset, int buf_index) = 0;
+  // Append an fsync() of |fd|. |flags| may be IORING_FSYNC_DATASYNC, from
+  // <linux/io_uring.h>, for an fdatasync(). Link it after writes with
+  // |IoUringSQE::SetLink()| to have it run once they complete.
+  virtual IoUringSQE PrepFsync(int fd, unsigned flags) = 0;
+  // Append an fallocate() of |len| bytes at |offset| of |fd|.
+  virtual IoUringSQE PrepFallocate(int fd, int mode, uint64_t offset,
+                                   uint64_t len) = 0;
 
   // Return number of SQEs available in the queue. If this is 0, subsequent
   // calls to Prep*() functions will fail.
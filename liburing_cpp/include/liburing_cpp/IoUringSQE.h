@@ -56,6 +56,12 @@ std::ostream &operator<<(std::ostream &, Errno err);
 struct [[nodiscard]] IoUringSQE {
   constexpr IoUringSQE(void *p) : sqe(p) {}
   IoUringSQE &SetFlags(unsigned int flags);
+  // Chain the next SQE to this one: it only starts once this one completed
+  // successfully, and fails with -ECANCELED otherwise.
+  IoUringSQE &SetLink();
+  // Start this SQE only once all the previously submitted ones completed, and
+  // the following ones only once this one completed.
+  IoUringSQE &SetDrain();
   template <typename T>
   IoUringSQE &SetData(const T &data) {
     static_assert(
@@ -44,6 +44,9 @@ class IoUring final : public IoUringInterface {
       if (files_registered_) {
         UnregisterFiles();
       }
+      if (eventfd_registered_) {
+        UnregisterEventFd();
+      }
       io_uring_queue_exit(&ring);
     }
   }
@@ -82,6 +85,18 @@ class IoUring final : public IoUringInterface {
     return ret;
   }
 
+  Errno RegisterEventFd(int fd) override {
+    const auto ret = Errno(io_uring_register_eventfd(&ring, fd));
+    eventfd_registered_ = ret.IsOk();
+    return ret;
+  }
+
+  Errno UnregisterEventFd() override {
+    const auto ret = Errno(io_uring_unregister_eventfd(&ring));
+    eventfd_registered_ = !ret.IsOk();
+    return ret;
+  }
+
   IoUringSQE PrepRead(int fd, void* buf, unsigned nbytes,
                       uint64_t offset) override {
     auto sqe = io_uring_get_sqe(&ring);
@@ -100,6 +115,41 @@ class IoUring final : public IoUringInterface {
     io_uring_prep_write(sqe, fd, buf, nbytes, offset);
     return IoUringSQE{static_cast<void*>(sqe)};
   }
+  IoUringSQE PrepReadFixed(int fd, void* buf, unsigned nbytes,
+                           uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepWriteFixed(int fd, const void* buf, unsigned nbytes,
+                            uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepFsync(int fd, unsigned flags) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fsync(sqe, fd, flags);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepFallocate(int fd, int mode, uint64_t offset,
+                           uint64_t len) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fallocate(sqe, fd, mode, offset, len);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
 
   size_t SQELeft() const override { return io_uring_sq_space_left(&ring); }
   size_t SQEReady() const override { return io_uring_sq_ready(&ring); }
@@ -162,6 +212,7 @@ class IoUring final : public IoUringInterface {
   struct io_uring ring {};
   bool buffer_registered_ = false;
   bool files_registered_ = false;
+  bool eventfd_registered_ = false;
   std::atomic<size_t> request_id_{};
 };
 
@@ -29,6 +29,20 @@ IoUringSQE &IoUringSQE::SetFlags(unsigned int flags) {
   return *this;
 }
 
+IoUringSQE &IoUringSQE::SetLink() {
+  if (IsOk()) {
+    static_cast<struct io_uring_sqe *>(sqe)->flags |= IOSQE_IO_LINK;
+  }
+  return *this;
+}
+
+IoUringSQE &IoUringSQE::SetDrain() {
+  if (IsOk()) {
+    static_cast<struct io_uring_sqe *>(sqe)->flags |= IOSQE_IO_DRAIN;
+  }
+  return *this;
+}
+
 IoUringSQE &IoUringSQE::SetData(uint64_t data) {
   if (IsOk()) {
     ::io_uring_sqe_set_data(static_cast<struct io_uring_sqe *>(sqe),
@@ -22,6 +22,7 @@
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
@@ -191,4 +192,93 @@ TEST_F(IoUringTest, ExtentRead) {
   for (int i = 0; i < data.size(); ++i) {
     ASSERT_EQ(data[i], i % 256);
   }
-}
\ No newline at end of file
+}
+
+TEST_F(IoUringTest, FixedBufferReadWrite) {
+  const int fd = fileno(fp);
+  const auto page = GetArbitraryPageData();
+  std::vector<unsigned char> buffer(kBlockSize * 2);
+  std::copy(page.begin(), page.end(), buffer.begin());
+  const struct iovec iov {
+    buffer.data(), buffer.size()
+  };
+  const auto registered = ring->RegisterBuffers(&iov, 1);
+  ASSERT_TRUE(registered.IsOk()) << registered;
+
+  ASSERT_TRUE(
+      ring->PrepWriteFixed(fd, buffer.data(), kBlockSize, kBlockSize * 2, 0)
+          .IsOk());
+  ASSERT_TRUE(ring->SubmitAndWait(1).IsOk());
+  auto cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, kBlockSize);
+
+  // Read it back into the second half of the registered buffer.
+  ASSERT_TRUE(ring->PrepReadFixed(fd,
+                                  buffer.data() + kBlockSize,
+                                  kBlockSize,
+                                  kBlockSize * 2,
+                                  0)
+                  .IsOk());
+  ASSERT_TRUE(ring->SubmitAndWait(1).IsOk());
+  cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, kBlockSize);
+  ASSERT_TRUE(
+      std::equal(page.begin(), page.end(), buffer.begin() + kBlockSize));
+  ASSERT_TRUE(ring->UnregisterBuffers().IsOk());
+}
+
+TEST_F(IoUringTest, LinkedWriteAndFsync) {
+  const int fd = fileno(fp);
+  const auto page = GetArbitraryPageData();
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_TRUE(ring->PrepWrite(fd, page.data(), kBlockSize, i * kBlockSize)
+                    .SetLink()
+                    .SetData(i)
+                    .IsOk());
+  }
+  ASSERT_TRUE(ring->PrepFsync(fd, 0).SetData(size_t{4}).IsOk());
+  ASSERT_TRUE(ring->SubmitAndWait(5).IsOk());
+  const auto cqes = ring->PopCQE(5);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  // A chain completes in order.
+  size_t expected = 0;
+  for (const auto& cqe : cqes.GetResult()) {
+    ASSERT_EQ(cqe.GetData<size_t>(), expected++);
+    ASSERT_GE(cqe.res, 0);
+  }
+  struct stat st {};
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ(st.st_size, static_cast<off_t>(kBlockSize * 4));
+}
+
+TEST_F(IoUringTest, BrokenLinkIsCanceled) {
+  const int fd = fileno(fp);
+  std::array<char, 16> buf{};
+  // Reading from an invalid fd fails, the linked fsync is canceled.
+  ASSERT_TRUE(ring->PrepRead(-1, buf.data(), buf.size(), 0).SetLink().IsOk());
+  ASSERT_TRUE(ring->PrepFsync(fd, 0).IsOk());
+  ASSERT_TRUE(ring->SubmitAndWait(2).IsOk());
+  const auto cqes = ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  ASSERT_EQ(cqes.GetResult()[0].res, -EBADF);
+  ASSERT_EQ(cqes.GetResult()[1].res, -ECANCELED);
+}
+
+TEST_F(IoUringTest, DrainedFallocate) {
+  const int fd = fileno(fp);
+  const auto page = GetArbitraryPageData();
+  ASSERT_TRUE(ring->PrepWrite(fd, page.data(), kBlockSize, 0).IsOk());
+  // Only starts once the write completed.
+  ASSERT_TRUE(ring->PrepFallocate(fd, 0, 0, kBlockSize * 16).SetDrain().IsOk());
+  ASSERT_TRUE(ring->SubmitAndWait(2).IsOk());
+  const auto cqes = ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  for (const auto& cqe : cqes.GetResult()) {
+    ASSERT_GE(cqe.res, 0) << strerror(-cqe.res);
+  }
+  struct stat st {};
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ(st.st_size, static_cast<off_t>(kBlockSize * 16));
+}
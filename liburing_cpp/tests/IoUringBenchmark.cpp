@@ -0,0 +1,181 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+// Compares reading and writing scattered blocks of a file with one
+// pread()/pwrite() per block against batches of io_uring requests at various
+// queue depths.
+
+#include <benchmark/benchmark.h>
+#include <liburing_cpp/IoUring.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace io_uring_cpp;
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kFileBlocks = 16384;
+// Number of blocks transferred per iteration.
+constexpr size_t kBlocksPerIteration = 1024;
+
+class BenchmarkFile {
+ public:
+  BenchmarkFile() : fp_(tmpfile()) {
+    std::vector<char> block(kBlockSize, 'A');
+    for (size_t i = 0; fp_ && i < kFileBlocks; i++) {
+      if (pwrite(fileno(fp_), block.data(), kBlockSize, i * kBlockSize) !=
+          static_cast<ssize_t>(kBlockSize)) {
+        fclose(fp_);
+        fp_ = nullptr;
+      }
+    }
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<size_t> dist(0, kFileBlocks - 1);
+    for (size_t i = 0; i < kBlocksPerIteration; i++) {
+      offsets_.push_back(dist(gen) * kBlockSize);
+    }
+  }
+  ~BenchmarkFile() {
+    if (fp_) {
+      fclose(fp_);
+    }
+  }
+  int fd() const { return fp_ ? fileno(fp_) : -1; }
+  const std::vector<uint64_t>& offsets() const { return offsets_; }
+
+ private:
+  FILE* fp_;
+  std::vector<uint64_t> offsets_;
+};
+
+enum class Mode { kRead, kWrite };
+
+void SetBytesProcessed(benchmark::State& state) {
+  state.SetBytesProcessed(state.iterations() * kBlocksPerIteration *
+                          kBlockSize);
+}
+
+template <Mode mode>
+void BM_Sync(benchmark::State& state) {
+  BenchmarkFile file;
+  if (file.fd() < 0) {
+    state.SkipWithError("Failed to create the benchmark file");
+    return;
+  }
+  std::vector<char> buffer(kBlockSize, 'B');
+  for (auto _ : state) {
+    for (const auto offset : file.offsets()) {
+      const auto ret =
+          mode == Mode::kRead
+              ? pread(file.fd(), buffer.data(), kBlockSize, offset)
+              : pwrite(file.fd(), buffer.data(), kBlockSize, offset);
+      if (ret != static_cast<ssize_t>(kBlockSize)) {
+        state.SkipWithError("Short or failed I/O");
+        return;
+      }
+    }
+  }
+  SetBytesProcessed(state);
+}
+
+// Submits the blocks in batches of state.range(0) requests, each with its own
+// slice of the buffer. With |fixed|, the buffer is registered to the kernel.
+template <Mode mode, bool fixed>
+void BM_IoUring(benchmark::State& state) {
+  const size_t queue_depth = state.range(0);
+  BenchmarkFile file;
+  auto ring = IoUringInterface::CreateLinuxIoUring(queue_depth, 0);
+  if (file.fd() < 0 || ring == nullptr) {
+    state.SkipWithError("Failed to create the benchmark file or io_uring");
+    return;
+  }
+  std::vector<char> buffer(kBlockSize * queue_depth, 'B');
+  if (fixed) {
+    const struct iovec iov {
+      buffer.data(), buffer.size()
+    };
+    if (!ring->RegisterBuffers(&iov, 1).IsOk()) {
+      state.SkipWithError("Failed to register the buffer");
+      return;
+    }
+  }
+  const auto& offsets = file.offsets();
+  for (auto _ : state) {
+    for (size_t next = 0; next < offsets.size(); next += queue_depth) {
+      const size_t batch_size =
+          std::min(queue_depth, offsets.size() - next);
+      for (size_t i = 0; i < batch_size; i++) {
+        char* buf = buffer.data() + i * kBlockSize;
+        const uint64_t offset = offsets[next + i];
+        IoUringSQE sqe{nullptr};
+        if (mode == Mode::kRead) {
+          sqe = fixed ? ring->PrepReadFixed(
+                            file.fd(), buf, kBlockSize, offset, 0)
+                      : ring->PrepRead(file.fd(), buf, kBlockSize, offset);
+        } else {
+          sqe = fixed ? ring->PrepWriteFixed(
+                            file.fd(), buf, kBlockSize, offset, 0)
+                      : ring->PrepWrite(file.fd(), buf, kBlockSize, offset);
+        }
+        if (!sqe.IsOk()) {
+          state.SkipWithError("Submission queue is full");
+          return;
+        }
+      }
+      if (!ring->SubmitAndWait(batch_size).IsOk()) {
+        state.SkipWithError("Failed to submit");
+        return;
+      }
+      const auto cqes = ring->PopCQE(batch_size);
+      if (cqes.IsErr()) {
+        state.SkipWithError(cqes.GetError().ErrMsg());
+        return;
+      }
+      for (const auto& cqe : cqes.GetResult()) {
+        if (cqe.res != static_cast<int32_t>(kBlockSize)) {
+          state.SkipWithError("Short or failed I/O");
+          return;
+        }
+      }
+    }
+  }
+  SetBytesProcessed(state);
+}
+
+void QueueDepths(benchmark::internal::Benchmark* b) {
+  for (int queue_depth : {1, 4, 16, 64, 256}) {
+    b->Arg(queue_depth);
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_Sync<Mode::kRead>);
+BENCHMARK(BM_IoUring<Mode::kRead, false>)->Apply(QueueDepths);
+BENCHMARK(BM_IoUring<Mode::kRead, true>)->Apply(QueueDepths);
+BENCHMARK(BM_Sync<Mode::kWrite>);
+BENCHMARK(BM_IoUring<Mode::kWrite, false>)->Apply(QueueDepths);
+BENCHMARK(BM_IoUring<Mode::kWrite, true>)->Apply(QueueDepths);
+
+BENCHMARK_MAIN();
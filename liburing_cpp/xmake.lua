@@ -1,4 +1,4 @@
-add_requires("liburing", "gtest")
+add_requires("liburing", "gtest", "benchmark")
 
 target("liburing_cpp")
   set_kind("static")
@@ -11,9 +11,17 @@ target("liburing_cpp")
 
 target("liburing_cpp_tests")
   set_kind("binary")
-  add_files("tests/*.cpp")
+  add_files("tests/BasicTests.cpp", "tests/main.cpp")
   set_languages("c++17")
   add_deps("liburing_cpp")
   add_packages("gtest", "liburing")
   add_cxflags("-g")
 
+
+target("liburing_cpp_benchmark")
+  set_kind("binary")
+  add_files("tests/IoUringBenchmark.cpp")
+  set_languages("c++17")
+  add_deps("liburing_cpp")
+  add_packages("benchmark", "liburing")
+  add_cxflags("-g")
@@ -26,6 +26,9 @@
 #include <lz4.h>
 #include <lz4hc.h>
 
+#include <atomic>
+#include <thread>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_generator/deflate_utils.h"
@@ -35,50 +38,203 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Below this number of blocks StoreDstCompressedFileInfo() doesn't start any
+// thread.
+constexpr size_t kMinParallelBlocks = 16;
+
+// Stores in |postfix_bspatch| the patch from the |recompressed| block to the
+// |target| one if they differ, and the hash of |recompressed| in |hash|.
+bool CheckRecompressedBlock(std::string_view recompressed,
+                            std::string_view target,
+                            std::string* postfix_bspatch,
+                            Blob* hash) {
+  if (recompressed != target) {
+    ScopedTempFile patch;
+    int err = bsdiff::bsdiff(
+        reinterpret_cast<const unsigned char*>(recompressed.data()),
+        recompressed.size(),
+        reinterpret_cast<const unsigned char*>(target.data()),
+        target.size(),
+        patch.path().c_str(),
+        nullptr);
+    CHECK_EQ(err, 0);
+    LOG(WARNING) << "Recompress Postfix patch size: "
+                 << utils::FileSize(patch.path());
+    TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), postfix_bspatch));
+  }
+  // Include recompressed blob hash, so we can determine if the device
+  // produces same compressed output
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+      recompressed.data(), recompressed.length(), hash));
+  return true;
+}
+
+}  // namespace
+
+Blob Lz4diffSourceCache::Decompress(std::string_view blob,
+                                    const CompressedFile& file_info) {
+  const auto& block_info = file_info.blocks;
+  if (block_info.empty()) {
+    return {};
+  }
+  size_t uncompressed_size = 0;
+  size_t compressed_size = 0;
+  for (const auto& block : block_info) {
+    CHECK_EQ(uncompressed_size, block.uncompressed_offset)
+        << " Compressed block info is expected to be sorted, expected offset "
+        << uncompressed_size << ", actual block " << block;
+    uncompressed_size += block.uncompressed_length;
+    compressed_size += block.compressed_length;
+  }
+  if (blob.size() < compressed_size) {
+    LOG(INFO) << "File is chunked. Skip lz4 decompress. Expected size: "
+              << compressed_size << ", actual size: " << blob.size();
+    return {};
+  }
+  Blob output;
+  output.reserve(uncompressed_size);
+  size_t compressed_offset = 0;
+  for (const auto& block : block_info) {
+    std::string_view cluster =
+        blob.substr(compressed_offset, block.compressed_length);
+    compressed_offset += block.compressed_length;
+    if (!block.IsCompressed()) {
+      output.insert(output.end(), cluster.begin(), cluster.end());
+      continue;
+    }
+    const auto entry =
+        GetBlock(cluster, block, file_info.zero_padding_enabled);
+    if (!entry) {
+      return {};
+    }
+    output.insert(
+        output.end(), entry->decompressed.begin(), entry->decompressed.end());
+  }
+  CHECK_EQ(blob.size(), compressed_offset)
+      << " Unexpected data the end of compressed data ";
+  return output;
+}
+
+std::shared_ptr<const Lz4diffSourceCache::Entry> Lz4diffSourceCache::GetBlock(
+    std::string_view cluster,
+    const CompressedBlock& block,
+    bool zero_padding_enabled) {
+  const size_t hash = std::hash<std::string_view>()(cluster);
+  auto find_entry = [&]() -> std::shared_ptr<const Entry> {
+    auto [begin, end] = entries_.equal_range(hash);
+    for (auto it = begin; it != end; ++it) {
+      const Entry& entry = *it->second;
+      if (entry.zero_padding_enabled == zero_padding_enabled &&
+          entry.decompressed.size() == block.uncompressed_length &&
+          entry.compressed == cluster) {
+        return it->second;
+      }
+    }
+    return nullptr;
+  };
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto entry = find_entry())
+      return entry;
+  }
+
+  auto entry = std::make_shared<Entry>();
+  entry->compressed = std::string(cluster);
+  entry->zero_padding_enabled = zero_padding_enabled;
+  entry->decompressed = TryDecompressBlob(
+      cluster,
+      {CompressedBlock(0, block.compressed_length, block.uncompressed_length)},
+      zero_padding_enabled);
+  if (entry->decompressed.empty()) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Decompressed by another thread meanwhile.
+  if (auto other_entry = find_entry())
+    return other_entry;
+  entries_.emplace(hash, entry);
+  insertion_order_.emplace_back(hash, entry.get());
+  size_ += entry->compressed.size() + entry->decompressed.size();
+  while (size_ > max_size_ && !insertion_order_.empty()) {
+    const auto [oldest_hash, oldest_entry] = insertion_order_.front();
+    insertion_order_.pop_front();
+    auto [begin, end] = entries_.equal_range(oldest_hash);
+    for (auto it = begin; it != end; ++it) {
+      if (it->second.get() == oldest_entry) {
+        size_ -= oldest_entry->compressed.size() +
+                 oldest_entry->decompressed.size();
+        entries_.erase(it);
+        break;
+      }
+    }
+  }
+  return entry;
+}
+
 bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
                                 std::string_view target_blob,
                                 const CompressedFile& dst_file_info,
-                                Lz4diffHeader* output) {
+                                Lz4diffHeader* output,
+                                size_t num_threads) {
   *output->mutable_dst_info()->mutable_algo() = dst_file_info.algo;
   output->mutable_dst_info()->set_zero_padding_enabled(
       dst_file_info.zero_padding_enabled);
   const auto& block_info = dst_file_info.blocks;
-  auto& dst_block_info = *output->mutable_dst_info()->mutable_block_info();
-  dst_block_info.Clear();
+  std::vector<size_t> offsets;
+  offsets.reserve(block_info.size());
   size_t offset = 0;
   for (const auto& block : block_info) {
+    CHECK_LT(offset, recompressed_blob.size());
+    offsets.push_back(offset);
+    offset += block.compressed_length;
+  }
+
+  // The blocks are checked independently, on several threads for the large
+  // files.
+  std::vector<std::string> postfix_bspatches(block_info.size());
+  std::vector<Blob> hashes(block_info.size());
+  std::atomic<size_t> next_block{0};
+  std::atomic<bool> failed{false};
+  auto check_blocks = [&]() {
+    for (size_t i = next_block++; i < block_info.size() && !failed;
+         i = next_block++) {
+      const auto length = block_info[i].compressed_length;
+      if (!CheckRecompressedBlock(recompressed_blob.substr(offsets[i], length),
+                                  target_blob.substr(offsets[i], length),
+                                  &postfix_bspatches[i],
+                                  &hashes[i])) {
+        failed = true;
+      }
+    }
+  };
+  if (block_info.size() < kMinParallelBlocks) {
+    num_threads = 1;
+  }
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_threads; i++) {
+    workers.emplace_back(check_blocks);
+  }
+  check_blocks();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  TEST_AND_RETURN_FALSE(!failed);
+
+  auto& dst_block_info = *output->mutable_dst_info()->mutable_block_info();
+  dst_block_info.Clear();
+  for (size_t i = 0; i < block_info.size(); i++) {
+    const auto& block = block_info[i];
     auto& pb_block = *dst_block_info.Add();
     pb_block.set_uncompressed_offset(block.uncompressed_offset);
     pb_block.set_uncompressed_length(block.uncompressed_length);
     pb_block.set_compressed_length(block.compressed_length);
-    CHECK_LT(offset, recompressed_blob.size());
-    auto s1 = recompressed_blob.substr(offset, block.compressed_length);
-    auto s2 = target_blob.substr(offset, block.compressed_length);
-    if (s1 != s2) {
-      ScopedTempFile patch;
-      int err =
-          bsdiff::bsdiff(reinterpret_cast<const unsigned char*>(s1.data()),
-                         s1.size(),
-                         reinterpret_cast<const unsigned char*>(s2.data()),
-                         s2.size(),
-                         patch.path().c_str(),
-                         nullptr);
-      CHECK_EQ(err, 0);
-      LOG(WARNING) << "Recompress Postfix patch size: "
-                   << utils::FileSize(patch.path());
-      std::string patch_content;
-      TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), &patch_content));
-      pb_block.set_postfix_bspatch(std::move(patch_content));
+    if (!postfix_bspatches[i].empty()) {
+      pb_block.set_postfix_bspatch(std::move(postfix_bspatches[i]));
     }
-    // Include recompressed blob hash, so we can determine if the device
-    // produces same compressed output
-    Blob recompressed_blob_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
-        s1.data(), s1.length(), &recompressed_blob_hash));
-    pb_block.set_sha256_hash(recompressed_blob_hash.data(),
-                             recompressed_blob_hash.size());
-
-    offset += block.compressed_length;
+    pb_block.set_sha256_hash(hashes[i].data(), hashes[i].size());
   }
   return true;
 }
@@ -182,12 +338,16 @@ bool Lz4Diff(std::string_view src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             Lz4diffSourceCache* src_cache,
+             size_t num_threads) noexcept {
   const auto& src_block_info = src_file_info.blocks;
   const auto& dst_block_info = dst_file_info.blocks;
 
-  auto decompressed_src = TryDecompressBlob(
-      src, src_block_info, src_file_info.zero_padding_enabled);
+  auto decompressed_src =
+      src_cache ? src_cache->Decompress(src, src_file_info)
+                : TryDecompressBlob(
+                      src, src_block_info, src_file_info.zero_padding_enabled);
   auto decompressed_dst = TryDecompressBlob(
       dst, dst_block_info, dst_file_info.zero_padding_enabled);
   if (decompressed_src.empty() || decompressed_dst.empty()) {
@@ -221,12 +381,17 @@ bool Lz4Diff(std::string_view src,
   auto recompressed_blob = TryCompressBlob(ToStringView(decompressed_dst),
                                            dst_block_info,
                                            dst_file_info.zero_padding_enabled,
-                                           dst_file_info.algo);
+                                           dst_file_info.algo,
+                                           num_threads);
   TEST_AND_RETURN_FALSE(recompressed_blob.size() > 0);
 
   StoreSrcCompressedFileInfo(src_file_info, &header);
-  StoreDstCompressedFileInfo(
-      ToStringView(recompressed_blob), dst, dst_file_info, &header);
+  TEST_AND_RETURN_FALSE(
+      StoreDstCompressedFileInfo(ToStringView(recompressed_blob),
+                                 dst,
+                                 dst_file_info,
+                                 &header,
+                                 num_threads));
   return ConstructLz4diffPatch(std::move(patch_data), header, output);
 }
 
@@ -235,13 +400,17 @@ bool Lz4Diff(const Blob& src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             Lz4diffSourceCache* src_cache,
+             size_t num_threads) noexcept {
   return Lz4Diff(ToStringView(src),
                  ToStringView(dst),
                  src_file_info,
                  dst_file_info,
                  output,
-                 op_type);
+                 op_type,
+                 src_cache,
+                 num_threads);
 }
 
 }  // namespace chromeos_update_engine
@@ -17,8 +17,13 @@
 #ifndef UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_H_
 #define UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_H_
 
-#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "lz4diff/lz4diff.pb.h"
 #include "update_engine/lz4diff/lz4diff_format.h"
@@ -26,19 +31,61 @@
 
 namespace chromeos_update_engine {
 
+// Lz4diffSourceCache keeps the decompressed source pclusters of the Lz4Diff()
+// calls, so that the files diffed from the same source data, like the chunks
+// of a file or the new files matched to the same old one, decompress it once.
+// The pclusters are looked up by content. Thread safe.
+class Lz4diffSourceCache {
+ public:
+  // The cache drops the oldest pclusters once they take more than |max_size|
+  // bytes.
+  explicit Lz4diffSourceCache(size_t max_size) : max_size_(max_size) {}
+
+  // Same as TryDecompressBlob(), with the decompressed pclusters found in the
+  // cache reused.
+  Blob Decompress(std::string_view blob, const CompressedFile& file_info);
+
+ private:
+  struct Entry {
+    std::string compressed;
+    bool zero_padding_enabled;
+    Blob decompressed;
+  };
+
+  // Returns the decompressed |block|, whose data is |cluster|.
+  std::shared_ptr<const Entry> GetBlock(std::string_view cluster,
+                                        const CompressedBlock& block,
+                                        bool zero_padding_enabled);
+
+  const size_t max_size_;
+  std::mutex mutex_;
+  // By hash of the compressed data.
+  std::unordered_multimap<size_t, std::shared_ptr<const Entry>> entries_;
+  // The hashes of |entries_|, oldest first.
+  std::deque<std::pair<size_t, const Entry*>> insertion_order_;
+  size_t size_{0};
+};
+
+// Diffs the lz4 compressed |src| and |dst|. The source is decompressed through
+// |src_cache| if not null, and the recompressed blocks of |dst| are checked on
+// up to |num_threads| threads.
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             Lz4diffSourceCache* src_cache = nullptr,
+             size_t num_threads = 1) noexcept;
 
 bool Lz4Diff(const Blob& src,
              const Blob& dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             Lz4diffSourceCache* src_cache = nullptr,
+             size_t num_threads = 1) noexcept;
 
 }  // namespace chromeos_update_engine
 
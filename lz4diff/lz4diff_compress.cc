@@ -21,95 +21,208 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 #include <base/logging.h>
 #include <lz4.h>
 #include <lz4hc.h>
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Below this number of compressed blocks TryCompressBlob() doesn't start any
+// thread.
+constexpr size_t kMinParallelBlocks = 16;
+// Number of blocks each thread compresses before the compressed blocks are
+// passed to the sink, which bounds the memory used for them.
+constexpr size_t kBlocksPerThread = 16;
+
+// Compresses |block| of |blob| into |block_buffer|, padded to
+// block.compressed_length. |uncompressed_size| is the size of the data listed
+// in the blocks of |blob|.
+bool CompressBlock(LZ4_streamHC_t* hc,
+                   std::string_view blob,
+                   size_t uncompressed_size,
+                   const CompressedBlock& block,
+                   const bool zero_padding_enabled,
+                   const CompressionAlgorithm& compression_algo,
+                   Blob* block_buffer) {
+  const auto uncompressed_block =
+      blob.substr(block.uncompressed_offset, block.uncompressed_length);
+  block_buffer->resize(block.compressed_length);
+  int ret = 0;
+  // LZ4 spec enforces that last op of a compressed block must be an insert op
+  // of at least 5 bytes. Compressors will try to conform to that requirement
+  // if the input size is just right. We don't want that. So always give a
+  // little bit more data.
+  switch (int src_size = uncompressed_size - block.uncompressed_offset;
+          compression_algo.type()) {
+    case CompressionAlgorithm::LZ4HC:
+      ret = LZ4_compress_HC_destSize(
+          hc,
+          uncompressed_block.data(),
+          reinterpret_cast<char*>(block_buffer->data()),
+          &src_size,
+          block.compressed_length,
+          compression_algo.level());
+      break;
+    case CompressionAlgorithm::LZ4:
+      ret = LZ4_compress_destSize(uncompressed_block.data(),
+                                  reinterpret_cast<char*>(block_buffer->data()),
+                                  &src_size,
+                                  block.compressed_length);
+      break;
+    default:
+      LOG(ERROR) << "Unrecognized compression algorithm: "
+                 << compression_algo.type();
+      return false;
+  }
+  TEST_GT(ret, 0);
+  const uint64_t bytes_written = ret;
+  // Last block may have trailing zeros
+  TEST_LE(bytes_written, block.compressed_length);
+  if (bytes_written < block.compressed_length) {
+    if (zero_padding_enabled) {
+      const auto padding = block.compressed_length - bytes_written;
+      std::memmove(
+          block_buffer->data() + padding, block_buffer->data(), bytes_written);
+      std::fill(block_buffer->data(), block_buffer->data() + padding, 0);
+
+    } else {
+      std::fill(block_buffer->data() + bytes_written,
+                block_buffer->data() + block.compressed_length,
+                0);
+    }
+  }
+  return true;
+}
+
+// Passes |block| of |blob| to |sink|, from |block_buffer| if compressed.
+bool SinkBlock(std::string_view blob,
+               const CompressedBlock& block,
+               const Blob& block_buffer,
+               const SinkFunc& sink) {
+  if (!block.IsCompressed()) {
+    const auto uncompressed_block =
+        blob.substr(block.uncompressed_offset, block.uncompressed_length);
+    TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
+                 uncompressed_block.size()),
+            uncompressed_block.size());
+    return true;
+  }
+  TEST_EQ(sink(block_buffer.data(), block_buffer.size()), block_buffer.size());
+  return true;
+}
+
+// Compresses the blocks on |num_threads| threads, a window of
+// kBlocksPerThread blocks per thread at a time, and passes each window to
+// |sink| in order once it's compressed. The blocks are compressed
+// independently, so the output is the same as compressing them one by one.
+bool CompressBlocksInParallel(std::string_view blob,
+                              const std::vector<CompressedBlock>& block_info,
+                              size_t uncompressed_size,
+                              const bool zero_padding_enabled,
+                              const CompressionAlgorithm& compression_algo,
+                              const SinkFunc& sink,
+                              size_t num_threads) {
+  std::vector<LZ4_streamHC_t*> streams(num_threads);
+  DEFER {
+    for (auto hc : streams) {
+      if (hc)
+        LZ4_freeStreamHC(hc);
+    }
+  };
+  for (auto& hc : streams) {
+    hc = LZ4_createStreamHC();
+    TEST_AND_RETURN_FALSE(hc);
+  }
+  const size_t window_size = num_threads * kBlocksPerThread;
+  std::vector<Blob> block_buffers(window_size);
+  for (size_t begin = 0; begin < block_info.size(); begin += window_size) {
+    const size_t end = std::min(block_info.size(), begin + window_size);
+    std::atomic<size_t> next_block{begin};
+    std::atomic<bool> failed{false};
+    auto compress_blocks = [&](LZ4_streamHC_t* hc) {
+      for (size_t i = next_block++; i < end && !failed; i = next_block++) {
+        if (block_info[i].IsCompressed() &&
+            !CompressBlock(hc,
+                           blob,
+                           uncompressed_size,
+                           block_info[i],
+                           zero_padding_enabled,
+                           compression_algo,
+                           &block_buffers[i - begin])) {
+          failed = true;
+        }
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < num_threads; i++)
+      workers.emplace_back(compress_blocks, streams[i]);
+    compress_blocks(streams[0]);
+    for (auto& worker : workers)
+      worker.join();
+    TEST_AND_RETURN_FALSE(!failed);
+    for (size_t i = begin; i < end; i++) {
+      TEST_AND_RETURN_FALSE(
+          SinkBlock(blob, block_info[i], block_buffers[i - begin], sink));
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo,
-                     const SinkFunc& sink) {
+                     const SinkFunc& sink,
+                     size_t num_threads) {
   size_t uncompressed_size = 0;
+  size_t num_compressed_blocks = 0;
   for (const auto& block : block_info) {
     CHECK_EQ(uncompressed_size, block.uncompressed_offset)
         << "Compressed block info is expected to be sorted.";
     uncompressed_size += block.uncompressed_length;
+    if (block.IsCompressed())
+      num_compressed_blocks++;
   }
-  auto hc = LZ4_createStreamHC();
-  DEFER {
-    if (hc) {
-      LZ4_freeStreamHC(hc);
-      hc = nullptr;
-    }
-  };
-  size_t compressed_offset = 0;
-  Blob block_buffer;
-  for (const auto& block : block_info) {
-    const auto uncompressed_block =
-        blob.substr(block.uncompressed_offset, block.uncompressed_length);
-    if (!block.IsCompressed()) {
-      TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
-                   uncompressed_block.size()),
-              uncompressed_block.size());
-      continue;
-    }
-    block_buffer.resize(block.compressed_length);
-    // Execute the increment at end of each loop
+  if (num_threads > 1 && num_compressed_blocks >= kMinParallelBlocks) {
+    TEST_AND_RETURN_FALSE(CompressBlocksInParallel(
+        blob,
+        block_info,
+        uncompressed_size,
+        zero_padding_enabled,
+        compression_algo,
+        sink,
+        std::min<size_t>(
+            num_threads,
+            utils::DivRoundUp(num_compressed_blocks, kBlocksPerThread))));
+  } else {
+    auto hc = LZ4_createStreamHC();
     DEFER {
-      compressed_offset += block.compressed_length;
-      block_buffer.clear();
+      if (hc) {
+        LZ4_freeStreamHC(hc);
+        hc = nullptr;
+      }
     };
-
-    int ret = 0;
-    // LZ4 spec enforces that last op of a compressed block must be an insert op
-    // of at least 5 bytes. Compressors will try to conform to that requirement
-    // if the input size is just right. We don't want that. So always give a
-    // little bit more data.
-    switch (int src_size = uncompressed_size - block.uncompressed_offset;
-            compression_algo.type()) {
-      case CompressionAlgorithm::LZ4HC:
-        ret = LZ4_compress_HC_destSize(
-            hc,
-            uncompressed_block.data(),
-            reinterpret_cast<char*>(block_buffer.data()),
-            &src_size,
-            block.compressed_length,
-            compression_algo.level());
-        break;
-      case CompressionAlgorithm::LZ4:
-        ret =
-            LZ4_compress_destSize(uncompressed_block.data(),
-                                  reinterpret_cast<char*>(block_buffer.data()),
-                                  &src_size,
-                                  block.compressed_length);
-        break;
-      default:
-        LOG(ERROR) << "Unrecognized compression algorithm: "
-                   << compression_algo.type();
-        return {};
-    }
-    TEST_GT(ret, 0);
-    const uint64_t bytes_written = ret;
-    // Last block may have trailing zeros
-    TEST_LE(bytes_written, block.compressed_length);
-    if (bytes_written < block.compressed_length) {
-      if (zero_padding_enabled) {
-        const auto padding = block.compressed_length - bytes_written;
-        std::memmove(
-            block_buffer.data() + padding, block_buffer.data(), bytes_written);
-        std::fill(block_buffer.data(), block_buffer.data() + padding, 0);
-
-      } else {
-        std::fill(block_buffer.data() + bytes_written,
-                  block_buffer.data() + block.compressed_length,
-                  0);
+    Blob block_buffer;
+    for (const auto& block : block_info) {
+      if (block.IsCompressed()) {
+        TEST_AND_RETURN_FALSE(CompressBlock(hc,
+                                            blob,
+                                            uncompressed_size,
+                                            block,
+                                            zero_padding_enabled,
+                                            compression_algo,
+                                            &block_buffer));
       }
+      TEST_AND_RETURN_FALSE(SinkBlock(blob, block, block_buffer, sink));
     }
-    TEST_EQ(sink(block_buffer.data(), block_buffer.size()),
-            block_buffer.size());
   }
   // Any trailing data will be copied to the output buffer.
   TEST_EQ(
@@ -122,7 +235,8 @@ bool TryCompressBlob(std::string_view blob,
 Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
-                     const CompressionAlgorithm compression_algo) {
+                     const CompressionAlgorithm compression_algo,
+                     size_t num_threads) {
   size_t uncompressed_size = 0;
   size_t compressed_size = 0;
   for (const auto& block : block_info) {
@@ -141,7 +255,8 @@ Blob TryCompressBlob(std::string_view blob,
                        [&output](const uint8_t* data, size_t size) {
                          output.insert(output.end(), data, data + size);
                          return size;
-                       })) {
+                       },
+                       num_threads)) {
     return {};
   }
 
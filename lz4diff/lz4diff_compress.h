@@ -36,12 +36,16 @@ using SinkFunc = std::function<size_t(const uint8_t*, size_t)>;
 Blob TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
-                     const CompressionAlgorithm compression_algo);
+                     const CompressionAlgorithm compression_algo,
+                     size_t num_threads = 1);
+// Passes the compressed blocks to |sink| one by one, in order. The blocks are
+// compressed on up to |num_threads| threads.
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
                      const CompressionAlgorithm compression_algo,
-                     const SinkFunc& sink);
+                     const SinkFunc& sink,
+                     size_t num_threads = 1);
 
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
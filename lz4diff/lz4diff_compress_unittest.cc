@@ -112,6 +112,49 @@ TEST_F(Lz4diffCompressTest, ExtractElfBinary) {
   ASSERT_EQ(decompressed_blob, expected_blob);
 }
 
+TEST_F(Lz4diffCompressTest, ParallelCompressTest) {
+  const auto build_path = GetBuildArtifactsPath("gen/erofs.img");
+  auto fs = ErofsFilesystem::CreateFromFile(build_path);
+  ASSERT_NE(fs, nullptr);
+  vector<ErofsFilesystem::File> files;
+  ASSERT_TRUE(fs->GetFiles(&files));
+  const auto it =
+      std::find_if(files.begin(), files.end(), [](const auto& file) {
+        return file.name == "/delta_generator";
+      });
+  ASSERT_NE(it, files.end());
+  const auto& info = it->compressed_file_info;
+  Blob compressed_blob;
+  ASSERT_TRUE(utils::ReadExtents(
+      build_path, it->extents, &compressed_blob, kBlockSize));
+  const auto decompressed_blob = TryDecompressBlob(
+      compressed_blob, info.blocks, info.zero_padding_enabled);
+  ASSERT_GT(decompressed_blob.size(), 0UL);
+
+  const auto expected_blob = TryCompressBlob(ToStringView(decompressed_blob),
+                                             info.blocks,
+                                             info.zero_padding_enabled,
+                                             info.algo);
+  ASSERT_GT(expected_blob.size(), 0UL);
+  // The blocks are passed to the sink one at a time and in order.
+  Blob blob;
+  size_t num_writes = 0;
+  ASSERT_TRUE(TryCompressBlob(
+      ToStringView(decompressed_blob),
+      info.blocks,
+      info.zero_padding_enabled,
+      info.algo,
+      [&](const uint8_t* data, size_t size) {
+        blob.insert(blob.end(), data, data + size);
+        num_writes++;
+        return size;
+      },
+      4));
+  EXPECT_EQ(expected_blob, blob);
+  // One write per block and one for the trailing data.
+  EXPECT_EQ(info.blocks.size() + 1, num_writes);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
@@ -105,6 +105,65 @@ TEST_F(Lz4diffTest, DiffElfBinary) {
   ASSERT_EQ(patched_new_data, new_data);
 }
 
+TEST_F(Lz4diffTest, SourceCacheTest) {
+  const auto old_img = GetBuildArtifactsPath("gen/erofs.img");
+  const auto new_img = GetBuildArtifactsPath("gen/erofs_new.img");
+  auto old_fs = ErofsFilesystem::CreateFromFile(old_img);
+  ASSERT_NE(old_fs, nullptr);
+  auto new_fs = ErofsFilesystem::CreateFromFile(new_img);
+  ASSERT_NE(new_fs, nullptr);
+  vector<ErofsFilesystem::File> old_files;
+  ASSERT_TRUE(old_fs->GetFiles(&old_files));
+  vector<ErofsFilesystem::File> new_files;
+  ASSERT_TRUE(new_fs->GetFiles(&new_files));
+  auto find_file = [](const vector<ErofsFilesystem::File>& files) {
+    return std::find_if(files.begin(), files.end(), [](const auto& file) {
+      return file.name == "/delta_generator";
+    });
+  };
+  const auto old_it = find_file(old_files);
+  ASSERT_NE(old_it, old_files.end());
+  const auto new_it = find_file(new_files);
+  ASSERT_NE(new_it, new_files.end());
+  Blob old_data;
+  ASSERT_TRUE(
+      utils::ReadExtents(old_img, old_it->extents, &old_data, kBlockSize));
+  Blob new_data;
+  ASSERT_TRUE(
+      utils::ReadExtents(new_img, new_it->extents, &new_data, kBlockSize));
+
+  const auto& old_info = old_it->compressed_file_info;
+  const auto expected_data = TryDecompressBlob(
+      old_data, old_info.blocks, old_info.zero_padding_enabled);
+  ASSERT_GT(expected_data.size(), 0UL);
+  Lz4diffSourceCache cache(1024 * 1024 * 1024);
+  // The second time the pclusters are found in the cache.
+  EXPECT_EQ(expected_data, cache.Decompress(ToStringView(old_data), old_info));
+  EXPECT_EQ(expected_data, cache.Decompress(ToStringView(old_data), old_info));
+  // Too small to keep any pcluster.
+  Lz4diffSourceCache small_cache(1);
+  EXPECT_EQ(expected_data,
+            small_cache.Decompress(ToStringView(old_data), old_info));
+
+  // The cache and the threads don't change the patch.
+  Blob expected_diff;
+  ASSERT_TRUE(Lz4Diff(old_data,
+                      new_data,
+                      old_info,
+                      new_it->compressed_file_info,
+                      &expected_diff));
+  Blob diff;
+  ASSERT_TRUE(Lz4Diff(old_data,
+                      new_data,
+                      old_info,
+                      new_it->compressed_file_info,
+                      &diff,
+                      nullptr,
+                      &cache,
+                      4));
+  EXPECT_EQ(expected_diff, diff);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
@@ -241,7 +241,8 @@ bool ApplyInnerPatch(Blob decompressed_src,
 // Hand coding CPS is not fun.
 bool Lz4Patch(std::string_view src_data,
               const Lz4diffPatch& patch,
-              const SinkFunc& sink) {
+              const SinkFunc& sink,
+              size_t num_threads) {
   auto decompressed_src = TryDecompressBlob(
       src_data,
       ToCompressedBlockVec(patch.pb_header.src_info().block_info()),
@@ -252,7 +253,8 @@ bool Lz4Patch(std::string_view src_data,
       GetDecompressedSize(patch.pb_header.dst_info().block_info());
   decompressed_dst.reserve(decompressed_dst_size);
 
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
+  TEST_AND_RETURN_FALSE(
+      ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst));
 
   if (!HasPosfixPatches(patch)) {
     return TryCompressBlob(
@@ -260,7 +262,8 @@ bool Lz4Patch(std::string_view src_data,
         ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
         patch.pb_header.dst_info().zero_padding_enabled(),
         patch.pb_header.dst_info().algo(),
-        sink);
+        sink,
+        num_threads);
   }
   auto postfix_patcher =
       [&sink,
@@ -304,7 +307,8 @@ bool Lz4Patch(std::string_view src_data,
       ToCompressedBlockVec(patch.pb_header.dst_info().block_info()),
       patch.pb_header.dst_info().zero_padding_enabled(),
       patch.pb_header.dst_info().algo(),
-      postfix_patcher);
+      postfix_patcher,
+      num_threads);
 }
 
 bool Lz4Patch(std::string_view src_data,
@@ -315,10 +319,13 @@ bool Lz4Patch(std::string_view src_data,
       GetCompressedSize(patch.pb_header.dst_info().block_info());
   blob.reserve(output_size);
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      src_data, patch, [&blob](const uint8_t* data, size_t size) -> size_t {
+      src_data,
+      patch,
+      [&blob](const uint8_t* data, size_t size) -> size_t {
         blob.insert(blob.end(), data, data + size);
         return size;
-      }));
+      },
+      1));
   *output = std::move(blob);
   return true;
 }
@@ -335,10 +342,11 @@ bool Lz4Patch(std::string_view src_data,
 
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
-              const SinkFunc& sink) {
+              const SinkFunc& sink,
+              size_t num_threads) {
   Lz4diffPatch patch;
   TEST_AND_RETURN_FALSE(ParseLz4DifffPatch(patch_data, &patch));
-  return Lz4Patch(src_data, patch, sink);
+  return Lz4Patch(src_data, patch, sink, num_threads);
 }
 
 bool Lz4Patch(const Blob& src_data, const Blob& patch_data, Blob* output) {
@@ -22,9 +22,13 @@
 
 namespace chromeos_update_engine {
 
+// Applies |patch_data| to |src_data| and passes the patched data to |sink| as
+// each block is recompressed. The blocks are recompressed on up to
+// |num_threads| threads.
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
-              const SinkFunc& sink);
+              const SinkFunc& sink,
+              size_t num_threads = 1);
 
 bool Lz4Patch(std::string_view src_data,
               std::string_view patch_data,
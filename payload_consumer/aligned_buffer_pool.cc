@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) {
+  if (this != &other) {
+    reset();
+    std::swap(pool_, other.pool_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+  return *this;
+}
+
+void PooledBuffer::reset() {
+  if (data_ != nullptr)
+    pool_->Release(data_, capacity_);
+  pool_ = nullptr;
+  data_ = nullptr;
+  size_ = 0;
+  capacity_ = 0;
+}
+
+AlignedBufferPool::AlignedBufferPool(uint64_t max_idle_bytes)
+    : max_idle_bytes_(max_idle_bytes) {}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  Trim();
+}
+
+AlignedBufferPool* AlignedBufferPool::Get() {
+  // Never destroyed, the buffers may be released by threads still running at
+  // exit.
+  static AlignedBufferPool* pool = new AlignedBufferPool();
+  return pool;
+}
+
+size_t AlignedBufferPool::SizeClass(size_t size) {
+  size_t index = 0;
+  for (size_t capacity = kMinSizeClass; capacity < size; capacity <<= 1) {
+    if (++index == kNumSizeClasses)
+      break;
+  }
+  return index;
+}
+
+PooledBuffer AlignedBufferPool::Acquire(size_t size) {
+  if (size == 0)
+    return {};
+  const size_t index = SizeClass(size);
+  if (index == kNumSizeClasses) {
+    // Too large to keep, rounded to the alignment only.
+    const size_t capacity = (size + kAlignment - 1) & ~(kAlignment - 1);
+    uint8_t* data = Allocate(capacity);
+    if (data == nullptr)
+      return {};
+    return PooledBuffer(this, data, size, capacity);
+  }
+  const size_t capacity = kMinSizeClass << index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_[index].empty()) {
+      uint8_t* data = idle_[index].back();
+      idle_[index].pop_back();
+      idle_bytes_ -= capacity;
+      idle_memory_.Set(idle_bytes_);
+      return PooledBuffer(this, data, size, capacity);
+    }
+  }
+  uint8_t* data = Allocate(capacity);
+  if (data == nullptr)
+    return {};
+  return PooledBuffer(this, data, size, capacity);
+}
+
+void AlignedBufferPool::set_use_huge_pages(bool use_huge_pages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  use_huge_pages_ = use_huge_pages;
+}
+
+void AlignedBufferPool::Trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& buffers : idle_) {
+    for (uint8_t* data : buffers)
+      free(data);
+    buffers.clear();
+  }
+  idle_bytes_ = 0;
+  idle_memory_.Set(0);
+}
+
+uint64_t AlignedBufferPool::idle_bytes() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_bytes_;
+}
+
+uint64_t AlignedBufferPool::num_allocations() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_allocations_;
+}
+
+uint8_t* AlignedBufferPool::Allocate(size_t capacity) {
+  bool huge_pages;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    huge_pages = use_huge_pages_ && capacity >= kHugePageSize;
+    num_allocations_++;
+  }
+  void* data = nullptr;
+  const int err = posix_memalign(
+      &data, huge_pages ? kHugePageSize : kAlignment, capacity);
+  if (err != 0) {
+    LOG(ERROR) << "Unable to allocate a buffer of " << capacity
+               << " bytes: " << err;
+    return nullptr;
+  }
+  // Only a hint, the buffer works without huge pages.
+  if (huge_pages)
+    madvise(data, capacity, MADV_HUGEPAGE);
+  return static_cast<uint8_t*>(data);
+}
+
+void AlignedBufferPool::Release(uint8_t* data, size_t capacity) {
+  const size_t index = SizeClass(capacity);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index < kNumSizeClasses &&
+        idle_bytes_ + capacity <= max_idle_bytes_) {
+      idle_[index].push_back(data);
+      idle_bytes_ += capacity;
+      idle_memory_.Set(idle_bytes_);
+      return;
+    }
+  }
+  free(data);
+}
+
+}  // namespace chromeos_update_engine
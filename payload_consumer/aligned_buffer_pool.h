@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/memory_accounting.h"
+
+namespace chromeos_update_engine {
+
+class AlignedBufferPool;
+
+// A buffer taken from an AlignedBufferPool, returned to it when destroyed.
+// Its data isn't initialized.
+class PooledBuffer {
+ public:
+  PooledBuffer() = default;
+  PooledBuffer(PooledBuffer&& other) { *this = std::move(other); }
+  PooledBuffer& operator=(PooledBuffer&& other);
+  ~PooledBuffer() { reset(); }
+
+  uint8_t* data() { return data_; }
+  const uint8_t* data() const { return data_; }
+  // The size asked for.
+  size_t size() const { return size_; }
+  // The size of the size class the buffer belongs to.
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+
+  // Returns the buffer to its pool.
+  void reset();
+
+ private:
+  friend class AlignedBufferPool;
+  PooledBuffer(AlignedBufferPool* pool,
+               uint8_t* data,
+               size_t size,
+               size_t capacity)
+      : pool_(pool), data_(data), size_(size), capacity_(capacity) {}
+
+  AlignedBufferPool* pool_{nullptr};
+  uint8_t* data_{nullptr};
+  size_t size_{0};
+  size_t capacity_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PooledBuffer);
+};
+
+// AlignedBufferPool keeps the buffers of the apply and verify paths once they
+// are released, for the next operations or partitions to reuse, instead of
+// allocating and faulting in new memory every time. The buffers are aligned
+// to kAlignment, so they can be written with O_DIRECT, and keep their address
+// while in the pool, so they can stay registered as io_uring fixed buffers.
+// They are rounded up to power of two size classes from kMinSizeClass to
+// kMaxSizeClass. Larger ones are allocated and freed every time. The idle
+// buffers are charged to MemoryTag::kBufferPool, and the pool frees the
+// ones that don't fit in its limit. Safe to use from several threads.
+class AlignedBufferPool {
+ public:
+  static constexpr size_t kAlignment = 4096;
+  static constexpr size_t kMinSizeClass = 4096;
+  static constexpr size_t kMaxSizeClass = 64 * 1024 * 1024;
+  // Idle bytes kept by the default pool.
+  static constexpr uint64_t kDefaultMaxIdleBytes = 64 * 1024 * 1024;
+  // The buffers of at least this size are backed by transparent huge pages
+  // when enabled.
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  explicit AlignedBufferPool(uint64_t max_idle_bytes = kDefaultMaxIdleBytes);
+  ~AlignedBufferPool();
+
+  // Returns the pool of the process.
+  static AlignedBufferPool* Get();
+
+  // Returns a buffer of at least |size| bytes, or an empty one if |size| is 0
+  // or the allocation failed.
+  PooledBuffer Acquire(size_t size);
+
+  // Whether the buffers of at least kHugePageSize bytes allocated from now on
+  // are aligned to it and advised to use transparent huge pages.
+  void set_use_huge_pages(bool use_huge_pages);
+
+  // Frees the idle buffers.
+  void Trim();
+
+  uint64_t idle_bytes();
+  // Number of buffers allocated since the pool was created, for tests.
+  uint64_t num_allocations();
+
+ private:
+  friend class PooledBuffer;
+
+  static constexpr size_t kNumSizeClasses = 15;
+  static_assert(kMinSizeClass << (kNumSizeClasses - 1) == kMaxSizeClass);
+
+  // Returns the index of the smallest size class holding |size| bytes, or
+  // kNumSizeClasses if it's larger than kMaxSizeClass.
+  static size_t SizeClass(size_t size);
+
+  uint8_t* Allocate(size_t capacity);
+  void Release(uint8_t* data, size_t capacity);
+
+  const uint64_t max_idle_bytes_;
+
+  std::mutex mutex_;
+  // The idle buffers of each size class.
+  std::array<std::vector<uint8_t*>, kNumSizeClasses> idle_;
+  uint64_t idle_bytes_{0};
+  MemoryCharge idle_memory_{MemoryTag::kBufferPool};
+  bool use_huge_pages_{false};
+  uint64_t num_allocations_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(AlignedBufferPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ALIGNED_BUFFER_POOL_H_
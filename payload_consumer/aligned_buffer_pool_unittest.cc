@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <utility>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+bool IsAligned(const void* data) {
+  return reinterpret_cast<uintptr_t>(data) % AlignedBufferPool::kAlignment ==
+         0;
+}
+}  // namespace
+
+TEST(AlignedBufferPoolTest, ReusesReleasedBuffersTest) {
+  AlignedBufferPool pool(1024 * 1024);
+  EXPECT_TRUE(pool.Acquire(0).empty());
+
+  PooledBuffer buffer = pool.Acquire(5000);
+  ASSERT_FALSE(buffer.empty());
+  EXPECT_EQ(5000u, buffer.size());
+  EXPECT_EQ(8192u, buffer.capacity());
+  EXPECT_TRUE(IsAligned(buffer.data()));
+  memset(buffer.data(), 0x55, buffer.size());
+  uint8_t* data = buffer.data();
+  buffer.reset();
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(8192u, pool.idle_bytes());
+
+  // Any size of the same class gets the released buffer back.
+  PooledBuffer same_class = pool.Acquire(8192);
+  EXPECT_EQ(data, same_class.data());
+  EXPECT_EQ(0u, pool.idle_bytes());
+  PooledBuffer other_class = pool.Acquire(100);
+  EXPECT_EQ(4096u, other_class.capacity());
+  EXPECT_EQ(2u, pool.num_allocations());
+
+  // Moving a buffer releases it only once.
+  PooledBuffer moved = std::move(same_class);
+  EXPECT_TRUE(same_class.empty());
+  EXPECT_EQ(data, moved.data());
+  moved = std::move(other_class);
+  EXPECT_EQ(8192u, pool.idle_bytes());
+  moved.reset();
+  EXPECT_EQ(8192u + 4096u, pool.idle_bytes());
+
+  pool.Trim();
+  EXPECT_EQ(0u, pool.idle_bytes());
+}
+
+TEST(AlignedBufferPoolTest, IdleLimitTest) {
+  AlignedBufferPool pool(16 * 1024);
+  PooledBuffer first = pool.Acquire(16 * 1024);
+  PooledBuffer second = pool.Acquire(16 * 1024);
+  first.reset();
+  // Doesn't fit next to the first one, it's freed.
+  second.reset();
+  EXPECT_EQ(16u * 1024, pool.idle_bytes());
+
+  // Larger than the largest size class, never kept.
+  PooledBuffer large = pool.Acquire(AlignedBufferPool::kMaxSizeClass + 1);
+  ASSERT_FALSE(large.empty());
+  EXPECT_TRUE(IsAligned(large.data()));
+  EXPECT_EQ(AlignedBufferPool::kMaxSizeClass + AlignedBufferPool::kAlignment,
+            large.capacity());
+  large.reset();
+  EXPECT_EQ(16u * 1024, pool.idle_bytes());
+}
+
+TEST(AlignedBufferPoolTest, HugePagesTest) {
+  AlignedBufferPool pool;
+  pool.set_use_huge_pages(true);
+  PooledBuffer buffer = pool.Acquire(AlignedBufferPool::kHugePageSize);
+  ASSERT_FALSE(buffer.empty());
+  EXPECT_EQ(0u,
+            reinterpret_cast<uintptr_t>(buffer.data()) %
+                AlignedBufferPool::kHugePageSize);
+  memset(buffer.data(), 0xaa, buffer.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_io_uring.h"
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <limits>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Delay before retrying a submission the kernel didn't fully accept.
+constexpr int kSubmitRetryDelayMs = 10;
+}  // namespace
+
+AsyncIoUring::AsyncIoUring(unsigned queue_depth) : queue_depth_(queue_depth) {
+  CHECK_GT(queue_depth_, 0u);
+}
+
+AsyncIoUring::~AsyncIoUring() {
+  submit_task_id_.Cancel();
+  controller_.reset();
+  if (!ring_ || callbacks_.empty()) {
+    return;
+  }
+  if (num_queued_ > 0) {
+    const auto submitted = ring_->Submit();
+    // Requests left in the submission queue never reach the kernel.
+    if (submitted.EntriesSubmitted() < num_queued_) {
+      LOG(WARNING) << "Dropping "
+                   << num_queued_ - submitted.EntriesSubmitted()
+                   << " queued io_uring requests";
+    }
+    num_queued_ -= submitted.EntriesSubmitted();
+  }
+  for (size_t i = num_queued_; i < callbacks_.size(); i++) {
+    const auto cqe = ring_->PopCQE();
+    if (cqe.IsErr()) {
+      // The kernel may still write to the buffers of the requests in flight,
+      // so leak the ring and the callbacks owning them instead of aborting.
+      LOG(ERROR) << "Failed to reap io_uring completions: " << cqe.GetError()
+                 << ", leaking " << callbacks_.size() - i
+                 << " requests in flight";
+      ignore_result(ring_.release());
+      ignore_result(new std::map<uint64_t, Callback>(std::move(callbacks_)));
+      return;
+    }
+  }
+}
+
+bool AsyncIoUring::Init() {
+  CHECK(!ring_);
+  ring_ = io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth_, 0);
+  if (!ring_) {
+    PLOG(WARNING) << "Failed to create an io_uring";
+    return false;
+  }
+  event_fd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (!event_fd_.is_valid()) {
+    PLOG(ERROR) << "Failed to create an eventfd";
+    ring_.reset();
+    return false;
+  }
+  const auto err = ring_->RegisterEventFd(event_fd_.get());
+  if (!err.IsOk()) {
+    LOG(ERROR) << "Failed to register the eventfd of the io_uring: " << err;
+    ring_.reset();
+    return false;
+  }
+  controller_ = base::FileDescriptorWatcher::WatchReadable(
+      event_fd_.get(),
+      base::BindRepeating(&AsyncIoUring::OnCompletions,
+                          base::Unretained(this)));
+  return true;
+}
+
+bool AsyncIoUring::Read(
+    int fd, void* buf, size_t count, off64_t offset, Callback callback) {
+  CHECK(ring_);
+  TEST_AND_RETURN_FALSE(count <= std::numeric_limits<unsigned>::max());
+  if (IsFull()) {
+    return false;
+  }
+  return AddRequest(ring_->PrepRead(fd, buf, count, offset),
+                    std::move(callback));
+}
+
+bool AsyncIoUring::Write(int fd,
+                         const void* buf,
+                         size_t count,
+                         off64_t offset,
+                         Callback callback) {
+  CHECK(ring_);
+  TEST_AND_RETURN_FALSE(count <= std::numeric_limits<unsigned>::max());
+  if (IsFull()) {
+    return false;
+  }
+  return AddRequest(ring_->PrepWrite(fd, buf, count, offset),
+                    std::move(callback));
+}
+
+bool AsyncIoUring::AddRequest(io_uring_cpp::IoUringSQE sqe,
+                              Callback callback) {
+  // There are never more than |queue_depth_| requests queued or in flight,
+  // and the submission queue has that many entries.
+  CHECK(sqe.IsOk());
+  const uint64_t id = next_request_id_++;
+  sqe.SetData(id);
+  callbacks_.emplace(id, std::move(callback));
+  num_queued_++;
+  if (!submit_task_id_.IsScheduled()) {
+    CHECK(submit_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&AsyncIoUring::SubmitQueued, base::Unretained(this))));
+  }
+  return true;
+}
+
+void AsyncIoUring::SubmitQueued() {
+  const auto submitted = ring_->Submit();
+  num_queued_ -= submitted.EntriesSubmitted();
+  if (num_queued_ == 0) {
+    return;
+  }
+  // The kernel is out of resources, the requests it didn't take stay in the
+  // submission queue.
+  LOG(WARNING) << "Submitted " << submitted.EntriesSubmitted() << " of "
+               << num_queued_ + submitted.EntriesSubmitted()
+               << " io_uring requests: "
+               << (submitted.IsOk() ? "" : submitted.ErrMsg())
+               << ", retrying";
+  CHECK(submit_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&AsyncIoUring::SubmitQueued, base::Unretained(this)),
+      base::TimeDelta::FromMilliseconds(kSubmitRetryDelayMs)));
+}
+
+void AsyncIoUring::OnCompletions() {
+  // Reset the counter of the eventfd before reaping, the CQEs posted after
+  // the loop below signal it again.
+  uint64_t value = 0;
+  if (HANDLE_EINTR(read(event_fd_.get(), &value, sizeof(value))) < 0 &&
+      errno != EAGAIN) {
+    PLOG(ERROR) << "Failed to read the eventfd of the io_uring";
+  }
+  while (ring_->PeekCQE().IsOk()) {
+    // Doesn't block, a CQE is ready.
+    const auto cqe = ring_->PopCQE();
+    CHECK(cqe.IsOk());
+    const uint64_t id = cqe.GetResult().GetData<uint64_t>();
+    auto it = callbacks_.find(id);
+    CHECK(it != callbacks_.end());
+    Callback callback = std::move(it->second);
+    callbacks_.erase(it);
+    // The callback may queue more requests.
+    std::move(callback).Run(cqe.GetResult().res);
+  }
+}
+
+}  // namespace chromeos_update_engine
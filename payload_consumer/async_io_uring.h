@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
+
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+
+#include <base/callback.h>
+#include <base/files/file_descriptor_watcher_posix.h>
+#include <base/files/scoped_file.h>
+#include <base/macros.h>
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/common/scoped_task_id.h"
+
+namespace chromeos_update_engine {
+
+// AsyncIoUring keeps many reads and writes in flight from the main message
+// loop without blocking it and without threads: the requests go to an
+// io_uring whose eventfd is watched by the loop, and each request's callback
+// runs on the loop once it completes. The requests queued from one task are
+// submitted together with a single syscall once that task returns.
+//
+// Must be created, used and destroyed on the thread of the message loop.
+class AsyncIoUring {
+ public:
+  // Called with the number of bytes transferred, which may be short, or with
+  // -errno if the request failed.
+  using Callback = base::OnceCallback<void(ssize_t result)>;
+
+  static constexpr unsigned kDefaultQueueDepth = 64;
+
+  explicit AsyncIoUring(unsigned queue_depth = kDefaultQueueDepth);
+  // Waits for the requests in flight, without running their callbacks, since
+  // the kernel may still write to their buffers.
+  ~AsyncIoUring();
+
+  // Creates the ring and starts watching its completions. Returns false if
+  // the kernel doesn't support io_uring, the caller should then fall back to
+  // synchronous I/O.
+  bool Init();
+
+  // Queues a read of |count| bytes at |offset| of |fd| into |buf|, or a write
+  // of |buf|. The buffer must stay valid until |callback| runs. Returns false
+  // without queuing anything if the queue is full, the caller can retry once
+  // one of its callbacks ran.
+  bool Read(int fd, void* buf, size_t count, off64_t offset, Callback callback);
+  bool Write(int fd,
+             const void* buf,
+             size_t count,
+             off64_t offset,
+             Callback callback);
+
+  // Whether |queue_depth_| requests are already queued or in flight.
+  bool IsFull() const { return callbacks_.size() >= queue_depth_; }
+  size_t num_pending() const { return callbacks_.size(); }
+
+ private:
+  // Registers the callback of the request |sqe| and schedules the submission
+  // of the queued requests.
+  bool AddRequest(io_uring_cpp::IoUringSQE sqe, Callback callback);
+
+  // Submits the requests queued since the last submission.
+  void SubmitQueued();
+
+  // Runs the callbacks of the completed requests.
+  void OnCompletions();
+
+  const unsigned queue_depth_;
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  base::ScopedFD event_fd_;
+  std::unique_ptr<base::FileDescriptorWatcher::Controller> controller_;
+
+  // The callbacks of the queued and in flight requests, by request id.
+  std::map<uint64_t, Callback> callbacks_;
+  uint64_t next_request_id_{0};
+  // Number of requests queued but not submitted yet.
+  size_t num_queued_{0};
+  ScopedTaskId submit_task_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncIoUring);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
@@ -0,0 +1,179 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_io_uring.h"
+
+#include <vector>
+
+#include <base/bind.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#endif  // BASE_VER < 780000
+#if BASE_VER >= 780000  // Chrome OS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER >= 780000
+#include <base/time/time.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 16;
+
+AsyncIoUring::Callback RecordResult(std::vector<ssize_t>* results) {
+  return base::BindOnce(
+      [](std::vector<ssize_t>* results, ssize_t result) {
+        results->push_back(result);
+      },
+      results);
+}
+
+// Writes the blocks of |data| keeping the queue full: the completion
+// callbacks queue the next blocks.
+class BlockWriter {
+ public:
+  BlockWriter(AsyncIoUring* ring, int fd, const brillo::Blob* data)
+      : ring_(ring), fd_(fd), data_(data) {}
+
+  void WriteNext() {
+    while (next_offset_ < data_->size() && !ring_->IsFull()) {
+      ASSERT_TRUE(ring_->Write(
+          fd_,
+          data_->data() + next_offset_,
+          kBlockSize,
+          next_offset_,
+          base::BindOnce(&BlockWriter::OnWritten, base::Unretained(this))));
+      next_offset_ += kBlockSize;
+    }
+  }
+
+  std::vector<ssize_t> results_;
+
+ private:
+  void OnWritten(ssize_t result) {
+    results_.push_back(result);
+    WriteNext();
+  }
+
+  AsyncIoUring* ring_;
+  int fd_;
+  const brillo::Blob* data_;
+  size_t next_offset_{0};
+};
+}  // namespace
+
+class AsyncIoUringTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    if (!ring_.Init()) {
+      GTEST_SKIP() << "io_uring isn't supported by this kernel.";
+    }
+  }
+
+  // Runs the loop until no request is pending.
+  void RunUntilIdle() {
+    brillo::MessageLoopRunUntil(
+        &loop_, base::TimeDelta::FromSeconds(10), [this]() {
+          return ring_.num_pending() == 0;
+        });
+    EXPECT_EQ(0u, ring_.num_pending());
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+  ScopedTempFile temp_file_{"AsyncIoUringTest-XXXXXX", true};
+  // Smaller than the number of blocks, so the queue fills up.
+  AsyncIoUring ring_{4};
+};
+
+TEST_F(AsyncIoUringTest, WriteAndReadTest) {
+  brillo::Blob data(kBlockSize * kNumBlocks);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<uint8_t>(i * 31 + i / kBlockSize);
+
+  BlockWriter writer(&ring_, temp_file_.fd(), &data);
+  writer.WriteNext();
+  EXPECT_TRUE(ring_.IsFull());
+  // Queued, but not submitted before the loop runs.
+  EXPECT_TRUE(writer.results_.empty());
+  RunUntilIdle();
+  EXPECT_EQ(std::vector<ssize_t>(kNumBlocks, kBlockSize), writer.results_);
+
+  brillo::Blob on_disk;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &on_disk));
+  EXPECT_EQ(data, on_disk);
+
+  // Read it back in two requests.
+  brillo::Blob read_data(data.size());
+  std::vector<ssize_t> results;
+  const size_t half = data.size() / 2;
+  ASSERT_TRUE(ring_.Read(temp_file_.fd(),
+                         read_data.data(),
+                         half,
+                         0,
+                         RecordResult(&results)));
+  ASSERT_TRUE(ring_.Read(temp_file_.fd(),
+                         read_data.data() + half,
+                         half,
+                         half,
+                         RecordResult(&results)));
+  RunUntilIdle();
+  EXPECT_EQ(std::vector<ssize_t>(2, half), results);
+  EXPECT_EQ(data, read_data);
+}
+
+TEST_F(AsyncIoUringTest, QueueFullAndErrorsTest) {
+  std::vector<ssize_t> results;
+  brillo::Blob buf(kBlockSize);
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_TRUE(
+        ring_.Read(-1, buf.data(), buf.size(), 0, RecordResult(&results)));
+  }
+  EXPECT_TRUE(ring_.IsFull());
+  EXPECT_FALSE(
+      ring_.Read(-1, buf.data(), buf.size(), 0, RecordResult(&results)));
+  RunUntilIdle();
+  EXPECT_EQ(std::vector<ssize_t>(4, -EBADF), results);
+  EXPECT_FALSE(ring_.IsFull());
+}
+
+TEST_F(AsyncIoUringTest, DestroyWithRequestsInFlightTest) {
+  brillo::Blob buf(kBlockSize);
+  std::vector<ssize_t> results;
+  {
+    AsyncIoUring ring;
+    ASSERT_TRUE(ring.Init());
+    ASSERT_TRUE(ring.Read(
+        temp_file_.fd(), buf.data(), buf.size(), 0, RecordResult(&results)));
+  }
+  // The request was waited for, without running its callback.
+  brillo::MessageLoopRunMaxIterations(&loop_, 10);
+  EXPECT_TRUE(results.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,205 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_snapshot_writer.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+AsyncSnapshotWriter::AsyncSnapshotWriter(
+    std::unique_ptr<android::snapshot::ISnapshotWriter> writer,
+    size_t queue_size)
+    : ISnapshotWriter(writer->options()),
+      writer_(std::move(writer)),
+      queue_size_(queue_size) {
+  write_thread_ = std::thread(&AsyncSnapshotWriter::WriteLoop, this);
+}
+
+AsyncSnapshotWriter::~AsyncSnapshotWriter() {
+  {
+    // The operations still queued are dropped, the update resumes from the
+    // last label anyway.
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  operation_queued_.notify_one();
+  write_thread_.join();
+}
+
+bool AsyncSnapshotWriter::Initialize() {
+  return Wait() && writer_->Initialize();
+}
+
+bool AsyncSnapshotWriter::InitializeAppend(uint64_t label) {
+  return Wait() && writer_->InitializeAppend(label);
+}
+
+std::unique_ptr<AsyncSnapshotWriter::FileDescriptor>
+AsyncSnapshotWriter::OpenReader() {
+  if (!Wait())
+    return nullptr;
+  return writer_->OpenReader();
+}
+
+bool AsyncSnapshotWriter::VerifyMergeOps() const noexcept {
+  return Wait() && writer_->VerifyMergeOps();
+}
+
+bool AsyncSnapshotWriter::Finalize() {
+  return Wait() && writer_->Finalize();
+}
+
+uint64_t AsyncSnapshotWriter::GetCowSize() {
+  Wait();
+  return writer_->GetCowSize();
+}
+
+bool AsyncSnapshotWriter::EmitCopy(uint64_t new_block,
+                                   uint64_t old_block,
+                                   uint64_t num_blocks) {
+  return Queue({.type = Operation::kCopy,
+                .new_block = new_block,
+                .old_block = old_block,
+                .num_blocks = num_blocks});
+}
+
+bool AsyncSnapshotWriter::EmitRawBlocks(uint64_t new_block_start,
+                                        const void* data,
+                                        size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  return Queue({.type = Operation::kRawBlocks,
+                .new_block = new_block_start,
+                .data = brillo::Blob(bytes, bytes + size)});
+}
+
+bool AsyncSnapshotWriter::EmitXorBlocks(uint32_t new_block_start,
+                                        const void* data,
+                                        size_t size,
+                                        uint32_t old_block,
+                                        uint16_t offset) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  return Queue({.type = Operation::kXorBlocks,
+                .new_block = new_block_start,
+                .old_block = old_block,
+                .offset = offset,
+                .data = brillo::Blob(bytes, bytes + size)});
+}
+
+bool AsyncSnapshotWriter::EmitZeroBlocks(uint64_t new_block_start,
+                                         uint64_t num_blocks) {
+  return Queue({.type = Operation::kZeroBlocks,
+                .new_block = new_block_start,
+                .num_blocks = num_blocks});
+}
+
+bool AsyncSnapshotWriter::EmitLabel(uint64_t label) {
+  return Queue({.type = Operation::kLabel, .new_block = label}) && Wait();
+}
+
+bool AsyncSnapshotWriter::EmitSequenceData(size_t num_ops,
+                                           const uint32_t* data) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  return Queue({.type = Operation::kSequenceData,
+                .new_block = num_ops,
+                .data = brillo::Blob(bytes, bytes + num_ops * sizeof(*data))});
+}
+
+bool AsyncSnapshotWriter::Queue(Operation operation) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // An operation larger than the whole queue waits for it to be empty.
+  operation_written_.wait(lock, [this, &operation] {
+    return failed_ || queued_bytes_ == 0 ||
+           queued_bytes_ + operation.size() <= queue_size_;
+  });
+  if (failed_)
+    return false;
+  queued_bytes_ += operation.size();
+  queue_.push_back(std::move(operation));
+  operation_queued_.notify_one();
+  return true;
+}
+
+bool AsyncSnapshotWriter::Wait() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  operation_written_.wait(lock,
+                          [this] { return queue_.empty() && !writing_; });
+  return !failed_;
+}
+
+void AsyncSnapshotWriter::WriteLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    operation_queued_.wait(lock,
+                           [this] { return stopping_ || !queue_.empty(); });
+    if (stopping_)
+      return;
+    const Operation operation = std::move(queue_.front());
+    queue_.pop_front();
+    const bool failed = failed_;
+    writing_ = true;
+    lock.unlock();
+
+    const bool result = failed || Write(operation);
+
+    lock.lock();
+    writing_ = false;
+    queued_bytes_ -= operation.size();
+    if (!result)
+      failed_ = true;
+    operation_written_.notify_all();
+  }
+}
+
+bool AsyncSnapshotWriter::Write(const Operation& operation) {
+  bool result = false;
+  switch (operation.type) {
+    case Operation::kCopy:
+      result = writer_->AddCopy(
+          operation.new_block, operation.old_block, operation.num_blocks);
+      break;
+    case Operation::kRawBlocks:
+      result = writer_->AddRawBlocks(
+          operation.new_block, operation.data.data(), operation.data.size());
+      break;
+    case Operation::kXorBlocks:
+      result = writer_->AddXorBlocks(operation.new_block,
+                                     operation.data.data(),
+                                     operation.data.size(),
+                                     operation.old_block,
+                                     operation.offset);
+      break;
+    case Operation::kZeroBlocks:
+      result =
+          writer_->AddZeroBlocks(operation.new_block, operation.num_blocks);
+      break;
+    case Operation::kLabel:
+      result = writer_->AddLabel(operation.new_block);
+      break;
+    case Operation::kSequenceData:
+      result = writer_->AddSequenceData(
+          operation.new_block,
+          reinterpret_cast<const uint32_t*>(operation.data.data()));
+      break;
+  }
+  if (!result)
+    LOG(ERROR) << "Failed to add COW operation of type " << operation.type;
+  return result;
+}
+
+}  // namespace chromeos_update_engine
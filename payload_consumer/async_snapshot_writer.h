@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_SNAPSHOT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_SNAPSHOT_WRITER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <libsnapshot/snapshot_writer.h>
+
+namespace chromeos_update_engine {
+
+// AsyncSnapshotWriter adds the COW operations passed to it to the wrapped
+// ISnapshotWriter on a background thread, so that the next operations are
+// produced while the previous ones are compressed and written to the COW.
+// The operations and their data are copied into a queue of up to
+// |queue_size| bytes, adding an operation only blocks while the queue is full.
+//
+// A failure of the wrapped writer is returned by the next call once it
+// happened, and the operations queued after it are dropped. Labels, which the
+// update resumes from, are only returned once they and the operations before
+// them are written. So are the calls other than those adding operations.
+class AsyncSnapshotWriter final : public android::snapshot::ISnapshotWriter {
+ public:
+  AsyncSnapshotWriter(
+      std::unique_ptr<android::snapshot::ISnapshotWriter> writer,
+      size_t queue_size);
+  ~AsyncSnapshotWriter() override;
+
+  bool Initialize() override;
+  bool InitializeAppend(uint64_t label) override;
+  std::unique_ptr<FileDescriptor> OpenReader() override;
+  bool VerifyMergeOps() const noexcept override;
+  bool Finalize() override;
+  uint64_t GetCowSize() override;
+
+  bool EmitCopy(uint64_t new_block,
+                uint64_t old_block,
+                uint64_t num_blocks) override;
+  bool EmitRawBlocks(uint64_t new_block_start,
+                     const void* data,
+                     size_t size) override;
+  bool EmitXorBlocks(uint32_t new_block_start,
+                     const void* data,
+                     size_t size,
+                     uint32_t old_block,
+                     uint16_t offset) override;
+  bool EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override;
+  bool EmitLabel(uint64_t label) override;
+  bool EmitSequenceData(size_t num_ops, const uint32_t* data) override;
+
+ private:
+  struct Operation {
+    enum Type {
+      kCopy,
+      kRawBlocks,
+      kXorBlocks,
+      kZeroBlocks,
+      kLabel,
+      kSequenceData,
+    };
+    Type type;
+    // The label, or the number of operations of the sequence data.
+    uint64_t new_block{0};
+    uint64_t old_block{0};
+    uint64_t num_blocks{0};
+    uint16_t offset{0};
+    brillo::Blob data;
+
+    // Bytes of the queue used by the operation.
+    size_t size() const { return sizeof(Operation) + data.size(); }
+  };
+
+  // Adds |operation| to the queue, waiting for room for it. Returns false if
+  // the wrapped writer failed.
+  bool Queue(Operation operation);
+  // Waits until the queued operations are written. Returns whether they all
+  // succeeded.
+  bool Wait() const;
+
+  // Main loop of |write_thread_|.
+  void WriteLoop();
+  bool Write(const Operation& operation);
+
+  std::unique_ptr<android::snapshot::ISnapshotWriter> writer_;
+  const size_t queue_size_;
+
+  mutable std::mutex mutex_;
+  std::deque<Operation> queue_;
+  // Bytes of the queued operations, and of the one being written.
+  size_t queued_bytes_{0};
+  bool writing_{false};
+  bool failed_{false};
+  bool stopping_{false};
+  // Signaled when an operation is queued or the thread is stopping.
+  std::condition_variable operation_queued_;
+  // Signaled when an operation is written.
+  mutable std::condition_variable operation_written_;
+
+  std::thread write_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncSnapshotWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_SNAPSHOT_WRITER_H_
@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_snapshot_writer.h"
+
+#include <memory>
+#include <utility>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <libsnapshot/mock_snapshot_writer.h>
+
+namespace chromeos_update_engine {
+
+using android::snapshot::CowOptions;
+using android::snapshot::MockSnapshotWriter;
+using testing::_;
+using testing::InSequence;
+using testing::Return;
+
+class AsyncSnapshotWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    auto mock_writer = std::make_unique<MockSnapshotWriter>(options_);
+    mock_writer_ = mock_writer.get();
+    // Smaller than the raw blocks written, which still go through alone.
+    writer_ = std::make_unique<AsyncSnapshotWriter>(std::move(mock_writer),
+                                                    kBlockSize);
+  }
+
+  static constexpr uint32_t kBlockSize = 4096;
+  CowOptions options_{.block_size = kBlockSize};
+  MockSnapshotWriter* mock_writer_;
+  std::unique_ptr<AsyncSnapshotWriter> writer_;
+};
+
+TEST_F(AsyncSnapshotWriterTest, WritesInOrderTest) {
+  brillo::Blob data(2 * kBlockSize, 'a');
+  const brillo::Blob expected_data = data;
+  {
+    InSequence seq;
+    EXPECT_CALL(*mock_writer_, Initialize()).WillOnce(Return(true));
+    EXPECT_CALL(*mock_writer_, EmitRawBlocks(3, _, data.size()))
+        .WillOnce([&expected_data](uint64_t, const void* bytes, size_t size) {
+          const uint8_t* begin = static_cast<const uint8_t*>(bytes);
+          EXPECT_EQ(expected_data, brillo::Blob(begin, begin + size));
+          return true;
+        });
+    EXPECT_CALL(*mock_writer_, EmitZeroBlocks(5, 2)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_writer_, EmitCopy(7, 1, 1)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_writer_, EmitLabel(1)).WillOnce(Return(true));
+    EXPECT_CALL(*mock_writer_, Finalize()).WillOnce(Return(true));
+    EXPECT_CALL(*mock_writer_, GetCowSize()).WillOnce(Return(123));
+  }
+
+  ASSERT_TRUE(writer_->Initialize());
+  ASSERT_TRUE(writer_->AddRawBlocks(3, data.data(), data.size()));
+  // The data was copied.
+  std::fill(data.begin(), data.end(), 'b');
+  ASSERT_TRUE(writer_->AddZeroBlocks(5, 2));
+  ASSERT_TRUE(writer_->AddCopy(7, 1));
+  ASSERT_TRUE(writer_->AddLabel(1));
+  EXPECT_TRUE(writer_->Finalize());
+  EXPECT_EQ(123u, writer_->GetCowSize());
+}
+
+TEST_F(AsyncSnapshotWriterTest, FailureTest) {
+  EXPECT_CALL(*mock_writer_, EmitZeroBlocks(0, 1)).WillOnce(Return(false));
+  EXPECT_CALL(*mock_writer_, EmitZeroBlocks(1, 1)).Times(0);
+  EXPECT_CALL(*mock_writer_, EmitLabel(_)).Times(0);
+  EXPECT_CALL(*mock_writer_, Finalize()).Times(0);
+
+  // The failure is returned once the operation is written.
+  EXPECT_TRUE(writer_->AddZeroBlocks(0, 1));
+  EXPECT_FALSE(writer_->AddLabel(1));
+  EXPECT_FALSE(writer_->AddZeroBlocks(1, 1));
+  EXPECT_FALSE(writer_->Finalize());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,204 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/blob_cache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kTempSuffix[] = ".tmp";
+
+// The keys are used as file names, so only lowercase letters, digits and
+// dashes are allowed.
+bool IsValidKey(const string& key) {
+  return !key.empty() && std::all_of(key.begin(), key.end(), [](char c) {
+    return base::IsAsciiDigit(c) || base::IsAsciiLower(c) || c == '-';
+  });
+}
+}  // namespace
+
+BlobCache::BlobCache(const base::FilePath& dir, uint64_t max_size)
+    : dir_(dir), max_size_(max_size) {}
+
+bool BlobCache::Init() {
+  if (!base::DirectoryExists(dir_))
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(dir_));
+
+  // The oldest files are evicted first.
+  std::vector<std::pair<base::Time, std::pair<string, uint64_t>>> files;
+  base::FileEnumerator file_enum(dir_, false, base::FileEnumerator::FILES);
+  for (base::FilePath path = file_enum.Next(); !path.empty();
+       path = file_enum.Next()) {
+    const string name = path.BaseName().value();
+    // Left by an interrupted Put().
+    if (!IsValidKey(name)) {
+      unlink(path.value().c_str());
+      continue;
+    }
+    const auto info = file_enum.GetInfo();
+    files.push_back({info.GetLastModifiedTime(),
+                     {name, static_cast<uint64_t>(info.GetSize())}});
+  }
+  std::sort(files.begin(), files.end());
+  entries_.clear();
+  lru_.clear();
+  size_ = 0;
+  pinned_size_ = 0;
+  for (const auto& [time, file] : files)
+    AddEntry(file.first, file.second);
+  LOG(INFO) << "Blob cache in " << dir_.value() << " has " << entries_.size()
+            << " entries, " << size_ << " bytes.";
+  // The limit may have been lowered since the previous attempt.
+  MakeRoom(0);
+  return true;
+}
+
+string BlobCache::OperationKey(const string& data_sha256_hash) {
+  return base::ToLowerASCII(utils::HexEncode(data_sha256_hash));
+}
+
+string BlobCache::MetadataKey(const brillo::Blob& payload_hash) {
+  return "metadata-" + base::ToLowerASCII(utils::HexEncode(payload_hash));
+}
+
+bool BlobCache::Contains(const string& key) const {
+  return entries_.find(key) != entries_.end();
+}
+
+bool BlobCache::Get(const string& key, brillo::Blob* data) {
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return false;
+  if (!utils::ReadFile(GetPath(key).value(), data) ||
+      data->size() != it->second.size) {
+    LOG(ERROR) << "Unable to read the blob cache entry " << key;
+    Remove(key);
+    return false;
+  }
+  if (!it->second.pinned) {
+    lru_.erase(it->second.last_use);
+    it->second.last_use = use_count_++;
+    lru_[it->second.last_use] = key;
+  }
+  return true;
+}
+
+bool BlobCache::Put(const string& key, const void* data, size_t size) {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
+  if (Contains(key))
+    return true;
+  if (!MakeRoom(size))
+    return false;
+  // Written under a temporary name first, so that an interrupted write
+  // doesn't leave a truncated entry.
+  const base::FilePath path = GetPath(key);
+  const string temp_path = path.value() + kTempSuffix;
+  if (!utils::WriteFile(temp_path.c_str(), data, size) ||
+      rename(temp_path.c_str(), path.value().c_str()) != 0) {
+    PLOG(WARNING) << "Unable to write the blob cache entry " << key;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  AddEntry(key, size);
+  return true;
+}
+
+bool BlobCache::Pin(const string& key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return false;
+  // Pinned entries aren't in |lru_|, so that they're never evicted.
+  if (!it->second.pinned) {
+    lru_.erase(it->second.last_use);
+    pinned_size_ += it->second.size;
+  }
+  it->second.pinned = true;
+  return true;
+}
+
+void BlobCache::Remove(const string& key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return;
+  unlink(GetPath(key).value().c_str());
+  size_ -= it->second.size;
+  if (it->second.pinned)
+    pinned_size_ -= it->second.size;
+  else
+    lru_.erase(it->second.last_use);
+  entries_.erase(it);
+}
+
+uint64_t BlobCache::Clear() {
+  const uint64_t freed = size_;
+  for (const auto& [key, entry] : entries_)
+    unlink(GetPath(key).value().c_str());
+  entries_.clear();
+  lru_.clear();
+  size_ = 0;
+  pinned_size_ = 0;
+  return freed;
+}
+
+void BlobCache::LimitSize(uint64_t max_size) {
+  if (max_size >= max_size_)
+    return;
+  max_size_ = max_size;
+  // The pinned entries are kept even if they don't fit.
+  while (size_ > max_size_ && !lru_.empty()) {
+    const string key = lru_.begin()->second;
+    Remove(key);
+  }
+}
+
+bool BlobCache::MakeRoom(uint64_t size) {
+  // Nothing is evicted if it wouldn't be enough.
+  if (size > max_size_ || pinned_size_ > max_size_ - size)
+    return false;
+  while (size_ + size > max_size_) {
+    const string key = lru_.begin()->second;
+    Remove(key);
+  }
+  return true;
+}
+
+void BlobCache::AddEntry(const string& key, uint64_t size) {
+  entries_[key] = {size, use_count_};
+  lru_[use_count_++] = key;
+  size_ += size;
+}
+
+base::FilePath BlobCache::GetPath(const string& key) const {
+  return dir_.Append(key);
+}
+
+}  // namespace chromeos_update_engine
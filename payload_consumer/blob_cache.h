@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOB_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOB_CACHE_H_
+
+#include <map>
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// BlobCache keeps pieces of the payload on disk across update attempts, so
+// that a new attempt doesn't download them again. The data of the install
+// operations is stored under the hex encoded |data_sha256_hash| of the
+// operation, and the metadata under a key derived from the payload hash.
+// BlobCache doesn't verify the data it returns, the callers check it against
+// the hashes in the manifest as they would with downloaded data.
+class BlobCache {
+ public:
+  // Keeps at most |max_size| bytes in |dir|, evicting the least recently used
+  // entries first.
+  BlobCache(const base::FilePath& dir, uint64_t max_size);
+
+  // Creates the cache directory if needed and loads the entries left by the
+  // previous attempts. Returns false if the directory can't be used.
+  bool Init();
+
+  // Returns the key of the data of an operation with |data_sha256_hash|, and
+  // of the metadata of the payload with |payload_hash|.
+  static std::string OperationKey(const std::string& data_sha256_hash);
+  static std::string MetadataKey(const brillo::Blob& payload_hash);
+
+  bool Contains(const std::string& key) const;
+
+  // Reads the data of |key| in |data|.
+  bool Get(const std::string& key, brillo::Blob* data);
+
+  // Stores |size| bytes of |data| under |key|, evicting other entries to make
+  // room for it. Returns false if it doesn't fit or can't be written.
+  bool Put(const std::string& key, const void* data, size_t size);
+
+  // Keeps the entry of |key| from being evicted by this object, so that it's
+  // still there when it's needed. Returns false if there is no such entry.
+  bool Pin(const std::string& key);
+
+  void Remove(const std::string& key);
+
+  // Removes all the entries. Returns the number of bytes freed.
+  uint64_t Clear();
+
+  // Lowers the limit to |max_size| bytes if it's above it, evicting the
+  // entries which don't fit anymore.
+  void LimitSize(uint64_t max_size);
+
+  // Total size of the entries in bytes.
+  uint64_t size() const { return size_; }
+
+ private:
+  struct Entry {
+    uint64_t size;
+    // Order of the last use, the key in |lru_| unless the entry is pinned.
+    uint64_t last_use;
+    bool pinned{false};
+  };
+
+  void AddEntry(const std::string& key, uint64_t size);
+
+  // Evicts the unpinned entries until |size| more bytes fit in |max_size_|.
+  // Returns false if they can't fit.
+  bool MakeRoom(uint64_t size);
+
+  base::FilePath GetPath(const std::string& key) const;
+
+  const base::FilePath dir_;
+  uint64_t max_size_;
+
+  std::map<std::string, Entry> entries_;
+  // The keys of the entries that can be evicted, least recently used first.
+  std::map<uint64_t, std::string> lru_;
+  uint64_t size_{0};
+  // Total size of the pinned entries.
+  uint64_t pinned_size_{0};
+  uint64_t use_count_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlobCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOB_CACHE_H_
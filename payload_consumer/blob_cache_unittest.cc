@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/blob_cache.h"
+
+#include <string>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class BlobCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_dir_ = temp_dir_.GetPath().Append("cache");
+  }
+
+  base::ScopedTempDir temp_dir_;
+  base::FilePath cache_dir_;
+};
+
+TEST_F(BlobCacheTest, PutGetTest) {
+  BlobCache cache(cache_dir_, 100);
+  ASSERT_TRUE(cache.Init());
+  EXPECT_TRUE(base::DirectoryExists(cache_dir_));
+
+  const string key = BlobCache::OperationKey("\xab\x01");
+  EXPECT_EQ("ab01", key);
+  EXPECT_EQ("metadata-ff", BlobCache::MetadataKey({0xff}));
+
+  const brillo::Blob data = {1, 2, 3, 4};
+  EXPECT_FALSE(cache.Contains(key));
+  EXPECT_TRUE(cache.Put(key, data.data(), data.size()));
+  EXPECT_TRUE(cache.Contains(key));
+  EXPECT_EQ(4u, cache.size());
+
+  brillo::Blob read;
+  EXPECT_TRUE(cache.Get(key, &read));
+  EXPECT_EQ(data, read);
+
+  // Keys are file names.
+  EXPECT_FALSE(cache.Put("../ab", data.data(), data.size()));
+  // Larger than the whole cache.
+  EXPECT_FALSE(cache.Put("cd", nullptr, 101));
+
+  cache.Remove(key);
+  EXPECT_FALSE(cache.Contains(key));
+  EXPECT_FALSE(cache.Get(key, &read));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST_F(BlobCacheTest, EvictsLeastRecentlyUsedTest) {
+  BlobCache cache(cache_dir_, 30);
+  ASSERT_TRUE(cache.Init());
+  const brillo::Blob data(10, 0x55);
+  brillo::Blob read;
+  ASSERT_TRUE(cache.Put("aa", data.data(), data.size()));
+  ASSERT_TRUE(cache.Put("bb", data.data(), data.size()));
+  ASSERT_TRUE(cache.Put("cc", data.data(), data.size()));
+  ASSERT_TRUE(cache.Pin("aa"));
+  ASSERT_TRUE(cache.Get("bb", &read));
+
+  // "aa" is pinned and "bb" was read last, so "cc" goes first.
+  ASSERT_TRUE(cache.Put("dd", data.data(), data.size()));
+  EXPECT_TRUE(cache.Contains("aa"));
+  EXPECT_TRUE(cache.Contains("bb"));
+  EXPECT_FALSE(cache.Contains("cc"));
+  EXPECT_FALSE(base::PathExists(cache_dir_.Append("cc")));
+
+  ASSERT_TRUE(cache.Put("ee", data.data(), data.size()));
+  EXPECT_TRUE(cache.Contains("aa"));
+  EXPECT_FALSE(cache.Contains("bb"));
+
+  // Doesn't fit next to the pinned entry, nothing is evicted for it.
+  const brillo::Blob large_data(25);
+  EXPECT_FALSE(cache.Put("ff", large_data.data(), large_data.size()));
+  EXPECT_TRUE(cache.Contains("dd"));
+  EXPECT_TRUE(cache.Contains("ee"));
+  EXPECT_FALSE(cache.Pin("bb"));
+
+  EXPECT_EQ(30u, cache.Clear());
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_TRUE(base::IsDirectoryEmpty(cache_dir_));
+}
+
+TEST_F(BlobCacheTest, InitLoadsEntriesTest) {
+  const brillo::Blob data = {1, 2, 3};
+  {
+    BlobCache cache(cache_dir_, 100);
+    ASSERT_TRUE(cache.Init());
+    ASSERT_TRUE(cache.Put("aa", data.data(), data.size()));
+    ASSERT_TRUE(cache.Put("metadata-bb", data.data(), data.size()));
+  }
+  // Left by an interrupted Put().
+  ASSERT_TRUE(base::WriteFile(cache_dir_.Append("cc.tmp"), "x", 1));
+
+  BlobCache cache(cache_dir_, 100);
+  ASSERT_TRUE(cache.Init());
+  EXPECT_EQ(6u, cache.size());
+  EXPECT_FALSE(base::PathExists(cache_dir_.Append("cc.tmp")));
+  brillo::Blob read;
+  EXPECT_TRUE(cache.Get("metadata-bb", &read));
+  EXPECT_EQ(data, read);
+
+  // A lower limit evicts the entries that don't fit.
+  BlobCache smaller_cache(cache_dir_, 4);
+  ASSERT_TRUE(smaller_cache.Init());
+  EXPECT_EQ(3u, smaller_cache.size());
+}
+
+TEST_F(BlobCacheTest, LimitSizeTest) {
+  BlobCache cache(cache_dir_, 100);
+  ASSERT_TRUE(cache.Init());
+  const brillo::Blob data = {1, 2, 3};
+  ASSERT_TRUE(cache.Put("aa", data.data(), data.size()));
+  ASSERT_TRUE(cache.Put("bb", data.data(), data.size()));
+  ASSERT_TRUE(cache.Put("cc", data.data(), data.size()));
+  ASSERT_TRUE(cache.Pin("aa"));
+
+  // The least recently used unpinned entry is evicted first.
+  cache.LimitSize(6);
+  EXPECT_TRUE(cache.Contains("aa"));
+  EXPECT_FALSE(cache.Contains("bb"));
+  EXPECT_TRUE(cache.Contains("cc"));
+  EXPECT_FALSE(cache.Put("dd", data.data(), data.size()));
+
+  // The limit is never raised, and pinned entries are kept.
+  cache.LimitSize(100);
+  cache.LimitSize(0);
+  EXPECT_TRUE(cache.Contains("aa"));
+  EXPECT_FALSE(cache.Contains("cc"));
+  EXPECT_EQ(3u, cache.size());
+}
+
+TEST_F(BlobCacheTest, TruncatedEntryTest) {
+  BlobCache cache(cache_dir_, 100);
+  ASSERT_TRUE(cache.Init());
+  const brillo::Blob data = {1, 2, 3};
+  ASSERT_TRUE(cache.Put("aa", data.data(), data.size()));
+  ASSERT_TRUE(base::WriteFile(cache_dir_.Append("aa"), "x", 1));
+
+  brillo::Blob read;
+  EXPECT_FALSE(cache.Get("aa", &read));
+  EXPECT_FALSE(cache.Contains("aa"));
+}
+
+}  // namespace chromeos_update_engine
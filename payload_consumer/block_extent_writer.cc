@@ -55,6 +55,10 @@ size_t BlockExtentWriter::ConsumeWithBuffer(const uint8_t* data, size_t count) {
                    << count - cur_extent_size << " bytes left";
         return 0;
       }
+      if (!Flush()) {
+        LOG(ERROR) << "Failed to flush the buffered extents.";
+        return 0;
+      }
     }
     return cur_extent_size;
   }
@@ -84,6 +88,10 @@ size_t BlockExtentWriter::ConsumeWithBuffer(const uint8_t* data, size_t count) {
         LOG(ERROR) << "Exhausted all blocks, but still have "
                    << count - bytes_to_copy << " bytes left";
       }
+      if (!Flush()) {
+        LOG(ERROR) << "Failed to flush the buffered extents.";
+        return 0;
+      }
     }
   }
   return bytes_to_copy;
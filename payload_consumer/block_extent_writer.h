@@ -41,6 +41,9 @@ class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
   virtual bool WriteExtent(const void* bytes,
                            const Extent& extent,
                            size_t block_size) = 0;
+  // Called once the data of the last extent was passed to WriteExtent(), so
+  // that implementations buffering extents can submit them.
+  virtual bool Flush() { return true; }
   size_t BlockSize() const { return block_size_; }
 
  private:
@@ -16,22 +16,104 @@
 
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
 
+#include <stdlib.h>
+
+#include <cstddef>
+#include <vector>
+
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+
 using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+// Bytes of freed memory each thread keeps: the 900k bzip2 blocks of the
+// payloads need about 3.6 MB, plus the output buffer.
+constexpr size_t kMaxCachedBytes = 8 * 1024 * 1024;
+
+// The memory freed by the bzip2 writers of a thread, reused by the next ones.
+// Each allocation is preceded by its size, so it may be freed on any thread.
+class AllocationCache {
+ public:
+  AllocationCache() = default;
+  ~AllocationCache() {
+    for (void* allocation : free_)
+      free(allocation);
+  }
+
+  void* Allocate(size_t size) {
+    for (size_t i = 0; i < free_.size(); i++) {
+      if (*static_cast<size_t*>(free_[i]) == size) {
+        void* allocation = free_[i];
+        free_.erase(free_.begin() + i);
+        free_bytes_ -= size;
+        return static_cast<uint8_t*>(allocation) + kHeaderSize;
+      }
+    }
+    void* allocation = malloc(kHeaderSize + size);
+    if (allocation == nullptr)
+      return nullptr;
+    *static_cast<size_t*>(allocation) = size;
+    return static_cast<uint8_t*>(allocation) + kHeaderSize;
+  }
+
+  void Free(void* ptr) {
+    if (ptr == nullptr)
+      return;
+    void* allocation = static_cast<uint8_t*>(ptr) - kHeaderSize;
+    const size_t size = *static_cast<size_t*>(allocation);
+    if (free_bytes_ + size > kMaxCachedBytes) {
+      free(allocation);
+      return;
+    }
+    free_.push_back(allocation);
+    free_bytes_ += size;
+  }
+
+ private:
+  // Keeps the returned memory aligned like malloc()'s.
+  static constexpr size_t kHeaderSize = alignof(std::max_align_t);
+
+  std::vector<void*> free_;
+  size_t free_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(AllocationCache);
+};
+
+AllocationCache* GetAllocationCache() {
+  thread_local AllocationCache cache;
+  return &cache;
+}
+
+void* BzAlloc(void* opaque, int items, int size) {
+  return GetAllocationCache()->Allocate(static_cast<size_t>(items) * size);
 }
 
-BzipExtentWriter::~BzipExtentWriter() {
+void BzFree(void* opaque, void* ptr) {
+  GetAllocationCache()->Free(ptr);
+}
+}  // namespace
+
+template <typename Writer>
+BasicBzipExtentWriter<Writer>::~BasicBzipExtentWriter() {
+  GetAllocationCache()->Free(output_buffer_);
   TEST_AND_RETURN(BZ2_bzDecompressEnd(&stream_) == BZ_OK);
   TEST_AND_RETURN(input_buffer_.empty());
 }
 
-bool BzipExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
-                            uint32_t block_size) {
+template <typename Writer>
+bool BasicBzipExtentWriter<Writer>::Init(
+    const RepeatedPtrField<Extent>& extents, uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(output_buffer_size_ > 0);
+  if (output_buffer_ == nullptr) {
+    output_buffer_ = static_cast<uint8_t*>(
+        GetAllocationCache()->Allocate(output_buffer_size_));
+    TEST_AND_RETURN_FALSE(output_buffer_ != nullptr);
+  }
   // Init bzip2 stream
+  stream_.bzalloc = &BzAlloc;
+  stream_.bzfree = &BzFree;
   int rc = BZ2_bzDecompressInit(&stream_,
                                 0,   // verbosity. (0 == silent)
                                 0);  // 0 = faster algo, more memory
@@ -41,8 +123,9 @@ bool BzipExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
   return next_->Init(extents, block_size);
 }
 
-bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
+template <typename Writer>
+bool BasicBzipExtentWriter<Writer>::Write(const void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(output_buffer_ != nullptr);
 
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
@@ -58,17 +141,17 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   stream_.avail_in = input_end - input;
 
   for (;;) {
-    stream_.next_out = reinterpret_cast<char*>(output_buffer.data());
-    stream_.avail_out = output_buffer.size();
+    stream_.next_out = reinterpret_cast<char*>(output_buffer_);
+    stream_.avail_out = output_buffer_size_;
 
     int rc = BZ2_bzDecompress(&stream_);
     TEST_AND_RETURN_FALSE(rc == BZ_OK || rc == BZ_STREAM_END);
 
-    if (stream_.avail_out == output_buffer.size())
+    if (stream_.avail_out == output_buffer_size_)
       break;  // got no new bytes
 
-    TEST_AND_RETURN_FALSE(next_->Write(
-        output_buffer.data(), output_buffer.size() - stream_.avail_out));
+    TEST_AND_RETURN_FALSE(
+        next_->Write(output_buffer_, output_buffer_size_ - stream_.avail_out));
 
     if (rc == BZ_STREAM_END)
       CHECK_EQ(stream_.avail_in, 0u);
@@ -84,4 +167,8 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   return true;
 }
 
+template class BasicBzipExtentWriter<ExtentWriter>;
+template class BasicBzipExtentWriter<DirectExtentWriter>;
+template class BasicBzipExtentWriter<SnapshotExtentWriter>;
+
 }  // namespace chromeos_update_engine
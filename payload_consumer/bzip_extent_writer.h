@@ -28,28 +28,41 @@
 
 // BzipExtentWriter is a concrete ExtentWriter subclass that bzip-decompresses
 // what it's given in Write. It passes the decompressed data to an underlying
-// ExtentWriter.
+// ExtentWriter, up to |output_buffer_size| bytes at a time. The memory of the
+// libbz2 stream and the output buffer is kept by each thread for the next
+// writers, so that every operation doesn't allocate its own.
+// Like BasicZstdExtentWriter, the underlying writer is held as a |Writer|.
 
 namespace chromeos_update_engine {
 
-class BzipExtentWriter : public ExtentWriter {
+template <typename Writer>
+class BasicBzipExtentWriter : public ExtentWriter {
  public:
-  explicit BzipExtentWriter(std::unique_ptr<ExtentWriter> next)
-      : next_(std::move(next)) {
+  static constexpr size_t kDefaultOutputBufferSize = 256 * 1024;
+
+  explicit BasicBzipExtentWriter(
+      std::unique_ptr<Writer> next,
+      size_t output_buffer_size = kDefaultOutputBufferSize)
+      : next_(std::move(next)), output_buffer_size_(output_buffer_size) {
     memset(&stream_, 0, sizeof(stream_));
   }
-  ~BzipExtentWriter() override;
+  ~BasicBzipExtentWriter() override;
 
   bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
             uint32_t block_size) override;
   bool Write(const void* bytes, size_t count) override;
 
  private:
-  std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
-  bz_stream stream_;                    // the libbz2 stream
+  std::unique_ptr<Writer> next_;  // The underlying ExtentWriter.
+  bz_stream stream_;              // the libbz2 stream
   brillo::Blob input_buffer_;
+  const size_t output_buffer_size_;
+  // Allocated in Init() from the memory kept by the thread.
+  uint8_t* output_buffer_{nullptr};
 };
 
+using BzipExtentWriter = BasicBzipExtentWriter<ExtentWriter>;
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BZIP_EXTENT_WRITER_H_
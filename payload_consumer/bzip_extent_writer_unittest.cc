@@ -70,6 +70,28 @@ TEST_F(BzipExtentWriterTest, SimpleTest) {
   EXPECT_EQ(string(buf.begin(), buf.end()), string(test_uncompressed));
 }
 
+TEST_F(BzipExtentWriterTest, SmallOutputBufferTest) {
+  vector<Extent> extents = {ExtentForRange(0, 1)};
+  static const char test_uncompressed[] = "test\n";
+  static const uint8_t test[] = {
+      0x42, 0x5a, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0xcc, 0xc3,
+      0x71, 0xd4, 0x00, 0x00, 0x02, 0x41, 0x80, 0x00, 0x10, 0x02, 0x00, 0x0c,
+      0x00, 0x20, 0x00, 0x21, 0x9a, 0x68, 0x33, 0x4d, 0x19, 0x97, 0x8b, 0xb9,
+      0x22, 0x9c, 0x28, 0x48, 0x66, 0x61, 0xb8, 0xea, 0x00,
+  };
+
+  // The second writer reuses the memory of the first one.
+  for (int i = 0; i < 2; i++) {
+    BzipExtentWriter bzip_writer(std::make_unique<DirectExtentWriter>(fd_), 2);
+    EXPECT_TRUE(bzip_writer.Init({extents.begin(), extents.end()}, kBlockSize));
+    EXPECT_TRUE(bzip_writer.Write(test, sizeof(test)));
+
+    brillo::Blob buf;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &buf));
+    EXPECT_EQ(string(buf.begin(), buf.end()), string(test_uncompressed));
+  }
+}
+
 TEST_F(BzipExtentWriterTest, ChunkedTest) {
   // Generated with:
   //   yes "ABC" | head -c 819200 | bzip2 -9 |
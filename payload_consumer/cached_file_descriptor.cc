@@ -19,6 +19,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <utility>
 
 #include <base/logging.h>
 
@@ -39,15 +40,39 @@ off64_t CachedFileDescriptorBase::Seek(off64_t offset, int whence) {
     if (!FlushCache()) {
       return -1;
     }
-    // Then we have to seek there.
-    if (GetFd()->Seek(next_offset, SEEK_SET) < 0) {
+    // Then we have to seek there. The asynchronous writes are positioned, the
+    // underlying offset is only moved before it is used.
+    if (!async_write_back_ && GetFd()->Seek(next_offset, SEEK_SET) < 0) {
       return -1;
     }
     offset_ = next_offset;
+    cache_offset_ = next_offset;
   }
   return offset_;
 }
 
+ssize_t CachedFileDescriptorBase::Read(void* buf, size_t count) {
+  if (!async_write_back_)
+    return GetFd()->Read(buf, count);
+  if (!SyncWriteBack())
+    return -1;
+  ssize_t bytes_read = GetFd()->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+    cache_offset_ = offset_;
+  }
+  return bytes_read;
+}
+
+bool CachedFileDescriptorBase::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  if (async_write_back_ && !SyncWriteBack())
+    return false;
+  return GetFd()->BlkIoctl(request, start, length, result);
+}
+
 ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
   auto bytes = static_cast<const uint8_t*>(buf);
   size_t total_bytes_wrote = 0;
@@ -73,15 +98,51 @@ ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
 }
 
 bool CachedFileDescriptorBase::Flush() {
+  if (async_write_back_)
+    return SyncWriteBack() && GetFd()->Flush();
   return FlushCache() && GetFd()->Flush();
 }
 
 bool CachedFileDescriptorBase::Close() {
+  const bool flushed = async_write_back_ ? SyncWriteBack() : FlushCache();
   offset_ = 0;
-  return FlushCache() && GetFd()->Close();
+  cache_offset_ = 0;
+  return flushed && GetFd()->Close();
+}
+
+bool CachedFileDescriptorBase::WaitForWriteBack() {
+  if (!write_back_.valid())
+    return true;
+  if (!write_back_.get()) {
+    PLOG(ERROR) << "Failed to write back cached data!";
+    return false;
+  }
+  return true;
+}
+
+bool CachedFileDescriptorBase::SyncWriteBack() {
+  return FlushCache() && WaitForWriteBack() &&
+         GetFd()->Seek(offset_, SEEK_SET) == offset_;
 }
 
 bool CachedFileDescriptorBase::FlushCache() {
+  if (async_write_back_) {
+    // Only one write in flight, it owns |write_back_cache_|.
+    if (!WaitForWriteBack())
+      return false;
+    if (bytes_cached_ == 0)
+      return true;
+    std::swap(cache_, write_back_cache_);
+    FileDescriptor* fd = GetFd();
+    const FileDescriptor::WriteRequest request{
+        write_back_cache_.data(), bytes_cached_, cache_offset_};
+    write_back_ = std::async(std::launch::async, [fd, request] {
+      return fd->WriteBatch({request});
+    });
+    cache_offset_ += bytes_cached_;
+    bytes_cached_ = 0;
+    return true;
+  }
   size_t begin = 0;
   while (begin < bytes_cached_) {
     auto bytes_wrote =
@@ -92,6 +153,7 @@ bool CachedFileDescriptorBase::FlushCache() {
     }
     begin += bytes_wrote;
   }
+  cache_offset_ += bytes_cached_;
   bytes_cached_ = 0;
   return true;
 }
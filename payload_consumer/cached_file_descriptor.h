@@ -20,18 +20,35 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <future>
 #include <memory>
 #include <vector>
 
-#include <brillo/secure_blob.h>
+#include <base/logging.h>
 
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
 
+// Caches the writes to the underlying file descriptor until |cache_size|
+// bytes are written or a seek breaks their contiguity. With
+// |async_write_back|, a full cache is written on a background thread while a
+// second one of the same size is filled, and Flush() and Close() wait for the
+// write in flight. The underlying file descriptor is then written from that
+// thread, so it must not be used by anything else in the meantime.
 class CachedFileDescriptorBase : public FileDescriptor {
  public:
-  explicit CachedFileDescriptorBase(size_t cache_size) : cache_(cache_size) {}
+  explicit CachedFileDescriptorBase(size_t cache_size,
+                                    bool async_write_back = false)
+      : cache_(AlignedBufferPool::Get()->Acquire(cache_size)),
+        async_write_back_(async_write_back) {
+    CHECK_EQ(cache_.size(), cache_size);
+    if (async_write_back_) {
+      write_back_cache_ = AlignedBufferPool::Get()->Acquire(cache_size);
+      CHECK_EQ(write_back_cache_.size(), cache_size);
+    }
+  }
   ~CachedFileDescriptorBase() override = default;
 
   bool Open(const char* path, int flags, mode_t mode) override {
@@ -40,18 +57,14 @@ class CachedFileDescriptorBase : public FileDescriptor {
   bool Open(const char* path, int flags) override {
     return GetFd()->Open(path, flags);
   }
-  ssize_t Read(void* buf, size_t count) override {
-    return GetFd()->Read(buf, count);
-  }
+  ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override { return GetFd()->BlockDevSize(); }
   bool BlkIoctl(int request,
                 uint64_t start,
                 uint64_t length,
-                int* result) override {
-    return GetFd()->BlkIoctl(request, start, length, result);
-  }
+                int* result) override;
   bool Flush() override;
   bool Close() override;
   bool IsSettingErrno() override { return GetFd()->IsSettingErrno(); }
@@ -60,21 +73,43 @@ class CachedFileDescriptorBase : public FileDescriptor {
  protected:
   virtual FileDescriptor* GetFd() = 0;
 
+  // Waits for the asynchronous write in flight, if any. Returns whether it
+  // succeeded.
+  bool WaitForWriteBack();
+
  private:
-  // Internal flush without the need to call |fd_->Flush()|.
+  // Internal flush without the need to call |fd_->Flush()|. With
+  // |async_write_back_|, only starts the write of the cached data.
   bool FlushCache();
 
-  brillo::Blob cache_;
+  // With |async_write_back_|, writes all the cached data and moves the offset
+  // of the underlying file descriptor to |offset_|, before it is used
+  // directly.
+  bool SyncWriteBack();
+
+  // Taken from the AlignedBufferPool, so that the partitions opened one after
+  // the other reuse the same memory.
+  PooledBuffer cache_;
   size_t bytes_cached_{0};
   off64_t offset_{0};
+  // Offset of the first byte of |cache_| in the file.
+  off64_t cache_offset_{0};
+
+  const bool async_write_back_;
+  // The cache being written by |write_back_|.
+  PooledBuffer write_back_cache_;
+  std::future<bool> write_back_;
 
   DISALLOW_COPY_AND_ASSIGN(CachedFileDescriptorBase);
 };
 
 class CachedFileDescriptor final : public CachedFileDescriptorBase {
  public:
-  CachedFileDescriptor(FileDescriptorPtr fd, size_t cache_size)
-      : CachedFileDescriptorBase(cache_size), fd_(fd) {}
+  CachedFileDescriptor(FileDescriptorPtr fd,
+                       size_t cache_size,
+                       bool async_write_back = false)
+      : CachedFileDescriptorBase(cache_size, async_write_back), fd_(fd) {}
+  ~CachedFileDescriptor() override { WaitForWriteBack(); }
 
  protected:
   virtual FileDescriptor* GetFd() { return fd_.get(); }
@@ -85,6 +120,7 @@ class UnownedCachedFileDescriptor final : public CachedFileDescriptorBase {
  public:
   UnownedCachedFileDescriptor(FileDescriptor* fd, size_t cache_size)
       : CachedFileDescriptorBase(cache_size), fd_(fd) {}
+  ~UnownedCachedFileDescriptor() override { WaitForWriteBack(); }
   // used for EnocdeFEC
   void SetFD(FileDescriptor* fd);
 
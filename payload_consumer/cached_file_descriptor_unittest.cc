@@ -43,7 +43,7 @@ const size_t kRandomIterations = 1000;
 class CachedFileDescriptorTest : public ::testing::Test {
  public:
   void Open() {
-    cfd_.reset(new CachedFileDescriptor(fd_, kCacheSize));
+    cfd_.reset(new CachedFileDescriptor(fd_, kCacheSize, async_write_back_));
     EXPECT_TRUE(cfd_->Open(temp_file_.path().c_str(), O_RDWR, 0600));
   }
 
@@ -75,9 +75,15 @@ class CachedFileDescriptorTest : public ::testing::Test {
   FileDescriptorPtr fd_{new EintrSafeFileDescriptor};
   ScopedTempFile temp_file_{"CachedFileDescriptor-file.XXXXXX"};
   int value_{1};
+  bool async_write_back_{false};
   FileDescriptorPtr cfd_;
 };
 
+class AsyncCachedFileDescriptorTest : public CachedFileDescriptorTest {
+ public:
+  AsyncCachedFileDescriptorTest() { async_write_back_ = true; }
+};
+
 TEST_F(CachedFileDescriptorTest, IsOpenTest) {
   EXPECT_TRUE(cfd_->IsOpen());
 }
@@ -201,4 +207,37 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(AsyncCachedFileDescriptorTest, RandomWriteTest) {
+  brillo::Blob blob_in(kFileSize, 0);
+  uint32_t rand_seed = time(nullptr);
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob_in.size();
+    size_t size = rand_r(&rand_seed) % (blob_in.size() - start);
+    std::fill_n(&blob_in[start], size, idx % 256);
+    EXPECT_EQ(cfd_->Seek(start, SEEK_SET), static_cast<off64_t>(start));
+    Write(&blob_in[start], size);
+  }
+  EXPECT_TRUE(cfd_->Flush());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(AsyncCachedFileDescriptorTest, ReadAfterWriteTest) {
+  off64_t seek = 10;
+  brillo::Blob blob_in(kCacheSize * 2 + 5, value_);
+  EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+  Write(blob_in.data(), blob_in.size());
+
+  // Reading waits for the writes in flight and the cached data.
+  brillo::Blob blob_out(blob_in.size());
+  EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+  EXPECT_EQ(static_cast<ssize_t>(blob_out.size()),
+            cfd_->Read(blob_out.data(), blob_out.size()));
+  EXPECT_EQ(blob_in, blob_out);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_CUR),
+            static_cast<off64_t>(seek + blob_in.size()));
+}
+
 }  // namespace chromeos_update_engine
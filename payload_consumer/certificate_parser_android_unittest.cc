@@ -58,4 +58,34 @@ TEST(CertificateParserAndroidTest, VerifySignature) {
   ASSERT_TRUE(verifier->VerifyRawSignature(sig_blob, hash_blob, nullptr));
 }
 
+TEST(CertificateParserAndroidTest, CachedPublicKeysTest) {
+  brillo::Blob hash_blob;
+  ASSERT_TRUE(HashCalculator::RawHashOfData({'x'}, &hash_blob));
+  brillo::Blob sig_blob;
+  ASSERT_TRUE(PayloadSigner::SignHash(
+      hash_blob,
+      test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &sig_blob));
+
+  brillo::Blob zip;
+  ASSERT_TRUE(utils::ReadFile(
+      test_utils::GetBuildArtifactsPath(kUnittestOtacertsPath), &zip));
+  ScopedTempFile zip_file("otacerts.XXXXXX");
+  ASSERT_TRUE(
+      utils::WriteFile(zip_file.path().c_str(), zip.data(), zip.size()));
+
+  // The second verifier gets the cached keys, which outlive the first one.
+  auto verifier = PayloadVerifier::CreateInstanceFromZipPath(zip_file.path());
+  ASSERT_TRUE(verifier != nullptr);
+  verifier.reset();
+  verifier = PayloadVerifier::CreateInstanceFromZipPath(zip_file.path());
+  ASSERT_TRUE(verifier != nullptr);
+  ASSERT_TRUE(verifier->VerifyRawSignature(sig_blob, hash_blob, nullptr));
+
+  // A changed zip is parsed again.
+  ASSERT_TRUE(utils::WriteFile(zip_file.path().c_str(), "x", 1));
+  EXPECT_EQ(nullptr,
+            PayloadVerifier::CreateInstanceFromZipPath(zip_file.path()));
+}
+
 }  // namespace chromeos_update_engine
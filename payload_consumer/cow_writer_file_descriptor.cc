@@ -16,6 +16,9 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <memory>
 #include <utility>
 
@@ -26,19 +29,25 @@
 
 namespace chromeos_update_engine {
 CowWriterFileDescriptor::CowWriterFileDescriptor(
-    std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer)
+    std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer,
+    size_t cache_size)
     : cow_writer_(std::move(cow_writer)),
-      cow_reader_(cow_writer_->OpenReader()) {
+      cow_reader_(cow_writer_->OpenReader()),
+      cache_size_(cache_size) {
   CHECK_NE(cow_writer_, nullptr);
   CHECK_NE(cow_reader_, nullptr);
 }
 
 CowWriterFileDescriptor::CowWriterFileDescriptor(
     std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer,
-    std::unique_ptr<FileDescriptor> cow_reader)
-    : cow_writer_(std::move(cow_writer)), cow_reader_(std::move(cow_reader)) {
+    std::unique_ptr<FileDescriptor> cow_reader,
+    size_t cache_size)
+    : cow_writer_(std::move(cow_writer)),
+      cow_reader_(std::move(cow_reader)),
+      cache_size_(cache_size) {
   CHECK_NE(cow_writer_, nullptr);
   CHECK_NE(cow_reader_, nullptr);
+  offset_ = cow_reader_->Seek(0, SEEK_CUR);
 }
 
 bool CowWriterFileDescriptor::Open(const char* path, int flags, mode_t mode) {
@@ -50,58 +59,142 @@ bool CowWriterFileDescriptor::Open(const char* path, int flags) {
   return false;
 }
 
-ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
-  if (dirty_) {
-    // OK, CowReader provides a snapshot view of what the cow contains. Which
-    // means any writes happened after opening a CowReader isn't visible to
-    // that CowReader. Therefore, we re-open CowReader whenever we attempt a
-    // read after write. This does incur an overhead everytime you read after
-    // write.
-    // The usage of |dirty_| flag to coordinate re-open is a very coarse grained
-    // checked. This implementation has suboptimal performance. For better
-    // performance, keep track of blocks which are overwritten, and only re-open
-    // if reading a dirty block.
-    // TODO(b/173432386) Implement finer grained dirty checks
-    const auto offset = cow_reader_->Seek(0, SEEK_CUR);
-    cow_reader_.reset();
-    if (!cow_writer_->Finalize()) {
-      LOG(ERROR) << "Failed to Finalize() cow writer";
+size_t CowWriterFileDescriptor::block_size() const {
+  return cow_writer_->options().block_size;
+}
+
+bool CowWriterFileDescriptor::ReopenReader() {
+  // OK, CowReader provides a snapshot view of what the cow contains. Which
+  // means any writes happened after opening a CowReader isn't visible to
+  // that CowReader. Therefore, we re-open CowReader whenever we attempt a
+  // read after write. This does incur an overhead everytime you read after
+  // write.
+  // The usage of |dirty_| flag to coordinate re-open is a very coarse grained
+  // checked. This implementation has suboptimal performance. For better
+  // performance, keep track of blocks which are overwritten, and only re-open
+  // if reading a dirty block.
+  // TODO(b/173432386) Implement finer grained dirty checks
+  cow_reader_.reset();
+  if (!cow_writer_->Finalize()) {
+    LOG(ERROR) << "Failed to Finalize() cow writer";
+    return false;
+  }
+  cow_reader_ = cow_writer_->OpenReader();
+  if (cow_reader_ == nullptr) {
+    LOG(ERROR) << "Failed to re-open cow reader after writing to COW";
+    return false;
+  }
+  dirty_ = false;
+  return true;
+}
+
+ssize_t CowWriterFileDescriptor::ReadAt(void* buf,
+                                        size_t count,
+                                        off64_t offset) {
+  const auto pos = cow_reader_->Seek(offset, SEEK_SET);
+  if (pos != offset) {
+    LOG(ERROR) << "Failed to seek cow reader, expected " << offset
+               << " actual: " << pos;
+    return -1;
+  }
+  auto c_buf = static_cast<uint8_t*>(buf);
+  size_t bytes_read = 0;
+  while (bytes_read < count) {
+    const auto rc = cow_reader_->Read(c_buf + bytes_read, count - bytes_read);
+    if (rc < 0) {
       return -1;
     }
-    cow_reader_ = cow_writer_->OpenReader();
-    if (cow_reader_ == nullptr) {
-      LOG(ERROR) << "Failed to re-open cow reader after writing to COW";
-      return -1;
+    if (rc == 0) {
+      break;
     }
-    const auto pos = cow_reader_->Seek(offset, SEEK_SET);
-    if (pos != offset) {
-      LOG(ERROR) << "Failed to seek to previous position after re-opening cow "
-                    "reader, expected "
-                 << offset << " actual: " << pos;
+    bytes_read += rc;
+  }
+  return bytes_read;
+}
+
+bool CowWriterFileDescriptor::FillCache(size_t count, off64_t offset) {
+  const size_t bs = block_size();
+  const off64_t start = offset - offset % bs;
+  const size_t length = utils::RoundUp(offset + count - start, bs);
+  cache_.resize(length);
+  const auto bytes_read = ReadAt(cache_.data(), length, start);
+  if (bytes_read < 0) {
+    cache_.clear();
+    return false;
+  }
+  cache_.resize(bytes_read);
+  cache_offset_ = start;
+  return true;
+}
+
+ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
+  if (dirty_ && !ReopenReader()) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  const bool sequential = offset_ == next_sequential_offset_;
+  next_sequential_offset_ = offset_ + count;
+
+  if (count > cache_size_) {
+    // Reads too large for the cache bypass it, they already amortize the cost
+    // of going through the snapshot reader.
+    const auto bytes_read = ReadAt(buf, count, offset_);
+    if (bytes_read > 0) {
+      offset_ += bytes_read;
+    }
+    return bytes_read;
+  }
+
+  const off64_t cache_end = cache_offset_ + cache_.size();
+  if (offset_ < cache_offset_ || offset_ + off64_t(count) > cache_end) {
+    if (sequential) {
+      readahead_size_ =
+          std::min(std::max(readahead_size_ * 2, count), cache_size_);
+    } else {
+      readahead_size_ = count;
+    }
+    if (!FillCache(readahead_size_, offset_)) {
       return -1;
     }
-    dirty_ = false;
   }
-  return cow_reader_->Read(buf, count);
+
+  // The cache may end before |offset_| + |count| at the end of the device.
+  const off64_t available = cache_offset_ + cache_.size() - offset_;
+  if (available <= 0) {
+    return 0;
+  }
+  const size_t bytes_read = std::min(count, size_t(available));
+  memcpy(buf, cache_.data() + (offset_ - cache_offset_), bytes_read);
+  offset_ += bytes_read;
+  return bytes_read;
 }
 
 ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
-  auto offset = cow_reader_->Seek(0, SEEK_CUR);
-  CHECK_EQ(offset % cow_writer_->options().block_size, 0);
-  auto success = cow_writer_->AddRawBlocks(
-      offset / cow_writer_->options().block_size, buf, count);
-  if (success) {
-    if (cow_reader_->Seek(count, SEEK_CUR) < 0) {
-      return -1;
-    }
-    dirty_ = true;
-    return count;
+  CHECK_EQ(offset_ % block_size(), 0);
+  if (!cow_writer_->AddRawBlocks(offset_ / block_size(), buf, count)) {
+    return -1;
   }
-  return -1;
+  offset_ += count;
+  dirty_ = true;
+  // The reader is re-opened before the next read, the cache would be stale.
+  cache_.clear();
+  return count;
 }
 
 off64_t CowWriterFileDescriptor::Seek(const off64_t offset, int whence) {
-  return cow_reader_->Seek(offset, whence);
+  off64_t pos;
+  if (whence == SEEK_CUR) {
+    // |cow_reader_| isn't kept at |offset_|, make the seek absolute.
+    pos = cow_reader_->Seek(offset_ + offset, SEEK_SET);
+  } else {
+    pos = cow_reader_->Seek(offset, whence);
+  }
+  if (pos >= 0) {
+    offset_ = pos;
+  }
+  return pos;
 }
 
 uint64_t CowWriterFileDescriptor::BlockDevSize() {
@@ -141,6 +234,7 @@ bool CowWriterFileDescriptor::Close() {
     TEST_AND_RETURN_FALSE(cow_reader_->Close());
     cow_reader_ = nullptr;
   }
+  cache_.clear();
   return true;
 }
 
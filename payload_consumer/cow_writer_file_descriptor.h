@@ -16,6 +16,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 #include <libsnapshot/snapshot_writer.h>
 
@@ -26,15 +27,23 @@ namespace chromeos_update_engine {
 // A Readable/Writable FileDescriptor class. This is a simple wrapper around
 // CowWriter. Only intended to be used by FileSystemVerifierAction for writing
 // FEC. Writes must be block aligned(4096) or write will fail.
+//
+// Reads go through a readahead cache of up to |cache_size| bytes. Sequential
+// reads double the readahead window on every cache miss until it reaches the
+// cache size, random reads shrink it back to the size of the request.
 class CowWriterFileDescriptor final : public FileDescriptor {
  public:
+  static constexpr size_t kDefaultCacheSize = 2 * 1024 * 1024;  // 2 MiB
+
   explicit CowWriterFileDescriptor(
-      std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer);
+      std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer,
+      size_t cache_size = kDefaultCacheSize);
 
   // |cow_reader| should be obtained by calling |cow_writer->OpenReader()|
   CowWriterFileDescriptor(
       std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer,
-      std::unique_ptr<FileDescriptor> cow_reader);
+      std::unique_ptr<FileDescriptor> cow_reader,
+      size_t cache_size = kDefaultCacheSize);
   ~CowWriterFileDescriptor();
 
   bool Open(const char* path, int flags, mode_t mode) override;
@@ -64,8 +73,33 @@ class CowWriterFileDescriptor final : public FileDescriptor {
   bool IsOpen() override;
 
  private:
+  // Re-opens |cow_reader_| so it sees the blocks written since it was opened.
+  bool ReopenReader();
+
+  // Reads |count| bytes at |offset| from |cow_reader_| into |buf|, stopping
+  // early at the end of the device. Returns the number of bytes read or -1.
+  ssize_t ReadAt(void* buf, size_t count, off64_t offset);
+
+  // Refills the cache with at least |count| bytes starting at |offset|.
+  bool FillCache(size_t count, off64_t offset);
+
+  size_t block_size() const;
+
   std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer_;
   FileDescriptorPtr cow_reader_;
   bool dirty_ = false;
+
+  // Current offset of this fd. The position of |cow_reader_| is only
+  // meaningful right after a Seek() on it.
+  off64_t offset_ = 0;
+
+  const size_t cache_size_;
+  // Cached bytes starting at the block aligned |cache_offset_|.
+  std::vector<uint8_t> cache_;
+  off64_t cache_offset_ = 0;
+  // Size of the next readahead, and where a read has to start to be
+  // considered sequential.
+  size_t readahead_size_ = 0;
+  off64_t next_sequential_offset_ = -1;
 };
 }  // namespace chromeos_update_engine
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <algorithm>
 #include <cstring>
 #include <memory>
 #include <utility>
@@ -117,4 +118,55 @@ TEST_F(CowWriterFileDescriptorUnittest, ReadAfterWrite) {
          "is open, Finalize() should not be called.";
 }
 
+TEST_F(CowWriterFileDescriptorUnittest, CachedReads) {
+  std::vector<unsigned char> data(PARTITION_SIZE);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<unsigned char>(i * 7 + i / BLOCK_SIZE);
+  }
+  auto cow_writer = GetCowWriter();
+  ASSERT_TRUE(cow_writer->Initialize());
+  ASSERT_TRUE(cow_writer->AddRawBlocks(0, data.data(), data.size()));
+  ASSERT_TRUE(cow_writer->AddLabel(1));
+  ASSERT_TRUE(cow_writer->Finalize());
+
+  cow_writer = GetCowWriter();
+  ASSERT_TRUE(cow_writer->InitializeAppend(1));
+  // A small cache, so sequential reads refill it several times.
+  CowWriterFileDescriptor cow_fd(std::move(cow_writer), BLOCK_SIZE * 3);
+
+  // Unaligned sequential reads.
+  std::vector<unsigned char> read_back(PARTITION_SIZE);
+  for (size_t offset = 0; offset < PARTITION_SIZE; offset += 1000) {
+    const size_t len = std::min<size_t>(1000, PARTITION_SIZE - offset);
+    ASSERT_EQ((ssize_t)len, cow_fd.Read(read_back.data() + offset, len));
+  }
+  ASSERT_EQ(data, read_back);
+  ASSERT_EQ(0, cow_fd.Read(read_back.data(), 1));
+
+  // Random reads, backwards.
+  for (size_t offset : {BLOCK_SIZE * 7 + 5, BLOCK_SIZE + 100, size_t{3}}) {
+    ASSERT_EQ((off64_t)offset, cow_fd.Seek(offset, SEEK_SET));
+    ASSERT_EQ(100, cow_fd.Read(read_back.data(), 100));
+    ASSERT_EQ(0, memcmp(read_back.data(), data.data() + offset, 100));
+  }
+  ASSERT_EQ(103 + 10, cow_fd.Seek(10, SEEK_CUR));
+
+  // Reads larger than the cache bypass it.
+  ASSERT_EQ(0, cow_fd.Seek(0, SEEK_SET));
+  ASSERT_EQ((ssize_t)PARTITION_SIZE,
+            cow_fd.Read(read_back.data(), PARTITION_SIZE));
+  ASSERT_EQ(data, read_back);
+
+  // Cached blocks are dropped on write.
+  ASSERT_EQ((off64_t)BLOCK_SIZE, cow_fd.Seek(BLOCK_SIZE, SEEK_SET));
+  ASSERT_EQ(100, cow_fd.Read(read_back.data(), 100));
+  const std::vector<unsigned char> block(BLOCK_SIZE, 0x5A);
+  ASSERT_EQ((off64_t)BLOCK_SIZE * 2, cow_fd.Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)BLOCK_SIZE, cow_fd.Write(block.data(), block.size()));
+  ASSERT_EQ((off64_t)BLOCK_SIZE * 2, cow_fd.Seek(BLOCK_SIZE * 2, SEEK_SET));
+  read_back.resize(BLOCK_SIZE);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE, cow_fd.Read(read_back.data(), BLOCK_SIZE));
+  ASSERT_EQ(block, read_back);
+}
+
 }  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <linux/fs.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cstring>
@@ -49,6 +50,7 @@
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/partition_update_generator_interface.h"
 #include "update_engine/payload_consumer/partition_writer.h"
@@ -58,6 +60,7 @@
 #endif  // USE_FEC
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/written_data_hasher.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -74,6 +77,166 @@ const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// Checkpoints are spaced so that writing them takes at most 1/50th of the
+// time, but never more than kMaxCheckpointIntervalSeconds apart so a resumed
+// update doesn't redo too much work.
+const int64_t kCheckpointCostRatio = 50;
+const int64_t kMaxCheckpointIntervalSeconds = 10;
+// Upper bound on the number of threads applying operations in parallel.
+const size_t kMaxInstallOperationWorkers = 8;
+// Blocks |manifest_arena_| allocates the manifest from. Large manifests have
+// hundreds of thousands of extents, grow the blocks up to 1 MiB to keep the
+// number of allocations low.
+const size_t kManifestArenaStartBlockSize = 64 * 1024;
+const size_t kManifestArenaMaxBlockSize = 1024 * 1024;
+// Number of scheduled operations (and their data) kept in memory per worker.
+const size_t kPendingOperationsPerWorker = 4;
+// Consecutive operations without data of up to kMaxBatchedOperationBlocks
+// blocks are passed to the partition writer together, so that it can merge
+// their I/O. A batch has at most kMaxBatchedOperations operations and
+// kMaxBatchedBlocks blocks, as it is checkpointed as a whole.
+const size_t kMaxBatchedOperations = 256;
+const uint64_t kMaxBatchedOperationBlocks = 32;
+const uint64_t kMaxBatchedBlocks = 1024;
+
+// Replace operations with less data than this are still buffered, copying a
+// small blob is cheaper than streaming it through the extent writers.
+const uint64_t kMinStreamedOperationSize = 1024 * 1024;  // 1 MiB
+
+// Filesystem the COW images that don't fit in super are allocated from.
+const char kCowImageFilesystem[] = "/data";
+// With ADAPTIVE_VABC_COMPRESSION, the COW is only left uncompressed if the
+// filesystem has at least this many times its size free.
+const uint64_t kUncompressedCowFreeSpaceFactor = 2;
+
+// Returns whether the checkpointed update was interrupted in the middle of the
+// data of its next operation, which may then be the first one.
+bool HasOperationBytesWritten(PrefsInterface* prefs) {
+  int64_t bytes_written = 0;
+  return prefs->GetInt64(kPrefsUpdateStateOperationBytesWritten,
+                         &bytes_written) &&
+         bytes_written > 0;
+}
+
+// Returns the COW size of |partition| with compression disabled.
+uint64_t UncompressedCowSize(const PartitionUpdate& partition,
+                             uint64_t block_size) {
+  // new_cow_size per partition = partition_size - (#blocks in Copy
+  // operations part of the partition)
+  auto new_cow_size = partition.new_partition_info().size();
+  for (const auto& operation : partition.merge_operations()) {
+    if (operation.type() == CowMergeOperation::COW_COPY) {
+      new_cow_size -= operation.dst_extent().num_blocks() * block_size;
+    }
+  }
+  // Every block written to COW device will come with a header which
+  // stores src/dst block info along with other data.
+  const auto cow_metadata_size = partition.new_partition_info().size() /
+                                 block_size *
+                                 sizeof(android::snapshot::CowOperation);
+  // update_engine will emit a label op every op or every two seconds,
+  // whichever one is longer. In the worst case, we add 1 label per
+  // InstallOp. So take size of label ops into account.
+  const auto label_ops_size =
+      partition.operations_size() * sizeof(android::snapshot::CowOperation);
+  // Adding extra 2MB headroom just for any unexpected space usage.
+  // If we overrun reserved COW size, entire OTA will fail
+  // and no way for user to retry OTA
+  return new_cow_size + (1024 * 1024 * 2) + cow_metadata_size + label_ops_size;
+}
+
+// Returns whether there is enough free space to write the COW of every
+// partition in |manifest| uncompressed. Compressing the COW is the main CPU
+// cost of installing a VABC update, when space isn't a concern it's faster to
+// skip it.
+bool HasSpaceForUncompressedCow(const DeltaArchiveManifest& manifest) {
+  const auto& metadata = manifest.dynamic_partition_metadata();
+  if (!metadata.vabc_enabled() || metadata.vabc_compression_param().empty() ||
+      metadata.vabc_compression_param() == "none") {
+    return false;
+  }
+  uint64_t cow_size = 0;
+  for (const auto& partition : manifest.partitions()) {
+    cow_size += UncompressedCowSize(partition, manifest.block_size());
+  }
+  uint64_t free_bytes = 0;
+  if (!utils::GetFilesystemFreeSpace(kCowImageFilesystem, &free_bytes)) {
+    return false;
+  }
+  LOG(INFO) << "Uncompressed COW needs " << cow_size << " bytes, "
+            << kCowImageFilesystem << " has " << free_bytes << " bytes free.";
+  return free_bytes / kUncompressedCowFreeSpaceFactor >= cow_size;
+}
+
+// Returns whether to write the COW of |manifest| uncompressed with
+// ADAPTIVE_VABC_COMPRESSION. The choice is made from the free space when the
+// partitions are prepared for a new update and stored, the snapshots of a
+// resumed update keep the one they were created with.
+bool UseUncompressedCow(PrefsInterface* prefs,
+                        const DeltaArchiveManifest& manifest,
+                        bool is_resume) {
+  bool uncompressed = false;
+  if (is_resume) {
+    // Not stored if the partitions were prepared without the header.
+    ignore_result(prefs->GetBoolean(kPrefsUncompressedCow, &uncompressed));
+    return uncompressed;
+  }
+  // Already uncompressed when the partitions are prepared again after a
+  // failure.
+  uncompressed =
+      manifest.dynamic_partition_metadata().vabc_compression_param() ==
+          "none" ||
+      HasSpaceForUncompressedCow(manifest);
+  LOG_IF(WARNING, !prefs->SetBoolean(kPrefsUncompressedCow, uncompressed))
+      << "Unable to save the COW compression choice.";
+  return uncompressed;
+}
+
+// Sets the compression of the COW of |manifest| to none, with the COW sizes
+// that takes.
+void SetUncompressedCow(DeltaArchiveManifest* manifest) {
+  LOG(INFO) << "Setting Virtual AB Compression algorithm to none";
+  manifest->mutable_dynamic_partition_metadata()->set_vabc_compression_param(
+      "none");
+  for (auto& partition : *manifest->mutable_partitions()) {
+    partition.set_estimate_cow_size(
+        UncompressedCowSize(partition, manifest->block_size()));
+    LOG(INFO) << "New COW size for partition " << partition.partition_name()
+              << " is " << partition.estimate_cow_size();
+  }
+}
+
+// Returns the space the COW of |manifest| may take in kCowImageFilesystem.
+uint64_t EstimateCowSize(BootControlInterface* boot_control,
+                         const DeltaArchiveManifest& manifest) {
+  if (!boot_control->GetDynamicPartitionControl()
+           ->GetVirtualAbFeatureFlag()
+           .IsEnabled()) {
+    return 0;
+  }
+  uint64_t cow_size = 0;
+  for (const auto& partition : manifest.partitions()) {
+    cow_size += partition.estimate_cow_size()
+                    ? partition.estimate_cow_size()
+                    : UncompressedCowSize(partition, manifest.block_size());
+  }
+  return cow_size;
+}
+
+// Lowers the limit of |blob_cache| so that |cow_size| bytes are left free in
+// kCowImageFilesystem, evicting the entries in their way.
+void LimitBlobCacheSize(BlobCache* blob_cache, uint64_t cow_size) {
+  uint64_t free_bytes = 0;
+  if (!utils::GetFilesystemFreeSpace(kCowImageFilesystem, &free_bytes))
+    return;
+  // The space of the entries is given back as they are evicted.
+  const uint64_t available = free_bytes + blob_cache->size();
+  const uint64_t max_size = available > cow_size ? available - cow_size : 0;
+  LOG(INFO) << "Limiting the blob cache to " << max_size << " bytes, "
+            << kCowImageFilesystem << " has " << free_bytes
+            << " bytes free and the COW needs " << cow_size << " bytes.";
+  blob_cache->LimitSize(max_size);
+}
 
 }  // namespace
 
@@ -181,11 +344,192 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
   const char* bytes_end = bytes_start + read_len;
   buffer_.reserve(max);
   buffer_.insert(buffer_.end(), bytes_start, bytes_end);
+  buffer_memory_.Set(buffer_.capacity());
   *bytes_p = bytes_end;
   *count_p = count - read_len;
   return read_len;
 }
 
+void DeltaPerformer::HashReceivedMetadata(size_t offset) {
+  // The header is always part of the metadata, whose end is known once it's
+  // parsed.
+  const size_t metadata_end =
+      IsHeaderParsed() ? min<size_t>(buffer_.size(), metadata_size_)
+                       : buffer_.size();
+  payload_hash_calculator_.Update(buffer_.data() + offset,
+                                  buffer_.size() - offset);
+  if (offset < metadata_end) {
+    signed_hash_calculator_.Update(buffer_.data() + offset,
+                                   metadata_end - offset);
+    metadata_hash_calculator_.Update(buffer_.data() + offset,
+                                     metadata_end - offset);
+    num_metadata_bytes_hashed_ = metadata_end;
+  }
+}
+
+bool DeltaPerformer::GetOperationData(const InstallOperation& operation,
+                                      const char** bytes_p,
+                                      size_t* count_p) {
+  if (operation.data_length() > 0 && buffer_.empty() &&
+      operation.data_offset() == buffer_offset_ &&
+      *count_p >= operation.data_length()) {
+    op_data_ = reinterpret_cast<const uint8_t*>(*bytes_p);
+    op_data_size_ = operation.data_length();
+    op_data_in_place_ = true;
+    *bytes_p += op_data_size_;
+    *count_p -= op_data_size_;
+    return true;
+  }
+
+  CopyDataToBuffer(bytes_p, count_p, operation.data_length());
+  if (!CanPerformInstallOperation(operation))
+    return false;
+  op_data_ = buffer_.data();
+  op_data_size_ = buffer_.size();
+  op_data_in_place_ = false;
+  return true;
+}
+
+bool DeltaPerformer::ReadCachedOperationData(const InstallOperation& operation,
+                                             ErrorCode* error) {
+  // The data of the previous operation was consumed, and the bytes passed to
+  // Write() are the ones following this data.
+  brillo::Blob data;
+  if (!buffer_.empty() || operation.data_offset() != buffer_offset_ ||
+      !blob_cache_->Get(BlobCache::OperationKey(operation.data_sha256_hash()),
+                        &data) ||
+      data.size() != operation.data_length()) {
+    LOG(ERROR) << "Unable to read the cached data of operation "
+               << next_operation_num_;
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  buffer_ = std::move(data);
+  buffer_memory_.Set(buffer_.capacity());
+  op_data_from_cache_ = true;
+  return true;
+}
+
+bool DeltaPerformer::InitSharedDataBlobs() {
+  shared_blob_uses_.clear();
+  shared_blobs_.clear();
+  // The first operation using each data blob, by data offset.
+  std::map<uint64_t, const InstallOperation*> first_uses;
+  size_t op_num = 0;
+  for (const auto& partition : partitions_) {
+    for (const auto& op : partition.operations()) {
+      const size_t current_op_num = op_num++;
+      if (!op.data_length())
+        continue;
+      auto [first_use, inserted] = first_uses.emplace(op.data_offset(), &op);
+      if (inserted || current_op_num < next_operation_num_ ||
+          shared_blob_uses_[op.data_offset()]++) {
+        continue;
+      }
+      // When the update was interrupted between the operations sharing the
+      // blob, it was only kept in |blob_cache_|.
+      const InstallOperation& first_op = *first_use->second;
+      if (op.data_offset() < buffer_offset_ &&
+          (!blob_cache_ || first_op.data_sha256_hash().empty() ||
+           !blob_cache_->Pin(
+               BlobCache::OperationKey(first_op.data_sha256_hash())))) {
+        LOG(ERROR) << "The data blob at offset " << op.data_offset()
+                   << " used by the next operations is gone.";
+        return false;
+      }
+    }
+  }
+  if (!shared_blob_uses_.empty()) {
+    LOG(INFO) << shared_blob_uses_.size()
+              << " data blobs are shared by several operations.";
+  }
+  return true;
+}
+
+bool DeltaPerformer::GetSharedOperationData(const InstallOperation& operation,
+                                            ErrorCode* error) {
+  auto it = shared_blobs_.find(operation.data_offset());
+  if (it == shared_blobs_.end() && blob_cache_ &&
+      !operation.data_sha256_hash().empty()) {
+    brillo::Blob data;
+    if (blob_cache_->Get(BlobCache::OperationKey(operation.data_sha256_hash()),
+                         &data)) {
+      it = shared_blobs_.emplace(operation.data_offset(), std::move(data))
+               .first;
+    }
+  }
+  if (it == shared_blobs_.end() ||
+      !shared_blob_uses_.count(operation.data_offset()) ||
+      it->second.size() != operation.data_length()) {
+    LOG(ERROR) << "Unable to read the shared data of operation "
+               << next_operation_num_;
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  op_data_ = it->second.data();
+  op_data_size_ = it->second.size();
+  op_data_in_place_ = false;
+  op_data_shared_ = true;
+  shared_op_data_offset_ = operation.data_offset();
+  return true;
+}
+
+void DeltaPerformer::KeepSharedOperationData(
+    const InstallOperation& operation) {
+  if (!operation.data_length() ||
+      !shared_blob_uses_.count(operation.data_offset()) ||
+      shared_blobs_.count(operation.data_offset())) {
+    return;
+  }
+  // The blobs in |blob_cache_| don't need to stay in memory until they're
+  // used again.
+  if (blob_cache_ && !operation.data_sha256_hash().empty() &&
+      blob_cache_->Pin(BlobCache::OperationKey(operation.data_sha256_hash()))) {
+    return;
+  }
+  shared_blobs_.emplace(
+      operation.data_offset(),
+      brillo::Blob(op_data_, op_data_ + operation.data_length()));
+}
+
+bool DeltaPerformer::UseCachedOperationData(
+    vector<std::pair<uint64_t, uint64_t>>* ranges) {
+  ranges->clear();
+  if (!blob_cache_ || !manifest_valid_ || !payload_->size)
+    return false;
+  const uint64_t data_begin = metadata_size_ + metadata_signature_size_;
+  // The next byte expected by Write().
+  uint64_t offset = data_begin + buffer_offset_ + buffer_.size();
+  std::set<uint64_t> cached_data_offsets;
+  // Only the first operation using a data blob reads it.
+  std::set<uint64_t> data_offsets;
+  for (const auto& partition : partitions_) {
+    for (const auto& op : partition.operations()) {
+      const uint64_t begin = data_begin + op.data_offset();
+      if (!op.data_length() || !data_offsets.insert(op.data_offset()).second ||
+          op.data_sha256_hash().empty() || begin < offset ||
+          !blob_cache_->Pin(BlobCache::OperationKey(op.data_sha256_hash()))) {
+        continue;
+      }
+      if (begin > offset)
+        ranges->emplace_back(offset, begin - offset);
+      offset = begin + op.data_length();
+      cached_data_offsets.insert(op.data_offset());
+    }
+  }
+  // The cached data is only read once Write() gets the data following it,
+  // usually the payload signature, so that data must exist.
+  if (cached_data_offsets.empty() || offset >= payload_->size) {
+    ranges->clear();
+    return false;
+  }
+  ranges->emplace_back(offset, payload_->size - offset);
+  LOG(INFO) << "Using the cached data of " << cached_data_offsets.size()
+            << " operations.";
+  cached_data_offsets_ = std::move(cached_data_offsets);
+  return true;
+}
+
 bool DeltaPerformer::HandleOpResult(bool op_result,
                                     const char* op_type_name,
                                     ErrorCode* error) {
@@ -205,6 +549,9 @@ int DeltaPerformer::Close() {
   // Checkpoint update progress before canceling, so that subsequent attempts
   // can resume from exactly where update_engine left last time.
   CheckpointUpdateProgress(true);
+  if (source_cache_warmer_)
+    source_cache_warmer_->Stop();
+  CloseScheduledPartitions();
   int err = -CloseCurrentPartition();
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
@@ -219,11 +566,18 @@ int DeltaPerformer::Close() {
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
+  // Without a writer, the current partition was left running in the
+  // background by FinishCurrentPartition().
   if (!partition_writer_) {
     return 0;
   }
+  CloseScheduledPartitions();
   int err = partition_writer_->Close();
   partition_writer_ = nullptr;
+  if (phase_metrics_) {
+    phase_metrics_->Stop(phases::kApply,
+                         partitions_[current_partition_].partition_name());
+  }
   return err;
 }
 
@@ -234,28 +588,243 @@ bool DeltaPerformer::OpenCurrentPartition() {
   const PartitionUpdate& partition = partitions_[current_partition_];
   size_t num_previous_partitions =
       install_plan_->partitions.size() - partitions_.size();
-  const InstallPlan::Partition& install_part =
+  InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
   auto dynamic_control = boot_control_->GetDynamicPartitionControl();
-  partition_writer_ = CreatePartitionWriter(
-      partition,
-      install_part,
-      dynamic_control,
-      block_size_,
-      interactive_,
-      IsDynamicPartition(install_part.name, install_plan_->target_slot));
+  const bool is_dynamic_partition =
+      IsDynamicPartition(install_part.name, install_plan_->target_slot);
+  const bool is_vabc_partition =
+      dynamic_control && dynamic_control->UpdateUsesSnapshotCompression() &&
+      is_dynamic_partition;
+  const size_t partition_operation_num = GetPartitionOperationNum();
+  // The data written before resuming this partition wasn't seen, and the COW
+  // of VABC partitions holds copy operations without their data.
+  install_part.written_data_hasher.reset();
+  if (is_vabc_partition)
+    check_applied_operations_ = false;
+  if (install_plan_->hash_while_writing && partition_operation_num == 0 &&
+      resume_operation_bytes_ == 0 && !is_vabc_partition) {
+    install_part.written_data_hasher =
+        std::make_shared<WrittenDataHasher>(install_part.target_size);
+  }
+  partition_writer_ = CreatePartitionWriter(partition,
+                                            install_part,
+                                            dynamic_control,
+                                            block_size_,
+                                            interactive_,
+                                            is_dynamic_partition);
   // Open source fds if we have a delta payload, or for partitions in the
   // partial update.
-  const bool source_may_exist = manifest_.partial_update() ||
+  const bool source_may_exist = manifest_->partial_update() ||
                                 payload_->type == InstallPayloadType::kDelta;
+
+  TEST_AND_RETURN_FALSE(
+      partition_writer_->Init(install_plan_,
+                              source_may_exist,
+                              partition_operation_num,
+                              resume_operation_bytes_ > 0));
+  // A forced checkpoint waits for the scheduled operations, don't stall the
+  // previous partitions still applied in the background.
+  if (scheduled_partitions_.empty()) {
+    CheckpointUpdateProgress(true);
+  }
+  // The COW writer of VABC partitions checkpoints by appending a label after
+  // the data written so far, which would include the part of a streamed
+  // operation received before the checkpoint.
+  stream_replace_ops_ = install_plan_->stream_replace_ops && !is_vabc_partition;
+  if (install_plan_->parallel_install_ops) {
+    TEST_AND_RETURN_FALSE(StartOperationScheduler(
+        partition, install_part, is_dynamic_partition, source_may_exist));
+  }
+  if (phase_metrics_)
+    phase_metrics_->Start(phases::kApply, partition.partition_name());
+  return true;
+}
+
+bool DeltaPerformer::CanScheduleOperations(size_t partition_index) {
+  if (!install_plan_->parallel_install_ops)
+    return false;
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  const InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + partition_index];
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  // The COW writer used for VABC is inherently sequential.
+  return !(dynamic_control &&
+           dynamic_control->UpdateUsesSnapshotCompression() &&
+           IsDynamicPartition(install_part.name, install_plan_->target_slot));
+}
+
+bool DeltaPerformer::StartOperationScheduler(
+    const PartitionUpdate& partition_update,
+    const InstallPlan::Partition& install_part,
+    bool is_dynamic_partition,
+    bool source_may_exist) {
+  if (!CanScheduleOperations(current_partition_)) {
+    LOG(INFO) << "Applying operations of " << install_part.name
+              << " sequentially, VABC partitions can't be written in parallel.";
+    return true;
+  }
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  const size_t num_workers = std::min<size_t>(
+      std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L), kMaxInstallOperationWorkers);
   const size_t partition_operation_num = GetPartitionOperationNum();
+  std::vector<std::unique_ptr<PartitionWriterInterface>> writers;
+  for (size_t i = 0; i < num_workers; i++) {
+    auto writer = CreatePartitionWriter(partition_update,
+                                        install_part,
+                                        dynamic_control,
+                                        block_size_,
+                                        interactive_,
+                                        is_dynamic_partition);
+    if (!writer->Init(install_plan_,
+                      source_may_exist,
+                      partition_operation_num,
+                      resume_operation_bytes_ > 0)) {
+      LOG(WARNING) << "Unable to open partition writer " << i << " for "
+                   << install_part.name
+                   << ", applying its operations sequentially.";
+      for (auto& opened_writer : writers) {
+        opened_writer->Close();
+      }
+      // The operations of this partition would be applied sequentially while
+      // the previous ones are still running.
+      ErrorCode error = ErrorCode::kSuccess;
+      TEST_AND_RETURN_FALSE(WaitForScheduledOperations(&error));
+      TEST_AND_RETURN_FALSE(FinishCompletedPartitions(&error));
+      CloseScheduledPartitions();
+      return true;
+    }
+    writers.push_back(std::move(writer));
+  }
+  auto scheduled_partition = std::make_unique<ScheduledPartition>();
+  scheduled_partition->partition_index = current_partition_;
+  scheduled_partition->worker_writers = std::move(writers);
+  scheduled_partitions_.push_back(std::move(scheduled_partition));
+  if (operation_scheduler_) {
+    operation_scheduler_->StartNewPartition();
+  } else {
+    // Each worker applies its operations within the budget, the scheduler
+    // keeps those running at once within it too when the payload tells their
+    // peak memory.
+    operation_scheduler_ = std::make_unique<InstallOperationScheduler>(
+        num_workers,
+        num_workers * kPendingOperationsPerWorker,
+        install_plan_->apply_memory_budget);
+    first_scheduled_operation_num_ = next_operation_num_;
+    pending_checkpoints_.clear();
+    last_completed_checkpoint_ = CurrentCheckpoint();
+  }
+  const size_t num_cpu_bound = std::count_if(
+      partition_update.operations().begin(),
+      partition_update.operations().end(),
+      InstallOperationScheduler::IsCpuBound);
+  LOG(INFO) << "Applying operations of " << install_part.name << " on "
+            << num_workers << " threads, " << num_cpu_bound << " of "
+            << partition_update.operations_size() << " are CPU-bound.";
+  return true;
+}
 
-  TEST_AND_RETURN_FALSE(partition_writer_->Init(
-      install_plan_, source_may_exist, partition_operation_num));
-  CheckpointUpdateProgress(true);
+bool DeltaPerformer::WaitForScheduledOperations(ErrorCode* error) {
+  if (!operation_scheduler_)
+    return true;
+  if (!operation_scheduler_->Wait(error)) {
+    LOG(ERROR) << "Failed to apply the scheduled operations of partition \""
+               << partitions_[current_partition_].partition_name()
+               << "\" or the partitions before it.";
+    if (*error == ErrorCode::kSuccess)
+      *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::FinishCurrentPartition(ErrorCode* error) {
+  if (!partition_writer_)
+    return true;
+  if (operation_scheduler_ && install_plan_->concurrent_partitions &&
+      next_operation_num_ < num_total_operations_) {
+    size_t next_partition = current_partition_ + 1;
+    while (next_operation_num_ >= acc_num_operations_[next_partition]) {
+      next_partition++;
+    }
+    if (CanScheduleOperations(next_partition)) {
+      LOG(INFO) << "Applying the remaining operations of partition \""
+                << partitions_[current_partition_].partition_name()
+                << "\" in the background.";
+      scheduled_partitions_.back()->writer = std::move(partition_writer_);
+      return FinishCompletedPartitions(error);
+    }
+  }
+  if (!WaitForScheduledOperations(error) ||
+      !FinishCompletedPartitions(error)) {
+    return false;
+  }
+  if (!partition_writer_->FinishedInstallOps()) {
+    *error = ErrorCode::kDownloadWriteError;
+    return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::FinishCompletedPartitions(ErrorCode* error) {
+  if (!operation_scheduler_)
+    return true;
+  const size_t num_completed = first_scheduled_operation_num_ +
+                               operation_scheduler_->num_completed_in_order();
+  while (!scheduled_partitions_.empty() &&
+         scheduled_partitions_.front()->writer) {
+    ScheduledPartition* partition = scheduled_partitions_.front().get();
+    if (num_completed < acc_num_operations_[partition->partition_index])
+      break;
+    if (!partition->writer->FinishedInstallOps()) {
+      LOG(ERROR) << "Unable to finish partition \""
+                 << partitions_[partition->partition_index].partition_name()
+                 << "\"";
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    for (auto& writer : partition->worker_writers) {
+      writer->Close();
+    }
+    partition->writer->Close();
+    if (phase_metrics_) {
+      phase_metrics_->Stop(
+          phases::kApply,
+          partitions_[partition->partition_index].partition_name());
+    }
+    scheduled_partitions_.pop_front();
+  }
+  ReportAppliedPartitions(current_partition_);
   return true;
 }
 
+void DeltaPerformer::ReportAppliedPartitions(size_t end) {
+  if (!partition_applied_callback_)
+    return;
+  if (!scheduled_partitions_.empty()) {
+    end = std::min(end, scheduled_partitions_.front()->partition_index);
+  }
+  for (; num_applied_partitions_ < end; num_applied_partitions_++) {
+    partition_applied_callback_.Run(
+        partitions_[num_applied_partitions_].partition_name());
+  }
+}
+
+void DeltaPerformer::CloseScheduledPartitions() {
+  operation_scheduler_.reset();
+  for (auto& partition : scheduled_partitions_) {
+    for (auto& writer : partition->worker_writers) {
+      writer->Close();
+    }
+    if (partition->writer) {
+      partition->writer->Close();
+    }
+  }
+  scheduled_partitions_.clear();
+  pending_checkpoints_.clear();
+}
+
 size_t DeltaPerformer::GetPartitionOperationNum() {
   return next_operation_num_ -
          (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
@@ -269,7 +838,7 @@ void LogPartitionInfoHash(const PartitionInfo& info, const string& tag) {
             << " size: " << info.size();
 }
 
-void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
+void LogPartitionInfo(const RepeatedPtrField<PartitionUpdate>& partitions) {
   for (const PartitionUpdate& partition : partitions) {
     if (partition.has_old_partition_info()) {
       LogPartitionInfoHash(partition.old_partition_info(),
@@ -361,8 +930,19 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   } else {
     // We have the full metadata in |payload|. Verify its integrity
     // and authenticity based on the information we have in Omaha response.
-    *error = payload_metadata_.ValidateMetadataSignature(
-        payload, payload_->metadata_signature, *payload_verifier);
+    // When it was received through Write(), it's already hashed.
+    if (num_metadata_bytes_hashed_ == metadata_size_ &&
+        metadata_hash_calculator_.Finalize()) {
+      *error = payload_metadata_.ValidateMetadataSignature(
+          payload.data(),
+          payload.size(),
+          payload_->metadata_signature,
+          *payload_verifier,
+          metadata_hash_calculator_.raw_hash());
+    } else {
+      *error = payload_metadata_.ValidateMetadataSignature(
+          payload, payload_->metadata_signature, *payload_verifier);
+    }
   }
   if (*error != ErrorCode::kSuccess) {
     if (install_plan_->hash_checks_mandatory) {
@@ -378,13 +958,14 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   }
 
   // The payload metadata is deemed valid, it's safe to parse the protobuf.
-  if (!payload_metadata_.GetManifest(payload, &manifest_)) {
+  if (!payload_metadata_.GetManifest(payload, manifest_)) {
     LOG(ERROR) << "Unable to parse manifest in update file.";
     *error = ErrorCode::kDownloadManifestParseError;
     return MetadataParseResult::kError;
   }
 
   manifest_parsed_ = true;
+  manifest_memory_.Set(manifest_arena_.SpaceAllocated());
   return MetadataParseResult::kSuccess;
 }
 
@@ -398,13 +979,13 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
       20);
 
 bool DeltaPerformer::CheckSPLDowngrade() {
-  if (!manifest_.has_security_patch_level()) {
+  if (!manifest_->has_security_patch_level()) {
     return true;
   }
-  if (manifest_.security_patch_level().empty()) {
+  if (manifest_->security_patch_level().empty()) {
     return true;
   }
-  const auto new_spl = manifest_.security_patch_level();
+  const auto new_spl = manifest_->security_patch_level();
   const auto current_spl =
       android::base::GetProperty("ro.build.version.security_patch", "");
   if (current_spl.empty()) {
@@ -447,15 +1028,19 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
 
+  if (!manifest_valid_ && phase_metrics_)
+    phase_metrics_->Start(phases::kManifest);
   while (!manifest_valid_) {
     // Read data up to the needed limit; this is either maximium payload header
     // size, or the full metadata size (once it becomes known).
     const bool do_read_header = !IsHeaderParsed();
+    const size_t buffer_size = buffer_.size();
     CopyDataToBuffer(
         &c_bytes,
         &count,
         (do_read_header ? kMaxPayloadHeaderSize
                         : metadata_size_ + metadata_signature_size_));
+    HashReceivedMetadata(buffer_size);
 
     MetadataParseResult result = ParsePayloadMetadata(buffer_, error);
     if (result == MetadataParseResult::kError)
@@ -472,66 +1057,45 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     if ((*error = ValidateManifest()) != ErrorCode::kSuccess)
       return false;
     manifest_valid_ = true;
+    if (phase_metrics_)
+      phase_metrics_->Stop(phases::kManifest);
     if (!install_plan_->is_resume) {
       auto begin = reinterpret_cast<const char*>(buffer_.data());
       prefs_->SetString(kPrefsManifestBytes, {begin, buffer_.size()});
     }
+    if (blob_cache_ && !payload_->hash.empty()) {
+      blob_cache_->Put(BlobCache::MetadataKey(payload_->hash),
+                       buffer_.data(),
+                       buffer_.size());
+    }
 
-    // Clear the download buffer.
-    DiscardBuffer(false, metadata_size_);
+    // Clear the download buffer, it was hashed as it was received.
+    brillo::Blob().swap(buffer_);
+    buffer_memory_.Set(0);
 
-    block_size_ = manifest_.block_size();
+    block_size_ = manifest_->block_size();
 
     if (!CheckSPLDowngrade()) {
       *error = ErrorCode::kPayloadTimestampError;
       return false;
     }
 
-    // update estimate_cow_size if VABC is disabled
-    // new_cow_size per partition = partition_size - (#blocks in Copy
-    // operations part of the partition)
+    // update estimate_cow_size if VABC is disabled. With
+    // ADAPTIVE_VABC_COMPRESSION, it's chosen as the partitions are prepared.
     if (install_plan_->vabc_none) {
-      LOG(INFO) << "Setting Virtual AB Compression algorithm to none";
-      manifest_.mutable_dynamic_partition_metadata()
-          ->set_vabc_compression_param("none");
-      for (auto& partition : *manifest_.mutable_partitions()) {
-        auto new_cow_size = partition.new_partition_info().size();
-        for (const auto& operation : partition.merge_operations()) {
-          if (operation.type() == CowMergeOperation::COW_COPY) {
-            new_cow_size -=
-                operation.dst_extent().num_blocks() * manifest_.block_size();
-          }
-        }
-        // Every block written to COW device will come with a header which
-        // stores src/dst block info along with other data.
-        const auto cow_metadata_size = partition.new_partition_info().size() /
-                                       manifest_.block_size() *
-                                       sizeof(android::snapshot::CowOperation);
-        // update_engine will emit a label op every op or every two seconds,
-        // whichever one is longer. In the worst case, we add 1 label per
-        // InstallOp. So take size of label ops into account.
-        const auto label_ops_size = partition.operations_size() *
-                                    sizeof(android::snapshot::CowOperation);
-        // Adding extra 2MB headroom just for any unexpected space usage.
-        // If we overrun reserved COW size, entire OTA will fail
-        // and no way for user to retry OTA
-        partition.set_estimate_cow_size(new_cow_size + (1024 * 1024 * 2) +
-                                        cow_metadata_size + label_ops_size);
-        LOG(INFO) << "New COW size for partition " << partition.partition_name()
-                  << " is " << partition.estimate_cow_size();
-      }
+      SetUncompressedCow(manifest_.get());
     }
     if (install_plan_->disable_vabc) {
-      manifest_.mutable_dynamic_partition_metadata()->set_vabc_enabled(false);
+      manifest_->mutable_dynamic_partition_metadata()->set_vabc_enabled(false);
     }
     if (install_plan_->enable_threading) {
-      manifest_.mutable_dynamic_partition_metadata()
+      manifest_->mutable_dynamic_partition_metadata()
           ->mutable_vabc_feature_set()
           ->set_threaded(true);
       LOG(INFO) << "Attempting to enable multi-threaded compression for VABC";
     }
     if (install_plan_->batched_writes) {
-      manifest_.mutable_dynamic_partition_metadata()
+      manifest_->mutable_dynamic_partition_metadata()
           ->mutable_vabc_feature_set()
           ->set_batch_writes(true);
       LOG(INFO) << "Attempting to enable batched writes for VABC";
@@ -567,7 +1131,12 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       LOG(ERROR) << "Unable to prime the update state.";
       return false;
     }
+    if (!InitSharedDataBlobs()) {
+      *error = ErrorCode::kDownloadStateInitializationError;
+      return false;
+    }
 
+    check_applied_operations_ = install_plan_->skip_applied_operations;
     if (next_operation_num_ < acc_num_operations_[current_partition_]) {
       if (!OpenCurrentPartition()) {
         *error = ErrorCode::kInstallDeviceOpenError;
@@ -577,6 +1146,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
 
     if (next_operation_num_ > 0)
       UpdateOverallProgress(true, "Resuming after ");
+    StartSourceCacheWarmer();
     LOG(INFO) << "Starting to apply update payload operations";
   }
 
@@ -586,21 +1156,23 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // why we're canceling.
     if (download_delegate_ && download_delegate_->ShouldCancel(error))
       return false;
+    // A chunk of data completed by the last operation didn't match its hash.
+    if (payload_chunk_verifier_.failed()) {
+      *error = ErrorCode::kPayloadHashMismatchError;
+      return false;
+    }
 
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
-      if (partition_writer_) {
-        if (!partition_writer_->FinishedInstallOps()) {
-          *error = ErrorCode::kDownloadWriteError;
-          return false;
-        }
-      }
+      if (!FinishCurrentPartition(error))
+        return false;
       CloseCurrentPartition();
       // Skip until there are operations for current_partition_.
       while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
         current_partition_++;
       }
+      ReportAppliedPartitions(current_partition_);
       if (!OpenCurrentPartition()) {
         *error = ErrorCode::kInstallDeviceOpenError;
         return false;
@@ -609,11 +1181,48 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
 
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
+    if (source_cache_warmer_)
+      source_cache_warmer_->OperationStarted(next_operation_num_);
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    if (resume_operation_bytes_ > 0 && !streaming_op_ &&
+        !ResumeStreamingOperation(op, error)) {
+      return false;
+    }
+
+    op_data_from_cache_ = false;
+    if (op.data_length() > 0 && !streaming_op_ &&
+        cached_data_offsets_.erase(op.data_offset()) &&
+        !ReadCachedOperationData(op, error)) {
+      return false;
+    }
+    // The data before |buffer_offset_| was received with a previous operation
+    // that shares it with this one, or is the part of the streamed operation
+    // already written.
+    if (op.data_length() > 0 && !streaming_op_ &&
+        op.data_offset() < buffer_offset_ &&
+        !GetSharedOperationData(op, error)) {
+      return false;
+    }
+
+    if (!op_data_from_cache_ && !op_data_shared_ &&
+        (streaming_op_ ||
+         (ShouldStreamOperation(op) && !IsOperationApplied(op)))) {
+      if (!StreamReplaceOperation(op, &c_bytes, &count, error))
+        return false;
+      // Wait for the rest of the data.
+      if (streaming_op_)
+        return true;
+
+      ScopedTerminatorExitUnblocker exit_unblocker =
+          ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Completed ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
 
     // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
+    if (!op_data_shared_ && !GetOperationData(op, &c_bytes, &count))
       return true;
 
     // Validate the operation unconditionally. This helps prevent the
@@ -625,6 +1234,15 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // called. Otherwise, we might be failing operations before even if there
     // isn't sufficient data to compute the proper hash.
     *error = ValidateOperationHash(op);
+    if (blob_cache_ && !op.data_sha256_hash().empty() && !op_data_shared_) {
+      const string key = BlobCache::OperationKey(op.data_sha256_hash());
+      if (*error == ErrorCode::kSuccess && !op_data_from_cache_)
+        blob_cache_->Put(key, op_data_, op_data_size_);
+      else if (*error != ErrorCode::kSuccess && op_data_from_cache_)
+        blob_cache_->Remove(key);
+    }
+    if (*error == ErrorCode::kSuccess && !op_data_shared_)
+      KeepSharedOperationData(op);
     if (*error != ErrorCode::kSuccess) {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Mandatory operation hash check failed";
@@ -640,14 +1258,44 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
+    // The data is still received and hashed as part of the payload.
+    if (IsOperationApplied(op)) {
+      if (op.data_length() > 0)
+        DiscardOperationData();
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Skipped ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
+
+    if (operation_scheduler_) {
+      if (!ScheduleInstallOperation(op, error))
+        return false;
+      next_operation_num_++;
+      UpdateOverallProgress(false, "Scheduled ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
+
+    if (ShouldBatchOperation(op)) {
+      if (!PerformBatchedOperations(error))
+        return false;
+      UpdateOverallProgress(false, "Completed ");
+      CheckpointUpdateProgress(false);
+      continue;
+    }
+
     base::TimeTicks op_start_time = base::TimeTicks::Now();
+    InstallOperationTimer op_timer;
 
     bool op_result{};
     const string op_name = InstallOperationTypeName(op.type());
+    ScopedTrace op_trace(op_name);
     switch (op.type()) {
       case InstallOperation::REPLACE:
       case InstallOperation::REPLACE_BZ:
       case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
         op_result = PerformReplaceOperation(op);
         OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
         break;
@@ -674,31 +1322,42 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     }
     if (!HandleOpResult(op_result, op_name.c_str(), error))
       return false;
+    if (operation_metrics_) {
+      operation_metrics_->Record(
+          op,
+          block_size_,
+          op_timer,
+          partitions_[current_partition_].partition_name());
+    }
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
     CheckpointUpdateProgress(false);
   }
 
-  if (partition_writer_) {
-    TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
+  if (payload_chunk_verifier_.failed()) {
+    *error = ErrorCode::kPayloadHashMismatchError;
+    return false;
   }
+  if (!FinishCurrentPartition(error))
+    return false;
   CloseCurrentPartition();
+  ReportAppliedPartitions(partitions_.size());
 
   // In major version 2, we don't add unused operation to the payload.
   // If we already extracted the signature we should skip this step.
-  if (manifest_.has_signatures_offset() && manifest_.has_signatures_size() &&
+  if (manifest_->has_signatures_offset() && manifest_->has_signatures_size() &&
       signatures_message_data_.empty()) {
-    if (manifest_.signatures_offset() != buffer_offset_) {
+    if (manifest_->signatures_offset() != buffer_offset_) {
       LOG(ERROR) << "Payload signatures offset points to blob offset "
-                 << manifest_.signatures_offset()
+                 << manifest_->signatures_offset()
                  << " but signatures are expected at offset " << buffer_offset_;
       *error = ErrorCode::kDownloadPayloadVerificationError;
       return false;
     }
-    CopyDataToBuffer(&c_bytes, &count, manifest_.signatures_size());
+    CopyDataToBuffer(&c_bytes, &count, manifest_->signatures_size());
     // Needs more data to cover entire signature.
-    if (buffer_.size() < manifest_.signatures_size())
+    if (buffer_.size() < manifest_->signatures_size())
       return true;
     if (!ExtractSignatureMessage()) {
       LOG(ERROR) << "Extract payload signature failed.";
@@ -717,18 +1376,67 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   return true;
 }
 
+google::protobuf::ArenaOptions DeltaPerformer::ManifestArenaOptions() {
+  google::protobuf::ArenaOptions options;
+  options.start_block_size = kManifestArenaStartBlockSize;
+  options.max_block_size = kManifestArenaMaxBlockSize;
+  return options;
+}
+
 bool DeltaPerformer::IsManifestValid() {
   return manifest_valid_;
 }
 
-bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
-  partitions_.assign(manifest_.partitions().begin(),
-                     manifest_.partitions().end());
+std::vector<uint64_t> DeltaPerformer::GetOperationDataEnds() const {
+  std::vector<uint64_t> ends;
+  if (!manifest_valid_)
+    return ends;
+  const uint64_t data_begin = metadata_size_ + metadata_signature_size_;
+  for (const auto& partition : partitions_) {
+    for (const auto& op : partition.operations()) {
+      if (op.data_length() > 0)
+        ends.push_back(data_begin + op.data_offset() + op.data_length());
+    }
+  }
+  std::sort(ends.begin(), ends.end());
+  return ends;
+}
+
+void DeltaPerformer::StartSourceCacheWarmer() {
+  if (install_plan_->source_warming_size == 0 ||
+      install_plan_->source_slot == BootControlInterface::kInvalidSlot) {
+    return;
+  }
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  const bool uses_vabc =
+      dynamic_control && dynamic_control->UpdateUsesSnapshotCompression();
+  const size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  std::vector<SourceCacheWarmer::Partition> warmer_partitions;
+  for (int i = 0; i < partitions_.size(); i++) {
+    const InstallPlan::Partition& install_part =
+        install_plan_->partitions[num_previous_partitions + i];
+    const bool is_vabc_partition =
+        uses_vabc &&
+        IsDynamicPartition(install_part.name, install_plan_->target_slot);
+    warmer_partitions.push_back(
+        {install_part.source_path, &partitions_[i], is_vabc_partition});
+  }
+  const uint64_t budget =
+      SourceCacheWarmer::GetBudget(install_plan_->source_warming_size);
+  LOG(INFO) << "Warming up to " << budget
+            << " bytes of the source partitions ahead of the operations.";
+  source_cache_warmer_ = std::make_unique<SourceCacheWarmer>(
+      std::move(warmer_partitions), block_size_, budget);
+  source_cache_warmer_->Start(next_operation_num_);
+}
 
+bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   // For VAB and partial updates, the partition preparation will copy the
   // dynamic partitions metadata to the target metadata slot, and rename the
   // slot suffix of the partitions in the metadata.
   if (install_plan_->target_slot != BootControlInterface::kInvalidSlot) {
+    ScopedPhaseTimer timer(phase_metrics_, phases::kPreparePartitions);
     uint64_t required_size = 0;
     if (!PreparePartitionsForUpdate(&required_size)) {
       if (required_size > 0) {
@@ -740,18 +1448,16 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     }
   }
 
-  // Partitions in manifest are no longer needed after preparing partitions.
-  manifest_.clear_partitions();
   // TODO(xunchang) TBD: allow partial update only on devices with dynamic
   // partition.
-  if (manifest_.partial_update()) {
+  if (manifest_->partial_update()) {
     std::set<std::string> touched_partitions;
     for (const auto& partition_update : partitions_) {
       touched_partitions.insert(partition_update.partition_name());
     }
 
-    auto generator = partition_update_generator::Create(boot_control_,
-                                                        manifest_.block_size());
+    auto generator = partition_update_generator::Create(
+        boot_control_, manifest_->block_size());
     std::vector<PartitionUpdate> untouched_static_partitions;
     TEST_AND_RETURN_FALSE(
         generator->GenerateOperationsForPartitionsNotInPayload(
@@ -759,9 +1465,9 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
             install_plan_->target_slot,
             touched_partitions,
             &untouched_static_partitions));
-    partitions_.insert(partitions_.end(),
-                       untouched_static_partitions.begin(),
-                       untouched_static_partitions.end());
+    for (auto& partition_update : untouched_static_partitions) {
+      *manifest_->add_partitions() = std::move(partition_update);
+    }
 
     // Save the untouched dynamic partitions in install plan.
     std::vector<std::string> dynamic_partitions;
@@ -807,8 +1513,10 @@ bool DeltaPerformer::PreparePartitionsForUpdate(uint64_t* required_size) {
   return PreparePartitionsForUpdate(prefs_,
                                     boot_control_,
                                     install_plan_->target_slot,
-                                    manifest_,
+                                    manifest_.get(),
                                     update_check_response_hash,
+                                    install_plan_->adaptive_vabc_compression,
+                                    blob_cache_,
                                     required_size);
 }
 
@@ -816,8 +1524,10 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
     PrefsInterface* prefs,
     BootControlInterface* boot_control,
     BootControlInterface::Slot target_slot,
-    const DeltaArchiveManifest& manifest,
+    DeltaArchiveManifest* manifest,
     const std::string& update_check_response_hash,
+    bool adaptive_vabc_compression,
+    BlobCache* blob_cache,
     uint64_t* required_size) {
   string last_hash;
   ignore_result(
@@ -835,10 +1545,25 @@ bool DeltaPerformer::PreparePartitionsForUpdate(
     ResetUpdateProgress(prefs, false);
   }
 
+  if (adaptive_vabc_compression &&
+      UseUncompressedCow(prefs, *manifest, is_resume) &&
+      manifest->dynamic_partition_metadata().vabc_compression_param() !=
+          "none") {
+    LOG(INFO) << "Enough free space to skip Virtual AB Compression";
+    SetUncompressedCow(manifest);
+  }
+
+  // The space of the COW is only allocated for a new update, give it the
+  // space of the blob cache first.
+  if (blob_cache) {
+    LimitBlobCacheSize(
+        blob_cache, is_resume ? 0 : EstimateCowSize(boot_control, *manifest));
+  }
+
   if (!boot_control->GetDynamicPartitionControl()->PreparePartitionsForUpdate(
           boot_control->GetCurrentSlot(),
           target_slot,
-          manifest,
+          *manifest,
           !is_resume /* should update */,
           required_size)) {
     LOG(ERROR) << "Unable to initialize partition metadata for slot "
@@ -873,16 +1598,217 @@ bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(op_data_size_ >= operation.data_length());
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
+      operation, op_data_, op_data_size_));
   // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  DiscardOperationData();
+  return true;
+}
+
+bool DeltaPerformer::IsOperationApplied(const InstallOperation& operation) {
+  if (applied_operation_num_ == next_operation_num_)
+    return true;
+  if (!check_applied_operations_ || operation_scheduler_ || streaming_op_ ||
+      resume_operation_bytes_ > 0) {
+    return false;
+  }
+  // The operations are applied in order, so the first one that doesn't match
+  // is where the previous attempt stopped.
+  if (operation.dst_sha256_hash().empty() ||
+      !partition_writer_->IsOperationApplied(operation)) {
+    check_applied_operations_ = false;
+    LOG(INFO) << "Skipped " << num_skipped_operations_
+              << " operations already applied, applying the next ones from "
+              << "operation " << next_operation_num_;
+    return false;
+  }
+  applied_operation_num_ = next_operation_num_;
+  num_skipped_operations_++;
+  // The data of the skipped operations isn't written again.
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  install_plan_->partitions[num_previous_partitions + current_partition_]
+      .written_data_hasher.reset();
+  return true;
+}
+
+bool DeltaPerformer::ShouldStreamOperation(
+    const InstallOperation& operation) const {
+  if (!stream_replace_ops_ || operation_scheduler_)
+    return false;
+  if (operation.type() != InstallOperation::REPLACE &&
+      operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ &&
+      operation.type() != InstallOperation::REPLACE_ZSTD)
+    return false;
+  // The data must be the next bytes of the payload, nothing may be buffered
+  // in front of it. The data shared with the next operations is kept instead.
+  return operation.data_length() >= kMinStreamedOperationSize &&
+         buffer_.empty() && operation.data_offset() == buffer_offset_ &&
+         !shared_blob_uses_.count(operation.data_offset());
+}
+
+bool DeltaPerformer::StreamReplaceOperation(const InstallOperation& operation,
+                                            const char** bytes_p,
+                                            size_t* count_p,
+                                            ErrorCode* error) {
+  const string op_name = InstallOperationTypeName(operation.type());
+  if (!streaming_op_) {
+    auto streaming_op = std::make_unique<StreamingOperation>();
+    streaming_op->start_checkpoint = CurrentCheckpoint();
+    streaming_op->writer =
+        partition_writer_->CreateReplaceOperationWriter(operation);
+    if (!streaming_op->writer)
+      return HandleOpResult(false, op_name.c_str(), error);
+    streaming_op->resumable = IsResumableStreamingOperation(operation);
+    streaming_op_ = std::move(streaming_op);
+  }
+  streaming_op_->timer.Resume();
+
+  // On failure |streaming_op_| is kept, so the progress is still checkpointed
+  // from before this operation, or its last block checkpointed.
+  const size_t len = min<uint64_t>(
+      *count_p, operation.data_length() - streaming_op_->bytes_written);
+  // The data up to the last block boundary is written first, so that the
+  // progress can be checkpointed there.
+  size_t first_len = len;
+  if (streaming_op_->resumable) {
+    const uint64_t block_end =
+        (streaming_op_->bytes_written + len) / block_size_ * block_size_;
+    if (block_end > streaming_op_->bytes_written)
+      first_len = block_end - streaming_op_->bytes_written;
+  }
+  if (!WriteStreamedData(bytes_p, count_p, first_len) ||
+      !WriteStreamedData(bytes_p, count_p, len - first_len)) {
+    return HandleOpResult(false, op_name.c_str(), error);
+  }
+  if (streaming_op_->bytes_written < operation.data_length()) {
+    streaming_op_->timer.Pause();
+    return true;
+  }
+
+  // All the data was written, release the writer before the operation is
+  // considered complete.
+  streaming_op_->writer.reset();
+  if (!streaming_op_->hash_calculator.Finalize()) {
+    *error = ErrorCode::kDownloadOperationHashVerificationError;
+    return false;
+  }
+  *error = ValidateOperationHash(operation,
+                                 &streaming_op_->hash_calculator.raw_hash());
+  if (*error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return false;
+    }
+    LOG(WARNING) << "Ignoring operation validation errors";
+    *error = ErrorCode::kSuccess;
+  }
+  if (operation_metrics_) {
+    operation_metrics_->Record(
+        operation,
+        block_size_,
+        streaming_op_->timer,
+        partitions_[current_partition_].partition_name());
+  }
+  streaming_op_.reset();
+  return true;
+}
+
+bool DeltaPerformer::WriteStreamedData(const char** bytes_p,
+                                       size_t* count_p,
+                                       size_t len) {
+  if (len == 0)
+    return true;
+  const char* bytes = *bytes_p;
+  TEST_AND_RETURN_FALSE(streaming_op_->writer->Write(bytes, len) &&
+                        streaming_op_->hash_calculator.Update(bytes, len));
+  // Same as DiscardBuffer() for bytes that went through |buffer_|.
+  payload_hash_calculator_.Update(bytes, len);
+  signed_hash_calculator_.Update(bytes, len);
+  payload_chunk_verifier_.Update(bytes, len);
+  buffer_offset_ += len;
+  streaming_op_->bytes_written += len;
+  *bytes_p += len;
+  *count_p -= len;
+
+  if (!streaming_op_->resumable || streaming_op_->bytes_written % block_size_)
+    return true;
+  UpdateCheckpoint& checkpoint = streaming_op_->start_checkpoint;
+  checkpoint.next_operation_num = next_operation_num_;
+  checkpoint.next_data_offset = buffer_offset_;
+  checkpoint.sha256_context = payload_hash_calculator_.GetContext();
+  checkpoint.signed_sha256_context = signed_hash_calculator_.GetContext();
+  checkpoint.operation_bytes_written = streaming_op_->bytes_written;
+  checkpoint.operation_sha256_context =
+      streaming_op_->hash_calculator.GetContext();
+  CheckpointUpdateProgress(false);
+  return true;
+}
+
+bool DeltaPerformer::IsResumableStreamingOperation(
+    const InstallOperation& operation) const {
+  // The checkpoints of the scheduled operations are taken in order of
+  // completion instead.
+  return operation.type() == InstallOperation::REPLACE &&
+         stream_replace_ops_ && !operation_scheduler_;
+}
+
+bool DeltaPerformer::ResumeStreamingOperation(
+    const InstallOperation& operation, ErrorCode* error) {
+  const uint64_t bytes_written = resume_operation_bytes_;
+  if (operation.type() != InstallOperation::REPLACE ||
+      bytes_written % block_size_ ||
+      bytes_written >= operation.data_length() ||
+      operation.data_offset() + bytes_written != buffer_offset_) {
+    LOG(ERROR) << "Unable to resume operation " << next_operation_num_
+               << " after " << bytes_written << " bytes of its data.";
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
+  auto streaming_op = std::make_unique<StreamingOperation>();
+  if (!streaming_op->hash_calculator.SetContext(
+          resume_operation_hash_context_)) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
+  streaming_op->start_checkpoint = CurrentCheckpoint();
+
+  // Write the rest of the data to the blocks after the ones written.
+  InstallOperation remaining = operation;
+  remaining.clear_dst_extents();
+  uint64_t blocks_to_skip = bytes_written / block_size_;
+  for (const Extent& extent : operation.dst_extents()) {
+    const uint64_t skipped = min(blocks_to_skip, extent.num_blocks());
+    blocks_to_skip -= skipped;
+    if (skipped == extent.num_blocks())
+      continue;
+    Extent* remaining_extent = remaining.add_dst_extents();
+    remaining_extent->set_start_block(extent.start_block() + skipped);
+    remaining_extent->set_num_blocks(extent.num_blocks() - skipped);
+  }
+  remaining.set_data_offset(buffer_offset_);
+  remaining.set_data_length(operation.data_length() - bytes_written);
+  streaming_op->writer =
+      partition_writer_->CreateReplaceOperationWriter(remaining);
+  if (!streaming_op->writer)
+    return HandleOpResult(false, "REPLACE", error);
+  streaming_op->bytes_written = bytes_written;
+  // The operation may be resumed again if it still streams in this attempt.
+  streaming_op->resumable = IsResumableStreamingOperation(operation);
+  streaming_op_ = std::move(streaming_op);
+  LOG(INFO) << "Resuming operation " << next_operation_num_ << " after "
+            << bytes_written << " of its " << operation.data_length()
+            << " bytes.";
+  resume_operation_bytes_ = 0;
+  resume_operation_hash_context_.clear();
   return true;
 }
 
@@ -907,6 +1833,65 @@ bool DeltaPerformer::PerformSourceCopyOperation(
   return partition_writer_->PerformSourceCopyOperation(operation, error);
 }
 
+bool DeltaPerformer::ShouldBatchOperation(
+    const InstallOperation& operation) const {
+  // The operations of a batch are neither measured, checked for being applied
+  // nor scheduled on their own.
+  if (operation_scheduler_ || operation_metrics_ || check_applied_operations_)
+    return false;
+  if (operation.has_data_offset() || operation.has_data_length())
+    return false;
+  switch (operation.type()) {
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+    case InstallOperation::SOURCE_COPY:
+      return utils::BlocksInExtents(operation.dst_extents()) <=
+             kMaxBatchedOperationBlocks;
+    default:
+      return false;
+  }
+}
+
+bool DeltaPerformer::PerformBatchedOperations(ErrorCode* error) {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  const size_t first_operation = GetPartitionOperationNum();
+  std::vector<PartitionWriterInterface::OperationWithData> batch;
+  uint64_t num_blocks = 0;
+  while (batch.size() < kMaxBatchedOperations &&
+         first_operation + batch.size() <
+             static_cast<size_t>(partition.operations_size())) {
+    const InstallOperation& operation =
+        partition.operations(first_operation + batch.size());
+    const uint64_t operation_blocks =
+        utils::BlocksInExtents(operation.dst_extents());
+    // The first operation was already checked and started.
+    if (!batch.empty()) {
+      if (!ShouldBatchOperation(operation) ||
+          num_blocks + operation_blocks > kMaxBatchedBlocks) {
+        break;
+      }
+      if (source_cache_warmer_)
+        source_cache_warmer_->OperationStarted(next_operation_num_ +
+                                               batch.size());
+    }
+    if (operation.has_src_length())
+      TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
+    if (operation.has_dst_length())
+      TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
+    batch.push_back({&operation});
+    num_blocks += operation_blocks;
+  }
+
+  base::TimeTicks start_time = base::TimeTicks::Now();
+  ScopedTrace trace("BATCH");
+  const bool result = partition_writer_->PerformOperations(batch, error);
+  OP_DURATION_HISTOGRAM("BATCH", start_time);
+  if (!HandleOpResult(result, "batched", error))
+    return false;
+  next_operation_num_ += batch.size();
+  return true;
+}
+
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
     const RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
@@ -933,29 +1918,145 @@ bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(op_data_shared_ ||
+                        buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(op_data_size_ >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
+      operation, error, op_data_, op_data_size_));
+  DiscardOperationData();
+  return true;
+}
+
+bool DeltaPerformer::ScheduleInstallOperation(const InstallOperation& operation,
+                                              ErrorCode* error) {
+  if (operation.has_src_length())
+    TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
+  if (operation.has_dst_length())
+    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
+
+  // The data is hashed and released from |buffer_| right away, so the next
+  // operation can be downloaded while this one waits to be applied.
+  auto data = std::make_shared<brillo::Blob>();
+  if (operation.has_data_offset() || operation.has_data_length()) {
+    TEST_AND_RETURN_FALSE(op_data_shared_ ||
+                          buffer_offset_ == operation.data_offset());
+    TEST_AND_RETURN_FALSE(op_data_size_ >= operation.data_length());
+    DiscardOperationData(data.get());
+  }
+  // Released with the task once the operation is applied.
+  auto data_memory = std::make_shared<MemoryCharge>(
+      MemoryTag::kScheduledOperations, data->capacity());
+
+  const size_t next_partition_operation_num = GetPartitionOperationNum() + 1;
+  ScheduledPartition* partition = scheduled_partitions_.back().get();
+  if (!operation_scheduler_->Schedule(
+          operation,
+          [this,
+           partition,
+           &operation,
+           data,
+           data_memory,
+           next_partition_operation_num](size_t worker_index,
+                                         ErrorCode* error) {
+            return PerformScheduledOperation(partition,
+                                             worker_index,
+                                             operation,
+                                             *data,
+                                             next_partition_operation_num,
+                                             error);
+          },
+          error)) {
+    return HandleOpResult(false, "scheduled", error);
+  }
+  UpdateCheckpoint checkpoint = CurrentCheckpoint();
+  checkpoint.next_operation_num++;
+  pending_checkpoints_.push_back(std::move(checkpoint));
+  // Release the partitions left in the background as soon as they're done.
+  return FinishCompletedPartitions(error);
+}
+
+bool DeltaPerformer::PerformScheduledOperation(
+    ScheduledPartition* partition,
+    size_t worker_index,
+    const InstallOperation& operation,
+    const brillo::Blob& data,
+    size_t next_partition_operation_num,
+    ErrorCode* error) {
+  PartitionWriterInterface* writer =
+      partition->worker_writers[worker_index].get();
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  InstallOperationTimer op_timer;
+  const string op_name = InstallOperationTypeName(operation.type());
+  ScopedTrace op_trace(op_name);
+  bool op_result{};
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      op_result =
+          writer->PerformReplaceOperation(operation, data.data(), data.size());
+      OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
+      break;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      op_result = writer->PerformZeroOrDiscardOperation(operation);
+      OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
+      break;
+    case InstallOperation::SOURCE_COPY:
+      op_result = writer->PerformSourceCopyOperation(operation, error);
+      OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      op_result = writer->PerformDiffOperation(
+          operation, error, data.data(), data.size());
+      OP_DURATION_HISTOGRAM(op_name, op_start_time);
+      break;
+    default:
+      op_result = false;
+  }
+  if (!op_result) {
+    LOG(ERROR) << "Failed to perform " << op_name << " operation "
+               << next_partition_operation_num - 1 << " in partition \""
+               << partitions_[partition->partition_index].partition_name()
+               << "\"";
+    if (*error == ErrorCode::kSuccess)
+      *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
+  }
+  if (operation_metrics_) {
+    operation_metrics_->Record(
+        operation,
+        block_size_,
+        op_timer,
+        partitions_[partition->partition_index].partition_name());
+  }
+  // Operations depending on this one may run on other workers, make sure they
+  // see what this one wrote.
+  writer->CheckpointUpdateProgress(next_partition_operation_num);
   return true;
 }
 
 bool DeltaPerformer::ExtractSignatureMessage() {
   TEST_AND_RETURN_FALSE(signatures_message_data_.empty());
-  TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_.signatures_size());
+  TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_->signatures_offset());
+  TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_->signatures_size());
   signatures_message_data_.assign(
-      buffer_.begin(), buffer_.begin() + manifest_.signatures_size());
+      buffer_.begin(), buffer_.begin() + manifest_->signatures_size());
 
   LOG(INFO) << "Extracted signature data of size "
-            << manifest_.signatures_size() << " at "
-            << manifest_.signatures_offset();
+            << manifest_->signatures_size() << " at "
+            << manifest_->signatures_offset();
   return true;
 }
 
@@ -1004,8 +2105,8 @@ DeltaPerformer::CreatePayloadVerifier() {
 ErrorCode DeltaPerformer::ValidateManifest() {
   // Perform assorted checks to validation check the manifest, make sure it
   // matches data from other sources, and that it is a supported version.
-  bool has_old_fields = std::any_of(manifest_.partitions().begin(),
-                                    manifest_.partitions().end(),
+  bool has_old_fields = std::any_of(manifest_->partitions().begin(),
+                                    manifest_->partitions().end(),
                                     [](const PartitionUpdate& partition) {
                                       return partition.has_old_partition_info();
                                     });
@@ -1014,7 +2115,7 @@ ErrorCode DeltaPerformer::ValidateManifest() {
   // update. Also, always treat the partial update as delta so that we can
   // perform the minor version check correctly.
   InstallPayloadType actual_payload_type =
-      (has_old_fields || manifest_.partial_update())
+      (has_old_fields || manifest_->partial_update())
           ? InstallPayloadType::kDelta
           : InstallPayloadType::kFull;
 
@@ -1034,18 +2135,18 @@ ErrorCode DeltaPerformer::ValidateManifest() {
   // Check that the minor version is compatible.
   // TODO(xunchang) increment minor version & add check for partial update
   if (actual_payload_type == InstallPayloadType::kFull) {
-    if (manifest_.minor_version() != kFullPayloadMinorVersion) {
+    if (manifest_->minor_version() != kFullPayloadMinorVersion) {
       LOG(ERROR) << "Manifest contains minor version "
-                 << manifest_.minor_version()
+                 << manifest_->minor_version()
                  << ", but all full payloads should have version "
                  << kFullPayloadMinorVersion << ".";
       return ErrorCode::kUnsupportedMinorPayloadVersion;
     }
   } else {
-    if (manifest_.minor_version() < kMinSupportedMinorPayloadVersion ||
-        manifest_.minor_version() > kMaxSupportedMinorPayloadVersion) {
+    if (manifest_->minor_version() < kMinSupportedMinorPayloadVersion ||
+        manifest_->minor_version() > kMaxSupportedMinorPayloadVersion) {
       LOG(ERROR) << "Manifest contains minor version "
-                 << manifest_.minor_version()
+                 << manifest_->minor_version()
                  << " not in the range of supported minor versions ["
                  << kMinSupportedMinorPayloadVersion << ", "
                  << kMaxSupportedMinorPayloadVersion << "].";
@@ -1068,6 +2169,11 @@ ErrorCode DeltaPerformer::ValidateManifest() {
     }
   }
 
+  if (!payload_chunk_verifier_.Init(*manifest_)) {
+    LOG(ERROR) << "Invalid payload chunk hashes in the manifest.";
+    return ErrorCode::kDownloadManifestParseError;
+  }
+
   // TODO(crbug.com/37661) we should be adding more and more manifest checks,
   // such as partition boundaries, etc.
 
@@ -1076,8 +2182,8 @@ ErrorCode DeltaPerformer::ValidateManifest() {
 
 ErrorCode DeltaPerformer::CheckTimestampError() const {
   bool is_partial_update =
-      manifest_.has_partial_update() && manifest_.partial_update();
-  const auto& partitions = manifest_.partitions();
+      manifest_->has_partial_update() && manifest_->partial_update();
+  const auto& partitions = manifest_->partitions();
 
   // Check version field for a given PartitionUpdate object. If an error
   // is encountered, set |error_code| accordingly. If downgrade is detected,
@@ -1142,11 +2248,11 @@ ErrorCode DeltaPerformer::CheckTimestampError() const {
   }
 
   // For non-partial updates, check max_timestamp first.
-  if (manifest_.max_timestamp() < hardware_->GetBuildTimestamp()) {
+  if (manifest_->max_timestamp() < hardware_->GetBuildTimestamp()) {
     LOG(ERROR) << "The current OS build timestamp ("
                << hardware_->GetBuildTimestamp()
                << ") is newer than the maximum timestamp in the manifest ("
-               << manifest_.max_timestamp() << ")";
+               << manifest_->max_timestamp() << ")";
     return ErrorCode::kPayloadTimestampError;
   }
   // Otherwise... partitions can have empty timestamps.
@@ -1165,7 +2271,7 @@ ErrorCode DeltaPerformer::CheckTimestampError() const {
 }
 
 ErrorCode DeltaPerformer::ValidateOperationHash(
-    const InstallOperation& operation) {
+    const InstallOperation& operation, const brillo::Blob* calculated_op_hash) {
   if (!operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation
@@ -1185,8 +2291,8 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
     // that doesn't have a hash at the time the manifest is created. So we
     // should not complaint about that operation. This operation can be
     // recognized by the fact that it's offset is mentioned in the manifest.
-    if (manifest_.signatures_offset() &&
-        manifest_.signatures_offset() == operation.data_offset()) {
+    if (manifest_->signatures_offset() &&
+        manifest_->signatures_offset() == operation.data_offset()) {
       LOG(INFO) << "Skipping hash verification for signature operation "
                 << next_operation_num_ + 1;
     } else {
@@ -1207,21 +2313,24 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
                           (operation.data_sha256_hash().data() +
                            operation.data_sha256_hash().size()));
 
-  brillo::Blob calculated_op_hash;
-  if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
-    return ErrorCode::kDownloadOperationHashVerificationError;
+  brillo::Blob buffer_op_hash;
+  if (!calculated_op_hash) {
+    if (!HashCalculator::RawHashOfBytes(
+            op_data_, operation.data_length(), &buffer_op_hash)) {
+      LOG(ERROR) << "Unable to compute actual hash of operation "
+                 << next_operation_num_;
+      return ErrorCode::kDownloadOperationHashVerificationError;
+    }
+    calculated_op_hash = &buffer_op_hash;
   }
 
-  if (calculated_op_hash != expected_op_hash) {
+  if (*calculated_op_hash != expected_op_hash) {
     LOG(ERROR) << "Hash verification failed for operation "
                << next_operation_num_
                << ". Expected hash = " << HexEncode(expected_op_hash);
     LOG(ERROR) << "Calculated hash over " << operation.data_length()
                << " bytes at offset: " << operation.data_offset() << " = "
-               << HexEncode(calculated_op_hash);
+               << HexEncode(*calculated_op_hash);
     return ErrorCode::kDownloadOperationHashMismatch;
   }
 
@@ -1288,7 +2397,8 @@ ErrorCode DeltaPerformer::VerifyPayload(
 }
 
 void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
-                                   size_t signed_hash_buffer_size) {
+                                   size_t signed_hash_buffer_size,
+                                   brillo::Blob* discarded) {
   // Update the buffer offset.
   if (do_advance_offset)
     buffer_offset_ += buffer_.size();
@@ -1296,16 +2406,54 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
   // Hash the content.
   payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
   signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  // Only the data blobs are hashed in chunks, not the metadata.
+  if (do_advance_offset)
+    payload_chunk_verifier_.Update(buffer_.data(), buffer_.size());
 
+  if (discarded) {
+    discarded->swap(buffer_);
+    buffer_memory_.Set(buffer_.capacity());
+    return;
+  }
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
+  buffer_memory_.Set(0);
+}
+
+void DeltaPerformer::DiscardOperationData(brillo::Blob* discarded) {
+  if (op_data_shared_) {
+    // The data was received and hashed with a previous operation.
+    if (discarded)
+      discarded->assign(op_data_, op_data_ + op_data_size_);
+    auto uses = shared_blob_uses_.find(shared_op_data_offset_);
+    if (uses != shared_blob_uses_.end() && --uses->second == 0) {
+      shared_blob_uses_.erase(uses);
+      shared_blobs_.erase(shared_op_data_offset_);
+    }
+  } else if (!op_data_in_place_) {
+    DiscardBuffer(true, buffer_.size(), discarded);
+  } else {
+    // The scheduled operations outlive the bytes passed to Write().
+    if (discarded)
+      discarded->assign(op_data_, op_data_ + op_data_size_);
+    payload_hash_calculator_.Update(op_data_, op_data_size_);
+    signed_hash_calculator_.Update(op_data_, op_data_size_);
+    payload_chunk_verifier_.Update(op_data_, op_data_size_);
+    buffer_offset_ += op_data_size_;
+  }
+  op_data_ = nullptr;
+  op_data_size_ = 0;
+  op_data_in_place_ = false;
+  op_data_shared_ = false;
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      const string& update_check_response_hash) {
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!(prefs->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) &&
-        next_operation != kUpdateStateOperationInvalid && next_operation > 0)) {
+        next_operation != kUpdateStateOperationInvalid &&
+        (next_operation > 0 ||
+         (next_operation == 0 && HasOperationBytesWritten(prefs))))) {
     LOG(WARNING) << "Failed to resume update " << kPrefsUpdateStateNextOperation
                  << " invalid: " << next_operation;
     return false;
@@ -1375,6 +2523,8 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
+    prefs->Delete(kPrefsUpdateStateOperationBytesWritten);
+    prefs->Delete(kPrefsUpdateStateOperationSHA256Context);
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
@@ -1383,6 +2533,10 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
+    prefs->Delete(kPrefsVerifierStatePartitionIndex);
+    prefs->Delete(kPrefsVerifierStateOffset);
+    prefs->Delete(kPrefsVerifierStateSHA256Context);
+    prefs->Delete(kPrefsUncompressedCow);
 
     LOG(INFO) << "Resetting recorded hash for prepared partitions.";
     prefs->Delete(kPrefsDynamicPartitionMetadataUpdated);
@@ -1403,8 +2557,56 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  const UpdateCheckpoint checkpoint = GetCheckpoint(force);
   Terminator::set_exit_blocked(true);
-  if (last_updated_operation_num_ != next_operation_num_ || force) {
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  // Sync the partition before the transaction, which blocks every other
+  // access to |prefs_| until it's submitted.
+  if (CheckpointChanged(checkpoint, force))
+    CheckpointPartitionWriter(checkpoint.next_operation_num);
+  // Commit all the keys with a single write when the prefs support it. If
+  // they don't, the progress is reset first and the next operation written
+  // last, so a partially written checkpoint is never used.
+  const bool in_transaction = prefs_->StartTransaction();
+  if (!WriteCheckpoint(checkpoint, force)) {
+    if (in_transaction)
+      prefs_->CancelTransaction();
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(!in_transaction || prefs_->SubmitTransaction());
+  last_updated_operation_num_ = checkpoint.next_operation_num;
+  last_updated_operation_bytes_ = checkpoint.operation_bytes_written;
+  UpdateCheckpointWait(base::TimeTicks::Now() - start_time);
+  return true;
+}
+
+bool DeltaPerformer::CheckpointChanged(const UpdateCheckpoint& checkpoint,
+                                       bool force) const {
+  return last_updated_operation_num_ != checkpoint.next_operation_num ||
+         last_updated_operation_bytes_ != checkpoint.operation_bytes_written ||
+         force;
+}
+
+void DeltaPerformer::CheckpointPartitionWriter(size_t next_operation_num) {
+  const size_t partition_start =
+      current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
+  if (partition_writer_) {
+    if (next_operation_num >= partition_start) {
+      partition_writer_->CheckpointUpdateProgress(next_operation_num -
+                                                  partition_start);
+    }
+  } else {
+    CHECK_EQ(next_operation_num, num_total_operations_)
+        << "Partition writer is null, we are expected to finish all "
+           "operations: "
+        << next_operation_num << "/" << num_total_operations_;
+  }
+}
+
+bool DeltaPerformer::WriteCheckpoint(const UpdateCheckpoint& checkpoint,
+                                     bool force) {
+  const size_t next_operation_num = checkpoint.next_operation_num;
+  if (CheckpointChanged(checkpoint, force)) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
     if (!signatures_message_data_.empty()) {
@@ -1422,22 +2624,30 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
                                 signatures_message_data_))
           << "Unable to store the signature blob.";
     }
-    TEST_AND_RETURN_FALSE(prefs_->SetString(
-        kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
+    TEST_AND_RETURN_FALSE(prefs_->SetString(kPrefsUpdateStateSHA256Context,
+                                            checkpoint.sha256_context));
     TEST_AND_RETURN_FALSE(
         prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
-                          signed_hash_calculator_.GetContext()));
+                          checkpoint.signed_sha256_context));
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
+                                           checkpoint.next_data_offset));
     TEST_AND_RETURN_FALSE(
-        prefs_->SetInt64(kPrefsUpdateStateNextDataOffset, buffer_offset_));
-    last_updated_operation_num_ = next_operation_num_;
-
-    if (next_operation_num_ < num_total_operations_) {
-      size_t partition_index = current_partition_;
-      while (next_operation_num_ >= acc_num_operations_[partition_index]) {
-        partition_index++;
-      }
+        prefs_->SetInt64(kPrefsUpdateStateOperationBytesWritten,
+                         checkpoint.operation_bytes_written));
+    TEST_AND_RETURN_FALSE(
+        prefs_->SetString(kPrefsUpdateStateOperationSHA256Context,
+                          checkpoint.operation_sha256_context));
+
+    if (next_operation_num < num_total_operations_) {
+      // The checkpointed operation may belong to a previous partition still
+      // applied in the background.
+      const size_t partition_index =
+          std::upper_bound(acc_num_operations_.begin(),
+                           acc_num_operations_.end(),
+                           next_operation_num) -
+          acc_num_operations_.begin();
       const size_t partition_operation_num =
-          next_operation_num_ -
+          next_operation_num -
           (partition_index ? acc_num_operations_[partition_index - 1] : 0);
       const InstallOperation& op =
           partitions_[partition_index].operations(partition_operation_num);
@@ -1447,26 +2657,65 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       TEST_AND_RETURN_FALSE(
           prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
     }
-    if (partition_writer_) {
-      partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
-    } else {
-      CHECK_EQ(next_operation_num_, num_total_operations_)
-          << "Partition writer is null, we are expected to finish all "
-             "operations: "
-          << next_operation_num_ << "/" << num_total_operations_;
-    }
   }
   TEST_AND_RETURN_FALSE(
-      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num));
   return true;
 }
 
+void DeltaPerformer::UpdateCheckpointWait(base::TimeDelta checkpoint_cost) {
+  // Smooth out the cost so that a single slow write doesn't space the next
+  // checkpoints too much.
+  checkpoint_cost_ = checkpoint_cost_.is_zero()
+                         ? checkpoint_cost
+                         : (checkpoint_cost_ * 3 + checkpoint_cost) / 4;
+  update_checkpoint_wait_ = std::clamp(
+      checkpoint_cost_ * kCheckpointCostRatio,
+      base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds),
+      base::TimeDelta::FromSeconds(kMaxCheckpointIntervalSeconds));
+}
+
+DeltaPerformer::UpdateCheckpoint DeltaPerformer::GetCheckpoint(bool wait) {
+  if (!operation_scheduler_)
+    return CurrentCheckpoint();
+
+  if (wait) {
+    ErrorCode error = ErrorCode::kSuccess;
+    // A failure only means the progress stops at the failed operation.
+    operation_scheduler_->Wait(&error);
+  }
+  const size_t num_completed = first_scheduled_operation_num_ +
+                               operation_scheduler_->num_completed_in_order();
+  while (!pending_checkpoints_.empty() &&
+         pending_checkpoints_.front().next_operation_num <= num_completed) {
+    last_completed_checkpoint_ = std::move(pending_checkpoints_.front());
+    pending_checkpoints_.pop_front();
+  }
+  return last_completed_checkpoint_;
+}
+
+DeltaPerformer::UpdateCheckpoint DeltaPerformer::CurrentCheckpoint() const {
+  if (streaming_op_)
+    return streaming_op_->start_checkpoint;
+  UpdateCheckpoint checkpoint;
+  checkpoint.next_operation_num = next_operation_num_;
+  checkpoint.next_data_offset = buffer_offset_;
+  checkpoint.sha256_context = payload_hash_calculator_.GetContext();
+  checkpoint.signed_sha256_context = signed_hash_calculator_.GetContext();
+  // An operation resumed from the middle of its data but not started again
+  // yet.
+  checkpoint.operation_bytes_written = resume_operation_bytes_;
+  checkpoint.operation_sha256_context = resume_operation_hash_context_;
+  return checkpoint;
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
 
   int64_t next_operation = kUpdateStateOperationInvalid;
   if (!prefs_->GetInt64(kPrefsUpdateStateNextOperation, &next_operation) ||
-      next_operation == kUpdateStateOperationInvalid || next_operation <= 0) {
+      next_operation == kUpdateStateOperationInvalid || next_operation < 0 ||
+      (next_operation == 0 && !HasOperationBytesWritten(prefs_))) {
     // Initiating a new update, no more state needs to be initialized.
     return true;
   }
@@ -1478,6 +2727,20 @@ bool DeltaPerformer::PrimeUpdateState() {
       prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset) &&
       next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
+  payload_chunk_verifier_.Restart(buffer_offset_);
+
+  // The update may have been interrupted in the middle of a streamed
+  // operation, which then continues after the blocks already written.
+  int64_t operation_bytes_written = 0;
+  if (prefs_->GetInt64(kPrefsUpdateStateOperationBytesWritten,
+                       &operation_bytes_written) &&
+      operation_bytes_written > 0) {
+    TEST_AND_RETURN_FALSE(
+        prefs_->GetString(kPrefsUpdateStateOperationSHA256Context,
+                          &resume_operation_hash_context_) &&
+        !resume_operation_hash_context_.empty());
+    resume_operation_bytes_ = operation_bytes_written;
+  }
 
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
@@ -19,24 +19,37 @@
 
 #include <inttypes.h>
 
+#include <deque>
 #include <limits>
+#include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/callback.h>
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/blob_cache.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/install_operation_metrics.h"
+#include "update_engine/payload_consumer/install_operation_scheduler.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
+#include "update_engine/payload_consumer/payload_chunk_verifier.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/source_cache_warmer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -62,6 +75,8 @@ class DeltaPerformer : public FileWriter {
   // operations. They must add up to one hundred (100).
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
+  // Minimum interval between two update checkpoints. It grows with the
+  // measured cost of writing a checkpoint, see UpdateCheckpointWait().
   static const uint64_t kCheckpointFrequencySeconds;
 
   DeltaPerformer(
@@ -111,6 +126,10 @@ class DeltaPerformer : public FileWriter {
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
+  // Returns the sorted offsets in the payload of the ends of the data blobs of
+  // the operations, or nothing until the manifest is valid.
+  std::vector<uint64_t> GetOperationDataEnds() const;
+
   // Verifies the downloaded payload against the signed hash included in the
   // payload, against the update check hash and size using the public key and
   // returns ErrorCode::kSuccess on success, an error code on failure.
@@ -161,6 +180,47 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // Replaces the delegate asked whether to cancel the update before each
+  // operation. May be nullptr, for when Write() runs on a thread other than
+  // the one the delegate lives on.
+  void set_download_delegate(DownloadActionDelegate* download_delegate) {
+    download_delegate_ = download_delegate;
+  }
+
+  // Records the resources used by every applied operation into
+  // |operation_metrics|, which must outlive this object. May be nullptr.
+  void set_operation_metrics(InstallOperationMetrics* operation_metrics) {
+    operation_metrics_ = operation_metrics;
+  }
+
+  // Times the manifest, the partition preparation and the apply of each
+  // partition in |phase_metrics|, which must outlive this object. May be
+  // nullptr.
+  void set_phase_metrics(PhaseMetrics* phase_metrics) {
+    phase_metrics_ = phase_metrics;
+  }
+
+  // Calls |callback| with the name of each partition of the payload once all
+  // of its operations are applied, in the order of the partitions. This
+  // includes the partitions applied before resuming. Runs on the thread
+  // calling Write().
+  void set_partition_applied_callback(
+      base::RepeatingCallback<void(const std::string&)> callback) {
+    partition_applied_callback_ = std::move(callback);
+  }
+
+  // Stores the metadata and the verified data of the applied operations in
+  // |blob_cache|, which must outlive this object. May be nullptr.
+  void set_blob_cache(BlobCache* blob_cache) { blob_cache_ = blob_cache; }
+
+  // Once the manifest is valid, looks up the data of the operations not
+  // received yet in the blob cache. If some is found, it's read from the cache
+  // instead of being passed to Write(), and |ranges| is set to the (offset,
+  // length) ranges of the rest of the payload, which Write() still expects in
+  // order. Otherwise returns false.
+  bool UseCachedOperationData(
+      std::vector<std::pair<uint64_t, uint64_t>>* ranges);
+
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
@@ -179,13 +239,19 @@ class DeltaPerformer : public FileWriter {
   // on the payload at least once (to update in-memory flags) before writing
   // (applying) the payload.
   // If error due to insufficient space, |required_size| is set to the required
-  // size on the device to apply the payload.
+  // size on the device to apply the payload. Unless nullptr, |blob_cache| is
+  // first limited to the free space the COW of |manifest| doesn't need.
+  // With |adaptive_vabc_compression|, |manifest| is changed to an uncompressed
+  // COW if the free space was enough for one when the partitions were first
+  // prepared for this payload.
   static bool PreparePartitionsForUpdate(
       PrefsInterface* prefs,
       BootControlInterface* boot_control,
       BootControlInterface::Slot target_slot,
-      const DeltaArchiveManifest& manifest,
+      DeltaArchiveManifest* manifest,
       const std::string& update_check_response_hash,
+      bool adaptive_vabc_compression,
+      BlobCache* blob_cache,
       uint64_t* required_size);
 
  protected:
@@ -208,6 +274,24 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
+  FRIEND_TEST(DeltaPerformerTest, StreamedReplaceOperationTest);
+  FRIEND_TEST(DeltaPerformerTest, ResumeStreamedReplaceOperationTest);
+  FRIEND_TEST(DeltaPerformerTest, SkipAppliedOperationsTest);
+  FRIEND_TEST(DeltaPerformerTest, CheckpointWaitFollowsCostTest);
+  FRIEND_TEST(DeltaPerformerTest, SharedDataBlobTest);
+  FRIEND_TEST(DeltaPerformerTest, CachedOperationDataTest);
+
+  // The update progress saved to prefs by CheckpointUpdateProgress().
+  struct UpdateCheckpoint {
+    size_t next_operation_num{0};
+    uint64_t next_data_offset{0};
+    std::string sha256_context;
+    std::string signed_sha256_context;
+    // The bytes of the data of operation |next_operation_num| already written
+    // when it's a streamed REPLACE, and the hash context of that data.
+    uint64_t operation_bytes_written{0};
+    std::string operation_sha256_context;
+  };
 
   // Obtain the operation index for current partition. If all operations for
   // current partition is are finished, return # of operations. This is mostly
@@ -226,6 +310,45 @@ class DeltaPerformer : public FileWriter {
   // and returns this number.
   size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
 
+  // Hashes the bytes of the metadata and its signature appended to |buffer_|
+  // from |offset|, as they're received, so that the manifest can be checked
+  // and parsed as soon as its last byte arrives.
+  void HashReceivedMetadata(size_t offset);
+
+  // Points |op_data_| to the data blob of |operation| and returns whether all
+  // of it was received. When nothing is buffered and |*bytes_p| holds the
+  // whole blob, it's used in place instead of being copied to |buffer_|.
+  // Advances |*bytes_p| and decreases |*count_p| by the bytes consumed.
+  bool GetOperationData(const InstallOperation& operation,
+                        const char** bytes_p,
+                        size_t* count_p);
+
+  // Reads the data of |operation| from |blob_cache_| into |buffer_| if it was
+  // picked by UseCachedOperationData(). Returns false and sets |error| if it
+  // can't be read.
+  bool ReadCachedOperationData(const InstallOperation& operation,
+                               ErrorCode* error);
+
+  // Counts the uses of the data blobs shared by several operations, from
+  // |next_operation_num_| on. When resuming an update, the blobs of the
+  // operations already applied must be in |blob_cache_|. Returns false if one
+  // isn't.
+  bool InitSharedDataBlobs();
+
+  // Starts |source_cache_warmer_| on the source partitions of a delta payload
+  // when install_plan_->source_warming_size is set.
+  void StartSourceCacheWarmer();
+
+  // Points |op_data_| to the data blob of |operation|, which was received with
+  // a previous operation sharing it. Returns false and sets |error| if the blob
+  // wasn't kept.
+  bool GetSharedOperationData(const InstallOperation& operation,
+                              ErrorCode* error);
+
+  // Keeps the data blob of |operation| in |op_data_| for the next operations
+  // sharing it, pinned in |blob_cache_| or else in memory.
+  void KeepSharedOperationData(const InstallOperation& operation);
+
   // If |op_result| is false, emits an error message using |op_type_name| and
   // sets |*error| accordingly. Otherwise does nothing. Returns |op_result|.
   bool HandleOpResult(bool op_result,
@@ -249,7 +372,10 @@ class DeltaPerformer : public FileWriter {
   // Validates that the hash of the blobs corresponding to the given |operation|
   // matches what's specified in the manifest in the payload.
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
-  ErrorCode ValidateOperationHash(const InstallOperation& operation);
+  // If |calculated_op_hash| is null, the hash is computed over |op_data_|.
+  ErrorCode ValidateOperationHash(
+      const InstallOperation& operation,
+      const brillo::Blob* calculated_op_hash = nullptr);
 
   // Returns true on success.
   bool PerformInstallOperation(const InstallOperation& operation);
@@ -258,12 +384,55 @@ class DeltaPerformer : public FileWriter {
   // |error| will be set if source hash mismatch, otherwise |error| might not be
   // set even if it fails.
   bool PerformReplaceOperation(const InstallOperation& operation);
+
+  // Returns whether the data of |operation| should be written to the
+  // partition as it's received, see StreamReplaceOperation().
+  bool ShouldStreamOperation(const InstallOperation& operation) const;
+
+  // Returns whether |operation|, the next one, can be skipped because its
+  // destination already holds the data it writes. Stops checking after the
+  // first operation that doesn't, see install_plan_->skip_applied_operations.
+  bool IsOperationApplied(const InstallOperation& operation);
+
+  // Passes up to |*count_p| bytes from |*bytes_p| of the data of the replace
+  // |operation| to |streaming_op_|, starting it if needed, and advances
+  // |*bytes_p| and |*count_p| accordingly. The bytes are hashed and added to
+  // |buffer_offset_| as if they went through |buffer_|. Once all the data was
+  // written, validates the operation hash and resets |streaming_op_|. Returns
+  // false and sets |error| on failure.
+  bool StreamReplaceOperation(const InstallOperation& operation,
+                              const char** bytes_p,
+                              size_t* count_p,
+                              ErrorCode* error);
+
+  // Writes |len| bytes from |*bytes_p| to |streaming_op_| for
+  // StreamReplaceOperation(), and checkpoints the progress within the
+  // operation when it is resumable and the data written ends on a block.
+  bool WriteStreamedData(const char** bytes_p, size_t* count_p, size_t len);
+
+  // Returns whether a streamed |operation| can be resumed from the middle of
+  // its data: uncompressed REPLACE operations can, as their data maps to the
+  // blocks written, but the state of the decompressors can't be saved.
+  bool IsResumableStreamingOperation(const InstallOperation& operation) const;
+
+  // Starts |streaming_op_| for |operation| after the bytes of its data written
+  // before the update was interrupted, from |resume_operation_bytes_|.
+  bool ResumeStreamingOperation(const InstallOperation& operation,
+                                ErrorCode* error);
   bool PerformZeroOrDiscardOperation(const InstallOperation& operation);
   bool PerformSourceCopyOperation(const InstallOperation& operation,
                                   ErrorCode* error);
   bool PerformDiffOperation(const InstallOperation& operation,
                             ErrorCode* error);
 
+  // Returns whether |operation| is a small operation without data, applied
+  // in a batch with the next ones by PerformBatchedOperations().
+  bool ShouldBatchOperation(const InstallOperation& operation) const;
+  // Applies the operation |next_operation_num_| and the ones following it in
+  // the current partition that can be batched with it, with one call to the
+  // partition writer, and moves |next_operation_num_| past them.
+  bool PerformBatchedOperations(ErrorCode* error);
+
   // Extracts the payload signature message from the current |buffer_| if the
   // offset matches the one specified by the manifest. Returns whether the
   // signature was extracted.
@@ -274,7 +443,97 @@ class DeltaPerformer : public FileWriter {
   // bytes in |buffer_|. Then discard the content, ensuring that memory is being
   // deallocated. If |do_advance_offset|, advances the internal offset counter
   // accordingly.
-  void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
+  // If |discarded| isn't null, the content is moved there instead.
+  void DiscardBuffer(bool do_advance_offset,
+                     size_t signed_hash_buffer_size,
+                     brillo::Blob* discarded = nullptr);
+
+  // Same as DiscardBuffer(true, ...) for the data blob of the current
+  // operation, which might not be in |buffer_|. If |discarded| isn't null, the
+  // data is moved or copied there.
+  void DiscardOperationData(brillo::Blob* discarded = nullptr);
+
+  // Whether the operations of partition |partition_index| can be applied in
+  // parallel when install_plan_->parallel_install_ops is set.
+  bool CanScheduleOperations(size_t partition_index);
+
+  // Starts applying the operations of the current partition on multiple
+  // threads, each with its own partition writer. Reuses |operation_scheduler_|
+  // if previous partitions are still applied on it. Leaves
+  // |operation_scheduler_| unset if the partition can't be updated in
+  // parallel, in which case operations are applied sequentially. Returns false
+  // only if that required finishing the previous partitions and it failed.
+  bool StartOperationScheduler(const PartitionUpdate& partition_update,
+                               const InstallPlan::Partition& install_part,
+                               bool is_dynamic_partition,
+                               bool source_may_exist);
+
+  // Waits for all the operations scheduled on |operation_scheduler_| to
+  // complete. Returns false and sets |error| if any of them failed.
+  bool WaitForScheduledOperations(ErrorCode* error);
+
+  // Called once all the operations of the current partition were received.
+  // When install_plan_->concurrent_partitions is set and the next partition
+  // can be applied in parallel too, the scheduled operations of this one keep
+  // running while the next one is downloaded. Otherwise waits for them and
+  // finishes the partition. Returns false and sets |error| on failure.
+  bool FinishCurrentPartition(ErrorCode* error);
+
+  // Finishes and closes the partitions left running by FinishCurrentPartition()
+  // whose operations all completed. Returns false and sets |error| on failure.
+  bool FinishCompletedPartitions(ErrorCode* error);
+
+  // Passes the partitions before |end| to |partition_applied_callback_|,
+  // except the ones still applied in the background and those after them.
+  void ReportAppliedPartitions(size_t end);
+
+  // Drops the scheduled operations that didn't start yet, waits for the
+  // running ones and closes the writers of all the scheduled partitions,
+  // including the ones left running in the background.
+  void CloseScheduledPartitions();
+
+  // Validates |operation| and schedules it on |operation_scheduler_|, taking
+  // its data out of |buffer_|.
+  bool ScheduleInstallOperation(const InstallOperation& operation,
+                                ErrorCode* error);
+
+  struct ScheduledPartition;
+
+  // Applies |operation| of |partition| with the partition writer of worker
+  // |worker_index|. Called from the |operation_scheduler_| threads.
+  bool PerformScheduledOperation(ScheduledPartition* partition,
+                                 size_t worker_index,
+                                 const InstallOperation& operation,
+                                 const brillo::Blob& data,
+                                 size_t next_partition_operation_num,
+                                 ErrorCode* error);
+
+  // Whether |checkpoint| differs from the last one written, or |force| is set.
+  bool CheckpointChanged(const UpdateCheckpoint& checkpoint, bool force) const;
+
+  // Makes the data written by |partition_writer_| up to |next_operation_num|
+  // durable, before the checkpoint pointing past it is written to |prefs_|.
+  void CheckpointPartitionWriter(size_t next_operation_num);
+
+  // Writes |checkpoint| to |prefs_|, |force| writes it even if the next
+  // operation didn't change since the last one.
+  bool WriteCheckpoint(const UpdateCheckpoint& checkpoint, bool force);
+
+  // Adjusts |update_checkpoint_wait_| after a checkpoint took
+  // |checkpoint_cost|, so that checkpoints only take a small fraction of the
+  // update time on slow storage.
+  void UpdateCheckpointWait(base::TimeDelta checkpoint_cost);
+
+  // Returns the progress that can be checkpointed. When operations are applied
+  // in parallel, this is the state right after the last operation that
+  // completed together with all the operations before it. If |wait|, waits for
+  // the scheduled operations first.
+  UpdateCheckpoint GetCheckpoint(bool wait);
+
+  // Returns the progress after all the operations up to
+  // |next_operation_num_| were applied. While an operation is streamed, this
+  // is the progress from before it started.
+  UpdateCheckpoint CurrentCheckpoint() const;
 
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
@@ -324,6 +583,19 @@ class DeltaPerformer : public FileWriter {
   // nullptr if not used.
   DownloadActionDelegate* download_delegate_;
 
+  // Where the applied operations are recorded, nullptr if they aren't.
+  InstallOperationMetrics* operation_metrics_{nullptr};
+  // Where the phases of the apply are timed, nullptr if they aren't.
+  PhaseMetrics* phase_metrics_{nullptr};
+
+  base::RepeatingCallback<void(const std::string&)> partition_applied_callback_;
+  // The number of partitions passed to |partition_applied_callback_|.
+  size_t num_applied_partitions_{0};
+
+  BlobCache* blob_cache_{nullptr};
+  // The data offsets of the operations which data is read from |blob_cache_|.
+  std::set<uint64_t> cached_data_offsets_;
+
   // Install Plan based on Omaha Response.
   InstallPlan* install_plan_;
 
@@ -332,9 +604,20 @@ class DeltaPerformer : public FileWriter {
 
   PayloadMetadata payload_metadata_;
 
+  // Returns the options of |manifest_arena_|, sized for manifests with many
+  // operations.
+  static google::protobuf::ArenaOptions ManifestArenaOptions();
+
+  // Owns |manifest_| and all of its sub-messages, which are allocated from a
+  // few large blocks and freed at once with the performer.
+  google::protobuf::Arena manifest_arena_{ManifestArenaOptions()};
+
   // Parsed manifest. Set after enough bytes to parse the manifest were
   // downloaded.
-  DeltaArchiveManifest manifest_;
+  DeltaArchiveManifest* manifest_{
+      google::protobuf::Arena::CreateMessage<DeltaArchiveManifest>(
+          &manifest_arena_)};
+  MemoryCharge manifest_memory_{MemoryTag::kManifest};
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
   uint64_t metadata_size_{0};
@@ -351,9 +634,10 @@ class DeltaPerformer : public FileWriter {
   size_t num_total_operations_{0};
 
   // The list of partitions to update as found in the manifest major
-  // version 2. When parsing an older manifest format, the information is
-  // converted over to this format instead.
-  std::vector<PartitionUpdate> partitions_;
+  // version 2, followed by the partitions generated for a partial update.
+  // These are the messages of |manifest_|, not copies.
+  const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions_{
+      manifest_->partitions()};
 
   // Index in the list of partitions (|partitions_| member) of the current
   // partition being processed.
@@ -367,11 +651,38 @@ class DeltaPerformer : public FileWriter {
   // payload metadata; once that's downloaded and parsed, it stores data for
   // the next update operation.
   brillo::Blob buffer_;
+  MemoryCharge buffer_memory_{MemoryTag::kPayloadBuffer};
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
-
-  // Last |next_operation_num_| value updated as part of the progress update.
+  // The data blob of the operation being applied, set by GetOperationData().
+  // Either the content of |buffer_|, or the bytes passed to Write() if
+  // |op_data_in_place_|.
+  const uint8_t* op_data_{nullptr};
+  size_t op_data_size_{0};
+  bool op_data_in_place_{false};
+  // Whether |op_data_| was read from |blob_cache_|.
+  bool op_data_from_cache_{false};
+  // Whether |op_data_| is the data blob at |shared_op_data_offset_|, shared
+  // with a previous operation.
+  bool op_data_shared_{false};
+  uint64_t shared_op_data_offset_{0};
+
+  // The number of operations left to apply with the data blob of a previous
+  // operation, by data offset.
+  std::map<uint64_t, size_t> shared_blob_uses_;
+  // The shared data blobs kept in memory until their last use, by data offset.
+  std::map<uint64_t, brillo::Blob> shared_blobs_;
+
+  // Last |next_operation_num_| value updated as part of the progress update,
+  // and the bytes of that operation written then.
   uint64_t last_updated_operation_num_{std::numeric_limits<uint64_t>::max()};
+  uint64_t last_updated_operation_bytes_{0};
+
+  // When resuming an update interrupted in the middle of a streamed
+  // operation, the bytes of its data already written and their hash context,
+  // until the operation is started again.
+  uint64_t resume_operation_bytes_{0};
+  std::string resume_operation_hash_context_;
 
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
@@ -384,6 +695,15 @@ class DeltaPerformer : public FileWriter {
   // the metadata and doesn't include the payload signature itself.
   HashCalculator signed_hash_calculator_;
 
+  // Calculates the hash of the metadata as it's received, checked against the
+  // metadata signature.
+  HashCalculator metadata_hash_calculator_;
+  uint64_t num_metadata_bytes_hashed_{0};
+
+  // Verifies the data blobs received against the chunk hashes of the
+  // manifest, if it has some.
+  PayloadChunkVerifier payload_chunk_verifier_;
+
   // Signatures message blob extracted directly from the payload.
   std::string signatures_message_data_;
 
@@ -414,14 +734,70 @@ class DeltaPerformer : public FileWriter {
       base::TimeDelta::FromSeconds(kProgressLogTimeoutSeconds)};
   base::TimeTicks forced_progress_log_time_;
 
-  // The frequency that we should write an update checkpoint (constant), and
-  // the point in time at which the next checkpoint should be written.
-  const base::TimeDelta update_checkpoint_wait_{
+  // The frequency that we should write an update checkpoint, and the point in
+  // time at which the next checkpoint should be written. The frequency is
+  // derived from |checkpoint_cost_|, the average time a checkpoint takes.
+  base::TimeDelta update_checkpoint_wait_{
       base::TimeDelta::FromSeconds(kCheckpointFrequencySeconds)};
   base::TimeTicks update_checkpoint_time_;
+  base::TimeDelta checkpoint_cost_;
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
 
+  // A partition whose operations are applied on |operation_scheduler_|.
+  struct ScheduledPartition {
+    size_t partition_index;
+    // Worker i of |operation_scheduler_| uses |worker_writers[i]|.
+    std::vector<std::unique_ptr<PartitionWriterInterface>> worker_writers;
+    // Set once the partition is no longer the current one but some of its
+    // operations are still running, see FinishCurrentPartition().
+    std::unique_ptr<PartitionWriterInterface> writer;
+  };
+  // In partition order, the back one is the current partition unless its
+  // |writer| is set. Declared before |operation_scheduler_| so the workers are
+  // stopped before the writers they use are destroyed.
+  std::deque<std::unique_ptr<ScheduledPartition>> scheduled_partitions_;
+
+  // Set while the operations of the current partition are applied in
+  // parallel, when install_plan_->parallel_install_ops is set. Shared with the
+  // partitions before it when install_plan_->concurrent_partitions is set.
+  std::unique_ptr<InstallOperationScheduler> operation_scheduler_;
+  // Value of |next_operation_num_| when |operation_scheduler_| was started.
+  size_t first_scheduled_operation_num_{0};
+  // Progress after each scheduled operation that isn't completed in order
+  // yet, and after the last one that is.
+  std::deque<UpdateCheckpoint> pending_checkpoints_;
+  UpdateCheckpoint last_completed_checkpoint_;
+
+  // Whether the data of large replace operations of the current partition is
+  // written as it's received. Set from install_plan_->stream_replace_ops for
+  // partitions that support it.
+  bool stream_replace_ops_{false};
+
+  // Whether the destination of the next operations is still compared to
+  // their target hashes, see IsOperationApplied().
+  bool check_applied_operations_{false};
+  // The number of the last operation found already applied.
+  std::optional<size_t> applied_operation_num_;
+  size_t num_skipped_operations_{0};
+  // The replace operation whose data is being written as it's received.
+  struct StreamingOperation {
+    std::unique_ptr<ExtentWriter> writer;
+    HashCalculator hash_calculator;
+    uint64_t bytes_written{0};
+    // Progress to checkpoint until the operation completes, advanced to the
+    // last block written when the operation is resumable.
+    bool resumable{false};
+    UpdateCheckpoint start_checkpoint;
+    // Only runs while the operation's data is being written.
+    InstallOperationTimer timer;
+  };
+  std::unique_ptr<StreamingOperation> streaming_op_;
+
+  // Reads the source extents of the next operations into the page cache while
+  // the payload downloads, may be null.
+  std::unique_ptr<SourceCacheWarmer> source_cache_warmer_;
+
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
 
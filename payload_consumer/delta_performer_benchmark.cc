@@ -0,0 +1,526 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmarks of applying full, delta and VABC payloads with DeltaPerformer,
+// on synthetic images and on the sample images. The payloads are generated
+// once per run, the partitions are temporary files (point TMPDIR to a tmpfs
+// on host to leave the disk out). Reports the apply throughput, the process
+// CPU seconds per MiB of payload, the bytes read and written through syscalls
+// and the peak RSS of the process so far; run a single benchmark with
+// --benchmark_filter for its own peak RSS. Run with --benchmark_format=json
+// for machine-readable results.
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+
+#include <android-base/unique_fd.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <brillo/key_value_store.h>
+#include <libsnapshot/snapshot_writer.h>
+
+#include "update_engine/common/download_action.h"
+#include "update_engine/common/dynamic_partition_control_stub.h"
+#include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+using android::base::unique_fd;
+using android::snapshot::CompressedSnapshotWriter;
+using android::snapshot::CowOptions;
+using android::snapshot::ISnapshotWriter;
+using std::string;
+using std::unique_ptr;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr char kPartitionName[] = "system";
+// Size of the writes to DeltaPerformer, as the fetchers would pass them.
+constexpr size_t kWriteSize = 256 * 1024;
+
+struct Scenario {
+  const char* name;
+  // Images in the build artifacts, the synthetic images are used if null.
+  const char* source_image;
+  const char* target_image;
+  bool full;
+  uint32_t minor_version;
+  bool enable_zucchini;
+  bool enable_lz4diff;
+  bool vabc;
+  bool vabc_xor;
+};
+
+// The minor versions of the delta payloads limit the diff algorithms the
+// generator may pick to the one measured, and the previous ones.
+const Scenario kScenarios[] = {
+    {"full/synthetic", nullptr, nullptr, true, kFullPayloadMinorVersion},
+    {"bsdiff/synthetic",
+     nullptr,
+     nullptr,
+     false,
+     kBrotliBsdiffMinorPayloadVersion},
+    {"vabc/synthetic",
+     nullptr,
+     nullptr,
+     false,
+     kBrotliBsdiffMinorPayloadVersion,
+     false,
+     false,
+     true},
+    {"vabc_xor/synthetic",
+     nullptr,
+     nullptr,
+     false,
+     kBrotliBsdiffMinorPayloadVersion,
+     false,
+     false,
+     true,
+     true},
+    {"bsdiff/ext2",
+     "gen/disk_ext2_4k.img",
+     "gen/disk_ext2_unittest.img",
+     false,
+     kBrotliBsdiffMinorPayloadVersion},
+    {"puffdiff/squashfs",
+     "gen/disk_sqfs_default.img",
+     "gen/disk_sqfs_unittest.img",
+     false,
+     kPuffdiffMinorPayloadVersion},
+    {"zucchini/erofs",
+     "gen/erofs.img",
+     "gen/erofs_new.img",
+     false,
+     kMaxSupportedMinorPayloadVersion,
+     true},
+    {"lz4diff/erofs",
+     "gen/erofs.img",
+     "gen/erofs_new.img",
+     false,
+     kMaxSupportedMinorPayloadVersion,
+     true,
+     true},
+};
+
+// Size of the synthetic images, in MiB.
+constexpr int kSyntheticImageSizes[] = {32, 128};
+
+double ProcessCpuSeconds() {
+  timespec ts{};
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double PeakRssMiB() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  // |ru_maxrss| is in KiB.
+  return usage.ru_maxrss / 1024.0;
+}
+
+// Reads the bytes read and written by the process through syscalls, which
+// also counts the I/O served by the page cache or a tmpfs.
+bool ReadProcessIo(uint64_t* read_bytes, uint64_t* written_bytes) {
+  string io;
+  if (!utils::ReadFile("/proc/self/io", &io))
+    return false;
+  *read_bytes = *written_bytes = 0;
+  base::StringPairs pairs;
+  base::SplitStringIntoKeyValuePairs(io, ':', '\n', &pairs);
+  for (const auto& [key, value] : pairs) {
+    string trimmed_value;
+    base::TrimWhitespaceASCII(value, base::TRIM_ALL, &trimmed_value);
+    if (key == "rchar")
+      base::StringToUint64(trimmed_value, read_bytes);
+    else if (key == "wchar")
+      base::StringToUint64(trimmed_value, written_bytes);
+  }
+  return true;
+}
+
+// Writes a synthetic source image of |size| bytes to |source_path| and a
+// target image made of its blocks, some edited, moved, shifted or replaced,
+// to |target_path|. The images are the same on every run.
+bool WriteSyntheticImages(size_t size,
+                          const string& source_path,
+                          const string& target_path) {
+  std::mt19937 gen(size);
+  brillo::Blob source(size);
+  for (size_t offset = 0; offset < size; offset += kBlockSize) {
+    const uint32_t kind = gen() % 8;
+    auto block = source.begin() + offset;
+    if (kind == 0) {
+      // Zeros.
+    } else if (kind < 4) {
+      // Random data, which doesn't compress.
+      std::generate(block, block + kBlockSize, [&gen] { return gen(); });
+    } else {
+      // Text-like data, which compresses.
+      for (size_t i = 0; i < kBlockSize; i++)
+        block[i] = 'a' + (i * kind + gen() % 4) % 26;
+    }
+  }
+
+  brillo::Blob target = source;
+  // Moves runs of 64 blocks around, as SOURCE_COPY or VABC COPY operations.
+  constexpr size_t kRunSize = 64 * kBlockSize;
+  for (size_t offset = 0; offset + 2 * kRunSize <= size;
+       offset += 8 * kRunSize) {
+    std::swap_ranges(target.begin() + offset,
+                     target.begin() + offset + kRunSize,
+                     target.begin() + offset + kRunSize);
+  }
+  for (size_t offset = 0; offset < size; offset += kBlockSize) {
+    auto block = target.begin() + offset;
+    const uint32_t change = gen() % 32;
+    if (change == 0) {
+      // Replaced with new data.
+      std::generate(block, block + kBlockSize, [&gen] { return gen(); });
+    } else if (change < 5) {
+      // A few bytes edited, as bsdiff or XOR operations.
+      for (int i = 0; i < 16; i++)
+        block[gen() % kBlockSize] ^= 1 + gen() % 255;
+    }
+  }
+  // Data shifted by an insertion in the middle of the image.
+  const size_t shift_offset = size / 2 + 100;
+  std::copy_backward(target.begin() + shift_offset,
+                     target.end() - 100,
+                     target.end());
+  return utils::WriteFile(source_path.c_str(), source.data(), size) &&
+         utils::WriteFile(target_path.c_str(), target.data(), size);
+}
+
+// A payload generated for a scenario, with the images it applies to.
+struct GeneratedPayload {
+  ScopedTempFile source_image{"benchmark_source.XXXXXX"};
+  ScopedTempFile target_image{"benchmark_target.XXXXXX"};
+  ScopedTempFile payload_file{"benchmark_payload.XXXXXX"};
+  string source_path;
+  uint64_t target_size;
+  brillo::Blob payload;
+  uint64_t metadata_size;
+};
+
+bool GeneratePayload(const Scenario& scenario,
+                     size_t synthetic_image_size,
+                     GeneratedPayload* generated) {
+  string source_path = generated->source_image.path();
+  string target_path = generated->target_image.path();
+  if (scenario.source_image) {
+    source_path = test_utils::GetBuildArtifactsPath(scenario.source_image);
+    target_path = test_utils::GetBuildArtifactsPath(scenario.target_image);
+  } else {
+    TEST_AND_RETURN_FALSE(WriteSyntheticImages(
+        synthetic_image_size, source_path, target_path));
+  }
+
+  PayloadGenerationConfig config;
+  config.is_delta = !scenario.full;
+  config.version.major = kBrilloMajorPayloadVersion;
+  config.version.minor = scenario.minor_version;
+  config.enable_zucchini = scenario.enable_zucchini;
+  config.enable_lz4diff = scenario.enable_lz4diff;
+  config.enable_vabc_xor = scenario.vabc_xor;
+  if (scenario.full)
+    config.hard_chunk_size = 1024 * 1024;
+  if (!scenario.full) {
+    config.source.partitions.emplace_back(kPartitionName);
+    config.source.partitions.back().path = source_path;
+    TEST_AND_RETURN_FALSE(config.source.LoadImageSize());
+    TEST_AND_RETURN_FALSE(config.source.partitions.back().OpenFilesystem());
+  }
+  config.target.partitions.emplace_back(kPartitionName);
+  config.target.partitions.back().path = target_path;
+  TEST_AND_RETURN_FALSE(config.target.LoadImageSize());
+  TEST_AND_RETURN_FALSE(config.target.partitions.back().OpenFilesystem());
+  if (scenario.vabc) {
+    brillo::KeyValueStore store;
+    store.SetString("super_partition_groups", "benchmark");
+    store.SetString("benchmark_size",
+                    base::NumberToString(config.target.partitions[0].size));
+    store.SetString("benchmark_partition_list", kPartitionName);
+    store.SetString("virtual_ab", "true");
+    store.SetString("virtual_ab_compression", "true");
+    TEST_AND_RETURN_FALSE(config.target.LoadDynamicPartitionMetadata(store));
+    TEST_AND_RETURN_FALSE(config.target.ValidateDynamicPartitionMetadata());
+  }
+  TEST_AND_RETURN_FALSE(config.Validate());
+  TEST_AND_RETURN_FALSE(
+      GenerateUpdatePayloadFile(config,
+                                generated->payload_file.path(),
+                                "" /* private_key_path */,
+                                &generated->metadata_size));
+  TEST_AND_RETURN_FALSE(
+      utils::ReadFile(generated->payload_file.path(), &generated->payload));
+  generated->source_path = source_path;
+  generated->target_size = config.target.partitions[0].size;
+  return true;
+}
+
+// Dynamic partition control writing the COW of the VABC partitions to a
+// file, through the same writer snapuserd reads on device.
+class BenchmarkDynamicPartitionControl : public DynamicPartitionControlStub {
+ public:
+  BenchmarkDynamicPartitionControl(bool vabc,
+                                   bool vabc_xor,
+                                   const string& cow_path)
+      : vabc_(vabc), vabc_xor_(vabc_xor), cow_path_(cow_path) {}
+
+  FeatureFlag GetVirtualAbCompressionXorFeatureFlag() override {
+    return FeatureFlag(vabc_xor_ ? FeatureFlag::Value::LAUNCH
+                                 : FeatureFlag::Value::NONE);
+  }
+
+  bool IsDynamicPartition(const string& part_name, uint32_t slot) override {
+    return vabc_;
+  }
+
+  bool UpdateUsesSnapshotCompression() override { return vabc_; }
+
+  unique_ptr<ISnapshotWriter> OpenCowWriter(
+      const string& unsuffixed_partition_name,
+      const std::optional<string>& source_path,
+      bool is_append) override {
+    const CowOptions options{.block_size = kBlockSize, .compression = "gz"};
+    auto writer = std::make_unique<CompressedSnapshotWriter>(options);
+    unique_fd fd(HANDLE_EINTR(open(
+        cow_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
+    if (fd < 0 || !writer->SetCowDevice(std::move(fd)))
+      return nullptr;
+    if (source_path)
+      writer->SetSourceDevice(*source_path);
+    return writer;
+  }
+
+ private:
+  const bool vabc_;
+  const bool vabc_xor_;
+  const string cow_path_;
+};
+
+class BenchmarkBootControl : public FakeBootControl {
+ public:
+  explicit BenchmarkBootControl(
+      unique_ptr<DynamicPartitionControlInterface> dynamic_control)
+      : dynamic_control_(std::move(dynamic_control)) {}
+
+  DynamicPartitionControlInterface* GetDynamicPartitionControl() override {
+    return dynamic_control_.get();
+  }
+
+ private:
+  unique_ptr<DynamicPartitionControlInterface> dynamic_control_;
+};
+
+class BenchmarkDownloadDelegate : public DownloadActionDelegate {
+ public:
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {}
+  bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+  void DownloadComplete() override {}
+};
+
+// Applies |generated| once, writing the payload in |kWriteSize| chunks.
+bool ApplyPayload(const Scenario& scenario,
+                  const GeneratedPayload& generated,
+                  const string& target_path,
+                  const string& cow_path) {
+  FakePrefs prefs;
+  FakeHardware hardware;
+  BenchmarkDownloadDelegate delegate;
+  BenchmarkBootControl boot_control(
+      std::make_unique<BenchmarkDynamicPartitionControl>(
+          scenario.vabc, scenario.vabc_xor, cow_path));
+  InstallPlan install_plan;
+  install_plan.source_slot = 0;
+  install_plan.target_slot = 1;
+  install_plan.payloads = {
+      {.size = generated.payload.size(),
+       .metadata_size = generated.metadata_size,
+       .type = scenario.full ? InstallPayloadType::kFull
+                             : InstallPayloadType::kDelta}};
+  if (!scenario.full) {
+    boot_control.SetPartitionDevice(
+        kPartitionName, install_plan.source_slot, generated.source_path);
+  }
+  boot_control.SetPartitionDevice(
+      kPartitionName, install_plan.target_slot, target_path);
+
+  DeltaPerformer performer(&prefs,
+                           &boot_control,
+                           &hardware,
+                           &delegate,
+                           &install_plan,
+                           &install_plan.payloads[0],
+                           false /* interactive */,
+                           "" /* update_certificates_path */);
+  ErrorCode error = ErrorCode::kSuccess;
+  for (size_t offset = 0; offset < generated.payload.size();
+       offset += kWriteSize) {
+    const size_t count =
+        std::min(kWriteSize, generated.payload.size() - offset);
+    if (!performer.Write(generated.payload.data() + offset, count, &error)) {
+      LOG(ERROR) << "Failed to apply the payload: "
+                 << utils::ErrorCodeToString(error);
+      return false;
+    }
+  }
+  return performer.Close() == 0;
+}
+
+// The benchmark functions run several times to find the number of
+// iterations, the payloads are generated on the first run only. They're
+// destroyed at exit, which removes their temporary files.
+const GeneratedPayload* GetGeneratedPayload(const Scenario& scenario,
+                                            size_t synthetic_image_size) {
+  static std::map<std::pair<string, size_t>, unique_ptr<GeneratedPayload>>
+      payloads;
+  auto& generated = payloads[{scenario.name, synthetic_image_size}];
+  if (!generated) {
+    generated = std::make_unique<GeneratedPayload>();
+    if (!GeneratePayload(scenario, synthetic_image_size, generated.get())) {
+      generated.reset();
+      return nullptr;
+    }
+  }
+  return generated.get();
+}
+
+void BM_ApplyPayload(benchmark::State& state,
+                     const Scenario& scenario,
+                     size_t synthetic_image_size) {
+  const GeneratedPayload* generated =
+      GetGeneratedPayload(scenario, synthetic_image_size);
+  if (!generated) {
+    state.SkipWithError("Failed to generate the payload.");
+    return;
+  }
+  ScopedTempFile target_file("benchmark_result.XXXXXX");
+  ScopedTempFile cow_file("benchmark_cow.XXXXXX");
+
+  double cpu_seconds = 0;
+  uint64_t read_bytes = 0, written_bytes = 0;
+  size_t total_bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    // Start from an empty target partition, as on device.
+    bool reset = truncate(target_file.path().c_str(), 0) == 0 &&
+                 truncate(target_file.path().c_str(),
+                          generated->target_size) == 0;
+    uint64_t read_start = 0, written_start = 0;
+    reset = reset && ReadProcessIo(&read_start, &written_start);
+    state.ResumeTiming();
+    if (!reset) {
+      state.SkipWithError("Failed to reset the target partition.");
+      break;
+    }
+
+    const double cpu_start = ProcessCpuSeconds();
+    if (!ApplyPayload(
+            scenario, *generated, target_file.path(), cow_file.path())) {
+      state.SkipWithError("Failed to apply the payload.");
+      break;
+    }
+    cpu_seconds += ProcessCpuSeconds() - cpu_start;
+
+    state.PauseTiming();
+    uint64_t read_end = 0, written_end = 0;
+    if (ReadProcessIo(&read_end, &written_end)) {
+      read_bytes += read_end - read_start;
+      written_bytes += written_end - written_start;
+    }
+    state.ResumeTiming();
+    total_bytes += generated->payload.size();
+  }
+  state.SetBytesProcessed(total_bytes);
+  if (total_bytes > 0) {
+    const double payload_mib = static_cast<double>(total_bytes) / (1 << 20);
+    state.counters["cpu_s_per_mib"] = cpu_seconds / payload_mib;
+    state.counters["read_mib_per_apply"] = benchmark::Counter(
+        read_bytes / static_cast<double>(1 << 20),
+        benchmark::Counter::kAvgIterations);
+    state.counters["written_mib_per_apply"] = benchmark::Counter(
+        written_bytes / static_cast<double>(1 << 20),
+        benchmark::Counter::kAvgIterations);
+  }
+  state.counters["payload_mib"] =
+      static_cast<double>(generated->payload.size()) / (1 << 20);
+  state.counters["peak_rss_mib"] = PeakRssMiB();
+}
+
+void RegisterBenchmarks() {
+  for (const Scenario& scenario : kScenarios) {
+    if (scenario.source_image) {
+      benchmark::RegisterBenchmark(
+          base::StringPrintf("BM_ApplyPayload/%s", scenario.name).c_str(),
+          BM_ApplyPayload,
+          scenario,
+          0)
+          ->Unit(benchmark::kMillisecond)
+          ->UseRealTime();
+      continue;
+    }
+    for (int size_mib : kSyntheticImageSizes) {
+      benchmark::RegisterBenchmark(
+          base::StringPrintf(
+              "BM_ApplyPayload/%s/%dMiB", scenario.name, size_mib)
+              .c_str(),
+          BM_ApplyPayload,
+          scenario,
+          static_cast<size_t>(size_mib) << 20)
+          ->Unit(benchmark::kMillisecond)
+          ->UseRealTime();
+    }
+  }
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  chromeos_update_engine::RegisterBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -49,6 +49,7 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/testing_constants.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/blob_cache.h"
 #include "update_engine/payload_consumer/mock_partition_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
@@ -56,6 +57,7 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/zstd.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -180,7 +182,7 @@ class DeltaPerformerTest : public ::testing::Test {
     payload_.type = payload_type;
 
     // The Manifest we are validating.
-    performer_.manifest_.CopyFrom(manifest);
+    performer_.manifest_->CopyFrom(manifest);
     performer_.major_payload_version_ = major_version;
 
     EXPECT_EQ(expected, performer_.ValidateManifest());
@@ -301,24 +303,41 @@ class DeltaPerformerTest : public ::testing::Test {
     EXPECT_TRUE(test_utils::WriteFileVector(new_part.path(), target_data));
 
     payload_.size = payload_data.size();
-    // We installed the operations only in the rootfs partition, but the
-    // delta performer needs to access all the partitions.
+    SetPartitionDevices(new_part.path(), source_path);
+
+    if (write_chunk_size_ == 0) {
+      EXPECT_EQ(expect_success,
+                delta_performer->Write(payload_data.data(),
+                                       payload_data.size()));
+    } else {
+      bool success = true;
+      for (size_t offset = 0; offset < payload_data.size() && success;
+           offset += write_chunk_size_) {
+        success = delta_performer->Write(
+            payload_data.data() + offset,
+            std::min(write_chunk_size_, payload_data.size() - offset));
+      }
+      EXPECT_EQ(expect_success, success);
+    }
+    EXPECT_EQ(0, performer_.Close());
+
+    brillo::Blob partition_data;
+    EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+    return partition_data;
+  }
+
+  // We install the operations only in the rootfs partition, but the delta
+  // performer needs to access all the partitions.
+  void SetPartitionDevices(const string& target_path,
+                           const string& source_path) {
     fake_boot_control_.SetPartitionDevice(
-        kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+        kPartitionNameRoot, install_plan_.target_slot, target_path);
     fake_boot_control_.SetPartitionDevice(
         kPartitionNameRoot, install_plan_.source_slot, source_path);
     fake_boot_control_.SetPartitionDevice(
         kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
     fake_boot_control_.SetPartitionDevice(
         kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
-
-    EXPECT_EQ(expect_success,
-              delta_performer->Write(payload_data.data(), payload_data.size()));
-    EXPECT_EQ(0, performer_.Close());
-
-    brillo::Blob partition_data;
-    EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
-    return partition_data;
   }
 
   // Calls delta performer's Write method by pretending to pass in bytes from a
@@ -428,6 +447,9 @@ class DeltaPerformerTest : public ::testing::Test {
     EXPECT_EQ(payload_.metadata_size, performer_.metadata_size_);
   }
 
+  // If set, ApplyPayloadToData() passes the payload in chunks of this size.
+  size_t write_chunk_size_{0};
+
   FakePrefs prefs_;
   InstallPlan install_plan_;
   InstallPlan::Payload payload_;
@@ -467,6 +489,52 @@ TEST_F(DeltaPerformerTest, FullPayloadWriteTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, MetadataReceivedInChunksTest) {
+  // The metadata is hashed as it's received, which must match its signature.
+  install_plan_.hash_checks_mandatory = true;
+  write_chunk_size_ = 7;
+  payload_.type = InstallPayloadType::kFull;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data,
+                                              {aop},
+                                              true,
+                                              kBrilloMajorPayloadVersion,
+                                              kFullPayloadMinorVersion);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, ModifiedMetadataReceivedInChunksTest) {
+  install_plan_.hash_checks_mandatory = true;
+  brillo::Blob payload_data = GeneratePayload(brillo::Blob(),
+                                              vector<AnnotatedOperation>(),
+                                              true,
+                                              kBrilloMajorPayloadVersion,
+                                              kFullPayloadMinorVersion);
+  payload_.size = payload_data.size();
+  // A byte of the manifest, right after the header.
+  payload_data[24] ^= 1;
+
+  ErrorCode error = ErrorCode::kSuccess;
+  bool success = true;
+  for (size_t offset = 0; offset < payload_data.size() && success;
+       offset += 7) {
+    success = performer_.Write(
+        payload_data.data() + offset,
+        std::min<size_t>(7, payload_data.size() - offset),
+        &error);
+  }
+  EXPECT_FALSE(success);
+  EXPECT_EQ(ErrorCode::kDownloadMetadataSignatureMismatch, error);
+}
+
 TEST_F(DeltaPerformerTest, ShouldCancelTest) {
   payload_.type = InstallPayloadType::kFull;
   brillo::Blob expected_data =
@@ -551,6 +619,376 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, ReplaceZstdOperationTest) {
+  brillo::Blob expected_data(
+      std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096 * 4);
+  brillo::Blob zstd_data;
+  ASSERT_TRUE(ZstdCompress(expected_data, &zstd_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 4);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(zstd_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_ZSTD);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(zstd_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, PackedExtentsTest) {
+  brillo::Blob blob_data(std::begin(kRandomString), std::end(kRandomString));
+  blob_data.resize(4096 * 2);
+  // The blocks of the data are written in the reverse order.
+  brillo::Blob expected_data(blob_data.begin() + 4096, blob_data.end());
+  expected_data.insert(
+      expected_data.end(), blob_data.begin(), blob_data.begin() + 4096);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(blob_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data =
+      GeneratePayload(blob_data,
+                      aops,
+                      false,
+                      kBrilloMajorPayloadVersion,
+                      kPackedExtentsMinorPayloadVersion);
+  PayloadMetadata payload_metadata;
+  ASSERT_TRUE(payload_metadata.ParsePayloadHeader(payload_data));
+  // The manifest follows the header of this major version uncompressed.
+  ASSERT_GE(payload_data.size(), payload_metadata.GetMetadataSize());
+  DeltaArchiveManifest manifest;
+  ASSERT_TRUE(manifest.ParseFromArray(
+      payload_data.data() + kMaxPayloadHeaderSize,
+      payload_metadata.GetMetadataSize() - kMaxPayloadHeaderSize));
+  EXPECT_TRUE(manifest.partitions(0).operations(0).dst_extents().empty());
+  EXPECT_TRUE(manifest.partitions(0).operations(0).has_packed_dst_extents());
+
+  // GetManifest() unpacks them.
+  ASSERT_TRUE(payload_metadata.GetManifest(payload_data, &manifest));
+  const InstallOperation& op = manifest.partitions(0).operations(0);
+  EXPECT_EQ(2, op.dst_extents_size());
+  EXPECT_FALSE(op.has_packed_dst_extents());
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationTest) {
+  install_plan_.stream_replace_ops = true;
+  // Large enough to be streamed, passed in chunks which don't line up with
+  // the blocks.
+  write_chunk_size_ = 10000;
+  const size_t kNumBlocks = 512;
+  brillo::Blob expected_data(kNumBlocks * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++)
+    expected_data[i] = kRandomString[i % sizeof(kRandomString)] ^ (i / 4096);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, kNumBlocks);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(nullptr, performer_.streaming_op_);
+  EXPECT_EQ(expected_data.size(), performer_.buffer_offset_);
+}
+
+TEST_F(DeltaPerformerTest, ResumeStreamedReplaceOperationTest) {
+  install_plan_.stream_replace_ops = true;
+  const size_t kNumBlocks = 512;
+  brillo::Blob expected_data(kNumBlocks * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++)
+    expected_data[i] = kRandomString[i % sizeof(kRandomString)] ^ (i / 4096);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 100);
+  *(aop.op.add_dst_extents()) = ExtentForRange(200, kNumBlocks - 100);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  vector<AnnotatedOperation> aops = {aop};
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  const size_t data_start = payload_data.size() - expected_data.size();
+  payload_.size = payload_data.size();
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  SetPartitionDevices(new_part.path(), "/dev/null");
+
+  // Interrupted after 150 blocks and a half of the data.
+  const size_t interrupted_size = 150 * 4096 + 2048;
+  EXPECT_TRUE(performer_.Write(payload_data.data(), data_start));
+  EXPECT_TRUE(performer_.Write(payload_data.data() + data_start,
+                               interrupted_size));
+  EXPECT_EQ(0, performer_.Close());
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextOperation, &value));
+  EXPECT_EQ(0, value);
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateOperationBytesWritten, &value));
+  EXPECT_EQ(150 * 4096, value);
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &value));
+  EXPECT_EQ(150 * 4096, value);
+  prefs_.SetString(kPrefsUpdateCheckResponseHash, "12345");
+  EXPECT_TRUE(DeltaPerformer::CanResumeUpdate(&prefs_, "12345"));
+
+  // The resumed download starts over with the metadata.
+  install_plan_.partitions.clear();
+  DeltaPerformer resumed_performer{&prefs_,
+                                   &fake_boot_control_,
+                                   &fake_hardware_,
+                                   &mock_delegate_,
+                                   &install_plan_,
+                                   &payload_,
+                                   false /* interactive */,
+                                   "" /* Update certs path */};
+  EXPECT_TRUE(resumed_performer.Write(payload_data.data(), data_start));
+  EXPECT_NE(nullptr, resumed_performer.streaming_op_);
+  EXPECT_TRUE(resumed_performer.Write(payload_data.data() + data_start + value,
+                                      expected_data.size() - value));
+  EXPECT_EQ(nullptr, resumed_performer.streaming_op_);
+  EXPECT_EQ(expected_data.size(), resumed_performer.buffer_offset_);
+  EXPECT_EQ(0, resumed_performer.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  partition_data.resize((200 + kNumBlocks - 100) * 4096);
+  EXPECT_TRUE(std::equal(expected_data.begin(),
+                         expected_data.begin() + 100 * 4096,
+                         partition_data.begin()));
+  EXPECT_TRUE(std::equal(expected_data.begin() + 100 * 4096,
+                         expected_data.end(),
+                         partition_data.begin() + 200 * 4096));
+}
+
+TEST_F(DeltaPerformerTest, SkipAppliedOperationsTest) {
+  install_plan_.skip_applied_operations = true;
+  const size_t kNumOps = 4;
+  brillo::Blob expected_data(kNumOps * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++)
+    expected_data[i] = kRandomString[i % sizeof(kRandomString)] ^ (i / 4096);
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumOps; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+        expected_data.data() + i * 4096, 4096, &hash));
+    aop.op.set_dst_sha256_hash(hash.data(), hash.size());
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  // The first two operations were applied by a previous attempt. The last one
+  // matches too but comes after one that doesn't.
+  brillo::Blob target_data = expected_data;
+  std::fill(target_data.begin() + 2 * 4096, target_data.begin() + 3 * 4096, 0);
+  EXPECT_EQ(expected_data,
+            ApplyPayloadToData(payload_data, "/dev/null", target_data, true));
+  EXPECT_EQ(2u, performer_.num_skipped_operations_);
+  EXPECT_FALSE(performer_.check_applied_operations_);
+  EXPECT_EQ(expected_data.size(), performer_.buffer_offset_);
+}
+
+TEST_F(DeltaPerformerTest, InPlaceOperationDataTest) {
+  // Chunks holding whole blobs, which are used in place, and blobs split
+  // across chunks, which are buffered.
+  write_chunk_size_ = 3 * 4096 + 100;
+  const size_t kNumOps = 8;
+  brillo::Blob expected_data(kNumOps * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++)
+    expected_data[i] = kRandomString[i % sizeof(kRandomString)] ^ (i / 4096);
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumOps; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(expected_data.size(), performer_.buffer_offset_);
+  EXPECT_FALSE(performer_.op_data_in_place_);
+  // All the bytes were hashed once, in order.
+  brillo::Blob payload_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_hash));
+  EXPECT_EQ(payload_hash, performer_.payload_hash_calculator_.raw_hash());
+}
+
+TEST_F(DeltaPerformerTest, SharedDataBlobTest) {
+  write_chunk_size_ = 5000;
+  brillo::Blob block_a(std::begin(kRandomString), std::end(kRandomString));
+  block_a.resize(4096);
+  const brillo::Blob block_b(4096, 'b');
+  brillo::Blob expected_data = block_a;
+  expected_data.insert(expected_data.end(), block_b.begin(), block_b.end());
+  expected_data.insert(expected_data.end(), block_a.begin(), block_a.end());
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < 3; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+
+  // The third operation uses the blob of the first one.
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  EXPECT_EQ(payload_.metadata_size + 2 * 4096, payload_data.size());
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+  EXPECT_EQ(2u * 4096, performer_.buffer_offset_);
+  EXPECT_TRUE(performer_.shared_blobs_.empty());
+  EXPECT_TRUE(performer_.shared_blob_uses_.empty());
+  brillo::Blob payload_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_hash));
+  EXPECT_EQ(payload_hash, performer_.payload_hash_calculator_.raw_hash());
+}
+
+TEST_F(DeltaPerformerTest, CachedOperationDataTest) {
+  const size_t kNumOps = 3;
+  brillo::Blob expected_data(kNumOps * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++)
+    expected_data[i] = kRandomString[i % sizeof(kRandomString)] ^ (i / 4096);
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumOps; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, false);
+  const size_t data_start = payload_data.size() - expected_data.size();
+  payload_.size = payload_data.size();
+
+  // The data of the first two operations was kept by a previous attempt.
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  BlobCache blob_cache(cache_dir.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(blob_cache.Init());
+  for (size_t i = 0; i < 2; i++) {
+    const brillo::Blob data(expected_data.begin() + i * 4096,
+                            expected_data.begin() + (i + 1) * 4096);
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data, &hash));
+    ASSERT_TRUE(blob_cache.Put(
+        BlobCache::OperationKey({hash.begin(), hash.end()}),
+        data.data(),
+        data.size()));
+  }
+  performer_.set_blob_cache(&blob_cache);
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  SetPartitionDevices(new_part.path(), "/dev/null");
+  EXPECT_TRUE(performer_.Write(payload_data.data(), data_start));
+  vector<std::pair<uint64_t, uint64_t>> ranges;
+  ASSERT_TRUE(performer_.UseCachedOperationData(&ranges));
+  // Only the data of the last operation is downloaded.
+  ASSERT_EQ(1u, ranges.size());
+  EXPECT_EQ(data_start + 2 * 4096, ranges[0].first);
+  EXPECT_EQ(4096u, ranges[0].second);
+  EXPECT_TRUE(performer_.Write(payload_data.data() + ranges[0].first,
+                               ranges[0].second));
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+  // The cached data was hashed in payload order.
+  brillo::Blob payload_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_hash));
+  EXPECT_EQ(payload_hash, performer_.payload_hash_calculator_.raw_hash());
+}
+
+TEST_F(DeltaPerformerTest, AdaptiveVabcCompressionResumeTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  auto* metadata = manifest.mutable_dynamic_partition_metadata();
+  metadata->set_vabc_enabled(true);
+  metadata->set_vabc_compression_param("gz");
+  auto* partition = manifest.add_partitions();
+  partition->set_partition_name("system");
+  partition->mutable_new_partition_info()->set_size(10 * 4096);
+  partition->set_estimate_cow_size(4096);
+  uint64_t required_size = 0;
+
+  // A resumed update keeps the choice made when its partitions were first
+  // prepared, whatever the free space is now.
+  prefs_.SetString(kPrefsDynamicPartitionMetadataUpdated, "hash");
+  prefs_.SetBoolean(kPrefsUncompressedCow, true);
+  DeltaArchiveManifest resumed = manifest;
+  EXPECT_TRUE(DeltaPerformer::PreparePartitionsForUpdate(&prefs_,
+                                                         &fake_boot_control_,
+                                                         1,
+                                                         &resumed,
+                                                         "hash",
+                                                         true,
+                                                         nullptr,
+                                                         &required_size));
+  EXPECT_EQ("none",
+            resumed.dynamic_partition_metadata().vabc_compression_param());
+  EXPECT_GT(resumed.partitions(0).estimate_cow_size(), 10u * 4096);
+
+  // The partitions prepared without the header stay compressed.
+  prefs_.Delete(kPrefsUncompressedCow);
+  resumed = manifest;
+  EXPECT_TRUE(DeltaPerformer::PreparePartitionsForUpdate(&prefs_,
+                                                         &fake_boot_control_,
+                                                         1,
+                                                         &resumed,
+                                                         "hash",
+                                                         true,
+                                                         nullptr,
+                                                         &required_size));
+  EXPECT_EQ("gz",
+            resumed.dynamic_partition_metadata().vabc_compression_param());
+  EXPECT_EQ(4096u, resumed.partitions(0).estimate_cow_size());
+
+  // A new update chooses again and stores what it chose.
+  prefs_.SetBoolean(kPrefsUncompressedCow, true);
+  DeltaArchiveManifest new_update = manifest;
+  EXPECT_TRUE(DeltaPerformer::PreparePartitionsForUpdate(&prefs_,
+                                                         &fake_boot_control_,
+                                                         1,
+                                                         &new_update,
+                                                         "new-hash",
+                                                         true,
+                                                         nullptr,
+                                                         &required_size));
+  bool uncompressed = false;
+  EXPECT_TRUE(prefs_.GetBoolean(kPrefsUncompressedCow, &uncompressed));
+  EXPECT_EQ(uncompressed,
+            new_update.dynamic_partition_metadata().vabc_compression_param() ==
+                "none");
+  string last_hash;
+  EXPECT_TRUE(
+      prefs_.GetString(kPrefsDynamicPartitionMetadataUpdated, &last_hash));
+  EXPECT_EQ("new-hash", last_hash);
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -1148,6 +1586,25 @@ AnnotatedOperation GetSourceCopyOp(uint32_t src_block,
 }
 }  // namespace
 
+TEST_F(DeltaPerformerTest, CheckpointWaitFollowsCostTest) {
+  const base::TimeDelta min_wait =
+      base::TimeDelta::FromSeconds(DeltaPerformer::kCheckpointFrequencySeconds);
+  performer_.UpdateCheckpointWait(base::TimeDelta::FromMilliseconds(1));
+  EXPECT_EQ(min_wait, performer_.update_checkpoint_wait_);
+
+  // A slow checkpoint spaces the next ones, but only gradually.
+  performer_.UpdateCheckpointWait(base::TimeDelta::FromMilliseconds(401));
+  const base::TimeDelta wait = performer_.update_checkpoint_wait_;
+  EXPECT_GT(wait, min_wait);
+  EXPECT_LT(wait, base::TimeDelta::FromMilliseconds(401) * 50);
+
+  // Never so much that a resumed update redoes too much work.
+  for (int i = 0; i < 10; i++)
+    performer_.UpdateCheckpointWait(base::TimeDelta::FromSeconds(5));
+  EXPECT_EQ(base::TimeDelta::FromSeconds(10),
+            performer_.update_checkpoint_wait_);
+}
+
 TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   TestDeltaPerformer delta_performer{&prefs_,
                                      &fake_boot_control_,
@@ -1175,9 +1632,13 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   Sequence seq;
   std::vector<size_t> indices;
   EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
-      .WillRepeatedly(
-          [&indices](size_t index) mutable { indices.emplace_back(index); });
-  EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
+      .WillRepeatedly([this, &indices](size_t index) mutable {
+        // The partition is synced outside of the prefs transaction.
+        EXPECT_TRUE(prefs_.StartTransaction());
+        prefs_.CancelTransaction();
+        indices.emplace_back(index);
+      });
+  EXPECT_CALL(writer1, Init(_, true, _, false)).Times(1).WillOnce(Return(true));
   EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
       .Times(2)
       .WillRepeatedly(Return(true));
@@ -17,8 +17,9 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 
-#include <functional>
-#include <map>
+#include <algorithm>
+#include <iterator>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -33,48 +34,91 @@ namespace chromeos_update_engine {
 // Currently the only usecase is for VABCPartitionWriter to keep track of which
 // block belongs to which merge operation. Therefore this class only contains
 // the minimal set of functions needed.
-template <typename T, typename Comparator = ExtentLess>
+//
+// Entries are kept in a vector sorted by start block, so lookups are binary
+// searches over contiguous memory. Adding extents in increasing order, or all
+// at once with AddExtents(), is cheap; adding them in random order one at a
+// time costs a linear move per insertion.
+template <typename T>
 class ExtentMap {
  public:
   bool AddExtent(const Extent& extent, T&& value) {
-    if (set_.OverlapsWithExtent(extent)) {
+    const auto it = std::upper_bound(
+        entries_.begin(), entries_.end(), extent.start_block(), StartsBefore);
+    if ((it != entries_.end() && it->Overlaps(extent)) ||
+        (it != entries_.begin() && std::prev(it)->Overlaps(extent))) {
       return false;
     }
-    const auto& [it, inserted] = map_.insert({extent, std::forward<T>(value)});
-    if (inserted) {
-      set_.AddExtent(extent);
+    entries_.insert(it,
+                    {extent.start_block(),
+                     extent.num_blocks(),
+                     std::forward<T>(value)});
+    return true;
+  }
+
+  // Adds all of |entries| at once, which is cheaper than adding them one by
+  // one in random order. Entries overlapping an earlier one in |entries| or
+  // one already in the map are dropped, in which case false is returned.
+  bool AddExtents(std::vector<std::pair<Extent, T>> entries) {
+    std::vector<Entry> added;
+    added.reserve(entries.size());
+    for (auto& [extent, value] : entries) {
+      added.push_back(
+          {extent.start_block(), extent.num_blocks(), std::move(value)});
+    }
+    std::stable_sort(added.begin(),
+                     added.end(),
+                     [](const Entry& a, const Entry& b) {
+                       return a.start_block < b.start_block;
+                     });
+    // Both |entries_| and |added| are sorted, merge them. Existing entries
+    // were added first, so they win over any added entry they overlap.
+    std::vector<Entry> merged;
+    merged.reserve(entries_.size() + added.size());
+    bool success = true;
+    auto existing = entries_.begin();
+    for (auto& entry : added) {
+      while (existing != entries_.end() &&
+             existing->start_block <= entry.start_block) {
+        merged.push_back(std::move(*existing++));
+      }
+      if ((!merged.empty() && merged.back().Overlaps(entry)) ||
+          (existing != entries_.end() && existing->Overlaps(entry))) {
+        success = false;
+        continue;
+      }
+      merged.push_back(std::move(entry));
     }
-    return inserted;
+    std::move(existing, entries_.end(), std::back_inserter(merged));
+    entries_ = std::move(merged);
+    return success;
   }
 
-  size_t size() const { return map_.size(); }
+  size_t size() const { return entries_.size(); }
 
   // Return a pointer to entry which is intersecting |extent|. If T is already
   // a pointer type, return T on success. This function always return
   // |nullptr| on failure. Therefore you cannot store nullptr as an entry.
   std::optional<T> Get(const Extent& extent) const {
-    const auto it = map_.find(extent);
-    if (it == map_.end()) {
-      for (const auto& ext : set_.GetCandidateRange(extent)) {
-        // Sometimes there are operations like
-        // map.AddExtent({0, 5}, 42);
-        // map.Get({2, 1})
-        // If the querying extent is completely covered within the key, we still
-        // consdier this to be a valid query.
-
-        if (ExtentContains(ext, extent)) {
-          return map_.at(ext);
-        }
-        if (ExtentRanges::ExtentsOverlap(ext, extent)) {
-          LOG(WARNING) << "Looking up a partially intersecting extent isn't "
-                          "supported by "
-                          "this data structure. Querying extent: "
-                       << extent << ", partial match in map: " << ext;
-        }
+    // Sometimes there are operations like
+    // map.AddExtent({0, 5}, 42);
+    // map.Get({2, 1})
+    // If the querying extent is completely covered within the key, we still
+    // consdier this to be a valid query.
+    auto it = FirstCandidate(extent);
+    for (; it != entries_.end() && it->start_block < EndBlock(extent); ++it) {
+      if (it->Contains(extent)) {
+        return it->value;
+      }
+      if (it->Overlaps(extent)) {
+        LOG(WARNING) << "Looking up a partially intersecting extent isn't "
+                        "supported by "
+                        "this data structure. Querying extent: "
+                     << extent << ", partial match in map: "
+                     << it->ToExtent();
       }
-      return {};
     }
-    return {it->second};
+    return {};
   }
 
   // Return a set of extents that are contained in this extent map.
@@ -87,19 +131,84 @@ class ExtentMap {
   // E.g. extent map contains [0,5] and [10,15], GetIntersectingExtents([3, 12])
   // would return [3,5] and [10,12]
   std::vector<Extent> GetIntersectingExtents(const Extent& extent) const {
-    return set_.GetIntersectingExtents(extent);
+    std::vector<Extent> result;
+    const uint64_t end = EndBlock(extent);
+    for (auto it = FirstCandidate(extent);
+         it != entries_.end() && it->start_block < end;
+         ++it) {
+      const uint64_t start = std::max(it->start_block, extent.start_block());
+      const uint64_t stop = std::min(it->end_block(), end);
+      if (start < stop) {
+        result.push_back(ExtentForRange(start, stop - start));
+      }
+    }
+    return result;
   }
 
   // Complement of |GetIntersectingExtents|, return vector of extents which are
   // part of |extent| but not covered by this map.
   std::vector<Extent> GetNonIntersectingExtents(const Extent& extent) const {
-    return FilterExtentRanges({extent}, set_);
+    std::vector<Extent> result;
+    uint64_t next = extent.start_block();
+    const uint64_t end = EndBlock(extent);
+    for (const auto& covered : GetIntersectingExtents(extent)) {
+      if (covered.start_block() > next) {
+        result.push_back(ExtentForRange(next, covered.start_block() - next));
+      }
+      next = EndBlock(covered);
+    }
+    if (next < end) {
+      result.push_back(ExtentForRange(next, end - next));
+    }
+    return result;
   }
 
  private:
-  // Get a range of exents that potentially intersect with parameter |extent|
-  std::map<Extent, T, Comparator> map_;
-  ExtentRanges set_{false};
+  struct Entry {
+    uint64_t start_block;
+    uint64_t num_blocks;
+    T value;
+
+    uint64_t end_block() const { return start_block + num_blocks; }
+    bool Overlaps(uint64_t other_start, uint64_t other_num_blocks) const {
+      return num_blocks > 0 && other_num_blocks > 0 &&
+             start_block < other_start + other_num_blocks &&
+             other_start < end_block();
+    }
+    bool Overlaps(const Extent& extent) const {
+      return Overlaps(extent.start_block(), extent.num_blocks());
+    }
+    bool Overlaps(const Entry& other) const {
+      return Overlaps(other.start_block, other.num_blocks);
+    }
+    bool Contains(const Extent& extent) const {
+      return start_block <= extent.start_block() &&
+             EndBlock(extent) <= end_block();
+    }
+    Extent ToExtent() const { return ExtentForRange(start_block, num_blocks); }
+  };
+
+  static uint64_t EndBlock(const Extent& extent) {
+    return extent.start_block() + extent.num_blocks();
+  }
+
+  static bool StartsBefore(uint64_t start_block, const Entry& entry) {
+    return start_block < entry.start_block;
+  }
+
+  // Returns the first entry that may intersect |extent|: the last one starting
+  // at or before it, since entries don't overlap each other.
+  typename std::vector<Entry>::const_iterator FirstCandidate(
+      const Extent& extent) const {
+    auto it = std::upper_bound(
+        entries_.begin(), entries_.end(), extent.start_block(), StartsBefore);
+    if (it != entries_.begin())
+      --it;
+    return it;
+  }
+
+  // Sorted by start block, disjoint, and touching entries aren't merged.
+  std::vector<Entry> entries_;
 };
 }  // namespace chromeos_update_engine
 
@@ -158,4 +158,28 @@ TEST_F(ExtentMapTest, GetTouchingExtents) {
   ASSERT_EQ(extents[1], ExtentForRange(10, 5));
 }
 
+TEST_F(ExtentMapTest, AddExtents) {
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(30, 5), 3));
+  // Unsorted, and the last two overlap an earlier entry and an existing one.
+  ASSERT_FALSE(map_.AddExtents({{ExtentForRange(20, 5), 2},
+                                {ExtentForRange(0, 5), 0},
+                                {ExtentForRange(10, 5), 1},
+                                {ExtentForRange(12, 5), 4},
+                                {ExtentForRange(28, 3), 5}}));
+  ASSERT_EQ(map_.size(), 4U);
+  for (int i = 0; i < 4; i++) {
+    ASSERT_EQ(map_.Get(ExtentForRange(i * 10 + 1, 2)), i);
+  }
+  ASSERT_EQ(map_.Get(ExtentForRange(16, 1)), std::nullopt);
+  ASSERT_EQ(map_.GetNonIntersectingExtents(ExtentForRange(0, 40)),
+            (std::vector<Extent>{ExtentForRange(5, 5),
+                                 ExtentForRange(15, 5),
+                                 ExtentForRange(25, 5),
+                                 ExtentForRange(35, 5)}));
+
+  ASSERT_TRUE(map_.AddExtents({{ExtentForRange(40, 5), 6}}));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(44, 2), 7));
+  ASSERT_EQ(map_.size(), 5U);
+}
+
 }  // namespace chromeos_update_engine
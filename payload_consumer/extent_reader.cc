@@ -17,6 +17,7 @@
 #include "update_engine/payload_consumer/extent_reader.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -66,6 +67,9 @@ bool DirectExtentReader::Seek(uint64_t offset) {
 
 bool DirectExtentReader::Read(void* buffer, size_t count) {
   auto bytes = reinterpret_cast<uint8_t*>(buffer);
+  // Collect the reads from all the extents covered by |count| first, so the
+  // file descriptor can have them in flight together.
+  std::vector<FileDescriptor::ReadRequest> requests;
   uint64_t bytes_read = 0;
   while (bytes_read < count) {
     if (cur_extent_ == extents_.end()) {
@@ -76,15 +80,11 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
     uint64_t bytes_to_read =
         std::min(count - bytes_read, cur_extent_bytes_left);
 
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::ReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+    requests.push_back(
+        {bytes + bytes_read,
+         static_cast<size_t>(bytes_to_read),
+         static_cast<off64_t>(cur_extent_->start_block() * block_size_ +
+                              cur_extent_bytes_read_)});
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
@@ -95,7 +95,7 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
       cur_extent_bytes_read_ = 0;
     }
   }
-  return true;
+  return requests.empty() || fd_->ReadBatch(requests);
 }
 
 }  // namespace chromeos_update_engine
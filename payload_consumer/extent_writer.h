@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <brillo/secure_blob.h>
@@ -48,7 +49,7 @@ class ExtentWriter {
 // DirectExtentWriter is probably the simplest ExtentWriter implementation.
 // It writes the data directly into the extents.
 
-class DirectExtentWriter : public ExtentWriter {
+class DirectExtentWriter final : public ExtentWriter {
  public:
   explicit DirectExtentWriter(FileDescriptorPtr fd) : fd_(fd) {}
   ~DirectExtentWriter() override = default;
@@ -71,6 +72,8 @@ class DirectExtentWriter : public ExtentWriter {
   google::protobuf::RepeatedPtrField<Extent> extents_;
   // The next call to write should correspond to |cur_extents_|.
   google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+  // The writes of the current Write() call, kept to reuse their memory.
+  std::vector<FileDescriptor::WriteRequest> requests_;
 };
 
 }  // namespace chromeos_update_engine
@@ -21,9 +21,69 @@ namespace chromeos_update_engine {
 ssize_t FakeFileDescriptor::Read(void* buf, size_t count) {
   // Record the read operation so it can later be inspected.
   read_ops_.emplace_back(offset_, count);
+  io_stats_.read_calls++;
+  io_stats_.time_us += storage_model_.latency_us +
+                       CountRequest(offset_, count) + TransferTime(count);
 
+  const ssize_t bytes_read = ReadAt(buf, count, offset_);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+bool FakeFileDescriptor::ReadBatch(const std::vector<ReadRequest>& requests) {
+  io_stats_.batch_calls++;
+  // The requests are issued in order, |queue_depth| at a time.
+  const size_t queue_depth = std::max<size_t>(storage_model_.queue_depth, 1);
+  for (size_t first = 0; first < requests.size(); first += queue_depth) {
+    const size_t last = std::min(first + queue_depth, requests.size());
+    double seek_us = 0;
+    double transfer_us = 0;
+    for (size_t i = first; i < last; i++) {
+      seek_us = std::max(
+          seek_us, CountRequest(requests[i].offset, requests[i].count));
+      transfer_us += TransferTime(requests[i].count);
+    }
+    io_stats_.time_us += storage_model_.latency_us + seek_us + transfer_us;
+  }
+
+  for (const ReadRequest& request : requests) {
+    // Short reads are retried like utils::ReadAll() would.
+    size_t done = 0;
+    while (done < request.count) {
+      const uint64_t offset = request.offset + done;
+      read_ops_.emplace_back(offset, request.count - done);
+      const ssize_t bytes_read =
+          ReadAt(static_cast<uint8_t*>(request.buf) + done,
+                 request.count - done,
+                 offset);
+      if (bytes_read <= 0)
+        return false;
+      done += bytes_read;
+    }
+  }
+  return true;
+}
+
+double FakeFileDescriptor::CountRequest(uint64_t offset, size_t count) {
+  io_stats_.requests++;
+  io_stats_.bytes_read += count;
+  const bool sequential = offset == last_request_end_;
+  last_request_end_ = offset + count;
+  if (sequential)
+    return 0;
+  io_stats_.non_sequential_requests++;
+  return storage_model_.seek_us;
+}
+
+double FakeFileDescriptor::TransferTime(size_t count) const {
+  return storage_model_.bytes_per_us > 0 ? count / storage_model_.bytes_per_us
+                                         : 0;
+}
+
+ssize_t FakeFileDescriptor::ReadAt(void* buf, size_t count, uint64_t offset) {
   // Check for the EOF condition first to avoid reporting it as a failure.
-  if (offset_ >= static_cast<uint64_t>(size_) || count == 0)
+  if (offset >= static_cast<uint64_t>(size_) || count == 0)
     return 0;
   // Find the first offset greater or equal than the current position where a
   // failure will occur. This will mark the end of the read chunk.
@@ -31,28 +91,29 @@ ssize_t FakeFileDescriptor::Read(void* buf, size_t count) {
   for (const auto& failure : failure_ranges_) {
     // A failure range that includes the current offset results in an
     // immediate failure to read any bytes.
-    if (failure.first <= offset_ && offset_ < failure.first + failure.second) {
+    if (failure.first <= offset && offset < failure.first + failure.second) {
       errno = EIO;
       return -1;
     }
-    if (failure.first > offset_)
+    if (failure.first > offset)
       first_failure = std::min(first_failure, failure.first);
   }
-  count = std::min(static_cast<uint64_t>(count), first_failure - offset_);
+  count = std::min(static_cast<uint64_t>(count), first_failure - offset);
   static const char kHexChars[] = "0123456789ABCDEF";
   for (size_t i = 0; i < count; ++i) {
-    // Encode the 16-bit number "offset_ / 4" as a hex digit in big-endian.
-    uint16_t current_num = offset_ / 4;
-    uint8_t current_digit = (current_num >> (4 * (3 - offset_ % 4))) & 0x0f;
+    // Encode the 16-bit number "offset / 4" as a hex digit in big-endian.
+    uint16_t current_num = offset / 4;
+    uint8_t current_digit = (current_num >> (4 * (3 - offset % 4))) & 0x0f;
 
     static_cast<uint8_t*>(buf)[i] = kHexChars[current_digit];
-    offset_++;
+    offset++;
   }
 
   return count;
 }
 
 off64_t FakeFileDescriptor::Seek(off64_t offset, int whence) {
+  io_stats_.seek_calls++;
   switch (whence) {
     case SEEK_SET:
       offset_ = offset;
@@ -33,8 +33,39 @@ namespace chromeos_update_engine {
 // numbers 0, 1, 2... each one encoded in 4 bytes as the big-endian 16-bit
 // number encoded in hexadecimal. For example, the beginning of the stream in
 // ASCII is 0000000100020003... which corresponds to the numbers 0, 1, 2 and 3.
+// The reads can be timed with a model of the storage, to benchmark the I/O
+// of the code under test deterministically. The time is only counted, never
+// waited for.
 class FakeFileDescriptor : public FileDescriptor {
  public:
+  // The cost of the reads, in simulated microseconds.
+  struct StorageModel {
+    // Of every read request.
+    double latency_us{0};
+    // Added to the requests not starting where the previous one ended.
+    double seek_us{0};
+    // Bytes transferred per microsecond, or 0 to not count the transfer.
+    double bytes_per_us{0};
+    // Number of the requests of a ReadBatch() in flight at once. Their
+    // latencies and seeks overlap, not their transfers.
+    size_t queue_depth{1};
+  };
+
+  // What the reads of the file cost so far.
+  struct IoStats {
+    // Calls to Read(), Seek() and ReadBatch().
+    size_t read_calls{0};
+    size_t seek_calls{0};
+    size_t batch_calls{0};
+    // Read requests, one per Read() and per request of a ReadBatch().
+    size_t requests{0};
+    // Requests not starting where the previous one ended.
+    size_t non_sequential_requests{0};
+    uint64_t bytes_read{0};
+    // Time of the reads as per the storage model.
+    double time_us{0};
+  };
+
   FakeFileDescriptor() = default;
   ~FakeFileDescriptor() override = default;
 
@@ -52,6 +83,8 @@ class FakeFileDescriptor : public FileDescriptor {
 
   ssize_t Read(void* buf, size_t count) override;
 
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+
   ssize_t Write(const void* buf, size_t count) override {
     // Read-only block device.
     errno = EROFS;
@@ -101,7 +134,22 @@ class FakeFileDescriptor : public FileDescriptor {
     return read_ops_;
   }
 
+  void SetStorageModel(const StorageModel& model) { storage_model_ = model; }
+  const IoStats& GetIoStats() const { return io_stats_; }
+  void ResetIoStats() { io_stats_ = {}; }
+
  private:
+  // Reads up to |count| bytes at |offset| into |buf| like Read(), without
+  // moving the file pointer or counting the read.
+  ssize_t ReadAt(void* buf, size_t count, uint64_t offset);
+
+  // Counts a read request of |count| bytes at |offset| in |io_stats_|, and
+  // returns its seek time as per |storage_model_|.
+  double CountRequest(uint64_t offset, size_t count);
+
+  // Returns the time to transfer |count| bytes as per |storage_model_|.
+  double TransferTime(size_t count) const;
+
   // Whether the fake file is open.
   bool open_{false};
 
@@ -118,6 +166,11 @@ class FakeFileDescriptor : public FileDescriptor {
   // List of reads performed as (offset, length) of the read request.
   std::vector<std::pair<uint64_t, uint64_t>> read_ops_;
 
+  StorageModel storage_model_;
+  IoStats io_stats_;
+  // Where the last read request ended.
+  uint64_t last_request_end_{0};
+
   DISALLOW_COPY_AND_ASSIGN(FakeFileDescriptor);
 };
 
@@ -0,0 +1,80 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+class FakeFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(fd_.Open("fake", O_RDONLY));
+    fd_.SetStorageModel({.latency_us = 100,
+                         .seek_us = 50,
+                         .bytes_per_us = 4,
+                         .queue_depth = 2});
+  }
+
+  FakeFileDescriptor fd_;
+};
+
+TEST_F(FakeFileDescriptorTest, ReadStatsTest) {
+  char buf[8];
+  EXPECT_EQ(8, fd_.Read(buf, 8));
+  EXPECT_EQ(8, fd_.Read(buf, 8));
+  EXPECT_EQ(32, fd_.Seek(16, SEEK_CUR));
+  EXPECT_EQ(8, fd_.Read(buf, 8));
+
+  const auto& stats = fd_.GetIoStats();
+  EXPECT_EQ(3u, stats.read_calls);
+  EXPECT_EQ(1u, stats.seek_calls);
+  EXPECT_EQ(3u, stats.requests);
+  // Only the read after the seek.
+  EXPECT_EQ(1u, stats.non_sequential_requests);
+  EXPECT_EQ(24u, stats.bytes_read);
+  EXPECT_DOUBLE_EQ(3 * (100 + 2) + 50, stats.time_us);
+
+  fd_.ResetIoStats();
+  EXPECT_EQ(0u, fd_.GetIoStats().requests);
+}
+
+TEST_F(FakeFileDescriptorTest, ReadBatchTest) {
+  std::vector<char> bufs(4 * 8);
+  std::vector<FileDescriptor::ReadRequest> requests;
+  for (off64_t offset : {0, 8, 64, 128})
+    requests.push_back({bufs.data() + requests.size() * 8, 8, offset});
+  EXPECT_TRUE(fd_.ReadBatch(requests));
+  EXPECT_EQ(FakeFileDescriptorData(8),
+            brillo::Blob(bufs.begin(), bufs.begin() + 8));
+
+  const auto& stats = fd_.GetIoStats();
+  EXPECT_EQ(1u, stats.batch_calls);
+  EXPECT_EQ(0u, stats.read_calls);
+  EXPECT_EQ(4u, stats.requests);
+  EXPECT_EQ(2u, stats.non_sequential_requests);
+  // Two requests in flight at once, the second pair seeks once for both.
+  EXPECT_DOUBLE_EQ((100 + 4) + (100 + 50 + 4), stats.time_us);
+
+  // The failure ranges apply to the batches too.
+  fd_.AddFailureRange(64, 1);
+  EXPECT_FALSE(fd_.ReadBatch(requests));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,10 +16,32 @@
 
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include <base/logging.h>
 
+#include "update_engine/common/utils.h"
+
 namespace chromeos_update_engine {
 
+namespace {
+// Copies the part of the |src_size| bytes of |src| at |src_offset| that
+// overlaps the |count| bytes at |offset| to |buf|.
+void CopyOverlap(const uint8_t* src,
+                 uint64_t src_offset,
+                 uint64_t src_size,
+                 uint8_t* buf,
+                 uint64_t offset,
+                 uint64_t count) {
+  const uint64_t begin = std::max(src_offset, offset);
+  const uint64_t end = std::min(src_offset + src_size, offset + count);
+  if (begin < end) {
+    memcpy(buf + (begin - offset), src + (begin - src_offset), end - begin);
+  }
+}
+}  // namespace
+
 bool FecFileDescriptor::Open(const char* path, int flags) {
   return Open(path, flags, 0600);
 }
@@ -42,11 +64,111 @@ bool FecFileDescriptor::Open(const char* path, int flags, mode_t mode) {
   }
 
   dev_size_ = status.data_size;
+  offset_ = 0;
+  ClearCache();
   return true;
 }
 
 ssize_t FecFileDescriptor::Read(void* buf, size_t count) {
-  return fh_.read(buf, count);
+  const ssize_t bytes_read = ReadAt(buf, count, offset_);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+bool FecFileDescriptor::ReadBatch(const std::vector<ReadRequest>& requests) {
+  // In offset order, so that a chunk shared by consecutive requests is only
+  // decoded for the first one.
+  std::vector<const ReadRequest*> sorted;
+  sorted.reserve(requests.size());
+  for (const auto& request : requests) {
+    sorted.push_back(&request);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+    return a->offset < b->offset;
+  });
+  for (const auto* request : sorted) {
+    TEST_AND_RETURN_FALSE(request->offset >= 0);
+    TEST_AND_RETURN_FALSE(
+        ReadAt(request->buf, request->count, request->offset) ==
+        static_cast<ssize_t>(request->count));
+  }
+  return true;
+}
+
+ssize_t FecFileDescriptor::DecodeAt(void* buf, size_t count, uint64_t offset) {
+  return fh_.pread(buf, count, offset);
+}
+
+ssize_t FecFileDescriptor::ReadAt(void* buf, size_t count, uint64_t offset) {
+  if (offset >= dev_size_ || count == 0) {
+    return 0;
+  }
+  count = std::min<uint64_t>(count, dev_size_ - offset);
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  const uint64_t last_index = (offset + count - 1) / kCacheChunkSize;
+  for (uint64_t index = offset / kCacheChunkSize; index <= last_index;) {
+    const uint64_t chunk_offset = index * kCacheChunkSize;
+    const brillo::Blob* chunk = GetCachedChunk(index);
+    if (chunk != nullptr) {
+      CopyOverlap(
+          chunk->data(), chunk_offset, chunk->size(), out, offset, count);
+      index++;
+      continue;
+    }
+    // Decodes the run of chunks missing from the cache at once.
+    uint64_t end_index = index + 1;
+    while (end_index <= last_index && cache_.count(end_index) == 0) {
+      end_index++;
+    }
+    const uint64_t run_size =
+        std::min(end_index * kCacheChunkSize, dev_size_) - chunk_offset;
+    brillo::Blob run(run_size);
+    const ssize_t bytes_read = DecodeAt(run.data(), run_size, chunk_offset);
+    if (bytes_read != static_cast<ssize_t>(run_size)) {
+      if (bytes_read >= 0) {
+        errno = EIO;
+      }
+      PLOG(ERROR) << "Failed to read " << run_size << " bytes at offset "
+                  << chunk_offset << " with error correction";
+      return -1;
+    }
+    CopyOverlap(run.data(), chunk_offset, run_size, out, offset, count);
+    for (uint64_t i = index; i < end_index; i++) {
+      auto begin = run.begin() + (i - index) * kCacheChunkSize;
+      auto end = std::min(begin + kCacheChunkSize, run.end());
+      CacheChunk(i, brillo::Blob(begin, end));
+    }
+    index = end_index;
+  }
+  return count;
+}
+
+const brillo::Blob* FecFileDescriptor::GetCachedChunk(uint64_t index) {
+  auto it = cache_.find(index);
+  if (it == cache_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return &it->second->second;
+}
+
+void FecFileDescriptor::CacheChunk(uint64_t index, brillo::Blob data) {
+  if (max_cached_chunks_ == 0) {
+    return;
+  }
+  if (lru_.size() == max_cached_chunks_) {
+    cache_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.emplace_front(index, std::move(data));
+  cache_[index] = lru_.begin();
+}
+
+void FecFileDescriptor::ClearCache() {
+  cache_.clear();
+  lru_.clear();
 }
 
 ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
@@ -55,10 +177,21 @@ ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
 }
 
 off64_t FecFileDescriptor::Seek(off64_t offset, int whence) {
-  if (fh_.seek(offset, whence)) {
-    return offset;
+  off64_t new_offset = offset;
+  if (whence == SEEK_CUR) {
+    new_offset += offset_;
+  } else if (whence == SEEK_END) {
+    new_offset += dev_size_;
+  } else if (whence != SEEK_SET) {
+    errno = EINVAL;
+    return -1;
   }
-  return -1;
+  if (new_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = new_offset;
+  return new_offset;
 }
 
 uint64_t FecFileDescriptor::BlockDevSize() {
@@ -74,6 +207,7 @@ bool FecFileDescriptor::BlkIoctl(int request,
 }
 
 bool FecFileDescriptor::Close() {
+  ClearCache();
   return fh_.close();
 }
 
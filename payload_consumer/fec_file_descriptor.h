@@ -17,6 +17,12 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
 #include <fec/io.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -30,9 +36,20 @@
 namespace chromeos_update_engine {
 
 // An error corrected file based on FEC.
+//
+// Correcting a corrupted block reads the RS blocks interleaved across the
+// whole partition, so the decoded data is kept in an LRU cache of
+// kCacheChunkSize chunks: the source extents of an operation are typically read
+// once to verify them and once more to apply it. The chunks missing for a read
+// are decoded together with a single libfec call.
 class FecFileDescriptor : public FileDescriptor {
  public:
-  FecFileDescriptor() = default;
+  static constexpr size_t kCacheChunkSize = 64 * 1024;
+  static constexpr size_t kDefaultCacheSize = 16 * 1024 * 1024;
+
+  // Caches up to |cache_size| bytes of decoded data, 0 disables the cache.
+  explicit FecFileDescriptor(size_t cache_size = kDefaultCacheSize)
+      : max_cached_chunks_(cache_size / kCacheChunkSize) {}
   ~FecFileDescriptor() = default;
 
   // Interface methods.
@@ -41,6 +58,7 @@ class FecFileDescriptor : public FileDescriptor {
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -56,8 +74,28 @@ class FecFileDescriptor : public FileDescriptor {
   }
 
  protected:
+  // Reads |count| bytes at |offset| through libfec, correcting the errors.
+  virtual ssize_t DecodeAt(void* buf, size_t count, uint64_t offset);
+
   fec::io fh_;
   uint64_t dev_size_{0};
+
+ private:
+  // Reads up to |count| bytes at |offset|, stopping at the end of the data.
+  ssize_t ReadAt(void* buf, size_t count, uint64_t offset);
+
+  // Returns the cached chunk |index| and marks it as the most recently used,
+  // or null if it isn't cached.
+  const brillo::Blob* GetCachedChunk(uint64_t index);
+  void CacheChunk(uint64_t index, brillo::Blob data);
+  void ClearCache();
+
+  const size_t max_cached_chunks_;
+  // The offset Read() reads at.
+  uint64_t offset_{0};
+  // The cached chunks and their index, the most recently used first.
+  std::list<std::pair<uint64_t, brillo::Blob>> lru_;
+  std::unordered_map<uint64_t, decltype(lru_)::iterator> cache_;
 };
 
 }  // namespace chromeos_update_engine
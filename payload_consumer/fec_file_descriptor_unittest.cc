@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fec_file_descriptor.h"
+
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kChunkSize = FecFileDescriptor::kCacheChunkSize;
+
+// Decodes from a buffer instead of libfec, and records the decoded ranges.
+class TestFecFileDescriptor : public FecFileDescriptor {
+ public:
+  TestFecFileDescriptor(size_t size, size_t cache_size)
+      : FecFileDescriptor(cache_size), data_(FakeFileDescriptorData(size)) {
+    dev_size_ = size;
+  }
+
+  const brillo::Blob& data() const { return data_; }
+  // The (offset, count) of the DecodeAt() calls.
+  std::vector<std::pair<uint64_t, size_t>> decodes;
+
+ protected:
+  ssize_t DecodeAt(void* buf, size_t count, uint64_t offset) override {
+    decodes.emplace_back(offset, count);
+    memcpy(buf, data_.data() + offset, count);
+    return count;
+  }
+
+ private:
+  brillo::Blob data_;
+};
+
+// Reads |count| bytes at |offset| of |fd| with Seek() and Read().
+brillo::Blob ReadAt(FileDescriptor* fd, uint64_t offset, size_t count) {
+  brillo::Blob buf(count);
+  EXPECT_EQ(static_cast<off64_t>(offset), fd->Seek(offset, SEEK_SET));
+  const ssize_t bytes_read = fd->Read(buf.data(), count);
+  buf.resize(bytes_read < 0 ? 0 : bytes_read);
+  return buf;
+}
+
+brillo::Blob Slice(const brillo::Blob& data, uint64_t offset, size_t count) {
+  return brillo::Blob(data.begin() + offset, data.begin() + offset + count);
+}
+}  // namespace
+
+TEST(FecFileDescriptorTest, CachesDecodedChunksTest) {
+  const size_t size = kChunkSize * 4 + 100;
+  TestFecFileDescriptor fd(size, kChunkSize * 8);
+
+  // The chunks are decoded at once, including the partial last one.
+  EXPECT_EQ(Slice(fd.data(), 100, size - 100), ReadAt(&fd, 100, size));
+  EXPECT_EQ(1u, fd.decodes.size());
+  EXPECT_EQ(0u, fd.decodes[0].first);
+  EXPECT_EQ(size, fd.decodes[0].second);
+
+  // Then read from the cache.
+  EXPECT_EQ(Slice(fd.data(), kChunkSize - 10, 20),
+            ReadAt(&fd, kChunkSize - 10, 20));
+  brillo::Blob next(30);
+  EXPECT_EQ(30, fd.Read(next.data(), next.size()));
+  EXPECT_EQ(Slice(fd.data(), kChunkSize + 10, 30), next);
+  EXPECT_EQ(1u, fd.decodes.size());
+
+  // Nothing past the end of the data.
+  EXPECT_TRUE(ReadAt(&fd, size, 10).empty());
+}
+
+TEST(FecFileDescriptorTest, LeastRecentlyUsedEvictionTest) {
+  TestFecFileDescriptor fd(kChunkSize * 4, kChunkSize * 2);
+  for (uint64_t chunk : {0, 1, 0, 2, 0, 1}) {
+    EXPECT_EQ(Slice(fd.data(), chunk * kChunkSize, 10),
+              ReadAt(&fd, chunk * kChunkSize, 10));
+  }
+  // Chunk 1 was evicted by chunk 2, and chunk 2 by chunk 1 again.
+  const std::vector<std::pair<uint64_t, size_t>> expected = {
+      {0, kChunkSize},
+      {kChunkSize, kChunkSize},
+      {kChunkSize * 2, kChunkSize},
+      {kChunkSize, kChunkSize},
+  };
+  EXPECT_EQ(expected, fd.decodes);
+}
+
+TEST(FecFileDescriptorTest, DecodesMissingRunsTest) {
+  TestFecFileDescriptor fd(kChunkSize * 4, kChunkSize * 4);
+  EXPECT_EQ(Slice(fd.data(), kChunkSize, kChunkSize),
+            ReadAt(&fd, kChunkSize, kChunkSize));
+  // Only the missing chunks are decoded, the cached one splits the run.
+  fd.decodes.clear();
+  EXPECT_EQ(fd.data(), ReadAt(&fd, 0, kChunkSize * 4));
+  const std::vector<std::pair<uint64_t, size_t>> expected = {
+      {0, kChunkSize},
+      {kChunkSize * 2, kChunkSize * 2},
+  };
+  EXPECT_EQ(expected, fd.decodes);
+}
+
+TEST(FecFileDescriptorTest, ReadBatchTest) {
+  TestFecFileDescriptor fd(kChunkSize * 4, kChunkSize * 4);
+  brillo::Blob first(kChunkSize), second(100), third(kChunkSize);
+  // Out of order, the second request is in a chunk the first one decodes.
+  const std::vector<FileDescriptor::ReadRequest> requests = {
+      {third.data(), third.size(), kChunkSize * 3},
+      {second.data(), second.size(), kChunkSize + 100},
+      {first.data(), first.size(), 100},
+  };
+  ASSERT_TRUE(fd.ReadBatch(requests));
+  EXPECT_EQ(Slice(fd.data(), 100, kChunkSize), first);
+  EXPECT_EQ(Slice(fd.data(), kChunkSize + 100, 100), second);
+  EXPECT_EQ(Slice(fd.data(), kChunkSize * 3, kChunkSize), third);
+  EXPECT_EQ(2u, fd.decodes.size());
+
+  // Reading past the end fails.
+  brillo::Blob past_end(10);
+  EXPECT_FALSE(fd.ReadBatch(
+      {{past_end.data(), past_end.size(), kChunkSize * 4 - 5}}));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,18 +17,113 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <type_traits>
+
 #include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Reads or writes all the bytes of |iovs| from or to |fd| at |offset| with
+// preadv()/pwritev(), restarting after short transfers. Modifies |iovs|.
+template <typename Request>
+bool TransferVectors(int fd, std::vector<iovec>* iovs, off64_t offset) {
+  size_t next = 0;
+  while (next < iovs->size()) {
+    ssize_t ret;
+    if constexpr (std::is_same_v<Request, FileDescriptor::ReadRequest>) {
+      ret = HANDLE_EINTR(
+          preadv64(fd, iovs->data() + next, iovs->size() - next, offset));
+    } else {
+      ret = HANDLE_EINTR(
+          pwritev64(fd, iovs->data() + next, iovs->size() - next, offset));
+    }
+    if (ret < 0) {
+      PLOG(ERROR) << "Vectored I/O of " << iovs->size() - next
+                  << " buffers at offset " << offset << " failed";
+      return false;
+    }
+    // A read returning 0 bytes hit the end of the file.
+    TEST_AND_RETURN_FALSE(ret > 0);
+    offset += ret;
+    size_t done = ret;
+    while (done > 0 && done >= (*iovs)[next].iov_len) {
+      done -= (*iovs)[next].iov_len;
+      next++;
+    }
+    if (done > 0) {
+      iovec* iov = &(*iovs)[next];
+      iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+      iov->iov_len -= done;
+    }
+  }
+  return true;
+}
+
+// Applies |requests| with one preadv()/pwritev() per run of requests
+// contiguous in the file, of up to IOV_MAX buffers each.
+template <typename Request>
+bool TransferBatch(int fd, const std::vector<Request>& requests) {
+  std::vector<const Request*> sorted;
+  sorted.reserve(requests.size());
+  for (const auto& request : requests) {
+    if (request.count > 0)
+      sorted.push_back(&request);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+    return a->offset < b->offset;
+  });
+  std::vector<iovec> iovs;
+  size_t next = 0;
+  while (next < sorted.size()) {
+    const off64_t offset = sorted[next]->offset;
+    off64_t end = offset;
+    iovs.clear();
+    while (next < sorted.size() && sorted[next]->offset == end &&
+           iovs.size() < IOV_MAX) {
+      const Request& request = *sorted[next++];
+      iovs.push_back({const_cast<void*>(static_cast<const void*>(request.buf)),
+                      request.count});
+      end += request.count;
+    }
+    TEST_AND_RETURN_FALSE(TransferVectors<Request>(fd, &iovs, offset));
+  }
+  return true;
+}
+
+}  // namespace
+
+bool FileDescriptor::ReadBatch(const std::vector<ReadRequest>& requests) {
+  for (const auto& request : requests) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(
+        this, request.buf, request.count, request.offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(request.count));
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteBatch(const std::vector<WriteRequest>& requests) {
+  for (const auto& request : requests) {
+    TEST_AND_RETURN_FALSE_ERRNO(Seek(request.offset, SEEK_SET) ==
+                                request.offset);
+    TEST_AND_RETURN_FALSE(utils::WriteAll(this, request.buf, request.count));
+  }
+  return true;
+}
+
 EintrSafeFileDescriptor::~EintrSafeFileDescriptor() {
   if (IsOpen()) {
     Close();
@@ -74,6 +169,18 @@ off64_t EintrSafeFileDescriptor::Seek(off64_t offset, int whence) {
   return lseek64(fd_, offset, whence);
 }
 
+bool EintrSafeFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  return TransferBatch(fd_, requests);
+}
+
+bool EintrSafeFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  CHECK_GE(fd_, 0);
+  return TransferBatch(fd_, requests);
+}
+
 uint64_t EintrSafeFileDescriptor::BlockDevSize() {
   if (fd_ < 0)
     return 0;
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <memory>
+#include <vector>
 
 #include <base/macros.h>
 
@@ -48,6 +49,19 @@ using FileDescriptorPtr = std::shared_ptr<FileDescriptor>;
 // An abstract class defining the file descriptor API.
 class FileDescriptor {
  public:
+  // A positioned read or write of |count| bytes at |offset|, used by the batch
+  // I/O methods below.
+  struct ReadRequest {
+    void* buf;
+    size_t count;
+    off64_t offset;
+  };
+  struct WriteRequest {
+    const void* buf;
+    size_t count;
+    off64_t offset;
+  };
+
   FileDescriptor() {}
   virtual ~FileDescriptor() {}
 
@@ -72,6 +86,15 @@ class FileDescriptor {
   // may set errno accordingly.
   virtual off64_t Seek(off64_t offset, int whence) = 0;
 
+  // Reads or writes all the bytes of every request in |requests|. Requests
+  // may be executed in any order and concurrently, so they must not overlap.
+  // The file offset is unspecified after the call. Returns false if any of
+  // the requests failed or was short. The default implementation issues the
+  // requests one at a time with Seek() and Read()/Write(); implementations
+  // able to have several I/Os in flight should override them.
+  virtual bool ReadBatch(const std::vector<ReadRequest>& requests);
+  virtual bool WriteBatch(const std::vector<WriteRequest>& requests);
+
   // Return the size of the block device in bytes, or 0 if the device is not a
   // block device or an error occurred.
   virtual uint64_t BlockDevSize() = 0;
@@ -126,6 +149,10 @@ class EintrSafeFileDescriptor final : public FileDescriptor {
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  // Merge the requests contiguous in the file into preadv()/pwritev() calls
+  // and leave the file offset untouched.
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 8;
+}  // namespace
+
+class EintrSafeFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+    data_.resize(kBlockSize * kNumBlocks);
+    for (size_t i = 0; i < data_.size(); i++)
+      data_[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+  }
+
+  ScopedTempFile temp_file_{"EintrSafeFileDescriptorTest-XXXXXX",
+                            false,
+                            kBlockSize * kNumBlocks};
+  EintrSafeFileDescriptor fd_;
+  brillo::Blob data_;
+};
+
+TEST_F(EintrSafeFileDescriptorTest, WriteAndReadBatchTest) {
+  // Contiguous blocks in a shuffled order, and a hole at block 5.
+  std::vector<FileDescriptor::WriteRequest> writes;
+  for (size_t block : {3, 0, 7, 1, 6, 2, 4}) {
+    const size_t offset = block * kBlockSize;
+    writes.push_back(
+        {data_.data() + offset, kBlockSize, static_cast<off64_t>(offset)});
+  }
+  writes.push_back({nullptr, 0, 0});
+  ASSERT_TRUE(fd_.WriteBatch(writes));
+  // The file offset isn't used.
+  EXPECT_EQ(0, fd_.Seek(0, SEEK_CUR));
+
+  brillo::Blob expected = data_;
+  std::fill(expected.begin() + kBlockSize * 5,
+            expected.begin() + kBlockSize * 6,
+            0);
+  brillo::Blob on_disk;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &on_disk));
+  EXPECT_EQ(expected, on_disk);
+
+  brillo::Blob read_data(data_.size());
+  std::vector<FileDescriptor::ReadRequest> reads = {
+      {read_data.data() + kBlockSize * 6 + 1,
+       kBlockSize * 2 - 1,
+       kBlockSize * 6 + 1},
+      {read_data.data(), kBlockSize * 5, 0},
+      {read_data.data() + kBlockSize * 6, 1, kBlockSize * 6},
+      {read_data.data() + kBlockSize * 5, kBlockSize, kBlockSize * 5},
+  };
+  ASSERT_TRUE(fd_.ReadBatch(reads));
+  EXPECT_EQ(expected, read_data);
+}
+
+TEST_F(EintrSafeFileDescriptorTest, ReadBatchPastEndTest) {
+  brillo::Blob read_data(kBlockSize * 2);
+  EXPECT_FALSE(fd_.ReadBatch({{read_data.data(),
+                               read_data.size(),
+                               kBlockSize * (kNumBlocks - 1)}}));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,9 +16,15 @@
 
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 
+#include <base/files/scoped_file.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
@@ -35,6 +41,55 @@ namespace {
 // Size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
+// Copies |length| bytes at |in_offset| of |in_fd| to |out_offset| of
+// |out_fd| with copy_file_range().
+bool CopyFileRange(int in_fd,
+                   off64_t in_offset,
+                   int out_fd,
+                   off64_t out_offset,
+                   uint64_t length) {
+  while (length > 0) {
+    const ssize_t copied = HANDLE_EINTR(copy_file_range(
+        in_fd, &in_offset, out_fd, &out_offset, length, 0));
+    // 0 is the end of |in_fd|.
+    TEST_AND_RETURN_FALSE_ERRNO(copied > 0);
+    length -= copied;
+  }
+  return true;
+}
+
+// Copies |length| bytes at |in_offset| of |in_fd| to |out_offset| of
+// |out_fd| through the pipe |pipe_fds|, which must be empty, with splice().
+bool SpliceRange(int in_fd,
+                 off64_t in_offset,
+                 int out_fd,
+                 off64_t out_offset,
+                 uint64_t length,
+                 const int pipe_fds[2]) {
+  while (length > 0) {
+    ssize_t in_pipe = HANDLE_EINTR(splice(in_fd,
+                                          &in_offset,
+                                          pipe_fds[1],
+                                          nullptr,
+                                          std::min(length, kMaxCopyBufferSize),
+                                          SPLICE_F_MOVE));
+    TEST_AND_RETURN_FALSE_ERRNO(in_pipe > 0);
+    length -= in_pipe;
+    while (in_pipe > 0) {
+      const ssize_t spliced = HANDLE_EINTR(splice(
+          pipe_fds[0], nullptr, out_fd, &out_offset, in_pipe, SPLICE_F_MOVE));
+      TEST_AND_RETURN_FALSE_ERRNO(spliced > 0);
+      in_pipe -= spliced;
+    }
+  }
+  return true;
+}
+
+bool IsRegularFile(int fd) {
+  struct stat st {};
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
 }  // namespace
 namespace fd_utils {
 
@@ -90,6 +145,62 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
   return true;
 }
 
+bool CopyExtentsInKernel(FileDescriptorPtr source,
+                         const RepeatedPtrField<Extent>& src_extents,
+                         FileDescriptorPtr target,
+                         const RepeatedPtrField<Extent>& tgt_extents,
+                         uint64_t block_size) {
+  const int source_fd = source->Fd();
+  const int target_fd = target->Fd();
+  TEST_AND_RETURN_FALSE(source_fd >= 0 && target_fd >= 0);
+  TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
+                        utils::BlocksInExtents(tgt_extents));
+
+  // copy_file_range() only copies between regular files, but may then share
+  // the blocks instead of copying them.
+  const bool use_copy_file_range =
+      IsRegularFile(source_fd) && IsRegularFile(target_fd);
+  base::ScopedFD pipe_read, pipe_write;
+  if (!use_copy_file_range) {
+    int pipe_fds[2];
+    TEST_AND_RETURN_FALSE_ERRNO(pipe2(pipe_fds, O_CLOEXEC) == 0);
+    pipe_read.reset(pipe_fds[0]);
+    pipe_write.reset(pipe_fds[1]);
+    // Move up to kMaxCopyBufferSize at once, the default is 64 KiB.
+    fcntl(pipe_write.get(), F_SETPIPE_SZ, kMaxCopyBufferSize);
+  }
+  const int pipe_fds[2] = {pipe_read.get(), pipe_write.get()};
+
+  auto src = src_extents.begin();
+  auto tgt = tgt_extents.begin();
+  uint64_t src_block = 0, tgt_block = 0;
+  while (src != src_extents.end() && tgt != tgt_extents.end()) {
+    const uint64_t num_blocks = std::min(src->num_blocks() - src_block,
+                                         tgt->num_blocks() - tgt_block);
+    const off64_t in_offset = (src->start_block() + src_block) * block_size;
+    const off64_t out_offset = (tgt->start_block() + tgt_block) * block_size;
+    const uint64_t length = num_blocks * block_size;
+    if (use_copy_file_range) {
+      TEST_AND_RETURN_FALSE(CopyFileRange(
+          source_fd, in_offset, target_fd, out_offset, length));
+    } else {
+      TEST_AND_RETURN_FALSE(SpliceRange(
+          source_fd, in_offset, target_fd, out_offset, length, pipe_fds));
+    }
+    src_block += num_blocks;
+    tgt_block += num_blocks;
+    if (src_block == src->num_blocks()) {
+      src++;
+      src_block = 0;
+    }
+    if (tgt_block == tgt->num_blocks()) {
+      tgt++;
+      tgt_block = 0;
+    }
+  }
+  return true;
+}
+
 bool ReadAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& extents,
                         uint64_t block_size,
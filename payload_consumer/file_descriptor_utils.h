@@ -50,6 +50,20 @@ bool CopyAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Copies blocks from the |source| file to the |target| file like
+// CopyAndHashExtents(), but within the kernel, with copy_file_range() between
+// regular files and splice() otherwise, so the data isn't copied to and from
+// user space. Both files must expose their file descriptor through Fd(), and
+// the writes bypass any caching or policy of |target|. Returns false if the
+// kernel can't copy between them or on error, the blocks are then left
+// partially copied.
+bool CopyExtentsInKernel(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    FileDescriptorPtr target,
+    const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
+    uint64_t block_size);
+
 // Reads blocks from |source| and calculates the hash. The blocks to read are
 // specified by |extents|. Stores the hash in |hash_out| if it is not null. The
 // block sizes are passed as |block_size|. In case of error reading, it returns
@@ -165,6 +165,35 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsManyToManyTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+// The kernel copies between the files themselves.
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelTest) {
+  ScopedTempFile src_file("fd_src.XXXXXX");
+  ASSERT_TRUE(
+      utils::WriteFile(src_file.path().c_str(), "00000001000200030004", 20));
+  FileDescriptorPtr source(new EintrSafeFileDescriptor());
+  ASSERT_TRUE(source->Open(src_file.path().c_str(), O_RDONLY));
+  auto src_extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
+  auto tgt_extents = CreateExtentList({{2, 3}, {0, 2}});
+
+  EXPECT_TRUE(fd_utils::CopyExtentsInKernel(
+      source, src_extents, target_, tgt_extents, 4));
+  ExpectTarget("00030000000100040002");
+
+  // A source past the end of the file.
+  EXPECT_FALSE(fd_utils::CopyExtentsInKernel(source,
+                                             CreateExtentList({{5, 1}}),
+                                             target_,
+                                             CreateExtentList({{0, 1}}),
+                                             4));
+}
+
+// Only the files with a file descriptor can be copied in the kernel.
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelWithoutFdTest) {
+  auto extents = CreateExtentList({{0, 5}});
+  EXPECT_FALSE(
+      fd_utils::CopyExtentsInKernel(source_, extents, target_, extents, 4));
+}
+
 // Failing to read from the source should fail the hash calculation.
 TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsReadFailureTest) {
   auto extents = CreateExtentList({{0, 5}});
@@ -37,10 +37,15 @@
 #include <brillo/secure_blob.h>
 #include <brillo/streams/file_stream.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_trace.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#include "update_engine/payload_consumer/written_data_hasher.h"
 
 using brillo::data_encoding::Base64Encode;
 using std::string;
@@ -80,9 +85,29 @@ namespace chromeos_update_engine {
 
 namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
+// With io_uring, read this much per step as several kReadFileBufferSize
+// requests in flight together.
+const off_t kIoUringReadBufferSize = 8 * kReadFileBufferSize;
+// How often to check the progress of the partitions hashed in parallel.
+constexpr base::TimeDelta kParallelHashingCheckInterval =
+    base::TimeDelta::FromMilliseconds(100);
+// How often to save the progress of the verification.
+constexpr base::TimeDelta kCheckpointInterval = base::TimeDelta::FromSeconds(1);
 constexpr float kVerityProgressPercent = 0.3;
 constexpr float kEncodeFECPercent = 0.3;
 
+// Reads |count| bytes at |offset| of |fd| into |buffer|, split into requests
+// of at most kReadFileBufferSize bytes.
+bool ReadAt(FileDescriptor* fd, off64_t offset, void* buffer, size_t count) {
+  std::vector<FileDescriptor::ReadRequest> requests;
+  for (size_t done = 0; done < count; done += kReadFileBufferSize) {
+    requests.push_back({static_cast<uint8_t*>(buffer) + done,
+                        std::min<size_t>(kReadFileBufferSize, count - done),
+                        static_cast<off64_t>(offset + done)});
+  }
+  return fd->ReadBatch(requests);
+}
+
 }  // namespace
 
 void FilesystemVerifierAction::PerformAction() {
@@ -93,12 +118,12 @@ void FilesystemVerifierAction::PerformAction() {
     LOG(ERROR) << "FilesystemVerifierAction missing input object.";
     return;
   }
-  install_plan_ = GetInputObject();
+  install_plan_ = TakeInputObject();
 
   if (install_plan_.partitions.empty()) {
     LOG(INFO) << "No partitions to verify.";
     if (HasOutputPipe())
-      SetOutputObject(install_plan_);
+      SetOutputObject(std::move(install_plan_));
     abort_action_completer.set_code(ErrorCode::kSuccess);
     return;
   }
@@ -123,19 +148,45 @@ void FilesystemVerifierAction::PerformAction() {
       !install_plan_.write_verity) {
     dynamic_control_->MapAllPartitions();
   }
-  StartPartitionHashing();
+  started_early_ = !AllPartitionsReady();
+  if (UseParallelVerification()) {
+    StartParallelVerification();
+  } else {
+    LoadCheckpoint();
+    StartPartitionHashing();
+  }
   abort_action_completer.set_should_complete(false);
 }
 
+bool FilesystemVerifierAction::CanStartOnPartitions() {
+  return HasInputObject() && !GetInputObject().partitions.empty() &&
+         !dynamic_control_->UpdateUsesSnapshotCompression();
+}
+
+void FilesystemVerifierAction::PartitionsReady() {
+  if (cancelled_)
+    return;
+  if (AllPartitionsReady())
+    UpdateProgress(progress_);
+  if (waiting_for_partitions_)
+    StartPartitionHashing();
+}
+
 void FilesystemVerifierAction::TerminateProcessing() {
   cancelled_ = true;
   Cleanup(ErrorCode::kSuccess);  // error code is ignored if canceled_ is true.
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
+  // Waits for the workers, which must be done before unmapping partitions.
+  parallel_hasher_.reset();
   partition_fd_.reset();
   // This memory is not used anymore.
-  buffer_.clear();
+  buffer_.reset();
+  buffer_memory_.Set(0);
+  // A cancelled verification can still resume from its checkpoint.
+  if (!cancelled_)
+    ClearCheckpoint();
   if (code == ErrorCode::kSuccess && !cancelled_) {
     if (!dynamic_control_->FinishUpdate(install_plan_.powerwash_required)) {
       LOG(ERROR) << "Failed to FinishUpdate("
@@ -154,18 +205,27 @@ void FilesystemVerifierAction::Cleanup(ErrorCode code) {
 
   if (cancelled_)
     return;
+  // The install plan isn't used anymore.
   if (code == ErrorCode::kSuccess && HasOutputPipe())
-    SetOutputObject(install_plan_);
+    SetOutputObject(std::move(install_plan_));
   UpdateProgress(1.0);
   processor_->ActionComplete(this, code);
 }
 
 void FilesystemVerifierAction::UpdateProgress(double progress) {
-  if (delegate_ != nullptr) {
+  progress_ = progress;
+  // The action before is still reporting its own progress.
+  if (delegate_ != nullptr && AllPartitionsReady()) {
     delegate_->OnVerifyProgressUpdate(progress);
   }
 }
 
+uint64_t FilesystemVerifierAction::bytes_verified() const {
+  if (partition_weight_.empty())
+    return 0;
+  return static_cast<uint64_t>(progress_ * partition_weight_.back());
+}
+
 void FilesystemVerifierAction::UpdatePartitionProgress(double progress) {
   UpdateProgress((partition_weight_[partition_index_] * (1 - progress) +
                   partition_weight_[partition_index_ + 1] * progress) /
@@ -209,12 +269,26 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
                << partition.source_path << ") failed.";
     return false;
   }
+  if (IoTraceRecorder::Get()->IsRecording()) {
+    partition_fd_ = std::make_unique<TracingFileDescriptor>(
+        FileDescriptorPtr(std::move(partition_fd_)),
+        IoTraceRecorder::Get(),
+        "cow:" + partition.name);
+  }
   partition_size_ = partition.target_size;
   return true;
 }
 
 bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
-  partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
+  if (install_plan_.use_io_uring) {
+    partition_fd_ = std::make_unique<IoUringFileDescriptor>();
+  } else {
+    partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
+  }
+  if (IoTraceRecorder::Get()->IsRecording()) {
+    partition_fd_ = std::make_unique<TracingFileDescriptor>(
+        FileDescriptorPtr(std::move(partition_fd_)), IoTraceRecorder::Get());
+  }
   const bool write_verity = ShouldWriteVerity();
   int flags = write_verity ? O_RDWR : O_RDONLY;
   if (!utils::SetBlockDeviceReadOnly(part_path, !write_verity)) {
@@ -233,6 +307,16 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
                                                const size_t buffer_size) {
   if (verity_writer_->FECFinished()) {
     LOG(INFO) << "EncodeFEC is completed. Resuming other tasks";
+    StopPhase(phases::kVerity, install_plan_.partitions[partition_index_].name);
+    if (UseParallelVerification()) {
+      // The partition is hashed together with the others once all the verity
+      // data is written.
+      partition_fd_->Close();
+      partition_fd_.reset();
+      partition_index_++;
+      StartParallelVerification();
+      return;
+    }
     if (dynamic_control_->UpdateUsesSnapshotCompression()) {
       // Spin up snapuserd to read fs.
       if (!InitializeFdVABC(false)) {
@@ -241,7 +325,9 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
         return;
       }
     }
-    HashPartition(0, partition_size_, buffer, buffer_size);
+    StartPhase(phases::kHashing,
+               install_plan_.partitions[partition_index_].name);
+    HashPartition(written_hash_size_, partition_size_, buffer, buffer_size);
     return;
   }
   if (!verity_writer_->IncrementalFinalize(fd, fd)) {
@@ -273,21 +359,32 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
     WriteVerityData(fd, buffer, buffer_size);
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kVerityCalculationError);
-    return;
+  auto read_size = std::min<size_t>(buffer_size, end_offset - start_offset);
+  uint64_t known_start = 0;
+  uint64_t known_end = 0;
+  if (verity_writer_->GetKnownData(start_offset, &known_start, &known_end) &&
+      known_start < start_offset + read_size) {
+    if (known_start <= static_cast<uint64_t>(start_offset)) {
+      // The hash tree digests of this data are already known.
+      CHECK(pending_task_id_.PostTask(
+          FROM_HERE,
+          base::BindOnce(&FilesystemVerifierAction::WriteVerityAndHashPartition,
+                         base::Unretained(this),
+                         std::min<off64_t>(known_end, end_offset),
+                         end_offset,
+                         buffer,
+                         buffer_size)));
+      return;
+    }
+    read_size = known_start - start_offset;
   }
-  const auto read_size =
-      std::min<size_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
+  if (!ReadAt(fd, start_offset, buffer, read_size)) {
+    PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                << start_offset;
     Cleanup(ErrorCode::kVerityCalculationError);
     return;
   }
+  const off64_t bytes_read = read_size;
   if (!verity_writer_->Update(
           start_offset, static_cast<const uint8_t*>(buffer), read_size)) {
     LOG(ERROR) << "VerityWriter::Update() failed";
@@ -316,29 +413,26 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
     LOG_IF(WARNING, start_offset > end_offset)
         << "start_offset is greater than end_offset : " << start_offset << " > "
         << end_offset;
+    StopPhase(phases::kHashing,
+              install_plan_.partitions[partition_index_].name);
     FinishPartitionHashing();
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
-  }
   const auto read_size =
       std::min<size_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
+  if (!ReadAt(fd, start_offset, buffer, read_size)) {
+    PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                << start_offset;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
+  const off64_t bytes_read = read_size;
   if (!hasher_->Update(buffer, read_size)) {
     LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
+  SaveCheckpoint(start_offset + bytes_read, false);
   const auto progress = (start_offset + bytes_read) * 1.0f / partition_size_;
   // If we are writing verity, then the progress bar will be split between
   // verity writes and partition hashing. Otherwise, the entire progress bar is
@@ -361,6 +455,18 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
 }
 
 void FilesystemVerifierAction::StartPartitionHashing() {
+  const bool partition_ready =
+      partition_index_ == install_plan_.partitions.size()
+          ? AllPartitionsReady()
+          : verifier_step_ != VerifierStep::kVerifyTargetHash ||
+                IsPartitionReady(
+                    install_plan_.partitions[partition_index_].name);
+  waiting_for_partitions_ = !partition_ready;
+  if (waiting_for_partitions_) {
+    LOG(INFO) << "Waiting for partition " << partition_index_
+              << " to be written.";
+    return;
+  }
   if (partition_index_ == install_plan_.partitions.size()) {
     if (!install_plan_.untouched_dynamic_partitions.empty()) {
       LOG(INFO) << "Verifying extents of untouched dynamic partitions ["
@@ -379,6 +485,18 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kSuccess);
     return;
   }
+  if (started_early_ && HasInputObject()) {
+    // The hash computed while writing the partition is only in the install
+    // plans set once it was written.
+    const InstallPlan& input_plan = GetInputObject();
+    InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    if (partition_index_ < input_plan.partitions.size() &&
+        input_plan.partitions[partition_index_].name == partition.name) {
+      partition.written_data_hasher =
+          input_plan.partitions[partition_index_].written_data_hasher;
+    }
+  }
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
   const auto& part_path = GetPartitionPath();
@@ -395,7 +513,12 @@ void FilesystemVerifierAction::StartPartitionHashing() {
         LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
                   << partition.name << ") because size is 0.";
         partition_index_++;
-        StartPartitionHashing();
+        if (UseParallelVerification()) {
+          StartParallelVerification();
+        } else {
+          ReportVerifiedPartitions();
+          StartPartitionHashing();
+        }
         return;
       }
       LOG(ERROR) << "Cannot hash partition " << partition_index_ << " ("
@@ -410,8 +533,33 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  buffer_.resize(kReadFileBufferSize);
+  buffer_ = AlignedBufferPool::Get()->Acquire(GetReadSize());
+  if (buffer_.empty()) {
+    LOG(ERROR) << "Unable to allocate the read buffer.";
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
+  buffer_memory_.Set(buffer_.capacity());
   hasher_ = std::make_unique<HashCalculator>();
+  std::string hash_context;
+  written_hash_size_ = GetWrittenHash(&hash_context);
+  const bool resumed = resume_offset_ > written_hash_size_;
+  if (resumed) {
+    written_hash_size_ = resume_offset_;
+    hash_context = resume_context_;
+  }
+  if (written_hash_size_ > 0 && !hasher_->SetContext(hash_context)) {
+    LOG(WARNING) << "Unable to restore the hash of the first "
+                 << written_hash_size_ << " bytes of " << partition.name;
+    hasher_ = std::make_unique<HashCalculator>();
+    written_hash_size_ = 0;
+  }
+  if (written_hash_size_ > 0) {
+    LOG(INFO) << "Using the hash of the first " << written_hash_size_
+              << " bytes of " << partition.name
+              << (resumed ? " saved before the verification was interrupted."
+                          : " computed while writing it.");
+  }
 
   offset_ = 0;
   filesystem_data_end_ = partition_size_;
@@ -432,12 +580,185 @@ void FilesystemVerifierAction::StartPartitionHashing() {
       Cleanup(ErrorCode::kVerityCalculationError);
       return;
     }
+    StartPhase(phases::kVerity, partition.name);
     WriteVerityAndHashPartition(
         0, filesystem_data_end_, buffer_.data(), buffer_.size());
   } else {
     LOG(INFO) << "Verity writes disabled on partition " << partition.name;
-    HashPartition(0, partition_size_, buffer_.data(), buffer_.size());
+    StartPhase(phases::kHashing, partition.name);
+    HashPartition(
+        written_hash_size_, partition_size_, buffer_.data(), buffer_.size());
+  }
+}
+
+bool FilesystemVerifierAction::UseParallelVerification() const {
+  return install_plan_.verify_threads > 1 && !started_early_ &&
+         verifier_step_ == VerifierStep::kVerifyTargetHash;
+}
+
+void FilesystemVerifierAction::StartParallelVerification() {
+  const size_t num_partitions = install_plan_.partitions.size();
+  while (partition_index_ < num_partitions && !ShouldWriteVerity()) {
+    partition_index_++;
+  }
+  if (partition_index_ < num_partitions) {
+    // Writes the verity data, then comes back here from WriteVerityData().
+    StartPartitionHashing();
+    return;
+  }
+  StartParallelHashing();
+}
+
+void FilesystemVerifierAction::StartParallelHashing() {
+  if (install_plan_.write_verity &&
+      dynamic_control_->UpdateUsesSnapshotCompression()) {
+    // Re-spin snapuserd so that it serves the verity data just written, see
+    // InitializeFdVABC(). Partitions weren't mapped yet if none needed verity.
+    dynamic_control_->UnmapAllPartitions();
+    dynamic_control_->MapAllPartitions();
+  }
+
+  std::vector<ParallelPartitionHasher::Job> jobs;
+  parallel_partitions_.clear();
+  parallel_total_bytes_ = 0;
+  for (partition_index_ = 0;
+       partition_index_ < install_plan_.partitions.size();
+       partition_index_++) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    const auto& part_path = GetPartitionPath();
+    const uint64_t size = GetPartitionSize();
+    if (part_path.empty()) {
+      if (size == 0) {
+        LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
+                  << partition.name << ") because size is 0.";
+        continue;
+      }
+      LOG(ERROR) << "Cannot hash partition " << partition_index_ << " ("
+                 << partition.name
+                 << ") because its device path cannot be determined.";
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    if (!utils::SetBlockDeviceReadOnly(part_path, true)) {
+      LOG(WARNING) << "Failed to set block device " << part_path
+                   << " as readonly";
+    }
+    ParallelPartitionHasher::Job job{part_path, size};
+    job.offset = GetWrittenHash(&job.context);
+    parallel_total_bytes_ += size - job.offset;
+    jobs.push_back(std::move(job));
+    parallel_partitions_.push_back(partition_index_);
+  }
+
+  LOG(INFO) << "Hashing " << jobs.size() << " partitions on "
+            << install_plan_.verify_threads << " threads.";
+  parallel_hasher_ =
+      std::make_unique<ParallelPartitionHasher>(std::move(jobs),
+                                                install_plan_.verify_threads,
+                                                GetReadSize(),
+                                                install_plan_.use_io_uring);
+  // The partitions are hashed together, only the whole is timed.
+  StartPhase(phases::kHashing);
+  parallel_hasher_->Start();
+  parallel_progress_start_ = progress_;
+  CheckParallelHashing();
+}
+
+void FilesystemVerifierAction::CheckParallelHashing() {
+  if (parallel_total_bytes_ > 0) {
+    UpdateProgress(parallel_progress_start_ +
+                   (1 - parallel_progress_start_) *
+                       parallel_hasher_->bytes_hashed() /
+                       parallel_total_bytes_);
+  }
+  if (!parallel_hasher_->IsDone()) {
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckParallelHashing,
+                       base::Unretained(this)),
+        kParallelHashingCheckInterval));
+    return;
   }
+  StopPhase(phases::kHashing);
+
+  // Check the partitions in order, so that the first mismatching one is the
+  // one whose source is verified, as when hashing them one after another.
+  for (size_t job = 0; job < parallel_partitions_.size(); job++) {
+    partition_index_ = parallel_partitions_[job];
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    brillo::Blob hash;
+    if (!parallel_hasher_->GetResult(job, &hash)) {
+      LOG(ERROR) << "Failed to hash partition " << partition.name;
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    LOG(INFO) << "Hash of " << partition.name << ": " << HexEncode(hash);
+    if (partition.target_hash == hash) {
+      continue;
+    }
+    LOG(ERROR) << "New '" << partition.name
+               << "' partition verification failed.";
+    std::string context;
+    if (GetWrittenHash(&context) > 0) {
+      LOG(WARNING) << "Hashing all the partitions again from disk.";
+      ignore_written_hashes_ = true;
+      parallel_hasher_.reset();
+      StartParallelHashing();
+      return;
+    }
+    if (partition.source_hash.empty()) {
+      Cleanup(ErrorCode::kNewRootfsVerificationError);
+      return;
+    }
+    // Verify the source of this partition the usual way.
+    parallel_hasher_.reset();
+    verifier_step_ = VerifierStep::kVerifySourceHash;
+    StartPartitionHashing();
+    return;
+  }
+  parallel_hasher_.reset();
+  partition_index_ = install_plan_.partitions.size();
+  ReportVerifiedPartitions();
+  // Verifies the untouched dynamic partitions and finishes the action.
+  StartPartitionHashing();
+}
+
+void FilesystemVerifierAction::ReportVerifiedPartitions() {
+  // Under VABC, the partitions are unmapped and mapped again by the next
+  // actions, which can't run while verifying.
+  if (verifier_step_ != VerifierStep::kVerifyTargetHash ||
+      dynamic_control_->UpdateUsesSnapshotCompression() ||
+      num_reported_partitions_ >= partition_index_) {
+    return;
+  }
+  if (HasOutputPipe())
+    SetOutputObject(install_plan_);
+  for (; num_reported_partitions_ < partition_index_;
+       num_reported_partitions_++) {
+    PartitionCompleted(install_plan_.partitions[num_reported_partitions_].name);
+  }
+}
+
+uint64_t FilesystemVerifierAction::GetWrittenHash(std::string* context) const {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  if (ignore_written_hashes_ ||
+      verifier_step_ != VerifierStep::kVerifyTargetHash ||
+      !partition.written_data_hasher) {
+    return 0;
+  }
+  const uint64_t size = partition.written_data_hasher->GetHashedPrefix(context);
+  return size <= GetPartitionSize() ? size : 0;
+}
+
+size_t FilesystemVerifierAction::GetReadSize() const {
+  if (install_plan_.verify_read_size > 0) {
+    return install_plan_.verify_read_size;
+  }
+  return install_plan_.use_io_uring ? kIoUringReadBufferSize
+                                    : kReadFileBufferSize;
 }
 
 bool FilesystemVerifierAction::IsVABC(
@@ -477,12 +798,74 @@ size_t FilesystemVerifierAction::GetPartitionSize() const {
 bool FilesystemVerifierAction::ShouldWriteVerity() {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
+  // A checkpoint is only saved once the verity data is written.
   return verifier_step_ == VerifierStep::kVerifyTargetHash &&
-         install_plan_.write_verity &&
+         install_plan_.write_verity && resume_offset_ == 0 &&
          (partition.hash_tree_size > 0 || partition.fec_size > 0);
 }
 
+void FilesystemVerifierAction::LoadCheckpoint() {
+  int64_t index = 0;
+  int64_t offset = 0;
+  std::string context;
+  if (prefs_ == nullptr || !install_plan_.is_resume ||
+      !prefs_->GetInt64(kPrefsVerifierStatePartitionIndex, &index) ||
+      !prefs_->GetInt64(kPrefsVerifierStateOffset, &offset) ||
+      !prefs_->GetString(kPrefsVerifierStateSHA256Context, &context)) {
+    return;
+  }
+  const size_t num_partitions = install_plan_.partitions.size();
+  if (index < 0 || static_cast<uint64_t>(index) > num_partitions ||
+      offset < 0 ||
+      (offset > 0 && (static_cast<uint64_t>(index) == num_partitions ||
+                      static_cast<uint64_t>(offset) >
+                          install_plan_.partitions[index].target_size ||
+                      context.empty()))) {
+    LOG(WARNING) << "Ignoring invalid verification checkpoint: partition "
+                 << index << " offset " << offset;
+    return;
+  }
+  LOG(INFO) << "Resuming the verification at partition " << index
+            << " offset " << offset;
+  partition_index_ = index;
+  resume_offset_ = offset;
+  resume_context_ = offset > 0 ? context : "";
+}
+
+void FilesystemVerifierAction::SaveCheckpoint(uint64_t offset, bool force) {
+  if (prefs_ == nullptr || verifier_step_ != VerifierStep::kVerifyTargetHash) {
+    return;
+  }
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (!force && now < next_checkpoint_time_) {
+    return;
+  }
+  next_checkpoint_time_ = now + kCheckpointInterval;
+  // The partition index is saved last: if this is interrupted, the partition
+  // is either hashed again entirely, or its hash mismatches and is then
+  // computed again from disk.
+  if (!prefs_->SetString(kPrefsVerifierStateSHA256Context,
+                         offset > 0 ? hasher_->GetContext() : "") ||
+      !prefs_->SetInt64(kPrefsVerifierStateOffset, offset) ||
+      !prefs_->SetInt64(kPrefsVerifierStatePartitionIndex, partition_index_)) {
+    LOG(WARNING) << "Unable to save the verification checkpoint.";
+  }
+}
+
+void FilesystemVerifierAction::ClearCheckpoint() {
+  if (prefs_ == nullptr) {
+    return;
+  }
+  prefs_->Delete(kPrefsVerifierStatePartitionIndex);
+  prefs_->Delete(kPrefsVerifierStateOffset);
+  prefs_->Delete(kPrefsVerifierStateSHA256Context);
+}
+
 void FilesystemVerifierAction::FinishPartitionHashing() {
+  // Whatever the result, the checkpoint doesn't apply to the partition hashed
+  // next.
+  resume_offset_ = 0;
+  resume_context_.clear();
   if (!hasher_->Finalize()) {
     LOG(ERROR) << "Unable to finalize the hash.";
     Cleanup(ErrorCode::kError);
@@ -498,6 +881,13 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       if (partition.target_hash != hasher_->raw_hash()) {
         LOG(ERROR) << "New '" << partition.name
                    << "' partition verification failed.";
+        if (written_hash_size_ > 0) {
+          // Don't trust the data hashed while writing anymore, hash this
+          // partition again from disk.
+          LOG(WARNING) << "Hashing " << partition.name << " again from disk.";
+          ignore_written_hashes_ = true;
+          break;
+        }
         if (partition.source_hash.empty()) {
           // No need to verify source if it is a full payload.
           Cleanup(ErrorCode::kNewRootfsVerificationError);
@@ -510,6 +900,8 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         verifier_step_ = VerifierStep::kVerifySourceHash;
       } else {
         partition_index_++;
+        SaveCheckpoint(0, true);
+        ReportVerifiedPartitions();
       }
       break;
     case VerifierStep::kVerifySourceHash:
@@ -550,7 +942,8 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       return;
   }
   // Start hashing the next partition, if any.
-  buffer_.clear();
+  buffer_.reset();
+  buffer_memory_.Set(0);
   if (partition_fd_) {
     partition_fd_->Close();
     partition_fd_.reset();
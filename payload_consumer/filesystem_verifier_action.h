@@ -25,13 +25,18 @@
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 // This action will hash all the partitions of the target slot involved in the
@@ -60,10 +65,14 @@ class FilesystemVerifyDelegate {
 
 class FilesystemVerifierAction : public InstallPlanAction {
  public:
+  // If |prefs| isn't null, the progress of the verification is saved to it,
+  // and an interrupted verification of the same update resumes from there.
   explicit FilesystemVerifierAction(
-      DynamicPartitionControlInterface* dynamic_control)
+      DynamicPartitionControlInterface* dynamic_control,
+      PrefsInterface* prefs = nullptr)
       : verity_writer_(verity_writer::CreateVerityWriter()),
-        dynamic_control_(dynamic_control) {
+        dynamic_control_(dynamic_control),
+        prefs_(prefs) {
     CHECK(dynamic_control_);
   }
 
@@ -71,6 +80,10 @@ class FilesystemVerifierAction : public InstallPlanAction {
 
   void PerformAction() override;
   void TerminateProcessing() override;
+  // The target partitions can be hashed as soon as they're written, unless
+  // they are only readable through snapuserd.
+  bool CanStartOnPartitions() override;
+  void PartitionsReady() override;
 
   // Used for listening to progress updates
   void set_delegate(FilesystemVerifyDelegate* delegate) {
@@ -80,6 +93,10 @@ class FilesystemVerifierAction : public InstallPlanAction {
     return this->delegate_;
   }
 
+  // Bytes of the target partitions verified so far, as estimated from the
+  // progress.
+  uint64_t bytes_verified() const;
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
@@ -105,6 +122,38 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // remaining to be hashed, it finishes the action.
   void StartPartitionHashing();
 
+  // Returns whether the target partitions are hashed concurrently.
+  bool UseParallelVerification() const;
+  // In parallel verification, writes the verity data of the partitions that
+  // need it one after another, starting from |partition_index_|, then starts
+  // StartParallelHashing().
+  void StartParallelVerification();
+  // Hashes all the target partitions on |parallel_hasher_|.
+  void StartParallelHashing();
+  // Reports the progress of |parallel_hasher_| and checks the hashes once it
+  // is done.
+  void CheckParallelHashing();
+
+  // Lets the next action work on the partitions verified since the last
+  // call.
+  void ReportVerifiedPartitions();
+
+  // Number of bytes read at once when hashing.
+  size_t GetReadSize() const;
+
+  // Returns the number of bytes at the beginning of the current target
+  // partition hashed while it was written, and stores the context of their
+  // hash in |context|. Returns 0 if the partition must be hashed entirely.
+  uint64_t GetWrittenHash(std::string* context) const;
+
+  // Loads the checkpoint saved by an interrupted verification of this update,
+  // if any.
+  void LoadCheckpoint();
+  // Saves that the current partition is hashed up to |offset|, at most once
+  // every kCheckpointInterval unless |force|.
+  void SaveCheckpoint(uint64_t offset, bool force);
+  void ClearCheckpoint();
+
   const std::string& GetPartitionPath() const;
 
   bool IsVABC(const InstallPlan::Partition& partition) const;
@@ -142,8 +191,10 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // verity writer might attempt to write to this fd, if verity is enabled.
   std::unique_ptr<FileDescriptor> partition_fd_;
 
-  // Buffer for storing data we read.
-  brillo::Blob buffer_;
+  // Buffer for storing data we read, reused by the next partitions through the
+  // AlignedBufferPool.
+  PooledBuffer buffer_;
+  MemoryCharge buffer_memory_{MemoryTag::kVerifier};
 
   bool cancelled_{false};  // true if the action has been cancelled.
 
@@ -169,6 +220,23 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The end offset of filesystem data, first byte position of hashtree.
   uint64_t filesystem_data_end_{0};
 
+  // Number of bytes of the current partition whose hash was restored, from the
+  // one computed while it was written or from a checkpoint, they aren't read
+  // again.
+  uint64_t written_hash_size_{0};
+  // Set once a partition mismatched with a hash computed while it was
+  // written, the partitions are then read back entirely.
+  bool ignore_written_hashes_{false};
+
+  // Stores the checkpoints, may be null.
+  PrefsInterface* prefs_{nullptr};
+  base::TimeTicks next_checkpoint_time_;
+  // The checkpoint loaded by LoadCheckpoint(): the partition at
+  // |partition_index_| is hashed from |resume_offset_| on with the hash
+  // context |resume_context_|, and its verity data is already written.
+  uint64_t resume_offset_{0};
+  std::string resume_context_;
+
   // An observer that observes progress updates of this action.
   FilesystemVerifyDelegate* delegate_{};
 
@@ -176,6 +244,28 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // points to pending read callbacks from async stream.
   ScopedTaskId pending_task_id_;
 
+  // Hashes the target partitions in parallel verification, and the index in
+  // install_plan_.partitions of the partition of each of its jobs.
+  std::unique_ptr<ParallelPartitionHasher> parallel_hasher_;
+  std::vector<size_t> parallel_partitions_;
+  uint64_t parallel_total_bytes_{0};
+  // Progress reported when |parallel_hasher_| started, the rest of the
+  // progress bar is filled as it hashes.
+  double parallel_progress_start_{0};
+
+  // Whether the action was started before the action before it was done
+  // writing all the partitions, the partitions are then verified one after
+  // another, as they're written.
+  bool started_early_{false};
+  // Set while waiting for the action before to write the partition at
+  // |partition_index_|, or to complete.
+  bool waiting_for_partitions_{false};
+  // Number of partitions reported as verified to the next action.
+  size_t num_reported_partitions_{0};
+
+  // Last progress passed to UpdateProgress().
+  double progress_{0};
+
   // Cumulative sum of partition sizes. Used for progress report.
   // This vector will always start with 0, and end with total size of all
   // partitions.
@@ -33,13 +33,16 @@
 #include <sys/stat.h>
 
 #include "gmock/gmock-spec-builders.h"
+#include "update_engine/common/constants.h"
 #include "update_engine/common/dynamic_partition_control_stub.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_dynamic_partition_control.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_consumer/written_data_hasher.h"
 
 using brillo::MessageLoop;
 using std::string;
@@ -109,7 +112,8 @@ class FilesystemVerifierActionTest : public ::testing::Test {
 
   void BuildActions(const InstallPlan& install_plan);
   void BuildActions(const InstallPlan& install_plan,
-                    DynamicPartitionControlInterface* dynamic_control);
+                    DynamicPartitionControlInterface* dynamic_control,
+                    PrefsInterface* prefs = nullptr);
 
   InstallPlan::Partition* AddFakePartition(InstallPlan* install_plan,
                                            std::string name = "fake_part") {
@@ -345,10 +349,11 @@ bool FilesystemVerifierActionTest::DoTest(bool terminate_early,
 
 void FilesystemVerifierActionTest::BuildActions(
     const InstallPlan& install_plan,
-    DynamicPartitionControlInterface* dynamic_control) {
+    DynamicPartitionControlInterface* dynamic_control,
+    PrefsInterface* prefs) {
   auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   auto verifier_action =
-      std::make_unique<FilesystemVerifierAction>(dynamic_control);
+      std::make_unique<FilesystemVerifierAction>(dynamic_control, prefs);
   auto collector_action =
       std::make_unique<ObjectCollectorAction<InstallPlan>>();
 
@@ -419,6 +424,138 @@ TEST_F(FilesystemVerifierActionTest, NonExistentDriveTest) {
   EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
 }
 
+TEST_F(FilesystemVerifierActionTest, ParallelVerificationTest) {
+  install_plan_.verify_threads = 2;
+  install_plan_.verify_read_size = BLOCK_SIZE * 16;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  AddFakePartition(&install_plan_, "part_c");
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelVerificationMismatchTest) {
+  install_plan_.verify_threads = 2;
+  AddFakePartition(&install_plan_, "part_a");
+  auto part = AddFakePartition(&install_plan_, "part_b");
+  // The source still matches, so the target is at fault.
+  part->target_hash = part->source_hash;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, WrittenHashTest) {
+  auto part = AddFakePartition(&install_plan_);
+  brillo::Blob part_data;
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &part_data));
+  constexpr size_t kWrittenSize = BLOCK_SIZE * 100;
+  part->written_data_hasher =
+      std::make_shared<WrittenDataHasher>(part->target_size);
+  part->written_data_hasher->Write(0, part_data.data(), kWrittenSize);
+  // The hashed head of the partition isn't read again.
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(target_part_.path().c_str(), O_RDWR));
+  ZeroRange(fd, 0, kWrittenSize / BLOCK_SIZE);
+  fd->Close();
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, WrittenHashMismatchTest) {
+  auto part = AddFakePartition(&install_plan_);
+  constexpr size_t kWrittenSize = BLOCK_SIZE * 100;
+  part->written_data_hasher =
+      std::make_shared<WrittenDataHasher>(part->target_size);
+  // Not the data on disk, the partition is then hashed again from disk.
+  part->written_data_hasher->WriteZeros(0, kWrittenSize);
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ResumeFromCheckpointTest) {
+  install_plan_.is_resume = true;
+  AddFakePartition(&install_plan_, "part_a");
+  AddFakePartition(&install_plan_, "part_b");
+  brillo::Blob part_data;
+  ASSERT_TRUE(utils::ReadFile(target_part_.path(), &part_data));
+  constexpr size_t kHashedSize = BLOCK_SIZE * 100;
+  HashCalculator hasher;
+  ASSERT_TRUE(hasher.Update(part_data.data(), kHashedSize));
+  FakePrefs prefs;
+  prefs.SetInt64(kPrefsVerifierStatePartitionIndex, 1);
+  prefs.SetInt64(kPrefsVerifierStateOffset, kHashedSize);
+  prefs.SetString(kPrefsVerifierStateSHA256Context, hasher.GetContext());
+  // Neither part_a nor the hashed head of part_b are read again.
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(target_part_.path().c_str(), O_RDWR));
+  ZeroRange(fd, 0, kHashedSize / BLOCK_SIZE);
+  fd->Close();
+  BuildActions(install_plan_, &dynamic_control_stub_, &prefs);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+  // The checkpoint is cleared once the verification completes.
+  EXPECT_FALSE(prefs.Exists(kPrefsVerifierStatePartitionIndex));
+  EXPECT_FALSE(prefs.Exists(kPrefsVerifierStateOffset));
+  EXPECT_FALSE(prefs.Exists(kPrefsVerifierStateSHA256Context));
+}
+
+TEST_F(FilesystemVerifierActionTest, ResumeFromStaleCheckpointTest) {
+  install_plan_.is_resume = true;
+  AddFakePartition(&install_plan_);
+  constexpr size_t kHashedSize = BLOCK_SIZE * 100;
+  const brillo::Blob zeros(kHashedSize);
+  HashCalculator hasher;
+  ASSERT_TRUE(hasher.Update(zeros.data(), zeros.size()));
+  FakePrefs prefs;
+  prefs.SetInt64(kPrefsVerifierStatePartitionIndex, 0);
+  prefs.SetInt64(kPrefsVerifierStateOffset, kHashedSize);
+  // Not the data on disk, the partition is then hashed again from disk.
+  prefs.SetString(kPrefsVerifierStateSHA256Context, hasher.GetContext());
+  BuildActions(install_plan_, &dynamic_control_stub_, &prefs);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
 TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashTest) {
   ASSERT_EQ(0U, getuid());
   EXPECT_TRUE(DoTest(false, false));
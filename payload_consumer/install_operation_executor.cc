@@ -19,6 +19,9 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <linux/fs.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <memory>
 #include <utility>
@@ -41,7 +44,12 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/scratch_buffer.h"
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+#include "update_engine/payload_consumer/source_data_cache.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -104,6 +112,47 @@ class BsdiffExtentFile : public bsdiff::FileInterface {
 
   DISALLOW_COPY_AND_ASSIGN(BsdiffExtentFile);
 };
+
+// A read-only bsdiff::FileInterface over the source data of a BSDIFF
+// operation read ahead in memory, so that bspatch seeks in it for free.
+class BsdiffMemoryFile : public bsdiff::FileInterface {
+ public:
+  explicit BsdiffMemoryFile(std::unique_ptr<ScratchBuffer> data)
+      : data_(std::move(data)) {}
+  ~BsdiffMemoryFile() override = default;
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    TEST_AND_RETURN_FALSE(count <= data_->size() - offset_);
+    memcpy(buf, data_->data() + offset_, count);
+    *bytes_read = count;
+    offset_ += count;
+    return true;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    return false;
+  }
+
+  bool Seek(off_t pos) override {
+    TEST_AND_RETURN_FALSE(pos >= 0 &&
+                          static_cast<uint64_t>(pos) <= data_->size());
+    offset_ = pos;
+    return true;
+  }
+
+  bool Close() override { return true; }
+
+  bool GetSize(uint64_t* size) override {
+    *size = data_->size();
+    return true;
+  }
+
+ private:
+  std::unique_ptr<ScratchBuffer> data_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffMemoryFile);
+};
 // A class to be passed to |puffpatch| for reading from |source_fd_| and writing
 // into |target_fd_|.
 class PuffinExtentStream : public puffin::StreamInterface {
@@ -175,26 +224,216 @@ class PuffinExtentStream : public puffin::StreamInterface {
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
+// A stream to be passed to |puffpatch| for reading the source data cached in
+// memory.
+class PuffinMemoryStream : public puffin::StreamInterface {
+ public:
+  explicit PuffinMemoryStream(std::shared_ptr<const brillo::Blob> data)
+      : data_(std::move(data)) {}
+  ~PuffinMemoryStream() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = data_->size();
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  bool Seek(uint64_t offset) override {
+    TEST_AND_RETURN_FALSE(offset <= data_->size());
+    offset_ = offset;
+    return true;
+  }
+
+  bool Read(void* buffer, size_t count) override {
+    TEST_AND_RETURN_FALSE(count <= data_->size() - offset_);
+    memcpy(buffer, data_->data() + offset_, count);
+    offset_ += count;
+    return true;
+  }
+
+  bool Write(const void* buffer, size_t count) override { return false; }
+
+  bool Close() override { return true; }
+
+ private:
+  std::shared_ptr<const brillo::Blob> data_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PuffinMemoryStream);
+};
+
+// Maps the source extents of a ZUCCHINI operation read-only and back to back
+// in memory. The source is then read through the page cache, which the kernel
+// can reclaim under memory pressure, instead of being copied into anonymous
+// memory for the whole operation.
+class MappedSourceExtents {
+ public:
+  MappedSourceExtents() = default;
+  ~MappedSourceExtents() {
+    if (data_ != nullptr)
+      munmap(data_, size_);
+  }
+
+  // Maps the |extents| of |fd|. Returns false if they can't be mapped, in
+  // which case the source has to be read instead.
+  bool Init(int fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            size_t block_size) {
+    size_ = utils::BlocksInExtents(extents) * block_size;
+    if (fd < 0 || size_ == 0 || extents.size() > kMaxMappedExtents ||
+        block_size % getpagesize() != 0) {
+      return false;
+    }
+    // Reading a page past the end of the file would raise SIGBUS rather than
+    // fail the operation.
+    const off_t fd_size = utils::FileSize(fd);
+    for (const Extent& extent : extents) {
+      if (fd_size < 0 || extent.start_block() + extent.num_blocks() >
+                             static_cast<uint64_t>(fd_size) / block_size) {
+        return false;
+      }
+    }
+    // The address range is reserved first, then each extent is mapped over
+    // its part of it.
+    void* data =
+        mmap(nullptr, size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+      return false;
+    data_ = static_cast<uint8_t*>(data);
+    uint8_t* next = data_;
+    for (const Extent& extent : extents) {
+      const size_t length = extent.num_blocks() * block_size;
+      void* mapped = mmap(next,
+                          length,
+                          PROT_READ,
+                          MAP_SHARED | MAP_FIXED,
+                          fd,
+                          extent.start_block() * block_size);
+      if (mapped != next) {
+        PLOG(WARNING) << "Failed to map the source extents";
+        return false;
+      }
+      // Starts reading the source now, as a read of the extents would.
+      madvise(next, length, MADV_WILLNEED);
+      next += length;
+    }
+    return true;
+  }
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  // Each extent is a mapping of the process, whose number is limited.
+  static constexpr int kMaxMappedExtents = 256;
+
+  uint8_t* data_{nullptr};
+  size_t size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedSourceExtents);
+};
+
+InstallOperationExecutor::InstallOperationExecutor(size_t block_size,
+                                                   size_t lz4diff_threads)
+    : block_size_(block_size),
+      lz4diff_threads_(lz4diff_threads),
+      puff_source_cache_(std::make_unique<SourceDataCache>(
+          kMaxPuffSourceCacheSize)) {}
+
+InstallOperationExecutor::~InstallOperationExecutor() = default;
+
+bool InstallOperationExecutor::SetZstdDictionary(
+    const std::string& dictionary) {
+  zstd_dictionary_.reset();
+  if (dictionary.empty())
+    return true;
+  zstd_dictionary_.reset(
+      ZSTD_createDDict(dictionary.data(), dictionary.size()));
+  if (!zstd_dictionary_) {
+    LOG(ERROR) << "Failed to load the zstd dictionary.";
+    return false;
+  }
+  return true;
+}
+
+template <typename Writer>
 bool InstallOperationExecutor::ExecuteReplaceOperation(
     const InstallOperation& operation,
-    std::unique_ptr<ExtentWriter> writer,
+    std::unique_ptr<Writer> writer,
     const void* data,
     size_t count) {
-  TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE ||
-                        operation.type() == InstallOperation::REPLACE_BZ ||
-                        operation.type() == InstallOperation::REPLACE_XZ);
+  auto replace_writer =
+      CreateReplaceOperationWriter(operation, std::move(writer));
+  TEST_AND_RETURN_FALSE(replace_writer != nullptr);
+  TEST_AND_RETURN_FALSE(replace_writer->Write(data, operation.data_length()));
+
+  return true;
+}
+
+template <typename Writer>
+std::unique_ptr<ExtentWriter>
+InstallOperationExecutor::CreateReplaceOperationWriter(
+    const InstallOperation& operation, std::unique_ptr<Writer> writer) {
+  if (operation.type() != InstallOperation::REPLACE &&
+      operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ &&
+      operation.type() != InstallOperation::REPLACE_ZSTD) {
+    LOG(ERROR) << "Not a replace operation: "
+               << InstallOperationTypeName(operation.type());
+    return nullptr;
+  }
   // Setup the ExtentWriter stack based on the operation type.
+  std::unique_ptr<ExtentWriter> replace_writer;
   if (operation.type() == InstallOperation::REPLACE_BZ) {
-    writer.reset(new BzipExtentWriter(std::move(writer)));
+    replace_writer =
+        std::make_unique<BasicBzipExtentWriter<Writer>>(std::move(writer));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
-    writer.reset(new XzExtentWriter(std::move(writer)));
+    replace_writer =
+        std::make_unique<BasicXzExtentWriter<Writer>>(std::move(writer));
+  } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+    replace_writer = std::make_unique<BasicZstdExtentWriter<Writer>>(
+        std::move(writer), zstd_dictionary_.get());
+  } else {
+    replace_writer = std::move(writer);
   }
-  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
-
-  return true;
+  if (!replace_writer->Init(operation.dst_extents(), block_size_)) {
+    LOG(ERROR) << "Failed to initialize the extent writer.";
+    return nullptr;
+  }
+  return replace_writer;
 }
 
+template bool InstallOperationExecutor::ExecuteReplaceOperation(
+    const InstallOperation& operation,
+    std::unique_ptr<ExtentWriter> writer,
+    const void* data,
+    size_t count);
+template bool InstallOperationExecutor::ExecuteReplaceOperation(
+    const InstallOperation& operation,
+    std::unique_ptr<DirectExtentWriter> writer,
+    const void* data,
+    size_t count);
+template bool InstallOperationExecutor::ExecuteReplaceOperation(
+    const InstallOperation& operation,
+    std::unique_ptr<SnapshotExtentWriter> writer,
+    const void* data,
+    size_t count);
+template std::unique_ptr<ExtentWriter>
+InstallOperationExecutor::CreateReplaceOperationWriter(
+    const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer);
+template std::unique_ptr<ExtentWriter>
+InstallOperationExecutor::CreateReplaceOperationWriter(
+    const InstallOperation& operation,
+    std::unique_ptr<DirectExtentWriter> writer);
+template std::unique_ptr<ExtentWriter>
+InstallOperationExecutor::CreateReplaceOperationWriter(
+    const InstallOperation& operation,
+    std::unique_ptr<SnapshotExtentWriter> writer);
+
 bool InstallOperationExecutor::ExecuteZeroOrDiscardOperation(
     const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer) {
   TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::ZERO ||
@@ -215,8 +454,7 @@ bool InstallOperationExecutor::ExecuteZeroOrDiscardOperation(
           static_cast<size_t>(utils::BlocksInExtents(operation.dst_extents()) *
                               block_size_)},
       Access::READ_ONLY));
-  writer->Write(buffer.data(), buffer.length());
-  return true;
+  return writer->Write(buffer.data(), buffer.length());
 }
 
 bool InstallOperationExecutor::ExecuteSourceCopyOperation(
@@ -267,19 +505,25 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  brillo::Blob src_data;
-
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      source_fd, operation.src_extents(), &src_data, block_size_));
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  ScratchBuffer src_data;
+  TEST_AND_RETURN_FALSE(src_data.Init(
+      src_size, memory_budget_ && src_size + count > memory_budget_));
+  auto reader = std::make_unique<DirectExtentReader>();
+  TEST_AND_RETURN_FALSE(
+      reader->Init(source_fd, operation.src_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(reader->Read(src_data.data(), src_size));
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      ToStringView(src_data),
+      ToStringView(src_data.data(), src_data.size()),
       ToStringView(data, count),
       [writer(writer.get())](const uint8_t* data, size_t size) -> size_t {
         if (!writer->Write(data, size)) {
           return 0;
         }
         return size;
-      }));
+      },
+      lz4diff_threads_));
   return true;
 }
 
@@ -289,12 +533,24 @@ bool InstallOperationExecutor::ExecuteSourceBsdiffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
   auto reader = std::make_unique<DirectExtentReader>();
   TEST_AND_RETURN_FALSE(
       reader->Init(source_fd, operation.src_extents(), block_size_));
-  auto src_file = std::make_unique<BsdiffExtentFile>(
-      std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_);
+  std::unique_ptr<bsdiff::FileInterface> src_file;
+  // bspatch seeks back and forth in the source for every control entry, which
+  // with the extent reader is one small read per entry. Reading the whole
+  // source up front turns them into a few batched reads.
+  if (src_size <= kMaxBsdiffSourceBufferSize &&
+      (!memory_budget_ || src_size + count <= memory_budget_)) {
+    auto src_data = std::make_unique<ScratchBuffer>();
+    TEST_AND_RETURN_FALSE(src_data->Init(src_size, false));
+    TEST_AND_RETURN_FALSE(reader->Read(src_data->data(), src_size));
+    src_file = std::make_unique<BsdiffMemoryFile>(std::move(src_data));
+  } else {
+    src_file = std::make_unique<BsdiffExtentFile>(std::move(reader), src_size);
+  }
 
   auto dst_file = std::make_unique<BsdiffExtentFile>(
       std::move(writer),
@@ -313,12 +569,22 @@ bool InstallOperationExecutor::ExecutePuffDiffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
-      std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_));
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  puffin::UniqueStreamPtr src_stream;
+  // Puffin reads the deflate streams of the source piece by piece, and the
+  // operations patching parts of the same file read the same source.
+  if (!memory_budget_ && src_size <= kMaxPuffSourceCacheSize) {
+    auto src_data = puff_source_cache_->Read(
+        source_fd, operation.src_extents(), block_size_);
+    TEST_AND_RETURN_FALSE(src_data != nullptr);
+    src_stream.reset(new PuffinMemoryStream(std::move(src_data)));
+  } else {
+    auto reader = std::make_unique<DirectExtentReader>();
+    TEST_AND_RETURN_FALSE(
+        reader->Init(source_fd, operation.src_extents(), block_size_));
+    src_stream.reset(new PuffinExtentStream(std::move(reader), src_size));
+  }
 
   puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
       std::move(writer),
@@ -342,36 +608,53 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
     size_t count) {
   uint64_t src_size =
       utils::BlocksInExtents(operation.src_extents()) * block_size_;
-  brillo::Blob source_bytes(src_size);
-
-  // TODO(197361113) either make zucchini stream the read, or use memory mapped
-  // files.
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(reader->Seek(0));
-  TEST_AND_RETURN_FALSE(reader->Read(source_bytes.data(), src_size));
+  uint64_t dst_size =
+      utils::BlocksInExtents(operation.dst_extents()) * block_size_;
+  // Zucchini needs the whole source and target in memory. The source is
+  // mapped from the source partition when possible, otherwise read in memory.
+  // Past the budget the buffers are mapped from scratch files instead.
+  MappedSourceExtents mapped_source;
+  const bool source_mapped = mapped_source.Init(
+      source_fd->Fd(), operation.src_extents(), block_size_);
+  const bool spill =
+      memory_budget_ &&
+      (source_mapped ? 0 : src_size) + dst_size + count > memory_budget_;
+  ScratchBuffer source_buffer;
+  zucchini::ConstBufferView source_bytes;
+  if (source_mapped) {
+    source_bytes = {mapped_source.data(), mapped_source.size()};
+  } else {
+    TEST_AND_RETURN_FALSE(source_buffer.Init(src_size, spill));
+    auto reader = std::make_unique<DirectExtentReader>();
+    TEST_AND_RETURN_FALSE(
+        reader->Init(source_fd, operation.src_extents(), block_size_));
+    TEST_AND_RETURN_FALSE(reader->Seek(0));
+    TEST_AND_RETURN_FALSE(reader->Read(source_buffer.data(), src_size));
+    source_bytes = {source_buffer.data(), source_buffer.size()};
+  }
 
-  brillo::Blob zucchini_patch;
+  // The patch buffer is kept for the next ZUCCHINI operations, unless memory
+  // is short.
+  DEFER {
+    if (memory_budget_)
+      brillo::Blob().swap(zucchini_patch_);
+  };
+  zucchini_patch_.clear();
   TEST_AND_RETURN_FALSE(puffin::BrotliDecode(
-      static_cast<const uint8_t*>(data), count, &zucchini_patch));
+      static_cast<const uint8_t*>(data), count, &zucchini_patch_));
   auto patch_reader = zucchini::EnsemblePatchReader::Create(
-      {zucchini_patch.data(), zucchini_patch.size()});
+      {zucchini_patch_.data(), zucchini_patch_.size()});
   if (!patch_reader.has_value()) {
     LOG(ERROR) << "Failed to parse the zucchini patch.";
     return false;
   }
 
-  auto dst_size = patch_reader->header().new_size;
-  TEST_AND_RETURN_FALSE(dst_size ==
-                        utils::BlocksInExtents(operation.dst_extents()) *
-                            block_size_);
+  TEST_AND_RETURN_FALSE(patch_reader->header().new_size == dst_size);
 
-  brillo::Blob patched_data(dst_size);
-  auto status =
-      zucchini::ApplyBuffer({source_bytes.data(), source_bytes.size()},
-                            *patch_reader,
-                            {patched_data.data(), patched_data.size()});
+  ScratchBuffer patched_data;
+  TEST_AND_RETURN_FALSE(patched_data.Init(dst_size, spill));
+  auto status = zucchini::ApplyBuffer(
+      source_bytes, *patch_reader, {patched_data.data(), patched_data.size()});
   if (status != zucchini::status::kStatusSuccess) {
     LOG(ERROR) << "Failed to apply the zucchini patch: " << status;
     return false;
@@ -17,7 +17,12 @@
 #ifndef UPDATE_ENGINE_INSTALL_OPERATION_EXECUTOR_H
 #define UPDATE_ENGINE_INSTALL_OPERATION_EXECUTOR_H
 
+#include <zstd.h>
+
 #include <memory>
+#include <string>
+
+#include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -25,15 +30,53 @@
 
 namespace chromeos_update_engine {
 
+class SourceDataCache;
+
 class InstallOperationExecutor {
  public:
-  explicit InstallOperationExecutor(size_t block_size)
-      : block_size_(block_size) {}
+  // The LZ4DIFF operations recompress their blocks on |lz4diff_threads|
+  // threads.
+  explicit InstallOperationExecutor(size_t block_size,
+                                    size_t lz4diff_threads = 1);
+  ~InstallOperationExecutor();
+
+  // Size of the source data of the PUFFDIFF operations kept in memory for the
+  // next operations, unless there is a memory budget.
+  static constexpr uint64_t kMaxPuffSourceCacheSize = 32 * 1024 * 1024;
+
+  // Largest source of a BSDIFF operation read in memory before patching,
+  // within the memory budget if there is one. Larger ones are streamed.
+  static constexpr uint64_t kMaxBsdiffSourceBufferSize = 64 * 1024 * 1024;
 
+  // Keeps the whole source and target buffers of the ZUCCHINI and LZ4DIFF
+  // operations in scratch files when they would take more than
+  // |memory_budget| bytes, 0 for no limit. The BSDIFF and PUFFDIFF operations
+  // stream them instead, the former past the budget and the latter without
+  // caching their source in memory when there is a budget.
+  void set_memory_budget(uint64_t memory_budget) {
+    memory_budget_ = memory_budget;
+  }
+
+  // Loads the zstd dictionary of the partition the next operations belong
+  // to, or drops the current one if |dictionary| is empty.
+  bool SetZstdDictionary(const std::string& dictionary);
+
+  // The replace operations are instantiated for a |Writer| of ExtentWriter,
+  // DirectExtentWriter or SnapshotExtentWriter. The decompressor the
+  // operation needs is then composed with the final sink types at compile
+  // time, so the decompressed data reaches them without virtual calls.
+  template <typename Writer>
   bool ExecuteReplaceOperation(const InstallOperation& operation,
-                               std::unique_ptr<ExtentWriter> writer,
+                               std::unique_ptr<Writer> writer,
                                const void* data,
                                size_t count);
+  // Wraps |writer| with the decompressor needed by the REPLACE, REPLACE_BZ,
+  // REPLACE_XZ or REPLACE_ZSTD |operation| and initializes it, so the
+  // operation's data can be passed to Write() in several chunks as it's
+  // received. Returns nullptr on failure.
+  template <typename Writer>
+  std::unique_ptr<ExtentWriter> CreateReplaceOperationWriter(
+      const InstallOperation& operation, std::unique_ptr<Writer> writer);
   bool ExecuteZeroOrDiscardOperation(const InstallOperation& operation,
                                      std::unique_ptr<ExtentWriter> writer);
   bool ExecuteSourceCopyOperation(const InstallOperation& operation,
@@ -68,7 +111,17 @@ class InstallOperationExecutor {
                                const void* data,
                                size_t count);
 
+  struct DDictDeleter {
+    void operator()(ZSTD_DDict* p) { ZSTD_freeDDict(p); }
+  };
+
   size_t block_size_;
+  size_t lz4diff_threads_;
+  uint64_t memory_budget_{0};
+  std::unique_ptr<SourceDataCache> puff_source_cache_;
+  std::unique_ptr<ZSTD_DDict, DDictDeleter> zstd_dictionary_;
+  // The decompressed patch of the last ZUCCHINI operation.
+  brillo::Blob zucchini_patch_;
 };
 
 }  // namespace chromeos_update_engine
@@ -122,6 +122,10 @@ class InstallOperationExecutorTest : public ::testing::Test {
           << " is modified but it shouldn't.";
     }
   }
+  // Applies a ZUCCHINI operation from the |src_extents| of the source to the
+  // whole target.
+  void RunZucchiniOp(const std::vector<Extent>& src_extents);
+
   ScopedTempFile source_{"source_partition.XXXXXXXX", true};
   ScopedTempFile target_{"target_partition.XXXXXXXX", true};
   FileDescriptorPtr source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
@@ -224,14 +228,15 @@ TEST_F(InstallOperationExecutorTest, SourceCopyOpTest) {
   VerityUntouchedExtents(op);
 }
 
-TEST_F(InstallOperationExecutorTest, ZucchiniOpTest) {
+void InstallOperationExecutorTest::RunZucchiniOp(
+    const std::vector<Extent>& src_extents) {
   InstallOperation op;
   op.set_type(InstallOperation::ZUCCHINI);
-  *op.mutable_src_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+  for (const Extent& extent : src_extents)
+    *op.mutable_src_extents()->Add() = extent;
   *op.mutable_dst_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
 
   // Make a zucchini patch
-  std::vector<Extent> src_extents{ExtentForRange(0, NUM_BLOCKS)};
   std::vector<Extent> dst_extents{ExtentForRange(0, NUM_BLOCKS)};
   PayloadGenerationConfig config{
       .version = PayloadVersion(kBrilloMajorPayloadVersion,
@@ -263,6 +268,16 @@ TEST_F(InstallOperationExecutorTest, ZucchiniOpTest) {
   ASSERT_EQ(target_data_, patched_data);
 }
 
+TEST_F(InstallOperationExecutorTest, ZucchiniOpTest) {
+  RunZucchiniOp({ExtentForRange(0, NUM_BLOCKS)});
+}
+
+TEST_F(InstallOperationExecutorTest, ZucchiniOpSeveralSourceExtentsTest) {
+  // The extents are mapped back to back, in order.
+  RunZucchiniOp(
+      {ExtentForRange(6, 4), ExtentForRange(0, 3), ExtentForRange(3, 3)});
+}
+
 TEST_F(InstallOperationExecutorTest, GetNthBlockTest) {
   std::vector<Extent> extents;
   extents.emplace_back(ExtentForRange(10, 3));
@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_metrics.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+void AddStats(const InstallOperationStats& stats,
+              InstallOperationStats* total) {
+  total->count += stats.count;
+  total->wall_time += stats.wall_time;
+  total->cpu_time += stats.cpu_time;
+  total->src_bytes += stats.src_bytes;
+  total->dst_bytes += stats.dst_bytes;
+  total->data_bytes += stats.data_bytes;
+}
+}  // namespace
+
+bool InstallOperationStats::operator==(
+    const InstallOperationStats& other) const {
+  return count == other.count && wall_time == other.wall_time &&
+         cpu_time == other.cpu_time && src_bytes == other.src_bytes &&
+         dst_bytes == other.dst_bytes && data_bytes == other.data_bytes;
+}
+
+InstallOperationTimer::InstallOperationTimer() {
+  Resume();
+}
+
+void InstallOperationTimer::Pause() {
+  if (!running_)
+    return;
+  wall_time_ += base::TimeTicks::Now() - wall_start_;
+  if (base::ThreadTicks::IsSupported())
+    cpu_time_ += base::ThreadTicks::Now() - cpu_start_;
+  running_ = false;
+}
+
+void InstallOperationTimer::Resume() {
+  if (running_)
+    return;
+  wall_start_ = base::TimeTicks::Now();
+  if (base::ThreadTicks::IsSupported())
+    cpu_start_ = base::ThreadTicks::Now();
+  running_ = true;
+}
+
+base::TimeDelta InstallOperationTimer::wall_time() const {
+  if (!running_)
+    return wall_time_;
+  return wall_time_ + (base::TimeTicks::Now() - wall_start_);
+}
+
+base::TimeDelta InstallOperationTimer::cpu_time() const {
+  if (!running_ || !base::ThreadTicks::IsSupported())
+    return cpu_time_;
+  return cpu_time_ + (base::ThreadTicks::Now() - cpu_start_);
+}
+
+void InstallOperationMetrics::Record(const InstallOperation& operation,
+                                     size_t block_size,
+                                     const InstallOperationTimer& timer,
+                                     const std::string& partition) {
+  InstallOperationStats stats;
+  stats.count = 1;
+  stats.wall_time = timer.wall_time();
+  stats.cpu_time = timer.cpu_time();
+  stats.src_bytes = operation.has_src_length()
+                        ? operation.src_length()
+                        : utils::BlocksInExtents(operation.src_extents()) *
+                              block_size;
+  stats.dst_bytes = operation.has_dst_length()
+                        ? operation.dst_length()
+                        : utils::BlocksInExtents(operation.dst_extents()) *
+                              block_size;
+  stats.data_bytes = operation.data_length();
+  Record(operation.type(), stats, partition);
+}
+
+void InstallOperationMetrics::Record(InstallOperation::Type type,
+                                     const InstallOperationStats& stats,
+                                     const std::string& partition) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AddStats(stats, &stats_[type]);
+  if (!partition.empty())
+    AddStats(stats, &partition_stats_[partition]);
+}
+
+InstallOperationStatsMap InstallOperationMetrics::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+PartitionOperationStatsMap InstallOperationMetrics::GetPartitionStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return partition_stats_;
+}
+
+void InstallOperationMetrics::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.clear();
+  partition_stats_.clear();
+}
+
+void LogInstallOperationStats(const InstallOperationStatsMap& stats) {
+  for (const auto& [type, op_stats] : stats) {
+    const int64_t wall_ms = op_stats.wall_time.InMilliseconds();
+    // Bytes per millisecond are kilobytes per second.
+    const uint64_t kbps =
+        wall_ms > 0 ? (op_stats.src_bytes + op_stats.dst_bytes) / wall_ms : 0;
+    LOG(INFO) << InstallOperationTypeName(type) << ": " << op_stats.count
+              << " operations, " << wall_ms << " ms wall time, "
+              << op_stats.cpu_time.InMilliseconds() << " ms CPU time, "
+              << op_stats.src_bytes << " bytes read, " << op_stats.dst_bytes
+              << " bytes written, " << op_stats.data_bytes
+              << " bytes of payload data, " << kbps << " kB/s.";
+  }
+}
+
+}  // namespace chromeos_update_engine
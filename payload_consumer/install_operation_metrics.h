@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_METRICS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_METRICS_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Resources used by all the applied install operations of a given type.
+struct InstallOperationStats {
+  uint64_t count{0};
+  base::TimeDelta wall_time;
+  // CPU time of the thread applying the operations.
+  base::TimeDelta cpu_time;
+  // Bytes read from the source partition.
+  uint64_t src_bytes{0};
+  // Bytes written to the target partition.
+  uint64_t dst_bytes{0};
+  // Bytes of payload data consumed.
+  uint64_t data_bytes{0};
+
+  bool operator==(const InstallOperationStats& other) const;
+};
+
+using InstallOperationStatsMap =
+    std::map<InstallOperation::Type, InstallOperationStats>;
+// The stats of all the operations applied to each partition, by name.
+using PartitionOperationStatsMap =
+    std::map<std::string, InstallOperationStats>;
+
+// Measures the wall time and the CPU time of the calling thread spent since
+// its creation or the last Resume() call.
+class InstallOperationTimer {
+ public:
+  InstallOperationTimer();
+
+  // Stops measuring until Resume() is called.
+  void Pause();
+  void Resume();
+
+  base::TimeDelta wall_time() const;
+  base::TimeDelta cpu_time() const;
+
+ private:
+  bool running_{false};
+  base::TimeTicks wall_start_;
+  base::ThreadTicks cpu_start_;
+  base::TimeDelta wall_time_;
+  base::TimeDelta cpu_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationTimer);
+};
+
+// InstallOperationMetrics accumulates InstallOperationStats per operation
+// type, and per partition. Operations can be recorded from any thread.
+class InstallOperationMetrics {
+ public:
+  InstallOperationMetrics() = default;
+
+  // Records that |operation| was applied to |partition| during |timer|, using
+  // |block_size| to compute the number of source and target bytes.
+  void Record(const InstallOperation& operation,
+              size_t block_size,
+              const InstallOperationTimer& timer,
+              const std::string& partition = "");
+
+  // Records |stats| for operations of type |type| applied to |partition|. The
+  // stats of the operations recorded without a partition are only counted per
+  // type.
+  void Record(InstallOperation::Type type,
+              const InstallOperationStats& stats,
+              const std::string& partition = "");
+
+  InstallOperationStatsMap GetStats() const;
+  PartitionOperationStatsMap GetPartitionStats() const;
+
+  void Reset();
+
+ private:
+  mutable std::mutex mutex_;
+  InstallOperationStatsMap stats_;
+  PartitionOperationStatsMap partition_stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationMetrics);
+};
+
+// Logs a summary of |stats|, one line per operation type.
+void LogInstallOperationStats(const InstallOperationStatsMap& stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_METRICS_H_
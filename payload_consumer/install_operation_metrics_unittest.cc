@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_metrics.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+class InstallOperationMetricsTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kBlockSize = 4096;
+  InstallOperationMetrics metrics_;
+};
+
+TEST_F(InstallOperationMetricsTest, RecordsBytesPerTypeTest) {
+  InstallOperation copy;
+  copy.set_type(InstallOperation::SOURCE_COPY);
+  *copy.add_src_extents() = ExtentForRange(0, 2);
+  *copy.add_src_extents() = ExtentForRange(10, 1);
+  *copy.add_dst_extents() = ExtentForRange(20, 3);
+
+  InstallOperation replace;
+  replace.set_type(InstallOperation::REPLACE_XZ);
+  replace.set_data_offset(0);
+  replace.set_data_length(100);
+  *replace.add_dst_extents() = ExtentForRange(0, 4);
+
+  InstallOperation diff;
+  diff.set_type(InstallOperation::PUFFDIFF);
+  diff.set_data_length(50);
+  diff.set_src_length(1000);
+  diff.set_dst_length(2000);
+
+  InstallOperationTimer timer;
+  metrics_.Record(copy, kBlockSize, timer, "system");
+  metrics_.Record(copy, kBlockSize, timer, "vendor");
+  metrics_.Record(replace, kBlockSize, timer, "system");
+  metrics_.Record(diff, kBlockSize, timer);
+
+  const InstallOperationStatsMap stats = metrics_.GetStats();
+  ASSERT_EQ(3u, stats.size());
+  const InstallOperationStats& copy_stats =
+      stats.at(InstallOperation::SOURCE_COPY);
+  EXPECT_EQ(2u, copy_stats.count);
+  EXPECT_EQ(6 * kBlockSize, copy_stats.src_bytes);
+  EXPECT_EQ(6 * kBlockSize, copy_stats.dst_bytes);
+  EXPECT_EQ(0u, copy_stats.data_bytes);
+
+  const InstallOperationStats& replace_stats =
+      stats.at(InstallOperation::REPLACE_XZ);
+  EXPECT_EQ(1u, replace_stats.count);
+  EXPECT_EQ(0u, replace_stats.src_bytes);
+  EXPECT_EQ(4 * kBlockSize, replace_stats.dst_bytes);
+  EXPECT_EQ(100u, replace_stats.data_bytes);
+
+  // The explicit lengths take precedence over the extents.
+  const InstallOperationStats& diff_stats =
+      stats.at(InstallOperation::PUFFDIFF);
+  EXPECT_EQ(1000u, diff_stats.src_bytes);
+  EXPECT_EQ(2000u, diff_stats.dst_bytes);
+  EXPECT_EQ(50u, diff_stats.data_bytes);
+
+  // The operations recorded without a partition are only counted per type.
+  const PartitionOperationStatsMap partition_stats =
+      metrics_.GetPartitionStats();
+  ASSERT_EQ(2u, partition_stats.size());
+  const InstallOperationStats& system_stats = partition_stats.at("system");
+  EXPECT_EQ(2u, system_stats.count);
+  EXPECT_EQ(3 * kBlockSize, system_stats.src_bytes);
+  EXPECT_EQ(7 * kBlockSize, system_stats.dst_bytes);
+  EXPECT_EQ(100u, system_stats.data_bytes);
+  EXPECT_EQ(1u, partition_stats.at("vendor").count);
+
+  metrics_.Reset();
+  EXPECT_TRUE(metrics_.GetStats().empty());
+  EXPECT_TRUE(metrics_.GetPartitionStats().empty());
+}
+
+TEST_F(InstallOperationMetricsTest, AccumulatesTimesTest) {
+  InstallOperationStats stats;
+  stats.count = 1;
+  stats.wall_time = base::TimeDelta::FromMilliseconds(30);
+  stats.cpu_time = base::TimeDelta::FromMilliseconds(20);
+  metrics_.Record(InstallOperation::ZERO, stats);
+  metrics_.Record(InstallOperation::ZERO, stats);
+
+  InstallOperationStats expected;
+  expected.count = 2;
+  expected.wall_time = base::TimeDelta::FromMilliseconds(60);
+  expected.cpu_time = base::TimeDelta::FromMilliseconds(40);
+  EXPECT_EQ(expected, metrics_.GetStats().at(InstallOperation::ZERO));
+}
+
+TEST_F(InstallOperationMetricsTest, RecordFromManyThreadsTest) {
+  const size_t kNumThreads = 4;
+  const size_t kNumOperations = 1000;
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  op.set_data_length(1);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this, &op] {
+      InstallOperationTimer timer;
+      for (size_t j = 0; j < kNumOperations; j++)
+        metrics_.Record(op, kBlockSize, timer);
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  const InstallOperationStats stats =
+      metrics_.GetStats().at(InstallOperation::REPLACE);
+  EXPECT_EQ(kNumThreads * kNumOperations, stats.count);
+  EXPECT_EQ(kNumThreads * kNumOperations, stats.data_bytes);
+}
+
+TEST_F(InstallOperationMetricsTest, PausedTimerDoesNotAdvanceTest) {
+  InstallOperationTimer timer;
+  timer.Pause();
+  const base::TimeDelta wall_time = timer.wall_time();
+  const base::TimeDelta cpu_time = timer.cpu_time();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  EXPECT_EQ(wall_time, timer.wall_time());
+  EXPECT_EQ(cpu_time, timer.cpu_time());
+
+  timer.Resume();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  EXPECT_GE(timer.wall_time() - wall_time,
+            base::TimeDelta::FromMilliseconds(5));
+}
+
+}  // namespace chromeos_update_engine
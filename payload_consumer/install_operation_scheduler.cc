@@ -0,0 +1,247 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/thread_placement.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+bool RangesOverlap(const ExtentRanges& a, const ExtentRanges& b) {
+  const ExtentRanges& smaller =
+      a.extent_set().size() < b.extent_set().size() ? a : b;
+  const ExtentRanges& larger = &smaller == &a ? b : a;
+  for (const Extent& extent : smaller.extent_set()) {
+    if (larger.OverlapsWithExtent(extent))
+      return true;
+  }
+  return false;
+}
+}  // namespace
+
+InstallOperationScheduler::InstallOperationScheduler(size_t num_workers,
+                                                     size_t max_pending,
+                                                     uint64_t memory_budget)
+    : max_pending_(max_pending), memory_budget_(memory_budget) {
+  CHECK_GT(num_workers, 0u);
+  CHECK_GT(max_pending_, 0u);
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back(&InstallOperationScheduler::WorkerLoop, this, i);
+  }
+}
+
+InstallOperationScheduler::~InstallOperationScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    // Operations that didn't start yet are dropped.
+    ready_.clear();
+  }
+  ready_cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool InstallOperationScheduler::Schedule(const InstallOperation& operation,
+                                         Task task,
+                                         ErrorCode* error) {
+  auto entry = std::make_unique<Entry>();
+  entry->partition = partition_;
+  entry->dst_ranges.AddRepeatedExtents(operation.dst_extents());
+  entry->task = std::move(task);
+  entry->cpu_bound = IsCpuBound(operation);
+  entry->memory = operation.cost_hint().peak_memory();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cond_.wait(
+      lock, [this] { return failed_ || entries_.size() < max_pending_; });
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+
+  const size_t seq = completed_in_order_ + entries_.size();
+  for (auto& other : entries_) {
+    if (!other->done && Conflicts(*other, *entry)) {
+      other->dependents.push_back(seq);
+      entry->num_dependencies++;
+    }
+  }
+  const bool ready = entry->num_dependencies == 0;
+  entries_.push_back(std::move(entry));
+  if (ready) {
+    ready_.push_back(seq);
+    ready_cond_.notify_one();
+  }
+  return true;
+}
+
+bool InstallOperationScheduler::Wait(ErrorCode* error) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cond_.wait(lock, [this] {
+    return entries_.empty() || (failed_ && num_running_ == 0);
+  });
+  if (failed_) {
+    *error = error_;
+    return false;
+  }
+  return true;
+}
+
+void InstallOperationScheduler::StartNewPartition() {
+  partition_++;
+}
+
+size_t InstallOperationScheduler::num_completed_in_order() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return completed_in_order_;
+}
+
+size_t InstallOperationScheduler::num_scheduled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return completed_in_order_ + entries_.size();
+}
+
+bool InstallOperationScheduler::IsCpuBound(const InstallOperation& operation) {
+  switch (operation.type()) {
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool InstallOperationScheduler::Conflicts(const Entry& a, const Entry& b) {
+  return a.partition == b.partition &&
+         RangesOverlap(a.dst_ranges, b.dst_ranges);
+}
+
+void InstallOperationScheduler::WorkerLoop(size_t worker_index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto next = ready_.end();
+    ready_cond_.wait(lock, [this, &next] {
+      if (stopping_)
+        return true;
+      if (ready_.empty())
+        return false;
+      next = NextReady();
+      return next != ready_.end();
+    });
+    if (stopping_)
+      break;
+    const size_t seq = *next;
+    ready_.erase(next);
+    // Entries are heap allocated, so this stays valid while the lock is
+    // released. It can't be removed from |entries_| before it's done.
+    Entry* entry = GetEntry(seq);
+    Task task = std::move(entry->task);
+    const bool cpu_bound = entry->cpu_bound;
+    const uint64_t memory = entry->memory;
+    num_running_++;
+    if (cpu_bound)
+      num_running_cpu_bound_++;
+    memory_in_use_ += memory;
+
+    lock.unlock();
+    ThreadPlacement::Get()->PlaceCurrentThread(
+        cpu_bound ? ThreadPlacement::WorkClass::kCompute
+                  : ThreadPlacement::WorkClass::kIo);
+    ErrorCode error = ErrorCode::kSuccess;
+    const bool success = task(worker_index, &error);
+    lock.lock();
+
+    num_running_--;
+    if (cpu_bound)
+      num_running_cpu_bound_--;
+    memory_in_use_ -= memory;
+    // Ready operations may have been waiting for that memory.
+    if (memory_budget_ && !ready_.empty())
+      ready_cond_.notify_all();
+    if (!success) {
+      LOG(ERROR) << "Install operation " << seq << " failed on worker "
+                 << worker_index << ", dropping the pending operations.";
+      if (!failed_) {
+        failed_ = true;
+        error_ = error;
+      }
+      ready_.clear();
+      done_cond_.notify_all();
+      continue;
+    }
+
+    entry->done = true;
+    for (size_t dependent_seq : entry->dependents) {
+      Entry* dependent = GetEntry(dependent_seq);
+      if (--dependent->num_dependencies == 0 && !failed_) {
+        ready_.push_back(dependent_seq);
+        ready_cond_.notify_one();
+      }
+    }
+    while (!entries_.empty() && entries_.front()->done) {
+      entries_.pop_front();
+      completed_in_order_++;
+    }
+    done_cond_.notify_all();
+  }
+}
+
+std::deque<size_t>::iterator InstallOperationScheduler::NextReady() {
+  // Ready operations don't depend on each other, any of them can run first.
+  const size_t share = (workers_.size() + 1) / 2;
+  const size_t num_running_io_bound = num_running_ - num_running_cpu_bound_;
+  auto first_fitting = ready_.end();
+  for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+    const Entry* entry = GetEntry(*it);
+    if (memory_budget_ && num_running_ &&
+        entry->memory > memory_budget_ - std::min(memory_budget_,
+                                                  memory_in_use_)) {
+      continue;
+    }
+    const size_t num_running_same_kind =
+        entry->cpu_bound ? num_running_cpu_bound_ : num_running_io_bound;
+    if (num_running_same_kind < share)
+      return it;
+    if (first_fitting == ready_.end())
+      first_fitting = it;
+  }
+  return first_fitting;
+}
+
+InstallOperationScheduler::Entry* InstallOperationScheduler::GetEntry(
+    size_t seq) {
+  CHECK_GE(seq, completed_in_order_);
+  CHECK_LT(seq - completed_in_order_, entries_.size());
+  return entries_[seq - completed_in_order_].get();
+}
+
+}  // namespace chromeos_update_engine
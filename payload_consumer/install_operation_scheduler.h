@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_SCHEDULER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// InstallOperationScheduler runs the install operations of a partition on a
+// pool of worker threads. Operations are scheduled in payload order, and an
+// operation only starts once every previously scheduled operation it conflicts
+// with has completed, so the result on disk is the same as applying them
+// sequentially. Source extents are read from the source slot, which is never
+// written during an update, so two operations conflict only if their
+// destination extents overlap.
+// Among the operations ready to run, the workers prefer the kind, CPU-bound or
+// I/O-bound, running on less than half of them. When partitions are applied
+// concurrently, the diffs of one run next to the copies of the other instead
+// of all of them contending for the same resource.
+// With a memory budget, an operation only starts once the peak memory of its
+// cost hint fits in what the running operations leave. An operation larger
+// than the budget runs alone.
+//
+// All public methods must be called from the same thread.
+class InstallOperationScheduler {
+ public:
+  // Applies an operation using the resources owned by worker |worker_index|.
+  // Returns false and may set |error| on failure.
+  using Task = std::function<bool(size_t worker_index, ErrorCode* error)>;
+
+  // Starts |num_workers| threads. At most |max_pending| scheduled operations
+  // may be waiting or running at any time, Schedule() blocks beyond that.
+  // The operations running at once use at most |memory_budget| bytes if not 0,
+  // as per their cost hints.
+  InstallOperationScheduler(size_t num_workers,
+                            size_t max_pending,
+                            uint64_t memory_budget = 0);
+  ~InstallOperationScheduler();
+
+  // Schedules |task| to apply |operation|. Returns false and sets |error| if a
+  // previously scheduled operation failed, in which case |task| is dropped.
+  bool Schedule(const InstallOperation& operation,
+                Task task,
+                ErrorCode* error);
+
+  // Waits until all the scheduled operations completed, or until one of them
+  // failed and the running ones returned. Returns false and sets |error| if
+  // any operation failed.
+  bool Wait(ErrorCode* error);
+
+  // Starts scheduling the operations of another partition. Partitions don't
+  // share any blocks, so operations scheduled after this call never wait for
+  // the ones scheduled before it, and the two can be applied concurrently.
+  void StartNewPartition();
+
+  // Number of operations, in scheduling order, that completed successfully
+  // together with all the operations scheduled before them. This is the
+  // progress that can safely be checkpointed.
+  size_t num_completed_in_order() const;
+
+  size_t num_scheduled() const;
+  size_t num_workers() const { return workers_.size(); }
+
+  // Whether applying |operation| is mostly bound by the CPU rather than by
+  // the storage: the diffs and the compressed replaces.
+  static bool IsCpuBound(const InstallOperation& operation);
+
+ private:
+  struct Entry {
+    // Index of the partition, counted from the scheduler creation.
+    size_t partition{0};
+    ExtentRanges dst_ranges;
+    Task task;
+    bool cpu_bound{false};
+    // Peak memory of the operation, from its cost hint.
+    uint64_t memory{0};
+    // Number of earlier operations this one still waits for.
+    size_t num_dependencies{0};
+    // Sequence numbers of later operations waiting for this one.
+    std::vector<size_t> dependents;
+    bool done{false};
+  };
+
+  // Returns whether |a| and |b| can't be applied in parallel.
+  static bool Conflicts(const Entry& a, const Entry& b);
+
+  // Main loop of worker |worker_index|.
+  void WorkerLoop(size_t worker_index);
+
+  // Returns the entry with sequence number |seq|, which must not have been
+  // completed in order yet. Must be called with |mutex_| held.
+  Entry* GetEntry(size_t seq);
+
+  // Returns the ready operation to run next, or |ready_|.end() if none fits
+  // in the memory budget. Must be called with |mutex_| held.
+  std::deque<size_t>::iterator NextReady();
+
+  const size_t max_pending_;
+  const uint64_t memory_budget_;
+
+  mutable std::mutex mutex_;
+  // Signaled when an operation becomes ready or the scheduler is stopping.
+  std::condition_variable ready_cond_;
+  // Signaled when an operation completes.
+  std::condition_variable done_cond_;
+
+  // Operations not completed in order yet. The front entry has sequence
+  // number |completed_in_order_|.
+  std::deque<std::unique_ptr<Entry>> entries_;
+  size_t completed_in_order_{0};
+  // Sequence numbers of operations whose dependencies are all done.
+  std::deque<size_t> ready_;
+  size_t num_running_{0};
+  // Number of the running operations that are CPU-bound.
+  size_t num_running_cpu_bound_{0};
+  // Peak memory of the running operations.
+  uint64_t memory_in_use_{0};
+  // Partition the next scheduled operation belongs to.
+  size_t partition_{0};
+
+  bool stopping_{false};
+  bool failed_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_SCHEDULER_H_
@@ -0,0 +1,343 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+InstallOperation MakeOperation(uint64_t src_start,
+                               uint64_t src_blocks,
+                               uint64_t dst_start,
+                               uint64_t dst_blocks) {
+  InstallOperation op;
+  if (src_blocks)
+    *op.add_src_extents() = ExtentForRange(src_start, src_blocks);
+  *op.add_dst_extents() = ExtentForRange(dst_start, dst_blocks);
+  return op;
+}
+
+// A gate tasks can block on until the test opens it.
+class Gate {
+ public:
+  void Open() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      open_ = true;
+    }
+    cond_.notify_all();
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return open_; });
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool open_{false};
+};
+
+}  // namespace
+
+class InstallOperationSchedulerTest : public ::testing::Test {
+ protected:
+  void Record(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    order_.push_back(id);
+  }
+
+  std::vector<int> order() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return order_;
+  }
+
+  std::mutex mutex_;
+  std::vector<int> order_;
+};
+
+TEST_F(InstallOperationSchedulerTest, IndependentOperationsRunInParallelTest) {
+  InstallOperationScheduler scheduler(2, 8);
+  Gate gate;
+  ErrorCode error = ErrorCode::kSuccess;
+  // The first operation can only complete once the second one started, which
+  // requires them to run at the same time. Reading blocks written by another
+  // operation isn't a conflict, those are read from the source slot.
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 10),
+      [this, &gate](size_t, ErrorCode*) {
+        gate.Wait();
+        Record(0);
+        return true;
+      },
+      &error));
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 10, 10, 10),
+      [this, &gate](size_t, ErrorCode*) {
+        Record(1);
+        gate.Open();
+        return true;
+      },
+      &error));
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ((std::vector<int>{1, 0}), order());
+  EXPECT_EQ(2u, scheduler.num_completed_in_order());
+}
+
+TEST_F(InstallOperationSchedulerTest, ConflictingOperationsRunInOrderTest) {
+  InstallOperationScheduler scheduler(4, 8);
+  ErrorCode error = ErrorCode::kSuccess;
+  // Each operation overwrites some of the blocks written by the previous one.
+  const std::vector<InstallOperation> ops = {
+      MakeOperation(0, 0, 0, 10),
+      MakeOperation(0, 0, 5, 10),
+      MakeOperation(0, 0, 14, 87),
+      MakeOperation(0, 0, 100, 1),
+  };
+  for (size_t i = 0; i < ops.size(); i++) {
+    ASSERT_TRUE(scheduler.Schedule(
+        ops[i],
+        [this, i](size_t, ErrorCode*) {
+          Record(i);
+          return true;
+        },
+        &error));
+  }
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ((std::vector<int>{0, 1, 2, 3}), order());
+  EXPECT_EQ(4u, scheduler.num_scheduled());
+}
+
+TEST_F(InstallOperationSchedulerTest, CompletedInOrderTest) {
+  InstallOperationScheduler scheduler(2, 8);
+  Gate first_gate;
+  Gate second_done;
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 1),
+      [&first_gate](size_t, ErrorCode*) {
+        first_gate.Wait();
+        return true;
+      },
+      &error));
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 1, 1),
+      [&second_done](size_t, ErrorCode*) {
+        second_done.Open();
+        return true;
+      },
+      &error));
+  second_done.Wait();
+  // The second operation is done, but the first one isn't.
+  EXPECT_EQ(0u, scheduler.num_completed_in_order());
+  first_gate.Open();
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ(2u, scheduler.num_completed_in_order());
+}
+
+TEST_F(InstallOperationSchedulerTest, FailureTest) {
+  InstallOperationScheduler scheduler(2, 8);
+  Gate gate;
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 10),
+      [&gate](size_t, ErrorCode* error) {
+        gate.Wait();
+        *error = ErrorCode::kDownloadStateInitializationError;
+        return false;
+      },
+      &error));
+  // Depends on the failing operation, so it must never run.
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 10),
+      [this](size_t, ErrorCode*) {
+        Record(1);
+        return true;
+      },
+      &error));
+  gate.Open();
+  EXPECT_FALSE(scheduler.Wait(&error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  EXPECT_EQ(0u, scheduler.num_completed_in_order());
+  EXPECT_TRUE(order().empty());
+
+  error = ErrorCode::kSuccess;
+  EXPECT_FALSE(scheduler.Schedule(
+      MakeOperation(0, 0, 20, 1),
+      [](size_t, ErrorCode*) { return true; },
+      &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+}
+
+TEST_F(InstallOperationSchedulerTest, PartitionsRunInParallelTest) {
+  InstallOperationScheduler scheduler(2, 8);
+  Gate gate;
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 10),
+      [this, &gate](size_t, ErrorCode*) {
+        gate.Wait();
+        Record(0);
+        return true;
+      },
+      &error));
+  // Same blocks, but in another partition, so it doesn't wait for the first
+  // operation.
+  scheduler.StartNewPartition();
+  ASSERT_TRUE(scheduler.Schedule(
+      MakeOperation(0, 0, 0, 10),
+      [this, &gate](size_t, ErrorCode*) {
+        Record(1);
+        gate.Open();
+        return true;
+      },
+      &error));
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ((std::vector<int>{1, 0}), order());
+  EXPECT_EQ(2u, scheduler.num_completed_in_order());
+}
+
+TEST_F(InstallOperationSchedulerTest, PairsCpuAndIoBoundOperationsTest) {
+  InstallOperationScheduler scheduler(2, 8);
+  Gate cpu_started, io_started, cpu_gate, io_gate, io_done;
+  ErrorCode error = ErrorCode::kSuccess;
+  InstallOperation cpu_op = MakeOperation(0, 1, 0, 1);
+  cpu_op.set_type(InstallOperation::SOURCE_BSDIFF);
+  InstallOperation io_op = MakeOperation(0, 1, 1, 1);
+  io_op.set_type(InstallOperation::SOURCE_COPY);
+  EXPECT_TRUE(InstallOperationScheduler::IsCpuBound(cpu_op));
+  EXPECT_FALSE(InstallOperationScheduler::IsCpuBound(io_op));
+
+  // Keep both workers busy, one with each kind of operation.
+  ASSERT_TRUE(scheduler.Schedule(
+      cpu_op,
+      [this, &cpu_started, &cpu_gate](size_t, ErrorCode*) {
+        cpu_started.Open();
+        cpu_gate.Wait();
+        Record(0);
+        return true;
+      },
+      &error));
+  ASSERT_TRUE(scheduler.Schedule(
+      io_op,
+      [this, &io_started, &io_gate](size_t, ErrorCode*) {
+        io_started.Open();
+        io_gate.Wait();
+        Record(1);
+        return true;
+      },
+      &error));
+  cpu_started.Wait();
+  io_started.Wait();
+
+  scheduler.StartNewPartition();
+  ASSERT_TRUE(scheduler.Schedule(
+      cpu_op,
+      [this](size_t, ErrorCode*) {
+        Record(2);
+        return true;
+      },
+      &error));
+  ASSERT_TRUE(scheduler.Schedule(
+      io_op,
+      [this, &io_done](size_t, ErrorCode*) {
+        Record(3);
+        io_done.Open();
+        return true;
+      },
+      &error));
+  // The worker freed by the I/O-bound operation skips the CPU-bound one
+  // scheduled first, which would leave both workers on the CPU.
+  io_gate.Open();
+  io_done.Wait();
+  cpu_gate.Open();
+  EXPECT_TRUE(scheduler.Wait(&error));
+  const std::vector<int> recorded = order();
+  ASSERT_EQ(4u, recorded.size());
+  EXPECT_EQ((std::vector<int>{1, 3}),
+            std::vector<int>(recorded.begin(), recorded.begin() + 2));
+}
+
+TEST_F(InstallOperationSchedulerTest, MaxPendingTest) {
+  const size_t kNumOperations = 20;
+  InstallOperationScheduler scheduler(3, 2);
+  ErrorCode error = ErrorCode::kSuccess;
+  for (size_t i = 0; i < kNumOperations; i++) {
+    ASSERT_TRUE(scheduler.Schedule(
+        MakeOperation(0, 0, i, 1),
+        [this, i](size_t, ErrorCode*) {
+          Record(i);
+          return true;
+        },
+        &error));
+    EXPECT_LE(scheduler.num_scheduled() - scheduler.num_completed_in_order(),
+              2u);
+  }
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ(kNumOperations, order().size());
+}
+
+TEST_F(InstallOperationSchedulerTest, MemoryBudgetTest) {
+  InstallOperationScheduler scheduler(4, 32, 100);
+  ErrorCode error = ErrorCode::kSuccess;
+  std::atomic<uint64_t> in_use{0};
+  std::atomic<uint64_t> peak{0};
+  auto schedule = [&](uint64_t block, uint64_t memory) {
+    InstallOperation op = MakeOperation(0, 0, block, 1);
+    op.mutable_cost_hint()->set_peak_memory(memory);
+    return scheduler.Schedule(
+        op,
+        [&in_use, &peak, memory](size_t, ErrorCode*) {
+          const uint64_t now = in_use += memory;
+          uint64_t old_peak = peak;
+          while (now > old_peak &&
+                 !peak.compare_exchange_weak(old_peak, now)) {
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          in_use -= memory;
+          return true;
+        },
+        &error);
+  };
+  for (uint64_t i = 0; i < 20; i++)
+    ASSERT_TRUE(schedule(i, 30));
+  EXPECT_TRUE(scheduler.Wait(&error));
+  // At most three operations of 30 bytes fit at once.
+  EXPECT_LE(peak, 90u);
+
+  // An operation larger than the budget still runs, alone.
+  peak = 0;
+  ASSERT_TRUE(schedule(20, 150));
+  for (uint64_t i = 21; i < 30; i++)
+    ASSERT_TRUE(schedule(i, 10));
+  EXPECT_TRUE(scheduler.Wait(&error));
+  EXPECT_EQ(150u, peak);
+}
+
+}  // namespace chromeos_update_engine
@@ -95,6 +95,7 @@ string InstallPlan::ToString() const {
           {"source_slot", BootControlInterface::SlotName(source_slot)},
           {"target_slot", BootControlInterface::SlotName(target_slot)},
           {"initial url", url_str},
+          {"mirror urls", base::JoinString(mirror_urls, " ")},
           {"hash_checks_mandatory", utils::ToString(hash_checks_mandatory)},
           {"powerwash_required", utils::ToString(powerwash_required)},
           {"switch_slot_on_reboot", utils::ToString(switch_slot_on_reboot)},
@@ -122,6 +123,8 @@ string InstallPlan::ToString() const {
                              partition.target_hash.size())},
             {"run_postinstall", utils::ToString(partition.run_postinstall)},
             {"postinstall_path", partition.postinstall_path},
+            {"postinstall_depends_on",
+             base::JoinString(partition.postinstall_depends_on, " ")},
             {"readonly_target_path", partition.readonly_target_path},
             {"filesystem_type", partition.filesystem_type},
         },
@@ -183,7 +186,8 @@ bool InstallPlan::Partition::operator==(
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
-          postinstall_optional == that.postinstall_optional);
+          postinstall_optional == that.postinstall_optional &&
+          postinstall_depends_on == that.postinstall_depends_on);
 }
 
 bool InstallPlan::Partition::ParseVerityConfig(
@@ -224,6 +228,53 @@ bool InstallPlan::Partition::ParseVerityConfig(
   return true;
 }
 
+void InstallPlan::Partition::ParseCopiedBlocks(
+    const PartitionUpdate& partition) {
+  copied_blocks.clear();
+  for (const InstallOperation& op : partition.operations()) {
+    if (op.type() != InstallOperation::SOURCE_COPY)
+      continue;
+    // The source and destination extents may be split differently.
+    auto src = op.src_extents().begin();
+    uint64_t src_used = 0;
+    for (const Extent& dst : op.dst_extents()) {
+      uint64_t dst_used = 0;
+      while (dst_used < dst.num_blocks() && src != op.src_extents().end()) {
+        const uint64_t num_blocks =
+            std::min(dst.num_blocks() - dst_used, src->num_blocks() - src_used);
+        copied_blocks.push_back({dst.start_block() + dst_used,
+                                 src->start_block() + src_used,
+                                 num_blocks});
+        dst_used += num_blocks;
+        src_used += num_blocks;
+        if (src_used == src->num_blocks()) {
+          src++;
+          src_used = 0;
+        }
+      }
+    }
+  }
+  std::sort(copied_blocks.begin(),
+            copied_blocks.end(),
+            [](const CopiedBlocks& a, const CopiedBlocks& b) {
+              return a.target_block < b.target_block;
+            });
+  // Merge the runs contiguous on both sides.
+  size_t num_runs = 0;
+  for (const CopiedBlocks& run : copied_blocks) {
+    if (num_runs > 0) {
+      CopiedBlocks& last = copied_blocks[num_runs - 1];
+      if (last.target_block + last.num_blocks == run.target_block &&
+          last.source_block + last.num_blocks == run.source_block) {
+        last.num_blocks += run.num_blocks;
+        continue;
+      }
+    }
+    copied_blocks[num_runs++] = run;
+  }
+  copied_blocks.resize(num_runs);
+}
+
 template <typename PartitinoUpdateArray>
 bool InstallPlan::ParseManifestToInstallPlan(
     const PartitinoUpdateArray& partitions,
@@ -244,12 +295,18 @@ bool InstallPlan::ParseManifestToInstallPlan(
                                             : kPostinstallDefaultScript);
       install_part.filesystem_type = partition.filesystem_type();
       install_part.postinstall_optional = partition.postinstall_optional();
+      install_part.postinstall_depends_on.assign(
+          partition.postinstall_depends_on().begin(),
+          partition.postinstall_depends_on().end());
     }
 
     if (partition.has_old_partition_info()) {
       const PartitionInfo& info = partition.old_partition_info();
       install_part.source_size = info.size();
       install_part.source_hash.assign(info.hash().begin(), info.hash().end());
+      install_part.source_verity_root_digest.assign(
+          partition.old_verity_root_digest().begin(),
+          partition.old_verity_root_digest().end());
     }
 
     if (!partition.has_new_partition_info()) {
@@ -269,6 +326,10 @@ bool InstallPlan::ParseManifestToInstallPlan(
                 << "` verity configs";
       return false;
     }
+    if (install_plan->incremental_verity && install_part.hash_tree_size > 0 &&
+        install_part.source_size > 0) {
+      install_part.ParseCopiedBlocks(partition);
+    }
 
     install_plan->partitions.push_back(install_part);
   }
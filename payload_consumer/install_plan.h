@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -38,6 +39,8 @@ enum class InstallPayloadType {
 
 std::string InstallPayloadTypeToString(InstallPayloadType type);
 
+class WrittenDataHasher;
+
 struct InstallPlan {
   InstallPlan() = default;
 
@@ -76,6 +79,8 @@ struct InstallPlan {
   bool vabc_none{false};
   bool disable_vabc{false};
   std::string download_url;  // url to download from
+  // Other URLs serving the same payload as |download_url|.
+  std::vector<std::string> mirror_urls;
   std::string version;       // version we are installing.
 
   struct Payload {
@@ -123,6 +128,9 @@ struct InstallPlan {
     std::string source_path;
     uint64_t source_size{0};
     brillo::Blob source_hash;
+    // The root digest of the dm-verity hash tree of the source partition, if
+    // the payload has it.
+    brillo::Blob source_verity_root_digest;
 
     // |target_path| is intended to be a path to block device, which you can
     // open with |open| syscall and perform regular unix style read/write.
@@ -143,6 +151,8 @@ struct InstallPlan {
     std::string postinstall_path;
     std::string filesystem_type;
     bool postinstall_optional{false};
+    // The partitions whose postinstall must be done before this one starts.
+    std::vector<std::string> postinstall_depends_on;
 
     // Verity hash tree and FEC config. See update_metadata.proto for details.
     // All offsets and sizes are in bytes.
@@ -159,7 +169,24 @@ struct InstallPlan {
     uint64_t fec_size{0};
     uint32_t fec_roots{0};
 
+    // If not null, hashes the data written to the target partition by the
+    // install operations, see WrittenDataHasher. Only set for partitions
+    // written from their first operation by this process.
+    std::shared_ptr<WrittenDataHasher> written_data_hasher;
+
+    // A run of target blocks that SOURCE_COPY operations copy from the source
+    // partition.
+    struct CopiedBlocks {
+      uint64_t target_block;
+      uint64_t source_block;
+      uint64_t num_blocks;
+    };
+    // The blocks copied from the source partition, sorted by target block.
+    // Only set with incremental_verity, for the partitions with a hash tree.
+    std::vector<CopiedBlocks> copied_blocks;
+
     bool ParseVerityConfig(const PartitionUpdate&);
+    void ParseCopiedBlocks(const PartitionUpdate&);
   };
   std::vector<Partition> partitions;
 
@@ -202,6 +229,130 @@ struct InstallPlan {
 
   // Whether to enable multi-threaded compression on COW writes
   bool enable_threading = false;
+
+  // Whether to apply the payload on a dedicated thread while it's being
+  // downloaded, instead of inside the fetcher's write callback.
+  bool pipelined_apply = false;
+
+  // Whether the fetchers tune the download to the throughput and round trip
+  // time they measure, see HttpFetcher::set_adaptive_tuning().
+  bool adaptive_download = false;
+
+  // Whether to apply the non-conflicting operations of a partition on
+  // multiple threads. Not supported for VABC partitions.
+  bool parallel_install_ops = false;
+
+  // Whether to submit the extent reads and writes of the target partitions
+  // through io_uring. Falls back to synchronous I/O if it's unavailable.
+  bool use_io_uring = false;
+
+  // Whether to write the data of large REPLACE, REPLACE_BZ, REPLACE_XZ and
+  // REPLACE_ZSTD operations to the partition as it's received instead of
+  // buffering the whole blob first. The operation hash is then checked once
+  // all of its data was written. Not supported for VABC partitions.
+  bool stream_replace_ops = false;
+
+  // Whether the operations of a partition still applied in parallel keep
+  // running while the next partition is downloaded, instead of waiting for
+  // them at every partition boundary. Requires parallel_install_ops.
+  bool concurrent_partitions = false;
+
+  // Whether to write the COW uncompressed, as with vabc_none, when the
+  // filesystem holding the COW images has plenty of free space. Only the free
+  // space is considered, when the partitions are first prepared for the
+  // payload. The resumed attempts keep that choice.
+  bool adaptive_vabc_compression = false;
+
+  // Number of partitions FilesystemVerifierAction hashes concurrently. 0 and 1
+  // hash them one after another.
+  size_t verify_threads = 0;
+
+  // Number of bytes FilesystemVerifierAction reads at once, 0 for the default.
+  size_t verify_read_size = 0;
+
+  // Whether to hash the target partitions as they're written, so that
+  // FilesystemVerifierAction only reads back the data following what could be
+  // hashed in order. Not supported for VABC partitions.
+  bool hash_while_writing = false;
+
+  // Whether to take the digests of the blocks SOURCE_COPY operations copy
+  // from the hash tree of the source partition when building the hash tree of
+  // a target partition, so that only the other blocks are read and hashed.
+  // Falls back to hashing all the blocks if the source tree doesn't match the
+  // source data.
+  bool incremental_verity = false;
+
+  // Whether to read the source partitions through their active dm-verity
+  // device when its root digest is the one of the payload, instead of hashing
+  // the source extents of the operations. Corrupted source blocks then fail
+  // to read rather than fail their source hash.
+  bool trust_source_verity = false;
+
+  // Whether to hash each source partition entirely before applying its
+  // operations. When it matches, the source extents of the operations aren't
+  // verified again.
+  bool verify_source_partitions = false;
+
+  // Whether to verify the metadata and prepare the partitions on a separate
+  // thread once the metadata is received, buffering the following data until
+  // they're ready instead of stopping the download. Unused with pipelined
+  // apply, which already does it on its own thread.
+  bool prepare_partitions_early = false;
+
+  // Whether FilesystemVerifierAction starts on the partitions already written
+  // while DownloadAction still runs, and PostinstallRunnerAction on the ones
+  // already verified. Not supported with VABC, powerwash or rollback.
+  bool overlap_actions = false;
+
+  // Number of bytes the source and target buffers of a diff operation may
+  // take in memory, 0 for no limit. Larger ones are kept in scratch files.
+  uint64_t apply_memory_budget = 0;
+
+  // Number of bytes of the source partitions read into the page cache ahead
+  // of the operation being applied, on an idle priority thread, 0 to disable.
+  // Capped to a quarter of the memory available when the operations start.
+  uint64_t source_warming_size = 0;
+
+  // I/O priority of the threads writing the target partitions, as passed to
+  // ioprio_set(), or -1 to keep the one of the process.
+  int io_priority = -1;
+
+  // Number of bytes written to a target partition between two starts of its
+  // writeback, 0 to leave the writeback to the kernel.
+  uint64_t writeback_interval = 0;
+
+  // Whether to write the aligned data of the target partitions with O_DIRECT.
+  bool direct_io = false;
+
+  // Whether to copy the blocks of SOURCE_COPY operations with
+  // copy_file_range() or splice() instead of reading and writing them. The
+  // writes to the target partitions then aren't cached. Not supported for
+  // VABC partitions, with the I/O policy above or while hashing the written
+  // data.
+  bool kernel_copy = false;
+
+  // Whether to discard the blocks of the target partitions that the
+  // operations rewrite before applying the first operation, so that the
+  // storage doesn't keep the old data of the target slot as live. Not
+  // supported for VABC partitions, when resuming or while skipping the
+  // applied operations.
+  bool discard_target = false;
+
+  // Size in bytes of the two buffers the cached writes to the target
+  // partitions alternate between, one being filled while the other is written
+  // on a background thread. 0 to write the cache synchronously.
+  uint64_t write_back_buffer_size = 0;
+
+  // Number of postinstall programs PostinstallRunnerAction runs at once. The
+  // postinstall of a partition only starts once the ones it depends on are
+  // done. 0 and 1 run them one after another.
+  size_t postinstall_concurrency = 1;
+
+  // Whether DeltaPerformer skips the operations whose destination already
+  // matches their dst_sha256_hash, as left by a previous attempt, until the
+  // first operation that doesn't match. Not supported for VABC partitions or
+  // with parallel_install_ops.
+  bool skip_applied_operations = false;
 };
 
 class InstallPlanAction;
@@ -0,0 +1,256 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_policy_file_descriptor.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+namespace chromeos_update_engine {
+
+static_assert(AlignedBufferPool::kAlignment %
+                  IoPolicyFileDescriptor::kDirectIoAlignment ==
+              0);
+
+namespace {
+// From linux/ioprio.h, which isn't exported to userspace by older kernels.
+constexpr int kIoprioClassShift = 13;
+constexpr int kIoprioClassRt = 1;
+constexpr int kIoprioClassBe = 2;
+constexpr int kIoprioClassIdle = 3;
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioMaxLevel = 7;
+
+// The I/O priority already set on the calling thread, -1 if none was.
+thread_local int thread_io_priority = -1;
+}  // namespace
+
+bool ParseIoPriority(const std::string& value, int* io_priority) {
+  const auto fields = base::SplitString(
+      value, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  int io_class = 0;
+  if (fields[0] == "idle") {
+    // The idle class has no level.
+    TEST_AND_RETURN_FALSE(fields.size() == 1);
+    *io_priority = kIoprioClassIdle << kIoprioClassShift;
+    return true;
+  } else if (fields[0] == "be") {
+    io_class = kIoprioClassBe;
+  } else if (fields[0] == "rt") {
+    io_class = kIoprioClassRt;
+  } else {
+    return false;
+  }
+  int level = 0;
+  TEST_AND_RETURN_FALSE(fields.size() == 2 &&
+                        base::StringToInt(fields[1], &level) && level >= 0 &&
+                        level <= kIoprioMaxLevel);
+  *io_priority = (io_class << kIoprioClassShift) | level;
+  return true;
+}
+
+bool SetThreadIoPriority(int io_priority) {
+  // Marked as set even on failure, so that it isn't retried on every I/O.
+  thread_io_priority = io_priority;
+  if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, io_priority) != 0) {
+    PLOG(WARNING) << "Unable to set the I/O priority of thread " << gettid();
+    return false;
+  }
+  return true;
+}
+
+IoPolicyFileDescriptor::IoPolicyFileDescriptor(FileDescriptorPtr fd,
+                                               const IoPolicy& policy)
+    : fd_(std::move(fd)), policy_(policy) {}
+
+bool IoPolicyFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  TEST_AND_RETURN_FALSE(fd_->Open(path, flags, mode));
+  OpenDirect(path, flags);
+  return true;
+}
+
+bool IoPolicyFileDescriptor::Open(const char* path, int flags) {
+  TEST_AND_RETURN_FALSE(fd_->Open(path, flags));
+  OpenDirect(path, flags);
+  return true;
+}
+
+ssize_t IoPolicyFileDescriptor::Read(void* buf, size_t count) {
+  ApplyIoPriority();
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t IoPolicyFileDescriptor::Write(const void* buf, size_t count) {
+  ApplyIoPriority();
+  const WriteRequest request{buf, count, offset_};
+  ssize_t written = 0;
+  if (direct_fd_.ok() && IsAligned(request)) {
+    if (!WriteDirect(request))
+      return -1;
+    // Keep the position of |fd_| where the write ended.
+    if (fd_->Seek(count, SEEK_CUR) < 0)
+      return -1;
+    written = count;
+  } else {
+    written = fd_->Write(buf, count);
+    if (written < 0)
+      return written;
+  }
+  offset_ += written;
+  AddWritten(written);
+  return written;
+}
+
+off64_t IoPolicyFileDescriptor::Seek(off64_t offset, int whence) {
+  const off64_t result = fd_->Seek(offset, whence);
+  if (result >= 0)
+    offset_ = result;
+  return result;
+}
+
+bool IoPolicyFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  ApplyIoPriority();
+  return fd_->ReadBatch(requests);
+}
+
+bool IoPolicyFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  ApplyIoPriority();
+  uint64_t total = 0;
+  if (!direct_fd_.ok()) {
+    TEST_AND_RETURN_FALSE(fd_->WriteBatch(requests));
+    for (const auto& request : requests)
+      total += request.count;
+  } else {
+    std::vector<WriteRequest> buffered;
+    for (const auto& request : requests) {
+      total += request.count;
+      if (IsAligned(request)) {
+        TEST_AND_RETURN_FALSE(WriteDirect(request));
+      } else {
+        buffered.push_back(request);
+      }
+    }
+    if (!buffered.empty())
+      TEST_AND_RETURN_FALSE(fd_->WriteBatch(buffered));
+  }
+  AddWritten(total);
+  return true;
+}
+
+bool IoPolicyFileDescriptor::Close() {
+  direct_fd_.reset();
+  offset_ = 0;
+  bytes_since_writeback_ = 0;
+  return fd_->Close();
+}
+
+void IoPolicyFileDescriptor::ApplyIoPriority() {
+  if (policy_.io_priority < 0 || thread_io_priority == policy_.io_priority)
+    return;
+  SetThreadIoPriority(policy_.io_priority);
+}
+
+void IoPolicyFileDescriptor::OpenDirect(const char* path, int flags) {
+  if (!policy_.direct_io || (flags & O_ACCMODE) == O_RDONLY)
+    return;
+  // The file was just opened through |fd_|, don't create or truncate it again.
+  flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+  direct_fd_.reset(HANDLE_EINTR(open(path, flags | O_DIRECT | O_CLOEXEC)));
+  if (!direct_fd_.ok()) {
+    PLOG(WARNING) << "Unable to open " << path
+                  << " with O_DIRECT, writing through the page cache";
+  }
+}
+
+bool IoPolicyFileDescriptor::WriteDirect(const WriteRequest& request) {
+  const void* buf = request.buf;
+  // The buffers of the pool are aligned, their data is written as is.
+  PooledBuffer aligned_buf;
+  if (reinterpret_cast<uintptr_t>(buf) % kDirectIoAlignment != 0) {
+    aligned_buf = AlignedBufferPool::Get()->Acquire(request.count);
+    if (aligned_buf.empty()) {
+      LOG(ERROR) << "Unable to allocate " << request.count << " bytes";
+      return false;
+    }
+    memcpy(aligned_buf.data(), buf, request.count);
+    buf = aligned_buf.data();
+  }
+  size_t done = 0;
+  while (done < request.count) {
+    const ssize_t written =
+        HANDLE_EINTR(pwrite(direct_fd_.get(),
+                            static_cast<const uint8_t*>(buf) + done,
+                            request.count - done,
+                            request.offset + done));
+    if (written <= 0) {
+      PLOG(ERROR) << "Unable to write " << request.count - done
+                  << " bytes at offset " << request.offset + done
+                  << " with O_DIRECT";
+      return false;
+    }
+    done += written;
+  }
+  return true;
+}
+
+bool IoPolicyFileDescriptor::IsAligned(const WriteRequest& request) {
+  return request.offset % kDirectIoAlignment == 0 &&
+         request.count % kDirectIoAlignment == 0 && request.count > 0;
+}
+
+void IoPolicyFileDescriptor::AddWritten(uint64_t count) {
+  if (policy_.writeback_interval == 0 || !writeback_supported_)
+    return;
+  if (bytes_since_writeback_.fetch_add(count) + count <
+      policy_.writeback_interval) {
+    return;
+  }
+  bytes_since_writeback_ = 0;
+  const int fd = Fd();
+  if (fd < 0)
+    return;
+  // Waits for the writeback started last time, then starts it for the pages
+  // dirtied since.
+  if (sync_file_range(
+          fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE) != 0) {
+    PLOG(WARNING) << "sync_file_range() failed, leaving the writeback to the "
+                  << "kernel";
+    writeback_supported_ = false;
+    return;
+  }
+  num_writebacks_++;
+}
+
+}  // namespace chromeos_update_engine
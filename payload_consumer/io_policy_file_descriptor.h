@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_POLICY_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_POLICY_FILE_DESCRIPTOR_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// How the writes of an update hit the block layer.
+struct IoPolicy {
+  // I/O priority of the threads reading and writing the file, as passed to
+  // ioprio_set(), or -1 to keep the one of the process.
+  int io_priority{-1};
+  // Starts the writeback of the dirty pages every |writeback_interval| bytes
+  // written, after waiting for the writeback started the previous time. This
+  // bounds the dirty pages to about twice the interval, so neither they nor
+  // the final fsync() grow with the size of the partition. 0 leaves the
+  // writeback to the kernel.
+  uint64_t writeback_interval{0};
+  // Whether to write the data aligned to |kDirectIoAlignment| with O_DIRECT,
+  // bypassing the page cache.
+  bool direct_io{false};
+
+  bool IsDefault() const {
+    return io_priority < 0 && writeback_interval == 0 && !direct_io;
+  }
+};
+
+// Parses an I/O priority such as "idle", "be:7" or "rt:0" into the value
+// passed to ioprio_set(). Returns false if |value| is malformed.
+bool ParseIoPriority(const std::string& value, int* io_priority);
+
+// Sets the I/O priority of the calling thread to |io_priority|, as passed to
+// ioprio_set(). Returns false on failure.
+bool SetThreadIoPriority(int io_priority);
+
+// A FileDescriptor applying an IoPolicy to the I/O of the wrapped one. The
+// I/O priority is set on every thread the first time it goes through this
+// descriptor. Unaligned writes with |direct_io| go through the page cache.
+// Safe to use from several threads as long as the wrapped descriptor is.
+class IoPolicyFileDescriptor final : public FileDescriptor {
+ public:
+  // Alignment of the offset, size and buffer of the O_DIRECT writes.
+  static constexpr size_t kDirectIoAlignment = 4096;
+
+  IoPolicyFileDescriptor(FileDescriptorPtr fd, const IoPolicy& policy);
+  ~IoPolicyFileDescriptor() override = default;
+
+  // Interface methods.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+  // Whether the aligned writes bypass the page cache. Only meaningful once
+  // opened.
+  bool IsUsingDirectIo() const { return direct_fd_.ok(); }
+  // Number of times the writeback was started.
+  uint64_t num_writebacks() const { return num_writebacks_; }
+
+ private:
+  // Sets the I/O priority of the calling thread if not already done.
+  void ApplyIoPriority();
+
+  // Opens |direct_fd_| on |path| if the policy asks for it.
+  void OpenDirect(const char* path, int flags);
+
+  // Writes |request| through |direct_fd_|. Returns false if it failed.
+  bool WriteDirect(const WriteRequest& request);
+
+  static bool IsAligned(const WriteRequest& request);
+
+  // Accounts for |count| bytes written and starts the writeback if needed.
+  void AddWritten(uint64_t count);
+
+  FileDescriptorPtr fd_;
+  const IoPolicy policy_;
+
+  // A second descriptor on the same file, opened with O_DIRECT.
+  android::base::unique_fd direct_fd_;
+  // Position of |fd_|, for the sequential writes sent to |direct_fd_|.
+  off64_t offset_{0};
+
+  std::atomic<uint64_t> bytes_since_writeback_{0};
+  std::atomic<uint64_t> num_writebacks_{0};
+  // Cleared if the file doesn't support sync_file_range().
+  std::atomic<bool> writeback_supported_{true};
+
+  DISALLOW_COPY_AND_ASSIGN(IoPolicyFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_POLICY_FILE_DESCRIPTOR_H_
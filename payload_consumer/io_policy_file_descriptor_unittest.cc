@@ -0,0 +1,134 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_policy_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = IoPolicyFileDescriptor::kDirectIoAlignment;
+constexpr size_t kNumBlocks = 8;
+
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<uint8_t>(i * 13 + i / kBlockSize);
+  return data;
+}
+}  // namespace
+
+class IoPolicyFileDescriptorTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<IoPolicyFileDescriptor> Open(const IoPolicy& policy) {
+    auto fd = std::make_unique<IoPolicyFileDescriptor>(
+        std::make_shared<EintrSafeFileDescriptor>(), policy);
+    EXPECT_TRUE(fd->Open(temp_file_.path().c_str(), O_RDWR));
+    return fd;
+  }
+
+  ScopedTempFile temp_file_{"IoPolicyFileDescriptorTest-XXXXXX",
+                            false,
+                            kBlockSize * kNumBlocks};
+};
+
+TEST(IoPolicyTest, ParseIoPriorityTest) {
+  int io_priority = -1;
+  EXPECT_TRUE(ParseIoPriority("idle", &io_priority));
+  EXPECT_EQ(3 << 13, io_priority);
+  EXPECT_TRUE(ParseIoPriority("be:7", &io_priority));
+  EXPECT_EQ((2 << 13) | 7, io_priority);
+  EXPECT_TRUE(ParseIoPriority("rt:0", &io_priority));
+  EXPECT_EQ(1 << 13, io_priority);
+
+  EXPECT_FALSE(ParseIoPriority("", &io_priority));
+  EXPECT_FALSE(ParseIoPriority("be", &io_priority));
+  EXPECT_FALSE(ParseIoPriority("be:8", &io_priority));
+  EXPECT_FALSE(ParseIoPriority("idle:1", &io_priority));
+  EXPECT_FALSE(ParseIoPriority("low:1", &io_priority));
+}
+
+TEST_F(IoPolicyFileDescriptorTest, WritebackTest) {
+  IoPolicy policy;
+  policy.writeback_interval = kBlockSize * 2;
+  auto fd = Open(policy);
+  const brillo::Blob data = MakeData(kBlockSize * kNumBlocks);
+  for (size_t block = 0; block < kNumBlocks; block++) {
+    ASSERT_EQ(static_cast<ssize_t>(kBlockSize),
+              fd->Write(data.data() + block * kBlockSize, kBlockSize));
+  }
+  EXPECT_EQ(kNumBlocks / 2, fd->num_writebacks());
+
+  // Batches count as well.
+  ASSERT_TRUE(fd->WriteBatch({{data.data(), kBlockSize * 2, 0}}));
+  EXPECT_EQ(kNumBlocks / 2 + 1, fd->num_writebacks());
+  ASSERT_TRUE(fd->Close());
+
+  brillo::Blob on_disk;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &on_disk));
+  EXPECT_EQ(data, on_disk);
+}
+
+TEST_F(IoPolicyFileDescriptorTest, DirectIoTest) {
+  IoPolicy policy;
+  policy.direct_io = true;
+  auto fd = Open(policy);
+  // Some filesystems, like tmpfs, don't support O_DIRECT. The writes then go
+  // through the page cache and the result is the same.
+  LOG(INFO) << "Using O_DIRECT: " << fd->IsUsingDirectIo();
+
+  const brillo::Blob data = MakeData(kBlockSize * kNumBlocks);
+  // An aligned write from an unaligned buffer, then an unaligned one.
+  brillo::Blob unaligned(kBlockSize + 1);
+  std::copy(data.begin(), data.begin() + kBlockSize, unaligned.begin() + 1);
+  ASSERT_EQ(static_cast<ssize_t>(kBlockSize),
+            fd->Write(unaligned.data() + 1, kBlockSize));
+  ASSERT_EQ(3, fd->Write(data.data() + kBlockSize, 3));
+  ASSERT_EQ(static_cast<ssize_t>(kBlockSize + 3), fd->Seek(0, SEEK_CUR));
+  ASSERT_EQ(static_cast<ssize_t>(kBlockSize - 3),
+            fd->Write(data.data() + kBlockSize + 3, kBlockSize - 3));
+
+  // The rest in a batch mixing aligned and unaligned requests.
+  std::vector<FileDescriptor::WriteRequest> writes = {
+      {data.data() + kBlockSize * 2, kBlockSize * 3, kBlockSize * 2},
+      {data.data() + kBlockSize * 5, 10, kBlockSize * 5},
+      {data.data() + kBlockSize * 5 + 10,
+       kBlockSize * 3 - 10,
+       kBlockSize * 5 + 10},
+  };
+  ASSERT_TRUE(fd->WriteBatch(writes));
+
+  brillo::Blob read_data(data.size());
+  ASSERT_TRUE(fd->ReadBatch({{read_data.data(), read_data.size(), 0}}));
+  EXPECT_EQ(data, read_data);
+  ASSERT_TRUE(fd->Close());
+
+  brillo::Blob on_disk;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &on_disk));
+  EXPECT_EQ(data, on_disk);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,302 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_trace.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kIoTraceHeader[] = "# update_engine I/O trace v1";
+// The buffered lines are written past this size.
+constexpr size_t kMaxBufferSize = 256 * 1024;
+
+uint64_t MonotonicTimeUs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+bool ParseOp(const std::string& value, IoTraceEntry::Op* op) {
+  if (value.size() != 1)
+    return false;
+  switch (value[0]) {
+    case static_cast<char>(IoTraceEntry::Op::kRead):
+    case static_cast<char>(IoTraceEntry::Op::kWrite):
+    case static_cast<char>(IoTraceEntry::Op::kIoctl):
+    case static_cast<char>(IoTraceEntry::Op::kFlush):
+      *op = static_cast<IoTraceEntry::Op>(value[0]);
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+bool IoTraceEntry::operator==(const IoTraceEntry& other) const {
+  return file == other.file && op == other.op && thread == other.thread &&
+         start_us == other.start_us && latency_us == other.latency_us &&
+         offset == other.offset && length == other.length;
+}
+
+bool ParseIoTrace(const std::string& contents, IoTrace* trace) {
+  trace->files.clear();
+  trace->entries.clear();
+  const auto lines = base::SplitString(
+      contents, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  TEST_AND_RETURN_FALSE(!lines.empty() && lines[0] == kIoTraceHeader);
+  for (size_t i = 1; i < lines.size(); i++) {
+    const std::string& line = lines[i];
+    if (line[0] == 'F') {
+      // "F <index> <path>", the files are listed in order.
+      const size_t path_start = line.find(' ', 2);
+      unsigned index = 0;
+      if (path_start == std::string::npos ||
+          !base::StringToUint(line.substr(2, path_start - 2), &index) ||
+          index != trace->files.size()) {
+        LOG(ERROR) << "Invalid file in I/O trace: " << line;
+        return false;
+      }
+      trace->files.push_back(line.substr(path_start + 1));
+      continue;
+    }
+    const auto fields = base::SplitString(
+        line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    IoTraceEntry entry;
+    unsigned file = 0;
+    unsigned thread = 0;
+    if (fields.size() != 7 || !base::StringToUint(fields[0], &file) ||
+        !ParseOp(fields[1], &entry.op) ||
+        !base::StringToUint(fields[2], &thread) ||
+        !base::StringToUint64(fields[3], &entry.start_us) ||
+        !base::StringToUint64(fields[4], &entry.latency_us) ||
+        !base::StringToUint64(fields[5], &entry.offset) ||
+        !base::StringToUint64(fields[6], &entry.length) ||
+        file >= trace->files.size()) {
+      LOG(ERROR) << "Invalid entry in I/O trace: " << line;
+      return false;
+    }
+    entry.file = file;
+    entry.thread = thread;
+    trace->entries.push_back(entry);
+  }
+  return true;
+}
+
+IoTraceRecorder::~IoTraceRecorder() {
+  Stop();
+}
+
+IoTraceRecorder* IoTraceRecorder::Get() {
+  static IoTraceRecorder recorder;
+  return &recorder;
+}
+
+bool IoTraceRecorder::Start(const std::string& path) {
+  Stop();
+  std::lock_guard<std::mutex> lock(mutex_);
+  fd_.reset(HANDLE_EINTR(
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)));
+  if (!fd_.ok()) {
+    PLOG(ERROR) << "Failed to create the I/O trace " << path;
+    return false;
+  }
+  buffer_ = std::string(kIoTraceHeader) + "\n";
+  num_files_ = 0;
+  start_us_ = MonotonicTimeUs();
+  LOG(INFO) << "Recording the I/O of the update to " << path;
+  return true;
+}
+
+void IoTraceRecorder::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!fd_.ok())
+    return;
+  FlushLocked();
+  fd_.reset();
+}
+
+bool IoTraceRecorder::IsRecording() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return fd_.ok();
+}
+
+uint32_t IoTraceRecorder::AddFile(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!fd_.ok())
+    return 0;
+  buffer_ += base::StringPrintf("F %u %s\n", num_files_, path.c_str());
+  return num_files_++;
+}
+
+uint64_t IoTraceRecorder::Now() const {
+  return MonotonicTimeUs() - start_us_;
+}
+
+void IoTraceRecorder::Record(const IoTraceEntry& entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!fd_.ok())
+    return;
+  base::StringAppendF(&buffer_,
+                      "%u %c %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                      "\n",
+                      entry.file,
+                      static_cast<char>(entry.op),
+                      entry.thread,
+                      entry.start_us,
+                      entry.latency_us,
+                      entry.offset,
+                      entry.length);
+  if (buffer_.size() >= kMaxBufferSize)
+    FlushLocked();
+}
+
+void IoTraceRecorder::FlushLocked() {
+  if (!utils::WriteAll(fd_.get(), buffer_.data(), buffer_.size()))
+    PLOG(WARNING) << "Failed to write the I/O trace";
+  buffer_.clear();
+}
+
+TracingFileDescriptor::TracingFileDescriptor(FileDescriptorPtr fd,
+                                             IoTraceRecorder* recorder,
+                                             const std::string& path)
+    : fd_(std::move(fd)), recorder_(recorder) {
+  if (!path.empty())
+    file_ = recorder_->AddFile(path);
+}
+
+bool TracingFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  TEST_AND_RETURN_FALSE(fd_->Open(path, flags, mode));
+  file_ = recorder_->AddFile(path);
+  offset_ = 0;
+  return true;
+}
+
+bool TracingFileDescriptor::Open(const char* path, int flags) {
+  TEST_AND_RETURN_FALSE(fd_->Open(path, flags));
+  file_ = recorder_->AddFile(path);
+  offset_ = 0;
+  return true;
+}
+
+ssize_t TracingFileDescriptor::Read(void* buf, size_t count) {
+  const uint64_t start_us = recorder_->Now();
+  const ssize_t result = fd_->Read(buf, count);
+  if (result > 0) {
+    Record(
+        IoTraceEntry::Op::kRead, start_us, recorder_->Now(), offset_, result);
+    offset_ += result;
+  }
+  return result;
+}
+
+ssize_t TracingFileDescriptor::Write(const void* buf, size_t count) {
+  const uint64_t start_us = recorder_->Now();
+  const ssize_t result = fd_->Write(buf, count);
+  if (result > 0) {
+    Record(
+        IoTraceEntry::Op::kWrite, start_us, recorder_->Now(), offset_, result);
+    offset_ += result;
+  }
+  return result;
+}
+
+off64_t TracingFileDescriptor::Seek(off64_t offset, int whence) {
+  const off64_t result = fd_->Seek(offset, whence);
+  if (result >= 0)
+    offset_ = result;
+  return result;
+}
+
+bool TracingFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  const uint64_t start_us = recorder_->Now();
+  const bool success = fd_->ReadBatch(requests);
+  const uint64_t end_us = recorder_->Now();
+  for (const ReadRequest& request : requests) {
+    Record(IoTraceEntry::Op::kRead,
+           start_us,
+           end_us,
+           request.offset,
+           request.count);
+  }
+  return success;
+}
+
+bool TracingFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  const uint64_t start_us = recorder_->Now();
+  const bool success = fd_->WriteBatch(requests);
+  const uint64_t end_us = recorder_->Now();
+  for (const WriteRequest& request : requests) {
+    Record(IoTraceEntry::Op::kWrite,
+           start_us,
+           end_us,
+           request.offset,
+           request.count);
+  }
+  return success;
+}
+
+bool TracingFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  const uint64_t start_us = recorder_->Now();
+  const bool success = fd_->BlkIoctl(request, start, length, result);
+  Record(IoTraceEntry::Op::kIoctl, start_us, recorder_->Now(), start, length);
+  return success;
+}
+
+bool TracingFileDescriptor::Flush() {
+  const uint64_t start_us = recorder_->Now();
+  const bool success = fd_->Flush();
+  Record(IoTraceEntry::Op::kFlush, start_us, recorder_->Now(), 0, 0);
+  return success;
+}
+
+void TracingFileDescriptor::Record(IoTraceEntry::Op op,
+                                   uint64_t start_us,
+                                   uint64_t end_us,
+                                   uint64_t offset,
+                                   uint64_t length) {
+  IoTraceEntry entry;
+  entry.file = file_;
+  entry.op = op;
+  entry.thread = static_cast<uint32_t>(gettid());
+  entry.start_us = start_us;
+  entry.latency_us = end_us - start_us;
+  entry.offset = offset;
+  entry.length = length;
+  recorder_->Record(entry);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_TRACE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_TRACE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// One I/O of an install, as recorded in an I/O trace.
+struct IoTraceEntry {
+  enum class Op : char {
+    kRead = 'r',
+    kWrite = 'w',
+    kIoctl = 'i',
+    kFlush = 'f',
+  };
+
+  // Index of the file in the trace.
+  uint32_t file{0};
+  Op op{Op::kRead};
+  // Thread that issued the I/O.
+  uint32_t thread{0};
+  // Start of the I/O since the start of the trace, and its duration.
+  uint64_t start_us{0};
+  uint64_t latency_us{0};
+  // Byte range of the I/O, the ones of the request for an ioctl.
+  uint64_t offset{0};
+  uint64_t length{0};
+
+  bool operator==(const IoTraceEntry& other) const;
+};
+
+// A parsed I/O trace: the paths of the files, indexed by the |file| of the
+// entries, and the entries in the order they completed.
+struct IoTrace {
+  std::vector<std::string> files;
+  std::vector<IoTraceEntry> entries;
+};
+
+// Parses an I/O trace written by IoTraceRecorder. Returns false if
+// |contents| is malformed.
+bool ParseIoTrace(const std::string& contents, IoTrace* trace);
+
+// IoTraceRecorder writes the I/O of the partition writers and the verifier to
+// a text file, one line per I/O, to replay it on another storage with
+// io_trace_replay. The lines are buffered and written in batches.
+// All the methods are thread safe.
+class IoTraceRecorder {
+ public:
+  IoTraceRecorder() = default;
+  ~IoTraceRecorder();
+
+  // The recorder of the process.
+  static IoTraceRecorder* Get();
+
+  // Starts recording to a new file at |path|, stopping the current recording
+  // if any. Returns false if the file can't be created.
+  bool Start(const std::string& path);
+  // Writes the remaining entries and closes the file.
+  void Stop();
+  bool IsRecording() const;
+
+  // Returns the index of the file opened at |path| in the trace.
+  uint32_t AddFile(const std::string& path);
+  // Returns the time since the start of the recording.
+  uint64_t Now() const;
+  // Records |entry|, whose start time is from Now().
+  void Record(const IoTraceEntry& entry);
+
+ private:
+  // Writes |buffer_| to |fd_|. Must be called with |mutex_| held.
+  void FlushLocked();
+
+  mutable std::mutex mutex_;
+  android::base::unique_fd fd_;
+  // Lines not written yet.
+  std::string buffer_;
+  uint32_t num_files_{0};
+  // Monotonic time of the start, in microseconds.
+  std::atomic<uint64_t> start_us_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IoTraceRecorder);
+};
+
+// A FileDescriptor recording the I/O of the wrapped one with an
+// IoTraceRecorder. The entries of a batch share the time of the whole batch.
+// Safe to use from several threads as long as the wrapped descriptor is.
+class TracingFileDescriptor final : public FileDescriptor {
+ public:
+  // If |fd| is already open, |path| names its file in the trace.
+  TracingFileDescriptor(FileDescriptorPtr fd,
+                        IoTraceRecorder* recorder,
+                        const std::string& path = "");
+  ~TracingFileDescriptor() override = default;
+
+  // Interface methods.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
+
+ private:
+  // Records an I/O of |op| from |start_us| to |end_us|.
+  void Record(IoTraceEntry::Op op,
+              uint64_t start_us,
+              uint64_t end_us,
+              uint64_t offset,
+              uint64_t length);
+
+  FileDescriptorPtr fd_;
+  IoTraceRecorder* recorder_;
+  // Index of the file in the trace, once opened.
+  uint32_t file_{0};
+  // Position of |fd_|, for the entries of Read() and Write().
+  off64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(TracingFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_TRACE_H_
@@ -0,0 +1,142 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_trace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+class IoTraceTest : public ::testing::Test {
+ protected:
+  void ReadTrace(IoTrace* trace) {
+    std::string contents;
+    ASSERT_TRUE(utils::ReadFile(trace_file_.path(), &contents));
+    ASSERT_TRUE(ParseIoTrace(contents, trace));
+  }
+
+  ScopedTempFile trace_file_{"io_trace.XXXXXX"};
+  IoTraceRecorder recorder_;
+};
+
+TEST_F(IoTraceTest, RecordTest) {
+  ASSERT_TRUE(recorder_.Start(trace_file_.path()));
+  EXPECT_TRUE(recorder_.IsRecording());
+  auto fake_fd = std::make_shared<FakeFileDescriptor>();
+  TracingFileDescriptor fd(fake_fd, &recorder_);
+  ASSERT_TRUE(fd.Open("/dev/block/by-name/system_b", O_RDONLY));
+
+  char buf[16];
+  EXPECT_EQ(8, fd.Read(buf, 8));
+  EXPECT_EQ(32, fd.Seek(24, SEEK_CUR));
+  EXPECT_EQ(4, fd.Read(buf, 4));
+  EXPECT_TRUE(fd.ReadBatch({{buf, 8, 100}, {buf + 8, 8, 50}}));
+  EXPECT_TRUE(fd.Flush());
+  // The failed I/O isn't recorded.
+  EXPECT_EQ(-1, fd.Write(buf, 8));
+
+  auto open_fake_fd = std::make_shared<FakeFileDescriptor>();
+  ASSERT_TRUE(open_fake_fd->Open("cow", O_RDONLY));
+  TracingFileDescriptor open_fd(open_fake_fd, &recorder_, "cow:system");
+  EXPECT_TRUE(open_fd.Flush());
+  recorder_.Stop();
+  EXPECT_FALSE(recorder_.IsRecording());
+
+  IoTrace trace;
+  ReadTrace(&trace);
+  EXPECT_EQ(std::vector<std::string>(
+                {"/dev/block/by-name/system_b", "cow:system"}),
+            trace.files);
+  ASSERT_EQ(6u, trace.entries.size());
+  const std::vector<std::pair<IoTraceEntry::Op, uint64_t>> ops = {
+      {IoTraceEntry::Op::kRead, 0},
+      {IoTraceEntry::Op::kRead, 32},
+      {IoTraceEntry::Op::kRead, 100},
+      {IoTraceEntry::Op::kRead, 50},
+      {IoTraceEntry::Op::kFlush, 0},
+      {IoTraceEntry::Op::kFlush, 0},
+  };
+  const std::vector<uint64_t> lengths = {8, 4, 8, 8, 0, 0};
+  for (size_t i = 0; i < ops.size(); i++) {
+    const IoTraceEntry& entry = trace.entries[i];
+    EXPECT_EQ(i < 5 ? 0u : 1u, entry.file);
+    EXPECT_EQ(ops[i].first, entry.op);
+    EXPECT_EQ(ops[i].second, entry.offset);
+    EXPECT_EQ(lengths[i], entry.length);
+    EXPECT_EQ(static_cast<uint32_t>(gettid()), entry.thread);
+    if (i > 0)
+      EXPECT_LE(trace.entries[i - 1].start_us, entry.start_us);
+  }
+  // The entries of a batch share its time.
+  EXPECT_EQ(trace.entries[2].start_us, trace.entries[3].start_us);
+  EXPECT_EQ(trace.entries[2].latency_us, trace.entries[3].latency_us);
+}
+
+TEST_F(IoTraceTest, NotRecordingTest) {
+  EXPECT_FALSE(recorder_.IsRecording());
+  EXPECT_EQ(0u, recorder_.AddFile("/dev/null"));
+  recorder_.Record({});
+
+  // A new recording starts a new trace.
+  ASSERT_TRUE(recorder_.Start(trace_file_.path()));
+  EXPECT_EQ(0u, recorder_.AddFile("a"));
+  ASSERT_TRUE(recorder_.Start(trace_file_.path()));
+  EXPECT_EQ(0u, recorder_.AddFile("b"));
+  IoTraceEntry entry;
+  entry.op = IoTraceEntry::Op::kWrite;
+  entry.thread = 7;
+  entry.start_us = 10;
+  entry.latency_us = 5;
+  entry.offset = 4096;
+  entry.length = 512;
+  recorder_.Record(entry);
+  recorder_.Stop();
+
+  IoTrace trace;
+  ReadTrace(&trace);
+  EXPECT_EQ(std::vector<std::string>({"b"}), trace.files);
+  EXPECT_EQ(std::vector<IoTraceEntry>({entry}), trace.entries);
+}
+
+TEST_F(IoTraceTest, ParseInvalidTest) {
+  IoTrace trace;
+  const std::string header = "# update_engine I/O trace v1\n";
+  EXPECT_TRUE(ParseIoTrace(header, &trace));
+  EXPECT_TRUE(ParseIoTrace(header + "F 0 /a b\n0 i 1 2 3 4 5\n", &trace));
+  EXPECT_EQ(std::vector<std::string>({"/a b"}), trace.files);
+  EXPECT_EQ(1u, trace.entries.size());
+
+  EXPECT_FALSE(ParseIoTrace("", &trace));
+  EXPECT_FALSE(ParseIoTrace("F 0 /a\n", &trace));
+  // The files are listed in order.
+  EXPECT_FALSE(ParseIoTrace(header + "F 1 /a\n", &trace));
+  // Unknown file, unknown op and missing field.
+  EXPECT_FALSE(ParseIoTrace(header + "F 0 /a\n1 r 1 2 3 4 5\n", &trace));
+  EXPECT_FALSE(ParseIoTrace(header + "F 0 /a\n0 x 1 2 3 4 5\n", &trace));
+  EXPECT_FALSE(ParseIoTrace(header + "F 0 /a\n0 r 1 2 3 4\n", &trace));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+io_uring_cpp::IoUringSQE PrepRequest(io_uring_cpp::IoUringInterface* ring,
+                                     int fd,
+                                     const FileDescriptor::ReadRequest& req) {
+  return ring->PrepRead(fd, req.buf, req.count, req.offset);
+}
+
+io_uring_cpp::IoUringSQE PrepRequest(io_uring_cpp::IoUringInterface* ring,
+                                     int fd,
+                                     const FileDescriptor::WriteRequest& req) {
+  return ring->PrepWrite(fd, req.buf, req.count, req.offset);
+}
+
+// Synchronously transfers what's left of |req| after the first |done| bytes,
+// for requests the kernel completed only partially.
+bool CompleteRequest(int fd,
+                     const FileDescriptor::ReadRequest& req,
+                     size_t done) {
+  const size_t remaining = req.count - done;
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                        static_cast<uint8_t*>(req.buf) + done,
+                                        remaining,
+                                        req.offset + done,
+                                        &bytes_read));
+  return bytes_read == static_cast<ssize_t>(remaining);
+}
+
+bool CompleteRequest(int fd,
+                     const FileDescriptor::WriteRequest& req,
+                     size_t done) {
+  return utils::PWriteAll(fd,
+                          static_cast<const uint8_t*>(req.buf) + done,
+                          req.count - done,
+                          req.offset + done);
+}
+
+}  // namespace
+
+IoUringFileDescriptor::IoUringFileDescriptor(unsigned queue_depth)
+    : queue_depth_(queue_depth) {
+  CHECK_GT(queue_depth_, 0u);
+}
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  if (IsOpen()) {
+    Close();
+  }
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  TEST_AND_RETURN_FALSE(fd_.Open(path, flags, mode));
+  InitRing();
+  return true;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags) {
+  TEST_AND_RETURN_FALSE(fd_.Open(path, flags));
+  InitRing();
+  return true;
+}
+
+void IoUringFileDescriptor::InitRing() {
+  const int saved_errno = errno;
+  ring_ = io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth_, 0);
+  if (!ring_) {
+    PLOG(WARNING) << "Failed to create an io_uring, falling back to "
+                     "synchronous I/O";
+  }
+  errno = saved_errno;
+}
+
+ssize_t IoUringFileDescriptor::Read(void* buf, size_t count) {
+  return fd_.Read(buf, count);
+}
+
+ssize_t IoUringFileDescriptor::Write(const void* buf, size_t count) {
+  return fd_.Write(buf, count);
+}
+
+off64_t IoUringFileDescriptor::Seek(off64_t offset, int whence) {
+  return fd_.Seek(offset, whence);
+}
+
+bool IoUringFileDescriptor::ReadBatch(
+    const std::vector<ReadRequest>& requests) {
+  return SubmitBatch(requests);
+}
+
+bool IoUringFileDescriptor::WriteBatch(
+    const std::vector<WriteRequest>& requests) {
+  return SubmitBatch(requests);
+}
+
+uint64_t IoUringFileDescriptor::BlockDevSize() {
+  return fd_.BlockDevSize();
+}
+
+bool IoUringFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  return fd_.BlkIoctl(request, start, length, result);
+}
+
+bool IoUringFileDescriptor::Flush() {
+  return fd_.Flush();
+}
+
+bool IoUringFileDescriptor::Close() {
+  // Nothing is left in flight once a batch method returns.
+  ring_.reset();
+  return fd_.Close();
+}
+
+template <typename Request>
+bool IoUringFileDescriptor::SubmitBatch(const std::vector<Request>& requests) {
+  CHECK(IsOpen());
+  size_t next = 0;
+  while (ring_ && next < requests.size()) {
+    const size_t batch_end =
+        std::min<size_t>(requests.size(), next + queue_depth_);
+    for (size_t i = next; i < batch_end; i++) {
+      TEST_AND_RETURN_FALSE(requests[i].count <=
+                            std::numeric_limits<unsigned>::max());
+      auto sqe = PrepRequest(ring_.get(), fd_.Fd(), requests[i]);
+      // The queue is empty between batches and has |queue_depth_| entries.
+      CHECK(sqe.IsOk());
+      sqe.SetData(i);
+    }
+    const size_t batch_size = batch_end - next;
+    const auto submitted = ring_->Submit();
+    const size_t num_submitted = submitted.EntriesSubmitted();
+    if (num_submitted != batch_size) {
+      LOG(WARNING) << "Submitted " << num_submitted << " of " << batch_size
+                   << " io_uring requests: "
+                   << (submitted.IsOk() ? "" : submitted.ErrMsg())
+                   << ", falling back to synchronous I/O";
+    }
+    bool success = true;
+    std::vector<io_uring_cpp::IoUringCQE> completions;
+    if (num_submitted > 0) {
+      auto cqes = ring_->PopCQE(num_submitted);
+      if (cqes.IsOk()) {
+        completions = cqes.GetResult();
+      } else {
+        LOG(WARNING) << "Failed to reap " << num_submitted
+                     << " io_uring completions at once: " << cqes.GetError()
+                     << ", reaping them one by one";
+        // None of them were consumed, wait for each of them instead.
+        while (completions.size() < num_submitted) {
+          auto cqe = ring_->PopCQE();
+          if (cqe.IsErr()) {
+            // The ring is unusable. Its requests may still be in flight,
+            // failing the batch fails the update instead of the daemon.
+            LOG(ERROR) << "Failed to reap io_uring completions after "
+                       << completions.size() << " of " << num_submitted
+                       << ": " << cqe.GetError();
+            ring_.reset();
+            return false;
+          }
+          completions.push_back(cqe.GetResult());
+        }
+      }
+      for (const auto& cqe : completions) {
+        const size_t index = cqe.GetData<size_t>();
+        const Request& req = requests[index];
+        if (cqe.res < 0) {
+          errno = -cqe.res;
+          PLOG(ERROR) << "io_uring request of " << req.count
+                      << " bytes at offset " << req.offset << " failed";
+          success = false;
+        } else if (static_cast<size_t>(cqe.res) < req.count &&
+                   !CompleteRequest(fd_.Fd(), req, cqe.res)) {
+          PLOG(ERROR) << "Failed to complete the short io_uring request of "
+                      << req.count << " bytes at offset " << req.offset;
+          success = false;
+        }
+      }
+    }
+    TEST_AND_RETURN_FALSE(success);
+    if (num_submitted != batch_size) {
+      // Drop the ring along with the requests it didn't take, and apply the
+      // whole batch again synchronously below. Redoing positioned I/O that
+      // already completed is harmless.
+      ring_.reset();
+      break;
+    }
+    next = batch_end;
+  }
+  if (next == requests.size()) {
+    return true;
+  }
+  const std::vector<Request> remaining(requests.begin() + next,
+                                       requests.end());
+  if constexpr (std::is_same_v<Request, ReadRequest>) {
+    return fd_.ReadBatch(remaining);
+  } else {
+    return fd_.WriteBatch(remaining);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A FileDescriptor which submits the requests of ReadBatch() and WriteBatch()
+// through an io_uring, so a whole extent list is in flight with a single
+// syscall instead of one blocking pread()/pwrite() per extent. All the other
+// methods behave like EintrSafeFileDescriptor. If the kernel doesn't support
+// io_uring, the batch methods fall back to the synchronous default.
+//
+// The ring isn't thread safe, an instance must only be used by one thread at
+// a time.
+class IoUringFileDescriptor final : public FileDescriptor {
+ public:
+  // Maximum number of requests submitted to the ring at once.
+  static constexpr unsigned kDefaultQueueDepth = 64;
+
+  explicit IoUringFileDescriptor(unsigned queue_depth = kDefaultQueueDepth);
+  ~IoUringFileDescriptor() override;
+
+  // Interface methods.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadBatch(const std::vector<ReadRequest>& requests) override;
+  bool WriteBatch(const std::vector<WriteRequest>& requests) override;
+  uint64_t BlockDevSize() override;
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return true; }
+  bool IsOpen() override { return fd_.IsOpen(); }
+  int Fd() override { return fd_.Fd(); }
+
+  // Whether batches are submitted through io_uring. Only meaningful once
+  // opened.
+  bool IsUsingIoUring() const { return ring_ != nullptr; }
+
+ private:
+  // Submits |requests| to the ring, at most |queue_depth_| at a time, and
+  // waits for all of them to complete.
+  template <typename Request>
+  bool SubmitBatch(const std::vector<Request>& requests);
+
+  // Creates |ring_| after the file is opened.
+  void InitRing();
+
+  const unsigned queue_depth_;
+  EintrSafeFileDescriptor fd_;
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
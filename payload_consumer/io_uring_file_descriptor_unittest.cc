@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 16;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+    if (!fd_.IsUsingIoUring()) {
+      GTEST_SKIP() << "io_uring isn't supported by this kernel.";
+    }
+  }
+
+  ScopedTempFile temp_file_{"IoUringFileDescriptorTest-XXXXXX",
+                            false,
+                            kBlockSize * kNumBlocks};
+  // A small queue depth so batches are split in several submissions.
+  IoUringFileDescriptor fd_{3};
+};
+
+TEST_F(IoUringFileDescriptorTest, WriteAndReadBatchTest) {
+  brillo::Blob data(kBlockSize * kNumBlocks);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<uint8_t>(i * 31 + i / kBlockSize);
+
+  // Write the blocks in reverse order, one request per block.
+  std::vector<FileDescriptor::WriteRequest> writes;
+  for (size_t block = kNumBlocks; block > 0; block--) {
+    const size_t offset = (block - 1) * kBlockSize;
+    writes.push_back({data.data() + offset, kBlockSize,
+                      static_cast<off64_t>(offset)});
+  }
+  ASSERT_TRUE(fd_.WriteBatch(writes));
+
+  brillo::Blob on_disk;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &on_disk));
+  EXPECT_EQ(data, on_disk);
+
+  // Read it back with requests of different sizes.
+  brillo::Blob read_data(data.size());
+  std::vector<FileDescriptor::ReadRequest> reads = {
+      {read_data.data(), kBlockSize * 5, 0},
+      {read_data.data() + kBlockSize * 5, 1, kBlockSize * 5},
+      {read_data.data() + kBlockSize * 5 + 1,
+       kBlockSize * 11 - 1,
+       kBlockSize * 5 + 1},
+  };
+  ASSERT_TRUE(fd_.ReadBatch(reads));
+  EXPECT_EQ(data, read_data);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadPastEndFailsTest) {
+  brillo::Blob buffer(kBlockSize * 2);
+  EXPECT_FALSE(fd_.ReadBatch(
+      {{buffer.data(), buffer.size(), kBlockSize * (kNumBlocks - 1)}}));
+}
+
+TEST_F(IoUringFileDescriptorTest, EmptyBatchTest) {
+  EXPECT_TRUE(fd_.ReadBatch({}));
+  EXPECT_TRUE(fd_.WriteBatch({}));
+}
+
+}  // namespace chromeos_update_engine
@@ -26,12 +26,19 @@
 namespace chromeos_update_engine {
 class MockPartitionWriter : public PartitionWriter {
  public:
-  MockPartitionWriter() : PartitionWriter({}, {}, nullptr, kBlockSize, false) {}
+  MockPartitionWriter() : PartitionWriter({}, {}, nullptr, kBlockSize, false) {
+    // Batches are applied one operation at a time, with the mocked methods.
+    ON_CALL(*this, PerformOperations(testing::_, testing::_))
+        .WillByDefault([this](const std::vector<OperationWithData>& operations,
+                              ErrorCode* error) {
+          return PartitionWriterInterface::PerformOperations(operations, error);
+        });
+  }
   virtual ~MockPartitionWriter() = default;
 
   // Perform necessary initialization work before InstallOperation can be
   // applied to this partition
-  MOCK_METHOD(bool, Init, (const InstallPlan*, bool, size_t), (override));
+  MOCK_METHOD(bool, Init, (const InstallPlan*, bool, size_t, bool), (override));
 
   // |CheckpointUpdateProgress| will be called after SetNextOpIndex(), but it's
   // optional. DeltaPerformer may or may not call this everytime an operation is
@@ -45,6 +52,10 @@ class MockPartitionWriter : public PartitionWriter {
               PerformReplaceOperation,
               (const InstallOperation&, const void*, size_t),
               (override));
+  MOCK_METHOD(std::unique_ptr<ExtentWriter>,
+              CreateReplaceOperationWriter,
+              (const InstallOperation&),
+              (override));
   MOCK_METHOD(bool,
               PerformZeroOrDiscardOperation,
               (const InstallOperation&),
@@ -57,6 +68,11 @@ class MockPartitionWriter : public PartitionWriter {
               PerformDiffOperation,
               (const InstallOperation&, ErrorCode*, const void*, size_t),
               (override));
+  MOCK_METHOD(bool,
+              PerformOperations,
+              (const std::vector<OperationWithData>&, ErrorCode*),
+              (override));
+  MOCK_METHOD(bool, IsOperationApplied, (const InstallOperation&), (override));
 };
 
 }  // namespace chromeos_update_engine
@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+void AppendVarint(uint64_t value, string* packed) {
+  while (value >= 0x80) {
+    packed->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  packed->push_back(static_cast<char>(value));
+}
+
+bool ReadVarint(const string& packed, size_t* offset, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    TEST_AND_RETURN_FALSE(*offset < packed.size());
+    const uint8_t byte = packed[(*offset)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// The start blocks are coded relative to the end of the previous extent, and
+// the differences wrap around as uint64_t, so that any extent can be packed.
+uint64_t ZigZagEncode(uint64_t delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+uint64_t ZigZagDecode(uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+bool UnpackField(bool has_packed,
+                 const string& packed,
+                 RepeatedPtrField<Extent>* extents) {
+  if (!has_packed)
+    return true;
+  // Only one of the packed and the repeated field may be set.
+  TEST_AND_RETURN_FALSE(extents->empty());
+  return UnpackExtents(packed, extents);
+}
+}  // namespace
+
+string PackExtents(const RepeatedPtrField<Extent>& extents) {
+  string packed;
+  uint64_t previous_end = 0;
+  for (const Extent& extent : extents) {
+    AppendVarint(ZigZagEncode(extent.start_block() - previous_end), &packed);
+    AppendVarint(extent.num_blocks(), &packed);
+    previous_end = extent.start_block() + extent.num_blocks();
+  }
+  return packed;
+}
+
+bool UnpackExtents(const string& packed, RepeatedPtrField<Extent>* extents) {
+  uint64_t previous_end = 0;
+  size_t offset = 0;
+  while (offset < packed.size()) {
+    uint64_t delta, num_blocks;
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &offset, &delta));
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &offset, &num_blocks));
+    Extent* extent = extents->Add();
+    extent->set_start_block(previous_end + ZigZagDecode(delta));
+    extent->set_num_blocks(num_blocks);
+    previous_end = extent->start_block() + num_blocks;
+  }
+  return true;
+}
+
+void PackOperationExtents(InstallOperation* operation) {
+  if (!operation->src_extents().empty()) {
+    operation->set_packed_src_extents(PackExtents(operation->src_extents()));
+    operation->clear_src_extents();
+  }
+  if (!operation->dst_extents().empty()) {
+    operation->set_packed_dst_extents(PackExtents(operation->dst_extents()));
+    operation->clear_dst_extents();
+  }
+}
+
+void PackManifestExtents(DeltaArchiveManifest* manifest) {
+  if (manifest->minor_version() < kPackedExtentsMinorPayloadVersion)
+    return;
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    for (InstallOperation& operation : *partition.mutable_operations())
+      PackOperationExtents(&operation);
+  }
+}
+
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest) {
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    for (InstallOperation& operation : *partition.mutable_operations()) {
+      if (!operation.has_packed_src_extents() &&
+          !operation.has_packed_dst_extents()) {
+        continue;
+      }
+      if (manifest->minor_version() < kPackedExtentsMinorPayloadVersion) {
+        LOG(ERROR) << "Packed extents in partition "
+                   << partition.partition_name() << " on minor version "
+                   << manifest->minor_version();
+        return false;
+      }
+      TEST_AND_RETURN_FALSE(UnpackField(operation.has_packed_src_extents(),
+                                        operation.packed_src_extents(),
+                                        operation.mutable_src_extents()));
+      TEST_AND_RETURN_FALSE(UnpackField(operation.has_packed_dst_extents(),
+                                        operation.packed_dst_extents(),
+                                        operation.mutable_dst_extents()));
+      operation.clear_packed_src_extents();
+      operation.clear_packed_dst_extents();
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,53 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+
+#include <string>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Returns |extents| in the packed format of the packed_src_extents and
+// packed_dst_extents fields of the InstallOperation.
+std::string PackExtents(
+    const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+// Appends to |extents| the extents packed in |packed|. Returns false if
+// |packed| isn't valid.
+bool UnpackExtents(const std::string& packed,
+                   google::protobuf::RepeatedPtrField<Extent>* extents);
+
+// Moves the src_extents and dst_extents of |operation| to its packed fields.
+void PackOperationExtents(InstallOperation* operation);
+
+// Packs the extents of all the operations of |manifest| if its minor version
+// allows it, for a manifest parsed from a payload and written again.
+void PackManifestExtents(DeltaArchiveManifest* manifest);
+
+// Moves the packed extents of all the operations of |manifest| back to their
+// src_extents and dst_extents, so that the rest of the client only deals with
+// these. Returns false if an operation has invalid packed extents, or has
+// them on a minor version before they were allowed.
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(PackedExtentsTest, PackUnpackTest) {
+  RepeatedPtrField<Extent> extents;
+  // Forward and backward jumps, a large block number and a sparse hole.
+  for (const Extent& extent : {ExtentForRange(10, 5),
+                               ExtentForRange(15, 1),
+                               ExtentForRange(2, 3),
+                               ExtentForRange(1ULL << 40, 200),
+                               ExtentForRange(kSparseHole, 4)}) {
+    *extents.Add() = extent;
+  }
+  const string packed = PackExtents(extents);
+  // Single byte varints for the first extents.
+  EXPECT_EQ(string("\x14\x05\x00\x01", 4), packed.substr(0, 4));
+
+  RepeatedPtrField<Extent> unpacked;
+  ASSERT_TRUE(UnpackExtents(packed, &unpacked));
+  EXPECT_EQ(vector<Extent>(extents.begin(), extents.end()),
+            vector<Extent>(unpacked.begin(), unpacked.end()));
+
+  EXPECT_EQ("", PackExtents({}));
+  unpacked.Clear();
+  EXPECT_TRUE(UnpackExtents("", &unpacked));
+  EXPECT_TRUE(unpacked.empty());
+
+  // Truncated in the middle of an extent, or of a varint.
+  EXPECT_FALSE(UnpackExtents(packed.substr(0, 3), &unpacked));
+  EXPECT_FALSE(UnpackExtents("\x14\x85", &unpacked));
+  // A varint longer than 64 bits.
+  EXPECT_FALSE(UnpackExtents(string(11, '\xff'), &unpacked));
+}
+
+TEST(PackedExtentsTest, UnpackManifestExtentsTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kPackedExtentsMinorPayloadVersion);
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->set_partition_name("system");
+  InstallOperation* copy = partition->add_operations();
+  copy->set_type(InstallOperation::SOURCE_COPY);
+  *copy->add_src_extents() = ExtentForRange(0, 2);
+  *copy->add_src_extents() = ExtentForRange(8, 1);
+  *copy->add_dst_extents() = ExtentForRange(4, 3);
+  InstallOperation* replace = partition->add_operations();
+  replace->set_type(InstallOperation::REPLACE);
+  *replace->add_dst_extents() = ExtentForRange(7, 1);
+  const DeltaArchiveManifest original = manifest;
+
+  PackOperationExtents(copy);
+  PackOperationExtents(replace);
+  EXPECT_TRUE(copy->src_extents().empty());
+  EXPECT_TRUE(copy->dst_extents().empty());
+  EXPECT_TRUE(copy->has_packed_src_extents());
+  EXPECT_FALSE(replace->has_packed_src_extents());
+  EXPECT_LT(manifest.ByteSizeLong(), original.ByteSizeLong());
+
+  DeltaArchiveManifest unpacked = manifest;
+  ASSERT_TRUE(UnpackManifestExtents(&unpacked));
+  EXPECT_EQ(original.SerializeAsString(), unpacked.SerializeAsString());
+  PackManifestExtents(&unpacked);
+  EXPECT_EQ(manifest.SerializeAsString(), unpacked.SerializeAsString());
+
+  // Not allowed before their minor version.
+  unpacked = manifest;
+  unpacked.set_minor_version(kZstdDictionaryMinorPayloadVersion);
+  EXPECT_FALSE(UnpackManifestExtents(&unpacked));
+
+  // Both the packed and the repeated extents.
+  unpacked = manifest;
+  *unpacked.mutable_partitions(0)->mutable_operations(0)->add_src_extents() =
+      ExtentForRange(1, 1);
+  EXPECT_FALSE(UnpackManifestExtents(&unpacked));
+}
+
+}  // namespace chromeos_update_engine
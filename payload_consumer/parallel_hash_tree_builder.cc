@@ -0,0 +1,266 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Below this many blocks per thread, starting the threads costs more than
+// hashing the blocks.
+constexpr size_t kMinBlocksPerThread = 64;
+}  // namespace
+
+ParallelHashTreeBuilder::ParallelHashTreeBuilder(size_t block_size,
+                                                 const EVP_MD* md,
+                                                 size_t num_threads)
+    : block_size_(block_size),
+      md_(md),
+      num_threads_(std::max<size_t>(1, num_threads)) {
+  CHECK(md_ != nullptr);
+  digest_slot_size_ = 1;
+  while (digest_slot_size_ < static_cast<size_t>(EVP_MD_size(md_)))
+    digest_slot_size_ <<= 1;
+}
+
+ParallelHashTreeBuilder::~ParallelHashTreeBuilder() {
+  EVP_MD_CTX_free(salted_ctx_);
+}
+
+bool ParallelHashTreeBuilder::Initialize(uint64_t data_size,
+                                         const brillo::Blob& salt) {
+  TEST_AND_RETURN_FALSE(digest_slot_size_ * 2 < block_size_);
+  if (data_size % block_size_ != 0) {
+    LOG(ERROR) << "Hash tree data size " << data_size
+               << " is not a multiple of the block size " << block_size_;
+    return false;
+  }
+  data_size_ = data_size;
+
+  EVP_MD_CTX_free(salted_ctx_);
+  salted_ctx_ = EVP_MD_CTX_new();
+  TEST_AND_RETURN_FALSE(salted_ctx_ != nullptr);
+  TEST_AND_RETURN_FALSE(
+      EVP_DigestInit_ex(salted_ctx_, md_, nullptr) == 1 &&
+      EVP_DigestUpdate(salted_ctx_, salt.data(), salt.size()) == 1);
+
+  const uint64_t num_blocks = data_size_ / block_size_;
+  levels_.clear();
+  levels_.emplace_back(
+      utils::DivRoundUp(num_blocks * digest_slot_size_, block_size_) *
+          block_size_,
+      0);
+  block_hashed_.assign(num_blocks, false);
+  num_blocks_hashed_ = 0;
+  leftover_.clear();
+  update_offset_ = 0;
+  return true;
+}
+
+bool ParallelHashTreeBuilder::HashBlocks(uint64_t offset,
+                                         const uint8_t* data,
+                                         size_t length) {
+  TEST_AND_RETURN_FALSE(salted_ctx_ != nullptr);
+  if (offset % block_size_ != 0 || length % block_size_ != 0 ||
+      offset > data_size_ || length > data_size_ - offset) {
+    LOG(ERROR) << "Can't hash " << length << " bytes at offset " << offset
+               << " of " << data_size_ << " bytes of hash tree data.";
+    return false;
+  }
+  const uint64_t first_block = offset / block_size_;
+  const size_t num_blocks = length / block_size_;
+  TEST_AND_RETURN_FALSE(MarkBlocksHashed(first_block, num_blocks));
+  return HashBlocksInParallel(
+      data,
+      num_blocks,
+      levels_.front().data() + first_block * digest_slot_size_);
+}
+
+bool ParallelHashTreeBuilder::SetBlockDigests(uint64_t first_block,
+                                              const uint8_t* digests,
+                                              size_t num_blocks) {
+  TEST_AND_RETURN_FALSE(salted_ctx_ != nullptr);
+  if (first_block > block_hashed_.size() ||
+      num_blocks > block_hashed_.size() - first_block) {
+    LOG(ERROR) << "Can't set the digests of " << num_blocks
+               << " blocks from block " << first_block << " of "
+               << block_hashed_.size() << " hash tree data blocks.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(MarkBlocksHashed(first_block, num_blocks));
+  std::copy(digests,
+            digests + num_blocks * digest_slot_size_,
+            levels_.front().data() + first_block * digest_slot_size_);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::ComputeDigest(const uint8_t* block,
+                                            uint8_t* digest) const {
+  TEST_AND_RETURN_FALSE(salted_ctx_ != nullptr);
+  return HashRange(block, 1, digest);
+}
+
+bool ParallelHashTreeBuilder::MarkBlocksHashed(uint64_t first_block,
+                                               size_t num_blocks) {
+  for (uint64_t i = first_block; i < first_block + num_blocks; i++) {
+    if (block_hashed_[i]) {
+      LOG(ERROR) << "Hash tree data block " << i << " hashed twice.";
+      return false;
+    }
+    block_hashed_[i] = true;
+  }
+  num_blocks_hashed_ += num_blocks;
+  return true;
+}
+
+bool ParallelHashTreeBuilder::Update(const uint8_t* data, size_t length) {
+  if (!leftover_.empty()) {
+    const size_t count = std::min(length, block_size_ - leftover_.size());
+    leftover_.insert(leftover_.end(), data, data + count);
+    data += count;
+    length -= count;
+    if (leftover_.size() < block_size_)
+      return true;
+    TEST_AND_RETURN_FALSE(
+        HashBlocks(update_offset_, leftover_.data(), leftover_.size()));
+    update_offset_ += leftover_.size();
+    leftover_.clear();
+  }
+  const size_t full_blocks_size = length - length % block_size_;
+  if (full_blocks_size != 0) {
+    TEST_AND_RETURN_FALSE(HashBlocks(update_offset_, data, full_blocks_size));
+    update_offset_ += full_blocks_size;
+  }
+  leftover_.assign(data + full_blocks_size, data + length);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::SkipTo(uint64_t offset) {
+  if (offset == update_offset_ + leftover_.size())
+    return true;
+  if (!leftover_.empty() || offset < update_offset_ ||
+      offset % block_size_ != 0 || offset > data_size_) {
+    LOG(ERROR) << "Can't skip to offset " << offset << " of the hash tree data"
+               << " from offset " << update_offset_ + leftover_.size();
+    return false;
+  }
+  update_offset_ = offset;
+  return true;
+}
+
+bool ParallelHashTreeBuilder::BuildHashTree() {
+  TEST_AND_RETURN_FALSE(!levels_.empty());
+  TEST_AND_RETURN_FALSE(leftover_.empty());
+  if (num_blocks_hashed_ != block_hashed_.size()) {
+    LOG(ERROR) << "Only " << num_blocks_hashed_ << " of "
+               << block_hashed_.size() << " hash tree data blocks hashed.";
+    return false;
+  }
+  levels_.resize(1);
+  while (levels_.back().size() > block_size_) {
+    const size_t num_blocks = levels_.back().size() / block_size_;
+    brillo::Blob next_level(
+        utils::DivRoundUp(num_blocks * digest_slot_size_, block_size_) *
+            block_size_,
+        0);
+    TEST_AND_RETURN_FALSE(HashBlocksInParallel(
+        levels_.back().data(), num_blocks, next_level.data()));
+    levels_.push_back(std::move(next_level));
+  }
+  return true;
+}
+
+bool ParallelHashTreeBuilder::WriteHashTree(
+    const std::function<bool(const void*, size_t)>& callback) const {
+  for (auto level = levels_.rbegin(); level != levels_.rend(); level++) {
+    if (!callback(level->data(), level->size())) {
+      LOG(ERROR) << "Failed to write hash tree level of " << level->size()
+                 << " bytes.";
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t ParallelHashTreeBuilder::CalculateSize(uint64_t data_size) const {
+  uint64_t size = 0;
+  uint64_t level_blocks = utils::DivRoundUp(data_size, block_size_);
+  do {
+    level_blocks =
+        utils::DivRoundUp(level_blocks * digest_slot_size_, block_size_);
+    size += level_blocks * block_size_;
+  } while (level_blocks > 1);
+  return size;
+}
+
+bool ParallelHashTreeBuilder::HashBlocksInParallel(const uint8_t* data,
+                                                   size_t num_blocks,
+                                                   uint8_t* out) const {
+  const size_t num_threads = std::max<size_t>(
+      1, std::min(num_threads_, num_blocks / kMinBlocksPerThread));
+  const size_t blocks_per_thread = utils::DivRoundUp(num_blocks, num_threads);
+  std::vector<std::thread> workers;
+  // Not a std::vector<bool>, each thread sets its own element.
+  std::vector<char> results(num_threads, false);
+  for (size_t i = 1; i < num_threads; i++) {
+    const size_t first = i * blocks_per_thread;
+    if (first >= num_blocks)
+      break;
+    workers.emplace_back([&, i, first]() {
+      results[i] = HashRange(data + first * block_size_,
+                             std::min(blocks_per_thread, num_blocks - first),
+                             out + first * digest_slot_size_);
+    });
+  }
+  results[0] = HashRange(data, std::min(blocks_per_thread, num_blocks), out);
+  for (auto& worker : workers)
+    worker.join();
+  for (size_t i = 0; i <= workers.size(); i++)
+    TEST_AND_RETURN_FALSE(results[i]);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::HashRange(const uint8_t* data,
+                                        size_t num_blocks,
+                                        uint8_t* out) const {
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  TEST_AND_RETURN_FALSE(ctx != nullptr);
+  bool success = true;
+  // Only the digest is written, the padding of its slot stays zero.
+  for (size_t i = 0; i < num_blocks; i++) {
+    if (EVP_MD_CTX_copy_ex(ctx, salted_ctx_) != 1 ||
+        EVP_DigestUpdate(ctx, data + i * block_size_, block_size_) != 1 ||
+        EVP_DigestFinal_ex(ctx, out + i * digest_slot_size_, nullptr) != 1) {
+      success = false;
+      break;
+    }
+  }
+  EVP_MD_CTX_free(ctx);
+  if (!success)
+    LOG(ERROR) << "Failed to hash a hash tree block.";
+  return success;
+}
+
+}  // namespace chromeos_update_engine
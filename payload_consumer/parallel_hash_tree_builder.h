@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <openssl/evp.h>
+
+namespace chromeos_update_engine {
+
+// ParallelHashTreeBuilder builds the same dm-verity hash tree as libverity's
+// HashTreeBuilder, but hashes the data blocks, and then each level of the
+// tree, on |num_threads| threads.
+//
+// The data blocks can be hashed in any order with HashBlocks(), so the tree
+// can be built from the data as it is written, or sequentially with Update().
+// The digests of unchanged blocks can also be taken from an older tree of the
+// data with SetBlockDigests(). The class itself isn't thread safe.
+class ParallelHashTreeBuilder {
+ public:
+  ParallelHashTreeBuilder(size_t block_size,
+                          const EVP_MD* md,
+                          size_t num_threads);
+  ~ParallelHashTreeBuilder();
+
+  // Prepares to hash |data_size| bytes of data, which must be a multiple of
+  // the block size, with |salt| prepended to every hashed block.
+  bool Initialize(uint64_t data_size, const brillo::Blob& salt);
+
+  // Hashes |length| bytes of |data| at |offset| in the data. Both must be
+  // block aligned, and each block can only be hashed once.
+  bool HashBlocks(uint64_t offset, const uint8_t* data, size_t length);
+  // Hashes |length| bytes of |data| following the data passed to the previous
+  // calls.
+  bool Update(const uint8_t* data, size_t length);
+  // Continues the data passed to Update() at |offset|, which must be block
+  // aligned, past the blocks set with SetBlockDigests().
+  bool SkipTo(uint64_t offset);
+
+  // Uses the |num_blocks| digests at |digests|, one digest slot each as laid
+  // out in the tree, for the data blocks from |first_block| instead of hashing
+  // them, for example from the tree of an older version of the data that had
+  // the same salt.
+  bool SetBlockDigests(uint64_t first_block,
+                       const uint8_t* digests,
+                       size_t num_blocks);
+  // Writes the digest of the data block at |block| to |digest|.
+  bool ComputeDigest(const uint8_t* block, uint8_t* digest) const;
+
+  // Builds the upper levels of the tree once all the data blocks are hashed.
+  bool BuildHashTree();
+  // Passes the levels of the tree to |callback|, from the top one down.
+  bool WriteHashTree(
+      const std::function<bool(const void*, size_t)>& callback) const;
+
+  // Returns the size of the hash tree of |data_size| bytes of data.
+  uint64_t CalculateSize(uint64_t data_size) const;
+
+  size_t digest_slot_size() const { return digest_slot_size_; }
+  // Returns the size of the lowest level of the tree, holding the digests of
+  // the data blocks. It is written last by WriteHashTree().
+  uint64_t data_digests_size() const {
+    return levels_.empty() ? 0 : levels_.front().size();
+  }
+
+ private:
+  // Marks |num_blocks| data blocks from |first_block| as hashed, and fails if
+  // any of them already was.
+  bool MarkBlocksHashed(uint64_t first_block, size_t num_blocks);
+  // Hashes |num_blocks| blocks of |data| into |out|, one digest slot each.
+  bool HashBlocksInParallel(const uint8_t* data,
+                            size_t num_blocks,
+                            uint8_t* out) const;
+  bool HashRange(const uint8_t* data, size_t num_blocks, uint8_t* out) const;
+
+  const size_t block_size_;
+  const EVP_MD* md_;
+  const size_t num_threads_;
+  // The digest size rounded up to a power of 2, as dm-verity lays them out.
+  size_t digest_slot_size_{0};
+
+  uint64_t data_size_{0};
+  // The state after hashing the salt, copied for every block.
+  EVP_MD_CTX* salted_ctx_{nullptr};
+  // The levels of the tree, from the one holding the data block digests up.
+  std::vector<brillo::Blob> levels_;
+  std::vector<bool> block_hashed_;
+  uint64_t num_blocks_hashed_{0};
+
+  // The data passed to Update() that doesn't fill a block yet.
+  brillo::Blob leftover_;
+  uint64_t update_offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHashTreeBuilder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
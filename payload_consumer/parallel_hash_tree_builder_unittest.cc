@@ -0,0 +1,154 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <verity/hash_tree_builder.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 7 + i / 1000);
+  return data;
+}
+
+bool AppendTo(brillo::Blob* tree, const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  tree->insert(tree->end(), bytes, bytes + size);
+  return true;
+}
+
+// Returns the hash tree libverity builds for |data|.
+brillo::Blob ExpectedHashTree(const std::string& algorithm,
+                              size_t block_size,
+                              const brillo::Blob& data,
+                              const brillo::Blob& salt) {
+  HashTreeBuilder builder(block_size, HashTreeBuilder::HashFunction(algorithm));
+  EXPECT_TRUE(builder.Initialize(data.size(), salt));
+  EXPECT_TRUE(builder.Update(data.data(), data.size()));
+  EXPECT_TRUE(builder.BuildHashTree());
+  brillo::Blob tree;
+  EXPECT_TRUE(builder.WriteHashTree([&tree](auto data, auto size) {
+    return AppendTo(&tree, data, size);
+  }));
+  return tree;
+}
+
+brillo::Blob GetHashTree(const ParallelHashTreeBuilder& builder) {
+  brillo::Blob tree;
+  EXPECT_TRUE(builder.WriteHashTree([&tree](auto data, auto size) {
+    return AppendTo(&tree, data, size);
+  }));
+  return tree;
+}
+}  // namespace
+
+class ParallelHashTreeBuilderTest
+    : public ::testing::TestWithParam<std::string> {};
+
+TEST_P(ParallelHashTreeBuilderTest, MatchesHashTreeBuilderTest) {
+  // Small blocks give a three level tree without much data.
+  constexpr size_t kBlockSize = 1024;
+  const brillo::Blob data = MakeData(kBlockSize * 2000);
+  const brillo::Blob salt = {1, 2, 3, 4, 5};
+  const auto md = HashTreeBuilder::HashFunction(GetParam());
+  const brillo::Blob expected =
+      ExpectedHashTree(GetParam(), kBlockSize, data, salt);
+
+  for (size_t num_threads : {1, 3, 8}) {
+    ParallelHashTreeBuilder builder(kBlockSize, md, num_threads);
+    ASSERT_TRUE(builder.Initialize(data.size(), salt));
+    EXPECT_EQ(HashTreeBuilder(kBlockSize, md).CalculateSize(data.size()),
+              builder.CalculateSize(data.size()));
+    // Chunks that don't line up with the blocks.
+    for (size_t offset = 0; offset < data.size(); offset += 3333) {
+      ASSERT_TRUE(builder.Update(
+          data.data() + offset, std::min<size_t>(3333, data.size() - offset)));
+    }
+    ASSERT_TRUE(builder.BuildHashTree());
+    EXPECT_EQ(expected, GetHashTree(builder)) << num_threads << " threads";
+  }
+}
+
+TEST_P(ParallelHashTreeBuilderTest, OutOfOrderBlocksTest) {
+  constexpr size_t kBlockSize = 4096;
+  const brillo::Blob data = MakeData(kBlockSize * 300);
+  const auto md = HashTreeBuilder::HashFunction(GetParam());
+  ParallelHashTreeBuilder builder(kBlockSize, md, 2);
+  ASSERT_TRUE(builder.Initialize(data.size(), {}));
+
+  const size_t split = kBlockSize * 100;
+  ASSERT_TRUE(
+      builder.HashBlocks(split, data.data() + split, data.size() - split));
+  // Not all blocks are hashed yet, and each can only be hashed once.
+  EXPECT_FALSE(builder.BuildHashTree());
+  EXPECT_FALSE(builder.HashBlocks(split, data.data() + split, kBlockSize));
+  EXPECT_FALSE(builder.HashBlocks(1, data.data(), kBlockSize));
+  ASSERT_TRUE(builder.HashBlocks(0, data.data(), split));
+  ASSERT_TRUE(builder.BuildHashTree());
+  EXPECT_EQ(ExpectedHashTree(GetParam(), kBlockSize, data, {}),
+            GetHashTree(builder));
+}
+
+TEST_P(ParallelHashTreeBuilderTest, SetBlockDigestsTest) {
+  constexpr size_t kBlockSize = 4096;
+  const brillo::Blob data = MakeData(kBlockSize * 300);
+  const brillo::Blob salt = {6, 7};
+  const auto md = HashTreeBuilder::HashFunction(GetParam());
+  const brillo::Blob expected =
+      ExpectedHashTree(GetParam(), kBlockSize, data, salt);
+  ParallelHashTreeBuilder builder(kBlockSize, md, 2);
+  ASSERT_TRUE(builder.Initialize(data.size(), salt));
+
+  // The data block digests are the end of the tree.
+  const uint8_t* digests =
+      expected.data() + expected.size() - builder.data_digests_size();
+  const size_t slot_size = builder.digest_slot_size();
+  ASSERT_TRUE(builder.SetBlockDigests(100, digests + 100 * slot_size, 50));
+  EXPECT_FALSE(builder.SetBlockDigests(149, digests, 1));
+  EXPECT_FALSE(builder.SetBlockDigests(299, digests, 2));
+
+  brillo::Blob digest(slot_size);
+  ASSERT_TRUE(builder.ComputeDigest(data.data() + 7 * kBlockSize,
+                                    digest.data()));
+  EXPECT_TRUE(
+      std::equal(digest.begin(), digest.end(), digests + 7 * slot_size));
+
+  const size_t skip_start = 100 * kBlockSize;
+  const size_t skip_end = 150 * kBlockSize;
+  ASSERT_TRUE(builder.Update(data.data(), 1000));
+  // Only past whole blocks.
+  EXPECT_FALSE(builder.SkipTo(skip_end));
+  ASSERT_TRUE(builder.Update(data.data() + 1000, skip_start - 1000));
+  ASSERT_TRUE(builder.SkipTo(skip_end));
+  ASSERT_TRUE(builder.Update(data.data() + skip_end, data.size() - skip_end));
+  ASSERT_TRUE(builder.BuildHashTree());
+  EXPECT_EQ(expected, GetHashTree(builder));
+}
+
+INSTANTIATE_TEST_CASE_P(HashAlgorithms,
+                        ParallelHashTreeBuilderTest,
+                        ::testing::Values("sha1", "sha256"));
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,250 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/common/thread_placement.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Reads are split in requests of this size, so that io_uring can have
+// several of them in flight.
+constexpr size_t kReadRequestSize = 128 * 1024;
+
+bool ReadAt(FileDescriptor* fd, uint64_t offset, void* buffer, size_t count) {
+  std::vector<FileDescriptor::ReadRequest> requests;
+  for (size_t done = 0; done < count; done += kReadRequestSize) {
+    requests.push_back({static_cast<uint8_t*>(buffer) + done,
+                        std::min(kReadRequestSize, count - done),
+                        static_cast<off64_t>(offset + done)});
+  }
+  return fd->ReadBatch(requests);
+}
+}  // namespace
+
+// Runs one read at a time on its thread, while the caller hashes the
+// previous chunk.
+class ParallelPartitionHasher::ChunkReader {
+ public:
+  ChunkReader() : thread_(&ChunkReader::ReadLoop, this) {}
+
+  ~ChunkReader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Starts reading |count| bytes at |offset| of |fd| into |buffer|. The
+  // previous read must have been waited for.
+  void Read(FileDescriptor* fd, uint64_t offset, void* buffer, size_t count) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      CHECK(!busy_);
+      fd_ = fd;
+      offset_ = offset;
+      buffer_ = buffer;
+      count_ = count;
+      busy_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  // Waits for the read started last to finish and returns whether it
+  // succeeded.
+  bool Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !busy_; });
+    return success_;
+  }
+
+ private:
+  void ReadLoop() {
+    ThreadPlacement::Get()->PlaceCurrentThread(
+        ThreadPlacement::WorkClass::kIo);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return busy_ || stopping_; });
+      if (!busy_) {
+        return;
+      }
+      lock.unlock();
+      const bool success = ReadAt(fd_, offset_, buffer_, count_);
+      lock.lock();
+      success_ = success;
+      busy_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The read requested, only changed while not |busy_|.
+  FileDescriptor* fd_{nullptr};
+  uint64_t offset_{0};
+  void* buffer_{nullptr};
+  size_t count_{0};
+  bool busy_{false};
+  bool success_{false};
+  bool stopping_{false};
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkReader);
+};
+
+ParallelPartitionHasher::ParallelPartitionHasher(std::vector<Job> jobs,
+                                                 size_t num_threads,
+                                                 size_t read_size,
+                                                 bool use_io_uring)
+    : jobs_(std::move(jobs)),
+      num_threads_(std::max<size_t>(
+          1, std::min<size_t>(num_threads, jobs_.size()))),
+      read_size_(read_size),
+      use_io_uring_(use_io_uring),
+      results_(jobs_.size()) {
+  CHECK_GT(read_size_, 0u);
+}
+
+ParallelPartitionHasher::~ParallelPartitionHasher() {
+  cancelled_ = true;
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ParallelPartitionHasher::Start() {
+  CHECK(workers_.empty());
+  for (size_t i = 0; i < num_threads_; i++) {
+    workers_.emplace_back(&ParallelPartitionHasher::WorkerLoop, this);
+  }
+}
+
+bool ParallelPartitionHasher::IsDone() const {
+  return num_done_ == jobs_.size();
+}
+
+bool ParallelPartitionHasher::GetResult(size_t index,
+                                        brillo::Blob* hash) const {
+  CHECK(IsDone());
+  CHECK_LT(index, results_.size());
+  *hash = results_[index].hash;
+  return results_[index].success;
+}
+
+void ParallelPartitionHasher::WorkerLoop() {
+  ChunkReader reader;
+  for (size_t index = next_job_++; index < jobs_.size();
+       index = next_job_++) {
+    ThreadPlacement::Get()->PlaceCurrentThread(
+        ThreadPlacement::WorkClass::kCompute);
+    HashJob(jobs_[index], &reader, &results_[index]);
+    num_done_++;
+  }
+}
+
+void ParallelPartitionHasher::HashJob(const Job& job,
+                                      ChunkReader* reader,
+                                      Result* result) {
+  std::unique_ptr<FileDescriptor> fd;
+  if (use_io_uring_) {
+    fd = std::make_unique<IoUringFileDescriptor>();
+  } else {
+    fd = std::make_unique<EintrSafeFileDescriptor>();
+  }
+  if (!fd->Open(job.path.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Unable to open " << job.path << " for reading.";
+    return;
+  }
+
+  HashCalculator hasher;
+  if (!job.context.empty() && !hasher.SetContext(job.context)) {
+    LOG(ERROR) << "Unable to restore the hash context of " << job.path;
+    return;
+  }
+  // The jobs of all the partitions reuse the buffers of the previous ones.
+  PooledBuffer buffers[2] = {AlignedBufferPool::Get()->Acquire(read_size_),
+                             AlignedBufferPool::Get()->Acquire(read_size_)};
+  if (buffers[0].empty() || buffers[1].empty()) {
+    LOG(ERROR) << "Unable to allocate the read buffers of " << job.path;
+    return;
+  }
+  MemoryCharge buffers_memory(MemoryTag::kVerifier, 2 * read_size_);
+  auto chunk_size = [&job, this](uint64_t offset) {
+    return std::min<uint64_t>(read_size_, job.size - offset);
+  };
+
+  // |reader| reads the chunk at |offset| into buffers[current].
+  size_t current = 0;
+  if (job.offset < job.size) {
+    reader->Read(
+        fd.get(), job.offset, buffers[0].data(), chunk_size(job.offset));
+  }
+  for (uint64_t offset = job.offset; offset < job.size;) {
+    if (!reader->Wait()) {
+      PLOG(ERROR) << "Failed to read " << job.path << " at offset " << offset;
+      return;
+    }
+    const size_t count = chunk_size(offset);
+    const uint64_t next_offset = offset + count;
+    const bool read_next = next_offset < job.size && !cancelled_;
+    if (read_next) {
+      reader->Read(fd.get(),
+                   next_offset,
+                   buffers[1 - current].data(),
+                   chunk_size(next_offset));
+    }
+    const bool hashed = hasher.Update(buffers[current].data(), count);
+    if (hashed)
+      bytes_hashed_ += count;
+    if (!hashed || cancelled_) {
+      // Never leave the read writing to the buffers once they're released.
+      if (read_next)
+        reader->Wait();
+      LOG_IF(ERROR, !hashed)
+          << "Failed to hash " << job.path << " at offset " << offset;
+      return;
+    }
+    offset = next_offset;
+    current = 1 - current;
+  }
+  if (!hasher.Finalize()) {
+    LOG(ERROR) << "Unable to finalize the hash of " << job.path;
+    return;
+  }
+  result->hash = hasher.raw_hash();
+  result->success = true;
+}
+
+}  // namespace chromeos_update_engine
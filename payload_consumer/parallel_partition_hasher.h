@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// ParallelPartitionHasher computes the SHA-256 hash of the head of several
+// partitions on a pool of worker threads, each hashing one partition at a
+// time. Every partition is read in chunks of |read_size| bytes with two
+// buffers, so that the read of the next chunk is in flight while the current
+// one is hashed. Each worker has a reader thread of its own for that, kept
+// for all of its jobs.
+//
+// All public methods must be called from the same thread.
+class ParallelPartitionHasher {
+ public:
+  struct Job {
+    // Path of the device or file to read.
+    std::string path;
+    // Number of bytes to hash from the beginning of |path|.
+    uint64_t size{0};
+    // If not empty, the context of the hash of the first |offset| bytes,
+    // which aren't read again.
+    uint64_t offset{0};
+    std::string context;
+  };
+
+  ParallelPartitionHasher(std::vector<Job> jobs,
+                          size_t num_threads,
+                          size_t read_size,
+                          bool use_io_uring);
+  // Cancels the jobs not finished yet and waits for the workers.
+  ~ParallelPartitionHasher();
+
+  // Starts the worker threads. Must be called once.
+  void Start();
+
+  // Returns whether all the jobs finished, successfully or not.
+  bool IsDone() const;
+
+  // Number of bytes hashed so far over all the jobs.
+  uint64_t bytes_hashed() const { return bytes_hashed_; }
+
+  // Returns whether job |index| succeeded and stores its hash in |hash|. Must
+  // only be called once IsDone() returns true.
+  bool GetResult(size_t index, brillo::Blob* hash) const;
+
+ private:
+  struct Result {
+    bool success{false};
+    brillo::Blob hash;
+  };
+
+  // Reads the chunks of the jobs of a worker on a thread of its own.
+  class ChunkReader;
+
+  void WorkerLoop();
+
+  // Hashes |job| into |result|, reading it with |reader|.
+  void HashJob(const Job& job, ChunkReader* reader, Result* result);
+
+  const std::vector<Job> jobs_;
+  const size_t num_threads_;
+  const size_t read_size_;
+  const bool use_io_uring_;
+
+  // Written by the worker running the corresponding job only, read once all
+  // the jobs are done.
+  std::vector<Result> results_;
+
+  // Index of the next job to start.
+  std::atomic<size_t> next_job_{0};
+  std::atomic<size_t> num_done_{0};
+  std::atomic<uint64_t> bytes_hashed_{0};
+  std::atomic<bool> cancelled_{false};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelPartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
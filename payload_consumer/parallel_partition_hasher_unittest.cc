@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kReadSize = 4096;
+
+brillo::Blob MakeData(size_t size, uint8_t seed) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 13 + seed);
+  return data;
+}
+
+brillo::Blob HashOf(const brillo::Blob& data, size_t size) {
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(data.data(), size, &hash));
+  return hash;
+}
+
+void WaitUntilDone(const ParallelPartitionHasher& hasher) {
+  while (!hasher.IsDone())
+    std::this_thread::yield();
+}
+}  // namespace
+
+class ParallelPartitionHasherTest : public ::testing::Test {
+ protected:
+  // Creates a file holding |data| and returns its path.
+  std::string CreateFile(const brillo::Blob& data) {
+    files_.push_back(
+        std::make_unique<ScopedTempFile>("ParallelPartitionHasher-XXXXXX"));
+    EXPECT_TRUE(utils::WriteFile(
+        files_.back()->path().c_str(), data.data(), data.size()));
+    return files_.back()->path();
+  }
+
+  std::vector<std::unique_ptr<ScopedTempFile>> files_;
+};
+
+TEST_F(ParallelPartitionHasherTest, HashesAllJobsTest) {
+  // Sizes that aren't a multiple of the read size, and a job hashing only the
+  // head of its file.
+  const std::vector<brillo::Blob> data = {
+      MakeData(kReadSize * 10 + 123, 1),
+      MakeData(kReadSize - 1, 2),
+      MakeData(kReadSize * 3, 3),
+      MakeData(0, 4),
+  };
+  const std::vector<uint64_t> sizes = {kReadSize * 10 + 123,
+                                       kReadSize - 1,
+                                       kReadSize * 2 + 5,
+                                       0};
+  std::vector<ParallelPartitionHasher::Job> jobs;
+  uint64_t total = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    jobs.push_back({CreateFile(data[i]), sizes[i]});
+    total += sizes[i];
+  }
+
+  ParallelPartitionHasher hasher(jobs, 3, kReadSize, false);
+  hasher.Start();
+  WaitUntilDone(hasher);
+  EXPECT_EQ(total, hasher.bytes_hashed());
+  for (size_t i = 0; i < data.size(); i++) {
+    brillo::Blob hash;
+    EXPECT_TRUE(hasher.GetResult(i, &hash));
+    EXPECT_EQ(HashOf(data[i], sizes[i]), hash) << "job " << i;
+  }
+}
+
+TEST_F(ParallelPartitionHasherTest, FailuresTest) {
+  const brillo::Blob data = MakeData(kReadSize * 2, 5);
+  std::vector<ParallelPartitionHasher::Job> jobs = {
+      {CreateFile(data), data.size()},
+      {"/non/existent/path", kReadSize},
+      // Past the end of the file.
+      {CreateFile(data), data.size() + 1},
+  };
+
+  ParallelPartitionHasher hasher(jobs, 2, kReadSize, false);
+  hasher.Start();
+  WaitUntilDone(hasher);
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher.GetResult(0, &hash));
+  EXPECT_EQ(HashOf(data, data.size()), hash);
+  EXPECT_FALSE(hasher.GetResult(1, &hash));
+  EXPECT_FALSE(hasher.GetResult(2, &hash));
+}
+
+TEST_F(ParallelPartitionHasherTest, ResumeFromContextTest) {
+  const brillo::Blob data = MakeData(kReadSize * 4 + 7, 7);
+  const uint64_t offset = kReadSize + 3;
+  HashCalculator head;
+  ASSERT_TRUE(head.Update(data.data(), offset));
+  // The head of the file isn't read, it doesn't need to match the context.
+  brillo::Blob file_data = data;
+  std::fill(file_data.begin(), file_data.begin() + offset, 0);
+  ParallelPartitionHasher::Job job{CreateFile(file_data), data.size()};
+  job.offset = offset;
+  job.context = head.GetContext();
+
+  ParallelPartitionHasher hasher({job}, 1, kReadSize, false);
+  hasher.Start();
+  WaitUntilDone(hasher);
+  EXPECT_EQ(data.size() - offset, hasher.bytes_hashed());
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher.GetResult(0, &hash));
+  EXPECT_EQ(HashOf(data, data.size()), hash);
+}
+
+TEST_F(ParallelPartitionHasherTest, DestroyWhileHashingTest) {
+  const brillo::Blob data = MakeData(kReadSize * 256, 6);
+  std::vector<ParallelPartitionHasher::Job> jobs;
+  for (size_t i = 0; i < 4; i++)
+    jobs.push_back({CreateFile(data), data.size()});
+  auto hasher =
+      std::make_unique<ParallelPartitionHasher>(jobs, 2, kReadSize, false);
+  hasher->Start();
+  // Stops the workers without waiting for the jobs.
+  hasher.reset();
+}
+
+}  // namespace chromeos_update_engine
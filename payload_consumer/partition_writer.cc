@@ -25,6 +25,7 @@
 #include <initializer_list>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -41,15 +42,28 @@
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_policy_file_descriptor.h"
+#include "update_engine/payload_consumer/io_trace.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/written_data_hasher.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
 namespace {
 constexpr uint64_t kCacheSize = 1024 * 1024;  // 1MB
+// The LZ4DIFF operations recompress every block of the files they patch, and
+// are among the largest operations of EROFS partitions.
+constexpr unsigned int kMaxLz4diffThreads = 4;
+
+size_t GetLz4diffThreads() {
+  return std::clamp(
+      std::thread::hardware_concurrency(), 1u, kMaxLz4diffThreads);
+}
 
 // Discard the tail of the block device referenced by |fd|, from the offset
 // |data_size| until the end of the block device. Returns whether the data was
@@ -84,23 +98,60 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
   return false;
 }
 
+// Appends |extent| to |extents|, merged into the last one if adjacent.
+void AppendExtent(const Extent& extent,
+                  google::protobuf::RepeatedPtrField<Extent>* extents) {
+  if (!extents->empty()) {
+    Extent* last = extents->Mutable(extents->size() - 1);
+    if (last->start_block() + last->num_blocks() == extent.start_block()) {
+      last->set_num_blocks(last->num_blocks() + extent.num_blocks());
+      return;
+    }
+  }
+  *extents->Add() = extent;
+}
+
 }  // namespace
 
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
+// With |use_io_uring|, batched reads and writes are submitted through io_uring.
+// The writes follow |io_policy|. A non-zero |write_back_buffer_size| makes the
+// cached writes asynchronous, with two buffers of that size.
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           uint64_t write_back_buffer_size,
+                           bool use_io_uring,
+                           const IoPolicy& io_policy,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  FileDescriptorPtr fd;
+  if (use_io_uring) {
+    fd = std::make_shared<IoUringFileDescriptor>();
+  } else {
+    fd = std::make_shared<EintrSafeFileDescriptor>();
+  }
+  if (!io_policy.IsDefault() && !read_only) {
+    fd = std::make_shared<IoPolicyFileDescriptor>(fd, io_policy);
+  }
+  // Below the cache, to record the I/O that reaches the storage.
+  if (IoTraceRecorder::Get()->IsRecording()) {
+    fd = std::make_shared<TracingFileDescriptor>(fd, IoTraceRecorder::Get());
+  }
   if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
-    LOG(INFO) << "Caching writes.";
+    if (write_back_buffer_size) {
+      fd = FileDescriptorPtr(
+          new CachedFileDescriptor(fd, write_back_buffer_size, true));
+      LOG(INFO) << "Caching writes, written back asynchronously.";
+    } else {
+      fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
+      LOG(INFO) << "Caching writes.";
+    }
   }
   if (!fd->Open(path, mode, 000)) {
     *err = errno;
@@ -121,9 +172,10 @@ PartitionWriter::PartitionWriter(
       install_part_(install_part),
       dynamic_control_(dynamic_control),
       verified_source_fd_(block_size, install_part.source_path),
+      source_prefetcher_(partition_update, block_size),
       interactive_(is_interactive),
       block_size_(block_size),
-      install_op_executor_(block_size) {}
+      install_op_executor_(block_size, GetLz4diffThreads()) {}
 
 PartitionWriter::~PartitionWriter() {
   Close();
@@ -143,17 +195,29 @@ bool PartitionWriter::OpenSourcePartition(uint32_t source_slot,
                  << ", file " << source_path_;
       return false;
     }
+    source_prefetcher_.Open(source_path_);
   }
   return true;
 }
 
 bool PartitionWriter::Init(const InstallPlan* install_plan,
                            bool source_may_exist,
-                           size_t next_op_index) {
+                           size_t next_op_index,
+                           bool resuming_operation) {
   const PartitionUpdate& partition = partition_update_;
   uint32_t source_slot = install_plan->source_slot;
   uint32_t target_slot = install_plan->target_slot;
   TEST_AND_RETURN_FALSE(OpenSourcePartition(source_slot, source_may_exist));
+  if (install_plan->verify_source_partitions && !source_path_.empty()) {
+    verified_source_fd_.VerifyWholeSource(install_part_.source_size,
+                                          install_part_.source_hash);
+  }
+  if (install_plan->trust_source_verity && !source_path_.empty()) {
+    verified_source_fd_.UseVerityDevice(
+        dynamic_control_,
+        install_part_.name,
+        install_part_.source_verity_root_digest);
+  }
 
   // We shouldn't open the source partition in certain cases, e.g. some dynamic
   // partitions in delta payload, partitions included in the full payload for
@@ -169,7 +233,24 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  // The write cache would turn the batched extent writes back into one
+  // write at a time, don't use it with io_uring.
+  const bool use_io_uring = install_plan->use_io_uring;
+  IoPolicy io_policy;
+  io_policy.io_priority = install_plan->io_priority;
+  io_policy.writeback_interval = install_plan->writeback_interval;
+  io_policy.direct_io = install_plan->direct_io;
+  // The kernel copies bypass the write cache, the I/O policy and the hashing
+  // of the written data.
+  kernel_copy_ = install_plan->kernel_copy && io_policy.IsDefault() &&
+                 !install_part_.written_data_hasher;
+  target_fd_ = OpenFile(target_path_.c_str(),
+                        flags,
+                        !use_io_uring && !kernel_copy_,
+                        install_plan->write_back_buffer_size,
+                        use_io_uring,
+                        io_policy,
+                        &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -185,78 +266,259 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   // Discard the end of the partition, but ignore failures.
   DiscardPartitionTail(target_fd_, install_part_.target_size);
 
+  if (ShouldDiscardTarget(*install_plan, next_op_index, resuming_operation)) {
+    const uint64_t discarded_blocks = DiscardRewrittenExtents();
+    LOG(INFO) << "Discarded " << discarded_blocks * block_size_ / 1024
+              << " KiB of partition \"" << partition.partition_name()
+              << "\" before applying the operations.";
+  }
+
+  TEST_AND_RETURN_FALSE(
+      install_op_executor_.SetZstdDictionary(partition.zstd_dictionary()));
+  install_op_executor_.set_memory_budget(install_plan->apply_memory_budget);
+
   return true;
 }
 
+bool PartitionWriter::ShouldDiscardTarget(const InstallPlan& install_plan,
+                                          size_t next_op_index,
+                                          bool resuming_operation) {
+  return install_plan.discard_target && next_op_index == 0 &&
+         !resuming_operation && !install_plan.skip_applied_operations;
+}
+
+uint64_t PartitionWriter::DiscardRewrittenExtents() {
+  ExtentRanges rewritten;
+  for (const InstallOperation& op : partition_update_.operations())
+    rewritten.AddRepeatedExtents(op.dst_extents());
+  // The source blocks are read from the partition being written.
+  if (!source_path_.empty() && source_path_ == target_path_) {
+    for (const InstallOperation& op : partition_update_.operations())
+      rewritten.SubtractRepeatedExtents(op.src_extents());
+  }
+  // The merged extents are discarded one ioctl each.
+  uint64_t discarded_blocks = 0;
+  for (const Extent& extent : rewritten.extent_set()) {
+    int error = 0;
+    if (!target_fd_->BlkIoctl(BLKDISCARD,
+                              extent.start_block() * block_size_,
+                              extent.num_blocks() * block_size_,
+                              &error) ||
+        error != 0) {
+      LOG(WARNING) << "Unable to discard the blocks of " << extent
+                   << ", leaving the other ones.";
+      break;
+    }
+    discarded_blocks += extent.num_blocks();
+  }
+  return discarded_blocks;
+}
+
 bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
                                               const void* data,
                                               size_t count) {
-  // Setup the ExtentWriter stack based on the operation type.
-  std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
+  TEST_AND_RETURN_FALSE(ApplyPendingZeroOrDiscard());
+  // Without a hasher of the written data, the decompressor writes straight
+  // to the DirectExtentWriter.
+  if (!install_part_.written_data_hasher) {
+    return install_op_executor_.ExecuteReplaceOperation(
+        operation,
+        std::make_unique<DirectExtentWriter>(target_fd_),
+        data,
+        count);
+  }
   return install_op_executor_.ExecuteReplaceOperation(
-      operation, std::move(writer), data, count);
+      operation, CreateBaseExtentWriter(), data, count);
+}
+
+std::unique_ptr<ExtentWriter> PartitionWriter::CreateReplaceOperationWriter(
+    const InstallOperation& operation) {
+  if (!ApplyPendingZeroOrDiscard())
+    return nullptr;
+  if (!install_part_.written_data_hasher) {
+    return install_op_executor_.CreateReplaceOperationWriter(
+        operation, std::make_unique<DirectExtentWriter>(target_fd_));
+  }
+  return install_op_executor_.CreateReplaceOperationWriter(
+      operation, CreateBaseExtentWriter());
 }
 
 bool PartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
 #ifdef BLKZEROOUT
-  int request =
-      (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
+  // Consecutive operations of the same type are applied together, with the
+  // extents adjacent across operations merged into one ioctl.
+  if (pending_zero_or_discard_.type() != operation.type())
+    TEST_AND_RETURN_FALSE(ApplyPendingZeroOrDiscard());
+  pending_zero_or_discard_.set_type(operation.type());
+  for (const Extent& extent : operation.dst_extents())
+    AppendExtent(extent, pending_zero_or_discard_.mutable_dst_extents());
+  return true;
 #else   // !defined(BLKZEROOUT)
   auto writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteZeroOrDiscardOperation(operation,
-                                                            writer.get());
+                                                            std::move(writer));
 #endif  // !defined(BLKZEROOUT)
+}
+
+bool PartitionWriter::ApplyPendingZeroOrDiscard() {
+  TEST_AND_RETURN_FALSE(!zero_or_discard_failed_);
+  if (pending_zero_or_discard_.dst_extents().empty())
+    return true;
+  InstallOperation operation;
+  operation.Swap(&pending_zero_or_discard_);
+  pending_zero_or_discard_.set_type(operation.type());
 
+#ifdef BLKZEROOUT
+  int request =
+      (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
+  int num_applied = 0;
   for (const Extent& extent : operation.dst_extents()) {
     const uint64_t start = extent.start_block() * block_size_;
     const uint64_t length = extent.num_blocks() * block_size_;
     int result = 0;
-    if (target_fd_->BlkIoctl(request, start, length, &result) && result == 0) {
-      continue;
+    if (!target_fd_->BlkIoctl(request, start, length, &result) ||
+        result != 0) {
+      break;
     }
-    // In case of failure, we fall back to writing 0 for the entire operation.
-    PLOG(WARNING) << "BlkIoctl failed. Falling back to write 0s for remainder "
-                     "of this operation.";
-    auto writer = CreateBaseExtentWriter();
-    return install_op_executor_.ExecuteZeroOrDiscardOperation(
-        operation, std::move(writer));
+    // The content of discarded blocks is unknown, they are read back instead.
+    if (install_part_.written_data_hasher &&
+        operation.type() == InstallOperation::ZERO) {
+      install_part_.written_data_hasher->WriteZeros(start, length);
+    }
+    num_applied++;
   }
-  return true;
+  if (num_applied == operation.dst_extents_size())
+    return true;
+  // In case of failure, we fall back to writing 0 for the remaining extents.
+  PLOG(WARNING) << "BlkIoctl failed. Falling back to write 0s for remainder "
+                   "of these operations.";
+  operation.mutable_dst_extents()->DeleteSubrange(0, num_applied);
+#endif  // defined(BLKZEROOUT)
+  zeros_written_bytes_ +=
+      utils::BlocksInExtents(operation.dst_extents()) * block_size_;
+  auto writer = CreateBaseExtentWriter();
+  return install_op_executor_.ExecuteZeroOrDiscardOperation(operation,
+                                                            std::move(writer));
 }
 
 bool PartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
+  InstallOperation buf;
+  const InstallOperation* copy = nullptr;
+  FileDescriptorPtr source_fd;
+  TEST_AND_RETURN_FALSE(
+      PrepareSourceCopy(operation, &buf, &copy, &source_fd, error));
+  if (!copy)
+    return true;
+  return CopySourceExtents(*copy, source_fd);
+}
+
+bool PartitionWriter::PerformOperations(
+    const std::vector<OperationWithData>& operations, ErrorCode* error) {
+  // The consecutive SOURCE_COPY operations reading from the same source are
+  // copied at once, as one operation with the extents of all of them.
+  InstallOperation merged;
+  merged.set_type(InstallOperation::SOURCE_COPY);
+  FileDescriptorPtr merged_source_fd;
+  auto copy_merged = [this, &merged, &merged_source_fd]() {
+    if (merged.dst_extents().empty())
+      return true;
+    const bool result = CopySourceExtents(merged, merged_source_fd);
+    merged.clear_src_extents();
+    merged.clear_dst_extents();
+    return result;
+  };
+
+  for (const OperationWithData& operation : operations) {
+    const InstallOperation& op = *operation.operation;
+    if (op.type() != InstallOperation::SOURCE_COPY) {
+      TEST_AND_RETURN_FALSE(copy_merged());
+      TEST_AND_RETURN_FALSE(PerformOperation(operation, error));
+      continue;
+    }
+    InstallOperation buf;
+    const InstallOperation* copy = nullptr;
+    FileDescriptorPtr source_fd;
+    TEST_AND_RETURN_FALSE(
+        PrepareSourceCopy(op, &buf, &copy, &source_fd, error));
+    if (!copy)
+      continue;
+    if (source_fd != merged_source_fd) {
+      TEST_AND_RETURN_FALSE(copy_merged());
+      merged_source_fd = source_fd;
+    }
+    for (const Extent& extent : copy->src_extents())
+      AppendExtent(extent, merged.mutable_src_extents());
+    for (const Extent& extent : copy->dst_extents())
+      AppendExtent(extent, merged.mutable_dst_extents());
+  }
+  return copy_merged();
+}
+
+bool PartitionWriter::PrepareSourceCopy(const InstallOperation& operation,
+                                        InstallOperation* buf,
+                                        const InstallOperation** copy,
+                                        FileDescriptorPtr* source_fd,
+                                        ErrorCode* error) {
   // The device may optimize the SOURCE_COPY operation.
   // Being this a device-specific optimization let DynamicPartitionController
   // decide it the operation should be skipped.
   const PartitionUpdate& partition = partition_update_;
 
-  InstallOperation buf;
   const bool should_optimize = dynamic_control_->OptimizeOperation(
-      partition.partition_name(), operation, &buf);
-  const InstallOperation& optimized = should_optimize ? buf : operation;
+      partition.partition_name(), operation, buf);
+  const InstallOperation& optimized = should_optimize ? *buf : operation;
+  // Nothing is left to copy on a snapshot of the source, so the source isn't
+  // read either. The target hash verified once the partition is written
+  // covers these blocks.
+  *copy = nullptr;
+  if (should_optimize && optimized.dst_extents().empty())
+    return true;
 
   // Invoke ChooseSourceFD with original operation, so that it can properly
   // verify source hashes. Optimized operation might contain a smaller set of
   // extents, or completely empty.
-  auto source_fd = ChooseSourceFD(operation, error);
-  if (source_fd == nullptr) {
+  TEST_AND_RETURN_FALSE(ApplyPendingZeroOrDiscard());
+  source_prefetcher_.OperationStarted(operation);
+  *source_fd = ChooseSourceFD(operation, error);
+  if (*source_fd == nullptr) {
     LOG(ERROR) << "Unrecoverable source hash mismatch found on partition "
                << partition.partition_name()
                << " extents: " << ExtentsToString(operation.src_extents());
     return false;
   }
+  *copy = &optimized;
+  return true;
+}
 
+bool PartitionWriter::CopySourceExtents(const InstallOperation& operation,
+                                        const FileDescriptorPtr& source_fd) {
+  // The source may be read through error correction instead.
+  if (kernel_copy_ && source_fd->Fd() >= 0) {
+    if (fd_utils::CopyExtentsInKernel(source_fd,
+                                      operation.src_extents(),
+                                      target_fd_,
+                                      operation.dst_extents(),
+                                      block_size_)) {
+      return true;
+    }
+    LOG(WARNING) << "Unable to copy the blocks of partition "
+                 << partition_update_.partition_name()
+                 << " in the kernel, copying them in update_engine.";
+    kernel_copy_ = false;
+  }
   auto writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteSourceCopyOperation(
-      optimized, std::move(writer), source_fd);
+      operation, std::move(writer), source_fd);
 }
 
 bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
                                            ErrorCode* error,
                                            const void* data,
                                            size_t count) {
+  TEST_AND_RETURN_FALSE(ApplyPendingZeroOrDiscard());
+  source_prefetcher_.OperationStarted(operation);
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
@@ -270,11 +532,41 @@ FileDescriptorPtr PartitionWriter::ChooseSourceFD(
   return verified_source_fd_.ChooseSourceFD(operation, error);
 }
 
+bool PartitionWriter::IsOperationApplied(const InstallOperation& operation) {
+  if (!target_fd_ || operation.dst_sha256_hash().empty())
+    return false;
+  // The zeros or discards of the previous operations come first.
+  if (!ApplyPendingZeroOrDiscard())
+    return false;
+  brillo::Blob hash;
+  if (!fd_utils::ReadAndHashExtents(
+          target_fd_, operation.dst_extents(), block_size_, &hash)) {
+    return false;
+  }
+  return hash.size() == operation.dst_sha256_hash().size() &&
+         std::equal(
+             hash.begin(), hash.end(), operation.dst_sha256_hash().begin());
+}
+
+bool PartitionWriter::FinishedInstallOps() {
+  TEST_AND_RETURN_FALSE(ApplyPendingZeroOrDiscard());
+  if (zeros_written_bytes_ > 0) {
+    LOG(INFO) << "Zeroing or discarding " << zeros_written_bytes_
+              << " bytes of partition " << partition_update_.partition_name()
+              << " took the slow path of writing zeros.";
+  }
+  return true;
+}
+
 int PartitionWriter::Close() {
   int err = 0;
 
   source_path_.clear();
 
+  if (target_fd_ && !ApplyPendingZeroOrDiscard()) {
+    LOG(ERROR) << "Error zeroing or discarding the target partition";
+    err = 1;
+  }
   if (target_fd_ && !target_fd_->Close()) {
     err = errno;
     PLOG(ERROR) << "Error closing target partition";
@@ -289,12 +581,21 @@ int PartitionWriter::Close() {
 
 void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   if (target_fd_) {
+    if (!ApplyPendingZeroOrDiscard()) {
+      LOG(ERROR) << "Error zeroing or discarding the target partition";
+      zero_or_discard_failed_ = true;
+    }
     target_fd_->Flush();
   }
 }
 
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<DirectExtentWriter>(target_fd_);
+  auto writer = std::make_unique<DirectExtentWriter>(target_fd_);
+  if (install_part_.written_data_hasher) {
+    return std::make_unique<HashingExtentWriter>(
+        std::move(writer), install_part_.written_data_hasher.get());
+  }
+  return writer;
 }
 
 bool PartitionWriter::ValidateSourceHash(const InstallOperation& operation,
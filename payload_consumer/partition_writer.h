@@ -17,9 +17,11 @@
 #ifndef UPDATE_ENGINE_PARTITION_WRITER_H_
 #define UPDATE_ENGINE_PARTITION_WRITER_H_
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
@@ -30,6 +32,7 @@
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -55,7 +58,8 @@ class PartitionWriter : public PartitionWriterInterface {
   // applied to this partition
   [[nodiscard]] bool Init(const InstallPlan* install_plan,
                           bool source_may_exist,
-                          size_t next_op_index) override;
+                          size_t next_op_index,
+                          bool resuming_operation) override;
 
   // |CheckpointUpdateProgress| will be called after SetNextOpIndex(), but it's
   // optional. DeltaPerformer may or may not call this everytime an operation is
@@ -75,6 +79,8 @@ class PartitionWriter : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceOperationWriter(
+      const InstallOperation& operation) override;
   [[nodiscard]] bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) override;
 
@@ -84,15 +90,25 @@ class PartitionWriter : public PartitionWriterInterface {
                                           ErrorCode* error,
                                           const void* data,
                                           size_t count) override;
+  // Copies the consecutive SOURCE_COPY operations of |operations| at once.
+  [[nodiscard]] bool PerformOperations(
+      const std::vector<OperationWithData>& operations,
+      ErrorCode* error) override;
+
+  bool IsOperationApplied(const InstallOperation& operation) override;
 
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
-  [[nodiscard]] bool FinishedInstallOps() override { return true; }
+  [[nodiscard]] bool FinishedInstallOps() override;
 
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDVerifiedBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDVerifyWholeSourceTest);
+  FRIEND_TEST(PartitionWriterTest, DiscardRewrittenExtentsTest);
+  FRIEND_TEST(PartitionWriterTest, ShouldDiscardTargetTest);
 
   [[nodiscard]] bool OpenSourcePartition(uint32_t source_slot,
                                          bool source_may_exist);
@@ -101,17 +117,60 @@ class PartitionWriter : public PartitionWriterInterface {
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Verifies the source of the SOURCE_COPY |operation| and sets |source_fd| to
+  // read it from. Sets |copy| to the operation left to copy once optimized by
+  // |dynamic_control_|, stored in |buf| if it differs, or to nullptr if
+  // nothing is left to copy.
+  [[nodiscard]] bool PrepareSourceCopy(const InstallOperation& operation,
+                                       InstallOperation* buf,
+                                       const InstallOperation** copy,
+                                       FileDescriptorPtr* source_fd,
+                                       ErrorCode* error);
+  // Copies the src_extents of |operation| from |source_fd| to its
+  // dst_extents.
+  [[nodiscard]] bool CopySourceExtents(const InstallOperation& operation,
+                                       const FileDescriptorPtr& source_fd);
+
+  // Zeroes or discards the extents of |pending_zero_or_discard_|, writing
+  // zeros where the ioctl fails.
+  [[nodiscard]] bool ApplyPendingZeroOrDiscard();
+
+  // Discards the blocks of the target partition written by the operations,
+  // leaving out the ones read as source when the source is the target
+  // partition itself. Stops at the first discard that fails. Returns the
+  // number of blocks discarded.
+  uint64_t DiscardRewrittenExtents();
+
+  // Returns whether Init() should discard the rewritten extents. Only when
+  // nothing was written to the partition yet, the blocks applied by a
+  // previous attempt are either skipped or kept by a resumed operation.
+  static bool ShouldDiscardTarget(const InstallPlan& install_plan,
+                                  size_t next_op_index,
+                                  bool resuming_operation);
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* dynamic_control_;
   // Path to source partition
   std::string source_path_;
   VerifiedSourceFd verified_source_fd_;
+  SourcePrefetcher source_prefetcher_;
   // Path to target partition
   std::string target_path_;
   FileDescriptorPtr target_fd_;
   const bool interactive_;
   const size_t block_size_;
+  // Whether SOURCE_COPY operations are copied with
+  // fd_utils::CopyExtentsInKernel(). Cleared once the kernel fails to copy.
+  std::atomic<bool> kernel_copy_{false};
+
+  // The merged extents of the last ZERO or DISCARD operations, applied before
+  // the next operation of another type or checkpoint.
+  InstallOperation pending_zero_or_discard_;
+  // Whether applying |pending_zero_or_discard_| at a checkpoint failed.
+  bool zero_or_discard_failed_{false};
+  // Bytes of ZERO and DISCARD operations written as zeros, without ioctl.
+  uint64_t zeros_written_bytes_{0};
 
   // This instance handles decompression/bsdfif/puffdiff. It's responsible for
   // constructing data which should be written to target partition, actual
@@ -0,0 +1,59 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/partition_writer_interface.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+bool PartitionWriterInterface::PerformOperations(
+    const std::vector<OperationWithData>& operations, ErrorCode* error) {
+  for (const OperationWithData& operation : operations)
+    TEST_AND_RETURN_FALSE(PerformOperation(operation, error));
+  return true;
+}
+
+bool PartitionWriterInterface::PerformOperation(
+    const OperationWithData& operation, ErrorCode* error) {
+  const InstallOperation& op = *operation.operation;
+  switch (op.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      return PerformReplaceOperation(op, operation.data, operation.count);
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return PerformZeroOrDiscardOperation(op);
+    case InstallOperation::SOURCE_COPY:
+      return PerformSourceCopyOperation(op, error);
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      return PerformDiffOperation(op, error, operation.data, operation.count);
+    default:
+      LOG(ERROR) << "Unexpected operation type " << op.type();
+      return false;
+  }
+}
+
+}  // namespace chromeos_update_engine
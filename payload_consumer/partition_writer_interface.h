@@ -18,11 +18,14 @@
 #define UPDATE_ENGINE_PARTITION_WRITER_INTERFACE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
 
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -32,10 +35,12 @@ class PartitionWriterInterface {
   virtual ~PartitionWriterInterface() = default;
 
   // Perform necessary initialization work before InstallOperation can be
-  // applied to this partition
+  // applied to this partition. |resuming_operation| is whether part of the
+  // operation |next_op_index| was written before resuming the update.
   [[nodiscard]] virtual bool Init(const InstallPlan* install_plan,
                                   bool source_may_exist,
-                                  size_t next_op_index) = 0;
+                                  size_t next_op_index,
+                                  bool resuming_operation) = 0;
 
   // |CheckpointUpdateProgress| will be called after SetNextOpIndex(), but it's
   // optional. DeltaPerformer may or may not call this everytime an operation is
@@ -54,6 +59,11 @@ class PartitionWriterInterface {
   // set even if it fails.
   [[nodiscard]] virtual bool PerformReplaceOperation(
       const InstallOperation& operation, const void* data, size_t count) = 0;
+  // Returns a writer applying the REPLACE, REPLACE_BZ, REPLACE_XZ or
+  // REPLACE_ZSTD |operation| as its data is passed to Write(), so the data
+  // doesn't need to be buffered entirely first. Returns nullptr on failure.
+  [[nodiscard]] virtual std::unique_ptr<ExtentWriter>
+  CreateReplaceOperationWriter(const InstallOperation& operation) = 0;
   [[nodiscard]] virtual bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) = 0;
 
@@ -65,6 +75,30 @@ class PartitionWriterInterface {
       const void* data,
       size_t count) = 0;
 
+  // An operation passed to PerformOperations(), with its data if it has any.
+  struct OperationWithData {
+    const InstallOperation* operation;
+    const void* data{nullptr};
+    size_t count{0};
+  };
+
+  // Performs |operations| in order and returns true if they all succeeded.
+  // Writers may merge the I/O of consecutive operations, so on failure any of
+  // them may or may not have been applied. The default implementation calls
+  // PerformOperation() for each of them.
+  [[nodiscard]] virtual bool PerformOperations(
+      const std::vector<OperationWithData>& operations, ErrorCode* error);
+
+  // Performs |operation| with the Perform*Operation() method of its type.
+  [[nodiscard]] bool PerformOperation(const OperationWithData& operation,
+                                      ErrorCode* error);
+
+  // Returns whether the dst_extents of |operation| already hold the data
+  // matching its dst_sha256_hash, so that it doesn't need to be applied.
+  virtual bool IsOperationApplied(const InstallOperation& operation) {
+    return false;
+  }
+
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
@@ -14,7 +14,11 @@
 // limitations under the License.
 //
 
+#include <linux/fs.h>
+
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -40,6 +44,26 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+// Records the byte ranges discarded, fails all of them with |fail| set.
+class DiscardRecordingFileDescriptor : public FakeFileDescriptor {
+ public:
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    if (request != BLKDISCARD || fail)
+      return false;
+    discards.emplace_back(start, length);
+    *result = 0;
+    return true;
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> discards;
+  bool fail{false};
+};
+}  // namespace
+
 class PartitionWriterTest : public testing::Test {
  public:
   // Helper function to pretend that the ECC file descriptor was already opened.
@@ -102,7 +126,7 @@ class PartitionWriterTest : public testing::Test {
     install_part_.target_size = blob_data.size();
 
     ErrorCode error;
-    EXPECT_TRUE(writer_.Init(&install_plan_, true, 0));
+    EXPECT_TRUE(writer_.Init(&install_plan_, true, 0, false));
     if (HasFailure()) {
       return {};
     }
@@ -218,4 +242,292 @@ TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   ASSERT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+TEST_F(PartitionWriterTest, ChooseSourceFDVerifiedBlocksTest) {
+  constexpr size_t kSourceSize = 8 * 4096;
+  brillo::Blob source_data(kSourceSize);
+  test_utils::FillWithData(&source_data);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source_partition.path().c_str(),
+                                      O_RDONLY);
+  SetFakeECCFile(kSourceSize);
+
+  // Returns an operation reading |blocks| of |source_data|.
+  auto make_op = [&source_data](const std::vector<uint64_t>& blocks) {
+    InstallOperation op;
+    brillo::Blob data;
+    for (uint64_t block : blocks) {
+      *(op.add_src_extents()) = ExtentForRange(block, 1);
+      data.insert(data.end(),
+                  source_data.begin() + block * 4096,
+                  source_data.begin() + (block + 1) * 4096);
+    }
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfData(data, &src_hash));
+    op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    return op;
+  };
+
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_EQ(verified_source_fd.source_fd_,
+            writer_.ChooseSourceFD(make_op({0, 1, 2, 3}), &error));
+  // The blocks already verified aren't read again.
+  brillo::Blob invalid_data(kSourceSize, 0x55);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), invalid_data));
+  EXPECT_EQ(verified_source_fd.source_fd_,
+            writer_.ChooseSourceFD(make_op({2, 0}), &error));
+  // The others still are.
+  EXPECT_EQ(nullptr, writer_.ChooseSourceFD(make_op({3, 4}), &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+}
+
+TEST_F(PartitionWriterTest, ChooseSourceFDVerifyWholeSourceTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob source_data(kSourceSize);
+  test_utils::FillWithData(&source_data);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source_partition.path().c_str(),
+                                      O_RDONLY);
+
+  brillo::Blob source_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(source_data, &source_hash));
+  EXPECT_FALSE(verified_source_fd.VerifyWholeSource(kSourceSize, {1, 2, 3}));
+  EXPECT_TRUE(verified_source_fd.VerifyWholeSource(kSourceSize, source_hash));
+
+  // None of the source blocks are read again.
+  brillo::Blob invalid_data(kSourceSize, 0x55);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), invalid_data));
+  InstallOperation op;
+  *(op.add_src_extents()) = ExtentForRange(1, 2);
+  brillo::Blob src_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+      source_data.data() + 4096, 2 * 4096, &src_hash));
+  op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_EQ(verified_source_fd.source_fd_, writer_.ChooseSourceFD(op, &error));
+}
+
+namespace {
+class FakeVerityDynamicPartitionControl : public DynamicPartitionControlStub {
+ public:
+  bool GetVerityDevice(const std::string& partition_name,
+                       const std::string& data_device,
+                       std::string* verity_device,
+                       brillo::Blob* root_digest,
+                       uint64_t* data_size) override {
+    if (partition_name != "system")
+      return false;
+    *verity_device = verity_device_;
+    *root_digest = {1, 2, 3};
+    *data_size = 2 * 4096;
+    return true;
+  }
+
+  std::string verity_device_;
+};
+}  // namespace
+
+TEST_F(PartitionWriterTest, ChooseSourceFDVerityDeviceTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob source_data(kSourceSize);
+  test_utils::FillWithData(&source_data);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source_partition.path().c_str(),
+                                      O_RDONLY);
+
+  FakeVerityDynamicPartitionControl dynamic_control;
+  dynamic_control.verity_device_ = source_partition.path();
+  const brillo::Blob root_digest = {1, 2, 3};
+  EXPECT_FALSE(
+      verified_source_fd.UseVerityDevice(&dynamic_control, "system", {}));
+  EXPECT_FALSE(
+      verified_source_fd.UseVerityDevice(&dynamic_control, "system", {4}));
+  EXPECT_FALSE(verified_source_fd.UseVerityDevice(
+      &dynamic_control, "vendor", root_digest));
+  ASSERT_TRUE(verified_source_fd.UseVerityDevice(
+      &dynamic_control, "system", root_digest));
+
+  // The source hash of the blocks covered by the verity device isn't checked.
+  InstallOperation op;
+  *(op.add_src_extents()) = ExtentForRange(0, 2);
+  op.set_src_sha256_hash("invalid");
+  ErrorCode error = ErrorCode::kSuccess;
+  EXPECT_EQ(verified_source_fd.source_verity_fd_,
+            writer_.ChooseSourceFD(op, &error));
+
+  // The other blocks are read from the source partition and verified.
+  op.clear_src_extents();
+  *(op.add_src_extents()) = ExtentForRange(1, 2);
+  brillo::Blob src_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+      source_data.data() + 4096, 2 * 4096, &src_hash));
+  op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  EXPECT_EQ(verified_source_fd.source_fd_, writer_.ChooseSourceFD(op, &error));
+}
+
+TEST_F(PartitionWriterTest, ZeroOperationsTest) {
+  constexpr size_t kNumBlocks = 10;
+  brillo::Blob target_data(kNumBlocks * kBlockSize, 'a');
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(target_partition.path(), target_data));
+  install_part_.target_size = target_data.size();
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
+
+  // The extents of consecutive operations are applied together, at the next
+  // checkpoint.
+  InstallOperation op;
+  op.set_type(InstallOperation::ZERO);
+  *(op.add_dst_extents()) = ExtentForRange(1, 2);
+  *(op.add_dst_extents()) = ExtentForRange(7, 1);
+  ASSERT_TRUE(writer_.PerformZeroOrDiscardOperation(op));
+  op.clear_dst_extents();
+  *(op.add_dst_extents()) = ExtentForRange(3, 1);
+  ASSERT_TRUE(writer_.PerformZeroOrDiscardOperation(op));
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(target_data, output_data);
+
+  writer_.CheckpointUpdateProgress(2);
+  std::fill_n(target_data.begin() + kBlockSize, 3 * kBlockSize, 0);
+  std::fill_n(target_data.begin() + 7 * kBlockSize, kBlockSize, 0);
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(target_data, output_data);
+
+  // Another type of operation applies the pending ones first.
+  op.clear_dst_extents();
+  *(op.add_dst_extents()) = ExtentForRange(9, 1);
+  ASSERT_TRUE(writer_.PerformZeroOrDiscardOperation(op));
+  InstallOperation replace_op;
+  replace_op.set_type(InstallOperation::REPLACE);
+  *(replace_op.add_dst_extents()) = ExtentForRange(0, 1);
+  const brillo::Blob replace_data(kBlockSize, 'b');
+  ASSERT_TRUE(writer_.PerformReplaceOperation(
+      replace_op, replace_data.data(), replace_data.size()));
+  EXPECT_TRUE(writer_.FinishedInstallOps());
+  writer_.CheckpointUpdateProgress(4);
+  std::fill_n(target_data.begin(), kBlockSize, 'b');
+  std::fill_n(target_data.begin() + 9 * kBlockSize, kBlockSize, 0);
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(target_data, output_data);
+}
+
+TEST_F(PartitionWriterTest, PerformOperationsTest) {
+  constexpr size_t kNumBlocks = 8;
+  brillo::Blob source_data(kNumBlocks * kBlockSize);
+  for (size_t i = 0; i < source_data.size(); i++)
+    source_data[i] = i / kBlockSize + '0';
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  brillo::Blob target_data(kNumBlocks * kBlockSize, 'a');
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(target_partition.path(), target_data));
+  install_part_.source_size = source_data.size();
+  install_part_.target_size = target_data.size();
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
+
+  auto source_copy = [&source_data](uint64_t src_block,
+                                    uint64_t dst_block,
+                                    uint64_t num_blocks) {
+    InstallOperation op;
+    op.set_type(InstallOperation::SOURCE_COPY);
+    *(op.add_src_extents()) = ExtentForRange(src_block, num_blocks);
+    *(op.add_dst_extents()) = ExtentForRange(dst_block, num_blocks);
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        source_data.data() + src_block * kBlockSize,
+        num_blocks * kBlockSize,
+        &src_hash));
+    op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    return op;
+  };
+  // The first two are copied together, the ZERO in between applies them
+  // before the last one.
+  std::vector<InstallOperation> ops = {
+      source_copy(0, 4, 2), source_copy(2, 6, 1), {}, source_copy(5, 1, 1)};
+  ops[2].set_type(InstallOperation::ZERO);
+  *(ops[2].add_dst_extents()) = ExtentForRange(0, 1);
+  std::vector<PartitionWriterInterface::OperationWithData> batch;
+  for (const InstallOperation& op : ops)
+    batch.push_back({&op});
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(writer_.PerformOperations(batch, &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  writer_.CheckpointUpdateProgress(ops.size());
+
+  std::fill_n(target_data.begin(), kBlockSize, 0);
+  std::fill_n(target_data.begin() + kBlockSize, kBlockSize, '5');
+  std::copy_n(source_data.begin(),
+              3 * kBlockSize,
+              target_data.begin() + 4 * kBlockSize);
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  EXPECT_EQ(target_data, output_data);
+
+  // A source hash mismatch fails the batch.
+  InstallOperation mismatched_op = source_copy(7, 3, 1);
+  mismatched_op.set_src_sha256_hash(ops[1].src_sha256_hash());
+  batch = {{&ops[1]}, {&mismatched_op}};
+  error = ErrorCode::kSuccess;
+  EXPECT_FALSE(writer_.PerformOperations(batch, &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+}
+
+TEST_F(PartitionWriterTest, DiscardRewrittenExtentsTest) {
+  InstallOperation* op = partition_update_.add_operations();
+  op->set_type(InstallOperation::REPLACE);
+  *(op->add_dst_extents()) = ExtentForRange(0, 2);
+  op = partition_update_.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *(op->add_src_extents()) = ExtentForRange(0, 1);
+  *(op->add_dst_extents()) = ExtentForRange(2, 3);
+  op = partition_update_.add_operations();
+  op->set_type(InstallOperation::ZERO);
+  *(op->add_dst_extents()) = ExtentForRange(8, 1);
+  auto fd = std::make_shared<DiscardRecordingFileDescriptor>();
+  ASSERT_TRUE(fd->Open("", O_RDWR));
+  writer_.target_fd_ = fd;
+
+  // The adjacent extents are discarded at once.
+  EXPECT_EQ(6u, writer_.DiscardRewrittenExtents());
+  EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{
+                {0, 5 * kBlockSize}, {8 * kBlockSize, kBlockSize}}),
+            fd->discards);
+
+  // The source blocks are kept when read from the target partition.
+  writer_.source_path_ = target_partition.path();
+  writer_.target_path_ = target_partition.path();
+  fd->discards.clear();
+  EXPECT_EQ(5u, writer_.DiscardRewrittenExtents());
+  EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{
+                {kBlockSize, 4 * kBlockSize}, {8 * kBlockSize, kBlockSize}}),
+            fd->discards);
+
+  fd->fail = true;
+  EXPECT_EQ(0u, writer_.DiscardRewrittenExtents());
+}
+
+TEST_F(PartitionWriterTest, ShouldDiscardTargetTest) {
+  InstallPlan install_plan;
+  EXPECT_FALSE(PartitionWriter::ShouldDiscardTarget(install_plan, 0, false));
+  install_plan.discard_target = true;
+  EXPECT_TRUE(PartitionWriter::ShouldDiscardTarget(install_plan, 0, false));
+
+  // The first operation was partly written before resuming, its data must be
+  // kept.
+  EXPECT_FALSE(PartitionWriter::ShouldDiscardTarget(install_plan, 0, true));
+  EXPECT_FALSE(PartitionWriter::ShouldDiscardTarget(install_plan, 3, false));
+  install_plan.skip_applied_operations = true;
+  EXPECT_FALSE(PartitionWriter::ShouldDiscardTarget(install_plan, 0, false));
+}
+
 }  // namespace chromeos_update_engine
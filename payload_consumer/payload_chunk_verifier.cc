@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_chunk_verifier.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+bool PayloadChunkVerifier::Init(const DeltaArchiveManifest& manifest) {
+  chunk_size_ = 0;
+  data_size_ = 0;
+  hashes_.clear();
+  Restart(0);
+  if (!manifest.has_payload_chunk_size())
+    return true;
+  TEST_AND_RETURN_FALSE(manifest.payload_chunk_size() > 0);
+  uint64_t data_size = 0;
+  for (const auto& partition : manifest.partitions()) {
+    for (const auto& op : partition.operations()) {
+      if (op.data_length() > 0)
+        data_size = std::max(data_size, op.data_offset() + op.data_length());
+    }
+  }
+  const uint64_t chunk_size = manifest.payload_chunk_size();
+  const uint64_t num_chunks = (data_size + chunk_size - 1) / chunk_size;
+  if (manifest.payload_chunk_hashes().size() != num_chunks * kHashSize) {
+    LOG(ERROR) << "The manifest has "
+               << manifest.payload_chunk_hashes().size() / kHashSize
+               << " payload chunk hashes, but its " << data_size
+               << " bytes of data make " << num_chunks << " chunks.";
+    return false;
+  }
+  chunk_size_ = chunk_size;
+  data_size_ = data_size;
+  hashes_ = manifest.payload_chunk_hashes();
+  LOG(INFO) << "Verifying the payload data in " << num_chunks << " chunks of "
+            << chunk_size_ << " bytes.";
+  return true;
+}
+
+uint64_t PayloadChunkVerifier::ChunkSize(uint64_t index) const {
+  return std::min(chunk_size_, data_size_ - ChunkOffset(index));
+}
+
+bool PayloadChunkVerifier::VerifyChunk(uint64_t index,
+                                       const void* data,
+                                       size_t size) const {
+  TEST_AND_RETURN_FALSE(index < num_chunks() && size == ChunkSize(index));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(data, size, &hash));
+  return hashes_.compare(index * kHashSize,
+                         kHashSize,
+                         reinterpret_cast<const char*>(hash.data()),
+                         hash.size()) == 0;
+}
+
+bool PayloadChunkVerifier::Update(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (enabled() && !failed_ && size > 0 && offset_ < data_size_) {
+    const uint64_t index = offset_ / chunk_size_;
+    const uint64_t chunk_end = ChunkOffset(index) + ChunkSize(index);
+    const size_t len = std::min<uint64_t>(size, chunk_end - offset_);
+    if (chunk_hash_)
+      TEST_AND_RETURN_FALSE(chunk_hash_->Update(bytes, len));
+    bytes += len;
+    size -= len;
+    offset_ += len;
+    if (offset_ < chunk_end)
+      continue;
+    if (chunk_hash_) {
+      TEST_AND_RETURN_FALSE(chunk_hash_->Finalize());
+      const brillo::Blob& hash = chunk_hash_->raw_hash();
+      if (hashes_.compare(index * kHashSize,
+                          kHashSize,
+                          reinterpret_cast<const char*>(hash.data()),
+                          hash.size()) != 0) {
+        LOG(ERROR) << "The payload data chunk " << index << " at offset "
+                   << ChunkOffset(index) << " doesn't match its hash.";
+        failed_ = true;
+      }
+    }
+    chunk_hash_.emplace();
+  }
+  return !failed_;
+}
+
+void PayloadChunkVerifier::Restart(uint64_t offset) {
+  offset_ = offset;
+  failed_ = false;
+  chunk_hash_.reset();
+  if (!enabled() || offset % chunk_size_ == 0)
+    chunk_hash_.emplace();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_CHUNK_VERIFIER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_CHUNK_VERIFIER_H_
+
+#include <optional>
+#include <string>
+
+#include <base/macros.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// PayloadChunkVerifier checks the data blobs of a payload against the hashes
+// of their fixed-size chunks listed in the manifest. The manifest is covered
+// by the metadata signature, so each chunk can be verified on its own as soon
+// as it's received, in any order, instead of only with the hash of the whole
+// payload once it's all downloaded.
+class PayloadChunkVerifier {
+ public:
+  PayloadChunkVerifier() = default;
+
+  // Loads the chunk hashes of |manifest|, which cover the data blobs of all
+  // its operations. Returns false if they don't match the size of the data.
+  // Nothing is verified if the manifest has no chunk hashes.
+  bool Init(const DeltaArchiveManifest& manifest);
+
+  bool enabled() const { return chunk_size_ > 0; }
+  uint64_t num_chunks() const { return hashes_.size() / kHashSize; }
+  // Offset and size of the chunk |index| in the data blobs.
+  uint64_t ChunkOffset(uint64_t index) const { return index * chunk_size_; }
+  uint64_t ChunkSize(uint64_t index) const;
+
+  // Returns whether |data| is the chunk |index|. Doesn't depend on the other
+  // chunks nor on Update(), so it may be called from any thread.
+  bool VerifyChunk(uint64_t index, const void* data, size_t size) const;
+
+  // Hashes the next |size| bytes of the data blobs, received in order.
+  // Returns false if a chunk they complete doesn't match its hash, after
+  // which failed() is true.
+  bool Update(const void* data, size_t size);
+
+  // Continues the verification of Update() at |offset| of the data blobs,
+  // when resuming an update. The chunk |offset| is in isn't verified unless
+  // |offset| is its start, since its first bytes were not kept.
+  void Restart(uint64_t offset);
+
+  bool failed() const { return failed_; }
+
+ private:
+  static constexpr size_t kHashSize = 32;
+
+  uint64_t chunk_size_{0};
+  uint64_t data_size_{0};
+  // The concatenated hashes of the chunks.
+  std::string hashes_;
+
+  // Offset in the data blobs of the next byte passed to Update().
+  uint64_t offset_{0};
+  // Hash of the chunk |offset_| is in, unset if it isn't verified.
+  std::optional<HashCalculator> chunk_hash_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadChunkVerifier);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_CHUNK_VERIFIER_H_
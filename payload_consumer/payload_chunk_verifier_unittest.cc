@@ -0,0 +1,117 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_chunk_verifier.h"
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PayloadChunkVerifierTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    for (size_t i = 0; i < data_.size(); i++)
+      data_[i] = i * 7;
+    // Two operations with 2500 bytes of data, in chunks of 1000 bytes.
+    auto partition = manifest_.add_partitions();
+    auto op = partition->add_operations();
+    op->set_data_offset(0);
+    op->set_data_length(1200);
+    op = partition->add_operations();
+    op->set_data_offset(1200);
+    op->set_data_length(1300);
+    manifest_.set_payload_chunk_size(1000);
+    for (size_t offset = 0; offset < data_.size(); offset += 1000) {
+      brillo::Blob hash;
+      ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+          data_.data() + offset,
+          std::min<size_t>(1000, data_.size() - offset),
+          &hash));
+      manifest_.mutable_payload_chunk_hashes()->append(hash.begin(),
+                                                       hash.end());
+    }
+  }
+
+  DeltaArchiveManifest manifest_;
+  brillo::Blob data_ = brillo::Blob(2500);
+  PayloadChunkVerifier verifier_;
+};
+
+TEST_F(PayloadChunkVerifierTest, VerifyChunkTest) {
+  ASSERT_TRUE(verifier_.Init(manifest_));
+  ASSERT_TRUE(verifier_.enabled());
+  EXPECT_EQ(3u, verifier_.num_chunks());
+  EXPECT_EQ(2000u, verifier_.ChunkOffset(2));
+  EXPECT_EQ(500u, verifier_.ChunkSize(2));
+
+  // In any order.
+  EXPECT_TRUE(verifier_.VerifyChunk(2, data_.data() + 2000, 500));
+  EXPECT_TRUE(verifier_.VerifyChunk(0, data_.data(), 1000));
+  EXPECT_FALSE(verifier_.VerifyChunk(1, data_.data(), 1000));
+  EXPECT_FALSE(verifier_.VerifyChunk(2, data_.data() + 2000, 499));
+  EXPECT_FALSE(verifier_.VerifyChunk(3, data_.data(), 0));
+}
+
+TEST_F(PayloadChunkVerifierTest, UpdateTest) {
+  ASSERT_TRUE(verifier_.Init(manifest_));
+  EXPECT_TRUE(verifier_.Update(data_.data(), 1200));
+  EXPECT_TRUE(verifier_.Update(data_.data() + 1200, 1300));
+  // The payload signature that follows isn't covered.
+  EXPECT_TRUE(verifier_.Update(data_.data(), 100));
+  EXPECT_FALSE(verifier_.failed());
+
+  ASSERT_TRUE(verifier_.Init(manifest_));
+  data_[1500]++;
+  EXPECT_TRUE(verifier_.Update(data_.data(), 1200));
+  // Fails as soon as the second chunk is complete.
+  EXPECT_FALSE(verifier_.Update(data_.data() + 1200, 900));
+  EXPECT_TRUE(verifier_.failed());
+}
+
+TEST_F(PayloadChunkVerifierTest, RestartTest) {
+  ASSERT_TRUE(verifier_.Init(manifest_));
+  data_[1100]++;
+  // The first bytes of the chunk restarted in aren't known, it isn't
+  // verified.
+  verifier_.Restart(1200);
+  EXPECT_TRUE(verifier_.Update(data_.data() + 1200, 1300));
+  EXPECT_FALSE(verifier_.failed());
+
+  data_[2100]++;
+  verifier_.Restart(2000);
+  EXPECT_FALSE(verifier_.Update(data_.data() + 2000, 500));
+}
+
+TEST_F(PayloadChunkVerifierTest, InvalidHashesTest) {
+  manifest_.mutable_payload_chunk_hashes()->resize(64);
+  EXPECT_FALSE(verifier_.Init(manifest_));
+
+  // Without chunk hashes, nothing is verified.
+  manifest_.clear_payload_chunk_size();
+  manifest_.clear_payload_chunk_hashes();
+  ASSERT_TRUE(verifier_.Init(manifest_));
+  EXPECT_FALSE(verifier_.enabled());
+  EXPECT_TRUE(verifier_.Update(data_.data(), data_.size()));
+}
+
+}  // namespace chromeos_update_engine
@@ -31,6 +31,11 @@ namespace chromeos_update_engine {
 // The major version used by Brillo.
 extern const uint64_t kBrilloMajorPayloadVersion;
 
+// The same format as kBrilloMajorPayloadVersion, with the manifest compressed
+// as a single zstd frame. The manifest size in the header and the metadata
+// signature are those of the compressed manifest.
+extern const uint64_t kCompressedManifestMajorPayloadVersion;
+
 // The minimum and maximum supported major version.
 extern const uint64_t kMinSupportedMajorPayloadVersion;
 extern const uint64_t kMaxSupportedMajorPayloadVersion;
@@ -65,6 +70,18 @@ extern const uint32_t kZucchiniMinorPayloadVersion;
 // THe minor version that allows LZ4DIFF operation
 constexpr uint32_t kLZ4DIFFMinorPayloadVersion = 9;
 
+// The minor version that allows several operations to share a data blob.
+constexpr uint32_t kSharedDataBlobMinorPayloadVersion = 10;
+
+// The minor version that allows REPLACE_ZSTD operation.
+constexpr uint32_t kZstdMinorPayloadVersion = 11;
+
+// The minor version that allows a zstd dictionary per partition.
+constexpr uint32_t kZstdDictionaryMinorPayloadVersion = 12;
+
+// The minor version that allows packing the extents of the operations.
+constexpr uint32_t kPackedExtentsMinorPayloadVersion = 13;
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
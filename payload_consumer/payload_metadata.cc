@@ -17,20 +17,138 @@
 #include "update_engine/payload_consumer/payload_metadata.h"
 
 #include <endian.h>
+#include <fcntl.h>
+#include <zstd.h>
 
+#include <memory>
+
+#include <base/files/scoped_file.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/data_encoding.h>
+#include <google/protobuf/io/zero_copy_stream.h>
 
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Decompresses a zstd frame as the protobuf parser reads it, so that the
+// decompressed manifest is never held in memory next to the parsed one.
+class ZstdInputStream : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  ZstdInputStream(const unsigned char* data, size_t size)
+      : input_{data, size, 0} {}
+
+  bool Init() {
+    stream_.reset(ZSTD_createDStream());
+    TEST_AND_RETURN_FALSE(stream_ != nullptr);
+    const size_t ret = ZSTD_DCtx_setParameter(
+        stream_.get(), ZSTD_d_windowLogMax, kZstdMaxWindowLog);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "Failed to set the zstd window limit: "
+                 << ZSTD_getErrorName(ret);
+      return false;
+    }
+    buffer_.resize(ZSTD_DStreamOutSize());
+    return true;
+  }
+
+  bool Next(const void** data, int* size) override {
+    if (backed_up_ > 0) {
+      *data = buffer_.data() + buffer_size_ - backed_up_;
+      *size = backed_up_;
+      byte_count_ += backed_up_;
+      backed_up_ = 0;
+      return true;
+    }
+    while (!finished_ && !failed_) {
+      // A full output buffer may leave decompressed data in the stream even
+      // once all the input is consumed. An empty manifest compresses to
+      // nothing, otherwise the input ends before the frame does.
+      if (input_.pos == input_.size && !output_full_) {
+        finished_ = true;
+        failed_ = input_.size > 0;
+        break;
+      }
+      ZSTD_outBuffer output{buffer_.data(), buffer_.size(), 0};
+      const size_t ret = ZSTD_decompressStream(stream_.get(), &output, &input_);
+      if (ZSTD_isError(ret)) {
+        LOG(ERROR) << "ZSTD_decompressStream failed: "
+                   << ZSTD_getErrorName(ret);
+        failed_ = true;
+        break;
+      }
+      output_full_ = output.pos == output.size;
+      // The manifest is a single frame, nothing may follow it.
+      if (ret == 0) {
+        finished_ = true;
+        failed_ = input_.pos != input_.size;
+      }
+      if (output.pos > 0) {
+        buffer_size_ = output.pos;
+        *data = buffer_.data();
+        *size = buffer_size_;
+        byte_count_ += buffer_size_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void BackUp(int count) override {
+    backed_up_ = count;
+    byte_count_ -= count;
+  }
+
+  bool Skip(int count) override {
+    const void* data;
+    int size;
+    while (count > 0) {
+      if (!Next(&data, &size))
+        return false;
+      if (size > count) {
+        BackUp(size - count);
+        return true;
+      }
+      count -= size;
+    }
+    return true;
+  }
+
+  int64_t ByteCount() const override { return byte_count_; }
+
+  // Returns whether the whole frame was decompressed without errors.
+  bool Succeeded() const { return finished_ && !failed_ && backed_up_ == 0; }
+
+ private:
+  struct ZstdDStreamDeleter {
+    void operator()(ZSTD_DStream* p) { ZSTD_freeDStream(p); }
+  };
+  std::unique_ptr<ZSTD_DStream, ZstdDStreamDeleter> stream_;
+  ZSTD_inBuffer input_;
+  brillo::Blob buffer_;
+  // Size of the data decompressed in |buffer_| by the last call to Next().
+  int buffer_size_{0};
+  // Bytes at the end of |buffer_| given back with BackUp().
+  int backed_up_{0};
+  int64_t byte_count_{0};
+  bool output_full_{false};
+  bool finished_{false};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdInputStream);
+};
+}  // namespace
+
 const uint64_t PayloadMetadata::kDeltaVersionOffset = sizeof(kDeltaMagic);
 const uint64_t PayloadMetadata::kDeltaVersionSize = 8;
 const uint64_t PayloadMetadata::kDeltaManifestSizeOffset =
@@ -149,15 +267,53 @@ bool PayloadMetadata::GetManifest(const unsigned char* payload,
                                   DeltaArchiveManifest* out_manifest) const {
   uint64_t manifest_offset = GetManifestOffset();
   CHECK_GE(size, manifest_offset + manifest_size_);
-  return out_manifest->ParseFromArray(&payload[manifest_offset],
-                                      manifest_size_);
+  if (major_payload_version_ < kCompressedManifestMajorPayloadVersion) {
+    TEST_AND_RETURN_FALSE(out_manifest->ParseFromArray(
+        &payload[manifest_offset], manifest_size_));
+  } else {
+    ZstdInputStream stream(&payload[manifest_offset], manifest_size_);
+    TEST_AND_RETURN_FALSE(stream.Init());
+    TEST_AND_RETURN_FALSE(out_manifest->ParseFromZeroCopyStream(&stream));
+    // The parser stops at the end of the decompressed data, or earlier on a
+    // malformed manifest.
+    TEST_AND_RETURN_FALSE(stream.Succeeded());
+  }
+  return UnpackManifestExtents(out_manifest);
 }
 
 ErrorCode PayloadMetadata::ValidateMetadataSignature(
     const brillo::Blob& payload,
     const string& metadata_signature,
     const PayloadVerifier& payload_verifier) const {
-  if (payload.size() < metadata_size_ + metadata_signature_size_)
+  return ValidateMetadataSignature(
+      payload.data(), payload.size(), metadata_signature, payload_verifier);
+}
+
+ErrorCode PayloadMetadata::ValidateMetadataSignature(
+    const unsigned char* payload,
+    size_t size,
+    const string& metadata_signature,
+    const PayloadVerifier& payload_verifier) const {
+  if (size < metadata_size_ + metadata_signature_size_)
+    return ErrorCode::kDownloadMetadataSignatureError;
+
+  brillo::Blob metadata_hash;
+  if (!HashCalculator::RawHashOfBytes(
+          payload, metadata_size_, &metadata_hash)) {
+    LOG(ERROR) << "Unable to compute actual hash of manifest";
+    return ErrorCode::kDownloadMetadataSignatureVerificationError;
+  }
+  return ValidateMetadataSignature(
+      payload, size, metadata_signature, payload_verifier, metadata_hash);
+}
+
+ErrorCode PayloadMetadata::ValidateMetadataSignature(
+    const unsigned char* payload,
+    size_t size,
+    const string& metadata_signature,
+    const PayloadVerifier& payload_verifier,
+    const brillo::Blob& metadata_hash) const {
+  if (size < metadata_size_ + metadata_signature_size_)
     return ErrorCode::kDownloadMetadataSignatureError;
 
   // A single signature in raw bytes.
@@ -175,8 +331,8 @@ ErrorCode PayloadMetadata::ValidateMetadataSignature(
     }
   } else {
     metadata_signature_protobuf.assign(
-        payload.begin() + metadata_size_,
-        payload.begin() + metadata_size_ + metadata_signature_size_);
+        reinterpret_cast<const char*>(payload) + metadata_size_,
+        metadata_signature_size_);
   }
 
   if (metadata_signature_blob.empty() && metadata_signature_protobuf.empty()) {
@@ -185,13 +341,6 @@ ErrorCode PayloadMetadata::ValidateMetadataSignature(
     return ErrorCode::kDownloadMetadataSignatureMissingError;
   }
 
-  brillo::Blob metadata_hash;
-  if (!HashCalculator::RawHashOfBytes(
-          payload.data(), metadata_size_, &metadata_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of manifest";
-    return ErrorCode::kDownloadMetadataSignatureVerificationError;
-  }
-
   if (metadata_hash.size() != kSHA256Size) {
     LOG(ERROR) << "Computed actual hash of metadata has incorrect size: "
                << metadata_hash.size();
@@ -225,26 +374,43 @@ ErrorCode PayloadMetadata::ValidateMetadataSignature(
 bool PayloadMetadata::ParsePayloadFile(const string& payload_path,
                                        DeltaArchiveManifest* manifest,
                                        Signatures* metadata_signatures) {
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(
-      utils::ReadFileChunk(payload_path, 0, kMaxPayloadHeaderSize, &payload));
+  base::ScopedFD fd(HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY)));
+  TEST_AND_RETURN_FALSE_ERRNO(fd.is_valid());
+  brillo::Blob payload(kMaxPayloadHeaderSize);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(
+      fd.get(), payload.data(), payload.size(), 0, &bytes_read));
+  payload.resize(bytes_read);
   TEST_AND_RETURN_FALSE(ParsePayloadHeader(payload));
 
+  // The manifest and the metadata signature are read in one go after the
+  // header, and parsed in the buffer they were read in.
+  uint64_t size = payload.size();
+  if (manifest != nullptr || metadata_signatures != nullptr)
+    size = metadata_size_;
+  if (metadata_signatures != nullptr)
+    size += metadata_signature_size_;
+  if (size > payload.size()) {
+    const off_t file_size = utils::FileSize(fd.get());
+    TEST_AND_RETURN_FALSE(file_size >= 0 &&
+                          size <= static_cast<uint64_t>(file_size));
+    const size_t offset = payload.size();
+    payload.resize(size);
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd.get(),
+                                          payload.data() + offset,
+                                          size - offset,
+                                          offset,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(bytes_read) == size - offset);
+  }
+
   if (manifest != nullptr) {
-    TEST_AND_RETURN_FALSE(
-        utils::ReadFileChunk(payload_path,
-                             kMaxPayloadHeaderSize,
-                             GetMetadataSize() - kMaxPayloadHeaderSize,
-                             &payload));
     TEST_AND_RETURN_FALSE(GetManifest(payload, manifest));
   }
 
   if (metadata_signatures != nullptr) {
-    payload.clear();
-    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-        payload_path, GetMetadataSize(), GetMetadataSignatureSize(), &payload));
-    TEST_AND_RETURN_FALSE(
-        metadata_signatures->ParseFromArray(payload.data(), payload.size()));
+    TEST_AND_RETURN_FALSE(metadata_signatures->ParseFromArray(
+        payload.data() + metadata_size_, metadata_signature_size_));
   }
 
   return true;
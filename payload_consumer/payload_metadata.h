@@ -72,6 +72,19 @@ class PayloadMetadata {
       const brillo::Blob& payload,
       const std::string& metadata_signature,
       const PayloadVerifier& payload_verifier) const;
+  ErrorCode ValidateMetadataSignature(
+      const unsigned char* payload,
+      size_t size,
+      const std::string& metadata_signature,
+      const PayloadVerifier& payload_verifier) const;
+  // Same as above with the SHA256 |metadata_hash| of the metadata of
+  // |payload|, already computed as it was received.
+  ErrorCode ValidateMetadataSignature(
+      const unsigned char* payload,
+      size_t size,
+      const std::string& metadata_signature,
+      const PayloadVerifier& payload_verifier,
+      const brillo::Blob& metadata_hash) const;
 
   // Returns the major payload version. If the version was not yet parsed,
   // returns zero.
@@ -85,7 +98,9 @@ class PayloadMetadata {
   // yet parsed, returns zero.
   uint32_t GetMetadataSignatureSize() const { return metadata_signature_size_; }
 
-  // Set |*out_manifest| to the manifest in |payload|.
+  // Set |*out_manifest| to the manifest in |payload|, decompressing it as it's
+  // parsed in kCompressedManifestMajorPayloadVersion payloads, and with the
+  // packed extents of its operations moved back to their repeated fields.
   // Returns true on success.
   bool GetManifest(const brillo::Blob& payload,
                    DeltaArchiveManifest* out_manifest) const;
@@ -96,7 +111,8 @@ class PayloadMetadata {
 
   // Parses a payload file |payload_path| and prepares the metadata properties,
   // manifest and metadata signatures. Can be used as an easy to use utility to
-  // get the payload information without manually the process.
+  // get the payload information without manually the process. The file is
+  // read once up to the last part requested.
   bool ParsePayloadFile(const std::string& payload_path,
                         DeltaArchiveManifest* manifest,
                         Signatures* metadata_signatures);
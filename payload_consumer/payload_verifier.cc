@@ -16,6 +16,10 @@
 
 #include "update_engine/payload_consumer/payload_verifier.h"
 
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
 #include <utility>
 #include <vector>
 
@@ -49,6 +53,41 @@ const uint8_t kSHA256DigestInfoPrefix[] = {
     0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20,
 };
 
+using PublicKeys =
+    std::vector<std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>>;
+
+// The public keys parsed from a certificate zip, along with the state of
+// the file they were parsed from.
+struct CachedPublicKeys {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  timespec mtime;
+  PublicKeys keys;
+
+  bool Matches(const struct stat& st) const {
+    return device == st.st_dev && inode == st.st_ino && size == st.st_size &&
+           mtime.tv_sec == st.st_mtim.tv_sec &&
+           mtime.tv_nsec == st.st_mtim.tv_nsec;
+  }
+};
+
+// Every binder call that touches a payload verifies it with the same
+// certificates, so their keys are parsed once per process and reparsed only
+// once the zip changes.
+std::mutex public_keys_cache_mutex;
+std::map<string, CachedPublicKeys>* public_keys_cache = nullptr;
+
+// Returns new references to |keys|.
+PublicKeys CopyPublicKeys(const PublicKeys& keys) {
+  PublicKeys copy;
+  for (const auto& key : keys) {
+    EVP_PKEY_up_ref(key.get());
+    copy.emplace_back(key.get(), EVP_PKEY_free);
+  }
+  return copy;
+}
+
 }  // namespace
 
 std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstance(
@@ -74,6 +113,20 @@ std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstance(
 
 std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstanceFromZipPath(
     const std::string& certificate_zip_path) {
+  struct stat st {};
+  const bool stat_ok = stat(certificate_zip_path.c_str(), &st) == 0;
+  std::lock_guard<std::mutex> lock(public_keys_cache_mutex);
+  if (public_keys_cache == nullptr)
+    public_keys_cache = new std::map<string, CachedPublicKeys>();
+  if (stat_ok) {
+    auto it = public_keys_cache->find(certificate_zip_path);
+    if (it != public_keys_cache->end() && it->second.Matches(st)) {
+      return std::unique_ptr<PayloadVerifier>(
+          new PayloadVerifier(CopyPublicKeys(it->second.keys)));
+    }
+  }
+  public_keys_cache->erase(certificate_zip_path);
+
   auto parser = CreateCertificateParser();
   if (!parser) {
     LOG(ERROR) << "Failed to create certificate parser from "
@@ -89,6 +142,13 @@ std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstanceFromZipPath(
     return nullptr;
   }
 
+  if (stat_ok) {
+    (*public_keys_cache)[certificate_zip_path] = {st.st_dev,
+                                                  st.st_ino,
+                                                  st.st_size,
+                                                  st.st_mtim,
+                                                  CopyPublicKeys(public_keys)};
+  }
   return std::unique_ptr<PayloadVerifier>(
       new PayloadVerifier(std::move(public_keys)));
 }
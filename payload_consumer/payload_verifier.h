@@ -49,7 +49,8 @@ class PayloadVerifier {
       const std::string& pem_public_key);
 
   // Extracts the public keys from the certificates contained in the input
-  // zip file. And creates a PayloadVerifier with these public keys.
+  // zip file. And creates a PayloadVerifier with these public keys. The keys
+  // are cached for the process until the file changes.
   static std::unique_ptr<PayloadVerifier> CreateInstanceFromZipPath(
       const std::string& certificate_zip_path);
 
@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/pipelined_payload_writer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Largest chunk handed to the wrapped writer in a single Write() call. Keeping
+// this bounded frees ring buffer space regularly, so the producer doesn't wait
+// for a huge operation to be applied before it can append more bytes.
+constexpr size_t kMaxApplyChunkSize = 1024 * 1024;  // 1 MiB
+}  // namespace
+
+PipelinedPayloadWriter::PipelinedPayloadWriter(FileWriter* writer,
+                                               size_t capacity)
+    : writer_(writer), buffer_(capacity) {
+  CHECK(writer_);
+  CHECK_GT(capacity, 0u);
+}
+
+PipelinedPayloadWriter::~PipelinedPayloadWriter() {
+  Stop();
+}
+
+bool PipelinedPayloadWriter::Start() {
+  TEST_AND_RETURN_FALSE(!apply_thread_.joinable());
+  apply_thread_ = std::thread(&PipelinedPayloadWriter::ApplyLoop, this);
+  LOG(INFO) << "Started pipelined payload apply with a " << buffer_.size()
+            << " bytes buffer.";
+  return true;
+}
+
+bool PipelinedPayloadWriter::Write(const void* bytes,
+                                   size_t count,
+                                   ErrorCode* error) {
+  *error = ErrorCode::kSuccess;
+  const uint8_t* c_bytes = reinterpret_cast<const uint8_t*>(bytes);
+  const size_t capacity = buffer_.size();
+  while (count > 0) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_available_.wait(lock, [this, capacity] {
+      return stopped_ || size_ + in_flight_ < capacity;
+    });
+    if (stopped_) {
+      *error = error_;
+      return false;
+    }
+    const size_t free_space = capacity - size_ - in_flight_;
+    const size_t write_pos = (read_pos_ + size_) % capacity;
+    // The free region may wrap around the end of |buffer_|, copy only the
+    // contiguous part here and let the next iteration copy the rest.
+    const size_t len = std::min({count, free_space, capacity - write_pos});
+    memcpy(buffer_.data() + write_pos, c_bytes, len);
+    size_ += len;
+    c_bytes += len;
+    count -= len;
+    data_available_.notify_one();
+  }
+  return true;
+}
+
+bool PipelinedPayloadWriter::Drain(ErrorCode* error) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  data_available_.notify_one();
+  if (apply_thread_.joinable()) {
+    apply_thread_.join();
+  }
+  *error = error_;
+  return !failed_;
+}
+
+void PipelinedPayloadWriter::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    abort_ = true;
+  }
+  data_available_.notify_one();
+  if (apply_thread_.joinable()) {
+    apply_thread_.join();
+  }
+}
+
+bool PipelinedPayloadWriter::HasFailed(ErrorCode* error) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (failed_) {
+    *error = error_;
+  }
+  return failed_;
+}
+
+bool PipelinedPayloadWriter::IsAboveHighWatermark() const {
+  return buffered_bytes() >= buffer_.size() / 4 * 3;
+}
+
+bool PipelinedPayloadWriter::IsBelowLowWatermark() const {
+  return buffered_bytes() <= buffer_.size() / 4;
+}
+
+size_t PipelinedPayloadWriter::buffered_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_ + in_flight_;
+}
+
+void PipelinedPayloadWriter::ApplyLoop() {
+  const size_t capacity = buffer_.size();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    data_available_.wait(lock, [this] { return size_ > 0 || stopping_; });
+    if (abort_ || (size_ == 0 && stopping_)) {
+      break;
+    }
+    const size_t len =
+        std::min({size_, capacity - read_pos_, kMaxApplyChunkSize});
+    const uint8_t* chunk = buffer_.data() + read_pos_;
+    read_pos_ = (read_pos_ + len) % capacity;
+    size_ -= len;
+    in_flight_ = len;
+
+    // The producer never touches the in flight region, so it's safe to apply
+    // it without holding the lock.
+    lock.unlock();
+    ErrorCode error = ErrorCode::kSuccess;
+    const bool success = writer_->Write(chunk, len, &error);
+    lock.lock();
+
+    in_flight_ = 0;
+    space_available_.notify_one();
+    if (!success) {
+      failed_ = true;
+      error_ = error;
+      break;
+    }
+  }
+  stopped_ = true;
+  // Drop whatever is left, no one is going to apply it.
+  size_ = 0;
+  space_available_.notify_all();
+}
+
+}  // namespace chromeos_update_engine
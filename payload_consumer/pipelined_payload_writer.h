@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PIPELINED_PAYLOAD_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PIPELINED_PAYLOAD_WRITER_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/payload_consumer/file_writer.h"
+
+namespace chromeos_update_engine {
+
+// PipelinedPayloadWriter decouples receiving payload bytes from applying them.
+// Bytes passed to Write() are copied into a bounded ring buffer, and a
+// dedicated apply thread drains the buffer into the wrapped |FileWriter|
+// (usually a DeltaPerformer). This lets the network receive the next chunk of
+// payload while the previous chunk is being written to disk.
+//
+// Write() and all other public methods must be called from the same thread
+// (the thread owning the MessageLoop). The wrapped writer is only ever called
+// from the apply thread while the pipeline is running.
+class PipelinedPayloadWriter {
+ public:
+  // |capacity| is the size of the ring buffer in bytes. Callers are expected
+  // to pause the producer when IsAboveHighWatermark() returns true, and resume
+  // it once IsBelowLowWatermark() returns true.
+  PipelinedPayloadWriter(FileWriter* writer, size_t capacity);
+  ~PipelinedPayloadWriter();
+
+  // Starts the apply thread. Returns false if already started.
+  bool Start();
+
+  // Copies |count| bytes into the ring buffer, blocking only if the buffer
+  // doesn't have enough room for them. Returns false and sets |error| if the
+  // apply thread stopped, either because the wrapped writer failed or because
+  // it asked to stop consuming data (in which case |error| is kSuccess).
+  bool Write(const void* bytes, size_t count, ErrorCode* error);
+
+  // Waits until all the buffered bytes have been handed to the wrapped writer
+  // and stops the apply thread. Returns false and sets |error| if the wrapped
+  // writer failed on any of the buffered bytes.
+  bool Drain(ErrorCode* error);
+
+  // Stops the apply thread as soon as the current chunk is applied, dropping
+  // any buffered bytes. Safe to call multiple times.
+  void Stop();
+
+  // Returns true if the apply thread stopped because the wrapped writer
+  // returned false. |error| is set to the error reported by the writer.
+  bool HasFailed(ErrorCode* error) const;
+
+  // Backpressure hints for the producer.
+  bool IsAboveHighWatermark() const;
+  bool IsBelowLowWatermark() const;
+
+  // Number of bytes currently buffered and not handed to the writer yet.
+  size_t buffered_bytes() const;
+  size_t capacity() const { return buffer_.size(); }
+
+ private:
+  // Main loop of the apply thread.
+  void ApplyLoop();
+
+  FileWriter* const writer_;
+
+  // Ring buffer storage. |read_pos_| is the offset of the oldest buffered byte
+  // and |size_| the number of buffered bytes.
+  brillo::Blob buffer_;
+  size_t read_pos_{0};
+  size_t size_{0};
+
+  // Bytes currently being written by the apply thread. They are no longer
+  // counted in |size_| but their space can't be reused until the write
+  // returns.
+  size_t in_flight_{0};
+
+  // Set by the producer when no more data will be written, or by Stop().
+  bool stopping_{false};
+  // Set by Stop() to drop buffered bytes instead of applying them.
+  bool abort_{false};
+  // Set by the apply thread once it exits its loop.
+  bool stopped_{false};
+  bool failed_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+
+  mutable std::mutex mutex_;
+  // Signaled when data is added or the pipeline is stopping.
+  std::condition_variable data_available_;
+  // Signaled when space is freed or the apply thread stopped.
+  std::condition_variable space_available_;
+
+  std::thread apply_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(PipelinedPayloadWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PIPELINED_PAYLOAD_WRITER_H_
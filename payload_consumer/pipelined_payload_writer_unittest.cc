@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/pipelined_payload_writer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A FileWriter that records everything written to it and can be told to fail
+// or to block until released.
+class RecordingFileWriter : public FileWriter {
+ public:
+  bool Write(const void* bytes, size_t count) override {
+    ErrorCode error;
+    return Write(bytes, count, &error);
+  }
+
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_cv_.wait(lock, [this] { return released_; });
+    if (fail_after_ >= 0 && data_.size() + count > size_t(fail_after_)) {
+      *error = ErrorCode::kDownloadWriteError;
+      return false;
+    }
+    const uint8_t* c_bytes = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), c_bytes, c_bytes + count);
+    return true;
+  }
+
+  int Close() override { return 0; }
+
+  void set_fail_after(int fail_after) { fail_after_ = fail_after; }
+
+  void SetReleased(bool released) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released_ = released;
+    }
+    released_cv_.notify_all();
+  }
+
+  brillo::Blob data() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return data_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable released_cv_;
+  bool released_{true};
+  // Fail once more than this many bytes would have been written, -1 to never
+  // fail.
+  int fail_after_{-1};
+  brillo::Blob data_;
+};
+
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 7 + 3);
+  return data;
+}
+
+}  // namespace
+
+class PipelinedPayloadWriterTest : public ::testing::Test {
+ protected:
+  RecordingFileWriter writer_;
+};
+
+TEST_F(PipelinedPayloadWriterTest, PassesDataInOrderTest) {
+  // Use a small capacity with odd sized writes so the ring buffer wraps
+  // around many times.
+  PipelinedPayloadWriter pipeline(&writer_, 17);
+  ASSERT_TRUE(pipeline.Start());
+  const brillo::Blob data = MakeData(1000);
+  ErrorCode error;
+  for (size_t offset = 0; offset < data.size(); offset += 13) {
+    size_t len = std::min<size_t>(13, data.size() - offset);
+    ASSERT_TRUE(pipeline.Write(data.data() + offset, len, &error));
+    EXPECT_EQ(ErrorCode::kSuccess, error);
+  }
+  EXPECT_TRUE(pipeline.Drain(&error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(data, writer_.data());
+}
+
+TEST_F(PipelinedPayloadWriterTest, WriteFailureTest) {
+  writer_.set_fail_after(100);
+  PipelinedPayloadWriter pipeline(&writer_, 64);
+  ASSERT_TRUE(pipeline.Start());
+  const brillo::Blob data = MakeData(1000);
+  ErrorCode error = ErrorCode::kSuccess;
+  bool success = true;
+  for (size_t offset = 0; offset < data.size() && success; offset += 10) {
+    success = pipeline.Write(data.data() + offset, 10, &error);
+  }
+  if (success) {
+    // All the data fit in the buffer before the failure was noticed.
+    EXPECT_FALSE(pipeline.Drain(&error));
+  }
+  EXPECT_EQ(ErrorCode::kDownloadWriteError, error);
+  EXPECT_TRUE(pipeline.HasFailed(&error));
+  EXPECT_EQ(ErrorCode::kDownloadWriteError, error);
+  EXPECT_LE(writer_.data().size(), 100u);
+}
+
+TEST_F(PipelinedPayloadWriterTest, StopDropsBufferedDataTest) {
+  writer_.SetReleased(false);
+  PipelinedPayloadWriter pipeline(&writer_, 100);
+  ASSERT_TRUE(pipeline.Start());
+  const brillo::Blob data = MakeData(80);
+  ErrorCode error;
+  ASSERT_TRUE(pipeline.Write(data.data(), 40, &error));
+  ASSERT_TRUE(pipeline.Write(data.data() + 40, 40, &error));
+  EXPECT_TRUE(pipeline.IsAboveHighWatermark());
+  EXPECT_FALSE(pipeline.IsBelowLowWatermark());
+
+  writer_.SetReleased(true);
+  pipeline.Stop();
+  // At most the chunk that was in flight when Stop() was called is applied.
+  EXPECT_LE(writer_.data().size(), 80u);
+  EXPECT_FALSE(pipeline.HasFailed(&error));
+  EXPECT_FALSE(pipeline.Write(data.data(), 1, &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+}
+
+TEST_F(PipelinedPayloadWriterTest, WatermarksTest) {
+  PipelinedPayloadWriter pipeline(&writer_, 100);
+  EXPECT_TRUE(pipeline.IsBelowLowWatermark());
+  EXPECT_FALSE(pipeline.IsAboveHighWatermark());
+  EXPECT_EQ(0u, pipeline.buffered_bytes());
+  EXPECT_EQ(100u, pipeline.capacity());
+
+  ASSERT_TRUE(pipeline.Start());
+  const brillo::Blob data = MakeData(100);
+  ErrorCode error;
+  ASSERT_TRUE(pipeline.Write(data.data(), data.size(), &error));
+  EXPECT_TRUE(pipeline.Drain(&error));
+  EXPECT_TRUE(pipeline.IsBelowLowWatermark());
+  EXPECT_EQ(data, writer_.data());
+}
+
+}  // namespace chromeos_update_engine
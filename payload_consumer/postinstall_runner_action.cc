@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <string>
@@ -36,6 +37,7 @@
 
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 
@@ -52,6 +54,14 @@ static constexpr bool Contains(std::string_view haystack,
   return haystack.find(needle) != std::string::npos;
 }
 
+static bool DeleteMountDir(const std::string& mount_dir) {
+#if BASE_VER < 800000
+  return base::DeleteFile(base::FilePath(mount_dir), true);
+#else
+  return base::DeleteFile(base::FilePath(mount_dir));
+#endif
+}
+
 static void LogBuildInfoForPartition(std::string_view mount_point) {
   static constexpr std::array<std::string_view, 3> kBuildPropFiles{
       "build.prop", "etc/build.prop", "system/build.prop"};
@@ -90,21 +100,21 @@ PostinstallRunnerAction::PostinstallRunnerAction(
   fs_mount_dir_ = temp_dir.value();
 #endif  // __ANDROID__
   CHECK(!fs_mount_dir_.empty());
-  EnsureUnmounted();
+  EnsureUnmounted(fs_mount_dir_);
   LOG(INFO) << "postinstall mount point: " << fs_mount_dir_;
 }
 
-void PostinstallRunnerAction::EnsureUnmounted() {
-  if (utils::IsMountpoint(fs_mount_dir_)) {
-    LOG(INFO) << "Found previously mounted filesystem at " << fs_mount_dir_;
-    utils::UnmountFilesystem(fs_mount_dir_);
+void PostinstallRunnerAction::EnsureUnmounted(const string& mount_dir) {
+  if (utils::IsMountpoint(mount_dir)) {
+    LOG(INFO) << "Found previously mounted filesystem at " << mount_dir;
+    utils::UnmountFilesystem(mount_dir);
   }
 }
 
 void PostinstallRunnerAction::PerformAction() {
   CHECK(HasInputObject());
   CHECK(boot_control_);
-  install_plan_ = GetInputObject();
+  install_plan_ = TakeInputObject();
 
   auto dynamic_control = boot_control_->GetDynamicPartitionControl();
   CHECK(dynamic_control);
@@ -151,17 +161,16 @@ void PostinstallRunnerAction::PerformAction() {
     partition_weight_[i] = partition.run_postinstall;
     total_weight_ += partition_weight_[i];
   }
-  accumulated_weight_ = 0;
-  ReportProgress(0);
+  partition_progress_.assign(install_plan_.partitions.size(), 0);
+  next_partition_ = 0;
+  ReportProgress();
 
   PerformPartitionPostinstall();
 }
 
 bool PostinstallRunnerAction::MountPartition(
-    const InstallPlan::Partition& partition) noexcept {
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
+    const InstallPlan::Partition& partition,
+    const string& mount_dir) noexcept {
   const auto mountable_device = partition.readonly_target_path;
   if (!utils::FileExists(mountable_device.c_str())) {
     LOG(ERROR) << "Mountable device " << mountable_device << " for partition "
@@ -169,14 +178,14 @@ bool PostinstallRunnerAction::MountPartition(
     return false;
   }
 
-  if (!utils::FileExists(fs_mount_dir_.c_str())) {
-    LOG(ERROR) << "Mount point " << fs_mount_dir_
+  if (!utils::FileExists(mount_dir.c_str())) {
+    LOG(ERROR) << "Mount point " << mount_dir
                << " does not exist, mount call will fail";
     return false;
   }
-  // Double check that the fs_mount_dir is not busy with a previous mounted
+  // Double check that the mount_dir is not busy with a previous mounted
   // filesystem from a previous crashed postinstall step.
-  EnsureUnmounted();
+  EnsureUnmounted(mount_dir);
 
 #ifdef __ANDROID__
   // In Chromium OS, the postinstall step is allowed to write to the block
@@ -191,7 +200,7 @@ bool PostinstallRunnerAction::MountPartition(
 
   if (!utils::MountFilesystem(
           mountable_device,
-          fs_mount_dir_,
+          mount_dir,
           MS_RDONLY,
           partition.filesystem_type,
           hardware_->GetPartitionMountOptions(partition.name))) {
@@ -200,17 +209,69 @@ bool PostinstallRunnerAction::MountPartition(
   return true;
 }
 
+pid_t PostinstallRunnerAction::current_command() const {
+  for (const auto& run : runs_) {
+    if (run->command)
+      return run->command;
+  }
+  return 0;
+}
+
+bool PostinstallRunnerAction::DependsOnRunningPartition(size_t index) const {
+  const auto& partition = install_plan_.partitions[index];
+  for (const auto& name : partition.postinstall_depends_on) {
+    for (const auto& run : runs_) {
+      if (install_plan_.partitions[run->partition].name == name)
+        return true;
+    }
+  }
+  return false;
+}
+
+string PostinstallRunnerAction::GetFreeMountDir() {
+  if (std::none_of(runs_.begin(), runs_.end(), [this](const auto& run) {
+        return run->mount_dir == fs_mount_dir_;
+      })) {
+    return fs_mount_dir_;
+  }
+  base::FilePath temp_dir;
+  if (!base::CreateNewTempDirectory("au_postinst_mount", &temp_dir)) {
+    LOG(ERROR) << "Unable to create a mount point for postinstall";
+    return "";
+  }
+  return temp_dir.value();
+}
+
 void PostinstallRunnerAction::PerformPartitionPostinstall() {
   if (install_plan_.download_url.empty()) {
     LOG(INFO) << "Skipping post-install";
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
-  while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
-    VLOG(1) << "Skipping post-install on partition "
-            << install_plan_.partitions[current_partition_].name;
+  const size_t concurrency =
+      std::max<size_t>(install_plan_.postinstall_concurrency, 1);
+  while (next_partition_ < install_plan_.partitions.size() &&
+         runs_.size() < concurrency) {
+    const size_t index = next_partition_;
+    const auto& partition = install_plan_.partitions[index];
+    // Started early, PartitionsReady() comes back here once the partition is
+    // verified.
+    if (!IsPartitionReady(partition.name))
+      return;
+    if (partition.run_postinstall) {
+      // The partitions start in order, so the ones following a partition
+      // waiting for its dependencies wait too.
+      if (DependsOnRunningPartition(index))
+        return;
+      next_partition_++;
+      if (!StartPartitionPostinstall(index))
+        return;
+      continue;
+    }
+
+    // Skip all the partitions that don't have a post-install step.
+    VLOG(1) << "Skipping post-install on partition " << partition.name;
+    next_partition_++;
     // Attempt to mount a device if it has postinstall script configured, even
     // if we want to skip running postinstall script.
     // This is because we've seen bugs like b/198787355 which is only triggered
@@ -220,51 +281,76 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     // It's possible that some of the partitions aren't mountable, but these
     // partitions shouldn't have postinstall configured. Therefore we guard this
     // logic with |postinstall_path.empty()|.
-    const auto& partition = install_plan_.partitions[current_partition_];
     if (!partition.postinstall_path.empty()) {
-      const auto mountable_device = partition.readonly_target_path;
-      if (!MountPartition(partition)) {
+      const string mount_dir = GetFreeMountDir();
+      if (mount_dir.empty()) {
         return CompletePostinstall(ErrorCode::kPostInstallMountError);
       }
-      LogBuildInfoForPartition(fs_mount_dir_);
-      if (!utils::UnmountFilesystem(fs_mount_dir_)) {
-        return CompletePartitionPostinstall(
-            1, "Error unmounting the device " + mountable_device);
+      const bool mounted = MountPartition(partition, mount_dir);
+      if (mounted) {
+        LogBuildInfoForPartition(mount_dir);
+      }
+      const bool unmounted = mounted && utils::UnmountFilesystem(mount_dir);
+      if (mount_dir != fs_mount_dir_) {
+        DeleteMountDir(mount_dir);
+      }
+      if (!mounted) {
+        return CompletePostinstall(ErrorCode::kPostInstallMountError);
+      }
+      if (!unmounted) {
+        LOG(ERROR) << "Error unmounting the device "
+                   << partition.readonly_target_path;
+        return CompletePartition(index, 1);
       }
     }
-    current_partition_++;
   }
-  if (current_partition_ == install_plan_.partitions.size())
+  if (runs_.empty() && next_partition_ == install_plan_.partitions.size() &&
+      AllPartitionsReady()) {
     return CompletePostinstall(ErrorCode::kSuccess);
+  }
+}
 
-  const InstallPlan::Partition& partition =
-      install_plan_.partitions[current_partition_];
+bool PostinstallRunnerAction::StartPartitionPostinstall(size_t index) {
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
+  StartPhase(phases::kPostinstall, partition.name);
 
   const string mountable_device = partition.readonly_target_path;
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
-
-  if (!MountPartition(partition)) {
+  const string mount_dir = GetFreeMountDir();
+  if (mount_dir.empty()) {
     CompletePostinstall(ErrorCode::kPostInstallMountError);
-    return;
+    return false;
+  }
+  if (!MountPartition(partition, mount_dir)) {
+    if (mount_dir != fs_mount_dir_) {
+      DeleteMountDir(mount_dir);
+    }
+    CompletePostinstall(ErrorCode::kPostInstallMountError);
+    return false;
   }
-  LogBuildInfoForPartition(fs_mount_dir_);
+  // Perform post-install for the partition. From this point the run needs to
+  // be cleaned up, which CompletePartitionPostinstall and CompletePostinstall
+  // do.
+  runs_.push_back(std::make_unique<PostinstallRun>());
+  PostinstallRun* run = runs_.back().get();
+  run->partition = index;
+  run->mount_dir = mount_dir;
+
+  LogBuildInfoForPartition(mount_dir);
   base::FilePath postinstall_path(partition.postinstall_path);
   if (postinstall_path.IsAbsolute()) {
     LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
                   "path instead: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
-  string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
-  if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+  string abs_path = base::FilePath(mount_dir).Append(postinstall_path).value();
+  if (!base::StartsWith(abs_path, mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    return false;
   }
 
   LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
@@ -289,113 +375,148 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   command.push_back(partition.target_path);
 #endif  // __ANDROID__
 
-  current_command_ = Subprocess::Get().ExecFlags(
+  run->command = Subprocess::Get().ExecFlags(
       command,
       Subprocess::kRedirectStderrToStdout,
       {kPostinstallStatusFd},
       base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
+                 base::Unretained(this),
+                 base::Unretained(run)));
   // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
+  CHECK_GE(run->command, 0);
 
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
-    return;
+  if (!run->command) {
+    CompletePartitionPostinstall(run, 1, "Postinstall didn't launch");
+    return false;
   }
 
   // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  run->progress_fd =
+      Subprocess::Get().GetPipeFd(run->command, kPostinstallStatusFd);
+  int fd_flags = fcntl(run->progress_fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(run->progress_fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
+                << run->progress_fd;
   }
 
-  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
-      progress_fd_,
+  run->progress_controller = base::FileDescriptorWatcher::WatchReadable(
+      run->progress_fd,
       base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
-                          base::Unretained(this)));
+                          base::Unretained(this),
+                          base::Unretained(run)));
+  return true;
 }
 
-void PostinstallRunnerAction::OnProgressFdReady() {
+void PostinstallRunnerAction::OnProgressFdReady(PostinstallRun* run) {
   char buf[1024];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, base::size(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
+    bool ok = utils::ReadAll(
+        run->progress_fd, buf, base::size(buf), &bytes_read, &eof);
+    run->progress_buffer.append(buf, bytes_read);
     // Process every line.
-    vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    vector<string> lines = base::SplitString(run->progress_buffer,
+                                             "\n",
+                                             base::KEEP_WHITESPACE,
+                                             base::SPLIT_WANT_ALL);
     if (!lines.empty()) {
-      progress_buffer_ = lines.back();
+      run->progress_buffer = lines.back();
       lines.pop_back();
       for (const auto& line : lines) {
-        ProcessProgressLine(line);
+        ProcessProgressLine(run->partition, line);
       }
     }
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      progress_controller_.reset();
+      run->progress_controller.reset();
       return;
     }
   } while (bytes_read);
 }
 
-bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
+bool PostinstallRunnerAction::ProcessProgressLine(size_t index,
+                                                  const string& line) {
   double frac = 0;
   if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
       !std::isnan(frac)) {
-    ReportProgress(frac);
+    if (!std::isfinite(frac) || frac < 0)
+      frac = 0;
+    if (frac > 1)
+      frac = 1;
+    partition_progress_[index] = frac;
+    ReportProgress();
     return true;
   }
 
   return false;
 }
 
-void PostinstallRunnerAction::ReportProgress(double frac) {
-  if (!delegate_)
+void PostinstallRunnerAction::ReportProgress() {
+  // The actions before are still reporting their own progress.
+  if (!delegate_ || !AllPartitionsReady())
     return;
-  if (current_partition_ >= partition_weight_.size() || total_weight_ == 0) {
+  if (total_weight_ == 0) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!std::isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double weighted_progress = 0;
+  for (size_t i = 0; i < partition_weight_.size(); ++i)
+    weighted_progress += partition_weight_[i] * partition_progress_[i];
+  delegate_->ProgressUpdate(weighted_progress / total_weight_);
 }
 
-void PostinstallRunnerAction::Cleanup() {
-  utils::UnmountFilesystem(fs_mount_dir_);
-#ifndef __ANDROID__
-#if BASE_VER < 800000
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_), true)) {
+void PostinstallRunnerAction::Cleanup(PostinstallRun* run) {
+  utils::UnmountFilesystem(run->mount_dir);
+#ifdef __ANDROID__
+  // The regular mount point is kept.
+  const bool remove_mount_dir = run->mount_dir != fs_mount_dir_;
 #else
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_))) {
+  const bool remove_mount_dir = true;
 #endif
-    PLOG(WARNING) << "Not removing temporary mountpoint " << fs_mount_dir_;
+  if (remove_mount_dir && !DeleteMountDir(run->mount_dir)) {
+    PLOG(WARNING) << "Not removing temporary mountpoint " << run->mount_dir;
   }
-#endif
 
-  progress_fd_ = -1;
-  progress_controller_.reset();
+  run->progress_fd = -1;
+  run->progress_controller.reset();
+
+  run->progress_buffer.clear();
+}
 
-  progress_buffer_.clear();
+void PostinstallRunnerAction::StopPostinstallRuns() {
+  for (const auto& run : runs_) {
+    if (run->command) {
+      // Calling KillExec() will discard the callback we registered and
+      // therefore the unretained reference to this object.
+      Subprocess::Get().KillExec(run->command);
+
+      // If the command has been suspended, resume it after KillExec() so that
+      // the process can process the SIGTERM sent by KillExec().
+      if (run->is_suspended && kill(run->command, SIGCONT) != 0) {
+        PLOG(ERROR) << "Couldn't resume child process " << run->command;
+      }
+    }
+    Cleanup(run.get());
+  }
+  runs_.clear();
 }
 
 void PostinstallRunnerAction::CompletePartitionPostinstall(
-    int return_code, const string& output) {
-  current_command_ = 0;
-  Cleanup();
+    PostinstallRun* run, int return_code, const string& output) {
+  const size_t index = run->partition;
+  Cleanup(run);
+  runs_.erase(std::find_if(runs_.begin(),
+                           runs_.end(),
+                           [run](const auto& r) { return r.get() == run; }));
+  StopPhase(phases::kPostinstall, install_plan_.partitions[index].name);
+  CompletePartition(index, return_code);
+}
 
+void PostinstallRunnerAction::CompletePartition(size_t index,
+                                                int return_code) {
   if (return_code != 0) {
     LOG(ERROR) << "Postinst command failed with code: " << return_code;
     ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
@@ -416,20 +537,23 @@ void PostinstallRunnerAction::CompletePartitionPostinstall(
 
     // If postinstall script for this partition is optional we can ignore the
     // result.
-    if (install_plan_.partitions[current_partition_].postinstall_optional) {
+    if (install_plan_.partitions[index].postinstall_optional) {
       LOG(INFO) << "Ignoring postinstall failure since it is optional";
     } else {
       return CompletePostinstall(error_code);
     }
   }
-  accumulated_weight_ += partition_weight_[current_partition_];
-  current_partition_++;
-  ReportProgress(0);
+  partition_progress_[index] = 1;
+  ReportProgress();
 
   PerformPartitionPostinstall();
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
+  // On a failure, the postinstall of the other partitions may still be
+  // running.
+  StopPostinstallRuns();
+
   // We only attempt to mark the new slot as active if all the postinstall
   // steps succeeded.
   if (error_code == ErrorCode::kSuccess) {
@@ -469,46 +593,54 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
   }
 
   LOG(INFO) << "All post-install commands succeeded";
+  // The install plan isn't used anymore, |completer| completes the action.
   if (HasOutputPipe()) {
-    SetOutputObject(install_plan_);
+    SetOutputObject(std::move(install_plan_));
   }
 }
 
 void PostinstallRunnerAction::SuspendAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGSTOP) != 0) {
-    PLOG(ERROR) << "Couldn't pause child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = true;
+  for (const auto& run : runs_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << run->command;
+    } else {
+      run->is_suspended = true;
+    }
   }
 }
 
 void PostinstallRunnerAction::ResumeAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGCONT) != 0) {
-    PLOG(ERROR) << "Couldn't resume child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = false;
+  for (const auto& run : runs_) {
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << run->command;
+    } else {
+      run->is_suspended = false;
+    }
   }
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
-  if (!current_command_)
-    return;
-  // Calling KillExec() will discard the callback we registered and therefore
-  // the unretained reference to this object.
-  Subprocess::Get().KillExec(current_command_);
+  StopPostinstallRuns();
+}
 
-  // If the command has been suspended, resume it after KillExec() so that the
-  // process can process the SIGTERM sent by KillExec().
-  if (is_current_command_suspended_) {
-    ResumeAction();
-  }
+bool PostinstallRunnerAction::CanStartOnPartitions() {
+  if (!HasInputObject())
+    return false;
+  const InstallPlan& install_plan = GetInputObject();
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  // The powerwash is only scheduled once the update is verified.
+  return !install_plan.download_url.empty() &&
+         !install_plan.powerwash_required && !install_plan.is_rollback &&
+         dynamic_control && !dynamic_control->UpdateUsesSnapshotCompression();
+}
 
-  current_command_ = 0;
-  Cleanup();
+void PostinstallRunnerAction::PartitionsReady() {
+  ReportProgress();
+  PerformPartitionPostinstall();
 }
 
 }  // namespace chromeos_update_engine
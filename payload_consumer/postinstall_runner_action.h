@@ -32,7 +32,11 @@
 #include "update_engine/payload_consumer/install_plan.h"
 
 // The Postinstall Runner Action is responsible for running the postinstall
-// script of a successfully downloaded update.
+// script of a successfully downloaded update. With a postinstall concurrency
+// above 1 in the install plan, the postinstall programs of the partitions run
+// concurrently, each once the partitions it depends on are done. Only the first
+// program running is mounted at the regular mount point, the others are mounted
+// at temporary directories.
 
 namespace chromeos_update_engine {
 
@@ -48,6 +52,11 @@ class PostinstallRunnerAction : public InstallPlanAction {
   void SuspendAction() override;
   void ResumeAction() override;
   void TerminateProcessing() override;
+  // The postinstall of a partition can run as soon as it is verified, unless
+  // the update schedules a powerwash or the partitions are only readable
+  // through snapuserd.
+  bool CanStartOnPartitions() override;
+  void PartitionsReady() override;
 
   class DelegateInterface {
    public:
@@ -67,37 +76,90 @@ class PostinstallRunnerAction : public InstallPlanAction {
  private:
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
+  FRIEND_TEST(PostinstallRunnerActionTest, DependsOnRunningPartitionTest);
+
+  // A postinstall program running for a partition.
+  struct PostinstallRun {
+    // The index of the partition in the InstallPlan.
+    size_t partition;
+
+    // Where the partition is mounted.
+    std::string mount_dir;
+
+    // The postinstall command, or 0 if it isn't running yet.
+    pid_t command{0};
+
+    // True if |command| has been suspended by SuspendAction().
+    bool is_suspended{false};
+
+    // The parent progress file descriptor used to watch for progress reports
+    // from the postinstall program and the task watching for them.
+    int progress_fd{-1};
+    std::unique_ptr<base::FileDescriptorWatcher::Controller>
+        progress_controller;
+
+    // A buffer of a partial read line from the progress file descriptor.
+    std::string progress_buffer;
+  };
 
   // exposed for testing purposes only
   void SetMountDir(std::string dir) { fs_mount_dir_ = std::move(dir); }
-  void EnsureUnmounted();
+  void EnsureUnmounted(const std::string& mount_dir);
 
+  // Returns the first postinstall command running, or 0 if none is.
+  pid_t current_command() const;
+
+  // Starts the postinstall of the next partitions, as long as fewer than the
+  // postinstall concurrency of the install plan run and the next partition
+  // doesn't depend on a running one.
   void PerformPartitionPostinstall();
-  [[nodiscard]] bool MountPartition(
-      const InstallPlan::Partition& partition) noexcept;
 
-  // Called whenever the |progress_fd_| has data available to read.
-  void OnProgressFdReady();
+  // Mounts the partition at |index| and starts its postinstall program.
+  // Returns false if the action or the partition was completed instead, in
+  // which case the caller should return.
+  bool StartPartitionPostinstall(size_t index);
+
+  // Whether the partition at |index| depends on a partition whose postinstall
+  // is running.
+  bool DependsOnRunningPartition(size_t index) const;
 
-  // Updates the action progress according to the |line| passed from the
-  // postinstall program. Valid lines are:
+  // Returns the regular mount point if no program is mounted there, or a new
+  // temporary directory. Returns an empty string on error.
+  std::string GetFreeMountDir();
+
+  [[nodiscard]] bool MountPartition(const InstallPlan::Partition& partition,
+                                    const std::string& mount_dir) noexcept;
+
+  // Called whenever the progress fd of |run| has data available to read.
+  void OnProgressFdReady(PostinstallRun* run);
+
+  // Updates the progress of the partition at |index| according to the |line|
+  // passed from its postinstall program. Valid lines are:
   //     global_progress <frac>
   //         <frac> should be between 0.0 and 1.0; sets the progress to the
   //         <frac> value.
-  bool ProcessProgressLine(const std::string& line);
+  bool ProcessProgressLine(size_t index, const std::string& line);
 
-  // Report the progress to the delegate given that the postinstall operation
-  // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
-  void ReportProgress(double frac);
+  // Report the progress to the delegate, from the weight and the progress of
+  // every partition.
+  void ReportProgress();
 
   // Cleanup the setup made when running postinstall for a given partition.
   // Unmount and remove the mountpoint directory if needed and cleanup the
   // status file descriptor and message loop task watching for it.
-  void Cleanup();
+  void Cleanup(PostinstallRun* run);
+
+  // Kills the postinstall commands still running and cleans them up.
+  void StopPostinstallRuns();
 
   // Subprocess::Exec callback.
-  void CompletePartitionPostinstall(int return_code, const std::string& output);
+  void CompletePartitionPostinstall(PostinstallRun* run,
+                                    int return_code,
+                                    const std::string& output);
+
+  // Completes the postinstall of the partition at |index| whose program
+  // returned |return_code|, and starts the next ones.
+  void CompletePartition(size_t index, int return_code);
 
   // Complete the Action with the passed |error_code| and mark the new slot as
   // ready. Called when the post-install script was run for all the partitions.
@@ -106,9 +168,9 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The path where the filesystem will be mounted during post-install.
   std::string fs_mount_dir_;
 
-  // The partition being processed on the list of partitions specified in the
+  // The next partition to process on the list of partitions specified in the
   // InstallPlan.
-  size_t current_partition_{0};
+  size_t next_partition_{0};
 
   // A non-negative value representing the estimated weight of each partition
   // passed in the install plan. The weight is used to predict the overall
@@ -119,9 +181,8 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The sum of all the weights in |partition_weight_|.
   double total_weight_{0};
 
-  // The sum of all the weights in |partition_weight_| up to but not including
-  // the |current_partition_|.
-  double accumulated_weight_{0};
+  // The progress of each partition, between 0 and 1.
+  std::vector<double> partition_progress_;
 
   // The delegate used to notify of progress updates, if any.
   DelegateInterface* delegate_{nullptr};
@@ -136,20 +197,8 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // Used for cleaning up if post-install fails.
   bool powerwash_scheduled_{false};
 
-  // Postinstall command currently running, or 0 if no program running.
-  pid_t current_command_{0};
-
-  // True if |current_command_| has been suspended by SuspendAction().
-  bool is_current_command_suspended_{false};
-
-  // The parent progress file descriptor used to watch for progress reports from
-  // the postinstall program and the task watching for them.
-  int progress_fd_{-1};
-
-  std::unique_ptr<base::FileDescriptorWatcher::Controller> progress_controller_;
-
-  // A buffer of a partial read line from the progress file descriptor.
-  std::string progress_buffer_;
+  // The postinstall programs currently running, in the order they started.
+  std::vector<std::unique_ptr<PostinstallRun>> runs_;
 
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
@@ -116,9 +116,9 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void SuspendRunningAction() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_ ||
+    if (!postinstall_action_ || !postinstall_action_->current_command() ||
         test_utils::Readlink(base::StringPrintf(
-            "/proc/%d/fd/0", postinstall_action_->current_command_)) !=
+            "/proc/%d/fd/0", postinstall_action_->current_command())) !=
             "/dev/zero") {
       // We need to wait for the postinstall command to start and flag that it
       // is ready by redirecting its input to /dev/zero.
@@ -139,7 +139,7 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void CancelWhenStarted() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_) {
+    if (!postinstall_action_ || !postinstall_action_->current_command()) {
       // Wait for the postinstall command to run.
       loop_.PostDelayedTask(
           FROM_HERE,
@@ -250,28 +250,54 @@ TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
   testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
   action.set_delegate(&mock_delegate_);
 
-  action.current_partition_ = 1;
   action.partition_weight_ = {1, 2, 5};
-  action.accumulated_weight_ = 1;
+  action.partition_progress_ = {1, 0, 0};
   action.total_weight_ = 8;
 
   // 50% of the second action is 2/8 = 0.25 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.25));
-  action.ProcessProgressLine("global_progress 0.5");
+  action.ProcessProgressLine(1, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // 1.5 should be read as 100%, to catch rounding error cases like 1.000001.
   // 100% of the second is 3/8 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.375));
-  action.ProcessProgressLine("global_progress 1.5");
+  action.ProcessProgressLine(1, "global_progress 1.5");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // The progress of the partitions running concurrently adds up.
+  // (1 + 2 + 5 * 0.5) / 8 = 0.6875
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.6875));
+  action.ProcessProgressLine(2, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // None of these should trigger a progress update.
-  action.ProcessProgressLine("foo_bar");
-  action.ProcessProgressLine("global_progress");
-  action.ProcessProgressLine("global_progress ");
-  action.ProcessProgressLine("global_progress NaN");
-  action.ProcessProgressLine("global_progress Exception in ... :)");
+  action.ProcessProgressLine(1, "foo_bar");
+  action.ProcessProgressLine(1, "global_progress");
+  action.ProcessProgressLine(1, "global_progress ");
+  action.ProcessProgressLine(1, "global_progress NaN");
+  action.ProcessProgressLine(1, "global_progress Exception in ... :)");
+}
+
+TEST_F(PostinstallRunnerActionTest, DependsOnRunningPartitionTest) {
+  PostinstallRunnerAction action(&fake_boot_control_, &fake_hardware_);
+  InstallPlan::Partition part;
+  part.name = "system";
+  action.install_plan_.partitions.push_back(part);
+  part.name = "vendor";
+  action.install_plan_.partitions.push_back(part);
+  part.name = "product";
+  part.postinstall_depends_on = {"system"};
+  action.install_plan_.partitions.push_back(part);
+
+  EXPECT_FALSE(action.DependsOnRunningPartition(2));
+  action.runs_.push_back(
+      std::make_unique<PostinstallRunnerAction::PostinstallRun>());
+  action.runs_.back()->partition = 1;
+  EXPECT_FALSE(action.DependsOnRunningPartition(2));
+  action.runs_.back()->partition = 0;
+  EXPECT_TRUE(action.DependsOnRunningPartition(2));
+  EXPECT_FALSE(action.DependsOnRunningPartition(1));
 }
 
 // Test that postinstall succeeds in the simple case of running the default
@@ -378,6 +404,31 @@ TEST_F(PostinstallRunnerActionTest, RunAsRootSkipOptionalPostinstallTest) {
   EXPECT_EQ(ErrorCode::kPostinstallRunnerError, processor_delegate_.code_);
 }
 
+// Test that the postinstall of several partitions can run at once, each one
+// mounted at its own mount point.
+TEST_F(PostinstallRunnerActionTest, RunAsRootConcurrentPostinstallTest) {
+  ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
+  InstallPlan::Partition part;
+  part.target_path = loop.dev();
+  part.readonly_target_path = loop.dev();
+  part.run_postinstall = true;
+  part.postinstall_path = "bin/postinst_progress";
+  InstallPlan install_plan;
+  for (const char* name : {"system", "vendor", "product"}) {
+    part.name = name;
+    install_plan.partitions.push_back(part);
+  }
+  install_plan.partitions.back().postinstall_depends_on = {"system"};
+  install_plan.download_url = "http://127.0.0.1:8080/update";
+  install_plan.postinstall_concurrency = 2;
+
+  testing::NiceMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(1.)).Times(testing::AtLeast(1));
+  setup_action_delegate_ = &mock_delegate_;
+  RunPostinstallActionWithInstallPlan(install_plan);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+}
+
 // Check that the failures from the postinstall script cause the action to
 // fail.
 TEST_F(PostinstallRunnerActionTest, RunAsRootErrScriptTest) {
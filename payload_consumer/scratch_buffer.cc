@@ -0,0 +1,61 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/scratch_buffer.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+ScratchBuffer::~ScratchBuffer() {
+  if (mapped_)
+    munmap(data_, size_);
+}
+
+bool ScratchBuffer::Init(size_t size, bool spill) {
+  TEST_AND_RETURN_FALSE(data_ == nullptr && !mapped_);
+  size_ = size;
+  if (!spill || size == 0) {
+    buffer_ = AlignedBufferPool::Get()->Acquire(size);
+    TEST_AND_RETURN_FALSE(size == 0 || !buffer_.empty());
+    blob_memory_.Set(size);
+    data_ = buffer_.data();
+    return true;
+  }
+
+  std::string path;
+  int fd = -1;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("apply_scratch.XXXXXX", &path, &fd));
+  ScopedFdCloser fd_closer(&fd);
+  // The file goes away with the mapping.
+  unlink(path.c_str());
+  TEST_AND_RETURN_FALSE_ERRNO(ftruncate(fd, size) == 0);
+  void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(mapped != MAP_FAILED);
+  data_ = static_cast<uint8_t*>(mapped);
+  mapped_ = true;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
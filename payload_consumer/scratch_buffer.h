@@ -0,0 +1,62 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <base/macros.h>
+
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/payload_consumer/aligned_buffer_pool.h"
+
+namespace chromeos_update_engine {
+
+// ScratchBuffer holds the whole source or target data of a diff operation.
+// Beyond the apply memory budget, it maps an unlinked scratch file instead of
+// allocating memory. The kernel can then write its pages back and reclaim
+// them under memory pressure, where anonymous memory would stay resident on
+// devices without swap and get the update killed. The memory is taken from
+// the AlignedBufferPool, and isn't initialized.
+class ScratchBuffer {
+ public:
+  ScratchBuffer() = default;
+  ~ScratchBuffer();
+
+  // Allocates |size| bytes, in a scratch file if |spill| is true. Returns
+  // false if the scratch file can't be created or mapped.
+  bool Init(size_t size, bool spill);
+
+  uint8_t* data() { return data_; }
+  size_t size() const { return size_; }
+  // Whether the data is in a scratch file.
+  bool spilled() const { return mapped_; }
+
+ private:
+  PooledBuffer buffer_;
+  MemoryCharge blob_memory_{MemoryTag::kDiffData};
+  uint8_t* data_{nullptr};
+  size_t size_{0};
+  bool mapped_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ScratchBuffer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SCRATCH_BUFFER_H_
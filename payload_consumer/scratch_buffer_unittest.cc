@@ -0,0 +1,50 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/scratch_buffer.h"
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(ScratchBufferTest, InMemoryTest) {
+  ScratchBuffer buffer;
+  ASSERT_TRUE(buffer.Init(10, false));
+  EXPECT_FALSE(buffer.spilled());
+  EXPECT_EQ(10u, buffer.size());
+  memset(buffer.data(), 0x55, buffer.size());
+  EXPECT_FALSE(buffer.Init(10, false));
+}
+
+TEST(ScratchBufferTest, SpilledTest) {
+  const size_t kSize = 3 * 4096 + 1;
+  ScratchBuffer buffer;
+  ASSERT_TRUE(buffer.Init(kSize, true));
+  EXPECT_TRUE(buffer.spilled());
+  EXPECT_EQ(kSize, buffer.size());
+  // Starts zeroed like the file it maps.
+  EXPECT_EQ(0, buffer.data()[kSize - 1]);
+  memset(buffer.data(), 0xaa, kSize);
+  EXPECT_EQ(0xaa, buffer.data()[kSize - 1]);
+
+  ScratchBuffer empty;
+  ASSERT_TRUE(empty.Init(0, true));
+  EXPECT_FALSE(empty.spilled());
+}
+
+}  // namespace chromeos_update_engine
@@ -28,8 +28,33 @@ namespace chromeos_update_engine {
 bool SnapshotExtentWriter::WriteExtent(const void* bytes,
                                        const Extent& extent,
                                        size_t block_size) {
-  return cow_writer_->AddRawBlocks(
-      extent.start_block(), bytes, extent.num_blocks() * block_size);
+  const size_t size = extent.num_blocks() * block_size;
+  if (!batch_.empty() &&
+      (extent.start_block() !=
+           batch_start_block_ + batch_.size() / block_size ||
+       batch_.size() + size > batch_size_)) {
+    TEST_AND_RETURN_FALSE(Flush());
+  }
+  // Large extents are passed through without copying them.
+  if (batch_.empty() && size >= batch_size_) {
+    return cow_writer_->AddRawBlocks(extent.start_block(), bytes, size);
+  }
+  if (batch_.empty()) {
+    batch_start_block_ = extent.start_block();
+  }
+  const auto data = static_cast<const uint8_t*>(bytes);
+  batch_.insert(batch_.end(), data, data + size);
+  return true;
+}
+
+bool SnapshotExtentWriter::Flush() {
+  if (batch_.empty()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(cow_writer_->AddRawBlocks(
+      batch_start_block_, batch_.data(), batch_.size()));
+  batch_.clear();
+  return true;
 }
 
 }  // namespace chromeos_update_engine
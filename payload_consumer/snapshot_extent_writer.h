@@ -27,16 +27,28 @@
 
 namespace chromeos_update_engine {
 
+// Writes extents to the COW as raw blocks. Consecutive extents that are
+// contiguous on disk are batched, up to |batch_size| bytes, and submitted in a
+// single AddRawBlocks() call so the COW writer compresses and writes larger
+// units.
 class SnapshotExtentWriter final : public BlockExtentWriter {
  public:
-  explicit SnapshotExtentWriter(android::snapshot::ICowWriter* cow_writer)
-      : cow_writer_(cow_writer) {}
+  static constexpr size_t kDefaultBatchSize = 2 * 1024 * 1024;
+
+  explicit SnapshotExtentWriter(android::snapshot::ICowWriter* cow_writer,
+                                size_t batch_size = kDefaultBatchSize)
+      : cow_writer_(cow_writer), batch_size_(batch_size) {}
   bool WriteExtent(const void* bytes,
                    const Extent& extent,
                    size_t block_size) override;
+  bool Flush() override;
 
  private:
   android::snapshot::ICowWriter* cow_writer_;
+  const size_t batch_size_;
+  // Data of the extents not submitted yet, starting at |batch_start_block_|.
+  std::vector<uint8_t> batch_;
+  uint64_t batch_start_block_{0};
 };
 
 }  // namespace chromeos_update_engine
@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <map>
@@ -193,4 +194,45 @@ TEST_F(SnapshotExtentWriterTest, WriteAcrossBlockBoundary) {
                      cow_writer_.operations_[125].data.end());
   ASSERT_EQ(buf, actual_data);
 }
+
+TEST_F(SnapshotExtentWriterTest, BatchContiguousExtents) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  AddExtent(&extents, 10, 1);
+  AddExtent(&extents, 11, 2);
+  AddExtent(&extents, 20, 1);
+  writer_.Init(extents, kBlockSize);
+
+  std::vector<uint8_t> buf(kBlockSize * 4);
+  std::iota(buf.begin(), buf.end(), 0);
+  // Feed the data in small chunks, the contiguous extents should still be
+  // submitted together.
+  for (size_t offset = 0; offset < buf.size(); offset += 1000) {
+    ASSERT_TRUE(writer_.Write(buf.data() + offset,
+                              std::min<size_t>(1000, buf.size() - offset)));
+  }
+  ASSERT_EQ(cow_writer_.operations_.size(), 2U);
+  ASSERT_EQ(std::vector<uint8_t>(buf.begin(), buf.begin() + kBlockSize * 3),
+            cow_writer_.operations_[10].data);
+  ASSERT_EQ(std::vector<uint8_t>(buf.begin() + kBlockSize * 3, buf.end()),
+            cow_writer_.operations_[20].data);
+}
+
+TEST_F(SnapshotExtentWriterTest, BatchSizeLimit) {
+  SnapshotExtentWriter writer{&cow_writer_, kBlockSize * 2};
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  AddExtent(&extents, 10, 1);
+  AddExtent(&extents, 11, 1);
+  AddExtent(&extents, 12, 1);
+  AddExtent(&extents, 13, 3);
+  writer.Init(extents, kBlockSize);
+
+  std::vector<uint8_t> buf(kBlockSize * 6);
+  std::iota(buf.begin(), buf.end(), 0);
+  ASSERT_TRUE(writer.Write(buf.data(), buf.size()));
+  ASSERT_EQ(cow_writer_.operations_.size(), 3U);
+  ASSERT_EQ(kBlockSize * 2, cow_writer_.operations_[10].data.size());
+  ASSERT_EQ(kBlockSize, cow_writer_.operations_[12].data.size());
+  ASSERT_EQ(kBlockSize * 3, cow_writer_.operations_[13].data.size());
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_cache_warmer.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <android-base/unique_fd.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/io_policy_file_descriptor.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Nice value of the warming thread, the lowest CPU priority.
+constexpr int kWarmerNiceValue = 19;
+
+// Returns the MemAvailable of /proc/meminfo in bytes, 0 if unknown.
+uint64_t GetMemAvailable() {
+  std::string meminfo;
+  if (!base::ReadFileToString(base::FilePath("/proc/meminfo"), &meminfo))
+    return 0;
+  for (const auto& line : base::SplitStringPiece(
+           meminfo, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (!base::StartsWith(line, "MemAvailable:", base::CompareCase::SENSITIVE))
+      continue;
+    const auto fields = base::SplitStringPiece(
+        line, " ", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    uint64_t kib = 0;
+    if (fields.size() == 3 && base::StringToUint64(fields[1], &kib))
+      return kib * 1024;
+  }
+  return 0;
+}
+}  // namespace
+
+SourceCacheWarmer::SourceCacheWarmer(std::vector<Partition> partitions,
+                                     size_t block_size,
+                                     uint64_t budget)
+    : partitions_(std::move(partitions)),
+      block_size_(block_size),
+      budget_(budget) {
+  source_bytes_before_.push_back(0);
+  for (const Partition& partition : partitions_) {
+    for (const InstallOperation& operation :
+         partition.partition_update->operations()) {
+      source_bytes_before_.push_back(source_bytes_before_.back() +
+                                     SourceBytes(partition, operation));
+    }
+    partition_ends_.push_back(source_bytes_before_.size() - 1);
+  }
+}
+
+SourceCacheWarmer::~SourceCacheWarmer() {
+  Stop();
+}
+
+uint64_t SourceCacheWarmer::GetBudget(uint64_t max_bytes) {
+  const uint64_t mem_available = GetMemAvailable();
+  if (mem_available == 0)
+    return max_bytes;
+  return std::min(max_bytes, mem_available / 4);
+}
+
+void SourceCacheWarmer::Start(size_t first_operation) {
+  if (thread_.joinable())
+    return;
+  next_to_apply_ = first_operation;
+  thread_ = std::thread(&SourceCacheWarmer::WarmLoop, this, first_operation);
+}
+
+void SourceCacheWarmer::OperationStarted(size_t operation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  next_to_apply_ = std::max(next_to_apply_, operation + 1);
+  cond_.notify_one();
+}
+
+void SourceCacheWarmer::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    cond_.notify_one();
+  }
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void SourceCacheWarmer::WarmLoop(size_t first_operation) {
+  // Only a hint, the warming is still paced if these fail.
+  if (setpriority(PRIO_PROCESS, gettid(), kWarmerNiceValue) != 0)
+    PLOG(WARNING) << "Unable to lower the priority of the warming thread";
+  int idle_io_priority = -1;
+  if (ParseIoPriority("idle", &idle_io_priority))
+    SetThreadIoPriority(idle_io_priority);
+
+  const size_t num_operations = source_bytes_before_.size() - 1;
+  size_t partition_index = partitions_.size();
+  android::base::unique_fd fd;
+  for (size_t next = first_operation; next < num_operations; next++) {
+    {
+      // Wait until warming |next| keeps the warmed data within the budget.
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        if (stop_)
+          return;
+        // Too late for the operations already started.
+        next = std::max(next, next_to_apply_);
+        if (next >= num_operations)
+          return;
+        if (source_bytes_before_[next + 1] -
+                source_bytes_before_[next_to_apply_] <=
+            budget_) {
+          break;
+        }
+        cond_.wait(lock);
+      }
+    }
+
+    const size_t index =
+        std::upper_bound(partition_ends_.begin(), partition_ends_.end(), next) -
+        partition_ends_.begin();
+    const size_t partition_start = index ? partition_ends_[index - 1] : 0;
+    if (index != partition_index) {
+      partition_index = index;
+      fd.reset();
+      // Partitions new in the target slot have no source.
+      if (partitions_[index].source_path.empty())
+        continue;
+      fd.reset(HANDLE_EINTR(open(partitions_[index].source_path.c_str(),
+                                 O_RDONLY | O_CLOEXEC)));
+      if (!fd.ok()) {
+        PLOG(WARNING) << "Unable to open "
+                      << partitions_[index].source_path
+                      << ", not warming its source extents.";
+      }
+    }
+    if (!fd.ok() ||
+        source_bytes_before_[next + 1] == source_bytes_before_[next]) {
+      continue;
+    }
+    const InstallOperation& operation =
+        partitions_[index].partition_update->operations(next - partition_start);
+    if (!Warm(fd.get(), operation)) {
+      if (stop_)
+        return;
+      // Skip the rest of the partition.
+      fd.reset();
+    }
+  }
+}
+
+bool SourceCacheWarmer::Warm(int fd, const InstallOperation& operation) {
+  const uint64_t source_bytes =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  brillo::Blob buffer(std::min<uint64_t>(kReadSize, source_bytes));
+  for (const Extent& extent : operation.src_extents()) {
+    uint64_t offset = extent.start_block() * block_size_;
+    uint64_t remaining = extent.num_blocks() * block_size_;
+    while (remaining > 0) {
+      if (stop_)
+        return false;
+      const size_t count = std::min<uint64_t>(remaining, buffer.size());
+      ssize_t bytes_read = 0;
+      if (!utils::PReadAll(fd, buffer.data(), count, offset, &bytes_read)) {
+        PLOG(WARNING) << "Unable to read the source extents to warm.";
+        return false;
+      }
+      if (bytes_read == 0) {
+        LOG(WARNING) << "The source extents to warm are past the end of the "
+                        "partition.";
+        return false;
+      }
+      offset += bytes_read;
+      remaining -= bytes_read;
+      bytes_warmed_ += bytes_read;
+    }
+  }
+  return true;
+}
+
+uint64_t SourceCacheWarmer::SourceBytes(
+    const Partition& partition, const InstallOperation& operation) const {
+  if (partition.skip_identity_copies && IsIdentityCopy(operation))
+    return 0;
+  return utils::BlocksInExtents(operation.src_extents()) * block_size_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_CACHE_WARMER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_CACHE_WARMER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// SourceCacheWarmer reads the source extents of the operations of the whole
+// payload ahead of the operation being applied, on a background thread with
+// the idle CPU and I/O priorities, so that they're in the page cache by the
+// time the operations read them. While the download is the bottleneck the
+// source partitions are otherwise untouched, and the idle I/O class keeps the
+// warming out of the way of the install's own reads and writes once it isn't.
+//
+// At most |budget| bytes of source data are warmed ahead of the next operation
+// to apply, so that the warmed pages aren't evicted before they're read.
+class SourceCacheWarmer {
+ public:
+  // The source partition of a partition of the payload.
+  struct Partition {
+    std::string source_path;
+    const PartitionUpdate* partition_update;
+    // Whether the SOURCE_COPY operations to the same blocks aren't read, as
+    // for the writers of a snapshot of the source.
+    bool skip_identity_copies{false};
+  };
+
+  // Bytes read at once from the source partitions.
+  static constexpr size_t kReadSize = 1024 * 1024;
+
+  // |partitions| are in payload order, the operations are counted over all of
+  // them.
+  SourceCacheWarmer(std::vector<Partition> partitions,
+                    size_t block_size,
+                    uint64_t budget);
+  ~SourceCacheWarmer();
+
+  // Returns |max_bytes|, or a quarter of the memory available on the device if
+  // that's less.
+  static uint64_t GetBudget(uint64_t max_bytes);
+
+  // Starts warming from operation |first_operation|, the next one to apply.
+  void Start(size_t first_operation);
+
+  // Called when |operation| starts being applied.
+  void OperationStarted(size_t operation);
+
+  // Stops the warming thread. Safe to call multiple times.
+  void Stop();
+
+  // Bytes of source data read so far.
+  uint64_t bytes_warmed() const { return bytes_warmed_; }
+
+ private:
+  // Main loop of the warming thread.
+  void WarmLoop(size_t first_operation);
+
+  // Reads the source extents of |operation| from |fd|. Returns false if
+  // reading failed or the warmer was stopped.
+  bool Warm(int fd, const InstallOperation& operation);
+
+  // Returns the source bytes read by |operation| of |partition|.
+  uint64_t SourceBytes(const Partition& partition,
+                       const InstallOperation& operation) const;
+
+  const std::vector<Partition> partitions_;
+  const size_t block_size_;
+  const uint64_t budget_;
+
+  // Number of operations in the partitions up to each one, and the source
+  // bytes of the operations before each one.
+  std::vector<size_t> partition_ends_;
+  std::vector<uint64_t> source_bytes_before_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // The first operation that didn't start being applied.
+  size_t next_to_apply_{0};
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> bytes_warmed_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceCacheWarmer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_CACHE_WARMER_H_
@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_cache_warmer.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+class SourceCacheWarmerTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kBlockSize = 4096;
+
+  void SetUp() override {
+    source_ =
+        std::make_unique<ScopedTempFile>("source-XXXXXX", false, 1024 * 1024);
+  }
+
+  // Adds an operation copying |num_blocks| source blocks from |start_block|
+  // to block 10, or a REPLACE if |num_blocks| is 0.
+  void AddOperation(PartitionUpdate* partition_update,
+                    uint64_t start_block,
+                    uint64_t num_blocks) {
+    InstallOperation* op = partition_update->add_operations();
+    op->set_type(num_blocks ? InstallOperation::SOURCE_COPY
+                            : InstallOperation::REPLACE);
+    if (num_blocks)
+      *op->add_src_extents() = ExtentForRange(start_block, num_blocks);
+    *op->add_dst_extents() = ExtentForRange(10, num_blocks ? num_blocks : 1);
+  }
+
+  // Waits until |warmer| read |bytes|, then a little more to check that it
+  // stops there.
+  void ExpectBytesWarmed(const SourceCacheWarmer& warmer, uint64_t bytes) {
+    for (int i = 0; i < 10000 && warmer.bytes_warmed() < bytes; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(bytes, warmer.bytes_warmed());
+  }
+
+  std::unique_ptr<ScopedTempFile> source_;
+};
+
+TEST_F(SourceCacheWarmerTest, BudgetTest) {
+  PartitionUpdate partition_update;
+  for (size_t i = 0; i < 10; i++)
+    AddOperation(&partition_update, i, 1);
+  SourceCacheWarmer warmer({{source_->path(), &partition_update}},
+                           kBlockSize,
+                           3 * kBlockSize);
+  warmer.Start(0);
+  ExpectBytesWarmed(warmer, 3 * kBlockSize);
+
+  // Operations 2 to 4 fit in the budget once operation 1 started.
+  warmer.OperationStarted(1);
+  ExpectBytesWarmed(warmer, 5 * kBlockSize);
+  // The operations already started aren't warmed.
+  warmer.OperationStarted(8);
+  ExpectBytesWarmed(warmer, 6 * kBlockSize);
+  warmer.Stop();
+  warmer.Stop();
+}
+
+TEST_F(SourceCacheWarmerTest, SkippedOperationsTest) {
+  PartitionUpdate missing_partition;
+  AddOperation(&missing_partition, 0, 1);
+  PartitionUpdate new_partition;
+  AddOperation(&new_partition, 0, 1);
+  PartitionUpdate vabc_partition;
+  AddOperation(&vabc_partition, 0, 0);
+  // Identity copy.
+  AddOperation(&vabc_partition, 10, 2);
+  AddOperation(&vabc_partition, 0, 2);
+  // Past the end of the source.
+  AddOperation(&vabc_partition, 1024 * 1024 / kBlockSize, 1);
+  AddOperation(&vabc_partition, 0, 1);
+  SourceCacheWarmer warmer({{"/nonexistent", &missing_partition},
+                            {"", &new_partition},
+                            {source_->path(), &vabc_partition, true}},
+                           kBlockSize,
+                           100 * kBlockSize);
+  warmer.Start(0);
+  // The rest of a partition past an unreadable extent is skipped.
+  ExpectBytesWarmed(warmer, 2 * kBlockSize);
+}
+
+TEST_F(SourceCacheWarmerTest, GetBudgetTest) {
+  EXPECT_EQ(4096u, SourceCacheWarmer::GetBudget(4096));
+  EXPECT_LT(SourceCacheWarmer::GetBudget(UINT64_MAX), UINT64_MAX);
+}
+
+}  // namespace chromeos_update_engine
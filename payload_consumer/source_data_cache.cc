@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_data_cache.h"
+
+#include <utility>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+std::string MakeKey(const FileDescriptorPtr& source_fd,
+                    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  const FileDescriptor* fd = source_fd.get();
+  std::string key(reinterpret_cast<const char*>(&fd), sizeof(fd));
+  for (const Extent& extent : extents) {
+    const uint64_t values[] = {extent.start_block(), extent.num_blocks()};
+    key.append(reinterpret_cast<const char*>(values), sizeof(values));
+  }
+  return key;
+}
+}  // namespace
+
+std::shared_ptr<const brillo::Blob> SourceDataCache::Read(
+    const FileDescriptorPtr& source_fd,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    size_t block_size) {
+  std::string key = MakeKey(source_fd, extents);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    num_hits_++;
+    return it->second->data;
+  }
+
+  auto data = std::make_shared<brillo::Blob>();
+  if (!utils::ReadExtents(source_fd, extents, data.get(), block_size))
+    return nullptr;
+  if (data->size() > max_size_)
+    return data;
+  while (size_ + data->size() > max_size_) {
+    size_ -= entries_.back().data->size();
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+  entries_.push_front({std::move(key), source_fd, data});
+  index_[entries_.front().key] = entries_.begin();
+  size_ += data->size();
+  memory_.Set(size_);
+  return data;
+}
+
+void SourceDataCache::Clear() {
+  entries_.clear();
+  index_.clear();
+  size_ = 0;
+  memory_.Set(0);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,80 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/memory_accounting.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// SourceDataCache keeps the source data of the last diff operations of a
+// partition, keyed by their source extents, so that the operations patching
+// the same source, like the pieces of an APK split over several PUFFDIFF
+// operations, read it only once. The source partition isn't written during
+// the update, so the cached data stays valid.
+class SourceDataCache {
+ public:
+  // Keeps at most |max_size| bytes, evicting the least recently used data
+  // first.
+  explicit SourceDataCache(uint64_t max_size) : max_size_(max_size) {}
+
+  // Returns the data of |extents| in |source_fd|, reading it unless it's
+  // cached. Returns nullptr if it can't be read.
+  std::shared_ptr<const brillo::Blob> Read(
+      const FileDescriptorPtr& source_fd,
+      const google::protobuf::RepeatedPtrField<Extent>& extents,
+      size_t block_size);
+
+  void Clear();
+
+  // Total size of the cached data in bytes.
+  uint64_t size() const { return size_; }
+  // Number of Read() calls served from the cache.
+  size_t num_hits() const { return num_hits_; }
+
+ private:
+  struct Entry {
+    std::string key;
+    // Kept so that the key isn't reused by another file at the same address.
+    FileDescriptorPtr source_fd;
+    std::shared_ptr<const brillo::Blob> data;
+  };
+
+  const uint64_t max_size_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::map<std::string, std::list<Entry>::iterator> index_;
+  uint64_t size_{0};
+  MemoryCharge memory_{MemoryTag::kDiffData};
+  size_t num_hits_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceDataCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_DATA_CACHE_H_
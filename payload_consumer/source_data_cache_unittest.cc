@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_data_cache.h"
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+class SourceDataCacheTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kBlockSize = 4096;
+
+  void SetUp() override {
+    fake_fd_ = std::make_shared<FakeFileDescriptor>();
+    ASSERT_TRUE(fake_fd_->Open("fake", 0));
+    fake_fd_->SetFileSize(16 * kBlockSize);
+  }
+
+  google::protobuf::RepeatedPtrField<Extent> Extents(uint64_t start_block,
+                                                     uint64_t num_blocks) {
+    google::protobuf::RepeatedPtrField<Extent> extents;
+    *extents.Add() = ExtentForRange(start_block, num_blocks);
+    return extents;
+  }
+
+  std::shared_ptr<FakeFileDescriptor> fake_fd_;
+};
+
+TEST_F(SourceDataCacheTest, ReadsOnceTest) {
+  SourceDataCache cache(4 * kBlockSize);
+  auto data = cache.Read(fake_fd_, Extents(0, 2), kBlockSize);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ(FakeFileDescriptorData(2 * kBlockSize), *data);
+  const size_t num_reads = fake_fd_->GetReadOps().size();
+
+  EXPECT_EQ(data, cache.Read(fake_fd_, Extents(0, 2), kBlockSize));
+  EXPECT_EQ(num_reads, fake_fd_->GetReadOps().size());
+  EXPECT_EQ(1u, cache.num_hits());
+  EXPECT_EQ(2 * kBlockSize, cache.size());
+
+  // Other extents, or the same ones of another file, are read.
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(0, 1), kBlockSize));
+  auto other_fd = std::make_shared<FakeFileDescriptor>();
+  ASSERT_TRUE(other_fd->Open("other", 0));
+  ASSERT_NE(nullptr, cache.Read(other_fd, Extents(0, 1), kBlockSize));
+  EXPECT_EQ(1u, cache.num_hits());
+  EXPECT_EQ(4 * kBlockSize, cache.size());
+}
+
+TEST_F(SourceDataCacheTest, EvictsLeastRecentlyUsedTest) {
+  SourceDataCache cache(3 * kBlockSize);
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(0, 1), kBlockSize));
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(1, 1), kBlockSize));
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(2, 1), kBlockSize));
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(0, 1), kBlockSize));
+  // Evicts the block 1, read the longest ago.
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(3, 1), kBlockSize));
+  EXPECT_EQ(3 * kBlockSize, cache.size());
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(0, 1), kBlockSize));
+  EXPECT_EQ(2u, cache.num_hits());
+  ASSERT_NE(nullptr, cache.Read(fake_fd_, Extents(1, 1), kBlockSize));
+  EXPECT_EQ(2u, cache.num_hits());
+
+  // Larger than the whole cache, returned but not kept.
+  auto data = cache.Read(fake_fd_, Extents(4, 4), kBlockSize);
+  ASSERT_NE(nullptr, data);
+  EXPECT_EQ(4 * kBlockSize, data->size());
+  EXPECT_EQ(3 * kBlockSize, cache.size());
+
+  fake_fd_->AddFailureRange(10 * kBlockSize, kBlockSize);
+  EXPECT_EQ(nullptr, cache.Read(fake_fd_, Extents(10, 1), kBlockSize));
+
+  cache.Clear();
+  EXPECT_EQ(0u, cache.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+SourcePrefetcher::SourcePrefetcher(const PartitionUpdate& partition_update,
+                                   size_t block_size,
+                                   bool skip_identity_copies)
+    : partition_update_(partition_update),
+      block_size_(block_size),
+      skip_identity_copies_(skip_identity_copies) {}
+
+void SourcePrefetcher::Open(const std::string& source_path) {
+  fd_.reset(open(source_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd_.ok()) {
+    PLOG(WARNING) << "Unable to open " << source_path
+                  << ", not prefetching source extents.";
+  }
+}
+
+void SourcePrefetcher::OperationStarted(const InstallOperation& operation) {
+  if (!fd_.ok())
+    return;
+  const std::optional<size_t> index = FindOperation(operation);
+  if (!index)
+    return;
+
+  // Whatever was prefetched for this operation and the ones before it is
+  // being read now.
+  while (!prefetched_.empty() && prefetched_.front().first <= *index) {
+    prefetched_bytes_ -= prefetched_.front().second;
+    prefetched_.pop_front();
+  }
+  if (next_prefetch_index_ <= *index) {
+    // Too late for this one, but the kernel merges it with the actual read.
+    next_prefetch_index_ = *index + 1;
+  }
+
+  const size_t num_operations = partition_update_.operations_size();
+  const size_t end = std::min(num_operations,
+                              *index + 1 + kMaxPrefetchOperations);
+  while (next_prefetch_index_ < end && prefetched_bytes_ < kMaxPrefetchBytes) {
+    const InstallOperation& next =
+        partition_update_.operations(next_prefetch_index_);
+    const uint64_t bytes = SourceBytes(next);
+    if (bytes > 0) {
+      Prefetch(next);
+      prefetched_.emplace_back(next_prefetch_index_, bytes);
+      prefetched_bytes_ += bytes;
+    }
+    next_prefetch_index_++;
+  }
+}
+
+std::optional<size_t> SourcePrefetcher::FindOperation(
+    const InstallOperation& operation) {
+  const size_t num_operations = partition_update_.operations_size();
+  for (size_t i = next_search_index_; i < num_operations; i++) {
+    if (&partition_update_.operations(i) == &operation) {
+      next_search_index_ = i + 1;
+      return i;
+    }
+  }
+  // Started out of order, e.g. after resuming.
+  for (size_t i = 0; i < next_search_index_ && i < num_operations; i++) {
+    if (&partition_update_.operations(i) == &operation) {
+      next_search_index_ = i + 1;
+      // Start over from this operation.
+      prefetched_.clear();
+      prefetched_bytes_ = 0;
+      next_prefetch_index_ = i + 1;
+      return i;
+    }
+  }
+  return std::nullopt;
+}
+
+uint64_t SourcePrefetcher::SourceBytes(
+    const InstallOperation& operation) const {
+  if (skip_identity_copies_ && IsIdentityCopy(operation))
+    return 0;
+  return utils::BlocksInExtents(operation.src_extents()) * block_size_;
+}
+
+void SourcePrefetcher::Prefetch(const InstallOperation& operation) {
+  for (const Extent& extent : operation.src_extents()) {
+    // Only a hint, the data is read anyway if this fails.
+    int err = posix_fadvise(fd_.get(),
+                            extent.start_block() * block_size_,
+                            extent.num_blocks() * block_size_,
+                            POSIX_FADV_WILLNEED);
+    if (err != 0) {
+      LOG(WARNING) << "posix_fadvise failed: " << err
+                   << ", not prefetching source extents anymore.";
+      fd_.reset();
+      return;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
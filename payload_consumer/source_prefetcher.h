@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// SourcePrefetcher asks the kernel to read the source extents of the
+// operations following the one being applied, so they're already in the page
+// cache when those operations read them. Source reads are scattered all over
+// the partition, which the kernel's own readahead doesn't help with.
+//
+// At most |kMaxPrefetchOperations| operations, and |kMaxPrefetchBytes| bytes
+// of source data, are prefetched ahead of the operation being applied.
+class SourcePrefetcher {
+ public:
+  static constexpr size_t kMaxPrefetchOperations = 32;
+  static constexpr uint64_t kMaxPrefetchBytes = 32 * 1024 * 1024;
+
+  // With |skip_identity_copies|, the SOURCE_COPY operations to the same
+  // blocks aren't prefetched, for the writers that don't read them.
+  SourcePrefetcher(const PartitionUpdate& partition_update,
+                   size_t block_size,
+                   bool skip_identity_copies = false);
+
+  // Opens the source partition at |source_path|. Prefetching is only
+  // disabled if it fails.
+  void Open(const std::string& source_path);
+
+  // Called before |operation|, one of the operations of the partition, reads
+  // its source extents.
+  void OperationStarted(const InstallOperation& operation);
+
+ private:
+  FRIEND_TEST(SourcePrefetcherTest, PrefetchWindowTest);
+  FRIEND_TEST(SourcePrefetcherTest, MaxPrefetchBytesTest);
+  FRIEND_TEST(SourcePrefetcherTest, UnknownOperationTest);
+  FRIEND_TEST(SourcePrefetcherTest, SkipIdentityCopiesTest);
+
+  // Returns the index of |operation| in |partition_update_|.
+  std::optional<size_t> FindOperation(const InstallOperation& operation);
+
+  // Returns the number of source bytes read by |operation|.
+  uint64_t SourceBytes(const InstallOperation& operation) const;
+
+  // Issues the readahead of the source extents of |operation|.
+  void Prefetch(const InstallOperation& operation);
+
+  const PartitionUpdate& partition_update_;
+  const size_t block_size_;
+  const bool skip_identity_copies_;
+  android::base::unique_fd fd_;
+
+  // Where to start looking for the next started operation. Operations are
+  // usually started in order, so it's found right away.
+  size_t next_search_index_{0};
+  // Index of the first operation not prefetched yet.
+  size_t next_prefetch_index_{0};
+  // Source bytes of the prefetched operations that didn't start yet, in
+  // operation order, and their sum.
+  std::deque<std::pair<size_t, uint64_t>> prefetched_;
+  uint64_t prefetched_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourcePrefetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+class SourcePrefetcherTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kBlockSize = 4096;
+
+  void SetUp() override {
+    source_ =
+        std::make_unique<ScopedTempFile>("source-XXXXXX", false, 1024 * 1024);
+  }
+
+  // Adds an operation reading |num_blocks| source blocks, or none.
+  void AddOperation(uint64_t num_blocks) {
+    InstallOperation* op = partition_update_.add_operations();
+    op->set_type(num_blocks ? InstallOperation::SOURCE_COPY
+                            : InstallOperation::REPLACE);
+    if (num_blocks)
+      *op->add_src_extents() = ExtentForRange(0, num_blocks);
+    *op->add_dst_extents() = ExtentForRange(0, 1);
+  }
+
+  PartitionUpdate partition_update_;
+  std::unique_ptr<ScopedTempFile> source_;
+};
+
+TEST_F(SourcePrefetcherTest, PrefetchWindowTest) {
+  const size_t kNumOperations = SourcePrefetcher::kMaxPrefetchOperations * 3;
+  for (size_t i = 0; i < kNumOperations; i++)
+    AddOperation(i % 2);
+  SourcePrefetcher prefetcher(partition_update_, kBlockSize);
+  prefetcher.Open(source_->path());
+
+  prefetcher.OperationStarted(partition_update_.operations(0));
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchOperations + 1,
+            prefetcher.next_prefetch_index_);
+  // Only the operations reading source blocks are tracked.
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchOperations / 2,
+            prefetcher.prefetched_.size());
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchOperations / 2 * kBlockSize,
+            prefetcher.prefetched_bytes_);
+
+  prefetcher.OperationStarted(partition_update_.operations(5));
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchOperations + 6,
+            prefetcher.next_prefetch_index_);
+  EXPECT_EQ(7u, prefetcher.prefetched_.front().first);
+
+  // Going back to an earlier operation starts over from there.
+  prefetcher.OperationStarted(partition_update_.operations(1));
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchOperations + 2,
+            prefetcher.next_prefetch_index_);
+  EXPECT_EQ(3u, prefetcher.prefetched_.front().first);
+}
+
+TEST_F(SourcePrefetcherTest, MaxPrefetchBytesTest) {
+  const uint64_t kBlocksPerOperation =
+      SourcePrefetcher::kMaxPrefetchBytes / kBlockSize / 4;
+  for (size_t i = 0; i < 10; i++)
+    AddOperation(kBlocksPerOperation);
+  SourcePrefetcher prefetcher(partition_update_, kBlockSize);
+  prefetcher.Open(source_->path());
+
+  prefetcher.OperationStarted(partition_update_.operations(0));
+  EXPECT_EQ(4u, prefetcher.prefetched_.size());
+  EXPECT_EQ(SourcePrefetcher::kMaxPrefetchBytes, prefetcher.prefetched_bytes_);
+  prefetcher.OperationStarted(partition_update_.operations(1));
+  EXPECT_EQ(4u, prefetcher.prefetched_.size());
+  EXPECT_EQ(6u, prefetcher.next_prefetch_index_);
+}
+
+TEST_F(SourcePrefetcherTest, UnknownOperationTest) {
+  AddOperation(1);
+  AddOperation(1);
+  SourcePrefetcher prefetcher(partition_update_, kBlockSize);
+  prefetcher.Open(source_->path());
+
+  // A copy of an operation isn't one of the partition's operations.
+  InstallOperation op = partition_update_.operations(0);
+  prefetcher.OperationStarted(op);
+  EXPECT_EQ(0u, prefetcher.next_prefetch_index_);
+  EXPECT_TRUE(prefetcher.prefetched_.empty());
+}
+
+TEST_F(SourcePrefetcherTest, SkipIdentityCopiesTest) {
+  // The operations reading one block copy it to the same place.
+  for (size_t i = 0; i < 6; i++)
+    AddOperation(i % 2 + 1);
+  SourcePrefetcher prefetcher(
+      partition_update_, kBlockSize, /*skip_identity_copies=*/true);
+  prefetcher.Open(source_->path());
+
+  prefetcher.OperationStarted(partition_update_.operations(0));
+  ASSERT_EQ(3u, prefetcher.prefetched_.size());
+  EXPECT_EQ(1u, prefetcher.prefetched_.front().first);
+  EXPECT_EQ(3 * 2 * kBlockSize, prefetcher.prefetched_bytes_);
+}
+
+}  // namespace chromeos_update_engine
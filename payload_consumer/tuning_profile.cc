@@ -0,0 +1,278 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/tuning_profile.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <brillo/key_value_store.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const vector<size_t> kCalibrationIoSizes = {
+    128 * 1024, 512 * 1024, 2 * 1024 * 1024};
+
+namespace {
+// Size of the scratch file written and read back at every I/O size.
+constexpr uint64_t kCalibrationFileSize = 16 * 1024 * 1024;
+// Size of the data hashed.
+constexpr size_t kCpuBenchmarkSize = 8 * 1024 * 1024;
+// The smallest size within this fraction of the speed of the largest one is
+// picked.
+constexpr double kFastEnough = 0.9;
+
+constexpr char kBuildTimestampKey[] = "build_timestamp";
+constexpr char kReadSpeedsKey[] = "read_speeds";
+constexpr char kQueuedReadSpeedsKey[] = "queued_read_speeds";
+constexpr char kWriteSpeedsKey[] = "write_speeds";
+constexpr char kHashSpeedKey[] = "hash_speed";
+constexpr char kVerifyReadSizeKey[] = "verify_read_size";
+constexpr char kVerifyThreadsKey[] = "verify_threads";
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t Speed(uint64_t bytes, Clock::time_point start) {
+  const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                         Clock::now() - start)
+                         .count();
+  return bytes * 1000000 / std::max<int64_t>(us, 1);
+}
+
+string JoinSpeeds(const vector<uint64_t>& speeds) {
+  vector<string> values;
+  for (uint64_t speed : speeds)
+    values.push_back(base::NumberToString(speed));
+  return base::JoinString(values, ",");
+}
+
+bool SplitSpeeds(const string& value, vector<uint64_t>* speeds) {
+  speeds->clear();
+  for (const auto& piece : base::SplitStringPiece(
+           value, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    uint64_t speed = 0;
+    if (!base::StringToUint64(piece, &speed))
+      return false;
+    speeds->push_back(speed);
+  }
+  return speeds->size() == kCalibrationIoSizes.size();
+}
+
+bool GetUint64(const brillo::KeyValueStore& store,
+               const string& key,
+               uint64_t* value) {
+  string str;
+  return store.GetString(key, &str) && base::StringToUint64(str, value);
+}
+
+// Returns the index of the smallest I/O size almost as fast as the fastest.
+size_t PickIoSize(const vector<uint64_t>& speeds) {
+  const uint64_t max_speed = *std::max_element(speeds.begin(), speeds.end());
+  for (size_t i = 0; i < speeds.size(); i++) {
+    if (speeds[i] >= max_speed * kFastEnough)
+      return i;
+  }
+  return speeds.size() - 1;
+}
+
+// Rewrites the file open in |fd| in writes of |io_size| bytes.
+bool MeasureWrites(int fd, size_t io_size, uint64_t* speed) {
+  brillo::Blob data(io_size);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 131 + (i >> 12);
+  const Clock::time_point start = Clock::now();
+  for (uint64_t offset = 0; offset < kCalibrationFileSize; offset += io_size) {
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, data.data(), io_size, offset));
+  }
+  *speed = Speed(kCalibrationFileSize, start);
+  return true;
+}
+
+// Reads the file open in |fd| in reads of |io_size| bytes, with
+// |queue_depth| of them in flight. The file is dropped from the page cache
+// first.
+bool MeasureReads(int fd, size_t io_size, size_t queue_depth, uint64_t* speed) {
+  TEST_AND_RETURN_FALSE(fdatasync(fd) == 0);
+  TEST_AND_RETURN_FALSE(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+  std::atomic<uint64_t> next_offset{0};
+  std::atomic<bool> failed{false};
+  // Each thread reads the next chunk not read yet, so that |queue_depth|
+  // reads are in flight at once.
+  auto read_chunks = [&]() {
+    brillo::Blob data(io_size);
+    for (uint64_t offset = next_offset += io_size;
+         offset <= kCalibrationFileSize;
+         offset = next_offset += io_size) {
+      ssize_t bytes_read = 0;
+      if (!utils::PReadAll(
+              fd, data.data(), io_size, offset - io_size, &bytes_read) ||
+          bytes_read != static_cast<ssize_t>(io_size)) {
+        failed = true;
+        return;
+      }
+    }
+  };
+  const Clock::time_point start = Clock::now();
+  vector<std::thread> threads;
+  for (size_t i = 1; i < queue_depth; i++)
+    threads.emplace_back(read_chunks);
+  read_chunks();
+  for (auto& thread : threads)
+    thread.join();
+  *speed = Speed(kCalibrationFileSize, start);
+  return !failed;
+}
+
+bool MeasureHashSpeed(const brillo::Blob& data, uint64_t* speed) {
+  const Clock::time_point start = Clock::now();
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(hasher.Update(data.data(), data.size()));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *speed = Speed(data.size(), start);
+  return true;
+}
+}  // namespace
+
+string TuningProfile::ToString() const {
+  brillo::KeyValueStore store;
+  store.SetString(kBuildTimestampKey, base::NumberToString(build_timestamp));
+  store.SetString(kReadSpeedsKey, JoinSpeeds(read_speeds));
+  store.SetString(kQueuedReadSpeedsKey, JoinSpeeds(queued_read_speeds));
+  store.SetString(kWriteSpeedsKey, JoinSpeeds(write_speeds));
+  store.SetString(kHashSpeedKey, base::NumberToString(hash_speed));
+  store.SetString(kVerifyReadSizeKey, base::NumberToString(verify_read_size));
+  store.SetString(kVerifyThreadsKey, base::NumberToString(verify_threads));
+  return store.SaveToString();
+}
+
+bool TuningProfile::Load(const string& value) {
+  brillo::KeyValueStore store;
+  TEST_AND_RETURN_FALSE(store.LoadFromString(value));
+  string build_timestamp_str;
+  uint64_t verify_read_size_value = 0;
+  uint64_t verify_threads_value = 0;
+  TEST_AND_RETURN_FALSE(
+      store.GetString(kBuildTimestampKey, &build_timestamp_str) &&
+      base::StringToInt64(build_timestamp_str, &build_timestamp));
+  string speeds;
+  TEST_AND_RETURN_FALSE(store.GetString(kReadSpeedsKey, &speeds) &&
+                        SplitSpeeds(speeds, &read_speeds));
+  TEST_AND_RETURN_FALSE(store.GetString(kQueuedReadSpeedsKey, &speeds) &&
+                        SplitSpeeds(speeds, &queued_read_speeds));
+  TEST_AND_RETURN_FALSE(store.GetString(kWriteSpeedsKey, &speeds) &&
+                        SplitSpeeds(speeds, &write_speeds));
+  TEST_AND_RETURN_FALSE(GetUint64(store, kHashSpeedKey, &hash_speed));
+  TEST_AND_RETURN_FALSE(
+      GetUint64(store, kVerifyReadSizeKey, &verify_read_size_value));
+  TEST_AND_RETURN_FALSE(
+      GetUint64(store, kVerifyThreadsKey, &verify_threads_value));
+  verify_read_size = verify_read_size_value;
+  verify_threads = verify_threads_value;
+  return true;
+}
+
+void TuningProfile::PickParameters(size_t num_cpus) {
+  num_cpus = std::max<size_t>(num_cpus, 1);
+  const size_t read_index = PickIoSize(read_speeds);
+  verify_read_size = kCalibrationIoSizes[read_index];
+  const uint64_t read_speed =
+      *std::max_element(read_speeds.begin(), read_speeds.end());
+  // The threads of the verification read at once, which some storages serve
+  // faster than one read at a time.
+  const uint64_t verify_speed = std::max(
+      read_speed,
+      *std::max_element(queued_read_speeds.begin(), queued_read_speeds.end()));
+  // Enough partitions are hashed at once to keep up with the storage.
+  verify_threads = std::clamp<uint64_t>(
+      (verify_speed + hash_speed - 1) / std::max<uint64_t>(hash_speed, 1),
+      1,
+      num_cpus);
+}
+
+void TuningProfile::ApplyTo(InstallPlan* install_plan) const {
+  if (install_plan->verify_read_size == 0)
+    install_plan->verify_read_size = verify_read_size;
+  if (install_plan->verify_threads == 0)
+    install_plan->verify_threads = verify_threads;
+}
+
+bool CalibrateDevice(const base::FilePath& dir, TuningProfile* profile) {
+  const Clock::time_point start = Clock::now();
+  const string path = dir.Append("calibration.tmp").value();
+  int fd = HANDLE_EINTR(open(path.c_str(),
+                             O_RDWR | O_CREAT | O_TRUNC | O_DSYNC | O_CLOEXEC,
+                             0600));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to create " << path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  ScopedPathUnlinker unlinker(path);
+
+  profile->read_speeds.resize(kCalibrationIoSizes.size());
+  profile->queued_read_speeds.resize(kCalibrationIoSizes.size());
+  profile->write_speeds.resize(kCalibrationIoSizes.size());
+  // The first pass allocates the blocks of the file, which the later ones
+  // only overwrite like the updates do with the partitions.
+  uint64_t allocation_speed = 0;
+  TEST_AND_RETURN_FALSE(
+      MeasureWrites(fd, kCalibrationIoSizes.back(), &allocation_speed));
+  for (size_t i = 0; i < kCalibrationIoSizes.size(); i++) {
+    const size_t io_size = kCalibrationIoSizes[i];
+    TEST_AND_RETURN_FALSE(
+        MeasureWrites(fd, io_size, &profile->write_speeds[i]));
+    TEST_AND_RETURN_FALSE(
+        MeasureReads(fd, io_size, 1, &profile->read_speeds[i]));
+    TEST_AND_RETURN_FALSE(MeasureReads(
+        fd, io_size, kCalibrationQueueDepth, &profile->queued_read_speeds[i]));
+  }
+
+  brillo::Blob data(kCpuBenchmarkSize);
+  std::minstd_rand random(1);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = random();
+  TEST_AND_RETURN_FALSE(MeasureHashSpeed(data, &profile->hash_speed));
+
+  profile->PickParameters(std::thread::hardware_concurrency());
+  LOG(INFO) << "Calibrated in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   Clock::now() - start)
+                   .count()
+            << " ms, read speeds " << JoinSpeeds(profile->read_speeds)
+            << " B/s, queued " << JoinSpeeds(profile->queued_read_speeds)
+            << " B/s, write speeds " << JoinSpeeds(profile->write_speeds)
+            << " B/s, hash " << profile->hash_speed << " B/s.";
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_TUNING_PROFILE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_TUNING_PROFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <base/files/file_path.h>
+
+#include "update_engine/payload_consumer/install_plan.h"
+
+namespace chromeos_update_engine {
+
+// The sizes of the reads and writes measured by CalibrateDevice().
+extern const std::vector<size_t> kCalibrationIoSizes;
+// The number of threads reading at once for the queued read speeds.
+constexpr size_t kCalibrationQueueDepth = 4;
+
+// TuningProfile has the measured performance of the storage and the CPUs of
+// the device, and the engine parameters picked from it. Devices range from
+// eMMC to UFS 4.0, which no single set of defaults suits. The profile is only
+// measured on demand, and only used by the updates whose headers ask for it.
+// It sizes the reads of the verification and its threads, it never turns on
+// the optional paths of the engine.
+struct TuningProfile {
+  // The build the profile was measured on, as in
+  // HardwareInterface::GetBuildTimestamp().
+  int64_t build_timestamp{0};
+
+  // Bytes per second of the sequential reads and O_DSYNC writes of each of
+  // |kCalibrationIoSizes| bytes, the queued reads from
+  // |kCalibrationQueueDepth| threads at once, as the verification threads do.
+  // The write speeds are only logged.
+  std::vector<uint64_t> read_speeds;
+  std::vector<uint64_t> queued_read_speeds;
+  std::vector<uint64_t> write_speeds;
+  // Bytes per second one core hashes with SHA-256.
+  uint64_t hash_speed{0};
+
+  // The parameters picked, see InstallPlan.
+  size_t verify_read_size{0};
+  size_t verify_threads{0};
+
+  // Returns the profile as key=value lines, the format Load() parses.
+  std::string ToString() const;
+  // Returns false if |value| isn't a complete profile.
+  bool Load(const std::string& value);
+
+  // Picks the parameters from the measurements, with up to |num_cpus| cores.
+  void PickParameters(size_t num_cpus);
+
+  // Sets the parameters in |install_plan| the payload headers left unset.
+  void ApplyTo(InstallPlan* install_plan) const;
+};
+
+// Measures the speeds of |profile| with a scratch file in |dir|, removed
+// afterwards, and picks its parameters. On most devices /data is on the same
+// storage as the partitions. Takes about a second on UFS, a few on eMMC, so
+// it's only run on demand and never before an update.
+bool CalibrateDevice(const base::FilePath& dir, TuningProfile* profile);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_TUNING_PROFILE_H_
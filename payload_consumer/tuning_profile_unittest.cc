@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/tuning_profile.h"
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(TuningProfileTest, PickParametersTest) {
+  TuningProfile profile;
+  // 2 MiB reads aren't much faster than 512 KiB ones, queued reads are.
+  profile.read_speeds = {100, 190, 200};
+  profile.queued_read_speeds = {300, 500, 800};
+  profile.write_speeds = {50, 60, 100};
+  profile.hash_speed = 300;
+  profile.PickParameters(8);
+  EXPECT_EQ(kCalibrationIoSizes[1], profile.verify_read_size);
+  EXPECT_EQ(3u, profile.verify_threads);
+
+  // A slow storage doesn't need the threads, and they're capped to the CPUs.
+  profile.queued_read_speeds = {100, 190, 200};
+  profile.PickParameters(8);
+  EXPECT_EQ(1u, profile.verify_threads);
+  profile.hash_speed = 1;
+  profile.PickParameters(2);
+  EXPECT_EQ(2u, profile.verify_threads);
+}
+
+TEST(TuningProfileTest, ToStringLoadTest) {
+  TuningProfile profile;
+  profile.build_timestamp = 1234;
+  profile.read_speeds = {1, 2, 3};
+  profile.queued_read_speeds = {4, 5, 6};
+  profile.write_speeds = {7, 8, 9};
+  profile.hash_speed = 10;
+  profile.PickParameters(4);
+
+  TuningProfile loaded;
+  ASSERT_TRUE(loaded.Load(profile.ToString()));
+  EXPECT_EQ(profile.ToString(), loaded.ToString());
+  EXPECT_EQ(1234, loaded.build_timestamp);
+  EXPECT_EQ(profile.verify_threads, loaded.verify_threads);
+
+  InstallPlan install_plan;
+  loaded.ApplyTo(&install_plan);
+  EXPECT_EQ(profile.verify_read_size, install_plan.verify_read_size);
+  EXPECT_EQ(profile.verify_threads, install_plan.verify_threads);
+  // The optional paths stay off.
+  EXPECT_FALSE(install_plan.use_io_uring);
+  EXPECT_FALSE(install_plan.parallel_install_ops);
+  EXPECT_EQ(0u, install_plan.write_back_buffer_size);
+
+  // The parameters set by the headers are kept.
+  install_plan = InstallPlan();
+  install_plan.verify_threads = 16;
+  loaded.ApplyTo(&install_plan);
+  EXPECT_EQ(profile.verify_read_size, install_plan.verify_read_size);
+  EXPECT_EQ(16u, install_plan.verify_threads);
+
+  EXPECT_FALSE(loaded.Load(""));
+  EXPECT_FALSE(loaded.Load("build_timestamp=1234\nread_speeds=1,2\n"));
+}
+
+TEST(TuningProfileTest, CalibrateDeviceTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  TuningProfile profile;
+  ASSERT_TRUE(CalibrateDevice(temp_dir.GetPath(), &profile));
+  EXPECT_EQ(kCalibrationIoSizes.size(), profile.read_speeds.size());
+  EXPECT_EQ(kCalibrationIoSizes.size(), profile.write_speeds.size());
+  EXPECT_GT(profile.hash_speed, 0u);
+  EXPECT_GE(profile.verify_threads, 1u);
+  EXPECT_NE(0u, profile.verify_read_size);
+  // The scratch file is removed.
+  EXPECT_TRUE(base::IsDirectoryEmpty(temp_dir.GetPath()));
+}
+
+}  // namespace chromeos_update_engine
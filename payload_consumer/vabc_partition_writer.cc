@@ -29,6 +29,7 @@
 
 #include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/async_snapshot_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -66,15 +67,21 @@ namespace chromeos_update_engine {
 using android::snapshot::ICowWriter;
 using ::google::protobuf::RepeatedPtrField;
 
+// Bytes of COW operations queued for the writer thread of the userspace
+// snapshots.
+constexpr size_t kCowWriteQueueSize = 16 * 1024 * 1024;  // 16 MiB
+
 // Compute XOR map, a map from dst extent to corresponding merge operation
-static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
+static ExtentMap<const CowMergeOperation*> ComputeXorMap(
     const RepeatedPtrField<CowMergeOperation>& merge_ops) {
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  std::vector<std::pair<Extent, const CowMergeOperation*>> xor_ops;
   for (const auto& merge_op : merge_ops) {
     if (merge_op.type() == CowMergeOperation::COW_XOR) {
-      xor_map.AddExtent(merge_op.dst_extent(), &merge_op);
+      xor_ops.emplace_back(merge_op.dst_extent(), &merge_op);
     }
   }
+  ExtentMap<const CowMergeOperation*> xor_map;
+  xor_map.AddExtents(std::move(xor_ops));
   return xor_map;
 }
 
@@ -88,7 +95,10 @@ VABCPartitionWriter::VABCPartitionWriter(
       dynamic_control_(dynamic_control),
       block_size_(block_size),
       executor_(block_size),
-      verified_source_fd_(block_size, install_part.source_path) {
+      verified_source_fd_(block_size, install_part.source_path),
+      source_prefetcher_(partition_update,
+                         block_size,
+                         /*skip_identity_copies=*/true) {
   for (const auto& cow_op : partition_update_.merge_operations()) {
     if (cow_op.type() != CowMergeOperation::COW_COPY) {
       continue;
@@ -106,6 +116,12 @@ bool VABCPartitionWriter::DoesDeviceSupportsXor() {
 bool VABCPartitionWriter::WriteAllCopyOps() {
   const bool userSnapshots = android::base::GetBoolProperty(
       "ro.virtual_ab.userspace.snapshots.enabled", false);
+  // With userspace snapshots, consecutive copies of contiguous source blocks
+  // to contiguous target blocks are emitted with a single AddCopy() call. The
+  // blocks are still copied in the same order.
+  uint64_t run_dst_block = 0;
+  uint64_t run_src_block = 0;
+  uint64_t run_num_blocks = 0;
   for (const auto& cow_op : partition_update_.merge_operations()) {
     if (cow_op.type() != CowMergeOperation::COW_COPY) {
       continue;
@@ -115,10 +131,21 @@ bool VABCPartitionWriter::WriteAllCopyOps() {
     }
     if (userSnapshots) {
       TEST_AND_RETURN_FALSE(cow_op.src_extent().num_blocks() != 0);
-      TEST_AND_RETURN_FALSE(
-          cow_writer_->AddCopy(cow_op.dst_extent().start_block(),
-                               cow_op.src_extent().start_block(),
-                               cow_op.src_extent().num_blocks()));
+      if (run_num_blocks > 0 &&
+          cow_op.dst_extent().start_block() ==
+              run_dst_block + run_num_blocks &&
+          cow_op.src_extent().start_block() ==
+              run_src_block + run_num_blocks) {
+        run_num_blocks += cow_op.src_extent().num_blocks();
+        continue;
+      }
+      if (run_num_blocks > 0) {
+        TEST_AND_RETURN_FALSE(
+            cow_writer_->AddCopy(run_dst_block, run_src_block, run_num_blocks));
+      }
+      run_dst_block = cow_op.dst_extent().start_block();
+      run_src_block = cow_op.src_extent().start_block();
+      run_num_blocks = cow_op.src_extent().num_blocks();
     } else {
       // Add blocks in reverse order, because snapused specifically prefers
       // this ordering. Since we already eliminated all self-overlapping
@@ -130,12 +157,17 @@ bool VABCPartitionWriter::WriteAllCopyOps() {
       }
     }
   }
+  if (run_num_blocks > 0) {
+    TEST_AND_RETURN_FALSE(
+        cow_writer_->AddCopy(run_dst_block, run_src_block, run_num_blocks));
+  }
   return true;
 }
 
 bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
                                bool source_may_exist,
-                               size_t next_op_index) {
+                               size_t next_op_index,
+                               bool resuming_operation) {
   if (dynamic_control_->GetVirtualAbCompressionXorFeatureFlag().IsEnabled()) {
     xor_map_ = ComputeXorMap(partition_update_.merge_operations());
     if (xor_map_.size() > 0) {
@@ -148,9 +180,23 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
     LOG(INFO) << "Virtual AB Compression with XOR is disabled.";
   }
   TEST_AND_RETURN_FALSE(install_plan != nullptr);
+  TEST_AND_RETURN_FALSE(
+      executor_.SetZstdDictionary(partition_update_.zstd_dictionary()));
+  executor_.set_memory_budget(install_plan->apply_memory_budget);
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
     TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    if (install_plan->verify_source_partitions) {
+      verified_source_fd_.VerifyWholeSource(install_part_.source_size,
+                                            install_part_.source_hash);
+    }
+    if (install_plan->trust_source_verity) {
+      verified_source_fd_.UseVerityDevice(
+          dynamic_control_,
+          install_part_.name,
+          install_part_.source_verity_root_digest);
+    }
+    source_prefetcher_.Open(install_part_.source_path);
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -160,6 +206,14 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   cow_writer_ = dynamic_control_->OpenCowWriter(
       install_part_.name, source_path, install_plan->is_resume);
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  // The userspace snapshots compress and write the COW in the calling
+  // thread, they do so on their own thread instead while the next operations
+  // are applied.
+  if (dynamic_control_->GetVirtualAbUserspaceSnapshotsFeatureFlag()
+          .IsEnabled()) {
+    cow_writer_ = std::make_unique<AsyncSnapshotWriter>(std::move(cow_writer_),
+                                                        kCowWriteQueueSize);
+  }
 
   // ===== Resume case handling code goes here ====
   // It is possible that the SOURCE_COPY are already written but
@@ -170,6 +224,7 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
               << partition_update_.partition_name() << "` op index "
               << next_op_index;
     TEST_AND_RETURN_FALSE(cow_writer_->InitializeAppend(next_op_index));
+    last_label_ = next_op_index;
     return true;
   } else {
     TEST_AND_RETURN_FALSE(cow_writer_->Initialize());
@@ -197,6 +252,7 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
       TEST_AND_RETURN_FALSE(WriteAllCopyOps());
     }
     cow_writer_->AddLabel(0);
+    last_label_ = 0;
   }
   return true;
 }
@@ -271,18 +327,76 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
 
 [[nodiscard]] bool VABCPartitionWriter::PerformSourceCopyOperation(
     const InstallOperation& operation, ErrorCode* error) {
+  FileDescriptorPtr source_fd;
+  std::vector<CowOperation> converted;
+  TEST_AND_RETURN_FALSE(
+      ConvertSourceCopyOperation(operation, error, &source_fd, &converted));
+  return WriteCowOperations(source_fd, converted);
+}
+
+bool VABCPartitionWriter::PerformOperations(
+    const std::vector<OperationWithData>& operations, ErrorCode* error) {
+  // The blocks the consecutive SOURCE_COPY operations replace are read and
+  // appended to the COW at once, in runs spanning the operations. Their COW
+  // copies are still added one operation at a time, in the order snapuserd
+  // expects.
+  std::vector<CowOperation> replaced;
+  FileDescriptorPtr replaced_source_fd;
+  auto write_replaced = [this, &replaced, &replaced_source_fd]() {
+    const bool result = WriteCowOperations(replaced_source_fd, replaced);
+    replaced.clear();
+    return result;
+  };
+
+  for (const OperationWithData& operation : operations) {
+    const InstallOperation& op = *operation.operation;
+    if (op.type() != InstallOperation::SOURCE_COPY) {
+      TEST_AND_RETURN_FALSE(write_replaced());
+      TEST_AND_RETURN_FALSE(PerformOperation(operation, error));
+      continue;
+    }
+    FileDescriptorPtr source_fd;
+    std::vector<CowOperation> converted;
+    TEST_AND_RETURN_FALSE(
+        ConvertSourceCopyOperation(op, error, &source_fd, &converted));
+    if (converted.empty())
+      continue;
+    if (source_fd != replaced_source_fd) {
+      TEST_AND_RETURN_FALSE(write_replaced());
+      replaced_source_fd = source_fd;
+    }
+    std::vector<CowOperation> copies;
+    for (const CowOperation& cow_op : converted) {
+      if (cow_op.op == CowOperation::CowCopy)
+        copies.push_back(cow_op);
+      else
+        push_back(&replaced, cow_op);
+    }
+    TEST_AND_RETURN_FALSE(WriteCowOperations(source_fd, copies));
+  }
+  return write_replaced();
+}
+
+bool VABCPartitionWriter::ConvertSourceCopyOperation(
+    const InstallOperation& operation,
+    ErrorCode* error,
+    FileDescriptorPtr* source_fd,
+    std::vector<CowOperation>* converted) {
+  // The blocks copied to the same place are already those of the snapshot.
+  // They aren't read to verify the source hash, the target hash of the
+  // partition is verified once it's written and covers them.
+  if (IsIdentityCopy(operation))
+    return true;
   // COPY ops are already handled during Init(), no need to do actual work, but
   // we still want to verify that all blocks contain expected data.
-  auto source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
-  TEST_AND_RETURN_FALSE(source_fd != nullptr);
-  std::vector<CowOperation> converted;
+  source_prefetcher_.OperationStarted(operation);
+  *source_fd = verified_source_fd_.ChooseSourceFD(operation, error);
+  TEST_AND_RETURN_FALSE(*source_fd != nullptr);
 
   const auto& src_extents = operation.src_extents();
   const auto& dst_extents = operation.dst_extents();
   BlockIterator it1{src_extents};
   BlockIterator it2{dst_extents};
-  const bool userSnapshots = android::base::GetBoolProperty(
-      "ro.virtual_ab.userspace.snapshots.enabled", false);
   // For devices not supporting XOR, sequence op is not supported, so all COPY
   // operations are written up front in strict merge order.
   const auto sequence_op_supported = DoesDeviceSupportsXor();
@@ -296,13 +410,22 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
     }
     if (copy_blocks_.ContainsBlock(dst_block)) {
       if (sequence_op_supported) {
-        push_back(&converted, {CowOperation::CowCopy, src_block, dst_block, 1});
+        push_back(converted, {CowOperation::CowCopy, src_block, dst_block, 1});
       }
     } else {
-      push_back(&converted,
-                {CowOperation::CowReplace, src_block, dst_block, 1});
+      push_back(converted, {CowOperation::CowReplace, src_block, dst_block, 1});
     }
   }
+  return true;
+}
+
+bool VABCPartitionWriter::WriteCowOperations(
+    const FileDescriptorPtr& source_fd,
+    const std::vector<CowOperation>& converted) {
+  if (converted.empty())
+    return true;
+  const bool userSnapshots = android::base::GetBoolProperty(
+      "ro.virtual_ab.userspace.snapshots.enabled", false);
   std::vector<uint8_t> buffer;
   for (const auto& cow_op : converted) {
     if (cow_op.op == CowOperation::CowCopy) {
@@ -340,10 +463,18 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
 bool VABCPartitionWriter::PerformReplaceOperation(const InstallOperation& op,
                                                   const void* data,
                                                   size_t count) {
-  // Setup the ExtentWriter stack based on the operation type.
-  std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
+  // The decompressor writes straight to the SnapshotExtentWriter.
+  return executor_.ExecuteReplaceOperation(
+      op,
+      std::make_unique<SnapshotExtentWriter>(cow_writer_.get()),
+      data,
+      count);
+}
 
-  return executor_.ExecuteReplaceOperation(op, std::move(writer), data, count);
+std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateReplaceOperationWriter(
+    const InstallOperation& operation) {
+  return executor_.CreateReplaceOperationWriter(
+      operation, std::make_unique<SnapshotExtentWriter>(cow_writer_.get()));
 }
 
 bool VABCPartitionWriter::PerformDiffOperation(
@@ -351,6 +482,7 @@ bool VABCPartitionWriter::PerformDiffOperation(
     ErrorCode* error,
     const void* data,
     size_t count) {
+  source_prefetcher_.OperationStarted(operation);
   FileDescriptorPtr source_fd =
       verified_source_fd_.ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
@@ -374,7 +506,16 @@ void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
   TEST_AND_RETURN(cow_writer_ != nullptr);
-  cow_writer_->AddLabel(next_op_index);
+  // The checkpoints taken while the same operation is being applied resume
+  // from the label already flushed, adding it again would only flush the COW
+  // once more.
+  if (last_label_ == next_op_index)
+    return;
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  if (cow_writer_->AddLabel(next_op_index))
+    last_label_ = next_op_index;
+  label_time_ += base::TimeTicks::Now() - start_time;
+  num_labels_++;
 }
 
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
@@ -395,6 +536,10 @@ int VABCPartitionWriter::Close() {
   if (cow_writer_) {
     LOG(INFO) << "Finalizing " << partition_update_.partition_name()
               << " COW image";
+    if (num_labels_ > 0) {
+      LOG(INFO) << "Spent " << utils::FormatTimeDelta(label_time_)
+                << " flushing " << num_labels_ << " checkpoint labels";
+    }
     cow_writer_->Finalize();
     cow_writer_ = nullptr;
   }
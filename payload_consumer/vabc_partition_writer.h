@@ -19,15 +19,19 @@
 
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include <base/time/time.h>
 #include <libsnapshot/snapshot_writer.h>
 
+#include "update_engine/common/cow_operation_convert.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
 #include "update_engine/payload_consumer/verified_source_fd.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
@@ -40,7 +44,8 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                       size_t block_size);
   [[nodiscard]] bool Init(const InstallPlan* install_plan,
                           bool source_may_exist,
-                          size_t next_op_index) override;
+                          size_t next_op_index,
+                          bool resuming_operation) override;
   ~VABCPartitionWriter() override;
 
   // Only ZERO and SOURCE_COPY InstallOperations are treated special by VABC
@@ -54,12 +59,20 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceOperationWriter(
+      const InstallOperation& operation) override;
 
   [[nodiscard]] bool PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error,
                                           const void* data,
                                           size_t count) override;
 
+  // Appends the blocks the consecutive SOURCE_COPY operations of
+  // |operations| replace to the COW together.
+  [[nodiscard]] bool PerformOperations(
+      const std::vector<OperationWithData>& operations,
+      ErrorCode* error) override;
+
   void CheckpointUpdateProgress(size_t next_op_index) override;
 
   [[nodiscard]] bool FinishedInstallOps() override;
@@ -73,6 +86,19 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   [[nodiscard]] bool DoesDeviceSupportsXor();
   bool IsXorEnabled() const noexcept { return xor_map_.size() > 0; }
   [[nodiscard]] bool WriteAllCopyOps();
+  // Verifies the source of the SOURCE_COPY |operation|, sets |source_fd| to
+  // read it from and appends the COW operations writing it to |converted|.
+  // Leaves both unchanged if nothing needs to be written.
+  [[nodiscard]] bool ConvertSourceCopyOperation(
+      const InstallOperation& operation,
+      ErrorCode* error,
+      FileDescriptorPtr* source_fd,
+      std::vector<CowOperation>* converted);
+  // Adds |converted| to the COW, reading the replaced blocks from
+  // |source_fd|.
+  [[nodiscard]] bool WriteCowOperations(
+      const FileDescriptorPtr& source_fd,
+      const std::vector<CowOperation>& converted);
   std::unique_ptr<android::snapshot::ISnapshotWriter> cow_writer_;
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
@@ -86,8 +112,15 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   const size_t block_size_;
   InstallOperationExecutor executor_;
   VerifiedSourceFd verified_source_fd_;
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
+  SourcePrefetcher source_prefetcher_;
+  ExtentMap<const CowMergeOperation*> xor_map_;
   ExtentRanges copy_blocks_;
+
+  // The last label added to the COW, which the update resumes from.
+  std::optional<size_t> last_label_;
+  // Time spent adding the labels of the checkpoints, which flushes the COW.
+  base::TimeDelta label_time_;
+  size_t num_labels_{0};
 };
 
 }  // namespace chromeos_update_engine
@@ -111,7 +111,7 @@ TEST_F(VABCPartitionWriterTest, MergeSequenceWriteTest) {
       }));
   EXPECT_CALL(dynamic_control_, GetVirtualAbCompressionXorFeatureFlag())
       .WillRepeatedly(Return(FeatureFlag(FeatureFlag::Value::LAUNCH)));
-  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
 }
 
 TEST_F(VABCPartitionWriterTest, MergeSequenceXorSameBlock) {
@@ -136,7 +136,7 @@ TEST_F(VABCPartitionWriterTest, MergeSequenceXorSameBlock) {
           }));
   EXPECT_CALL(dynamic_control_, GetVirtualAbCompressionXorFeatureFlag())
       .WillRepeatedly(Return(FeatureFlag(FeatureFlag::Value::LAUNCH)));
-  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
 }
 
 TEST_F(VABCPartitionWriterTest, EmitBlockTestXor) {
@@ -209,7 +209,7 @@ void VABCPartitionWriterTest::EmitBlockTest(bool xor_enabled) {
         }
         return cow_writer;
       }));
-  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
   ErrorCode error{};
   ASSERT_TRUE(writer_.PerformSourceCopyOperation(install_op, &error));
 }
@@ -284,13 +284,81 @@ TEST_F(VABCPartitionWriterTest, StreamXORBlockTest) {
       .WillRepeatedly(Return(FeatureFlag(FeatureFlag::Value::LAUNCH)));
   VABCPartitionWriter writer_{
       partition_update_, install_part_, &dynamic_control_, kBlockSize};
-  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
   const auto patch_data = GetNoopBSDIFF(kBlockSize * 5);
   ASSERT_GT(patch_data.size(), 0UL);
   ASSERT_TRUE(writer_.PerformDiffOperation(
       *install_op, nullptr, patch_data.data(), patch_data.size()));
 }
 
+TEST_F(VABCPartitionWriterTest, WriteAllCopyOpsCoalescesRunsTest) {
+  // Without XOR support, all the copies are written up front.
+  AddMergeOp(&partition_update_, {5, 1}, {10, 1}, CowMergeOperation::COW_COPY);
+  AddMergeOp(&partition_update_, {6, 2}, {11, 2}, CowMergeOperation::COW_COPY);
+  AddMergeOp(&partition_update_, {30, 1}, {30, 1}, CowMergeOperation::COW_COPY);
+  AddMergeOp(&partition_update_, {8, 1}, {13, 1}, CowMergeOperation::COW_COPY);
+  AddMergeOp(&partition_update_, {20, 1}, {40, 1}, CowMergeOperation::COW_COPY);
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, false))
+      .WillOnce(Invoke([](const std::string&,
+                          const std::optional<std::string>&,
+                          bool) {
+        auto cow_writer =
+            std::make_unique<android::snapshot::MockSnapshotWriter>(
+                android::snapshot::CowOptions{});
+        ON_CALL(*cow_writer, EmitCopy(_, _, _)).WillByDefault(Return(true));
+        ON_CALL(*cow_writer, EmitLabel(_)).WillByDefault(Return(true));
+        EXPECT_CALL(*cow_writer, Initialize()).WillOnce(Return(true));
+        const bool is_ascending = android::base::GetBoolProperty(
+            "ro.virtual_ab.userspace.snapshots.enabled", false);
+        Sequence s;
+        if (is_ascending) {
+          EXPECT_CALL(*cow_writer, EmitCopy(10, 5, 4)).InSequence(s);
+          EXPECT_CALL(*cow_writer, EmitCopy(40, 20, 1)).InSequence(s);
+        } else {
+          EXPECT_CALL(*cow_writer, EmitCopy(10, 5, 1)).InSequence(s);
+          EXPECT_CALL(*cow_writer, EmitCopy(12, 7, 1)).InSequence(s);
+          EXPECT_CALL(*cow_writer, EmitCopy(11, 6, 1)).InSequence(s);
+          EXPECT_CALL(*cow_writer, EmitCopy(13, 8, 1)).InSequence(s);
+          EXPECT_CALL(*cow_writer, EmitCopy(40, 20, 1)).InSequence(s);
+        }
+        return cow_writer;
+      }));
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
+}
+
+TEST_F(VABCPartitionWriterTest, CheckpointAddsOneLabelPerOperationTest) {
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, false))
+      .WillOnce(Invoke([](const std::string&,
+                          const std::optional<std::string>&,
+                          bool) {
+        auto cow_writer =
+            std::make_unique<android::snapshot::MockSnapshotWriter>(
+                android::snapshot::CowOptions{});
+        EXPECT_CALL(*cow_writer, Initialize()).WillOnce(Return(true));
+        Sequence s;
+        EXPECT_CALL(*cow_writer, EmitLabel(1))
+            .InSequence(s)
+            .WillOnce(Return(true));
+        EXPECT_CALL(*cow_writer, EmitLabel(2))
+            .InSequence(s)
+            .WillOnce(Return(false))
+            .WillOnce(Return(true));
+        return cow_writer;
+      }));
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0, false));
+  writer_.CheckpointUpdateProgress(1);
+  // Nothing was applied since the last label.
+  writer_.CheckpointUpdateProgress(1);
+  // A label that failed to be added is added again by the next checkpoint.
+  writer_.CheckpointUpdateProgress(2);
+  writer_.CheckpointUpdateProgress(2);
+  writer_.CheckpointUpdateProgress(2);
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
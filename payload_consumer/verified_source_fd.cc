@@ -26,9 +26,13 @@
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 
+#include "update_engine/common/dynamic_partition_control_interface.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/log_rate_limiter.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/io_trace.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 
@@ -66,6 +70,10 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     LOG(ERROR) << "ChooseSourceFD fail: source_fd_ == nullptr";
     return nullptr;
   }
+  if (source_verity_fd_ &&
+      AllBlocksIn(verity_blocks_, operation.src_extents())) {
+    return source_verity_fd_;
+  }
   if (!operation.has_src_sha256_hash()) {
     // When the operation doesn't include a source hash, we attempt the error
     // corrected device first since we can't verify the block in the raw device
@@ -79,12 +87,16 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     return source_fd_;
   }
 
+  if (AllBlocksIn(verified_blocks_, operation.src_extents())) {
+    return source_fd_;
+  }
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
   if (fd_utils::ReadAndHashExtents(
           source_fd_, operation.src_extents(), block_size_, &source_hash) &&
       source_hash == expected_source_hash) {
+    verified_blocks_.AddRepeatedExtents(operation.src_extents());
     return source_fd_;
   }
   // We fall back to use the error corrected device if the hash of the raw
@@ -97,26 +109,113 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
         source_hash, operation, source_fd_, error);
     return nullptr;
   }
-  LOG(WARNING) << "Source hash from RAW device mismatched: found "
-               << base::HexEncode(source_hash.data(), source_hash.size())
-               << ", expected "
-               << base::HexEncode(expected_source_hash.data(),
-                                  expected_source_hash.size());
+  LOG_RATE_LIMITED(WARNING)
+      << "Source hash from RAW device mismatched: found "
+      << base::HexEncode(source_hash.data(), source_hash.size())
+      << ", expected "
+      << base::HexEncode(expected_source_hash.data(),
+                         expected_source_hash.size());
 
+  if (AllBlocksIn(ecc_verified_blocks_, operation.src_extents())) {
+    source_ecc_recovered_failures_++;
+    return source_ecc_fd_;
+  }
   if (fd_utils::ReadAndHashExtents(
           source_ecc_fd_, operation.src_extents(), block_size_, &source_hash) &&
       PartitionWriter::ValidateSourceHash(
           source_hash, operation, source_ecc_fd_, error)) {
+    ecc_verified_blocks_.AddRepeatedExtents(operation.src_extents());
     source_ecc_recovered_failures_++;
     return source_ecc_fd_;
   }
   return nullptr;
 }
 
+bool VerifiedSourceFd::VerifyWholeSource(uint64_t size,
+                                         const brillo::Blob& expected_hash) {
+  if (expected_hash.empty()) {
+    return false;
+  }
+  brillo::Blob hash;
+  if (HashCalculator::RawHashOfFile(source_path_, size, &hash) !=
+          static_cast<off_t>(size) ||
+      hash != expected_hash) {
+    LOG(WARNING) << "Source partition " << source_path_
+                 << " doesn't match its hash, verifying the source extents of "
+                    "each operation instead.";
+    return false;
+  }
+  LOG(INFO) << "Verified the " << size << " bytes of " << source_path_;
+  verified_blocks_.AddExtent(ExtentForRange(0, size / block_size_));
+  return true;
+}
+
+bool VerifiedSourceFd::UseVerityDevice(
+    DynamicPartitionControlInterface* dynamic_control,
+    const string& partition_name,
+    const brillo::Blob& expected_root_digest) {
+  if (expected_root_digest.empty()) {
+    return false;
+  }
+  string verity_path;
+  brillo::Blob root_digest;
+  uint64_t data_size = 0;
+  if (!dynamic_control->GetVerityDevice(partition_name,
+                                        source_path_,
+                                        &verity_path,
+                                        &root_digest,
+                                        &data_size)) {
+    LOG(INFO) << "No active verity device for " << partition_name;
+    return false;
+  }
+  if (root_digest != expected_root_digest) {
+    LOG(WARNING) << "The verity device of " << partition_name
+                 << " has root digest "
+                 << base::HexEncode(root_digest.data(), root_digest.size())
+                 << ", expected "
+                 << base::HexEncode(expected_root_digest.data(),
+                                    expected_root_digest.size())
+                 << ", verifying the source extents of each operation.";
+    return false;
+  }
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!fd->Open(verity_path.c_str(), O_RDONLY)) {
+    PLOG(WARNING) << "Unable to open the verity device " << verity_path;
+    return false;
+  }
+  source_verity_fd_ = fd;
+  verity_blocks_.AddExtent(ExtentForRange(0, data_size / block_size_));
+  LOG(INFO) << "Reading the first " << data_size << " bytes of "
+            << partition_name << " through " << verity_path;
+  return true;
+}
+
+bool VerifiedSourceFd::AllBlocksIn(
+    const ExtentRanges& ranges,
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  if (ranges.blocks() == 0) {
+    return false;
+  }
+  for (const auto& extent : extents) {
+    uint64_t blocks = 0;
+    for (const auto& overlap : ranges.GetIntersectingExtents(extent)) {
+      blocks += overlap.num_blocks();
+    }
+    if (blocks != extent.num_blocks()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool VerifiedSourceFd::Open() {
   source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
   if (source_fd_ == nullptr)
     return false;
+  if (IoTraceRecorder::Get()->IsRecording()) {
+    source_fd_ = std::make_shared<TracingFileDescriptor>(
+        source_fd_, IoTraceRecorder::Get());
+  }
   TEST_AND_RETURN_FALSE_ERRNO(source_fd_->Open(source_path_.c_str(), O_RDONLY));
   return true;
 }
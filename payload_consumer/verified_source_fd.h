@@ -21,14 +21,18 @@
 #include <string>
 #include <utility>
 
+#include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/common/error_code.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
+class DynamicPartitionControlInterface;
+
 class VerifiedSourceFd {
  public:
   explicit VerifiedSourceFd(size_t block_size, std::string source_path)
@@ -38,8 +42,25 @@ class VerifiedSourceFd {
 
   [[nodiscard]] bool Open();
 
+  // Hashes the first |size| bytes of the source partition, and if they match
+  // |expected_hash|, treats all of its blocks as verified. Returns whether
+  // they matched.
+  bool VerifyWholeSource(uint64_t size, const brillo::Blob& expected_hash);
+
+  // Reads the source blocks covered by the active dm-verity device of
+  // |partition_name| through it, without verifying their source hash, if its
+  // root digest is |expected_root_digest|. The kernel verifies them as they're
+  // read instead. Returns whether the verity device is used.
+  bool UseVerityDevice(DynamicPartitionControlInterface* dynamic_control,
+                       const std::string& partition_name,
+                       const brillo::Blob& expected_root_digest);
+
  private:
   bool OpenCurrentECCPartition();
+  // Whether all the blocks of |extents| are in |ranges|.
+  static bool AllBlocksIn(
+      const ExtentRanges& ranges,
+      const google::protobuf::RepeatedPtrField<Extent>& extents);
   const size_t block_size_;
   const std::string source_path_;
   FileDescriptorPtr source_ecc_fd_;
@@ -47,6 +68,9 @@ class VerifiedSourceFd {
 
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDVerifiedBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDVerifyWholeSourceTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDVerityDeviceTest);
   // The total number of operations that failed source hash verification but
   // passed after falling back to the error-corrected |source_ecc_fd_| device.
   uint64_t source_ecc_recovered_failures_{0};
@@ -55,6 +79,18 @@ class VerifiedSourceFd {
   // Used to avoid re-opening the same source partition if it is not actually
   // error corrected.
   bool source_ecc_open_failure_{false};
+
+  // Blocks that matched the source hash of an operation, or of the whole
+  // partition, on |source_fd_| and on |source_ecc_fd_|. The source partition
+  // doesn't change during the update, so the operations reading only these
+  // blocks read what their source hash expects: many operations share source
+  // blocks, and they are hashed only once.
+  ExtentRanges verified_blocks_;
+  ExtentRanges ecc_verified_blocks_;
+
+  // The dm-verity device of the source partition, and the blocks it covers.
+  FileDescriptorPtr source_verity_fd_;
+  ExtentRanges verity_blocks_;
 };
 }  // namespace chromeos_update_engine
 
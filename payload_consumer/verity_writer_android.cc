@@ -18,9 +18,13 @@
 
 #include <fcntl.h>
 
+#include <unistd.h>
+
 #include <algorithm>
 #include <memory>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
@@ -29,19 +33,28 @@ extern "C" {
 #include <fec.h>
 }
 
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+// The number of the copied blocks checked against the source hash tree
+// before using it. A tree built with another salt or layout has none of
+// their digests.
+constexpr size_t kNumCheckedSourceDigests = 16;
+}  // namespace
+
 bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
                                 const uint64_t _data_size,
                                 const uint64_t _fec_offset,
                                 const uint64_t _fec_size,
                                 const uint64_t _fec_roots,
                                 const uint64_t _block_size,
-                                const bool _verify_mode) {
+                                const bool _verify_mode,
+                                const size_t _num_threads) {
   current_step_ = EncodeFECStep::kInitFDStep;
   data_offset_ = _data_offset;
   data_size_ = _data_size;
@@ -53,22 +66,32 @@ bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
   current_round_ = 0;
   // This is the N in RS(M, N), which is the number of bytes for each rs block.
   rs_n_ = FEC_RSM - fec_roots_;
-  rs_char_.reset(init_rs_char(FEC_PARAMS(fec_roots_)));
-  rs_blocks_.resize(block_size_ * rs_n_);
-  buffer_.resize(block_size_, 0);
-  fec_.resize(block_size_ * fec_roots_);
-  fec_read_.resize(fec_.size());
   TEST_AND_RETURN_FALSE(data_size_ % block_size_ == 0);
   TEST_AND_RETURN_FALSE(fec_roots_ >= 0 && fec_roots_ < FEC_RSM);
 
   num_rounds_ = utils::DivRoundUp(data_size_ / block_size_, rs_n_);
   TEST_AND_RETURN_FALSE(num_rounds_ * fec_roots_ * block_size_ == fec_size_);
-  TEST_AND_RETURN_FALSE(rs_char_ != nullptr);
+
+  // There's no point in more threads than rounds.
+  num_threads_ = std::max<size_t>(
+      1, std::min<size_t>(_num_threads, std::max<size_t>(num_rounds_, 1)));
+  rs_chars_.clear();
+  rs_blocks_.clear();
+  for (size_t i = 0; i < num_threads_; i++) {
+    rs_chars_.emplace_back(init_rs_char(FEC_PARAMS(fec_roots_)),
+                           &free_rs_char);
+    TEST_AND_RETURN_FALSE(rs_chars_.back() != nullptr);
+    rs_blocks_.emplace_back(block_size_ * rs_n_);
+  }
+  round_data_.resize(num_threads_ * rs_n_ * block_size_);
+  fec_.resize(num_threads_ * block_size_ * fec_roots_);
+  fec_read_.resize(fec_.size());
   return true;
 }
 
 bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
                                    FileDescriptor* _write_fd) {
+  ScopedTrace trace("verity_fec");
   if (current_step_ == EncodeFECStep::kInitFDStep) {
     read_fd_ = _read_fd;
     write_fd_ = _write_fd;
@@ -77,63 +100,90 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
   } else if (current_step_ == EncodeFECStep::kEncodeRoundStep) {
     // Encodes |block_size| number of rs blocks each round so that we can read
     // one block each time instead of 1 byte to increase random read
-    // performance. This uses about 1 MiB memory for 4K block size.
-    for (size_t j = 0; j < rs_n_; j++) {
-      uint64_t offset = fec_ecc_interleave(
-          current_round_ * rs_n_ * block_size_ + j, rs_n_, num_rounds_);
-      // Don't read past |data_size|, treat them as 0.
-      if (offset >= data_size_) {
-        std::fill(buffer_.begin(), buffer_.end(), 0);
-      } else {
-        ssize_t bytes_read = 0;
-        TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd_,
-                                              buffer_.data(),
-                                              buffer_.size(),
-                                              data_offset_ + offset,
-                                              &bytes_read));
-        TEST_AND_RETURN_FALSE(bytes_read >= 0);
-        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
-                              buffer_.size());
-      }
-      for (size_t k = 0; k < buffer_.size(); k++) {
-        rs_blocks_[k * rs_n_ + j] = buffer_[k];
+    // performance. This uses about 1 MiB memory per thread for 4K block size.
+    // Each step encodes one round per thread; the blocks of all its rounds
+    // are read in a single batch first.
+    const size_t num_rounds =
+        std::min(num_threads_, num_rounds_ - current_round_);
+    std::vector<FileDescriptor::ReadRequest> requests;
+    requests.reserve(num_rounds * rs_n_);
+    for (size_t i = 0; i < num_rounds; i++) {
+      for (size_t j = 0; j < rs_n_; j++) {
+        uint64_t offset = fec_ecc_interleave(
+            (current_round_ + i) * rs_n_ * block_size_ + j, rs_n_, num_rounds_);
+        uint8_t* block = round_data_.data() + (i * rs_n_ + j) * block_size_;
+        // Don't read past |data_size|, treat them as 0.
+        if (offset >= data_size_) {
+          std::fill(block, block + block_size_, 0);
+        } else {
+          requests.push_back({block,
+                              static_cast<size_t>(block_size_),
+                              static_cast<off64_t>(data_offset_ + offset)});
+        }
       }
     }
-    for (size_t j = 0; j < block_size_; j++) {
-      // Encode [j * rs_n_ : (j + 1) * rs_n_) in |rs_blocks| and write
-      // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char_.get(),
-                     rs_blocks_.data() + j * rs_n_,
-                     fec_.data() + j * fec_roots_);
+    if (!read_fd_->ReadBatch(requests)) {
+      PLOG(ERROR) << "EncodeFEC read failed";
+      return false;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t worker = 1; worker < std::min(num_threads_, num_rounds);
+         worker++) {
+      workers.emplace_back(
+          &IncrementalEncodeFEC::EncodeRounds, this, worker, num_rounds);
+    }
+    EncodeRounds(0, num_rounds);
+    for (auto& worker : workers) {
+      worker.join();
     }
 
+    const size_t fec_size = num_rounds * block_size_ * fec_roots_;
     if (verify_mode_) {
       ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd_,
-                                            fec_read_.data(),
-                                            fec_read_.size(),
-                                            fec_offset_,
-                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          read_fd_, fec_read_.data(), fec_size, fec_offset_, &bytes_read));
       TEST_AND_RETURN_FALSE(bytes_read >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
-                            fec_read_.size());
-      TEST_AND_RETURN_FALSE(fec_ == fec_read_);
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_size);
+      TEST_AND_RETURN_FALSE(
+          std::equal(fec_.begin(), fec_.begin() + fec_size, fec_read_.begin()));
     } else {
       CHECK(write_fd_);
       write_fd_->Seek(fec_offset_, SEEK_SET);
-      if (!utils::WriteAll(write_fd_, fec_.data(), fec_.size())) {
+      if (!utils::WriteAll(write_fd_, fec_.data(), fec_size)) {
         PLOG(ERROR) << "EncodeFEC write() failed";
         return false;
       }
     }
-    fec_offset_ += fec_.size();
-    current_round_++;
+    fec_offset_ += fec_size;
+    current_round_ += num_rounds;
   } else if (current_step_ == EncodeFECStep::kWriteStep) {
     write_fd_->Flush();
   }
   UpdateState();
   return true;
 }
+
+void IncrementalEncodeFEC::EncodeRounds(size_t worker, size_t num_rounds) {
+  brillo::Blob& rs_blocks = rs_blocks_[worker];
+  for (size_t i = worker; i < num_rounds; i += num_threads_) {
+    const uint8_t* data = round_data_.data() + i * rs_n_ * block_size_;
+    for (size_t j = 0; j < rs_n_; j++) {
+      for (size_t k = 0; k < block_size_; k++) {
+        rs_blocks[k * rs_n_ + j] = data[j * block_size_ + k];
+      }
+    }
+    uint8_t* fec = fec_.data() + i * block_size_ * fec_roots_;
+    for (size_t j = 0; j < block_size_; j++) {
+      // Encode [j * rs_n_ : (j + 1) * rs_n_) in |rs_blocks| and write
+      // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
+      encode_rs_char(rs_chars_[worker].get(),
+                     rs_blocks.data() + j * rs_n_,
+                     fec + j * fec_roots_);
+    }
+  }
+}
+
 // update the current state of EncodeFEC. Can be changed to have smaller steps
 void IncrementalEncodeFEC::UpdateState() {
   if (current_step_ == EncodeFECStep::kInitFDStep) {
@@ -157,6 +207,17 @@ double IncrementalEncodeFEC::ReportProgress() const {
   return static_cast<double>(current_round_) / num_rounds_;
 }
 
+namespace {
+// Hash tree and FEC computation are CPU bound, but run alongside the rest of
+// the update.
+constexpr long kMaxVerityThreads = 4;  // NOLINT(runtime/int)
+
+size_t GetVerityThreadCount() {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);  // NOLINT(runtime/int)
+  return std::max(1L, std::min(num_cpus, kMaxVerityThreads));
+}
+}  // namespace
+
 namespace verity_writer {
 std::unique_ptr<VerityWriterInterface> CreateVerityWriter() {
   return std::make_unique<VerityWriterAndroid>();
@@ -165,6 +226,7 @@ std::unique_ptr<VerityWriterInterface> CreateVerityWriter() {
 
 bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
   partition_ = &partition;
+  known_data_.clear();
   LOG(INFO) << "Initializing Incremental EncodeFEC";
   TEST_AND_RETURN_FALSE(encodeFEC_.Init(partition_->fec_data_offset,
                                         partition_->fec_data_size,
@@ -172,7 +234,8 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                                         partition_->fec_size,
                                         partition_->fec_roots,
                                         partition_->block_size,
-                                        false /* verify_mode */));
+                                        false /* verify_mode */,
+                                        GetVerityThreadCount()));
   hash_tree_written_ = false;
   if (partition_->hash_tree_size != 0) {
     auto hash_function =
@@ -182,8 +245,8 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                  << partition_->hash_tree_algorithm;
       return false;
     }
-    hash_tree_builder_ = std::make_unique<HashTreeBuilder>(
-        partition_->block_size, hash_function);
+    hash_tree_builder_ = std::make_unique<ParallelHashTreeBuilder>(
+        partition_->block_size, hash_function, GetVerityThreadCount());
     TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
         partition_->hash_tree_data_size, partition_->hash_tree_salt));
     if (hash_tree_builder_->CalculateSize(partition_->hash_tree_data_size) !=
@@ -194,15 +257,174 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                         partition_->hash_tree_data_size);
       return false;
     }
+    if (!partition_->copied_blocks.empty() && !LoadSourceDigests()) {
+      LOG(WARNING) << "Unable to use the source hash tree of "
+                   << partition_->name << ", hashing all of its data.";
+      known_data_.clear();
+      TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
+          partition_->hash_tree_data_size, partition_->hash_tree_salt));
+    }
   }
   total_offset_ = 0;
   return true;
 }
 
+bool VerityWriterAndroid::LoadSourceDigests() {
+  const uint64_t block_size = partition_->block_size;
+  const uint64_t hash_tree_end =
+      partition_->hash_tree_offset + partition_->hash_tree_size;
+  if (partition_->source_path.empty() ||
+      partition_->source_size < hash_tree_end ||
+      partition_->hash_tree_data_offset % block_size != 0) {
+    LOG(WARNING) << "The source partition of " << partition_->name
+                 << " can't hold the same hash tree layout.";
+    return false;
+  }
+  EintrSafeFileDescriptor source_fd;
+  TEST_AND_RETURN_FALSE(
+      source_fd.Open(partition_->source_path.c_str(), O_RDONLY));
+  auto read_at = [&source_fd](uint8_t* buffer, size_t size, uint64_t offset) {
+    ssize_t bytes_read = 0;
+    return utils::PReadAll(&source_fd, buffer, size, offset, &bytes_read) &&
+           static_cast<size_t>(bytes_read) == size;
+  };
+
+  // The copied blocks within the hash tree data on both sides, in blocks from
+  // its start.
+  const uint64_t first_block = partition_->hash_tree_data_offset / block_size;
+  const uint64_t end_block =
+      first_block + partition_->hash_tree_data_size / block_size;
+  std::vector<InstallPlan::Partition::CopiedBlocks> runs;
+  for (auto run : partition_->copied_blocks) {
+    uint64_t skip = 0;
+    if (run.target_block < first_block)
+      skip = first_block - run.target_block;
+    if (run.source_block < first_block)
+      skip = std::max(skip, first_block - run.source_block);
+    if (skip >= run.num_blocks)
+      continue;
+    run.target_block += skip;
+    run.source_block += skip;
+    run.num_blocks -= skip;
+    if (run.target_block >= end_block || run.source_block >= end_block)
+      continue;
+    run.num_blocks = std::min({run.num_blocks,
+                               end_block - run.target_block,
+                               end_block - run.source_block});
+    runs.push_back({run.target_block - first_block,
+                    run.source_block - first_block,
+                    run.num_blocks});
+  }
+  if (runs.empty())
+    return false;
+
+  // The data block digests are the last level of the tree.
+  const size_t slot_size = hash_tree_builder_->digest_slot_size();
+  const uint64_t digests_offset =
+      hash_tree_end - hash_tree_builder_->data_digests_size();
+  brillo::Blob block(block_size);
+  brillo::Blob digest(slot_size);
+  brillo::Blob source_digest(slot_size);
+  const size_t step =
+      std::max<size_t>(1, runs.size() / kNumCheckedSourceDigests);
+  for (size_t i = 0; i < runs.size(); i += step) {
+    const uint64_t source_block = runs[i].source_block;
+    TEST_AND_RETURN_FALSE(
+        read_at(block.data(),
+                block.size(),
+                partition_->hash_tree_data_offset + source_block * block_size));
+    TEST_AND_RETURN_FALSE(read_at(source_digest.data(),
+                                  source_digest.size(),
+                                  digests_offset + source_block * slot_size));
+    TEST_AND_RETURN_FALSE(
+        hash_tree_builder_->ComputeDigest(block.data(), digest.data()));
+    if (digest != source_digest) {
+      LOG(WARNING) << "The source hash tree of " << partition_->name
+                   << " doesn't match the data of block " << source_block;
+      return false;
+    }
+  }
+
+  brillo::Blob digests;
+  uint64_t num_known_blocks = 0;
+  for (const auto& run : runs) {
+    digests.resize(run.num_blocks * slot_size);
+    TEST_AND_RETURN_FALSE(
+        read_at(digests.data(),
+                digests.size(),
+                digests_offset + run.source_block * slot_size));
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->SetBlockDigests(
+        run.target_block, digests.data(), run.num_blocks));
+    const uint64_t start =
+        partition_->hash_tree_data_offset + run.target_block * block_size;
+    const uint64_t end = start + run.num_blocks * block_size;
+    if (!known_data_.empty() && known_data_.rbegin()->second == start)
+      known_data_.rbegin()->second = end;
+    else
+      known_data_[start] = end;
+    num_known_blocks += run.num_blocks;
+  }
+  LOG(INFO) << "Using the source hash tree digests of " << num_known_blocks
+            << " of the " << end_block - first_block << " blocks of "
+            << partition_->name;
+  return true;
+}
+
+bool VerityWriterAndroid::GetKnownData(uint64_t offset,
+                                       uint64_t* start,
+                                       uint64_t* end) const {
+  auto it = known_data_.upper_bound(offset);
+  if (it != known_data_.begin() && std::prev(it)->second > offset)
+    it--;
+  if (it == known_data_.end())
+    return false;
+  *start = it->first;
+  *end = it->second;
+  return true;
+}
+
+uint64_t VerityWriterAndroid::GetHashedDataEnd() const {
+  uint64_t start = 0;
+  uint64_t end = 0;
+  if (GetKnownData(total_offset_, &start, &end) && start <= total_offset_)
+    return end;
+  return total_offset_;
+}
+
+bool VerityWriterAndroid::UpdateHashTree(uint64_t offset,
+                                         const uint8_t* data,
+                                         size_t size) {
+  const uint64_t data_offset = partition_->hash_tree_data_offset;
+  while (size > 0) {
+    uint64_t known_start = 0;
+    uint64_t known_end = 0;
+    size_t count = size;
+    if (GetKnownData(offset, &known_start, &known_end) &&
+        known_start < offset + size) {
+      if (known_start <= offset) {
+        count = std::min<uint64_t>(size, known_end - offset);
+        offset += count;
+        data += count;
+        size -= count;
+        continue;
+      }
+      count = known_start - offset;
+    }
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->SkipTo(offset - data_offset));
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(data, count));
+    offset += count;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
 bool VerityWriterAndroid::Update(const uint64_t offset,
                                  const uint8_t* buffer,
                                  size_t size) {
-  if (offset != total_offset_) {
+  // Only the known data can be skipped.
+  if (offset != total_offset_ &&
+      (offset < total_offset_ || offset > GetHashedDataEnd())) {
     LOG(ERROR) << "Sequential read expected, expected to read at: "
                << total_offset_ << " actual read occurs at: " << offset;
     return false;
@@ -221,8 +443,9 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
     }
     const uint64_t end_offset = std::min(offset + size, hash_tree_data_end);
     if (start_offset < end_offset) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
-          buffer + start_offset - offset, end_offset - start_offset));
+      TEST_AND_RETURN_FALSE(UpdateHashTree(start_offset,
+                                           buffer + start_offset - offset,
+                                           end_offset - start_offset));
 
       if (end_offset == hash_tree_data_end) {
         LOG(INFO)
@@ -230,7 +453,7 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
       }
     }
   }
-  total_offset_ += size;
+  total_offset_ = offset + size;
 
   return true;
 }
@@ -238,28 +461,14 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
                                    FileDescriptor* write_fd) {
   const auto hash_tree_data_end =
       partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-  if (total_offset_ < hash_tree_data_end) {
+  if (GetHashedDataEnd() < hash_tree_data_end) {
     LOG(ERROR) << "Read up to " << total_offset_
                << " when we are expecting to read everything "
                   "before "
                << hash_tree_data_end;
     return false;
   }
-  // All hash tree data blocks has been hashed, write hash tree to disk.
-  LOG(INFO) << "Writing verity hash tree to "
-            << partition_->readonly_target_path;
-  if (hash_tree_builder_) {
-    TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-    TEST_AND_RETURN_FALSE_ERRNO(
-        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-    auto success =
-        hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-          return utils::WriteAll(write_fd, data, size);
-        });
-    // hashtree builder already prints error messages.
-    TEST_AND_RETURN_FALSE(success);
-    hash_tree_builder_.reset();
-  }
+  TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
   if (partition_->fec_size != 0) {
     LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
     TEST_AND_RETURN_FALSE(EncodeFEC(read_fd,
@@ -281,28 +490,14 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
     LOG(INFO) << "Completing prework in Finalize";
     const auto hash_tree_data_end =
         partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-    if (total_offset_ < hash_tree_data_end) {
+    if (GetHashedDataEnd() < hash_tree_data_end) {
       LOG(ERROR) << "Read up to " << total_offset_
                  << " when we are expecting to read everything "
                     "before "
                  << hash_tree_data_end;
       return false;
     }
-    // All hash tree data blocks has been hashed, write hash tree to disk.
-    LOG(INFO) << "Writing verity hash tree to "
-              << partition_->readonly_target_path;
-    if (hash_tree_builder_) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-      TEST_AND_RETURN_FALSE_ERRNO(
-          write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-      auto success =
-          hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-            return utils::WriteAll(write_fd, data, size);
-          });
-      // hashtree builder already prints error messages.
-      TEST_AND_RETURN_FALSE(success);
-      hash_tree_builder_.reset();
-    }
+    TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
     hash_tree_written_ = true;
     if (partition_->fec_size != 0) {
       LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
@@ -313,6 +508,27 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
   }
   return true;
 }
+
+bool VerityWriterAndroid::WriteHashTree(FileDescriptor* write_fd) {
+  ScopedTrace trace("verity_hash_tree", partition_->name);
+  // All hash tree data blocks has been hashed, write hash tree to disk.
+  LOG(INFO) << "Writing verity hash tree to "
+            << partition_->readonly_target_path;
+  if (hash_tree_builder_) {
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
+    TEST_AND_RETURN_FALSE_ERRNO(
+        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
+    auto success =
+        hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
+          return utils::WriteAll(write_fd, data, size);
+        });
+    // hashtree builder already prints error messages.
+    TEST_AND_RETURN_FALSE(success);
+    hash_tree_builder_.reset();
+  }
+  return true;
+}
+
 bool VerityWriterAndroid::FECFinished() const {
   if ((encodeFEC_.Finished() || partition_->fec_size == 0) &&
       hash_tree_written_) {
@@ -334,6 +550,7 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
                                     uint32_t fec_roots,
                                     uint32_t block_size,
                                     bool verify_mode) {
+  ScopedTrace trace("verity_fec");
   TEST_AND_RETURN_FALSE(data_size % block_size == 0);
   TEST_AND_RETURN_FALSE(fec_roots >= 0 && fec_roots < FEC_RSM);
   // This is the N in RS(M, N), which is the number of bytes for each rs
@@ -17,8 +17,10 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 
+#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <verity/hash_tree_builder.h>
 #include <base/logging.h>
@@ -30,6 +32,7 @@ extern "C" {
 
 #include "payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 namespace chromeos_update_engine {
@@ -41,16 +44,17 @@ enum class EncodeFECStep {
 };
 class IncrementalEncodeFEC {
  public:
-  IncrementalEncodeFEC()
-      : rs_char_(nullptr, &free_rs_char), cache_fd_(nullptr, 1 * (1 << 20)) {}
-  // Initialize all member variables needed to performe FEC Computation
+  IncrementalEncodeFEC() : cache_fd_(nullptr, 1 * (1 << 20)) {}
+  // Initialize all member variables needed to performe FEC Computation. Each
+  // Compute() step encodes |_num_threads| rounds, one per thread.
   bool Init(const uint64_t _data_offset,
             const uint64_t _data_size,
             const uint64_t _fec_offset,
             const uint64_t _fec_size,
             const uint64_t _fec_roots,
             const uint64_t _block_size,
-            const bool _verify_mode);
+            const bool _verify_mode,
+            const size_t _num_threads = 1);
   bool Compute(FileDescriptor* _read_fd, FileDescriptor* _write_fd);
   void UpdateState();
   bool Finished() const;
@@ -58,8 +62,19 @@ class IncrementalEncodeFEC {
   double ReportProgress() const;
 
  private:
-  brillo::Blob rs_blocks_;
-  brillo::Blob buffer_;
+  using RsChar = std::unique_ptr<void, decltype(&free_rs_char)>;
+
+  // Interleaves and encodes the rounds of the current step assigned to worker
+  // |worker| out of the |num_rounds| in |round_data_|, using its codec.
+  void EncodeRounds(size_t worker, size_t num_rounds);
+
+  // The rs blocks data each round reads, in the order fec_ecc_interleave()
+  // gives, for the rounds of the current step.
+  brillo::Blob round_data_;
+  // One codec and interleaving buffer per worker thread.
+  std::vector<RsChar> rs_chars_;
+  std::vector<brillo::Blob> rs_blocks_;
+  size_t num_threads_{1};
   brillo::Blob fec_;
   brillo::Blob fec_read_;
   EncodeFECStep current_step_;
@@ -75,7 +90,6 @@ class IncrementalEncodeFEC {
   uint64_t block_size_;
   size_t rs_n_;
   bool verify_mode_;
-  std::unique_ptr<void, decltype(&free_rs_char)> rs_char_;
   UnownedCachedFileDescriptor cache_fd_;
 };
 
@@ -86,6 +100,9 @@ class VerityWriterAndroid : public VerityWriterInterface {
 
   bool Init(const InstallPlan::Partition& partition);
   bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override;
+  bool GetKnownData(uint64_t offset,
+                    uint64_t* start,
+                    uint64_t* end) const override;
   bool Finalize(FileDescriptor* read_fd, FileDescriptor* write_fd) override;
   bool IncrementalFinalize(FileDescriptor* read_fd,
                            FileDescriptor* write_fd) override;
@@ -116,13 +133,30 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         bool verify_mode);
 
  private:
+  // Builds the hash tree once all its data is hashed and writes it to
+  // |write_fd|.
+  bool WriteHashTree(FileDescriptor* write_fd);
+
+  // Takes the digests of the blocks copied from the source partition from its
+  // hash tree, once a sample of them matches the source data.
+  bool LoadSourceDigests();
+  // Hashes the |size| bytes of |data| at |offset| in the partition, except
+  // for the known data.
+  bool UpdateHashTree(uint64_t offset, const uint8_t* data, size_t size);
+  // Returns the end of the data passed to Update() so far and of the known
+  // data following it.
+  uint64_t GetHashedDataEnd() const;
+
   // stores the state of EncodeFEC
   IncrementalEncodeFEC encodeFEC_;
   bool hash_tree_written_ = false;
   const InstallPlan::Partition* partition_ = nullptr;
 
-  std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
+  std::unique_ptr<ParallelHashTreeBuilder> hash_tree_builder_;
   uint64_t total_offset_ = 0;
+  // The end offsets of the ranges of the partition whose digests were taken
+  // from the source hash tree, by start offset.
+  std::map<uint64_t, uint64_t> known_data_;
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
 
@@ -27,6 +27,39 @@
 
 namespace chromeos_update_engine {
 
+namespace {
+// Writes |data| to the target partition and its hash tree after it, skipping
+// the known data as FilesystemVerifierAction does, and returns the result.
+brillo::Blob BuildHashTree(const InstallPlan::Partition& partition,
+                           const brillo::Blob& data) {
+  test_utils::WriteFileVector(partition.target_path, data);
+  EintrSafeFileDescriptor fd;
+  EXPECT_TRUE(fd.Open(partition.target_path.c_str(), O_RDWR));
+  VerityWriterAndroid verity_writer;
+  EXPECT_TRUE(verity_writer.Init(partition));
+  uint64_t offset = 0;
+  while (offset < partition.hash_tree_offset) {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint64_t next = partition.hash_tree_offset;
+    if (verity_writer.GetKnownData(offset, &start, &end)) {
+      if (start == offset) {
+        offset = end;
+        continue;
+      }
+      next = start;
+    }
+    EXPECT_TRUE(
+        verity_writer.Update(offset, data.data() + offset, next - offset));
+    offset = next;
+  }
+  EXPECT_TRUE(verity_writer.Finalize(&fd, &fd));
+  brillo::Blob result;
+  EXPECT_TRUE(utils::ReadFile(partition.target_path, &result));
+  return result;
+}
+}  // namespace
+
 class VerityWriterAndroidTest : public ::testing::Test {
  protected:
   void SetUp() override {
@@ -165,6 +198,100 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   ASSERT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, MultiThreadedFECTest) {
+  // Enough data for several rounds, with a last partial round.
+  constexpr uint64_t kBlockSize = 4096;
+  constexpr uint64_t kFecRoots = 2;
+  constexpr uint64_t kRsN = FEC_RSM - kFecRoots;
+  constexpr uint64_t kDataSize = (kRsN * 4 + 10) * kBlockSize;
+  constexpr uint64_t kFecSize = 5 * kFecRoots * kBlockSize;
+  brillo::Blob part_data(kDataSize + kFecSize);
+  for (size_t i = 0; i < kDataSize; i++)
+    part_data[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             0,
+                                             kDataSize,
+                                             kDataSize,
+                                             kFecSize,
+                                             kFecRoots,
+                                             kBlockSize,
+                                             false /* verify_mode */));
+  brillo::Blob expected_part;
+  ASSERT_TRUE(utils::ReadFile(partition_.target_path, &expected_part));
+
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  for (bool verify_mode : {false, true}) {
+    IncrementalEncodeFEC encode_fec;
+    ASSERT_TRUE(encode_fec.Init(0,
+                                kDataSize,
+                                kDataSize,
+                                kFecSize,
+                                kFecRoots,
+                                kBlockSize,
+                                verify_mode,
+                                3 /* num_threads */));
+    while (!encode_fec.Finished()) {
+      ASSERT_TRUE(
+          encode_fec.Compute(partition_fd_.get(), partition_fd_.get()));
+    }
+    brillo::Blob actual_part;
+    ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+    ASSERT_EQ(expected_part, actual_part);
+  }
+}
+
+TEST_F(VerityWriterAndroidTest, IncrementalHashTreeTest) {
+  constexpr uint64_t kBlockSize = 4096;
+  partition_.hash_tree_algorithm = "sha256";
+  partition_.hash_tree_data_size = 8 * kBlockSize;
+  partition_.hash_tree_offset = partition_.hash_tree_data_size;
+  partition_.hash_tree_salt = {1, 2, 3};
+  brillo::Blob source_data(9 * kBlockSize);
+  for (size_t i = 0; i < partition_.hash_tree_data_size; i++)
+    source_data[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+  ScopedTempFile source_file;
+  InstallPlan::Partition source = partition_;
+  source.target_path = source_file.path();
+  BuildHashTree(source, source_data);
+
+  // Blocks 0 to 3 are copied from blocks 4 to 7 of the source, and block 7
+  // is unchanged.
+  brillo::Blob target_data = source_data;
+  std::copy(source_data.begin() + 4 * kBlockSize,
+            source_data.begin() + 8 * kBlockSize,
+            target_data.begin());
+  std::fill(target_data.begin() + 4 * kBlockSize,
+            target_data.begin() + 7 * kBlockSize,
+            0x5a);
+  const brillo::Blob expected = BuildHashTree(partition_, target_data);
+
+  partition_.source_path = source_file.path();
+  partition_.source_size = source_data.size();
+  partition_.copied_blocks = {{0, 4, 4}, {7, 7, 1}};
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  uint64_t start = 0;
+  uint64_t end = 0;
+  ASSERT_TRUE(verity_writer_.GetKnownData(0, &start, &end));
+  EXPECT_EQ(0u, start);
+  EXPECT_EQ(4 * kBlockSize, end);
+  ASSERT_TRUE(verity_writer_.GetKnownData(end, &start, &end));
+  EXPECT_EQ(7 * kBlockSize, start);
+  EXPECT_EQ(8 * kBlockSize, end);
+  EXPECT_FALSE(verity_writer_.GetKnownData(end, &start, &end));
+  EXPECT_EQ(expected, BuildHashTree(partition_, target_data));
+
+  // A source tree with another salt isn't used.
+  partition_.hash_tree_salt = {4};
+  partition_.copied_blocks.clear();
+  const brillo::Blob expected_salted = BuildHashTree(partition_, target_data);
+  partition_.copied_blocks = {{0, 4, 4}, {7, 7, 1}};
+  VerityWriterAndroid salted_verity_writer;
+  ASSERT_TRUE(salted_verity_writer.Init(partition_));
+  EXPECT_FALSE(salted_verity_writer.GetKnownData(0, &start, &end));
+  EXPECT_EQ(expected_salted, BuildHashTree(partition_, target_data));
+}
+
 TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
   partition_.hash_tree_size = 0;
   partition_.hash_tree_data_size = 0;
@@ -39,6 +39,15 @@ class VerityWriterInterface {
   // blocks has passed.
   virtual bool Update(uint64_t offset, const uint8_t* buffer, size_t size) = 0;
 
+  // Finds the first range [|start|, |end|) of the partition at or past
+  // |offset| whose hash tree digests are already known, so it can be skipped
+  // instead of passed to Update(). Returns false if there is none.
+  virtual bool GetKnownData(uint64_t offset,
+                            uint64_t* start,
+                            uint64_t* end) const {
+    return false;
+  }
+
   // Deprecated function -> use IncrementalFinalize to allow verity writes to be
   // interrupted. left for backwards compatibility
   virtual bool Finalize(FileDescriptor* read_fd, FileDescriptor* write_fd) {
@@ -0,0 +1,175 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/written_data_hasher.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kZerosSize = 64 * 1024;
+}  // namespace
+
+WrittenDataHasher::WrittenDataHasher(uint64_t size, size_t max_pending_bytes)
+    : size_(size), max_pending_bytes_(max_pending_bytes), limit_(size) {}
+
+void WrittenDataHasher::Write(uint64_t offset, const void* data, size_t count) {
+  Record(offset, static_cast<const uint8_t*>(data), count);
+}
+
+void WrittenDataHasher::WriteZeros(uint64_t offset, uint64_t count) {
+  Record(offset, nullptr, count);
+}
+
+uint64_t WrittenDataHasher::GetHashedPrefix(std::string* context) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (invalid_ || hashed_size_ == 0)
+    return 0;
+  *context = hasher_.GetContext();
+  return hashed_size_;
+}
+
+void WrittenDataHasher::Record(uint64_t offset,
+                               const uint8_t* data,
+                               uint64_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (invalid_ || offset >= size_ || length == 0)
+    return;
+  length = std::min(length, size_ - offset);
+  if (offset < hashed_size_ || Overlaps(offset, length)) {
+    Invalidate("data written twice");
+    return;
+  }
+  if (offset >= limit_)
+    return;
+
+  if (offset != hashed_size_) {
+    const size_t data_size = data ? length : 0;
+    if (pending_bytes_ + data_size > max_pending_bytes_) {
+      // Everything past this write can't be hashed anymore.
+      limit_ = offset;
+      for (auto it = pending_.lower_bound(limit_); it != pending_.end();) {
+        pending_bytes_ -= it->second.data.size();
+        it = pending_.erase(it);
+      }
+      return;
+    }
+    PendingWrite& pending = pending_[offset];
+    pending.length = length;
+    if (data)
+      pending.data.assign(data, data + length);
+    pending_bytes_ += data_size;
+    return;
+  }
+
+  if (!Hash(data, length))
+    return;
+  // Hash the writes that were waiting for this one.
+  while (!pending_.empty() && pending_.begin()->first == hashed_size_) {
+    PendingWrite pending = std::move(pending_.begin()->second);
+    pending_.erase(pending_.begin());
+    pending_bytes_ -= pending.data.size();
+    if (!Hash(pending.data.empty() ? nullptr : pending.data.data(),
+              pending.length)) {
+      return;
+    }
+  }
+}
+
+bool WrittenDataHasher::Hash(const uint8_t* data, uint64_t length) {
+  if (data) {
+    if (!hasher_.Update(data, length)) {
+      Invalidate("hash update failed");
+      return false;
+    }
+  } else {
+    static const brillo::Blob zeros(kZerosSize, 0);
+    for (uint64_t done = 0; done < length; done += kZerosSize) {
+      if (!hasher_.Update(zeros.data(),
+                          std::min<uint64_t>(kZerosSize, length - done))) {
+        Invalidate("hash update failed");
+        return false;
+      }
+    }
+  }
+  hashed_size_ += length;
+  return true;
+}
+
+bool WrittenDataHasher::Overlaps(uint64_t offset, uint64_t length) const {
+  // A write straddling |limit_| overlaps the dropped one starting there.
+  if (offset < limit_ && offset + length > limit_)
+    return true;
+  auto next = pending_.lower_bound(offset);
+  if (next != pending_.end() && next->first < offset + length)
+    return true;
+  if (next == pending_.begin())
+    return false;
+  auto prev = std::prev(next);
+  return prev->first + prev->second.length > offset;
+}
+
+void WrittenDataHasher::Invalidate(const char* reason) {
+  LOG(WARNING) << "Not using the hash of the written data: " << reason
+               << ", the whole partition will be read back.";
+  invalid_ = true;
+  pending_.clear();
+  pending_bytes_ = 0;
+}
+
+bool HashingExtentWriter::Init(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint32_t block_size) {
+  block_size_ = block_size;
+  extents_ = extents;
+  cur_extent_ = extents_.begin();
+  extent_bytes_written_ = 0;
+  return writer_->Init(extents, block_size);
+}
+
+bool HashingExtentWriter::Write(const void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(writer_->Write(bytes, count));
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  size_t bytes_recorded = 0;
+  while (bytes_recorded < count) {
+    TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
+    const uint64_t bytes_remaining_cur_extent =
+        cur_extent_->num_blocks() * block_size_ - extent_bytes_written_;
+    const size_t bytes_to_record = static_cast<size_t>(std::min<uint64_t>(
+        count - bytes_recorded, bytes_remaining_cur_extent));
+    if (cur_extent_->start_block() != kSparseHole) {
+      hasher_->Write(
+          cur_extent_->start_block() * block_size_ + extent_bytes_written_,
+          data + bytes_recorded,
+          bytes_to_record);
+    }
+    bytes_recorded += bytes_to_record;
+    extent_bytes_written_ += bytes_to_record;
+    if (extent_bytes_written_ == cur_extent_->num_blocks() * block_size_) {
+      extent_bytes_written_ = 0;
+      cur_extent_++;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
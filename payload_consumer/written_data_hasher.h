@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITTEN_DATA_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITTEN_DATA_HASHER_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+
+namespace chromeos_update_engine {
+
+// WrittenDataHasher computes the SHA-256 hash of the head of a partition from
+// the data written to it by the install operations, so that
+// FilesystemVerifierAction only needs to read back what comes after it.
+//
+// The hash is computed in order: writes at the end of the data hashed so far
+// are hashed right away, and writes past it are kept in memory, indexed by
+// offset, until the gap before them is filled. Once more than
+// |max_pending_bytes| would be kept, the writes past the first one that
+// doesn't fit are dropped and the hashed data stops before it. Writing again
+// over data already recorded invalidates the whole hash.
+//
+// All methods are thread safe, the writers of a partition share one instance.
+class WrittenDataHasher {
+ public:
+  static constexpr size_t kDefaultMaxPendingBytes = 32 * 1024 * 1024;
+
+  explicit WrittenDataHasher(
+      uint64_t size, size_t max_pending_bytes = kDefaultMaxPendingBytes);
+
+  // Records that |count| bytes of |data| were written at |offset|. Data past
+  // the size of the partition is ignored.
+  void Write(uint64_t offset, const void* data, size_t count);
+  // Records that |count| zero bytes were written at |offset|.
+  void WriteZeros(uint64_t offset, uint64_t count);
+
+  // Returns the number of bytes from the beginning of the partition hashed so
+  // far, and stores the context of their hash in |context| if it isn't 0.
+  uint64_t GetHashedPrefix(std::string* context) const;
+
+ private:
+  struct PendingWrite {
+    uint64_t length{0};
+    // Empty for zeros.
+    brillo::Blob data;
+  };
+
+  // Records |length| bytes of |data|, or zeros if |data| is null.
+  void Record(uint64_t offset, const uint8_t* data, uint64_t length);
+  // Hashes |length| bytes of |data|, or zeros if |data| is null, at the end of
+  // the hashed data.
+  bool Hash(const uint8_t* data, uint64_t length);
+  // Whether [offset, offset + length) overlaps a write already recorded.
+  bool Overlaps(uint64_t offset, uint64_t length) const;
+  void Invalidate(const char* reason);
+
+  const uint64_t size_;
+  const size_t max_pending_bytes_;
+
+  mutable std::mutex mutex_;
+  HashCalculator hasher_;
+  uint64_t hashed_size_{0};
+  // Writes at or past this offset are dropped.
+  uint64_t limit_;
+  bool invalid_{false};
+  std::map<uint64_t, PendingWrite> pending_;
+  size_t pending_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(WrittenDataHasher);
+};
+
+// HashingExtentWriter records the data written through |writer| in |hasher|.
+class HashingExtentWriter : public ExtentWriter {
+ public:
+  HashingExtentWriter(std::unique_ptr<ExtentWriter> writer,
+                      WrittenDataHasher* hasher)
+      : writer_(std::move(writer)), hasher_(hasher) {}
+  ~HashingExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  std::unique_ptr<ExtentWriter> writer_;
+  WrittenDataHasher* hasher_;
+
+  size_t block_size_{0};
+  // Bytes written into |cur_extent_| thus far.
+  uint64_t extent_bytes_written_{0};
+  google::protobuf::RepeatedPtrField<Extent> extents_;
+  google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashingExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITTEN_DATA_HASHER_H_
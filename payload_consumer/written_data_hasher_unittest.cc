@@ -0,0 +1,180 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/written_data_hasher.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 31 + i / kBlockSize);
+  return data;
+}
+
+// Returns the hash restored from the context of |hasher|, and the number of
+// bytes it covers in |size|.
+brillo::Blob GetPrefixHash(const WrittenDataHasher& hasher, uint64_t* size) {
+  std::string context;
+  *size = hasher.GetHashedPrefix(&context);
+  if (*size == 0)
+    return {};
+  HashCalculator calculator;
+  EXPECT_TRUE(calculator.SetContext(context));
+  EXPECT_TRUE(calculator.Finalize());
+  return calculator.raw_hash();
+}
+
+brillo::Blob HashOf(const brillo::Blob& data, size_t size) {
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(data.data(), size, &hash));
+  return hash;
+}
+
+void WriteBlock(WrittenDataHasher* hasher,
+                const brillo::Blob& data,
+                size_t block) {
+  hasher->Write(
+      block * kBlockSize, data.data() + block * kBlockSize, kBlockSize);
+}
+}  // namespace
+
+TEST(WrittenDataHasherTest, InOrderTest) {
+  brillo::Blob data = MakeData(kBlockSize * 4);
+  std::fill(data.begin() + kBlockSize, data.begin() + kBlockSize * 2, 0);
+  WrittenDataHasher hasher(data.size());
+  WriteBlock(&hasher, data, 0);
+  hasher.WriteZeros(kBlockSize, kBlockSize);
+  // Data past the end of the partition is ignored.
+  brillo::Blob tail(data.begin() + kBlockSize * 2, data.end());
+  tail.resize(tail.size() + kBlockSize);
+  hasher.Write(kBlockSize * 2, tail.data(), tail.size());
+
+  uint64_t size = 0;
+  EXPECT_EQ(HashOf(data, data.size()), GetPrefixHash(hasher, &size));
+  EXPECT_EQ(data.size(), size);
+}
+
+TEST(WrittenDataHasherTest, OutOfOrderTest) {
+  const brillo::Blob data = MakeData(kBlockSize * 8);
+  WrittenDataHasher hasher(data.size());
+  for (size_t block : {7, 5, 6, 1, 3, 2}) {
+    WriteBlock(&hasher, data, block);
+  }
+  uint64_t size = 0;
+  GetPrefixHash(hasher, &size);
+  EXPECT_EQ(0u, size);
+
+  WriteBlock(&hasher, data, 0);
+  EXPECT_EQ(HashOf(data, kBlockSize * 4), GetPrefixHash(hasher, &size));
+  EXPECT_EQ(kBlockSize * 4, size);
+
+  WriteBlock(&hasher, data, 4);
+  EXPECT_EQ(HashOf(data, data.size()), GetPrefixHash(hasher, &size));
+  EXPECT_EQ(data.size(), size);
+}
+
+TEST(WrittenDataHasherTest, PendingLimitTest) {
+  const brillo::Blob data = MakeData(kBlockSize * 8);
+  WrittenDataHasher hasher(data.size(), kBlockSize * 2);
+  // Blocks 2 and 3 are kept, block 5 doesn't fit, and zeros don't count.
+  WriteBlock(&hasher, data, 2);
+  WriteBlock(&hasher, data, 3);
+  WriteBlock(&hasher, data, 5);
+  WriteBlock(&hasher, data, 6);
+  brillo::Blob expected = data;
+  std::fill(expected.begin() + kBlockSize * 4,
+            expected.begin() + kBlockSize * 5,
+            0);
+  hasher.WriteZeros(kBlockSize * 4, kBlockSize);
+  WriteBlock(&hasher, data, 0);
+  WriteBlock(&hasher, data, 1);
+
+  uint64_t size = 0;
+  EXPECT_EQ(HashOf(expected, kBlockSize * 5), GetPrefixHash(hasher, &size));
+  EXPECT_EQ(kBlockSize * 5, size);
+  // The rest can't be hashed anymore.
+  WriteBlock(&hasher, data, 7);
+  GetPrefixHash(hasher, &size);
+  EXPECT_EQ(kBlockSize * 5, size);
+}
+
+TEST(WrittenDataHasherTest, WrittenTwiceTest) {
+  const brillo::Blob data = MakeData(kBlockSize * 4);
+  {
+    WrittenDataHasher hasher(data.size());
+    WriteBlock(&hasher, data, 0);
+    hasher.Write(kBlockSize / 2, data.data(), kBlockSize);
+    uint64_t size = 0;
+    GetPrefixHash(hasher, &size);
+    EXPECT_EQ(0u, size);
+  }
+  {
+    // Overlapping a pending write.
+    WrittenDataHasher hasher(data.size());
+    WriteBlock(&hasher, data, 2);
+    hasher.WriteZeros(kBlockSize, kBlockSize * 2);
+    WriteBlock(&hasher, data, 0);
+    uint64_t size = 0;
+    GetPrefixHash(hasher, &size);
+    EXPECT_EQ(0u, size);
+  }
+}
+
+TEST(WrittenDataHasherTest, HashingExtentWriterTest) {
+  const brillo::Blob data = MakeData(kBlockSize * 6);
+  WrittenDataHasher hasher(data.size());
+  auto fake_writer = std::make_unique<FakeExtentWriter>();
+  FakeExtentWriter* fake_writer_ptr = fake_writer.get();
+  HashingExtentWriter writer(std::move(fake_writer), &hasher);
+
+  // Writes blocks 3-5 then 0-2 of |data|, with a sparse hole in between.
+  const auto extents = {ExtentForRange(3, 3),
+                        ExtentForRange(kSparseHole, 1),
+                        ExtentForRange(0, 3)};
+  google::protobuf::RepeatedPtrField<Extent> dst_extents(extents.begin(),
+                                                         extents.end());
+  brillo::Blob written(data.begin() + kBlockSize * 3, data.end());
+  written.resize(written.size() + kBlockSize);
+  written.insert(written.end(), data.begin(), data.begin() + kBlockSize * 3);
+  ASSERT_TRUE(writer.Init(dst_extents, kBlockSize));
+  // Split across extents.
+  ASSERT_TRUE(writer.Write(written.data(), kBlockSize * 4 + 10));
+  ASSERT_TRUE(writer.Write(written.data() + kBlockSize * 4 + 10,
+                           written.size() - kBlockSize * 4 - 10));
+  EXPECT_EQ(written, fake_writer_ptr->WrittenData());
+
+  uint64_t size = 0;
+  EXPECT_EQ(HashOf(data, data.size()), GetPrefixHash(hasher, &size));
+  EXPECT_EQ(data.size(), size);
+}
+
+}  // namespace chromeos_update_engine
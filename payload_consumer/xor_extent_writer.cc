@@ -14,10 +14,10 @@
 // limitations under the License.
 //
 
-#include <algorithm>
 #include <optional>
 #include <vector>
 
+#include "update_engine/common/log_rate_limiter.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -28,7 +28,6 @@ namespace chromeos_update_engine {
 bool XORExtentWriter::WriteExtent(const void* bytes,
                                   const Extent& extent,
                                   const size_t size) {
-  brillo::Blob xor_block_data;
   const auto xor_extents = xor_map_.GetIntersectingExtents(extent);
   for (const auto& xor_ext : xor_extents) {
     const auto merge_op_opt = xor_map_.Get(xor_ext);
@@ -72,38 +71,36 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
             partition_size_ &&
         partition_size_ != 0;
     if (is_out_of_bound_read) {
-      LOG(INFO) << "Getting partial read for last block, converting "
-                   "XOR operation to a regular replace "
-                << xor_ext;
+      LOG_RATE_LIMITED(INFO)
+          << "Getting partial read for last block, converting XOR operation "
+             "to a regular replace "
+          << xor_ext;
       TEST_AND_RETURN_FALSE(
           cow_writer_->AddRawBlocks(xor_ext.start_block(),
                                     dst_block_data,
                                     xor_ext.num_blocks() * BlockSize()));
       continue;
     }
-    xor_block_data.resize(BlockSize() * xor_ext.num_blocks());
+    xor_block_data_.resize(BlockSize() * xor_ext.num_blocks());
     ssize_t bytes_read = 0;
     TEST_AND_RETURN_FALSE_ERRNO(
         utils::PReadAll(source_fd_,
-                        xor_block_data.data(),
-                        xor_block_data.size(),
+                        xor_block_data_.data(),
+                        xor_block_data_.size(),
                         src_offset + src_block * BlockSize(),
                         &bytes_read));
-    if (bytes_read != static_cast<ssize_t>(xor_block_data.size())) {
+    if (bytes_read != static_cast<ssize_t>(xor_block_data_.size())) {
       LOG(ERROR) << "bytes_read: " << bytes_read << ", expected to read "
-                 << xor_block_data.size() << " at block " << src_block
+                 << xor_block_data_.size() << " at block " << src_block
                  << " offset " << src_offset;
       return false;
     }
 
-    std::transform(xor_block_data.cbegin(),
-                   xor_block_data.cbegin() + xor_block_data.size(),
-                   dst_block_data,
-                   xor_block_data.begin(),
-                   std::bit_xor<unsigned char>{});
+    utils::XorBytes(
+        dst_block_data, xor_block_data_.size(), xor_block_data_.data());
     TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(xor_ext.start_block(),
-                                                    xor_block_data.data(),
-                                                    xor_block_data.size(),
+                                                    xor_block_data_.data(),
+                                                    xor_block_data_.size(),
                                                     src_block,
                                                     src_offset));
   }
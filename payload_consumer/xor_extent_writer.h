@@ -30,7 +30,7 @@ namespace chromeos_update_engine {
 
 // An extent writer that will selectively convert some of the blocks into an XOR
 // block. All blocks that appear in |xor_map| will be converted,
-class XORExtentWriter : public BlockExtentWriter {
+class XORExtentWriter final : public BlockExtentWriter {
  public:
   XORExtentWriter(const InstallOperation& op,
                   FileDescriptorPtr source_fd,
@@ -61,6 +61,9 @@ class XORExtentWriter : public BlockExtentWriter {
   const ExtentMap<const CowMergeOperation*>& xor_map_;
   android::snapshot::ICowWriter* cow_writer_;
   const size_t partition_size_;
+  // The source blocks XORed with the extent being written, kept to reuse
+  // their memory for the next extents.
+  brillo::Blob xor_block_data_;
 };
 
 }  // namespace chromeos_update_engine
@@ -16,12 +16,22 @@
 
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <thread>
+
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+
 using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+const brillo::Blob::size_type kOutputBufferLength = 256 * 1024;
 
 // xz uses a variable dictionary size which impacts on the compression ratio
 // and is required to be reconstructed in RAM during decompression. While we
@@ -50,21 +60,210 @@ const char* XzErrorString(enum xz_ret error) {
   }
 #undef __XZ_ERROR_STRING_CASE
 }
+
+// Size of the stream header and of the stream footer.
+constexpr size_t kXzStreamHeaderSize = 12;
+constexpr uint8_t kXzHeaderMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+constexpr uint8_t kXzFooterMagic[] = {'Y', 'Z'};
+// The blocks are decompressed in memory, larger ones go through the streaming
+// decoder instead.
+constexpr uint64_t kMaxParallelBlockSize = 16 * 1024 * 1024;
+constexpr unsigned int kMaxXzThreads = 4;
+
+uint32_t ReadLe32(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return le32toh(value);
+}
+
+void AppendLe32(brillo::Blob* out, uint32_t value) {
+  value = htole32(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+// Reads the xz variable-length integer at |*pos| and moves |*pos| past it.
+bool ReadVli(const uint8_t* data, size_t size, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 9 && *pos < size; i++) {
+    const uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+    if ((byte & 0x80) == 0)
+      return byte != 0 || i == 0;
+  }
+  return false;
+}
+
+void AppendVli(brillo::Blob* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+// Builds an xz stream holding only |block| of the stream |data|, with the
+// same stream flags.
+brillo::Blob MakeBlockStream(const uint8_t* data,
+                             const XzBlock& block) {
+  brillo::Blob stream(data, data + kXzStreamHeaderSize);
+  stream.insert(
+      stream.end(), data + block.offset, data + block.offset + block.size);
+
+  brillo::Blob index = {0x00, 0x01};
+  AppendVli(&index, block.unpadded_size);
+  AppendVli(&index, block.uncompressed_size);
+  index.resize((index.size() + 3) & ~3);
+  AppendLe32(&index, xz_crc32(index.data(), index.size(), 0));
+  stream.insert(stream.end(), index.begin(), index.end());
+
+  brillo::Blob footer;
+  AppendLe32(&footer, index.size() / 4 - 1);
+  footer.insert(footer.end(), data + 6, data + 8);
+  AppendLe32(&stream, xz_crc32(footer.data(), footer.size(), 0));
+  stream.insert(stream.end(), footer.begin(), footer.end());
+  stream.insert(
+      stream.end(), std::begin(kXzFooterMagic), std::end(kXzFooterMagic));
+  return stream;
+}
+
+// Decompresses the whole |stream| to |out|, which must be exactly the size of
+// the decompressed data.
+bool DecompressStream(const brillo::Blob& stream, brillo::Blob* out) {
+  std::unique_ptr<xz_dec, void (*)(xz_dec*)> decoder(
+      xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize), &xz_dec_end);
+  TEST_AND_RETURN_FALSE(decoder != nullptr);
+  xz_buf request;
+  request.in = stream.data();
+  request.in_pos = 0;
+  request.in_size = stream.size();
+  request.out = out->data();
+  request.out_pos = 0;
+  request.out_size = out->size();
+  xz_ret ret;
+  do {
+    ret = xz_dec_run(decoder.get(), &request);
+  } while (ret == XZ_OK);
+  if (ret != XZ_STREAM_END) {
+    LOG(ERROR) << "xz_dec_run returned " << XzErrorString(ret);
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(request.out_pos == request.out_size);
+  return true;
+}
 }  // namespace
 
-XzExtentWriter::~XzExtentWriter() {
+template <typename Writer>
+BasicXzExtentWriter<Writer>::~BasicXzExtentWriter() {
   stream_.reset();
   TEST_AND_RETURN(input_buffer_.empty());
 }
 
-bool XzExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
-                          uint32_t block_size) {
+template <typename Writer>
+bool BasicXzExtentWriter<Writer>::Init(const RepeatedPtrField<Extent>& extents,
+                                       uint32_t block_size) {
   stream_.reset(xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize));
   TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  write_called_ = false;
+  output_buffer_.resize(kOutputBufferLength);
   return underlying_writer_->Init(extents, block_size);
 }
 
-bool XzExtentWriter::Write(const void* bytes, size_t count) {
+bool ParseXzBlocks(const uint8_t* data,
+                   size_t size,
+                   std::vector<XzBlock>* blocks) {
+  if (size < 2 * kXzStreamHeaderSize ||
+      memcmp(data, kXzHeaderMagic, sizeof(kXzHeaderMagic)) != 0) {
+    return false;
+  }
+  // The footer holds the size of the index, which lists the blocks.
+  const uint8_t* footer = data + size - kXzStreamHeaderSize;
+  if (memcmp(footer + 10, kXzFooterMagic, sizeof(kXzFooterMagic)) != 0 ||
+      memcmp(footer + 8, data + 6, 2) != 0 ||
+      xz_crc32(footer + 4, 6, 0) != ReadLe32(footer)) {
+    return false;
+  }
+  const uint64_t index_size = (uint64_t{ReadLe32(footer + 4)} + 1) * 4;
+  if (index_size > size - 2 * kXzStreamHeaderSize)
+    return false;
+  const size_t index_offset = size - kXzStreamHeaderSize - index_size;
+  const uint8_t* index = data + index_offset;
+  const size_t records_end = index_size - 4;
+  if (index[0] != 0 ||
+      xz_crc32(index, records_end, 0) != ReadLe32(index + records_end)) {
+    return false;
+  }
+  size_t pos = 1;
+  uint64_t num_records;
+  if (!ReadVli(index, records_end, &pos, &num_records))
+    return false;
+  blocks->clear();
+  uint64_t offset = kXzStreamHeaderSize;
+  for (uint64_t i = 0; i < num_records; i++) {
+    XzBlock block;
+    if (!ReadVli(index, records_end, &pos, &block.unpadded_size) ||
+        !ReadVli(index, records_end, &pos, &block.uncompressed_size) ||
+        block.unpadded_size > index_offset - offset ||
+        block.uncompressed_size > kMaxParallelBlockSize) {
+      return false;
+    }
+    block.offset = offset;
+    block.size = (block.unpadded_size + 3) & ~uint64_t{3};
+    offset += block.size;
+    if (offset > index_offset)
+      return false;
+    blocks->push_back(block);
+  }
+  return offset == index_offset;
+}
+
+template <typename Writer>
+bool BasicXzExtentWriter<Writer>::WriteBlocksInParallel(
+    const uint8_t* data, const std::vector<Block>& blocks) {
+  const size_t num_threads =
+      std::clamp(std::thread::hardware_concurrency(), 1u, kMaxXzThreads);
+  struct DecompressedBlock {
+    brillo::Blob data;
+    std::future<bool> done;
+  };
+  // The blocks being decompressed, in order. A std::deque keeps the
+  // references to them valid while more are added.
+  std::deque<DecompressedBlock> pending;
+  size_t next = 0;
+  while (next < blocks.size() || !pending.empty()) {
+    while (next < blocks.size() && pending.size() < num_threads) {
+      const Block& block = blocks[next++];
+      DecompressedBlock* decompressed = &pending.emplace_back();
+      decompressed->data.resize(block.uncompressed_size);
+      decompressed->done =
+          std::async(std::launch::async, [data, &block, decompressed] {
+            return DecompressStream(MakeBlockStream(data, block),
+                                    &decompressed->data);
+          });
+    }
+    DecompressedBlock& decompressed = pending.front();
+    TEST_AND_RETURN_FALSE(decompressed.done.get());
+    TEST_AND_RETURN_FALSE(underlying_writer_->Write(decompressed.data.data(),
+                                                    decompressed.data.size()));
+    pending.pop_front();
+  }
+  return true;
+}
+
+template <typename Writer>
+bool BasicXzExtentWriter<Writer>::Write(const void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  if (!write_called_) {
+    write_called_ = true;
+    std::vector<Block> blocks;
+    if (ParseBlocks(static_cast<const uint8_t*>(bytes), count, &blocks) &&
+        blocks.size() > 1) {
+      // Nothing can follow the end of the stream.
+      stream_.reset();
+      return WriteBlocksInParallel(static_cast<const uint8_t*>(bytes), blocks);
+    }
+  }
+
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
   // source.
@@ -80,9 +279,8 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
-  request.out = output_buffer.data();
-  request.out_size = output_buffer.size();
+  request.out = output_buffer_.data();
+  request.out_size = output_buffer_.size();
   for (;;) {
     request.out_pos = 0;
 
@@ -96,14 +294,12 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
       break;
 
     TEST_AND_RETURN_FALSE(
-        underlying_writer_->Write(output_buffer.data(), request.out_pos));
+        underlying_writer_->Write(output_buffer_.data(), request.out_pos));
     if (ret == XZ_STREAM_END)
       CHECK_EQ(request.in_size, request.in_pos);
     if (request.in_size == request.in_pos)
       break;  // No more input to process.
   }
-  output_buffer.clear();
-
   // Store unconsumed data (if any) in |input_buffer_|. Since |input| can point
   // to the existing |input_buffer_| we create a new one before assigning it.
   brillo::Blob new_input_buffer(request.in + request.in_pos,
@@ -112,4 +308,8 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   return true;
 }
 
+template class BasicXzExtentWriter<ExtentWriter>;
+template class BasicXzExtentWriter<DirectExtentWriter>;
+template class BasicXzExtentWriter<SnapshotExtentWriter>;
+
 }  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 
@@ -29,34 +30,71 @@
 // XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
 // what it's given in Write using xz-embedded. Note that xz-embedded only
 // supports files with either no CRC or CRC-32. It passes the decompressed data
-// to an underlying ExtentWriter.
+// to an underlying ExtentWriter. When the whole stream is passed to the first
+// Write() and holds several blocks, the blocks are decompressed on several
+// threads. Like BasicZstdExtentWriter, the underlying writer is held as a
+// |Writer|.
 
 namespace chromeos_update_engine {
 
-class XzExtentWriter : public ExtentWriter {
+// A block of an xz stream, as listed in the index of the stream.
+struct XzBlock {
+  // Offset and size of the block in the stream, padding included.
+  size_t offset;
+  size_t size;
+  uint64_t unpadded_size;
+  uint64_t uncompressed_size;
+};
+
+// Returns the blocks of |data| if it is exactly one complete xz stream.
+bool ParseXzBlocks(const uint8_t* data,
+                   size_t size,
+                   std::vector<XzBlock>* blocks);
+
+template <typename Writer>
+class BasicXzExtentWriter : public ExtentWriter {
   struct xz_deleter {
     constexpr void operator()(xz_dec* p) { xz_dec_end(p); }
   };
 
  public:
-  explicit XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
+  explicit BasicXzExtentWriter(std::unique_ptr<Writer> underlying_writer)
       : underlying_writer_(std::move(underlying_writer)) {}
-  ~XzExtentWriter() override;
+  ~BasicXzExtentWriter() override;
 
   bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
             uint32_t block_size) override;
   bool Write(const void* bytes, size_t count) override;
 
+  using Block = XzBlock;
+
+  static bool ParseBlocks(const uint8_t* data,
+                          size_t size,
+                          std::vector<Block>* blocks) {
+    return ParseXzBlocks(data, size, blocks);
+  }
+
  private:
+  // Decompresses the |blocks| of the stream |data| on several threads and
+  // writes them in order.
+  bool WriteBlocksInParallel(const uint8_t* data,
+                             const std::vector<Block>& blocks);
+
   // The underlying ExtentWriter.
-  std::unique_ptr<ExtentWriter> underlying_writer_;
+  std::unique_ptr<Writer> underlying_writer_;
   // The opaque xz decompressor struct.
   std::unique_ptr<xz_dec, xz_deleter> stream_{nullptr};
   brillo::Blob input_buffer_;
+  // Allocated in Init() and reused by all the Write() calls.
+  brillo::Blob output_buffer_;
+  // Whether Write() was called since Init().
+  bool write_called_{false};
 
-  DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
+  DISALLOW_COPY_AND_ASSIGN(BasicXzExtentWriter);
 };
 
+using XzExtentWriter = BasicXzExtentWriter<ExtentWriter>;
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_XZ_EXTENT_WRITER_H_
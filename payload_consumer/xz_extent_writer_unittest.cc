@@ -77,6 +77,28 @@ const uint8_t kCompressed30KiBofA[] = {
     0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0x59, 0x5a,
 };
 
+// Data in three blocks, generated with:
+// printf 'a%.0s' {1..2048}; printf 'b%.0s' {1..2048}; printf 'c%.0s' {1..1000}
+// | xz -6 --check=crc32 --block-size=2048 |
+// hexdump -v -e '"    " 12/1 "0x%02x, " "\n"'
+const uint8_t kCompressedThreeBlocks[] = {
+    0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x01, 0x69, 0x22, 0xde, 0x36,
+    0x03, 0xc0, 0x19, 0x80, 0x10, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x20, 0x81, 0x21, 0xe0, 0x07, 0xff, 0x00, 0x11, 0x5d, 0x00, 0x30,
+    0xef, 0xfb, 0xbf, 0xfe, 0xa3, 0xb1, 0x5e, 0xe5, 0xf8, 0x3f, 0xb2, 0xa8,
+    0x81, 0x93, 0x96, 0x00, 0x00, 0x00, 0x00, 0x00, 0xec, 0x72, 0x3d, 0x44,
+    0x03, 0xc0, 0x19, 0x80, 0x10, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x20, 0x81, 0x21, 0xe0, 0x07, 0xff, 0x00, 0x11, 0x5d, 0x00, 0x31,
+    0x6f, 0xfb, 0xbf, 0xfe, 0xa3, 0xb1, 0x5e, 0xe5, 0xf8, 0x3f, 0xb2, 0xa8,
+    0x81, 0x93, 0x96, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79, 0x3f, 0xca, 0xfa,
+    0x03, 0xc0, 0x13, 0xe8, 0x07, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x00,
+    0x41, 0xab, 0x66, 0xa7, 0xe0, 0x03, 0xe7, 0x00, 0x0b, 0x5d, 0x00, 0x31,
+    0xef, 0xfb, 0xbf, 0xfe, 0xa3, 0xb0, 0xb9, 0xa6, 0x56, 0x00, 0x00, 0x00,
+    0x8b, 0x75, 0xef, 0xad, 0x00, 0x03, 0x2d, 0x80, 0x10, 0x2d, 0x80, 0x10,
+    0x27, 0xe8, 0x07, 0x00, 0x34, 0x42, 0x15, 0x47, 0x9b, 0xe3, 0x51, 0x40,
+    0x03, 0x00, 0x00, 0x00, 0x00, 0x01, 0x59, 0x5a,
+};
+
 }  // namespace
 
 class XzExtentWriterTest : public ::testing::Test {
@@ -148,4 +170,44 @@ TEST_F(XzExtentWriterTest, PartialDataIsKept) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, ParseBlocksTest) {
+  std::vector<XzExtentWriter::Block> blocks;
+  EXPECT_TRUE(XzExtentWriter::ParseBlocks(
+      kCompressedThreeBlocks, sizeof(kCompressedThreeBlocks), &blocks));
+  ASSERT_EQ(3u, blocks.size());
+  EXPECT_EQ(12u, blocks[0].offset);
+  EXPECT_EQ(48u, blocks[0].size);
+  EXPECT_EQ(2048u, blocks[0].uncompressed_size);
+  EXPECT_EQ(108u, blocks[2].offset);
+  EXPECT_EQ(40u, blocks[2].size);
+  EXPECT_EQ(1000u, blocks[2].uncompressed_size);
+
+  // Not a complete stream.
+  EXPECT_FALSE(XzExtentWriter::ParseBlocks(
+      kCompressedThreeBlocks, sizeof(kCompressedThreeBlocks) - 1, &blocks));
+  EXPECT_FALSE(XzExtentWriter::ParseBlocks(
+      kCompressedThreeBlocks + 1, sizeof(kCompressedThreeBlocks) - 1, &blocks));
+  EXPECT_TRUE(XzExtentWriter::ParseBlocks(
+      kCompressedDataCRC32, sizeof(kCompressedDataCRC32), &blocks));
+  EXPECT_EQ(1u, blocks.size());
+}
+
+TEST_F(XzExtentWriterTest, CompressedBlocksTest) {
+  WriteAll(brillo::Blob(std::begin(kCompressedThreeBlocks),
+                        std::end(kCompressedThreeBlocks)));
+  brillo::Blob expected_data(2048, 'a');
+  expected_data.insert(expected_data.end(), 2048, 'b');
+  expected_data.insert(expected_data.end(), 1000, 'c');
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(XzExtentWriterTest, CorruptedBlockRejected) {
+  brillo::Blob compressed(std::begin(kCompressedThreeBlocks),
+                          std::end(kCompressedThreeBlocks));
+  // In the compressed data of the second block.
+  compressed[80] ^= 0xff;
+  EXPECT_TRUE(xz_writer_->Init({}, 1024));
+  EXPECT_FALSE(xz_writer_->Write(compressed.data(), compressed.size()));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/snapshot_extent_writer.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The Frame_Header_Descriptor of a zstd frame follows its 4 bytes magic number.
+// Its 2 lowest bits are the size of the Dictionary_ID field, which is 0 if the
+// frame was compressed without a dictionary.
+constexpr size_t kFrameHeaderDescriptorOffset = 4;
+constexpr uint8_t kDictionaryIdFlagMask = 0x3;
+}  // namespace
+
+template <typename Writer>
+bool BasicZstdExtentWriter<Writer>::Init(
+    const RepeatedPtrField<Extent>& extents, uint32_t block_size) {
+  stream_.reset(ZSTD_createDStream());
+  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  const size_t ret = ZSTD_DCtx_setParameter(
+      stream_.get(), ZSTD_d_windowLogMax, kZstdMaxWindowLog);
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << "Failed to set the zstd window limit: "
+               << ZSTD_getErrorName(ret);
+    return false;
+  }
+  output_buffer_.resize(ZSTD_DStreamOutSize());
+  return underlying_writer_->Init(extents, block_size);
+}
+
+template <typename Writer>
+bool BasicZstdExtentWriter<Writer>::Write(const void* bytes, size_t count) {
+  if (!dictionary_ || dictionary_checked_)
+    return Decompress(bytes, count);
+
+  // A frame compressed without the dictionary must not be decompressed with
+  // it, its first sequences could use the repeat offsets of the dictionary.
+  const uint8_t* input = static_cast<const uint8_t*>(bytes);
+  const size_t used = std::min(
+      kFrameHeaderDescriptorOffset + 1 - frame_start_.size(), count);
+  frame_start_.insert(frame_start_.end(), input, input + used);
+  if (frame_start_.size() <= kFrameHeaderDescriptorOffset)
+    return true;
+  dictionary_checked_ = true;
+  if (frame_start_[kFrameHeaderDescriptorOffset] & kDictionaryIdFlagMask) {
+    const size_t ret = ZSTD_DCtx_refDDict(stream_.get(), dictionary_);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_DCtx_refDDict failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+  }
+  TEST_AND_RETURN_FALSE(Decompress(frame_start_.data(), frame_start_.size()));
+  frame_start_.clear();
+  return Decompress(input + used, count - used);
+}
+
+template <typename Writer>
+bool BasicZstdExtentWriter<Writer>::Decompress(const void* bytes,
+                                               size_t count) {
+  ZSTD_inBuffer input{bytes, count, 0};
+  for (;;) {
+    ZSTD_outBuffer output{output_buffer_.data(), output_buffer_.size(), 0};
+    const size_t ret = ZSTD_decompressStream(stream_.get(), &output, &input);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+    if (output.pos > 0) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(output_buffer_.data(), output.pos));
+    }
+    // A full output buffer may leave decompressed data in the stream even
+    // once all the input is consumed.
+    if (input.pos == input.size && output.pos < output.size)
+      break;
+  }
+  return true;
+}
+
+template class BasicZstdExtentWriter<ExtentWriter>;
+template class BasicZstdExtentWriter<DirectExtentWriter>;
+template class BasicZstdExtentWriter<SnapshotExtentWriter>;
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+
+namespace chromeos_update_engine {
+
+// The largest zstd window accepted in REPLACE_ZSTD operations, which is also
+// the memory needed to decompress them. The generator never uses a larger
+// window.
+constexpr int kZstdMaxWindowLog = 23;
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that zstd-decompresses
+// what it's given in Write. It passes the decompressed data to an underlying
+// ExtentWriter. A frame which has a dictionary ID is decompressed with the
+// dictionary passed, if any.
+// The underlying writer is held as a |Writer|, so that with one of the final
+// sinks the decompressed data is written without a virtual call. It is
+// instantiated for ExtentWriter, DirectExtentWriter and SnapshotExtentWriter.
+template <typename Writer>
+class BasicZstdExtentWriter : public ExtentWriter {
+  struct zstd_deleter {
+    void operator()(ZSTD_DStream* p) { ZSTD_freeDStream(p); }
+  };
+
+ public:
+  explicit BasicZstdExtentWriter(std::unique_ptr<Writer> underlying_writer,
+                                 const ZSTD_DDict* dictionary = nullptr)
+      : underlying_writer_(std::move(underlying_writer)),
+        dictionary_(dictionary) {}
+  ~BasicZstdExtentWriter() override = default;
+
+  bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  // Passes |bytes| to the decompression stream.
+  bool Decompress(const void* bytes, size_t count);
+
+  // The underlying ExtentWriter.
+  std::unique_ptr<Writer> underlying_writer_;
+  // The zstd decompression stream. It keeps the input it didn't consume yet.
+  std::unique_ptr<ZSTD_DStream, zstd_deleter> stream_{nullptr};
+  brillo::Blob output_buffer_;
+  // Not owned, may be null.
+  const ZSTD_DDict* dictionary_;
+  // The first bytes of the frame, kept until they tell whether it uses the
+  // dictionary.
+  brillo::Blob frame_start_;
+  bool dictionary_checked_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(BasicZstdExtentWriter);
+};
+
+using ZstdExtentWriter = BasicZstdExtentWriter<ExtentWriter>;
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
@@ -0,0 +1,235 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <fcntl.h>
+#include <zdict.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/memory/ptr_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+brillo::Blob Compress(const brillo::Blob& data) {
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  brillo::Blob compressed(ZSTD_compressBound(data.size()));
+  const size_t size = ZSTD_compress2(
+      cctx, compressed.data(), compressed.size(), data.data(), data.size());
+  ZSTD_freeCCtx(cctx);
+  EXPECT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  return compressed;
+}
+
+// Returns samples that share most of their content, to train a dictionary on.
+std::vector<brillo::Blob> DictionarySamples() {
+  std::vector<brillo::Blob> samples;
+  for (int i = 0; i < 200; i++) {
+    std::string sample;
+    for (int j = 0; j < 20; j++) {
+      sample += "ro.product.property" + std::to_string(j) + "=value" +
+                std::to_string((i * 31 + j * 7) % 97) + "\n";
+    }
+    samples.emplace_back(sample.begin(), sample.end());
+  }
+  return samples;
+}
+
+brillo::Blob TrainDictionary(const std::vector<brillo::Blob>& samples) {
+  brillo::Blob data;
+  std::vector<size_t> sizes;
+  for (const auto& sample : samples) {
+    data.insert(data.end(), sample.begin(), sample.end());
+    sizes.push_back(sample.size());
+  }
+  brillo::Blob dictionary(4096);
+  const size_t size = ZDICT_trainFromBuffer(dictionary.data(),
+                                            dictionary.size(),
+                                            data.data(),
+                                            sizes.data(),
+                                            sizes.size());
+  EXPECT_FALSE(ZDICT_isError(size));
+  dictionary.resize(size);
+  return dictionary;
+}
+}  // namespace
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_extent_writer_ = new FakeExtentWriter();
+    zstd_writer_.reset(
+        new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_)));
+  }
+
+  // Owned by |zstd_writer_|.
+  FakeExtentWriter* fake_extent_writer_{nullptr};
+  std::unique_ptr<ZstdExtentWriter> zstd_writer_;
+};
+
+TEST_F(ZstdExtentWriterTest, CompressedSampleData) {
+  const brillo::Blob data = {'R', 'e', 'd', 'u', 'n', 'd', 'a', 'a', 'a',
+                             'a', 'a', 'a', 'a', 'a', 'n', 't', '\n'};
+  const brillo::Blob compressed = Compress(data);
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_TRUE(fake_extent_writer_->InitCalled());
+  EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
+  // Decompresses to several output buffers from little input.
+  const brillo::Blob data(20 * ZSTD_DStreamOutSize(), 'a');
+  const brillo::Blob compressed = Compress(data);
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, PartialDataIsKept) {
+  brillo::Blob data(300 * 1024);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 7) % 251 + i / 4096;
+  const brillo::Blob compressed = Compress(data);
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  for (uint8_t byte : compressed)
+    ASSERT_TRUE(zstd_writer_->Write(&byte, 1));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, GarbageDataRejected) {
+  const brillo::Blob garbage(100, 'x');
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_FALSE(zstd_writer_->Write(garbage.data(), garbage.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, LargeWindowRejected) {
+  // The window isn't reduced to the size of the data when it isn't known
+  // before compressing.
+  const brillo::Blob data(1024, 'a');
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, kZstdMaxWindowLog + 1);
+  brillo::Blob compressed(ZSTD_compressBound(data.size()) + 64);
+  ZSTD_inBuffer input{data.data(), data.size(), 0};
+  ZSTD_outBuffer output{compressed.data(), compressed.size(), 0};
+  ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue);
+  const size_t ret = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+  ZSTD_freeCCtx(cctx);
+  ASSERT_EQ(0u, ret);
+  compressed.resize(output.pos);
+
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_FALSE(zstd_writer_->Write(compressed.data(), compressed.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, DictionaryTest) {
+  const std::vector<brillo::Blob> samples = DictionarySamples();
+  const brillo::Blob dictionary = TrainDictionary(samples);
+  ASSERT_FALSE(dictionary.empty());
+  ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+  ASSERT_NE(nullptr, ddict);
+
+  const brillo::Blob& data = samples[3];
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  brillo::Blob dict_compressed(ZSTD_compressBound(data.size()));
+  const size_t size = ZSTD_compress_usingDict(cctx,
+                                              dict_compressed.data(),
+                                              dict_compressed.size(),
+                                              data.data(),
+                                              data.size(),
+                                              dictionary.data(),
+                                              dictionary.size(),
+                                              19);
+  ZSTD_freeCCtx(cctx);
+  ASSERT_FALSE(ZSTD_isError(size));
+  dict_compressed.resize(size);
+  EXPECT_NE(0u, ZSTD_getDictID_fromFrame(dict_compressed.data(), size));
+
+  // The frame header is split over several writes.
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(
+      new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_), ddict));
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  for (uint8_t byte : dict_compressed)
+    ASSERT_TRUE(zstd_writer_->Write(&byte, 1));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+
+  // Frames without a dictionary ID are decompressed without the dictionary.
+  const brillo::Blob compressed = Compress(data);
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(
+      new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_), ddict));
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+
+  // Frames with a dictionary ID fail without the dictionary.
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(
+      new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_)));
+  ASSERT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_FALSE(
+      zstd_writer_->Write(dict_compressed.data(), dict_compressed.size()));
+
+  zstd_writer_.reset();
+  ZSTD_freeDDict(ddict);
+}
+
+TEST_F(ZstdExtentWriterTest, DirectExtentWriterSinkTest) {
+  constexpr size_t kBlockSize = 4096;
+  ScopedTempFile temp_file("ZstdExtentWriterTest-file.XXXXXX");
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor);
+  ASSERT_TRUE(fd->Open(temp_file.path().c_str(), O_RDWR, 0600));
+
+  brillo::Blob data(3 * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 13) % 253;
+  const brillo::Blob compressed = Compress(data);
+  const std::vector<Extent> extents = {ExtentForRange(2, 1),
+                                       ExtentForRange(0, 2)};
+  BasicZstdExtentWriter<DirectExtentWriter> writer(
+      std::make_unique<DirectExtentWriter>(fd));
+  ASSERT_TRUE(writer.Init({extents.begin(), extents.end()}, kBlockSize));
+  for (size_t offset = 0; offset < compressed.size(); offset += 1000) {
+    const size_t count = std::min<size_t>(1000, compressed.size() - offset);
+    ASSERT_TRUE(writer.Write(compressed.data() + offset, count));
+  }
+  fd->Close();
+
+  brillo::Blob written;
+  ASSERT_TRUE(utils::ReadFile(temp_file.path(), &written));
+  ASSERT_EQ(data.size(), written.size());
+  EXPECT_TRUE(std::equal(data.begin(),
+                         data.begin() + kBlockSize,
+                         written.begin() + 2 * kBlockSize));
+  EXPECT_TRUE(
+      std::equal(data.begin() + kBlockSize, data.end(), written.begin()));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,9 +17,13 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
 #include <utility>
 
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
@@ -27,6 +31,7 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/image_hash.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -34,6 +39,25 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Sets the blob of a merged REPLACE/REPLACE_BZ/REPLACE_XZ operation on a
+// worker thread.
+class ReplaceDataProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit ReplaceDataProcessor(std::function<void()> run)
+      : run_(std::move(run)) {}
+  ~ReplaceDataProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override { run_(); }
+
+ private:
+  std::function<void()> run_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaceDataProcessor);
+};
+}  // namespace
+
 bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      const PartitionConfig& old_part,
                                      const PartitionConfig& new_part,
@@ -41,6 +65,14 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      vector<AnnotatedOperation>* aops) {
   TEST_AND_RETURN_FALSE(old_part.name == new_part.name);
 
+  bool unchanged = false;
+  TEST_AND_RETURN_FALSE(
+      CopyUnchangedPartition(config, old_part, new_part, aops, &unchanged));
+  if (unchanged) {
+    LOG(INFO) << new_part.name << " is unchanged, copying it as is.";
+    return true;
+  }
+
   ssize_t hard_chunk_blocks =
       (config.hard_chunk_size == -1
            ? -1
@@ -54,7 +86,8 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                                        hard_chunk_blocks,
                                                        soft_chunk_blocks,
                                                        config,
-                                                       blob_file));
+                                                       blob_file,
+                                                       job_queue_));
   LOG(INFO) << "done reading " << new_part.name;
 
   SortOperationsByDestination(aops);
@@ -68,8 +101,14 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
   }
 
   LOG(INFO) << "Merging " << aops->size() << " operations.";
-  TEST_AND_RETURN_FALSE(MergeOperations(
-      aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
+  const size_t cow_chunk_blocks = config.cow_chunk_size / config.block_size;
+  TEST_AND_RETURN_FALSE(MergeOperations(aops,
+                                        config.version,
+                                        merge_chunk_blocks,
+                                        new_part.path,
+                                        blob_file,
+                                        job_queue_,
+                                        cow_chunk_blocks));
   LOG(INFO) << aops->size() << " operations after merge.";
 
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
@@ -87,9 +126,17 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
                                      const string& target_part_path,
                                      BlobFileWriter* blob_file) {
+  // Only do split if an operation has more than one dst extents, most
+  // operations are already fragmented.
+  size_t num_fragments = 0;
+  for (const AnnotatedOperation& aop : *aops)
+    num_fragments += std::max(aop.op.dst_extents_size(), 1);
+  if (num_fragments == aops->size())
+    return true;
+
   vector<AnnotatedOperation> fragmented_aops;
-  for (const AnnotatedOperation& aop : *aops) {
-    // Only do split if the operation has more than one dst extents.
+  fragmented_aops.reserve(num_fragments);
+  for (AnnotatedOperation& aop : *aops) {
     if (aop.op.dst_extents_size() > 1) {
       if (aop.op.type() == InstallOperation::SOURCE_COPY) {
         TEST_AND_RETURN_FALSE(SplitSourceCopy(aop, &fragmented_aops));
@@ -101,7 +148,7 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
         continue;
       }
     }
-    fragmented_aops.push_back(aop);
+    fragmented_aops.push_back(std::move(aop));
   }
   *aops = std::move(fragmented_aops);
   return true;
@@ -196,11 +243,21 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   const PayloadVersion& version,
                                   size_t chunk_blocks,
                                   const string& target_part_path,
-                                  BlobFileWriter* blob_file) {
+                                  BlobFileWriter* blob_file,
+                                  DiffJobQueue* job_queue,
+                                  size_t align_blocks) {
+  if (align_blocks > 1) {
+    SplitReplaceOperationsAtChunks(aops, align_blocks);
+    // Merged operations are whole chunks when they start on a chunk.
+    if (chunk_blocks >= align_blocks)
+      chunk_blocks -= chunk_blocks % align_blocks;
+  }
+
   vector<AnnotatedOperation> new_aops;
-  for (const AnnotatedOperation& curr_aop : *aops) {
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     AnnotatedOperation& last_aop = new_aops.back();
@@ -208,7 +265,7 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
 
     if (last_aop.op.dst_extents_size() <= 0 ||
         curr_aop.op.dst_extents_size() <= 0) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     uint32_t last_dst_idx = last_aop.op.dst_extents_size() - 1;
@@ -220,18 +277,24 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
         last_aop.op.dst_extents(last_dst_idx).num_blocks() +
         curr_aop.op.dst_extents(0).num_blocks();
     bool is_a_replace = IsAReplaceOperation(curr_aop.op.type());
+    // An operation not starting on a chunk stops at the end of the chunk.
+    const uint64_t last_start_block = last_aop.op.dst_extents(0).start_block();
+    bool crosses_chunk =
+        align_blocks > 1 && last_start_block % align_blocks != 0 &&
+        last_start_block / align_blocks !=
+            (curr_start_block + curr_aop.op.dst_extents(0).num_blocks() - 1) /
+                align_blocks;
 
     bool is_delta_op = curr_aop.op.type() == InstallOperation::SOURCE_COPY;
     if (((is_delta_op && (last_aop.op.type() == curr_aop.op.type())) ||
-         (is_a_replace && last_is_a_replace)) &&
+         (is_a_replace && last_is_a_replace && !crosses_chunk)) &&
         last_end_block == curr_start_block &&
         combined_block_count <= chunk_blocks) {
       // If the operations have the same type (which is a type that we can
       // merge), are contiguous, are fragmented to have one destination extent,
       // and their combined block count would be less than chunk size, merge
       // them.
-      last_aop.name = base::StringPrintf(
-          "%s,%s", last_aop.name.c_str(), curr_aop.name.c_str());
+      last_aop.name.append(",").append(curr_aop.name);
 
       if (is_delta_op) {
         ExtendExtents(last_aop.op.mutable_src_extents(),
@@ -244,21 +307,49 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
         last_aop.op.set_data_length(0);
     } else {
       // Otherwise just include the extent as is.
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
     }
   }
 
   // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ operations that have been
-  // merged.
+  // merged, each one is read and compressed independently of the others. The
+  // operations that weren't merged keep their blob.
+  std::atomic<bool> failed{false};
+  std::list<ReplaceDataProcessor> processors;
+  vector<DiffJobQueue::Job> jobs;
   for (AnnotatedOperation& curr_aop : new_aops) {
-    if (curr_aop.op.data_length() == 0 &&
-        IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+    if (curr_aop.op.data_length() != 0 ||
+        !IsAReplaceOperation(curr_aop.op.type())) {
+      continue;
     }
+    AnnotatedOperation* aop = &curr_aop;
+    processors.emplace_back(
+        [aop, &version, &target_part_path, blob_file, &failed] {
+          if (!AddDataAndSetType(aop, version, target_part_path, blob_file))
+            failed = true;
+        });
+    // The data is in memory along with its best and current compressed
+    // versions.
+    uint64_t num_blocks = utils::BlocksInExtents(aop->op.dst_extents());
+    jobs.push_back(
+        {num_blocks, &processors.back(), 3 * num_blocks * kBlockSize});
+  }
+  if (job_queue) {
+    job_queue->RunJobs(jobs);
+  } else if (processors.size() == 1) {
+    processors.front().Run();
+  } else if (!processors.empty()) {
+    base::DelegateSimpleThreadPool thread_pool(
+        "merge-operations",
+        std::min(diff_utils::GetMaxThreads(), processors.size()));
+    thread_pool.Start();
+    for (ReplaceDataProcessor& processor : processors)
+      thread_pool.AddWork(&processor);
+    thread_pool.JoinAll();
   }
+  TEST_AND_RETURN_FALSE(!failed);
 
-  *aops = new_aops;
+  *aops = std::move(new_aops);
   return true;
 }
 
@@ -289,6 +380,41 @@ bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
   return true;
 }
 
+void ABGenerator::SplitReplaceOperationsAtChunks(
+    vector<AnnotatedOperation>* aops, size_t align_blocks) {
+  vector<AnnotatedOperation> new_aops;
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& aop : *aops) {
+    if (!IsAReplaceOperation(aop.op.type()) || aop.op.dst_extents_size() != 1) {
+      new_aops.push_back(std::move(aop));
+      continue;
+    }
+    const Extent extent = aop.op.dst_extents(0);
+    const uint64_t end_block = extent.start_block() + extent.num_blocks();
+    uint64_t start_block = extent.start_block();
+    const uint64_t first_end =
+        (start_block / align_blocks + 1) * align_blocks;
+    if (first_end >= end_block) {
+      new_aops.push_back(std::move(aop));
+      continue;
+    }
+    for (int i = 0; start_block < end_block; i++) {
+      const uint64_t piece_end = std::min<uint64_t>(
+          (start_block / align_blocks + 1) * align_blocks, end_block);
+      AnnotatedOperation piece;
+      piece.name = base::StringPrintf("%s:%d", aop.name.c_str(), i);
+      piece.op.set_type(aop.op.type());
+      *piece.op.add_dst_extents() =
+          ExtentForRange(start_block, piece_end - start_block);
+      // Set the data length to zero so we know to add the blob later.
+      piece.op.set_data_length(0);
+      new_aops.push_back(std::move(piece));
+      start_block = piece_end;
+    }
+  }
+  *aops = std::move(new_aops);
+}
+
 bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
                                 const string& source_part_path) {
   for (AnnotatedOperation& aop : *aops) {
@@ -310,4 +436,34 @@ bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
   return true;
 }
 
+bool ABGenerator::CopyUnchangedPartition(const PayloadGenerationConfig& config,
+                                         const PartitionConfig& old_part,
+                                         const PartitionConfig& new_part,
+                                         vector<AnnotatedOperation>* aops,
+                                         bool* unchanged) {
+  *unchanged = false;
+  if (old_part.path.empty() || old_part.size != new_part.size ||
+      new_part.size == 0 || new_part.size % config.block_size != 0) {
+    return true;
+  }
+  // The hashes are those of the partition info, computed once.
+  brillo::Blob old_hash, new_hash;
+  TEST_AND_RETURN_FALSE(GetImageHash(old_part.path, old_part.size, &old_hash));
+  TEST_AND_RETURN_FALSE(GetImageHash(new_part.path, new_part.size, &new_hash));
+  if (old_hash != new_hash)
+    return true;
+
+  AnnotatedOperation aop;
+  aop.name = "<unchanged>";
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  const Extent extent = ExtentForRange(0, new_part.size / config.block_size);
+  *aop.op.add_src_extents() = extent;
+  *aop.op.add_dst_extents() = extent;
+  if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
+    aop.op.set_src_sha256_hash(old_hash.data(), old_hash.size());
+  aops->assign(1, aop);
+  *unchanged = true;
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -25,6 +25,7 @@
 
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/diff_job_queue.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/payload_generator/operations_generator.h"
@@ -39,6 +40,9 @@ namespace chromeos_update_engine {
 class ABGenerator : public OperationsGenerator {
  public:
   ABGenerator() = default;
+  // Diffs the files of the partitions on the threads of |job_queue|, which
+  // must outlive this object.
+  explicit ABGenerator(DiffJobQueue* job_queue) : job_queue_(job_queue) {}
 
   // Generate the update payload operations for the given partition using
   // SOURCE_* operations, used for generating deltas for the minor version
@@ -103,17 +107,34 @@ class ABGenerator : public OperationsGenerator {
   //   - Their combined blocks do not exceed |chunk_blocks| blocks.
   // Note that unlike other methods, you can't pass a negative number in
   // |chunk_blocks|.
+  // The blobs of the merged REPLACE_* operations are compressed on the threads
+  // of |job_queue| if not null, or on a thread pool of their own otherwise.
+  // If |align_blocks| is more than 1, the REPLACE_* operations are first split
+  // at the multiples of |align_blocks|, and merged only into operations that
+  // start on one of them or don't go past the next one.
   static bool MergeOperations(std::vector<AnnotatedOperation>* aops,
                               const PayloadVersion& version,
                               size_t chunk_blocks,
                               const std::string& target_part,
-                              BlobFileWriter* blob_file);
+                              BlobFileWriter* blob_file,
+                              DiffJobQueue* job_queue = nullptr,
+                              size_t align_blocks = 0);
 
   // Takes a vector of AnnotatedOperations |aops|, adds source hash to all
   // operations that have src_extents.
   static bool AddSourceHash(std::vector<AnnotatedOperation>* aops,
                             const std::string& source_part_path);
 
+  // Sets |unchanged| to whether |old_part| and |new_part| have the same size
+  // and hash. If they do, |aops| is set to a single SOURCE_COPY of all the
+  // blocks to the same place, whose source hash is the hash of the partition,
+  // so that the partition isn't diffed.
+  static bool CopyUnchangedPartition(const PayloadGenerationConfig& config,
+                                     const PartitionConfig& old_part,
+                                     const PartitionConfig& new_part,
+                                     std::vector<AnnotatedOperation>* aops,
+                                     bool* unchanged);
+
  private:
   // Adds the data payload for a REPLACE/REPLACE_BZ/REPLACE_XZ operation |aop|
   // by reading its output extents from |target_part_path| and appending a
@@ -127,6 +148,14 @@ class ABGenerator : public OperationsGenerator {
                                 const std::string& target_part_path,
                                 BlobFileWriter* blob_file);
 
+  // Splits the REPLACE_* operations of |aops| with one dst extent that goes
+  // past a multiple of |align_blocks| into operations that don't. The new
+  // operations have no blob yet.
+  static void SplitReplaceOperationsAtChunks(
+      std::vector<AnnotatedOperation>* aops, size_t align_blocks);
+
+  DiffJobQueue* job_queue_{nullptr};
+
   DISALLOW_COPY_AND_ASSIGN(ABGenerator);
 };
 
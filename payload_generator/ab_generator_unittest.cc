@@ -22,6 +22,7 @@
 
 #include <random>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -31,6 +32,8 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_job_queue.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/xz.h"
@@ -379,6 +382,58 @@ TEST_F(ABGeneratorTest, SplitSourceCopyTest) {
   EXPECT_EQ(3U, third_op.dst_extents(0).num_blocks());
 }
 
+TEST_F(ABGeneratorTest, CopyUnchangedPartitionTest) {
+  brillo::Blob part_data(4 * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  ScopedTempFile old_file("CopyUnchangedPartitionTest_old.XXXXXX");
+  ScopedTempFile new_file("CopyUnchangedPartitionTest_new.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(old_file.path(), part_data));
+  ASSERT_TRUE(test_utils::WriteFileVector(new_file.path(), part_data));
+
+  PayloadGenerationConfig config;
+  config.block_size = kBlockSize;
+  config.version.minor = kOpSrcHashMinorPayloadVersion;
+  PartitionConfig old_part("part");
+  old_part.path = old_file.path();
+  old_part.size = part_data.size();
+  PartitionConfig new_part("part");
+  new_part.path = new_file.path();
+  new_part.size = part_data.size();
+
+  vector<AnnotatedOperation> aops;
+  bool unchanged = false;
+  ASSERT_TRUE(ABGenerator::CopyUnchangedPartition(
+      config, old_part, new_part, &aops, &unchanged));
+  EXPECT_TRUE(unchanged);
+  ASSERT_EQ(1U, aops.size());
+  const InstallOperation& op = aops[0].op;
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, op.type());
+  EXPECT_TRUE(IsIdentityCopy(op));
+  ASSERT_EQ(1, op.dst_extents().size());
+  EXPECT_TRUE(ExtentEquals(op.dst_extents(0), 0, 4));
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &hash));
+  EXPECT_EQ(hash, brillo::Blob(op.src_sha256_hash().begin(),
+                               op.src_sha256_hash().end()));
+
+  // A partition with one block changed is diffed.
+  part_data[kBlockSize]++;
+  ScopedTempFile changed_file("CopyUnchangedPartitionTest_changed.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(changed_file.path(), part_data));
+  new_part.path = changed_file.path();
+  aops.clear();
+  ASSERT_TRUE(ABGenerator::CopyUnchangedPartition(
+      config, old_part, new_part, &aops, &unchanged));
+  EXPECT_FALSE(unchanged);
+  EXPECT_TRUE(aops.empty());
+
+  // So is a full payload.
+  old_part.path.clear();
+  ASSERT_TRUE(ABGenerator::CopyUnchangedPartition(
+      config, old_part, old_part, &aops, &unchanged));
+  EXPECT_FALSE(unchanged);
+}
+
 TEST_F(ABGeneratorTest, SplitReplaceTest) {
   TestSplitReplaceOrReplaceXzOperation(InstallOperation::REPLACE, false);
 }
@@ -495,6 +550,125 @@ TEST_F(ABGeneratorTest, MergeReplaceXzOperationsToReplaceTest) {
   TestMergeReplaceOrReplaceXzOperations(InstallOperation::REPLACE_XZ, false);
 }
 
+TEST_F(ABGeneratorTest, MergeReplaceOperationsWithJobQueueTest) {
+  // Pairs of contiguous REPLACE operations separated by a block that isn't
+  // written, half of them compressible.
+  constexpr size_t kNumPairs = 8;
+  const size_t part_num_blocks = kNumPairs * 3;
+  brillo::Blob part_data(part_num_blocks * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  std::mt19937 gen(12345);
+  for (size_t i = 0; i < part_data.size(); i += 2 * 3 * kBlockSize) {
+    for (size_t j = i; j < i + 3 * kBlockSize; j++)
+      part_data[j] = static_cast<uint8_t>(gen());
+  }
+  ScopedTempFile part_file("MergeReplaceWithJobQueueTest_part.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+
+  vector<AnnotatedOperation> orig_aops;
+  for (size_t i = 0; i < kNumPairs * 2; i++) {
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::REPLACE);
+    *(aop.op.add_dst_extents()) = ExtentForRange(i / 2 * 3 + i % 2, 1);
+    aop.op.set_data_offset(i * kBlockSize);
+    aop.op.set_data_length(kBlockSize);
+    aop.name = std::to_string(i);
+    orig_aops.push_back(aop);
+  }
+
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  ScopedTempFile data_file("MergeReplaceWithJobQueueTest_data.XXXXXX");
+  int data_fd = open(data_file.path().c_str(), O_RDWR, 000);
+  EXPECT_GE(data_fd, 0);
+  ScopedFdCloser data_fd_closer(&data_fd);
+  off_t data_file_size = 0;
+  BlobFileWriter blob_file(data_fd, &data_file_size);
+
+  vector<AnnotatedOperation> aops = orig_aops;
+  EXPECT_TRUE(ABGenerator::MergeOperations(
+      &aops, version, 2, part_file.path(), &blob_file));
+  DiffJobQueue job_queue(4);
+  vector<AnnotatedOperation> queued_aops = orig_aops;
+  EXPECT_TRUE(ABGenerator::MergeOperations(
+      &queued_aops, version, 2, part_file.path(), &blob_file, &job_queue));
+
+  // The job queue gives the same operations as the thread pool.
+  ASSERT_EQ(kNumPairs, aops.size());
+  ASSERT_EQ(aops.size(), queued_aops.size());
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(std::to_string(2 * i) + "," + std::to_string(2 * i + 1),
+              queued_aops[i].name);
+    EXPECT_EQ(i % 2 ? InstallOperation::REPLACE_XZ : InstallOperation::REPLACE,
+              queued_aops[i].op.type());
+    EXPECT_EQ(aops[i].op.type(), queued_aops[i].op.type());
+    EXPECT_EQ(aops[i].op.data_length(), queued_aops[i].op.data_length());
+    EXPECT_EQ(1, queued_aops[i].op.dst_extents_size());
+    EXPECT_TRUE(ExtentEquals(queued_aops[i].op.dst_extents(0), i * 3, 2));
+
+    brillo::Blob blob(aops[i].op.data_length());
+    brillo::Blob queued_blob(queued_aops[i].op.data_length());
+    ssize_t bytes_read;
+    ASSERT_TRUE(utils::PReadAll(data_fd,
+                                blob.data(),
+                                blob.size(),
+                                aops[i].op.data_offset(),
+                                &bytes_read));
+    ASSERT_TRUE(utils::PReadAll(data_fd,
+                                queued_blob.data(),
+                                queued_blob.size(),
+                                queued_aops[i].op.data_offset(),
+                                &bytes_read));
+    EXPECT_EQ(blob, queued_blob);
+  }
+}
+
+TEST_F(ABGeneratorTest, MergeReplaceAlignedToChunksTest) {
+  brillo::Blob part_data(16 * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  ScopedTempFile part_file("MergeReplaceAlignedToChunksTest_part.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+
+  vector<AnnotatedOperation> aops;
+  for (const auto& [name, start_block, num_blocks] :
+       {std::tuple{"A", 1, 5}, std::tuple{"B", 6, 3}, std::tuple{"C", 9, 7}}) {
+    AnnotatedOperation aop;
+    aop.name = name;
+    aop.op.set_type(InstallOperation::REPLACE);
+    *(aop.op.add_dst_extents()) = ExtentForRange(start_block, num_blocks);
+    aop.op.set_data_offset(start_block * kBlockSize);
+    aop.op.set_data_length(num_blocks * kBlockSize);
+    aops.push_back(aop);
+  }
+
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  ScopedTempFile data_file("MergeReplaceAlignedToChunksTest_data.XXXXXX");
+  int data_fd = open(data_file.path().c_str(), O_RDWR, 000);
+  EXPECT_GE(data_fd, 0);
+  ScopedFdCloser data_fd_closer(&data_fd);
+  off_t data_file_size = 0;
+  BlobFileWriter blob_file(data_fd, &data_file_size);
+
+  // Chunks of 4 blocks, merged operations of up to 10 blocks use whole
+  // chunks.
+  EXPECT_TRUE(ABGenerator::MergeOperations(
+      &aops, version, 10, part_file.path(), &blob_file, nullptr, 4));
+
+  ASSERT_EQ(3U, aops.size());
+  EXPECT_EQ("A:0", aops[0].name);
+  EXPECT_TRUE(ExtentEquals(aops[0].op.dst_extents(0), 1, 3));
+  EXPECT_EQ("A:1,B:0,B:1,C:0", aops[1].name);
+  EXPECT_TRUE(ExtentEquals(aops[1].op.dst_extents(0), 4, 8));
+  EXPECT_EQ("C:1", aops[2].name);
+  EXPECT_TRUE(ExtentEquals(aops[2].op.dst_extents(0), 12, 4));
+  for (const AnnotatedOperation& aop : aops) {
+    EXPECT_EQ(1, aop.op.dst_extents_size());
+    EXPECT_TRUE(diff_utils::IsAReplaceOperation(aop.op.type()));
+    EXPECT_GT(aop.op.data_length(), 0U);
+  }
+}
+
 TEST_F(ABGeneratorTest, NoMergeOperationsTest) {
   // Test to make sure we don't merge operations that shouldn't be merged.
   vector<AnnotatedOperation> aops;
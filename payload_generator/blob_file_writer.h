@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 
+#include <atomic>
+
 #include <base/macros.h>
 
 #include <base/synchronization/lock.h>
@@ -29,23 +31,32 @@ class BlobFileWriter {
   // Create the BlobFileWriter object that will manage the blobs stored to
   // |blob_fd| in a thread safe way.
   BlobFileWriter(int blob_fd, off_t* blob_file_size)
-      : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {}
+      : blob_fd_(blob_fd),
+        blob_file_size_(blob_file_size),
+        next_offset_(blob_file_size ? *blob_file_size : 0) {}
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. Blobs stored from several threads at
+  // once are written in parallel.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // Increase |total_blobs| by |increment|. Thread safe.
   void IncTotalBlobs(size_t increment);
 
  private:
-  size_t total_blobs_{0};
-  size_t stored_blobs_{0};
+  std::atomic<size_t> total_blobs_{0};
+  std::atomic<size_t> stored_blobs_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
   int blob_fd_;
+
+  // The size of the file once all the blobs being stored are written, it only
+  // grows when the blobs are written. Protected with the |blob_mutex_|.
   off_t* blob_file_size_;
 
+  // The offset where the next blob is stored. Each blob reserves its range of
+  // the file by increasing it.
+  std::atomic<off_t> next_offset_;
+
   base::Lock blob_mutex_;
 
   DISALLOW_COPY_AND_ASSIGN(BlobFileWriter);
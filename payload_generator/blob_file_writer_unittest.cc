@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -49,4 +51,42 @@ TEST(BlobFileWriterTest, SimpleTest) {
   EXPECT_EQ(blob, stored_blob);
 }
 
+TEST(BlobFileWriterTest, ConcurrentStoreBlobTest) {
+  ScopedTempFile blob_file("BlobFileWriterTest.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+
+  constexpr size_t kNumThreads = 8;
+  constexpr size_t kBlobsPerThread = 100;
+  std::vector<std::vector<off_t>> offsets(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&, i] {
+      // Each thread stores blobs of its own size filled with its own value.
+      const brillo::Blob blob(i + 1, 'a' + i);
+      for (size_t j = 0; j < kBlobsPerThread; j++)
+        offsets[i].push_back(blob_file_writer.StoreBlob(blob));
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  const off_t kTotalSize =
+      kBlobsPerThread * kNumThreads * (kNumThreads + 1) / 2;
+  EXPECT_EQ(kTotalSize, blob_file_size);
+  brillo::Blob stored_data(kTotalSize);
+  ssize_t bytes_read;
+  ASSERT_TRUE(utils::PReadAll(
+      blob_file.fd(), stored_data.data(), kTotalSize, 0, &bytes_read));
+  EXPECT_EQ(kTotalSize, bytes_read);
+  for (size_t i = 0; i < kNumThreads; i++) {
+    for (off_t offset : offsets[i]) {
+      ASSERT_GE(offset, 0);
+      EXPECT_EQ(brillo::Blob(i + 1, 'a' + i),
+                brillo::Blob(stored_data.begin() + offset,
+                             stored_data.begin() + offset + i + 1));
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,110 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_index_cache.h"
+
+#include <string.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Bump when the format of the entries or the hash of the blocks change.
+constexpr uint64_t kBlockIndexCacheVersion = 1;
+
+// Each entry is this header followed by the hashes of the blocks, then their
+// first copies.
+struct EntryHeader {
+  uint64_t num_blocks;
+};
+}  // namespace
+
+string BlockIndexCache::Key(const brillo::Blob& image_hash,
+                            size_t block_size) {
+  HashCalculator hasher;
+  const uint64_t version = kBlockIndexCacheVersion;
+  hasher.Update(&version, sizeof(version));
+  const string tag = "block-index";
+  hasher.Update(tag.data(), tag.size() + 1);
+  const uint64_t block_size64 = block_size;
+  hasher.Update(&block_size64, sizeof(block_size64));
+  hasher.Update(image_hash.data(), image_hash.size());
+  hasher.Finalize();
+  return DiffCache::Key(hasher.raw_hash());
+}
+
+bool BlockIndexCache::Lookup(const string& key,
+                             size_t num_blocks,
+                             BlockMapping::ImageIndex* index) const {
+  brillo::Blob data;
+  if (!cache_.LookupData(key, &data))
+    return false;
+  TEST_AND_RETURN_FALSE(Deserialize(data, index));
+  TEST_AND_RETURN_FALSE(index->hashes.size() == num_blocks);
+  return true;
+}
+
+bool BlockIndexCache::Store(const string& key,
+                            const BlockMapping::ImageIndex& index) const {
+  return cache_.StoreData(key, Serialize(index));
+}
+
+brillo::Blob BlockIndexCache::Serialize(const BlockMapping::ImageIndex& index) {
+  const EntryHeader header{index.hashes.size()};
+  const size_t hashes_size = index.hashes.size() * sizeof(index.hashes[0]);
+  const size_t first_copies_size =
+      index.first_copies.size() * sizeof(index.first_copies[0]);
+  brillo::Blob data(sizeof(header) + hashes_size + first_copies_size);
+  memcpy(data.data(), &header, sizeof(header));
+  memcpy(data.data() + sizeof(header), index.hashes.data(), hashes_size);
+  memcpy(data.data() + sizeof(header) + hashes_size,
+         index.first_copies.data(),
+         first_copies_size);
+  return data;
+}
+
+bool BlockIndexCache::Deserialize(const brillo::Blob& data,
+                                  BlockMapping::ImageIndex* index) {
+  EntryHeader header;
+  TEST_AND_RETURN_FALSE(data.size() >= sizeof(header));
+  memcpy(&header, data.data(), sizeof(header));
+  constexpr size_t kBlockEntrySize =
+      sizeof(index->hashes[0]) + sizeof(index->first_copies[0]);
+  TEST_AND_RETURN_FALSE((data.size() - sizeof(header)) / kBlockEntrySize ==
+                            header.num_blocks &&
+                        (data.size() - sizeof(header)) % kBlockEntrySize == 0);
+  index->hashes.resize(header.num_blocks);
+  index->first_copies.resize(header.num_blocks);
+  const size_t hashes_size = index->hashes.size() * sizeof(index->hashes[0]);
+  memcpy(index->hashes.data(), data.data() + sizeof(header), hashes_size);
+  memcpy(index->first_copies.data(),
+         data.data() + sizeof(header) + hashes_size,
+         index->first_copies.size() * sizeof(index->first_copies[0]));
+  // Each block is the first of its copies or comes after it, as
+  // BlockMapping::AddIndexedDiskBlocks() requires.
+  for (size_t i = 0; i < header.num_blocks; i++) {
+    const uint32_t first_copy = index->first_copies[i];
+    TEST_AND_RETURN_FALSE(first_copy == BlockMapping::ImageIndex::kZeroBlock ||
+                          first_copy <= i);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
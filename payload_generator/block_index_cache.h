@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_INDEX_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_INDEX_CACHE_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/diff_cache.h"
+
+namespace chromeos_update_engine {
+
+// BlockIndexCache keeps the BlockMapping::ImageIndex of the source images in
+// a DiffCache directory, keyed by the hash of the image, so that the payloads
+// generated from the same source image don't read and hash all its blocks
+// again to find the moved and zero blocks.
+class BlockIndexCache {
+ public:
+  explicit BlockIndexCache(const std::string& dir) : cache_(dir) {}
+
+  // Returns the key of the index of the image whose SHA-256 hash is
+  // |image_hash|, split in blocks of |block_size| bytes.
+  static std::string Key(const brillo::Blob& image_hash, size_t block_size);
+
+  // Reads the index stored for |key|. Returns false if there is no valid entry
+  // for it with |num_blocks| blocks.
+  bool Lookup(const std::string& key,
+              size_t num_blocks,
+              BlockMapping::ImageIndex* index) const;
+
+  bool Store(const std::string& key,
+             const BlockMapping::ImageIndex& index) const;
+
+  static brillo::Blob Serialize(const BlockMapping::ImageIndex& index);
+  static bool Deserialize(const brillo::Blob& data,
+                          BlockMapping::ImageIndex* index);
+
+ private:
+  DiffCache cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockIndexCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_INDEX_CACHE_H_
@@ -0,0 +1,80 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/block_index_cache.h"
+
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+BlockMapping::ImageIndex TestIndex() {
+  BlockMapping::ImageIndex index;
+  index.hashes = {0x1234, 0, 0x5678, 0x1234};
+  index.first_copies = {0, BlockMapping::ImageIndex::kZeroBlock, 2, 0};
+  return index;
+}
+}  // namespace
+
+TEST(BlockIndexCacheTest, SerializeTest) {
+  const BlockMapping::ImageIndex index = TestIndex();
+  const brillo::Blob data = BlockIndexCache::Serialize(index);
+  BlockMapping::ImageIndex read_index;
+  ASSERT_TRUE(BlockIndexCache::Deserialize(data, &read_index));
+  EXPECT_EQ(index.hashes, read_index.hashes);
+  EXPECT_EQ(index.first_copies, read_index.first_copies);
+
+  // Truncated or with trailing data.
+  EXPECT_FALSE(BlockIndexCache::Deserialize(
+      brillo::Blob(data.begin(), data.end() - 1), &read_index));
+  brillo::Blob longer_data = data;
+  longer_data.resize(data.size() + 12);
+  EXPECT_FALSE(BlockIndexCache::Deserialize(longer_data, &read_index));
+
+  // A block whose first copy comes after it.
+  BlockMapping::ImageIndex invalid_index = TestIndex();
+  invalid_index.first_copies[0] = 2;
+  EXPECT_FALSE(BlockIndexCache::Deserialize(
+      BlockIndexCache::Serialize(invalid_index), &read_index));
+}
+
+TEST(BlockIndexCacheTest, StoreLookupTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const brillo::Blob image_hash(32, 0xab);
+  const string key = BlockIndexCache::Key(image_hash, 4096);
+  EXPECT_NE(key, BlockIndexCache::Key(image_hash, 512));
+  EXPECT_NE(key, BlockIndexCache::Key(brillo::Blob(32, 0xcd), 4096));
+
+  BlockIndexCache cache(temp_dir.GetPath().value());
+  BlockMapping::ImageIndex index;
+  EXPECT_FALSE(cache.Lookup(key, 4, &index));
+  ASSERT_TRUE(cache.Store(key, TestIndex()));
+  EXPECT_TRUE(cache.Lookup(key, 4, &index));
+  EXPECT_EQ(TestIndex().hashes, index.hashes);
+  EXPECT_EQ(TestIndex().first_copies, index.first_copies);
+  // An image of another size.
+  EXPECT_FALSE(cache.Lookup(key, 5, &index));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,11 +17,16 @@
 #include "update_engine/payload_generator/block_mapping.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -32,99 +37,302 @@ using std::vector;
 
 namespace {
 
-size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+// Number of blocks read and hashed at once by each thread.
+constexpr size_t kBlocksPerChunk = 256;
+
+constexpr uint64_t kHashMultiplier = 0x9e3779b97f4a7c15ULL;
+
+// The finalizer of MurmurHash3, which spreads every bit of |h| to all the bits
+// of the result.
+uint64_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Reads the |block_size| bytes block at |byte_offset| of |fd| in |blob|.
+bool ReadBlock(int fd,
+               off_t byte_offset,
+               size_t block_size,
+               brillo::Blob* blob) {
+  blob->resize(block_size);
+  ssize_t bytes_read = 0;
+  return chromeos_update_engine::utils::PReadAll(
+             fd, blob->data(), block_size, byte_offset, &bytes_read) &&
+         static_cast<size_t>(bytes_read) == block_size;
 }
 
 }  // namespace
 
 namespace chromeos_update_engine {
 
+uint64_t BlockMapping::HashBlock(const uint8_t* data, size_t size) {
+  // The words of the block are hashed in independent lanes, so that the
+  // multiplications of a lane don't wait on the other lanes and the compiler
+  // can vectorize the loop.
+  constexpr size_t kLanes = 4;
+  uint64_t lanes[kLanes] = {1, 2, 3, 4};
+  size_t offset = 0;
+  for (; offset + sizeof(lanes) <= size; offset += sizeof(lanes)) {
+    uint64_t words[kLanes];
+    memcpy(words, data + offset, sizeof(words));
+    for (size_t i = 0; i < kLanes; i++) {
+      lanes[i] = (lanes[i] ^ words[i]) * kHashMultiplier;
+      lanes[i] ^= lanes[i] >> 32;
+    }
+  }
+  uint64_t hash = size;
+  for (uint64_t lane : lanes)
+    hash = (hash ^ MixHash(lane)) * kHashMultiplier;
+  for (; offset < size; offset++)
+    hash = (hash ^ data[offset]) * kHashMultiplier;
+  return MixHash(hash);
+}
+
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  if (block_data.size() != block_size_)
+    return -1;
+  return AddBlock(
+      -1, 0, block_data.data(), HashBlock(block_data.data(), block_size_));
 }
 
 BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
-  brillo::Blob blob(block_size_);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size_, byte_offset, &bytes_read))
+  brillo::Blob blob;
+  if (!ReadBlock(fd, byte_offset, block_size_, &blob))
     return -1;
-  if (static_cast<size_t>(bytes_read) != block_size_)
-    return -1;
-  return AddBlock(fd, byte_offset, blob);
+  return AddBlock(
+      fd, byte_offset, blob.data(), HashBlock(blob.data(), block_size_));
 }
 
 bool BlockMapping::AddManyDiskBlocks(int fd,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
-                                     vector<BlockId>* block_ids) {
-  bool ret = true;
+                                     vector<BlockId>* block_ids,
+                                     size_t num_threads,
+                                     vector<uint64_t>* block_hashes) {
   block_ids->resize(num_blocks);
-  for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
-    ret = ret && (*block_ids)[block] != -1;
+  if (block_hashes)
+    block_hashes->resize(num_blocks);
+  num_threads = std::max<size_t>(num_threads, 1);
+  // The blocks are read and hashed in parallel a window at a time, then added
+  // in order so that the block ids don't depend on the number of threads.
+  const size_t window_blocks =
+      std::min(num_blocks, num_threads * kBlocksPerChunk);
+  brillo::Blob data(window_blocks * block_size_);
+  vector<uint64_t> hashes(window_blocks);
+  // The blocks of the window already in the mapping when the window is read.
+  vector<BlockId> found_ids(window_blocks);
+  bool ret = true;
+  for (size_t window = 0; window < num_blocks; window += window_blocks) {
+    const size_t window_size = std::min(window_blocks, num_blocks - window);
+    const size_t num_chunks =
+        (window_size + kBlocksPerChunk - 1) / kBlocksPerChunk;
+    std::unique_ptr<bool[]> chunks_read(new bool[num_chunks]());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+      for (size_t chunk = next++; chunk < num_chunks; chunk = next++) {
+        const size_t first = chunk * kBlocksPerChunk;
+        const size_t count = std::min(kBlocksPerChunk, window_size - first);
+        uint8_t* chunk_data = data.data() + first * block_size_;
+        ssize_t bytes_read = 0;
+        if (!utils::PReadAll(
+                fd,
+                chunk_data,
+                count * block_size_,
+                initial_byte_offset + (window + first) * block_size_,
+                &bytes_read) ||
+            static_cast<size_t>(bytes_read) != count * block_size_) {
+          continue;
+        }
+        bool success = true;
+        for (size_t i = 0; i < count && success; i++) {
+          const uint8_t* block_data = chunk_data + i * block_size_;
+          hashes[first + i] = HashBlock(block_data, block_size_);
+          success =
+              FindBlock(block_data, hashes[first + i], &found_ids[first + i]);
+        }
+        chunks_read[chunk] = success;
+      }
+    };
+    vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(num_threads, num_chunks); i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    for (size_t i = 0; i < window_size; i++) {
+      BlockId& block_id = (*block_ids)[window + i];
+      block_id = -1;
+      if (!chunks_read[i / kBlocksPerChunk]) {
+        ret = false;
+        continue;
+      }
+      // Blocks not in the mapping yet may be equal to one added earlier in
+      // this window.
+      block_id = found_ids[i];
+      if (block_hashes)
+        (*block_hashes)[window + i] = hashes[i];
+      if (block_id == -1) {
+        block_id = AddBlock(fd,
+                            initial_byte_offset + (window + i) * block_size_,
+                            data.data() + i * block_size_,
+                            hashes[i]);
+      }
+      ret = ret && block_id != -1;
+    }
   }
   return ret;
 }
 
+bool BlockMapping::AddIndexedDiskBlocks(int fd,
+                                        off_t initial_byte_offset,
+                                        const ImageIndex& index,
+                                        vector<BlockId>* block_ids) {
+  TEST_AND_RETURN_FALSE(fd >= 0);
+  TEST_AND_RETURN_FALSE(unique_blocks_.size() == 1);
+  TEST_AND_RETURN_FALSE(index.hashes.size() == index.first_copies.size());
+  const size_t num_blocks = index.hashes.size();
+  block_ids->resize(num_blocks);
+  for (size_t i = 0; i < num_blocks; i++) {
+    const uint32_t first_copy = index.first_copies[i];
+    if (first_copy == ImageIndex::kZeroBlock) {
+      (*block_ids)[i] = 0;
+    } else if (first_copy < i) {
+      (*block_ids)[i] = (*block_ids)[first_copy];
+    } else {
+      TEST_AND_RETURN_FALSE(first_copy == i);
+      if ((unique_blocks_.size() + 1) * 2 > table_.size())
+        GrowTable();
+      const size_t mask = table_.size() - 1;
+      size_t slot = index.hashes[i] & mask;
+      while (table_[slot] != -1)
+        slot = (slot + 1) & mask;
+      (*block_ids)[i] = InsertBlock(slot,
+                                    fd,
+                                    initial_byte_offset + i * block_size_,
+                                    nullptr,
+                                    index.hashes[i]);
+    }
+  }
+  return true;
+}
+
+BlockMapping::ImageIndex BlockMapping::MakeImageIndex(
+    const vector<BlockId>& block_ids, vector<uint64_t> block_hashes) {
+  ImageIndex index;
+  index.hashes = std::move(block_hashes);
+  index.first_copies.resize(block_ids.size());
+  // The first block with each block id, by block id.
+  std::unordered_map<BlockId, uint32_t> first_blocks;
+  for (size_t i = 0; i < block_ids.size(); i++) {
+    if (block_ids[i] == 0) {
+      index.first_copies[i] = ImageIndex::kZeroBlock;
+      continue;
+    }
+    index.first_copies[i] = first_blocks.emplace(block_ids[i], i).first->second;
+  }
+  return index;
+}
+
 BlockMapping::BlockId BlockMapping::AddBlock(int fd,
                                              off_t byte_offset,
-                                             const brillo::Blob& block_data) {
-  if (block_data.size() != block_size_)
-    return -1;
-  size_t h = HashValue(block_data);
+                                             const uint8_t* block_data,
+                                             uint64_t hash) {
+  if ((unique_blocks_.size() + 1) * 2 > table_.size())
+    GrowTable();
 
-  // We either reuse a UniqueBlock or create a new one. If we need a new
-  // UniqueBlock it could also be part of a new or existing bucket (if there is
-  // a hash collision).
-  vector<UniqueBlock>* bucket = nullptr;
-
-  auto mapping_it = mapping_.find(h);
-  if (mapping_it == mapping_.end()) {
-    bucket = &mapping_[h];
-  } else {
-    for (UniqueBlock& existing_block : mapping_it->second) {
-      bool equals = false;
-      if (!existing_block.CompareData(block_data, &equals))
-        return -1;
-      if (equals)
-        return existing_block.block_id;
-    }
-    bucket = &mapping_it->second;
+  // Blocks with the same data are in the probe sequence of the hash, and only
+  // those with the same hash are compared, which may read them from disk.
+  const size_t mask = table_.size() - 1;
+  size_t slot = hash & mask;
+  for (; table_[slot] != -1; slot = (slot + 1) & mask) {
+    UniqueBlock& existing_block = unique_blocks_[table_[slot]];
+    if (existing_block.hash != hash)
+      continue;
+    bool equals = false;
+    if (!existing_block.CompareData(block_data, block_size_, &equals))
+      return -1;
+    if (equals)
+      return table_[slot];
   }
 
   // No existing block was found at this point, so we create and fill in a new
   // one.
-  bucket->emplace_back();
-  UniqueBlock* new_ublock = &bucket->back();
+  return InsertBlock(slot, fd, byte_offset, block_data, hash);
+}
 
+BlockMapping::BlockId BlockMapping::InsertBlock(size_t slot,
+                                                int fd,
+                                                off_t byte_offset,
+                                                const uint8_t* block_data,
+                                                uint64_t hash) {
+  const BlockId block_id = unique_blocks_.size();
+  table_[slot] = block_id;
+  unique_blocks_.emplace_back();
+  UniqueBlock* new_ublock = &unique_blocks_.back();
+
+  new_ublock->hash = hash;
   new_ublock->times_read = 1;
   new_ublock->fd = fd;
   new_ublock->byte_offset = byte_offset;
-  new_ublock->block_id = used_block_ids++;
   // We need to cache blocks that are not referencing any disk location.
   if (fd == -1)
-    new_ublock->block_data = block_data;
+    new_ublock->block_data.assign(block_data, block_data + block_size_);
 
-  return new_ublock->block_id;
+  return block_id;
 }
 
-bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
+bool BlockMapping::FindBlock(const uint8_t* block_data,
+                             uint64_t hash,
+                             BlockId* block_id) const {
+  *block_id = -1;
+  if (table_.empty())
+    return true;
+  const size_t mask = table_.size() - 1;
+  for (size_t slot = hash & mask; table_[slot] != -1;
+       slot = (slot + 1) & mask) {
+    const UniqueBlock& existing_block = unique_blocks_[table_[slot]];
+    if (existing_block.hash != hash)
+      continue;
+    bool equals = false;
+    TEST_AND_RETURN_FALSE(
+        existing_block.CompareDataNoCache(block_data, block_size_, &equals));
+    if (equals) {
+      *block_id = table_[slot];
+      return true;
+    }
+  }
+  return true;
+}
+
+void BlockMapping::GrowTable() {
+  table_.assign(std::max<size_t>(table_.size() * 2, 1024), -1);
+  const size_t mask = table_.size() - 1;
+  for (size_t block_id = 0; block_id < unique_blocks_.size(); block_id++) {
+    size_t slot = unique_blocks_[block_id].hash & mask;
+    while (table_[slot] != -1)
+      slot = (slot + 1) & mask;
+    table_[slot] = block_id;
+  }
+}
+
+bool BlockMapping::UniqueBlock::CompareData(const uint8_t* other_block,
+                                            size_t block_size,
                                             bool* equals) {
   if (!block_data.empty()) {
-    *equals = block_data == other_block;
+    *equals = memcmp(block_data.data(), other_block, block_size) == 0;
     return true;
   }
-  const size_t block_size = other_block.size();
-  brillo::Blob blob(block_size);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
+  brillo::Blob blob;
+  if (!ReadBlock(fd, byte_offset, block_size, &blob))
     return false;
-  if (static_cast<size_t>(bytes_read) != block_size)
-    return false;
-  *equals = blob == other_block;
+  *equals = memcmp(blob.data(), other_block, block_size) == 0;
 
   // We increase the number of times we had to read this block from disk and
   // we cache this block based on that. This caching method is optimized for
@@ -137,13 +345,29 @@ bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
   return true;
 }
 
+bool BlockMapping::UniqueBlock::CompareDataNoCache(const uint8_t* other_block,
+                                                   size_t block_size,
+                                                   bool* equals) const {
+  if (!block_data.empty()) {
+    *equals = memcmp(block_data.data(), other_block, block_size) == 0;
+    return true;
+  }
+  brillo::Blob blob;
+  if (!ReadBlock(fd, byte_offset, block_size, &blob))
+    return false;
+  *equals = memcmp(blob.data(), other_block, block_size) == 0;
+  return true;
+}
+
 bool MapPartitionBlocks(const string& old_part,
                         const string& new_part,
                         size_t old_size,
                         size_t new_size,
                         size_t block_size,
                         vector<BlockMapping::BlockId>* old_block_ids,
-                        vector<BlockMapping::BlockId>* new_block_ids) {
+                        vector<BlockMapping::BlockId>* new_block_ids,
+                        size_t num_threads,
+                        BlockMapping::ImageIndex* old_index) {
   BlockMapping mapping(block_size);
   if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
     return false;
@@ -152,10 +376,27 @@ bool MapPartitionBlocks(const string& old_part,
   ScopedFdCloser old_fd_closer(&old_fd);
   ScopedFdCloser new_fd_closer(&new_fd);
 
+  const size_t old_num_blocks = old_size / block_size;
+  if (old_index && !old_index->hashes.empty()) {
+    TEST_AND_RETURN_FALSE(old_index->hashes.size() == old_num_blocks);
+    TEST_AND_RETURN_FALSE(
+        mapping.AddIndexedDiskBlocks(old_fd, 0, *old_index, old_block_ids));
+  } else {
+    vector<uint64_t> old_hashes;
+    TEST_AND_RETURN_FALSE(
+        mapping.AddManyDiskBlocks(old_fd,
+                                  0,
+                                  old_num_blocks,
+                                  old_block_ids,
+                                  num_threads,
+                                  old_index ? &old_hashes : nullptr));
+    if (old_index) {
+      *old_index = BlockMapping::MakeImageIndex(*old_block_ids,
+                                                std::move(old_hashes));
+    }
+  }
   TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+      new_fd, 0, new_size / block_size, new_block_ids, num_threads));
   return true;
 }
 
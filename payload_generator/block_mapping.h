@@ -17,7 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 
-#include <map>
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -37,6 +38,19 @@ class BlockMapping {
  public:
   using BlockId = int64_t;
 
+  // What mapping the blocks of an image learned about them, to add the same
+  // blocks again without reading them.
+  struct ImageIndex {
+    // Marks the blocks with all zeros in |first_copies|.
+    static constexpr uint32_t kZeroBlock = UINT32_MAX;
+
+    // The HashBlock() of each block.
+    std::vector<uint64_t> hashes;
+    // For each block, the first block of the image with the same data, which
+    // may be the block itself, or kZeroBlock.
+    std::vector<uint32_t> first_copies;
+  };
+
   explicit BlockMapping(size_t block_size) : block_size_(block_size) {}
 
   // Add a single data block to the mapping. Returns its unique block id.
@@ -51,32 +65,74 @@ class BlockMapping {
 
   // This is a helper method to add |num_blocks| contiguous blocks reading them
   // from the file descriptor |fd| starting at offset |initial_byte_offset|.
+  // The blocks are read, hashed and looked up on |num_threads| threads, the
+  // block ids are the same as when adding the blocks one by one.
   // Returns whether it succeeded to add all the disk blocks and stores in
-  // |block_ids| the block id for each one of the added blocks.
+  // |block_ids| the block id for each one of the added blocks, and in
+  // |block_hashes| their hash if not null.
   bool AddManyDiskBlocks(int fd,
                          off_t initial_byte_offset,
                          size_t num_blocks,
-                         std::vector<BlockId>* block_ids);
+                         std::vector<BlockId>* block_ids,
+                         size_t num_threads = 1,
+                         std::vector<uint64_t>* block_hashes = nullptr);
+
+  // Same as AddManyDiskBlocks() for the blocks described by |index|, which
+  // aren't read nor compared. The mapping must only have the block with all
+  // zeros, as block id 0, so that the blocks unique in the image are unique
+  // in the mapping too.
+  bool AddIndexedDiskBlocks(int fd,
+                            off_t initial_byte_offset,
+                            const ImageIndex& index,
+                            std::vector<BlockId>* block_ids);
+
+  // Returns the index of the image whose blocks got the ids |block_ids| and
+  // the hashes |block_hashes|, where block id 0 is the block with all zeros.
+  static ImageIndex MakeImageIndex(const std::vector<BlockId>& block_ids,
+                                   std::vector<uint64_t> block_hashes);
+
+  // Returns the 64 bits hash of the |size| bytes at |data|.
+  static uint64_t HashBlock(const uint8_t* data, size_t size);
 
  private:
   FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  // Add a single block passed in |block_data| whose hash is |hash|. If |fd| is
+  // not -1, the block can be discarded to save RAM and retrieved later from
+  // |fd| at the position |byte_offset|.
+  BlockId AddBlock(int fd,
+                   off_t byte_offset,
+                   const uint8_t* block_data,
+                   uint64_t hash);
+
+  // Adds a new unique block whose hash is |hash| in the empty |slot| of
+  // |table_|, like AddBlock().
+  BlockId InsertBlock(size_t slot,
+                      int fd,
+                      off_t byte_offset,
+                      const uint8_t* block_data,
+                      uint64_t hash);
+
+  // Looks up the block passed in |block_data| whose hash is |hash| without
+  // changing the mapping, so it can run on several threads at once. Stores in
+  // |block_id| its block id, or -1 if it wasn't added yet. Returns false if
+  // reading a block from disk failed.
+  bool FindBlock(const uint8_t* block_data,
+                 uint64_t hash,
+                 BlockId* block_id) const;
+
+  // Makes room in |table_| for one more block id.
+  void GrowTable();
 
   size_t block_size_;
 
-  BlockId used_block_ids{0};
-
   // The UniqueBlock represents the data of a block associated to a unique
   // block id.
   struct UniqueBlock {
     brillo::Blob block_data;
 
-    // The block id assigned to this unique block.
-    BlockId block_id;
+    // The hash of the block data, compared before the data itself.
+    uint64_t hash{0};
 
     // The location on this unique block on disk (if not cached in block_data).
     int fd{-1};
@@ -85,14 +141,26 @@ class BlockMapping {
     // Number of times we have seen this data block. Used for caching.
     uint32_t times_read{0};
 
-    // Compares the UniqueBlock data with the other_block data and stores if
-    // they are equal in |equals|. Returns whether there was an error reading
-    // the block from disk while comparing it.
-    bool CompareData(const brillo::Blob& other_block, bool* equals);
+    // Compares the UniqueBlock data with the |block_size| bytes at
+    // |other_block| and stores if they are equal in |equals|. Returns whether
+    // there was an error reading the block from disk while comparing it.
+    bool CompareData(const uint8_t* other_block,
+                     size_t block_size,
+                     bool* equals);
+
+    // Same as CompareData() but doesn't cache the data read from disk.
+    bool CompareDataNoCache(const uint8_t* other_block,
+                            size_t block_size,
+                            bool* equals) const;
   };
 
-  // A mapping from hash values to possible block ids.
-  std::map<size_t, std::vector<UniqueBlock>> mapping_;
+  // The unique blocks, indexed by block id.
+  std::vector<UniqueBlock> unique_blocks_;
+
+  // An open addressing hash table of the block ids, by the hash of their
+  // data. Its size is a power of two, and at most half of it is used. Empty
+  // slots are -1.
+  std::vector<BlockId> table_;
 };
 
 // Maps the blocks of the old and new partitions |old_part| and |new_part| whose
@@ -100,14 +168,19 @@ class BlockMapping {
 // with the same data will have the same block id and vice versa, regardless of
 // the partition they are on.
 // The block ids number 0 corresponds to the block with all zeros, but any
-// other block id number is assigned randomly.
+// other block id number is assigned randomly. The partitions are read and
+// hashed on |num_threads| threads.
+// If |old_index| isn't null and not empty, the old partition isn't read but
+// added from it. If it is empty, it is set to the index of the old partition.
 bool MapPartitionBlocks(const std::string& old_part,
                         const std::string& new_part,
                         size_t old_size,
                         size_t new_size,
                         size_t block_size,
                         std::vector<BlockMapping::BlockId>* old_block_ids,
-                        std::vector<BlockMapping::BlockId>* new_block_ids);
+                        std::vector<BlockMapping::BlockId>* new_block_ids,
+                        size_t num_threads = 1,
+                        BlockMapping::ImageIndex* old_index = nullptr);
 
 }  // namespace chromeos_update_engine
 
@@ -62,10 +62,8 @@ TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
 
   // Check that the block_data is not stored on memory if we just used the block
   // once.
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_TRUE(ublock.block_data.empty());
-    }
+  for (const BlockMapping::UniqueBlock& ublock : bm_.unique_blocks_) {
+    EXPECT_TRUE(ublock.block_data.empty());
   }
 
   brillo::Blob block(block_size_, 'a');
@@ -74,13 +72,11 @@ TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
     EXPECT_EQ(0, bm_.AddBlock(block));
   }
 
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_FALSE(ublock.block_data.empty());
-      // The block was loaded from disk only 4 times, and after that the counter
-      // is not updated anymore.
-      EXPECT_EQ(4U, ublock.times_read);
-    }
+  for (const BlockMapping::UniqueBlock& ublock : bm_.unique_blocks_) {
+    EXPECT_FALSE(ublock.block_data.empty());
+    // The block was loaded from disk only 4 times, and after that the counter
+    // is not updated anymore.
+    EXPECT_EQ(4U, ublock.times_read);
   }
 }
 
@@ -112,4 +108,104 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
   EXPECT_EQ((vector<BlockMapping::BlockId>{0, 11, 12, 13, 1, 2}), new_ids);
 }
 
+TEST_F(BlockMappingTest, MapPartitionBlocksWithIndex) {
+  // Old blocks with zeros and repeated blocks, and new blocks sharing some.
+  const vector<char> old_blocks = {'a', 0, 'b', 'a', 0, 'c', 'b'};
+  string old_contents;
+  for (char c : old_blocks)
+    old_contents += string(block_size_, c);
+  test_utils::WriteFileString(old_part_.path(), old_contents);
+  string new_contents = string(block_size_, 'c') + string(block_size_, 'd') +
+                        string(block_size_, 0) + string(block_size_, 'a');
+  test_utils::WriteFileString(new_part_.path(), new_contents);
+
+  BlockMapping::ImageIndex index;
+  vector<BlockMapping::BlockId> old_ids, new_ids;
+  EXPECT_TRUE(MapPartitionBlocks(old_part_.path(),
+                                 new_part_.path(),
+                                 old_contents.size(),
+                                 new_contents.size(),
+                                 block_size_,
+                                 &old_ids,
+                                 &new_ids,
+                                 2,
+                                 &index));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{1, 0, 2, 1, 0, 3, 2}), old_ids);
+  EXPECT_EQ((vector<BlockMapping::BlockId>{3, 4, 0, 1}), new_ids);
+  constexpr uint32_t kZero = BlockMapping::ImageIndex::kZeroBlock;
+  EXPECT_EQ((vector<uint32_t>{0, kZero, 2, 0, kZero, 5, 2}),
+            index.first_copies);
+  ASSERT_EQ(old_blocks.size(), index.hashes.size());
+  EXPECT_EQ(BlockMapping::HashBlock(
+                reinterpret_cast<const uint8_t*>(old_contents.data()),
+                block_size_),
+            index.hashes[0]);
+
+  // The same ids are found from the index.
+  vector<BlockMapping::BlockId> indexed_old_ids, indexed_new_ids;
+  EXPECT_TRUE(MapPartitionBlocks(old_part_.path(),
+                                 new_part_.path(),
+                                 old_contents.size(),
+                                 new_contents.size(),
+                                 block_size_,
+                                 &indexed_old_ids,
+                                 &indexed_new_ids,
+                                 2,
+                                 &index));
+  EXPECT_EQ(old_ids, indexed_old_ids);
+  EXPECT_EQ(new_ids, indexed_new_ids);
+
+  // An index of another size than the old partition is rejected.
+  index.hashes.pop_back();
+  index.first_copies.pop_back();
+  EXPECT_FALSE(MapPartitionBlocks(old_part_.path(),
+                                  new_part_.path(),
+                                  old_contents.size(),
+                                  new_contents.size(),
+                                  block_size_,
+                                  &indexed_old_ids,
+                                  &indexed_new_ids,
+                                  2,
+                                  &index));
+}
+
+TEST_F(BlockMappingTest, AddManyDiskBlocksThreads) {
+  // Enough blocks for several windows of chunks, with blocks repeated within
+  // and across them.
+  constexpr size_t kNumBlocks = 3000;
+  string contents(kNumBlocks * block_size_, '\0');
+  for (size_t i = 0; i < contents.size(); ++i)
+    contents[i] = (i / block_size_) % 700 + (i % 3);
+  test_utils::WriteFileString(old_part_.path(), contents);
+  int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser old_fd_closer(&old_fd);
+
+  vector<BlockMapping::BlockId> expected_ids;
+  for (size_t i = 0; i < kNumBlocks; ++i)
+    expected_ids.push_back(bm_.AddDiskBlock(old_fd, i * block_size_));
+
+  for (size_t num_threads : {1, 3, 8}) {
+    BlockMapping mapping(block_size_);
+    vector<BlockMapping::BlockId> ids;
+    EXPECT_TRUE(
+        mapping.AddManyDiskBlocks(old_fd, 0, kNumBlocks, &ids, num_threads));
+    EXPECT_EQ(expected_ids, ids);
+  }
+
+  // Past the end of the file.
+  vector<BlockMapping::BlockId> ids;
+  EXPECT_FALSE(bm_.AddManyDiskBlocks(old_fd, 0, kNumBlocks + 1, &ids, 2));
+  EXPECT_EQ(-1, ids.back());
+}
+
+TEST_F(BlockMappingTest, HashBlock) {
+  brillo::Blob block(block_size_, 'a');
+  const uint64_t hash = BlockMapping::HashBlock(block.data(), block.size());
+  brillo::Blob other_block = block;
+  other_block[block_size_ - 1] = 'b';
+  EXPECT_NE(hash, BlockMapping::HashBlock(other_block.data(), block.size()));
+  EXPECT_NE(hash, BlockMapping::HashBlock(block.data(), block.size() - 1));
+  EXPECT_EQ(hash, BlockMapping::HashBlock(block.data(), block.size()));
+}
+
 }  // namespace chromeos_update_engine
@@ -17,8 +17,13 @@
 #include "update_engine/payload_generator/cow_size_estimator.h"
 
 #include <algorithm>
-#include <functional>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -35,6 +40,330 @@
 namespace chromeos_update_engine {
 using android::snapshot::CowWriter;
 
+namespace {
+// Number of new blocks compressed at once by the parallel estimator.
+constexpr uint64_t kMaxChunkBlocks = 256;
+// The sampling estimator checks its error bound every time this many chunks
+// were compressed, and never stops before the first check.
+constexpr size_t kSamplingRoundChunks = 32;
+// Z-score of the 95% confidence interval.
+constexpr double kSamplingZScore = 1.96;
+
+// Reads the new blocks of the XOR merge operation |op| XORed with their
+// source blocks into |data|.
+bool ReadXorData(FileDescriptorPtr source_fd,
+                 FileDescriptorPtr target_fd,
+                 const CowMergeOperation& op,
+                 const size_t block_size,
+                 std::vector<unsigned char>* data) {
+  // dst block count is used, because
+  // src block count is probably(if src_offset > 0) 1 block
+  // larger than dst extent. Using it might lead to intreseting out of bound
+  // disk reads.
+  std::vector<unsigned char> old_data(op.dst_extent().num_blocks() *
+                                      block_size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          source_fd,
+          old_data.data(),
+          old_data.size(),
+          op.src_extent().start_block() * block_size + op.src_offset(),
+          &bytes_read)) {
+    PLOG(ERROR) << "Failed to read source data at " << op.src_extent();
+    return false;
+  }
+  data->resize(op.dst_extent().num_blocks() * block_size);
+  if (!utils::PReadAll(target_fd,
+                       data->data(),
+                       data->size(),
+                       op.dst_extent().start_block() * block_size,
+                       &bytes_read)) {
+    PLOG(ERROR) << "Failed to read target data at " << op.dst_extent();
+    return false;
+  }
+  CHECK_GT(old_data.size(), 0UL);
+  CHECK_GT(data->size(), 0UL);
+  utils::XorBytes(old_data.data(), data->size(), data->data());
+  return true;
+}
+
+// Reads the new blocks in |ext| into |data|.
+bool ReadRawData(FileDescriptorPtr target_fd,
+                 const Extent& ext,
+                 const size_t block_size,
+                 std::vector<unsigned char>* data) {
+  data->resize(ext.num_blocks() * block_size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(target_fd,
+                       data->data(),
+                       data->size(),
+                       ext.start_block() * block_size,
+                       &bytes_read)) {
+    PLOG(ERROR) << "Failed to read new block data at " << ext;
+    return false;
+  }
+  return true;
+}
+
+// Returns a CowWriter that discards all the data but still reports the COW
+// size.
+std::unique_ptr<CowWriter> CreateEstimationCowWriter(
+    const size_t block_size, const std::string& compression) {
+  auto cow_writer = std::make_unique<CowWriter>(
+      android::snapshot::CowOptions{.block_size =
+                                        static_cast<uint32_t>(block_size),
+                                    .compression = compression});
+  // CowWriter treats -1 as special value, will discard all the data but still
+  // reports Cow size. Good for estimation purposes
+  cow_writer->Initialize(android::base::borrowed_fd{-1});
+  return cow_writer;
+}
+
+// New blocks written by the dry run, compressed as a unit by the parallel
+// estimator. Either the blocks of an XOR merge operation, or a range of raw
+// blocks.
+struct CowChunk {
+  const CowMergeOperation* xor_op{nullptr};
+  Extent raw_extent;
+
+  uint64_t num_blocks() const {
+    return xor_op ? xor_op->dst_extent().num_blocks() : raw_extent.num_blocks();
+  }
+};
+
+// Compresses the chunks of a partition on several threads. The COW size of a
+// chunk is the size of a COW with only that chunk in it, minus the size of an
+// empty COW.
+class ParallelCowEstimator {
+ public:
+  ParallelCowEstimator(FileDescriptorPtr source_fd,
+                       FileDescriptorPtr target_fd,
+                       size_t block_size,
+                       std::string compression,
+                       std::vector<CowChunk> chunks)
+      : source_fd_(std::move(source_fd)),
+        target_fd_(std::move(target_fd)),
+        block_size_(block_size),
+        compression_(std::move(compression)),
+        chunks_(std::move(chunks)),
+        chunk_sizes_(chunks_.size()) {
+    auto empty_writer = CreateEstimationCowWriter(block_size_, compression_);
+    CHECK(empty_writer->Finalize());
+    empty_cow_size_ = empty_writer->GetCowSize();
+  }
+
+  // Computes the COW size of the chunks in [begin, end) using |num_threads|
+  // threads. Returns false on failure.
+  bool Compress(size_t begin, size_t end, size_t num_threads) {
+    std::atomic<size_t> next{begin};
+    std::atomic<bool> success{true};
+    auto worker = [this, &next, &success, end]() {
+      for (size_t i = next++; i < end && success; i = next++) {
+        if (!CompressChunk(i)) {
+          success = false;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return success;
+  }
+
+  const std::vector<CowChunk>& chunks() const { return chunks_; }
+  size_t chunk_size(size_t i) const { return chunk_sizes_[i]; }
+
+ private:
+  bool CompressChunk(size_t i) {
+    const CowChunk& chunk = chunks_[i];
+    std::vector<unsigned char> data;
+    {
+      // The file descriptors have a single offset, reads can't run in
+      // parallel. Compressing the data is what takes time.
+      std::lock_guard<std::mutex> lock(read_mutex_);
+      if (chunk.xor_op) {
+        TEST_AND_RETURN_FALSE(ReadXorData(
+            source_fd_, target_fd_, *chunk.xor_op, block_size_, &data));
+      } else {
+        TEST_AND_RETURN_FALSE(
+            ReadRawData(target_fd_, chunk.raw_extent, block_size_, &data));
+      }
+    }
+    auto cow_writer = CreateEstimationCowWriter(block_size_, compression_);
+    if (chunk.xor_op) {
+      const auto& op = *chunk.xor_op;
+      CHECK(cow_writer->AddXorBlocks(op.dst_extent().start_block(),
+                                     data.data(),
+                                     data.size(),
+                                     op.src_extent().start_block(),
+                                     op.src_offset()));
+    } else {
+      cow_writer->AddRawBlocks(
+          chunk.raw_extent.start_block(), data.data(), data.size());
+    }
+    TEST_AND_RETURN_FALSE(cow_writer->Finalize());
+    const size_t cow_size = cow_writer->GetCowSize();
+    chunk_sizes_[i] = cow_size > empty_cow_size_ ? cow_size - empty_cow_size_
+                                                 : 0;
+    return true;
+  }
+
+  FileDescriptorPtr source_fd_;
+  FileDescriptorPtr target_fd_;
+  const size_t block_size_;
+  const std::string compression_;
+  const std::vector<CowChunk> chunks_;
+  std::vector<size_t> chunk_sizes_;
+  size_t empty_cow_size_{0};
+  std::mutex read_mutex_;
+};
+
+// Returns the upper bound of the confidence interval of the COW size of all
+// |total_blocks|, given the sizes of the first |num_sampled| chunks of
+// |estimator|. Sets |relative_error| to the half width of the interval divided
+// by the estimate.
+uint64_t EstimateFromSample(const ParallelCowEstimator& estimator,
+                            size_t num_sampled,
+                            uint64_t total_blocks,
+                            double* relative_error) {
+  double sampled_size = 0;
+  double sampled_blocks = 0;
+  for (size_t i = 0; i < num_sampled; i++) {
+    sampled_size += estimator.chunk_size(i);
+    sampled_blocks += estimator.chunks()[i].num_blocks();
+  }
+  // Ratio estimator of the COW bytes per block.
+  const double ratio = sampled_size / sampled_blocks;
+  double sum_squares = 0;
+  for (size_t i = 0; i < num_sampled; i++) {
+    const double residual = estimator.chunk_size(i) -
+                            ratio * estimator.chunks()[i].num_blocks();
+    sum_squares += residual * residual;
+  }
+  const double n = num_sampled;
+  const double mean_blocks = sampled_blocks / n;
+  const double finite_population =
+      1 - n / static_cast<double>(estimator.chunks().size());
+  const double std_error =
+      num_sampled > 1 ? std::sqrt(finite_population * sum_squares /
+                                  (n - 1) / n) /
+                            mean_blocks
+                      : ratio;
+  const double half_width = kSamplingZScore * std_error;
+  *relative_error = ratio > 0 ? half_width / ratio : 0;
+  const double remaining_blocks = total_blocks - sampled_blocks;
+  return sampled_size + std::ceil((ratio + half_width) * remaining_blocks);
+}
+
+size_t EstimateCowSizeInParallel(
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations,
+    const size_t block_size,
+    const std::string& compression,
+    const size_t partition_size,
+    const bool xor_enabled,
+    const CowEstimateOptions& options) {
+  CHECK_NE(target_fd, nullptr);
+  CHECK(target_fd->IsOpen());
+  // Everything but the new blocks goes in one COW, written in the same order
+  // as CowDryRun() does.
+  auto cow_writer = CreateEstimationCowWriter(block_size, compression);
+  std::vector<CowChunk> chunks;
+  VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer.get());
+  ExtentRanges visited;
+  for (const auto& op : merge_operations) {
+    if (op.type() == CowMergeOperation::COW_COPY) {
+      visited.AddExtent(op.dst_extent());
+      cow_writer->AddCopy(op.dst_extent().start_block(),
+                          op.src_extent().start_block(),
+                          op.dst_extent().num_blocks());
+    } else if (op.type() == CowMergeOperation::COW_XOR && xor_enabled) {
+      CHECK_NE(source_fd, nullptr) << "Source fd is required to enable XOR ops";
+      CHECK(source_fd->IsOpen());
+      visited.AddExtent(op.dst_extent());
+      chunks.push_back({.xor_op = &op});
+    }
+    cow_writer->AddLabel(0);
+  }
+  for (const auto& op : operations) {
+    cow_writer->AddLabel(0);
+    if (op.type() == InstallOperation::ZERO) {
+      for (const auto& ext : op.dst_extents()) {
+        visited.AddExtent(ext);
+        cow_writer->AddZeroBlocks(ext.start_block(), ext.num_blocks());
+      }
+    }
+  }
+  cow_writer->AddLabel(0);
+  const size_t last_block = partition_size / block_size;
+  const auto unvisited_extents =
+      FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
+  uint64_t total_blocks = 0;
+  for (const auto& ext : unvisited_extents) {
+    for (uint64_t offset = 0; offset < ext.num_blocks();
+         offset += kMaxChunkBlocks) {
+      chunks.push_back(
+          {.raw_extent = ExtentForRange(
+               ext.start_block() + offset,
+               std::min(kMaxChunkBlocks, ext.num_blocks() - offset))});
+    }
+    cow_writer->AddLabel(0);
+  }
+  CHECK(cow_writer->Finalize());
+  size_t cow_size = cow_writer->GetCowSize();
+  for (const auto& chunk : chunks) {
+    total_blocks += chunk.num_blocks();
+  }
+
+  if (options.max_sampling_error > 0) {
+    // Chunks are sampled in a random, but reproducible, order.
+    std::shuffle(chunks.begin(), chunks.end(), std::mt19937_64{});
+  }
+  ParallelCowEstimator estimator(std::move(source_fd),
+                                 std::move(target_fd),
+                                 block_size,
+                                 compression,
+                                 std::move(chunks));
+  const size_t num_chunks = estimator.chunks().size();
+  const size_t num_threads = std::max<size_t>(options.num_threads, 1);
+  if (options.max_sampling_error <= 0) {
+    CHECK(estimator.Compress(0, num_chunks, num_threads));
+    for (size_t i = 0; i < num_chunks; i++) {
+      cow_size += estimator.chunk_size(i);
+    }
+    return cow_size;
+  }
+
+  const size_t round_chunks = std::max(kSamplingRoundChunks, num_threads);
+  size_t num_sampled = 0;
+  uint64_t data_size = 0;
+  double relative_error = 0;
+  while (num_sampled < num_chunks) {
+    const size_t end = std::min(num_sampled + round_chunks, num_chunks);
+    CHECK(estimator.Compress(num_sampled, end, num_threads));
+    num_sampled = end;
+    data_size = EstimateFromSample(
+        estimator, num_sampled, total_blocks, &relative_error);
+    if (relative_error <= options.max_sampling_error) {
+      break;
+    }
+  }
+  LOG(INFO) << "Compressed " << num_sampled << " of " << num_chunks
+            << " chunks to estimate the COW size, relative error "
+            << relative_error;
+  return cow_size + data_size;
+}
+
+}  // namespace
+
 bool CowDryRun(
     FileDescriptorPtr source_fd,
     FileDescriptorPtr target_fd,
@@ -59,39 +388,9 @@ bool CowDryRun(
       CHECK_NE(source_fd, nullptr) << "Source fd is required to enable XOR ops";
       CHECK(source_fd->IsOpen());
       visited.AddExtent(op.dst_extent());
-      // dst block count is used, because
-      // src block count is probably(if src_offset > 0) 1 block
-      // larger than dst extent. Using it might lead to intreseting out of bound
-      // disk reads.
-      std::vector<unsigned char> old_data(op.dst_extent().num_blocks() *
-                                          block_size);
-      ssize_t bytes_read = 0;
-      if (!utils::PReadAll(
-              source_fd,
-              old_data.data(),
-              old_data.size(),
-              op.src_extent().start_block() * block_size + op.src_offset(),
-              &bytes_read)) {
-        PLOG(ERROR) << "Failed to read source data at " << op.src_extent();
-        return false;
-      }
-      std::vector<unsigned char> new_data(op.dst_extent().num_blocks() *
-                                          block_size);
-      if (!utils::PReadAll(target_fd,
-                           new_data.data(),
-                           new_data.size(),
-                           op.dst_extent().start_block() * block_size,
-                           &bytes_read)) {
-        PLOG(ERROR) << "Failed to read target data at " << op.dst_extent();
-        return false;
-      }
-      CHECK_GT(old_data.size(), 0UL);
-      CHECK_GT(new_data.size(), 0UL);
-      std::transform(new_data.begin(),
-                     new_data.end(),
-                     old_data.begin(),
-                     new_data.begin(),
-                     std::bit_xor<unsigned char>{});
+      std::vector<unsigned char> new_data;
+      TEST_AND_RETURN_FALSE(
+          ReadXorData(source_fd, target_fd, op, block_size, &new_data));
       CHECK(cow_writer->AddXorBlocks(op.dst_extent().start_block(),
                                      new_data.data(),
                                      new_data.size(),
@@ -118,16 +417,8 @@ bool CowDryRun(
   const auto unvisited_extents =
       FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
   for (const auto& ext : unvisited_extents) {
-    std::vector<unsigned char> data(ext.num_blocks() * block_size);
-    ssize_t bytes_read = 0;
-    if (!utils::PReadAll(target_fd,
-                         data.data(),
-                         data.size(),
-                         ext.start_block() * block_size,
-                         &bytes_read)) {
-      PLOG(ERROR) << "Failed to read new block data at " << ext;
-      return false;
-    }
+    std::vector<unsigned char> data;
+    TEST_AND_RETURN_FALSE(ReadRawData(target_fd, ext, block_size, &data));
     cow_writer->AddRawBlocks(ext.start_block(), data.data(), data.size());
     cow_writer->AddLabel(0);
   }
@@ -144,22 +435,29 @@ size_t EstimateCowSize(
     const size_t block_size,
     std::string compression,
     const size_t partition_size,
-    const bool xor_enabled) {
-  android::snapshot::CowWriter cow_writer{
-      {.block_size = static_cast<uint32_t>(block_size),
-       .compression = std::move(compression)}};
-  // CowWriter treats -1 as special value, will discard all the data but still
-  // reports Cow size. Good for estimation purposes
-  cow_writer.Initialize(android::base::borrowed_fd{-1});
+    const bool xor_enabled,
+    const CowEstimateOptions& options) {
+  if (options.num_threads > 1 || options.max_sampling_error > 0) {
+    return EstimateCowSizeInParallel(std::move(source_fd),
+                                     std::move(target_fd),
+                                     operations,
+                                     merge_operations,
+                                     block_size,
+                                     compression,
+                                     partition_size,
+                                     xor_enabled,
+                                     options);
+  }
+  auto cow_writer = CreateEstimationCowWriter(block_size, compression);
   CHECK(CowDryRun(source_fd,
                   target_fd,
                   operations,
                   merge_operations,
                   block_size,
-                  &cow_writer,
+                  cow_writer.get(),
                   partition_size,
                   xor_enabled));
-  return cow_writer.GetCowSize();
+  return cow_writer->GetCowSize();
 }
 
 }  // namespace chromeos_update_engine
@@ -22,6 +22,21 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
+
+// How EstimateCowSize() spends its time.
+struct CowEstimateOptions {
+  // Number of threads compressing new blocks. With a single thread, every
+  // operation is replayed through one CowWriter, giving the exact COW size.
+  // With more, the blocks are compressed in chunks by separate CowWriters and
+  // the partial sizes are summed, which may slightly overestimate the size.
+  size_t num_threads = 1;
+  // If non zero, only compress a random sample of the new blocks, until the
+  // 95% confidence interval of the size of their COW data is within this
+  // fraction of the estimate. The upper bound of the interval is used for the
+  // blocks that weren't compressed.
+  double max_sampling_error = 0;
+};
+
 // Given file descriptor to the target image, and list of
 // operations, estimate the size of COW image if the operations are applied on
 // Virtual AB Compression enabled device. This is intended to be used by update
@@ -37,7 +52,8 @@ size_t EstimateCowSize(
     const size_t block_size,
     std::string compression,
     const size_t partition_size,
-    bool xor_enabled);
+    bool xor_enabled,
+    const CowEstimateOptions& options = {});
 
 // Convert InstallOps to CowOps and apply the converted cow op to |cow_writer|
 bool CowDryRun(
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/cow_size_estimator.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <random>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 4096;
+}  // namespace
+
+class CowSizeEstimatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Mix random and repetitive blocks so they don't all compress the same.
+    brillo::Blob data(kNumBlocks * kBlockSize);
+    std::mt19937 gen(42);
+    for (size_t block = 0; block < kNumBlocks; block++) {
+      const bool random = gen() % 3 == 0;
+      for (size_t i = 0; i < kBlockSize; i++) {
+        data[block * kBlockSize + i] =
+            random ? gen() : static_cast<uint8_t>(block + i / 64);
+      }
+    }
+    ASSERT_TRUE(utils::WriteFile(
+        target_file_.path().c_str(), data.data(), data.size()));
+    target_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    ASSERT_TRUE(target_fd_->Open(target_file_.path().c_str(), O_RDONLY));
+
+    // Zero every fourth block so the new blocks are split in many extents.
+    for (size_t block = 0; block < kNumBlocks; block += 4) {
+      InstallOperation* op = operations_.Add();
+      op->set_type(InstallOperation::ZERO);
+      *op->add_dst_extents() = ExtentForRange(block, 1);
+    }
+  }
+
+  size_t Estimate(const CowEstimateOptions& options) {
+    return EstimateCowSize(nullptr,
+                           target_fd_,
+                           operations_,
+                           {},
+                           kBlockSize,
+                           "gz",
+                           kNumBlocks * kBlockSize,
+                           false,
+                           options);
+  }
+
+  ScopedTempFile target_file_{"CowSizeEstimatorTest_target.XXXXXX"};
+  FileDescriptorPtr target_fd_;
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+};
+
+TEST_F(CowSizeEstimatorTest, ParallelTest) {
+  const size_t exact = Estimate({});
+  const size_t parallel = Estimate({.num_threads = 4});
+  EXPECT_GE(parallel, exact * 0.99);
+  EXPECT_LE(parallel, exact * 1.05);
+  // The estimate doesn't depend on how the chunks were spread.
+  EXPECT_EQ(parallel, Estimate({.num_threads = 3}));
+}
+
+TEST_F(CowSizeEstimatorTest, SamplingTest) {
+  const size_t exact = Estimate({});
+  const size_t sampled =
+      Estimate({.num_threads = 2, .max_sampling_error = 0.1});
+  EXPECT_GE(sampled, exact * 0.9);
+  EXPECT_LE(sampled, exact * 1.25);
+  // The sample is reproducible.
+  EXPECT_EQ(sampled, Estimate({.num_threads = 4, .max_sampling_error = 0.1}));
+}
+
+}  // namespace chromeos_update_engine
@@ -16,16 +16,23 @@
 
 #include "update_engine/payload_generator/deflate_utils.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_util.h>
+#include <puffin/utils.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
@@ -297,13 +304,147 @@ bool DeflatePreprocessFileData(const std::string_view filename,
   return true;
 }
 
+namespace {
+
+// Returns the diff cache key of the deflates found in the file |data|.
+string DeflatesCacheKey(const std::string_view filename,
+                        const brillo::Blob& data) {
+  HashCalculator hasher;
+  auto update_int = [&hasher](uint64_t value) {
+    hasher.Update(&value, sizeof(value));
+  };
+  // Bump when the deflates found in the same data may change.
+  constexpr uint64_t kDeflatesCacheVersion = 2;
+  constexpr char kDeflatesCacheTag[] = "deflates";
+  hasher.Update(kDeflatesCacheTag, sizeof(kDeflatesCacheTag));
+  update_int(kDeflatesCacheVersion);
+  // Zip and gzip files are searched differently.
+  update_int(IsFileExtensions(filename, {".gz", ".gzip", ".tgz"}));
+  update_int(data.size());
+  hasher.Update(data.data(), data.size());
+  hasher.Finalize();
+  return DiffCache::Key(hasher.raw_hash());
+}
+
+// Returns the diff cache key of the deflates of |data| left by
+// puffin::RemoveDeflatesWithBadDistanceCaches().
+string GoodDeflatesCacheKey(const brillo::Blob& data,
+                            const vector<BitExtent>& deflates) {
+  HashCalculator hasher;
+  auto update_int = [&hasher](uint64_t value) {
+    hasher.Update(&value, sizeof(value));
+  };
+  // Bump when puffin keeps other deflates of the same data.
+  constexpr uint64_t kGoodDeflatesCacheVersion = 1;
+  constexpr char kGoodDeflatesCacheTag[] = "good-distance-caches";
+  hasher.Update(kGoodDeflatesCacheTag, sizeof(kGoodDeflatesCacheTag));
+  update_int(kGoodDeflatesCacheVersion);
+  update_int(deflates.size());
+  for (const auto& deflate : deflates) {
+    update_int(deflate.offset);
+    update_int(deflate.length);
+  }
+  update_int(data.size());
+  hasher.Update(data.data(), data.size());
+  hasher.Finalize();
+  return DiffCache::Key(hasher.raw_hash());
+}
+
+// The deflates of a file are stored in the diff cache as the offset and
+// length of each deflate.
+bool LookupDeflates(const DiffCache& cache,
+                    const string& key,
+                    vector<BitExtent>* deflates) {
+  brillo::Blob entry;
+  if (!cache.LookupData(key, &entry))
+    return false;
+  TEST_AND_RETURN_FALSE(entry.size() % (2 * sizeof(uint64_t)) == 0);
+  deflates->resize(entry.size() / (2 * sizeof(uint64_t)));
+  for (size_t i = 0; i < deflates->size(); i++) {
+    uint64_t values[2];
+    memcpy(values, entry.data() + i * sizeof(values), sizeof(values));
+    (*deflates)[i] = BitExtent(values[0], values[1]);
+  }
+  return true;
+}
+
+bool StoreDeflates(const DiffCache& cache,
+                   const string& key,
+                   const vector<BitExtent>& deflates) {
+  brillo::Blob entry(deflates.size() * 2 * sizeof(uint64_t));
+  for (size_t i = 0; i < deflates.size(); i++) {
+    const uint64_t values[2] = {deflates[i].offset, deflates[i].length};
+    memcpy(entry.data() + i * sizeof(values), values, sizeof(values));
+  }
+  return cache.StoreData(key, entry);
+}
+
+// Reads the zip or gzip |file| from the partition at |part_path| and sets its
+// deflates, from |cache| if it has them.
+bool LocateFileDeflates(const string& part_path,
+                        const DiffCache* cache,
+                        FilesystemInterface::File* file) {
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadExtents(part_path,
+                         file->extents,
+                         &data,
+                         kBlockSize * utils::BlocksInExtents(file->extents),
+                         kBlockSize));
+  // |data| read from disk always has size multiple of kBlockSize. So it
+  // might contain trailing garbage data and confuse the gzip/zip
+  // processors. Trim them.
+  if (file->file_stat.st_size > 0 &&
+      static_cast<size_t>(file->file_stat.st_size) < data.size()) {
+    data.resize(file->file_stat.st_size);
+  }
+  vector<puffin::BitExtent> deflates;
+  string key;
+  if (cache)
+    key = DeflatesCacheKey(file->name, data);
+  if (!cache || !LookupDeflates(*cache, key, &deflates)) {
+    TEST_AND_RETURN_FALSE(
+        DeflatePreprocessFileData(file->name, data, &deflates));
+    if (cache && !StoreDeflates(*cache, key, deflates))
+      LOG(WARNING) << "Failed to cache the deflates of " << file->name;
+  }
+  // Shift the deflate's extent to the offset starting from the beginning
+  // of the current partition; and the delta processor will align the
+  // extents in a continuous buffer later.
+  TEST_AND_RETURN_FALSE(ShiftBitExtentsOverExtents(file->extents, &deflates));
+  file->deflates = std::move(deflates);
+  return true;
+}
+
+}  // namespace
+
+bool RemoveDeflatesWithBadDistanceCaches(const brillo::Blob& data,
+                                         vector<BitExtent>* deflates,
+                                         const string& cache_dir) {
+  if (cache_dir.empty() || deflates->empty())
+    return puffin::RemoveDeflatesWithBadDistanceCaches(data, deflates);
+  const DiffCache cache(cache_dir);
+  const string key = GoodDeflatesCacheKey(data, *deflates);
+  if (LookupDeflates(cache, key, deflates))
+    return true;
+  TEST_AND_RETURN_FALSE(
+      puffin::RemoveDeflatesWithBadDistanceCaches(data, deflates));
+  if (!StoreDeflates(cache, key, *deflates))
+    LOG(WARNING) << "Failed to cache the deflates with good distance caches";
+  return true;
+}
+
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               vector<FilesystemInterface::File>* result_files,
-                              bool extract_deflates) {
+                              bool extract_deflates,
+                              size_t num_threads,
+                              const string& cache_dir) {
   // Get the file system files.
   vector<FilesystemInterface::File> tmp_files;
   part.fs_interface->GetFiles(&tmp_files);
   result_files->reserve(tmp_files.size());
+  // Indexes in |result_files| of the files to search for deflates.
+  vector<size_t> deflate_files;
 
   for (auto& file : tmp_files) {
     auto is_regular_file = IsRegularFile(file);
@@ -346,39 +487,40 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
       bool is_zip = IsFileExtensions(
           file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
       bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
-      if (is_zip || is_gzip) {
-        brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
-            part.path,
-            file.extents,
-            &data,
-            kBlockSize * utils::BlocksInExtents(file.extents),
-            kBlockSize));
-        // |data| read from disk always has size multiple of kBlockSize. So it
-        // might contain trailing garbage data and confuse the gzip/zip
-        // processors. Trim them.
-        if (file.file_stat.st_size > 0 &&
-            static_cast<size_t>(file.file_stat.st_size) < data.size()) {
-          data.resize(file.file_stat.st_size);
-        }
-        vector<puffin::BitExtent> deflates;
-        if (!DeflatePreprocessFileData(file.name, data, &deflates)) {
-          LOG(ERROR) << "Failed to preprocess deflate data in partition "
-                     << part.name;
-          return false;
-        }
-        // Shift the deflate's extent to the offset starting from the beginning
-        // of the current partition; and the delta processor will align the
-        // extents in a continuous buffer later.
-        TEST_AND_RETURN_FALSE(
-            ShiftBitExtentsOverExtents(file.extents, &deflates));
-        file.deflates = std::move(deflates);
-      }
+      if (is_zip || is_gzip)
+        deflate_files.push_back(result_files->size());
     }
 
     result_files->push_back(file);
   }
-  return true;
+
+  if (deflate_files.empty())
+    return true;
+  // The files are searched independently, in parallel.
+  const DiffCache cache(cache_dir);
+  const DiffCache* cache_ptr = cache_dir.empty() ? nullptr : &cache;
+  std::atomic<size_t> next_file{0};
+  std::atomic<bool> failed{false};
+  auto locate_deflates = [&]() {
+    for (size_t i = next_file++; i < deflate_files.size() && !failed;
+         i = next_file++) {
+      FilesystemInterface::File* file = &(*result_files)[deflate_files[i]];
+      if (!LocateFileDeflates(part.path, cache_ptr, file)) {
+        LOG(ERROR) << "Failed to preprocess deflate data of " << file->name
+                   << " in partition " << part.name;
+        failed = true;
+      }
+    }
+  };
+  num_threads = std::max<size_t>(
+      1, std::min<size_t>(num_threads, deflate_files.size()));
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(locate_deflates);
+  locate_deflates();
+  for (auto& thread : threads)
+    thread.join();
+  return !failed;
 }
 
 }  // namespace deflate_utils
@@ -32,9 +32,14 @@ namespace deflate_utils {
 // includes:
 //  - splitting large Squashfs containers into its smaller files.
 //  - extracting deflates in zip and gzip files.
+// The zip and gzip files are searched on |num_threads| threads. With a
+// |cache_dir|, the deflates found are kept in a DiffCache there, keyed by the
+// content of the file.
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               std::vector<FilesystemInterface::File>* result,
-                              bool extract_deflates);
+                              bool extract_deflates,
+                              size_t num_threads = 1,
+                              const std::string& cache_dir = "");
 
 // Spreads all extents in |over_extents| over |base_extents|. Here we assume the
 // |over_extents| are non-overlapping and sorted by their offset.
@@ -103,6 +108,15 @@ bool DeflatePreprocessFileData(const std::string_view filename,
                                const brillo::Blob& data,
                                std::vector<puffin::BitExtent>* deflates);
 
+// Same as puffin::RemoveDeflatesWithBadDistanceCaches(), which puffs each
+// deflate in |deflates| of |data|. With a |cache_dir|, the deflates kept are
+// stored in a DiffCache there, keyed by |data| and |deflates|, so that the
+// source files shared by several payloads are only puffed once.
+bool RemoveDeflatesWithBadDistanceCaches(
+    const brillo::Blob& data,
+    std::vector<puffin::BitExtent>* deflates,
+    const std::string& cache_dir = "");
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
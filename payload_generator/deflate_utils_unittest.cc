@@ -22,6 +22,9 @@
 #include <utility>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
@@ -186,5 +189,27 @@ TEST(DeflateUtilsTest, CompactBoundaryTest) {
   EXPECT_EQ(out_deflates, expected_out_deflates);
 }
 
+TEST(DeflateUtilsTest, RemoveDeflatesWithBadDistanceCachesCacheTest) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  // An empty deflate with the fixed Huffman codes.
+  const brillo::Blob data = {0x03, 0x00};
+  vector<BitExtent> deflates = {BitExtent(0, 10)};
+  ASSERT_TRUE(RemoveDeflatesWithBadDistanceCaches(
+      data, &deflates, cache_dir.GetPath().value()));
+  EXPECT_EQ(vector<BitExtent>({BitExtent(0, 10)}), deflates);
+
+  // The deflates kept are read from the cache next time.
+  base::FileEnumerator files(
+      cache_dir.GetPath(), false, base::FileEnumerator::FILES);
+  const base::FilePath entry = files.Next();
+  ASSERT_FALSE(entry.empty());
+  EXPECT_TRUE(files.Next().empty());
+  ASSERT_TRUE(base::WriteFile(entry, "", 0));
+  ASSERT_TRUE(RemoveDeflatesWithBadDistanceCaches(
+      data, &deflates, cache_dir.GetPath().value()));
+  EXPECT_TRUE(deflates.empty());
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
@@ -31,6 +31,7 @@
 #include <base/logging.h>
 #include <base/threading/simple_thread.h>
 
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -40,8 +41,11 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_job_queue.h"
 #include "update_engine/payload_generator/full_update_generator.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
+#include "update_engine/payload_generator/numa_nodes.h"
+#include "update_engine/payload_generator/operations_reorderer.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -76,6 +80,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       std::vector<AnnotatedOperation>* aops,
       std::vector<CowMergeOperation>* cow_merge_sequence,
       size_t* cow_size,
+      brillo::Blob* zstd_dictionary,
+      DiffJobQueue* job_queue,
       std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy)
       : config_(config),
         old_part_(old_part),
@@ -84,6 +90,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         aops_(aops),
         cow_merge_sequence_(cow_merge_sequence),
         cow_size_(cow_size),
+        zstd_dictionary_(zstd_dictionary),
+        job_queue_(job_queue),
         strategy_(std::move(strategy)) {}
   PartitionProcessor(PartitionProcessor&&) noexcept = default;
 
@@ -98,25 +106,52 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       LOG(FATAL) << "GenerateOperations(" << old_part_.name << ", "
                  << new_part_.name << ") failed";
     }
+    if (config_.enable_zstd_dictionary &&
+        config_.version.minor >= kZstdDictionaryMinorPayloadVersion &&
+        !diff_utils::CompressWithZstdDictionary(new_part_.path,
+                                                aops_,
+                                                file_writer_,
+                                                job_queue_,
+                                                zstd_dictionary_)) {
+      LOG(FATAL) << "Failed to compress the operations of " << new_part_.name
+                 << " with a zstd dictionary";
+    }
 
     bool snapshot_enabled =
         config_.target.dynamic_partition_metadata &&
         config_.target.dynamic_partition_metadata->snapshot_enabled();
+    const bool vabc_enabled =
+        snapshot_enabled && IsDynamicPartition(new_part_.name) &&
+        config_.target.dynamic_partition_metadata->vabc_enabled();
+    if (config_.reorder_operations && !old_part_.path.empty()) {
+      LOG(INFO) << "Reordering the operations of " << new_part_.name;
+      ReorderOperations(aops_, {.sequential_writes = vabc_enabled});
+    }
+
     if (!snapshot_enabled || !IsDynamicPartition(new_part_.name)) {
       return;
     }
     // Skip cow size estimation if VABC isn't enabled
-    if (!config_.target.dynamic_partition_metadata->vabc_enabled()) {
+    if (!vabc_enabled) {
       return;
     }
     if (!old_part_.path.empty()) {
-      auto generator = MergeSequenceGenerator::Create(*aops_);
+      ScopedThreadPhaseTimer timer(config_.phase_metrics,
+                                   generator_phases::kMergeSequence,
+                                   new_part_.name);
+      auto generator =
+          MergeSequenceGenerator::Create(*aops_, new_part_.boot_read_extents);
       if (!generator || !generator->Generate(cow_merge_sequence_)) {
         LOG(FATAL) << "Failed to generate merge sequence";
       }
+      if (config_.cow_chunk_size)
+        SortOperationsByMergeSequence(*cow_merge_sequence_, aops_);
     }
 
     LOG(INFO) << "Estimating COW size for partition: " << new_part_.name;
+    ScopedThreadPhaseTimer timer(config_.phase_metrics,
+                                 generator_phases::kCowEstimate,
+                                 new_part_.name);
     // Need the contents of source/target image bytes when doing
     // dry run.
     auto target_fd = std::make_unique<EintrSafeFileDescriptor>();
@@ -142,7 +177,11 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         config_.block_size,
         config_.target.dynamic_partition_metadata->vabc_compression_param(),
         new_part_.size,
-        config_.enable_vabc_xor);
+        config_.enable_vabc_xor,
+        {.num_threads = config_.cow_estimate_threads > 0
+                            ? config_.cow_estimate_threads
+                            : diff_utils::GetMaxThreads(),
+         .max_sampling_error = config_.cow_estimate_max_error});
     LOG(INFO) << "Estimated COW size for partition: " << new_part_.name << " "
               << *cow_size_;
   }
@@ -155,6 +194,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
   std::vector<AnnotatedOperation>* aops_;
   std::vector<CowMergeOperation>* cow_merge_sequence_;
   size_t* cow_size_;
+  brillo::Blob* zstd_dictionary_;
+  DiffJobQueue* job_queue_;
   std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy_;
   DISALLOW_COPY_AND_ASSIGN(PartitionProcessor);
 };
@@ -169,6 +210,7 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
     return false;
   }
 
+  ScopedPhaseTimer timer(config.phase_metrics, generator_phases::kGenerate);
   // Create empty payload file object.
   PayloadFile payload;
   TEST_AND_RETURN_FALSE(payload.Init(config));
@@ -189,10 +231,27 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
     all_merge_sequences.resize(config.target.partitions.size());
 
     std::vector<size_t> all_cow_sizes(config.target.partitions.size(), 0);
+    std::vector<brillo::Blob> all_zstd_dictionaries(
+        config.target.partitions.size());
 
+    // The files and chunks of all the partitions are diffed on the threads of
+    // |job_queue|, the largest first and within the memory budget if there is
+    // one. Each partition gets a thread of its own which mostly waits for its
+    // jobs, then merges and estimates the COW size while the jobs of the other
+    // partitions run.
+    std::vector<std::vector<int>> node_cpus;
+    if (config.numa_aware) {
+      node_cpus = ReadNumaNodeCpus();
+      LOG(INFO) << "Spreading the diff threads over " << node_cpus.size()
+                << " NUMA nodes";
+    }
+    DiffJobQueue job_queue(config.max_threads > 0
+                               ? config.max_threads
+                               : diff_utils::GetMaxThreads(),
+                           config.max_memory,
+                           std::move(node_cpus));
     std::vector<PartitionProcessor> partition_tasks{};
-    auto thread_count = std::min<int>(diff_utils::GetMaxThreads(),
-                                      config.target.partitions.size());
+    auto thread_count = std::max<int>(config.target.partitions.size(), 1);
     base::DelegateSimpleThreadPool thread_pool{"partition-thread-pool",
                                                thread_count};
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
@@ -209,11 +268,11 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         // Delta update.
         LOG(INFO) << "Using generator ABGenerator() for partition "
                   << new_part.name;
-        strategy.reset(new ABGenerator());
+        strategy.reset(new ABGenerator(&job_queue));
       } else {
         LOG(INFO) << "Using generator FullUpdateGenerator() for partition "
                   << new_part.name;
-        strategy.reset(new FullUpdateGenerator());
+        strategy.reset(new FullUpdateGenerator(&job_queue));
       }
 
       // Generate the operations using the strategy we selected above.
@@ -224,6 +283,8 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    &all_aops[i],
                                                    &all_merge_sequences[i],
                                                    &all_cow_sizes[i],
+                                                   &all_zstd_dictionaries[i],
+                                                   &job_queue,
                                                    std::move(strategy)));
     }
     thread_pool.Start();
@@ -241,15 +302,20 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                new_part,
                                std::move(all_aops[i]),
                                std::move(all_merge_sequences[i]),
-                               all_cow_sizes[i]));
+                               all_cow_sizes[i],
+                               std::move(all_zstd_dictionaries[i])));
     }
   }
   data_file.CloseFd();
 
   LOG(INFO) << "Writing payload file...";
   // Write payload file to disk.
-  TEST_AND_RETURN_FALSE(payload.WritePayload(
-      output_path, data_file.path(), private_key_path, metadata_size));
+  {
+    ScopedThreadPhaseTimer write_timer(config.phase_metrics,
+                                       generator_phases::kWritePayload);
+    TEST_AND_RETURN_FALSE(payload.WritePayload(
+        output_path, data_file.path(), private_key_path, metadata_size));
+  }
 
   LOG(INFO) << "All done. Successfully created delta file with "
             << "metadata size = " << *metadata_size;
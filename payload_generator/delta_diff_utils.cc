@@ -30,12 +30,17 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <list>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <set>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -44,12 +49,14 @@
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <base/threading/simple_thread.h>
+#include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bsdiff.h>
 #include <bsdiff/constants.h>
 #include <bsdiff/control_entry.h>
 #include <bsdiff/patch_reader.h>
 #include <bsdiff/patch_writer_factory.h>
+#include <lz4.h>
 #include <puffin/brotli_util.h>
 #include <puffin/utils.h>
 #include <zucchini/buffer_view.h>
@@ -57,17 +64,26 @@
 #include <zucchini/zucchini.h>
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4diff.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/block_index_cache.h"
 #include "update_engine/payload_generator/block_mapping.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_algorithm_stats.h"
+#include "update_engine/payload_generator/diff_budget.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_similarity_index.h"
+#include "update_engine/payload_generator/image_hash.h"
+#include "update_engine/payload_generator/mapped_image.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::list;
 using std::map;
@@ -93,8 +109,78 @@ const uint64_t kMaxPuffdiffDestinationSize = 150 * 1024 * 1024;  // bytes
 // as zucchini tends to use more peak memory.
 const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
+// The chunks of the executables split for zucchini are diffed against the old
+// data within a quarter of their size around them, for the code moved between
+// the versions. The old data then stays within kMaxZucchiniDestinationSize.
+const uint64_t kZucchiniMarginDivisor = 4;
+const uint64_t kMaxZucchiniChunkSize =
+    kMaxZucchiniDestinationSize * kZucchiniMarginDivisor /
+    (kZucchiniMarginDivisor + 2);
+
 const int kBrotliCompressionQuality = 11;
 
+// Files split in chunks are diffed in jobs of at least this many blocks, so
+// that the idle threads can take over the rest of a large file.
+const uint64_t kMinFileJobBlocks = 4096;  // 16 MiB
+
+// Rough cost of diffing a block against an old file and of the deflates in it,
+// relative to just compressing it, to start the slowest jobs first.
+const uint64_t kDiffCostFactor = 4;
+const uint64_t kDeflateCostFactor = 2;
+
+// Full operations of at least this size try their compressors in parallel.
+const size_t kMinParallelCompressionSize = 4 * 1024 * 1024;  // bytes
+
+// Most threads a single lz4diff operation recompresses the new blocks on,
+// which only helps the large files while the other threads are busy too.
+const size_t kMaxLz4diffThreads = 4;
+
+// The XOR source search hashes kXorAnchorsPerBlock windows of kXorWindowSize
+// bytes of each new block and looks for them at every offset of the old data.
+// At most kMaxXorCandidates old positions are compared with each new block.
+const size_t kXorWindowSize = 32;
+const size_t kXorAnchorsPerBlock = 4;
+const size_t kMaxXorCandidates = 16;
+// Bits of the filter of the anchor hashes checked before the hash table.
+const size_t kXorFilterBits = 20;
+
+// Rough peak memory of diffing |old_blocks| against |new_blocks| blocks. Both
+// are read in memory along with the patch, bsdiff adds a suffix array of 8
+// bytes per old byte, and puffing the deflates takes about as much again.
+uint64_t EstimateDiffMemory(uint64_t old_blocks,
+                            uint64_t new_blocks,
+                            bool has_deflates) {
+  constexpr uint64_t kSuffixArrayEntrySize = 8;
+  uint64_t memory =
+      (old_blocks * (1 + kSuffixArrayEntrySize) + new_blocks * 2) * kBlockSize;
+  return has_deflates ? memory * 2 : memory;
+}
+
+// Whether zucchini may diff the file |name|, or one of its chunks.
+bool IsZucchiniFile(std::string_view name) {
+  // The chunks of a file are named "<file>:<chunk>".
+  const size_t colon = name.rfind(':');
+  if (colon != std::string_view::npos && colon + 1 < name.size() &&
+      std::all_of(name.begin() + colon + 1, name.end(), [](char c) {
+        return base::IsAsciiDigit(c);
+      })) {
+    name = name.substr(0, colon);
+  }
+  // zip files are ignored for now. We expect puffin to perform better on
+  // those. Investigate whether puffin over zucchini yields better results
+  // on those.
+  return deflate_utils::IsFileExtensions(
+      name,
+      {".ko",
+       ".so",
+       ".art",
+       ".odex",
+       ".vdex",
+       "<kernel>",
+       "<modem-partition>",
+       /*, ".capex",".jar", ".apk", ".apex"*/});
+}
+
 // Storing a diff operation has more overhead over replace operation in the
 // manifest, we need to store an additional src_sha256_hash which is 32 bytes
 // and not compressible, and also src_extents which could use anywhere from a
@@ -218,12 +304,20 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
     brillo::Blob patch;
     InstallOperation::Type op_type{};
+    ScopedThreadPhaseTimer timer(
+        config_.phase_metrics,
+        string(generator_phases::kDiffAlgorithmPrefix) + "LZ4DIFF");
+    const size_t lz4diff_threads = std::min<size_t>(
+        kMaxLz4diffThreads,
+        config_.max_threads > 0 ? config_.max_threads : GetMaxThreads());
     if (Lz4Diff(old_data_,
                 new_data_,
                 old_block_info_,
                 new_block_info_,
                 &patch,
-                &op_type)) {
+                &op_type,
+                config_.lz4diff_source_cache,
+                lz4diff_threads)) {
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
@@ -232,10 +326,37 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     }
   }
 
+  // With VABC XOR, bsdiff also adds the XOR merge operations of |aop|, which
+  // aren't cached.
+  const bool use_diff_cache =
+      !config_.diff_cache_dir.empty() && !config_.enable_vabc_xor;
+  const DiffCache diff_cache(config_.diff_cache_dir);
+  string diff_cache_key;
+  if (use_diff_cache) {
+    diff_cache_key = GetDiffCacheKey(diff_candidates, *aop, *data_blob);
+    InstallOperation::Type op_type{};
+    brillo::Blob patch;
+    if (diff_cache.Lookup(diff_cache_key, &op_type, &patch)) {
+      // The full operation stays the best one when no diff was better.
+      if (op_type != aop->op.type()) {
+        aop->op.set_type(op_type);
+        *data_blob = std::move(patch);
+      }
+      return true;
+    }
+  }
+  const InstallOperation::Type full_op_type = aop->op.type();
+
   const uint64_t input_bytes = std::max(utils::BlocksInExtents(src_extents_),
                                         utils::BlocksInExtents(dst_extents_)) *
                                kBlockSize;
 
+  DiffAlgorithmStats* diff_stats = config_.diff_algorithm_stats;
+  DiffBudget* diff_budget = config_.diff_budget;
+  const base::TimeTicks diff_start = base::TimeTicks::Now();
+  vector<InstallOperation_Type> tried_types;
+  bool skipped_by_stats = false;
+  bool skipped_by_budget = false;
   for (auto [op_type, limit] : diff_candidates) {
     if (!config_.OperationEnabled(op_type)) {
       continue;
@@ -254,6 +375,28 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
 
+    if (!CanDiffWith(op_type, *aop)) {
+      continue;
+    }
+    if (diff_stats && !diff_stats->ShouldTry(aop->name, op_type)) {
+      skipped_by_stats = true;
+      continue;
+    }
+    if (diff_budget && !diff_budget->ShouldTry(aop->name,
+                                               op_type,
+                                               old_data_.size(),
+                                               new_data_.size(),
+                                               base::TimeTicks::Now() -
+                                                   diff_start)) {
+      skipped_by_budget = true;
+      continue;
+    }
+    tried_types.push_back(op_type);
+    const base::TimeTicks attempt_start = base::TimeTicks::Now();
+
+    ScopedThreadPhaseTimer timer(config_.phase_metrics,
+                                 generator_phases::kDiffAlgorithmPrefix +
+                                     string(InstallOperationTypeName(op_type)));
     switch (op_type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
@@ -269,11 +412,90 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       default:
         NOTREACHED();
     }
+    if (diff_budget) {
+      diff_budget->AddResult(
+          op_type, new_data_.size(), base::TimeTicks::Now() - attempt_start);
+    }
   }
 
+  if (diff_stats) {
+    for (auto op_type : tried_types)
+      diff_stats->AddResult(aop->name, op_type, op_type == aop->op.type());
+  }
+
+  // The result may be worse than it could be when algorithms were skipped.
+  if (use_diff_cache && !skipped_by_stats && !skipped_by_budget) {
+    // A failure to cache the result only costs a diff next time.
+    const bool is_full_op = aop->op.type() == full_op_type;
+    if (!diff_cache.Store(diff_cache_key,
+                          aop->op.type(),
+                          is_full_op ? brillo::Blob() : *data_blob)) {
+      LOG(WARNING) << "Failed to cache the diff of " << aop->name;
+    }
+  }
   return true;
 }
 
+string BestDiffGenerator::GetDiffCacheKey(
+    const vector<std::pair<InstallOperation_Type, size_t>>& diff_candidates,
+    const AnnotatedOperation& aop,
+    const brillo::Blob& data_blob) const {
+  HashCalculator hasher;
+  auto update_int = [&hasher](uint64_t value) {
+    hasher.Update(&value, sizeof(value));
+  };
+  auto update_deflates = [&](const vector<puffin::BitExtent>& deflates) {
+    update_int(deflates.size());
+    for (const auto& deflate : deflates) {
+      update_int(deflate.offset);
+      update_int(deflate.length);
+    }
+  };
+  // Bump when the diff of the same input may change.
+  constexpr uint64_t kDiffCacheVersion = 1;
+  update_int(kDiffCacheVersion);
+  update_int(config_.version.major);
+  update_int(config_.version.minor);
+  for (const auto& [op_type, limit] : diff_candidates) {
+    update_int(op_type);
+    update_int(limit);
+    update_int(config_.OperationEnabled(op_type));
+  }
+  update_int(config_.OperationEnabled(InstallOperation::BROTLI_BSDIFF));
+  update_int(config_.compressors.size());
+  for (const auto compressor : config_.compressors)
+    update_int(static_cast<uint64_t>(compressor));
+  // Zucchini picks its disassembler from the file name.
+  update_int(aop.name.size());
+  hasher.Update(aop.name.data(), aop.name.size());
+  // The diffs are compared with the full operation, and their cost depends on
+  // the number of source extents.
+  update_int(aop.op.type());
+  update_int(data_blob.size());
+  update_int(src_extents_.size());
+  update_deflates(old_deflates_);
+  update_deflates(new_deflates_);
+  update_int(old_data_.size());
+  hasher.Update(old_data_.data(), old_data_.size());
+  update_int(new_data_.size());
+  hasher.Update(new_data_.data(), new_data_.size());
+  hasher.Finalize();
+  return DiffCache::Key(hasher.raw_hash());
+}
+
+bool BestDiffGenerator::CanDiffWith(InstallOperation_Type operation_type,
+                                    const AnnotatedOperation& aop) const {
+  switch (operation_type) {
+    case InstallOperation::PUFFDIFF:
+      // Only Puffdiff if both files have at least one deflate left.
+      return !old_deflates_.empty() && !new_deflates_.empty();
+    case InstallOperation::ZUCCHINI:
+      return IsZucchiniFile(aop.name);
+    default:
+      return true;
+  }
+}
+
 bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     InstallOperation_Type operation_type,
     AnnotatedOperation* aop,
@@ -310,6 +532,7 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     if (config_.enable_vabc_xor) {
       StoreExtents(src_extents_, operation.mutable_src_extents());
       diff_utils::PopulateXorOps(aop, bsdiff_delta);
+      diff_utils::AddSimilarXorOps(aop, old_data_, new_data_);
     }
     operation.set_type(operation_type);
     *data_blob = std::move(bsdiff_delta);
@@ -319,48 +542,31 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
 
 bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                                       brillo::Blob* data_blob) {
-  // Only Puffdiff if both files have at least one deflate left.
-  if (!old_deflates_.empty() && !new_deflates_.empty()) {
-    brillo::Blob puffdiff_delta;
-    ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
-    // Perform PuffDiff operation.
-    TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
-                                           new_data_,
-                                           old_deflates_,
-                                           new_deflates_,
-                                           GetUsableCompressorTypes(),
-                                           temp_file.path(),
-                                           &puffdiff_delta));
-    TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
-
-    InstallOperation& operation = aop->op;
-    if (IsDiffOperationBetter(operation,
-                              data_blob->size(),
-                              puffdiff_delta.size(),
-                              src_extents_.size())) {
-      operation.set_type(InstallOperation::PUFFDIFF);
-      *data_blob = std::move(puffdiff_delta);
-    }
+  brillo::Blob puffdiff_delta;
+  ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
+  // Perform PuffDiff operation.
+  TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
+                                         new_data_,
+                                         old_deflates_,
+                                         new_deflates_,
+                                         GetUsableCompressorTypes(),
+                                         temp_file.path(),
+                                         &puffdiff_delta));
+  TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
+
+  InstallOperation& operation = aop->op;
+  if (IsDiffOperationBetter(operation,
+                            data_blob->size(),
+                            puffdiff_delta.size(),
+                            src_extents_.size())) {
+    operation.set_type(InstallOperation::PUFFDIFF);
+    *data_blob = std::move(puffdiff_delta);
   }
   return true;
 }
 
 bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
                                                       brillo::Blob* data_blob) {
-  // zip files are ignored for now. We expect puffin to perform better on those.
-  // Investigate whether puffin over zucchini yields better results on those.
-  if (!deflate_utils::IsFileExtensions(
-          aop->name,
-          {".ko",
-           ".so",
-           ".art",
-           ".odex",
-           ".vdex",
-           "<kernel>",
-           "<modem-partition>",
-           /*, ".capex",".jar", ".apk", ".apex"*/})) {
-    return true;
-  }
   zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
   zucchini::ConstBufferView dst_bytes(new_data_.data(), new_data_.size());
 
@@ -397,24 +603,55 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
  public:
   FileDeltaProcessor(const string& old_part,
                      const string& new_part,
+                     const string& partition_name,
                      const PayloadGenerationConfig& config,
                      const File& old_extents,
                      const File& new_extents,
                      const string& name,
                      ssize_t chunk_blocks,
-                     BlobFileWriter* blob_file)
+                     BlobFileWriter* blob_file,
+                     uint64_t block_offset = 0,
+                     uint64_t num_blocks = std::numeric_limits<uint64_t>::max(),
+                     uint64_t old_margin_blocks = 0)
       : old_part_(old_part),
         new_part_(new_part),
+        partition_name_(partition_name),
         config_(config),
         old_extents_(old_extents),
         new_extents_(new_extents),
         new_extents_blocks_(utils::BlocksInExtents(new_extents.extents)),
         name_(name),
         chunk_blocks_(chunk_blocks),
-        blob_file_(blob_file) {}
+        blob_file_(blob_file),
+        block_offset_(block_offset),
+        num_blocks_(std::min(num_blocks, new_extents_blocks_ - block_offset)),
+        old_margin_blocks_(old_margin_blocks) {}
 
   bool operator>(const FileDeltaProcessor& other) const {
-    return new_extents_blocks_ > other.new_extents_blocks_;
+    return EstimateCost() > other.EstimateCost();
+  }
+
+  // Relative cost of Run(), to run the slowest processors first.
+  uint64_t EstimateCost() const {
+    uint64_t cost = num_blocks_;
+    if (!old_extents_.extents.empty())
+      cost *= kDiffCostFactor;
+    if (!new_extents_.deflates.empty())
+      cost *= kDeflateCostFactor;
+    return cost;
+  }
+
+  // Peak memory of Run(), the chunks are diffed one at a time.
+  uint64_t EstimateMemory() const {
+    uint64_t new_blocks = num_blocks_;
+    uint64_t old_blocks = utils::BlocksInExtents(old_extents_.extents);
+    if (chunk_blocks_ > 0) {
+      new_blocks = std::min<uint64_t>(new_blocks, chunk_blocks_);
+      old_blocks = std::min<uint64_t>(old_blocks,
+                                      chunk_blocks_ + 2 * old_margin_blocks_);
+    }
+    return EstimateDiffMemory(
+        old_blocks, new_blocks, !new_extents_.deflates.empty());
   }
 
   ~FileDeltaProcessor() override = default;
@@ -430,6 +667,7 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
  private:
   const string& old_part_;  // NOLINT(runtime/member_string_references)
   const string& new_part_;  // NOLINT(runtime/member_string_references)
+  const string partition_name_;
   const PayloadGenerationConfig& config_;
 
   // The block ranges of the old/new file within the src/tgt image
@@ -440,6 +678,12 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   // Block limit of one aop.
   const ssize_t chunk_blocks_;
   BlobFileWriter* blob_file_;
+  // The part of |new_extents_| processed, a multiple of |chunk_blocks_| blocks
+  // unless it ends with the file.
+  const uint64_t block_offset_;
+  const uint64_t num_blocks_;
+  // The old blocks diffed with each chunk on both sides of it.
+  const uint64_t old_margin_blocks_;
 
   // The list of ops to reach the new file from the old file.
   vector<AnnotatedOperation> file_aops_;
@@ -451,16 +695,21 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
 
 void FileDeltaProcessor::Run() {
   TEST_AND_RETURN(blob_file_ != nullptr);
+  ScopedThreadPhaseTimer timer(
+      config_.phase_metrics, generator_phases::kDiffJobs, partition_name_);
   base::TimeTicks start = base::TimeTicks::Now();
 
-  if (!DeltaReadFile(&file_aops_,
-                     old_part_,
-                     new_part_,
-                     old_extents_,
-                     new_extents_,
-                     chunk_blocks_,
-                     config_,
-                     blob_file_)) {
+  if (!DeltaReadFileChunks(&file_aops_,
+                           old_part_,
+                           new_part_,
+                           old_extents_,
+                           new_extents_,
+                           chunk_blocks_,
+                           block_offset_,
+                           num_blocks_,
+                           config_,
+                           blob_file_,
+                           old_margin_blocks_)) {
     LOG(ERROR) << "Failed to generate delta for " << name_ << " ("
                << new_extents_blocks_ << " blocks)";
     failed_ = true;
@@ -474,6 +723,13 @@ void FileDeltaProcessor::Run() {
     return;
   }
 
+  if (num_blocks_ < new_extents_blocks_) {
+    LOG(INFO) << "Encoded blocks " << block_offset_ << " to "
+              << block_offset_ + num_blocks_ << " of file " << name_ << " ("
+              << new_extents_blocks_ << " blocks) in "
+              << (base::TimeTicks::Now() - start);
+    return;
+  }
   LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
             << " blocks) in " << (base::TimeTicks::Now() - start);
 }
@@ -532,7 +788,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadGenerationConfig& config,
-                        BlobFileWriter* blob_file) {
+                        BlobFileWriter* blob_file,
+                        DiffJobQueue* job_queue) {
   const auto& version = config.version;
   ExtentRanges old_visited_blocks;
   ExtentRanges new_visited_blocks;
@@ -549,13 +806,32 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     new_visited_blocks.AddExtent(new_part.verity.fec_extent);
   }
 
+  // Keep the images mapped while their files are diffed, instead of mapping
+  // them again for each file.
+  std::shared_ptr<const MappedImage> old_image, new_image;
+  if (!old_part.path.empty())
+    old_image = MappedImage::Get(old_part.path);
+  if (!new_part.path.empty())
+    new_image = MappedImage::Get(new_part.path);
+
   const bool puffdiff_allowed =
       config.OperationEnabled(InstallOperation::PUFFDIFF);
 
+  const size_t preprocess_threads =
+      config.max_threads > 0 ? config.max_threads : GetMaxThreads();
+
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  {
+    ScopedThreadPhaseTimer timer(
+        config.phase_metrics, generator_phases::kFileList, new_part.name);
+    TEST_AND_RETURN_FALSE(
+        deflate_utils::PreprocessPartitionFiles(new_part,
+                                                &new_files,
+                                                puffdiff_allowed,
+                                                preprocess_threads,
+                                                config.diff_cache_dir));
+  }
 
   ExtentRanges old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
@@ -570,6 +846,9 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       });
   if (!config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) ||
       no_compressed_files) {
+    ScopedThreadPhaseTimer timer(config.phase_metrics,
+                                 generator_phases::kMovedAndZeroBlocks,
+                                 new_part.name);
     TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
                                                   old_part.path,
                                                   new_part.path,
@@ -585,14 +864,119 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
 
   map<string, FilesystemInterface::File> old_files_map;
   if (old_part.fs_interface) {
+    ScopedThreadPhaseTimer timer(
+        config.phase_metrics, generator_phases::kFileList, new_part.name);
     vector<FilesystemInterface::File> old_files;
-    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-        old_part, &old_files, puffdiff_allowed));
+    TEST_AND_RETURN_FALSE(
+        deflate_utils::PreprocessPartitionFiles(old_part,
+                                                &old_files,
+                                                puffdiff_allowed,
+                                                preprocess_threads,
+                                                config.diff_cache_dir));
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file;
   }
 
+  // The new files no old file has the name of, like renamed or versioned
+  // ones, are diffed against the old file they share the most blocks with
+  // instead of the one with the closest name, if any shares enough. Only the
+  // old files no new file has the name of are candidates.
+  map<string, const File*> similar_old_files;
+  if (old_image && new_image && !old_files_map.empty()) {
+    std::set<string> new_file_names;
+    vector<const File*> unmatched_new_files;
+    for (const File& new_file : new_files) {
+      if (new_file.extents.empty() ||
+          !new_file_names.insert(new_file.name).second) {
+        continue;
+      }
+      if (old_files_map.find(new_file.name) == old_files_map.end())
+        unmatched_new_files.push_back(&new_file);
+    }
+    vector<const File*> candidate_old_files;
+    for (const auto& [name, old_file] : old_files_map) {
+      if (!old_file.extents.empty() && new_file_names.count(name) == 0)
+        candidate_old_files.push_back(&old_file);
+    }
+    if (!unmatched_new_files.empty() && !candidate_old_files.empty()) {
+      const FileSimilarityIndex index(std::move(candidate_old_files),
+                                      *old_image,
+                                      kBlockSize,
+                                      preprocess_threads);
+      const vector<const File*> found = index.FindSimilarFiles(
+          unmatched_new_files, *new_image, preprocess_threads);
+      for (size_t i = 0; i < found.size(); i++) {
+        if (found[i])
+          similar_old_files[unmatched_new_files[i]->name] = found[i];
+      }
+    }
+  }
+
   list<FileDeltaProcessor> file_delta_processors;
+  // Files of several chunks are split in parts diffed independently, which
+  // produce the same operations as the whole file diffed at once.
+  auto add_file_delta_processors = [&](const File& old_file,
+                                       const File& new_file,
+                                       const string& name,
+                                       ssize_t chunk_blocks) {
+    const uint64_t file_blocks = utils::BlocksInExtents(new_file.extents);
+    if (config.max_memory > 0) {
+      // Chunks small enough to be diffed within the memory budget, at the
+      // price of a larger patch.
+      const uint64_t max_chunk_blocks = std::max<uint64_t>(
+          1,
+          config.max_memory /
+              EstimateDiffMemory(1, 1, !new_file.deflates.empty()));
+      const uint64_t file_chunk_blocks =
+          chunk_blocks > 0 ? chunk_blocks : file_blocks;
+      if (file_chunk_blocks > max_chunk_blocks) {
+        LOG(INFO) << "Splitting " << name << " (" << file_blocks
+                  << " blocks) in chunks of " << max_chunk_blocks
+                  << " blocks to fit in the memory budget.";
+        chunk_blocks = max_chunk_blocks;
+      }
+    }
+    // Executables too large for zucchini are split in chunks it can diff.
+    uint64_t old_margin_blocks = 0;
+    if (config.zucchini_chunk_size > 0 &&
+        config.OperationEnabled(InstallOperation::ZUCCHINI) &&
+        !old_file.extents.empty() &&
+        file_blocks * kBlockSize > kMaxZucchiniDestinationSize &&
+        IsZucchiniFile(name)) {
+      const uint64_t zucchini_chunk_blocks =
+          std::min(config.zucchini_chunk_size, kMaxZucchiniChunkSize) /
+          kBlockSize;
+      if (chunk_blocks <= 0 ||
+          static_cast<uint64_t>(chunk_blocks) > zucchini_chunk_blocks) {
+        LOG(INFO) << "Splitting " << name << " (" << file_blocks
+                  << " blocks) in chunks of " << zucchini_chunk_blocks
+                  << " blocks for zucchini.";
+        chunk_blocks = zucchini_chunk_blocks;
+      }
+      old_margin_blocks =
+          static_cast<uint64_t>(chunk_blocks) / kZucchiniMarginDivisor;
+    }
+    uint64_t job_blocks = file_blocks;
+    if (chunk_blocks > 0) {
+      job_blocks = utils::DivRoundUp(kMinFileJobBlocks, chunk_blocks) *
+                   static_cast<uint64_t>(chunk_blocks);
+    }
+    for (uint64_t block_offset = 0; block_offset < file_blocks;
+         block_offset += job_blocks) {
+      file_delta_processors.emplace_back(old_part.path,
+                                         new_part.path,
+                                         new_part.name,
+                                         config,
+                                         old_file,
+                                         new_file,
+                                         name,
+                                         chunk_blocks,
+                                         blob_file,
+                                         block_offset,
+                                         job_blocks,
+                                         old_margin_blocks);
+    }
+  };
 
   // The processing is very straightforward here, we generate operations for
   // every file (and pseudo-file such as the metadata) in the new filesystem
@@ -613,8 +997,15 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     if (new_file_extents.empty())
       continue;
 
-    FilesystemInterface::File old_file =
-        GetOldFile(old_files_map, new_file.name);
+    FilesystemInterface::File old_file;
+    const auto similar_old_file = similar_old_files.find(new_file.name);
+    if (similar_old_file != similar_old_files.end()) {
+      old_file = *similar_old_file->second;
+      LOG(INFO) << "Using " << old_file.name << " as source for "
+                << new_file.name << ", which shares most blocks with it";
+    } else {
+      old_file = GetOldFile(old_files_map, new_file.name);
+    }
     old_visited_blocks.AddExtents(old_file.extents);
 
     // TODO(b/177104308) Filtering |new_file_extents| might confuse puffdiff, as
@@ -634,14 +1025,10 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // whatsoever.
     auto filtered_new_file = new_file;
     filtered_new_file.extents = RemoveDuplicateBlocks(new_file_extents);
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
-                                       config,
-                                       std::move(old_file),
-                                       std::move(filtered_new_file),
-                                       new_file.name,  // operation name
-                                       hard_chunk_blocks,
-                                       blob_file);
+    add_file_delta_processors(old_file,
+                              filtered_new_file,
+                              new_file.name,  // operation name
+                              hard_chunk_blocks);
   }
   // Process all the blocks not included in any file. We provided all the unused
   // blocks in the old partition as available data.
@@ -665,35 +1052,42 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     old_file.extents = old_unvisited;
     File new_file;
     new_file.extents = RemoveDuplicateBlocks(new_unvisited);
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
-                                       config,
-                                       old_file,
-                                       new_file,
-                                       "<non-file-data>",  // operation name
-                                       soft_chunk_blocks,
-                                       blob_file);
+    add_file_delta_processors(old_file,
+                              new_file,
+                              "<non-file-data>",  // operation name
+                              soft_chunk_blocks);
   }
 
-  size_t max_threads = GetMaxThreads();
+  ScopedThreadPhaseTimer diff_timer(
+      config.phase_metrics, generator_phases::kDiff, new_part.name);
+  if (job_queue) {
+    // The queue starts the largest files of all the partitions first.
+    vector<DiffJobQueue::Job> jobs;
+    for (auto& processor : file_delta_processors)
+      jobs.push_back(
+          {processor.EstimateCost(), &processor, processor.EstimateMemory()});
+    job_queue->RunJobs(jobs);
+  } else {
+    size_t max_threads = GetMaxThreads();
 
-  if (config.max_threads > 0) {
-    max_threads = config.max_threads;
-  }
+    if (config.max_threads > 0) {
+      max_threads = config.max_threads;
+    }
 
-  // Sort the files in descending order based on number of new blocks to make
-  // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
-    file_delta_processors.sort(std::greater<FileDeltaProcessor>());
-  }
+    // Sort the files in descending order based on their estimated cost to
+    // make sure we start the slowest ones first.
+    if (file_delta_processors.size() > max_threads) {
+      file_delta_processors.sort(std::greater<FileDeltaProcessor>());
+    }
 
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+    base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
+                                               max_threads);
+    thread_pool.Start();
+    for (auto& processor : file_delta_processors) {
+      thread_pool.AddWork(&processor);
+    }
+    thread_pool.JoinAll();
   }
-  thread_pool.JoinAll();
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -713,24 +1107,55 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              ExtentRanges* old_visited_blocks,
                              ExtentRanges* new_visited_blocks,
                              ExtentRanges* old_zero_blocks) {
+  // The index of the old partition is kept with the diff cache, keyed by the
+  // hash of the partition that its partition info needs anyway.
+  const BlockIndexCache index_cache(config.diff_cache_dir);
+  string index_key;
+  BlockMapping::ImageIndex old_index;
+  bool old_index_found = false;
+  if (!config.diff_cache_dir.empty()) {
+    brillo::Blob old_hash;
+    if (GetImageHash(old_part, old_num_blocks * kBlockSize, &old_hash)) {
+      index_key = BlockIndexCache::Key(old_hash, kBlockSize);
+      old_index_found =
+          index_cache.Lookup(index_key, old_num_blocks, &old_index);
+    }
+  }
+  if (old_index_found)
+    LOG(INFO) << "Loaded the block index of " << old_part << " from the cache.";
+
   vector<BlockMapping::BlockId> old_block_ids;
   vector<BlockMapping::BlockId> new_block_ids;
-  TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
-                                           new_part,
-                                           old_num_blocks * kBlockSize,
-                                           new_num_blocks * kBlockSize,
-                                           kBlockSize,
-                                           &old_block_ids,
-                                           &new_block_ids));
-
-  // A mapping from the block_id to the list of block numbers with that block id
-  // in the old partition. This is used to lookup where in the old partition
-  // is a block from the new partition.
-  map<BlockMapping::BlockId, vector<uint64_t>> old_blocks_map;
+  TEST_AND_RETURN_FALSE(MapPartitionBlocks(
+      old_part,
+      new_part,
+      old_num_blocks * kBlockSize,
+      new_num_blocks * kBlockSize,
+      kBlockSize,
+      &old_block_ids,
+      &new_block_ids,
+      config.max_threads > 0 ? config.max_threads : GetMaxThreads(),
+      index_key.empty() ? nullptr : &old_index));
+  if (!index_key.empty() && !old_index_found &&
+      !index_cache.Store(index_key, old_index)) {
+    LOG(WARNING) << "Failed to cache the block index of " << old_part;
+  }
+
+  // The first old block not visited yet with each block id, indexed by block
+  // id. This is used to lookup where in the old partition is a block from the
+  // new partition. Block ids are assigned in order from 0, so this is at most
+  // one entry per old block.
+  constexpr uint64_t kNoOldBlock = std::numeric_limits<uint64_t>::max();
+  vector<uint64_t> old_block_by_id;
+  if (!old_block_ids.empty()) {
+    old_block_by_id.resize(
+        *std::max_element(old_block_ids.begin(), old_block_ids.end()) + 1,
+        kNoOldBlock);
+  }
 
   for (uint64_t block = old_num_blocks; block-- > 0;) {
     if (old_block_ids[block] != 0 && !old_visited_blocks->ContainsBlock(block))
-      old_blocks_map[old_block_ids[block]].push_back(block);
+      old_block_by_id[old_block_ids[block]] = block;
 
     // Mark all zeroed blocks in the old image as "used" since it doesn't make
     // any sense to spend I/O to read zeros from the source partition and more
@@ -760,14 +1185,13 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
       continue;
     }
 
-    auto old_blocks_map_it = old_blocks_map.find(new_block_ids[block]);
     // Check if the block exists in the old partition at all.
-    if (old_blocks_map_it == old_blocks_map.end() ||
-        old_blocks_map_it->second.empty())
+    const uint64_t block_id = new_block_ids[block];
+    if (block_id >= old_block_by_id.size() ||
+        old_block_by_id[block_id] == kNoOldBlock)
       continue;
 
-    AppendBlockToExtents(&old_identical_blocks,
-                         old_blocks_map_it->second.back());
+    AppendBlockToExtents(&old_identical_blocks, old_block_by_id[block_id]);
     AppendBlockToExtents(&new_identical_blocks, block);
   }
 
@@ -859,6 +1283,29 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    ssize_t chunk_blocks,
                    const PayloadGenerationConfig& config,
                    BlobFileWriter* blob_file) {
+  return DeltaReadFileChunks(aops,
+                             old_part,
+                             new_part,
+                             old_file,
+                             new_file,
+                             chunk_blocks,
+                             0,
+                             utils::BlocksInExtents(new_file.extents),
+                             config,
+                             blob_file);
+}
+
+bool DeltaReadFileChunks(std::vector<AnnotatedOperation>* aops,
+                         const std::string& old_part,
+                         const std::string& new_part,
+                         const File& old_file,
+                         const File& new_file,
+                         ssize_t chunk_blocks,
+                         uint64_t first_block,
+                         uint64_t num_blocks,
+                         const PayloadGenerationConfig& config,
+                         BlobFileWriter* blob_file,
+                         uint64_t old_margin_blocks) {
   const auto& old_extents = old_file.extents;
   const auto& new_extents = new_file.extents;
   const auto& name = new_file.name;
@@ -874,14 +1321,27 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
   if (chunk_blocks == -1)
     chunk_blocks = total_blocks;
 
-  for (uint64_t block_offset = 0; block_offset < total_blocks;
+  if (first_block % chunk_blocks != 0) {
+    LOG(ERROR) << "Block " << first_block << " isn't the start of a chunk of "
+               << chunk_blocks << " blocks.";
+    return false;
+  }
+
+  const uint64_t end_block =
+      first_block + std::min(num_blocks, total_blocks - first_block);
+  for (uint64_t block_offset = first_block; block_offset < end_block;
        block_offset += chunk_blocks) {
     // Split the old/new file in the same chunks. Note that this could drop
     // some information from the old file used for the new chunk. If the old
     // file is smaller (or even empty when there's no old file) the chunk will
     // also be empty.
+    const uint64_t old_offset =
+        block_offset - std::min(block_offset, old_margin_blocks);
     vector<Extent> old_extents_chunk =
-        ExtentsSublist(old_extents, block_offset, chunk_blocks);
+        ExtentsSublist(old_extents,
+                       old_offset,
+                       block_offset - old_offset + chunk_blocks +
+                           old_margin_blocks);
     vector<Extent> new_extents_chunk =
         ExtentsSublist(new_extents, block_offset, chunk_blocks);
     NormalizeExtents(&old_extents_chunk);
@@ -926,8 +1386,7 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return false;
 
   if (version.OperationAllowed(InstallOperation::ZERO) &&
-      std::all_of(
-          new_data.begin(), new_data.end(), [](uint8_t x) { return x == 0; })) {
+      utils::IsAllZeros(new_data.data(), new_data.size())) {
     // The read buffer is all zeros, so produce a ZERO operation. No need to
     // check other types of operations in this case.
     *out_blob = brillo::Blob();
@@ -937,8 +1396,40 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
 
   bool out_blob_set = false;
 
+  // zstd decompresses several times faster than xz and bzip2 on the client,
+  // which is worth more than the few percent of size they would save, so
+  // they aren't tried when it's allowed.
+  if (version.OperationAllowed(InstallOperation::REPLACE_ZSTD)) {
+    brillo::Blob new_data_zstd;
+    if (ZstdCompress(new_data, &new_data_zstd) && !new_data_zstd.empty()) {
+      *out_type = InstallOperation::REPLACE_ZSTD;
+      *out_blob = std::move(new_data_zstd);
+      out_blob_set = true;
+    }
+  }
+
+  // Large operations compress with bzip2 on another thread while xz runs, so
+  // that a single one doesn't take twice as long as its slowest compressor.
+  // XzCompress() splits them in blocks compressed on threads of their own too.
+  // The chunks of the default size are already compressed in parallel with
+  // each other.
+  const bool try_bz = !out_blob_set &&
+                      version.OperationAllowed(InstallOperation::REPLACE_BZ);
+  const bool try_xz = !out_blob_set &&
+                      version.OperationAllowed(InstallOperation::REPLACE_XZ);
+  brillo::Blob new_data_bz;
+  bool bz_success = false;
+  std::thread bz_thread;
+  if (try_bz && new_data.size() >= kMinParallelCompressionSize && try_xz) {
+    bz_thread = std::thread([&new_data, &new_data_bz, &bz_success] {
+      bz_success = BzipCompress(new_data, &new_data_bz);
+    });
+  } else if (try_bz) {
+    bz_success = BzipCompress(new_data, &new_data_bz);
+  }
+
   // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
+  if (try_xz) {
     brillo::Blob new_data_xz;
     if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
       *out_type = InstallOperation::REPLACE_XZ;
@@ -946,13 +1437,14 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
       out_blob_set = true;
     }
   }
+  if (bz_thread.joinable())
+    bz_thread.join();
 
   // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
-    brillo::Blob new_data_bz;
+  if (try_bz) {
     // TODO(deymo): Implement some heuristic to determine if it is worth trying
     // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
-    if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
+    if (bz_success && !new_data_bz.empty() &&
         (!out_blob_set || out_blob->size() > new_data_bz.size())) {
       // A REPLACE_BZ is better or nothing else was set.
       *out_type = InstallOperation::REPLACE_BZ;
@@ -1038,6 +1530,154 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
   return true;
 }
 
+size_t AddSimilarXorOps(AnnotatedOperation* aop,
+                        const brillo::Blob& old_data,
+                        const brillo::Blob& new_data) {
+  const auto& src_extents = aop->op.src_extents();
+  const auto& dst_extents = aop->op.dst_extents();
+  const size_t num_old_blocks = std::min<size_t>(
+      old_data.size() / kBlockSize, utils::BlocksInExtents(src_extents));
+  const size_t num_new_blocks = std::min<size_t>(
+      new_data.size() / kBlockSize, utils::BlocksInExtents(dst_extents));
+  if (num_old_blocks == 0 || num_new_blocks == 0)
+    return 0;
+  const size_t old_size = num_old_blocks * kBlockSize;
+
+  ExtentRanges xor_dst_blocks;
+  for (const auto& op : aop->xor_ops)
+    xor_dst_blocks.AddExtent(op.dst_extent());
+
+  // Polynomial hash of a window, rolled over the old data one byte at a time.
+  constexpr uint64_t kHashBase = 0x100000001b3ULL;
+  auto window_hash = [](const uint8_t* data) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < kXorWindowSize; i++)
+      hash = hash * kHashBase + data[i];
+    return hash;
+  };
+  auto filter_bit = [](uint64_t hash) { return hash >> (64 - kXorFilterBits); };
+
+  // The new block and offset in it of each anchor. The windows of a single
+  // byte value, like zeros, are found everywhere and aren't anchors.
+  std::unordered_map<uint64_t, vector<std::pair<size_t, size_t>>> anchors;
+  vector<bool> filter(size_t{1} << kXorFilterBits);
+  vector<bool> searched(num_new_blocks);
+  for (size_t i = 0; i < num_new_blocks; i++) {
+    if (xor_dst_blocks.ContainsBlock(GetNthBlock(dst_extents, i)))
+      continue;
+    searched[i] = true;
+    for (size_t j = 0; j < kXorAnchorsPerBlock; j++) {
+      const size_t offset = j * (kBlockSize / kXorAnchorsPerBlock);
+      const uint8_t* window = new_data.data() + i * kBlockSize + offset;
+      if (std::all_of(window, window + kXorWindowSize, [window](uint8_t c) {
+            return c == window[0];
+          })) {
+        continue;
+      }
+      const uint64_t hash = window_hash(window);
+      anchors[hash].emplace_back(i, offset);
+      filter[filter_bit(hash)] = true;
+    }
+  }
+  if (anchors.empty())
+    return 0;
+
+  // The old positions where an anchor of each new block is.
+  vector<vector<size_t>> candidates(num_new_blocks);
+  uint64_t top_power = 1;
+  for (size_t i = 1; i < kXorWindowSize; i++)
+    top_power *= kHashBase;
+  uint64_t hash = window_hash(old_data.data());
+  for (size_t pos = 0; pos + kXorWindowSize <= old_size; pos++) {
+    if (pos > 0) {
+      hash = (hash - old_data[pos - 1] * top_power) * kHashBase +
+             old_data[pos + kXorWindowSize - 1];
+    }
+    if (!filter[filter_bit(hash)])
+      continue;
+    const auto it = anchors.find(hash);
+    if (it == anchors.end())
+      continue;
+    for (const auto& [block, offset] : it->second) {
+      if (pos < offset || pos - offset + kBlockSize > old_size)
+        continue;
+      auto& block_candidates = candidates[block];
+      const size_t candidate = pos - offset;
+      if (block_candidates.size() < kMaxXorCandidates &&
+          std::find(block_candidates.begin(),
+                    block_candidates.end(),
+                    candidate) == block_candidates.end()) {
+        block_candidates.push_back(candidate);
+      }
+    }
+  }
+
+  // Each new block is XORed with the old position with the most equal bytes,
+  // when the XOR compresses better than the block itself.
+  vector<CowMergeOperation> xor_ops;
+  brillo::Blob xor_block(kBlockSize);
+  brillo::Blob compressed(LZ4_compressBound(kBlockSize));
+  auto compressed_size = [&compressed](const uint8_t* data) {
+    return LZ4_compress_default(reinterpret_cast<const char*>(data),
+                                reinterpret_cast<char*>(compressed.data()),
+                                kBlockSize,
+                                compressed.size());
+  };
+  size_t num_xor_blocks = 0;
+  for (size_t i = 0; i < num_new_blocks; i++) {
+    if (!searched[i] || candidates[i].empty())
+      continue;
+    const uint8_t* new_block = new_data.data() + i * kBlockSize;
+    size_t best_candidate = 0;
+    size_t best_equal_bytes = 0;
+    for (const size_t candidate : candidates[i]) {
+      size_t equal_bytes = 0;
+      for (size_t j = 0; j < kBlockSize; j++)
+        equal_bytes += new_block[j] == old_data[candidate + j];
+      if (equal_bytes > best_equal_bytes) {
+        best_candidate = candidate;
+        best_equal_bytes = equal_bytes;
+      }
+    }
+    if (best_equal_bytes < kBlockSize / 2)
+      continue;
+    // An unaligned source reads the next old block too, which must follow it
+    // in the partition.
+    const size_t src_index = best_candidate / kBlockSize;
+    const size_t src_offset = best_candidate % kBlockSize;
+    const size_t src_block = GetNthBlock(src_extents, src_index);
+    if (src_offset > 0 &&
+        GetNthBlock(src_extents, src_index + 1) != src_block + 1) {
+      continue;
+    }
+    std::copy(new_block, new_block + kBlockSize, xor_block.begin());
+    utils::XorBytes(
+        old_data.data() + best_candidate, kBlockSize, xor_block.data());
+    if (compressed_size(xor_block.data()) >= compressed_size(new_block))
+      continue;
+    AppendXorBlock(
+        &xor_ops, src_block, GetNthBlock(dst_extents, i), src_offset);
+    num_xor_blocks++;
+  }
+
+  for (auto& op : xor_ops) {
+    if (op.src_offset() > 0)
+      op.mutable_src_extent()->set_num_blocks(op.dst_extent().num_blocks() + 1);
+  }
+  aop->xor_ops.insert(aop->xor_ops.end(), xor_ops.begin(), xor_ops.end());
+  std::sort(aop->xor_ops.begin(),
+            aop->xor_ops.end(),
+            [](const CowMergeOperation& a, const CowMergeOperation& b) {
+              return a.dst_extent().start_block() <
+                     b.dst_extent().start_block();
+            });
+  if (num_xor_blocks > 0) {
+    LOG(INFO) << "Added " << num_xor_blocks << " XOR blocks of similar old "
+              << "data to " << aop->name;
+  }
+  return num_xor_blocks;
+}
+
 bool ReadExtentsToDiff(const string& old_part,
                        const string& new_part,
                        const vector<Extent>& src_extents,
@@ -1058,13 +1698,34 @@ bool ReadExtentsToDiff(const string& old_part,
   // All operations have dst_extents.
   StoreExtents(dst_extents, operation.mutable_dst_extents());
 
+  // The images are shared by all the files of the partitions, so the data of
+  // an unchanged file is compared without being read into buffers.
+  std::shared_ptr<const MappedImage> new_image = MappedImage::Get(new_part);
+  std::shared_ptr<const MappedImage> old_image;
+  if (blocks_to_read > 0)
+    old_image = MappedImage::Get(old_part);
+  if (new_image && old_image &&
+      new_image->ExtentsEqual(
+          dst_extents, *old_image, src_extents, kBlockSize)) {
+    // No change in data.
+    operation.set_type(InstallOperation::SOURCE_COPY);
+    StoreExtents(src_extents, operation.mutable_src_extents());
+    out_data->clear();
+    return true;
+  }
+
   // Read in bytes from new data.
   brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           dst_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  if (new_image) {
+    TEST_AND_RETURN_FALSE(
+        new_image->ReadExtents(dst_extents, kBlockSize, &new_data));
+  } else {
+    TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
+                                             dst_extents,
+                                             &new_data,
+                                             kBlockSize * blocks_to_write,
+                                             kBlockSize));
+  }
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
   // Data blob that will be written to delta file.
@@ -1080,11 +1741,16 @@ bool ReadExtentsToDiff(const string& old_part,
   if (blocks_to_read > 0) {
     brillo::Blob old_data;
     // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
+    if (old_image) {
+      TEST_AND_RETURN_FALSE(
+          old_image->ReadExtents(src_extents, kBlockSize, &old_data));
+    } else {
+      TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
+                                               src_extents,
+                                               &old_data,
+                                               kBlockSize * blocks_to_read,
+                                               kBlockSize));
+    }
     if (old_data == new_data) {
       // No change in data.
       operation.set_type(InstallOperation::SOURCE_COPY);
@@ -1135,10 +1801,145 @@ bool ReadExtentsToDiff(const string& old_part,
   return true;
 }
 
+namespace {
+// The replace operations compressed with the zstd dictionary of their
+// partition, the ones of small files which don't compress well on their own.
+constexpr uint64_t kMaxZstdDictionaryOperationSize = 64 * 1024;
+constexpr size_t kZstdDictionarySize = 64 * 1024;
+// Fewer samples than this can't train a useful dictionary.
+constexpr size_t kMinZstdDictionarySamples = 16;
+// Bounds the time spent training the dictionary.
+constexpr uint64_t kMaxZstdDictionarySamplesSize = 16 * 1024 * 1024;
+
+// Compresses the data of a small replace operation with the dictionary.
+class DictionaryCompressionJob : public base::DelegateSimpleThread::Delegate {
+ public:
+  DictionaryCompressionJob(const string& new_part,
+                           const AnnotatedOperation& aop,
+                           const ZstdDictionaryCompressor& compressor,
+                           std::atomic<bool>* failed)
+      : new_part_(new_part),
+        aop_(aop),
+        compressor_(compressor),
+        failed_(failed) {}
+
+  void Run() override {
+    brillo::Blob data;
+    if (!utils::ReadExtents(
+            new_part_, aop_.op.dst_extents(), &data, kBlockSize) ||
+        !compressor_.Compress(data, &blob_)) {
+      LOG(ERROR) << "Failed to compress " << aop_.name
+                 << " with the zstd dictionary.";
+      *failed_ = true;
+    }
+  }
+
+  const AnnotatedOperation& aop() const { return aop_; }
+  const brillo::Blob& blob() const { return blob_; }
+
+ private:
+  const string& new_part_;
+  const AnnotatedOperation& aop_;
+  const ZstdDictionaryCompressor& compressor_;
+  std::atomic<bool>* failed_;
+  brillo::Blob blob_;
+};
+}  // namespace
+
+bool CompressWithZstdDictionary(const string& new_part,
+                                vector<AnnotatedOperation>* aops,
+                                BlobFileWriter* blob_file,
+                                DiffJobQueue* job_queue,
+                                brillo::Blob* dictionary) {
+  dictionary->clear();
+  vector<AnnotatedOperation*> small_aops;
+  uint64_t small_aops_size = 0;
+  for (AnnotatedOperation& aop : *aops) {
+    const uint64_t size =
+        utils::BlocksInExtents(aop.op.dst_extents()) * kBlockSize;
+    if (IsAReplaceOperation(aop.op.type()) &&
+        size <= kMaxZstdDictionaryOperationSize) {
+      small_aops.push_back(&aop);
+      small_aops_size += size;
+    }
+  }
+  if (small_aops.size() < kMinZstdDictionarySamples)
+    return true;
+
+  // Train on operations spread over the whole partition.
+  const size_t stride =
+      (small_aops_size + kMaxZstdDictionarySamplesSize - 1) /
+      kMaxZstdDictionarySamplesSize;
+  vector<brillo::Blob> samples;
+  for (size_t i = 0; i < small_aops.size(); i += stride) {
+    brillo::Blob data;
+    TEST_AND_RETURN_FALSE(utils::ReadExtents(
+        new_part, small_aops[i]->op.dst_extents(), &data, kBlockSize));
+    samples.push_back(std::move(data));
+  }
+  brillo::Blob trained;
+  if (!TrainZstdDictionary(samples, kZstdDictionarySize, &trained))
+    return true;
+  samples.clear();
+
+  const ZstdDictionaryCompressor compressor(trained);
+  std::atomic<bool> failed{false};
+  list<DictionaryCompressionJob> jobs;
+  for (const AnnotatedOperation* aop : small_aops)
+    jobs.emplace_back(new_part, *aop, compressor, &failed);
+  if (job_queue) {
+    vector<DiffJobQueue::Job> queue_jobs;
+    for (auto& job : jobs) {
+      const uint64_t blocks =
+          utils::BlocksInExtents(job.aop().op.dst_extents());
+      queue_jobs.push_back({blocks, &job, 2 * blocks * kBlockSize});
+    }
+    job_queue->RunJobs(queue_jobs);
+  } else {
+    base::DelegateSimpleThreadPool thread_pool("zstd-dictionary",
+                                               GetMaxThreads());
+    thread_pool.Start();
+    for (auto& job : jobs)
+      thread_pool.AddWork(&job);
+    thread_pool.JoinAll();
+  }
+  TEST_AND_RETURN_FALSE(!failed);
+
+  // The dictionary is part of the manifest, it must save more than that.
+  uint64_t saved = 0;
+  size_t num_compressed = 0;
+  for (const auto& job : jobs) {
+    if (job.blob().size() < job.aop().op.data_length()) {
+      saved += job.aop().op.data_length() - job.blob().size();
+      num_compressed++;
+    }
+  }
+  if (saved <= trained.size()) {
+    LOG(INFO) << "The zstd dictionary of " << new_part << " would only save "
+              << saved << " bytes, not using it.";
+    return true;
+  }
+
+  auto aop_it = small_aops.begin();
+  for (const auto& job : jobs) {
+    AnnotatedOperation* aop = *aop_it++;
+    if (job.blob().size() >= aop->op.data_length())
+      continue;
+    aop->op.set_type(InstallOperation::REPLACE_ZSTD);
+    TEST_AND_RETURN_FALSE(aop->SetOperationBlob(job.blob(), blob_file));
+  }
+  LOG(INFO) << "Compressed " << num_compressed << " operations of " << new_part
+            << " with a zstd dictionary of " << trained.size()
+            << " bytes, saving " << saved - trained.size() << " bytes.";
+  *dictionary = std::move(trained);
+  return true;
+}
+
 bool IsAReplaceOperation(InstallOperation::Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 bool IsNoSourceOperation(InstallOperation::Type op_type) {
@@ -1148,11 +1949,8 @@ bool IsNoSourceOperation(InstallOperation::Type op_type) {
 
 bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   info->set_size(part.size);
-  HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
-                        static_cast<off_t>(part.size));
-  TEST_AND_RETURN_FALSE(hasher.Finalize());
-  const brillo::Blob& hash = hasher.raw_hash();
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(GetImageHash(part.path, part.size, &hash));
   info->set_hash(hash.data(), hash.size());
   LOG(INFO) << part.path << ": size=" << part.size
             << " hash=" << HexEncode(hash);
@@ -28,6 +28,7 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/deflate_utils.h"
+#include "update_engine/payload_generator/diff_job_queue.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
@@ -46,14 +47,17 @@ using File = FilesystemInterface::File;
 // and soft chunk limits in number of blocks respectively. The soft chunk limit
 // is used to split MOVE and SOURCE_COPY operations and REPLACE_BZ of zeroed
 // blocks, while the hard limit is used to split a file when generating other
-// operations. A value of -1 in |hard_chunk_blocks| means whole files.
+// operations. A value of -1 in |hard_chunk_blocks| means whole files. The
+// files are diffed on the threads of |job_queue| if not nullptr, and on a
+// thread pool of their own otherwise.
 bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadGenerationConfig& version,
-                        BlobFileWriter* blob_file);
+                        BlobFileWriter* blob_file,
+                        DiffJobQueue* job_queue = nullptr);
 
 // Create operations in |aops| for identical blocks that moved around in the old
 // and new partition and also handle zeroed blocks. The old and new partition
@@ -94,6 +98,24 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const PayloadGenerationConfig& config,
                    BlobFileWriter* blob_file);
 
+// Same as DeltaReadFile(), but only for the chunks in the |num_blocks| blocks
+// of |new_file| starting at block |first_block|, which must be the start of a
+// chunk. The operations are named as if the whole file was read at once, so
+// that the parts of a file can be read independently. Each chunk is diffed
+// against the blocks of |old_file| at the same offset, extended by
+// |old_margin_blocks| on both sides.
+bool DeltaReadFileChunks(std::vector<AnnotatedOperation>* aops,
+                         const std::string& old_part,
+                         const std::string& new_part,
+                         const File& old_file,
+                         const File& new_file,
+                         ssize_t chunk_blocks,
+                         uint64_t first_block,
+                         uint64_t num_blocks,
+                         const PayloadGenerationConfig& config,
+                         BlobFileWriter* blob_file,
+                         uint64_t old_margin_blocks = 0);
+
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
 // this |new_extents| for the diff. It stores necessary data in |out_data| and
@@ -123,6 +145,18 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                brillo::Blob* out_blob,
                                InstallOperation::Type* out_type);
 
+// Trains a zstd dictionary on the data of the small replace operations of
+// |aops|, read from |new_part|, and compresses them with it as REPLACE_ZSTD
+// operations when they get smaller, storing their new blobs in |blob_file|.
+// The dictionary is stored in |dictionary|, which is left empty if it couldn't
+// be trained or doesn't save more than its own size. The operations are
+// compressed on the threads of |job_queue| if not nullptr.
+bool CompressWithZstdDictionary(const std::string& new_part,
+                                std::vector<AnnotatedOperation>* aops,
+                                BlobFileWriter* blob_file,
+                                DiffJobQueue* job_queue,
+                                brillo::Blob* dictionary);
+
 // Returns whether |op_type| is one of the REPLACE full operations.
 bool IsAReplaceOperation(InstallOperation::Type op_type);
 
@@ -160,6 +194,15 @@ inline bool PopulateXorOps(AnnotatedOperation* aop,
   return PopulateXorOps(aop, patch_data.data(), patch_data.size());
 }
 
+// Searches |old_data| for the position most similar to each block of
+// |new_data| that the XOR blocks of |aop| don't cover yet, and adds a COW_XOR
+// with it to |aop| where the XOR compresses better than the block. The data
+// are those of the src and dst extents of |aop|. Returns the number of blocks
+// added.
+size_t AddSimilarXorOps(AnnotatedOperation* aop,
+                        const brillo::Blob& old_data,
+                        const brillo::Blob& new_data);
+
 // A utility class that tries different algorithms and pick the patch with the
 // smallest size.
 
@@ -192,16 +235,19 @@ class BestDiffGenerator {
     vector<puffin::BitExtent> dst_deflates;
     TEST_AND_RETURN(deflate_utils::FindAndCompactDeflates(
         dst_extents_, new_deflates_, &dst_deflates));
-    puffin::RemoveEqualBitExtents(
-        old_data_, new_data_, &src_deflates, &dst_deflates);
     // See crbug.com/915559.
+    // Whether a deflate is kept only depends on its own data, so removing them
+    // before the equal ones gives the same deflates, and the result for the
+    // whole source file can be reused by the payloads of other targets.
     if (config.version.minor <= kPuffdiffMinorPayloadVersion) {
-      CHECK(
-          puffin::RemoveDeflatesWithBadDistanceCaches(old_data, &src_deflates));
+      CHECK(deflate_utils::RemoveDeflatesWithBadDistanceCaches(
+          old_data, &src_deflates, config.diff_cache_dir));
 
-      CHECK(
-          puffin::RemoveDeflatesWithBadDistanceCaches(new_data, &dst_deflates));
+      CHECK(deflate_utils::RemoveDeflatesWithBadDistanceCaches(
+          new_data, &dst_deflates, config.diff_cache_dir));
     }
+    puffin::RemoveEqualBitExtents(
+        old_data_, new_data_, &src_deflates, &dst_deflates);
     old_deflates_ = std::move(src_deflates);
     new_deflates_ = std::move(dst_deflates);
   }
@@ -220,6 +266,9 @@ class BestDiffGenerator {
 
  private:
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
+  // Returns whether |operation_type| may give a diff of the data of |aop|.
+  bool CanDiffWith(InstallOperation_Type operation_type,
+                   const AnnotatedOperation& aop) const;
   bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
                                    AnnotatedOperation* aop,
                                    brillo::Blob* data_blob);
@@ -227,6 +276,13 @@ class BestDiffGenerator {
                                      brillo::Blob* data_blob);
   bool TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
                                      brillo::Blob* data_blob);
+  // Returns the key of the diff cache entry of the operation, which covers
+  // the data diffed and everything that changes the best diff found for it.
+  std::string GetDiffCacheKey(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      const AnnotatedOperation& aop,
+      const brillo::Blob& data_blob) const;
 
   const brillo::Blob& old_data_;
   const brillo::Blob& new_data_;
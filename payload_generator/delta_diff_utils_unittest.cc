@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <algorithm>
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
@@ -30,10 +31,13 @@
 #include "payload_generator/filesystem_interface.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::string;
 using std::vector;
@@ -186,6 +190,134 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationLargeTest) {
+  // Large enough for the compressors to run in parallel, with repeated random
+  // runs that both compress.
+  brillo::Blob data;
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  while (data.size() < 8 * 1024 * 1024) {
+    const uint8_t value = dis(gen);
+    data.insert(data.end(), dis(gen) % 16 + 1, value);
+  }
+
+  brillo::Blob xz_blob;
+  brillo::Blob bz_blob;
+  ASSERT_TRUE(XzCompress(data, &xz_blob));
+  ASSERT_TRUE(BzipCompress(data, &bz_blob));
+
+  brillo::Blob out_blob;
+  InstallOperation::Type out_type{};
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kSourceMinorPayloadVersion),
+      &out_blob,
+      &out_type));
+  // The result is the same as trying the compressors one after the other.
+  if (bz_blob.size() < xz_blob.size()) {
+    EXPECT_EQ(InstallOperation::REPLACE_BZ, out_type);
+    EXPECT_EQ(bz_blob, out_blob);
+  } else {
+    EXPECT_EQ(InstallOperation::REPLACE_XZ, out_type);
+    EXPECT_EQ(xz_blob, out_blob);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationZstdTest) {
+  brillo::Blob data(kBlockSize * 4);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i % 13 + i / kBlockSize;
+
+  brillo::Blob zstd_blob;
+  ASSERT_TRUE(ZstdCompress(data, &zstd_blob));
+
+  brillo::Blob out_blob;
+  InstallOperation::Type out_type{};
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kZstdMinorPayloadVersion),
+      &out_blob,
+      &out_type));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, out_type);
+  EXPECT_EQ(zstd_blob, out_blob);
+
+  // Full payloads can't tell whether the client supports REPLACE_ZSTD.
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion),
+      &out_blob,
+      &out_type));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, out_type);
+}
+
+TEST_F(DeltaDiffUtilsTest, CompressWithZstdDictionaryTest) {
+  // Small files that share most of their content, one per block.
+  vector<brillo::Blob> files;
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  for (uint64_t block = 0; block < 64; block++) {
+    string text;
+    for (int line = 0; text.size() < kBlockSize; line++) {
+      text += base::StringPrintf("ro.vendor.property%d=value%" PRIu64 "\n",
+                                 line,
+                                 (block * 31 + line * 7) % 97);
+    }
+    text.resize(kBlockSize);
+    brillo::Blob data(text.begin(), text.end());
+    ASSERT_TRUE(WriteExtents(
+        new_part_.path, {ExtentForRange(block, 1)}, kBlockSize, data));
+
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::REPLACE);
+    *aop.op.add_dst_extents() = ExtentForRange(block, 1);
+    ASSERT_TRUE(aop.SetOperationBlob(data, &blob_file));
+    aops_.push_back(aop);
+    files.push_back(std::move(data));
+  }
+
+  brillo::Blob dictionary;
+  ASSERT_TRUE(diff_utils::CompressWithZstdDictionary(
+      new_part_.path, &aops_, &blob_file, nullptr, &dictionary));
+  ASSERT_FALSE(dictionary.empty());
+
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                           ZSTD_freeDCtx);
+  for (size_t i = 0; i < aops_.size(); i++) {
+    const InstallOperation& op = aops_[i].op;
+    ASSERT_EQ(InstallOperation::REPLACE_ZSTD, op.type());
+    EXPECT_LT(op.data_length(), kBlockSize);
+    brillo::Blob blob;
+    ASSERT_TRUE(utils::ReadFileChunk(
+        tmp_blob_file_.path(), op.data_offset(), op.data_length(), &blob));
+    brillo::Blob decompressed(kBlockSize);
+    const size_t size = ZSTD_decompress_usingDict(dctx.get(),
+                                                  decompressed.data(),
+                                                  decompressed.size(),
+                                                  blob.data(),
+                                                  blob.size(),
+                                                  dictionary.data(),
+                                                  dictionary.size());
+    ASSERT_EQ(kBlockSize, size);
+    EXPECT_EQ(files[i], decompressed);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, CompressWithZstdDictionaryFewOperationsTest) {
+  // Too few operations to train a dictionary on.
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  brillo::Blob data(kBlockSize, 'a');
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  *aop.op.add_dst_extents() = ExtentForRange(0, 1);
+  ASSERT_TRUE(aop.SetOperationBlob(data, &blob_file));
+  aops_.push_back(aop);
+
+  brillo::Blob dictionary;
+  ASSERT_TRUE(diff_utils::CompressWithZstdDictionary(
+      new_part_.path, &aops_, &blob_file, nullptr, &dictionary));
+  EXPECT_TRUE(dictionary.empty());
+  EXPECT_EQ(InstallOperation::REPLACE, aops_[0].op.type());
+}
+
 TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
   // The old file is on a different block than the new one.
   vector<Extent> old_extents = {ExtentForRange(1, 1)};
@@ -448,10 +580,11 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   brillo::Blob data;
   AnnotatedOperation aop;
 
+  // The last version that compresses the REPLACE operations with bzip2.
   const FilesystemInterface::File empty;
   PayloadGenerationConfig config{
       .version = PayloadVersion(kMaxSupportedMajorPayloadVersion,
-                                kMaxSupportedMinorPayloadVersion)};
+                                kSharedDataBlobMinorPayloadVersion)};
   ASSERT_TRUE(diff_utils::ReadExtentsToDiff(old_part_.path,
                                             new_part_.path,
                                             extents,
@@ -467,6 +600,116 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   ASSERT_EQ(InstallOperation::REPLACE_BZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, DeltaReadFileChunksTest) {
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 1));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 2));
+  FilesystemInterface::File old_file;
+  old_file.extents = {ExtentForRange(10, 10)};
+  FilesystemInterface::File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(30, 4), ExtentForRange(50, 6)};
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion)};
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+
+  vector<AnnotatedOperation> whole_aops;
+  ASSERT_TRUE(diff_utils::DeltaReadFile(&whole_aops,
+                                        old_part_.path,
+                                        new_part_.path,
+                                        old_file,
+                                        new_file,
+                                        3,  // chunk_blocks
+                                        config,
+                                        &blob_file));
+  ASSERT_EQ(4u, whole_aops.size());
+
+  // The file read in two parts gives the same operations.
+  vector<AnnotatedOperation> aops;
+  for (uint64_t first_block : {0, 6}) {
+    ASSERT_TRUE(diff_utils::DeltaReadFileChunks(&aops,
+                                                old_part_.path,
+                                                new_part_.path,
+                                                old_file,
+                                                new_file,
+                                                3,  // chunk_blocks
+                                                first_block,
+                                                6,  // num_blocks
+                                                config,
+                                                &blob_file));
+  }
+  ASSERT_EQ(whole_aops.size(), aops.size());
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(whole_aops[i].name, aops[i].name);
+    EXPECT_EQ(whole_aops[i].op.type(), aops[i].op.type());
+    EXPECT_EQ(whole_aops[i].op.src_extents().size(),
+              aops[i].op.src_extents().size());
+    EXPECT_EQ(ExtentsToString(whole_aops[i].op.dst_extents()),
+              ExtentsToString(aops[i].op.dst_extents()));
+  }
+  EXPECT_EQ("file:3", aops.back().name);
+
+  // The parts must start with a chunk.
+  EXPECT_FALSE(diff_utils::DeltaReadFileChunks(&aops,
+                                               old_part_.path,
+                                               new_part_.path,
+                                               old_file,
+                                               new_file,
+                                               3,  // chunk_blocks
+                                               4,  // first_block
+                                               3,  // num_blocks
+                                               config,
+                                               &blob_file));
+}
+
+TEST_F(DeltaDiffUtilsTest, DeltaReadFileChunksOldMarginTest) {
+  // Random data, so that the chunks are diffed against the same data in the
+  // old partition.
+  brillo::Blob data(old_part_.size);
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  for (auto& byte : data)
+    byte = dis(gen);
+  ASSERT_TRUE(test_utils::WriteFileVector(old_part_.path, data));
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, data));
+  FilesystemInterface::File old_file;
+  old_file.extents = {ExtentForRange(10, 10)};
+  FilesystemInterface::File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(10, 4), ExtentForRange(40, 6)};
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion)};
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+
+  vector<AnnotatedOperation> aops;
+  ASSERT_TRUE(diff_utils::DeltaReadFileChunks(&aops,
+                                              old_part_.path,
+                                              new_part_.path,
+                                              old_file,
+                                              new_file,
+                                              3,  // chunk_blocks
+                                              0,  // first_block
+                                              9,  // num_blocks
+                                              config,
+                                              &blob_file,
+                                              2));  // old_margin_blocks
+  ASSERT_EQ(3u, aops.size());
+  // Each chunk is diffed against the old blocks around it, within the old
+  // file.
+  EXPECT_EQ(ExtentsToString({ExtentForRange(10, 5)}),
+            ExtentsToString(aops[0].op.src_extents()));
+  EXPECT_EQ(ExtentsToString({ExtentForRange(11, 7)}),
+            ExtentsToString(aops[1].op.src_extents()));
+  EXPECT_EQ(ExtentsToString({ExtentForRange(14, 6)}),
+            ExtentsToString(aops[2].op.src_extents()));
+  // The same dst chunks as without margin.
+  EXPECT_EQ(ExtentsToString({ExtentForRange(10, 3)}),
+            ExtentsToString(aops[0].op.dst_extents()));
+  EXPECT_EQ(ExtentsToString({ExtentForRange(13, 1), ExtentForRange(40, 2)}),
+            ExtentsToString(aops[1].op.dst_extents()));
+}
+
 // Test the simple case where all the blocks are different and no new blocks are
 // zeroed.
 TEST_F(DeltaDiffUtilsTest, NoZeroedOrUniqueBlocksDetected) {
@@ -845,4 +1088,50 @@ TEST_F(DeltaDiffUtilsTest, XorOpsStrided) {
   ASSERT_EQ(aop.xor_ops[3].dst_extent().start_block(), 702UL);
 }
 
+TEST_F(DeltaDiffUtilsTest, AddSimilarXorOpsTest) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<uint16_t> dis(0, 255);
+  brillo::Blob old_data(4 * kBlockSize);
+  for (auto& byte : old_data)
+    byte = dis(gen);
+  brillo::Blob new_data(5 * kBlockSize);
+  for (auto& byte : new_data)
+    byte = dis(gen);
+  auto copy_old = [&](size_t old_offset, size_t new_block) {
+    std::copy(old_data.begin() + old_offset,
+              old_data.begin() + old_offset + kBlockSize,
+              new_data.begin() + new_block * kBlockSize);
+  };
+  // Would read two old blocks that aren't next to each other.
+  copy_old(kBlockSize + 904, 0);
+  // Unaligned and aligned old data, a few bytes changed.
+  copy_old(1000, 1);
+  std::fill_n(new_data.begin() + kBlockSize + 10, 10, 0);
+  copy_old(3 * kBlockSize, 2);
+  std::fill_n(new_data.begin() + 2 * kBlockSize + 100, 100, 0);
+  // Block 3 stays random, block 4 is XORed already.
+  copy_old(2 * kBlockSize, 4);
+
+  AnnotatedOperation aop;
+  *aop.op.add_src_extents() = ExtentForRange(10, 2);
+  *aop.op.add_src_extents() = ExtentForRange(20, 2);
+  *aop.op.add_dst_extents() = ExtentForRange(100, 5);
+  CowMergeOperation& xor_op = aop.xor_ops.emplace_back();
+  xor_op.set_type(CowMergeOperation::COW_XOR);
+  *xor_op.mutable_src_extent() = ExtentForRange(20, 1);
+  *xor_op.mutable_dst_extent() = ExtentForRange(104, 1);
+
+  EXPECT_EQ(2u, diff_utils::AddSimilarXorOps(&aop, old_data, new_data));
+  ASSERT_EQ(3u, aop.xor_ops.size());
+  EXPECT_EQ(ExtentForRange(10, 2), aop.xor_ops[0].src_extent());
+  EXPECT_EQ(ExtentForRange(101, 1), aop.xor_ops[0].dst_extent());
+  EXPECT_EQ(1000u, aop.xor_ops[0].src_offset());
+  EXPECT_EQ(ExtentForRange(21, 1), aop.xor_ops[1].src_extent());
+  EXPECT_EQ(ExtentForRange(102, 1), aop.xor_ops[1].dst_extent());
+  EXPECT_EQ(0u, aop.xor_ops[1].src_offset());
+  EXPECT_EQ(ExtentForRange(104, 1), aop.xor_ops[2].dst_extent());
+  for (const auto& op : aop.xor_ops)
+    EXPECT_EQ(CowMergeOperation::COW_XOR, op.type());
+}
+
 }  // namespace chromeos_update_engine
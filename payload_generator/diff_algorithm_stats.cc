@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_algorithm_stats.h"
+
+#include <base/logging.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+string DiffAlgorithmStats::GetFileType(const string& name) {
+  const string base_name = name.substr(name.find_last_of('/') + 1);
+  if (base::StartsWith(base_name, "<", base::CompareCase::SENSITIVE))
+    return base_name;
+  const size_t pos = base_name.find_last_of('.');
+  if (pos == string::npos)
+    return "";
+  return base::ToLowerASCII(base_name.substr(pos));
+}
+
+bool DiffAlgorithmStats::ShouldTry(const string& name,
+                                   InstallOperation::Type type) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = results_.find({GetFileType(name), type});
+  return it == results_.end() || it->second.wins > 0 ||
+         it->second.losses < max_losses_;
+}
+
+void DiffAlgorithmStats::AddResult(const string& name,
+                                   InstallOperation::Type type,
+                                   bool won) {
+  const string file_type = GetFileType(name);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Results& results = results_[{file_type, type}];
+  if (won) {
+    results.wins++;
+    return;
+  }
+  if (++results.losses == max_losses_ && results.wins == 0) {
+    LOG(INFO) << "Not trying " << InstallOperationTypeName(type)
+              << " on the \"" << file_type << "\" files anymore, it lost on "
+              << "the last " << max_losses_ << " of them.";
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_ALGORITHM_STATS_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_ALGORITHM_STATS_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// DiffAlgorithmStats counts which diff algorithm produced the smallest
+// operation for each file type, so that the algorithms that never win on a
+// file type stop being tried on it. File types are the file extensions, or
+// the whole name of the pseudo files like "<kernel>". Thread safe.
+class DiffAlgorithmStats {
+ public:
+  // An algorithm is skipped for a file type once it was tried |max_losses|
+  // times on it without winning.
+  explicit DiffAlgorithmStats(size_t max_losses) : max_losses_(max_losses) {}
+
+  // Returns whether diffing the file |name| with |type| may still win.
+  bool ShouldTry(const std::string& name, InstallOperation::Type type) const;
+
+  // Records whether diffing the file |name| with |type| gave the smallest
+  // operation.
+  void AddResult(const std::string& name,
+                 InstallOperation::Type type,
+                 bool won);
+
+  // Returns the file type of the file |name|.
+  static std::string GetFileType(const std::string& name);
+
+ private:
+  struct Results {
+    size_t wins{0};
+    size_t losses{0};
+  };
+
+  const size_t max_losses_;
+
+  mutable std::mutex mutex_;
+  std::map<std::pair<std::string, InstallOperation::Type>, Results> results_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffAlgorithmStats);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_ALGORITHM_STATS_H_
@@ -0,0 +1,50 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_algorithm_stats.h"
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(DiffAlgorithmStatsTest, GetFileTypeTest) {
+  EXPECT_EQ(".apk", DiffAlgorithmStats::GetFileType("/app/Foo/Foo.APK"));
+  EXPECT_EQ(".so", DiffAlgorithmStats::GetFileType("lib.x.so"));
+  EXPECT_EQ("", DiffAlgorithmStats::GetFileType("/bin/sh"));
+  EXPECT_EQ("", DiffAlgorithmStats::GetFileType("/a.b/sh"));
+  EXPECT_EQ("<kernel>", DiffAlgorithmStats::GetFileType("<kernel>"));
+}
+
+TEST(DiffAlgorithmStatsTest, SkipsLosingAlgorithmsTest) {
+  DiffAlgorithmStats stats(2);
+  EXPECT_TRUE(stats.ShouldTry("/a.png", InstallOperation::PUFFDIFF));
+  stats.AddResult("/a.png", InstallOperation::PUFFDIFF, false);
+  EXPECT_TRUE(stats.ShouldTry("/b.png", InstallOperation::PUFFDIFF));
+  stats.AddResult("/b.png", InstallOperation::PUFFDIFF, false);
+  EXPECT_FALSE(stats.ShouldTry("/c.png", InstallOperation::PUFFDIFF));
+
+  // Other algorithms and file types are still tried.
+  EXPECT_TRUE(stats.ShouldTry("/c.png", InstallOperation::BROTLI_BSDIFF));
+  EXPECT_TRUE(stats.ShouldTry("/c.apk", InstallOperation::PUFFDIFF));
+
+  // An algorithm that won once keeps being tried.
+  stats.AddResult("/a.apk", InstallOperation::ZUCCHINI, true);
+  stats.AddResult("/b.apk", InstallOperation::ZUCCHINI, false);
+  stats.AddResult("/c.apk", InstallOperation::ZUCCHINI, false);
+  EXPECT_TRUE(stats.ShouldTry("/d.apk", InstallOperation::ZUCCHINI));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_budget.h"
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+uint64_t DiffBudget::EstimateMemory(InstallOperation::Type type,
+                                    uint64_t old_size,
+                                    uint64_t new_size) {
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      // Both files and the patch, and a suffix array of 8 bytes per old byte.
+      return old_size * 9 + new_size * 2;
+    case InstallOperation::PUFFDIFF:
+      // Bsdiff of the puffed files, which are about twice as large.
+      return EstimateMemory(InstallOperation::BROTLI_BSDIFF,
+                            old_size * 2,
+                            new_size * 2) +
+             old_size + new_size;
+    case InstallOperation::ZUCCHINI:
+      // The suffix array and the references found in the old file.
+      return old_size * 12 + new_size * 4;
+    default:
+      return old_size + new_size;
+  }
+}
+
+bool DiffBudget::ShouldTry(const string& name,
+                           InstallOperation::Type type,
+                           uint64_t old_size,
+                           uint64_t new_size,
+                           base::TimeDelta elapsed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (memory_budget_ > 0) {
+    const uint64_t memory = EstimateMemory(type, old_size, new_size);
+    if (memory > memory_budget_) {
+      LOG(INFO) << InstallOperationTypeName(type) << " skipped on " << name
+                << ", it would use about " << memory << " bytes of memory";
+      skipped_[type].memory++;
+      return false;
+    }
+  }
+  if (time_budget_.is_zero())
+    return true;
+  base::TimeDelta predicted;
+  const auto it = throughputs_.find(type);
+  if (it != throughputs_.end() && it->second.bytes > 0)
+    predicted = it->second.time * (static_cast<double>(new_size) /
+                                   it->second.bytes);
+  if (elapsed >= time_budget_ || elapsed + predicted > time_budget_) {
+    LOG(INFO) << InstallOperationTypeName(type) << " skipped on " << name
+              << " after " << elapsed.InSecondsF() << " s of diffing, it "
+              << "would take about " << predicted.InSecondsF() << " s more";
+    skipped_[type].time++;
+    return false;
+  }
+  return true;
+}
+
+void DiffBudget::AddResult(InstallOperation::Type type,
+                           uint64_t new_size,
+                           base::TimeDelta duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Throughput& throughput = throughputs_[type];
+  throughput.bytes += new_size;
+  throughput.time += duration;
+}
+
+void DiffBudget::LogSummary() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [type, skipped] : skipped_) {
+    LOG(INFO) << InstallOperationTypeName(type) << " skipped " << skipped.time
+              << " times over the time budget and " << skipped.memory
+              << " times over the memory budget.";
+  }
+}
+
+}  // namespace chromeos_update_engine
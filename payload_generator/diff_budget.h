@@ -0,0 +1,88 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_BUDGET_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_BUDGET_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// DiffBudget bounds the time spent diffing each file, or chunk of a file, and
+// the memory of each diff algorithm tried on it. The diff algorithms can't be
+// interrupted, so an algorithm isn't started when its estimated memory is over
+// the budget, or when the time it would take, predicted from its throughput on
+// the files diffed so far, doesn't fit in what is left of the time budget of
+// the file. The smallest operation found until then is used. Thread safe.
+class DiffBudget {
+ public:
+  // A zero |time_budget| or |memory_budget| is unlimited.
+  DiffBudget(base::TimeDelta time_budget, uint64_t memory_budget)
+      : time_budget_(time_budget), memory_budget_(memory_budget) {}
+
+  // Returns whether diffing the file |name| of |old_size| bytes against
+  // |new_size| bytes with |type| fits in the budget, when the file has been
+  // diffed for |elapsed| already. Logs why not otherwise.
+  bool ShouldTry(const std::string& name,
+                 InstallOperation::Type type,
+                 uint64_t old_size,
+                 uint64_t new_size,
+                 base::TimeDelta elapsed);
+
+  // Records that diffing |new_size| bytes with |type| took |duration|.
+  void AddResult(InstallOperation::Type type,
+                 uint64_t new_size,
+                 base::TimeDelta duration);
+
+  // Logs how many times each algorithm was skipped.
+  void LogSummary() const;
+
+  // Rough peak memory of diffing |old_size| bytes against |new_size| bytes
+  // with |type|.
+  static uint64_t EstimateMemory(InstallOperation::Type type,
+                                 uint64_t old_size,
+                                 uint64_t new_size);
+
+ private:
+  struct Throughput {
+    uint64_t bytes{0};
+    base::TimeDelta time;
+  };
+  struct Skipped {
+    size_t time{0};
+    size_t memory{0};
+  };
+
+  const base::TimeDelta time_budget_;
+  const uint64_t memory_budget_;
+
+  mutable std::mutex mutex_;
+  std::map<InstallOperation::Type, Throughput> throughputs_;
+  std::map<InstallOperation::Type, Skipped> skipped_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffBudget);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_BUDGET_H_
@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_budget.h"
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+TEST(DiffBudgetTest, MemoryBudgetTest) {
+  DiffBudget budget(TimeDelta(), 1000);
+  EXPECT_EQ(900u + 200u,
+            DiffBudget::EstimateMemory(
+                InstallOperation::BROTLI_BSDIFF, 100, 100));
+  EXPECT_TRUE(budget.ShouldTry(
+      "/a", InstallOperation::BROTLI_BSDIFF, 50, 100, TimeDelta()));
+  EXPECT_FALSE(budget.ShouldTry(
+      "/a", InstallOperation::BROTLI_BSDIFF, 100, 100, TimeDelta()));
+  // Puffdiff diffs the larger puffed files.
+  EXPECT_FALSE(budget.ShouldTry(
+      "/a.apk", InstallOperation::PUFFDIFF, 50, 100, TimeDelta()));
+}
+
+TEST(DiffBudgetTest, TimeBudgetTest) {
+  DiffBudget budget(TimeDelta::FromSeconds(10), 0);
+  // Nothing is known of the algorithm yet.
+  EXPECT_TRUE(budget.ShouldTry(
+      "/a", InstallOperation::PUFFDIFF, 100, 100, TimeDelta()));
+  EXPECT_FALSE(budget.ShouldTry("/a",
+                                InstallOperation::PUFFDIFF,
+                                100,
+                                100,
+                                TimeDelta::FromSeconds(10)));
+
+  // Diffs 100 bytes per second.
+  budget.AddResult(
+      InstallOperation::PUFFDIFF, 1000, TimeDelta::FromSeconds(10));
+  EXPECT_TRUE(budget.ShouldTry("/b",
+                               InstallOperation::PUFFDIFF,
+                               500,
+                               500,
+                               TimeDelta::FromSeconds(4)));
+  EXPECT_FALSE(budget.ShouldTry("/b",
+                                InstallOperation::PUFFDIFF,
+                                500,
+                                500,
+                                TimeDelta::FromSeconds(6)));
+  EXPECT_FALSE(budget.ShouldTry(
+      "/c", InstallOperation::PUFFDIFF, 2000, 2000, TimeDelta()));
+  // The other algorithms have throughputs of their own.
+  EXPECT_TRUE(budget.ShouldTry(
+      "/c", InstallOperation::ZUCCHINI, 2000, 2000, TimeDelta()));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Each entry is the operation type followed by the operation data.
+struct EntryHeader {
+  uint32_t type;
+};
+}  // namespace
+
+string DiffCache::Key(const brillo::Blob& raw_hash) {
+  return HexEncode(raw_hash);
+}
+
+bool DiffCache::Lookup(const string& key,
+                       InstallOperation::Type* type,
+                       brillo::Blob* data) const {
+  brillo::Blob entry;
+  if (!LookupData(key, &entry))
+    return false;
+  EntryHeader header;
+  TEST_AND_RETURN_FALSE(entry.size() >= sizeof(header));
+  memcpy(&header, entry.data(), sizeof(header));
+  TEST_AND_RETURN_FALSE(InstallOperation::Type_IsValid(header.type));
+  *type = static_cast<InstallOperation::Type>(header.type);
+  data->assign(entry.begin() + sizeof(header), entry.end());
+  return true;
+}
+
+bool DiffCache::Store(const string& key,
+                      InstallOperation::Type type,
+                      const brillo::Blob& data) const {
+  const EntryHeader header{static_cast<uint32_t>(type)};
+  brillo::Blob entry(sizeof(header));
+  memcpy(entry.data(), &header, sizeof(header));
+  entry.insert(entry.end(), data.begin(), data.end());
+  return StoreData(key, entry);
+}
+
+bool DiffCache::LookupData(const string& key, brillo::Blob* data) const {
+  return utils::ReadFile(base::FilePath(dir_).Append(key).value(), data);
+}
+
+bool DiffCache::StoreData(const string& key, const brillo::Blob& data) const {
+  const base::FilePath dir(dir_);
+  TEST_AND_RETURN_FALSE(base::CreateDirectory(dir));
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(base::CreateTemporaryFileInDir(dir, &temp_path));
+  ScopedPathUnlinker unlinker(temp_path.value());
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(temp_path.value().c_str(), data.data(), data.size()));
+  // Readers see either no entry or the complete one.
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(temp_path.value().c_str(), dir.Append(key).value().c_str()) == 0);
+  unlinker.set_should_remove(false);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
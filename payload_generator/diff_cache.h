@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// DiffCache keeps the result of diffing an operation in a directory, one file
+// per key, so that generating other payloads from the same files doesn't diff
+// them again. Entries are written to a temporary file and renamed, so several
+// threads or processes may share the same directory.
+class DiffCache {
+ public:
+  explicit DiffCache(const std::string& dir) : dir_(dir) {}
+
+  // Returns the key of the cache entry for the hash |raw_hash| of everything
+  // the diff result depends on.
+  static std::string Key(const brillo::Blob& raw_hash);
+
+  // Reads the operation type and data stored for |key|. Returns false if there
+  // is no valid entry for it.
+  bool Lookup(const std::string& key,
+              InstallOperation::Type* type,
+              brillo::Blob* data) const;
+
+  // Stores the operation type |type| and its |data| for |key|.
+  bool Store(const std::string& key,
+             InstallOperation::Type type,
+             const brillo::Blob& data) const;
+
+  // Same as Lookup() and Store(), for entries holding other data than an
+  // operation, with keys of their own.
+  bool LookupData(const std::string& key, brillo::Blob* data) const;
+  bool StoreData(const std::string& key, const brillo::Blob& data) const;
+
+ private:
+  std::string dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(temp_dir_.CreateUniqueTempDir()); }
+
+  base::ScopedTempDir temp_dir_;
+};
+
+TEST_F(DiffCacheTest, StoreLookupTest) {
+  const base::FilePath cache_dir = temp_dir_.GetPath().Append("cache");
+  DiffCache cache(cache_dir.value());
+  const std::string key = DiffCache::Key({0xab, 0x01});
+  EXPECT_EQ("AB01", key);
+
+  InstallOperation::Type type{};
+  brillo::Blob data;
+  EXPECT_FALSE(cache.Lookup(key, &type, &data));
+
+  const brillo::Blob patch = {1, 2, 3};
+  ASSERT_TRUE(cache.Store(key, InstallOperation::PUFFDIFF, patch));
+  EXPECT_TRUE(cache.Lookup(key, &type, &data));
+  EXPECT_EQ(InstallOperation::PUFFDIFF, type);
+  EXPECT_EQ(patch, data);
+
+  // An entry may be replaced, no temporary file is left behind.
+  ASSERT_TRUE(cache.Store(key, InstallOperation::REPLACE_XZ, {}));
+  EXPECT_TRUE(cache.Lookup(key, &type, &data));
+  EXPECT_EQ(InstallOperation::REPLACE_XZ, type);
+  EXPECT_TRUE(data.empty());
+  base::FileEnumerator files(cache_dir, false, base::FileEnumerator::FILES);
+  EXPECT_EQ(cache_dir.Append(key), files.Next());
+  EXPECT_TRUE(files.Next().empty());
+}
+
+TEST_F(DiffCacheTest, StoreLookupDataTest) {
+  DiffCache cache(temp_dir_.GetPath().value());
+  brillo::Blob data;
+  EXPECT_FALSE(cache.LookupData("AA", &data));
+
+  const brillo::Blob stored = {1, 2, 3};
+  ASSERT_TRUE(cache.StoreData("AA", stored));
+  EXPECT_TRUE(cache.LookupData("AA", &data));
+  EXPECT_EQ(stored, data);
+}
+
+TEST_F(DiffCacheTest, InvalidEntryTest) {
+  DiffCache cache(temp_dir_.GetPath().value());
+  ASSERT_TRUE(base::WriteFile(temp_dir_.GetPath().Append("AA"), "x", 1));
+  ASSERT_TRUE(
+      base::WriteFile(temp_dir_.GetPath().Append("BB"), "\xff\xff\xff\x7f", 4));
+
+  InstallOperation::Type type{};
+  brillo::Blob data;
+  EXPECT_FALSE(cache.Lookup("AA", &type, &data));
+  EXPECT_FALSE(cache.Lookup("BB", &type, &data));
+}
+
+}  // namespace chromeos_update_engine
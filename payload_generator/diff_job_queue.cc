@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_job_queue.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "update_engine/payload_generator/numa_nodes.h"
+
+namespace chromeos_update_engine {
+
+DiffJobQueue::DiffJobQueue(size_t num_threads,
+                           uint64_t memory_budget,
+                           std::vector<std::vector<int>> node_cpus)
+    : memory_budget_(memory_budget),
+      node_cpus_(std::move(node_cpus)),
+      thread_pool_("diff-job-queue", num_threads) {
+  thread_pool_.Start();
+}
+
+DiffJobQueue::~DiffJobQueue() {
+  thread_pool_.JoinAll();
+}
+
+void DiffJobQueue::RunJobs(const std::vector<Job>& jobs) {
+  if (jobs.empty())
+    return;
+  Batch batch{jobs.size()};
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (const Job& job : jobs)
+    pending_jobs_.insert({job, num_jobs_added_++, &batch});
+  thread_pool_.AddWork(&runner_, jobs.size());
+  batch.done.wait(lock, [&batch] { return batch.num_pending == 0; });
+}
+
+std::set<DiffJobQueue::PendingJob>::iterator DiffJobQueue::FindJobToRun() {
+  if (!memory_budget_ || !memory_in_use_)
+    return pending_jobs_.begin();
+  if (memory_in_use_ >= memory_budget_)
+    return pending_jobs_.end();
+  return std::find_if(
+      pending_jobs_.begin(), pending_jobs_.end(), [this](const PendingJob& p) {
+        return p.job.memory <= memory_budget_ - memory_in_use_;
+      });
+}
+
+void DiffJobQueue::PlaceCurrentThread() {
+  // The threads of |thread_pool_| only run the jobs of this queue.
+  thread_local bool placed = false;
+  if (node_cpus_.size() < 2 || placed)
+    return;
+  placed = true;
+  // Each thread is placed once, the first ones to run a job take the nodes
+  // in turns.
+  const size_t node = num_threads_placed_++ % node_cpus_.size();
+  PinCurrentThreadToCpus(node_cpus_[node]);
+}
+
+void DiffJobQueue::RunNextJob() {
+  PlaceCurrentThread();
+  std::unique_lock<std::mutex> lock(mutex_);
+  // There are as many runs of |runner_| as jobs added, so there is always a
+  // pending job to run here, maybe once the running ones release memory.
+  auto it = FindJobToRun();
+  while (it == pending_jobs_.end()) {
+    memory_released_.wait(lock);
+    it = FindJobToRun();
+  }
+  const PendingJob pending_job = *it;
+  pending_jobs_.erase(it);
+  memory_in_use_ += pending_job.job.memory;
+  lock.unlock();
+
+  pending_job.job.delegate->Run();
+
+  lock.lock();
+  memory_in_use_ -= pending_job.job.memory;
+  if (memory_budget_)
+    memory_released_.notify_all();
+  if (--pending_job.batch->num_pending == 0)
+    pending_job.batch->done.notify_one();
+}
+
+}  // namespace chromeos_update_engine
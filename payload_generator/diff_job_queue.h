@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_JOB_QUEUE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_JOB_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/threading/simple_thread.h>
+
+namespace chromeos_update_engine {
+
+// DiffJobQueue runs the diff jobs of all the partitions of a payload on one
+// set of threads, so that the threads aren't left idle by the small
+// partitions while a large one is still being diffed. The pending jobs with
+// the largest cost run first, whichever partition they come from.
+// With a memory budget, a job only starts once its estimated memory fits in
+// what the running jobs leave. Jobs larger than the budget run alone.
+// With the CPUs of several NUMA nodes, the threads are spread evenly over the
+// nodes and each one only runs on the CPUs of its node, so that the buffers
+// a job allocates and reads the images into are local to the CPU diffing
+// them.
+class DiffJobQueue {
+ public:
+  struct Job {
+    // Relative cost of the job, for example the number of blocks it diffs.
+    uint64_t cost;
+    base::DelegateSimpleThread::Delegate* delegate;
+    // Estimated peak memory of the job in bytes.
+    uint64_t memory{0};
+  };
+
+  // Runs the jobs on |num_threads| threads, and within |memory_budget| bytes
+  // if not 0. |node_cpus| has the CPUs of each NUMA node to spread the
+  // threads over, nothing to leave them unpinned.
+  explicit DiffJobQueue(size_t num_threads,
+                        uint64_t memory_budget = 0,
+                        std::vector<std::vector<int>> node_cpus = {});
+  ~DiffJobQueue();
+
+  // Runs |jobs| on the threads of the queue and returns once they're all done.
+  // May be called from several threads at once.
+  void RunJobs(const std::vector<Job>& jobs);
+
+ private:
+  // A set of jobs passed to RunJobs().
+  struct Batch {
+    size_t num_pending;
+    std::condition_variable done;
+  };
+
+  struct PendingJob {
+    Job job;
+    // Order of the job in the queue, to run the jobs of the same cost in the
+    // order they were added.
+    uint64_t order;
+    Batch* batch;
+
+    // The jobs to run first are ordered first.
+    bool operator<(const PendingJob& other) const {
+      if (job.cost != other.job.cost)
+        return job.cost > other.job.cost;
+      return order < other.order;
+    }
+  };
+
+  // Added to |thread_pool_| once per job, runs the next pending job.
+  class Runner : public base::DelegateSimpleThread::Delegate {
+   public:
+    explicit Runner(DiffJobQueue* queue) : queue_(queue) {}
+    void Run() override { queue_->RunNextJob(); }
+
+   private:
+    DiffJobQueue* queue_;
+  };
+
+  void RunNextJob();
+
+  // Pins the calling thread of |thread_pool_| to the CPUs of a node the first
+  // time it runs a job.
+  void PlaceCurrentThread();
+
+  // Returns the first pending job that fits in the memory budget, or
+  // |pending_jobs_|.end() if none does.
+  std::set<PendingJob>::iterator FindJobToRun();
+
+  const uint64_t memory_budget_;
+  const std::vector<std::vector<int>> node_cpus_;
+  // The number of threads placed on a node so far.
+  std::atomic<size_t> num_threads_placed_{0};
+
+  std::mutex mutex_;
+  std::set<PendingJob> pending_jobs_;
+  uint64_t num_jobs_added_{0};
+  // Estimated memory of the running jobs.
+  uint64_t memory_in_use_{0};
+  // Signaled when a job finishes and releases its memory.
+  std::condition_variable memory_released_;
+
+  Runner runner_{this};
+  base::DelegateSimpleThreadPool thread_pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffJobQueue);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_JOB_QUEUE_H_
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_job_queue.h"
+
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+class RecordingDelegate : public base::DelegateSimpleThread::Delegate {
+ public:
+  RecordingDelegate(int id, std::mutex* mutex, vector<int>* order)
+      : id_(id), mutex_(mutex), order_(order) {}
+  void Run() override {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    order_->push_back(id_);
+  }
+
+ private:
+  int id_;
+  std::mutex* mutex_;
+  vector<int>* order_;
+};
+
+// Records the peak of the memory used by the jobs running at once.
+class MemoryDelegate : public base::DelegateSimpleThread::Delegate {
+ public:
+  MemoryDelegate(uint64_t memory,
+                 std::atomic<uint64_t>* in_use,
+                 std::atomic<uint64_t>* peak)
+      : memory_(memory), in_use_(in_use), peak_(peak) {}
+  void Run() override {
+    const uint64_t in_use = *in_use_ += memory_;
+    uint64_t peak = *peak_;
+    while (in_use > peak && !peak_->compare_exchange_weak(peak, in_use)) {
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    *in_use_ -= memory_;
+  }
+
+ private:
+  uint64_t memory_;
+  std::atomic<uint64_t>* in_use_;
+  std::atomic<uint64_t>* peak_;
+};
+
+// Records the CPUs the jobs are allowed to run on. The first job waits for
+// a second one to start, so that two threads run jobs.
+class AffinityDelegate : public base::DelegateSimpleThread::Delegate {
+ public:
+  AffinityDelegate(std::mutex* mutex,
+                   std::atomic<int>* num_started,
+                   std::set<vector<int>>* affinities)
+      : mutex_(mutex), num_started_(num_started), affinities_(affinities) {}
+  void Run() override {
+    (*num_started_)++;
+    while (*num_started_ < 2)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    cpu_set_t cpu_set;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpu_set), &cpu_set));
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpu_set))
+        cpus.push_back(cpu);
+    }
+    std::lock_guard<std::mutex> lock(*mutex_);
+    affinities_->insert(cpus);
+  }
+
+ private:
+  std::mutex* mutex_;
+  std::atomic<int>* num_started_;
+  std::set<vector<int>>* affinities_;
+};
+}  // namespace
+
+TEST(DiffJobQueueTest, RunsLargestJobsFirstTest) {
+  DiffJobQueue job_queue(1);
+  std::mutex mutex;
+  vector<int> order;
+  std::list<RecordingDelegate> delegates;
+  vector<DiffJobQueue::Job> jobs;
+  const vector<uint64_t> costs = {3, 10, 1, 10, 5};
+  for (size_t i = 0; i < costs.size(); i++) {
+    delegates.emplace_back(i, &mutex, &order);
+    jobs.push_back({costs[i], &delegates.back()});
+  }
+  job_queue.RunJobs(jobs);
+  // The jobs of the same cost run in the order they were passed.
+  EXPECT_EQ(vector<int>({1, 3, 4, 0, 2}), order);
+
+  job_queue.RunJobs({});
+  EXPECT_EQ(5u, order.size());
+}
+
+TEST(DiffJobQueueTest, ConcurrentBatchesTest) {
+  DiffJobQueue job_queue(4);
+  std::mutex mutex;
+  constexpr int kNumBatches = 8;
+  constexpr int kJobsPerBatch = 50;
+  vector<vector<int>> orders(kNumBatches);
+  std::atomic<int> num_done{0};
+  vector<std::thread> threads;
+  for (int batch = 0; batch < kNumBatches; batch++) {
+    threads.emplace_back([&, batch] {
+      std::list<RecordingDelegate> delegates;
+      vector<DiffJobQueue::Job> jobs;
+      for (int i = 0; i < kJobsPerBatch; i++) {
+        delegates.emplace_back(i, &mutex, &orders[batch]);
+        jobs.push_back({static_cast<uint64_t>(i), &delegates.back()});
+      }
+      job_queue.RunJobs(jobs);
+      // All the jobs of the batch are done when RunJobs() returns.
+      std::lock_guard<std::mutex> lock(mutex);
+      EXPECT_EQ(static_cast<size_t>(kJobsPerBatch), orders[batch].size());
+      num_done++;
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_EQ(kNumBatches, num_done);
+}
+
+TEST(DiffJobQueueTest, MemoryBudgetTest) {
+  DiffJobQueue job_queue(8, 100);
+  std::atomic<uint64_t> in_use{0};
+  std::atomic<uint64_t> peak{0};
+  std::list<MemoryDelegate> delegates;
+  vector<DiffJobQueue::Job> jobs;
+  for (uint64_t i = 0; i < 40; i++) {
+    delegates.emplace_back(30, &in_use, &peak);
+    jobs.push_back({i, &delegates.back(), 30});
+  }
+  job_queue.RunJobs(jobs);
+  // At most three jobs of 30 bytes fit at once.
+  EXPECT_LE(peak, 90u);
+
+  // A job larger than the budget still runs, alone.
+  peak = 0;
+  delegates.clear();
+  jobs.clear();
+  delegates.emplace_back(150, &in_use, &peak);
+  jobs.push_back({1, &delegates.back(), 150});
+  for (uint64_t i = 0; i < 10; i++) {
+    delegates.emplace_back(10, &in_use, &peak);
+    jobs.push_back({0, &delegates.back(), 10});
+  }
+  job_queue.RunJobs(jobs);
+  EXPECT_EQ(150u, peak);
+}
+
+TEST(DiffJobQueueTest, ThreadsPinnedToNodesTest) {
+  cpu_set_t cpu_set;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpu_set), &cpu_set));
+  vector<int> allowed_cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set))
+      allowed_cpus.push_back(cpu);
+  }
+  ASSERT_FALSE(allowed_cpus.empty());
+  // Two nodes of one CPU each, the same one if there's only one.
+  const vector<vector<int>> node_cpus = {{allowed_cpus.front()},
+                                         {allowed_cpus.back()}};
+
+  std::mutex mutex;
+  std::atomic<int> num_started{0};
+  std::set<vector<int>> affinities;
+  {
+    DiffJobQueue job_queue(2, 0, node_cpus);
+    std::list<AffinityDelegate> delegates;
+    vector<DiffJobQueue::Job> jobs;
+    for (uint64_t i = 0; i < 20; i++) {
+      delegates.emplace_back(&mutex, &num_started, &affinities);
+      jobs.push_back({i, &delegates.back()});
+    }
+    job_queue.RunJobs(jobs);
+  }
+  // Each thread took a node of its own.
+  EXPECT_EQ(std::set<vector<int>>(node_cpus.begin(), node_cpus.end()),
+            affinities);
+}
+
+}  // namespace chromeos_update_engine
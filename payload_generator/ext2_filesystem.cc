@@ -37,6 +37,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_list_cache.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::set;
@@ -127,11 +128,12 @@ int UpdateFileAndAppend(ext2_ino_t dir,
 }  // namespace
 
 unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
-    const string& filename) {
+    const string& filename, const string& cache_dir) {
   if (filename.empty())
     return nullptr;
   unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
   result->filename_ = filename;
+  result->cache_dir_ = cache_dir;
 
   errcode_t err = ext2fs_open(filename.c_str(),
                               0,  // flags (read only)
@@ -159,6 +161,25 @@ size_t Ext2Filesystem::GetBlockCount() const {
 }
 
 bool Ext2Filesystem::GetFiles(vector<File>* files) const {
+  if (cache_dir_.empty())
+    return ReadFiles(files);
+  // The image is read once to find its cache entry, which is faster than
+  // walking all its inodes.
+  const FileListCache cache(cache_dir_);
+  string key;
+  TEST_AND_RETURN_FALSE(FileListCache::Key(filename_, "ext2", &key));
+  if (cache.Lookup(key, files)) {
+    LOG(INFO) << "Loaded the " << files->size() << " files of " << filename_
+              << " from the cache.";
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(ReadFiles(files));
+  if (!cache.Store(key, *files))
+    LOG(WARNING) << "Failed to cache the files of " << filename_;
+  return true;
+}
+
+bool Ext2Filesystem::ReadFiles(vector<File>* files) const {
   TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys_));
 
   ext2_inode_scan iscan;
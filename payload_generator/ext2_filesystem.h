@@ -38,9 +38,10 @@ namespace chromeos_update_engine {
 class Ext2Filesystem : public FilesystemInterface {
  public:
   // Creates an Ext2Filesystem from a ext2 formatted filesystem stored in a
-  // file. The file doesn't need to be loop-back mounted.
+  // file. The file doesn't need to be loop-back mounted. With a |cache_dir|,
+  // GetFiles() keeps the files found in a FileListCache there.
   static std::unique_ptr<Ext2Filesystem> CreateFromFile(
-      const std::string& filename);
+      const std::string& filename, const std::string& cache_dir = "");
   virtual ~Ext2Filesystem();
 
   // FilesystemInterface overrides.
@@ -65,12 +66,18 @@ class Ext2Filesystem : public FilesystemInterface {
  private:
   Ext2Filesystem() = default;
 
+  // Walks the inodes of the filesystem to find its files, see GetFiles().
+  bool ReadFiles(std::vector<File>* files) const;
+
   // The ext2 main data structure holding the filesystem.
   ext2_filsys filsys_ = nullptr;
 
   // The file where the filesystem is stored.
   std::string filename_;
 
+  // The directory of the FileListCache, if any.
+  std::string cache_dir_;
+
   DISALLOW_COPY_AND_ASSIGN(Ext2Filesystem);
 };
 
@@ -23,6 +23,8 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -184,6 +186,33 @@ TEST_F(Ext2FilesystemTest, ParseGeneratedImages) {
   }
 }
 
+TEST_F(Ext2FilesystemTest, CachedFilesTest) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  const string image = GetBuildArtifactsPath("gen/disk_ext2_4k.img");
+  unique_ptr<Ext2Filesystem> fs = Ext2Filesystem::CreateFromFile(image);
+  ASSERT_NE(nullptr, fs.get());
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+
+  // The first run stores the files in the cache, the second loads them.
+  for (int i = 0; i < 2; i++) {
+    unique_ptr<Ext2Filesystem> cached_fs =
+        Ext2Filesystem::CreateFromFile(image, cache_dir.GetPath().value());
+    ASSERT_NE(nullptr, cached_fs.get());
+    vector<FilesystemInterface::File> cached_files;
+    EXPECT_TRUE(cached_fs->GetFiles(&cached_files));
+    EXPECT_FALSE(base::IsDirectoryEmpty(cache_dir.GetPath()));
+    ASSERT_EQ(files.size(), cached_files.size());
+    for (size_t j = 0; j < files.size(); j++) {
+      EXPECT_EQ(files[j].name, cached_files[j].name);
+      EXPECT_EQ(files[j].file_stat.st_ino, cached_files[j].file_stat.st_ino);
+      EXPECT_EQ(files[j].file_stat.st_mode, cached_files[j].file_stat.st_mode);
+      EXPECT_EQ(files[j].extents, cached_files[j].extents);
+    }
+  }
+}
+
 TEST_F(Ext2FilesystemTest, LoadSettingsFailsTest) {
   unique_ptr<Ext2Filesystem> fs = Ext2Filesystem::CreateFromFile(
       GetBuildArtifactsPath("gen/disk_ext2_1k.img"));
@@ -0,0 +1,348 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Microbenchmarks of the extent data structures shared by the generator and
+// the consumer, over many small fragmented extents and over large contiguous
+// runs. The Arg of each benchmark is the number of extents. Run with
+// --benchmark_format=json for machine-readable results.
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+
+enum Distribution {
+  // Extents of 1 to 4 blocks separated by gaps of 1 to 8 blocks, like the
+  // files of a fragmented filesystem.
+  kFragmented = 0,
+  // Extents of 1024 to 65536 blocks separated by gaps of 1 to 8 blocks.
+  kContiguous = 1,
+};
+
+// Returns |count| disjoint extents of |distribution|, sorted by start block.
+// They're the same on every run.
+vector<Extent> MakeExtents(Distribution distribution, size_t count) {
+  std::mt19937 gen(count);
+  const uint64_t max_blocks = distribution == kFragmented ? 4 : 65536;
+  const uint64_t min_blocks = distribution == kFragmented ? 1 : 1024;
+  vector<Extent> extents;
+  extents.reserve(count);
+  uint64_t next_block = 0;
+  for (size_t i = 0; i < count; i++) {
+    next_block += 1 + gen() % 8;
+    const uint64_t num_blocks =
+        min_blocks + gen() % (max_blocks - min_blocks + 1);
+    extents.push_back(ExtentForRange(next_block, num_blocks));
+    next_block += num_blocks;
+  }
+  return extents;
+}
+
+// Returns |extents| in a random order.
+vector<Extent> Shuffled(vector<Extent> extents) {
+  std::shuffle(extents.begin(), extents.end(), std::mt19937(extents.size()));
+  return extents;
+}
+
+// Returns |count| extents of 1 to 16 blocks spread over |extents|, to query
+// against them.
+vector<Extent> MakeQueries(const vector<Extent>& extents, size_t count) {
+  std::mt19937 gen(count + 1);
+  const uint64_t last_block =
+      extents.back().start_block() + extents.back().num_blocks();
+  vector<Extent> queries;
+  queries.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    queries.push_back(ExtentForRange(gen() % last_block, 1 + gen() % 16));
+  return queries;
+}
+
+ExtentRanges MakeRanges(const vector<Extent>& extents) {
+  ExtentRanges ranges;
+  ranges.AddExtents(extents);
+  return ranges;
+}
+
+void ExtentArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"distribution", "extents"})
+      ->ArgsProduct({{kFragmented, kContiguous}, {1 << 10, 1 << 14, 1 << 20}});
+}
+
+// ExtentRanges::AddExtent() and SubtractExtent() go through the whole set,
+// so the benchmarks that build an ExtentRanges are run on fewer extents.
+void ExtentRangesArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"distribution", "extents"})
+      ->ArgsProduct({{kFragmented, kContiguous}, {1 << 10, 1 << 12, 1 << 14}});
+}
+
+Distribution GetDistribution(const benchmark::State& state) {
+  return static_cast<Distribution>(state.range(0));
+}
+
+void BM_ExtentRangesAddExtent(benchmark::State& state) {
+  const vector<Extent> extents =
+      Shuffled(MakeExtents(GetDistribution(state), state.range(1)));
+  for (auto _ : state) {
+    ExtentRanges ranges;
+    for (const Extent& extent : extents)
+      ranges.AddExtent(extent);
+    benchmark::DoNotOptimize(ranges.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_ExtentRangesAddExtent)
+    ->Apply(ExtentRangesArgs)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExtentRangesSubtractExtent(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  // The extents are subtracted from one covering them all, in random order,
+  // which splits it as many times.
+  const uint64_t last_block =
+      extents.back().start_block() + extents.back().num_blocks();
+  const vector<Extent> shuffled = Shuffled(extents);
+  for (auto _ : state) {
+    state.PauseTiming();
+    ExtentRanges ranges;
+    ranges.AddExtent(ExtentForRange(0, last_block));
+    state.ResumeTiming();
+    for (const Extent& extent : shuffled)
+      ranges.SubtractExtent(extent);
+    benchmark::DoNotOptimize(ranges.blocks());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_ExtentRangesSubtractExtent)
+    ->Apply(ExtentRangesArgs)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExtentRangesOverlapsWithExtent(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  const ExtentRanges ranges = MakeRanges(extents);
+  const vector<Extent> queries = MakeQueries(extents, 1 << 16);
+  for (auto _ : state) {
+    size_t overlaps = 0;
+    for (const Extent& query : queries)
+      overlaps += ranges.OverlapsWithExtent(query);
+    benchmark::DoNotOptimize(overlaps);
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_ExtentRangesOverlapsWithExtent)
+    ->Apply(ExtentRangesArgs);
+
+void BM_ExtentRangesGetIntersectingExtents(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  const ExtentRanges ranges = MakeRanges(extents);
+  const vector<Extent> queries = MakeQueries(extents, 1 << 16);
+  for (auto _ : state) {
+    size_t intersections = 0;
+    for (const Extent& query : queries)
+      intersections += ranges.GetIntersectingExtents(query).size();
+    benchmark::DoNotOptimize(intersections);
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_ExtentRangesGetIntersectingExtents)
+    ->Apply(ExtentRangesArgs);
+
+void BM_ExtentRangesIterate(benchmark::State& state) {
+  const ExtentRanges ranges =
+      MakeRanges(MakeExtents(GetDistribution(state), state.range(1)));
+  for (auto _ : state) {
+    uint64_t blocks = 0;
+    for (const Extent& extent : ranges.extent_set())
+      blocks += extent.num_blocks();
+    benchmark::DoNotOptimize(blocks);
+  }
+  state.SetItemsProcessed(state.iterations() * ranges.extent_set().size());
+}
+BENCHMARK(BM_ExtentRangesIterate)
+    ->Apply(ExtentRangesArgs);
+
+void BM_FilterExtentRanges(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  // Filters out every other extent, and a piece of the others.
+  vector<Extent> filtered;
+  for (size_t i = 0; i < extents.size(); i++) {
+    if (i % 2 == 0)
+      filtered.push_back(extents[i]);
+    else
+      filtered.push_back(ExtentForRange(extents[i].start_block(), 1));
+  }
+  const ExtentRanges ranges = MakeRanges(filtered);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(FilterExtentRanges(extents, ranges));
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_FilterExtentRanges)
+    ->Apply(ExtentRangesArgs)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExtentsSublist(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  const uint64_t num_blocks = utils::BlocksInExtents(extents);
+  // Sublists of 1/16th of the blocks at random offsets.
+  std::mt19937 gen(extents.size());
+  for (auto _ : state) {
+    const uint64_t offset = gen() % num_blocks;
+    benchmark::DoNotOptimize(
+        ExtentsSublist(extents, offset, num_blocks / 16));
+  }
+}
+BENCHMARK(BM_ExtentsSublist)
+    ->Apply(ExtentArgs);
+
+void BM_NormalizeExtents(benchmark::State& state) {
+  // Runs of touching extents, which merge into one extent each.
+  vector<Extent> extents;
+  for (const Extent& extent :
+       MakeExtents(GetDistribution(state), state.range(1))) {
+    for (uint64_t block = 0; block < extent.num_blocks(); block += 4) {
+      extents.push_back(
+          ExtentForRange(extent.start_block() + block,
+                         std::min<uint64_t>(4, extent.num_blocks() - block)));
+    }
+    if (extents.size() >= static_cast<size_t>(state.range(1)))
+      break;
+  }
+  for (auto _ : state) {
+    state.PauseTiming();
+    vector<Extent> normalized = extents;
+    state.ResumeTiming();
+    NormalizeExtents(&normalized);
+    benchmark::DoNotOptimize(normalized.size());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_NormalizeExtents)
+    ->Apply(ExtentArgs)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExtentMapAddExtents(benchmark::State& state) {
+  const vector<Extent> extents =
+      Shuffled(MakeExtents(GetDistribution(state), state.range(1)));
+  for (auto _ : state) {
+    state.PauseTiming();
+    vector<std::pair<Extent, size_t>> entries;
+    entries.reserve(extents.size());
+    for (size_t i = 0; i < extents.size(); i++)
+      entries.emplace_back(extents[i], i);
+    state.ResumeTiming();
+    ExtentMap<size_t> map;
+    map.AddExtents(std::move(entries));
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+BENCHMARK(BM_ExtentMapAddExtents)
+    ->Apply(ExtentArgs)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ExtentMapGet(benchmark::State& state) {
+  const vector<Extent> extents = MakeExtents(GetDistribution(state),
+                                             state.range(1));
+  vector<std::pair<Extent, size_t>> entries;
+  for (size_t i = 0; i < extents.size(); i++)
+    entries.emplace_back(extents[i], i);
+  ExtentMap<size_t> map;
+  map.AddExtents(std::move(entries));
+  // Single blocks within the extents, as VABCPartitionWriter looks them up.
+  std::mt19937 gen(extents.size());
+  vector<Extent> queries;
+  for (size_t i = 0; i < (1 << 16); i++) {
+    const Extent& extent = extents[gen() % extents.size()];
+    queries.push_back(ExtentForRange(
+        extent.start_block() + gen() % extent.num_blocks(), 1));
+  }
+  for (auto _ : state) {
+    size_t found = 0;
+    for (const Extent& query : queries)
+      found += map.Get(query).has_value();
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_ExtentMapGet)
+    ->Apply(ExtentArgs);
+
+// Args: number of blocks, percentage of them duplicating an earlier block.
+void BM_BlockMappingAddManyDiskBlocks(benchmark::State& state) {
+  const size_t num_blocks = state.range(0);
+  const size_t duplicate_percent = state.range(1);
+  std::mt19937 gen(num_blocks);
+  brillo::Blob data(num_blocks * kBlockSize);
+  for (size_t i = 0; i < num_blocks; i++) {
+    auto block = data.begin() + i * kBlockSize;
+    if (i > 0 && gen() % 100 < duplicate_percent) {
+      const size_t copy = gen() % i;
+      std::copy_n(data.begin() + copy * kBlockSize, kBlockSize, block);
+    } else {
+      std::generate(block, block + kBlockSize, [&gen] { return gen(); });
+    }
+  }
+  ScopedTempFile file("extent_benchmark.XXXXXX", true);
+  if (!utils::WriteAll(file.fd(), data.data(), data.size())) {
+    state.SkipWithError("Unable to write the blocks.");
+    return;
+  }
+  for (auto _ : state) {
+    BlockMapping mapping(kBlockSize);
+    vector<BlockMapping::BlockId> block_ids;
+    if (!mapping.AddManyDiskBlocks(file.fd(), 0, num_blocks, &block_ids)) {
+      state.SkipWithError("Failed to add the blocks.");
+      break;
+    }
+    benchmark::DoNotOptimize(block_ids.back());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BlockMappingAddManyDiskBlocks)
+    ->ArgNames({"blocks", "duplicate_percent"})
+    ->ArgsProduct({{1 << 12, 1 << 16}, {0, 50}})
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
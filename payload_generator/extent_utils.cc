@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -170,6 +171,14 @@ bool operator!=(const Extent& a, const Extent& b) noexcept {
   return !(a == b);
 }
 
+bool IsIdentityCopy(const InstallOperation& operation) {
+  return operation.type() == InstallOperation::SOURCE_COPY &&
+         std::equal(operation.src_extents().begin(),
+                    operation.src_extents().end(),
+                    operation.dst_extents().begin(),
+                    operation.dst_extents().end());
+}
+
 std::ostream& operator<<(std::ostream& out, const Extent& extent) {
   out << "[" << extent.start_block() << " - "
       << extent.start_block() + extent.num_blocks() - 1 << "]";
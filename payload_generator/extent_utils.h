@@ -91,6 +91,10 @@ bool operator==(const Extent& a, const Extent& b) noexcept;
 
 bool operator!=(const Extent& a, const Extent& b) noexcept;
 
+// Returns whether |operation| is a SOURCE_COPY of its blocks to the same
+// place, which the writers of a snapshot of the source have nothing to do for.
+bool IsIdentityCopy(const InstallOperation& operation);
+
 // TODO(zhangkelvin) This is ugly. Rewrite using C++20's coroutine once
 // that's available. Unfortunately with C++17 this is the best I could do.
 
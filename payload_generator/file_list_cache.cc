@@ -0,0 +1,192 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_list_cache.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/image_hash.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Bump when the format of the entries or the files listed for the same image
+// change.
+constexpr uint64_t kFileListCacheVersion = 2;
+
+void AppendInt(uint64_t value, brillo::Blob* data) {
+  const size_t offset = data->size();
+  data->resize(offset + sizeof(value));
+  memcpy(data->data() + offset, &value, sizeof(value));
+}
+
+void AppendString(const string& value, brillo::Blob* data) {
+  AppendInt(value.size(), data);
+  data->insert(data->end(), value.begin(), value.end());
+}
+
+// Reads the values appended by AppendInt() and AppendString() in order.
+class EntryReader {
+ public:
+  explicit EntryReader(const brillo::Blob& data) : data_(data) {}
+
+  bool ReadInt(uint64_t* value) {
+    TEST_AND_RETURN_FALSE(data_.size() - offset_ >= sizeof(*value));
+    memcpy(value, data_.data() + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool ReadString(string* value) {
+    uint64_t size;
+    TEST_AND_RETURN_FALSE(ReadInt(&size));
+    TEST_AND_RETURN_FALSE(data_.size() - offset_ >= size);
+    value->assign(data_.begin() + offset_, data_.begin() + offset_ + size);
+    offset_ += size;
+    return true;
+  }
+
+  bool AtEnd() const { return offset_ == data_.size(); }
+
+ private:
+  const brillo::Blob& data_;
+  size_t offset_{0};
+};
+}  // namespace
+
+bool FileListCache::Key(const string& image_path,
+                        const string& fs_type,
+                        string* key) {
+  HashCalculator hasher;
+  const uint64_t version = kFileListCacheVersion;
+  hasher.Update(&version, sizeof(version));
+  const string tag = "files-" + fs_type;
+  hasher.Update(tag.data(), tag.size() + 1);
+  brillo::Blob image_hash;
+  TEST_AND_RETURN_FALSE(GetImageHash(image_path, -1, &image_hash));
+  hasher.Update(image_hash.data(), image_hash.size());
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = DiffCache::Key(hasher.raw_hash());
+  return true;
+}
+
+bool FileListCache::Lookup(const string& key,
+                           vector<FilesystemInterface::File>* files) const {
+  brillo::Blob data;
+  if (!cache_.LookupData(key, &data))
+    return false;
+  return Deserialize(data, files);
+}
+
+bool FileListCache::Store(
+    const string& key, const vector<FilesystemInterface::File>& files) const {
+  return cache_.StoreData(key, Serialize(files));
+}
+
+brillo::Blob FileListCache::Serialize(
+    const vector<FilesystemInterface::File>& files) {
+  brillo::Blob data;
+  AppendInt(files.size(), &data);
+  for (const auto& file : files) {
+    AppendString(file.name, &data);
+    const struct stat& st = file.file_stat;
+    for (uint64_t value : {static_cast<uint64_t>(st.st_ino),
+                           static_cast<uint64_t>(st.st_mode),
+                           static_cast<uint64_t>(st.st_nlink),
+                           static_cast<uint64_t>(st.st_uid),
+                           static_cast<uint64_t>(st.st_gid),
+                           static_cast<uint64_t>(st.st_size),
+                           static_cast<uint64_t>(st.st_blksize),
+                           static_cast<uint64_t>(st.st_blocks),
+                           static_cast<uint64_t>(st.st_atime),
+                           static_cast<uint64_t>(st.st_mtime),
+                           static_cast<uint64_t>(st.st_ctime)}) {
+      AppendInt(value, &data);
+    }
+    AppendInt(file.is_compressed, &data);
+    AppendInt(file.extents.size(), &data);
+    for (const Extent& extent : file.extents) {
+      AppendInt(extent.start_block(), &data);
+      AppendInt(extent.num_blocks(), &data);
+    }
+    AppendInt(file.deflates.size(), &data);
+    for (const auto& deflate : file.deflates) {
+      AppendInt(deflate.offset, &data);
+      AppendInt(deflate.length, &data);
+    }
+  }
+  return data;
+}
+
+bool FileListCache::Deserialize(const brillo::Blob& data,
+                                vector<FilesystemInterface::File>* files) {
+  EntryReader reader(data);
+  uint64_t num_files;
+  TEST_AND_RETURN_FALSE(reader.ReadInt(&num_files));
+  vector<FilesystemInterface::File> result;
+  for (uint64_t i = 0; i < num_files; i++) {
+    FilesystemInterface::File file;
+    TEST_AND_RETURN_FALSE(reader.ReadString(&file.name));
+    uint64_t values[11];
+    for (uint64_t& value : values)
+      TEST_AND_RETURN_FALSE(reader.ReadInt(&value));
+    struct stat& st = file.file_stat;
+    st.st_ino = values[0];
+    st.st_mode = values[1];
+    st.st_nlink = values[2];
+    st.st_uid = values[3];
+    st.st_gid = values[4];
+    st.st_size = values[5];
+    st.st_blksize = values[6];
+    st.st_blocks = values[7];
+    st.st_atime = values[8];
+    st.st_mtime = values[9];
+    st.st_ctime = values[10];
+    uint64_t is_compressed;
+    TEST_AND_RETURN_FALSE(reader.ReadInt(&is_compressed));
+    file.is_compressed = is_compressed;
+    uint64_t num_extents;
+    TEST_AND_RETURN_FALSE(reader.ReadInt(&num_extents));
+    for (uint64_t j = 0; j < num_extents; j++) {
+      uint64_t start_block, num_blocks;
+      TEST_AND_RETURN_FALSE(reader.ReadInt(&start_block));
+      TEST_AND_RETURN_FALSE(reader.ReadInt(&num_blocks));
+      file.extents.push_back(ExtentForRange(start_block, num_blocks));
+    }
+    uint64_t num_deflates;
+    TEST_AND_RETURN_FALSE(reader.ReadInt(&num_deflates));
+    for (uint64_t j = 0; j < num_deflates; j++) {
+      uint64_t offset, length;
+      TEST_AND_RETURN_FALSE(reader.ReadInt(&offset));
+      TEST_AND_RETURN_FALSE(reader.ReadInt(&length));
+      file.deflates.emplace_back(offset, length);
+    }
+    result.push_back(std::move(file));
+  }
+  TEST_AND_RETURN_FALSE(reader.AtEnd());
+  *files = std::move(result);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_LIST_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_LIST_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+namespace chromeos_update_engine {
+
+// FileListCache keeps the list of files of a filesystem image in a DiffCache
+// directory, keyed by the content of the image, so that parsing the same
+// image again only reads it. Only the stat, name, extents and deflates of the
+// files are kept, the compressed file info isn't.
+class FileListCache {
+ public:
+  explicit FileListCache(const std::string& dir) : cache_(dir) {}
+
+  // Sets |key| to the key of the files of the image |image_path| listed by the
+  // filesystem named |fs_type|.
+  static bool Key(const std::string& image_path,
+                  const std::string& fs_type,
+                  std::string* key);
+
+  // Reads the files stored for |key|. Returns false if there is no valid entry
+  // for it.
+  bool Lookup(const std::string& key,
+              std::vector<FilesystemInterface::File>* files) const;
+
+  bool Store(const std::string& key,
+             const std::vector<FilesystemInterface::File>& files) const;
+
+  static brillo::Blob Serialize(
+      const std::vector<FilesystemInterface::File>& files);
+  static bool Deserialize(const brillo::Blob& data,
+                          std::vector<FilesystemInterface::File>* files);
+
+ private:
+  DiffCache cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileListCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_LIST_CACHE_H_
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_list_cache.h"
+
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+vector<FilesystemInterface::File> TestFiles() {
+  FilesystemInterface::File file;
+  file.name = "/system/app.apk";
+  file.file_stat.st_ino = 12;
+  file.file_stat.st_mode = S_IFREG | 0644;
+  file.file_stat.st_size = 8000;
+  file.file_stat.st_mtime = 1234567890;
+  file.extents = {ExtentForRange(10, 1), ExtentForRange(20, 2)};
+  file.deflates = {{100, 2000}, {4000, 3000}};
+  FilesystemInterface::File free_space;
+  free_space.name = "<free-space>";
+  free_space.is_compressed = true;
+  free_space.extents = {ExtentForRange(30, 5)};
+  return {file, free_space};
+}
+
+void ExpectSameFiles(const vector<FilesystemInterface::File>& expected,
+                     const vector<FilesystemInterface::File>& files) {
+  ASSERT_EQ(expected.size(), files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    EXPECT_EQ(expected[i].name, files[i].name);
+    EXPECT_EQ(expected[i].file_stat.st_ino, files[i].file_stat.st_ino);
+    EXPECT_EQ(expected[i].file_stat.st_mode, files[i].file_stat.st_mode);
+    EXPECT_EQ(expected[i].file_stat.st_size, files[i].file_stat.st_size);
+    EXPECT_EQ(expected[i].file_stat.st_mtime, files[i].file_stat.st_mtime);
+    EXPECT_EQ(expected[i].is_compressed, files[i].is_compressed);
+    EXPECT_EQ(expected[i].extents, files[i].extents);
+    EXPECT_EQ(expected[i].deflates, files[i].deflates);
+  }
+}
+}  // namespace
+
+TEST(FileListCacheTest, SerializeTest) {
+  const vector<FilesystemInterface::File> files = TestFiles();
+  const brillo::Blob data = FileListCache::Serialize(files);
+  vector<FilesystemInterface::File> read_files;
+  ASSERT_TRUE(FileListCache::Deserialize(data, &read_files));
+  ExpectSameFiles(files, read_files);
+
+  // Truncated or with trailing data.
+  EXPECT_FALSE(FileListCache::Deserialize(
+      brillo::Blob(data.begin(), data.end() - 1), &read_files));
+  brillo::Blob longer_data = data;
+  longer_data.push_back(0);
+  EXPECT_FALSE(FileListCache::Deserialize(longer_data, &read_files));
+}
+
+TEST(FileListCacheTest, StoreLookupTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  ScopedTempFile image("FileListCacheTest-image.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileString(image.path(), "image"));
+
+  string key;
+  ASSERT_TRUE(FileListCache::Key(image.path(), "ext2", &key));
+  string other_key;
+  ASSERT_TRUE(FileListCache::Key(image.path(), "mapfile", &other_key));
+  EXPECT_NE(key, other_key);
+
+  FileListCache cache(temp_dir.GetPath().value());
+  vector<FilesystemInterface::File> files;
+  EXPECT_FALSE(cache.Lookup(key, &files));
+  ASSERT_TRUE(cache.Store(key, TestFiles()));
+  EXPECT_TRUE(cache.Lookup(key, &files));
+  ExpectSameFiles(TestFiles(), files);
+
+  // Another content has another key.
+  ASSERT_TRUE(test_utils::WriteFileString(image.path(), "other image"));
+  ASSERT_TRUE(FileListCache::Key(image.path(), "ext2", &other_key));
+  EXPECT_NE(key, other_key);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,178 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::pair;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The number of blocks of a new file looked up in the index at most.
+constexpr size_t kMaxSampledBlocks = 64;
+// The blocks found in more old files than this, like the padding or the
+// headers all the files of a kind share, are left out of the index.
+constexpr size_t kMaxFilesPerBlock = 4;
+// The number of blocks of the old files copied and hashed at once.
+constexpr uint64_t kHashBlocks = 256;
+}  // namespace
+
+FileSimilarityIndex::FileSimilarityIndex(vector<const File*> old_files,
+                                         const MappedImage& old_image,
+                                         size_t block_size,
+                                         size_t num_threads)
+    : old_files_(std::move(old_files)),
+      block_size_(block_size),
+      zero_block_hash_(BlockMapping::HashBlock(
+          brillo::Blob(block_size).data(), block_size)) {
+  num_threads = std::max<size_t>(
+      1, std::min<size_t>(num_threads, old_files_.size()));
+  // Each thread hashes whole files, into a list of its own.
+  vector<vector<pair<uint64_t, uint32_t>>> thread_hashes(num_threads);
+  std::atomic<size_t> next_file{0};
+  auto hash_files = [&](vector<pair<uint64_t, uint32_t>>* hashes) {
+    brillo::Blob data;
+    for (size_t i = next_file++; i < old_files_.size(); i = next_file++) {
+      for (const Extent& extent : old_files_[i]->extents) {
+        for (uint64_t offset = 0; offset < extent.num_blocks();
+             offset += kHashBlocks) {
+          const uint64_t count =
+              std::min(kHashBlocks, extent.num_blocks() - offset);
+          if (!old_image.ReadExtents(
+                  {ExtentForRange(extent.start_block() + offset, count)},
+                  block_size_,
+                  &data)) {
+            break;
+          }
+          for (uint64_t block = 0; block < count; block++) {
+            const uint64_t hash = BlockMapping::HashBlock(
+                data.data() + block * block_size_, block_size_);
+            if (hash != zero_block_hash_)
+              hashes->emplace_back(hash, i);
+          }
+        }
+      }
+    }
+  };
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(hash_files, &thread_hashes[i]);
+  hash_files(&thread_hashes[0]);
+  for (auto& thread : threads)
+    thread.join();
+
+  for (const auto& hashes : thread_hashes) {
+    for (const auto& [hash, file_index] : hashes) {
+      vector<uint32_t>& files = block_files_[hash];
+      if (files.empty() || files.back() != file_index)
+        files.push_back(file_index);
+    }
+  }
+  for (auto it = block_files_.begin(); it != block_files_.end();) {
+    vector<uint32_t>& files = it->second;
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    if (files.size() > kMaxFilesPerBlock) {
+      it = block_files_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+vector<const FileSimilarityIndex::File*> FileSimilarityIndex::FindSimilarFiles(
+    const vector<const File*>& new_files,
+    const MappedImage& new_image,
+    size_t num_threads) const {
+  vector<const File*> similar_files(new_files.size());
+  num_threads = std::max<size_t>(
+      1, std::min<size_t>(num_threads, new_files.size()));
+  std::atomic<size_t> next_file{0};
+  auto find_files = [&]() {
+    for (size_t i = next_file++; i < new_files.size(); i = next_file++)
+      similar_files[i] = FindSimilarFile(*new_files[i], new_image);
+  };
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(find_files);
+  find_files();
+  for (auto& thread : threads)
+    thread.join();
+  return similar_files;
+}
+
+const FileSimilarityIndex::File* FileSimilarityIndex::FindSimilarFile(
+    const File& new_file, const MappedImage& new_image) const {
+  const uint64_t num_blocks = utils::BlocksInExtents(new_file.extents);
+  const uint64_t num_samples =
+      std::min<uint64_t>(num_blocks, kMaxSampledBlocks);
+  // The number of sampled blocks found in each old file, by index.
+  std::map<uint32_t, size_t> votes;
+  size_t num_informative_samples = 0;
+  brillo::Blob data;
+  auto extent = new_file.extents.begin();
+  uint64_t extent_first_block = 0;
+  for (uint64_t sample = 0; sample < num_samples; sample++) {
+    // The samples are spread evenly over the file.
+    const uint64_t block = sample * num_blocks / num_samples;
+    while (block >= extent_first_block + extent->num_blocks()) {
+      extent_first_block += extent->num_blocks();
+      ++extent;
+    }
+    const uint64_t image_block =
+        extent->start_block() + block - extent_first_block;
+    if (!new_image.ReadExtents(
+            {ExtentForRange(image_block, 1)}, block_size_, &data)) {
+      continue;
+    }
+    const uint64_t hash = BlockMapping::HashBlock(data.data(), block_size_);
+    if (hash == zero_block_hash_)
+      continue;
+    num_informative_samples++;
+    const auto it = block_files_.find(hash);
+    if (it == block_files_.end())
+      continue;
+    for (uint32_t file_index : it->second)
+      votes[file_index]++;
+  }
+
+  const File* similar_file = nullptr;
+  size_t max_votes = 0;
+  for (const auto& [file_index, file_votes] : votes) {
+    if (file_votes > max_votes) {
+      max_votes = file_votes;
+      similar_file = old_files_[file_index];
+    }
+  }
+  if (max_votes * 4 < num_informative_samples)
+    return nullptr;
+  return similar_file;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/mapped_image.h"
+
+namespace chromeos_update_engine {
+
+// FileSimilarityIndex finds the old file a new file shares the most data
+// with, to diff the new files that no old file has the name of, like renamed
+// APKs or versioned libraries, against it. The blocks of the old files are
+// indexed by their hash. A sample of the blocks of the new file is then
+// looked up, and the old file with the most of them wins if it has at least
+// a quarter of them. The zero blocks and the blocks found in many old files
+// tell nothing about the files and are ignored.
+class FileSimilarityIndex {
+ public:
+  using File = FilesystemInterface::File;
+
+  // Indexes the blocks of |old_files| in |old_image| on |num_threads|
+  // threads. The files must outlive the index.
+  FileSimilarityIndex(std::vector<const File*> old_files,
+                      const MappedImage& old_image,
+                      size_t block_size,
+                      size_t num_threads);
+  ~FileSimilarityIndex() = default;
+
+  // Returns, for each of |new_files| in |new_image|, the old file most
+  // similar to it, or nullptr if none is similar enough. The files are looked
+  // up on |num_threads| threads.
+  std::vector<const File*> FindSimilarFiles(
+      const std::vector<const File*>& new_files,
+      const MappedImage& new_image,
+      size_t num_threads) const;
+
+ private:
+  // Returns the old file most similar to |new_file|, or nullptr.
+  const File* FindSimilarFile(const File& new_file,
+                              const MappedImage& new_image) const;
+
+  const std::vector<const File*> old_files_;
+  const size_t block_size_;
+  const uint64_t zero_block_hash_;
+  // The indexes in |old_files_| of the files with a block of each hash.
+  std::unordered_map<uint64_t, std::vector<uint32_t>> block_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileSimilarityIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
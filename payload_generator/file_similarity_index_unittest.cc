@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+
+FilesystemInterface::File MakeFile(const char* name, vector<Extent> extents) {
+  FilesystemInterface::File file;
+  file.name = name;
+  file.extents = std::move(extents);
+  return file;
+}
+}  // namespace
+
+TEST(FileSimilarityIndexTest, FindSimilarFilesTest) {
+  // Old image: /lib_v1.so in blocks 0-3, /app.apk in 4-9, zeros in 10-11.
+  brillo::Blob old_data(12 * kBlockSize);
+  test_utils::FillWithData(&old_data);
+  std::fill(old_data.begin() + 10 * kBlockSize, old_data.end(), 0);
+  ScopedTempFile old_file("FileSimilarityIndexTest_old.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(old_file.path(), old_data));
+  const vector<FilesystemInterface::File> old_files = {
+      MakeFile("/lib_v1.so", {ExtentForRange(0, 4)}),
+      MakeFile("/app.apk", {ExtentForRange(4, 6)}),
+      MakeFile("/zeros", {ExtentForRange(10, 2)})};
+
+  // New image: /lib_v2.so has three of the blocks of /lib_v1.so and a new
+  // one, /moved/app.apk the blocks of /app.apk in another order, /new.bin
+  // only new data and /zeros2 only zeros. The rest of the image has other data
+  // than the old one.
+  brillo::Blob new_data(33 * kBlockSize);
+  test_utils::FillWithData(&new_data);
+  new_data.erase(new_data.begin(), new_data.begin() + 20 * kBlockSize);
+  auto copy_block = [&](size_t old_block, size_t new_block) {
+    std::copy(old_data.begin() + old_block * kBlockSize,
+              old_data.begin() + (old_block + 1) * kBlockSize,
+              new_data.begin() + new_block * kBlockSize);
+  };
+  for (size_t i = 0; i < 3; i++)
+    copy_block(i, i);
+  for (size_t i = 0; i < 6; i++)
+    copy_block(9 - i, 4 + i);
+  std::fill(new_data.begin() + 12 * kBlockSize, new_data.end(), 0);
+  ScopedTempFile new_file("FileSimilarityIndexTest_new.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(new_file.path(), new_data));
+  const vector<FilesystemInterface::File> new_files = {
+      MakeFile("/lib_v2.so", {ExtentForRange(0, 4)}),
+      MakeFile("/moved/app.apk", {ExtentForRange(7, 3), ExtentForRange(4, 3)}),
+      MakeFile("/new.bin", {ExtentForRange(10, 2)}),
+      MakeFile("/zeros2", {ExtentForRange(12, 1)})};
+
+  auto old_image = MappedImage::Get(old_file.path());
+  auto new_image = MappedImage::Get(new_file.path());
+  ASSERT_NE(nullptr, old_image);
+  ASSERT_NE(nullptr, new_image);
+  const FileSimilarityIndex index(
+      {&old_files[0], &old_files[1], &old_files[2]}, *old_image, kBlockSize, 2);
+  const vector<const FilesystemInterface::File*> similar_files =
+      index.FindSimilarFiles(
+          {&new_files[0], &new_files[1], &new_files[2], &new_files[3]},
+          *new_image,
+          2);
+  EXPECT_EQ(
+      vector<const FilesystemInterface::File*>(
+          {&old_files[0], &old_files[1], nullptr, nullptr}),
+      similar_files);
+}
+
+}  // namespace chromeos_update_engine
@@ -20,8 +20,14 @@
 #include <inttypes.h>
 
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
@@ -41,20 +47,192 @@ namespace {
 
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 
+// The chunks read ahead of the compression take at most this much memory,
+// whatever the number of threads.
+const size_t kMaxReadAheadSize = 16 * 1024 * 1024;  // bytes
+const size_t kMinReadBuffers = 2;
+
+// The data with fewer bits of information per byte than this, estimated from
+// the frequency of its bytes, is considered compressible.
+const double kMaxCompressibleEntropy = 6.0;
+
+// A region of the partition compressed in one full operation.
+struct Chunk {
+  uint64_t offset;
+  size_t size;
+};
+
+enum class ChunkKind {
+  kZeros,
+  kCompressible,
+  kIncompressible,
+};
+
+ChunkKind GetChunkKind(const brillo::Blob& data) {
+  uint64_t counts[256] = {};
+  for (uint8_t byte : data)
+    counts[byte]++;
+  if (counts[0] == data.size())
+    return ChunkKind::kZeros;
+  double entropy = 0;
+  for (uint64_t count : counts) {
+    if (count == 0)
+      continue;
+    const double p = static_cast<double>(count) / data.size();
+    entropy -= p * std::log2(p);
+  }
+  return entropy < kMaxCompressibleEntropy ? ChunkKind::kCompressible
+                                           : ChunkKind::kIncompressible;
+}
+
+// Splits the first |size| bytes of |fd| in chunks of |chunk_size| bytes, and
+// merges the consecutive chunks of zeros or of compressible data in chunks of
+// up to |max_chunk_size| bytes. The partition is read once more for this, but
+// the read ahead of the kernel keeps that sequential read cheap next to the
+// compression.
+bool GetAdaptiveChunks(int fd,
+                       size_t chunk_size,
+                       size_t max_chunk_size,
+                       uint64_t size,
+                       vector<Chunk>* chunks) {
+  brillo::Blob buffer;
+  ChunkKind last_kind = ChunkKind::kIncompressible;
+  for (uint64_t offset = 0; offset < size; offset += chunk_size) {
+    buffer.resize(std::min<uint64_t>(chunk_size, size - offset));
+    ssize_t bytes_read = -1;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd, buffer.data(), buffer.size(), offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer.size()));
+    const ChunkKind kind = GetChunkKind(buffer);
+    if (!chunks->empty() && kind != ChunkKind::kIncompressible &&
+        kind == last_kind &&
+        chunks->back().size + buffer.size() <= max_chunk_size) {
+      chunks->back().size += buffer.size();
+    } else {
+      chunks->push_back({offset, buffer.size()});
+    }
+    last_kind = kind;
+  }
+  return true;
+}
+
+// ChunkReader reads the chunks of a partition in order on its own thread, so
+// that the reads are sequential and overlap with the compression of the
+// chunks already read. At most |num_buffers| chunks are held in memory, the
+// reader waits for the compressed chunks to give their buffer back.
+class ChunkReader {
+ public:
+  ChunkReader(int fd, const vector<Chunk>& chunks, size_t num_buffers)
+      : fd_(fd), chunks_(chunks), num_buffers_(num_buffers) {}
+
+  ~ChunkReader() {
+    Abort();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  void Start() { thread_ = std::thread(&ChunkReader::Run, this); }
+
+  // Waits for the chunk |index| to be read and moves it into |chunk|. Every
+  // chunk taken must be given back with ReturnBuffer().
+  bool TakeChunk(size_t index, brillo::Blob* chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    chunk_read_.wait(lock, [this, index] {
+      return failed_ || read_chunks_.count(index) > 0;
+    });
+    auto it = read_chunks_.find(index);
+    if (it == read_chunks_.end())
+      return false;
+    *chunk = std::move(it->second);
+    read_chunks_.erase(it);
+    return true;
+  }
+
+  void ReturnBuffer(brillo::Blob&& buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_buffers_.push_back(std::move(buffer));
+    buffers_in_use_--;
+    buffer_returned_.notify_one();
+  }
+
+  // Stops the reads and fails the pending and future TakeChunk() calls.
+  void Abort() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    chunk_read_.notify_all();
+    buffer_returned_.notify_one();
+  }
+
+ private:
+  void Run() {
+    for (size_t index = 0; index < chunks_.size(); index++) {
+      const uint64_t offset = chunks_[index].offset;
+      const size_t size = chunks_[index].size;
+      brillo::Blob buffer;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        buffer_returned_.wait(lock, [this] {
+          return failed_ || buffers_in_use_ < num_buffers_;
+        });
+        if (failed_)
+          return;
+        buffers_in_use_++;
+        if (!free_buffers_.empty()) {
+          buffer = std::move(free_buffers_.back());
+          free_buffers_.pop_back();
+        }
+      }
+      buffer.resize(size);
+      ssize_t bytes_read = -1;
+      if (!utils::PReadAll(
+              fd_, buffer.data(), buffer.size(), offset, &bytes_read) ||
+          bytes_read != static_cast<ssize_t>(size)) {
+        LOG(ERROR) << "Error reading region at " << offset << " of size "
+                   << size;
+        Abort();
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      read_chunks_[index] = std::move(buffer);
+      chunk_read_.notify_all();
+    }
+  }
+
+  const int fd_;
+  const vector<Chunk>& chunks_;
+  const size_t num_buffers_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  // Signaled when a chunk is read or the reader fails.
+  std::condition_variable chunk_read_;
+  // Signaled when a buffer is given back or the reader is aborted.
+  std::condition_variable buffer_returned_;
+  std::map<size_t, brillo::Blob> read_chunks_;
+  // Buffers given back, reused for the next reads.
+  vector<brillo::Blob> free_buffers_;
+  size_t buffers_in_use_{0};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkReader);
+};
+
 // This class encapsulates a full update chunk processing thread work. The
-// processor reads a chunk of data from the input file descriptor and compresses
-// it. The processor will destroy itself when the work is done.
+// processor takes a chunk of data from the ChunkReader and compresses it.
 class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
+  // Compress the chunk |index| of |reader|, of |size| bytes starting at offset
+  // |offset|.
   ChunkProcessor(const PayloadVersion& version,
-                 int fd,
+                 ChunkReader* reader,
+                 size_t index,
                  off_t offset,
                  size_t size,
                  BlobFileWriter* blob_file,
                  AnnotatedOperation* aop)
       : version_(version),
-        fd_(fd),
+        reader_(reader),
+        index_(index),
         offset_(offset),
         size_(size),
         blob_file_(blob_file),
@@ -64,18 +242,19 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
   ~ChunkProcessor() override = default;
 
   // Overrides DelegateSimpleThread::Delegate.
-  // Run() handles the read from |fd| in a thread-safe way, and stores the
-  // new operation to generate the region starting at |offset| of size |size|
-  // in the output operation |aop|. The associated blob data is stored in
-  // |blob_fd| and |blob_file_size| is updated.
+  // Run() waits for the chunk to be read, and stores the new operation to
+  // generate the region starting at |offset| of size |size| in the output
+  // operation |aop|. The associated blob data is stored in |blob_file|.
   void Run() override;
 
  private:
   bool ProcessChunk();
+  bool CompressChunk(const brillo::Blob& chunk);
 
   // Work parameters.
   const PayloadVersion& version_;
-  int fd_;
+  ChunkReader* reader_;
+  size_t index_;
   off_t offset_;
   size_t size_;
   BlobFileWriter* blob_file_;
@@ -92,16 +271,19 @@ void ChunkProcessor::Run() {
 }
 
 bool ChunkProcessor::ProcessChunk() {
-  brillo::Blob buffer_in_(size_);
-  brillo::Blob op_blob;
-  ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+  brillo::Blob chunk;
+  TEST_AND_RETURN_FALSE(reader_->TakeChunk(index_, &chunk));
+  TEST_AND_RETURN_FALSE(chunk.size() == size_);
+  const bool success = CompressChunk(chunk);
+  reader_->ReturnBuffer(std::move(chunk));
+  return success;
+}
 
+bool ChunkProcessor::CompressChunk(const brillo::Blob& chunk) {
+  brillo::Blob op_blob;
   InstallOperation::Type op_type;
   TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
-      buffer_in_, version_, &op_blob, &op_type));
+      chunk, version_, &op_blob, &op_type));
 
   aop_->op.set_type(op_type);
   TEST_AND_RETURN_FALSE(aop_->SetOperationBlob(op_blob, blob_file_));
@@ -136,30 +318,66 @@ bool FullUpdateGenerator::GenerateOperations(
   TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
 
   size_t chunk_blocks = full_chunk_size / config.block_size;
+  const bool adaptive_chunks = config.full_max_chunk_size > full_chunk_size;
   size_t max_threads = diff_utils::GetMaxThreads();
   LOG(INFO) << "Compressing partition " << new_part.name << " from "
             << new_part.path << " splitting in chunks of " << chunk_blocks
-            << " blocks (" << config.block_size << " bytes each) using "
-            << max_threads << " threads";
+            << " blocks (" << config.block_size << " bytes each)"
+            << (adaptive_chunks
+                    ? ", merged up to " +
+                          std::to_string(config.full_max_chunk_size /
+                                         config.block_size) +
+                          " blocks where compressible,"
+                    : "")
+            << " using "
+            << (job_queue_ ? "the shared job queue"
+                           : std::to_string(max_threads) + " threads");
 
   int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  // We potentially have all the ChunkProcessors in memory but only
-  // |max_threads| will actually hold a block in memory while we process.
+  // The chunks are processed in order, so the kernel can read ahead.
+  posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
   size_t partition_blocks = new_part.size / config.block_size;
-  size_t num_chunks = utils::DivRoundUp(partition_blocks, chunk_blocks);
+  const uint64_t partition_size =
+      static_cast<uint64_t>(partition_blocks) * config.block_size;
+  vector<Chunk> chunks;
+  if (adaptive_chunks) {
+    TEST_AND_RETURN_FALSE(GetAdaptiveChunks(in_fd,
+                                            full_chunk_size,
+                                            config.full_max_chunk_size,
+                                            partition_size,
+                                            &chunks));
+  } else {
+    for (uint64_t offset = 0; offset < partition_size;
+         offset += full_chunk_size) {
+      const size_t size =
+          std::min<uint64_t>(full_chunk_size, partition_size - offset);
+      chunks.push_back({offset, size});
+    }
+  }
+  size_t max_chunk_size = full_chunk_size;
+  for (const Chunk& chunk : chunks)
+    max_chunk_size = std::max(max_chunk_size, chunk.size);
+
+  // We potentially have all the ChunkProcessors in memory but only the
+  // buffers of |reader| actually hold a chunk in memory while we process.
+  size_t num_chunks = chunks.size();
+  ChunkReader reader(
+      in_fd,
+      chunks,
+      std::max(kMinReadBuffers, kMaxReadAheadSize / max_chunk_size));
   aops->resize(num_chunks);
   vector<ChunkProcessor> chunk_processors;
   chunk_processors.reserve(num_chunks);
   blob_file->IncTotalBlobs(num_chunks);
 
   for (size_t i = 0; i < num_chunks; ++i) {
-    size_t start_block = i * chunk_blocks;
+    size_t start_block = chunks[i].offset / config.block_size;
     // The last chunk could be smaller.
-    size_t num_blocks =
-        std::min(chunk_blocks, partition_blocks - i * chunk_blocks);
+    size_t num_blocks = chunks[i].size / config.block_size;
 
     // Preset all the static information about the operations. The
     // ChunkProcessor will set the rest.
@@ -172,20 +390,35 @@ bool FullUpdateGenerator::GenerateOperations(
 
     chunk_processors.emplace_back(
         config.version,
-        in_fd,
+        &reader,
+        i,
         static_cast<off_t>(start_block) * config.block_size,
         num_blocks * config.block_size,
         blob_file,
         aop);
   }
 
-  // Thread pool used for worker threads.
-  base::DelegateSimpleThreadPool thread_pool("full-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (ChunkProcessor& processor : chunk_processors)
-    thread_pool.AddWork(&processor);
-  thread_pool.JoinAll();
+  // The jobs run in the order of the chunks, which is the order they're read.
+  reader.Start();
+  if (job_queue_) {
+    // The jobs must run in the order the chunks are read, or the threads
+    // could all wait for chunks that |reader| has no buffer left for. So they
+    // all get the same cost and the memory of the largest chunk, even when
+    // merged chunks make them differ. A chunk is in memory along with its
+    // best and current compressed versions.
+    vector<DiffJobQueue::Job> jobs;
+    for (ChunkProcessor& processor : chunk_processors)
+      jobs.push_back({chunk_blocks, &processor, 3 * max_chunk_size});
+    job_queue_->RunJobs(jobs);
+  } else {
+    // Thread pool used for worker threads.
+    base::DelegateSimpleThreadPool thread_pool("full-update-generator",
+                                               max_threads);
+    thread_pool.Start();
+    for (ChunkProcessor& processor : chunk_processors)
+      thread_pool.AddWork(&processor);
+    thread_pool.JoinAll();
+  }
 
   // All the operations must have a type set at this point. Otherwise, a
   // ChunkProcessor failed to complete.
@@ -23,6 +23,7 @@
 #include <base/macros.h>
 
 #include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/diff_job_queue.h"
 #include "update_engine/payload_generator/operations_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
@@ -31,6 +32,10 @@ namespace chromeos_update_engine {
 class FullUpdateGenerator : public OperationsGenerator {
  public:
   FullUpdateGenerator() = default;
+  // Compresses the chunks of the partitions on the threads of |job_queue|,
+  // which must outlive this object.
+  explicit FullUpdateGenerator(DiffJobQueue* job_queue)
+      : job_queue_(job_queue) {}
 
   // OperationsGenerator override.
   // Creates a full update for the target image defined in |config|. |config|
@@ -44,6 +49,8 @@ class FullUpdateGenerator : public OperationsGenerator {
                           std::vector<AnnotatedOperation>* aops) override;
 
  private:
+  DiffJobQueue* job_queue_{nullptr};
+
   DISALLOW_COPY_AND_ASSIGN(FullUpdateGenerator);
 };
 
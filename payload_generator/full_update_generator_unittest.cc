@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/full_update_generator.h"
 
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -113,6 +114,66 @@ TEST_F(FullUpdateGeneratorTest, ChunkSizeTooBig) {
             utils::BlocksInExtents(aops[1].op.dst_extents()));
 }
 
+// Test that a partition with more chunks than the read buffers is processed
+// entirely, with the reads waiting for the compressed chunks.
+TEST_F(FullUpdateGeneratorTest, MoreChunksThanReadBuffersTest) {
+  config_.hard_chunk_size = 1024 * 1024;
+  config_.soft_chunk_size = config_.hard_chunk_size;
+  brillo::Blob new_part(20 * 1024 * 1024 + 8 * 1024);
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  ASSERT_EQ(21U, aops.size());
+  const uint64_t chunk_blocks = config_.hard_chunk_size / config_.block_size;
+  for (size_t i = 0; i < aops.size(); ++i) {
+    EXPECT_TRUE(aops[i].op.has_type());
+    ASSERT_EQ(1, aops[i].op.dst_extents_size());
+    EXPECT_EQ(i * chunk_blocks, aops[i].op.dst_extents(0).start_block());
+  }
+  EXPECT_EQ(2U, aops.back().op.dst_extents(0).num_blocks());
+}
+
+// Test that the chunks of zeros and of compressible data are merged up to
+// the maximum chunk size, and the incompressible ones are not.
+TEST_F(FullUpdateGeneratorTest, AdaptiveChunksTest) {
+  config_.full_max_chunk_size = 512 * 1024;
+  brillo::Blob new_part(5 * 512 * 1024);
+  // Zeros, then data with 4 bits of entropy per byte, then random data.
+  for (size_t i = 2 * 512 * 1024; i < 4 * 512 * 1024; i++)
+    new_part[i] = i % 16;
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> dist(0, 255);
+  for (size_t i = 4 * 512 * 1024; i < new_part.size(); i++)
+    new_part[i] = dist(gen);
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  const vector<uint64_t> expected_blocks = {128, 128, 128, 128, 32, 32, 32, 32};
+  ASSERT_EQ(expected_blocks.size(), aops.size());
+  uint64_t start_block = 0;
+  for (size_t i = 0; i < aops.size(); ++i) {
+    EXPECT_TRUE(aops[i].op.has_type());
+    ASSERT_EQ(1, aops[i].op.dst_extents_size());
+    EXPECT_EQ(start_block, aops[i].op.dst_extents(0).start_block())
+        << "i = " << i;
+    EXPECT_EQ(expected_blocks[i], aops[i].op.dst_extents(0).num_blocks())
+        << "i = " << i;
+    start_block += expected_blocks[i];
+  }
+}
+
 // Test that if the image size is much smaller than the chunk size, it handles
 // correctly the only chunk of the partition.
 TEST_F(FullUpdateGeneratorTest, ImageSizeTooSmall) {
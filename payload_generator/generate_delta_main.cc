@@ -14,19 +14,27 @@
 // limitations under the License.
 //
 
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/strings.h>
 #include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/files/file_util.h>
+#include <base/json/json_writer.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
+#include <base/values.h>
 #include <brillo/key_value_store.h>
 #include <brillo/message_loops/base_message_loop.h>
 #include <unistd.h>
@@ -37,12 +45,22 @@
 #include "update_engine/common/fake_boot_control.h"
 #include "update_engine/common/fake_hardware.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/phase_metrics.h"
 #include "update_engine/common/prefs.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_algorithm_stats.h"
+#include "update_engine/payload_generator/diff_budget.h"
+#include "update_engine/payload_generator/generator_service.h"
+#include "update_engine/payload_generator/install_time_estimator.h"
+#include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
@@ -64,6 +82,10 @@ namespace {
 constexpr char kPayloadPropertiesFormatKeyValue[] = "key-value";
 constexpr char kPayloadPropertiesFormatJson[] = "json";
 
+// Memory the decompressed source data shared by the lz4diff operations takes
+// at most.
+constexpr size_t kLz4diffSourceCacheSize = 256 * 1024 * 1024;
+
 void ParseSignatureSizes(const string& signature_sizes_flag,
                          vector<size_t>* signature_sizes) {
   signature_sizes->clear();
@@ -112,12 +134,41 @@ void SignatureFileFlagToBlobs(const string& signature_file_flag,
   }
 }
 
+// Writes |payload_props| to |props_file| in |props_format|, or to the standard
+// output if |props_file| is "-".
+bool WriteProperties(PayloadProperties* payload_props,
+                     const string& props_file,
+                     const string& props_format) {
+  string properties;
+  if (props_format == kPayloadPropertiesFormatKeyValue) {
+    TEST_AND_RETURN_FALSE(payload_props->GetPropertiesAsKeyValue(&properties));
+  } else if (props_format == kPayloadPropertiesFormatJson) {
+    TEST_AND_RETURN_FALSE(payload_props->GetPropertiesAsJson(&properties));
+  } else {
+    LOG(FATAL) << "Invalid option " << props_format
+               << " for --properties_format flag.";
+  }
+  if (props_file == "-") {
+    printf("%s", properties.c_str());
+  } else {
+    utils::WriteFile(
+        props_file.c_str(), properties.c_str(), properties.length());
+    LOG(INFO) << "Generated properties file at " << props_file;
+  }
+  return true;
+}
+
+// Signs the payload. If |props_file| is not empty, the properties of the
+// signed payload computed while it's written are written there, see
+// WriteProperties().
 void SignPayload(const string& in_file,
                  const string& out_file,
                  const vector<size_t>& signature_sizes,
                  const string& payload_signature_file,
                  const string& metadata_signature_file,
-                 const string& out_metadata_size_file) {
+                 const string& out_metadata_size_file,
+                 const string& props_file,
+                 const string& props_format) {
   LOG(INFO) << "Signing payload.";
   LOG_IF(FATAL, in_file.empty()) << "Must pass --in_file to sign payload.";
   LOG_IF(FATAL, out_file.empty()) << "Must pass --out_file to sign payload.";
@@ -127,12 +178,47 @@ void SignPayload(const string& in_file,
   SignatureFileFlagToBlobs(payload_signature_file, &payload_signatures);
   SignatureFileFlagToBlobs(metadata_signature_file, &metadata_signatures);
   uint64_t final_metadata_size{};
-  CHECK(PayloadSigner::AddSignatureToPayload(in_file,
-                                             signature_sizes,
-                                             payload_signatures,
-                                             metadata_signatures,
-                                             out_file,
-                                             &final_metadata_size));
+  PayloadProperties payload_props;
+  CHECK(PayloadSigner::AddSignatureToPayload(
+      in_file,
+      signature_sizes,
+      payload_signatures,
+      metadata_signatures,
+      out_file,
+      &final_metadata_size,
+      props_file.empty() ? nullptr : &payload_props));
+  LOG(INFO) << "Done signing payload. Final metadata size = "
+            << final_metadata_size;
+  if (!out_metadata_size_file.empty()) {
+    string metadata_size_string = std::to_string(final_metadata_size);
+    CHECK(utils::WriteFile(out_metadata_size_file.c_str(),
+                           metadata_size_string.data(),
+                           metadata_size_string.size()));
+  }
+  if (!props_file.empty())
+    CHECK(WriteProperties(&payload_props, props_file, props_format));
+}
+
+// Like SignPayload(), with the private keys.
+void SignPayloadWithKeys(const string& in_file,
+                         const string& out_file,
+                         const string& private_keys,
+                         const string& out_metadata_size_file,
+                         const string& props_file,
+                         const string& props_format) {
+  LOG(INFO) << "Signing payload with private keys.";
+  LOG_IF(FATAL, in_file.empty()) << "Must pass --in_file to sign payload.";
+  LOG_IF(FATAL, out_file.empty()) << "Must pass --out_file to sign payload.";
+  vector<string> private_key_paths = base::SplitString(
+      private_keys, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  uint64_t final_metadata_size{};
+  PayloadProperties payload_props;
+  CHECK(PayloadSigner::SignPayloadFile(
+      in_file,
+      private_key_paths,
+      out_file,
+      &final_metadata_size,
+      props_file.empty() ? nullptr : &payload_props));
   LOG(INFO) << "Done signing payload. Final metadata size = "
             << final_metadata_size;
   if (!out_metadata_size_file.empty()) {
@@ -141,6 +227,60 @@ void SignPayload(const string& in_file,
                            metadata_size_string.data(),
                            metadata_size_string.size()));
   }
+  if (!props_file.empty())
+    CHECK(WriteProperties(&payload_props, props_file, props_format));
+}
+
+int MergePartialPayloads(const string& partial_payloads,
+                         const string& out_file,
+                         const string& private_key,
+                         const string& out_metadata_size_file) {
+  LOG(INFO) << "Merging partial payloads.";
+  LOG_IF(FATAL, out_file.empty())
+      << "Must pass --out_file to merge partial payloads.";
+  vector<string> partial_payload_paths = base::SplitString(
+      partial_payloads, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  uint64_t metadata_size{};
+  if (!PayloadFile::MergePartialPayloads(
+          partial_payload_paths, out_file, private_key, &metadata_size)) {
+    LOG(ERROR) << "Failed to merge the partial payloads.";
+    return 1;
+  }
+  if (!out_metadata_size_file.empty()) {
+    string metadata_size_string = std::to_string(metadata_size);
+    CHECK(utils::WriteFile(out_metadata_size_file.c_str(),
+                           metadata_size_string.data(),
+                           metadata_size_string.size()));
+  }
+  LOG(INFO) << "Done merging partial payloads.";
+  return 0;
+}
+
+// Keeps only the partitions named in |shard_partitions| in |config|, which
+// are generated into a partial payload.
+void KeepShardPartitions(const string& shard_partitions,
+                         PayloadGenerationConfig* config) {
+  const vector<string> names = base::SplitString(
+      shard_partitions, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  vector<PartitionConfig> target_partitions, source_partitions;
+  for (const string& name : names) {
+    auto it = std::find_if(config->target.partitions.begin(),
+                           config->target.partitions.end(),
+                           [&name](const PartitionConfig& part) {
+                             return part.name == name;
+                           });
+    LOG_IF(FATAL, it == config->target.partitions.end())
+        << "Partition " << name << " of --shard_partitions isn't in "
+        << "--partition_names.";
+    const size_t index = it - config->target.partitions.begin();
+    target_partitions.push_back(std::move(*it));
+    if (config->is_delta)
+      source_partitions.push_back(std::move(config->source.partitions[index]));
+  }
+  config->target.partitions = std::move(target_partitions);
+  config->source.partitions = std::move(source_partitions);
+  LOG(INFO) << "Generating a partial payload of partitions "
+            << base::JoinString(names, ", ");
 }
 
 int VerifySignedPayload(const string& in_file, const string& public_key) {
@@ -253,22 +393,70 @@ bool ApplyPayload(const string& payload_file,
 bool ExtractProperties(const string& payload_path,
                        const string& props_file,
                        const string& props_format) {
-  string properties;
   PayloadProperties payload_props(payload_path);
-  if (props_format == kPayloadPropertiesFormatKeyValue) {
-    TEST_AND_RETURN_FALSE(payload_props.GetPropertiesAsKeyValue(&properties));
-  } else if (props_format == kPayloadPropertiesFormatJson) {
-    TEST_AND_RETURN_FALSE(payload_props.GetPropertiesAsJson(&properties));
+  return WriteProperties(&payload_props, props_file, props_format);
+}
+
+bool EstimatePayloadInstallTime(const string& payload_path,
+                                const string& profile_file,
+                                const string& out_file) {
+  brillo::KeyValueStore store;
+  TEST_AND_RETURN_FALSE(store.Load(base::FilePath(profile_file)));
+  DeviceProfile profile;
+  TEST_AND_RETURN_FALSE(profile.Load(store));
+
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  Signatures metadata_signatures;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadFile(
+      payload_path, &manifest, &metadata_signatures));
+
+  const string estimates =
+      InstallTimeToKeyValue(EstimateInstallTime(manifest, profile));
+  if (out_file == "-") {
+    printf("%s", estimates.c_str());
   } else {
-    LOG(FATAL) << "Invalid option " << props_format
-               << " for --properties_format flag.";
+    TEST_AND_RETURN_FALSE(utils::WriteFile(
+        out_file.c_str(), estimates.c_str(), estimates.size()));
+    LOG(INFO) << "Generated install time file at " << out_file;
   }
-  if (props_file == "-") {
-    printf("%s", properties.c_str());
-  } else {
-    utils::WriteFile(
-        props_file.c_str(), properties.c_str(), properties.length());
-    LOG(INFO) << "Generated properties file at " << props_file;
+  return true;
+}
+
+// Clears the verity config of the target partitions whose hash tree or FEC
+// data are shipped in the payload as per |mode|, see --precompute_verity.
+bool PrecomputeVerity(const string& mode,
+                      const string& profile_file,
+                      double download_throughput,
+                      PayloadGenerationConfig* config) {
+  DeviceProfile profile;
+  if (mode == "auto") {
+    brillo::KeyValueStore store;
+    TEST_AND_RETURN_FALSE(!profile_file.empty());
+    TEST_AND_RETURN_FALSE(store.Load(base::FilePath(profile_file)));
+    TEST_AND_RETURN_FALSE(profile.Load(store));
+    TEST_AND_RETURN_FALSE(download_throughput > 0);
+  } else if (mode != "all") {
+    LOG(ERROR) << "Invalid --precompute_verity " << mode;
+    return false;
+  }
+  for (PartitionConfig& part : config->target.partitions) {
+    if (part.verity.IsEmpty())
+      continue;
+    VerityPrecomputation precomputation{true, true};
+    if (mode == "auto") {
+      precomputation = ChooseVerityPrecomputation(
+          part.verity, config->block_size, profile, download_throughput);
+    }
+    LOG(INFO) << "Partition " << part.name << ": hash tree "
+              << (precomputation.hash_tree ? "shipped" : "computed on device")
+              << ", FEC "
+              << (precomputation.fec ? "shipped" : "computed on device")
+              << ".";
+    if (precomputation.hash_tree)
+      part.verity.ClearHashTree();
+    if (precomputation.fec)
+      part.verity.ClearFec();
   }
   return true;
 }
@@ -349,6 +537,27 @@ DEFINE_string(out_metadata_hash_file, "", "Path to output metadata hash file");
 DEFINE_string(out_metadata_size_file, "", "Path to output metadata size file");
 DEFINE_string(private_key, "", "Path to private key in .pem format");
 DEFINE_string(public_key, "", "Path to public key in .pem format");
+DEFINE_string(shard_partitions,
+              "",
+              "Names of the partitions of --partition_names to generate, "
+              "separated by colons. The unsigned partial payload written to "
+              "--out_file only has these partitions, and is merged with the "
+              "partial payloads of the other partitions by "
+              "--merge_partial_payloads. All the other flags must be the same "
+              "for all the partial payloads of a payload.");
+DEFINE_string(merge_partial_payloads,
+              "",
+              "Paths to the partial payloads generated with "
+              "--shard_partitions to merge, in order, into the payload written "
+              "to --out_file and signed with --private_key if given. To pass "
+              "multiple paths, use a single argument with a colon between "
+              "paths.");
+DEFINE_string(signing_private_keys,
+              "",
+              "Private keys in .pem format to sign --in_file with into "
+              "--out_file, reading the payload only once. To pass multiple "
+              "keys, use a single argument with a colon between paths, e.g. "
+              "/path/to/key:/path/to/next_key .");
 DEFINE_int32(public_key_version,
              -1,
              "DEPRECATED. Key-check version # of client");
@@ -374,6 +583,16 @@ DEFINE_string(metadata_signature_file,
 DEFINE_int32(chunk_size,
              200 * 1024 * 1024,
              "Payload chunk size (-1 for whole files)");
+DEFINE_uint64(cow_chunk_size,
+              0,
+              "If not 0, align the replace operations to chunks of this "
+              "many bytes for the Virtual A/B COW writer, and order the "
+              "operations like the merge sequence.");
+DEFINE_uint64(full_max_chunk_size,
+              0,
+              "If larger than the chunk size of the full operations, merge "
+              "the consecutive chunks of zeros or of compressible data in "
+              "full operations of up to this many bytes.");
 DEFINE_uint64(rootfs_partition_size,
               chromeos_update_engine::kRootFSPartitionSize,
               "RootFS partition size for the image once installed");
@@ -387,11 +606,23 @@ DEFINE_int32(minor_version,
 DEFINE_string(properties_file,
               "",
               "If passed, dumps the payload properties of the payload passed "
-              "in --in_file and exits. Look at --properties_format.");
+              "in --in_file and exits. When signing, dumps the properties of "
+              "the signed payload instead, computed while it's written. Look "
+              "at --properties_format.");
 DEFINE_string(properties_format,
               kPayloadPropertiesFormatKeyValue,
               "Defines the format of the --properties_file. The acceptable "
               "values are: key-value (default) and json");
+DEFINE_string(device_profile,
+              "",
+              "A key/value file with the performance measured on a device, "
+              "see install_time_estimator.h. Look at --install_time_file.");
+DEFINE_string(install_time_file,
+              "",
+              "If passed with --device_profile, writes the predicted apply, "
+              "verify and merge times of each partition of the payload passed "
+              "in --in_file on that device to this key/value file, or to the "
+              "standard output if \"-\", and exits.");
 DEFINE_int64(max_timestamp,
              0,
              "The maximum timestamp of the OS allowed to apply this "
@@ -410,6 +641,12 @@ DEFINE_string(new_postinstall_config_file,
               "",
               "A config file specifying postinstall related metadata. "
               "Only allowed in major version 2 or newer.");
+DEFINE_string(boot_read_trace,
+              "",
+              "A key/value file with, for each target partition, the blocks "
+              "read during the first boot after the update, as space "
+              "separated <start block>:<num blocks>. With Virtual A/B "
+              "compression, the operations writing them merge first.");
 DEFINE_string(dynamic_partition_info_file,
               "",
               "An info file specifying dynamic partition metadata. "
@@ -420,6 +657,22 @@ DEFINE_bool(disable_fec_computation,
 DEFINE_bool(disable_verity_computation,
             false,
             "Disables the verity data computation on device.");
+DEFINE_bool(source_verity_root_digest,
+            false,
+            "Stores the root digest of the verity hash tree of each source "
+            "partition in the delta payload, so that devices reading the "
+            "source through dm-verity can skip hashing the source extents.");
+DEFINE_string(precompute_verity,
+              "",
+              "Ships the hash tree and the FEC data of the target partitions "
+              "in the delta payload instead of computing them on device: "
+              "\"all\", or \"auto\" to ship them only where computing them "
+              "on the device of --device_profile takes longer than "
+              "downloading them at --download_throughput.");
+DEFINE_double(download_throughput,
+              0,
+              "The download throughput of the device in bytes per second, for "
+              "--precompute_verity=auto.");
 DEFINE_string(out_maximum_signature_size_file,
               "",
               "Path to the output maximum signature size given a private key.");
@@ -450,6 +703,41 @@ DEFINE_bool(
     true,
     "Whether to enable zucchini feature when processing executable files.");
 
+DEFINE_bool(enable_zstd_dictionary,
+            false,
+            "Whether to compress the small replace operations of each "
+            "partition with a zstd dictionary, on minor version 12 or newer.");
+
+DEFINE_bool(free_blobs_while_writing,
+            false,
+            "Whether to release the disk space of the temporary data blobs "
+            "file while copying them to the payload, for hosts with little "
+            "disk space.");
+
+DEFINE_bool(reorder_operations,
+            false,
+            "Whether to reorder the operations of delta payloads so that "
+            "more source reads are sequential and the diff operations are "
+            "interleaved with the copies.");
+
+DEFINE_bool(add_operation_dst_hashes,
+            false,
+            "Whether to add the hash of the data written by each operation "
+            "to the manifest, so that a client resuming or retrying the "
+            "update can skip the operations already applied.");
+
+DEFINE_bool(add_operation_cost_hints,
+            false,
+            "Whether to add to the manifest the peak memory of each "
+            "operation, and its apply time on the device of "
+            "--device_profile if passed, for the client to schedule them.");
+
+DEFINE_int32(payload_chunk_size,
+             0,
+             "If non zero, the data of the payload is also hashed in chunks "
+             "of this many bytes, a multiple of the block size, so that it "
+             "can be verified as it's downloaded. Example: 1048576");
+
 DEFINE_string(erofs_compression_param,
               "",
               "Compression parameter passed to mkfs.erofs's -z option. "
@@ -460,6 +748,132 @@ DEFINE_int64(max_threads,
              "The maximum number of threads allowed for generating "
              "ota.");
 
+DEFINE_int64(max_memory,
+             0,
+             "If non zero, the approximate maximum number of bytes of memory "
+             "used to diff the files at once. Files too large for it are "
+             "diffed in smaller chunks.");
+
+DEFINE_bool(numa_aware,
+            false,
+            "Whether to spread the diff threads over the NUMA nodes of the "
+            "host, each thread running on the CPUs of its node so that the "
+            "data it diffs is in the memory local to them.");
+
+DEFINE_string(serve_socket,
+              "",
+              "If set, runs as a service generating the payloads of the jobs "
+              "received on this unix socket, each job being the '\\0' "
+              "terminated command line arguments of a delta_generator run. "
+              "The jobs inherit the other flags of the service. The exit code "
+              "of each job is written back followed by a newline.");
+
+DEFINE_int64(serve_max_jobs,
+             1,
+             "The maximum number of jobs the service runs at once.");
+
+DEFINE_string(serve_resident_images,
+              "",
+              "Colon-separated list of images, usually the source images of "
+              "the jobs, that the service keeps in memory between the jobs.");
+
+DEFINE_int64(zucchini_chunk_size,
+             0,
+             "If non zero, the executables too large for zucchini are diffed "
+             "in chunks of this many bytes, a multiple of the block size, so "
+             "that they can still use zucchini.");
+
+DEFINE_string(diff_cache_dir,
+              "",
+              "Directory where the diff results, the files found in the "
+              "images and the block index of the source images are cached, "
+              "to reuse them when generating other payloads from the same "
+              "files.");
+
+DEFINE_int32(max_diff_losses,
+             0,
+             "If non zero, a diff algorithm is not tried anymore on the files "
+             "of an extension once it gave a larger operation than another "
+             "one on this many of them, and never a smaller one. Makes the "
+             "generation faster, but the payload may be larger.");
+
+DEFINE_int64(diff_time_budget,
+             0,
+             "If non zero, the number of seconds each file may be diffed for. "
+             "The diff algorithms that would take longer, after the ones "
+             "tried on the file, are skipped. Makes the generation time more "
+             "predictable, but the payload may be larger.");
+
+DEFINE_int64(diff_memory_budget,
+             0,
+             "If non zero, the diff algorithms that would use more than this "
+             "many bytes of memory on a file are skipped.");
+
+DEFINE_int32(cow_estimate_threads,
+             1,
+             "Number of threads estimating the COW size of each partition. "
+             "Estimates made with more than one thread may be slightly "
+             "larger. 0 to use one thread per CPU.");
+
+DEFINE_double(cow_estimate_max_error,
+              0,
+              "If non zero, estimate the COW size from a sample of the new "
+              "blocks, with this maximum relative error. Example: 0.01");
+
+DEFINE_string(phase_stats_file,
+              "",
+              "If not empty, path of a JSON file to write the wall and CPU "
+              "time of each phase of the payload generation to, with the "
+              "utilization of the diff threads and the peak memory.");
+DEFINE_string(trace_file,
+              "",
+              "If not empty, path of a file to write a trace of the phases of "
+              "the payload generation to, in the JSON trace event format "
+              "opened by Perfetto.");
+
+// Writes the stats of |metrics| to |path| in JSON, with the share of the
+// generation time the |diff_threads| threads were busy diffing.
+bool WritePhaseStats(const PhaseMetrics& metrics,
+                     size_t diff_threads,
+                     const string& path) {
+  const PhaseStatsMap stats = metrics.GetStats();
+  base::TimeDelta generate_time, diff_jobs_time;
+  auto phases = std::make_unique<base::ListValue>();
+  for (const auto& [key, phase_stats] : stats) {
+    if (key.first == generator_phases::kGenerate)
+      generate_time += phase_stats.wall_time;
+    else if (key.first == generator_phases::kDiffJobs)
+      diff_jobs_time += phase_stats.wall_time;
+    auto phase = std::make_unique<base::DictionaryValue>();
+    phase->SetString("phase", key.first);
+    phase->SetString("partition", key.second);
+    phase->SetInteger("count", static_cast<int>(phase_stats.count));
+    phase->SetDouble("wall_seconds", phase_stats.wall_time.InSecondsF());
+    phase->SetDouble("cpu_seconds", phase_stats.cpu_time.InSecondsF());
+    if (phase_stats.peak_rss)
+      phase->SetDouble("peak_rss_mib", phase_stats.peak_rss / 1024.0 / 1024.0);
+    phases->Append(std::move(phase));
+  }
+
+  base::DictionaryValue json;
+  json.Set("phases", std::move(phases));
+  json.SetInteger("diff_threads", static_cast<int>(diff_threads));
+  if (!generate_time.is_zero()) {
+    json.SetDouble("diff_thread_utilization",
+                   diff_jobs_time.InSecondsF() / generate_time.InSecondsF() /
+                       diff_threads);
+  }
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    // |ru_maxrss| is in KiB.
+    json.SetDouble("peak_rss_mib", usage.ru_maxrss / 1024.0);
+  }
+  string json_str;
+  TEST_AND_RETURN_FALSE(base::JSONWriter::WriteWithOptions(
+      json, base::JSONWriter::OPTIONS_PRETTY_PRINT, &json_str));
+  return utils::WriteFile(path.c_str(), json_str.data(), json_str.size());
+}
+
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
@@ -490,6 +904,46 @@ void RoundUpPartitions(const ImageConfig& config) {
   }
 }
 
+int RunCommand();
+
+// Runs the jobs received on --serve_socket, each in a process forked from the
+// service, until the service is stopped.
+int RunService() {
+  CHECK_GT(FLAGS_serve_max_jobs, 0);
+  GeneratorService service(
+      FLAGS_serve_max_jobs, [](const vector<string>& args) {
+        // The flags of the job are parsed over the ones of the service.
+        vector<char*> argv = {const_cast<char*>("delta_generator")};
+        for (const string& arg : args)
+          argv.push_back(const_cast<char*>(arg.c_str()));
+        int argc = argv.size();
+        char** argv_data = argv.data();
+        gflags::ParseCommandLineFlags(&argc, &argv_data, true);
+        if (argc != 1) {
+          LOG(ERROR) << "Unused args in the job: "
+                     << android::base::Join(
+                            vector<char*>(argv_data + 1, argv_data + argc),
+                            " ");
+          return 1;
+        }
+        return RunCommand();
+      });
+  for (const string& image :
+       base::SplitString(FLAGS_serve_resident_images,
+                         ":",
+                         base::TRIM_WHITESPACE,
+                         base::SPLIT_WANT_NONEMPTY)) {
+    if (!service.KeepResident(image))
+      return 1;
+  }
+  if (!service.Listen(FLAGS_serve_socket))
+    return 1;
+  while (service.AcceptJob()) {
+  }
+  service.WaitForJobs();
+  return 1;
+}
+
 int Main(int argc, char** argv) {
   gflags::SetUsageMessage(
       "Generates a payload to provide to ChromeOS' update_engine.\n\n"
@@ -518,6 +972,13 @@ int Main(int argc, char** argv) {
   // Initialize the Xz compressor.
   XzCompressInit();
 
+  if (!FLAGS_serve_socket.empty())
+    return RunService();
+  return RunCommand();
+}
+
+int RunCommand() {
+
   if (!FLAGS_out_maximum_signature_size_file.empty()) {
     LOG_IF(FATAL, FLAGS_private_key.empty())
         << "Private key is not provided when calculating the maximum signature "
@@ -561,7 +1022,24 @@ int Main(int argc, char** argv) {
                 signature_sizes,
                 FLAGS_payload_signature_file,
                 FLAGS_metadata_signature_file,
-                FLAGS_out_metadata_size_file);
+                FLAGS_out_metadata_size_file,
+                FLAGS_properties_file,
+                FLAGS_properties_format);
+    return 0;
+  }
+  if (!FLAGS_merge_partial_payloads.empty()) {
+    return MergePartialPayloads(FLAGS_merge_partial_payloads,
+                                FLAGS_out_file,
+                                FLAGS_private_key,
+                                FLAGS_out_metadata_size_file);
+  }
+  if (!FLAGS_signing_private_keys.empty()) {
+    SignPayloadWithKeys(FLAGS_in_file,
+                        FLAGS_out_file,
+                        FLAGS_signing_private_keys,
+                        FLAGS_out_metadata_size_file,
+                        FLAGS_properties_file,
+                        FLAGS_properties_format);
     return 0;
   }
   if (!FLAGS_public_key.empty()) {
@@ -575,6 +1053,14 @@ int Main(int argc, char** argv) {
                ? 0
                : 1;
   }
+  if (!FLAGS_install_time_file.empty()) {
+    LOG_IF(FATAL, FLAGS_device_profile.empty())
+        << "--install_time_file requires --device_profile.";
+    return EstimatePayloadInstallTime(
+               FLAGS_in_file, FLAGS_device_profile, FLAGS_install_time_file)
+               ? 0
+               : 1;
+  }
 
   // A payload generation was requested. Convert the flags to a
   // PayloadGenerationConfig.
@@ -612,6 +1098,15 @@ int Main(int argc, char** argv) {
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
+  payload_config.enable_zstd_dictionary = FLAGS_enable_zstd_dictionary;
+  payload_config.reorder_operations = FLAGS_reorder_operations;
+  payload_config.free_blobs_while_writing = FLAGS_free_blobs_while_writing;
+  CHECK_GE(FLAGS_payload_chunk_size, 0);
+  payload_config.payload_chunk_size = FLAGS_payload_chunk_size;
+  payload_config.add_operation_dst_hashes = FLAGS_add_operation_dst_hashes;
+  payload_config.add_operation_cost_hints = FLAGS_add_operation_cost_hints;
+  if (FLAGS_add_operation_cost_hints)
+    payload_config.cost_hints_device_profile = FLAGS_device_profile;
 
   payload_config.ParseCompressorTypes(FLAGS_compressor_types);
 
@@ -688,6 +1183,8 @@ int Main(int argc, char** argv) {
 
   // Use the default soft_chunk_size defined in the config.
   payload_config.hard_chunk_size = FLAGS_chunk_size;
+  payload_config.cow_chunk_size = FLAGS_cow_chunk_size;
+  payload_config.full_max_chunk_size = FLAGS_full_max_chunk_size;
   payload_config.block_size = kBlockSize;
 
   // The partition size is never passed to the delta_generator, so we
@@ -699,6 +1196,12 @@ int Main(int argc, char** argv) {
   RoundUpPartitions(payload_config.target);
   CHECK(payload_config.target.LoadImageSize());
 
+  if (!FLAGS_boot_read_trace.empty()) {
+    brillo::KeyValueStore store;
+    CHECK(store.Load(base::FilePath(FLAGS_boot_read_trace)));
+    CHECK(payload_config.target.LoadBootReadExtents(store));
+  }
+
   if (!FLAGS_dynamic_partition_info_file.empty()) {
     brillo::KeyValueStore store;
     CHECK(store.Load(base::FilePath(FLAGS_dynamic_partition_info_file)));
@@ -714,14 +1217,55 @@ int Main(int argc, char** argv) {
 
   CHECK(!FLAGS_out_file.empty());
 
+  if (!FLAGS_partition_timestamps.empty()) {
+    CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
+                                      &payload_config));
+  }
+
+  // The partitions of other shards were only needed for the checks above,
+  // their filesystems aren't opened.
+  if (!FLAGS_shard_partitions.empty()) {
+    LOG_IF(FATAL, !FLAGS_private_key.empty())
+        << "Partial payloads are signed when merged, don't pass "
+        << "--private_key with --shard_partitions.";
+    KeepShardPartitions(FLAGS_shard_partitions, &payload_config);
+  }
+
   payload_config.rootfs_partition_size = FLAGS_rootfs_partition_size;
 
+  // The phases are traced as they're timed.
+  std::unique_ptr<PhaseMetrics> phase_metrics;
+  if (!FLAGS_phase_stats_file.empty() || !FLAGS_trace_file.empty()) {
+    phase_metrics = std::make_unique<PhaseMetrics>();
+    payload_config.phase_metrics = phase_metrics.get();
+  }
+  if (!FLAGS_trace_file.empty())
+    CHECK(trace::StartFileTrace(FLAGS_trace_file));
+
   if (payload_config.is_delta) {
-    // Avoid opening the filesystem interface for full payloads.
-    for (PartitionConfig& part : payload_config.target.partitions)
-      CHECK(part.OpenFilesystem());
-    for (PartitionConfig& part : payload_config.source.partitions)
-      CHECK(part.OpenFilesystem());
+    // Avoid opening the filesystem interface for full payloads. The
+    // filesystems of the partitions are parsed in parallel, except for the
+    // EROFS ones which erofs-utils can only parse one at a time.
+    // Walking a single EROFS image on several threads is out of scope for
+    // the same reason.
+    vector<std::thread> threads;
+    std::atomic<bool> opened{true};
+    for (auto* image : {&payload_config.target, &payload_config.source}) {
+      for (PartitionConfig& part : image->partitions)
+        threads.emplace_back([&part, &phase_metrics, &opened] {
+          ScopedThreadPhaseTimer timer(
+              phase_metrics.get(), generator_phases::kFilesystem, part.name);
+          if (!part.OpenFilesystem(FLAGS_diff_cache_dir)) {
+            LOG(ERROR) << "Unable to open the filesystem of partition "
+                       << part.name << " in " << part.path;
+            opened = false;
+          }
+        });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    if (!opened)
+      return 1;
   }
 
   payload_config.version.major = FLAGS_major_version;
@@ -770,11 +1314,36 @@ int Main(int argc, char** argv) {
   payload_config.security_patch_level = FLAGS_security_patch_level;
 
   payload_config.max_threads = FLAGS_max_threads;
-
-  if (!FLAGS_partition_timestamps.empty()) {
-    CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
-                                      &payload_config));
+  payload_config.max_memory = FLAGS_max_memory;
+  payload_config.numa_aware = FLAGS_numa_aware;
+  CHECK_GE(FLAGS_zucchini_chunk_size, 0);
+  payload_config.zucchini_chunk_size = FLAGS_zucchini_chunk_size;
+  payload_config.diff_cache_dir = FLAGS_diff_cache_dir;
+  std::unique_ptr<DiffAlgorithmStats> diff_algorithm_stats;
+  if (FLAGS_max_diff_losses > 0) {
+    diff_algorithm_stats =
+        std::make_unique<DiffAlgorithmStats>(FLAGS_max_diff_losses);
+    payload_config.diff_algorithm_stats = diff_algorithm_stats.get();
+  }
+  std::unique_ptr<DiffBudget> diff_budget;
+  if (FLAGS_diff_time_budget > 0 || FLAGS_diff_memory_budget > 0) {
+    CHECK_GE(FLAGS_diff_time_budget, 0);
+    CHECK_GE(FLAGS_diff_memory_budget, 0);
+    diff_budget = std::make_unique<DiffBudget>(
+        base::TimeDelta::FromSeconds(FLAGS_diff_time_budget),
+        FLAGS_diff_memory_budget);
+    payload_config.diff_budget = diff_budget.get();
+  }
+  std::unique_ptr<Lz4diffSourceCache> lz4diff_source_cache;
+  if (payload_config.is_delta) {
+    lz4diff_source_cache =
+        std::make_unique<Lz4diffSourceCache>(kLz4diffSourceCacheSize);
+    payload_config.lz4diff_source_cache = lz4diff_source_cache.get();
   }
+  LOG_IF(FATAL, FLAGS_cow_estimate_threads < 0)
+      << "--cow_estimate_threads can't be negative.";
+  payload_config.cow_estimate_threads = FLAGS_cow_estimate_threads;
+  payload_config.cow_estimate_max_error = FLAGS_cow_estimate_max_error;
 
   if (payload_config.is_delta &&
       payload_config.version.minor >= kVerityMinorPayloadVersion &&
@@ -791,6 +1360,22 @@ int Main(int argc, char** argv) {
         payload_config.target.partitions[i].verity.Clear();
       }
     }
+    if (FLAGS_source_verity_root_digest) {
+      // Only the hash tree of the source partitions is needed, and checked.
+      for (PartitionConfig& part : payload_config.source.partitions)
+        part.disable_fec_computation = true;
+      CHECK(payload_config.source.LoadVerityConfig());
+      for (PartitionConfig& part : payload_config.source.partitions) {
+        part.verity_root_digest = part.verity.hash_tree_root_digest;
+        part.verity.Clear();
+      }
+    }
+    if (!FLAGS_precompute_verity.empty()) {
+      CHECK(PrecomputeVerity(FLAGS_precompute_verity,
+                             FLAGS_device_profile,
+                             FLAGS_download_throughput,
+                             &payload_config));
+    }
   }
 
   LOG(INFO) << "Generating " << (payload_config.is_delta ? "delta" : "full")
@@ -807,6 +1392,17 @@ int Main(int argc, char** argv) {
           payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
     return 1;
   }
+  if (diff_budget)
+    diff_budget->LogSummary();
+  trace::StopFileTrace();
+  if (!FLAGS_phase_stats_file.empty()) {
+    LogPhaseStats(phase_metrics->GetStats());
+    CHECK(WritePhaseStats(*phase_metrics,
+                          payload_config.max_threads > 0
+                              ? payload_config.max_threads
+                              : diff_utils::GetMaxThreads(),
+                          FLAGS_phase_stats_file));
+  }
   if (!FLAGS_out_metadata_size_file.empty()) {
     string metadata_size_string = std::to_string(metadata_size);
     CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
@@ -0,0 +1,205 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generator_service.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The arguments of a job are at most this large.
+constexpr size_t kMaxJobArgumentsSize = 1024 * 1024;
+}  // namespace
+
+GeneratorService::GeneratorService(size_t max_jobs, JobRunner run_job)
+    : max_jobs_(std::max<size_t>(max_jobs, 1)), run_job_(std::move(run_job)) {}
+
+GeneratorService::~GeneratorService() {
+  if (socket_fd_ >= 0) {
+    IGNORE_EINTR(close(socket_fd_));
+    unlink(socket_path_.c_str());
+  }
+  for (const auto& [address, size] : resident_images_)
+    munmap(address, size);
+}
+
+bool GeneratorService::Listen(const string& socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "The socket path " << socket_path << " is too long";
+    return false;
+  }
+  memcpy(address.sun_path, socket_path.data(), socket_path.size());
+  // Only a socket is replaced, not a file passed by mistake.
+  struct stat socket_stat;
+  if (lstat(socket_path.c_str(), &socket_stat) == 0) {
+    TEST_AND_RETURN_FALSE(S_ISSOCK(socket_stat.st_mode));
+    TEST_AND_RETURN_FALSE(unlink(socket_path.c_str()) == 0);
+  }
+
+  socket_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create the service socket";
+    return false;
+  }
+  if (bind(socket_fd_,
+           reinterpret_cast<const struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(socket_fd_, SOMAXCONN) != 0) {
+    PLOG(ERROR) << "Unable to listen on " << socket_path;
+    IGNORE_EINTR(close(socket_fd_));
+    socket_fd_ = -1;
+    return false;
+  }
+  socket_path_ = socket_path;
+  LOG(INFO) << "Accepting jobs on " << socket_path;
+  return true;
+}
+
+bool GeneratorService::KeepResident(const string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << path;
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  const off_t size = utils::FileSize(fd);
+  TEST_AND_RETURN_FALSE(size >= 0);
+  if (size == 0)
+    return true;
+  void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map " << path;
+    return false;
+  }
+  resident_images_.emplace_back(address, size);
+  // Locking the pages needs a large enough RLIMIT_MEMLOCK, without it the
+  // image is only read ahead into the page cache.
+  if (mlock(address, size) != 0) {
+    PLOG(INFO) << "Unable to lock " << path << " in memory, reading it ahead";
+    madvise(address, size, MADV_WILLNEED);
+  }
+  LOG(INFO) << "Keeping " << path << " resident, " << size << " bytes";
+  return true;
+}
+
+bool GeneratorService::AcceptJob() {
+  TEST_AND_RETURN_FALSE(socket_fd_ >= 0);
+  ReapJobs(false);
+  while (running_jobs_.size() >= max_jobs_)
+    ReapJobs(true);
+
+  int fd = HANDLE_EINTR(accept4(socket_fd_, nullptr, nullptr, SOCK_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to accept a job";
+    return false;
+  }
+  const pid_t pid = fork();
+  if (pid == 0) {
+    IGNORE_EINTR(close(socket_fd_));
+    RunJob(fd);
+  }
+  IGNORE_EINTR(close(fd));
+  if (pid < 0) {
+    PLOG(ERROR) << "Unable to start a job";
+    return false;
+  }
+  LOG(INFO) << "Started job " << pid;
+  running_jobs_.insert(pid);
+  return true;
+}
+
+void GeneratorService::WaitForJobs() {
+  while (!running_jobs_.empty())
+    ReapJobs(true);
+}
+
+void GeneratorService::RunJob(int fd) {
+  vector<string> args;
+  int exit_code = 1;
+  if (ReadJobArguments(fd, &args)) {
+    exit_code = run_job_(args);
+  } else {
+    LOG(ERROR) << "Unable to read the arguments of the job";
+  }
+  const string reply = std::to_string(exit_code) + "\n";
+  if (!utils::WriteAll(fd, reply.data(), reply.size()))
+    PLOG(WARNING) << "Unable to send the exit code of the job";
+  IGNORE_EINTR(close(fd));
+  // The state inherited from the service, like its sockets, isn't cleaned up
+  // by the job.
+  _exit(exit_code);
+}
+
+void GeneratorService::ReapJobs(bool block) {
+  while (!running_jobs_.empty()) {
+    int status = 0;
+    const pid_t pid = HANDLE_EINTR(waitpid(-1, &status, block ? 0 : WNOHANG));
+    if (pid <= 0)
+      return;
+    if (running_jobs_.erase(pid)) {
+      LOG(INFO) << "Job " << pid << " exited with "
+                << (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+    block = false;
+  }
+}
+
+bool GeneratorService::ReadJobArguments(int fd, vector<string>* args) {
+  args->clear();
+  string data;
+  char buffer[4096];
+  while (true) {
+    const ssize_t rc = HANDLE_EINTR(read(fd, buffer, sizeof(buffer)));
+    if (rc < 0) {
+      PLOG(ERROR) << "Unable to read the arguments of the job";
+      return false;
+    }
+    if (rc == 0)
+      break;
+    data.append(buffer, rc);
+    TEST_AND_RETURN_FALSE(data.size() <= kMaxJobArgumentsSize);
+  }
+  // Every argument is terminated, a job cut short isn't run.
+  TEST_AND_RETURN_FALSE(data.empty() || data.back() == '\0');
+  size_t start = 0;
+  while (start < data.size()) {
+    const size_t end = data.find('\0', start);
+    args->push_back(data.substr(start, end - start));
+    start = end + 1;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
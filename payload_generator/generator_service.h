@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATOR_SERVICE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATOR_SERVICE_H_
+
+#include <sys/types.h>
+
+#include <functional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// GeneratorService runs delta_generator as a long-running service, so that a
+// release system generating many payloads from the same source builds keeps
+// the source images resident and the caches warm between them. The jobs are
+// received on a unix socket: a client connects, writes the command line
+// arguments of the job, each one terminated by a '\0', and shuts down its
+// side of the connection. The job runs in a child process forked from the
+// service, which answers with the exit code of the job followed by a '\n'.
+//
+// The jobs inherit the flags the service was started with, which a job may
+// override, and run concurrently up to a maximum number of jobs.
+class GeneratorService {
+ public:
+  // Runs a job with its arguments, and returns its exit code.
+  using JobRunner = std::function<int(const std::vector<std::string>& args)>;
+
+  GeneratorService(size_t max_jobs, JobRunner run_job);
+  ~GeneratorService();
+
+  // Listens on the unix socket |socket_path|, replacing any socket left
+  // there by a previous service.
+  bool Listen(const std::string& socket_path);
+
+  // Maps the image at |path| for the lifetime of the service and reads it in,
+  // so that the jobs diffing against it find it in the page cache.
+  bool KeepResident(const std::string& path);
+
+  // Waits for the next job and starts it in a child process, after one of the
+  // running jobs finished if there are already |max_jobs| of them.
+  bool AcceptJob();
+
+  // Waits for all the running jobs to finish.
+  void WaitForJobs();
+
+  // Reads the '\0' terminated arguments of a job from |fd| until the end of
+  // the input.
+  static bool ReadJobArguments(int fd, std::vector<std::string>* args);
+
+ private:
+  // Runs the job of the connection |fd| in the child process.
+  [[noreturn]] void RunJob(int fd);
+
+  // Reaps the finished jobs, waiting for one to finish if |block|.
+  void ReapJobs(bool block);
+
+  const size_t max_jobs_;
+  JobRunner run_job_;
+  int socket_fd_{-1};
+  std::string socket_path_;
+  std::set<pid_t> running_jobs_;
+  // The resident images, as their mapped address and size.
+  std::vector<std::pair<void*, size_t>> resident_images_;
+
+  DISALLOW_COPY_AND_ASSIGN(GeneratorService);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATOR_SERVICE_H_
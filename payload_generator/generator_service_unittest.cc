@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generator_service.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class GeneratorServiceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    socket_path_ = temp_dir_.GetPath().Append("service").value();
+  }
+
+  // Sends a job of |args| to the service and returns its reply.
+  string SendJob(const vector<string>& args) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_GE(fd, 0);
+    ScopedFdCloser fd_closer(&fd);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path_.c_str(), sizeof(address.sun_path));
+    EXPECT_EQ(0,
+              connect(fd,
+                      reinterpret_cast<const struct sockaddr*>(&address),
+                      sizeof(address)));
+    for (const string& arg : args)
+      EXPECT_TRUE(utils::WriteAll(fd, arg.c_str(), arg.size() + 1));
+    EXPECT_EQ(0, shutdown(fd, SHUT_WR));
+    string reply;
+    char buffer[16];
+    ssize_t rc;
+    while ((rc = read(fd, buffer, sizeof(buffer))) > 0)
+      reply.append(buffer, rc);
+    return reply;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string socket_path_;
+};
+
+TEST_F(GeneratorServiceTest, ReadJobArgumentsTest) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  const string data("--a=1\0\0--b\0", 11);
+  ASSERT_TRUE(utils::WriteAll(fds[1], data.data(), data.size()));
+  close(fds[1]);
+  vector<string> args;
+  EXPECT_TRUE(GeneratorService::ReadJobArguments(fds[0], &args));
+  EXPECT_EQ(vector<string>({"--a=1", "", "--b"}), args);
+  close(fds[0]);
+
+  // The last argument isn't terminated.
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_TRUE(utils::WriteAll(fds[1], "--a\0--b", 7));
+  close(fds[1]);
+  EXPECT_FALSE(GeneratorService::ReadJobArguments(fds[0], &args));
+  close(fds[0]);
+}
+
+TEST_F(GeneratorServiceTest, RunsJobsTest) {
+  GeneratorService service(2, [](const vector<string>& args) {
+    return args == vector<string>({"--a", "--b"}) ? 3 : 4;
+  });
+  ASSERT_TRUE(service.Listen(socket_path_));
+  std::thread server([&service] {
+    for (int i = 0; i < 3; i++)
+      EXPECT_TRUE(service.AcceptJob());
+    service.WaitForJobs();
+  });
+  EXPECT_EQ("3\n", SendJob({"--a", "--b"}));
+  EXPECT_EQ("4\n", SendJob({}));
+  EXPECT_EQ("4\n", SendJob({"--a"}));
+  server.join();
+}
+
+TEST_F(GeneratorServiceTest, ListenReplacesOnlySocketsTest) {
+  {
+    GeneratorService service(1, [](const vector<string>&) { return 0; });
+    ASSERT_TRUE(service.Listen(socket_path_));
+  }
+  // A socket left by a previous service.
+  {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    ScopedFdCloser fd_closer(&fd);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path_.c_str(), sizeof(address.sun_path));
+    ASSERT_EQ(0,
+              bind(fd,
+                   reinterpret_cast<const struct sockaddr*>(&address),
+                   sizeof(address)));
+  }
+  GeneratorService service(1, [](const vector<string>&) { return 0; });
+  EXPECT_TRUE(service.Listen(socket_path_));
+
+  const string file_path = temp_dir_.GetPath().Append("file").value();
+  ASSERT_TRUE(utils::WriteFile(file_path.c_str(), "x", 1));
+  GeneratorService file_service(1, [](const vector<string>&) { return 0; });
+  EXPECT_FALSE(file_service.Listen(file_path));
+  EXPECT_TRUE(utils::FileExists(file_path.c_str()));
+}
+
+TEST_F(GeneratorServiceTest, KeepResidentTest) {
+  const string image_path = temp_dir_.GetPath().Append("image").value();
+  ASSERT_TRUE(utils::WriteFile(image_path.c_str(), "data", 4));
+  GeneratorService service(1, [](const vector<string>&) { return 0; });
+  EXPECT_TRUE(service.KeepResident(image_path));
+  EXPECT_FALSE(service.KeepResident(image_path + "-missing"));
+}
+
+}  // namespace chromeos_update_engine
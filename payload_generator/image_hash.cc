@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/image_hash.h"
+
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// What the hash of an image depends on. A rewritten image has a new
+// modification time, or a new inode when replaced by another file.
+using ImageHashKey = std::tuple<string, off_t, dev_t, ino_t, time_t, long>;
+
+std::mutex image_hashes_mutex;
+std::map<ImageHashKey, brillo::Blob>& ImageHashes() {
+  static auto* image_hashes = new std::map<ImageHashKey, brillo::Blob>();
+  return *image_hashes;
+}
+}  // namespace
+
+bool GetImageHash(const string& path, off_t size, brillo::Blob* raw_hash) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return false;
+  }
+  if (size < 0)
+    size = st.st_size;
+  const ImageHashKey key{path,
+                         size,
+                         st.st_dev,
+                         st.st_ino,
+                         st.st_mtim.tv_sec,
+                         st.st_mtim.tv_nsec};
+  {
+    std::lock_guard<std::mutex> lock(image_hashes_mutex);
+    auto it = ImageHashes().find(key);
+    if (it != ImageHashes().end()) {
+      *raw_hash = it->second;
+      return true;
+    }
+  }
+  // Hashed without the lock, so that the images of several partitions are
+  // hashed at once.
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(hasher.UpdateFile(path, size) == size);
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *raw_hash = hasher.raw_hash();
+  std::lock_guard<std::mutex> lock(image_hashes_mutex);
+  ImageHashes()[key] = *raw_hash;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,36 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_HASH_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_HASH_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Sets |raw_hash| to the SHA-256 hash of the first |size| bytes of the image
+// |path|, or of the whole image if |size| is negative. The hashes are kept for
+// the rest of the process by path, size, inode and modification time, so the
+// partition info and the cache keys of the same image only read it once.
+bool GetImageHash(const std::string& path, off_t size, brillo::Blob* raw_hash);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_HASH_H_
@@ -0,0 +1,246 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/install_time_estimator.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kDefaultOperationThroughput[] = "default_operation_throughput";
+const char kStorageReadThroughput[] = "storage_read_throughput";
+const char kStorageWriteThroughput[] = "storage_write_throughput";
+const char kHashThroughput[] = "hash_throughput";
+const char kCpuCores[] = "cpu_cores";
+const char kTotal[] = "total";
+
+bool ParseThroughput(const string& key, const string& value, double* out) {
+  if (!base::StringToDouble(value, out) || !(*out > 0)) {
+    LOG(ERROR) << "Invalid throughput " << value << " for " << key;
+    return false;
+  }
+  return true;
+}
+
+bool GetThroughput(const brillo::KeyValueStore& store,
+                   const string& key,
+                   double* out) {
+  string value;
+  if (!store.GetString(key, &value)) {
+    LOG(ERROR) << "Missing " << key << " in the device profile.";
+    return false;
+  }
+  return ParseThroughput(key, value, out);
+}
+}  // namespace
+
+bool DeviceProfile::Load(const brillo::KeyValueStore& store) {
+  TEST_AND_RETURN_FALSE(GetThroughput(
+      store, kDefaultOperationThroughput, &default_operation_throughput));
+  TEST_AND_RETURN_FALSE(
+      GetThroughput(store, kStorageReadThroughput, &storage_read_throughput));
+  TEST_AND_RETURN_FALSE(
+      GetThroughput(store, kStorageWriteThroughput, &storage_write_throughput));
+  TEST_AND_RETURN_FALSE(
+      GetThroughput(store, kHashThroughput, &hash_throughput));
+
+  operation_throughput.clear();
+  for (int i = InstallOperation::Type_MIN; i <= InstallOperation::Type_MAX;
+       i++) {
+    if (!InstallOperation::Type_IsValid(i))
+      continue;
+    const auto type = static_cast<InstallOperation::Type>(i);
+    const string key = InstallOperationTypeName(type);
+    string value;
+    if (!store.GetString(key, &value))
+      continue;
+    TEST_AND_RETURN_FALSE(
+        ParseThroughput(key, value, &operation_throughput[type]));
+  }
+
+  cpu_cores = 1;
+  string value;
+  if (store.GetString(kCpuCores, &value) &&
+      (!base::StringToSizeT(value, &cpu_cores) || cpu_cores == 0)) {
+    LOG(ERROR) << "Invalid " << kCpuCores << " " << value;
+    return false;
+  }
+  return true;
+}
+
+vector<PartitionInstallTime> EstimateInstallTime(
+    const DeltaArchiveManifest& manifest, const DeviceProfile& profile) {
+  const uint64_t block_size = manifest.block_size();
+  const bool snapshot_enabled =
+      manifest.dynamic_partition_metadata().snapshot_enabled();
+  vector<PartitionInstallTime> estimates;
+  for (const PartitionUpdate& partition : manifest.partitions()) {
+    PartitionInstallTime estimate;
+    estimate.partition_name = partition.partition_name();
+
+    // The measured throughputs of the operations already include their own
+    // reads and writes, but the storage is shared by the operations applied
+    // at once.
+    double operations_time = 0;
+    uint64_t read_bytes = 0;
+    uint64_t written_bytes = 0;
+    for (const InstallOperation& op : partition.operations()) {
+      const uint64_t dst_bytes =
+          utils::BlocksInExtents(op.dst_extents()) * block_size;
+      auto it = profile.operation_throughput.find(op.type());
+      if (it != profile.operation_throughput.end()) {
+        operations_time += dst_bytes / it->second;
+      } else if (op.cost_hint().has_apply_time_us()) {
+        // The payload knows better than the default throughput.
+        operations_time += op.cost_hint().apply_time_us() / 1e6;
+      } else {
+        operations_time += dst_bytes / profile.default_operation_throughput;
+      }
+      read_bytes += utils::BlocksInExtents(op.src_extents()) * block_size;
+      written_bytes += dst_bytes;
+    }
+    estimate.apply =
+        std::max({operations_time / profile.cpu_cores,
+                  read_bytes / profile.storage_read_throughput,
+                  written_bytes / profile.storage_write_throughput});
+
+    // The partition is read once, to hash it and to compute the hash tree and
+    // the FEC data from it, FEC being counted like hashing.
+    const uint64_t partition_size = partition.new_partition_info().size();
+    uint64_t hashed_bytes = partition_size;
+    uint64_t verity_bytes = 0;
+    if (partition.has_hash_tree_extent()) {
+      hashed_bytes +=
+          partition.hash_tree_data_extent().num_blocks() * block_size;
+      verity_bytes += partition.hash_tree_extent().num_blocks() * block_size;
+    }
+    if (partition.has_fec_extent()) {
+      hashed_bytes += partition.fec_data_extent().num_blocks() * block_size;
+      verity_bytes += partition.fec_extent().num_blocks() * block_size;
+    }
+    estimate.verify =
+        std::max(partition_size / profile.storage_read_throughput,
+                 hashed_bytes / profile.hash_throughput) +
+        verity_bytes / profile.storage_write_throughput;
+
+    if (snapshot_enabled) {
+      estimate.merge = written_bytes / profile.storage_read_throughput +
+                       written_bytes / profile.storage_write_throughput;
+    }
+    estimates.push_back(estimate);
+  }
+  return estimates;
+}
+
+string InstallTimeToKeyValue(const vector<PartitionInstallTime>& estimates) {
+  brillo::KeyValueStore store;
+  PartitionInstallTime total;
+  total.partition_name = kTotal;
+  auto add = [&store](const PartitionInstallTime& estimate) {
+    const string& name = estimate.partition_name;
+    store.SetString(name + ".apply",
+                    base::StringPrintf("%.3f", estimate.apply));
+    store.SetString(name + ".verify",
+                    base::StringPrintf("%.3f", estimate.verify));
+    store.SetString(name + ".merge",
+                    base::StringPrintf("%.3f", estimate.merge));
+  };
+  for (const PartitionInstallTime& estimate : estimates) {
+    add(estimate);
+    total.apply += estimate.apply;
+    total.verify += estimate.verify;
+    total.merge += estimate.merge;
+  }
+  add(total);
+  return store.SaveToString();
+}
+
+VerityPrecomputation ChooseVerityPrecomputation(const VerityConfig& verity,
+                                                size_t block_size,
+                                                const DeviceProfile& profile,
+                                                double download_throughput) {
+  const double compute_throughput =
+      std::min(profile.hash_throughput, profile.storage_read_throughput);
+  auto worth_shipping = [&](const Extent& data, const Extent& computed) {
+    return computed.num_blocks() != 0 &&
+           data.num_blocks() * block_size / compute_throughput >
+               computed.num_blocks() * block_size / download_throughput;
+  };
+  VerityPrecomputation precomputation;
+  precomputation.hash_tree =
+      worth_shipping(verity.hash_tree_data_extent, verity.hash_tree_extent);
+  precomputation.fec =
+      worth_shipping(verity.fec_data_extent, verity.fec_extent);
+  return precomputation;
+}
+
+InstallOperationCost EstimateOperationCost(const InstallOperation& op,
+                                           size_t block_size,
+                                           const DeviceProfile* profile) {
+  const uint64_t src_bytes =
+      utils::BlocksInExtents(op.src_extents()) * block_size;
+  const uint64_t dst_bytes =
+      utils::BlocksInExtents(op.dst_extents()) * block_size;
+  // What InstallOperationExecutor holds in memory besides the data blob.
+  uint64_t working_memory = 0;
+  switch (op.type()) {
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      if (src_bytes <= InstallOperationExecutor::kMaxBsdiffSourceBufferSize)
+        working_memory = src_bytes;
+      break;
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      working_memory = src_bytes;
+      break;
+    case InstallOperation::PUFFDIFF:
+      // The source cache and the 5MB cache of puffpatch.
+      if (src_bytes <= InstallOperationExecutor::kMaxPuffSourceCacheSize)
+        working_memory = src_bytes;
+      working_memory += 5 * 1024 * 1024;
+      break;
+    case InstallOperation::ZUCCHINI:
+      working_memory = src_bytes + dst_bytes;
+      break;
+    default:
+      break;
+  }
+  InstallOperationCost cost;
+  cost.set_peak_memory(op.data_length() + working_memory);
+  if (profile) {
+    auto it = profile->operation_throughput.find(op.type());
+    const double throughput = it != profile->operation_throughput.end()
+                                  ? it->second
+                                  : profile->default_operation_throughput;
+    cost.set_apply_time_us(static_cast<uint64_t>(dst_bytes / throughput * 1e6));
+  }
+  return cost;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,104 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_INSTALL_TIME_ESTIMATOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_INSTALL_TIME_ESTIMATOR_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <brillo/key_value_store.h>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The performance of a device installing payloads, as measured on it. All the
+// throughputs are in bytes per second.
+struct DeviceProfile {
+  // Loads the profile from a key/value store. The keys are the names of the
+  // operation types, like REPLACE_XZ, with the throughput of that type in
+  // bytes written to the target per second on one thread, and:
+  //   default_operation_throughput: for the operation types not listed.
+  //   storage_read_throughput, storage_write_throughput: of the storage.
+  //   hash_throughput: of SHA-256 on one core.
+  //   cpu_cores: optional, the number of operations applied at once.
+  // Returns false if a throughput is missing or not a positive number.
+  bool Load(const brillo::KeyValueStore& store);
+
+  std::map<InstallOperation::Type, double> operation_throughput;
+  double default_operation_throughput{0};
+  double storage_read_throughput{0};
+  double storage_write_throughput{0};
+  double hash_throughput{0};
+  size_t cpu_cores{1};
+};
+
+// The predicted install time of one partition, in seconds.
+struct PartitionInstallTime {
+  std::string partition_name;
+  // Applying the operations of the payload.
+  double apply{0};
+  // Hashing the target partition, and computing its hash tree and FEC data
+  // when the payload asks for it.
+  double verify{0};
+  // Merging the snapshot of the partition after the reboot, with Virtual A/B.
+  double merge{0};
+};
+
+// Predicts how long each partition of |manifest| takes to install on a device
+// with the performance of |profile|. The operations applied at once are
+// bounded by the CPU cores, and also by the storage for the bytes they read
+// and write. The merge, only with snapshots, reads and writes again every
+// block written.
+std::vector<PartitionInstallTime> EstimateInstallTime(
+    const DeltaArchiveManifest& manifest, const DeviceProfile& profile);
+
+// Returns the estimates as a key/value store, the keys being
+// <partition>.apply, <partition>.verify, <partition>.merge and the same for
+// "total", with the times in seconds.
+std::string InstallTimeToKeyValue(
+    const std::vector<PartitionInstallTime>& estimates);
+
+// The verity data of a partition to compute on the host and ship in the
+// payload, instead of computing it on the device.
+struct VerityPrecomputation {
+  bool hash_tree{false};
+  bool fec{false};
+};
+
+// Chooses, separately for the hash tree and the FEC data of |verity|, to ship
+// them when computing them on a device with |profile| takes longer than
+// downloading them at |download_throughput| bytes per second. Computing reads
+// the data they cover and FEC is counted like hashing; the writes are the same
+// either way.
+VerityPrecomputation ChooseVerityPrecomputation(const VerityConfig& verity,
+                                                size_t block_size,
+                                                const DeviceProfile& profile,
+                                                double download_throughput);
+
+// Returns the cost hint of |op|: the memory the client needs to apply it, and
+// with a |profile|, the time it takes on that device. Operations whose type
+// isn't in the profile are counted at its default throughput.
+InstallOperationCost EstimateOperationCost(const InstallOperation& op,
+                                           size_t block_size,
+                                           const DeviceProfile* profile);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_INSTALL_TIME_ESTIMATOR_H_
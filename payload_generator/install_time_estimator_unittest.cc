@@ -0,0 +1,258 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/install_time_estimator.h"
+
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const double kMiB = 1024 * 1024;
+
+// Returns a profile store without |missing_key|.
+brillo::KeyValueStore GetProfileStore(const string& missing_key = "") {
+  const std::map<string, string> values = {
+      {"default_operation_throughput", "1048576"},
+      {"REPLACE", "2097152"},
+      {"storage_read_throughput", "4194304"},
+      {"storage_write_throughput", "4194304"},
+      {"hash_throughput", "2097152"},
+      {"cpu_cores", "2"},
+  };
+  brillo::KeyValueStore store;
+  for (const auto& [key, value] : values) {
+    if (key != missing_key)
+      store.SetString(key, value);
+  }
+  return store;
+}
+
+void AddOperation(PartitionUpdate* partition,
+                  InstallOperation::Type type,
+                  uint64_t start_block,
+                  uint64_t num_blocks,
+                  bool has_src) {
+  InstallOperation* op = partition->add_operations();
+  op->set_type(type);
+  Extent* dst = op->add_dst_extents();
+  dst->set_start_block(start_block);
+  dst->set_num_blocks(num_blocks);
+  if (has_src)
+    *op->add_src_extents() = *dst;
+}
+}  // namespace
+
+TEST(InstallTimeEstimatorTest, LoadProfileTest) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Load(GetProfileStore()));
+  EXPECT_EQ(kMiB, profile.default_operation_throughput);
+  EXPECT_EQ(4 * kMiB, profile.storage_read_throughput);
+  EXPECT_EQ(4 * kMiB, profile.storage_write_throughput);
+  EXPECT_EQ(2 * kMiB, profile.hash_throughput);
+  EXPECT_EQ(2u, profile.cpu_cores);
+  ASSERT_EQ(1u, profile.operation_throughput.size());
+  EXPECT_EQ(2 * kMiB, profile.operation_throughput[InstallOperation::REPLACE]);
+
+  EXPECT_FALSE(profile.Load(GetProfileStore("hash_throughput")));
+  // The number of cores is optional.
+  ASSERT_TRUE(profile.Load(GetProfileStore("cpu_cores")));
+  EXPECT_EQ(1u, profile.cpu_cores);
+
+  brillo::KeyValueStore store = GetProfileStore();
+  store.SetString("SOURCE_COPY", "fast");
+  EXPECT_FALSE(profile.Load(store));
+
+  store = GetProfileStore();
+  store.SetString("storage_read_throughput", "0");
+  EXPECT_FALSE(profile.Load(store));
+
+  store = GetProfileStore();
+  store.SetString("cpu_cores", "0");
+  EXPECT_FALSE(profile.Load(store));
+}
+
+TEST(InstallTimeEstimatorTest, EstimateTest) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Load(GetProfileStore()));
+
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  manifest.mutable_dynamic_partition_metadata()->set_snapshot_enabled(true);
+  PartitionUpdate* system = manifest.add_partitions();
+  system->set_partition_name("system");
+  system->mutable_new_partition_info()->set_size(2 * kMiB);
+  AddOperation(system, InstallOperation::REPLACE, 0, 256, false);
+  AddOperation(system, InstallOperation::SOURCE_COPY, 256, 256, true);
+
+  PartitionUpdate* vendor = manifest.add_partitions();
+  vendor->set_partition_name("vendor");
+  vendor->mutable_new_partition_info()->set_size(2 * kMiB);
+  vendor->mutable_hash_tree_data_extent()->set_num_blocks(512);
+  vendor->mutable_hash_tree_extent()->set_start_block(512);
+  vendor->mutable_hash_tree_extent()->set_num_blocks(8);
+
+  auto estimates = EstimateInstallTime(manifest, profile);
+  ASSERT_EQ(2u, estimates.size());
+  EXPECT_EQ("system", estimates[0].partition_name);
+  // 0.5s of REPLACE and 1s of SOURCE_COPY on two cores, which is longer
+  // than the 0.25s of reads and 0.5s of writes.
+  EXPECT_DOUBLE_EQ(0.75, estimates[0].apply);
+  // Hashing 2 MiB is slower than reading it.
+  EXPECT_DOUBLE_EQ(1, estimates[0].verify);
+  // The 2 MiB written are read and written again.
+  EXPECT_DOUBLE_EQ(1, estimates[0].merge);
+
+  EXPECT_EQ("vendor", estimates[1].partition_name);
+  EXPECT_DOUBLE_EQ(0, estimates[1].apply);
+  // The partition and the data of its hash tree are hashed, then the 32 KiB
+  // of the hash tree are written.
+  EXPECT_DOUBLE_EQ(2 + 1. / 128, estimates[1].verify);
+  EXPECT_DOUBLE_EQ(0, estimates[1].merge);
+
+  brillo::KeyValueStore store;
+  ASSERT_TRUE(store.LoadFromString(InstallTimeToKeyValue(estimates)));
+  string value;
+  EXPECT_TRUE(store.GetString("system.apply", &value));
+  EXPECT_EQ("0.750", value);
+  EXPECT_TRUE(store.GetString("total.verify", &value));
+  EXPECT_EQ("3.008", value);
+
+  // Without snapshots there is no merge.
+  manifest.mutable_dynamic_partition_metadata()->set_snapshot_enabled(false);
+  estimates = EstimateInstallTime(manifest, profile);
+  EXPECT_DOUBLE_EQ(0, estimates[0].merge);
+}
+
+TEST(InstallTimeEstimatorTest, PackedExtentsPayloadTest) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Load(GetProfileStore()));
+
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  manifest.set_minor_version(kPackedExtentsMinorPayloadVersion);
+  PartitionUpdate* system = manifest.add_partitions();
+  system->set_partition_name("system");
+  system->mutable_new_partition_info()->set_size(2 * kMiB);
+  AddOperation(system, InstallOperation::REPLACE, 0, 256, false);
+  AddOperation(system, InstallOperation::SOURCE_COPY, 256, 256, true);
+  PackManifestExtents(&manifest);
+
+  // The estimate is made from the manifest parsed back from the payload, as
+  // delta_generator does.
+  ScopedTempFile blobs_file("InstallTimeEstimatorTest.blobs.XXXXXX");
+  ScopedTempFile payload_file("InstallTimeEstimatorTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(PayloadFile::WritePayload(payload_file.path(),
+                                        blobs_file.path(),
+                                        "",
+                                        kBrilloMajorPayloadVersion,
+                                        manifest,
+                                        &metadata_size));
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest parsed_manifest;
+  ASSERT_TRUE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &parsed_manifest, nullptr));
+
+  const auto estimates = EstimateInstallTime(parsed_manifest, profile);
+  ASSERT_EQ(1u, estimates.size());
+  EXPECT_DOUBLE_EQ(0.75, estimates[0].apply);
+}
+
+TEST(InstallTimeEstimatorTest, ChooseVerityPrecomputationTest) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Load(GetProfileStore()));
+
+  // 2 MiB covered by a 32 KiB hash tree and a 64 KiB FEC: computing either
+  // takes 1s at 2 MiB/s.
+  VerityConfig verity;
+  verity.hash_tree_data_extent.set_num_blocks(512);
+  verity.hash_tree_extent.set_num_blocks(8);
+  verity.fec_data_extent.set_num_blocks(512);
+  verity.fec_extent.set_num_blocks(16);
+  verity.fec_roots = 2;
+
+  auto precomputation =
+      ChooseVerityPrecomputation(verity, 4096, profile, 48 * 1024);
+  EXPECT_TRUE(precomputation.hash_tree);
+  EXPECT_FALSE(precomputation.fec);
+
+  precomputation = ChooseVerityPrecomputation(verity, 4096, profile, kMiB);
+  EXPECT_TRUE(precomputation.hash_tree);
+  EXPECT_TRUE(precomputation.fec);
+
+  precomputation = ChooseVerityPrecomputation(verity, 4096, profile, 16 * 1024);
+  EXPECT_FALSE(precomputation.hash_tree);
+  EXPECT_FALSE(precomputation.fec);
+
+  // Nothing to ship without verity data.
+  verity.fec_extent.Clear();
+  precomputation = ChooseVerityPrecomputation(verity, 4096, profile, kMiB);
+  EXPECT_FALSE(precomputation.fec);
+}
+
+TEST(InstallTimeEstimatorTest, OperationCostTest) {
+  DeviceProfile profile;
+  ASSERT_TRUE(profile.Load(GetProfileStore()));
+  PartitionUpdate partition;
+  AddOperation(&partition, InstallOperation::SOURCE_BSDIFF, 0, 256, true);
+  AddOperation(&partition, InstallOperation::REPLACE, 256, 256, false);
+  AddOperation(&partition, InstallOperation::ZUCCHINI, 512, 256, true);
+  for (InstallOperation& op : *partition.mutable_operations())
+    op.set_data_length(1000);
+
+  // bspatch holds the 1 MiB source next to the patch.
+  InstallOperationCost cost =
+      EstimateOperationCost(partition.operations(0), 4096, nullptr);
+  EXPECT_EQ(kMiB + 1000, cost.peak_memory());
+  EXPECT_FALSE(cost.has_apply_time_us());
+  cost = EstimateOperationCost(partition.operations(0), 4096, &profile);
+  EXPECT_EQ(1000000u, cost.apply_time_us());
+
+  cost = EstimateOperationCost(partition.operations(1), 4096, &profile);
+  EXPECT_EQ(1000u, cost.peak_memory());
+  EXPECT_EQ(500000u, cost.apply_time_us());
+
+  // Zucchini holds both the source and the target.
+  cost = EstimateOperationCost(partition.operations(2), 4096, nullptr);
+  EXPECT_EQ(2 * kMiB + 1000, cost.peak_memory());
+
+  // The hints replace the default throughput of the types not profiled.
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  *manifest.add_partitions() = partition;
+  manifest.mutable_partitions(0)
+      ->mutable_operations(0)
+      ->mutable_cost_hint()
+      ->set_apply_time_us(3000000);
+  const auto estimates = EstimateInstallTime(manifest, profile);
+  ASSERT_EQ(1u, estimates.size());
+  // 3s of SOURCE_BSDIFF, 0.5s of REPLACE and 1s of ZUCCHINI on two cores.
+  EXPECT_DOUBLE_EQ(2.25, estimates[0].apply);
+}
+
+}  // namespace chromeos_update_engine
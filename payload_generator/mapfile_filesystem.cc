@@ -16,14 +16,20 @@
 
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <thread>
 
 #include <base/files/file_util.h>
+#include <base/files/memory_mapped_file.h>
 #include <base/logging.h>
 #include <base/memory/ptr_util.h>
-#include <base/strings/string_number_conversions.h>
-#include <base/strings/string_split.h>
+#include <base/strings/string_piece.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -36,10 +42,107 @@ using std::vector;
 namespace {
 // The .map file is defined in terms of 4K blocks.
 size_t kMapfileBlockSize = 4096;
+
+// The default chunk size of the parse of large .map files.
+constexpr size_t kParseChunkSize = 4 * 1024 * 1024;
+constexpr unsigned kMaxParseThreads = 8;
+
+// Parses a decimal block number made only of digits, in place.
+bool ParseBlockNumber(base::StringPiece text, uint64_t* value) {
+  if (text.empty())
+    return false;
+  uint64_t result = 0;
+  for (char c : text) {
+    if (c < '0' || c > '9')
+      return false;
+    const uint64_t digit = c - '0';
+    if (result > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+      return false;
+    result = result * 10 + digit;
+  }
+  *value = result;
+  return true;
+}
 }  // namespace
 
 namespace chromeos_update_engine {
 
+namespace {
+// Parses one line of the .map file into |mapped_file|.
+bool ParseMapfileLine(base::StringPiece line,
+                      uint64_t num_blocks,
+                      FilesystemInterface::File* mapped_file) {
+  size_t delim, last_delim = line.size();
+  while (last_delim > 0 &&
+         (delim = line.rfind(' ', last_delim - 1)) != base::StringPiece::npos) {
+    base::StringPiece blocks = line.substr(delim + 1, last_delim - (delim + 1));
+    size_t dash = blocks.find('-');
+    uint64_t block_start, block_end;
+    if (dash == base::StringPiece::npos &&
+        ParseBlockNumber(blocks, &block_start)) {
+      mapped_file->extents.push_back(ExtentForRange(block_start, 1));
+    } else if (dash != base::StringPiece::npos &&
+               ParseBlockNumber(blocks.substr(0, dash), &block_start) &&
+               ParseBlockNumber(blocks.substr(dash + 1), &block_end)) {
+      if (block_end < block_start) {
+        LOG(ERROR) << "End block " << block_end
+                   << " is smaller than start block " << block_start
+                   << std::endl
+                   << line;
+        return false;
+      }
+      if (block_end > num_blocks) {
+        LOG(ERROR) << "The end block " << block_end
+                   << " is past the end of the file of " << num_blocks
+                   << " blocks" << std::endl
+                   << line;
+        return false;
+      }
+      mapped_file->extents.push_back(
+          ExtentForRange(block_start, block_end - block_start + 1));
+    } else {
+      // If we can't parse N or N-M, we assume the block is actually part of
+      // the name of the file.
+      break;
+    }
+    last_delim = delim;
+  }
+  // We parsed the blocks from the end of the line, so we need to reverse
+  // the Extents in the file.
+  std::reverse(mapped_file->extents.begin(), mapped_file->extents.end());
+  mapped_file->name = line.substr(0, last_delim).as_string();
+  return true;
+}
+
+// Parses the lines in [|begin|, |end|), which ends right after a '\n' unless
+// it is the |last_chunk| of the file. The text after the last '\n' of the
+// file is a line too, even if empty.
+bool ParseMapfileChunk(const char* begin,
+                       const char* end,
+                       bool last_chunk,
+                       uint64_t num_blocks,
+                       vector<FilesystemInterface::File>* files) {
+  const char* line_start = begin;
+  while (true) {
+    const char* line_end = static_cast<const char*>(
+        memchr(line_start, '\n', end - line_start));
+    if (!line_end && !last_chunk)
+      return true;
+    if (!line_end)
+      line_end = end;
+    files->emplace_back();
+    if (!ParseMapfileLine(base::StringPiece(line_start, line_end - line_start),
+                          num_blocks,
+                          &files->back())) {
+      return false;
+    }
+    if (line_end == end)
+      return true;
+    line_start = line_end + 1;
+  }
+}
+}  // namespace
+
 std::unique_ptr<MapfileFilesystem> MapfileFilesystem::CreateFromFile(
     const string& filename, const string& mapfile_filename) {
   if (filename.empty() || mapfile_filename.empty())
@@ -66,7 +169,9 @@ std::unique_ptr<MapfileFilesystem> MapfileFilesystem::CreateFromFile(
 
 MapfileFilesystem::MapfileFilesystem(const string& mapfile_filename,
                                      off_t num_blocks)
-    : mapfile_filename_(mapfile_filename), num_blocks_(num_blocks) {}
+    : mapfile_filename_(mapfile_filename),
+      num_blocks_(num_blocks),
+      parse_chunk_size_(kParseChunkSize) {}
 
 size_t MapfileFilesystem::GetBlockSize() const {
   return kMapfileBlockSize;
@@ -79,65 +184,72 @@ size_t MapfileFilesystem::GetBlockCount() const {
 bool MapfileFilesystem::GetFiles(vector<File>* files) const {
   files->clear();
 
-  string file_data;
-  if (!base::ReadFileToString(base::FilePath(mapfile_filename_), &file_data)) {
+  const base::FilePath path(mapfile_filename_);
+  int64_t file_size;
+  if (!base::GetFileSize(path, &file_size)) {
     LOG(ERROR) << "Unable to read .map file: " << mapfile_filename_;
     return false;
   }
+  // An empty file can't be mapped, and has no files.
+  if (file_size == 0)
+    return true;
 
-  // Iterate over all the lines in the file and generate one File entry per
-  // line.
-  vector<base::StringPiece> lines = base::SplitStringPiece(
-      file_data, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-  for (const base::StringPiece& line : lines) {
-    File mapped_file;
-
-    mapped_file.extents = {};
-    size_t delim, last_delim = line.size();
-    while ((delim = line.rfind(' ', last_delim - 1)) != string::npos) {
-      string blocks =
-          line.substr(delim + 1, last_delim - (delim + 1)).as_string();
-      size_t dash = blocks.find('-', 0);
-      uint64_t block_start, block_end;
-      if (dash == string::npos && base::StringToUint64(blocks, &block_start)) {
-        mapped_file.extents.push_back(ExtentForRange(block_start, 1));
-      } else if (dash != string::npos &&
-                 base::StringToUint64(blocks.substr(0, dash), &block_start) &&
-                 base::StringToUint64(blocks.substr(dash + 1), &block_end)) {
-        if (block_end < block_start) {
-          LOG(ERROR) << "End block " << block_end
-                     << " is smaller than start block " << block_start
-                     << std::endl
-                     << line;
-          return false;
-        }
-        if (block_end > static_cast<uint64_t>(num_blocks_)) {
-          LOG(ERROR) << "The end block " << block_end
-                     << " is past the end of the file of " << num_blocks_
-                     << " blocks" << std::endl
-                     << line;
-          return false;
-        }
-        mapped_file.extents.push_back(
-            ExtentForRange(block_start, block_end - block_start + 1));
-      } else {
-        // If we can't parse N or N-M, we assume the block is actually part of
-        // the name of the file.
-        break;
-      }
-      last_delim = delim;
-    }
-    // We parsed the blocks from the end of the line, so we need to reverse
-    // the Extents in the file.
-    std::reverse(mapped_file.extents.begin(), mapped_file.extents.end());
-
-    if (last_delim == string::npos)
-      continue;
-    mapped_file.name = line.substr(0, last_delim).as_string();
+  // The .map file is parsed in place, without copying it or its lines.
+  base::MemoryMappedFile mapfile;
+  if (!mapfile.Initialize(path)) {
+    LOG(ERROR) << "Unable to read .map file: " << mapfile_filename_;
+    return false;
+  }
+  const char* data = reinterpret_cast<const char*>(mapfile.data());
+  const char* data_end = data + mapfile.length();
 
-    files->push_back(mapped_file);
+  // Split the file in chunks of whole lines, one File entry per line.
+  vector<const char*> chunk_starts = {data};
+  while (data_end - chunk_starts.back() >
+         static_cast<ptrdiff_t>(parse_chunk_size_)) {
+    const char* boundary = chunk_starts.back() + parse_chunk_size_;
+    const char* newline =
+        static_cast<const char*>(memchr(boundary, '\n', data_end - boundary));
+    if (!newline || newline + 1 == data_end)
+      break;
+    chunk_starts.push_back(newline + 1);
   }
+  chunk_starts.push_back(data_end);
+  const size_t num_chunks = chunk_starts.size() - 1;
+
+  vector<vector<File>> chunk_files(num_chunks);
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<bool> failed{false};
+  auto parse_chunks = [&]() {
+    for (size_t i = next_chunk++; i < num_chunks && !failed;
+         i = next_chunk++) {
+      if (!ParseMapfileChunk(chunk_starts[i],
+                             chunk_starts[i + 1],
+                             i + 1 == num_chunks,
+                             num_blocks_,
+                             &chunk_files[i])) {
+        failed = true;
+      }
+    }
+  };
+  const size_t num_threads = std::min<size_t>(
+      num_chunks,
+      std::clamp(std::thread::hardware_concurrency(), 1u, kMaxParseThreads));
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(parse_chunks);
+  parse_chunks();
+  for (auto& thread : threads)
+    thread.join();
+  if (failed)
+    return false;
 
+  size_t num_files = 0;
+  for (const auto& chunk : chunk_files)
+    num_files += chunk.size();
+  files->reserve(num_files);
+  for (auto& chunk : chunk_files)
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(*files));
   return true;
 }
 
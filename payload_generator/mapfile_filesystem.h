@@ -30,6 +30,8 @@
 #include <string>
 #include <vector>
 
+#include <gtest/gtest_prod.h>  // for FRIEND_TEST
+
 namespace chromeos_update_engine {
 
 class MapfileFilesystem : public FilesystemInterface {
@@ -49,6 +51,8 @@ class MapfileFilesystem : public FilesystemInterface {
   bool LoadSettings(brillo::KeyValueStore* store) const override;
 
  private:
+  FRIEND_TEST(MapfileFilesystemTest, ParsedInSeveralChunksTest);
+
   MapfileFilesystem(const std::string& mapfile_filename, off_t num_blocks);
 
   // The file where the map filesystem is stored.
@@ -57,6 +61,10 @@ class MapfileFilesystem : public FilesystemInterface {
   // The number of blocks in the filesystem.
   off_t num_blocks_;
 
+  // The .map files larger than this are parsed on several threads, in
+  // chunks of about this size.
+  size_t parse_chunk_size_;
+
   DISALLOW_COPY_AND_ASSIGN(MapfileFilesystem);
 };
 
@@ -107,6 +107,37 @@ TEST_F(MapfileFilesystemTest, SeveralFileFormatTest) {
   EXPECT_EQ(map_files["/1234"].extents, (vector<Extent>{ExtentForRange(7, 1)}));
 }
 
+TEST_F(MapfileFilesystemTest, ParsedInSeveralChunksTest) {
+  string text;
+  for (int i = 0; i < 100; i++)
+    text += base::StringPrintf("/file%d %d %d-%d\n", i, i, i + 1, i + 2);
+  test_utils::WriteFileString(temp_mapfile_.path(), text);
+  EXPECT_EQ(0, HANDLE_EINTR(truncate(temp_file_.path().c_str(), 4096 * 102)));
+
+  unique_ptr<MapfileFilesystem> fs = MapfileFilesystem::CreateFromFile(
+      temp_file_.path(), temp_mapfile_.path());
+  ASSERT_NE(nullptr, fs.get());
+  // Chunks end in the middle of the lines.
+  fs->parse_chunk_size_ = 37;
+
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  // The files are in the order of the lines, and the text after the last
+  // newline is an empty entry.
+  ASSERT_EQ(101u, files.size());
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(base::StringPrintf("/file%d", i), files[i].name);
+    EXPECT_EQ(files[i].extents,
+              (vector<Extent>{ExtentForRange(i, 1), ExtentForRange(i + 1, 2)}));
+  }
+  EXPECT_TRUE(files[100].name.empty());
+  EXPECT_TRUE(files[100].extents.empty());
+
+  // An error in any chunk fails the whole parse.
+  test_utils::WriteFileString(temp_mapfile_.path(), text + "/last 200-201");
+  EXPECT_FALSE(fs->GetFiles(&files));
+}
+
 TEST_F(MapfileFilesystemTest, BlockNumberTooBigTest) {
   test_utils::WriteFileString(temp_mapfile_.path(), "/some/file 1-4\n");
   EXPECT_EQ(0, HANDLE_EINTR(truncate(temp_file_.path().c_str(), 4096 * 3)));
@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The images mapped, by path. They're unmapped once their last user is done.
+std::mutex mapped_images_mutex;
+std::map<string, std::weak_ptr<const MappedImage>>* mapped_images = nullptr;
+}  // namespace
+
+MappedImage::~MappedImage() {
+  if (data_)
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+std::shared_ptr<const MappedImage> MappedImage::Get(const string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << path << " for reading.";
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Unable to stat " << path;
+    return nullptr;
+  }
+  // Block devices have no size in |st|.
+  const off_t size = utils::FileSize(fd);
+  if (size <= 0)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(mapped_images_mutex);
+  if (!mapped_images)
+    mapped_images = new std::map<string, std::weak_ptr<const MappedImage>>();
+  std::weak_ptr<const MappedImage>& entry = (*mapped_images)[path];
+  std::shared_ptr<const MappedImage> image = entry.lock();
+  if (image && image->dev_ == st.st_dev && image->ino_ == st.st_ino &&
+      image->size_ == static_cast<size_t>(size) &&
+      image->mtime_.tv_sec == st.st_mtim.tv_sec &&
+      image->mtime_.tv_nsec == st.st_mtim.tv_nsec) {
+    return image;
+  }
+
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map " << path;
+    return nullptr;
+  }
+  std::shared_ptr<MappedImage> new_image(new MappedImage());
+  new_image->data_ = static_cast<const uint8_t*>(data);
+  new_image->size_ = size;
+  new_image->dev_ = st.st_dev;
+  new_image->ino_ = st.st_ino;
+  new_image->mtime_ = st.st_mtim;
+  entry = new_image;
+  return new_image;
+}
+
+bool MappedImage::Contains(uint64_t start_block,
+                           uint64_t num_blocks,
+                           size_t block_size) const {
+  const uint64_t num_image_blocks = size_ / block_size;
+  return start_block <= num_image_blocks &&
+         num_blocks <= num_image_blocks - start_block;
+}
+
+bool MappedImage::ReadExtents(const vector<Extent>& extents,
+                              size_t block_size,
+                              brillo::Blob* out_data) const {
+  out_data->resize(utils::BlocksInExtents(extents) * block_size);
+  uint8_t* out = out_data->data();
+  for (const Extent& extent : extents) {
+    TEST_AND_RETURN_FALSE(
+        Contains(extent.start_block(), extent.num_blocks(), block_size));
+    const size_t length = extent.num_blocks() * block_size;
+    memcpy(out, data_ + extent.start_block() * block_size, length);
+    out += length;
+  }
+  return true;
+}
+
+bool MappedImage::ExtentsEqual(const vector<Extent>& extents,
+                               const MappedImage& other,
+                               const vector<Extent>& other_extents,
+                               size_t block_size) const {
+  if (utils::BlocksInExtents(extents) !=
+      utils::BlocksInExtents(other_extents)) {
+    return false;
+  }
+  for (const Extent& extent : extents) {
+    if (!Contains(extent.start_block(), extent.num_blocks(), block_size))
+      return false;
+  }
+  for (const Extent& extent : other_extents) {
+    if (!other.Contains(extent.start_block(), extent.num_blocks(), block_size))
+      return false;
+  }
+
+  // Walk both lists of extents at once, comparing the runs of blocks that are
+  // contiguous in both images.
+  auto other_it = other_extents.begin();
+  uint64_t other_offset = 0;
+  for (const Extent& extent : extents) {
+    uint64_t offset = 0;
+    while (offset < extent.num_blocks()) {
+      while (other_offset == other_it->num_blocks()) {
+        ++other_it;
+        other_offset = 0;
+      }
+      const uint64_t num_blocks = std::min(
+          extent.num_blocks() - offset, other_it->num_blocks() - other_offset);
+      if (memcmp(data_ + (extent.start_block() + offset) * block_size,
+                 other.data_ +
+                     (other_it->start_block() + other_offset) * block_size,
+                 num_blocks * block_size) != 0) {
+        return false;
+      }
+      offset += num_blocks;
+      other_offset += num_blocks;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
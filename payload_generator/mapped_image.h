@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// MappedImage is a read-only memory mapping of a partition image. All the
+// users of an image share one mapping, and so the pages of the page cache,
+// instead of each reading the blocks they need into buffers of their own.
+class MappedImage {
+ public:
+  ~MappedImage();
+
+  // Returns the mapping of the image |path|, shared with the other users of
+  // the same unchanged file. Returns nullptr if the image can't be mapped,
+  // like when it's empty.
+  static std::shared_ptr<const MappedImage> Get(const std::string& path);
+
+  // Same as utils::ReadExtents(), but copies the data from the mapping.
+  // Returns false if |extents| aren't all in the image.
+  bool ReadExtents(const std::vector<Extent>& extents,
+                   size_t block_size,
+                   brillo::Blob* out_data) const;
+
+  // Returns whether the data of |extents| in this image is the same as the
+  // data of |other_extents| in |other|, comparing the mappings without
+  // copying them.
+  bool ExtentsEqual(const std::vector<Extent>& extents,
+                    const MappedImage& other,
+                    const std::vector<Extent>& other_extents,
+                    size_t block_size) const;
+
+  size_t size() const { return size_; }
+
+ private:
+  MappedImage() = default;
+
+  // Returns whether the |num_blocks| blocks at |start_block| are in the image.
+  bool Contains(uint64_t start_block,
+                uint64_t num_blocks,
+                size_t block_size) const;
+
+  const uint8_t* data_{nullptr};
+  size_t size_{0};
+
+  // Identifies the file that was mapped, to map it again once it changed.
+  dev_t dev_{0};
+  ino_t ino_{0};
+  struct timespec mtime_ {};
+
+  DISALLOW_COPY_AND_ASSIGN(MappedImage);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
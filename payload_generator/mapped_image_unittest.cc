@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+}  // namespace
+
+class MappedImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(8 * kBlockSize);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), data_));
+  }
+
+  brillo::Blob data_;
+  ScopedTempFile image_file_{"MappedImageTest.XXXXXX"};
+};
+
+TEST_F(MappedImageTest, ReadExtentsTest) {
+  auto image = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(data_.size(), image->size());
+  // The users of an image share the mapping.
+  EXPECT_EQ(image, MappedImage::Get(image_file_.path()));
+
+  const vector<Extent> extents = {ExtentForRange(6, 2), ExtentForRange(1, 1)};
+  brillo::Blob read;
+  brillo::Blob expected;
+  EXPECT_TRUE(image->ReadExtents(extents, kBlockSize, &read));
+  EXPECT_TRUE(utils::ReadExtents(
+      image_file_.path(), extents, &expected, 3 * kBlockSize, kBlockSize));
+  EXPECT_EQ(expected, read);
+
+  EXPECT_FALSE(image->ReadExtents({ExtentForRange(7, 2)}, kBlockSize, &read));
+}
+
+TEST_F(MappedImageTest, ExtentsEqualTest) {
+  // The blocks 2 to 4 of the other image are the blocks 5 to 7 of the image.
+  brillo::Blob other_data(data_.begin() + 3 * kBlockSize, data_.end());
+  other_data.insert(
+      other_data.end(), data_.begin(), data_.begin() + 3 * kBlockSize);
+  ScopedTempFile other_file("MappedImageTest_other.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(other_file.path(), other_data));
+
+  auto image = MappedImage::Get(image_file_.path());
+  auto other = MappedImage::Get(other_file.path());
+  ASSERT_NE(nullptr, image);
+  ASSERT_NE(nullptr, other);
+  EXPECT_TRUE(image->ExtentsEqual(
+      {ExtentForRange(5, 3)}, *other, {ExtentForRange(2, 3)}, kBlockSize));
+  // Split differently in each image.
+  EXPECT_TRUE(image->ExtentsEqual({ExtentForRange(5, 1), ExtentForRange(6, 2)},
+                                  *other,
+                                  {ExtentForRange(2, 2), ExtentForRange(4, 1)},
+                                  kBlockSize));
+  EXPECT_FALSE(image->ExtentsEqual(
+      {ExtentForRange(4, 3)}, *other, {ExtentForRange(2, 3)}, kBlockSize));
+  EXPECT_FALSE(image->ExtentsEqual(
+      {ExtentForRange(5, 3)}, *other, {ExtentForRange(2, 2)}, kBlockSize));
+  EXPECT_FALSE(image->ExtentsEqual(
+      {ExtentForRange(5, 3)}, *other, {ExtentForRange(7, 3)}, kBlockSize));
+}
+
+TEST_F(MappedImageTest, MapsChangedFileAgainTest) {
+  auto image = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, image);
+  data_.resize(data_.size() + kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), data_));
+
+  auto new_image = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, new_image);
+  EXPECT_NE(image, new_image);
+  EXPECT_EQ(data_.size(), new_image->size());
+
+  ScopedTempFile empty_file("MappedImageTest_empty.XXXXXX");
+  EXPECT_EQ(nullptr, MappedImage::Get(empty_file.path()));
+}
+
+}  // namespace chromeos_update_engine
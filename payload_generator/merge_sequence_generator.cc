@@ -18,6 +18,9 @@
 
 #include <algorithm>
 #include <limits>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -177,7 +180,8 @@ static bool ProcessCopyOps(std::vector<CowMergeOperation>* sequence,
 }
 
 std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
-    const std::vector<AnnotatedOperation>& aops) {
+    const std::vector<AnnotatedOperation>& aops,
+    const std::vector<Extent>& boot_read_extents) {
   std::vector<CowMergeOperation> sequence;
 
   for (const auto& aop : aops) {
@@ -193,19 +197,24 @@ std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
   }
 
   std::sort(sequence.begin(), sequence.end());
-  return std::unique_ptr<MergeSequenceGenerator>(
+  auto generator = std::unique_ptr<MergeSequenceGenerator>(
       new MergeSequenceGenerator(sequence));
+  generator->boot_read_ranges_.AddExtents(boot_read_extents);
+  return generator;
 }
 
 bool MergeSequenceGenerator::FindDependency(
-    std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) const {
-  CHECK(result);
+    std::vector<std::vector<size_t>>* merge_after) const {
+  CHECK(merge_after);
   LOG(INFO) << "Finding dependencies";
 
-  // Since the OTA operation may reuse some source blocks, use the binary
-  // search on sorted dst extents to find overlaps.
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  for (const auto& op : operations_) {
+  // The dst extents never overlap and |operations_| is sorted by them, so the
+  // operations writing the src extent of another one are a contiguous range
+  // found with a binary search. Since the OTA operation may reuse some source
+  // blocks, several operations can depend on the same one.
+  merge_after->assign(operations_.size(), {});
+  for (size_t i = 0; i < operations_.size(); i++) {
+    const auto& op = operations_[i];
     // lower bound (inclusive): dst extent's end block >= src extent's start
     // block.
     const auto lower_it = std::lower_bound(
@@ -227,136 +236,256 @@ bool MergeSequenceGenerator::FindDependency(
               op.src_extent().start_block() + op.src_extent().num_blocks() - 1;
           return src_end_block < it.dst_extent().start_block();
         });
-
-    // TODO(xunchang) skip inserting the empty set to merge_after.
-    if (lower_it == upper_it) {
-      merge_after.insert({op, {}});
-    } else {
-      std::set<CowMergeOperation> operations(lower_it, upper_it);
-      auto it = operations.find(op);
-      if (it != operations.end()) {
+    auto& dependents = (*merge_after)[i];
+    for (auto it = lower_it; it != upper_it; it++) {
+      const size_t j = it - operations_.begin();
+      if (j == i) {
         LOG(INFO) << "Self overlapping " << op;
-        operations.erase(it);
+        continue;
       }
-      auto ret = merge_after.emplace(op, std::move(operations));
-      // Check the insertion indeed happens.
-      CHECK(ret.second) << op;
+      dependents.push_back(j);
     }
   }
-
-  *result = std::move(merge_after);
   return true;
 }
 
-bool MergeSequenceGenerator::Generate(
-    std::vector<CowMergeOperation>* sequence) const {
-  sequence->clear();
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  if (!FindDependency(&merge_after)) {
-    LOG(ERROR) << "Failed to find dependencies";
-    return false;
+bool MergeSequenceGenerator::FindDependency(
+    std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) const {
+  CHECK(result);
+  std::vector<std::vector<size_t>> merge_after;
+  TEST_AND_RETURN_FALSE(FindDependency(&merge_after));
+  result->clear();
+  for (size_t i = 0; i < operations_.size(); i++) {
+    std::set<CowMergeOperation> operations;
+    for (size_t j : merge_after[i]) {
+      operations.insert(operations_[j]);
+    }
+    auto ret = result->emplace(operations_[i], std::move(operations));
+    // Check the insertion indeed happens.
+    CHECK(ret.second) << operations_[i];
   }
+  return true;
+}
 
-  LOG(INFO) << "Generating sequence";
-
-  // Use the non-DFS version of the topology sort. So we can control the
-  // operations to discard to break cycles; thus yielding a deterministic
-  // sequence.
-  std::map<CowMergeOperation, int> incoming_edges;
-  for (const auto& it : merge_after) {
-    for (const auto& blocked : it.second) {
-      // Value is default initialized to 0.
-      incoming_edges[blocked] += 1;
+std::set<size_t> MergeSequenceGenerator::FindBootOperations(
+    const std::vector<std::vector<size_t>>& merge_after) const {
+  std::set<size_t> boot_operations;
+  if (boot_read_ranges_.blocks() == 0) {
+    return boot_operations;
+  }
+  std::vector<std::vector<size_t>> merge_before(operations_.size());
+  for (size_t i = 0; i < merge_after.size(); i++) {
+    for (size_t j : merge_after[i]) {
+      merge_before[j].push_back(i);
+    }
+  }
+  std::vector<size_t> to_visit;
+  for (size_t i = 0; i < operations_.size(); i++) {
+    if (boot_read_ranges_.OverlapsWithExtent(operations_[i].dst_extent())) {
+      to_visit.push_back(i);
     }
   }
+  while (!to_visit.empty()) {
+    const size_t i = to_visit.back();
+    to_visit.pop_back();
+    if (!boot_operations.insert(i).second) {
+      continue;
+    }
+    to_visit.insert(
+        to_visit.end(), merge_before[i].begin(), merge_before[i].end());
+  }
+  return boot_operations;
+}
 
+bool MergeSequenceGenerator::SortOperations(
+    const std::vector<std::vector<size_t>>& merge_after,
+    std::set<size_t> operations,
+    std::vector<size_t>* incoming_edges,
+    std::set<size_t>* unsorted_operations,
+    std::vector<size_t>* merge_sequence,
+    std::vector<size_t>* convert_to_raw) const {
   // Technically, we can use std::unordered_set or just a std::vector. but
   // std::set gives the benefit where operations are sorted by dst blocks. This
   // will ensure that operations that do not have dependency constraints appear
   // in increasing block order. Such order would help snapuserd batch merges and
   // improve boot time, but isn't strictly needed for correctness.
-  std::set<CowMergeOperation> free_operations;
-  for (const auto& op : operations_) {
-    if (incoming_edges.find(op) == incoming_edges.end()) {
-      free_operations.insert(op);
+  std::set<size_t> free_operations;
+  // Operations still waiting for others to merge.
+  std::set<size_t> blocked_operations;
+  for (size_t i : operations) {
+    if ((*incoming_edges)[i] == 0) {
+      free_operations.insert(i);
+    } else {
+      blocked_operations.insert(i);
     }
   }
 
-  std::vector<CowMergeOperation> merge_sequence;
-  std::set<CowMergeOperation> convert_to_raw;
-  while (!incoming_edges.empty()) {
+  // The free operations are processed even once none is blocked, the
+  // operations sorted later may depend on them.
+  while (!free_operations.empty() || !blocked_operations.empty()) {
     if (!free_operations.empty()) {
-      merge_sequence.insert(
-          merge_sequence.end(), free_operations.begin(), free_operations.end());
+      merge_sequence->insert(merge_sequence->end(),
+                             free_operations.begin(),
+                             free_operations.end());
     } else {
-      auto to_convert = incoming_edges.begin()->first;
+      const size_t to_convert = *blocked_operations.begin();
       free_operations.insert(to_convert);
-      convert_to_raw.insert(to_convert);
-      LOG(INFO) << "Converting operation to raw " << to_convert;
+      convert_to_raw->push_back(to_convert);
+      VLOG(1) << "Converting operation to raw " << operations_[to_convert];
     }
 
-    std::set<CowMergeOperation> next_free_operations;
-    for (const auto& op : free_operations) {
-      incoming_edges.erase(op);
+    std::set<size_t> next_free_operations;
+    for (size_t op : free_operations) {
+      blocked_operations.erase(op);
+      unsorted_operations->erase(op);
 
       // Now that this particular operation is merged, other operations
       // blocked by this one may be free. Decrement the count of blocking
       // operations, and set up the free operations for the next iteration.
-      for (const auto& blocked : merge_after[op]) {
-        auto it = incoming_edges.find(blocked);
-        if (it == incoming_edges.end()) {
+      // The operations sorted later only have their count decremented.
+      for (size_t blocked : merge_after[op]) {
+        if (unsorted_operations->find(blocked) == unsorted_operations->end() ||
+            free_operations.find(blocked) != free_operations.end()) {
           continue;
         }
 
-        auto blocking_transfer_count = &it->second;
-        if (*blocking_transfer_count <= 0) {
+        auto blocking_transfer_count = &(*incoming_edges)[blocked];
+        if (*blocking_transfer_count == 0) {
           LOG(ERROR) << "Unexpected count in merge after map "
-                     << blocking_transfer_count;
+                     << operations_[blocked];
           return false;
         }
         // This operation is no longer blocked by anyone. Add it to the merge
         // sequence in the next iteration.
         *blocking_transfer_count -= 1;
-        if (*blocking_transfer_count == 0) {
+        if (*blocking_transfer_count == 0 &&
+            blocked_operations.find(blocked) != blocked_operations.end()) {
           next_free_operations.insert(blocked);
         }
       }
     }
 
-    LOG(INFO) << "Remaining transfers " << incoming_edges.size()
-              << ", free transfers " << free_operations.size()
-              << ", merge_sequence size " << merge_sequence.size();
+    VLOG(1) << "Remaining transfers " << blocked_operations.size()
+            << ", free transfers " << free_operations.size()
+            << ", merge_sequence size " << merge_sequence->size();
     free_operations = std::move(next_free_operations);
   }
+  return true;
+}
+
+bool MergeSequenceGenerator::Generate(
+    std::vector<CowMergeOperation>* sequence) const {
+  sequence->clear();
+  std::vector<std::vector<size_t>> merge_after;
+  if (!FindDependency(&merge_after)) {
+    LOG(ERROR) << "Failed to find dependencies";
+    return false;
+  }
+
+  LOG(INFO) << "Generating sequence";
+
+  // Use the non-DFS version of the topology sort. So we can control the
+  // operations to discard to break cycles; thus yielding a deterministic
+  // sequence. Operations are referred to by their index in |operations_|,
+  // which is sorted by dst blocks.
+  std::vector<size_t> incoming_edges(operations_.size(), 0);
+  for (const auto& blocked_operations : merge_after) {
+    for (size_t blocked : blocked_operations) {
+      incoming_edges[blocked] += 1;
+    }
+  }
 
-  if (!free_operations.empty()) {
-    merge_sequence.insert(
-        merge_sequence.end(), free_operations.begin(), free_operations.end());
+  std::set<size_t> unsorted_operations;
+  for (size_t i = 0; i < operations_.size(); i++) {
+    unsorted_operations.insert(i);
   }
+  std::vector<size_t> merge_sequence;
+  std::vector<size_t> convert_to_raw;
+  // The blocks read at boot are read through the snapshot until they're
+  // merged. Their operations merge first, after only the operations they
+  // depend on.
+  const std::set<size_t> boot_operations = FindBootOperations(merge_after);
+  if (!boot_operations.empty()) {
+    LOG(INFO) << "Merging first " << boot_operations.size()
+              << " operations for the blocks read at boot";
+    TEST_AND_RETURN_FALSE(SortOperations(merge_after,
+                                         boot_operations,
+                                         &incoming_edges,
+                                         &unsorted_operations,
+                                         &merge_sequence,
+                                         &convert_to_raw));
+  }
+  TEST_AND_RETURN_FALSE(SortOperations(merge_after,
+                                       unsorted_operations,
+                                       &incoming_edges,
+                                       &unsorted_operations,
+                                       &merge_sequence,
+                                       &convert_to_raw));
 
   CHECK_EQ(operations_.size(), merge_sequence.size() + convert_to_raw.size());
 
   size_t blocks_in_sequence = 0;
-  for (const CowMergeOperation& transfer : merge_sequence) {
-    blocks_in_sequence += transfer.dst_extent().num_blocks();
+  std::vector<CowMergeOperation> result;
+  result.reserve(merge_sequence.size());
+  for (size_t i : merge_sequence) {
+    blocks_in_sequence += operations_[i].dst_extent().num_blocks();
+    result.push_back(operations_[i]);
   }
 
   size_t blocks_in_raw = 0;
-  for (const CowMergeOperation& transfer : convert_to_raw) {
-    blocks_in_raw += transfer.dst_extent().num_blocks();
+  for (size_t i : convert_to_raw) {
+    blocks_in_raw += operations_[i].dst_extent().num_blocks();
   }
 
   LOG(INFO) << "Blocks in merge sequence " << blocks_in_sequence
             << ", blocks in raw " << blocks_in_raw;
-  if (!ValidateSequence(merge_sequence)) {
+  if (!ValidateSequence(result)) {
     LOG(ERROR) << "Invalid Sequence";
     return false;
   }
 
-  *sequence = std::move(merge_sequence);
+  *sequence = std::move(result);
   return true;
 }
 
+void SortOperationsByMergeSequence(
+    const std::vector<CowMergeOperation>& sequence,
+    std::vector<AnnotatedOperation>* aops) {
+  // The first block of each dst extent of the sequence, to the end of the
+  // extent and its position in the sequence.
+  std::map<uint64_t, std::pair<uint64_t, size_t>> positions;
+  for (size_t i = 0; i < sequence.size(); i++) {
+    const Extent& extent = sequence[i].dst_extent();
+    positions[extent.start_block()] = {
+        extent.start_block() + extent.num_blocks(), i};
+  }
+  constexpr size_t kNotInSequence = std::numeric_limits<size_t>::max();
+  std::vector<size_t> keys(aops->size(), kNotInSequence);
+  for (size_t i = 0; i < aops->size(); i++) {
+    for (const Extent& extent : (*aops)[i].op.dst_extents()) {
+      const uint64_t end_block = extent.start_block() + extent.num_blocks();
+      auto it = positions.upper_bound(extent.start_block());
+      if (it != positions.begin())
+        --it;
+      for (; it != positions.end() && it->first < end_block; ++it) {
+        if (it->second.first > extent.start_block())
+          keys[i] = std::min(keys[i], it->second.second);
+      }
+    }
+  }
+  std::vector<size_t> order(aops->size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+    return keys[a] < keys[b];
+  });
+  std::vector<AnnotatedOperation> sorted;
+  sorted.reserve(aops->size());
+  for (size_t i : order)
+    sorted.push_back(std::move((*aops)[i]));
+  *aops = std::move(sorted);
+}
+
 bool MergeSequenceGenerator::ValidateSequence(
     const std::vector<CowMergeOperation>& sequence) {
   LOG(INFO) << "Validating merge sequence";
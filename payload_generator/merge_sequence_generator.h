@@ -42,6 +42,14 @@ bool operator==(const CowMergeOperation& op1, const CowMergeOperation& op2);
 std::ostream& operator<<(std::ostream& os,
                          const CowMergeOperation& merge_operation);
 
+// Sorts |aops| so that the operations writing the blocks of the merge
+// |sequence| come first, in the order these blocks are merged, then the other
+// operations in their current order. The COW ops written for the operations
+// are then laid out in the COW device in merge order.
+void SortOperationsByMergeSequence(
+    const std::vector<CowMergeOperation>& sequence,
+    std::vector<AnnotatedOperation>* aops);
+
 // This class takes a list of CowMergeOperations; and sorts them so that no
 // read after write will happen by following the sequence. When there is a
 // cycle, we will omit some operations in the list. Therefore, the result
@@ -49,9 +57,11 @@ std::ostream& operator<<(std::ostream& os,
 class MergeSequenceGenerator {
  public:
   // Creates an object from a list of OTA InstallOperations. Returns nullptr on
-  // failure.
+  // failure. The operations writing |boot_read_extents|, the target blocks
+  // read during the first boot, are merged first.
   static std::unique_ptr<MergeSequenceGenerator> Create(
-      const std::vector<AnnotatedOperation>& aops);
+      const std::vector<AnnotatedOperation>& aops,
+      const std::vector<Extent>& boot_read_extents = {});
   // Checks that no read after write happens in the given sequence.
   static bool ValidateSequence(const std::vector<CowMergeOperation>& sequence);
 
@@ -64,12 +74,36 @@ class MergeSequenceGenerator {
   explicit MergeSequenceGenerator(std::vector<CowMergeOperation> transfers)
       : operations_(std::move(transfers)) {}
 
-  // For a given merge operation, finds all the operations that should merge
-  // after myself. Put the result in |merge_after|.
+  // For each merge operation, finds the indices of all the operations that
+  // should merge after it. Puts the result in |merge_after|, indexed like
+  // |operations_|.
+  bool FindDependency(std::vector<std::vector<size_t>>* merge_after) const;
+  // Same as above, keyed by the operations themselves.
   bool FindDependency(std::map<CowMergeOperation, std::set<CowMergeOperation>>*
                           merge_after) const;
+
+  // Returns the operations writing |boot_read_ranges_|, together with all the
+  // operations they must merge after.
+  std::set<size_t> FindBootOperations(
+      const std::vector<std::vector<size_t>>& merge_after) const;
+
+  // Appends to |merge_sequence| the |operations|, which must not depend on
+  // any operation of |unsorted_operations| but each other, in an order that
+  // follows the |merge_after| dependencies. Cycles are broken by moving
+  // operations to |convert_to_raw| instead. The sorted operations are removed
+  // from |unsorted_operations|, and the count of the operations blocking
+  // each unsorted one in |incoming_edges| is updated.
+  bool SortOperations(const std::vector<std::vector<size_t>>& merge_after,
+                      std::set<size_t> operations,
+                      std::vector<size_t>* incoming_edges,
+                      std::set<size_t>* unsorted_operations,
+                      std::vector<size_t>* merge_sequence,
+                      std::vector<size_t>* convert_to_raw) const;
+
   // The list of CowMergeOperations to sort.
   const std::vector<CowMergeOperation> operations_;
+  // The target blocks read during the first boot.
+  ExtentRanges boot_read_ranges_;
 };
 
 void SplitSelfOverlapping(const Extent& src_extent,
@@ -15,6 +15,8 @@
 //
 
 #include <algorithm>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -215,6 +217,44 @@ TEST_F(MergeSequenceGeneratorTest, GenerateSequenceMultipleCycles) {
   GenerateSequence(transfers, expected);
 }
 
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceBootReadsFirst) {
+  std::vector<AnnotatedOperation> aops{
+      {"file1", {}, {}}, {"file2", {}, {}}, {"file3", {}, {}}};
+  const std::vector<std::pair<uint64_t, uint64_t>> src_dst = {
+      {20, 0}, {40, 10}, {50, 20}};
+  for (size_t i = 0; i < aops.size(); i++) {
+    aops[i].op.set_type(InstallOperation::SOURCE_COPY);
+    *aops[i].op.add_src_extents() = ExtentForRange(src_dst[i].first, 5);
+    *aops[i].op.add_dst_extents() = ExtentForRange(src_dst[i].second, 5);
+  }
+  const std::vector<CowMergeOperation> transfers = {
+      CreateCowMergeOperation(ExtentForRange(20, 5), ExtentForRange(0, 5)),
+      CreateCowMergeOperation(ExtentForRange(40, 5), ExtentForRange(10, 5)),
+      CreateCowMergeOperation(ExtentForRange(50, 5), ExtentForRange(20, 5))};
+
+  std::vector<CowMergeOperation> sequence;
+  auto generator = MergeSequenceGenerator::Create(aops);
+  ASSERT_TRUE(generator);
+  ASSERT_TRUE(generator->Generate(&sequence));
+  EXPECT_EQ(transfers, sequence);
+
+  generator = MergeSequenceGenerator::Create(aops, {ExtentForRange(12, 1)});
+  ASSERT_TRUE(generator);
+  ASSERT_TRUE(generator->Generate(&sequence));
+  EXPECT_EQ((std::vector<CowMergeOperation>{
+                transfers[1], transfers[0], transfers[2]}),
+            sequence);
+
+  // The third operation overwrites the source of the first one, which merges
+  // before it.
+  generator = MergeSequenceGenerator::Create(aops, {ExtentForRange(24, 1)});
+  ASSERT_TRUE(generator);
+  ASSERT_TRUE(generator->Generate(&sequence));
+  EXPECT_EQ((std::vector<CowMergeOperation>{
+                transfers[0], transfers[2], transfers[1]}),
+            sequence);
+}
+
 void ValidateSplitSequence(const Extent& src_extent, const Extent& dst_extent) {
   std::vector<CowMergeOperation> sequence;
   SplitSelfOverlapping(src_extent, dst_extent, &sequence);
@@ -424,4 +464,31 @@ TEST_F(MergeSequenceGeneratorTest, CreateGeneratorXorAlreadyPlusOne) {
   ASSERT_TRUE(generator->ValidateSequence(sequence));
 }
 
+TEST_F(MergeSequenceGeneratorTest, SortOperationsByMergeSequenceTest) {
+  const std::vector<CowMergeOperation> sequence = {
+      CreateCowMergeOperation(ExtentForRange(40, 5), ExtentForRange(20, 5)),
+      CreateCowMergeOperation(ExtentForRange(50, 5), ExtentForRange(0, 5)),
+  };
+  std::vector<AnnotatedOperation> aops;
+  for (const auto& [name, dst_extent] :
+       {std::pair{"replace", ExtentForRange(10, 2)},
+        std::pair{"copy", ExtentForRange(0, 5)},
+        std::pair{"zero", ExtentForRange(30, 1)},
+        std::pair{"diff", ExtentForRange(18, 4)}}) {
+    AnnotatedOperation aop;
+    aop.name = name;
+    *aop.op.add_dst_extents() = dst_extent;
+    aops.push_back(aop);
+  }
+
+  SortOperationsByMergeSequence(sequence, &aops);
+  // The diff writes blocks merged first, the operations merged without a
+  // sequence follow in their order.
+  std::vector<std::string> names;
+  for (const AnnotatedOperation& aop : aops)
+    names.push_back(aop.name);
+  EXPECT_EQ(std::vector<std::string>({"diff", "copy", "replace", "zero"}),
+            names);
+}
+
 }  // namespace chromeos_update_engine
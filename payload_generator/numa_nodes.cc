@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/numa_nodes.h"
+
+#include <sched.h>
+
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+bool ParseCpuList(const string& cpu_list, vector<int>* cpus) {
+  cpus->clear();
+  string trimmed;
+  base::TrimWhitespaceASCII(cpu_list, base::TRIM_ALL, &trimmed);
+  if (trimmed.empty())
+    return true;
+  for (const string& range : base::SplitString(
+           trimmed, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    const size_t dash = range.find('-');
+    unsigned first, last;
+    if (dash == string::npos) {
+      if (!base::StringToUint(range, &first))
+        return false;
+      last = first;
+    } else if (!base::StringToUint(range.substr(0, dash), &first) ||
+               !base::StringToUint(range.substr(dash + 1), &last) ||
+               last < first) {
+      return false;
+    }
+    if (last >= CPU_SETSIZE)
+      return false;
+    for (unsigned cpu = first; cpu <= last; cpu++)
+      cpus->push_back(cpu);
+  }
+  return true;
+}
+
+vector<vector<int>> ReadNumaNodeCpus() {
+  vector<vector<int>> nodes;
+  for (int node = 0;; node++) {
+    const base::FilePath node_dir(
+        base::StringPrintf("/sys/devices/system/node/node%d", node));
+    if (!base::DirectoryExists(node_dir))
+      break;
+    string cpu_list;
+    vector<int> cpus;
+    if (!base::ReadFileToString(node_dir.Append("cpulist"), &cpu_list) ||
+        !ParseCpuList(cpu_list, &cpus)) {
+      LOG(WARNING) << "Unable to read the CPUs of NUMA node " << node;
+      return {};
+    }
+    // The nodes with only memory have no CPUs to run the workers on.
+    if (!cpus.empty())
+      nodes.push_back(std::move(cpus));
+  }
+  return nodes;
+}
+
+bool PinCurrentThreadToCpus(const vector<int>& cpus) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &cpu_set);
+  if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    PLOG(WARNING) << "Unable to set the CPU affinity of the thread";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
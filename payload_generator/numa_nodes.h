@@ -0,0 +1,37 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_NUMA_NODES_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_NUMA_NODES_H_
+
+#include <string>
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// Parses a kernel CPU list like "0-3,8,10-11" into the CPU numbers it lists.
+bool ParseCpuList(const std::string& cpu_list, std::vector<int>* cpus);
+
+// Returns the CPUs of each NUMA node of the host that has any, read from
+// sysfs. Empty if the kernel doesn't report the nodes.
+std::vector<std::vector<int>> ReadNumaNodeCpus();
+
+// Restricts the calling thread to |cpus|. Returns whether it succeeded.
+bool PinCurrentThreadToCpus(const std::vector<int>& cpus);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_NUMA_NODES_H_
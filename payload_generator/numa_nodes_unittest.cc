@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/numa_nodes.h"
+
+#include <sched.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(NumaNodesTest, ParseCpuListTest) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+  EXPECT_TRUE(ParseCpuList("5", &cpus));
+  EXPECT_EQ(vector<int>({5}), cpus);
+  // The nodes without CPUs have an empty list.
+  EXPECT_TRUE(ParseCpuList("\n", &cpus));
+  EXPECT_TRUE(cpus.empty());
+
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("1,,2", &cpus));
+  EXPECT_FALSE(ParseCpuList("a-b", &cpus));
+  EXPECT_FALSE(ParseCpuList("0-100000", &cpus));
+}
+
+TEST(NumaNodesTest, ReadNumaNodeCpusTest) {
+  // Every CPU is in at most one node.
+  vector<bool> seen(CPU_SETSIZE);
+  for (const vector<int>& node : ReadNumaNodeCpus()) {
+    EXPECT_FALSE(node.empty());
+    for (int cpu : node) {
+      EXPECT_FALSE(seen[cpu]);
+      seen[cpu] = true;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
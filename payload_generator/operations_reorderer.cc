@@ -0,0 +1,210 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/operations_reorderer.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+struct OperationCost {
+  // Time spent reading and writing, including |seek|.
+  double io{0};
+  // Time lost seeking.
+  double seek{0};
+  double cpu{0};
+};
+
+bool IsDiffOperation(InstallOperation::Type type) {
+  switch (type) {
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Follows the position of the reads and writes and the time the I/O and the
+// CPU are busy while applying operations in order.
+class InstallSimulator {
+ public:
+  explicit InstallSimulator(const DeviceCostModel& model) : model_(model) {}
+
+  // Returns the cost of |op| if it was applied next.
+  OperationCost Cost(const InstallOperation& op) const {
+    OperationCost cost;
+    uint64_t read_position = read_position_;
+    AddExtentsCost(op.src_extents(),
+                   model_.read_bytes_per_second,
+                   true,
+                   &read_position,
+                   &cost);
+    const uint64_t bytes =
+        utils::BlocksInExtents(op.dst_extents()) * kBlockSize;
+    if (op.type() != InstallOperation::DISCARD) {
+      uint64_t write_position = write_position_;
+      AddExtentsCost(op.dst_extents(),
+                     model_.write_bytes_per_second,
+                     !model_.sequential_writes,
+                     &write_position,
+                     &cost);
+    }
+    if (op.type() == InstallOperation::REPLACE_BZ ||
+        op.type() == InstallOperation::REPLACE_XZ ||
+        op.type() == InstallOperation::REPLACE_ZSTD) {
+      cost.cpu = bytes / model_.decompress_bytes_per_second;
+    } else if (IsDiffOperation(op.type())) {
+      cost.cpu = bytes / model_.patch_bytes_per_second;
+    }
+    return cost;
+  }
+
+  // Returns the time to apply all the operations so far and one more of the
+  // given |cost|.
+  double TimeWith(const OperationCost& cost) const {
+    const double io_clock = io_clock_ + cost.io;
+    return std::max(io_clock, std::max(cpu_clock_, io_clock) + cost.cpu);
+  }
+
+  double time() const { return std::max(io_clock_, cpu_clock_); }
+
+  void Apply(const InstallOperation& op) {
+    const OperationCost cost = Cost(op);
+    io_clock_ += cost.io;
+    cpu_clock_ = std::max(cpu_clock_, io_clock_) + cost.cpu;
+    if (!op.src_extents().empty()) {
+      const Extent& last = *op.src_extents().rbegin();
+      read_position_ = last.start_block() + last.num_blocks();
+    }
+    if (!op.dst_extents().empty() && op.type() != InstallOperation::DISCARD) {
+      const Extent& last = *op.dst_extents().rbegin();
+      write_position_ = last.start_block() + last.num_blocks();
+    }
+  }
+
+ private:
+  void AddExtentsCost(const RepeatedPtrField<Extent>& extents,
+                      double bytes_per_second,
+                      bool seeks,
+                      uint64_t* position,
+                      OperationCost* cost) const {
+    for (const Extent& extent : extents) {
+      if (seeks && extent.start_block() != *position) {
+        cost->io += model_.seek_seconds;
+        cost->seek += model_.seek_seconds;
+      }
+      cost->io += extent.num_blocks() * kBlockSize / bytes_per_second;
+      *position = extent.start_block() + extent.num_blocks();
+    }
+  }
+
+  const DeviceCostModel& model_;
+  // The first read and write always seek.
+  uint64_t read_position_{std::numeric_limits<uint64_t>::max()};
+  uint64_t write_position_{std::numeric_limits<uint64_t>::max()};
+  double io_clock_{0};
+  double cpu_clock_{0};
+};
+
+}  // namespace
+
+double EstimateInstallTime(const vector<AnnotatedOperation>& aops,
+                           const DeviceCostModel& model) {
+  InstallSimulator simulator(model);
+  for (const AnnotatedOperation& aop : aops)
+    simulator.Apply(aop.op);
+  return simulator.time();
+}
+
+void ReorderOperations(vector<AnnotatedOperation>* aops,
+                       const DeviceCostModel& model) {
+  // The copies and the diffs are each taken in the order of their source, the
+  // operations without a source in their current order. Each step picks the
+  // first operation of one of these queues, the one that makes the install
+  // the least longer for the work it does: one continuing the previous read,
+  // or one using the I/O or the CPU while the other is still busy.
+  vector<vector<size_t>> queues(3);
+  for (size_t i = 0; i < aops->size(); i++) {
+    const InstallOperation& op = (*aops)[i].op;
+    if (op.src_extents().empty())
+      queues[2].push_back(i);
+    else
+      queues[IsDiffOperation(op.type()) ? 1 : 0].push_back(i);
+  }
+  for (size_t q = 0; q < 2; q++) {
+    std::stable_sort(
+        queues[q].begin(), queues[q].end(), [aops](size_t a, size_t b) {
+          return (*aops)[a].op.src_extents(0).start_block() <
+                 (*aops)[b].op.src_extents(0).start_block();
+        });
+  }
+
+  InstallSimulator simulator(model);
+  vector<size_t> next(queues.size(), 0);
+  vector<AnnotatedOperation> reordered;
+  reordered.reserve(aops->size());
+  while (reordered.size() < aops->size()) {
+    size_t best_queue = queues.size();
+    double best_ratio = std::numeric_limits<double>::max();
+    for (size_t q = 0; q < queues.size(); q++) {
+      if (next[q] == queues[q].size())
+        continue;
+      const InstallOperation& op = (*aops)[queues[q][next[q]]].op;
+      const OperationCost cost = simulator.Cost(op);
+      const double work = cost.io - cost.seek + cost.cpu;
+      const double added = simulator.TimeWith(cost) - simulator.time();
+      const double ratio = work > 0 ? added / work : 0;
+      if (ratio < best_ratio) {
+        best_ratio = ratio;
+        best_queue = q;
+      }
+    }
+    const AnnotatedOperation& aop =
+        (*aops)[queues[best_queue][next[best_queue]++]];
+    simulator.Apply(aop.op);
+    reordered.push_back(aop);
+  }
+
+  const double old_time = EstimateInstallTime(*aops, model);
+  const double new_time = simulator.time();
+  if (new_time >= old_time) {
+    LOG(INFO) << "Keeping the order of the operations, estimated to install "
+              << "in " << old_time << "s against " << new_time << "s.";
+    return;
+  }
+  LOG(INFO) << "Reordered the operations, the estimated install time went "
+            << "from " << old_time << "s to " << new_time << "s.";
+  *aops = std::move(reordered);
+}
+
+}  // namespace chromeos_update_engine
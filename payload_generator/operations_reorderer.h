@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_OPERATIONS_REORDERER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_OPERATIONS_REORDERER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+
+namespace chromeos_update_engine {
+
+// A rough model of the time a device takes to apply the operations of a
+// partition. The defaults are those of a slow eMMC device.
+struct DeviceCostModel {
+  // Time lost by a read or a write that doesn't continue the previous one.
+  double seek_seconds = 0.0005;
+  double read_bytes_per_second = 200.0 * 1024 * 1024;
+  double write_bytes_per_second = 80.0 * 1024 * 1024;
+  // Speed of the REPLACE_BZ, REPLACE_XZ and REPLACE_ZSTD decompression, per
+  // byte written.
+  double decompress_bytes_per_second = 60.0 * 1024 * 1024;
+  // Speed of the diff operations, per byte written.
+  double patch_bytes_per_second = 20.0 * 1024 * 1024;
+  // Virtual A/B compression appends every write to the COW device, so the
+  // writes never seek.
+  bool sequential_writes = false;
+};
+
+// Returns the estimated time, in seconds, to apply |aops| in that order. The
+// reads and writes of one operation overlap the CPU work of the previous ones,
+// as they do when the client applies operations on several threads.
+double EstimateInstallTime(const std::vector<AnnotatedOperation>& aops,
+                           const DeviceCostModel& model);
+
+// Reorders the A/B operations |aops| of a partition so that more source reads
+// are sequential and the diff operations, limited by the CPU, are interleaved
+// with the copies, limited by the I/O. The operations read the source
+// partition and write the target one, which don't share any block, so any
+// order gives the same result; the Virtual A/B merge sequence is generated
+// from the operations regardless of their order. |aops| is left unchanged if
+// the new order isn't estimated to be faster.
+void ReorderOperations(std::vector<AnnotatedOperation>* aops,
+                       const DeviceCostModel& model);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_OPERATIONS_REORDERER_H_
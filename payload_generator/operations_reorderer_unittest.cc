@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/operations_reorderer.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+AnnotatedOperation MakeOperation(const string& name,
+                                 InstallOperation::Type type,
+                                 const Extent& src_extent,
+                                 const Extent& dst_extent) {
+  AnnotatedOperation aop;
+  aop.name = name;
+  aop.op.set_type(type);
+  if (src_extent.num_blocks())
+    *aop.op.add_src_extents() = src_extent;
+  *aop.op.add_dst_extents() = dst_extent;
+  return aop;
+}
+
+vector<string> Names(const vector<AnnotatedOperation>& aops) {
+  vector<string> names;
+  for (const AnnotatedOperation& aop : aops)
+    names.push_back(aop.name);
+  return names;
+}
+}  // namespace
+
+class OperationsReordererTest : public ::testing::Test {
+ protected:
+  // Only the reads seek, to tell what the reordering does with them.
+  const DeviceCostModel model_{.sequential_writes = true};
+};
+
+TEST_F(OperationsReordererTest, EstimateInstallTimeTest) {
+  const vector<AnnotatedOperation> sequential = {
+      MakeOperation("a",
+                    InstallOperation::SOURCE_COPY,
+                    ExtentForRange(0, 1),
+                    ExtentForRange(0, 1)),
+      MakeOperation("b",
+                    InstallOperation::SOURCE_COPY,
+                    ExtentForRange(1, 1),
+                    ExtentForRange(1, 1))};
+  vector<AnnotatedOperation> random = sequential;
+  random[1].op.mutable_src_extents(0)->set_start_block(5);
+  EXPECT_NEAR(model_.seek_seconds,
+              EstimateInstallTime(random, model_) -
+                  EstimateInstallTime(sequential, model_),
+              1e-9);
+
+  // Without sequential writes, writing the blocks backwards seeks too.
+  DeviceCostModel model;
+  vector<AnnotatedOperation> backwards = sequential;
+  std::swap(backwards[0], backwards[1]);
+  EXPECT_NEAR(2 * model.seek_seconds,
+              EstimateInstallTime(backwards, model) -
+                  EstimateInstallTime(sequential, model),
+              1e-9);
+}
+
+TEST_F(OperationsReordererTest, ReadsSourceSequentiallyTest) {
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 4; i++) {
+    aops.push_back(MakeOperation(std::to_string(i),
+                                 InstallOperation::SOURCE_COPY,
+                                 ExtentForRange(3 - i, 1),
+                                 ExtentForRange(i, 1)));
+  }
+  const double old_time = EstimateInstallTime(aops, model_);
+  ReorderOperations(&aops, model_);
+  EXPECT_EQ(vector<string>({"3", "2", "1", "0"}), Names(aops));
+  EXPECT_NEAR(old_time - 3 * model_.seek_seconds,
+              EstimateInstallTime(aops, model_),
+              1e-9);
+}
+
+TEST_F(OperationsReordererTest, InterleavesDiffsAndCopiesTest) {
+  // 1 MiB each, the diffs take long to apply.
+  vector<AnnotatedOperation> aops = {
+      MakeOperation("copy1",
+                    InstallOperation::SOURCE_COPY,
+                    ExtentForRange(512, 256),
+                    ExtentForRange(0, 256)),
+      MakeOperation("copy2",
+                    InstallOperation::SOURCE_COPY,
+                    ExtentForRange(768, 256),
+                    ExtentForRange(256, 256)),
+      MakeOperation("diff1",
+                    InstallOperation::SOURCE_BSDIFF,
+                    ExtentForRange(0, 256),
+                    ExtentForRange(512, 256)),
+      MakeOperation("diff2",
+                    InstallOperation::SOURCE_BSDIFF,
+                    ExtentForRange(256, 256),
+                    ExtentForRange(768, 256)),
+  };
+  const double old_time = EstimateInstallTime(aops, model_);
+  ReorderOperations(&aops, model_);
+  // The copies are read while the first diff is applied.
+  EXPECT_EQ(vector<string>({"diff1", "copy1", "copy2", "diff2"}), Names(aops));
+  EXPECT_LT(EstimateInstallTime(aops, model_), old_time);
+}
+
+TEST_F(OperationsReordererTest, KeepsOrderIfNotFasterTest) {
+  vector<AnnotatedOperation> aops = {
+      MakeOperation("copy",
+                    InstallOperation::SOURCE_COPY,
+                    ExtentForRange(0, 4),
+                    ExtentForRange(0, 4)),
+      MakeOperation(
+          "replace", InstallOperation::REPLACE, {}, ExtentForRange(4, 4)),
+      MakeOperation("zero", InstallOperation::ZERO, {}, ExtentForRange(8, 4)),
+  };
+  const vector<AnnotatedOperation> original = aops;
+  ReorderOperations(&aops, model_);
+  EXPECT_EQ(Names(original), Names(aops));
+}
+
+}  // namespace chromeos_update_engine
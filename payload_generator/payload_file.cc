@@ -17,20 +17,30 @@
 #include "update_engine/payload_generator/payload_file.h"
 
 #include <endian.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 
 #include <algorithm>
 #include <map>
+#include <optional>
+#include <set>
+#include <tuple>
 #include <utility>
 
+#include <base/files/file_path.h>
 #include <base/strings/stringprintf.h>
+#include <brillo/key_value_store.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::string;
 using std::vector;
@@ -50,6 +60,9 @@ struct DeltaObject {
   off_t size;
 };
 
+// The granularity of the disk space released from the data blobs files.
+constexpr uint64_t kFreedBlockSize = 4096;
+
 // Writes the uint64_t passed in in host-endian to the file as big-endian.
 // Returns true on success.
 bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
@@ -63,6 +76,17 @@ bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   TEST_AND_RETURN_FALSE(config.version.Validate());
   major_version_ = config.version.major;
+  free_blobs_while_writing_ = config.free_blobs_while_writing;
+  payload_chunk_size_ = config.payload_chunk_size;
+  add_operation_dst_hashes_ = config.add_operation_dst_hashes;
+  add_operation_cost_hints_ = config.add_operation_cost_hints;
+  if (!config.cost_hints_device_profile.empty()) {
+    brillo::KeyValueStore store;
+    TEST_AND_RETURN_FALSE(
+        store.Load(base::FilePath(config.cost_hints_device_profile)));
+    cost_hints_profile_ = std::make_unique<DeviceProfile>();
+    TEST_AND_RETURN_FALSE(cost_hints_profile_->Load(store));
+  }
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
   manifest_.set_max_timestamp(config.max_timestamp);
@@ -98,15 +122,26 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
                                const PartitionConfig& new_conf,
                                vector<AnnotatedOperation> aops,
                                vector<CowMergeOperation> merge_sequence,
-                               size_t cow_size) {
+                               size_t cow_size,
+                               brillo::Blob zstd_dictionary) {
   Partition part;
   part.cow_size = cow_size;
+  part.zstd_dictionary = std::move(zstd_dictionary);
   part.name = new_conf.name;
   part.aops = std::move(aops);
+  if (add_operation_dst_hashes_)
+    TEST_AND_RETURN_FALSE(AddOperationDstHashes(new_conf.path, &part.aops));
+  if (add_operation_cost_hints_) {
+    for (AnnotatedOperation& aop : part.aops) {
+      *aop.op.mutable_cost_hint() = EstimateOperationCost(
+          aop.op, manifest_.block_size(), cost_hints_profile_.get());
+    }
+  }
   part.cow_merge_sequence = std::move(merge_sequence);
   part.postinstall = new_conf.postinstall;
   part.verity = new_conf.verity;
   part.version = new_conf.version;
+  part.old_verity_root_digest = old_conf.verity_root_digest;
   // Initialize the PartitionInfo objects if present.
   if (!old_conf.path.empty())
     TEST_AND_RETURN_FALSE(
@@ -122,16 +157,20 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
   // Reorder the data blobs with the manifest_.
-  ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
-  TEST_AND_RETURN_FALSE(
-      ReorderDataBlobs(data_blobs_path, ordered_blobs_file.path()));
+  vector<BlobRange> blob_ranges;
+  TEST_AND_RETURN_FALSE(ReorderDataBlobs(data_blobs_path, &blob_ranges));
 
-  // Check that install op blobs are in order.
+  // Check that install op blobs are in order. An operation may also use the
+  // blob of a previous operation.
   uint64_t next_blob_offset = 0;
   for (const auto& part : part_vec_) {
     for (const auto& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
+      if (aop.op.data_offset() < next_blob_offset &&
+          aop.op.data_offset() + aop.op.data_length() <= next_blob_offset) {
+        continue;
+      }
       if (aop.op.data_offset() != next_blob_offset) {
         LOG(FATAL) << "bad blob offset! " << aop.op.data_offset()
                    << " != " << next_blob_offset;
@@ -151,6 +190,10 @@ bool PayloadFile::WritePayload(const string& payload_file,
     if (part.cow_size > 0) {
       partition->set_estimate_cow_size(part.cow_size);
     }
+    if (!part.zstd_dictionary.empty()) {
+      partition->set_zstd_dictionary(part.zstd_dictionary.data(),
+                                     part.zstd_dictionary.size());
+    }
     if (part.postinstall.run) {
       partition->set_run_postinstall(true);
       if (!part.postinstall.path.empty())
@@ -158,6 +201,8 @@ bool PayloadFile::WritePayload(const string& payload_file,
       if (!part.postinstall.filesystem_type.empty())
         partition->set_filesystem_type(part.postinstall.filesystem_type);
       partition->set_postinstall_optional(part.postinstall.optional);
+      for (const auto& name : part.postinstall.depends_on)
+        partition->add_postinstall_depends_on(name);
     }
     if (!part.verity.IsEmpty()) {
       if (part.verity.hash_tree_extent.num_blocks() != 0) {
@@ -175,8 +220,13 @@ bool PayloadFile::WritePayload(const string& payload_file,
         partition->set_fec_roots(part.verity.fec_roots);
       }
     }
+    const bool pack_extents =
+        manifest_.minor_version() >= kPackedExtentsMinorPayloadVersion;
     for (const AnnotatedOperation& aop : part.aops) {
-      *partition->add_operations() = aop.op;
+      InstallOperation* operation = partition->add_operations();
+      *operation = aop.op;
+      if (pack_extents)
+        PackOperationExtents(operation);
     }
     for (const auto& merge_op : part.cow_merge_sequence) {
       *partition->add_merge_operations() = merge_op;
@@ -184,10 +234,23 @@ bool PayloadFile::WritePayload(const string& payload_file,
 
     if (part.old_info.has_size() || part.old_info.has_hash())
       *(partition->mutable_old_partition_info()) = part.old_info;
+    if (!part.old_verity_root_digest.empty()) {
+      partition->set_old_verity_root_digest(part.old_verity_root_digest.data(),
+                                            part.old_verity_root_digest.size());
+    }
     if (part.new_info.has_size() || part.new_info.has_hash())
       *(partition->mutable_new_partition_info()) = part.new_info;
   }
 
+  if (payload_chunk_size_ > 0) {
+    manifest_.set_payload_chunk_size(payload_chunk_size_);
+    TEST_AND_RETURN_FALSE(
+        HashDataBlobChunks({data_blobs_path},
+                           blob_ranges,
+                           payload_chunk_size_,
+                           manifest_.mutable_payload_chunk_hashes()));
+  }
+
   // Signatures appear at the end of the blobs. Note the offset in the
   // |manifest_|.
   uint64_t signature_blob_length = 0;
@@ -197,12 +260,14 @@ bool PayloadFile::WritePayload(const string& payload_file,
     PayloadSigner::AddSignatureToManifest(
         next_blob_offset, signature_blob_length, &manifest_);
   }
-  WritePayload(payload_file,
-               ordered_blobs_file.path(),
-               private_key_path,
-               major_version_,
-               manifest_,
-               metadata_size_out);
+  TEST_AND_RETURN_FALSE(WritePayload(payload_file,
+                                     {data_blobs_path},
+                                     blob_ranges,
+                                     private_key_path,
+                                     major_version_,
+                                     manifest_,
+                                     metadata_size_out,
+                                     free_blobs_while_writing_));
 
   ReportPayloadUsage(*metadata_size_out);
   return true;
@@ -214,9 +279,127 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                uint64_t major_version_,
                                const DeltaArchiveManifest& manifest,
                                uint64_t* metadata_size_out) {
-  std::string serialized_manifest;
+  const off_t blobs_size = utils::FileSize(ordered_blobs_file);
+  TEST_AND_RETURN_FALSE(blobs_size >= 0);
+  vector<BlobRange> blob_ranges;
+  if (blobs_size > 0)
+    blob_ranges.push_back({0, static_cast<uint64_t>(blobs_size)});
+  return WritePayload(payload_file,
+                      {ordered_blobs_file},
+                      blob_ranges,
+                      private_key_path,
+                      major_version_,
+                      manifest,
+                      metadata_size_out);
+}
 
-  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
+vector<PayloadFile::BlobRange> PayloadFile::GetReleasableRanges(
+    const vector<BlobRange>& blob_ranges) {
+  vector<size_t> sorted(blob_ranges.size());
+  for (size_t i = 0; i < sorted.size(); i++)
+    sorted[i] = i;
+  std::sort(sorted.begin(), sorted.end(), [&blob_ranges](size_t a, size_t b) {
+    return std::tie(blob_ranges[a].file, blob_ranges[a].offset) <
+           std::tie(blob_ranges[b].file, blob_ranges[b].offset);
+  });
+
+  // The overlapping ranges are released together, after the last of them.
+  vector<BlobRange> releasable(blob_ranges.size(), BlobRange{0, 0});
+  for (size_t i = 0; i < sorted.size();) {
+    const BlobRange& first = blob_ranges[sorted[i]];
+    uint64_t end = first.offset + first.length;
+    size_t last_use = sorted[i];
+    for (i++; i < sorted.size(); i++) {
+      const BlobRange& range = blob_ranges[sorted[i]];
+      if (range.file != first.file || range.offset >= end)
+        break;
+      end = std::max(end, range.offset + range.length);
+      last_use = std::max(last_use, sorted[i]);
+    }
+    releasable[last_use] = {first.offset, end - first.offset, first.file};
+  }
+  return releasable;
+}
+
+bool PayloadFile::HashDataBlobChunks(const vector<string>& blobs_files,
+                                     const vector<BlobRange>& blob_ranges,
+                                     uint64_t chunk_size,
+                                     string* out_hashes) {
+  TEST_AND_RETURN_FALSE(chunk_size > 0);
+  out_hashes->clear();
+  vector<int> blobs_fds;
+  DEFER {
+    for (int fd : blobs_fds)
+      close(fd);
+  };
+  for (const string& blobs_file : blobs_files) {
+    const int fd = open(blobs_file.c_str(), O_RDONLY);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    blobs_fds.push_back(fd);
+  }
+  std::optional<HashCalculator> chunk_hash;
+  uint64_t chunk_offset = 0;
+  auto finish_chunk = [&chunk_hash, &chunk_offset, out_hashes]() {
+    TEST_AND_RETURN_FALSE(chunk_hash->Finalize());
+    const brillo::Blob& hash = chunk_hash->raw_hash();
+    out_hashes->append(hash.begin(), hash.end());
+    chunk_hash.reset();
+    chunk_offset = 0;
+    return true;
+  };
+  brillo::Blob buf(std::min<uint64_t>(chunk_size, 1024 * 1024));
+  for (const BlobRange& range : blob_ranges) {
+    TEST_AND_RETURN_FALSE(range.file < blobs_fds.size());
+    uint64_t offset = range.offset;
+    uint64_t remaining = range.length;
+    while (remaining > 0) {
+      if (!chunk_hash)
+        chunk_hash.emplace();
+      const size_t count = std::min<uint64_t>(
+          {remaining, buf.size(), chunk_size - chunk_offset});
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          blobs_fds[range.file], buf.data(), count, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+      TEST_AND_RETURN_FALSE(chunk_hash->Update(buf.data(), count));
+      offset += count;
+      remaining -= count;
+      chunk_offset += count;
+      if (chunk_offset == chunk_size)
+        TEST_AND_RETURN_FALSE(finish_chunk());
+    }
+  }
+  if (chunk_hash)
+    TEST_AND_RETURN_FALSE(finish_chunk());
+  return true;
+}
+
+bool PayloadFile::SerializeManifest(const DeltaArchiveManifest& manifest,
+                                    uint64_t major_version,
+                                    string* out) {
+  TEST_AND_RETURN_FALSE(manifest.SerializeToString(out));
+  if (major_version < kCompressedManifestMajorPayloadVersion)
+    return true;
+  brillo::Blob compressed;
+  TEST_AND_RETURN_FALSE(
+      ZstdCompress(brillo::Blob(out->begin(), out->end()), &compressed));
+  LOG(INFO) << "Compressed the manifest from " << out->size() << " to "
+            << compressed.size() << " bytes.";
+  out->assign(compressed.begin(), compressed.end());
+  return true;
+}
+
+bool PayloadFile::WritePayload(const std::string& payload_file,
+                               const vector<string>& blobs_files,
+                               const vector<BlobRange>& blob_ranges,
+                               const std::string& private_key_path,
+                               uint64_t major_version_,
+                               const DeltaArchiveManifest& manifest,
+                               uint64_t* metadata_size_out,
+                               bool free_blobs) {
+  std::string serialized_manifest;
+  TEST_AND_RETURN_FALSE(
+      SerializeManifest(manifest, major_version_, &serialized_manifest));
   uint64_t metadata_size =
       sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
   LOG(INFO) << "Writing final delta file header...";
@@ -269,18 +452,54 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
 
   // Append the data blobs.
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
+  vector<int> blobs_fds;
+  DEFER {
+    for (int fd : blobs_fds)
+      close(fd);
+  };
+  for (const string& blobs_file : blobs_files) {
+    const int fd = open(blobs_file.c_str(), free_blobs ? O_RDWR : O_RDONLY, 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+    blobs_fds.push_back(fd);
+  }
+  vector<BlobRange> releasable_ranges;
+  if (free_blobs)
+    releasable_ranges = GetReleasableRanges(blob_ranges);
+  for (size_t i = 0; i < blob_ranges.size(); i++) {
+    const BlobRange& range = blob_ranges[i];
+    TEST_AND_RETURN_FALSE(range.file < blobs_fds.size());
+    const int blobs_fd = blobs_fds[range.file];
+    // The blobs are copied by the kernel, without going through user space.
+    off_t offset = range.offset;
+    uint64_t remaining = range.length;
+    while (remaining > 0) {
+      constexpr uint64_t kMaxSendfileSize = 1 << 30;
+      const ssize_t rc = sendfile(writer.fd(),
+                                  blobs_fd,
+                                  &offset,
+                                  std::min(remaining, kMaxSendfileSize));
+      TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+      remaining -= rc;
+    }
+    if (free_blobs && releasable_ranges[i].length > 0) {
+      // Only the blocks entirely in the range are released, the others may
+      // hold the blobs of other ranges.
+      const BlobRange& released = releasable_ranges[i];
+      const uint64_t start =
+          (released.offset + kFreedBlockSize - 1) / kFreedBlockSize *
+          kFreedBlockSize;
+      const uint64_t end = (released.offset + released.length) /
+                           kFreedBlockSize * kFreedBlockSize;
+      if (start < end &&
+          fallocate(blobs_fd,
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    start,
+                    end - start) != 0) {
+        PLOG(WARNING) << "Failed to release the copied data blobs, keeping "
+                      << "them.";
+        free_blobs = false;
+      }
     }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
   }
   // Write payload signature blob.
   if (!private_key_path.empty()) {
@@ -302,39 +521,178 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   return true;
 }
 
+bool PayloadFile::MergePartialPayloads(
+    const vector<string>& partial_payload_paths,
+    const string& payload_file,
+    const string& private_key_path,
+    uint64_t* metadata_size_out) {
+  TEST_AND_RETURN_FALSE(!partial_payload_paths.empty());
+  DeltaArchiveManifest manifest;
+  string common_fields;
+  uint64_t major_version = 0;
+  std::set<string> partition_names;
+  vector<BlobRange> blob_ranges;
+  uint64_t next_blob_offset = 0;
+  for (size_t i = 0; i < partial_payload_paths.size(); i++) {
+    const string& path = partial_payload_paths[i];
+    PayloadMetadata payload_metadata;
+    DeltaArchiveManifest partial_manifest;
+    TEST_AND_RETURN_FALSE(
+        payload_metadata.ParsePayloadFile(path, &partial_manifest, nullptr));
+    if (partial_manifest.has_signatures_offset()) {
+      LOG(ERROR) << "Partial payload " << path << " is signed.";
+      return false;
+    }
+
+    // The blobs of the partial payload follow the operations, the offsets of
+    // which are made relative to the blobs of all the partial payloads.
+    const uint64_t blobs_offset = payload_metadata.GetMetadataSize() +
+                                  payload_metadata.GetMetadataSignatureSize();
+    uint64_t blobs_length = 0;
+    for (PartitionUpdate& partition : *partial_manifest.mutable_partitions()) {
+      if (!partition_names.insert(partition.partition_name()).second) {
+        LOG(ERROR) << "Partition " << partition.partition_name()
+                   << " is in more than one partial payload.";
+        return false;
+      }
+      for (InstallOperation& op : *partition.mutable_operations()) {
+        if (!op.has_data_offset())
+          continue;
+        // The blob may be shared with a previous operation.
+        const bool shared = op.data_offset() < blobs_length &&
+                            op.data_offset() + op.data_length() <= blobs_length;
+        TEST_AND_RETURN_FALSE(shared || op.data_offset() == blobs_length);
+        op.set_data_offset(next_blob_offset + op.data_offset());
+        if (!shared)
+          blobs_length += op.data_length();
+      }
+    }
+    const off_t partial_payload_size = utils::FileSize(path);
+    TEST_AND_RETURN_FALSE(partial_payload_size >= 0);
+    TEST_AND_RETURN_FALSE(blobs_offset + blobs_length <=
+                          static_cast<uint64_t>(partial_payload_size));
+    if (blobs_length > 0)
+      blob_ranges.push_back({blobs_offset, blobs_length, i});
+    next_blob_offset += blobs_length;
+
+    // Everything but the partitions comes from the same options, so it must
+    // be the same in all the partial payloads.
+    DeltaArchiveManifest partitions_manifest;
+    partitions_manifest.mutable_partitions()->Swap(
+        partial_manifest.mutable_partitions());
+    // The chunks are hashed again over the blobs of all the payloads.
+    partial_manifest.clear_payload_chunk_hashes();
+    string partial_common_fields;
+    TEST_AND_RETURN_FALSE(
+        partial_manifest.SerializeToString(&partial_common_fields));
+    if (i == 0) {
+      major_version = payload_metadata.GetMajorVersion();
+      common_fields = std::move(partial_common_fields);
+      manifest = std::move(partial_manifest);
+    } else if (payload_metadata.GetMajorVersion() != major_version ||
+               partial_common_fields != common_fields) {
+      LOG(ERROR) << "Partial payload " << path << " wasn't generated with the "
+                 << "same options as " << partial_payload_paths[0];
+      return false;
+    }
+    for (PartitionUpdate& partition :
+         *partitions_manifest.mutable_partitions()) {
+      *manifest.add_partitions() = std::move(partition);
+    }
+  }
+
+  if (manifest.payload_chunk_size() > 0) {
+    TEST_AND_RETURN_FALSE(
+        HashDataBlobChunks(partial_payload_paths,
+                           blob_ranges,
+                           manifest.payload_chunk_size(),
+                           manifest.mutable_payload_chunk_hashes()));
+  }
+  if (!private_key_path.empty()) {
+    uint64_t signature_blob_length = 0;
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignatureBlobLength(
+        {private_key_path}, &signature_blob_length));
+    PayloadSigner::AddSignatureToManifest(
+        next_blob_offset, signature_blob_length, &manifest);
+  }
+  // ParsePayloadFile() unpacked the extents.
+  PackManifestExtents(&manifest);
+  LOG(INFO) << "Merging " << partial_payload_paths.size()
+            << " partial payloads with " << manifest.partitions_size()
+            << " partitions...";
+  return WritePayload(payload_file,
+                      partial_payload_paths,
+                      blob_ranges,
+                      private_key_path,
+                      major_version,
+                      manifest,
+                      metadata_size_out);
+}
+
 bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
-                                   const string& new_data_blobs_path) {
+                                   vector<BlobRange>* blob_ranges) {
   int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  DirectFileWriter writer;
-  int rc = writer.Open(
-      new_data_blobs_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
-  if (rc != 0) {
-    PLOG(ERROR) << "Error creating " << new_data_blobs_path;
-    return false;
-  }
-  ScopedFileWriterCloser writer_closer(&writer);
+  blob_ranges->clear();
   uint64_t out_file_size = 0;
-
+  brillo::Blob buf;
+  // The payload offset and the index of the first operation of the blobs
+  // written so far, by hash, when identical blobs may be stored once.
+  const bool share_blobs =
+      manifest_.minor_version() >= kSharedDataBlobMinorPayloadVersion;
+  std::map<string, std::pair<uint64_t, size_t>> shareable_blobs;
+  uint64_t shared_size = 0;
+  size_t op_index = 0;
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
+      const size_t current_op_index = op_index++;
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
+      buf.resize(aop.op.data_length());
       ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
       TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
 
       // Add the hash of the data blobs for this operation
       TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
 
+      if (share_blobs && !buf.empty() &&
+          buf.size() <= kMaxSharedDataBlobSize) {
+        // The hash covers the length of the blob too.
+        auto [it, inserted] = shareable_blobs.emplace(
+            aop.op.data_sha256_hash(),
+            std::make_pair(out_file_size, current_op_index));
+        if (!inserted) {
+          auto& [blob_offset, first_op_index] = it->second;
+          if (current_op_index - first_op_index <=
+              kMaxSharedDataBlobDistance) {
+            aop.op.set_data_offset(blob_offset);
+            shared_size += buf.size();
+            continue;
+          }
+          // The copy stored for this operation is shared by the next ones.
+          it->second = std::make_pair(out_file_size, current_op_index);
+        }
+      }
+
+      // The blobs of consecutive operations are often stored one after the
+      // other.
+      const uint64_t data_offset = aop.op.data_offset();
+      if (!blob_ranges->empty() &&
+          blob_ranges->back().offset + blob_ranges->back().length ==
+              data_offset) {
+        blob_ranges->back().length += buf.size();
+      } else {
+        blob_ranges->push_back({data_offset, buf.size()});
+      }
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
       out_file_size += buf.size();
     }
   }
+  if (shared_size)
+    LOG(INFO) << "Saved " << shared_size << " bytes of identical data blobs.";
   return true;
 }
 
@@ -346,6 +704,25 @@ bool PayloadFile::AddOperationHash(InstallOperation* op,
   return true;
 }
 
+bool PayloadFile::AddOperationDstHashes(const string& new_part_path,
+                                        vector<AnnotatedOperation>* aops) {
+  const size_t block_size = manifest_.block_size();
+  brillo::Blob data;
+  brillo::Blob hash;
+  for (AnnotatedOperation& aop : *aops) {
+    // The content of discarded blocks is unknown.
+    if (aop.op.type() == InstallOperation::DISCARD ||
+        aop.op.dst_extents().empty()) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(utils::ReadExtents(
+        new_part_path, aop.op.dst_extents(), &data, block_size));
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+    aop.op.set_dst_sha256_hash(hash.data(), hash.size());
+  }
+  return true;
+}
+
 void PayloadFile::ReportPayloadUsage(uint64_t metadata_size) const {
   std::map<DeltaObject, int> object_counts;
   off_t total_size = 0;
@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,6 +25,7 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/install_time_estimator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -45,17 +47,27 @@ class PayloadFile {
                     const PartitionConfig& new_conf,
                     std::vector<AnnotatedOperation> aops,
                     std::vector<CowMergeOperation> merge_sequence,
-                    size_t cow_size);
+                    size_t cow_size,
+                    brillo::Blob zstd_dictionary = {});
 
   // Write the payload to the |payload_file| file. The operations reference
   // blobs in the |data_blobs_path| file and the blobs will be reordered in the
-  // payload file to match the order of the operations. The size of the metadata
-  // section of the payload is stored in |metadata_size_out|.
+  // payload file to match the order of the operations, copying them straight
+  // from |data_blobs_path|. The size of the metadata section of the payload is
+  // stored in |metadata_size_out|. With |free_blobs_while_writing| in the
+  // config, the blocks of |data_blobs_path| are released once copied, so the
+  // two files together take little more than the size of the payload.
   bool WritePayload(const std::string& payload_file,
                     const std::string& data_blobs_path,
                     const std::string& private_key_path,
                     uint64_t* metadata_size_out);
 
+  // Serializes |manifest| into |out| the way it's stored in a payload of
+  // |major_version|, compressed from kCompressedManifestMajorPayloadVersion.
+  static bool SerializeManifest(const DeltaArchiveManifest& manifest,
+                                uint64_t major_version,
+                                std::string* out);
+
   static bool WritePayload(const std::string& payload_file,
                            const std::string& ordered_blobs_file,
                            const std::string& private_key_path,
@@ -63,8 +75,68 @@ class PayloadFile {
                            const DeltaArchiveManifest& manifest,
                            uint64_t* out_metadata_size);
 
+  // Writes to |payload_file| the payload made of the partitions of the partial
+  // payloads in |partial_payload_paths|, in order, signed with
+  // |private_key_path| if not empty. The partial payloads are unsigned
+  // payloads of disjoint sets of partitions of the same update, generated with
+  // the same options, e.g. on different hosts. Their data blobs are copied
+  // straight to |payload_file|. The size of the metadata section of the
+  // payload is stored in |metadata_size_out|.
+  static bool MergePartialPayloads(
+      const std::vector<std::string>& partial_payload_paths,
+      const std::string& payload_file,
+      const std::string& private_key_path,
+      uint64_t* metadata_size_out);
+
  private:
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, ReorderBlobsMergesRangesTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadReordersBlobsTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadSharesIdenticalBlobsTest);
+  FRIEND_TEST(PayloadFileTest, GetReleasableRangesTest);
+  FRIEND_TEST(PayloadFileTest, WritePayloadFreesBlobsTest);
+  FRIEND_TEST(PayloadFileTest, HashDataBlobChunksTest);
+  FRIEND_TEST(PayloadFileTest, AddOperationDstHashesTest);
+  friend class PayloadFileTest;
+
+  // A range of bytes of a data blobs file.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+    // Index of the file of the range in the data blobs files.
+    size_t file{0};
+
+    bool operator==(const BlobRange& other) const {
+      return offset == other.offset && length == other.length &&
+             file == other.file;
+    }
+  };
+
+  // Same as the public static WritePayload(), but the data blobs of the
+  // payload are the |blob_ranges| of |blobs_files|, in order. If |free_blobs|,
+  // the disk space of the blobs files is released as they are copied.
+  static bool WritePayload(const std::string& payload_file,
+                           const std::vector<std::string>& blobs_files,
+                           const std::vector<BlobRange>& blob_ranges,
+                           const std::string& private_key_path,
+                           uint64_t major_version_,
+                           const DeltaArchiveManifest& manifest,
+                           uint64_t* out_metadata_size,
+                           bool free_blobs = false);
+
+  // Returns, for each range of |blob_ranges|, the range of its blobs file
+  // that no later range reads, so that it can be released once copied, or an
+  // empty range.
+  static std::vector<BlobRange> GetReleasableRanges(
+      const std::vector<BlobRange>& blob_ranges);
+
+  // Hashes the data blobs in the |blob_ranges| of |blobs_files|, in order, in
+  // chunks of |chunk_size| bytes, and stores the concatenation of the SHA256
+  // hashes of the chunks in |out_hashes|.
+  static bool HashDataBlobChunks(const std::vector<std::string>& blobs_files,
+                                 const std::vector<BlobRange>& blob_ranges,
+                                 uint64_t chunk_size,
+                                 std::string* out_hashes);
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -74,15 +146,30 @@ class PayloadFile {
   // gracefully ignore the fake signature operation.
   static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
 
+  // Sets the hash of the data that each of |aops| writes in the new
+  // partition at |new_part_path|.
+  bool AddOperationDstHashes(const std::string& new_part_path,
+                             std::vector<AnnotatedOperation>* aops);
+
   // Install operations in the manifest may reference data blobs, which
-  // are in data_blobs_path. This function creates a new data blobs file
-  // with the data blobs in the same order as the referencing install
-  // operations in the manifest. E.g. if manifest[0] has a data blob
-  // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-  // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
+  // are in data_blobs_path. This function changes the operations to reference
+  // the data blobs in the same order as the operations, and stores in
+  // |blob_ranges| the ranges of data_blobs_path to copy to the payload to put
+  // them in that order. E.g. if manifest[0] has a data blob "X" at offset 1,
+  // manifest[1] has a data blob "Y" at offset 0, and data_blobs_path's file
+  // contains "YX", |blob_ranges| will be set to the ranges of "X" then "Y".
+  // Adjacent ranges are merged. Identical blobs are stored once when the
+  // minor version allows it, within the limits below.
   bool ReorderDataBlobs(const std::string& data_blobs_path,
-                        const std::string& new_data_blobs_path);
+                        std::vector<BlobRange>* blob_ranges);
+
+  // The client keeps a shared data blob in memory from its first operation to
+  // its last one. Only the blobs up to this size are shared, by operations at
+  // most this many operations apart, so the client never holds more than
+  // kMaxSharedDataBlobDistance * kMaxSharedDataBlobSize bytes of them. A blob
+  // used again further away is stored again.
+  static constexpr uint64_t kMaxSharedDataBlobSize = 1024 * 1024;  // 1 MiB
+  static constexpr size_t kMaxSharedDataBlobDistance = 64;
 
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
@@ -90,6 +177,23 @@ class PayloadFile {
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // Whether to release the disk space of the data blobs file while writing
+  // the payload.
+  bool free_blobs_while_writing_{false};
+
+  // If non zero, the size of the chunks of the data blobs hashed in the
+  // manifest.
+  uint32_t payload_chunk_size_{0};
+
+  // Whether the hash of the target data of the operations is added to the
+  // manifest.
+  bool add_operation_dst_hashes_{false};
+
+  // Whether to add the cost hints of the operations to the manifest, and the
+  // device to estimate their apply time on, if any.
+  bool add_operation_cost_hints_{false};
+  std::unique_ptr<DeviceProfile> cost_hints_profile_;
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -103,12 +207,15 @@ class PayloadFile {
 
     PartitionInfo old_info;
     PartitionInfo new_info;
+    brillo::Blob old_verity_root_digest;
 
     PostInstallConfig postinstall;
     VerityConfig verity;
     // Per partition timestamp.
     std::string version;
     size_t cow_size;
+    // The zstd dictionary of the REPLACE_ZSTD operations, if any.
+    brillo::Blob zstd_dictionary;
   };
 
   std::vector<Partition> part_vec_;
@@ -16,14 +16,21 @@
 
 #include "update_engine/payload_generator/payload_file.h"
 
+#include <string.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/testing_constants.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
 using std::vector;
@@ -32,6 +39,38 @@ namespace chromeos_update_engine {
 
 class PayloadFileTest : public ::testing::Test {
  protected:
+  // Writes to |path| an unsigned payload with a partition |name| which has an
+  // operation per blob of |blobs|, the empty blobs giving operations without
+  // data.
+  void WritePartialPayload(
+      const string& path,
+      const string& name,
+      const vector<string>& blobs,
+      uint32_t block_size = 4096,
+      uint64_t major_version = kBrilloMajorPayloadVersion) {
+    ScopedTempFile blobs_file("PartialPayload.blobs.XXXXXX");
+    PayloadFile payload;
+    payload.major_version_ = major_version;
+    payload.manifest_.set_block_size(block_size);
+    payload.part_vec_.resize(1);
+    payload.part_vec_[0].name = name;
+    string data;
+    for (const string& blob : blobs) {
+      AnnotatedOperation aop;
+      aop.op.set_type(InstallOperation::REPLACE);
+      if (!blob.empty()) {
+        aop.op.set_data_offset(data.size());
+        aop.op.set_data_length(blob.size());
+      }
+      payload.part_vec_[0].aops.push_back(aop);
+      data += blob;
+    }
+    EXPECT_TRUE(test_utils::WriteFileString(blobs_file.path(), data));
+    uint64_t metadata_size;
+    EXPECT_TRUE(
+        payload.WritePayload(path, blobs_file.path(), "", &metadata_size));
+  }
+
   PayloadFile payload_;
 };
 
@@ -45,8 +84,6 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   string orig_data = "kernel abcd";
   EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
 
-  ScopedTempFile new_blobs("ReorderBlobsTest.new.XXXXXX");
-
   payload_.part_vec_.resize(2);
 
   vector<AnnotatedOperation> aops;
@@ -64,14 +101,14 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   aop.op.set_data_length(6);
   payload_.part_vec_[1].aops = {aop};
 
-  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), &blob_ranges));
 
   const vector<AnnotatedOperation>& part0_aops = payload_.part_vec_[0].aops;
   const vector<AnnotatedOperation>& part1_aops = payload_.part_vec_[1].aops;
-  string new_data;
-  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
   // Kernel blobs should appear at the end.
-  EXPECT_EQ("bcdakernel", new_data);
+  EXPECT_EQ((vector<PayloadFile::BlobRange>{{8, 3}, {7, 1}, {0, 6}}),
+            blob_ranges);
 
   EXPECT_EQ(2U, part0_aops.size());
   EXPECT_EQ(0U, part0_aops[0].op.data_offset());
@@ -84,4 +121,350 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, ReorderBlobsMergesRangesTest) {
+  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcdef"));
+
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  for (uint64_t offset : {2, 4, 0, 1}) {
+    aop.op.set_data_offset(offset);
+    aop.op.set_data_length(offset == 0 ? 1 : 2);
+    payload_.part_vec_[0].aops.push_back(aop);
+  }
+  // Operations without data don't split the ranges.
+  payload_.part_vec_[0].aops.insert(payload_.part_vec_[0].aops.begin() + 1,
+                                    AnnotatedOperation());
+
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), &blob_ranges));
+  EXPECT_EQ((vector<PayloadFile::BlobRange>{{2, 4}, {0, 3}}), blob_ranges);
+  EXPECT_EQ(5U, payload_.part_vec_[0].aops.back().op.data_offset());
+}
+
+TEST_F(PayloadFileTest, WritePayloadReordersBlobsTest) {
+  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "kernel abcd"));
+
+  payload_.part_vec_.resize(2);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(8);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(7);
+  aop.op.set_data_length(1);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[1].aops.push_back(aop);
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+
+  // The blobs are copied to the payload in the order of the operations.
+  ScopedTempFile payload_file("ReorderBlobsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), "", &metadata_size));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  ASSERT_EQ(metadata_size + 10, payload_data.size());
+  EXPECT_EQ("bcdakernel", payload_data.substr(metadata_size));
+}
+
+TEST_F(PayloadFileTest, AddOperationDstHashesTest) {
+  constexpr size_t kBlockSize = 4096;
+  ScopedTempFile new_part("AddOperationDstHashesTest.XXXXXX");
+  brillo::Blob new_data(kBlockSize * 3);
+  for (size_t i = 0; i < new_data.size(); i++)
+    new_data[i] = i / kBlockSize + 1;
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part.path(), new_data));
+  payload_.manifest_.set_block_size(kBlockSize);
+
+  vector<AnnotatedOperation> aops(2);
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *aops[0].op.add_dst_extents() = ExtentForRange(2, 1);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 1);
+  aops[1].op.set_type(InstallOperation::DISCARD);
+  *aops[1].op.add_dst_extents() = ExtentForRange(1, 1);
+  EXPECT_TRUE(payload_.AddOperationDstHashes(new_part.path(), &aops));
+
+  // The hash covers the blocks in the order of the extents.
+  brillo::Blob expected_data(new_data.begin() + 2 * kBlockSize,
+                             new_data.end());
+  expected_data.insert(
+      expected_data.end(), new_data.begin(), new_data.begin() + kBlockSize);
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected_data, &expected_hash));
+  EXPECT_EQ(string(expected_hash.begin(), expected_hash.end()),
+            aops[0].op.dst_sha256_hash());
+  EXPECT_FALSE(aops[1].op.has_dst_sha256_hash());
+}
+
+TEST_F(PayloadFileTest, WritePayloadSharesIdenticalBlobsTest) {
+  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcdXabcd"));
+
+  payload_.part_vec_.resize(2);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(5);
+  aop.op.set_data_length(4);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(4);
+  aop.op.set_data_length(1);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(4);
+  payload_.part_vec_[1].aops.push_back(aop);
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  payload_.manifest_.set_minor_version(kSharedDataBlobMinorPayloadVersion);
+
+  // The identical blobs are stored once.
+  ScopedTempFile payload_file("ReorderBlobsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), "", &metadata_size));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  EXPECT_EQ("abcdX", payload_data.substr(metadata_size));
+  EXPECT_EQ(0U, payload_.part_vec_[0].aops[0].op.data_offset());
+  EXPECT_EQ(4U, payload_.part_vec_[0].aops[1].op.data_offset());
+  EXPECT_EQ(0U, payload_.part_vec_[1].aops[0].op.data_offset());
+  EXPECT_EQ(4U, payload_.part_vec_[1].aops[0].op.data_length());
+
+  // Older minor versions need a blob per operation.
+  payload_.part_vec_[0].aops[0].op.set_data_offset(5);
+  payload_.part_vec_[0].aops[1].op.set_data_offset(4);
+  payload_.manifest_.set_minor_version(kLZ4DIFFMinorPayloadVersion);
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), &blob_ranges));
+  EXPECT_EQ((vector<PayloadFile::BlobRange>{{5, 4}, {4, 1}, {0, 4}}),
+            blob_ranges);
+  EXPECT_EQ(5U, payload_.part_vec_[1].aops[0].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, ReorderDataBlobsSharingBoundTest) {
+  // A small blob, then a blob just over the size limit.
+  const string large_blob(PayloadFile::kMaxSharedDataBlobSize + 1, 'L');
+  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "s" + large_blob));
+
+  payload_.part_vec_.resize(1);
+  vector<AnnotatedOperation>& aops = payload_.part_vec_[0].aops;
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(1);
+  aop.op.set_data_length(large_blob.size());
+  aops.push_back(aop);
+  aops.push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(1);
+  aops.push_back(aop);
+  // Operations without data in between.
+  AnnotatedOperation zero_aop;
+  zero_aop.op.set_type(InstallOperation::ZERO);
+  aops.insert(aops.end(), PayloadFile::kMaxSharedDataBlobDistance, zero_aop);
+  aops.push_back(aop);
+  aops.push_back(aop);
+  payload_.manifest_.set_minor_version(kSharedDataBlobMinorPayloadVersion);
+
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), &blob_ranges));
+  const uint64_t large_size = large_blob.size();
+  // The large blob is stored twice, the small one is stored again for the
+  // operations too far from its first one, which share that copy.
+  EXPECT_EQ((vector<PayloadFile::BlobRange>{{1, large_size},
+                                            {1, large_size},
+                                            {0, 1},
+                                            {0, 1}}),
+            blob_ranges);
+  EXPECT_EQ(0U, aops[0].op.data_offset());
+  EXPECT_EQ(large_size, aops[1].op.data_offset());
+  EXPECT_EQ(2 * large_size, aops[2].op.data_offset());
+  EXPECT_EQ(2 * large_size + 1, aops.end()[-2].op.data_offset());
+  EXPECT_EQ(2 * large_size + 1, aops.end()[-1].op.data_offset());
+}
+
+TEST_F(PayloadFileTest, GetReleasableRangesTest) {
+  // Overlapping ranges are released with the last of them.
+  EXPECT_EQ((vector<PayloadFile::BlobRange>{
+                {0, 0}, {0, 2}, {8, 6}, {2, 6}, {0, 2, 1}}),
+            PayloadFile::GetReleasableRanges(
+                {{8, 4}, {0, 2}, {10, 4}, {2, 6}, {0, 2, 1}}));
+}
+
+TEST_F(PayloadFileTest, HashDataBlobChunksTest) {
+  ScopedTempFile blobs_file("HashDataBlobChunksTest.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(blobs_file.path(), "abcdefgh"));
+
+  // The chunks span the ranges, whatever their order in the file.
+  string hashes;
+  EXPECT_TRUE(PayloadFile::HashDataBlobChunks(
+      {blobs_file.path()}, {{4, 4}, {0, 3}}, 3, &hashes));
+  string expected_hashes;
+  for (const char* chunk : {"efg", "hab", "c"}) {
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(chunk, strlen(chunk), &hash));
+    expected_hashes.append(hash.begin(), hash.end());
+  }
+  EXPECT_EQ(expected_hashes, hashes);
+}
+
+TEST_F(PayloadFileTest, WritePayloadFreesBlobsTest) {
+  constexpr size_t kBlobSize = 4096;
+  string blobs;
+  for (char c : {'a', 'b', 'c'})
+    blobs.append(kBlobSize, c);
+  ScopedTempFile orig_blobs("WritePayloadFreesBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), blobs));
+
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_length(kBlobSize);
+  for (uint64_t i = 0; i < 3; i++) {
+    aop.op.set_data_offset((2 - i) * kBlobSize);
+    payload_.part_vec_[0].aops.push_back(aop);
+  }
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  payload_.free_blobs_while_writing_ = true;
+
+  ScopedTempFile payload_file("WritePayloadFreesBlobsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(payload_.WritePayload(
+      payload_file.path(), orig_blobs.path(), "", &metadata_size));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  EXPECT_EQ(string(kBlobSize, 'c') + string(kBlobSize, 'b') +
+                string(kBlobSize, 'a'),
+            payload_data.substr(metadata_size));
+
+  // The copied blobs are holes in the data blobs file.
+  string freed_blobs;
+  EXPECT_TRUE(utils::ReadFile(orig_blobs.path(), &freed_blobs));
+  EXPECT_EQ(string(blobs.size(), '\0'), freed_blobs);
+}
+
+TEST_F(PayloadFileTest, MergePartialPayloadsTest) {
+  ScopedTempFile system_payload("MergePartialPayloadsTest.system.XXXXXX");
+  ScopedTempFile vendor_payload("MergePartialPayloadsTest.vendor.XXXXXX");
+  WritePartialPayload(system_payload.path(), "system", {"ab", "cd"});
+  WritePartialPayload(vendor_payload.path(), "vendor", {"", "xyz"});
+
+  ScopedTempFile payload_file("MergePartialPayloadsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(PayloadFile::MergePartialPayloads(
+      {system_payload.path(), vendor_payload.path()},
+      payload_file.path(),
+      "",
+      &metadata_size));
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  EXPECT_TRUE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &manifest, nullptr));
+  EXPECT_EQ(metadata_size, payload_metadata.GetMetadataSize());
+  EXPECT_EQ(4096u, manifest.block_size());
+  ASSERT_EQ(2, manifest.partitions_size());
+  EXPECT_EQ("system", manifest.partitions(0).partition_name());
+  EXPECT_EQ("vendor", manifest.partitions(1).partition_name());
+  ASSERT_EQ(2, manifest.partitions(1).operations_size());
+  EXPECT_FALSE(manifest.partitions(1).operations(0).has_data_offset());
+  const InstallOperation& op = manifest.partitions(1).operations(1);
+  EXPECT_EQ(4u, op.data_offset());
+  EXPECT_EQ(3u, op.data_length());
+  // The data hashes of the partial payloads are kept.
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData({'x', 'y', 'z'}, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()), op.data_sha256_hash());
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  EXPECT_EQ("abcdxyz", payload_data.substr(metadata_size));
+
+  // The merged payload can be signed.
+  EXPECT_TRUE(PayloadFile::MergePartialPayloads(
+      {system_payload.path(), vendor_payload.path()},
+      payload_file.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &metadata_size));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+}
+
+TEST_F(PayloadFileTest, CompressedManifestTest) {
+  ScopedTempFile payload_file("CompressedManifestTest.payload.XXXXXX");
+  WritePartialPayload(payload_file.path(),
+                      "system",
+                      vector<string>(100, "ab"),
+                      4096,
+                      kCompressedManifestMajorPayloadVersion);
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  EXPECT_TRUE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &manifest, nullptr));
+  EXPECT_EQ(kCompressedManifestMajorPayloadVersion,
+            payload_metadata.GetMajorVersion());
+  ASSERT_EQ(1, manifest.partitions_size());
+  ASSERT_EQ(100, manifest.partitions(0).operations_size());
+  EXPECT_EQ(198u, manifest.partitions(0).operations(99).data_offset());
+  // The header and the metadata signature cover the compressed manifest.
+  EXPECT_LT(payload_metadata.GetMetadataSize(),
+            24 + manifest.ByteSizeLong());
+
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(PayloadSigner::SignPayloadFile(
+      payload_file.path(),
+      {test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath)},
+      payload_file.path(),
+      &metadata_size));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+  EXPECT_TRUE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &manifest, nullptr));
+  EXPECT_EQ(metadata_size, payload_metadata.GetMetadataSize());
+  EXPECT_TRUE(manifest.has_signatures_offset());
+
+  // A manifest which isn't a zstd frame fails to parse.
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  payload_data[24] ^= 0xff;
+  EXPECT_TRUE(test_utils::WriteFileString(payload_file.path(), payload_data));
+  EXPECT_FALSE(payload_metadata.ParsePayloadFile(
+      payload_file.path(), &manifest, nullptr));
+}
+
+TEST_F(PayloadFileTest, MergeMismatchingPartialPayloadsTest) {
+  ScopedTempFile system_payload("MergePartialPayloadsTest.system.XXXXXX");
+  ScopedTempFile vendor_payload("MergePartialPayloadsTest.vendor.XXXXXX");
+  ScopedTempFile payload_file("MergePartialPayloadsTest.payload.XXXXXX");
+  WritePartialPayload(system_payload.path(), "system", {"ab"});
+  uint64_t metadata_size = 0;
+
+  // The same partition in two partial payloads.
+  EXPECT_FALSE(PayloadFile::MergePartialPayloads(
+      {system_payload.path(), system_payload.path()},
+      payload_file.path(),
+      "",
+      &metadata_size));
+
+  // Partial payloads generated with different options.
+  WritePartialPayload(vendor_payload.path(), "vendor", {"xyz"}, 512);
+  EXPECT_FALSE(PayloadFile::MergePartialPayloads(
+      {system_payload.path(), vendor_payload.path()},
+      payload_file.path(),
+      "",
+      &metadata_size));
+
+  // Signed partial payloads.
+  WritePartialPayload(vendor_payload.path(), "vendor", {"xyz"});
+  EXPECT_TRUE(PayloadSigner::SignPayloadFile(
+      vendor_payload.path(),
+      {test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath)},
+      vendor_payload.path(),
+      &metadata_size));
+  EXPECT_FALSE(PayloadFile::MergePartialPayloads(
+      {vendor_payload.path()}, payload_file.path(), "", &metadata_size));
+}
+
 }  // namespace chromeos_update_engine
@@ -34,6 +34,7 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
@@ -43,21 +44,32 @@ using std::string;
 namespace chromeos_update_engine {
 
 bool PostInstallConfig::IsEmpty() const {
-  return !run && path.empty() && filesystem_type.empty() && !optional;
+  return !run && path.empty() && filesystem_type.empty() && !optional &&
+         depends_on.empty();
 }
 
 bool VerityConfig::IsEmpty() const {
   return hash_tree_data_extent.num_blocks() == 0 &&
          hash_tree_extent.num_blocks() == 0 && hash_tree_algorithm.empty() &&
-         hash_tree_salt.empty() && fec_data_extent.num_blocks() == 0 &&
+         hash_tree_salt.empty() && hash_tree_root_digest.empty() &&
+         fec_data_extent.num_blocks() == 0 &&
          fec_extent.num_blocks() == 0 && fec_roots == 0;
 }
 
 void VerityConfig::Clear() {
+  ClearHashTree();
+  ClearFec();
+}
+
+void VerityConfig::ClearHashTree() {
   hash_tree_data_extent.Clear();
   hash_tree_extent.Clear();
   hash_tree_algorithm.clear();
   hash_tree_salt.clear();
+  hash_tree_root_digest.clear();
+}
+
+void VerityConfig::ClearFec() {
   fec_data_extent.Clear();
   fec_extent.Clear();
   fec_roots = 0;
@@ -73,12 +85,12 @@ bool PartitionConfig::ValidateExists() const {
   return true;
 }
 
-bool PartitionConfig::OpenFilesystem() {
+bool PartitionConfig::OpenFilesystem(const string& cache_dir) {
   if (path.empty())
     return true;
   fs_interface.reset();
   if (diff_utils::IsExtFilesystem(path)) {
-    fs_interface = Ext2Filesystem::CreateFromFile(path);
+    fs_interface = Ext2Filesystem::CreateFromFile(path, cache_dir);
     // TODO(deymo): The delta generator algorithm doesn't support a block size
     // different than 4 KiB. Remove this check once that's fixed. b/26972455
     if (fs_interface) {
@@ -148,6 +160,11 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
                     &part.postinstall.filesystem_type);
     store.GetBoolean("POSTINSTALL_OPTIONAL_" + part.name,
                      &part.postinstall.optional);
+    string depends_on;
+    if (store.GetString("POSTINSTALL_DEPENDS_ON_" + part.name, &depends_on)) {
+      part.postinstall.depends_on =
+          brillo::string_utils::Split(depends_on, " ");
+    }
   }
   if (!found_postinstall) {
     LOG(ERROR) << "No valid postinstall config found.";
@@ -156,6 +173,31 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
   return true;
 }
 
+bool ImageConfig::LoadBootReadExtents(const brillo::KeyValueStore& store) {
+  for (PartitionConfig& part : partitions) {
+    string ranges;
+    if (!store.GetString(part.name, &ranges))
+      continue;
+    part.boot_read_extents.clear();
+    for (const string& range : brillo::string_utils::Split(ranges, " ")) {
+      const auto parts = brillo::string_utils::Split(range, ":");
+      uint64_t start_block = 0;
+      uint64_t num_blocks = 0;
+      if (parts.size() != 2 || !base::StringToUint64(parts[0], &start_block) ||
+          !base::StringToUint64(parts[1], &num_blocks) || num_blocks == 0) {
+        LOG(ERROR) << "Invalid boot read range " << range << " of "
+                   << part.name;
+        return false;
+      }
+      part.boot_read_extents.push_back(
+          ExtentForRange(start_block, num_blocks));
+    }
+    LOG(INFO) << "Loaded " << part.boot_read_extents.size()
+              << " boot read ranges of " << part.name;
+  }
+  return true;
+}
+
 bool ImageConfig::LoadDynamicPartitionMetadata(
     const brillo::KeyValueStore& store) {
   auto metadata = std::make_unique<DynamicPartitionMetadata>();
@@ -257,7 +299,8 @@ PayloadVersion::PayloadVersion(uint64_t major_version, uint32_t minor_version) {
 }
 
 bool PayloadVersion::Validate() const {
-  TEST_AND_RETURN_FALSE(major == kBrilloMajorPayloadVersion);
+  TEST_AND_RETURN_FALSE(major == kBrilloMajorPayloadVersion ||
+                        major == kCompressedManifestMajorPayloadVersion);
   TEST_AND_RETURN_FALSE(minor == kFullPayloadMinorVersion ||
                         minor == kSourceMinorPayloadVersion ||
                         minor == kOpSrcHashMinorPayloadVersion ||
@@ -266,7 +309,11 @@ bool PayloadVersion::Validate() const {
                         minor == kVerityMinorPayloadVersion ||
                         minor == kPartialUpdateMinorPayloadVersion ||
                         minor == kZucchiniMinorPayloadVersion ||
-                        minor == kLZ4DIFFMinorPayloadVersion);
+                        minor == kLZ4DIFFMinorPayloadVersion ||
+                        minor == kSharedDataBlobMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kZstdDictionaryMinorPayloadVersion ||
+                        minor == kPackedExtentsMinorPayloadVersion);
   return true;
 }
 
@@ -304,6 +351,11 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
     case InstallOperation::LZ4DIFF_PUFFDIFF:
       return minor >= kLZ4DIFFMinorPayloadVersion;
 
+    case InstallOperation::REPLACE_ZSTD:
+      // Full payloads don't have a minor version to tell whether the client
+      // supports this operation, so they keep using REPLACE_XZ.
+      return minor >= kZstdMinorPayloadVersion;
+
     case InstallOperation::MOVE:
     case InstallOperation::BSDIFF:
       NOTREACHED();
@@ -350,6 +402,10 @@ bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(hard_chunk_size == -1 ||
                         hard_chunk_size % block_size == 0);
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(cow_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(full_max_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(payload_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(zucchini_chunk_size % block_size == 0);
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
 
@@ -32,6 +32,35 @@
 
 namespace chromeos_update_engine {
 
+class DiffAlgorithmStats;
+class DiffBudget;
+class Lz4diffSourceCache;
+class PhaseMetrics;
+
+// Names of the phases timed while generating a payload, in the PhaseMetrics
+// of PayloadGenerationConfig. They're per partition, except for the diff
+// algorithms and the writing of the payload.
+namespace generator_phases {
+// GenerateUpdatePayloadFile() as a whole, with the CPU time of the whole
+// process. The other phases count the CPU time of their thread.
+constexpr char kGenerate[] = "generate";
+// Parsing the filesystems and locating the deflates of their files.
+constexpr char kFilesystem[] = "filesystem";
+constexpr char kFileList[] = "file_list";
+constexpr char kMovedAndZeroBlocks[] = "moved_and_zero_blocks";
+// From the first diff job of a partition started to the last one done.
+constexpr char kDiff[] = "diff";
+// The diff jobs themselves, whose wall times add up to the busy time of the
+// diff threads.
+constexpr char kDiffJobs[] = "diff_jobs";
+// Followed by the InstallOperationTypeName() of the diff operation tried, or
+// by "LZ4DIFF" for lz4diff, which picks between its two operations itself.
+constexpr char kDiffAlgorithmPrefix[] = "diff/";
+constexpr char kMergeSequence[] = "merge_sequence";
+constexpr char kCowEstimate[] = "cow_estimate";
+constexpr char kWritePayload[] = "write_payload";
+}  // namespace generator_phases
+
 struct PostInstallConfig {
   // Whether the postinstall config is empty.
   bool IsEmpty() const;
@@ -50,6 +79,10 @@ struct PostInstallConfig {
 
   // Whether this postinstall script should be ignored if it fails.
   bool optional = false;
+
+  // The partitions whose post-install program must be done before this one
+  // starts.
+  std::vector<std::string> depends_on;
 };
 
 // Data will be written to the payload and used for hash tree and FEC generation
@@ -61,6 +94,12 @@ struct VerityConfig {
   // Clears this config, subsequent calls to "IsEmpty" will return true.
   void Clear();
 
+  // Clears only the hash tree, or only the FEC, part of this config. The
+  // verity data cleared isn't computed on the device, its blocks are shipped
+  // in the payload like the rest of the partition.
+  void ClearHashTree();
+  void ClearFec();
+
   // The extent for data covered by verity hash tree.
   Extent hash_tree_data_extent;
 
@@ -73,6 +112,9 @@ struct VerityConfig {
   // The salt used for verity hash tree.
   brillo::Blob hash_tree_salt;
 
+  // The root digest of the verity hash tree, as stored in the image.
+  brillo::Blob hash_tree_root_digest;
+
   // The extent for data covered by FEC.
   Extent fec_data_extent;
 
@@ -98,8 +140,9 @@ struct PartitionConfig {
   bool ValidateExists() const;
 
   // Open then filesystem stored in this partition and stores it in
-  // |fs_interface|. Returns whether opening the filesystem worked.
-  bool OpenFilesystem();
+  // |fs_interface|. Returns whether opening the filesystem worked. With a
+  // |cache_dir|, the files of ext2 images are cached there.
+  bool OpenFilesystem(const std::string& cache_dir = "");
 
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
@@ -130,9 +173,17 @@ struct PartitionConfig {
   // Enables the on device fec data computation by default.
   bool disable_fec_computation = false;
 
+  // Only for source partitions, the root digest of their verity hash tree to
+  // store in the payload.
+  brillo::Blob verity_root_digest;
+
   // Per-partition version, usually a number representing timestamp.
   std::string version;
 
+  // Only for target partitions, the blocks read during the first boot after
+  // the update, merged first.
+  std::vector<Extent> boot_read_extents;
+
   // parameter passed to mkfs.erofs's -z option.
   // In the format of "compressor,compression_level"
   // Examples: lz4    lz4hc,9
@@ -162,6 +213,10 @@ struct ImageConfig {
   // Load dynamic partition info from a key value store.
   bool LoadDynamicPartitionMetadata(const brillo::KeyValueStore& store);
 
+  // Load the blocks of the partitions read at boot from a key value store,
+  // keyed by partition name, of space separated <start block>:<num blocks>.
+  bool LoadBootReadExtents(const brillo::KeyValueStore& store);
+
   // Validate |dynamic_partition_metadata| against |partitions|.
   bool ValidateDynamicPartitionMetadata() const;
 
@@ -239,6 +294,19 @@ struct PayloadGenerationConfig {
   // chunks.
   size_t soft_chunk_size = 2 * 1024 * 1024;
 
+  // If not 0, the REPLACE operations are aligned to the chunks of this size
+  // of the target partition, for the COW writer of Virtual A/B compression to
+  // get whole chunks. The operations are then also ordered like the merge
+  // sequence. Must be a multiple of |block_size|.
+  size_t cow_chunk_size = 0;
+
+  // If larger than the chunk size of the full operations, the consecutive
+  // chunks of zeros or of compressible data are merged in full operations of
+  // up to this size, which compress better. The chunks of incompressible data
+  // are left at the smaller size, for the device to decompress them in
+  // parallel. Must be a multiple of |block_size|.
+  size_t full_max_chunk_size = 0;
+
   // TODO(deymo): Remove the block_size member and maybe replace it with a
   // minimum alignment size for blocks (if needed). Algorithms should be able to
   // pick the block_size they want, but for now only 4 KiB is supported.
@@ -261,10 +329,79 @@ struct PayloadGenerationConfig {
   // Whether to enable zucchini ops
   bool enable_zucchini = true;
 
+  // Whether to compress the small replace operations of each partition with
+  // a zstd dictionary trained on them, on minor version 12 or newer.
+  bool enable_zstd_dictionary = false;
+
+  // Whether to release the disk space of the temporary data blobs file as its
+  // blobs are copied to the payload, so that the generation doesn't need
+  // twice the size of the payload of disk space.
+  bool free_blobs_while_writing = false;
+
+  // Whether to reorder the operations of each partition of a delta payload to
+  // make them faster to apply on a slow eMMC device.
+  bool reorder_operations = false;
+
+  // If non zero, the data blobs of the payload are hashed in chunks of this
+  // many bytes in the manifest, so that they're verified as they're received.
+  uint32_t payload_chunk_size = 0;
+
+  // Whether to add the hash of the target data of each operation to the
+  // manifest, so that the client can skip the operations already applied.
+  bool add_operation_dst_hashes = false;
+
+  // Whether to add a cost hint to each operation of the manifest, for the
+  // client to schedule them. With a device profile, the path of its key/value
+  // file, the hints also include the apply time on that device.
+  bool add_operation_cost_hints = false;
+  std::string cost_hints_device_profile;
+
   std::string security_patch_level;
 
   uint32_t max_threads = 0;
 
+  // If non zero, the files are diffed within about this many bytes of memory.
+  // The files that can't be diffed within it are split in smaller chunks.
+  uint64_t max_memory = 0;
+
+  // Whether the diff threads are spread over the NUMA nodes of the host, each
+  // one running on the CPUs of its node.
+  bool numa_aware = false;
+
+  // If non zero, the executables too large for zucchini are diffed in chunks
+  // of this many bytes, each against the old data around it, so that they can
+  // still use zucchini. Must be a multiple of |block_size|.
+  uint64_t zucchini_chunk_size = 0;
+
+  // If not empty, the directory where the diff results, the deflates of the
+  // files and the block index of the source images are cached to be reused by
+  // the next payloads generated from the same files.
+  std::string diff_cache_dir;
+
+  // If not null, the diff algorithms that keep losing on a file type are not
+  // tried on the next files of that type. Not owned.
+  DiffAlgorithmStats* diff_algorithm_stats = nullptr;
+
+  // If not null, the diff algorithms that don't fit in its time or memory
+  // budget are not tried on a file. Not owned.
+  DiffBudget* diff_budget = nullptr;
+
+  // If not null, the decompressed source data of the lz4diff operations is
+  // shared through this cache. Not owned.
+  Lz4diffSourceCache* lz4diff_source_cache = nullptr;
+
+  // If not null, the time spent in the generator_phases is added to it. Not
+  // owned.
+  PhaseMetrics* phase_metrics = nullptr;
+
+  // Number of threads estimating the COW size of each partition. With a
+  // single thread the estimate is exact, 0 uses GetMaxThreads() threads.
+  uint32_t cow_estimate_threads = 1;
+
+  // If non zero, the COW size is estimated from a sample of the new blocks,
+  // with this maximum relative error.
+  double cow_estimate_max_error = 0;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
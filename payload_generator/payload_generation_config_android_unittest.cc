@@ -154,6 +154,10 @@ TEST_F(PayloadGenerationConfigAndroidTest, LoadVerityConfigSimpleTest) {
   EXPECT_EQ("sha1", verity.hash_tree_algorithm);
   brillo::Blob salt(kHashTreeSalt, std::end(kHashTreeSalt));
   EXPECT_EQ(salt, verity.hash_tree_salt);
+  const brillo::Blob root_digest = {0x4f, 0x6c, 0xd0, 0x1e, 0x39, 0x9d, 0xaa,
+                                    0x73, 0x35, 0x53, 0xa7, 0x74, 0x1f, 0x81,
+                                    0xd0, 0xa6, 0xa9, 0x5f, 0x19, 0x9f};
+  EXPECT_EQ(root_digest, verity.hash_tree_root_digest);
   EXPECT_EQ(ExtentForRange(0, 3), verity.fec_data_extent);
   EXPECT_EQ(ExtentForRange(3, 2), verity.fec_extent);
   EXPECT_EQ(2u, verity.fec_roots);
@@ -17,9 +17,12 @@
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 #include <utility>
+#include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/payload_generator/extent_utils.h"
+
 namespace chromeos_update_engine {
 
 class PayloadGenerationConfigTest : public ::testing::Test {};
@@ -32,13 +35,16 @@ TEST_F(PayloadGenerationConfigTest, SimpleLoadPostInstallConfigTest) {
       store.LoadFromString("RUN_POSTINSTALL_root=true\n"
                            "POSTINSTALL_PATH_root=postinstall\n"
                            "FILESYSTEM_TYPE_root=ext4\n"
-                           "POSTINSTALL_OPTIONAL_root=true"));
+                           "POSTINSTALL_OPTIONAL_root=true\n"
+                           "POSTINSTALL_DEPENDS_ON_root=system vendor"));
   EXPECT_TRUE(image_config.LoadPostInstallConfig(store));
   EXPECT_FALSE(image_config.partitions[0].postinstall.IsEmpty());
   EXPECT_EQ(true, image_config.partitions[0].postinstall.run);
   EXPECT_EQ("postinstall", image_config.partitions[0].postinstall.path);
   EXPECT_EQ("ext4", image_config.partitions[0].postinstall.filesystem_type);
   EXPECT_TRUE(image_config.partitions[0].postinstall.optional);
+  EXPECT_EQ(std::vector<std::string>({"system", "vendor"}),
+            image_config.partitions[0].postinstall.depends_on);
 }
 
 TEST_F(PayloadGenerationConfigTest, LoadPostInstallConfigNameMismatchTest) {
@@ -53,6 +59,22 @@ TEST_F(PayloadGenerationConfigTest, LoadPostInstallConfigNameMismatchTest) {
   EXPECT_TRUE(image_config.partitions[0].postinstall.IsEmpty());
 }
 
+TEST_F(PayloadGenerationConfigTest, LoadBootReadExtentsTest) {
+  ImageConfig image_config;
+  image_config.partitions.emplace_back("system");
+  image_config.partitions.emplace_back("vendor");
+  brillo::KeyValueStore store;
+  ASSERT_TRUE(store.LoadFromString("system=10:5 100:1\nproduct=1:1"));
+  EXPECT_TRUE(image_config.LoadBootReadExtents(store));
+  EXPECT_EQ(
+      std::vector<Extent>({ExtentForRange(10, 5), ExtentForRange(100, 1)}),
+      image_config.partitions[0].boot_read_extents);
+  EXPECT_TRUE(image_config.partitions[1].boot_read_extents.empty());
+
+  ASSERT_TRUE(store.LoadFromString("vendor=10"));
+  EXPECT_FALSE(image_config.LoadBootReadExtents(store));
+}
+
 TEST_F(PayloadGenerationConfigTest, LoadDynamicPartitionMetadataTest) {
   ImageConfig image_config;
   brillo::KeyValueStore store;
@@ -82,6 +82,8 @@ bool PayloadProperties::GetPropertiesAsKeyValue(string* key_value_str) {
 }
 
 bool PayloadProperties::LoadFromPayload() {
+  if (loaded_)
+    return true;
   PayloadMetadata payload_metadata;
   DeltaArchiveManifest manifest;
   Signatures metadata_signatures;
@@ -105,20 +107,58 @@ bool PayloadProperties::LoadFromPayload() {
 
   if (payload_metadata.GetMetadataSignatureSize() > 0) {
     TEST_AND_RETURN_FALSE(metadata_signatures.signatures_size() > 0);
-    vector<string> base64_signatures;
-    for (const auto& sig : metadata_signatures.signatures()) {
-      base64_signatures.push_back(
-          brillo::data_encoding::Base64Encode(sig.data()));
-    }
-    metadata_signatures_ = base::JoinString(base64_signatures, ":");
+  } else {
+    metadata_signatures.Clear();
   }
+  SetFromManifest(manifest, metadata_signatures);
+  loaded_ = true;
+  return true;
+}
+
+bool PayloadProperties::LoadFromWrittenPayload(
+    const brillo::Blob& metadata,
+    const string& metadata_signature,
+    uint64_t payload_size,
+    const brillo::Blob& payload_hash) {
+  PayloadMetadata payload_metadata;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(metadata));
+  TEST_AND_RETURN_FALSE(payload_metadata.GetMetadataSize() == metadata.size());
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(metadata, &manifest));
+  Signatures metadata_signatures;
+  if (!metadata_signature.empty()) {
+    TEST_AND_RETURN_FALSE(metadata_signatures.ParseFromString(
+                              metadata_signature) &&
+                          metadata_signatures.signatures_size() > 0);
+  }
+
+  metadata_size_ = metadata.size();
+  brillo::Blob metadata_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfData(metadata, &metadata_hash));
+  metadata_hash_ = brillo::data_encoding::Base64Encode(metadata_hash);
+  payload_size_ = payload_size;
+  payload_hash_ = brillo::data_encoding::Base64Encode(payload_hash);
+  SetFromManifest(manifest, metadata_signatures);
+  loaded_ = true;
+  return true;
+}
+
+void PayloadProperties::SetFromManifest(
+    const DeltaArchiveManifest& manifest,
+    const Signatures& metadata_signatures) {
+  vector<string> base64_signatures;
+  for (const auto& sig : metadata_signatures.signatures()) {
+    base64_signatures.push_back(
+        brillo::data_encoding::Base64Encode(sig.data()));
+  }
+  metadata_signatures_ = base::JoinString(base64_signatures, ":");
 
   is_delta_ = std::any_of(manifest.partitions().begin(),
                           manifest.partitions().end(),
                           [](const PartitionUpdate& part) {
                             return part.has_old_partition_info();
                           });
-  return true;
 }
 
 }  // namespace chromeos_update_engine
@@ -22,6 +22,8 @@
 #include <brillo/key_value_store.h>
 #include <brillo/secure_blob.h>
 
+#include "update_engine/update_metadata.pb.h"
+
 namespace chromeos_update_engine {
 
 // A class for extracting information about a payload from the payload file
@@ -29,9 +31,22 @@ namespace chromeos_update_engine {
 // properties file. But more can be added if required.
 class PayloadProperties {
  public:
+  // The properties are read from the payload file on the first Get*() call.
   explicit PayloadProperties(const std::string& payload_path);
+  // The properties must be set with LoadFromWrittenPayload().
+  PayloadProperties() = default;
   ~PayloadProperties() = default;
 
+  // Sets the properties of a payload from the values computed while it was
+  // written, so that the multi-GB file isn't read back: its header and
+  // manifest in |metadata|, the serialized Signatures of the metadata in
+  // |metadata_signature| if signed, its total size in |payload_size| and the
+  // raw SHA256 hash of the whole file in |payload_hash|.
+  bool LoadFromWrittenPayload(const brillo::Blob& metadata,
+                              const std::string& metadata_signature,
+                              uint64_t payload_size,
+                              const brillo::Blob& payload_hash);
+
   // Get the properties in a json format. The json file will be used in
   // autotests, cros flash, etc. Mainly in Chrome OS.
   bool GetPropertiesAsJson(std::string* json_str);
@@ -42,9 +57,15 @@ class PayloadProperties {
 
  private:
   // Does the main job of reading the payload and extracting information from
-  // it.
+  // it, unless the properties are already loaded.
   bool LoadFromPayload();
 
+  // Sets the properties taken from the manifest and the metadata signatures.
+  void SetFromManifest(const DeltaArchiveManifest& manifest,
+                       const Signatures& metadata_signatures);
+
+  bool loaded_{false};
+
   // The path to the payload file.
   std::string payload_path_;
 
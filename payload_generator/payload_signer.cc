@@ -17,10 +17,18 @@
 #include "update_engine/payload_generator/payload_signer.h"
 
 #include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
 
+#include <base/files/file_path.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
@@ -34,8 +42,12 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -76,124 +88,297 @@ bool ConvertSignaturesToProtobuf(const vector<brillo::Blob>& signatures,
   return true;
 }
 
-// Given an unsigned payload under |payload_path| and the |payload_signature|
-// and |metadata_signature| generates an updated payload that includes the
-// signatures. It populates |out_metadata_size| with the size of the final
-// manifest after adding the fake signature operation, and
-// |out_signatures_offset| with the expected offset for the new blob, and
-// |out_metadata_signature_size| which will be size of |metadata_signature|
-// if the payload major version supports metadata signature, 0 otherwise.
-// Returns true on success, false otherwise.
-bool AddSignatureBlobToPayload(const string& payload_path,
-                               const string& payload_signature,
-                               const string& metadata_signature,
-                               brillo::Blob* out_payload,
-                               uint64_t* out_metadata_size,
-                               uint32_t* out_metadata_signature_size,
-                               uint64_t* out_signatures_offset) {
-  uint64_t manifest_offset = 20;
-  const int kProtobufSizeOffset = 12;
+// Size of the buffers the payload data is streamed through.
+constexpr size_t kStreamBufferSize = 4 * 1024 * 1024;
+// Number of buffers, so that the next ones are read while one is processed.
+constexpr size_t kNumStreamBuffers = 2;
+
+// Offset in the payload of the metadata signature size, right after the
+// magic, the major version and the manifest size.
+constexpr uint64_t kMetadataSignatureSizeOffset = 20;
+constexpr uint64_t kManifestSizeOffset = 12;
+
+using ChunkProcessor = std::function<bool(const uint8_t* data, size_t size)>;
+
+// Reads the |length| bytes at |offset| in |path| and passes them in order to
+// |process|, in chunks of up to kStreamBufferSize bytes. The chunks are read on
+// a separate thread, so the file is read while |process| runs on the previous
+// chunks. Returns false if reading fails or |process| returns false.
+bool StreamFileRange(const string& path,
+                     uint64_t offset,
+                     uint64_t length,
+                     const ChunkProcessor& process) {
+  if (length == 0)
+    return true;
+  int fd = open(path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+  const uint64_t num_chunks =
+      (length + kStreamBufferSize - 1) / kStreamBufferSize;
+  vector<brillo::Blob> buffers(kNumStreamBuffers,
+                               brillo::Blob(kStreamBufferSize));
+  std::mutex mutex;
+  std::condition_variable cond;
+  // Guarded by |mutex|.
+  uint64_t num_read = 0;
+  uint64_t num_processed = 0;
+  bool read_failed = false;
+  bool aborted = false;
+
+  std::thread reader([&] {
+    for (uint64_t i = 0; i < num_chunks; i++) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] {
+          return aborted || i - num_processed < kNumStreamBuffers;
+        });
+        if (aborted)
+          return;
+      }
+      const uint64_t chunk_offset = i * kStreamBufferSize;
+      const size_t chunk_size =
+          std::min<uint64_t>(kStreamBufferSize, length - chunk_offset);
+      uint8_t* buffer = buffers[i % kNumStreamBuffers].data();
+      ssize_t bytes_read = 0;
+      const bool success =
+          utils::PReadAll(
+              fd, buffer, chunk_size, offset + chunk_offset, &bytes_read) &&
+          static_cast<size_t>(bytes_read) == chunk_size;
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!success) {
+        LOG(ERROR) << "Failed to read " << chunk_size << " bytes at offset "
+                   << offset + chunk_offset << " in " << path;
+        read_failed = true;
+      } else {
+        num_read++;
+      }
+      cond.notify_all();
+      if (!success)
+        return;
+    }
+  });
+
+  bool success = true;
+  for (uint64_t i = 0; i < num_chunks && success; i++) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&] { return read_failed || num_read > i; });
+      if (num_read <= i) {
+        success = false;
+        break;
+      }
+    }
+    const size_t chunk_size =
+        std::min<uint64_t>(kStreamBufferSize, length - i * kStreamBufferSize);
+    success = process(buffers[i % kNumStreamBuffers].data(), chunk_size);
+    std::lock_guard<std::mutex> lock(mutex);
+    num_processed++;
+    aborted = !success;
+    cond.notify_all();
+  }
+  reader.join();
+  return success;
+}
 
+// The layout a payload has once signed, computed from the header and the
+// manifest of the unsigned payload only.
+struct SignedPayloadLayout {
+  // The header and the manifest of the signed payload, which includes the
+  // signature offset and size.
+  brillo::Blob metadata;
+  uint32_t metadata_signature_size;
+  uint64_t payload_signature_size;
+  // Offset and length in the unsigned payload of the data blobs, which are
+  // the same in the signed payload.
+  uint64_t data_offset;
+  uint64_t data_length;
+};
+
+// Reads the metadata of the payload in |payload_path| and computes the layout
+// it has once signed with a |metadata_signature_size| bytes metadata signature
+// blob and a |payload_signature_size| bytes payload signature blob. The data of
+// the payload isn't read. Returns true on success, false otherwise.
+bool GetSignedPayloadLayout(const string& payload_path,
+                            uint32_t metadata_signature_size,
+                            uint64_t payload_signature_size,
+                            SignedPayloadLayout* out_layout) {
   brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
+  TEST_AND_RETURN_FALSE(
+      utils::ReadFileChunk(payload_path, 0, kMaxPayloadHeaderSize, &payload));
   PayloadMetadata payload_metadata;
   TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
-  uint64_t metadata_size = payload_metadata.GetMetadataSize();
-  uint32_t metadata_signature_size =
-      payload_metadata.GetMetadataSignatureSize();
-  // Write metadata signature size in header.
-  uint32_t metadata_signature_size_be = htobe32(metadata_signature.size());
-  memcpy(payload.data() + manifest_offset,
-         &metadata_signature_size_be,
-         sizeof(metadata_signature_size_be));
-  manifest_offset += sizeof(metadata_signature_size_be);
-  // Replace metadata signature.
-  payload.erase(payload.begin() + metadata_size,
-                payload.begin() + metadata_size + metadata_signature_size);
-  payload.insert(payload.begin() + metadata_size,
-                 metadata_signature.begin(),
-                 metadata_signature.end());
-  metadata_signature_size = metadata_signature.size();
-  LOG(INFO) << "Metadata signature size: " << metadata_signature_size;
-
+  const uint64_t metadata_size = payload_metadata.GetMetadataSize();
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                             payload.size(),
+                                             metadata_size - payload.size(),
+                                             &payload));
   DeltaArchiveManifest manifest;
   TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
 
-  // Erase existing signatures.
-  if (manifest.has_signatures_offset()) {
-    payload.resize(manifest.signatures_offset() + metadata_size +
-                   metadata_signature_size);
-  }
+  const off_t payload_size = utils::FileSize(payload_path);
+  TEST_AND_RETURN_FALSE(payload_size >= 0);
+  out_layout->data_offset =
+      metadata_size + payload_metadata.GetMetadataSignatureSize();
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(payload_size) >=
+                        out_layout->data_offset);
+  // Existing signatures are erased.
+  out_layout->data_length =
+      manifest.has_signatures_offset()
+          ? manifest.signatures_offset()
+          : static_cast<uint64_t>(payload_size) - out_layout->data_offset;
+  TEST_AND_RETURN_FALSE(out_layout->data_offset + out_layout->data_length <=
+                        static_cast<uint64_t>(payload_size));
 
   // Updates the manifest to include the signature operation.
   PayloadSigner::AddSignatureToManifest(
-      payload.size() - metadata_size - metadata_signature_size,
-      payload_signature.size(),
-      &manifest);
-
-  // Updates the payload to include the new manifest.
+      out_layout->data_length, payload_signature_size, &manifest);
+  // GetManifest() unpacked the extents.
+  PackManifestExtents(&manifest);
   string serialized_manifest;
-  TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
+  TEST_AND_RETURN_FALSE(PayloadFile::SerializeManifest(
+      manifest, payload_metadata.GetMajorVersion(), &serialized_manifest));
   LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
-  payload.erase(payload.begin() + manifest_offset,
-                payload.begin() + metadata_size);
-  payload.insert(payload.begin() + manifest_offset,
-                 serialized_manifest.begin(),
-                 serialized_manifest.end());
 
-  // Updates the protobuf size.
+  // Keeps the magic and the major version, and updates the manifest size and
+  // the metadata signature size.
+  brillo::Blob metadata(payload.begin(),
+                        payload.begin() + kMetadataSignatureSizeOffset);
   uint64_t size_be = htobe64(serialized_manifest.size());
-  memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
-  metadata_size = serialized_manifest.size() + manifest_offset;
+  memcpy(&metadata[kManifestSizeOffset], &size_be, sizeof(size_be));
+  uint32_t metadata_signature_size_be = htobe32(metadata_signature_size);
+  const uint8_t* signature_size_bytes =
+      reinterpret_cast<const uint8_t*>(&metadata_signature_size_be);
+  metadata.insert(metadata.end(),
+                  signature_size_bytes,
+                  signature_size_bytes + sizeof(metadata_signature_size_be));
+  metadata.insert(
+      metadata.end(), serialized_manifest.begin(), serialized_manifest.end());
+  LOG(INFO) << "Updated metadata size: " << metadata.size();
+  LOG(INFO) << "Metadata signature size: " << metadata_signature_size;
 
-  LOG(INFO) << "Updated payload size: " << payload.size();
-  LOG(INFO) << "Updated metadata size: " << metadata_size;
-  uint64_t signatures_offset =
-      metadata_size + metadata_signature_size + manifest.signatures_offset();
-  LOG(INFO) << "Signature Blob Offset: " << signatures_offset;
-  payload.resize(signatures_offset);
-  payload.insert(payload.begin() + signatures_offset,
-                 payload_signature.begin(),
-                 payload_signature.end());
-
-  *out_payload = std::move(payload);
-  *out_metadata_size = metadata_size;
-  *out_metadata_signature_size = metadata_signature_size;
-  *out_signatures_offset = signatures_offset;
+  out_layout->metadata = std::move(metadata);
+  out_layout->metadata_signature_size = metadata_signature_size;
+  out_layout->payload_signature_size = payload_signature_size;
   return true;
 }
 
-// Given a |payload| with correct signature op and metadata signature size in
-// header and |metadata_size|, |metadata_signature_size|, |signatures_offset|,
-// calculate hash for payload and metadata, save it to |out_hash_data| and
-// |out_metadata_hash|.
-bool CalculateHashFromPayload(const brillo::Blob& payload,
-                              const uint64_t metadata_size,
-                              const uint32_t metadata_signature_size,
-                              const uint64_t signatures_offset,
+// Calculates the hash of the payload in |payload_path| with the |metadata| of
+// a signed payload and the |data_length| bytes of data at |data_offset|, into
+// |out_hash_data|, and the hash of |metadata| into |out_metadata_hash|. Either
+// can be null. The data is read once, in large chunks.
+bool CalculateHashFromPayload(const string& payload_path,
+                              const brillo::Blob& metadata,
+                              uint64_t data_offset,
+                              uint64_t data_length,
                               brillo::Blob* out_hash_data,
                               brillo::Blob* out_metadata_hash) {
   if (out_metadata_hash) {
     // Calculates the hash on the manifest.
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
-        payload.data(), metadata_size, out_metadata_hash));
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(metadata, out_metadata_hash));
   }
   if (out_hash_data) {
     // Calculates the hash on the updated payload. Note that we skip metadata
     // signature and payload signature.
     HashCalculator calc;
-    TEST_AND_RETURN_FALSE(calc.Update(payload.data(), metadata_size));
-    TEST_AND_RETURN_FALSE(signatures_offset >=
-                          metadata_size + metadata_signature_size);
-    TEST_AND_RETURN_FALSE(calc.Update(
-        payload.data() + metadata_size + metadata_signature_size,
-        signatures_offset - metadata_size - metadata_signature_size));
+    TEST_AND_RETURN_FALSE(calc.Update(metadata.data(), metadata.size()));
+    TEST_AND_RETURN_FALSE(StreamFileRange(
+        payload_path,
+        data_offset,
+        data_length,
+        [&calc](const uint8_t* data, size_t size) {
+          return calc.Update(data, size);
+        }));
     TEST_AND_RETURN_FALSE(calc.Finalize());
     *out_hash_data = calc.raw_hash();
   }
   return true;
 }
 
+// Writes to |signed_payload_path| the payload laid out as in |layout| with the
+// data of the unsigned payload in |payload_path|, and |metadata_signature|.
+// The data is passed to |payload_calc| if not null while it's copied, then the
+// payload signature blob written last is taken from |get_payload_signature|.
+// The signed payload is written to a unique temporary file in the same
+// directory, renamed once complete, so |payload_path| and
+// |signed_payload_path| can point to the same file. If
+// |out_properties| is not null, it's loaded with the properties of the signed
+// payload, hashed while it's written.
+bool WriteSignedPayload(
+    const string& payload_path,
+    const SignedPayloadLayout& layout,
+    const string& metadata_signature,
+    HashCalculator* payload_calc,
+    const std::function<bool(string*)>& get_payload_signature,
+    const string& signed_payload_path,
+    PayloadProperties* out_properties) {
+  TEST_AND_RETURN_FALSE(metadata_signature.size() ==
+                        layout.metadata_signature_size);
+  const base::FilePath signed_path(signed_payload_path);
+  string temp_pattern =
+      signed_path.DirName()
+          .Append(signed_path.BaseName().value() + ".XXXXXX")
+          .value();
+  // ScopedTempFile only takes the relative paths starting with a dot.
+  if (!signed_path.IsAbsolute())
+    temp_pattern = "./" + temp_pattern;
+  ScopedTempFile temp_file(temp_pattern);
+  const string& temp_path = temp_file.path();
+  // mkstemp() creates the file readable only by its owner.
+  TEST_AND_RETURN_FALSE_ERRNO(chmod(temp_path.c_str(), 0644) == 0);
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(
+      writer.Open(temp_path.c_str(), O_WRONLY | O_TRUNC, 0644) == 0);
+  HashCalculator file_calc;
+  auto write = [&writer, &file_calc, out_properties](const void* data,
+                                                    size_t size) {
+    if (out_properties)
+      TEST_AND_RETURN_FALSE(file_calc.Update(data, size));
+    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(data, size));
+    return true;
+  };
+  {
+    ScopedFileWriterCloser writer_closer(&writer);
+    TEST_AND_RETURN_FALSE(
+        write(layout.metadata.data(), layout.metadata.size()));
+    TEST_AND_RETURN_FALSE(
+        write(metadata_signature.data(), metadata_signature.size()));
+    TEST_AND_RETURN_FALSE(StreamFileRange(
+        payload_path,
+        layout.data_offset,
+        layout.data_length,
+        [&write, payload_calc](const uint8_t* data, size_t size) {
+          if (payload_calc)
+            TEST_AND_RETURN_FALSE(payload_calc->Update(data, size));
+          return write(data, size);
+        }));
+    string payload_signature;
+    TEST_AND_RETURN_FALSE(get_payload_signature(&payload_signature));
+    TEST_AND_RETURN_FALSE(payload_signature.size() ==
+                          layout.payload_signature_size);
+    TEST_AND_RETURN_FALSE(
+        write(payload_signature.data(), payload_signature.size()));
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(temp_path.c_str(), signed_payload_path.c_str()) == 0);
+  temp_file.Release();
+  const uint64_t signed_payload_size =
+      layout.metadata.size() + layout.metadata_signature_size +
+      layout.data_length + layout.payload_signature_size;
+  LOG(INFO) << "Signed payload size: " << signed_payload_size;
+  if (out_properties) {
+    TEST_AND_RETURN_FALSE(file_calc.Finalize());
+    TEST_AND_RETURN_FALSE(
+        out_properties->LoadFromWrittenPayload(layout.metadata,
+                                               metadata_signature,
+                                               signed_payload_size,
+                                               file_calc.raw_hash()));
+  }
+  return true;
+}
+
 std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> CreatePrivateKeyFromPath(
     const string& private_key_path) {
   FILE* fprikey = fopen(private_key_path.c_str(), "rb");
@@ -233,28 +418,45 @@ void PayloadSigner::AddSignatureToManifest(uint64_t signature_blob_offset,
 
 bool PayloadSigner::VerifySignedPayload(const string& payload_path,
                                         const string& public_key_path) {
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
+  // Only the metadata and the signatures are kept in memory, the data is
+  // streamed once to hash it.
+  brillo::Blob metadata;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadFileChunk(payload_path, 0, kMaxPayloadHeaderSize, &metadata));
   PayloadMetadata payload_metadata;
-  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
-  DeltaArchiveManifest manifest;
-  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
-  TEST_AND_RETURN_FALSE(manifest.has_signatures_offset() &&
-                        manifest.has_signatures_size());
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(metadata));
   uint64_t metadata_size = payload_metadata.GetMetadataSize();
   uint32_t metadata_signature_size =
       payload_metadata.GetMetadataSignatureSize();
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                             metadata.size(),
+                                             metadata_size - metadata.size(),
+                                             &metadata));
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(metadata, &manifest));
+  TEST_AND_RETURN_FALSE(manifest.has_signatures_offset() &&
+                        manifest.has_signatures_size());
   uint64_t signatures_offset =
       metadata_size + metadata_signature_size + manifest.signatures_offset();
-  CHECK_EQ(payload.size(), signatures_offset + manifest.signatures_size());
+  CHECK_EQ(static_cast<uint64_t>(utils::FileSize(payload_path)),
+           signatures_offset + manifest.signatures_size());
   brillo::Blob payload_hash, metadata_hash;
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 &payload_hash,
-                                                 &metadata_hash));
-  string signature(payload.begin() + signatures_offset, payload.end());
+  TEST_AND_RETURN_FALSE(
+      CalculateHashFromPayload(payload_path,
+                               metadata,
+                               metadata_size + metadata_signature_size,
+                               manifest.signatures_offset(),
+                               &payload_hash,
+                               &metadata_hash));
+  brillo::Blob signatures;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      payload_path, metadata_size, metadata_signature_size, &signatures));
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(payload_path,
+                                             signatures_offset,
+                                             manifest.signatures_size(),
+                                             &signatures));
+  string signature(signatures.begin() + metadata_signature_size,
+                   signatures.end());
   string public_key;
   TEST_AND_RETURN_FALSE(utils::ReadFile(public_key_path, &public_key));
   TEST_AND_RETURN_FALSE(payload_hash.size() == kSHA256Size);
@@ -265,8 +467,8 @@ bool PayloadSigner::VerifySignedPayload(const string& payload_path,
   TEST_AND_RETURN_FALSE(
       payload_verifier->VerifySignature(signature, payload_hash));
   if (metadata_signature_size) {
-    signature.assign(payload.begin() + metadata_size,
-                     payload.begin() + metadata_size + metadata_signature_size);
+    signature.assign(signatures.begin(),
+                     signatures.begin() + metadata_signature_size);
     TEST_AND_RETURN_FALSE(metadata_hash.size() == kSHA256Size);
     TEST_AND_RETURN_FALSE(
         payload_verifier->VerifySignature(signature, metadata_hash));
@@ -369,15 +571,20 @@ bool PayloadSigner::SignPayload(const string& unsigned_payload_path,
                                 const uint32_t metadata_signature_size,
                                 const uint64_t signatures_offset,
                                 string* out_serialized_signature) {
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(unsigned_payload_path, &payload));
+  brillo::Blob metadata;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      unsigned_payload_path, 0, metadata_size, &metadata));
+  TEST_AND_RETURN_FALSE(metadata.size() == metadata_size);
+  TEST_AND_RETURN_FALSE(signatures_offset >=
+                        metadata_size + metadata_signature_size);
   brillo::Blob hash_data;
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 &hash_data,
-                                                 nullptr));
+  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(
+      unsigned_payload_path,
+      metadata,
+      metadata_size + metadata_signature_size,
+      signatures_offset - metadata_size - metadata_signature_size,
+      &hash_data,
+      nullptr));
   TEST_AND_RETURN_FALSE(
       SignHashWithKeys(hash_data, private_key_paths, out_serialized_signature));
   return true;
@@ -409,21 +616,14 @@ bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
   TEST_AND_RETURN_FALSE(
       ConvertSignaturesToProtobuf(signatures, signature_sizes, &signature));
 
-  brillo::Blob payload;
-  uint64_t metadata_size, signatures_offset;
-  uint32_t metadata_signature_size;
   // Prepare payload for hashing.
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  signature,
-                                                  signature,
-                                                  &payload,
-                                                  &metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
+  SignedPayloadLayout layout;
+  TEST_AND_RETURN_FALSE(GetSignedPayloadLayout(
+      payload_path, signature.size(), signature.size(), &layout));
+  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload_path,
+                                                 layout.metadata,
+                                                 layout.data_offset,
+                                                 layout.data_length,
                                                  out_payload_hash_data,
                                                  out_metadata_hash));
   return true;
@@ -435,10 +635,9 @@ bool PayloadSigner::AddSignatureToPayload(
     const vector<brillo::Blob>& payload_signatures,
     const vector<brillo::Blob>& metadata_signatures,
     const string& signed_payload_path,
-    uint64_t* out_metadata_size) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+    uint64_t* out_metadata_size,
+    PayloadProperties* out_properties) {
+  // Adds the signature op to the payload metadata, and streams the data.
   string payload_signature, metadata_signature;
   TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
       payload_signatures, padded_signature_sizes, &payload_signature));
@@ -446,20 +645,75 @@ bool PayloadSigner::AddSignatureToPayload(
     TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
         metadata_signatures, padded_signature_sizes, &metadata_signature));
   }
-  brillo::Blob payload;
-  uint64_t signatures_offset;
-  uint32_t metadata_signature_size;
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  payload_signature,
-                                                  metadata_signature,
-                                                  &payload,
-                                                  out_metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-
-  LOG(INFO) << "Signed payload size: " << payload.size();
-  TEST_AND_RETURN_FALSE(utils::WriteFile(
-      signed_payload_path.c_str(), payload.data(), payload.size()));
+  SignedPayloadLayout layout;
+  TEST_AND_RETURN_FALSE(GetSignedPayloadLayout(payload_path,
+                                               metadata_signature.size(),
+                                               payload_signature.size(),
+                                               &layout));
+  TEST_AND_RETURN_FALSE(WriteSignedPayload(
+      payload_path,
+      layout,
+      metadata_signature,
+      nullptr,
+      [&payload_signature](string* out_payload_signature) {
+        *out_payload_signature = payload_signature;
+        return true;
+      },
+      signed_payload_path,
+      out_properties));
+  *out_metadata_size = layout.metadata.size();
+  return true;
+}
+
+bool PayloadSigner::SignPayloadFile(const string& payload_path,
+                                    const vector<string>& private_key_paths,
+                                    const string& signed_payload_path,
+                                    uint64_t* out_metadata_size,
+                                    PayloadProperties* out_properties) {
+  // The signatures are padded to the maximum size of the keys, so the
+  // signature blobs are as long as a placeholder blob of these sizes.
+  vector<size_t> signature_sizes;
+  vector<brillo::Blob> placeholder_signatures;
+  for (const string& path : private_key_paths) {
+    size_t signature_size;
+    TEST_AND_RETURN_FALSE(GetMaximumSignatureSize(path, &signature_size));
+    signature_sizes.push_back(signature_size);
+    placeholder_signatures.emplace_back(signature_size, 0);
+  }
+  string placeholder_signature;
+  TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
+      placeholder_signatures, signature_sizes, &placeholder_signature));
+
+  SignedPayloadLayout layout;
+  TEST_AND_RETURN_FALSE(GetSignedPayloadLayout(payload_path,
+                                               placeholder_signature.size(),
+                                               placeholder_signature.size(),
+                                               &layout));
+  // The metadata signature only depends on the metadata, so it's written
+  // before the data, which is hashed while it's copied.
+  brillo::Blob metadata_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfData(layout.metadata, &metadata_hash));
+  string metadata_signature;
+  TEST_AND_RETURN_FALSE(
+      SignHashWithKeys(metadata_hash, private_key_paths, &metadata_signature));
+
+  HashCalculator payload_calc;
+  TEST_AND_RETURN_FALSE(
+      payload_calc.Update(layout.metadata.data(), layout.metadata.size()));
+  TEST_AND_RETURN_FALSE(WriteSignedPayload(
+      payload_path,
+      layout,
+      metadata_signature,
+      &payload_calc,
+      [&payload_calc, &private_key_paths](string* out_payload_signature) {
+        TEST_AND_RETURN_FALSE(payload_calc.Finalize());
+        return SignHashWithKeys(
+            payload_calc.raw_hash(), private_key_paths, out_payload_signature);
+      },
+      signed_payload_path,
+      out_properties));
+  *out_metadata_size = layout.metadata.size();
   return true;
 }
 
@@ -24,6 +24,7 @@
 #include <brillo/key_value_store.h>
 #include <brillo/secure_blob.h>
 
+#include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/update_metadata.pb.h"
 
 // This class encapsulates methods used for payload signing.
@@ -78,13 +79,14 @@ class PayloadSigner {
 
   // Given an unsigned payload in |payload_path|,
   // this method does two things:
-  // 1. It loads the payload into memory, and inserts placeholder signature
-  //    operations and placeholder metadata signature to make the header and
-  //    the manifest match what the final signed payload will look like based
-  //    on |signatures_sizes|, if needed.
+  // 1. It loads the payload metadata into memory, and inserts placeholder
+  //    signature operations and placeholder metadata signature to make the
+  //    header and the manifest match what the final signed payload will look
+  //    like based on |signatures_sizes|, if needed.
   // 2. It calculates the raw SHA256 hash of the payload and the metadata in
   //    |payload_path| (except signatures) and returns the result in
-  //    |out_hash_data| and |out_metadata_hash| respectively.
+  //    |out_hash_data| and |out_metadata_hash| respectively. The payload data
+  //    is streamed once for both.
   //
   // The changes to payload are not preserved or written to disk.
   static bool HashPayloadForSigning(const std::string& payload_path,
@@ -98,15 +100,32 @@ class PayloadSigner {
   // new payload is stored in |signed_payload_path|. |payload_path| and
   // |signed_payload_path| can point to the same file. Populates
   // |out_metadata_size| with the size of the metadata after adding the
-  // signature operation in the manifest. Returns true on success, false
-  // otherwise.
+  // signature operation in the manifest. If |out_properties| is not null, it's
+  // loaded with the properties of the signed payload, computed while it's
+  // written. Returns true on success, false otherwise.
   static bool AddSignatureToPayload(
       const std::string& payload_path,
       const std::vector<size_t>& padded_signature_sizes,
       const std::vector<brillo::Blob>& payload_signatures,
       const std::vector<brillo::Blob>& metadata_signatures,
       const std::string& signed_payload_path,
-      uint64_t* out_metadata_size);
+      uint64_t* out_metadata_size,
+      PayloadProperties* out_properties = nullptr);
+
+  // Signs the unsigned payload in |payload_path| (with no fake signature op)
+  // with all the private keys in |private_key_paths| and stores the signed
+  // payload in |signed_payload_path|, which can point to the same file. This
+  // is the same as HashPayloadForSigning(), SignHash() with each key and
+  // AddSignatureToPayload(), but the payload data is only read once: it's
+  // hashed while it's copied, and the metadata and payload signatures of all
+  // the keys come from that one pass. Populates |out_metadata_size| and
+  // |out_properties| like AddSignatureToPayload(). Returns true on success,
+  // false otherwise.
+  static bool SignPayloadFile(const std::string& payload_path,
+                              const std::vector<std::string>& private_key_paths,
+                              const std::string& signed_payload_path,
+                              uint64_t* out_metadata_size,
+                              PayloadProperties* out_properties = nullptr);
 
   // Computes the SHA256 hash of the first metadata_size bytes of |metadata|
   // and signs the hash with the given private_key_path and writes the signed
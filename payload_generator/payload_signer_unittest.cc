@@ -19,6 +19,8 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/logging.h>
 #include <base/stl_util.h>
 #include <gtest/gtest.h>
@@ -174,4 +176,127 @@ TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
       payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
 }
 
+TEST_F(PayloadSignerTest, SignPayloadFileTest) {
+  ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload.WritePayload(
+      payload_file.path(), "/dev/null", "", &metadata_size));
+  // Some data, larger than the buffers it's streamed through.
+  brillo::Blob payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  for (size_t i = 0; i < 9 * 1024 * 1024 + 5; i++)
+    payload_data.push_back(i * 7 + i / 4096);
+  EXPECT_TRUE(utils::WriteFile(
+      payload_file.path().c_str(), payload_data.data(), payload_data.size()));
+
+  const vector<string> private_keys = {
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      GetBuildArtifactsPath(kUnittestPrivateKey2Path)};
+  ScopedTempFile signed_file("signed_payload.XXXXXX");
+  uint64_t signed_metadata_size;
+  EXPECT_TRUE(PayloadSigner::SignPayloadFile(payload_file.path(),
+                                             private_keys,
+                                             signed_file.path(),
+                                             &signed_metadata_size));
+  for (const auto& path : {kUnittestPublicKeyPath, kUnittestPublicKey2Path}) {
+    EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+        signed_file.path(), GetBuildArtifactsPath(path)));
+  }
+
+  // Same payload as when hashing, signing and adding the signatures in steps.
+  vector<size_t> signature_sizes;
+  for (const string& key : private_keys) {
+    size_t signature_size;
+    EXPECT_TRUE(PayloadSigner::GetMaximumSignatureSize(key, &signature_size));
+    signature_sizes.push_back(signature_size);
+  }
+  brillo::Blob payload_hash, metadata_hash;
+  EXPECT_TRUE(PayloadSigner::HashPayloadForSigning(
+      payload_file.path(), signature_sizes, &payload_hash, &metadata_hash));
+  vector<brillo::Blob> payload_signatures, metadata_signatures;
+  for (const string& key : private_keys) {
+    brillo::Blob signature;
+    EXPECT_TRUE(PayloadSigner::SignHash(payload_hash, key, &signature));
+    payload_signatures.push_back(signature);
+    EXPECT_TRUE(PayloadSigner::SignHash(metadata_hash, key, &signature));
+    metadata_signatures.push_back(signature);
+  }
+  ScopedTempFile expected_file("expected_payload.XXXXXX");
+  uint64_t expected_metadata_size;
+  PayloadProperties expected_props;
+  EXPECT_TRUE(PayloadSigner::AddSignatureToPayload(payload_file.path(),
+                                                   signature_sizes,
+                                                   payload_signatures,
+                                                   metadata_signatures,
+                                                   expected_file.path(),
+                                                   &expected_metadata_size,
+                                                   &expected_props));
+  EXPECT_EQ(expected_metadata_size, signed_metadata_size);
+  brillo::Blob signed_payload, expected_payload;
+  EXPECT_TRUE(utils::ReadFile(signed_file.path(), &signed_payload));
+  EXPECT_TRUE(utils::ReadFile(expected_file.path(), &expected_payload));
+  EXPECT_EQ(expected_payload, signed_payload);
+
+  // Signing again in place replaces the signatures.
+  PayloadProperties signed_props;
+  EXPECT_TRUE(PayloadSigner::SignPayloadFile(signed_file.path(),
+                                             private_keys,
+                                             signed_file.path(),
+                                             &signed_metadata_size,
+                                             &signed_props));
+  signed_payload.clear();
+  EXPECT_TRUE(utils::ReadFile(signed_file.path(), &signed_payload));
+  EXPECT_EQ(expected_payload, signed_payload);
+
+  // The properties computed while the payload is written are the same as
+  // those read back from it.
+  PayloadProperties read_props(signed_file.path());
+  string read_json, read_key_value;
+  EXPECT_TRUE(read_props.GetPropertiesAsJson(&read_json));
+  EXPECT_TRUE(read_props.GetPropertiesAsKeyValue(&read_key_value));
+  for (PayloadProperties* props : {&signed_props, &expected_props}) {
+    string json, key_value;
+    EXPECT_TRUE(props->GetPropertiesAsJson(&json));
+    EXPECT_TRUE(props->GetPropertiesAsKeyValue(&key_value));
+    EXPECT_EQ(read_json, json);
+    EXPECT_EQ(read_key_value, key_value);
+  }
+}
+
+TEST_F(PayloadSignerTest, SignPayloadFileTempFileTest) {
+  ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload.WritePayload(
+      payload_file.path(), "/dev/null", "", &metadata_size));
+
+  base::ScopedTempDir out_dir;
+  ASSERT_TRUE(out_dir.CreateUniqueTempDir());
+  const string signed_path =
+      out_dir.GetPath().Append("signed_payload").value();
+  EXPECT_TRUE(PayloadSigner::SignPayloadFile(
+      payload_file.path(),
+      {GetBuildArtifactsPath(kUnittestPrivateKeyPath)},
+      signed_path,
+      &metadata_size));
+  EXPECT_FALSE(PayloadSigner::SignPayloadFile(payload_file.path(),
+                                              {"/nonexistent/key.pem"},
+                                              signed_path,
+                                              &metadata_size));
+
+  // Only the signed payload is left in its directory, readable by all.
+  base::FileEnumerator files(
+      out_dir.GetPath(), false, base::FileEnumerator::FILES);
+  EXPECT_EQ(signed_path, files.Next().value());
+  EXPECT_EQ(0644, files.GetInfo().stat().st_mode & 0777);
+  EXPECT_TRUE(files.Next().empty());
+}
+
 }  // namespace chromeos_update_engine
@@ -88,6 +88,56 @@ bool GetFileMapContent(const string& sqfs_path, string* map) {
   return true;
 }
 
+// Parses the output of `unsquashfs -m`. For the format of the file map look
+// at the comments for |CreateFromFileMap()|.
+bool ParseFileMap(const string& map,
+                  vector<SquashfsReader::FileEntry>* entries) {
+  auto lines = base::SplitStringPiece(map,
+                                      "\n",
+                                      base::WhitespaceHandling::KEEP_WHITESPACE,
+                                      base::SplitResult::SPLIT_WANT_NONEMPTY);
+  for (const auto& line : lines) {
+    auto splits =
+        base::SplitStringPiece(line,
+                               " \t",
+                               base::WhitespaceHandling::TRIM_WHITESPACE,
+                               base::SplitResult::SPLIT_WANT_NONEMPTY);
+    // Only filename is invalid.
+    TEST_AND_RETURN_FALSE(splits.size() > 1);
+    SquashfsReader::FileEntry entry;
+    entry.name = splits[0].as_string();
+    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &entry.start));
+    for (size_t i = 2; i < splits.size(); ++i) {
+      uint32_t blk_size;
+      TEST_AND_RETURN_FALSE(base::StringToUint(splits[i], &blk_size));
+      entry.block_sizes.push_back(blk_size);
+    }
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
+// Lists the files and the fragments of the image the way `unsquashfs -m` does,
+// and finds /etc/update_engine.conf in |config_file| if present.
+bool ReadFileEntries(SquashfsReader* reader,
+                     vector<SquashfsReader::FileEntry>* entries,
+                     SquashfsReader::FileEntry* config_file) {
+  vector<SquashfsReader::Fragment> fragments;
+  TEST_AND_RETURN_FALSE(reader->ReadFiles(entries, &fragments));
+  for (const auto& entry : *entries) {
+    if (entry.name == kUpdateEngineConf)
+      *config_file = entry;
+  }
+  for (size_t i = 0; i < fragments.size(); i++) {
+    SquashfsReader::FileEntry entry;
+    entry.name = "<fragment-" + std::to_string(i) + ">";
+    entry.start = fragments[i].start;
+    entry.block_sizes = {fragments[i].size};
+    entries->push_back(std::move(entry));
+  }
+  return true;
+}
+
 bool GetUpdateEngineConfig(const std::string& sqfs_path, string* config) {
   ScopedTempDir unsquash_dir;
   if (!unsquash_dir.CreateUniqueTempDir()) {
@@ -131,7 +181,7 @@ bool GetUpdateEngineConfig(const std::string& sqfs_path, string* config) {
 
 }  // namespace
 
-bool SquashfsFilesystem::Init(const string& map,
+bool SquashfsFilesystem::Init(const vector<SquashfsReader::FileEntry>& entries,
                               const string& sqfs_path,
                               size_t size,
                               const SquashfsHeader& header,
@@ -144,27 +194,11 @@ bool SquashfsFilesystem::Init(const string& map,
   }
   vector<puffin::ByteExtent> zlib_blks;
 
-  // Reading files map. For the format of the file map look at the comments for
-  // |CreateFromFileMap()|.
-  auto lines = base::SplitStringPiece(map,
-                                      "\n",
-                                      base::WhitespaceHandling::KEEP_WHITESPACE,
-                                      base::SplitResult::SPLIT_WANT_NONEMPTY);
-  for (const auto& line : lines) {
-    auto splits =
-        base::SplitStringPiece(line,
-                               " \t",
-                               base::WhitespaceHandling::TRIM_WHITESPACE,
-                               base::SplitResult::SPLIT_WANT_NONEMPTY);
-    // Only filename is invalid.
-    TEST_AND_RETURN_FALSE(splits.size() > 1);
-    uint64_t start;
-    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &start));
+  for (const auto& entry : entries) {
+    const uint64_t start = entry.start;
     uint64_t cur_offset = start;
     bool is_compressed = false;
-    for (size_t i = 2; i < splits.size(); ++i) {
-      uint64_t blk_size;
-      TEST_AND_RETURN_FALSE(base::StringToUint64(splits[i], &blk_size));
+    for (uint64_t blk_size : entry.block_sizes) {
       // TODO(ahassani): For puffin push it into a proper list if uncompressed.
       auto new_blk_size = blk_size & ~kSquashfsCompressedBit;
       TEST_AND_RETURN_FALSE(new_blk_size <= header.block_size);
@@ -181,7 +215,7 @@ bool SquashfsFilesystem::Init(const string& map,
     // If size is zero do not add the file.
     if (cur_offset - start > 0) {
       File file;
-      file.name = splits[0].as_string();
+      file.name = entry.name;
       file.extents = {ExtentForBytes(kBlockSize, start, cur_offset - start)};
       file.is_compressed = is_compressed;
       files_.emplace_back(file);
@@ -317,22 +351,46 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
     return nullptr;
   }
 
-  // Read the map file.
-  string filemap;
-  if (!GetFileMapContent(sqfs_path, &filemap)) {
-    LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
-    return nullptr;
+  // Read the files natively when the compression is supported, it saves
+  // spawning unsquashfs and writing its map to disk.
+  vector<SquashfsReader::FileEntry> entries;
+  SquashfsReader::FileEntry config_file;
+  unique_ptr<SquashfsReader> reader = SquashfsReader::Open(sqfs_path);
+  if (reader && !ReadFileEntries(reader.get(), &entries, &config_file)) {
+    LOG(WARNING) << "Failed to read the files of " << sqfs_path
+                 << ", falling back to unsquashfs.";
+    entries.clear();
+    reader.reset();
+  }
+  if (!reader) {
+    // Read the map file.
+    string filemap;
+    if (!GetFileMapContent(sqfs_path, &filemap) ||
+        !ParseFileMap(filemap, &entries)) {
+      LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
+      return nullptr;
+    }
   }
 
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
   if (!sqfs->Init(
-          filemap, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
+          entries, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
     LOG(ERROR) << "Failed to initialized the Squashfs file system";
     return nullptr;
   }
 
   if (load_settings) {
-    if (!GetUpdateEngineConfig(sqfs_path, &sqfs->update_engine_config_)) {
+    if (reader) {
+      brillo::Blob config;
+      if (config_file.name.empty() ||
+          !reader->ReadFileData(config_file, &config) || config.empty()) {
+        LOG(ERROR) << "Failed to read " << kUpdateEngineConf << " from "
+                   << sqfs_path;
+        return nullptr;
+      }
+      sqfs->update_engine_config_.assign(config.begin(), config.end());
+    } else if (!GetUpdateEngineConfig(sqfs_path,
+                                      &sqfs->update_engine_config_)) {
       return nullptr;
     }
   }
@@ -347,8 +405,10 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFileMap(
     return nullptr;
   }
 
+  vector<SquashfsReader::FileEntry> entries;
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(filemap, "", size, header, false)) {
+  if (!ParseFileMap(filemap, &entries) ||
+      !sqfs->Init(entries, "", size, header, false)) {
     LOG(ERROR) << "Failed to initialize the Squashfs file system using filemap";
     return nullptr;
   }
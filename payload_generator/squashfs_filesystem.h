@@ -33,6 +33,7 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/squashfs_reader.h"
 
 namespace chromeos_update_engine {
 
@@ -57,7 +58,8 @@ class SquashfsFilesystem : public FilesystemInterface {
 
   // Creates the file system from the Squashfs file itself. If
   // |extract_deflates| is true, it will process files to find location of all
-  // deflate streams.
+  // deflate streams. The image is read directly by SquashfsReader, and with
+  // `unsquashfs` if its compression isn't supported by it.
   static std::unique_ptr<SquashfsFilesystem> CreateFromFile(
       const std::string& sqfs_path, bool extract_deflates, bool load_settings);
 
@@ -100,8 +102,9 @@ class SquashfsFilesystem : public FilesystemInterface {
  private:
   SquashfsFilesystem() = default;
 
-  // Initialize and populates the files in the file system.
-  bool Init(const std::string& map,
+  // Initialize and populates the files in the file system from the files
+  // and fragments listed in |entries|.
+  bool Init(const std::vector<SquashfsReader::FileEntry>& entries,
             const std::string& sqfs_path,
             size_t size,
             const SquashfsHeader& header,
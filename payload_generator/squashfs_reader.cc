@@ -0,0 +1,439 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/squashfs_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <lz4.h>
+#include <xz.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kSquashfsMagic = 0x73717368;
+constexpr size_t kSuperBlockSize = 96;
+// The uncompressed size of a metadata block.
+constexpr size_t kMetadataBlockSize = 8192;
+// Set in the header of the metadata blocks stored uncompressed.
+constexpr uint16_t kMetadataUncompressedBit = 1 << 15;
+// Past this depth the directory tree is considered to be corrupted.
+constexpr int kMaxDirectoryDepth = 256;
+
+// The sizes of the inodes of each type after their common header.
+constexpr size_t kInodeHeaderSize = 16;
+constexpr size_t kDirInodeSize = 16;
+constexpr size_t kExtendedDirInodeSize = 24;
+constexpr size_t kFileInodeSize = 16;
+constexpr size_t kExtendedFileInodeSize = 40;
+constexpr size_t kDirHeaderSize = 12;
+constexpr size_t kDirEntrySize = 8;
+constexpr size_t kFragmentEntrySize = 16;
+
+enum InodeType : uint16_t {
+  kDirInode = 1,
+  kFileInode = 2,
+  kExtendedDirInode = 8,
+  kExtendedFileInode = 9,
+};
+
+enum Compression : uint16_t {
+  kZlibCompression = 1,
+  kXzCompression = 4,
+  kLz4Compression = 5,
+  kZstdCompression = 6,
+};
+
+template <typename T>
+T ReadLE(const uint8_t* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+SquashfsReader::~SquashfsReader() {
+  if (data_)
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+std::unique_ptr<SquashfsReader> SquashfsReader::Open(const string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << path << " for reading.";
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kSuperBlockSize))
+    return nullptr;
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map " << path;
+    return nullptr;
+  }
+  std::unique_ptr<SquashfsReader> reader(new SquashfsReader());
+  reader->data_ = static_cast<const uint8_t*>(data);
+  reader->size_ = st.st_size;
+
+  const uint8_t* super_block = reader->data_;
+  if (ReadLE<uint32_t>(super_block) != kSquashfsMagic ||
+      ReadLE<uint16_t>(super_block + 28) != 4) {
+    return nullptr;
+  }
+  reader->num_fragments_ = ReadLE<uint32_t>(super_block + 16);
+  reader->block_size_ = ReadLE<uint32_t>(super_block + 12);
+  reader->compression_ = ReadLE<uint16_t>(super_block + 20);
+  reader->root_inode_ref_ = ReadLE<uint64_t>(super_block + 32);
+  reader->inode_table_ = ReadLE<uint64_t>(super_block + 64);
+  reader->directory_table_ = ReadLE<uint64_t>(super_block + 72);
+  reader->fragment_table_ = ReadLE<uint64_t>(super_block + 80);
+  switch (reader->compression_) {
+    case kZlibCompression:
+    case kXzCompression:
+    case kLz4Compression:
+    case kZstdCompression:
+      break;
+    default:
+      LOG(INFO) << "The compression " << reader->compression_ << " of " << path
+                << " isn't supported.";
+      return nullptr;
+  }
+  if (reader->block_size_ == 0 || reader->block_size_ >= kCompressedBit)
+    return nullptr;
+  return reader;
+}
+
+bool SquashfsReader::ReadFiles(vector<FileEntry>* files,
+                               vector<Fragment>* fragments) {
+  files->clear();
+  TEST_AND_RETURN_FALSE(ReadDirectory("", root_inode_ref_, files, 0));
+  TEST_AND_RETURN_FALSE(ReadFragments(&fragments_));
+  *fragments = fragments_;
+  return true;
+}
+
+bool SquashfsReader::ReadFileData(const FileEntry& file, brillo::Blob* data) {
+  data->clear();
+  uint64_t offset = file.start;
+  for (uint32_t block_size : file.block_sizes) {
+    const size_t size = block_size & ~kCompressedBit;
+    brillo::Blob block;
+    if (size == 0) {
+      // A sparse block.
+      block.resize(std::min<uint64_t>(block_size_,
+                                      file.file_size - data->size()));
+    } else if (block_size & kCompressedBit) {
+      TEST_AND_RETURN_FALSE(offset <= size_ && size <= size_ - offset);
+      block.assign(data_ + offset, data_ + offset + size);
+    } else {
+      TEST_AND_RETURN_FALSE(Decompress(offset, size, block_size_, &block));
+    }
+    data->insert(data->end(), block.begin(), block.end());
+    offset += size;
+  }
+  if (file.fragment != kNoFragment) {
+    // Only known once the files are read.
+    TEST_AND_RETURN_FALSE(file.fragment < fragments_.size());
+    const Fragment& fragment = fragments_[file.fragment];
+    const size_t size = fragment.size & ~kCompressedBit;
+    brillo::Blob block;
+    if (fragment.size & kCompressedBit) {
+      TEST_AND_RETURN_FALSE(fragment.start <= size_ &&
+                            size <= size_ - fragment.start);
+      block.assign(data_ + fragment.start, data_ + fragment.start + size);
+    } else {
+      TEST_AND_RETURN_FALSE(
+          Decompress(fragment.start, size, block_size_, &block));
+    }
+    TEST_AND_RETURN_FALSE(data->size() <= file.file_size);
+    const uint64_t tail_size = file.file_size - data->size();
+    TEST_AND_RETURN_FALSE(file.fragment_offset <= block.size() &&
+                          tail_size <= block.size() - file.fragment_offset);
+    data->insert(data->end(),
+                 block.begin() + file.fragment_offset,
+                 block.begin() + file.fragment_offset + tail_size);
+  }
+  TEST_AND_RETURN_FALSE(data->size() >= file.file_size);
+  data->resize(file.file_size);
+  return true;
+}
+
+bool SquashfsReader::Decompress(uint64_t offset,
+                                size_t size,
+                                size_t max_size,
+                                brillo::Blob* out) const {
+  TEST_AND_RETURN_FALSE(offset <= size_ && size <= size_ - offset);
+  const uint8_t* in = data_ + offset;
+  out->resize(max_size);
+  switch (compression_) {
+    case kZlibCompression: {
+      uLongf out_size = max_size;
+      TEST_AND_RETURN_FALSE(uncompress(out->data(), &out_size, in, size) ==
+                            Z_OK);
+      out->resize(out_size);
+      return true;
+    }
+    case kXzCompression: {
+      xz_dec* xz = xz_dec_init(XZ_SINGLE, 0);
+      TEST_AND_RETURN_FALSE(xz);
+      xz_buf buffer{in, 0, size, out->data(), 0, max_size};
+      const xz_ret ret = xz_dec_run(xz, &buffer);
+      xz_dec_end(xz);
+      TEST_AND_RETURN_FALSE(ret == XZ_STREAM_END);
+      out->resize(buffer.out_pos);
+      return true;
+    }
+    case kLz4Compression: {
+      const int out_size =
+          LZ4_decompress_safe(reinterpret_cast<const char*>(in),
+                              reinterpret_cast<char*>(out->data()),
+                              size,
+                              max_size);
+      TEST_AND_RETURN_FALSE(out_size >= 0);
+      out->resize(out_size);
+      return true;
+    }
+    case kZstdCompression: {
+      const size_t out_size = ZSTD_decompress(out->data(), max_size, in, size);
+      TEST_AND_RETURN_FALSE(!ZSTD_isError(out_size));
+      out->resize(out_size);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SquashfsReader::GetMetadataBlock(uint64_t block,
+                                      const brillo::Blob** metadata,
+                                      uint64_t* next_block) {
+  auto it = metadata_blocks_.find(block);
+  if (it == metadata_blocks_.end()) {
+    TEST_AND_RETURN_FALSE(block <= size_ && size_ - block >= 2);
+    const uint16_t header = ReadLE<uint16_t>(data_ + block);
+    const size_t size = header & ~kMetadataUncompressedBit;
+    brillo::Blob data;
+    if (header & kMetadataUncompressedBit) {
+      TEST_AND_RETURN_FALSE(size <= size_ - block - 2);
+      data.assign(data_ + block + 2, data_ + block + 2 + size);
+    } else {
+      TEST_AND_RETURN_FALSE(
+          Decompress(block + 2, size, kMetadataBlockSize, &data));
+    }
+    it = metadata_blocks_
+             .emplace(block, std::make_pair(std::move(data), block + 2 + size))
+             .first;
+  }
+  *metadata = &it->second.first;
+  *next_block = it->second.second;
+  return true;
+}
+
+bool SquashfsReader::ReadMetadata(uint64_t* block,
+                                  uint32_t* offset,
+                                  size_t size,
+                                  void* out) {
+  uint8_t* dst = static_cast<uint8_t*>(out);
+  while (size > 0) {
+    const brillo::Blob* metadata;
+    uint64_t next_block;
+    TEST_AND_RETURN_FALSE(GetMetadataBlock(*block, &metadata, &next_block));
+    TEST_AND_RETURN_FALSE(*offset <= metadata->size());
+    const size_t read_size = std::min<size_t>(size, metadata->size() - *offset);
+    memcpy(dst, metadata->data() + *offset, read_size);
+    dst += read_size;
+    size -= read_size;
+    *offset += read_size;
+    if (*offset == metadata->size()) {
+      *block = next_block;
+      *offset = 0;
+    }
+  }
+  return true;
+}
+
+bool SquashfsReader::ReadDirectory(const string& path,
+                                   uint64_t inode_ref,
+                                   vector<FileEntry>* files,
+                                   int depth) {
+  TEST_AND_RETURN_FALSE(depth < kMaxDirectoryDepth);
+  uint64_t block = inode_table_ + (inode_ref >> 16);
+  uint32_t offset = inode_ref & 0xffff;
+  uint8_t inode[kInodeHeaderSize + kExtendedDirInodeSize];
+  TEST_AND_RETURN_FALSE(
+      ReadMetadata(&block, &offset, kInodeHeaderSize, inode));
+  uint32_t listing_block;
+  uint32_t listing_size;
+  uint16_t listing_offset;
+  const uint8_t* fields = inode + kInodeHeaderSize;
+  switch (ReadLE<uint16_t>(inode)) {
+    case kDirInode:
+      TEST_AND_RETURN_FALSE(ReadMetadata(
+          &block, &offset, kDirInodeSize, inode + kInodeHeaderSize));
+      listing_block = ReadLE<uint32_t>(fields);
+      listing_size = ReadLE<uint16_t>(fields + 8);
+      listing_offset = ReadLE<uint16_t>(fields + 10);
+      break;
+    case kExtendedDirInode:
+      TEST_AND_RETURN_FALSE(ReadMetadata(
+          &block, &offset, kExtendedDirInodeSize, inode + kInodeHeaderSize));
+      listing_size = ReadLE<uint32_t>(fields + 4);
+      listing_block = ReadLE<uint32_t>(fields + 8);
+      listing_offset = ReadLE<uint16_t>(fields + 18);
+      break;
+    default:
+      LOG(ERROR) << "Inode " << inode_ref << " of " << path
+                 << " isn't a directory.";
+      return false;
+  }
+  // The size of the listing counts the . and .. entries, which aren't stored.
+  if (listing_size <= 3)
+    return true;
+  size_t remaining = listing_size - 3;
+  block = directory_table_ + listing_block;
+  offset = listing_offset;
+  while (remaining > 0) {
+    uint8_t header[kDirHeaderSize];
+    TEST_AND_RETURN_FALSE(remaining >= sizeof(header));
+    TEST_AND_RETURN_FALSE(
+        ReadMetadata(&block, &offset, sizeof(header), header));
+    remaining -= sizeof(header);
+    const uint32_t count = ReadLE<uint32_t>(header) + 1;
+    const uint32_t start = ReadLE<uint32_t>(header + 4);
+    for (uint32_t i = 0; i < count; i++) {
+      uint8_t entry[kDirEntrySize];
+      TEST_AND_RETURN_FALSE(remaining >= sizeof(entry));
+      TEST_AND_RETURN_FALSE(
+          ReadMetadata(&block, &offset, sizeof(entry), entry));
+      remaining -= sizeof(entry);
+      const uint16_t type = ReadLE<uint16_t>(entry + 4);
+      const size_t name_size = ReadLE<uint16_t>(entry + 6) + 1;
+      string name(name_size, '\0');
+      TEST_AND_RETURN_FALSE(remaining >= name_size);
+      TEST_AND_RETURN_FALSE(ReadMetadata(&block, &offset, name_size, &name[0]));
+      remaining -= name_size;
+      TEST_AND_RETURN_FALSE(name != "." && name != ".." &&
+                            name.find('/') == string::npos);
+
+      const uint64_t entry_ref =
+          (static_cast<uint64_t>(start) << 16) | ReadLE<uint16_t>(entry);
+      const string entry_path = path.empty() ? name : path + "/" + name;
+      if (type == kDirInode) {
+        TEST_AND_RETURN_FALSE(
+            ReadDirectory(entry_path, entry_ref, files, depth + 1));
+      } else if (type == kFileInode) {
+        FileEntry file;
+        file.name = entry_path;
+        TEST_AND_RETURN_FALSE(ReadFileInode(entry_ref, &file));
+        files->push_back(std::move(file));
+      }
+    }
+  }
+  return true;
+}
+
+bool SquashfsReader::ReadFileInode(uint64_t inode_ref, FileEntry* file) {
+  uint64_t block = inode_table_ + (inode_ref >> 16);
+  uint32_t offset = inode_ref & 0xffff;
+  uint8_t inode[kInodeHeaderSize + kExtendedFileInodeSize];
+  TEST_AND_RETURN_FALSE(
+      ReadMetadata(&block, &offset, kInodeHeaderSize, inode));
+  const uint8_t* fields = inode + kInodeHeaderSize;
+  switch (ReadLE<uint16_t>(inode)) {
+    case kFileInode:
+      TEST_AND_RETURN_FALSE(ReadMetadata(
+          &block, &offset, kFileInodeSize, inode + kInodeHeaderSize));
+      file->start = ReadLE<uint32_t>(fields);
+      file->fragment = ReadLE<uint32_t>(fields + 4);
+      file->fragment_offset = ReadLE<uint32_t>(fields + 8);
+      file->file_size = ReadLE<uint32_t>(fields + 12);
+      break;
+    case kExtendedFileInode:
+      TEST_AND_RETURN_FALSE(ReadMetadata(
+          &block, &offset, kExtendedFileInodeSize, inode + kInodeHeaderSize));
+      file->start = ReadLE<uint64_t>(fields);
+      file->file_size = ReadLE<uint64_t>(fields + 8);
+      file->fragment = ReadLE<uint32_t>(fields + 28);
+      file->fragment_offset = ReadLE<uint32_t>(fields + 32);
+      break;
+    default:
+      LOG(ERROR) << "Inode " << inode_ref << " of " << file->name
+                 << " isn't a regular file.";
+      return false;
+  }
+  // The tail of the file is in the fragment, if any.
+  const uint64_t num_blocks =
+      file->fragment == kNoFragment
+          ? utils::DivRoundUp(file->file_size, block_size_)
+          : file->file_size / block_size_;
+  // Each block size takes 4 bytes of the image.
+  TEST_AND_RETURN_FALSE(num_blocks <= size_ / sizeof(uint32_t));
+  file->block_sizes.resize(num_blocks);
+  return ReadMetadata(&block,
+                      &offset,
+                      num_blocks * sizeof(uint32_t),
+                      file->block_sizes.data());
+}
+
+bool SquashfsReader::ReadFragments(vector<Fragment>* fragments) {
+  fragments->clear();
+  if (num_fragments_ == 0)
+    return true;
+  // The fragment table is stored in metadata blocks, whose positions are
+  // listed at |fragment_table_|.
+  const uint64_t table_size =
+      static_cast<uint64_t>(num_fragments_) * kFragmentEntrySize;
+  const uint64_t num_blocks =
+      utils::DivRoundUp(table_size, kMetadataBlockSize);
+  TEST_AND_RETURN_FALSE(fragment_table_ <= size_ &&
+                        num_blocks <= (size_ - fragment_table_) / 8);
+  brillo::Blob table;
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    const brillo::Blob* metadata;
+    uint64_t next_block;
+    TEST_AND_RETURN_FALSE(
+        GetMetadataBlock(ReadLE<uint64_t>(data_ + fragment_table_ + i * 8),
+                         &metadata,
+                         &next_block));
+    table.insert(table.end(), metadata->begin(), metadata->end());
+  }
+  TEST_AND_RETURN_FALSE(table.size() >= table_size);
+  for (uint32_t i = 0; i < num_fragments_; i++) {
+    const uint8_t* entry = table.data() + i * kFragmentEntrySize;
+    fragments->push_back(
+        {ReadLE<uint64_t>(entry), ReadLE<uint32_t>(entry + 8)});
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
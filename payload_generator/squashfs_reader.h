@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// SquashfsReader reads the files of a squashfs version 4 image directly from
+// the memory-mapped image, following the definitions found in
+// fs/squashfs/squashfs_fs.h in the kernel header tree. It supports the gzip,
+// xz, lz4 and zstd compressions.
+class SquashfsReader {
+ public:
+  // The location of the data of a regular file, as listed by `unsquashfs -m`.
+  struct FileEntry {
+    // The path of the file from the root of the image, like "etc/passwd".
+    std::string name;
+    // The byte offset of the first data block in the image.
+    uint64_t start{0};
+    // The size of each data block in the image, with kCompressedBit set if the
+    // block is stored uncompressed. The tail of the file may be in a fragment
+    // instead.
+    std::vector<uint32_t> block_sizes;
+    uint64_t file_size{0};
+    uint32_t fragment{kNoFragment};
+    uint32_t fragment_offset{0};
+  };
+
+  // A fragment holding the tails of several files.
+  struct Fragment {
+    uint64_t start;
+    // The size in the image, with kCompressedBit set if uncompressed.
+    uint32_t size;
+  };
+
+  // Set in the size of the blocks stored uncompressed.
+  static constexpr uint32_t kCompressedBit = 1 << 24;
+  static constexpr uint32_t kNoFragment = 0xffffffff;
+
+  ~SquashfsReader();
+
+  // Maps the squashfs image |path|. Returns nullptr if it isn't a squashfs
+  // image in a supported compression.
+  static std::unique_ptr<SquashfsReader> Open(const std::string& path);
+
+  // Lists the regular files and the fragments of the image.
+  bool ReadFiles(std::vector<FileEntry>* files,
+                 std::vector<Fragment>* fragments);
+
+  // Reads the uncompressed content of |file| from the image.
+  bool ReadFileData(const FileEntry& file, brillo::Blob* data);
+
+ private:
+  SquashfsReader() = default;
+
+  // Decompresses the |size| bytes at |offset| in the image into |out|, which
+  // holds up to |max_size| bytes.
+  bool Decompress(uint64_t offset,
+                  size_t size,
+                  size_t max_size,
+                  brillo::Blob* out) const;
+
+  // Reads |size| bytes of the metadata at |offset| within the metadata block
+  // at byte |*block| of the image into |out|, and moves the position past
+  // them, possibly to the next metadata blocks.
+  bool ReadMetadata(uint64_t* block, uint32_t* offset, size_t size, void* out);
+  // Returns the uncompressed metadata block at byte |block| of the image in
+  // |metadata| and the position of the next one in |next_block|.
+  bool GetMetadataBlock(uint64_t block,
+                        const brillo::Blob** metadata,
+                        uint64_t* next_block);
+
+  bool ReadDirectory(const std::string& path,
+                     uint64_t inode_ref,
+                     std::vector<FileEntry>* files,
+                     int depth);
+  bool ReadFileInode(uint64_t inode_ref, FileEntry* file);
+  bool ReadFragments(std::vector<Fragment>* fragments);
+
+  // The memory-mapped image.
+  const uint8_t* data_{nullptr};
+  size_t size_{0};
+
+  uint32_t block_size_{0};
+  uint16_t compression_{0};
+  uint32_t num_fragments_{0};
+  uint64_t root_inode_ref_{0};
+  uint64_t inode_table_{0};
+  uint64_t directory_table_{0};
+  uint64_t fragment_table_{0};
+
+  // The uncompressed metadata blocks read so far and the position of the next
+  // block, by position in the image.
+  std::map<uint64_t, std::pair<brillo::Blob, uint64_t>> metadata_blocks_;
+  std::vector<Fragment> fragments_;
+
+  DISALLOW_COPY_AND_ASSIGN(SquashfsReader);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SQUASHFS_READER_H_
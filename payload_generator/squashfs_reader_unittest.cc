@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/squashfs_reader.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+using test_utils::GetBuildArtifactsPath;
+
+namespace {
+const SquashfsReader::FileEntry* FindFile(
+    const vector<SquashfsReader::FileEntry>& files, const string& name) {
+  auto it = std::find_if(files.begin(), files.end(), [&name](const auto& f) {
+    return f.name == name;
+  });
+  return it == files.end() ? nullptr : &*it;
+}
+}  // namespace
+
+TEST(SquashfsReaderTest, NotSquashfsTest) {
+  EXPECT_FALSE(
+      SquashfsReader::Open(GetBuildArtifactsPath("gen/disk_ext2_4k.img")));
+  EXPECT_FALSE(SquashfsReader::Open("/non/existent/path"));
+}
+
+TEST(SquashfsReaderTest, EmptyImageTest) {
+  auto reader =
+      SquashfsReader::Open(GetBuildArtifactsPath("gen/disk_sqfs_empty.img"));
+  ASSERT_TRUE(reader);
+  vector<SquashfsReader::FileEntry> files;
+  vector<SquashfsReader::Fragment> fragments;
+  EXPECT_TRUE(reader->ReadFiles(&files, &fragments));
+  EXPECT_TRUE(files.empty());
+  EXPECT_TRUE(fragments.empty());
+}
+
+TEST(SquashfsReaderTest, ReadFilesTest) {
+  auto reader =
+      SquashfsReader::Open(GetBuildArtifactsPath("gen/disk_sqfs_default.img"));
+  ASSERT_TRUE(reader);
+  vector<SquashfsReader::FileEntry> files;
+  vector<SquashfsReader::Fragment> fragments;
+  ASSERT_TRUE(reader->ReadFiles(&files, &fragments));
+  ASSERT_EQ(1u, fragments.size());
+
+  // The small files are all in the fragment.
+  const SquashfsReader::FileEntry* file = FindFile(files, "dir1/dir2/file");
+  ASSERT_TRUE(file);
+  EXPECT_EQ(4u, file->file_size);
+  EXPECT_EQ(0u, file->fragment);
+  EXPECT_TRUE(file->block_sizes.empty());
+  brillo::Blob data;
+  EXPECT_TRUE(reader->ReadFileData(*file, &data));
+  EXPECT_EQ(4u, data.size());
+
+  file = FindFile(files, "empty-file");
+  ASSERT_TRUE(file);
+  EXPECT_EQ(SquashfsReader::kNoFragment, file->fragment);
+  EXPECT_TRUE(reader->ReadFileData(*file, &data));
+  EXPECT_TRUE(data.empty());
+
+  // Blocks of zeros aren't stored.
+  file = FindFile(files, "regular-32k-zeros");
+  ASSERT_TRUE(file);
+  EXPECT_EQ(vector<uint32_t>({0}), file->block_sizes);
+  EXPECT_TRUE(reader->ReadFileData(*file, &data));
+  EXPECT_EQ(brillo::Blob(16384, 0), data);
+
+  file = FindFile(files, "sparse-10000blocks");
+  ASSERT_TRUE(file);
+  EXPECT_TRUE(reader->ReadFileData(*file, &data));
+  EXPECT_EQ(file->file_size, data.size());
+}
+
+TEST(SquashfsReaderTest, ReadFileDataTest) {
+  auto reader = SquashfsReader::Open(
+      GetBuildArtifactsPath("gen/disk_sqfs_unittest.img"));
+  ASSERT_TRUE(reader);
+  vector<SquashfsReader::FileEntry> files;
+  vector<SquashfsReader::Fragment> fragments;
+  ASSERT_TRUE(reader->ReadFiles(&files, &fragments));
+  const SquashfsReader::FileEntry* file =
+      FindFile(files, "etc/update_engine.conf");
+  ASSERT_TRUE(file);
+  brillo::Blob data;
+  EXPECT_TRUE(reader->ReadFileData(*file, &data));
+  EXPECT_EQ("PAYLOAD_MINOR_VERSION=1234\n", string(data.begin(), data.end()));
+}
+
+}  // namespace chromeos_update_engine
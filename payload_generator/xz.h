@@ -26,7 +26,9 @@ namespace chromeos_update_engine {
 void XzCompressInit();
 
 // Compresses the input buffer |in| into |out| with xz. The compressed stream
-// will be the equivalent of running xz -9 --check=none
+// will be the equivalent of running xz -9 --check=none. Inputs of 2 MiB or more
+// are split in independent blocks of 1 MiB, compressed on several threads; the
+// stream only depends on |in|, not on the number of threads.
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
 
 }  // namespace chromeos_update_engine
@@ -18,8 +18,12 @@
 
 #include <elf.h>
 #include <endian.h>
+#include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include <7zCrc.h>
 #include <Xz.h>
@@ -30,21 +34,34 @@ namespace {
 
 bool xz_initialized = false;
 
-// An ISeqInStream implementation that reads all the data from the passed Blob.
+// Inputs of at least two blocks are compressed in independent blocks of this
+// size, which the client can decompress in parallel.
+constexpr size_t kXzBlockSize = 1024 * 1024;  // 1 MiB
+// The blocks are compressed on up to this many threads.
+constexpr size_t kMaxXzThreads = 8;
+
+// Size of the stream header and of the stream footer.
+constexpr size_t kXzStreamHeaderSize = 12;
+constexpr uint8_t kXzFooterMagic[] = {'Y', 'Z'};
+
+// An ISeqInStream implementation that reads all the data from the passed
+// buffer.
 struct BlobReaderStream : public ISeqInStream {
-  explicit BlobReaderStream(const brillo::Blob& data) : data_(data) {
+  BlobReaderStream(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {
     Read = &BlobReaderStream::ReadStatic;
   }
 
   static SRes ReadStatic(const ISeqInStream* p, void* buf, size_t* size) {
     auto* self = static_cast<BlobReaderStream*>(const_cast<ISeqInStream*>(p));
-    *size = std::min(*size, self->data_.size() - self->pos_);
-    memcpy(buf, self->data_.data() + self->pos_, *size);
+    *size = std::min(*size, self->size_ - self->pos_);
+    memcpy(buf, self->data_ + self->pos_, *size);
     self->pos_ += *size;
     return SZ_OK;
   }
 
-  const brillo::Blob& data_;
+  const uint8_t* data_;
+  size_t size_;
 
   // The current reader position.
   size_t pos_ = 0;
@@ -99,26 +116,44 @@ int GetFilterID(const brillo::Blob& data) {
   return 0;
 }
 
-}  // namespace
+uint32_t ReadLe32(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return le32toh(value);
+}
 
-namespace chromeos_update_engine {
+void AppendLe32(brillo::Blob* out, uint32_t value) {
+  value = htole32(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
 
-void XzCompressInit() {
-  if (xz_initialized)
-    return;
-  xz_initialized = true;
-  // Although we don't include a CRC32 for the stream, the xz file header has
-  // a CRC32 of the header itself, which required the CRC table to be
-  // initialized.
-  CrcGenerateTable();
+// Reads the xz variable-length integer at |*pos| and moves |*pos| past it.
+bool ReadVli(const uint8_t* data, size_t size, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 9 && *pos < size; i++) {
+    const uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+    if ((byte & 0x80) == 0)
+      return byte != 0 || i == 0;
+  }
+  return false;
 }
 
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
-  CHECK(xz_initialized) << "Initialize XzCompress first";
-  out->clear();
-  if (in.empty())
-    return true;
+void AppendVli(brillo::Blob* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
 
+// Compresses the |size| bytes of |data| into |out| as an xz stream of a single
+// block, using the BCJ filter |filter_id|.
+bool XzCompressBlock(const uint8_t* data,
+                     size_t size,
+                     int filter_id,
+                     brillo::Blob* out) {
   // Xz compression properties.
   CXzProps props;
   XzProps_Init(&props);
@@ -135,16 +170,123 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   lzma2Props.lzmaProps.level = 6;
   lzma2Props.lzmaProps.numThreads = 1;
   // The input size data is used to reduce the dictionary size if possible.
-  lzma2Props.lzmaProps.reduceSize = in.size();
+  lzma2Props.lzmaProps.reduceSize = size;
   Lzma2EncProps_Normalize(&lzma2Props);
   props.lzma2Props = lzma2Props;
 
-  props.filterProps.id = GetFilterID(in);
+  props.filterProps.id = filter_id;
 
   BlobWriterStream out_writer(out);
-  BlobReaderStream in_reader(in);
+  BlobReaderStream in_reader(data, size);
   SRes res = Xz_Encode(&out_writer, &in_reader, &props, nullptr /* progress */);
   return res == SZ_OK;
 }
 
+// Writes the blocks of |streams|, xz streams of a single block with the same
+// stream flags, to |out| as one stream holding all of them in order.
+bool MergeXzStreams(const std::vector<brillo::Blob>& streams,
+                    brillo::Blob* out) {
+  out->assign(streams[0].begin(), streams[0].begin() + kXzStreamHeaderSize);
+  brillo::Blob index = {0x00};
+  AppendVli(&index, streams.size());
+  for (const brillo::Blob& stream : streams) {
+    if (stream.size() < 2 * kXzStreamHeaderSize)
+      return false;
+    // The footer holds the size of the index, which has the record of the
+    // block.
+    const uint8_t* footer = stream.data() + stream.size() - kXzStreamHeaderSize;
+    const uint64_t index_size = (uint64_t{ReadLe32(footer + 4)} + 1) * 4;
+    if (index_size > stream.size() - 2 * kXzStreamHeaderSize)
+      return false;
+    const size_t index_offset =
+        stream.size() - kXzStreamHeaderSize - index_size;
+    const uint8_t* block_index = stream.data() + index_offset;
+    size_t pos = 1;
+    uint64_t num_records, unpadded_size, uncompressed_size;
+    if (block_index[0] != 0 ||
+        !ReadVli(block_index, index_size, &pos, &num_records) ||
+        num_records != 1 ||
+        !ReadVli(block_index, index_size, &pos, &unpadded_size) ||
+        !ReadVli(block_index, index_size, &pos, &uncompressed_size)) {
+      return false;
+    }
+    // The block with its padding.
+    out->insert(out->end(),
+                stream.begin() + kXzStreamHeaderSize,
+                stream.begin() + index_offset);
+    AppendVli(&index, unpadded_size);
+    AppendVli(&index, uncompressed_size);
+  }
+  index.resize((index.size() + 3) & ~3);
+  AppendLe32(&index, CrcCalc(index.data(), index.size()));
+  out->insert(out->end(), index.begin(), index.end());
+
+  brillo::Blob footer;
+  AppendLe32(&footer, index.size() / 4 - 1);
+  footer.insert(footer.end(), streams[0].begin() + 6, streams[0].begin() + 8);
+  AppendLe32(out, CrcCalc(footer.data(), footer.size()));
+  out->insert(out->end(), footer.begin(), footer.end());
+  out->insert(out->end(), std::begin(kXzFooterMagic), std::end(kXzFooterMagic));
+  return true;
+}
+
+}  // namespace
+
+namespace chromeos_update_engine {
+
+void XzCompressInit() {
+  if (xz_initialized)
+    return;
+  xz_initialized = true;
+  // Although we don't include a CRC32 for the stream, the xz file header has
+  // a CRC32 of the header itself, which required the CRC table to be
+  // initialized.
+  CrcGenerateTable();
+}
+
+bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  CHECK(xz_initialized) << "Initialize XzCompress first";
+  out->clear();
+  if (in.empty())
+    return true;
+
+  const int filter_id = GetFilterID(in);
+  if (in.size() < 2 * kXzBlockSize)
+    return XzCompressBlock(in.data(), in.size(), filter_id, out);
+
+  // Every block is compressed on its own, and the filter restarts at each
+  // block, so the stream doesn't depend on the number of threads.
+  const size_t num_blocks = (in.size() + kXzBlockSize - 1) / kXzBlockSize;
+  std::vector<brillo::Blob> streams(num_blocks);
+  std::atomic<size_t> next_block{0};
+  std::atomic<bool> success{true};
+  auto compress_blocks = [&] {
+    for (size_t i = next_block++; i < num_blocks && success;
+         i = next_block++) {
+      const size_t offset = i * kXzBlockSize;
+      if (!XzCompressBlock(in.data() + offset,
+                           std::min(kXzBlockSize, in.size() - offset),
+                           filter_id,
+                           &streams[i])) {
+        success = false;
+      }
+    }
+  };
+  const size_t num_threads = std::max<size_t>(
+      1,
+      std::min<size_t>(
+          {std::thread::hardware_concurrency(), num_blocks, kMaxXzThreads}));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++)
+    threads.emplace_back(compress_blocks);
+  compress_blocks();
+  for (auto& thread : threads)
+    thread.join();
+  if (!success) {
+    LOG(ERROR) << "Failed to compress the xz blocks.";
+    return false;
+  }
+  return MergeXzStreams(streams, out);
+}
+
 }  // namespace chromeos_update_engine
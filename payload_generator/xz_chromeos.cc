@@ -16,23 +16,72 @@
 
 #include "update_engine/payload_generator/xz.h"
 
+#include <algorithm>
+#include <thread>
+
 #include <base/logging.h>
 #include <lzma.h>
 
 namespace chromeos_update_engine {
 
+namespace {
+// Inputs of at least two blocks are compressed in independent blocks of this
+// size, which the client can decompress in parallel.
+constexpr size_t kXzBlockSize = 1024 * 1024;  // 1 MiB
+// The blocks are compressed on up to this many threads.
+constexpr uint32_t kMaxXzThreads = 8;
+
+const uint32_t kLzmaPreset = 6;
+
+// Compresses |in| into |out| in blocks of kXzBlockSize on several threads.
+// liblzma writes the same stream whatever the number of threads.
+bool XzCompressBlocks(const brillo::Blob& in, brillo::Blob* out) {
+  lzma_mt options = {};
+  options.threads = std::clamp(std::thread::hardware_concurrency(),
+                               1u,
+                               kMaxXzThreads);
+  options.block_size = kXzBlockSize;
+  options.preset = kLzmaPreset;
+  options.check = LZMA_CHECK_NONE;  // We do not need CRC.
+  lzma_stream stream = LZMA_STREAM_INIT;
+  int rc = lzma_stream_encoder_mt(&stream, &options);
+  if (rc != LZMA_OK) {
+    LOG(ERROR) << "Failed to initialize the LZMA encoder with return code: "
+               << rc;
+    return false;
+  }
+  out->resize(lzma_stream_buffer_bound(in.size()));
+  stream.next_in = in.data();
+  stream.avail_in = in.size();
+  stream.next_out = out->data();
+  stream.avail_out = out->size();
+  do {
+    rc = lzma_code(&stream, LZMA_FINISH);
+  } while (rc == LZMA_OK);
+  out->resize(stream.total_out);
+  lzma_end(&stream);
+  if (rc != LZMA_STREAM_END) {
+    LOG(ERROR) << "Failed to compress data to LZMA stream with return code: "
+               << rc;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
 void XzCompressInit() {}
 
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   out->clear();
   if (in.empty())
     return true;
+  if (in.size() >= 2 * kXzBlockSize)
+    return XzCompressBlocks(in, out);
 
   // Resize the output buffer to get enough memory for writing the compressed
   // data.
   out->resize(lzma_stream_buffer_bound(in.size()));
 
-  const uint32_t kLzmaPreset = 6;
   size_t out_pos = 0;
   int rc = lzma_easy_buffer_encode(kLzmaPreset,
                                    LZMA_CHECK_NONE,  // We do not need CRC.
@@ -145,6 +145,33 @@ TYPED_TEST(ZipTest, PoorCompressionTest) {
   EXPECT_EQ(in, decompressed);
 }
 
+TYPED_TEST(ZipTest, LargeInputTest) {
+  // Large enough to be compressed in several xz blocks.
+  brillo::Blob in(5 * 1024 * 1024);
+  test_utils::FillWithData(&in);
+  brillo::Blob out;
+  EXPECT_TRUE(this->ZipCompress(in, &out));
+  EXPECT_LT(out.size(), in.size());
+  brillo::Blob decompressed;
+  EXPECT_TRUE(this->ZipDecompress(out, &decompressed));
+  EXPECT_EQ(in, decompressed);
+}
+
+TEST(XzCompressTest, LargeInputBlocksTest) {
+  XzCompressInit();
+  brillo::Blob in(5 * 1024 * 1024 + 123);
+  test_utils::FillWithData(&in);
+  brillo::Blob out;
+  ASSERT_TRUE(XzCompress(in, &out));
+  // One block per MiB, whatever the number of threads compressing them.
+  std::vector<XzBlock> blocks;
+  ASSERT_TRUE(ParseXzBlocks(out.data(), out.size(), &blocks));
+  EXPECT_EQ(6u, blocks.size());
+  brillo::Blob out_again;
+  ASSERT_TRUE(XzCompress(in, &out_again));
+  EXPECT_EQ(out, out_again);
+}
+
 TYPED_TEST(ZipTest, MalformedZipTest) {
   brillo::Blob in(std::begin(kRandomString), std::end(kRandomString));
   brillo::Blob out;
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// Slow to compress but as fast to decompress as the lower levels, and close
+// to the size of xz.
+constexpr int kZstdCompressionLevel = 19;
+
+struct ZstdCCtxDeleter {
+  void operator()(ZSTD_CCtx* p) { ZSTD_freeCCtx(p); }
+};
+
+// Compresses |in| into |out|, with |cdict| if not null.
+bool CompressFrame(const brillo::Blob& in,
+                   const ZSTD_CDict* cdict,
+                   brillo::Blob* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.empty())
+    return true;
+
+  std::unique_ptr<ZSTD_CCtx, ZstdCCtxDeleter> cctx(ZSTD_createCCtx());
+  TEST_AND_RETURN_FALSE(cctx != nullptr);
+  // The window is limited so that the client can decompress the data within
+  // kZstdMaxWindowLog, whatever the level picks for the size of |in|.
+  for (const auto& [param, value] :
+       {std::pair{ZSTD_c_compressionLevel, kZstdCompressionLevel},
+        std::pair{ZSTD_c_windowLog, kZstdMaxWindowLog},
+        std::pair{ZSTD_c_checksumFlag, 0}}) {
+    const size_t ret = ZSTD_CCtx_setParameter(cctx.get(), param, value);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_CCtx_setParameter failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+  }
+  if (cdict) {
+    const size_t ret = ZSTD_CCtx_refCDict(cctx.get(), cdict);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_CCtx_refCDict failed: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+  }
+
+  out->resize(ZSTD_compressBound(in.size()));
+  const size_t size = ZSTD_compress2(
+      cctx.get(), out->data(), out->size(), in.data(), in.size());
+  if (ZSTD_isError(size)) {
+    LOG(ERROR) << "ZSTD_compress2 failed: " << ZSTD_getErrorName(size);
+    return false;
+  }
+  out->resize(size);
+  return true;
+}
+}  // namespace
+
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return CompressFrame(in, nullptr, out);
+}
+
+bool TrainZstdDictionary(const vector<brillo::Blob>& samples,
+                         size_t max_size,
+                         brillo::Blob* dictionary) {
+  brillo::Blob samples_data;
+  vector<size_t> sample_sizes;
+  for (const brillo::Blob& sample : samples) {
+    samples_data.insert(samples_data.end(), sample.begin(), sample.end());
+    sample_sizes.push_back(sample.size());
+  }
+  dictionary->resize(max_size);
+  const size_t size = ZDICT_trainFromBuffer(dictionary->data(),
+                                            dictionary->size(),
+                                            samples_data.data(),
+                                            sample_sizes.data(),
+                                            sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    LOG(WARNING) << "Failed to train a zstd dictionary on " << samples.size()
+                 << " samples: " << ZDICT_getErrorName(size);
+    dictionary->clear();
+    return false;
+  }
+  dictionary->resize(size);
+  return true;
+}
+
+ZstdDictionaryCompressor::ZstdDictionaryCompressor(
+    const brillo::Blob& dictionary)
+    : cdict_(ZSTD_createCDict(
+          dictionary.data(), dictionary.size(), kZstdCompressionLevel)) {}
+
+bool ZstdDictionaryCompressor::Compress(const brillo::Blob& in,
+                                        brillo::Blob* out) const {
+  TEST_AND_RETURN_FALSE(cdict_ != nullptr);
+  return CompressFrame(in, cdict_.get(), out);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,59 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Compresses the input buffer |in| into |out| as a single zstd frame that
+// ZstdExtentWriter can decompress.
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out);
+
+// Trains a zstd dictionary of at most |max_size| bytes on |samples| and
+// stores it in |dictionary|. Fails when there isn't enough data to train on.
+bool TrainZstdDictionary(const std::vector<brillo::Blob>& samples,
+                         size_t max_size,
+                         brillo::Blob* dictionary);
+
+// Compresses blobs like ZstdCompress(), with a dictionary prepared once.
+// Compress() may be called from several threads at once.
+class ZstdDictionaryCompressor {
+ public:
+  explicit ZstdDictionaryCompressor(const brillo::Blob& dictionary);
+
+  bool Compress(const brillo::Blob& in, brillo::Blob* out) const;
+
+ private:
+  struct CDictDeleter {
+    void operator()(ZSTD_CDict* p) { ZSTD_freeCDict(p); }
+  };
+  std::unique_ptr<ZSTD_CDict, CDictDeleter> cdict_;
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdDictionaryCompressor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
@@ -1200,7 +1200,7 @@ class PayloadChecker(object):
       # Part 1: Check the file header.
       report.AddSection('header')
       # Check: Payload version is valid.
-      if self.payload.header.version not in (1, 2):
+      if self.payload.header.version not in (1, 2, 3):
         raise error.PayloadError('Unknown payload version (%d).' %
                                  self.payload.header.version)
       report.AddField('version', self.payload.header.version)
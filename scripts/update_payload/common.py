@@ -35,11 +35,13 @@ SIG_ASN1_HEADER = (
 )
 
 BRILLO_MAJOR_PAYLOAD_VERSION = 2
+COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION = 3
 
 SOURCE_MINOR_PAYLOAD_VERSION = 2
 OPSRCHASH_MINOR_PAYLOAD_VERSION = 3
 BROTLI_BSDIFF_MINOR_PAYLOAD_VERSION = 4
 PUFFDIFF_MINOR_PAYLOAD_VERSION = 5
+PACKED_EXTENTS_MINOR_PAYLOAD_VERSION = 13
 
 KERNEL = 'kernel'
 ROOTFS = 'root'
@@ -110,7 +110,8 @@ class Payload(object):
                    self._MANIFEST_LEN_SIZE)
       self.metadata_signature_len = 0
 
-      if self.version == common.BRILLO_MAJOR_PAYLOAD_VERSION:
+      if self.version in (common.BRILLO_MAJOR_PAYLOAD_VERSION,
+                          common.COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION):
         self.size += self._METADATA_SIGNATURE_LEN_SIZE
         self.metadata_signature_len = _ReadInt(
             payload_file, self._METADATA_SIGNATURE_LEN_SIZE, True,
@@ -256,8 +257,19 @@ class Payload(object):
 
     # Read the manifest.
     manifest_raw = self._ReadManifest()
+    if (self.header.version ==
+        common.COMPRESSED_MANIFEST_MAJOR_PAYLOAD_VERSION and manifest_raw):
+      # Only needed for these payloads.
+      import zstandard
+      manifest_raw = zstandard.ZstdDecompressor().decompress(manifest_raw)
     self.manifest = update_metadata_pb2.DeltaArchiveManifest()
     self.manifest.ParseFromString(manifest_raw)
+    # The packed_src_extents and packed_dst_extents fields aren't known to
+    # update_metadata_pb2, the operations would seem to have no extents.
+    if (self.manifest.minor_version >=
+        common.PACKED_EXTENTS_MINOR_PAYLOAD_VERSION):
+      raise PayloadError('unsupported minor version with packed extents: %d' %
+                         self.manifest.minor_version)
 
     # Read the metadata signature (if any).
     metadata_signature_raw = self._ReadMetadataSignature()
@@ -20,7 +20,7 @@
 // handles very slow data transfers.
 
 // To use this, simply make an HTTP connection to localhost:port and
-// GET a url.
+// GET a url. Connections are handled concurrently, each on its own thread.
 
 #include <err.h>
 #include <errno.h>
@@ -37,7 +37,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/logging.h>
@@ -69,6 +72,22 @@ enum {
   RC_ERR_REPORT,
 };
 
+// Network conditions modeled by the /shaped/ requests, for benchmarking the
+// fetchers reproducibly.
+struct NetworkProfile {
+  // Bandwidth cap of each connection, 0 for none.
+  size_t bytes_per_sec{0};
+  // Delay before the response, plus a random part of up to |jitter_ms|. The
+  // jitter is seeded with the start offset, so the same requests always see
+  // the same delays.
+  int latency_ms{0};
+  int jitter_ms{0};
+  // Stall for |stall_ms| after every |stall_every| bytes of payload, 0 for
+  // never.
+  size_t stall_every{0};
+  int stall_ms{0};
+};
+
 struct HttpRequest {
   string raw_headers;
   string host;
@@ -282,6 +301,52 @@ inline size_t WritePayload(int fd,
   return WritePayload(fd, start_offset, end_offset, 'a', 10);
 }
 
+// Writes the payload between |start_offset| and |end_offset| under the
+// bandwidth cap and stalls of |profile|. Returns the number of successfully
+// written bytes.
+size_t WriteShapedPayload(int fd,
+                          const off_t start_offset,
+                          const off_t end_offset,
+                          const NetworkProfile& profile) {
+  using std::chrono::steady_clock;
+  // Small enough chunks for the pacing to be smooth at low bandwidths.
+  constexpr off_t kChunkSize = 4096;
+  // Moved forward by the stalls, so the bandwidth cap doesn't catch up on
+  // them.
+  auto start_time = steady_clock::now();
+  size_t written = 0;
+  off_t offset = start_offset;
+  while (offset < end_offset) {
+    off_t chunk_end = std::min(end_offset, offset + kChunkSize);
+    if (profile.stall_every > 0) {
+      // Don't write past the next stall.
+      const off_t next_stall =
+          (written / profile.stall_every + 1) * profile.stall_every;
+      chunk_end = std::min(chunk_end, start_offset + next_stall);
+    }
+    const size_t ret = WritePayload(fd, offset, chunk_end);
+    written += ret;
+    if (ret != static_cast<size_t>(chunk_end - offset))
+      break;
+    offset = chunk_end;
+
+    if (profile.bytes_per_sec > 0) {
+      // Wait until the bytes written so far fit in the bandwidth.
+      std::this_thread::sleep_until(
+          start_time + std::chrono::microseconds(written * 1000000 /
+                                                 profile.bytes_per_sec));
+    }
+    if (profile.stall_every > 0 && written % profile.stall_every == 0 &&
+        offset < end_offset) {
+      LOG(INFO) << "stalling for " << profile.stall_ms << " ms after "
+                << written << " bytes";
+      std::this_thread::sleep_for(std::chrono::milliseconds(profile.stall_ms));
+      start_time += std::chrono::milliseconds(profile.stall_ms);
+    }
+  }
+  return written;
+}
+
 // Send an empty response, then kill the server.
 void HandleQuit(int fd) {
   WriteHeaders(fd, 0, 0, kHttpResponseOk);
@@ -291,17 +356,29 @@ void HandleQuit(int fd) {
 
 // Generates an HTTP response with payload corresponding to requested offsets
 // and length.  Optionally, truncate the payload at a given length and add a
-// pause midway through the transfer.  Returns the total number of bytes
-// delivered or -1 for error.
+// pause midway through the transfer, or shape the response with |profile|.
+// Returns the total number of bytes delivered or -1 for error.
 ssize_t HandleGet(int fd,
                   const HttpRequest& request,
                   const size_t total_length,
                   const size_t truncate_length,
                   const int sleep_every,
-                  const int sleep_secs) {
+                  const int sleep_secs,
+                  const NetworkProfile* profile = nullptr) {
   ssize_t ret{};
   size_t written = 0;
 
+  if (profile) {
+    std::mt19937 gen(request.start_offset);
+    int delay_ms = profile->latency_ms;
+    if (profile->jitter_ms > 0) {
+      delay_ms +=
+          std::uniform_int_distribution<int>(0, profile->jitter_ms)(gen);
+    }
+    LOG(INFO) << "delaying the response by " << delay_ms << " ms";
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+  }
+
   // Obtain start offset, make sure it is within total payload length.
   const size_t start_offset = request.start_offset;
   if (start_offset >= total_length) {
@@ -367,6 +444,10 @@ ssize_t HandleGet(int fd,
       return -1;
     LOG(INFO) << ret << " payload bytes written (second chunk)";
     written += ret;
+  } else if (profile) {
+    ret = WriteShapedPayload(fd, start_offset, end_offset, *profile);
+    LOG(INFO) << ret << " shaped payload bytes written";
+    written += ret;
   } else {
     if ((ret = WritePayload(fd, start_offset, end_offset)) < 0)
       return -1;
@@ -543,6 +624,17 @@ void HandleConnection(int fd) {
               terms.GetSizeT(2),
               terms.GetInt(3),
               terms.GetInt(4));
+  } else if (base::StartsWith(url, "/shaped/", base::CompareCase::SENSITIVE)) {
+    // /shaped/<size>/<bytes_per_sec>/<latency_ms>/<jitter_ms>/<stall_every>/
+    // <stall_ms>
+    const UrlTerms terms(url, 7);
+    NetworkProfile profile;
+    profile.bytes_per_sec = terms.GetSizeT(2);
+    profile.latency_ms = terms.GetInt(3);
+    profile.jitter_ms = terms.GetInt(4);
+    profile.stall_every = terms.GetSizeT(5);
+    profile.stall_ms = terms.GetInt(6);
+    HandleGet(fd, request, terms.GetSizeT(1), 0, 0, 0, &profile);
   } else if (url.find("/redirect/") == 0) {
     HandleRedirect(fd, request);
   } else if (url == "/error") {
@@ -658,6 +750,8 @@ int main(int argc, char** argv) {
     LOG(INFO) << "got past accept";
     if (client_fd < 0)
       LOG(FATAL) << "ERROR on accept";
-    HandleConnection(client_fd);
+    // A hanging or shaped response doesn't hold back the other connections,
+    // like the concurrent range requests of a parallel fetch.
+    std::thread(HandleConnection, client_fd).detach();
   }
 }